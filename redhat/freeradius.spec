@@ -345,8 +345,6 @@ This module provides the ability to authenticate users against an IMAP server.
 Summary: Memcached support for freeRADIUS
 Group: System Environment/Daemons
 Requires: %{name}%{?_isa} = %{version}-%{release}
-Requires: libmemcached
-BuildRequires: libmemcached-devel
 
 %description memcached
 Adds support for rlm_memcached as a cache driver.
@@ -940,6 +938,7 @@ fi
 %{_libdir}/freeradius/process_eap_sim.so
 %{_libdir}/freeradius/process_radius.so
 %{_libdir}/freeradius/process_tacacs.so
+%{_libdir}/freeradius/process_tftp.so
 %{_libdir}/freeradius/process_tls.so
 %{_libdir}/freeradius/process_ttls.so
 %{_libdir}/freeradius/process_vmps.so
@@ -969,6 +968,8 @@ fi
 %{_libdir}/freeradius/proto_radius_udp.so
 %{_libdir}/freeradius/proto_tacacs.so
 %{_libdir}/freeradius/proto_tacacs_tcp.so
+%{_libdir}/freeradius/proto_tftp.so
+%{_libdir}/freeradius/proto_tftp_udp.so
 %{_libdir}/freeradius/proto_vmps.so
 %{_libdir}/freeradius/proto_vmps_udp.so
 
@@ -11,8 +11,8 @@ SUBMAKEFILES := include/all.mk \
 
 #
 #  The default is to just build the source code.  We skip running the
-#  test framework if it's not necessary.
+#  test framework (and the benchmarks) if it's not necessary.
 #
-ifneq "$(findstring test,$(MAKECMDGOALS))$(findstring clean,$(MAKECMDGOALS))" ""
+ifneq "$(findstring test,$(MAKECMDGOALS))$(findstring bench,$(MAKECMDGOALS))$(findstring clean,$(MAKECMDGOALS))" ""
 SUBMAKEFILES +=	tests/all.mk
 endif
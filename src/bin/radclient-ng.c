@@ -38,6 +38,8 @@ RCSID("$Id$")
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/util/chap.h>
 #include <freeradius-devel/radius/client.h>
+#include <freeradius-devel/io/load.h>
+#include <freeradius-devel/util/math.h>
 
 #ifdef HAVE_OPENSSL_SSL_H
 #include <openssl/ssl.h>
@@ -49,6 +51,7 @@ RCSID("$Id$")
 #endif
 
 #include <assert.h>
+#include <pthread.h>
 
 typedef struct request_s request_t;	/* to shut up warnings about mschap.h */
 
@@ -91,6 +94,12 @@ static fr_radius_client_bio_info_t const *client_info = NULL;
 
 static int ipproto = IPPROTO_UDP;
 
+static uint32_t load_rate = 0;		//!< packets/s for an open loop load test, 0 for "no load test".
+static uint32_t load_threads = 1;
+static uint32_t load_sockets = 1;	//!< per thread
+static fr_time_delta_t load_duration;
+static char const *load_json = NULL;
+
 static bool do_coa = false;
 //static int coafd;
 static int coa_port = FR_COA_UDP_PORT;
@@ -172,13 +181,19 @@ static NEVER_RETURNS void usage(void)
 	fprintf(stderr, "  -F                                Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h                                Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                           Set request id to 'id'.  Values may be 0..255\n");
+	fprintf(stderr, "  -j <file>                         Write the results of a load test to 'file' as JSON ('-' for stdout).\n");
+	fprintf(stderr, "  -l <duration>                     Run a load test for 'duration' seconds (defaults to 10).\n");
+	fprintf(stderr, "  -n <sockets>                      Use 'sockets' source ports in each load test thread (defaults to 1).\n");
 	fprintf(stderr, "  -o <port>                         Set CoA listening port (defaults to 3799)\n");
 	fprintf(stderr, "  -p <num>                          Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -P <proto>                        Use proto (tcp or udp) for transport.\n");
 	fprintf(stderr, "  -r <retries>                      If timeout, retry sending the packet 'retries' times.\n");
+	fprintf(stderr, "  -R <pps>                          Run an open loop load test, sending 'pps' packets/s no matter\n");
+	fprintf(stderr, "                                    how quickly the server replies.  Packets are not retransmitted.\n");
 	fprintf(stderr, "  -s                                Print out summary information of auth results.\n");
 	fprintf(stderr, "  -S <file>                         read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>                      Wait 'timeout' seconds before retrying (may be a floating point number).\n");
+	fprintf(stderr, "  -T <threads>                      Spread the load test across 'threads' threads (defaults to 1).\n");
 	fprintf(stderr, "  -v                                Show program version information.\n");
 	fprintf(stderr, "  -x                                Debugging mode.\n");
 
@@ -973,6 +988,47 @@ static void client_packet_release(fr_bio_packet_t *client, fr_packet_t *packet)
 }
 
 
+/*
+ *	Update the password in a request, so that it matches the
+ *	authentication vector of the packet.
+ */
+static void password_update(fr_packet_t *packet, fr_pair_list_t *list, fr_pair_t const *password)
+{
+	fr_pair_t *vp;
+
+	if ((vp = fr_pair_find_by_da(list, NULL, attr_user_password)) != NULL) {
+		fr_pair_value_strdup(vp, password->vp_strvalue, false);
+
+	} else if ((vp = fr_pair_find_by_da(list, NULL, attr_chap_password)) != NULL) {
+		uint8_t		buffer[17];
+		fr_pair_t	*challenge;
+		uint8_t	const	*vector;
+
+		/*
+		 *	Use Chap-Challenge pair if present,
+		 *	Request Authenticator otherwise.
+		 */
+		challenge = fr_pair_find_by_da(list, NULL, attr_chap_challenge);
+		if (challenge && (challenge->vp_length == RADIUS_AUTH_VECTOR_LENGTH)) {
+			vector = challenge->vp_octets;
+		} else {
+			vector = packet->vector;
+		}
+
+		fr_chap_encode(buffer,
+			       fr_rand() & 0xff, vector, RADIUS_AUTH_VECTOR_LENGTH,
+			       password->vp_strvalue,
+			       password->vp_length);
+		fr_pair_value_memdup(vp, buffer, sizeof(buffer), false);
+
+	} else if (fr_pair_find_by_da_nested(list, NULL, attr_ms_chap_password) != NULL) {
+		mschapv1_encode(packet, list, password->vp_strvalue);
+
+	} else {
+		DEBUG("WARNING: No password in the request");
+	}
+}
+
 /*
  *	Send one packet.
  */
@@ -994,41 +1050,7 @@ static int send_one_packet(fr_bio_packet_t *client, rc_request_t *request)
 	 *	Update the password, so it can be encrypted with the
 	 *	new authentication vector.
 	 */
-	if (request->password) {
-		fr_pair_t *vp;
-
-		if ((vp = fr_pair_find_by_da(&request->request_pairs, NULL, attr_user_password)) != NULL) {
-			fr_pair_value_strdup(vp, request->password->vp_strvalue, false);
-
-		} else if ((vp = fr_pair_find_by_da(&request->request_pairs, NULL, attr_chap_password)) != NULL) {
-			uint8_t		buffer[17];
-			fr_pair_t	*challenge;
-			uint8_t	const	*vector;
-
-			/*
-			 *	Use Chap-Challenge pair if present,
-			 *	Request Authenticator otherwise.
-			 */
-			challenge = fr_pair_find_by_da(&request->request_pairs, NULL, attr_chap_challenge);
-			if (challenge && (challenge->vp_length == RADIUS_AUTH_VECTOR_LENGTH)) {
-				vector = challenge->vp_octets;
-			} else {
-				vector = request->packet->vector;
-			}
-
-			fr_chap_encode(buffer,
-				       fr_rand() & 0xff, vector, RADIUS_AUTH_VECTOR_LENGTH,
-				       request->password->vp_strvalue,
-				       request->password->vp_length);
-			fr_pair_value_memdup(vp, buffer, sizeof(buffer), false);
-
-		} else if (fr_pair_find_by_da_nested(&request->request_pairs, NULL, attr_ms_chap_password) != NULL) {
-			mschapv1_encode(request->packet, &request->request_pairs, request->password->vp_strvalue);
-
-		} else {
-			DEBUG("WARNING: No password in the request");
-		}
-	}
+	if (request->password) password_update(request->packet, &request->request_pairs, request->password);
 
 	request->timestamp = fr_time();
 	request->tries = 1;
@@ -1074,7 +1096,7 @@ static int client_bio_write_pause(fr_bio_packet_t *bio)
 {
 	fr_radius_client_bio_info_t const *info = fr_radius_client_bio_info(bio);
 
-	if (fr_event_filter_update(client_config.retry_cfg.el, info->fd_info->socket.fd, FR_EVENT_FILTER_IO, pause_write) < 0) {
+	if (fr_event_filter_update(info->retry_info->el, info->fd_info->socket.fd, FR_EVENT_FILTER_IO, pause_write) < 0) {
 		return fr_bio_error(GENERIC);
 	}
 
@@ -1085,7 +1107,7 @@ static int client_bio_write_resume(fr_bio_packet_t *bio)
 {
 	fr_radius_client_bio_info_t const *info = fr_radius_client_bio_info(bio);
 
-	if (fr_event_filter_update(client_config.retry_cfg.el, info->fd_info->socket.fd, FR_EVENT_FILTER_IO, resume_write) < 0) {
+	if (fr_event_filter_update(info->retry_info->el, info->fd_info->socket.fd, FR_EVENT_FILTER_IO, resume_write) < 0) {
 		return fr_bio_error(GENERIC);
 	}
 
@@ -1287,6 +1309,604 @@ static void  client_bio_activate(fr_bio_packet_t *client)
 }
 
 
+/*
+ *	Open loop load testing.
+ *
+ *	Each thread has its own event list, its own sockets, and its
+ *	own load generator.  The threads share nothing but the
+ *	(read-only) list of requests, which they use as templates for
+ *	the packets they send.  The statistics are merged once all of
+ *	the threads have finished.
+ */
+
+/*
+ *	A log-linear latency histogram, in the style of HdrHistogram.
+ *
+ *	Values below 2 * RC_HIST_SUB are recorded exactly.  Above
+ *	that, each power of two is split into RC_HIST_SUB buckets, so
+ *	the recorded value is always within 1/RC_HIST_SUB (~3%) of the
+ *	real one.  Values are in microseconds, and 32 bits of them is
+ *	more than an hour.
+ */
+#define RC_HIST_SUB_BITS	(5)
+#define RC_HIST_SUB		(1 << RC_HIST_SUB_BITS)
+#define RC_HIST_BUCKETS		((33 - RC_HIST_SUB_BITS) * RC_HIST_SUB)
+
+typedef struct {
+	uint64_t		count;			//!< number of values recorded
+	uint64_t		max;			//!< exact maximum value
+	uint64_t		bucket[RC_HIST_BUCKETS];
+} rc_histogram_t;
+
+/*
+ *	Statistics for packets which were scheduled to be sent in one
+ *	particular second of the test.
+ */
+typedef struct {
+	uint64_t		sent;
+	uint64_t		received;
+	uint64_t		lost;
+	uint64_t		dropped;		//!< all of the sockets were full, so we didn't send it.
+	rc_histogram_t		latency;
+} rc_load_second_t;
+
+typedef struct {
+	int			number;			//!< of this thread
+	pthread_t		pthread_id;
+
+	TALLOC_CTX		*ctx;			//!< only ever used by this thread
+	fr_event_list_t		*el;
+
+	fr_radius_client_config_t client_config;	//!< with our event list
+	fr_bio_fd_config_t	*fd_config;		//!< one for each socket
+	fr_bio_packet_t		**bios;			//!< one for each socket
+	uint32_t		connected;		//!< number of sockets which have connected
+	uint32_t		next_bio;		//!< socket to try first for the next packet
+
+	fr_load_config_t	load_config;
+	fr_load_t		*l;
+	fr_event_timer_t const	*ev;			//!< for stopping the test
+	bool			stopping;
+
+	rc_request_t		*current;		//!< last template we sent
+
+	fr_time_t		start;
+	uint64_t		sent;
+	uint64_t		received;
+	uint64_t		dropped;
+	uint64_t		outstanding;
+	rc_stats_t		stats;
+
+	rc_histogram_t		latency;		//!< for the whole test
+	rc_load_second_t	*timeline;
+	size_t			num_seconds;
+} rc_load_thread_t;
+
+static inline CC_HINT(always_inline) unsigned int hist_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < (2 * RC_HIST_SUB)) return value;
+
+	shift = fr_high_bit_pos(value) - (RC_HIST_SUB_BITS + 1);
+
+	return ((shift + 1) * RC_HIST_SUB) + ((value >> shift) - RC_HIST_SUB);
+}
+
+/*
+ *	The highest value which is recorded in a bucket.
+ */
+static uint64_t hist_value(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < (2 * RC_HIST_SUB)) return idx;
+
+	shift = (idx / RC_HIST_SUB) - 1;
+
+	return ((uint64_t) ((idx % RC_HIST_SUB) + RC_HIST_SUB + 1) << shift) - 1;
+}
+
+static void hist_add(rc_histogram_t *h, uint64_t value)
+{
+	if (value > UINT32_MAX) value = UINT32_MAX;
+
+	h->bucket[hist_index(value)]++;
+	h->count++;
+	if (value > h->max) h->max = value;
+}
+
+static void hist_merge(rc_histogram_t *out, rc_histogram_t const *in)
+{
+	unsigned int i;
+
+	for (i = 0; i < RC_HIST_BUCKETS; i++) {
+		out->bucket[i] += in->bucket[i];
+	}
+	out->count += in->count;
+	if (in->max > out->max) out->max = in->max;
+}
+
+static uint64_t hist_percentile(rc_histogram_t const *h, double percentile)
+{
+	unsigned int i;
+	uint64_t want, seen = 0;
+
+	if (!h->count) return 0;
+
+	want = (uint64_t) ((percentile * h->count) / 100.0);
+	if (want < 1) want = 1;
+
+	for (i = 0; i < RC_HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen < want) continue;
+
+		/*
+		 *	Don't report a value larger than the largest
+		 *	one we saw.
+		 */
+		if (hist_value(i) > h->max) return h->max;
+
+		return hist_value(i);
+	}
+
+	return h->max;
+}
+
+static rc_load_second_t *load_second(rc_load_thread_t *t, fr_time_t when)
+{
+	int64_t second;
+
+	second = fr_time_delta_to_sec(fr_time_sub(when, t->start));
+	if (second < 0) second = 0;
+	if ((size_t) second >= t->num_seconds) second = t->num_seconds - 1;
+
+	return &t->timeline[second];
+}
+
+static void load_check_done(rc_load_thread_t *t)
+{
+	if (t->stopping && (t->outstanding == 0)) fr_event_loop_exit(t->el, 1);
+}
+
+/*
+ *	Called by the load generator to send one packet.
+ *
+ *	"now" is when the packet was scheduled to be sent, which is
+ *	what we measure the latency from.
+ */
+static int load_send(fr_time_t now, void *uctx)
+{
+	rc_load_thread_t	*t = uctx;
+	rc_load_second_t	*second = load_second(t, now);
+	rc_request_t		*request;
+	fr_bio_packet_t		*client = NULL;
+	fr_packet_t		*packet;
+	fr_pair_list_t		list;
+	uint32_t		i;
+
+	/*
+	 *	Find a socket which has a free ID.  If we try to write
+	 *	to a socket where all of the IDs are in use, it will
+	 *	cancel the oldest outstanding packet, and we would
+	 *	never hear about it.
+	 */
+	for (i = 0; i < load_sockets; i++) {
+		fr_bio_packet_t *bio = t->bios[t->next_bio];
+
+		t->next_bio = (t->next_bio + 1) % load_sockets;
+
+		if (bio->write_blocked || (fr_radius_client_bio_outstanding(bio) >= 256)) continue;
+
+		client = bio;
+		break;
+	}
+
+	if (!client) {
+	drop:
+		t->dropped++;
+		second->dropped++;
+		return 0;
+	}
+
+	/*
+	 *	Cycle through the requests we read from the input files.
+	 */
+	t->current = fr_dlist_next(&rc_request_list, t->current);
+	if (!t->current) t->current = fr_dlist_head(&rc_request_list);
+	request = t->current;
+
+	MEM(packet = fr_packet_alloc(t->ctx, true));
+	packet->code = request->packet->code;
+	packet->socket = request->packet->socket;
+	packet->timestamp = now;
+	packet->uctx = packet;
+
+	fr_pair_list_init(&list);
+	if (fr_pair_list_copy(packet, &list, &request->request_pairs) < 0) {
+	fail:
+		talloc_free(packet);
+		goto drop;
+	}
+
+	if (request->password) password_update(packet, &list, request->password);
+
+	if (fr_bio_packet_write(client, packet, packet, &list) < 0) goto fail;
+
+	/*
+	 *	The packet has been encoded, so we don't need the pairs any more.
+	 */
+	fr_pair_list_free(&list);
+
+	t->sent++;
+	t->outstanding++;
+	second->sent++;
+
+	return 0;
+}
+
+static void load_packet_release(fr_bio_packet_t *client, fr_packet_t *packet)
+{
+	rc_load_thread_t *t = client->uctx;
+
+	t->stats.lost++;
+	load_second(t, packet->timestamp)->lost++;
+
+	talloc_free(packet);
+
+	t->outstanding--;
+	load_check_done(t);
+}
+
+static void load_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_bio_packet_t		*client = uctx;
+	rc_load_thread_t	*t = client->uctx;
+	rc_load_second_t	*second;
+	fr_packet_t		*packet, *reply;
+	fr_pair_list_t		reply_pairs;
+	int64_t			usec;
+	int			rcode;
+
+	fr_pair_list_init(&reply_pairs);
+
+	rcode = fr_bio_packet_read(client, (void **) &packet, &reply, client, &reply_pairs);
+	if (rcode < 0) {
+		ERROR("Failed reading packet - %s", fr_bio_strerror(rcode));
+		fr_exit_now(1);
+	}
+
+	if (!rcode) return;
+
+	usec = fr_time_delta_to_usec(fr_time_sub(reply->timestamp, packet->timestamp));
+	if (usec < 0) usec = 0;
+
+	second = load_second(t, packet->timestamp);
+
+	hist_add(&t->latency, usec);
+	hist_add(&second->latency, usec);
+	t->received++;
+	second->received++;
+
+	switch (reply->code) {
+	case FR_RADIUS_CODE_ACCESS_ACCEPT:
+	case FR_RADIUS_CODE_ACCOUNTING_RESPONSE:
+	case FR_RADIUS_CODE_COA_ACK:
+	case FR_RADIUS_CODE_DISCONNECT_ACK:
+		t->stats.accepted++;
+		break;
+
+	case FR_RADIUS_CODE_ACCESS_CHALLENGE:
+		break;
+
+	default:
+		t->stats.rejected++;
+	}
+
+	(void) fr_load_generator_have_reply(t->l, packet->timestamp);
+
+	/*
+	 *	The reply, and the reply pairs are parented by the
+	 *	original packet.
+	 */
+	(void) fr_radius_client_fd_bio_cancel(client, packet);
+	talloc_free(packet);
+
+	t->outstanding--;
+	load_check_done(t);
+}
+
+static void load_write(fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_bio_packet_t *client = uctx;
+
+	if (fr_bio_packet_write_flush(client) < 0) {
+		ERROR("Failed writing packet - %s", fr_strerror());
+		fr_exit_now(1);
+	}
+
+	if (!client->write_blocked) {
+		if (fr_event_filter_update(el, fd, FR_EVENT_FILTER_IO, pause_write) < 0) fr_assert(0);
+	}
+}
+
+static NEVER_RETURNS void load_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				     int fd_errno, UNUSED void *uctx)
+{
+	ERROR("Failed in connection - %s", fr_syserror(fd_errno));
+
+	fr_exit_now(1);
+}
+
+static NEVER_RETURNS void load_bio_failed(UNUSED fr_bio_packet_t *bio)
+{
+	ERROR("Failed connecting to server");
+
+	fr_exit_now(1);
+}
+
+static void load_stop(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rc_load_thread_t *t = uctx;
+
+	(void) fr_load_generator_stop(t->l);
+
+	t->stopping = true;
+	load_check_done(t);
+}
+
+static void load_bio_activate(fr_bio_packet_t *client)
+{
+	rc_load_thread_t *t = client->uctx;
+	fr_radius_client_bio_info_t const *info;
+
+	info = fr_radius_client_bio_info(client);
+
+	if (fr_event_fd_insert(t->ctx, NULL, t->el, info->fd_info->socket.fd,
+			       load_read, load_write, load_error, client) < 0) {
+	fail:
+		fr_perror("radclient");
+		fr_exit_now(1);
+	}
+
+	/*
+	 *	We only need to write when the socket is blocked.
+	 */
+	if (fr_event_filter_update(t->el, info->fd_info->socket.fd, FR_EVENT_FILTER_IO, pause_write) < 0) goto fail;
+
+	/*
+	 *	Don't start the test until all of the sockets are ready.
+	 */
+	if (++t->connected < load_sockets) return;
+
+	if (fr_event_timer_in(t->ctx, t->el, &t->ev, load_duration, load_stop, t) < 0) goto fail;
+
+	t->start = fr_time();
+	(void) fr_load_generator_start(t->l);
+}
+
+static void *load_thread(void *arg)
+{
+	rc_load_thread_t	*t = arg;
+	uint32_t		i;
+
+	t->el = fr_event_list_alloc(t->ctx, NULL, NULL);
+	if (!t->el) {
+		ERROR("Failed opening event list: %s", fr_strerror());
+		fr_exit_now(1);
+	}
+
+	t->client_config = client_config;
+	t->client_config.retry_cfg.el = t->el;
+	t->client_config.packet_cb_cfg = (fr_bio_packet_cb_funcs_t) {
+		.activate	= load_bio_activate,
+		.failed		= load_bio_failed,
+
+		.write_blocked	= client_bio_write_pause,
+		.write_resume	= client_bio_write_resume,
+
+		.release	= load_packet_release,
+	};
+
+	MEM(t->fd_config = talloc_array(t->ctx, fr_bio_fd_config_t, load_sockets));
+	MEM(t->bios = talloc_zero_array(t->ctx, fr_bio_packet_t *, load_sockets));
+
+	t->l = fr_load_generator_create(t->ctx, t->el, &t->load_config, load_send, t);
+	if (!t->l) {
+		ERROR("Failed creating load generator");
+		fr_exit_now(1);
+	}
+
+	for (i = 0; i < load_sockets; i++) {
+		fr_radius_client_bio_info_t const *info;
+
+		/*
+		 *	If a source port was given, each socket uses
+		 *	the next one.  Otherwise the kernel picks them.
+		 */
+		t->fd_config[i] = fd_config;
+		if (fd_config.src_port) t->fd_config[i].src_port = fd_config.src_port + (t->number * load_sockets) + i;
+
+		t->bios[i] = fr_radius_client_bio_alloc(t->ctx, &t->client_config, &t->fd_config[i]);
+		if (!t->bios[i]) {
+			ERROR("Failed opening socket: %s", fr_strerror());
+			fr_exit_now(1);
+		}
+		t->bios[i]->uctx = t;
+
+		info = fr_radius_client_bio_info(t->bios[i]);
+
+		if (fr_event_fd_insert(t->ctx, NULL, t->el, info->fd_info->socket.fd, NULL,
+				       fr_radius_client_bio_connect, load_error, t->bios[i]) < 0) {
+			fr_perror("radclient");
+			fr_exit_now(1);
+		}
+	}
+
+	(void) fr_event_loop(t->el);
+
+	for (i = 0; i < load_sockets; i++) {
+		(void) fr_event_fd_delete(t->el, fr_radius_client_bio_info(t->bios[i])->fd_info->socket.fd,
+					  FR_EVENT_FILTER_IO);
+	}
+
+	return NULL;
+}
+
+static void load_json_latency(FILE *fp, rc_histogram_t const *h)
+{
+	fprintf(fp, "{ \"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64
+		", \"p99.9\": %" PRIu64 ", \"max\": %" PRIu64 " }",
+		hist_percentile(h, 50.0), hist_percentile(h, 90.0), hist_percentile(h, 99.0),
+		hist_percentile(h, 99.9), h->max);
+}
+
+static void load_json_print(FILE *fp, rc_load_thread_t const *total)
+{
+	size_t i;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"rate\": %u,\n", load_rate);
+	fprintf(fp, "\t\"threads\": %u,\n", load_threads);
+	fprintf(fp, "\t\"sockets\": %u,\n", load_sockets);
+	fprintf(fp, "\t\"duration\": %" PRId64 ",\n", fr_time_delta_to_sec(load_duration));
+	fprintf(fp, "\t\"sent\": %" PRIu64 ",\n", total->sent);
+	fprintf(fp, "\t\"received\": %" PRIu64 ",\n", total->received);
+	fprintf(fp, "\t\"lost\": %" PRIu64 ",\n", total->stats.lost);
+	fprintf(fp, "\t\"dropped\": %" PRIu64 ",\n", total->dropped);
+	fprintf(fp, "\t\"accepted\": %" PRIu64 ",\n", total->stats.accepted);
+	fprintf(fp, "\t\"rejected\": %" PRIu64 ",\n", total->stats.rejected);
+	fprintf(fp, "\t\"latency_usec\": ");
+	load_json_latency(fp, &total->latency);
+	fprintf(fp, ",\n\t\"timeline\": [\n");
+
+	for (i = 0; i < total->num_seconds; i++) {
+		rc_load_second_t const *second = &total->timeline[i];
+
+		fprintf(fp, "\t\t{ \"second\": %zu, \"sent\": %" PRIu64 ", \"received\": %" PRIu64
+			", \"lost\": %" PRIu64 ", \"dropped\": %" PRIu64 ", \"latency_usec\": ",
+			i, second->sent, second->received, second->lost, second->dropped);
+		load_json_latency(fp, &second->latency);
+		fprintf(fp, " }%s\n", (i + 1) < total->num_seconds ? "," : "");
+	}
+
+	fprintf(fp, "\t]\n}\n");
+}
+
+/*
+ *	Run the open loop load test, and print the results.
+ */
+static int radclient_load(void)
+{
+	rc_load_thread_t	*threads, *total;
+	size_t			num_seconds;
+	uint32_t		i;
+	size_t			j;
+
+	num_seconds = (fr_time_delta_unwrap(load_duration) + NSEC - 1) / NSEC;
+
+	MEM(threads = talloc_zero_array(autofree, rc_load_thread_t, load_threads));
+	MEM(total = talloc_zero(autofree, rc_load_thread_t));
+	MEM(total->timeline = talloc_zero_array(total, rc_load_second_t, num_seconds));
+	total->num_seconds = num_seconds;
+
+	for (i = 0; i < load_threads; i++) {
+		rc_load_thread_t *t = &threads[i];
+		uint32_t pps;
+
+		/*
+		 *	Spread the rate as evenly as possible across the threads.
+		 */
+		pps = load_rate / load_threads;
+		if (i < (load_rate % load_threads)) pps++;
+
+		t->number = i;
+		MEM(t->ctx = talloc_new(NULL));
+		MEM(t->timeline = talloc_zero_array(t->ctx, rc_load_second_t, num_seconds));
+		t->num_seconds = num_seconds;
+
+		/*
+		 *	Run at a fixed rate until we're told to stop.  At
+		 *	high rates, send a few packets per timer, so that
+		 *	the timers aren't closer together than ~100us.
+		 */
+		t->load_config = (fr_load_config_t) {
+			.start_pps = pps,
+			.duration = load_duration,
+			.parallel = (pps / 10000) + 1,
+			.open_loop = true,
+		};
+
+		if (pthread_create(&t->pthread_id, NULL, load_thread, t) != 0) {
+			ERROR("Failed creating thread: %s", fr_syserror(errno));
+			fr_exit_now(1);
+		}
+	}
+
+	for (i = 0; i < load_threads; i++) {
+		rc_load_thread_t *t = &threads[i];
+
+		(void) pthread_join(t->pthread_id, NULL);
+
+		total->sent += t->sent;
+		total->received += t->received;
+		total->dropped += t->dropped;
+		total->stats.accepted += t->stats.accepted;
+		total->stats.rejected += t->stats.rejected;
+		total->stats.lost += t->stats.lost;
+		hist_merge(&total->latency, &t->latency);
+
+		for (j = 0; j < num_seconds; j++) {
+			total->timeline[j].sent += t->timeline[j].sent;
+			total->timeline[j].received += t->timeline[j].received;
+			total->timeline[j].lost += t->timeline[j].lost;
+			total->timeline[j].dropped += t->timeline[j].dropped;
+			hist_merge(&total->timeline[j].latency, &t->timeline[j].latency);
+		}
+
+		talloc_free(t->ctx);
+	}
+
+	stats.accepted = total->stats.accepted;
+	stats.rejected = total->stats.rejected;
+	stats.lost = total->stats.lost;
+
+	printf("Load test summary:\n"
+	       "\tSent          : %" PRIu64 "\n"
+	       "\tReceived      : %" PRIu64 "\n"
+	       "\tLost          : %" PRIu64 "\n"
+	       "\tDropped       : %" PRIu64 "\n"
+	       "\tLatency (usec): p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64 ", p99.9 %" PRIu64 ", max %" PRIu64 "\n",
+	       total->sent, total->received, total->stats.lost, total->dropped,
+	       hist_percentile(&total->latency, 50.0), hist_percentile(&total->latency, 90.0),
+	       hist_percentile(&total->latency, 99.0), hist_percentile(&total->latency, 99.9),
+	       total->latency.max);
+
+	if (load_json) {
+		FILE *fp;
+
+		if (strcmp(load_json, "-") == 0) {
+			fp = stdout;
+		} else {
+			fp = fopen(load_json, "w");
+			if (!fp) {
+				ERROR("Error opening %s: %s", load_json, fr_syserror(errno));
+				return -1;
+			}
+		}
+
+		load_json_print(fp, total);
+
+		if (fp != stdout) fclose(fp);
+	}
+
+	talloc_free(threads);
+	talloc_free(total);
+
+	return 0;
+}
+
+
 /**
  *
  * @hidecallgraph
@@ -1306,6 +1926,8 @@ int main(int argc, char **argv)
 	int		retries = 5;
 	fr_time_delta_t timeout = fr_time_delta_from_sec(2);
 
+	load_duration = fr_time_delta_from_sec(10);
+
 	/*
 	 *	It's easier having two sets of flags to set the
 	 *	verbosity of library calls and the verbosity of
@@ -1384,7 +2006,7 @@ int main(int argc, char **argv)
 	 *
 	 ***********************************************************************/
 
-	while ((c = getopt(argc, argv, "46A:c:C:d:D:f:Fi:ho:p:P:r:sS:t:vx")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "46A:c:C:d:D:f:Fi:hj:l:n:o:p:P:r:R:sS:t:T:vx")) != -1) switch (c) {
 		case '4':
 			fd_config.dst_ipaddr.af = AF_INET;
 			break;
@@ -1477,6 +2099,23 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'j':
+			load_json = optarg;
+			break;
+
+		case 'l':
+			if (fr_time_delta_from_str(&load_duration, optarg, strlen(optarg), FR_TIME_RES_SEC) < 0) {
+				fr_perror("Failed parsing load test duration");
+				fr_exit_now(EXIT_FAILURE);
+			}
+			if (!fr_time_delta_ispos(load_duration)) usage();
+			break;
+
+		case 'n':
+			load_sockets = strtoul(optarg, &end, 10);
+			if (*end || !load_sockets || (load_sockets > 1024)) usage();
+			break;
+
 		case 'o':
 			coa_port = atoi(optarg);
 			if (!coa_port || (coa_port > 65535)) usage();
@@ -1513,6 +2152,11 @@ int main(int argc, char **argv)
 			if ((retries == 0) || (retries > 1000)) usage();
 			break;
 
+		case 'R':
+			load_rate = strtoul(optarg, &end, 10);
+			if (*end || !load_rate) usage();
+			break;
+
 		case 's':
 			do_summary = true;
 			break;
@@ -1556,6 +2200,11 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'T':
+			load_threads = strtoul(optarg, &end, 10);
+			if (*end || !load_threads || (load_threads > 1024)) usage();
+			break;
+
 		case 'v':
 			fr_debug_lvl = 1;
 			DEBUG("%s", radclient_version);
@@ -1578,6 +2227,23 @@ int main(int argc, char **argv)
 		usage();
 	}
 
+	if (load_rate) {
+		if (load_rate < load_threads) {
+			ERROR("The load test rate must be at least one packet/s per thread");
+			usage();
+		}
+
+		/*
+		 *	The load test picks its own IDs, and sends each
+		 *	packet exactly once.
+		 */
+		if (forced_id >= 0) {
+			ERROR("Cannot force the packet ID in a load test");
+			usage();
+		}
+		retries = 1;
+	}
+
 	/*
 	 *	Get the request type
 	 */
@@ -1790,6 +2456,14 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 *	The load test opens its own sockets, one set for each thread.
+	 */
+	if (load_rate) {
+		if (radclient_load() < 0) ret = EXIT_FAILURE;
+		goto done;
+	}
+
 	/*
 	 *	Always bounce through a connect(), even if we don't need it.
 	 *
@@ -1808,6 +2482,7 @@ int main(int argc, char **argv)
 	 ***********************************************************************/
 	(void) fr_event_loop(client_config.retry_cfg.el);
 
+done:
 	/***********************************************************************
 	 *
 	 *	We are done the event loop.  Start cleaning things up.
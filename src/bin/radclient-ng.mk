@@ -3,6 +3,7 @@ TARGET		:= radclient-ng$(E)
 SOURCES		:= radclient-ng.c ${top_srcdir}/src/modules/rlm_mschap/smbdes.c \
 		   ${top_srcdir}/src/modules/rlm_mschap/mschap.c \
 		   ${top_srcdir}/src/lib/server/packet.c \
+		   ${top_srcdir}/src/lib/io/load.c \
 
 TGT_PREREQS	:= libfreeradius-radius$(L) libfreeradius-bio$(L)
 
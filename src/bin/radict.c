@@ -60,6 +60,7 @@ static void usage(void)
 	fprintf(stderr, "  -E               Export dictionary definitions.\n");
 	fprintf(stderr, "  -V               Write out all attribute values.\n");
 	fprintf(stderr, "  -D <dictdir>     Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -k <file>        Write the parsed dictionaries to this cache file.\n");
 	fprintf(stderr, "  -p <protocol>    Set protocol by name\n");
 	fprintf(stderr, "  -x               Debugging mode.\n");
 	fprintf(stderr, "  -c               Print out in CSV format.\n");
@@ -294,6 +295,8 @@ int main(int argc, char *argv[])
 	bool			export = false;
 	bool			file_export = false;
 	char const		*protocol = NULL;
+	char const		*dict_cache = NULL;
+	fr_dict_gctx_t		*gctx;
 
 	TALLOC_CTX		*autofree;
 
@@ -315,7 +318,7 @@ int main(int argc, char *argv[])
 
 	fr_debug_lvl = 1;
 
-	while ((c = getopt(argc, argv, "cfED:p:VxhH")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "cfED:k:p:VxhH")) != -1) switch (c) {
 		case 'c':
 			output_format = RADICT_OUT_CSV;
 			break;
@@ -336,6 +339,10 @@ int main(int argc, char *argv[])
 			dict_dir = optarg;
 			break;
 
+		case 'k':
+			dict_cache = optarg;
+			break;
+
 		case 'p':
 			protocol = optarg;
 			break;
@@ -367,12 +374,19 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
-	if (!fr_dict_global_ctx_init(NULL, true, dict_dir)) {
+	gctx = fr_dict_global_ctx_init(NULL, true, dict_dir);
+	if (!gctx) {
 		fr_perror("radict - Global context init failed");
 		ret = 1;
 		goto finish;
 	}
 
+	if (dict_cache && (fr_dict_global_ctx_cache(gctx, dict_cache) < 0)) {
+		fr_perror("radict - Dictionary cache init failed");
+		ret = 1;
+		goto finish;
+	}
+
 	INFO("Loading dictionary: %s/%s", dict_dir, FR_DICTIONARY_FILE);
 
 	if (fr_dict_internal_afrom_file(dict_end++, FR_DICTIONARY_INTERNAL_DIR, __FILE__) < 0) {
@@ -393,6 +407,12 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	if (fr_dict_global_ctx_cache_write(gctx) < 0) {
+		fr_perror("radict - Writing dictionary cache failed");
+		ret = 1;
+		goto finish;
+	}
+
 	if (print_headers) switch(output_format) {
 		case RADICT_OUT_CSV:
 			printf("Dictionary,OID,Attribute,ID,Type,Flags\n");
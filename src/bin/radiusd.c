@@ -31,11 +31,14 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/dependency.h>
+#include <freeradius-devel/server/log_async.h>
 #include <freeradius-devel/server/map_proc.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/radmin.h>
 #include <freeradius-devel/server/state.h>
 #include <freeradius-devel/server/virtual_servers.h>
+#include <freeradius-devel/io/handoff.h>
+#include <freeradius-devel/io/message.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/size.h>
 #include <freeradius-devel/util/strerror.h>
@@ -230,6 +233,7 @@ int main(int argc, char *argv[])
 	char const		*program;
 	fr_schedule_t		*sc = NULL;
 	int			ret = EXIT_SUCCESS;
+	bool			taking_over = false;
 
 	TALLOC_CTX		*global_ctx = NULL;
 	main_config_t		*config = NULL;
@@ -237,6 +241,9 @@ int main(int argc, char *argv[])
 
 	bool			raddb_dir_set = false;
 
+	char const		*dict_cache = NULL;
+	fr_dict_gctx_t		*gctx;
+
 	size_t			pool_size = 0;
 	void			*pool_page_start = NULL;
 	size_t			pool_page_len = 0;
@@ -356,7 +363,7 @@ int main(int argc, char *argv[])
 	}
 
 	/*  Process the options.  */
-	while ((c = getopt(argc, argv, "Cd:D:e:fhi:l:Mmn:p:PrsS:tTvxX")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "Cd:D:e:fhi:k:l:Mmn:p:PrsS:tTvxX")) != -1) switch (c) {
 		case 'C':
 			check_config = true;
 			config->spawn_workers = false;
@@ -386,6 +393,10 @@ int main(int argc, char *argv[])
 			usage(config, EXIT_SUCCESS);
 			break;
 
+		case 'k':
+			dict_cache = optarg;
+			break;
+
 		case 'l':
 			if (strcmp(optarg, "stdout") == 0) goto do_stdout;
 
@@ -562,7 +573,13 @@ int main(int argc, char *argv[])
 	 *	Initialise the top level dictionary hashes which hold
 	 *	the protocols.
 	 */
-	if (!fr_dict_global_ctx_init(NULL, true, config->dict_dir)) {
+	gctx = fr_dict_global_ctx_init(NULL, true, config->dict_dir);
+	if (!gctx) {
+		fr_perror("%s", program);
+		EXIT_WITH_FAILURE;
+	}
+
+	if (dict_cache && (fr_dict_global_ctx_cache(gctx, dict_cache) < 0)) {
 		fr_perror("%s", program);
 		EXIT_WITH_FAILURE;
 	}
@@ -603,10 +620,31 @@ int main(int argc, char *argv[])
 
 	if (!config->suppress_secrets) default_log.suppress_secrets = false;
 
+	/*
+	 *  If there's a server running with this config, get its
+	 *  sockets before we open any of our own.
+	 */
+	if (config->hot_restart && !check_config) {
+		switch (fr_handoff_receive(config->hot_restart)) {
+		case 0:
+			break;
+
+		case 1:
+			taking_over = true;
+			break;
+
+		default:
+			EXIT_WITH_FAILURE;
+		}
+	}
+
 	/*
 	 *  Check we're the only process using this config.
+	 *
+	 *  The server we're taking over from still holds the
+	 *  semaphore, and will until it exits.
 	 */
-	if (!config->allow_multiple_procs) {
+	if (!config->allow_multiple_procs && !taking_over) {
 		switch (main_config_exclusive_proc(config)) {
 		case 0:		/* No other processes running */
 			break;
@@ -787,13 +825,37 @@ int main(int argc, char *argv[])
 	 */
 	radius_pid = getpid();
 
+	/*
+	 *	Start the exec helper before any modules are
+	 *	loaded, while we're still small and cheap to fork.
+	 */
+	if (config->exec_helper && !check_config && (fr_exec_helper_start() < 0)) {
+		PERROR("Failed starting exec helper");
+		EXIT_WITH_FAILURE;
+	}
+
 	/*
 	 *	Initialise the interpreter, registering operations.
 	 */
 	if (unlang_global_init() < 0) EXIT_WITH_FAILURE;
 
+	/*
+	 *	Memory reports need talloc's NULL context tracking,
+	 *	which isn't thread safe.  They're only available in
+	 *	single threaded mode, so that's the only time we
+	 *	can't instantiate modules in parallel.
+	 */
+	if (config->spawn_workers) modules_instantiate_threads_set(config->instantiate_threads);
+
 	if (server_init(config->root_cs) < 0) EXIT_WITH_FAILURE;
 
+	/*
+	 *	All of the dictionaries have been loaded, so the
+	 *	cache can be (re)written.  Failing to write it only
+	 *	means the next startup is slower.
+	 */
+	if (fr_dict_global_ctx_cache_write(gctx) < 0) PWARN("Failed writing dictionary cache");
+
 	/*
 	 *  Everything seems to have loaded OK, exit gracefully.
 	 */
@@ -833,12 +895,69 @@ int main(int argc, char *argv[])
 		schedule->max_workers = config->max_workers;
 		schedule->max_networks = config->max_networks;
 		schedule->stats_interval = config->stats_interval;
+		schedule->work_stealing = config->work_stealing;
+		schedule->min_workers = config->min_workers;
+		schedule->scale_interval = config->scale_interval;
+		schedule->scale_up_delay = config->scale_up_delay;
+		schedule->scale_up_runnable = config->scale_up_runnable;
+		schedule->scale_down_idle = config->scale_down_idle;
+		schedule->network_cpus = config->network_cpus;
+		schedule->worker_cpus = config->worker_cpus;
+		schedule->numa_local = config->numa_local;
 
 		schedule->network.max_outstanding = config->max_requests;
+		schedule->network.queue_delay_target = config->queue_delay_target;
+		schedule->network.queue_delay_interval = config->queue_delay_interval;
+
+		/*
+		 *	Check what we'll get before starting the
+		 *	threads, so that we only complain once.
+		 */
+		if (config->huge_pages) {
+			fr_ring_buffer_t *rb;
+
+			rb = fr_ring_buffer_create_huge(NULL, FR_RING_BUFFER_HUGE_PAGE_SIZE);
+			if (!rb) {
+				PERROR("Failed allocating test buffer for thread.huge_pages");
+				EXIT_WITH_FAILURE;
+			}
+
+			switch (fr_ring_buffer_pages(rb)) {
+			case FR_RING_BUFFER_PAGES_HUGETLB:
+				INFO("Message buffers will be backed by pages from the hugetlb pool");
+				break;
+
+			case FR_RING_BUFFER_PAGES_THP:
+				WARN("No hugetlb pages available (see /proc/sys/vm/nr_hugepages), "
+				     "message buffers will use transparent huge pages");
+				break;
+
+			case FR_RING_BUFFER_PAGES_NORMAL:
+				WARN("Huge pages are not supported on this system, ignoring thread.huge_pages");
+				break;
+			}
+			talloc_free(rb);
+
+			fr_message_set_huge_pages(true);
+		}
 
 #define COPY(_x) schedule->worker._x = config->_x
 		COPY(max_requests);
 		COPY(max_request_time);
+		COPY(talloc_pool_size);
+		COPY(request_pool_init);
+		COPY(request_pool_max);
+		COPY(slow_request_threshold);
+		COPY(slow_request_sample);
+
+		/*
+		 *	Slow request breakdowns are written by the log
+		 *	thread, so the workers don't block on the log.
+		 */
+		if (fr_time_delta_ispos(config->slow_request_threshold) && (fr_log_async_start() < 0)) {
+			PERROR("Failed starting log thread");
+			EXIT_WITH_FAILURE;
+		}
 
 		/*
 		 *	Single server mode: use the global event list.
@@ -950,6 +1069,18 @@ int main(int argc, char *argv[])
 		close(from_child[1]);
 	}
 
+	/*
+	 *  We're ready, tell the old server to stop reading
+	 *  packets, and then let the next server do the same to us.
+	 */
+	if (taking_over) (void) fr_handoff_complete();
+
+	if (config->hot_restart &&
+	    (fr_handoff_listen(global_ctx, main_loop_event_list(), config->hot_restart,
+			       sc, config->max_request_time) < 0)) {
+		WARN("Hot restart disabled");
+	}
+
 	/*
 	 *	Clear the libfreeradius error buffer.
 	 */
@@ -1035,8 +1166,10 @@ int main(int argc, char *argv[])
 	/*
 	 *  We're exiting, so we can delete the PID file.
 	 *  (If it doesn't exist, we can ignore the error returned by unlink)
+	 *
+	 *  If we've handed off to a new server, the PID file is its.
 	 */
-	if (config->daemonize) {
+	if (config->daemonize && !fr_handoff_done()) {
 		DEBUG3("Unlinking PID file %s", config->pid_file);
 		unlink(config->pid_file);
 	}
@@ -1064,8 +1197,11 @@ int main(int argc, char *argv[])
 	 *
 	 *  This _shouldn't_ be needed, but may help with
 	 *  processes created by the exec code or triggers.
+	 *
+	 *  Not after a hot restart, as the new server may be
+	 *  in our process group.
 	 */
-	if (config->spawn_workers) {
+	if (config->spawn_workers && !fr_handoff_done()) {
 		INFO("All threads have exited, sending SIGTERM to remaining children");
 
 		/*
@@ -1188,6 +1324,7 @@ static NEVER_RETURNS void usage(main_config_t const *config, int status)
 #endif
 	fprintf(output, "  -f            Run as a foreground process, not a daemon.\n");
 	fprintf(output, "  -h            Print this help message.\n");
+	fprintf(output, "  -k <file>     Cache the parsed dictionaries in this file, to speed up startup.\n");
 	fprintf(output, "  -l <log_file> Logging output will be written to this file.\n");
 #ifndef NDEBUG
 	fprintf(output, "  -L <size>     When running in memory debug mode, set a hard limit on talloced memory\n");
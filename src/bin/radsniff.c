@@ -46,20 +46,36 @@ RCSID("$Id$")
 #  include <collectd/client.h>
 #endif
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #include "radsniff.h"
 
 #define RS_ASSERT(_x) if (!(_x) && !fr_cond_assert(_x)) exit(1)
 
 static rs_t *conf;
 static struct timeval start_pcap = {0, 0};
-static char timestr[50];
+static _Thread_local char timestr[50];
 
-static fr_rb_tree_t *request_tree = NULL;
-static fr_rb_tree_t *link_tree = NULL;
-static fr_event_list_t *events;
-static bool cleanup;
+/*
+ *	Each capture thread correlates the packets it receives
+ *	independently, so it gets its own trees and event list.
+ */
+static _Thread_local fr_rb_tree_t *request_tree = NULL;
+static _Thread_local fr_rb_tree_t *link_tree = NULL;
+static _Thread_local fr_event_list_t *events;
+static _Thread_local TALLOC_CTX *packet_ctx;		//!< Where requests and packets are allocated.
+static _Thread_local rs_thread_t *rs_thread;		//!< The capture thread we're running in.
+							///< NULL in the main thread.
+static _Thread_local bool cleanup;
 static int packets_count = 1; // Used in '$PATH/${packet}.txt.${count}'
 
+static atomic_uint_fast64_t packets_seen = ATOMIC_VAR_INIT(0);
+static atomic_uint_fast64_t packets_captured = ATOMIC_VAR_INIT(0);
+
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
 
 static char const *radsniff_version = RADIUSD_VERSION_BUILD("radsniff");
@@ -109,6 +125,7 @@ fr_dict_attr_autoload_t radsniff_dict_attr[] = {
 };
 
 static NEVER_RETURNS void usage(int status);
+static void rs_signal_self(int sig);
 
 /** Fork and kill the parent process, writing out our PID
  *
@@ -838,6 +855,79 @@ static void rs_stats_print_csv(rs_update_t *this, rs_stats_t *stats, UNUSED stru
 	fprintf(stdout , "%s\n", buffer);
 }
 
+/** Protect the interval stats of the current capture thread
+ *
+ * The main thread merges and clears the stats of each capture thread
+ * at the end of every interval.  Capture threads hold the lock while
+ * processing a batch of packets, so it's rarely contended.
+ *
+ * Does nothing if we're not running in a capture thread.
+ */
+static inline void rs_stats_lock(void)
+{
+	if (rs_thread) pthread_mutex_lock(&rs_thread->mutex);
+}
+
+static inline void rs_stats_unlock(void)
+{
+	if (rs_thread) pthread_mutex_unlock(&rs_thread->mutex);
+}
+
+/** Add the interval stats of one capture thread to the totals
+ *
+ */
+static void rs_stats_merge_latency(rs_latency_t *out, rs_latency_t const *in)
+{
+	int i;
+
+	out->interval.received_total += in->interval.received_total;
+	out->interval.linked_total += in->interval.linked_total;
+	out->interval.unlinked_total += in->interval.unlinked_total;
+	out->interval.reused_total += in->interval.reused_total;
+	out->interval.lost_total += in->interval.lost_total;
+
+	for (i = 0; i <= RS_RETRANSMIT_MAX; i++) out->interval.rt_total[i] += in->interval.rt_total[i];
+
+	out->interval.latency_total += in->interval.latency_total;
+
+	if (in->interval.latency_high > out->interval.latency_high) {
+		out->interval.latency_high = in->interval.latency_high;
+	}
+	if (in->interval.latency_low &&
+	    (!out->interval.latency_low || (in->interval.latency_low < out->interval.latency_low))) {
+		out->interval.latency_low = in->interval.latency_low;
+	}
+}
+
+/** Merge the interval stats from all capture threads, and clear them
+ *
+ */
+static void rs_stats_merge(rs_stats_t *stats)
+{
+	size_t	i;
+	size_t	rs_codes_len = (NUM_ELEMENTS(rs_useful_codes));
+	int	t;
+
+	for (t = 0; t < conf->num_threads; t++) {
+		rs_thread_t *thread = &conf->threads[t];
+
+		pthread_mutex_lock(&thread->mutex);
+		for (i = 0; i < rs_codes_len; i++) {
+			rs_latency_t *in = &thread->stats->exchange[rs_useful_codes[i]];
+
+			rs_stats_merge_latency(&stats->exchange[rs_useful_codes[i]], in);
+			memset(&in->interval, 0, sizeof(in->interval));
+		}
+
+		/*
+		 *	A thread may have muted the stats because it
+		 *	ran out of memory.
+		 */
+		if (timercmp(&thread->stats->quiet, &stats->quiet, >)) stats->quiet = thread->stats->quiet;
+		pthread_mutex_unlock(&thread->mutex);
+	}
+}
+
 /** Process stats for a single interval
  *
  */
@@ -859,6 +949,8 @@ static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
 
 	stats->intervals++;
 
+	if (conf->threads) rs_stats_merge(stats);
+
 	for (in_p = this->in;
 	     in_p;
 	     in_p = in_p->next) {
@@ -1134,7 +1226,10 @@ static void _rs_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *ct
 	rs_request_t *request = talloc_get_type_abort(ctx, rs_request_t);
 
 	request->event = NULL;
+
+	rs_stats_lock();
 	rs_packet_cleanup(request);
+	rs_stats_unlock();
 }
 
 /** Wrapper around fr_packet_cmp to strip off the outer request struct
@@ -1279,7 +1374,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
+	uint64_t		captured;
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	fr_packet_t	*packet;		/* Current packet were processing */
@@ -1390,7 +1485,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	packet = fr_packet_alloc(conf, false);
+	packet = fr_packet_alloc(packet_ctx, false);
 	if (!packet) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1469,9 +1564,9 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			int ret;
 			FILE *log_fp = fr_log_fp;
 
-			fr_log_fp = NULL;
+			if (!rs_thread) fr_log_fp = NULL;	/* Global, can't be changed when threaded */
 			ret = fr_packet_verify(packet, original->expect, conf->radius_secret);
-			fr_log_fp = log_fp;
+			if (!rs_thread) fr_log_fp = log_fp;
 			if (ret != 0) {
 				fr_perror("Failed verifying packet ID %d", packet->id);
 				fr_packet_free(&packet);
@@ -1606,9 +1701,9 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 				int ret;
 				FILE *log_fp = fr_log_fp;
 
-				fr_log_fp = NULL;
+				if (!rs_thread) fr_log_fp = NULL;
 				ret = fr_packet_verify(packet, NULL, conf->radius_secret);
-				fr_log_fp = log_fp;
+				if (!rs_thread) fr_log_fp = log_fp;
 				if (ret != 0) {
 					fr_perror("Failed verifying packet ID %d", packet->id);
 					fr_packet_free(&packet);
@@ -1630,11 +1725,11 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			int ret;
 			FILE *log_fp = fr_log_fp;
 
-			fr_log_fp = NULL;
+			if (!rs_thread) fr_log_fp = NULL;
 			ret = fr_radius_decode_simple(packet, &decoded,
 						      packet->data, packet->data_len, NULL,
 						      conf->radius_secret);
-			fr_log_fp = log_fp;
+			if (!rs_thread) fr_log_fp = log_fp;
 
 			if (ret < 0) {
 				fr_packet_free(&packet);	/* Also frees vps */
@@ -1757,7 +1852,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = rs_request_alloc(conf);
+			original = rs_request_alloc(packet_ctx);
 			original->id = count;
 			original->in = event->in;
 			original->stats_req = &stats->exchange[packet->code];
@@ -1913,19 +2008,25 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		fr_packet_free(&packet);	/* Also frees decoded */
 	}
 
-	captured++;
+	captured = atomic_fetch_add_explicit(&packets_captured, 1, memory_order_relaxed) + 1;
 	/*
 	 *	We've hit our capture limit, break out of the event loop
+	 *
+	 *	Capture threads ask the main thread to stop everything.
 	 */
-	if ((conf->limit > 0) && (captured >= conf->limit)) {
+	if ((conf->limit > 0) && (captured == conf->limit)) {
 		INFO("Captured %" PRIu64 " packets, exiting...", captured);
-		fr_event_loop_exit(events, 1);
+		if (rs_thread) {
+			rs_signal_self(SIGTERM);
+		} else {
+			fr_event_loop_exit(events, 1);
+		}
 	}
 }
 
 static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *ctx)
 {
-	static uint64_t		count = 0;	/* Packets seen */
+	uint64_t		count;		/* Packets seen */
 	static fr_time_t	last_sync = fr_time_wrap(0);
 	fr_time_t		now_real;
 	rs_event_t		*event = talloc_get_type(ctx, rs_event_t);
@@ -1941,9 +2042,12 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 	 *	pcap file time, we need to implement our own time
 	 *	tracking here, and run the monotonic/wallclock sync
 	 *	event ourselves.
+	 *
+	 *	Only one capture thread needs to do this.
 	 */
 	now_real = fr_time();
-	if (fr_time_delta_gt(fr_time_sub(now_real, last_sync), fr_time_delta_from_sec(1))) {
+	if ((!rs_thread || (rs_thread->id == 0)) &&
+	    fr_time_delta_gt(fr_time_sub(now_real, last_sync), fr_time_delta_from_sec(1))) {
 		fr_time_sync();
 		last_sync = now_real;
 	}
@@ -1989,7 +2093,7 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 			do {
 				now = fr_time_from_timeval(&header->ts);
 			} while (fr_event_timer_run(el, &now) == 1);
-			count++;
+			count = atomic_fetch_add_explicit(&packets_seen, 1, memory_order_relaxed) + 1;
 
 			rs_packet_process(count, event, header, data);
 		}
@@ -2000,20 +2104,22 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 	 *	Consume multiple packets from the capture buffer.
 	 *	We occasionally need to yield to allow events to run.
 	 */
+	rs_stats_lock();
 	for (i = 0; i < RS_FORCE_YIELD; i++) {
 		ret = pcap_next_ex(handle, &header, &data);
 		if (ret == 0) {
 			/* No more packets available at this time */
-			return;
+			break;
 		}
 		if (ret < 0) {
 			ERROR("Error requesting next packet, got (%i): %s", ret, pcap_geterr(handle));
-			return;
+			break;
 		}
 
-		count++;
+		count = atomic_fetch_add_explicit(&packets_seen, 1, memory_order_relaxed) + 1;
 		rs_packet_process(count, event, header, data);
 	}
+	rs_stats_unlock();
 }
 
 static int  _rs_event_status(UNUSED fr_time_t now, fr_time_delta_t wake_t, UNUSED void *uctx)
@@ -2260,6 +2366,276 @@ fr_event_list_t *list, int fd, int UNUSED flags, UNUSED void *ctx)
 	}
 }
 
+/** Apply the capture filter to a live or file handle
+ *
+ */
+static int rs_apply_filter(fr_pcap_t *in_p)
+{
+	if (!conf->pcap_filter) return 0;
+
+	/*
+	 *	Not all link layers support VLAN tags
+	 *	and this is the easiest way to discover
+	 *	which do and which don't.
+	 */
+	if ((!conf->pcap_filter_vlan ||
+	     (fr_pcap_apply_filter(in_p, conf->pcap_filter_vlan) < 0)) &&
+	     (fr_pcap_apply_filter(in_p, conf->pcap_filter) < 0)) {
+		fr_perror("Failed applying filter");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Open the capture handles for all capture threads
+ *
+ * The first thread uses the handles which are already open.  Every other
+ * thread gets its own handle for each interface, which are added to the
+ * end of the list, so the stats code sees all of them.
+ *
+ * All of the handles for an interface are then added to the same fanout
+ * group.
+ *
+ * @param[in] in	the list of open handles, one per interface.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int rs_threads_open(fr_pcap_t *in)
+{
+	fr_pcap_t	*in_p, **tail = NULL;
+	int		i, t, num_in = 0;
+	uint16_t	group;
+
+	for (in_p = in; in_p; in_p = in_p->next) {
+		if (in_p->type != PCAP_INTERFACE_IN) {
+			ERROR("Capture threads can only read from live interfaces");
+			return -1;
+		}
+		num_in++;
+		tail = &in_p->next;
+	}
+
+	MEM(conf->threads = talloc_zero_array(conf, rs_thread_t, conf->num_threads));
+
+	for (t = 0; t < conf->num_threads; t++) {
+		rs_thread_t *thread = &conf->threads[t];
+
+		thread->id = t;
+		thread->num_in = num_in;
+		thread->signal_pipe[0] = thread->signal_pipe[1] = -1;
+		MEM(thread->stats = talloc_zero(conf->threads, rs_stats_t));
+		pthread_mutex_init(&thread->mutex, NULL);
+
+		if (t == 0) {
+			thread->in = in;
+			continue;
+		}
+
+		for (in_p = in, i = 0; i < num_in; in_p = in_p->next, i++) {
+			fr_pcap_t *new;
+
+			MEM(new = fr_pcap_init(conf, in_p->name, PCAP_INTERFACE_IN));
+			new->promiscuous = conf->promiscuous;
+			new->buffer_pkts = conf->buffer_pkts;
+
+			if (fr_pcap_open(new) < 0) {
+				fr_perror("Failed opening pcap handle (%s)", new->name);
+				return -1;
+			}
+			if (rs_apply_filter(new) < 0) return -1;
+
+			if (!thread->in) thread->in = new;
+			*tail = new;
+			tail = &new->next;
+		}
+	}
+
+	/*
+	 *	Fanout groups are shared by all processes on
+	 *	the host, so derive them from our PID.
+	 */
+	group = (uint16_t) getpid();
+	for (in_p = in, i = 0; i < num_in; in_p = in_p->next, i++) {
+		for (t = 0; t < conf->num_threads; t++) {
+			fr_pcap_t	*member = conf->threads[t].in;
+			int		j;
+
+			for (j = 0; j < i; j++) member = member->next;
+
+			if (fr_pcap_fanout(member, group + i) < 0) {
+				fr_perror("radsniff");
+				return -1;
+			}
+		}
+	}
+
+	/*
+	 *	Make the stats output distinguish between the
+	 *	handles for each thread.
+	 */
+	for (t = 0; t < conf->num_threads; t++) {
+		for (in_p = conf->threads[t].in, i = 0; i < num_in; in_p = in_p->next, i++) {
+			char *name;
+
+			name = talloc_typed_asprintf(in_p, "%s#%i", in_p->name, t);
+			talloc_free(in_p->name);
+			in_p->name = name;
+		}
+	}
+
+	return 0;
+}
+
+/** Tell a capture thread to exit
+ *
+ */
+static void rs_thread_signal(fr_event_list_t *el, int fd, UNUSED int flags, UNUSED void *ctx)
+{
+	char c;
+
+	if (read(fd, &c, sizeof(c)) < 0) ERROR("Failed reading from thread pipe: %s", fr_syserror(errno));
+
+	fr_event_loop_exit(el, 1);
+}
+
+/** Capture, decode and correlate packets from this thread's handles
+ *
+ */
+static void *rs_thread_main(void *arg)
+{
+	rs_thread_t	*thread = arg;
+	TALLOC_CTX	*ctx;
+	fr_pcap_t	*in_p;
+	int		i;
+
+	rs_thread = thread;
+
+	/*
+	 *	The event list is allocated first, so it's freed
+	 *	last, after all the requests have cancelled their
+	 *	timers.
+	 */
+	ctx = talloc_new(NULL);
+	if (!ctx) return NULL;
+
+	events = fr_event_list_alloc(ctx, NULL, NULL);
+	if (!events) {
+		fr_perror("radsniff (thread %u)", thread->id);
+		goto done;
+	}
+
+	if (fr_event_fd_insert(NULL, NULL, events, thread->signal_pipe[0],
+			       rs_thread_signal, NULL, NULL, NULL) < 0) {
+		fr_perror("radsniff (thread %u)", thread->id);
+		goto done;
+	}
+
+	if (conf->link_da_num) {
+		link_tree = fr_rb_inline_talloc_alloc(ctx, rs_request_t, link_node, rs_rtx_cmp, _unmark_link);
+		if (!link_tree) {
+			ERROR("Failed creating RTX tree");
+			goto done;
+		}
+	}
+
+	request_tree = fr_rb_inline_talloc_alloc(ctx, rs_request_t, request_node, rs_packet_cmp, _unmark_request);
+	if (!request_tree) {
+		ERROR("Failed creating request tree");
+		goto done;
+	}
+
+	packet_ctx = talloc_new(ctx);
+	if (!packet_ctx) goto done;
+
+	for (in_p = thread->in, i = 0; i < thread->num_in; in_p = in_p->next, i++) {
+		rs_event_t *event;
+
+		event = talloc_zero(events, rs_event_t);
+		event->list = events;
+		event->in = in_p;
+		event->stats = thread->stats;
+
+		if (fr_event_fd_insert(NULL, NULL, events, in_p->fd,
+				       rs_got_packet,
+				       NULL,
+				       NULL,
+				       event) < 0) {
+			fr_perror("Failed inserting file descriptor");
+			goto done;
+		}
+	}
+
+	DEBUG2("Thread %u capturing", thread->id);
+
+	fr_event_loop(events);
+
+	DEBUG2("Thread %u done capturing", thread->id);
+
+done:
+	/*
+	 *	Don't pollute the stats as requests are freed.
+	 */
+	cleanup = true;
+	TALLOC_FREE(packet_ctx);
+	talloc_free(ctx);
+
+	return NULL;
+}
+
+/** Start the capture threads
+ *
+ */
+static int rs_threads_start(void)
+{
+	int t;
+
+	for (t = 0; t < conf->num_threads; t++) {
+		rs_thread_t	*thread = &conf->threads[t];
+		int		ret;
+
+		if (pipe(thread->signal_pipe) < 0) {
+			ERROR("Couldn't open thread pipe: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		ret = pthread_create(&thread->pthread_id, NULL, rs_thread_main, thread);
+		if (ret != 0) {
+			ERROR("Failed creating capture thread: %s", fr_syserror(ret));
+			close(thread->signal_pipe[0]);
+			close(thread->signal_pipe[1]);
+			thread->signal_pipe[0] = thread->signal_pipe[1] = -1;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Stop any running capture threads, and wait for them to exit
+ *
+ */
+static void rs_threads_stop(void)
+{
+	int t;
+
+	for (t = 0; t < conf->num_threads; t++) {
+		rs_thread_t *thread = &conf->threads[t];
+
+		if (thread->signal_pipe[1] < 0) continue;
+
+		if (write(thread->signal_pipe[1], "x", 1) < 0) {
+			ERROR("Failed signalling thread %u: %s", thread->id, fr_syserror(errno));
+		}
+		pthread_join(thread->pthread_id, NULL);
+
+		close(thread->signal_pipe[0]);
+		close(thread->signal_pipe[1]);
+		thread->signal_pipe[0] = thread->signal_pipe[1] = -1;
+	}
+}
+
 static NEVER_RETURNS void usage(int status)
 {
 	FILE *output = status ? stderr : stdout;
@@ -2284,6 +2660,7 @@ static NEVER_RETURNS void usage(int status)
 	fprintf(output, "  -h                    This help message.\n");
 	fprintf(output, "  -i <interface>        Capture packets from interface (defaults to all if supported).\n");
 	fprintf(output, "  -I <file>             Read packets from <file>\n");
+	fprintf(output, "  -j <threads>          Capture with multiple threads, sharing packets by flow (Linux only).\n");
 	fprintf(output, "  -l <attr>[,<attr>]    Output packet sig and a list of attributes.\n");
 	fprintf(output, "  -L <attr>[,<attr>]    Detect retransmissions using these attributes to link requests.\n");
 	fprintf(output, "  -m                    Don't put interface(s) into promiscuous mode.\n");
@@ -2363,6 +2740,7 @@ int main(int argc, char *argv[])
 	fr_pair_list_init(&conf->filter_response_vps);
 
 	stats = talloc_zero(conf, rs_stats_t);
+	packet_ctx = conf;
 
 	/*
 	 *	Set some defaults
@@ -2383,7 +2761,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mp:P:qr:R:s:St:vw:xXW:T:P:N:O:Z:")) != -1) {
+	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:j:l:L:mp:P:qr:R:s:St:vw:xXW:T:P:N:O:Z:")) != -1) {
 		switch (c) {
 		case 'a':
 		{
@@ -2478,6 +2856,14 @@ int main(int argc, char *argv[])
 			conf->from_file = true;
 			break;
 
+		case 'j':
+			conf->num_threads = atoi(optarg);
+			if ((conf->num_threads <= 0) || (conf->num_threads > RS_MAX_THREADS)) {
+				ERROR("Number of capture threads must be between 1 and %i", RS_MAX_THREADS);
+				usage(64);
+			}
+			break;
+
 		case 'l':
 			conf->list_attributes = optarg;
 			break;
@@ -2651,6 +3037,22 @@ int main(int argc, char *argv[])
 		conf->to_stdout = false;
 	}
 
+	/*
+	 *	Capture threads share packets using kernel fanout,
+	 *	and can't share a single output file.
+	 */
+	if (conf->num_threads) {
+		if (conf->from_file || conf->from_stdin) {
+			ERROR("Capture threads (-j) can only be used with live interfaces");
+			usage(64);
+		}
+
+		if (conf->to_file || conf->to_stdout || conf->to_output_dir) {
+			ERROR("Capture threads (-j) can't be used when writing packets (-w, -S, -Z)");
+			usage(64);
+		}
+	}
+
 	if (conf->to_stdout) {
 		out = fr_pcap_init(conf, "stdout", PCAP_STDIO_OUT);
 		if (!out) {
@@ -2969,19 +3371,7 @@ int main(int argc, char *argv[])
 				goto finish;
 			}
 
-			if (conf->pcap_filter) {
-				/*
-				 *	Not all link layers support VLAN tags
-				 *	and this is the easiest way to discover
-				 *	which do and which don't.
-				 */
-				if ((!conf->pcap_filter_vlan ||
-				     (fr_pcap_apply_filter(in_p, conf->pcap_filter_vlan) < 0)) &&
-				     (fr_pcap_apply_filter(in_p, conf->pcap_filter) < 0)) {
-					fr_perror("Failed applying filter");
-					goto finish;
-				}
-			}
+			if (rs_apply_filter(in_p) < 0) goto finish;
 
 			*tmp_p = in_p;
 			tmp_p = &(in_p->next);
@@ -3027,6 +3417,11 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/*
+	 *	Open the handles for the other capture threads.
+	 */
+	if (conf->num_threads && (rs_threads_open(in) < 0)) goto finish;
+
 	/*
 	 *	Get the offset between server time and wallclock time
 	 */
@@ -3076,8 +3471,10 @@ int main(int argc, char *argv[])
 
 		/*
 		 *  Now add fd's for each of the pcap sessions we opened
+		 *
+		 *  The capture threads do this themselves.
 		 */
-		for (in_p = in;
+		for (in_p = conf->num_threads ? NULL : in;
 		     in_p;
 		     in_p = in_p->next) {
 			rs_event_t *event;
@@ -3122,7 +3519,7 @@ int main(int argc, char *argv[])
 	/*
 	 *	If we just have the pipe, then exit.
 	 */
-	if (fr_event_list_num_fds(events) == 1) goto finish;
+	if (!conf->num_threads && (fr_event_list_num_fds(events) == 1)) goto finish;
 
 	/*
 	 *	Do this as late as possible so we can return an error code if something went wrong.
@@ -3141,6 +3538,20 @@ int main(int argc, char *argv[])
 #ifdef SIGQUIT
 	fr_set_signal(SIGQUIT, rs_signal_self);
 #endif
+	/*
+	 *	Start these after daemonizing, as threads don't
+	 *	survive a fork.
+	 */
+	if (conf->num_threads) {
+		gettimeofday(&start_pcap, NULL);
+
+		if (rs_threads_start() < 0) {
+			ret = EXIT_FAILURE;
+			goto finish;
+		}
+		DEBUG("Capturing with %i threads", conf->num_threads);
+	}
+
 	DEBUG2("Entering event loop");
 
 	fr_event_loop(events);	/* Enter the main event loop */
@@ -3148,6 +3559,8 @@ int main(int argc, char *argv[])
 	DEBUG2("Done sniffing");
 
 finish:
+	if (conf->threads) rs_threads_stop();
+
 	cleanup = true;
 
 	if (conf->daemonize) unlink(conf->pidfile);
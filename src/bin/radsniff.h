@@ -28,6 +28,7 @@
 RCSIDH(radsniff_h, "$Id$")
 
 #include <sys/types.h>
+#include <pthread.h>
 
 #include <freeradius-devel/util/pcap.h>
 #include <freeradius-devel/util/event.h>
@@ -44,6 +45,7 @@ RCSIDH(radsniff_h, "$Id$")
 #define RS_RETRANSMIT_MAX	5		//!< Maximum number of times we expect to see a packet retransmitted
 #define RS_MAX_ATTRS		50		//!< Maximum number of attributes we can filter on.
 #define RS_SOCKET_REOPEN_DELAY  5000		//!< How long we delay re-opening a collectd socket.
+#define RS_MAX_THREADS		64		//!< Maximum number of capture threads.
 
 /*
  *	Logging macros
@@ -230,6 +232,27 @@ typedef struct {
 	rs_stats_t		*stats;			//!< Where to write stats.
 } rs_event_t;
 
+/** A capture thread
+ *
+ * Each thread has its own set of PCAP handles, one per interface.  The
+ * handles for an interface are members of the same fanout group, so the
+ * kernel hashes each flow to a single thread, and requests and responses
+ * can be correlated without sharing the request trees between threads.
+ */
+typedef struct {
+	unsigned int		id;			//!< Thread number, starting at 0.
+	pthread_t		pthread_id;		//!< Set when the thread is started.
+
+	fr_pcap_t		*in;			//!< First of this thread's PCAP handles.
+	int			num_in;			//!< How many handles in the list belong to this thread.
+
+	pthread_mutex_t		mutex;			//!< Protects the interval stats.
+	rs_stats_t		*stats;			//!< Stats for the current interval, merged, and
+							///< cleared by the main thread.
+
+	int			signal_pipe[2];		//!< Tells the thread to exit.
+} rs_thread_t;
+
 typedef struct rs_update rs_update_t;
 
 /** Callback for printing stats header.
@@ -305,6 +328,10 @@ struct rs {
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
 	uint64_t		limit;			//!< Maximum number of packets to capture
 
+	int			num_threads;		//!< Number of capture threads.  0 means capture
+							///< in the main thread.
+	rs_thread_t		*threads;		//!< Capture threads.
+
 	struct {
 		int			interval;		//!< Time between stats updates in seconds.
 		stats_out_t		out;			//!< Where to write stats.
@@ -2914,7 +2914,7 @@ static size_t command_xlat_purify(command_result_t *result, command_file_ctx_t *
 		xlat_debug_head(head);
 	}
 
-	(void) xlat_purify(head, NULL);
+	(void) xlat_purify(head, NULL, NULL);
 
 	if (fr_debug_lvl > 2) {
 		DEBUG("After purify --------------------------------------------------");
@@ -1036,6 +1036,72 @@ fr_bio_t *fr_bio_fd_alloc(TALLOC_CTX *ctx, fr_bio_fd_config_t const *cfg, size_t
 	return (fr_bio_t *) my;
 }
 
+/** Allocate an FD bio for a stream socket which is already connected.
+ *
+ *  e.g. a socket which was returned from accept().  The local and remote addresses are taken from the
+ *  socket.  The bio takes ownership of the socket, and closes it when the bio is freed.
+ *
+ *  @param ctx		the talloc ctx
+ *  @param fd		the connected socket
+ *  @return
+ *	- NULL on error, the socket isn't a connected stream socket, or memory allocation failed.
+ *	- !NULL the bio
+ */
+fr_bio_t *fr_bio_fd_alloc_connected(TALLOC_CTX *ctx, int fd)
+{
+	int			type;
+	socklen_t		len = sizeof(type);
+	socklen_t		salen;
+	struct sockaddr_storage	sockaddr;
+	fr_bio_fd_t		*my;
+
+	if ((getsockopt(fd, SOL_SOCKET, SO_TYPE, (void *) &type, &len) < 0) || (type != SOCK_STREAM)) {
+		fr_strerror_const("Socket is not a stream socket");
+		return NULL;
+	}
+
+	salen = sizeof(sockaddr);
+	memset(&sockaddr, 0, salen);
+	if (getpeername(fd, (struct sockaddr *) &sockaddr, &salen) < 0) {
+		fr_strerror_printf("Failed getting peer name: %s", fr_syserror(errno));
+		return NULL;
+	}
+
+	if ((sockaddr.ss_family != AF_INET) && (sockaddr.ss_family != AF_INET6)) {
+		fr_strerror_const("Unsupported address family for connected socket");
+		return NULL;
+	}
+
+	my = (fr_bio_fd_t *) fr_bio_fd_alloc(ctx, NULL, 0);
+	if (!my) return NULL;
+
+	my->info.socket = (fr_socket_t) {
+		.type = SOCK_STREAM,
+		.af = sockaddr.ss_family,
+		.fd = fd,
+		.inet = {
+			.src_ipaddr = {
+				.af = sockaddr.ss_family,
+			},
+		},
+	};
+	my->info.type = FR_BIO_FD_CONNECTED;
+
+	if ((fr_ipaddr_from_sockaddr(&my->info.socket.inet.dst_ipaddr, &my->info.socket.inet.dst_port,
+				     &sockaddr, salen) < 0) ||
+	    (fr_bio_fd_socket_name(my) < 0) ||
+	    (fr_bio_fd_init_common(my) < 0)) {
+		/*
+		 *	The caller still owns the socket.
+		 */
+		my->info.state = FR_BIO_FD_STATE_CLOSED;
+		talloc_free(my);
+		return NULL;
+	}
+
+	return (fr_bio_t *) my;
+}
+
 /** Close the FD, but leave the bio allocated and alive.
  *
  */
@@ -1139,6 +1205,19 @@ int fr_bio_fd_connect(fr_bio_t *bio)
 		return fr_bio_error(IO);
 	}
 
+	/*
+	 *	The connection was refused, timed out, etc.
+	 */
+	if (error) {
+		fr_strerror_printf("Failed connecting socket: %s", fr_syserror(error));
+		goto fail;
+	}
+
+	/*
+	 *	The source IP may have changed, so get the new one.
+	 */
+	if ((my->info.socket.af != AF_LOCAL) && (fr_bio_fd_socket_name(my) < 0)) goto fail;
+
 	/*
 	 *	The socket is connected, so initialize the normal IO handlers.
 	 */
@@ -120,6 +120,8 @@ typedef struct {
 
 fr_bio_t	*fr_bio_fd_alloc(TALLOC_CTX *ctx, fr_bio_fd_config_t const *cfg, size_t offset) CC_HINT(nonnull(1));
 
+fr_bio_t	*fr_bio_fd_alloc_connected(TALLOC_CTX *ctx, int fd);
+
 int		fr_bio_fd_close(fr_bio_t *bio) CC_HINT(nonnull);
 
 int		fr_bio_fd_connect(fr_bio_t *bio) CC_HINT(nonnull);
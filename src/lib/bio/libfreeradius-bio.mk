@@ -16,3 +16,9 @@ SOURCES	:=		\
 	retry.c
 
 TGT_PREREQS	:= libfreeradius-util$(L)
+
+ifneq ($(OPENSSL_LIBS),)
+SOURCES		+= tls.c
+TGT_LDLIBS	:= $(OPENSSL_LIBS)
+TGT_LDFLAGS	:= $(OPENSSL_LDFLAGS)
+endif
@@ -260,8 +260,10 @@ static ssize_t fr_bio_mem_read_verify(fr_bio_t *bio, void *packet_ctx, void *buf
 
 	/*
 	 *	No data was read from the next bio, we still don't have a packet.  Return nothing.
+	 *
+	 *	For stream sockets, "would block" just means that the rest of the packet hasn't arrived yet.
 	 */
-	if (rcode == 0) return 0;
+	if ((rcode == 0) || (rcode == fr_bio_error(IO_WOULD_BLOCK))) return 0;
 
 	/*
 	 *	The next bio returned an error either when our buffer was empty, or else it had only a partial
@@ -280,5 +280,11 @@ fr_trie_t *fr_bio_network_trie_alloc(TALLOC_CTX *ctx, int af, fr_ipaddr_t const
 		}
 	}
 
+	/*
+	 *	The rules don't change, and are checked for every
+	 *	packet, so use the faster lookup table.
+	 */
+	(void) fr_trie_compile(trie, (af == AF_INET) ? 32 : 128);
+
 	return trie;
 }
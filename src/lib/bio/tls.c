@@ -0,0 +1,552 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/bio/tls.c
+ * @brief BIO TLS handlers
+ *
+ *  The TLS bio sits on top of a stream bio (usually an FD bio), and encrypts / decrypts the data which
+ *  passes through it.  OpenSSL never sees the socket.  Instead, it reads and writes ciphertext through a
+ *  BIO pair, and we move the ciphertext between the BIO pair and the next bio.  This means that the TLS
+ *  bio works with any stream bio, and that it never blocks.
+ *
+ *  The BIO pair has a fixed size, so we never buffer more than one or two TLS records of ciphertext.  If
+ *  the next bio blocks, writes to us return IO_WOULD_BLOCK until the pending ciphertext has been written.
+ *
+ *  As with SSL_write(), when a write returns IO_WOULD_BLOCK, the caller MUST retry the write with the same
+ *  data (or more data which starts with the same bytes).
+ *
+ *  If the next bio is an FD bio, the caller can instead give the socket to OpenSSL with fr_bio_tls_ktls().
+ *  OpenSSL then asks the kernel to do the record encryption (kTLS) once the handshake has finished.  If the
+ *  kernel or the cipher suite doesn't support kTLS, OpenSSL does the encryption itself, and reads and
+ *  writes the socket directly.  Either way, the next bio stays in the chain, and still owns the socket.
+ *
+ * @copyright 2024 Network RADIUS SAS (legal@networkradius.com)
+ */
+
+#include <freeradius-devel/bio/bio_priv.h>
+#include <freeradius-devel/bio/fd_priv.h>
+#include <freeradius-devel/bio/null.h>
+#include <freeradius-devel/bio/tls.h>
+
+#include <openssl/err.h>
+
+/** The TLS bio
+ *
+ */
+typedef struct {
+	FR_BIO_COMMON;
+
+	fr_bio_tls_info_t	info;
+
+	SSL			*ssl;		//!< our reference to the TLS session.
+	BIO			*network;	//!< our half of the BIO pair.  OpenSSL has the other half.
+						///< NULL when OpenSSL reads and writes the socket itself.
+} fr_bio_tls_t;
+
+/** Add the OpenSSL error stack to the fr_strerror() stack
+ *
+ */
+static void fr_bio_tls_strerror(char const *msg)
+{
+	unsigned long	error;
+	char		buffer[256];
+
+	while ((error = ERR_get_error()) != 0) {
+		ERR_error_string_n(error, buffer, sizeof(buffer));
+		fr_strerror_printf_push("%s", buffer);
+	}
+
+	fr_strerror_printf_push("%s", msg);
+}
+
+static int fr_bio_tls_destructor(fr_bio_tls_t *my)
+{
+	fr_assert(!fr_bio_prev(&my->bio));
+	fr_assert(!fr_bio_next(&my->bio));
+
+	/*
+	 *	OpenSSL owns the other half of the BIO pair, and will free it when the last reference to the
+	 *	SSL session goes away.
+	 */
+	if (my->network) BIO_free(my->network);
+	if (my->ssl) SSL_free(my->ssl);
+
+	return 0;
+}
+
+/** Write pending ciphertext to the next bio.
+ *
+ *  The data is written directly from the BIO pair buffer, so there are no extra copies.
+ *
+ *  @return
+ *	- <0 on fatal error
+ *	- 0 for "all data has been written"
+ *	- >0 for "there is still pending data", and the next bio is blocked.
+ */
+static ssize_t fr_bio_tls_flush(fr_bio_tls_t *my)
+{
+	fr_bio_t *next = fr_bio_next(&my->bio);
+
+	fr_assert(next != NULL);
+
+	if (!my->network) return 0;
+
+	while (true) {
+		char		*data;
+		ssize_t		pending, rcode;
+
+		pending = BIO_nread0(my->network, &data);
+		if (pending <= 0) return 0;
+
+		rcode = next->write(next, NULL, data, pending);
+		if (rcode == fr_bio_error(IO_WOULD_BLOCK)) return pending;
+		if (rcode < 0) return rcode;
+		if (rcode == 0) return pending;
+
+		(void) BIO_nread(my->network, &data, rcode);
+
+		if (rcode < pending) return pending - rcode;
+	}
+}
+
+/** Read ciphertext from the next bio into the BIO pair.
+ *
+ *  @return
+ *	- <0 on fatal error
+ *	- 0 for "no data was available"
+ *	- >0 for the amount of ciphertext which was read.
+ */
+static ssize_t fr_bio_tls_fill(fr_bio_tls_t *my)
+{
+	char		*p;
+	ssize_t		room, rcode;
+	fr_bio_t	*next = fr_bio_next(&my->bio);
+
+	fr_assert(next != NULL);
+
+	/*
+	 *	OpenSSL has already tried to read the socket, and there was no data.
+	 */
+	if (!my->network) return 0;
+
+	/*
+	 *	OpenSSL wants to read data, so there must be room in the BIO pair for it.
+	 */
+	room = BIO_nwrite0(my->network, &p);
+	if (room <= 0) {
+		fr_strerror_const("TLS input buffer is full");
+		return fr_bio_error(BUFFER_FULL);
+	}
+
+	rcode = next->read(next, NULL, p, room);
+	if (rcode == fr_bio_error(IO_WOULD_BLOCK)) return 0;
+	if (rcode <= 0) return rcode;
+
+	(void) BIO_nwrite(my->network, &p, rcode);
+
+	return rcode;
+}
+
+/** The handshake has finished.
+ *
+ */
+static void fr_bio_tls_established(fr_bio_tls_t *my)
+{
+	my->info.state = FR_BIO_TLS_STATE_OPEN;
+	my->info.resumed = (SSL_session_reused(my->ssl) == 1);
+
+	/*
+	 *	OpenSSL enables kTLS when it installs the session keys.  If the kernel refused, OpenSSL
+	 *	silently falls back to doing the encryption itself.
+	 */
+	if (!my->network) {
+		my->info.ktls_send = (BIO_get_ktls_send(SSL_get_wbio(my->ssl)) == 1);
+		my->info.ktls_recv = (BIO_get_ktls_recv(SSL_get_rbio(my->ssl)) == 1);
+	}
+}
+
+/** The TLS session has failed.  Nothing more can be read or written.
+ *
+ */
+static ssize_t fr_bio_tls_error(fr_bio_tls_t *my, int ret, char const *msg)
+{
+	int error = SSL_get_error(my->ssl, ret);
+
+	my->info.state = FR_BIO_TLS_STATE_CLOSED;
+	my->bio.read = fr_bio_fail_read;
+	my->bio.write = fr_bio_fail_write;
+
+	if (error == SSL_ERROR_ZERO_RETURN) {
+		fr_bio_eof(&my->bio);
+		if (my->cb.eof) my->cb.eof(&my->bio);
+		return 0;
+	}
+
+	if ((error == SSL_ERROR_SYSCALL) && (ERR_peek_error() == 0)) {
+		fr_strerror_printf("%s: Connection closed unexpectedly", msg);
+	} else {
+		fr_bio_tls_strerror(msg);
+	}
+
+	if (my->cb.failed) my->cb.failed(&my->bio);
+
+	return fr_bio_error(GENERIC);
+}
+
+/** Read decrypted data.
+ *
+ *  We read as much ciphertext as needed to decrypt one record.  If there is no more ciphertext available,
+ *  we return 0.
+ */
+static ssize_t fr_bio_tls_read(fr_bio_t *bio, UNUSED void *packet_ctx, void *buffer, size_t size)
+{
+	int		ret;
+	size_t		nread;
+	ssize_t		rcode;
+	fr_bio_tls_t	*my = talloc_get_type_abort(bio, fr_bio_tls_t);
+
+	while (true) {
+		ERR_clear_error();
+
+		ret = SSL_read_ex(my->ssl, buffer, size, &nread);
+		if (ret == 1) {
+			if (my->info.state == FR_BIO_TLS_STATE_HANDSHAKE) fr_bio_tls_established(my);
+			return nread;
+		}
+
+		switch (SSL_get_error(my->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			/*
+			 *	The handshake (or a key update) may have left a response for us to send.
+			 */
+			rcode = fr_bio_tls_flush(my);
+			if (rcode < 0) return rcode;
+
+			rcode = fr_bio_tls_fill(my);
+			if (rcode <= 0) return rcode;
+			continue;
+
+		case SSL_ERROR_WANT_WRITE:
+			if (!my->network) return 0;
+
+			rcode = fr_bio_tls_flush(my);
+			if (rcode < 0) return rcode;
+			if (rcode > 0) return 0;
+			continue;
+
+		default:
+			return fr_bio_tls_error(my, ret, "Failed reading from TLS session");
+		}
+	}
+}
+
+/** Encrypt data, and write it to the next bio.
+ *
+ *  Partial writes are allowed.  If the next bio is blocked, we encrypt nothing, and return IO_WOULD_BLOCK.
+ *  A NULL buffer flushes any pending ciphertext.
+ */
+static ssize_t fr_bio_tls_write(fr_bio_t *bio, UNUSED void *packet_ctx, void const *buffer, size_t size)
+{
+	int		ret;
+	size_t		written;
+	ssize_t		rcode;
+	fr_bio_tls_t	*my = talloc_get_type_abort(bio, fr_bio_tls_t);
+
+	rcode = fr_bio_tls_flush(my);
+	if (rcode < 0) return rcode;
+
+	/*
+	 *	Flushes don't block.  The caller can check fr_bio_tls_write_pending() to see if there's
+	 *	still data to write.
+	 */
+	if (!buffer) return 0;
+
+	if (rcode > 0) return fr_bio_error(IO_WOULD_BLOCK);
+
+	while (true) {
+		ERR_clear_error();
+
+		ret = SSL_write_ex(my->ssl, buffer, size, &written);
+		if (ret == 1) {
+			if (my->info.state == FR_BIO_TLS_STATE_HANDSHAKE) fr_bio_tls_established(my);
+
+			/*
+			 *	The ciphertext is in the BIO pair, so we are now responsible for it.  If the
+			 *	next bio blocks, the data is sent on the next write or flush.
+			 */
+			rcode = fr_bio_tls_flush(my);
+			if (rcode < 0) return rcode;
+
+			return written;
+		}
+
+		switch (SSL_get_error(my->ssl, ret)) {
+		case SSL_ERROR_WANT_WRITE:
+			if (!my->network) return fr_bio_error(IO_WOULD_BLOCK);
+
+			rcode = fr_bio_tls_flush(my);
+			if (rcode < 0) return rcode;
+			if (rcode > 0) return fr_bio_error(IO_WOULD_BLOCK);
+			continue;
+
+		case SSL_ERROR_WANT_READ:
+			rcode = fr_bio_tls_flush(my);
+			if (rcode < 0) return rcode;
+
+			rcode = fr_bio_tls_fill(my);
+			if (rcode < 0) return rcode;
+			if (rcode == 0) return fr_bio_error(IO_WOULD_BLOCK);
+			continue;
+
+		default:
+			return fr_bio_tls_error(my, ret, "Failed writing to TLS session");
+		}
+	}
+}
+
+/** Drive the TLS handshake
+ *
+ *  The caller should call this function when the next bio is readable or writable, until it returns 1.
+ *  If fr_bio_tls_write_pending() returns non-zero, the caller should wait for the next bio to become
+ *  writable.  Otherwise it should wait for the next bio to become readable.
+ *
+ *  Calling the handshake function is optional.  Reads and writes will also drive the handshake.  But the
+ *  caller then can't tell when the session is ready to use.
+ *
+ *  @param bio	the TLS bio.
+ *  @return
+ *	- <0 on error
+ *	- 0 for "handshake is in progress"
+ *	- 1 for "handshake is done"
+ */
+int fr_bio_tls_handshake(fr_bio_t *bio)
+{
+	int		ret;
+	ssize_t		rcode;
+	fr_bio_tls_t	*my = talloc_get_type_abort(bio, fr_bio_tls_t);
+
+	switch (my->info.state) {
+	case FR_BIO_TLS_STATE_OPEN:
+		return 1;
+
+	case FR_BIO_TLS_STATE_CLOSED:
+		fr_strerror_const("TLS session is closed");
+		return -1;
+
+	case FR_BIO_TLS_STATE_HANDSHAKE:
+		break;
+	}
+
+	while (true) {
+		rcode = fr_bio_tls_flush(my);
+		if (rcode < 0) return -1;
+		if (rcode > 0) return 0;
+
+		ERR_clear_error();
+
+		ret = SSL_do_handshake(my->ssl);
+		if (ret == 1) {
+			fr_bio_tls_established(my);
+
+			/*
+			 *	The last flight of the handshake may still be in the BIO pair.  It will be
+			 *	written out with the first application data.
+			 */
+			rcode = fr_bio_tls_flush(my);
+			if (rcode < 0) return -1;
+
+			return 1;
+		}
+
+		switch (SSL_get_error(my->ssl, ret)) {
+		case SSL_ERROR_WANT_WRITE:
+			if (!my->network) return 0;
+			continue;
+
+		case SSL_ERROR_WANT_READ:
+			rcode = fr_bio_tls_flush(my);
+			if (rcode < 0) return -1;
+			if (rcode > 0) return 0;
+
+			rcode = fr_bio_tls_fill(my);
+			if (rcode < 0) return -1;
+			if (rcode == 0) {
+				/*
+				 *	EOF during the handshake is always an error.
+				 */
+				if (my->bio.read != fr_bio_tls_read) {
+					fr_strerror_const("Connection closed during TLS handshake");
+					return -1;
+				}
+				return 0;
+			}
+			continue;
+
+		default:
+			(void) fr_bio_tls_error(my, ret, "TLS handshake failed");
+			return -1;
+		}
+	}
+}
+
+/** How much ciphertext is waiting to be written to the next bio.
+ *
+ */
+size_t fr_bio_tls_write_pending(fr_bio_t *bio)
+{
+	fr_bio_tls_t *my = talloc_get_type_abort(bio, fr_bio_tls_t);
+
+	/*
+	 *	OpenSSL keeps any partially written record to itself.  The caller will see IO_WOULD_BLOCK,
+	 *	and has to retry the write.
+	 */
+	if (!my->network) return 0;
+
+	return BIO_ctrl_pending(my->network);
+}
+
+/** Let OpenSSL read and write the socket directly, so that it can use kernel TLS.
+ *
+ *  This function MUST be called before any data has been read or written, and the next bio MUST be an FD
+ *  bio for a connected stream socket.
+ *
+ *  The kernel only takes over the encryption when the handshake has finished.  The caller can check
+ *  fr_bio_tls_info() to see if it did.  If the kernel doesn't support kTLS (or the negotiated cipher), the
+ *  session still works, and OpenSSL does the encryption in user space.
+ *
+ *  @param bio	the TLS bio.
+ *  @return
+ *	- <0 on error
+ *	- 0 for "kTLS isn't available", the TLS bio is unchanged.
+ *	- 1 for "OpenSSL now owns the socket"
+ */
+int fr_bio_tls_ktls(fr_bio_t *bio)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	fr_bio_tls_t	*my = talloc_get_type_abort(bio, fr_bio_tls_t);
+	fr_bio_fd_t	*fd;
+	BIO		*sock;
+
+	if (!my->network) return 1;
+
+	fd = talloc_get_type(fr_bio_next(&my->bio), fr_bio_fd_t);
+	if (!fd || (fd->info.socket.type != SOCK_STREAM) || (fd->info.state != FR_BIO_FD_STATE_OPEN)) return 0;
+
+	if ((my->info.state != FR_BIO_TLS_STATE_HANDSHAKE) || (SSL_in_before(my->ssl) != 1) ||
+	    (BIO_ctrl_pending(my->network) > 0) || (BIO_ctrl_pending(SSL_get_rbio(my->ssl)) > 0)) {
+		fr_strerror_const("Cannot enable kTLS after the TLS handshake has started");
+		return -1;
+	}
+
+	sock = BIO_new_socket(fd->info.socket.fd, BIO_NOCLOSE);
+	if (!sock) {
+		fr_bio_tls_strerror("Failed allocating TLS socket BIO");
+		return -1;
+	}
+
+	/*
+	 *	This frees OpenSSL's half of the BIO pair, and we free ours.
+	 */
+	SSL_set_bio(my->ssl, sock, sock);
+	BIO_free(my->network);
+	my->network = NULL;
+
+	SSL_set_options(my->ssl, SSL_OP_ENABLE_KTLS);
+
+	return 1;
+#else
+	(void) talloc_get_type_abort(bio, fr_bio_tls_t);
+
+	return 0;
+#endif
+}
+
+/** Returns a pointer to the bio-specific information.
+ *
+ */
+fr_bio_tls_info_t const *fr_bio_tls_info(fr_bio_t *bio)
+{
+	fr_bio_tls_t *my = talloc_get_type_abort(bio, fr_bio_tls_t);
+
+	return &my->info;
+}
+
+/** The next bio is at EOF, so we can't read any more ciphertext.
+ *
+ *  Any records which have already been read can still be decrypted.
+ */
+static void fr_bio_tls_eof(fr_bio_t *bio)
+{
+	fr_bio_tls_t *my = talloc_get_type_abort(bio, fr_bio_tls_t);
+
+	my->bio.read = fr_bio_null_read;
+	my->bio.write = fr_bio_null_write;
+}
+
+/** Allocate a TLS bio.
+ *
+ *  The caller should set the SSL session up as a client (SSL_set_connect_state()), or as a server
+ *  (SSL_set_accept_state()).  The bio takes its own reference to the SSL session, so the caller can free
+ *  its reference at any time.
+ *
+ *  The SSL session MUST NOT have any BIOs associated with it.
+ *
+ *  @param ctx		the talloc ctx
+ *  @param ssl		the TLS session.
+ *  @param next		the next bio, which is normally an FD bio for a stream socket.
+ *  @return
+ *	- NULL on error
+ *	- the TLS bio on success.
+ */
+fr_bio_t *fr_bio_tls_alloc(TALLOC_CTX *ctx, SSL *ssl, fr_bio_t *next)
+{
+	fr_bio_tls_t	*my;
+	BIO		*internal;
+
+	fr_assert(SSL_get_rbio(ssl) == NULL);
+
+	my = talloc_zero(ctx, fr_bio_tls_t);
+	if (!my) return NULL;
+
+	/*
+	 *	A zero size means "use the OpenSSL default", which is enough for one maximum sized record.
+	 */
+	if (BIO_new_bio_pair(&internal, 0, &my->network, 0) != 1) {
+		fr_bio_tls_strerror("Failed allocating TLS BIO pair");
+		talloc_free(my);
+		return NULL;
+	}
+
+	SSL_up_ref(ssl);
+	my->ssl = ssl;
+
+	SSL_set_bio(ssl, internal, internal);
+	SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	my->info.state = FR_BIO_TLS_STATE_HANDSHAKE;
+	my->info.ssl = ssl;
+
+	my->bio.read = fr_bio_tls_read;
+	my->bio.write = fr_bio_tls_write;
+	my->priv_cb.eof = fr_bio_tls_eof;
+
+	fr_bio_chain(&my->bio, next);
+
+	talloc_set_destructor(my, fr_bio_tls_destructor);
+	return (fr_bio_t *) my;
+}
@@ -0,0 +1,59 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/bio/tls.h
+ * @brief BIO TLS handlers.
+ *
+ * @copyright 2024 Network RADIUS SAS (legal@networkradius.com)
+ */
+RCSIDH(lib_bio_tls_h, "$Id$")
+
+#include <freeradius-devel/bio/base.h>
+
+#include <openssl/ssl.h>
+
+typedef enum {
+	FR_BIO_TLS_STATE_HANDSHAKE = 0,		//!< still doing the TLS handshake
+	FR_BIO_TLS_STATE_OPEN,			//!< application data can be exchanged
+	FR_BIO_TLS_STATE_CLOSED,		//!< the other end sent close_notify, or there was an error
+} fr_bio_tls_state_t;
+
+/** Run-time status of the TLS session.
+ *
+ */
+typedef struct {
+	fr_bio_tls_state_t	state;		//!< handshake, open, closed.
+
+	SSL const		*ssl;		//!< so the caller can see the cipher, peer certificate, etc.
+
+	bool			resumed;	//!< the session was resumed, and not negotiated from scratch.
+
+	bool			ktls_send;	//!< the kernel encrypts the data we send.
+	bool			ktls_recv;	//!< the kernel decrypts the data we receive.
+} fr_bio_tls_info_t;
+
+fr_bio_t	*fr_bio_tls_alloc(TALLOC_CTX *ctx, SSL *ssl, fr_bio_t *next) CC_HINT(nonnull);
+
+int		fr_bio_tls_handshake(fr_bio_t *bio) CC_HINT(nonnull);
+
+size_t		fr_bio_tls_write_pending(fr_bio_t *bio) CC_HINT(nonnull);
+
+int		fr_bio_tls_ktls(fr_bio_t *bio) CC_HINT(nonnull);
+
+fr_bio_tls_info_t const *fr_bio_tls_info(fr_bio_t *bio) CC_HINT(nonnull);
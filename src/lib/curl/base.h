@@ -93,6 +93,8 @@ typedef struct {
 	fr_event_timer_t const	*ev;			//!< Multi-Handle timer.
 	uint64_t		transfers;		//!< How many transfers are current in progress.
 	CURLM			*mandle;		//!< The multi handle.
+	unsigned int		refs;			//!< How many users share the handle.
+							///< Only used by fr_curl_io_shared_init().
 } fr_curl_handle_t;
 
 /** Structure representing an individual request being passed to curl for processing
@@ -138,6 +140,10 @@ fr_curl_io_request_t	*fr_curl_io_request_alloc(TALLOC_CTX *ctx);
 
 fr_curl_handle_t	*fr_curl_io_init(TALLOC_CTX *ctx, fr_event_list_t *el, bool multiplex);
 
+fr_curl_handle_t	*fr_curl_io_shared_init(fr_event_list_t *el, bool multiplex);
+
+void			fr_curl_io_shared_release(fr_curl_handle_t *mhandle) CC_HINT(nonnull);
+
 int			fr_curl_response_certinfo(request_t *request, fr_curl_io_request_t *randle);
 
 int			fr_curl_easy_tls_init (fr_curl_io_request_t *randle, fr_curl_tls_t const *conf);
@@ -628,3 +628,70 @@ error:
 
 	return NULL;
 }
+
+/** Multi-handles shared by everything running in this thread
+ *
+ * Indexed by whether the handle multiplexes requests.
+ */
+static _Thread_local fr_curl_handle_t *curl_shared_mhandle[2];
+
+/** Get the multi-handle shared by all users of curl in this thread
+ *
+ * libcurl keeps its connection cache, and its DNS cache, in the
+ * multi-handle.  Creating a multi-handle per module instance means each
+ * instance opens its own connections to the same servers, and performs
+ * its own TLS handshakes.  Sharing one multi-handle per thread means
+ * idle connections are reused by any instance talking to the same
+ * origin, and with HTTP/2, requests from all the instances are
+ * multiplexed over the same connection.
+ *
+ * libcurl only reuses a connection if the easy handle's TLS settings
+ * match the ones the connection was established with, so instances
+ * with different TLS configurations can still share a multi-handle.
+ *
+ * Must be released with fr_curl_io_shared_release().
+ *
+ * @param[in] el		servicing this thread.  Must be the same for all callers.
+ * @param[in] multiplex		Run multiple requests over the same connection simultaneously.
+ *				HTTP/2 only.  Users which disable multiplexing get a separate
+ *				multi-handle.
+ * @return
+ *	- The shared multi-handle on success.
+ *	- NULL on error.
+ */
+fr_curl_handle_t *fr_curl_io_shared_init(fr_event_list_t *el, bool multiplex)
+{
+	fr_curl_handle_t	**slot = &curl_shared_mhandle[multiplex];
+
+	if (*slot) {
+		fr_assert((*slot)->el == el);
+		(*slot)->refs++;
+		return *slot;
+	}
+
+	*slot = fr_curl_io_init(NULL, el, multiplex);
+	if (!*slot) return NULL;
+	(*slot)->refs = 1;
+
+	return *slot;
+}
+
+/** Release a reference to a shared multi-handle
+ *
+ * The multi-handle, and all the connections it holds open, are freed
+ * when the last user releases it.
+ *
+ * @param[in] mhandle	returned by fr_curl_io_shared_init().
+ */
+void fr_curl_io_shared_release(fr_curl_handle_t *mhandle)
+{
+	size_t i;
+
+	fr_assert(mhandle->refs > 0);
+	if (--mhandle->refs > 0) return;
+
+	for (i = 0; i < NUM_ELEMENTS(curl_shared_mhandle); i++) {
+		if (curl_shared_mhandle[i] == mhandle) curl_shared_mhandle[i] = NULL;
+	}
+	talloc_free(mhandle);
+}
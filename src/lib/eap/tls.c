@@ -1020,13 +1020,14 @@ unlang_action_t eap_tls_process(request_t *request, eap_session_t *eap_session)
 		}
 
 		/*
-		 *	Update the dirty_in buffer (data for reading by OpenSSL)
+		 *	Write the fragment straight into OpenSSL's input BIO.
 		 *
-		 *	This buffer will contain partial data when M bit is set, and should
-		 * 	should only be reinitialized when M bit is not set.
+		 *	The BIO accumulates partial data when the M bit is set,
+		 *	and OpenSSL consumes it once the record is complete, so
+		 *	we avoid copying every fragment twice.
 		 */
-		if ((tls_session->record_from_buff)(&tls_session->dirty_in, data, data_len) != data_len) {
-			REDEBUG("Exceeded maximum record size");
+		if (fr_tls_session_dirty_in_write(tls_session, data, data_len) < 0) {
+			RPEDEBUG("Exceeded maximum record size");
 			eap_tls_session->state = EAP_TLS_FAIL;
 			goto done;
 		}
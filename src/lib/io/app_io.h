@@ -63,11 +63,13 @@ typedef struct {
 
 	fr_io_track_create_t		track_create;  	//!< create a tracking structure
 	fr_io_track_cmp_t		track_compare;	//!< compare two tracking structures
+	fr_io_track_hash_t		track_hash;	//!< hash a tracking structure (optional)
 
 	fr_io_connection_set_t		connection_set;	//!< set src/dst IP/port of a connection
 	fr_io_network_get_t		network_get;	//!< get dynamic network information
 	fr_io_client_find_t		client_find;	//!< find radclient
 	fr_io_name_t			get_name;	//!< get the socket name
+	fr_io_stats_print_t		stats_print;	//!< print transport specific statistics (optional)
 
 	void				*private;	//!< any private APIs it needs to export.
 } fr_app_io_t;
@@ -56,6 +56,21 @@ typedef int (*fr_app_open_t)(void *instance, fr_schedule_t *sc, CONF_SECTION *cs
  */
 typedef int (*fr_app_priority_get_t)(void const *instance, uint8_t const *buffer, size_t buflen);
 
+/** Get the worker affinity of a packet
+ *
+ * Packets with the same affinity are sent to the same worker, so long
+ * as that worker is able to accept them.  This keeps multi-round
+ * sessions on one worker.
+ *
+ * @param[in] instance	of the #fr_app_t.
+ * @param[in] buffer	raw packet
+ * @param[in] buflen	length of the packet
+ * @return
+ *	0  - the packet has no affinity, and can go to any worker.
+ *	*  - the affinity of this packet
+ */
+typedef uint32_t (*fr_app_affinity_get_t)(void const *instance, uint8_t const *buffer, size_t buflen);
+
 /** Called by the network thread to pass an event list for the module to use for timer events
  */
 typedef void (*fr_app_event_list_set_t)(fr_listen_t *li, fr_event_list_t *el, void *nr);
@@ -88,6 +103,9 @@ typedef struct {
 							///< to all #fr_app_io_t can be performed by the #fr_app_t.
 
 	fr_app_priority_get_t		priority;	//!< Assign a priority to the packet.
+
+	fr_app_affinity_get_t		affinity;	//!< Pick which worker should process the packet.
+							///< May be NULL.
 } fr_app_t;
 
 /** Public structure describing an application (protocol) specialisation
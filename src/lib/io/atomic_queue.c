@@ -20,6 +20,12 @@
  * @brief Thread-safe queues.
  * @file io/atomic_queue.c
  *
+ * A bounded queue, safe for any number of producers and consumers.
+ * Each entry carries a sequence number, which tells producers and
+ * consumers whether it is free or full for the current lap of the
+ * ring.  Producers claim entries by moving the head with a CAS, and
+ * consumers by moving the tail.
+ *
  * @copyright 2016 Alan DeKok (aland@freeradius.org)
  * @copyright 2016 Alister Winfield
  */
@@ -262,11 +268,179 @@ bool fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data)
 	return true;
 }
 
+/** Push multiple pointers into the atomic queue
+ *
+ * Claims a run of consecutive free entries with a single CAS on the
+ * head, instead of one per entry.  The entries are written in order,
+ * so consumers pop them in the order they were passed in.
+ *
+ * Any number of producers and consumers may use the queue concurrently,
+ * and may mix single and batched operations.
+ *
+ * An entry which is seen to be free stays free until a producer claims
+ * it, which requires moving the head past it.  Counting the free entries
+ * and then moving the head with a CAS is therefore safe.
+ *
+ * @param[in] aq	The atomic queue to add data to.
+ * @param[in] data	Array of pointers to push.  None may be NULL.
+ * @param[in] num	The number of pointers in data.
+ * @return the number of pointers pushed, which may be fewer than num
+ *	if the queue became full.  Only the first N entries of data are pushed.
+ */
+size_t fr_atomic_queue_push_n(fr_atomic_queue_t *aq, void * const *data, size_t num)
+{
+	int64_t			head;
+	size_t			i, claimed;
+
+	if (num == 0) return 0;
+	if (num > aq->size) num = aq->size;
+
+	head = load(aq->head);
+
+	for (;;) {
+		int64_t seq, diff;
+
+		/*
+		 *	Count how many entries from head are free.
+		 */
+		for (claimed = 0; claimed < num; claimed++) {
+			seq = aquire(aq->entry[(head + claimed) % aq->size].seq);
+			if (seq != (int64_t) (head + claimed)) break;
+		}
+
+		/*
+		 *	seq is still that of the entry at head.
+		 */
+		if (claimed == 0) {
+			diff = seq - head;
+
+			/*
+			 *	head is larger than the current entry, the queue is full.
+			 */
+			if (diff < 0) return 0;
+
+			/*
+			 *	Someone else has already written to this entry.
+			 */
+			head = load(aq->head);
+			continue;
+		}
+
+		/*
+		 *	Claim all of the free entries at once.  If the
+		 *	CAS fails, head is updated to the current value.
+		 */
+		if (atomic_compare_exchange_strong_explicit(&aq->head, &head, head + claimed,
+							    memory_order_release, memory_order_relaxed)) break;
+	}
+
+	for (i = 0; i < claimed; i++) {
+		fr_atomic_queue_entry_t *entry = &aq->entry[(head + i) % aq->size];
+
+		entry->data = data[i];
+		store(entry->seq, head + i + 1);
+	}
+
+	return claimed;
+}
+
+/** Pop multiple pointers from the atomic queue
+ *
+ * Claims a run of consecutive full entries with a single CAS on the
+ * tail, instead of one per entry.
+ *
+ * An entry which is seen to be full stays full until a consumer claims
+ * it, which requires moving the tail past it.
+ *
+ * @param[in] aq	the atomic queue to retrieve data from.
+ * @param[out] data	where to write the pointers.
+ * @param[in] num	the maximum number of pointers to pop.
+ * @return the number of pointers popped.  0 if the queue was empty.
+ */
+size_t fr_atomic_queue_pop_n(fr_atomic_queue_t *aq, void **data, size_t num)
+{
+	int64_t			tail;
+	size_t			i, claimed;
+
+	if (num == 0) return 0;
+	if (num > aq->size) num = aq->size;
+
+	tail = load(aq->tail);
+
+	for (;;) {
+		int64_t seq, diff;
+
+		/*
+		 *	Count how many entries from tail have been written.
+		 */
+		for (claimed = 0; claimed < num; claimed++) {
+			seq = aquire(aq->entry[(tail + claimed) % aq->size].seq);
+			if (seq != (int64_t) (tail + claimed + 1)) break;
+		}
+
+		if (claimed == 0) {
+			diff = seq - (tail + 1);
+
+			/*
+			 *	The entry hasn't been written, the queue is empty.
+			 */
+			if (diff < 0) return 0;
+
+			tail = load(aq->tail);
+			continue;
+		}
+
+		if (atomic_compare_exchange_strong_explicit(&aq->tail, &tail, tail + claimed,
+							    memory_order_release, memory_order_relaxed)) break;
+	}
+
+	/*
+	 *	Copy each pointer to the caller BEFORE releasing
+	 *	its entry.
+	 */
+	for (i = 0; i < claimed; i++) {
+		fr_atomic_queue_entry_t *entry = &aq->entry[(tail + i) % aq->size];
+
+		data[i] = entry->data;
+		store(entry->seq, tail + i + aq->size);
+	}
+
+	return claimed;
+}
+
 size_t fr_atomic_queue_size(fr_atomic_queue_t *aq)
 {
 	return aq->size;
 }
 
+/** Return the number of entries in the queue
+ *
+ * The result is only a snapshot, as other threads can push or pop
+ * entries at any time.  However, a producer which sees a length
+ * larger than one after its own push knows that the consumer has not
+ * yet popped an earlier entry, and will therefore also see this one.
+ *
+ * @param[in] aq	the atomic queue to check.
+ * @return the number of entries which have been pushed but not popped.
+ */
+size_t fr_atomic_queue_length(fr_atomic_queue_t *aq)
+{
+	int64_t head, tail;
+
+	/*
+	 *	Make our own pushes visible before we look at the
+	 *	consumer's position.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	tail = load(aq->tail);
+	head = load(aq->head);
+
+	if (head <= tail) return 0;
+
+	return head - tail;
+}
+
 #ifdef WITH_VERIFY_PTR
 /** Check the talloc chunk is still valid
  *
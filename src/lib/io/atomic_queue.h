@@ -57,7 +57,10 @@ fr_atomic_queue_t	*fr_atomic_queue_alloc(TALLOC_CTX *ctx, size_t size);
 void			fr_atomic_queue_free(fr_atomic_queue_t **aq);
 bool			fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data);
 bool			fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data);
+size_t			fr_atomic_queue_push_n(fr_atomic_queue_t *aq, void * const *data, size_t num) CC_HINT(nonnull);
+size_t			fr_atomic_queue_pop_n(fr_atomic_queue_t *aq, void **data, size_t num) CC_HINT(nonnull);
 size_t			fr_atomic_queue_size(fr_atomic_queue_t *aq);
+size_t			fr_atomic_queue_length(fr_atomic_queue_t *aq);
 
 #ifdef WITH_VERIFY_PTR
 void			fr_atomic_queue_verify(fr_atomic_queue_t *aq);
@@ -301,6 +301,19 @@ typedef void *(*fr_io_track_create_t)(void const *instance, void *thread_instanc
  */
 typedef int (*fr_io_track_cmp_t)(void const *instance, void *thread_instance, fr_client_t *client, void const *one, void const *two);
 
+/** Hash a tracking structure for storing in a flat duplicate detection table
+ *
+ * Tracking structures which compare as equal via fr_io_track_cmp_t
+ * MUST have the same hash.
+ *
+ * @param[in] instance		the context for this function
+ * @param[in] thread_instance	the thread instance for this function
+ * @param[in] client		the client associated with this packet
+ * @param[in] packet		packet tracking structure
+ * @return the hash of the tracking structure.
+ */
+typedef uint32_t (*fr_io_track_hash_t)(void const *instance, void *thread_instance, fr_client_t *client, void const *packet);
+
 /**  Handle an error on the socket.
  *
  *  In general, the only thing to do on errors is to close the
@@ -355,6 +368,16 @@ typedef void (*fr_io_network_get_t)(int *ipproto, bool *dynamic_clients, fr_trie
 
 typedef char const *(*fr_io_name_t)(fr_listen_t *li);
 
+/** Print transport specific statistics for a socket
+ *
+ *  Used by the "stats network socket" command.  Each line should be
+ *  a "name\tvalue" pair.
+ *
+ * @param[in] li	the listener for this socket.
+ * @param[in] fp	where the statistics are printed.
+ */
+typedef void (*fr_io_stats_print_t)(fr_listen_t *li, FILE *fp);
+
 
 #ifdef __cplusplus
 }
@@ -44,11 +44,6 @@ RCSID("$Id$")
 #define MPRINT(...)
 #endif
 
-/*
- *	We disable this until we fix all of the signaling issues...
- */
-#define ENABLE_SKIPS (0)
-
 typedef enum {
 	TO_RESPONDER = 0,
 	TO_REQUESTOR = 1
@@ -62,10 +57,6 @@ static fr_table_num_sorted_t const channel_direction[] = {
 size_t channel_direction_len = NUM_ELEMENTS(channel_direction);
 #endif
 
-#if 0
-#define SIGNAL_INTERVAL (1000000)	//!< The minimum interval between responder signals.
-#endif
-
 /** Size of the atomic queues
  *
  * The queue reader MUST service the queue occasionally,
@@ -125,12 +116,14 @@ typedef struct {
 	uint64_t		ack;		//!< Sequence number of the other end.
 	uint64_t		their_view_of_my_sequence;	//!< Should be clear.
 
-	uint64_t		sequence_at_last_signal;	//!< When we last signaled.
-
 	fr_atomic_queue_t	*aq;		//!< The queue of messages - visible only to this channel.
 
 	atomic_bool		active;		//!< Whether the channel is active.
 
+	unsigned int		num_held;	//!< Requests from this channel which another responder
+						//!< is running.  Responder end only.
+	bool			close_pending;	//!< The close was acknowledged while requests were held.
+
 	fr_channel_stats_t	stats;		//!< channel statistics
 } fr_channel_end_t;
 
@@ -288,6 +281,31 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
 	return fr_control_message_send(end->control, end->rb, FR_CONTROL_ID_CHANNEL, &cc, sizeof(cc));
 }
 
+/** Whether we can skip signalling the other end after pushing messages
+ *
+ * If the queue holds other messages which the other end hasn't read,
+ * then it has either been signalled, or it is busy reading the queue.
+ * The readers always drain the queue until it is empty, so they will
+ * see these messages, too.
+ *
+ * The exception is when the other end has told us it needs a signal.
+ *
+ * @param[in] end	of the channel that the messages were written to.
+ * @param[in] pushed	how many messages we've just written.
+ * @return
+ *	- true if the signal can be skipped.
+ *	- false if we need to signal the other end.
+ */
+static inline bool fr_channel_skip_signal(fr_channel_end_t *end, size_t pushed)
+{
+	if (end->must_signal) return false;
+
+	if (fr_atomic_queue_length(end->aq) <= pushed) return false;
+
+	end->stats.skips++;
+	return true;
+}
+
 #define IALPHA (8)
 #define RTT(_old, _new) fr_time_delta_wrap((fr_time_delta_unwrap(_new) + (fr_time_delta_unwrap(_old) * (IALPHA - 1))) / IALPHA)
 
@@ -304,98 +322,107 @@ static int fr_channel_data_ready(fr_channel_t *ch, fr_time_t when, fr_channel_en
  *	- 0 on success
  */
 int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
+{
+	if (fr_channel_send_request_n(ch, &cd, 1) != 1) return -1;
+
+	return 0;
+}
+
+/** Send multiple request messages into the channel
+ *
+ * The messages are pushed to the queue together, and the other
+ * end is signalled at most once.
+ *
+ * The messages should be initialized, other than "sequence" and "ack".
+ * They must be in the order they were received.
+ *
+ * This function automatically calls the recv_reply callback if there is a reply.
+ *
+ * @param[in] ch	the channel to send the requests on.
+ * @param[in] cd	array of messages to send.
+ * @param[in] num	the number of messages.
+ * @return the number of messages sent.  If this is fewer than num,
+ *	the queue was full, and the remaining messages were not sent.
+ */
+size_t fr_channel_send_request_n(fr_channel_t *ch, fr_channel_data_t **cd, size_t num)
 {
 	uint64_t sequence;
 	fr_time_t when;
 	fr_time_delta_t message_interval;
 	fr_channel_end_t *requestor;
+	size_t i, pushed;
 
-	if (!fr_cond_assert_msg(atomic_load(&ch->end[TO_RESPONDER].active), "Channel not active")) return -1;
+	if (!fr_cond_assert_msg(atomic_load(&ch->end[TO_RESPONDER].active), "Channel not active")) return 0;
 
 	/*
 	 *	Same thread?  Just call the "recv" function directly.
 	 */
 	if (ch->same_thread) {
-		ch->end[TO_REQUESTOR].recv(ch->end[TO_REQUESTOR].recv_uctx, ch, cd);
-		return 0;
+		for (i = 0; i < num; i++) ch->end[TO_REQUESTOR].recv(ch->end[TO_REQUESTOR].recv_uctx, ch, cd[i]);
+		return num;
 	}
 
 	requestor = &(ch->end[TO_RESPONDER]);
-	when = cd->m.when;
+	sequence = requestor->sequence;
 
-	sequence = requestor->sequence + 1;
-	cd->live.sequence = sequence;
-	cd->live.ack = requestor->ack;
+	for (i = 0; i < num; i++) {
+		cd[i]->live.sequence = ++sequence;
+		cd[i]->live.ack = requestor->ack;
+	}
 
 	/*
-	 *	Push the message onto the queue for the other end.  If
+	 *	Push the messages onto the queue for the other end.  If
 	 *	the push fails, the caller should try another queue.
 	 */
-	if (!fr_atomic_queue_push(requestor->aq, cd)) {
+	pushed = fr_atomic_queue_push_n(requestor->aq, (void * const *) cd, num);
+	if (pushed < num) {
 		fr_strerror_printf("Failed pushing to atomic queue - full.  Queue contains %zu items",
 				   fr_atomic_queue_size(requestor->aq));
 		while (fr_channel_recv_reply(ch));
-		return -1;
+		if (!pushed) return 0;
 	}
 
-	requestor->sequence = sequence;
-	message_interval = fr_time_sub(when, requestor->stats.last_write);
+	for (i = 0; i < pushed; i++) {
+		when = cd[i]->m.when;
+		message_interval = fr_time_sub(when, requestor->stats.last_write);
 
-	if (fr_time_delta_ispos(requestor->stats.message_interval)) {
-		requestor->stats.message_interval = message_interval;
-	} else {
-		requestor->stats.message_interval = RTT(requestor->stats.message_interval, message_interval);
-	}
+		if (fr_time_delta_ispos(requestor->stats.message_interval)) {
+			requestor->stats.message_interval = message_interval;
+		} else {
+			requestor->stats.message_interval = RTT(requestor->stats.message_interval, message_interval);
+		}
 
-	fr_assert_msg(fr_time_lteq(requestor->stats.last_write, when),
-		      "Channel data timestamp (%" PRId64") older than last channel data sent (%" PRId64 ")",
-		      fr_time_unwrap(when), fr_time_unwrap(requestor->stats.last_write));
-	requestor->stats.last_write = when;
+		fr_assert_msg(fr_time_lteq(requestor->stats.last_write, when),
+			      "Channel data timestamp (%" PRId64") older than last channel data sent (%" PRId64 ")",
+			      fr_time_unwrap(when), fr_time_unwrap(requestor->stats.last_write));
+		requestor->stats.last_write = when;
+	}
 
-	requestor->stats.outstanding++;
-	requestor->stats.packets++;
+	requestor->sequence += pushed;
+	requestor->stats.outstanding += pushed;
+	requestor->stats.packets += pushed;
 
 	MPRINT("REQUESTOR requests %"PRIu64", num_outstanding %"PRIu64"\n", requestor->stats.packets, requestor->stats.outstanding);
 
-#if ENABLE_SKIPS
 	/*
-	 *	We just sent the first packet.  There can't possibly be a reply, so don't bother looking.
+	 *	The responder will see these packets without us having
+	 *	to wake it up.
 	 */
-	if (requestor->stats.outstanding == 1) {
-
-		/*
-		 *	There is at least one old packet which is
-		 *	outstanding, look for a reply.
-		 */
-	} else if (requestor->stats.outstanding > 1) {
-		bool has_reply;
-
-		has_reply = fr_channel_recv_reply(ch);
-
-		if (has_reply) while (fr_channel_recv_reply(ch));
-
-		/*
-		 *	There's no reply yet, so we still have packets outstanding.
-		 *	Or, there is a reply, and there are more packets outstanding.
-		 *	Skip the signal.
-		 */
-		if (!requestor->must_signal && (!has_reply || (has_reply && (requestor->stats.outstanding > 1)))) {
-			MPRINT("REQUESTOR SKIPS signal\n");
-			return 0;
-		}
+	if (fr_channel_skip_signal(requestor, pushed)) {
+		MPRINT("REQUESTOR SKIPS signal\n");
+		return pushed;
 	}
-#endif
 
 	/*
 	 *	Tell the other end that there is new data ready.
 	 *
 	 *	Ignore errors on signalling.  The responder already has
-	 *	the packet in its inbound queue, so at some point, it
-	 *	will pick up the message.
+	 *	the packets in its inbound queue, so at some point, it
+	 *	will pick up the messages.
 	 */
 	MPRINT("REQUESTOR SIGNALS\n");
-	(void) fr_channel_data_ready(ch, when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER);
-	return 0;
+	(void) fr_channel_data_ready(ch, cd[pushed - 1]->m.when, requestor, FR_CHANNEL_SIGNAL_DATA_TO_RESPONDER);
+	return pushed;
 }
 
 /** Receive a reply message from the channel
@@ -563,48 +590,22 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 	while (fr_channel_recv_request(ch));
 
 	/*
-	 *	No packets outstanding, we HAVE to signal the requestor
-	 *	thread.
+	 *	The requestor hasn't yet read the previous replies, so
+	 *	it will read this one, too.
 	 */
-	if (responder->stats.outstanding == 0) {
-		(void) fr_channel_data_ready(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER);
+	if (fr_channel_skip_signal(responder, 1)) {
+		MPRINT("\tRESPONDER SKIPS signal\n");
 		return 0;
 	}
 
-	MPRINT("\twhen - last_read_other = %"PRIu64" - %"PRIu64" = %"PRIu64"\n", when, responder->stats.last_read_other, when - responder->stats.last_read_other);
-	MPRINT("\twhen - last signal = %"PRIu64" - %"PRIu64" = %"PRIu64"\n", when, responder->stats.last_sent_signal, when - responder->stats.last_sent_signal);
-	MPRINT("\tsequence - ack = %"PRIu64" - %"PRIu64" = %"PRIu64"\n", responder->sequence, responder->their_view_of_my_sequence, responder->sequence - responder->their_view_of_my_sequence);
-
-#ifdef __APPLE__
-	/*
-	 *	If we've sent them a signal since the last ACK, they
-	 *	will receive it, and process the packets.  So we don't
-	 *	need to signal them again.
-	 *
-	 *	But... this doesn't appear to work on the Linux
-	 *	libkqueue implementation.
-	 */
-	if (responder->sequence_at_last_signal > responder->their_view_of_my_sequence) return 0;
-#endif
-
 	/*
-	 *	If we've received a new packet in the last while, OR
-	 *	we've sent a signal in the last while, then we don't
-	 *	need to send a new signal.  But we DO send a signal if
-	 *	we haven't seen an ACK for a few packets.
-	 *
-	 *	FIXME: make these limits configurable, or include
-	 *	predictions about packet processing time?
+	 *	No packets outstanding, we HAVE to signal the requestor
+	 *	thread.
 	 */
-	fr_assert(responder->their_view_of_my_sequence <= responder->sequence);
-#if 0
-	if (((responder->sequence - their_view_of_my_sequence) <= 1000) &&
-	    ((when - responder->stats.last_read_other < SIGNAL_INTERVAL) ||
-	     ((when - responder->stats.last_sent_signal) < SIGNAL_INTERVAL))) {
-		MPRINT("\tRESPONDER SKIPS signal\n");
+	if (responder->stats.outstanding == 0) {
+		(void) fr_channel_data_ready(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER);
 		return 0;
 	}
-#endif
 
 	MPRINT("\tRESPONDER SIGNALS num_outstanding %"PRIu64"\n", responder->stats.outstanding);
 	(void) fr_channel_data_ready(ch, when, responder, FR_CHANNEL_SIGNAL_DATA_TO_REQUESTOR);
@@ -685,9 +686,7 @@ int fr_channel_responder_sleeping(fr_channel_t *ch)
 fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_channel, void const *data, size_t data_size)
 {
 	int rcode;
-#if ENABLE_SKIPS
 	uint64_t ack;
-#endif
 	fr_channel_control_t cc;
 	fr_channel_signal_t cs;
 	fr_channel_event_t ce = FR_CHANNEL_ERROR;
@@ -698,9 +697,7 @@ fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_c
 	memcpy(&cc, data, data_size);
 
 	cs = cc.signal;
-#if ENABLE_SKIPS
 	ack = cc.ack;
-#endif
 	*p_channel = ch = cc.ch;
 
 	switch (cs) {
@@ -725,26 +722,25 @@ fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_c
 	case FR_CHANNEL_SIGNAL_DATA_DONE_RESPONDER:
 		MPRINT("channel got data_done_responder\n");
 		ce = FR_CHANNEL_DATA_READY_REQUESTOR;
-		ch->end[TO_RESPONDER].must_signal = true;
 		break;
 
 	case FR_CHANNEL_SIGNAL_RESPONDER_SLEEPING:
 		MPRINT("channel got responder_sleeping\n");
 		ce = FR_CHANNEL_NOOP;
-		ch->end[TO_RESPONDER].must_signal = true;
 		break;
 	}
 
 	/*
 	 *	Compare their ACK to the last sequence we
-	 *	sent.  If it's different, we signal the responder
-	 *	to wake up.
+	 *	sent.  If it's the same, the responder has seen all
+	 *	of our packets, and is going to sleep.  The next
+	 *	packet we send has to wake it up.
 	 */
 	requestor = &ch->end[TO_RESPONDER];
-#if ENABLE_SKIPS
-	if (!requestor->must_signal && (ack == requestor->sequence)) {
+	if (ack == requestor->sequence) {
 		MPRINT("REQUESTOR SKIPS signal AFTER CE %d num_outstanding %"PRIu64"\n", cs, requestor->stats.outstanding);
 		MPRINT("REQUESTOR has ack %"PRIu64", my seq %"PRIu64" my_view %"PRIu64"\n", ack, requestor->sequence, requestor->their_view_of_my_sequence);
+		requestor->must_signal = true;
 		return ce;
 	}
 
@@ -753,7 +749,6 @@ fr_channel_event_t fr_channel_service_message(fr_time_t when, fr_channel_t **p_c
 	 *	packets available, so we signal it to wake up again.
 	 */
 	fr_assert(ack <= requestor->sequence);
-#endif
 
 	/*
 	 *	We're signaling it again...
@@ -845,6 +840,9 @@ int fr_channel_signal_responder_close(fr_channel_t *ch)
 }
 
 /** Acknowledge that the channel is closing
+ *
+ * If requests from the channel are still held by another responder,
+ * the acknowledgement is sent when the last one is released.
  *
  * @param[in] ch	The channel.
  * @return
@@ -863,6 +861,11 @@ int fr_channel_responder_ack_close(fr_channel_t *ch)
 
 	(void) talloc_get_type_abort(ch, fr_channel_t);
 
+	if (ch->end[TO_REQUESTOR].num_held > 0) {
+		ch->end[TO_REQUESTOR].close_pending = true;
+		return 0;
+	}
+
 	atomic_store(&ch->end[TO_REQUESTOR].active, false);	/* Prevent further responses */
 
 	cc.signal = FR_CHANNEL_SIGNAL_CLOSE;
@@ -877,6 +880,50 @@ int fr_channel_responder_ack_close(fr_channel_t *ch)
 	return ret;
 }
 
+/** Note that another responder is running a request from this channel
+ *
+ * The requestor frees the channel once the close has been acknowledged,
+ * so the acknowledgement is delayed until every held request has been
+ * released.
+ *
+ * The caller must serialise this with all other use of the responder
+ * end of the channel.
+ *
+ * @param[in] ch	The channel.
+ */
+void fr_channel_responder_hold(fr_channel_t *ch)
+{
+	(void) talloc_get_type_abort(ch, fr_channel_t);
+
+	ch->end[TO_REQUESTOR].num_held++;
+}
+
+/** Release a request held with fr_channel_responder_hold()
+ *
+ * If the responder has already acknowledged the close, and this was the
+ * last held request, the acknowledgement is sent now.  The channel may
+ * then be freed at any time, and must not be used again.
+ *
+ * @param[in] ch	The channel.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_channel_responder_release(fr_channel_t *ch)
+{
+	(void) talloc_get_type_abort(ch, fr_channel_t);
+
+	fr_assert(ch->end[TO_REQUESTOR].num_held > 0);
+
+	if (--ch->end[TO_REQUESTOR].num_held > 0) return 0;
+
+	if (!ch->end[TO_REQUESTOR].close_pending) return 0;
+
+	ch->end[TO_REQUESTOR].close_pending = false;
+
+	return fr_channel_responder_ack_close(ch);
+}
+
 /** Add responder-specific data to a channel
  *
  * @param[in] ch	The channel.
@@ -965,6 +1012,7 @@ void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char cons
 	fr_log(log, L_INFO, file, line, "requestor\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.signals);
 	fr_log(log, L_INFO, file, line, "\tsignals re-sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.resignals);
+	fr_log(log, L_INFO, file, line, "\tsignals skipped = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.skips);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\toutstanding = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.outstanding);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.packets);
@@ -975,6 +1023,7 @@ void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char cons
 
 	fr_log(log, L_INFO, file, line, "responder\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64"\n", ch->end[TO_REQUESTOR].stats.signals);
+	fr_log(log, L_INFO, file, line, "\tsignals skipped = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.skips);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_REQUESTOR].stats.packets);
 	fr_log(log, L_INFO, file, line, "\tmessage interval (RTT) = %" PRIu64 "\n", fr_time_delta_unwrap(ch->end[TO_REQUESTOR].stats.message_interval));
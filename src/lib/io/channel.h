@@ -82,6 +82,7 @@ typedef struct {
 	uint64_t       		outstanding; 	//!< Number of outstanding requests with no reply.
 	uint64_t		signals;	//!< Number of kevent signals we've sent.
 	uint64_t		resignals;	//!< Number of signals resent.
+	uint64_t		skips;		//!< Number of signals we didn't need to send.
 
 	uint64_t		packets;	//!< Number of actual data packets.
 
@@ -134,6 +135,8 @@ typedef struct {
 			fr_time_delta_t		cpu_time;		//!< Total CPU time, including predicted work, (only worker -> network).
 			fr_time_delta_t		processing_time; 	//!< Actual processing time for this packet (only worker -> network).
 			fr_time_t		request_time;		//!< Timestamp of the request packet.
+			fr_time_delta_t		queue_time;		//!< How long the request waited before the worker
+									///< started it (only worker -> network).
 	        } reply;
 	};
 
@@ -159,6 +162,7 @@ extern size_t channel_packet_priority_len;
 fr_channel_t *fr_channel_create(TALLOC_CTX *ctx, fr_control_t *frontend, fr_control_t *worker, bool same) CC_HINT(nonnull);
 
 int	fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cm) CC_HINT(nonnull);
+size_t	fr_channel_send_request_n(fr_channel_t *ch, fr_channel_data_t **cd, size_t num) CC_HINT(nonnull);
 bool	fr_channel_recv_request(fr_channel_t *ch) CC_HINT(nonnull);
 
 int	fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd) CC_HINT(nonnull);
@@ -182,6 +186,9 @@ int	fr_channel_signal_open(fr_channel_t *ch) CC_HINT(nonnull);
 int	fr_channel_signal_responder_close(fr_channel_t *ch) CC_HINT(nonnull);
 int	fr_channel_responder_ack_close(fr_channel_t *ch) CC_HINT(nonnull);
 
+void	fr_channel_responder_hold(fr_channel_t *ch) CC_HINT(nonnull);
+int	fr_channel_responder_release(fr_channel_t *ch) CC_HINT(nonnull);
+
 void	fr_channel_responder_uctx_add(fr_channel_t *ch, void *ctx) CC_HINT(nonnull);
 void	*fr_channel_responder_uctx_get(fr_channel_t *ch) CC_HINT(nonnull);
 void	fr_channel_requestor_uctx_add(fr_channel_t *ch, void *ctx) CC_HINT(nonnull);
@@ -0,0 +1,608 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Pass listening sockets from a running server to one which replaces it.
+ * @file io/handoff.c
+ *
+ *  The running server listens on a unix socket.  A new server
+ *  connects to it before it opens any listeners, and is sent every
+ *  bound network socket the old server has.  The new server then
+ *  re-uses those sockets in place of the ones it would otherwise
+ *  have bound, so there's no window in which packets are refused.
+ *
+ *  Once the new server is ready, it tells the old one to switch.
+ *  The old server stops reading packets, lets the requests it already
+ *  has finish, and then exits.
+ *
+ *  The protocol is a series of one byte messages:
+ *
+ *	- 'F' old -> new, carrying a batch of file descriptors.
+ *	- 'E' old -> new, no more file descriptors.
+ *	- 'S' new -> old, the new server is processing packets.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/handoff.h>
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/main_loop.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/socket.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/** Maximum number of file descriptors sent in one message
+ */
+#define HANDOFF_MAX_FDS		(64)
+
+/** The highest file descriptor we'll look at when searching for sockets
+ */
+#define HANDOFF_MAX_FD		(65536)
+
+typedef struct {
+	/*
+	 *	New server.
+	 */
+	int			server_fd;		//!< Our connection to the old server.
+
+	/*
+	 *	Old server.
+	 */
+	int			listen_fd;		//!< Where new servers connect.
+	int			client_fd;		//!< The new server.
+
+	fr_event_list_t		*el;
+	fr_schedule_t		*sc;
+	fr_event_timer_t const	*ev;			//!< Drain timer.
+	fr_time_t		deadline;		//!< When we exit whether or not requests are done.
+	fr_time_delta_t		drain_time;
+
+	bool			handed_off;		//!< The new server has taken over.
+} fr_handoff_t;
+
+static fr_handoff_t handoff = {
+	.server_fd = -1,
+	.listen_fd = -1,
+	.client_fd = -1,
+};
+
+/** Read one message, along with any file descriptors it carries
+ *
+ * @param[in] sockfd	to read from.
+ * @param[out] type	of the message.
+ * @param[out] fds	received.  May be NULL if no descriptors are expected.
+ * @param[out] num_fds	how many descriptors were received.
+ * @return
+ *	- 1 on success.
+ *	- 0 on EOF.
+ *	- -1 on error.
+ */
+static int handoff_recv(int sockfd, char *type, int *fds, size_t *num_fds)
+{
+	struct msghdr	msg = {};
+	struct iovec	iov;
+	struct cmsghdr	*cmsg;
+	ssize_t		rcode;
+	union {
+		char		buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+		struct cmsghdr	align;
+	} control;
+
+	iov.iov_base = type;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	if (num_fds) *num_fds = 0;
+
+	do {
+		rcode = recvmsg(sockfd, &msg, 0);
+	} while ((rcode < 0) && (errno == EINTR));
+
+	if (rcode < 0) {
+		fr_strerror_printf("Failed reading from hot restart socket: %s", fr_syserror(errno));
+		return -1;
+	}
+	if (rcode == 0) return 0;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		size_t i, num;
+
+		if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)) continue;
+
+		num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		/*
+		 *	We weren't expecting any, don't leak them.
+		 */
+		if (!fds) {
+			for (i = 0; i < num; i++) {
+				int fd;
+
+				memcpy(&fd, CMSG_DATA(cmsg) + (i * sizeof(int)), sizeof(fd));
+				close(fd);
+			}
+			continue;
+		}
+
+		memcpy(fds + *num_fds, CMSG_DATA(cmsg), num * sizeof(int));
+		*num_fds += num;
+	}
+
+	if (msg.msg_flags & MSG_CTRUNC) {
+		fr_strerror_const("File descriptors were truncated by the kernel");
+		return -1;
+	}
+
+	return 1;
+}
+
+/** Write one message, along with any file descriptors it carries
+ *
+ */
+static int handoff_send(int sockfd, char type, int const *fds, size_t num_fds)
+{
+	struct msghdr	msg = {};
+	struct iovec	iov;
+	ssize_t		rcode;
+	union {
+		char		buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+		struct cmsghdr	align;
+	} control;
+
+	fr_assert(num_fds <= HANDOFF_MAX_FDS);
+
+	iov.iov_base = &type;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (num_fds) {
+		struct cmsghdr *cmsg;
+
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+	}
+
+	do {
+		rcode = sendmsg(sockfd, &msg, 0);
+	} while ((rcode < 0) && (errno == EINTR));
+
+	if (rcode < 0) {
+		fr_strerror_printf("Failed writing to hot restart socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Ask a running server for its sockets
+ *
+ * Must be called before any listeners are opened.  The sockets received
+ * are used by #fr_socket_bind in place of new ones, where the address
+ * and port match.
+ *
+ * @param[in] path	of the old server's hot restart socket.
+ * @return
+ *	- 1 if the old server sent us its sockets.
+ *	- 0 if there's no old server.
+ *	- -1 on error.
+ */
+int fr_handoff_receive(char const *path)
+{
+	int		sockfd;
+	size_t		total = 0;
+	struct timeval	tv = { .tv_sec = 5 };
+
+	sockfd = fr_socket_client_unix(path, false);
+	if (sockfd < 0) {
+		DEBUG("No running server at %s, starting normally", path);
+		return 0;
+	}
+
+	/*
+	 *	An old server which has hung shouldn't stop us starting.
+	 */
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		ERROR("Failed setting timeout on hot restart socket: %s", fr_syserror(errno));
+	error:
+		close(sockfd);
+		return -1;
+	}
+
+	for (;;) {
+		int	fds[HANDOFF_MAX_FDS];
+		size_t	i, num_fds;
+		char	type;
+		int	ret;
+
+		ret = handoff_recv(sockfd, &type, fds, &num_fds);
+		if (ret < 0) {
+			PERROR("Failed receiving sockets from running server");
+			for (i = 0; i < num_fds; i++) close(fds[i]);
+			goto error;
+		}
+		if (ret == 0) {
+			ERROR("Running server closed the hot restart socket before sending all sockets");
+			goto error;
+		}
+
+		for (i = 0; i < num_fds; i++) {
+			if (fr_socket_inherit(fds[i]) < 0) {
+				PERROR("Failed saving socket from running server");
+				for (; i < num_fds; i++) close(fds[i]);
+				goto error;
+			}
+		}
+		total += num_fds;
+
+		if (type == 'E') break;
+
+		if (type != 'F') {
+			ERROR("Unexpected message '%c' on hot restart socket", type);
+			goto error;
+		}
+	}
+
+	INFO("Received %zu sockets from running server", total);
+	handoff.server_fd = sockfd;
+
+	return 1;
+}
+
+/** Tell the old server that we've taken over
+ *
+ * Any sockets received which weren't used are closed.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_handoff_complete(void)
+{
+	size_t	num;
+	int	ret = 0;
+
+	if (handoff.server_fd < 0) return 0;
+
+	if (handoff_send(handoff.server_fd, 'S', NULL, 0) < 0) {
+		PERROR("Failed telling running server to exit");
+		ret = -1;
+	}
+
+	close(handoff.server_fd);
+	handoff.server_fd = -1;
+
+	num = fr_socket_inherit_free();
+	if (num) WARN("Closed %zu sockets from the old server which are no longer used", num);
+
+	return ret;
+}
+
+/** Whether this server has handed its sockets to a new one
+ *
+ */
+bool fr_handoff_done(void)
+{
+	return handoff.handed_off;
+}
+
+/** Is this a socket we should hand to the new server
+ *
+ * Only sockets bound to a port are of interest.  Stream sockets
+ * must be listening, and datagram sockets must be unconnected,
+ * anything else is a connection the server opened itself.
+ */
+static bool handoff_fd_is_listener(int fd)
+{
+	struct sockaddr_storage	salocal;
+	socklen_t		salen = sizeof(salocal);
+	fr_ipaddr_t		ipaddr;
+	uint16_t		port;
+	int			type;
+	socklen_t		len = sizeof(type);
+
+	if (getsockname(fd, (struct sockaddr *)&salocal, &salen) < 0) return false;
+
+	if ((salocal.ss_family != AF_INET) && (salocal.ss_family != AF_INET6)) return false;
+
+	if (fr_ipaddr_from_sockaddr(&ipaddr, &port, &salocal, salen) < 0) return false;
+
+	if (!port) return false;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0) return false;
+
+	switch (type) {
+	case SOCK_STREAM:
+	{
+#ifdef SO_ACCEPTCONN
+		int listening;
+
+		len = sizeof(listening);
+		if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0) return false;
+
+		return (listening != 0);
+#else
+		return false;
+#endif
+	}
+
+	case SOCK_DGRAM:
+		salen = sizeof(salocal);
+		if (getpeername(fd, (struct sockaddr *)&salocal, &salen) == 0) return false;
+
+		return (errno == ENOTCONN);
+
+	default:
+		return false;
+	}
+}
+
+/** Send all of our listening sockets to the new server
+ *
+ */
+static int handoff_send_fds(int sockfd)
+{
+	int		fds[HANDOFF_MAX_FDS];
+	size_t		num_fds = 0, total = 0;
+	int		fd, max_fd = HANDOFF_MAX_FD;
+	struct rlimit	limit;
+
+	if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur < (rlim_t)max_fd)) {
+		max_fd = (int)limit.rlim_cur;
+	}
+
+	for (fd = 0; fd < max_fd; fd++) {
+		if (!handoff_fd_is_listener(fd)) continue;
+
+		fds[num_fds++] = fd;
+		total++;
+
+		if (num_fds < HANDOFF_MAX_FDS) continue;
+
+		if (handoff_send(sockfd, 'F', fds, num_fds) < 0) return -1;
+		num_fds = 0;
+	}
+
+	if (num_fds && (handoff_send(sockfd, 'F', fds, num_fds) < 0)) return -1;
+
+	if (handoff_send(sockfd, 'E', NULL, 0) < 0) return -1;
+
+	INFO("Sent %zu sockets to new server", total);
+
+	return 0;
+}
+
+/** Exit once the requests we have are done
+ *
+ */
+static void handoff_drain_timer(fr_event_list_t *el, fr_time_t now, UNUSED void *uctx)
+{
+	uint64_t active;
+
+	active = fr_schedule_num_active(handoff.sc);
+	if (!active) {
+		INFO("All requests finished, exiting");
+	exit:
+		main_loop_signal_raise(RADIUS_SIGNAL_SELF_TERM);
+		return;
+	}
+
+	if (fr_time_gteq(now, handoff.deadline)) {
+		WARN("Exiting with %" PRIu64 " requests still active", active);
+		goto exit;
+	}
+
+	if (fr_event_timer_in(NULL, el, &handoff.ev, fr_time_delta_from_msec(100),
+			      handoff_drain_timer, NULL) < 0) {
+		PERROR("Failed inserting drain timer, exiting");
+		goto exit;
+	}
+}
+
+static void handoff_client_close(fr_event_list_t *el)
+{
+	fr_event_fd_delete(el, handoff.client_fd, FR_EVENT_FILTER_IO);
+	close(handoff.client_fd);
+	handoff.client_fd = -1;
+}
+
+/** The new server has something to say
+ *
+ */
+static void handoff_client_read(fr_event_list_t *el, int fd, UNUSED int flags, UNUSED void *uctx)
+{
+	char	type;
+	int	ret;
+
+	ret = handoff_recv(fd, &type, NULL, NULL);
+	if (ret < 0) {
+		PERROR("Hot restart aborted");
+		handoff_client_close(el);
+		return;
+	}
+
+	if (ret == 0) {
+		WARN("New server exited before taking over, continuing to process packets");
+		handoff_client_close(el);
+		return;
+	}
+
+	if (type != 'S') {
+		ERROR("Unexpected message '%c' on hot restart socket, aborting hot restart", type);
+		handoff_client_close(el);
+		return;
+	}
+
+	INFO("New server has taken over, waiting for active requests to finish");
+
+	handoff_client_close(el);
+
+	fr_event_fd_delete(el, handoff.listen_fd, FR_EVENT_FILTER_IO);
+	close(handoff.listen_fd);
+	handoff.listen_fd = -1;
+
+	handoff.handed_off = true;
+	handoff.deadline = fr_time_add(fr_time(), handoff.drain_time);
+
+	fr_schedule_pause(handoff.sc);
+
+	handoff_drain_timer(el, fr_time(), NULL);
+}
+
+static void handoff_client_error(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno,
+				 UNUSED void *uctx)
+{
+	ERROR("Hot restart aborted: %s", fr_syserror(fd_errno));
+	handoff_client_close(el);
+}
+
+/** A new server wants our sockets
+ *
+ */
+static void handoff_accept(fr_event_list_t *el, int fd, UNUSED int flags, UNUSED void *uctx)
+{
+	int sockfd;
+
+	sockfd = accept(fd, NULL, NULL);
+	if (sockfd < 0) {
+		if ((errno != EAGAIN) && (errno != EINTR)) {
+			ERROR("Failed accepting hot restart connection: %s", fr_syserror(errno));
+		}
+		return;
+	}
+
+	/*
+	 *	Only one new server at a time.
+	 */
+	if (handoff.client_fd >= 0) {
+		WARN("Hot restart already in progress, refusing new connection");
+		close(sockfd);
+		return;
+	}
+
+	INFO("New server is starting, sending it our sockets");
+
+	if (handoff_send_fds(sockfd) < 0) {
+		PERROR("Hot restart aborted");
+		close(sockfd);
+		return;
+	}
+
+	handoff.client_fd = sockfd;
+	if (fr_event_fd_insert(NULL, NULL, el, sockfd,
+			       handoff_client_read, NULL, handoff_client_error, NULL) < 0) {
+		PERROR("Hot restart aborted");
+		close(sockfd);
+		handoff.client_fd = -1;
+	}
+}
+
+/** Listen for a new server which wants to take over
+ *
+ * @param[in] ctx		to allocate events in.
+ * @param[in] el		main event list.
+ * @param[in] path		of the unix socket to listen on.
+ * @param[in] sc		the scheduler to pause when the new server takes over.
+ * @param[in] drain_time	how long to wait for requests to finish before exiting.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_handoff_listen(TALLOC_CTX *ctx, fr_event_list_t *el, char const *path,
+		      fr_schedule_t *sc, fr_time_delta_t drain_time)
+{
+	int			sockfd;
+	size_t			len;
+	struct sockaddr_un	salocal;
+
+	len = strlen(path);
+	if (len >= sizeof(salocal.sun_path)) {
+		ERROR("Hot restart path too long, maximum length is %zu", sizeof(salocal.sun_path) - 1);
+		return -1;
+	}
+
+	/*
+	 *	Any socket at the path belongs to the server we've
+	 *	just replaced, or to one which has gone away.
+	 */
+	if ((unlink(path) < 0) && (errno != ENOENT)) {
+		ERROR("Failed removing old hot restart socket %s: %s", path, fr_syserror(errno));
+		return -1;
+	}
+
+	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd < 0) {
+		ERROR("Failed creating hot restart socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	memset(&salocal, 0, sizeof(salocal));
+	salocal.sun_family = AF_UNIX;
+	memcpy(salocal.sun_path, path, len + 1);
+
+	if (bind(sockfd, (struct sockaddr *)&salocal, SUN_LEN(&salocal)) < 0) {
+		ERROR("Failed binding hot restart socket %s: %s", path, fr_syserror(errno));
+	error:
+		close(sockfd);
+		return -1;
+	}
+
+	if (chmod(path, S_IRUSR | S_IWUSR) < 0) {
+		ERROR("Failed setting permissions on hot restart socket %s: %s", path, fr_syserror(errno));
+		goto error;
+	}
+
+	if (listen(sockfd, 1) < 0) {
+		ERROR("Failed listening on hot restart socket %s: %s", path, fr_syserror(errno));
+		goto error;
+	}
+
+	if (fr_nonblock(sockfd) < 0) {
+		PERROR("Failed setting hot restart socket non-blocking");
+		goto error;
+	}
+
+	if (fr_event_fd_insert(ctx, NULL, el, sockfd, handoff_accept, NULL, NULL, NULL) < 0) {
+		PERROR("Failed inserting hot restart socket into event loop");
+		goto error;
+	}
+
+	handoff.listen_fd = sockfd;
+	handoff.el = el;
+	handoff.sc = sc;
+	handoff.drain_time = drain_time;
+
+	DEBUG("Listening for hot restart on %s", path);
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file io/handoff.h
+ * @brief Pass listening sockets from a running server to one which replaces it.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(handoff_h, "$Id$")
+
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/util/event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int	fr_handoff_receive(char const *path) CC_HINT(nonnull);
+
+int	fr_handoff_complete(void);
+
+int	fr_handoff_listen(TALLOC_CTX *ctx, fr_event_list_t *el, char const *path,
+			  fr_schedule_t *sc, fr_time_delta_t drain_time) CC_HINT(nonnull);
+
+bool	fr_handoff_done(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -18,6 +18,8 @@
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/server/time_tracking.h>
 
+#include <pthread.h>
+
 /** Describes a path data takes to/from the wire to/from fr_pair_ts
  *
  */
@@ -50,6 +52,12 @@ struct fr_listen {
 
 	size_t			default_message_size;	//!< copied from app_io, but may be changed
 	size_t			num_messages;		//!< for the message ring buffer
+
+	uint32_t		recv_batch;		//!< maximum number of datagrams to read per
+							///< read event.  0 or 1 means one.
+
+	bool			worker_affinity;	//!< send every packet from a connection to
+							///< the same worker.
 };
 
 /**
@@ -70,6 +78,12 @@ struct fr_async_s {
 	uint32_t		priority;	//!< higher == higher priority
 
 	uint32_t		sequence;	//!< higher == higher priority, too
+
+	fr_time_delta_t		queue_time;	//!< how long the request waited before it first ran.
+						///< Negative until then.
+
+	pthread_mutex_t		*channel_mutex;	//!< held while using the channel, when workers
+						//!< share work.  NULL otherwise.
 };
 
 int fr_io_listen_free(fr_listen_t *li);
@@ -126,6 +126,46 @@ static void fr_load_generator_send(fr_load_t *l, fr_time_t now, int count)
 	}
 }
 
+static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx);
+
+/** Send packets for every tick which is due, and then set the next timer.
+ *
+ *  Unlike the closed loop generator, we don't skip ticks when the
+ *  timer fires late.  The packets for those ticks should have been
+ *  sent, so we send them now, and tell the callback when they were
+ *  due.  We do limit the catch-up to one second of packets, so that
+ *  a process which was stopped for a long time doesn't flood the
+ *  other end when it resumes.
+ */
+static void load_timer_open(fr_load_t *l, fr_event_list_t *el, fr_time_t now)
+{
+	fr_time_t	due = l->next;
+	uint32_t	i, ticks = 0;
+	uint32_t	max_ticks = (l->pps / l->config->parallel) + 1;
+
+	l->state = FR_LOAD_STATE_SENDING;
+	l->stats.blocked = false;
+
+	while (fr_time_lteq(l->next, now)) {
+		if (ticks < max_ticks) {
+			ticks++;
+		} else {
+			l->stats.skipped += l->config->parallel;
+			due = fr_time_add(due, l->delta);
+		}
+		l->next = fr_time_add(l->next, l->delta);
+	}
+
+	if (fr_event_timer_in(l, el, &l->ev, fr_time_sub(l->next, now), load_timer, l) < 0) {
+		l->state = FR_LOAD_STATE_DRAINING;
+		return;
+	}
+
+	for (i = 0; i < ticks; i++) {
+		fr_load_generator_send(l, fr_time_add(due, fr_time_delta_mul(l->delta, i)), l->config->parallel);
+	}
+}
+
 static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 {
 	fr_load_t *l = uctx;
@@ -161,6 +201,11 @@ static void load_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 		}
 	}
 
+	if (l->config->open_loop) {
+		load_timer_open(l, el, now);
+		return;
+	}
+
 	/*
 	 *	We don't have "pps" packets in the backlog, go send
 	 *	some more.  We scale the backlog by 1000 milliseconds
@@ -238,7 +283,16 @@ int fr_load_generator_start(fr_load_t *l)
 	l->count = l->config->parallel;
 
 	l->delta = fr_time_delta_div(fr_time_delta_from_sec(l->config->parallel), fr_time_delta_wrap(l->pps));
-	l->next = fr_time_add(l->step_start, l->delta);
+
+	/*
+	 *	The open loop generator sends the first packets now,
+	 *	and the closed loop one after the first delay.
+	 */
+	if (l->config->open_loop) {
+		l->next = l->step_start;
+	} else {
+		l->next = fr_time_add(l->step_start, l->delta);
+	}
 
 	load_timer(l->el, l->step_start, l);
 	return 0;
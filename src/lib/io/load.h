@@ -68,6 +68,15 @@ RCSIDH(load_h, "$Id$")
  *  "duration" seconds, even if the maximum backlog is currently
  *  reached.  This increase has the effect of also increasing the
  *  maximum backlog.
+ *
+ *  When "open_loop" is set, the backlog is ignored, and the generator
+ *  is never gated.  Packets are sent at the configured rate no matter
+ *  how slowly the other end replies.  If the timer fires late, the
+ *  generator catches up by running the callback for every tick it
+ *  missed, and each callback is given the time at which the packet
+ *  was *scheduled* to be sent.  The caller should use that time when
+ *  measuring latency, so that a slow server is charged for the delay
+ *  it caused, instead of the delay being hidden by a late send.
  */
 typedef struct {
 	uint32_t       	start_pps;	//!< start PPS
@@ -76,6 +85,7 @@ typedef struct {
 	uint32_t	step;		//!< how much to increase each load test by
 	uint32_t	parallel;	//!< how many packets in parallel to send
 	uint32_t	milliseconds;	//!< how many milliseconds of backlog to top out at
+	bool		open_loop;	//!< send at the configured rate, no matter what the backlog is.
 } fr_load_config_t;
 
 typedef struct {
@@ -27,15 +27,35 @@
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
 
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/syserror.h>
 
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+/** Number of entries in the per-thread client cache
+ *
+ *  Must be a power of 2.
+ */
+#define CLIENT_CACHE_SIZE	(1024)
+
+/** Recently matched client, keyed by the exact source IP
+ *
+ */
+typedef struct {
+	fr_ipaddr_t			ipaddr;				//!< source IP of the packet
+	fr_io_client_t			*client;			//!< client the trie returned for it
+} fr_io_client_cache_t;
+
 typedef struct {
 	fr_event_list_t			*el;				//!< event list, for the master socket.
 	fr_network_t			*nr;				//!< network for the master socket
 
 	fr_trie_t			*trie;				//!< trie of clients
+	fr_io_client_cache_t		*client_cache;			//!< direct mapped cache in front of the trie
 	fr_heap_t			*pending_clients;		//!< heap of pending clients
 	fr_heap_t			*alive_clients;			//!< heap of active clients
 
@@ -95,6 +115,25 @@ typedef struct fr_io_connection_s fr_io_connection_t;
 /** Client definitions for master IO
  *
  */
+/** Open-addressed table of tracking entries
+ *
+ *  Used instead of an rbtree when "flat_tracking" is set.  Entries are
+ *  found with linear probing, so a lookup usually touches one or two
+ *  cache lines.  Deletions shift later entries back, so there are no
+ *  tombstones.
+ */
+typedef struct {
+	struct {
+		uint32_t			hash;		//!< cached from track->hash
+		fr_io_track_t			*track;		//!< NULL for an empty slot
+	}				*slots;
+	uint32_t			mask;		//!< number of slots - 1
+	uint32_t			num;		//!< number of entries in the table
+	fr_cmp_t			cmp;		//!< to compare entries with the same hash
+} fr_io_track_table_t;
+
+#define TRACK_TABLE_SIZE_INIT	512	//!< 256 IDs from each of a couple of source ports
+
 struct fr_io_client_s {
 	fr_io_connection_t		*connection;	//!< parent connection
 	fr_io_client_state_t		state;		//!< state of this client
@@ -114,12 +153,26 @@ struct fr_io_client_s {
 	fr_io_thread_t			*thread;
 	fr_event_timer_t const		*ev;		//!< when we clean up the client
 	fr_rb_tree_t			*table;		//!< tracking table for packets
+	fr_io_track_table_t		*flat;		//!< flat tracking table, used instead of "table"
 
 	fr_heap_t			*pending;	//!< pending packets for this client
 	fr_hash_table_t			*addresses;	//!< list of src/dst addresses used by this client
 
 	pthread_mutex_t			mutex;		//!< for parent / child signaling
 	fr_hash_table_t			*ht;		//!< for tracking connected sockets
+
+	fr_time_t			rate_tat;	//!< theoretical arrival time of the next packet,
+							///< for the rate limit.
+	uint64_t			rate_limited;	//!< number of packets dropped by the rate limit.
+
+	uint64_t			dup_replies;	//!< number of cached replies re-sent to retransmits.
+	size_t				reply_bytes;	//!< memory used by cached replies.
+
+	fr_time_delta_t			nak_lifetime;	//!< current lifetime of a NAK entry.
+	bool				nak_hit;	//!< packets were received while NAKed.
+
+	fr_io_track_t			*spare;		//!< tracking entry left over from the last
+							///< duplicate, so retransmits don't allocate.
 };
 
 /** Track a connection
@@ -166,6 +219,11 @@ static int track_free(fr_io_track_t *track)
 {
 	if (track->ev) (void) fr_event_timer_delete(&track->ev);
 
+	if (track->reply) {
+		fr_assert(track->client->reply_bytes >= track->reply_len);
+		track->client->reply_bytes -= track->reply_len;
+	}
+
 	talloc_free_children(track);
 
 	fr_assert(track->client->packets > 0);
@@ -174,12 +232,14 @@ static int track_free(fr_io_track_t *track)
 	return 0;
 }
 
+static bool track_table_delete(fr_io_client_t *client, fr_io_track_t *track);
+static void packet_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx);
+
 static int track_dedup_free(fr_io_track_t *track)
 {
-	fr_assert(track->client->table != NULL);
-	fr_assert(fr_rb_find(track->client->table, track) != NULL);
+	fr_assert((track->client->table != NULL) || (track->client->flat != NULL));
 
-	if (!fr_rb_delete(track->client->table, track)) {
+	if (!track_table_delete(track->client, track)) {
 		fr_assert(0);
 	}
 
@@ -332,6 +392,148 @@ static int8_t track_connected_cmp(void const *one, void const *two)
 	return CMP(ret, 0);
 }
 
+static fr_io_track_table_t *track_flat_alloc(TALLOC_CTX *ctx, fr_cmp_t cmp)
+{
+	fr_io_track_table_t *tt;
+
+	MEM(tt = talloc_zero(ctx, fr_io_track_table_t));
+	MEM(tt->slots = talloc_zero_array(tt, __typeof__(*tt->slots), TRACK_TABLE_SIZE_INIT));
+	tt->mask = TRACK_TABLE_SIZE_INIT - 1;
+	tt->cmp = cmp;
+
+	return tt;
+}
+
+static uint32_t track_flat_hash(fr_io_client_t *client, fr_io_track_t const *track)
+{
+	uint32_t hash;
+	void *thread_instance;
+
+	thread_instance = client->connection ? client->connection->child->thread_instance :
+					       client->thread->child->thread_instance;
+
+	hash = client->inst->app_io->track_hash(client->inst->app_io_instance, thread_instance,
+						client->radclient, track->packet);
+
+	/*
+	 *	Each source port has its own ID space.
+	 */
+	return fr_hash_update(&track->address->socket.inet.src_port, sizeof(track->address->socket.inet.src_port), hash);
+}
+
+static fr_io_track_t *track_flat_find(fr_io_track_table_t *tt, fr_io_track_t const *track)
+{
+	uint32_t i;
+
+	for (i = track->hash & tt->mask; tt->slots[i].track; i = (i + 1) & tt->mask) {
+		if ((tt->slots[i].hash == track->hash) && (tt->cmp(tt->slots[i].track, track) == 0)) {
+			return tt->slots[i].track;
+		}
+	}
+
+	return NULL;
+}
+
+static void track_flat_insert(fr_io_track_table_t *tt, fr_io_track_t *track)
+{
+	uint32_t i;
+
+	/*
+	 *	Keep the load factor under 3/4, otherwise the probe
+	 *	sequences get long.
+	 */
+	if (((tt->num + 1) * 4) > ((tt->mask + 1) * 3)) {
+		__typeof__(tt->slots) old = tt->slots;
+		uint32_t j, old_size = tt->mask + 1;
+
+		MEM(tt->slots = talloc_zero_array(tt, __typeof__(*tt->slots), old_size * 2));
+		tt->mask = (old_size * 2) - 1;
+
+		for (j = 0; j < old_size; j++) {
+			if (!old[j].track) continue;
+
+			for (i = old[j].hash & tt->mask; tt->slots[i].track; i = (i + 1) & tt->mask);
+			tt->slots[i] = old[j];
+		}
+		talloc_free(old);
+	}
+
+	for (i = track->hash & tt->mask; tt->slots[i].track; i = (i + 1) & tt->mask);
+
+	tt->slots[i].hash = track->hash;
+	tt->slots[i].track = track;
+	tt->num++;
+}
+
+static bool track_flat_delete(fr_io_track_table_t *tt, fr_io_track_t *track)
+{
+	uint32_t i, j, k;
+
+	for (i = track->hash & tt->mask; tt->slots[i].track != track; i = (i + 1) & tt->mask) {
+		if (!tt->slots[i].track) return false;
+	}
+
+	/*
+	 *	Move back any later entries which would no longer be
+	 *	found once slot "i" is empty.  An entry can move back
+	 *	if its home slot "k" is not cyclically in (i, j].
+	 */
+	for (j = (i + 1) & tt->mask; tt->slots[j].track; j = (j + 1) & tt->mask) {
+		k = tt->slots[j].hash & tt->mask;
+
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) continue;
+
+		tt->slots[i] = tt->slots[j];
+		i = j;
+	}
+
+	tt->slots[i].track = NULL;
+	tt->num--;
+
+	return true;
+}
+
+static fr_io_track_t *track_table_find(fr_io_client_t *client, fr_io_track_t *track)
+{
+	if (client->flat) {
+		track->hash = track_flat_hash(client, track);
+		return track_flat_find(client->flat, track);
+	}
+
+	return fr_rb_find(client->table, track);
+}
+
+static bool track_table_insert(fr_io_client_t *client, fr_io_track_t *track)
+{
+	if (client->flat) {
+		fr_assert(track_flat_find(client->flat, track) == NULL);
+		track_flat_insert(client->flat, track);
+		return true;
+	}
+
+	return fr_rb_insert(client->table, track);
+}
+
+static bool track_table_delete(fr_io_client_t *client, fr_io_track_t *track)
+{
+	if (client->flat) return track_flat_delete(client->flat, track);
+
+	return fr_rb_delete(client->table, track);
+}
+
+/** Allocate the duplicate detection table for a client
+ *
+ */
+static void track_table_alloc(fr_io_instance_t const *inst, fr_io_client_t *client, TALLOC_CTX *ctx, fr_cmp_t cmp)
+{
+	if (inst->flat_tracking && inst->app_io->track_hash) {
+		client->flat = track_flat_alloc(ctx, cmp);
+		return;
+	}
+
+	MEM(client->table = fr_rb_inline_talloc_alloc(ctx, fr_io_track_t, node, cmp, NULL));
+}
+
 
 static fr_io_pending_packet_t *pending_packet_pop(fr_io_thread_t *thread)
 {
@@ -369,6 +571,40 @@ static fr_io_pending_packet_t *pending_packet_pop(fr_io_thread_t *thread)
 	return pending;
 }
 
+/** Check a new packet against the client's rate limit
+ *
+ * This is GCRA, which is a token bucket that only needs one
+ * timestamp.  Each packet moves the theoretical arrival time (TAT)
+ * on by one emission interval.  A packet is allowed if the TAT is no
+ * more than "burst" intervals in the future.
+ *
+ * Each thread has its own copy of the client, so no locking is needed.
+ *
+ * @return
+ *	- true if the packet is allowed.
+ *	- false if it should be dropped.
+ */
+static bool client_rate_allow(fr_io_client_t *client, fr_time_t now)
+{
+	fr_client_t const	*radclient = client->radclient;
+	fr_time_delta_t		interval;
+	fr_time_t		tat;
+
+	if (!radclient->max_packets_per_second) return true;
+
+	interval = fr_time_delta_wrap(NSEC / radclient->max_packets_per_second);
+
+	tat = fr_time_gt(client->rate_tat, now) ? client->rate_tat : now;
+	if (fr_time_delta_gt(fr_time_sub(tat, now),
+			     fr_time_delta_wrap(fr_time_delta_unwrap(interval) * radclient->max_packets_burst))) {
+		client->rate_limited++;
+		return false;
+	}
+
+	client->rate_tat = fr_time_add(tat, interval);
+	return true;
+}
+
 static fr_client_t *radclient_clone(TALLOC_CTX *ctx, fr_client_t const *parent)
 {
 	fr_client_t *c;
@@ -403,6 +639,9 @@ static fr_client_t *radclient_clone(TALLOC_CTX *ctx, fr_client_t const *parent)
 
 	COPY_FIELD(use_connected);
 
+	COPY_FIELD(max_packets_per_second);
+	COPY_FIELD(max_packets_burst);
+
 #ifdef WITH_TLS
 	COPY_FIELD(tls_required);
 #endif
@@ -579,10 +818,7 @@ static fr_io_connection_t *fr_io_connection_alloc(fr_io_instance_t const *inst,
 	 *
 	 *	#todo - unify the code with static clients?
 	 */
-	if (inst->app_io->track_duplicates) {
-		MEM(connection->client->table = fr_rb_inline_talloc_alloc(client, fr_io_track_t, node,
-									  track_connected_cmp, NULL));
-	}
+	if (inst->app_io->track_duplicates) track_table_alloc(inst, connection->client, client, track_connected_cmp);
 
 	/*
 	 *	Set this radclient to be dynamic, and active.
@@ -908,6 +1144,42 @@ static fr_client_t *radclient_alloc(TALLOC_CTX *ctx, int ipproto, fr_io_address_
 	return radclient;
 }
 
+/** Find the client for a source IP, checking the cache before the trie
+ *
+ *  The trie does a longest prefix match, which is expensive when
+ *  there are many clients.  Packets from a NAS all have the same
+ *  source IP, so we remember the result of the last lookup in a
+ *  small direct mapped table.
+ */
+static fr_io_client_t *client_lookup(fr_io_thread_t *thread, fr_ipaddr_t const *ipaddr)
+{
+	fr_io_client_cache_t	*entry;
+	fr_io_client_t		*client;
+
+	entry = &thread->client_cache[fr_hash(&ipaddr->addr, (ipaddr->af == AF_INET) ?
+					      sizeof(ipaddr->addr.v4) : sizeof(ipaddr->addr.v6)) & (CLIENT_CACHE_SIZE - 1)];
+	if (entry->client && (fr_ipaddr_cmp(&entry->ipaddr, ipaddr) == 0)) return entry->client;
+
+	client = fr_trie_lookup_by_key(thread->trie, &ipaddr->addr, ipaddr->prefix);
+	if (!client) return NULL;
+
+	entry->ipaddr = *ipaddr;
+	entry->client = client;
+
+	return client;
+}
+
+/** Forget all cached lookups
+ *
+ *  Adding a client may change the longest prefix match for an
+ *  address, and removing one leaves dangling pointers.  Changes are
+ *  rare compared to lookups, so we just empty the whole cache.
+ */
+static inline CC_HINT(always_inline) void client_cache_flush(fr_io_thread_t *thread)
+{
+	memset(thread->client_cache, 0, sizeof(*thread->client_cache) * CLIENT_CACHE_SIZE);
+}
+
 /*
  *	Remove a client from the list of "live" clients.
  *
@@ -923,6 +1195,7 @@ static int _client_live_free(fr_io_client_t *client)
 	if (client->pending) TALLOC_FREE(client->pending);
 
 	(void) fr_trie_remove_by_key(client->thread->trie, &client->src_ipaddr.addr, client->src_ipaddr.prefix);
+	client_cache_flush(client->thread);
 	(void) fr_heap_extract(&client->thread->alive_clients, client);
 
 	return 0;
@@ -980,7 +1253,7 @@ static fr_io_client_t *client_alloc(TALLOC_CTX *ctx, fr_io_client_state_t state,
 	 */
 	if (inst->app_io->track_duplicates) {
 		fr_assert(inst->app_io->track_compare != NULL);
-		MEM(client->table = fr_rb_inline_talloc_alloc(client, fr_io_track_t, node, track_cmp, NULL));
+		track_table_alloc(inst, client, client, track_cmp);
 	}
 
 	/*
@@ -1006,6 +1279,7 @@ static fr_io_client_t *client_alloc(TALLOC_CTX *ctx, fr_io_client_state_t state,
 	}
 
 	client->in_trie = true;
+	client_cache_flush(thread);
 
 	/*
 	 *	Track the live clients so that we can clean
@@ -1037,11 +1311,29 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 	*is_dup = false;
 
 	/*
-	 *	Allocate a new tracking structure.  Most of the time
-	 *	there are no duplicates, so this is fine.
+	 *	Re-use the entry left over from the last duplicate.
+	 *	When a home server is down, most of what we receive
+	 *	are retransmits, and each of those would otherwise
+	 *	cost a pool allocation just to be found and freed
+	 *	again.
 	 */
-	MEM(track = talloc_zero_pooled_object(client, fr_io_track_t, 1, sizeof(*track) + sizeof(track->address) + 64));
-	MEM(track->address = my_address = talloc_zero(track, fr_io_address_t));
+	if (client->spare) {
+		track = client->spare;
+		client->spare = NULL;
+
+		my_address = UNCONST(fr_io_address_t *, track->address);
+		memset(track, 0, sizeof(*track));
+		memset(my_address, 0, sizeof(*my_address));
+		track->address = my_address;
+
+	} else {
+		/*
+		 *	Allocate a new tracking structure.  Most of the time
+		 *	there are no duplicates, so this is fine.
+		 */
+		MEM(track = talloc_zero_pooled_object(client, fr_io_track_t, 1, sizeof(*track) + sizeof(track->address) + 64));
+		MEM(track->address = my_address = talloc_zero(track, fr_io_address_t));
+	}
 
 	memcpy(my_address, address, sizeof(*address));
 	my_address->radclient = client->radclient;
@@ -1081,7 +1373,7 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 	/*
 	 *	No existing duplicate.  Return the new tracking entry.
 	 */
-	old = fr_rb_find(client->table, track);
+	old = track_table_find(client, track);
 	if (!old) goto do_insert;
 
 	fr_assert(old->client == client);
@@ -1123,7 +1415,18 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 
 		*is_dup = true;
 		old->packets++;
-		talloc_free(track);
+
+		/*
+		 *	Keep the entry for the next packet.  Connected
+		 *	sockets point track->address at the connection,
+		 *	so we can't get our own copy back.
+		 */
+		if (!client->connection && !client->spare) {
+			TALLOC_FREE(track->packet);
+			client->spare = track;
+		} else {
+			talloc_free(track);
+		}
 
 		/*
 		 *	Retransmits can sit in the outbound queue for
@@ -1150,7 +1453,7 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 	} else {
 		fr_assert(client == old->client);
 
-		if (!fr_rb_delete(client->table, old)) {
+		if (!track_table_delete(client, old)) {
 			fr_assert(0);
 		}
 		if (old->ev) (void) fr_event_timer_delete(&old->ev);
@@ -1161,7 +1464,7 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 	}
 
 do_insert:
-	if (!fr_rb_insert(client->table, track)) {
+	if (!track_table_insert(client, track)) {
 		fr_assert(0);
 	}
 
@@ -1487,8 +1790,7 @@ do_read:
 	 *	connected socket).
 	 */
 	if (!connection) {
-		client = fr_trie_lookup_by_key(thread->trie,
-					&address.socket.inet.src_ipaddr.addr, address.socket.inet.src_ipaddr.prefix);
+		client = client_lookup(thread, &address.socket.inet.src_ipaddr);
 		fr_assert(!client || !client->connection);
 
 	} else {
@@ -1506,6 +1808,7 @@ do_read:
 	 */
 	if (client && client->state == PR_CLIENT_NAK) {
 		if (accept_fd >= 0) close(accept_fd);
+		client->nak_hit = true;
 		return 0;
 	}
 
@@ -1636,7 +1939,9 @@ have_client:
 			 *	If there's a cached reply, just send that and don't do anything else.
 			 */
 			if (is_dup) {
-				fr_network_t *nr;
+				fr_network_t	*nr;
+				fr_event_list_t	*el;
+				ssize_t		slen;
 
 				if (track->do_not_respond) {
 					DEBUG("Ignoring retransmit from client %s - we are not responding to this request", client->radclient->shortname);
@@ -1651,8 +1956,48 @@ have_client:
 
 				if (connection) {
 					nr = connection->nr;
+					el = connection->el;
 				} else {
 					nr = thread->nr;
+					el = thread->el;
+				}
+
+				DEBUG("Sending duplicate reply to client %s", client->radclient->shortname);
+				client->dup_replies++;
+
+				/*
+				 *	We're already in the network thread, so
+				 *	write the cached reply directly.  This
+				 *	skips copying it into a message, and
+				 *	going round the event loop again just to
+				 *	call mod_write().
+				 *
+				 *	Only unconnected UDP sockets can do this.
+				 *	A connected socket may still have replies
+				 *	queued in the network layer, and a write
+				 *	into the middle of those would corrupt the
+				 *	stream.
+				 */
+				if (!connection) {
+					slen = child->app_io->write(child, track, track->timestamp,
+								    track->reply, track->reply_len, 0);
+					if (slen == (ssize_t) track->reply_len) {
+						if (child->app_io->flush) (void) child->app_io->flush(child);
+						packet_expiry_timer(el, fr_time_wrap(0), track);
+						return 0;
+					}
+
+					/*
+					 *	Short writes and blocked sockets
+					 *	go through the network layer.
+					 *	Anything else is an error, and the
+					 *	client will retransmit again.
+					 */
+					if ((slen < 0) && (errno != EWOULDBLOCK)) {
+						DEBUG("Failed sending duplicate reply to client %s", client->radclient->shortname);
+						packet_expiry_timer(el, fr_time_wrap(0), track);
+						return 0;
+					}
 				}
 
 				/*
@@ -1665,7 +2010,6 @@ have_client:
 				 *	to the localized message, and then caching that in the tracking
 				 *	structure.
 				 */
-				DEBUG("Sending duplicate reply to client %s", client->radclient->shortname);
 				fr_network_listen_write(nr, li, track->reply, track->reply_len,
 							track, track->timestamp);
 				return 0;
@@ -1675,6 +2019,17 @@ have_client:
 			 *	Got to free this if we don't process the packet.
 			 */
 			to_free = track;
+
+			/*
+			 *	Duplicates are answered above, and
+			 *	don't count against the rate limit.
+			 */
+			if ((client->state != PR_CLIENT_PENDING) && !client_rate_allow(client, recv_time)) {
+				RATE_LIMIT_GLOBAL(WARN, "proto_%s - client %s is over max_packets_per_second - discarding packet",
+						  inst->app_io->common.name, client->radclient->shortname);
+				talloc_free(to_free);
+				return 0;
+			}
 		}
 
 		/*
@@ -1985,7 +2340,8 @@ static void client_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 			break;
 
 		case PR_CLIENT_NAK:
-			delay = inst->nak_lifetime;
+			if (!fr_time_delta_ispos(client->nak_lifetime)) client->nak_lifetime = inst->nak_lifetime;
+			delay = client->nak_lifetime;
 			break;
 
 		default:
@@ -2002,6 +2358,25 @@ static void client_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 	 *	It's a negative cache entry.  Just delete it.
 	 */
 	if (client->state == PR_CLIENT_NAK) {
+		/*
+		 *	The source kept sending packets while it was
+		 *	blocked.  It's likely a scanner, or a
+		 *	misconfigured NAS, and will just be NAKed again.
+		 *	Back off exponentially, instead of running the
+		 *	dynamic client definition every nak_lifetime.
+		 */
+		if (client->nak_hit && fr_time_delta_lt(client->nak_lifetime, inst->max_nak_lifetime)) {
+			client->nak_hit = false;
+
+			delay = fr_time_delta_add(client->nak_lifetime, client->nak_lifetime);
+			if (fr_time_delta_gt(delay, inst->max_nak_lifetime)) delay = inst->max_nak_lifetime;
+			client->nak_lifetime = delay;
+
+			DEBUG("proto_%s - extending NAK client %pV for %pVs", inst->app_io->common.name,
+			      fr_box_ipaddr(client->src_ipaddr), fr_box_time_delta(delay));
+			goto reset_timer;
+		}
+
 		DEBUG("proto_%s - deleting NAK client %pV", inst->app_io->common.name, fr_box_ipaddr(client->src_ipaddr));
 
 	delete_client:
@@ -2307,6 +2682,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 		if (!track->reply) {
 			MEM(track->reply = talloc_memdup(track, buffer, buffer_len));
 			track->reply_len = buffer_len;
+			client->reply_bytes += buffer_len;
 		}
 
 		/*
@@ -2346,6 +2722,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 		client->state = PR_CLIENT_NAK;
 		TALLOC_FREE(client->pending);
 		if (client->table) TALLOC_FREE(client->table);
+		if (client->flat) TALLOC_FREE(client->flat);
 		fr_assert(client->packets == 0);
 
 		/*
@@ -2592,6 +2969,22 @@ reread:
 	return buffer_len;
 }
 
+/** Write any replies which the child has queued.
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	fr_io_instance_t const *inst;
+	fr_io_connection_t *connection;
+	fr_listen_t *child;
+
+	get_inst(li, &inst, NULL, &connection, &child);
+
+	if (!inst->app_io->flush) return 0;
+
+	return inst->app_io->flush(child);
+}
+
 /** Close the socket.
  *
  */
@@ -2684,6 +3077,22 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	if (inst->shard_networks && (inst->ipproto != IPPROTO_UDP)) {
+		cf_log_err(inst->app_io_conf, "'shard_networks' can only be used with UDP sockets");
+		return -1;
+	}
+
+	if (inst->shard_networks && inst->dedicated_network) {
+		cf_log_err(inst->app_io_conf, "'shard_networks' and 'dedicated_network' cannot be used together");
+		return -1;
+	}
+
+#if !defined(SO_ATTACH_REUSEPORT_CBPF) || !defined(SKF_AD_CPU)
+	if (inst->shard_by_cpu) {
+		cf_log_warn(inst->app_io_conf, "'shard_by_cpu' is not supported on this system, and will be ignored");
+	}
+#endif
+
 	/*
 	 *	Ensure that the dynamic client sections exist
 	 */
@@ -2733,6 +3142,41 @@ static char const *mod_name(fr_listen_t *li)
 	return child->app_io->get_name(child);
 }
 
+static void mod_stats_print(fr_listen_t *li, FILE *fp)
+{
+	fr_io_thread_t *thread;
+	fr_io_connection_t *connection;
+	fr_listen_t *child;
+	fr_io_instance_t const *inst;
+
+	get_inst(li, &inst, &thread, &connection, &child);
+
+	fr_assert(child != NULL);
+	if (child->app_io->stats_print) child->app_io->stats_print(child, fp);
+
+	if (connection) {
+		fprintf(fp, "count.rate_limited\t%" PRIu64 "\n", connection->client->rate_limited);
+		fprintf(fp, "count.dup_replies\t%" PRIu64 "\n", connection->client->dup_replies);
+		fprintf(fp, "size.reply_cache\t%zu\n", connection->client->reply_bytes);
+		return;
+	}
+
+	if (!thread->alive_clients) return;
+
+	fr_heap_foreach(thread->alive_clients, fr_io_client_t, client) {
+		char const *name = client->radclient->shortname;
+
+		if (client->radclient->max_packets_per_second) {
+			fprintf(fp, "client.%s.rate_limited\t%" PRIu64 "\n", name, client->rate_limited);
+		}
+
+		if (!inst->app_io->track_duplicates) continue;
+
+		fprintf(fp, "client.%s.dup_replies\t%" PRIu64 "\n", name, client->dup_replies);
+		fprintf(fp, "client.%s.reply_cache\t%zu\n", name, client->reply_bytes);
+	}}
+}
+
 /** Create a trie from arrays of allow / deny IP addresses
  *
  * @param ctx	the talloc ctx
@@ -2889,6 +3333,12 @@ fr_trie_t *fr_master_io_network(TALLOC_CTX *ctx, int af, fr_ipaddr_t *allow, fr_
 		deny[i].af = AF_UNSPEC;
 	}
 
+	/*
+	 *	The networks don't change, and are checked for every
+	 *	packet, so use the faster lookup table.
+	 */
+	(void) fr_trie_compile(trie, (af == AF_INET) ? 32 : 128);
+
 	return trie;
 }
 
@@ -2922,25 +3372,53 @@ int fr_io_listen_free(fr_listen_t *li)
 	return 0;
 }
 
-int fr_master_io_listen(fr_io_instance_t *inst, fr_schedule_t *sc,
-			size_t default_message_size, size_t num_messages)
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+/** Steer packets to the socket which matches the CPU that received them
+ *
+ * The program is attached to the SO_REUSEPORT group, and returns the
+ * index of the socket in the group.
+ */
+static int master_io_steer_by_cpu(fr_listen_t *li, unsigned int num_shards)
 {
-	fr_listen_t	*li, *child;
-	fr_io_thread_t	*thread;
-
-	/*
-	 *	No IO paths, so we don't initialize them.
-	 */
-	if (!inst->app_io) {
-		fr_assert(!inst->dynamic_clients);
-		return 0;
-	}
-
-	if (!inst->app_io->common.thread_inst_size) {
-		fr_strerror_const("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_shards },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = {
+		.len = NUM_ELEMENTS(code),
+		.filter = code,
+	};
+
+	if (setsockopt(li->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching CPU steering program to %s: %s", li->name, fr_syserror(errno));
 		return -1;
 	}
 
+	return 0;
+}
+#endif
+
+/** Create one listener, and add it to the scheduler
+ *
+ * @param[in] inst			the master IO instance.
+ * @param[in] sc			to add the listener to.
+ * @param[in] default_message_size	for the message ring buffer.
+ * @param[in] num_messages		for the message ring buffer.
+ * @param[in] shard			which network thread the listener is for.
+ * @param[in] num_shards		how many listeners we're opening.  If 1,
+ *					the scheduler picks the network thread.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int master_io_listen_shard(fr_io_instance_t *inst, fr_schedule_t *sc,
+				  size_t default_message_size, size_t num_messages,
+				  unsigned int shard, unsigned int num_shards)
+{
+	fr_listen_t	*li, *child;
+	fr_io_thread_t	*thread;
+
 	/*
 	 *	Build the #fr_listen_t.  This describes the complete
 	 *	path data takes from the socket to the decoder and
@@ -2984,6 +3462,7 @@ int fr_master_io_listen(fr_io_instance_t *inst, fr_schedule_t *sc,
 	 *	Create the trie of clients for this socket.
 	 */
 	MEM(thread->trie = fr_trie_alloc(thread, NULL, NULL));
+	MEM(thread->client_cache = talloc_zero_array(thread, fr_io_client_cache_t, CLIENT_CACHE_SIZE));
 	MEM(thread->alive_clients = fr_heap_alloc(thread, alive_client_cmp,
 						   fr_io_client_t, alive_id, 0));
 
@@ -3046,6 +3525,8 @@ int fr_master_io_listen(fr_io_instance_t *inst, fr_schedule_t *sc,
 	}
 
 	li->fd = child->fd;	/* copy this back up */
+	li->recv_batch = child->recv_batch;
+	li->worker_affinity = child->worker_affinity;
 
 	if (!child->app_io->get_name) {
 		child->name = child->app_io->common.name;
@@ -3055,9 +3536,10 @@ int fr_master_io_listen(fr_io_instance_t *inst, fr_schedule_t *sc,
 	li->name = child->name;
 
 	/*
-	 *	Record which socket we opened.
+	 *	Record which socket we opened.  The other shards
+	 *	share the same address.
 	 */
-	if (child->app_io_addr) {
+	if (child->app_io_addr && (shard == 0)) {
 		fr_listen_t *other;
 
 		other = listen_find_any(thread->child);
@@ -3074,10 +3556,42 @@ int fr_master_io_listen(fr_io_instance_t *inst, fr_schedule_t *sc,
 		(void) listen_record(child);
 	}
 
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+	if (inst->shard_by_cpu && (num_shards > 1) && (shard == 0) &&
+	    (master_io_steer_by_cpu(li, num_shards) < 0)) {
+		PERROR("proto_%s", inst->app_io->common.name);
+		talloc_free(li);
+		return -1;
+	}
+#endif
+
 	/*
 	 *	Add the socket to the scheduler, where it might end up
 	 *	in a different thread.
 	 */
+	if (num_shards > 1) {
+		if (!fr_schedule_listen_add_network(sc, li, shard)) {
+			talloc_free(li);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	/*
+	 *	Other listeners are always added to the first network
+	 *	thread, so the last one is left for us.  With only one
+	 *	network thread, this is the same as the default.
+	 */
+	if (inst->dedicated_network) {
+		if (!fr_schedule_listen_add_network(sc, li, fr_schedule_num_networks(sc) - 1)) {
+			talloc_free(li);
+			return -1;
+		}
+
+		return 0;
+	}
+
 	if (!fr_schedule_listen_add(sc, li)) {
 		talloc_free(li);
 		return -1;
@@ -3086,6 +3600,41 @@ int fr_master_io_listen(fr_io_instance_t *inst, fr_schedule_t *sc,
 	return 0;
 }
 
+int fr_master_io_listen(fr_io_instance_t *inst, fr_schedule_t *sc,
+			size_t default_message_size, size_t num_messages)
+{
+	unsigned int	i, num_shards = 1;
+
+	/*
+	 *	No IO paths, so we don't initialize them.
+	 */
+	if (!inst->app_io) {
+		fr_assert(!inst->dynamic_clients);
+		return 0;
+	}
+
+	if (!inst->app_io->common.thread_inst_size) {
+		fr_strerror_const("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
+		return -1;
+	}
+
+	/*
+	 *	Open one socket per network thread, all bound to the
+	 *	same address with SO_REUSEPORT.  The kernel hashes each
+	 *	packet's addresses and ports to pick a socket, so
+	 *	packets from one client always go to the same network
+	 *	thread.  Each socket has its own client and duplicate
+	 *	detection state, so that state is partitioned, too.
+	 */
+	if (inst->shard_networks) num_shards = fr_schedule_num_networks(sc);
+
+	for (i = 0; i < num_shards; i++) {
+		if (master_io_listen_shard(inst, sc, default_message_size, num_messages, i, num_shards) < 0) return -1;
+	}
+
+	return 0;
+}
+
 /*
  *	Used to create a tracking structure for fr_network_sendto_worker()
  */
@@ -3110,7 +3659,7 @@ fr_io_track_t *fr_master_io_track_alloc(fr_listen_t *li, fr_client_t *radclient,
 	if (unlikely(!thread)) return NULL;
 	fr_assert(thread->trie != NULL);
 
-	client = fr_trie_lookup_by_key(thread->trie, &src_ipaddr->addr, src_ipaddr->prefix);
+	client = client_lookup(thread, src_ipaddr);
 	if (!client) {
 		MEM(client = client_alloc(thread, PR_CLIENT_STATIC, inst, thread, radclient, NULL));
 	}
@@ -3142,10 +3691,12 @@ fr_app_io_t fr_master_app_io = {
 
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.inject			= mod_inject,
 
 	.open			= mod_open,
 	.close			= mod_close,
 	.event_list_set		= mod_event_list_set,
 	.get_name		= mod_name,
+	.stats_print		= mod_stats_print,
 };
@@ -54,6 +54,7 @@ typedef struct fr_io_track_s {
 	fr_io_address_t const  		*address;	//!< of this packet.. shared between multiple packets
 	fr_io_client_t			*client;	//!< client handling this packet.
 	uint8_t				*packet;	//!< really a tracking structure, not a packet
+	uint32_t			hash;		//!< of the tracking structure, for flat tracking tables.
 } fr_io_track_t;
 
 /** The master IO instance
@@ -82,9 +83,18 @@ typedef struct {
 	fr_time_delta_t			cleanup_delay;			//!< for Access-Request packets
 	fr_time_delta_t			idle_timeout;			//!< for dynamic clients
 	fr_time_delta_t			nak_lifetime;			//!< lifetime of NAKed clients
+	fr_time_delta_t			max_nak_lifetime;		//!< NAKed clients which keep sending packets
+									///< have their lifetime doubled, up to this.
 	fr_time_delta_t			check_interval;			//!< polling for closed sockets
 
 	bool				dynamic_clients;		//!< do we have dynamic clients.
+	bool				shard_networks;			//!< open one socket per network thread.
+	bool				shard_by_cpu;			//!< steer packets to the socket for the
+									///< receiving CPU.
+	bool				dedicated_network;		//!< put the socket on the last network thread,
+									///< away from the other listeners.
+	bool				flat_tracking;			//!< use open-addressed tables for duplicate
+									///< detection, instead of rbtrees.
 
 	CONF_SECTION			*server_cs;			//!< server CS for this listener
 
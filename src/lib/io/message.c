@@ -113,6 +113,29 @@ struct fr_message_set_s {
 	fr_ring_buffer_t	*rb_array[MSG_ARRAY_SIZE]; //!< array of ring buffers
 };
 
+/*
+ *	Set once at startup, before any threads are created.
+ */
+static bool message_set_huge_pages = false;
+
+/** Back the ring buffers of new message sets with huge pages
+ *
+ * Must be called before any message sets are created.
+ *
+ * @param[in] enable	whether to use huge pages.
+ */
+void fr_message_set_huge_pages(bool enable)
+{
+	message_set_huge_pages = enable;
+}
+
+static inline fr_ring_buffer_t *message_ring_buffer_create(fr_message_set_t *ms, size_t size)
+{
+	if (message_set_huge_pages) return fr_ring_buffer_create_huge(ms, size);
+
+	return fr_ring_buffer_create(ms, size);
+}
+
 
 /** Create a message set
  *
@@ -157,14 +180,14 @@ fr_message_set_t *fr_message_set_create(TALLOC_CTX *ctx, int num_messages, size_
 	CACHE_ALIGN(message_size);
 	ms->message_size = message_size;
 
-	ms->rb_array[0] = fr_ring_buffer_create(ms, ring_buffer_size);
+	ms->rb_array[0] = message_ring_buffer_create(ms, ring_buffer_size);
 	if (!ms->rb_array[0]) {
 		talloc_free(ms);
 		return NULL;
 	}
 	ms->rb_max = 0;
 
-	ms->mr_array[0] = fr_ring_buffer_create(ms, num_messages * message_size);
+	ms->mr_array[0] = message_ring_buffer_create(ms, num_messages * message_size);
 	if (!ms->mr_array[0]) {
 		talloc_free(ms);
 		return NULL;
@@ -752,7 +775,7 @@ static fr_message_t *fr_message_get_message(fr_message_set_t *ms, bool *p_cleane
 	 *	Allocate another message ring, double the size
 	 *	of the previous maximum.
 	 */
-	mr = fr_ring_buffer_create(ms, fr_ring_buffer_size(ms->mr_array[ms->mr_max]) * 2);
+	mr = message_ring_buffer_create(ms, fr_ring_buffer_size(ms->mr_array[ms->mr_max]) * 2);
 	if (!mr) {
 		fr_strerror_const_push("Failed allocating ring buffer");
 		return NULL;
@@ -875,7 +898,7 @@ alloc_rb:
 	 *	Allocate another message ring, double the size
 	 *	of the previous maximum.
 	 */
-	rb = fr_ring_buffer_create(ms, fr_ring_buffer_size(ms->rb_array[ms->rb_max]) * 2);
+	rb = message_ring_buffer_create(ms, fr_ring_buffer_size(ms->rb_array[ms->rb_max]) * 2);
 	if (!rb) {
 		fr_strerror_const_push("Failed allocating ring buffer");
 		goto cleanup;
@@ -1254,6 +1277,29 @@ void fr_message_set_gc(fr_message_set_t *ms)
 	fr_message_gc(ms, 1 << 24);
 }
 
+/** What kind of pages back the message set
+ *
+ * @param[in] ms the message set
+ * @return the smallest kind of page used by any of its ring buffers.
+ */
+fr_ring_buffer_pages_t fr_message_set_pages(fr_message_set_t *ms)
+{
+	int			i;
+	fr_ring_buffer_pages_t	pages = FR_RING_BUFFER_PAGES_HUGETLB;
+
+	(void) talloc_get_type_abort(ms, fr_message_set_t);
+
+	for (i = 0; i <= ms->mr_max; i++) {
+		if (fr_ring_buffer_pages(ms->mr_array[i]) < pages) pages = fr_ring_buffer_pages(ms->mr_array[i]);
+	}
+
+	for (i = 0; i <= ms->rb_max; i++) {
+		if (fr_ring_buffer_pages(ms->rb_array[i]) < pages) pages = fr_ring_buffer_pages(ms->rb_array[i]);
+	}
+
+	return pages;
+}
+
 /** Print debug information about the message set.
  *
  * @param[in] ms the message set
@@ -1271,12 +1317,14 @@ void fr_message_set_debug(fr_message_set_t *ms, FILE *fp)
 	for (i = 0; i <= ms->mr_max; i++) {
 		fr_ring_buffer_t *mr = ms->mr_array[i];
 
-		fprintf(fp, "messages[%d] =\tsize %zu, used %zu\n",
-			i, fr_ring_buffer_size(mr), fr_ring_buffer_used(mr));
+		fprintf(fp, "messages[%d] =\tsize %zu, used %zu, pages %s\n",
+			i, fr_ring_buffer_size(mr), fr_ring_buffer_used(mr),
+			fr_table_str_by_value(fr_ring_buffer_pages_table, fr_ring_buffer_pages(mr), "<INVALID>"));
 	}
 
 	for (i = 0; i <= ms->rb_max; i++) {
-		fprintf(fp, "ring buffer[%d] =\tsize %zu, used %zu\n",
-			i, fr_ring_buffer_size(ms->rb_array[i]), fr_ring_buffer_used(ms->rb_array[i]));
+		fprintf(fp, "ring buffer[%d] =\tsize %zu, used %zu, pages %s\n",
+			i, fr_ring_buffer_size(ms->rb_array[i]), fr_ring_buffer_used(ms->rb_array[i]),
+			fr_table_str_by_value(fr_ring_buffer_pages_table, fr_ring_buffer_pages(ms->rb_array[i]), "<INVALID>"));
 	}
 }
@@ -66,6 +66,9 @@ void fr_message_set_gc(fr_message_set_t *ms) CC_HINT(nonnull);
 
 void fr_message_set_debug(fr_message_set_t *ms, FILE *fp) CC_HINT(nonnull);
 
+void fr_message_set_huge_pages(bool enable);
+fr_ring_buffer_pages_t fr_message_set_pages(fr_message_set_t *ms) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
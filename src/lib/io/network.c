@@ -34,7 +34,9 @@ RCSID("$Id$")
 #include <freeradius-devel/util/rb.h>
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/probe.h>
 #include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/trace_ring.h>
 
 #include <freeradius-devel/io/channel.h>
 #include <freeradius-devel/io/control.h>
@@ -43,9 +45,18 @@ RCSID("$Id$")
 #include <freeradius-devel/io/queue.h>
 #include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/io/worker.h>
+#include <freeradius-devel/server/memory.h>
+#include <freeradius-devel/server/metrics.h>
 
 #define MAX_WORKERS 64
 
+/*
+ *	The maximum number of requests buffered for a worker before they're
+ *	sent to it.  Requests are also sent at the end of each event loop
+ *	iteration.
+ */
+#define MAX_BATCH 32
+
 static _Thread_local fr_ring_buffer_t *fr_network_rb;
 
 typedef struct {
@@ -64,10 +75,15 @@ typedef struct {
 	fr_time_delta_t		predicted;		//!< predicted processing time for one packet
 
 	bool			blocked;		//!< is this worker blocked?
+	bool			draining;		//!< no new requests are sent, and the channel
+							///< is closed once the outstanding ones are done.
 
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
 	fr_io_stats_t		stats;
+
+	fr_channel_data_t	*batch[MAX_BATCH];	//!< requests waiting to be sent to the worker
+	unsigned int		num_batched;		//!< how many requests are waiting
 } fr_network_worker_t;
 
 typedef struct {
@@ -91,8 +107,11 @@ typedef struct {
 	size_t			leftover;		//!< leftover data from a previous read
 	size_t			written;		//!< however much we did in a partial write
 
+	fr_event_timer_t const	*ev_read;		//!< to finish reading a batch of datagrams
+
 	fr_channel_data_t	*pending;		//!< the currently pending partial packet
 	fr_heap_t		*waiting;		//!< packets waiting to be written
+	fr_dlist_t		write_entry;		//!< in the list of sockets with replies to write
 	fr_io_stats_t		stats;
 } fr_network_socket_t;
 
@@ -115,6 +134,8 @@ struct fr_network_s {
 	pthread_t		thread_id;		//!< for self
 
 	bool			suspended;		//!< whether or not we're suspended.
+	bool			paused;			//!< another process has taken over our sockets,
+							///< so we never read from them again.
 
 	fr_log_t const		*log;			//!< log destination
 	fr_log_lvl_t		lvl;			//!< debug log level
@@ -128,6 +149,7 @@ struct fr_network_s {
 	fr_event_list_t		*el;			//!< our event list
 
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
+	fr_dlist_head_t		write_sockets;		//!< sockets with replies waiting to be written
 
 	fr_io_stats_t		stats;
 
@@ -146,13 +168,25 @@ struct fr_network_s {
 	bool			exiting;		//!< are we exiting?
 
 	fr_network_config_t	config;			//!< configuration
+
+	fr_time_t		queue_delay_above;	//!< When the worker queue delay went above the target.
+							///< 0 if it's below the target.
+	fr_time_t		shed_until;		//!< Shed low priority packets until this time.
 	fr_network_worker_t	*workers[MAX_WORKERS]; 	//!< each worker
+	fr_network_worker_t	*draining[MAX_WORKERS];	//!< workers being removed
+	int			num_draining;		//!< number of workers being removed
+	int			num_batched_workers;	//!< how many workers have requests waiting to be sent
+
+	fr_metrics_source_t	*metrics;		//!< our entry in the metrics registry.
 };
 
 static void fr_network_post_event(fr_event_list_t *el, fr_time_t now, void *uctx);
 static int fr_network_pre_event(fr_time_t now, fr_time_delta_t wake, void *uctx);
 static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s);
 static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int flags, void *ctx);
+static void fr_network_read_batch(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx);
+static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd, uint32_t affinity);
+static void fr_network_send_batches(fr_network_t *nr);
 
 static int8_t reply_cmp(void const *one, void const *two)
 {
@@ -303,6 +337,47 @@ int fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker)
 	return fr_control_message_send(nr->control, rb, FR_CONTROL_ID_WORKER, &worker, sizeof(worker));
 }
 
+/** Remove a worker from a network
+ *
+ * The network stops sending new requests to the worker.  Once all of
+ * the requests it has already sent have been answered, it closes the
+ * channel.  When all of its channels are closed, the worker exits.
+ *
+ * @param nr the network
+ * @param worker the worker
+ */
+int fr_network_worker_remove(fr_network_t *nr, fr_worker_t *worker)
+{
+	fr_ring_buffer_t *rb;
+
+	rb = fr_network_rb_init();
+	if (!rb) return -1;
+
+	(void) talloc_get_type_abort(nr, fr_network_t);
+	(void) talloc_get_type_abort(worker, fr_worker_t);
+
+	return fr_control_message_send(nr->control, rb, FR_CONTROL_ID_WORKER_REMOVE, &worker, sizeof(worker));
+}
+
+/** Stop reading from all of the network's sockets
+ *
+ * This is used when another process has taken over our listeners.
+ * Replies to the requests we've already read are still sent.
+ *
+ * @param nr the network
+ */
+int fr_network_pause(fr_network_t *nr)
+{
+	fr_ring_buffer_t *rb;
+
+	rb = fr_network_rb_init();
+	if (!rb) return -1;
+
+	(void) talloc_get_type_abort(nr, fr_network_t);
+
+	return fr_control_message_send(nr->control, rb, FR_CONTROL_ID_PAUSE, &nr, sizeof(nr));
+}
+
 /** Signal the network to read from a listener
  *
  * @param nr the network
@@ -451,7 +526,7 @@ static void fr_network_unsuspend(fr_network_t *nr)
 	fr_rb_iter_inorder_t	iter;
 	fr_network_socket_t	*s;
 
-	if (!nr->suspended) return;
+	if (!nr->suspended || nr->paused) return;
 
 	for (s = fr_rb_iter_init_inorder(&iter, nr->sockets);
 	     s != NULL;
@@ -464,6 +539,45 @@ static void fr_network_unsuspend(fr_network_t *nr)
 #define IALPHA (8)
 #define RTT(_old, _new) fr_time_delta_wrap((fr_time_delta_unwrap(_new) + (fr_time_delta_unwrap(_old) * (IALPHA - 1))) / IALPHA)
 
+/** Track how long the workers are queueing requests for
+ *
+ * This is the CoDel approach.  A short burst of requests can have a
+ * large queue delay, which is fine.  But if every request is delayed
+ * by more than the target for a whole interval, then the workers are
+ * overloaded.  We then shed low priority packets, until a request is
+ * seen with a queue delay below the target.
+ *
+ * Shedding also stops if we receive no replies for an interval.
+ */
+static void fr_network_queue_delay_update(fr_network_t *nr, fr_time_delta_t queue_time)
+{
+	fr_time_t now;
+
+	if (fr_time_delta_lt(queue_time, nr->config.queue_delay_target)) {
+		if (fr_time_gt(nr->shed_until, fr_time_wrap(0))) {
+			INFO("Worker queue delay is below %pV, no longer shedding low priority packets",
+			     fr_box_time_delta(nr->config.queue_delay_target));
+		}
+		nr->queue_delay_above = fr_time_wrap(0);
+		nr->shed_until = fr_time_wrap(0);
+		return;
+	}
+
+	now = fr_time();
+	if (fr_time_eq(nr->queue_delay_above, fr_time_wrap(0))) {
+		nr->queue_delay_above = now;
+		return;
+	}
+
+	if (fr_time_delta_lt(fr_time_sub(now, nr->queue_delay_above), nr->config.queue_delay_interval)) return;
+
+	if (fr_time_eq(nr->shed_until, fr_time_wrap(0))) {
+		RATE_LIMIT_GLOBAL(WARN, "Worker queue delay %pV is above %pV, shedding low priority packets",
+				  fr_box_time_delta(queue_time), fr_box_time_delta(nr->config.queue_delay_target));
+	}
+	nr->shed_until = fr_time_add(now, nr->config.queue_delay_interval);
+}
+
 /** Callback which handles a message being received on the network side.
  *
  * @param[in] ctx the network
@@ -489,6 +603,8 @@ static void fr_network_recv_reply(void *ctx, fr_channel_t *ch, fr_channel_data_t
 		worker->predicted = RTT(worker->predicted, cd->reply.processing_time);
 	}
 
+	if (fr_time_delta_ispos(nr->config.queue_delay_target)) fr_network_queue_delay_update(nr, cd->reply.queue_time);
+
 	/*
 	 *	Unblock the worker.
 	 */
@@ -508,6 +624,28 @@ static void fr_network_recv_reply(void *ctx, fr_channel_t *ch, fr_channel_data_t
 	}
 }
 
+/** Drop a request which was accepted for sending, but couldn't be sent
+ *
+ */
+static void fr_network_drop_request(fr_network_t *nr, fr_channel_data_t *cd)
+{
+	fr_network_socket_t *s;
+
+	s = fr_rb_find(nr->sockets, &(fr_network_socket_t){ .listen = cd->listen });
+
+	talloc_free(cd->packet_ctx);
+	fr_message_done(&cd->m);
+	nr->stats.dropped++;
+
+	if (!s) return;
+
+	s->stats.dropped++;
+	fr_assert(s->outstanding > 0);
+	s->outstanding--;
+
+	if (s->dead && !s->outstanding) talloc_free(s);
+}
+
 /** Handle a network control message callback for a channel
  *
  * This is called from the event loop when we get a notification
@@ -556,20 +694,45 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 								   fr_network_worker_t);
 		int			i;
 
+		/*
+		 *	Requests can't be sent to it any more.
+		 */
+		if (w->num_batched) {
+			unsigned int j;
+
+			for (j = 0; j < w->num_batched; j++) fr_network_drop_request(nr, w->batch[j]);
+			w->num_batched = 0;
+			nr->num_batched_workers--;
+		}
+
+		DEBUG3("Worker acked our close request");
+
+		/*
+		 *	Workers which are being removed have already
+		 *	been taken out of the array.
+		 */
+		if (w->draining) {
+			for (i = 0; i < nr->num_draining; i++) {
+				if (nr->draining[i] != w) continue;
+
+				nr->draining[i] = nr->draining[--nr->num_draining];
+				nr->draining[nr->num_draining] = NULL;
+				break;
+			}
+			break;
+		}
+
 		/*
 		 *	Remove this worker from the array
 		 */
 		for (i = 0; i < nr->num_workers; i++) {
-			DEBUG3("Worker acked our close request");
 			if (nr->workers[i] == w) {
-				nr->workers[i] = NULL;
-
-				if (i == (nr->num_workers - 1)) break;
-
 				/*
 				 *	Close the hole...
 				 */
-				memcpy(&nr->workers[i], &nr->workers[i + 1], ((nr->num_workers - i) - 1));
+				memmove(&nr->workers[i], &nr->workers[i + 1],
+					((nr->num_workers - i) - 1) * sizeof(nr->workers[0]));
+				nr->workers[nr->num_workers - 1] = NULL;
 				break;
 			}
 		}
@@ -581,18 +744,117 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 
 #define OUTSTANDING(_x) ((_x)->stats.in - (_x)->stats.out)
 
+/** Close the channels to workers which are being removed, once they're idle
+ *
+ * Replies point into the worker's message set, which it frees when the
+ * channel closes.  So we wait until every reply has been received, and
+ * written to its socket.
+ */
+static void fr_network_drain_check(fr_network_t *nr)
+{
+	int			i;
+	fr_rb_iter_inorder_t	iter;
+	fr_network_socket_t	*s;
+
+	for (s = fr_rb_iter_init_inorder(&iter, nr->sockets);
+	     s != NULL;
+	     s = fr_rb_iter_next_inorder(&iter)) {
+		if (s->pending || (fr_heap_num_elements(s->waiting) > 0)) return;
+	}
+
+	for (i = 0; i < nr->num_draining; i++) {
+		fr_network_worker_t *w = nr->draining[i];
+
+		if (OUTSTANDING(w) > 0) continue;
+
+		DEBUG2("Closing channel to removed worker");
+		fr_channel_signal_responder_close(w->channel);
+	}
+}
+
+/** Send the requests waiting for a worker
+ *
+ * If the worker's queue is full, the worker is marked as blocked,
+ * and the requests which couldn't be sent are given to other workers.
+ * They're only dropped if no other worker can take them.
+ *
+ * @param nr the network
+ * @param worker to send the requests to.
+ */
+static void fr_network_send_batch(fr_network_t *nr, fr_network_worker_t *worker)
+{
+	fr_channel_data_t	*unsent[MAX_BATCH];
+	size_t			sent, num, i;
+
+	num = worker->num_batched;
+	worker->num_batched = 0;
+	nr->num_batched_workers--;
+
+	/*
+	 *	If we fail, the only reason is that the worker isn't
+	 *	servicing its input queue.  When that happens, we
+	 *	have no idea what to do, and the whole thing falls over.
+	 */
+	sent = fr_channel_send_request_n(worker->channel, worker->batch, num);
+	if (sent == num) return;
+
+	worker->stats.in -= (num - sent);
+	if (!worker->blocked) {
+		worker->blocked = true;
+		nr->num_blocked++;
+	}
+
+	RATE_LIMIT_GLOBAL(PERROR, "Failed sending %zu packet(s) to worker - %u/%u workers are blocked",
+			  num - sent, nr->num_blocked, nr->num_workers);
+
+	if (nr->num_blocked == nr->num_workers) fr_network_suspend(nr);
+
+	/*
+	 *	Sending a request may flush another worker's batch,
+	 *	which can fail and get here again.  So work from a
+	 *	copy of the requests which weren't sent.
+	 */
+	num -= sent;
+	memcpy(unsent, &worker->batch[sent], num * sizeof(unsent[0]));
+
+	for (i = 0; i < num; i++) {
+		/*
+		 *	The other worker's batch may already have newer
+		 *	requests in it, and messages on a channel must be
+		 *	in time order.  So the request is stamped with
+		 *	the time it's re-queued.
+		 */
+		unsent[i]->m.when = fr_time();
+
+		if (fr_network_send_request(nr, unsent[i], 0) < 0) fr_network_drop_request(nr, unsent[i]);
+	}
+}
+
 /** Send a message on the "best" channel.
  *
  * @param nr the network
  * @param cd the message we've received
+ * @param affinity of the message, or 0 for "any worker".
  */
-static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
+static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd, uint32_t affinity)
 {
 	fr_network_worker_t *worker;
 
 	(void) talloc_get_type_abort(nr, fr_network_t);
 
 retry:
+	/*
+	 *	Messages with the same affinity go to the same worker,
+	 *	so long as it isn't blocked or overloaded.  Otherwise
+	 *	we pick a worker as usual.
+	 */
+	if (affinity && (nr->num_workers > 1)) {
+		worker = nr->workers[affinity % nr->num_workers];
+
+		if (!worker->blocked &&
+		    (!nr->config.max_outstanding || (OUTSTANDING(worker) < nr->config.max_outstanding))) goto send;
+	}
+
 	if (nr->num_workers == 1) {
 		worker = nr->workers[0];
 		if (worker->blocked) {
@@ -696,28 +958,27 @@ retry:
 		goto drop;
 	}
 
+send:
+	FR_PROBE(network_send_request, cd->listen->fd, cd->m.data_size, OUTSTANDING(worker));
+
 	/*
-	 *	Send the message to the channel.  If we fail, drop the
-	 *	packet.  The only reason for failure is that the
-	 *	worker isn't servicing it's input queue.  When that
-	 *	happens, we have no idea what to do, and the whole
-	 *	thing falls over.
+	 *	Add the message to the worker's batch.  The batch is
+	 *	sent when it's full, or at the end of this event loop
+	 *	iteration, so that all of the packets we read in one
+	 *	go are passed to the worker with one push, and at
+	 *	most one signal.
+	 *
+	 *	If the batch is already full, send it first.  If that
+	 *	fails, the worker is blocked, and we pick another one.
 	 */
-	if (fr_channel_send_request(worker->channel, cd) < 0) {
-		worker->stats.dropped++;
-		worker->blocked = true;
-		nr->num_blocked++;
-
-		RATE_LIMIT_GLOBAL(PERROR, "Failed sending packet to worker - %u/%u workers are blocked",
-				  nr->num_blocked, nr->num_workers);
-
-		if (nr->num_blocked == nr->num_workers) {
-			fr_network_suspend(nr);
-			return -1;
-		}
-		goto retry;
+	if (worker->num_batched == MAX_BATCH) {
+		fr_network_send_batch(nr, worker);
+		if (worker->blocked) goto retry;
 	}
 
+	if (!worker->num_batched) nr->num_batched_workers++;
+	worker->batch[worker->num_batched++] = cd;
+
 	worker->stats.in++;
 
 	/*
@@ -731,6 +992,32 @@ retry:
 	return 0;
 }
 
+/** Send the requests waiting for all workers
+ *
+ */
+static void fr_network_send_batches(fr_network_t *nr)
+{
+	int	i;
+	bool	flushed;
+
+	/*
+	 *	Requests which a blocked worker couldn't take are
+	 *	added to the batches of other workers, which we may
+	 *	already have sent.  So go round again until nothing
+	 *	is left to send.
+	 */
+	do {
+		flushed = false;
+
+		for (i = 0; (i < nr->num_workers) && (nr->num_batched_workers > 0); i++) {
+			if (!nr->workers[i]->num_batched) continue;
+
+			fr_network_send_batch(nr, nr->workers[i]);
+			flushed = true;
+		}
+	} while (flushed && (nr->num_batched_workers > 0));
+}
+
 
 /** Send a packet to the worker.
  *
@@ -769,7 +1056,7 @@ int fr_network_listen_send_packet(fr_network_t *nr, fr_listen_t *parent, fr_list
 	memcpy(cd->m.data, buffer, buflen);
 	cd->m.when = fr_time();
 
-	if (fr_network_send_request(nr, cd) < 0) {
+	if (fr_network_send_request(nr, cd, 0) < 0) {
 		talloc_free(cd->packet_ctx);
 		fr_message_done(&cd->m);
 		nr->stats.dropped++;
@@ -811,6 +1098,12 @@ static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s)
 
 	if (s->dead) return;
 
+	/*
+	 *	Send any requests for this socket before the workers
+	 *	are told to cancel its requests.
+	 */
+	fr_network_send_batches(nr);
+
 	s->dead = true;
 
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
@@ -822,6 +1115,10 @@ static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s)
 		(void) fr_worker_listen_cancel(nr->workers[i]->worker, s->listen);
 	}
 
+	for (i = 0; i < nr->num_draining; i++) {
+		(void) fr_worker_listen_cancel(nr->draining[i]->worker, s->listen);
+	}
+
 	/*
 	 *	If there are no outstanding packets, then we can free
 	 *	it now.
@@ -853,6 +1150,8 @@ static void fr_network_read(UNUSED fr_event_list_t *el, int sockfd, UNUSED int f
 	fr_network_t		*nr = s->nr;
 	ssize_t			data_size;
 	fr_channel_data_t	*cd, *next;
+	uint32_t		affinity;
+	bool			batch = (s->listen->recv_batch > 1);
 
 	if (!fr_cond_assert_msg(s->listen->fd == sockfd, "Expected listen->fd (%u) to be equal event fd (%u)",
 				s->listen->fd, sockfd)) return;
@@ -878,13 +1177,19 @@ next_message:
 	 *	Poll this socket, but not too often.  We have to go
 	 *	service other sockets, too.
 	 */
-	if (num_messages > 16) {
+	if (!batch && (num_messages > 16)) {
 		s->cd = cd;
 		return;
 	}
 
 	cd->priority = PRIORITY_NORMAL;
 
+	/*
+	 *	So that we can tell "no more data" apart from "the
+	 *	packet was discarded" for batched reads.
+	 */
+	errno = 0;
+
 	/*
 	 *	Read data from the network.
 	 *
@@ -910,6 +1215,13 @@ next_message:
 		 *	blocking issues can happen for stream sockets.
 		 */
 		s->cd = cd;
+
+		/*
+		 *	The packet was discarded by the app_io, but
+		 *	there may still be more datagrams in the
+		 *	batch.  Keep reading them.
+		 */
+		if (batch && (errno != EWOULDBLOCK) && (errno != EAGAIN)) goto next_datagram;
 		return;
 	}
 
@@ -924,6 +1236,8 @@ next_message:
 	s->cd = NULL;
 
 	DEBUG3("Read %zd byte(s) from FD %u", data_size, sockfd);
+	FR_PROBE(network_read, sockfd, data_size);
+	fr_trace_ring_event(FR_TRACE_PACKET_RECEIVED, 0, NULL, sockfd, (uint32_t) data_size);
 	nr->stats.in++;
 	s->stats.in++;
 
@@ -985,7 +1299,33 @@ next_message:
 		cd->priority = priority;
 	}
 
-	if (fr_network_send_request(nr, cd) < 0) {
+	/*
+	 *	The workers are overloaded.  Drop low priority
+	 *	packets here, so that they don't delay the more
+	 *	important ones.
+	 */
+	if ((cd->priority < PRIORITY_NORMAL) && fr_time_gt(nr->shed_until, fr_time_wrap(0))) {
+		if (fr_time_lt(cd->m.when, nr->shed_until)) goto discard;
+
+		nr->queue_delay_above = fr_time_wrap(0);
+		nr->shed_until = fr_time_wrap(0);
+	}
+
+	/*
+	 *	Keep all of the packets from a connection on one
+	 *	worker, so that they're processed in order, and any
+	 *	per-connection data stays in one worker's cache.
+	 *	Sockets are numbered sequentially, so connections are
+	 *	spread evenly across the workers.
+	 */
+	if (s->listen->worker_affinity && s->listen->connected) {
+		affinity = ((uint32_t) s->number) + 1;
+
+	} else {
+		affinity = s->listen->app->affinity ? s->listen->app->affinity(s->listen->app_instance, cd->m.data, data_size) : 0;
+	}
+
+	if (fr_network_send_request(nr, cd, affinity) < 0) {
 	discard:
 		talloc_free(cd->packet_ctx); /* not sure what else to do here */
 		fr_message_done(&cd->m);
@@ -1012,6 +1352,53 @@ next_message:
 		num_messages++;
 		goto next_message;
 	}
+
+	if (!batch) return;
+
+	/*
+	 *	Datagram sockets which read packets in batches are
+	 *	read until they're empty.  This avoids going back
+	 *	through the event loop for every packet.
+	 */
+	cd = (fr_channel_data_t *) fr_message_reserve(s->ms, s->listen->default_message_size);
+	if (!cd) {
+		ERROR("Failed allocating message size %zd! - Closing socket",
+		      s->listen->default_message_size);
+		fr_network_socket_dead(nr, s);
+		return;
+	}
+
+next_datagram:
+	/*
+	 *	We've read a full batch.  Go service other sockets,
+	 *	and then come back to read any datagrams which are
+	 *	still in the app_io's batch.  The kernel won't tell
+	 *	us about those, as they've already been read from
+	 *	the socket.
+	 */
+	if (++num_messages >= (int) s->listen->recv_batch) {
+		s->cd = cd;
+
+		if (fr_event_timer_in(s, nr->el, &s->ev_read, fr_time_delta_wrap(0),
+				      fr_network_read_batch, s) < 0) {
+			PERROR("Failed inserting batch read timer");
+		}
+		return;
+	}
+
+	goto next_message;
+}
+
+/** Finish reading a batch of datagrams
+ *
+ */
+static void fr_network_read_batch(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_network_socket_t	*s = talloc_get_type_abort(uctx, fr_network_socket_t);
+
+	if (s->dead) return;
+
+	fr_network_read(s->nr->el, s->listen->fd, 0, s);
 }
 
 int fr_network_sendto_worker(fr_network_t *nr, fr_listen_t *li, void *packet_ctx, uint8_t const *data, size_t data_len, fr_time_t recv_time)
@@ -1035,7 +1422,7 @@ int fr_network_sendto_worker(fr_network_t *nr, fr_listen_t *li, void *packet_ctx
 
 	memcpy(cd->m.data, data, data_len);
 
-	if (fr_network_send_request(nr, cd) < 0) {
+	if (fr_network_send_request(nr, cd, 0) < 0) {
 		talloc_free(packet_ctx);
 		fr_message_done(&cd->m);
 		nr->stats.dropped++;
@@ -1115,6 +1502,23 @@ static fr_event_update_t const resume_write[] = {
 };
 
 
+/** Tell the app_io to write any packets it has queued
+ *
+ */
+static inline void fr_network_flush(fr_network_socket_t *s)
+{
+	fr_listen_t *li = s->listen;
+	fr_network_t *nr = s->nr;
+
+	if (!li->app_io->flush) return;
+
+	/*
+	 *	A failure to write queued datagrams loses those
+	 *	packets, but the socket is still usable.
+	 */
+	if (li->app_io->flush(li) < 0) PERROR("Failed flushing socket %s", li->name);
+}
+
 /** Write packets to the network.
  *
  * @param el the event list
@@ -1191,6 +1595,7 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 				}
 
 				s->pending = cd;
+				fr_network_flush(s);
 				return;
 			}
 
@@ -1235,6 +1640,8 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		cd = fr_heap_pop(&s->waiting);
 	}
 
+	fr_network_flush(s);
+
 	/*
 	 *	We've successfully written all of the packets.  Remove
 	 *	the write callback.
@@ -1257,6 +1664,8 @@ static int _network_socket_free(fr_network_socket_t *s)
 	fr_rb_delete(nr->sockets, s);
 	fr_rb_delete(nr->sockets_by_num, s);
 
+	if (fr_dlist_entry_in_list(&s->write_entry)) fr_dlist_remove(&nr->write_sockets, s);
+
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
 
 	if (s->listen->app_io->close) {
@@ -1370,6 +1779,11 @@ static int fr_network_listen_add_self(fr_network_t *nr, fr_listen_t *li)
 		return -1;
 	}
 
+	if (fr_message_set_pages(s->ms) != FR_RING_BUFFER_PAGES_NORMAL) {
+		DEBUG2("Message buffers for %s are backed by %s pages", s->listen->name,
+		       fr_table_str_by_value(fr_ring_buffer_pages_table, fr_message_set_pages(s->ms), "<INVALID>"));
+	}
+
 	app_io = s->listen->app_io;
 	s->filter = FR_EVENT_FILTER_IO;
 
@@ -1532,6 +1946,81 @@ static void fr_network_worker_started_callback(void *ctx, void const *data, size
 	fr_assert(0 == 1);
 }
 
+/** Handle a control message asking us to stop using a worker
+ *
+ * @param[in] ctx the network
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_network_worker_remove_callback(void *ctx, void const *data, size_t data_size, UNUSED fr_time_t now)
+{
+	int i;
+	fr_network_t *nr = ctx;
+	fr_worker_t *worker;
+	fr_network_worker_t *w = NULL;
+
+	fr_assert(data_size == sizeof(worker));
+
+	memcpy(&worker, data, data_size);
+	(void) talloc_get_type_abort(worker, fr_worker_t);
+
+	for (i = 0; i < nr->num_workers; i++) {
+		if (nr->workers[i]->worker == worker) {
+			w = nr->workers[i];
+			break;
+		}
+	}
+	if (!w) return;
+
+	/*
+	 *	We always need somewhere to send requests.
+	 */
+	if (nr->num_workers == 1) {
+		ERROR("Refusing to remove our last worker");
+		return;
+	}
+
+	/*
+	 *	Requests we've already accepted for this worker still
+	 *	go to it.  New ones go to the other workers.
+	 */
+	if (w->num_batched) fr_network_send_batch(nr, w);
+
+	if (w->blocked) {
+		w->blocked = false;
+		nr->num_blocked--;
+	}
+
+	memmove(&nr->workers[i], &nr->workers[i + 1], ((nr->num_workers - i) - 1) * sizeof(nr->workers[0]));
+	nr->workers[--nr->num_workers] = NULL;
+
+	w->draining = true;
+	nr->draining[nr->num_draining++] = w;
+
+	DEBUG2("Removing worker, waiting for %" PRIu64 " outstanding request(s)", OUTSTANDING(w));
+
+	fr_network_drain_check(nr);
+	if (nr->num_blocked < nr->num_workers) fr_network_unsuspend(nr);
+}
+
+/** Handle a control message telling us to stop reading
+ *
+ * @param[in] ctx the network
+ * @param[in] data the message
+ * @param[in] data_size size of the data
+ * @param[in] now the current time
+ */
+static void fr_network_pause_callback(void *ctx, UNUSED void const *data, UNUSED size_t data_size, UNUSED fr_time_t now)
+{
+	fr_network_t *nr = ctx;
+
+	DEBUG2("No longer reading from sockets");
+
+	fr_network_suspend(nr);
+	nr->paused = true;
+}
+
 /** Handle a network control message callback for a packet sent to a socket
  *
  * @param[in] ctx the network
@@ -1581,6 +2070,8 @@ static int fr_network_pre_event(UNUSED fr_time_t now, UNUSED fr_time_delta_t wak
 
 	if (fr_heap_num_elements(nr->replies) > 0) return 1;
 
+	if (nr->num_batched_workers > 0) return 1;
+
 	return 0;
 }
 
@@ -1593,15 +2084,22 @@ static int fr_network_pre_event(UNUSED fr_time_t now, UNUSED fr_time_delta_t wak
 static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
 {
 	fr_channel_data_t *cd;
+	fr_network_socket_t *s;
 	fr_network_t *nr = talloc_get_type_abort(uctx, fr_network_t);
 
+	fr_memory_thread_sample();
+
+	/*
+	 *	Send the requests we've read in this iteration.
+	 */
+	fr_network_send_batches(nr);
+
 	/*
 	 *	Pull the replies off of our global heap, and try to
 	 *	push them to the individual sockets.
 	 */
 	while ((cd = fr_heap_pop(&nr->replies)) != NULL) {
 		fr_listen_t *li;
-		fr_network_socket_t *s;
 
 		li = cd->listen;
 
@@ -1647,18 +2145,28 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 			continue;
 		}
 
+		(void) fr_heap_insert(&s->waiting, cd);
+
 		/*
-		 *	No pending message, let's try writing it.
-		 *
 		 *	If there is a pending message, then we're
-		 *	waiting for IO write to become ready.
+		 *	waiting for IO write to become ready, and the
+		 *	write callback will send this one, too.
+		 *
+		 *	Otherwise, remember the socket, so that all of
+		 *	its replies are written at once.  This lets the
+		 *	app_io coalesce them into fewer system calls.
 		 */
-		if (!s->pending) {
+		if (!s->pending && !fr_dlist_entry_in_list(&s->write_entry)) {
 			fr_assert(!s->blocked);
-			(void) fr_heap_insert(&s->waiting, cd);
-			fr_network_write(nr->el, s->listen->fd, 0, s);
+			fr_dlist_insert_tail(&nr->write_sockets, s);
 		}
 	}
+
+	while ((s = fr_dlist_pop_head(&nr->write_sockets)) != NULL) {
+		fr_network_write(nr->el, s->listen->fd, 0, s);
+	}
+
+	if (nr->num_draining > 0) fr_network_drain_check(nr);
 }
 
 /** Stop a network thread in an orderly way
@@ -1671,6 +2179,26 @@ int fr_network_destroy(fr_network_t *nr)
 
 	(void) talloc_get_type_abort(nr, fr_network_t);
 
+	/*
+	 *	Discard requests which haven't been sent.  They're
+	 *	in the sockets' message sets.
+	 */
+	{
+		int i;
+		unsigned int j;
+
+		for (i = 0; i < nr->num_workers; i++) {
+			fr_network_worker_t *worker = nr->workers[i];
+
+			for (j = 0; j < worker->num_batched; j++) {
+				talloc_free(worker->batch[j]->packet_ctx);
+				fr_message_done(&worker->batch[j]->m);
+			}
+			worker->num_batched = 0;
+		}
+		nr->num_batched_workers = 0;
+	}
+
 	/*
 	 *	Close the network sockets
 	 */
@@ -1735,6 +2263,10 @@ int fr_network_destroy(fr_network_t *nr)
 
 			fr_channel_signal_responder_close(worker->channel);
 		}
+
+		for (i = 0; i < nr->num_draining; i++) {
+			fr_channel_signal_responder_close(nr->draining[i]->channel);
+		}
 	}
 
 	(void) fr_event_pre_delete(nr->el, fr_network_pre_event, nr);
@@ -1792,8 +2324,9 @@ void fr_network(fr_network_t *nr)
 	 *	nr->num_workers is decremented, so when
 	 *	nr->num_workers == 0, all workers have ACKd
 	 *	our close and are no longer using the channel.
+	 *	The same goes for workers which are being removed.
 	 */
-	while (likely(!(nr->exiting && (nr->num_workers == 0)))) {
+	while (likely(!(nr->exiting && (nr->num_workers == 0) && (nr->num_draining == 0)))) {
 		bool wait_for_event;
 		int num_events;
 
@@ -1846,8 +2379,50 @@ int fr_network_exit(fr_network_t *nr)
 /** Free any resources associated with a network thread
  *
  */
+static fr_metric_family_t const network_metric_in = {
+	.name = "freeradius_network_packets_received", .type = FR_METRIC_COUNTER,
+	.help = "Packets read by a network thread, and sent to a worker."
+};
+static fr_metric_family_t const network_metric_out = {
+	.name = "freeradius_network_replies_sent", .type = FR_METRIC_COUNTER,
+	.help = "Replies written by a network thread."
+};
+static fr_metric_family_t const network_metric_dup = {
+	.name = "freeradius_network_packets_duplicate", .type = FR_METRIC_COUNTER,
+	.help = "Duplicate packets seen by a network thread."
+};
+static fr_metric_family_t const network_metric_dropped = {
+	.name = "freeradius_network_packets_dropped", .type = FR_METRIC_COUNTER,
+	.help = "Packets dropped by a network thread."
+};
+static fr_metric_family_t const network_metric_workers = {
+	.name = "freeradius_network_workers", .type = FR_METRIC_GAUGE,
+	.help = "Workers a network thread is sending packets to."
+};
+
+/** Add the network's counters to a scrape
+ *
+ * Each counter has only one writer, the network thread, so we read them
+ * without locking.
+ */
+static void network_metrics(fr_metrics_t *m, void const *uctx)
+{
+	fr_network_t const	*nr = uctx;
+	uint64_t		stats[5];
+
+	if (fr_network_stats(nr, 5, stats) != 5) return;
+
+	fr_metrics_add(m, &network_metric_in, stats[0], "network", nr->name, NULL);
+	fr_metrics_add(m, &network_metric_out, stats[1], "network", nr->name, NULL);
+	fr_metrics_add(m, &network_metric_dup, stats[2], "network", nr->name, NULL);
+	fr_metrics_add(m, &network_metric_dropped, stats[3], "network", nr->name, NULL);
+	fr_metrics_add(m, &network_metric_workers, stats[4], "network", nr->name, NULL);
+}
+
 static int _fr_network_free(fr_network_t *nr)
 {
+	TALLOC_FREE(nr->metrics);
+
 	if (nr->signal_pipe[0] >= 0) close(nr->signal_pipe[0]);
 	if (nr->signal_pipe[1] >= 0) close(nr->signal_pipe[1]);
 
@@ -1891,6 +2466,9 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 	nr->signal_pipe[0] = -1;
 	nr->signal_pipe[1] = -1;
 	if (config) nr->config = *config;
+	if (fr_time_delta_ispos(nr->config.queue_delay_target) && !fr_time_delta_ispos(nr->config.queue_delay_interval)) {
+		nr->config.queue_delay_interval = fr_time_delta_from_msec(100);
+	}
 
 	nr->aq_control = fr_atomic_queue_alloc(nr, 1024);
 	if (!nr->aq_control) {
@@ -1940,6 +2518,16 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 		goto fail2;
 	}
 
+	if (fr_control_callback_add(nr->control, FR_CONTROL_ID_WORKER_REMOVE, nr, fr_network_worker_remove_callback) < 0) {
+		fr_strerror_const_push("Failed adding worker removal callback");
+		goto fail2;
+	}
+
+	if (fr_control_callback_add(nr->control, FR_CONTROL_ID_PAUSE, nr, fr_network_pause_callback) < 0) {
+		fr_strerror_const_push("Failed adding pause callback");
+		goto fail2;
+	}
+
 	if (fr_control_callback_add(nr->control, FR_CONTROL_ID_INJECT, nr, fr_network_inject_callback) < 0) {
 		fr_strerror_const_push("Failed adding packet injection callback");
 		goto fail2;
@@ -1966,6 +2554,8 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 		goto fail2;
 	}
 
+	fr_dlist_init(&nr->write_sockets, fr_network_socket_t, write_entry);
+
 	if (fr_event_pre_insert(nr->el, fr_network_pre_event, nr) < 0) {
 		fr_strerror_const("Failed adding pre-check to event list");
 		goto fail2;
@@ -1988,6 +2578,8 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 		goto fail2;
 	}
 
+	MEM(nr->metrics = fr_metrics_source_alloc(nr, network_metrics, nr));
+
 	return nr;
 }
 
@@ -2019,6 +2611,10 @@ void fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log)
 
 		fr_channel_stats_log(nr->workers[i]->channel, log, __FILE__, __LINE__);
 	}
+
+	for (i = 0; i < nr->num_draining; i++) {
+		fr_channel_stats_log(nr->draining[i]->channel, log, __FILE__, __LINE__);
+	}
 }
 
 static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
@@ -2070,6 +2666,8 @@ static int cmd_stats_socket(FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t con
 	fprintf(fp, "count.dup\t%" PRIu64 "\n", s->stats.dup);
 	fprintf(fp, "count.dropped\t%" PRIu64 "\n", s->stats.dropped);
 
+	if (s->listen->app_io->stats_print) s->listen->app_io->stats_print(s->listen, fp);
+
 	return 0;
 }
 
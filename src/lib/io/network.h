@@ -44,6 +44,12 @@ extern "C" {
 
 typedef struct {
 	uint32_t	max_outstanding;
+
+	fr_time_delta_t	queue_delay_target;	//!< Shed low priority packets when the workers
+						///< queue requests for longer than this.
+						///< 0 disables shedding.
+	fr_time_delta_t	queue_delay_interval;	//!< How long the queue delay has to stay above
+						///< the target before we start shedding.
 } fr_network_config_t;
 
 int		fr_network_listen_add(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
@@ -54,6 +60,10 @@ int		fr_network_directory_add(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull
 
 int		fr_network_worker_add(fr_network_t *nr, fr_worker_t *worker) CC_HINT(nonnull);
 
+int		fr_network_worker_remove(fr_network_t *nr, fr_worker_t *worker) CC_HINT(nonnull);
+
+int		fr_network_pause(fr_network_t *nr) CC_HINT(nonnull);
+
 void		fr_network_listen_read(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
 
 void		fr_network_listen_write(fr_network_t *nr, fr_listen_t *li, uint8_t const *packet, size_t packet_len,
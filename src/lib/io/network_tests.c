@@ -0,0 +1,150 @@
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include "network.c"
+
+#define NUM_REQUESTS	8
+
+typedef struct {
+	TALLOC_CTX		*ctx;
+	fr_event_list_t		*el;			//!< for the network.
+	fr_event_list_t		*worker_el;		//!< for the workers' control planes, which are never serviced.
+	fr_network_t		*nr;
+	fr_listen_t		li;			//!< which all of the requests were "read" from.
+} test_network_t;
+
+/** Add a worker to the network, with a channel nothing reads from
+ *
+ */
+static fr_network_worker_t *test_worker_add(test_network_t *tn)
+{
+	fr_network_worker_t	*w;
+	fr_atomic_queue_t	*aq;
+	fr_control_t		*control;
+
+	aq = fr_atomic_queue_alloc(tn->ctx, 1024);
+	TEST_ASSERT(aq != NULL);
+
+	control = fr_control_create(tn->ctx, tn->worker_el, aq);
+	TEST_ASSERT(control != NULL);
+
+	w = talloc_zero(tn->nr, fr_network_worker_t);
+	TEST_ASSERT(w != NULL);
+
+	w->channel = fr_channel_create(w, tn->nr->control, control, false);
+	TEST_ASSERT(w->channel != NULL);
+	w->predicted = fr_time_delta_from_msec(10);
+
+	fr_channel_requestor_uctx_add(w->channel, w);
+	fr_channel_set_recv_reply(w->channel, tn->nr, fr_network_recv_reply);
+
+	tn->nr->workers[tn->nr->num_workers++] = w;
+
+	return w;
+}
+
+static void test_network_init(test_network_t *tn)
+{
+	*tn = (test_network_t) {
+		.ctx = talloc_init_const("test"),
+		.li = {
+			.fd = -1,
+			.name = "test"
+		}
+	};
+
+	tn->el = fr_event_list_alloc(tn->ctx, NULL, NULL);
+	TEST_ASSERT(tn->el != NULL);
+
+	tn->worker_el = fr_event_list_alloc(tn->ctx, NULL, NULL);
+	TEST_ASSERT(tn->worker_el != NULL);
+
+	tn->nr = fr_network_create(tn->ctx, tn->el, "test", &default_log, L_DBG_LVL_OFF, NULL);
+	TEST_ASSERT(tn->nr != NULL);
+}
+
+/** Push requests to a worker's channel until its queue is full
+ *
+ */
+static size_t test_worker_fill(test_network_t *tn, fr_network_worker_t *w)
+{
+	fr_channel_data_t	*cd, **cds;
+	size_t			i, num = 4096, sent;
+
+	cd = talloc_zero_array(tn->ctx, fr_channel_data_t, num);
+	cds = talloc_array(tn->ctx, fr_channel_data_t *, num);
+	TEST_ASSERT((cd != NULL) && (cds != NULL));
+
+	for (i = 0; i < num; i++) {
+		cd[i].listen = &tn->li;
+		cd[i].m.when = fr_time();
+		cds[i] = &cd[i];
+	}
+
+	sent = fr_channel_send_request_n(w->channel, cds, num);
+	TEST_CHECK(sent < num);
+	TEST_MSG("Expected the worker's queue to fill, but all %zu requests were sent", num);
+
+	w->stats.in += sent;
+
+	return sent;
+}
+
+/** Requests a full worker can't take are sent to another worker, not dropped
+ *
+ * The full worker is second in the array, so the requests it couldn't
+ * take are batched for a worker which has already been flushed.
+ */
+static void test_send_batch_full_worker(void)
+{
+	test_network_t		tn;
+	fr_network_worker_t	*idle, *full;
+	fr_channel_data_t	cd[NUM_REQUESTS];
+	uint64_t		full_in;
+	size_t			i;
+
+	test_network_init(&tn);
+
+	idle = test_worker_add(&tn);
+	full = test_worker_add(&tn);
+
+	TEST_CASE("Fill the second worker's queue");
+	test_worker_fill(&tn, full);
+	full_in = full->stats.in;
+
+	TEST_CASE("Batch requests for the full worker");
+	memset(cd, 0, sizeof(cd));
+	for (i = 0; i < NUM_REQUESTS; i++) {
+		cd[i].listen = &tn.li;
+		cd[i].m.when = fr_time();
+
+		full->batch[full->num_batched++] = &cd[i];
+		full->stats.in++;
+	}
+	tn.nr->num_batched_workers = 1;
+
+	fr_network_send_batches(tn.nr);
+
+	TEST_CASE("The full worker is blocked, and was given none of the requests");
+	TEST_CHECK(full->blocked);
+	TEST_CHECK(tn.nr->num_blocked == 1);
+	TEST_CHECK(full->stats.in == full_in);
+	TEST_MSG("Expected %" PRIu64 " requests in, got %" PRIu64, full_in, full->stats.in);
+
+	TEST_CASE("The other worker was sent all of the requests");
+	TEST_CHECK(idle->num_batched == 0);
+	TEST_CHECK(tn.nr->num_batched_workers == 0);
+	TEST_CHECK(idle->stats.in == NUM_REQUESTS);
+	TEST_MSG("Expected %u requests in, got %" PRIu64, NUM_REQUESTS, idle->stats.in);
+
+	TEST_CASE("No requests were dropped, and they're still in time order");
+	TEST_CHECK(tn.nr->stats.dropped == 0);
+	for (i = 1; i < NUM_REQUESTS; i++) TEST_CHECK(fr_time_lteq(cd[i - 1].m.when, cd[i].m.when));
+
+	talloc_free(tn.ctx);
+}
+
+TEST_LIST = {
+	{ "fr_network_send_batch - full worker",	test_send_batch_full_worker },
+	{ NULL }
+};
@@ -29,6 +29,11 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 #include <string.h>
 
+#ifdef __linux__
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
 /*
  *	Ring buffers are allocated in a block.
  */
@@ -43,8 +48,43 @@ struct fr_ring_buffer_s {
 	size_t		reserved;	//!< amount of reserved data at write_offset
 
 	bool		closed;		//!< whether allocations are closed
+
+	fr_ring_buffer_pages_t	pages;	//!< what the buffer is backed by
 };
 
+fr_table_num_ordered_t const fr_ring_buffer_pages_table[] = {
+	{ L("normal"),	FR_RING_BUFFER_PAGES_NORMAL	},
+	{ L("thp"),	FR_RING_BUFFER_PAGES_THP	},
+	{ L("hugetlb"),	FR_RING_BUFFER_PAGES_HUGETLB	}
+};
+size_t fr_ring_buffer_pages_table_len = NUM_ELEMENTS(fr_ring_buffer_pages_table);
+
+/** Check the size of a ring buffer, and round it up to a power of 2
+ *
+ */
+static int ring_buffer_size(size_t *size)
+{
+	if (*size < 1024) *size = 1024;
+
+	if (*size > (1 << 30)) {
+		fr_strerror_const("Ring buffer size must be no more than (1 << 30)");
+		return -1;
+	}
+
+	/*
+	 *	Round up to the nearest power of 2.
+	 */
+	(*size)--;
+	*size |= *size >> 1;
+	*size |= *size >> 2;
+	*size |= *size >> 4;
+	*size |= *size >> 8;
+	*size |= *size >> 16;
+	(*size)++;
+
+	return 0;
+}
+
 /** Create a ring buffer.
  *
  *  The size provided will be rounded up to the next highest power of
@@ -72,25 +112,11 @@ fr_ring_buffer_t *fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size)
 		return NULL;
 	}
 
-	if (size < 1024) size = 1024;
-
-	if (size > (1 << 30)) {
-		fr_strerror_const("Ring buffer size must be no more than (1 << 30)");
+	if (ring_buffer_size(&size) < 0) {
 		talloc_free(rb);
 		return NULL;
 	}
 
-	/*
-	 *	Round up to the nearest power of 2.
-	 */
-	size--;
-	size |= size >> 1;
-	size |= size >> 2;
-	size |= size >> 4;
-	size |= size >> 8;
-	size |= size >> 16;
-	size++;
-
 	rb->buffer = talloc_array(rb, uint8_t, size);
 	if (!rb->buffer) {
 		talloc_free(rb);
@@ -101,6 +127,102 @@ fr_ring_buffer_t *fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size)
 	return rb;
 }
 
+#ifdef __linux__
+static int _ring_buffer_unmap(fr_ring_buffer_t *rb)
+{
+	munmap(rb->buffer, rb->size);
+	return 0;
+}
+
+/** Map memory for the ring buffer, backed by huge pages if possible
+ *
+ * Pages from the hugetlb pool are preferred.  If the pool is empty,
+ * or not configured, the kernel is asked to use transparent huge
+ * pages.  Either way, the pages are faulted in now, so that packets
+ * don't pay for that later.
+ */
+static int ring_buffer_map_huge(fr_ring_buffer_t *rb, size_t size)
+{
+	uint8_t		*p;
+	size_t		i, page_size;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (p != MAP_FAILED) {
+		rb->pages = FR_RING_BUFFER_PAGES_HUGETLB;
+		goto done;
+	}
+#endif
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return -1;
+
+#ifdef MADV_HUGEPAGE
+	/*
+	 *	The mapping may not be aligned to a huge page, in
+	 *	which case only the aligned part of it is eligible.
+	 */
+	if (madvise(p, size, MADV_HUGEPAGE) == 0) rb->pages = FR_RING_BUFFER_PAGES_THP;
+#endif
+
+	/*
+	 *	Touch every page, after the madvise(), so that the
+	 *	kernel can fault in huge pages.
+	 */
+	page_size = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < size; i += page_size) p[i] = 0;
+
+done:
+	rb->buffer = p;
+	rb->size = size;
+	talloc_set_destructor(rb, _ring_buffer_unmap);
+
+	return 0;
+}
+#endif
+
+/** Create a ring buffer backed by huge pages
+ *
+ *  Packet data is spread across the whole ring buffer, so with
+ *  normal pages, a busy buffer causes many TLB misses.  Backing it
+ *  with 2M pages means one TLB entry covers most, or all, of it.
+ *
+ *  The size is rounded up to #FR_RING_BUFFER_HUGE_PAGE_SIZE.  The
+ *  memory is faulted in before the buffer is returned.  Use
+ *  #fr_ring_buffer_pages to find out whether huge pages were used.
+ *
+ *  If huge pages aren't supported on this platform, or the memory
+ *  can't be mapped, a normal ring buffer is returned.
+ *
+ * @param[in] ctx	a talloc context
+ * @param[in] size	of the raw ring buffer array to allocate.
+ * @return
+ *	- A new ring buffer on success.
+ *	- NULL on failure.
+ */
+fr_ring_buffer_t *fr_ring_buffer_create_huge(TALLOC_CTX *ctx, size_t size)
+{
+#ifdef __linux__
+	fr_ring_buffer_t	*rb;
+
+	if (size < FR_RING_BUFFER_HUGE_PAGE_SIZE) size = FR_RING_BUFFER_HUGE_PAGE_SIZE;
+
+	if (ring_buffer_size(&size) < 0) return NULL;
+
+	rb = talloc_zero(ctx, fr_ring_buffer_t);
+	if (!rb) {
+		fr_strerror_const("Failed allocating memory.");
+		return NULL;
+	}
+
+	if (ring_buffer_map_huge(rb, size) == 0) return rb;
+
+	talloc_free(rb);
+#endif
+
+	return fr_ring_buffer_create(ctx, size);
+}
+
 
 /** Reserve room in the ring buffer.
  *
@@ -420,6 +542,20 @@ int fr_ring_buffer_close(fr_ring_buffer_t *rb)
  *	- <0 on error.
  *      - 0 on success
  */
+/** What kind of pages back the ring buffer
+ *
+ * @param[in] rb a ring buffer
+ * @return the type of pages.  #FR_RING_BUFFER_PAGES_THP only means
+ *	the kernel was asked for transparent huge pages, not that it
+ *	provided them.
+ */
+fr_ring_buffer_pages_t fr_ring_buffer_pages(fr_ring_buffer_t *rb)
+{
+	(void) talloc_get_type_abort(rb, fr_ring_buffer_t);
+
+	return rb->pages;
+}
+
 size_t fr_ring_buffer_size(fr_ring_buffer_t *rb)
 {
 	(void) talloc_get_type_abort(rb, fr_ring_buffer_t);
@@ -456,7 +592,7 @@ size_t fr_ring_buffer_used(fr_ring_buffer_t *rb)
  *
  * @param[in] rb a ring buffer
  * @param[out] p_start pointer to data at the start of the ring buffer
- * @param[in] p_size size of the allocated block at the start of the ring buffer.
+ * @param[out] p_size size of the contiguous block of data at the start of the ring buffer.
  * @return size of the used data in the ring buffer.
  *	- <0 on error.
  *      - 0 on success
@@ -467,11 +603,13 @@ int fr_ring_buffer_start(fr_ring_buffer_t *rb, uint8_t **p_start, size_t *p_size
 
 	*p_start = rb->buffer + rb->data_start;
 
-	if (rb->write_offset < rb->data_start) {
-		*p_size = rb->write_offset;
-		return 0;
-	}
-
+	/*
+	 *	Whether or not the buffer has wrapped, the oldest
+	 *	block of data is always between data_start and
+	 *	data_end.
+	 *
+	 *	|***W....S****E....|
+	 */
 	*p_size = (rb->data_end - rb->data_start);
 
 	return 0;
@@ -27,6 +27,7 @@
 RCSIDH(ring_buffer_h, "$Id$")
 
 #include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/table.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -36,8 +37,26 @@ extern "C" {
 
 typedef struct fr_ring_buffer_s fr_ring_buffer_t;
 
+/** The size of huge pages used by #fr_ring_buffer_create_huge
+ *
+ */
+#define FR_RING_BUFFER_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+typedef enum {
+	FR_RING_BUFFER_PAGES_NORMAL = 0,	//!< Allocated from the heap.
+	FR_RING_BUFFER_PAGES_THP,		//!< Transparent huge pages were requested.
+	FR_RING_BUFFER_PAGES_HUGETLB		//!< Allocated from the hugetlb pool.
+} fr_ring_buffer_pages_t;
+
+extern fr_table_num_ordered_t const fr_ring_buffer_pages_table[];
+extern size_t fr_ring_buffer_pages_table_len;
+
 fr_ring_buffer_t	*fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size);
 
+fr_ring_buffer_t	*fr_ring_buffer_create_huge(TALLOC_CTX *ctx, size_t size);
+
+fr_ring_buffer_pages_t	fr_ring_buffer_pages(fr_ring_buffer_t *rb) CC_HINT(nonnull);
+
 uint8_t			*fr_ring_buffer_reserve(fr_ring_buffer_t *rb, size_t size) CC_HINT(nonnull);
 
 uint8_t			*fr_ring_buffer_alloc(fr_ring_buffer_t *rb, size_t size);
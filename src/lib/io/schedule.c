@@ -32,10 +32,23 @@ RCSID("$Id$")
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/rb.h>
 #include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/trace_ring.h>
+#include <freeradius-devel/server/main_loop.h>
 #include <freeradius-devel/server/trigger.h>
 
 #include <pthread.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#ifdef __linux__
+#  include <dirent.h>
+#  include <sched.h>
+#endif
+
 /*
  *	Other OS's have sem_init, OS X doesn't.
  */
@@ -95,6 +108,16 @@ typedef struct {
 
 	fr_schedule_child_status_t status;	//!< status of the worker
 	fr_worker_t	*worker;		//!< the worker data structure
+
+	bool		elastic;		//!< started because the other workers were overloaded.
+	bool		retiring;		//!< the networks have been told to stop using us.
+	atomic_bool	exited;			//!< the thread has finished, and can be joined.
+	uint64_t	last_in;		//!< requests received, when we last checked the load.
+
+#ifdef __linux__
+	bool		pinned;			//!< whether we set the CPU affinity
+	cpu_set_t	cpus;			//!< CPUs this worker may run on
+#endif
 } fr_schedule_worker_t;
 
 /** Scheduler specific information for network threads
@@ -116,6 +139,11 @@ typedef struct {
 	fr_network_t	*nr;			//!< the receive data structure
 
 	fr_event_timer_t const *ev;		//!< timer for stats_interval
+
+#ifdef __linux__
+	bool		pinned;			//!< whether we set the CPU affinity
+	cpu_set_t	cpus;			//!< CPUs this network may run on
+#endif
 } fr_schedule_network_t;
 
 
@@ -146,6 +174,17 @@ struct fr_schedule_s {
 
 	fr_network_t	*single_network;	//!< for single-threaded mode
 	fr_worker_t	*single_worker;		//!< for single-threaded mode
+
+	fr_event_timer_t const *ev_scale;	//!< timer which checks the worker load.
+	fr_time_t	busy_since;		//!< when the workers became overloaded.
+	fr_time_t	idle_since;		//!< when the workers stopped being overloaded.
+
+#ifdef __linux__
+	unsigned int	*network_cpus;		//!< CPUs to pin network threads to, in order.
+	unsigned int	*worker_cpus;		//!< CPUs to pin worker threads to, in order.
+	bool		worker_node_set;	//!< Workers are bound to the CPUs in worker_node.
+	cpu_set_t	worker_node;		//!< CPUs on the same NUMA node as the networks.
+#endif
 };
 
 static _Thread_local int worker_id;		//!< Internal ID of the current worker thread.
@@ -159,6 +198,205 @@ int fr_schedule_worker_id(void)
 	return worker_id;
 }
 
+#ifdef __linux__
+/** Parse a list of CPUs, e.g. "0-3,8,10-11"
+ *
+ * @param[in] ctx	to allocate the array in.
+ * @param[out] out	talloc array of CPU numbers, in the order they were listed.
+ * @param[in] list	to parse.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int schedule_cpu_list_parse(TALLOC_CTX *ctx, unsigned int **out, char const *list)
+{
+	char const	*p = list;
+	unsigned int	*cpus = NULL;
+	size_t		num = 0;
+
+	while (*p) {
+		unsigned long	first, last, cpu;
+		char		*end;
+
+		while (isspace((uint8_t) *p)) p++;
+		if (!isdigit((uint8_t) *p)) goto invalid;
+
+		first = last = strtoul(p, &end, 10);
+		p = end;
+
+		if (*p == '-') {
+			p++;
+			if (!isdigit((uint8_t) *p)) goto invalid;
+			last = strtoul(p, &end, 10);
+			p = end;
+		}
+
+		if ((last < first) || (last >= CPU_SETSIZE)) {
+		invalid:
+			fr_strerror_printf("Invalid CPU list \"%s\"", list);
+			talloc_free(cpus);
+			return -1;
+		}
+
+		for (cpu = first; cpu <= last; cpu++) {
+			MEM(cpus = talloc_realloc(ctx, cpus, unsigned int, num + 1));
+			cpus[num++] = cpu;
+		}
+
+		while (isspace((uint8_t) *p)) p++;
+		if (*p == ',') {
+			p++;
+			continue;
+		}
+		if (*p) goto invalid;
+	}
+
+	if (!num) goto invalid;
+
+	*out = cpus;
+	return 0;
+}
+
+/** Find the NUMA node a CPU belongs to
+ *
+ * @return
+ *	- The node number.
+ *	- -1 if the system has no NUMA information.
+ */
+static int schedule_cpu_numa_node(unsigned int cpu)
+{
+	char		path[64];
+	DIR		*dir;
+	struct dirent	*dp;
+	int		node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+
+	dir = opendir(path);
+	if (!dir) return -1;
+
+	while ((dp = readdir(dir)) != NULL) {
+		if ((strncmp(dp->d_name, "node", 4) == 0) && isdigit((uint8_t) dp->d_name[4])) {
+			node = atoi(dp->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+
+	return node;
+}
+
+/** Work out which CPUs each network and worker thread should run on
+ *
+ */
+static int schedule_affinity_init(fr_schedule_t *sc)
+{
+	fr_schedule_config_t const	*config = sc->config;
+	int				node;
+
+	if (config->network_cpus && (schedule_cpu_list_parse(sc, &sc->network_cpus, config->network_cpus) < 0)) {
+		PERROR("Invalid network_cpus");
+		return -1;
+	}
+
+	if (config->worker_cpus && (schedule_cpu_list_parse(sc, &sc->worker_cpus, config->worker_cpus) < 0)) {
+		PERROR("Invalid worker_cpus");
+		return -1;
+	}
+
+	if (!config->numa_local) return 0;
+
+	if (!sc->network_cpus) {
+		WARN("Ignoring numa_local, as network_cpus is not set");
+		return 0;
+	}
+
+	node = schedule_cpu_numa_node(sc->network_cpus[0]);
+	if (node < 0) {
+		WARN("Ignoring numa_local, as the system has no NUMA information");
+		return 0;
+	}
+
+	/*
+	 *	Only keep the worker CPUs which are on the same node
+	 *	as the network thread.
+	 */
+	if (sc->worker_cpus) {
+		size_t	i, j, num = talloc_array_length(sc->worker_cpus);
+
+		for (i = 0, j = 0; i < num; i++) {
+			if (schedule_cpu_numa_node(sc->worker_cpus[i]) != node) continue;
+			sc->worker_cpus[j++] = sc->worker_cpus[i];
+		}
+
+		if (!j) {
+			ERROR("None of worker_cpus are on NUMA node %d, which has network CPU %u",
+			      node, sc->network_cpus[0]);
+			return -1;
+		}
+
+		MEM(sc->worker_cpus = talloc_realloc(sc, sc->worker_cpus, unsigned int, j));
+		return 0;
+	}
+
+	/*
+	 *	No explicit list, so let the workers float over
+	 *	every CPU on the node.
+	 */
+	{
+		char		path[64];
+		char		buffer[1024];
+		FILE		*fp;
+		unsigned int	*cpus;
+		size_t		i;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		fp = fopen(path, "r");
+		if (!fp) {
+			ERROR("Failed opening %s: %s", path, fr_syserror(errno));
+			return -1;
+		}
+		if (!fgets(buffer, sizeof(buffer), fp)) buffer[0] = '\0';
+		fclose(fp);
+		buffer[strcspn(buffer, "\n")] = '\0';
+
+		if (schedule_cpu_list_parse(sc, &cpus, buffer) < 0) {
+			PERROR("Failed reading CPUs for NUMA node %d", node);
+			return -1;
+		}
+
+		CPU_ZERO(&sc->worker_node);
+		for (i = 0; i < talloc_array_length(cpus); i++) CPU_SET(cpus[i], &sc->worker_node);
+		talloc_free(cpus);
+
+		sc->worker_node_set = true;
+	}
+
+	return 0;
+}
+
+/** Set the CPU affinity of the current thread
+ *
+ * This is done before the thread allocates anything, so that with the
+ * default "first touch" memory policy, its event list, message sets and
+ * ring buffers are allocated on its own NUMA node.
+ */
+static int schedule_thread_pin(fr_schedule_t *sc, char const *name, cpu_set_t const *cpus)
+{
+	int ret;
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+	if (ret != 0) {
+		ERROR("%s - Failed setting CPU affinity: %s", name, fr_syserror(ret));
+		return -1;
+	}
+
+	DEBUG2("%s - Running on %d CPU(s)", name, CPU_COUNT(cpus));
+
+	return 0;
+}
+#endif
+
 /** Entry point for worker threads
  *
  * @param[in] arg	the fr_schedule_worker_t
@@ -166,7 +404,7 @@ int fr_schedule_worker_id(void)
  */
 static void *fr_schedule_worker_thread(void *arg)
 {
-	TALLOC_CTX			*ctx;
+	TALLOC_CTX			*ctx = NULL;
 	fr_schedule_worker_t		*sw = talloc_get_type_abort(arg, fr_schedule_worker_t);
 	fr_schedule_t			*sc = sw->sc;
 	fr_schedule_child_status_t	status = FR_CHILD_FAIL;
@@ -203,6 +441,11 @@ static void *fr_schedule_worker_thread(void *arg)
 	worker_id = sw->id;		/* Store the current worker ID */
 
 	snprintf(worker_name, sizeof(worker_name), "Worker %d", sw->id);
+	fr_trace_ring_thread_name(worker_name);
+
+#ifdef __linux__
+	if (sw->pinned && (schedule_thread_pin(sc, worker_name, &sw->cpus) < 0)) goto fail;
+#endif
 
 	sw->ctx = ctx = talloc_init("%s", worker_name);
 	if (!ctx) {
@@ -218,6 +461,15 @@ static void *fr_schedule_worker_thread(void *arg)
 		goto fail;
 	}
 
+	/*
+	 *	Each request has multiple timers, most of which are
+	 *	deleted before they fire.
+	 */
+	if (fr_event_list_set_timer_wheel(sw->el, true) < 0) {
+		PERROR("%s - Failed creating timer wheel", worker_name);
+		goto fail;
+	}
+
 
 	sw->worker = fr_worker_create(ctx, sw->el, worker_name, sc->log, sc->lvl, &sc->config->worker);
 	if (!sw->worker) {
@@ -290,6 +542,7 @@ fail:
 	/*
 	 *	Tell the scheduler we're done.
 	 */
+	atomic_store(&sw->exited, true);
 	sem_post(&sc->worker_sem);
 
 	talloc_free(ctx);
@@ -314,7 +567,7 @@ static void stats_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
  */
 static void *fr_schedule_network_thread(void *arg)
 {
-	TALLOC_CTX			*ctx;
+	TALLOC_CTX			*ctx = NULL;
 	fr_schedule_network_t		*sn = talloc_get_type_abort(arg, fr_schedule_network_t);
 	fr_schedule_t			*sc = sn->sc;
 	fr_schedule_child_status_t	status = FR_CHILD_FAIL;
@@ -349,6 +602,11 @@ static void *fr_schedule_network_thread(void *arg)
 #endif
 
 	snprintf(network_name, sizeof(network_name), "Network %d", sn->id);
+	fr_trace_ring_thread_name(network_name);
+
+#ifdef __linux__
+	if (sn->pinned && (schedule_thread_pin(sc, network_name, &sn->cpus) < 0)) goto fail;
+#endif
 
 	INFO("%s - Starting", network_name);
 
@@ -364,6 +622,11 @@ static void *fr_schedule_network_thread(void *arg)
 		goto fail;
 	}
 
+	if (fr_event_list_set_timer_wheel(el, true) < 0) {
+		PERROR("%s - Failed creating timer wheel", network_name);
+		goto fail;
+	}
+
 	sn->nr = fr_network_create(ctx, el, network_name, sc->log, sc->lvl, &sc->config->network);
 	if (!sn->nr) {
 		PERROR("%s - Failed creating network", network_name);
@@ -446,6 +709,268 @@ int fr_schedule_pthread_create(pthread_t *thread, void *(*func)(void *), void *a
 	return 0;
 }
 
+/** Allocate a worker, and start its thread
+ *
+ * @param[in] sc	the scheduler.
+ * @param[in] id	of the new worker.
+ * @return
+ *	- The worker, which has been added to the list of workers.
+ *	- NULL on error.
+ */
+static fr_schedule_worker_t *schedule_worker_start(fr_schedule_t *sc, unsigned int id)
+{
+	fr_schedule_worker_t *sw;
+
+	/*
+	 *	Create a worker "glue" structure
+	 */
+	sw = talloc_zero(sc, fr_schedule_worker_t);
+	if (!sw) {
+		ERROR("Worker %u - Failed allocating memory", id);
+		return NULL;
+	}
+
+	sw->id = id;
+	sw->sc = sc;
+	sw->status = FR_CHILD_INITIALIZING;
+#ifdef __linux__
+	if (sc->worker_cpus) {
+		CPU_ZERO(&sw->cpus);
+		CPU_SET(sc->worker_cpus[id % talloc_array_length(sc->worker_cpus)], &sw->cpus);
+		sw->pinned = true;
+	} else if (sc->worker_node_set) {
+		sw->cpus = sc->worker_node;
+		sw->pinned = true;
+	}
+#endif
+	fr_dlist_insert_head(&sc->workers, sw);
+
+	if (fr_schedule_pthread_create(&sw->pthread_id, fr_schedule_worker_thread, sw) < 0) {
+		PERROR("Failed creating worker %u", id);
+		fr_dlist_remove(&sc->workers, sw);
+		talloc_free(sw);
+		return NULL;
+	}
+
+	return sw;
+}
+
+/** Join a worker thread which has exited, and free it
+ *
+ */
+static void schedule_worker_join(fr_schedule_t *sc, fr_schedule_worker_t *sw)
+{
+	int ret;
+
+	fr_dlist_remove(&sc->workers, sw);
+
+	if ((ret = pthread_join(sw->pthread_id, NULL)) != 0) {
+		ERROR("Failed joining worker %i: %s", sw->id, fr_syserror(ret));
+	} else {
+		DEBUG2("Worker %i joined (cleaned up)", sw->id);
+	}
+
+	talloc_free(sw);
+}
+
+/** Start another worker, because the existing ones are overloaded
+ *
+ */
+static void schedule_worker_add(fr_schedule_t *sc)
+{
+	fr_schedule_worker_t	*sw;
+	uint64_t		ids = 0;
+	unsigned int		id;
+
+	/*
+	 *	Use the lowest free ID, so that the new worker gets
+	 *	the same "worker" section and CPUs as the one which
+	 *	last had it.
+	 */
+	for (sw = fr_dlist_head(&sc->workers);
+	     sw != NULL;
+	     sw = fr_dlist_next(&sc->workers, sw)) {
+		ids |= ((uint64_t) 1) << sw->id;
+	}
+	for (id = 0; ids & (((uint64_t) 1) << id); id++);
+
+	sw = schedule_worker_start(sc, id);
+	if (!sw) return;
+
+	sw->elastic = true;
+
+	/*
+	 *	Workers start quickly, so we wait here.  No other
+	 *	worker is exiting, so the semaphore can only have
+	 *	been posted by this one.
+	 */
+	SEM_WAIT_INTR(&sc->worker_sem);
+
+	if (sw->status != FR_CHILD_RUNNING) {
+		ERROR("Worker %u - Failed starting", id);
+		schedule_worker_join(sc, sw);
+		return;
+	}
+
+	INFO("Scheduler - Workers are overloaded, started worker %u (%u/%u)", id,
+	     (unsigned int)fr_dlist_num_elements(&sc->workers), sc->config->max_workers);
+}
+
+/** Tell the networks to stop using the most recently started worker
+ *
+ * The networks close their channels once the worker has answered all of
+ * the requests they've sent it.  The worker then exits, and is joined by
+ * schedule_worker_reap().
+ */
+static void schedule_worker_retire(fr_schedule_t *sc)
+{
+	fr_schedule_worker_t	*sw;
+	fr_schedule_network_t	*sn;
+
+	for (sw = fr_dlist_head(&sc->workers);
+	     sw != NULL;
+	     sw = fr_dlist_next(&sc->workers, sw)) {
+		if (sw->elastic && !sw->retiring) break;
+	}
+	if (!sw) return;
+
+	INFO("Scheduler - Workers are idle, retiring worker %u", sw->id);
+
+	sw->retiring = true;
+
+	for (sn = fr_dlist_head(&sc->networks);
+	     sn != NULL;
+	     sn = fr_dlist_next(&sc->networks, sn)) {
+		(void) fr_network_worker_remove(sn->nr, sw->worker);
+	}
+}
+
+/** Join the workers which have finished retiring
+ *
+ */
+static void schedule_worker_reap(fr_schedule_t *sc)
+{
+	fr_schedule_worker_t *sw, *next;
+
+	for (sw = fr_dlist_head(&sc->workers);
+	     sw != NULL;
+	     sw = next) {
+		next = fr_dlist_next(&sc->workers, sw);
+
+		if (!sw->retiring || !atomic_load(&sw->exited)) continue;
+
+		/*
+		 *	Consume the semaphore the worker posted on exit.
+		 */
+		SEM_WAIT_INTR(&sc->worker_sem);
+		schedule_worker_join(sc, sw);
+	}
+}
+
+/** Add or remove workers, depending on how busy they are
+ *
+ * The workers are overloaded when the requests they've been sent have
+ * to wait too long before they start running, or when too many of them
+ * are waiting.  If that lasts for a whole interval, we start another
+ * worker.  When there's been no load for scale_down_idle, we retire the
+ * most recently started one.
+ */
+static void schedule_scale_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_schedule_t			*sc = talloc_get_type_abort(uctx, fr_schedule_t);
+	fr_schedule_config_t const	*config = sc->config;
+	fr_schedule_worker_t		*sw;
+	unsigned int			num = 0, num_delay = 0, num_retiring = 0;
+	uint64_t			runnable = 0;
+	int64_t				delay = 0;
+	bool				busy = false;
+
+	schedule_worker_reap(sc);
+
+	for (sw = fr_dlist_head(&sc->workers);
+	     sw != NULL;
+	     sw = fr_dlist_next(&sc->workers, sw)) {
+		uint64_t	in;
+		fr_time_delta_t	queue_delay;
+
+		if (sw->retiring) {
+			num_retiring++;
+			continue;
+		}
+
+		runnable += fr_worker_load(sw->worker, &in, &queue_delay);
+
+		/*
+		 *	The average only changes when the worker runs
+		 *	new requests, so it's stale for idle workers.
+		 */
+		if (in != sw->last_in) {
+			delay += fr_time_delta_unwrap(queue_delay);
+			num_delay++;
+		}
+		sw->last_in = in;
+		num++;
+	}
+
+	if (config->scale_up_runnable && (runnable >= ((uint64_t) num * config->scale_up_runnable))) busy = true;
+
+	if (fr_time_delta_ispos(config->scale_up_delay) && num_delay &&
+	    ((delay / num_delay) >= fr_time_delta_unwrap(config->scale_up_delay))) busy = true;
+
+	if (busy) {
+		sc->idle_since = fr_time_wrap(0);
+
+		if (fr_time_eq(sc->busy_since, fr_time_wrap(0))) {
+			sc->busy_since = now;
+
+		/*
+		 *	Don't start a worker while another is draining,
+		 *	as we wait for the new one on the same semaphore.
+		 */
+		} else if (fr_time_delta_gteq(fr_time_sub(now, sc->busy_since), config->scale_interval) &&
+			   (num < config->max_workers) && !num_retiring) {
+			schedule_worker_add(sc);
+			sc->busy_since = now;
+		}
+	} else {
+		sc->busy_since = fr_time_wrap(0);
+
+		if (fr_time_eq(sc->idle_since, fr_time_wrap(0))) {
+			sc->idle_since = now;
+
+		} else if (fr_time_delta_gteq(fr_time_sub(now, sc->idle_since), config->scale_down_idle) &&
+			   (num > config->min_workers)) {
+			schedule_worker_retire(sc);
+			sc->idle_since = now;
+		}
+	}
+
+	if (fr_event_timer_at(sc, el, &sc->ev_scale, fr_time_add(now, config->scale_interval),
+			      schedule_scale_timer, sc) < 0) {
+		PERROR("Failed inserting worker scaling timer");
+	}
+}
+
+static int cmd_show_trace(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	fr_trace_ring_dump(fp, (info->argc > 0) ? info->box[0]->vb_uint32 : 100);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_trace_table[] = {
+	{
+		.parent = "show",
+		.name = "trace",
+		.syntax = "[INTEGER]",
+		.func = cmd_show_trace,
+		.help = "Show the most recent events recorded by each thread, 100 by default.",
+		.read_only = true
+	},
+
+	CMD_TABLE_END
+};
+
 /** Create a scheduler and spawn the child threads.
  *
  * @param[in] ctx				talloc context.
@@ -466,7 +991,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 				  fr_schedule_thread_detach_t worker_thread_detach,
 				  fr_schedule_config_t *config)
 {
-	unsigned int i;
+	unsigned int i, num_workers;
 	fr_schedule_worker_t *sw, *next_sw;
 	fr_schedule_network_t *sn, *next_sn;
 	fr_schedule_t *sc;
@@ -535,6 +1060,11 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 			goto st_fail;
 		}
 
+		if (fr_command_register_hook(NULL, NULL, sc, cmd_trace_table) < 0) {
+			PERROR("Failed adding trace commands");
+			goto st_fail;
+		}
+
 		(void) fr_network_worker_add(sc->single_network, sc->single_worker);
 		DEBUG("Scheduler created in single-threaded mode");
 
@@ -568,8 +1098,45 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		if (sc->config->max_networks > 64) sc->config->max_networks = 64;
 		if (sc->config->max_workers < 1) sc->config->max_workers = 1;
 		if (sc->config->max_workers > 64) sc->config->max_workers = 64;
+
+		/*
+		 *	The pool is elastic only if it can change size.
+		 */
+		if (sc->config->min_workers >= sc->config->max_workers) sc->config->min_workers = 0;
+		if (sc->config->min_workers) {
+			if (!fr_time_delta_ispos(sc->config->scale_interval)) {
+				sc->config->scale_interval = fr_time_delta_from_sec(1);
+			}
+			if (!fr_time_delta_ispos(sc->config->scale_down_idle)) {
+				sc->config->scale_down_idle = fr_time_delta_from_sec(60);
+			}
+		}
 	}
 
+	/*
+	 *	Workers can only take work from each other if
+	 *	there's more than one of them.
+	 */
+	if (sc->config->work_stealing && (sc->config->max_workers > 1)) {
+		sc->config->worker.steal = fr_worker_steal_alloc(sc, sc->config->max_workers);
+		if (!sc->config->worker.steal) {
+			PERROR("Failed initialising work stealing");
+			talloc_free(sc);
+			return NULL;
+		}
+	}
+
+#ifdef __linux__
+	if (schedule_affinity_init(sc) < 0) {
+		talloc_free(sc);
+		return NULL;
+	}
+#else
+	if (sc->config->network_cpus || sc->config->worker_cpus || sc->config->numa_local) {
+		WARN("Ignoring network_cpus, worker_cpus and numa_local, as CPU affinity is only supported on Linux");
+	}
+#endif
+
 	/*
 	 *	Create the lists which hold the workers and networks.
 	 */
@@ -608,6 +1175,13 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		sn->id = i;
 		sn->sc = sc;
 		sn->status = FR_CHILD_INITIALIZING;
+#ifdef __linux__
+		if (sc->network_cpus) {
+			CPU_ZERO(&sn->cpus);
+			CPU_SET(sc->network_cpus[i % talloc_array_length(sc->network_cpus)], &sn->cpus);
+			sn->pinned = true;
+		}
+#endif
 		fr_dlist_insert_head(&sc->networks, sn);
 
 		if (fr_schedule_pthread_create(&sn->pthread_id, fr_schedule_network_thread, sn) < 0) {
@@ -650,29 +1224,16 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	}
 
 	/*
-	 *	Create all of the workers.
+	 *	Create all of the workers.  If the pool is elastic,
+	 *	we start with the minimum, and add more as needed.
 	 */
-	for (i = 0; i < sc->config->max_workers; i++) {
-		DEBUG3("Creating %u/%u workers", i + 1, sc->config->max_workers);
+	num_workers = sc->config->max_workers;
+	if (sc->config->min_workers) num_workers = sc->config->min_workers;
 
-		/*
-		 *	Create a worker "glue" structure
-		 */
-		sw = talloc_zero(sc, fr_schedule_worker_t);
-		if (!sw) {
-			ERROR("Worker %u - Failed allocating memory", i);
-			break;
-		}
+	for (i = 0; i < num_workers; i++) {
+		DEBUG3("Creating %u/%u workers", i + 1, num_workers);
 
-		sw->id = i;
-		sw->sc = sc;
-		sw->status = FR_CHILD_INITIALIZING;
-		fr_dlist_insert_head(&sc->workers, sw);
-
-		if (fr_schedule_pthread_create(&sw->pthread_id, fr_schedule_worker_thread, sw) < 0) {
-			PERROR("Failed creating worker %u", i);
-			break;
-		}
+		if (!schedule_worker_start(sc, i)) break;
 	}
 
 	/*
@@ -704,7 +1265,7 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 	/*
 	 *	Failed to start some workers, refuse to do anything!
 	 */
-	if ((unsigned int)fr_dlist_num_elements(&sc->workers) < sc->config->max_workers) {
+	if ((unsigned int)fr_dlist_num_elements(&sc->workers) < num_workers) {
 		fr_schedule_destroy(&sc);
 		return NULL;
 	}
@@ -737,6 +1298,27 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		}
 	}
 
+	if (fr_command_register_hook(NULL, NULL, sc, cmd_trace_table) < 0) {
+		PERROR("Failed adding trace commands");
+		goto st_fail;
+	}
+
+	/*
+	 *	Check the worker load from the main event loop, which
+	 *	is the only thing that changes the list of workers.
+	 */
+	if (sc->config->min_workers) {
+		if (fr_event_timer_in(sc, main_loop_event_list(), &sc->ev_scale, sc->config->scale_interval,
+				      schedule_scale_timer, sc) < 0) {
+			PERROR("Failed inserting worker scaling timer");
+			goto st_fail;
+		}
+
+		INFO("Scheduler created successfully with %u networks and %u-%u workers",
+		     sc->config->max_networks, num_workers, sc->config->max_workers);
+		return sc;
+	}
+
 	if (sc) INFO("Scheduler created successfully with %u networks and %u workers",
 		     sc->config->max_networks, (unsigned int)fr_dlist_num_elements(&sc->workers));
 
@@ -766,6 +1348,8 @@ int fr_schedule_destroy(fr_schedule_t **sc_to_free)
 
 	sc->running = false;
 
+	fr_event_timer_delete(&sc->ev_scale);
+
 	/*
 	 *	Single threaded mode: kill the only network / worker we have.
 	 */
@@ -898,6 +1482,62 @@ fr_network_t *fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li)
 	return nr;
 }
 
+/** Return the number of network threads in a scheduler
+ *
+ * @param[in] sc the scheduler
+ * @return the number of network threads.  Single-threaded mode has one.
+ */
+unsigned int fr_schedule_num_networks(fr_schedule_t *sc)
+{
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) return 1;
+
+	return fr_dlist_num_elements(&sc->networks);
+}
+
+/** Add a fr_listen_t to a particular network thread of a scheduler.
+ *
+ * This is used to spread multiple sockets for the same listener
+ * (e.g. with SO_REUSEPORT) across all of the network threads.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] li the ctx and callbacks for the transport.
+ * @param[in] id of the network thread, from 0 to fr_schedule_num_networks() - 1.
+ *		Larger numbers wrap around.
+ * @return
+ *	- NULL on error
+ *	- the fr_network_t that the socket was added to.
+ */
+fr_network_t *fr_schedule_listen_add_network(fr_schedule_t *sc, fr_listen_t *li, unsigned int id)
+{
+	fr_network_t *nr;
+
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) {
+		nr = sc->single_network;
+	} else {
+		fr_schedule_network_t *sn;
+
+		id %= fr_dlist_num_elements(&sc->networks);
+
+		for (sn = fr_dlist_head(&sc->networks);
+		     sn != NULL;
+		     sn = fr_dlist_next(&sc->networks, sn)) {
+			if (id == 0) break;
+			id--;
+		}
+		fr_assert(sn != NULL);
+
+		nr = sn->nr;
+	}
+
+	if (fr_network_listen_add(nr, li) < 0) return NULL;
+
+	return nr;
+}
+
 /** Add a directory NOTE_EXTEND to a scheduler.
  *
  * @param[in] sc the scheduler
@@ -929,3 +1569,53 @@ fr_network_t *fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li)
 
 	return nr;
 }
+
+/** Stop every network thread from reading from its sockets
+ *
+ * @param[in] sc the scheduler
+ */
+void fr_schedule_pause(fr_schedule_t *sc)
+{
+	fr_schedule_network_t *sn;
+
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) {
+		(void) fr_network_pause(sc->single_network);
+		return;
+	}
+
+	for (sn = fr_dlist_head(&sc->networks);
+	     sn != NULL;
+	     sn = fr_dlist_next(&sc->networks, sn)) {
+		(void) fr_network_pause(sn->nr);
+	}
+}
+
+/** Return the number of requests the workers are processing
+ *
+ * @param[in] sc the scheduler
+ * @return the number of active requests.
+ */
+uint64_t fr_schedule_num_active(fr_schedule_t *sc)
+{
+	fr_schedule_worker_t	*sw;
+	uint64_t		stats[6], active = 0;
+
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) {
+		if (fr_worker_stats(sc->single_worker, 6, stats) == 6) active = stats[5];
+		return active;
+	}
+
+	for (sw = fr_dlist_head(&sc->workers);
+	     sw != NULL;
+	     sw = fr_dlist_next(&sc->workers, sw)) {
+		if (sw->retiring) continue;
+
+		if (fr_worker_stats(sw->worker, 6, stats) == 6) active += stats[5];
+	}
+
+	return active;
+}
@@ -68,6 +68,19 @@ typedef struct {
 	fr_network_config_t network;		//!< configuration for each network;
 
 	fr_time_delta_t	stats_interval;		//!< print channel statistics
+
+	bool		work_stealing;		//!< idle workers take unstarted requests from busy ones
+
+	uint32_t	min_workers;		//!< if less than max_workers, start this many, and add
+						///< more when they're overloaded.
+	fr_time_delta_t	scale_interval;		//!< how often to check the worker load.
+	fr_time_delta_t	scale_up_delay;		//!< add a worker when the queue delay stays above this.
+	uint32_t	scale_up_runnable;	//!< or when this many requests per worker are waiting to run.
+	fr_time_delta_t	scale_down_idle;	//!< retire a worker when there's been no load for this long.
+
+	char const	*network_cpus;		//!< CPUs to pin network threads to, e.g. "0-3,8"
+	char const	*worker_cpus;		//!< CPUs to pin worker threads to
+	bool		numa_local;		//!< keep workers on the same NUMA node as the network threads
 } fr_schedule_config_t;
 
 int			fr_schedule_worker_id(void);
@@ -81,7 +94,11 @@ fr_schedule_t		*fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_
 int			fr_schedule_destroy(fr_schedule_t **sc);
 
 fr_network_t		*fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
+fr_network_t		*fr_schedule_listen_add_network(fr_schedule_t *sc, fr_listen_t *li, unsigned int id) CC_HINT(nonnull);
+unsigned int		fr_schedule_num_networks(fr_schedule_t *sc) CC_HINT(nonnull);
 fr_network_t		*fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
+void			fr_schedule_pause(fr_schedule_t *sc) CC_HINT(nonnull);
+uint64_t		fr_schedule_num_active(fr_schedule_t *sc) CC_HINT(nonnull);
 #ifdef __cplusplus
 }
 #endif
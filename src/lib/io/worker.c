@@ -59,10 +59,17 @@ RCSID("$Id$")
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/unlang/call.h>
 #include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/server/log_async.h>
+#include <freeradius-devel/server/memory.h>
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/server/time_tracking.h>
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/minmax_heap.h>
+#include <freeradius-devel/util/probe.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/trace_ring.h>
 
 #include <stdalign.h>
 
@@ -88,6 +95,41 @@ typedef struct {
 	fr_dlist_head_t		dlist;
 } fr_worker_channel_t;
 
+/** The parts of a worker which other workers can see, when work stealing is enabled
+ *
+ * A worker which is busy puts newly received messages into its backlog, instead of
+ * decoding them immediately.  A worker whose own queue is empty pops messages from the
+ * backlog of other workers, and runs the resulting requests itself.  The reply is then
+ * sent through the channel of the original worker, with its mutex held.
+ *
+ * Each stolen request holds the channel it was received on, so that the original
+ * worker can't acknowledge the channel closing, which lets the network free it, until
+ * the stolen request is done with it.
+ *
+ * Messages from listeners which track duplicates are never taken by other workers.
+ * Retransmits and conflicting packets are matched against the dedup tree of the worker
+ * which received them, so the original request has to be running there too.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Serialises use of the worker's channels, and
+						//!< their message sets.
+	fr_atomic_queue_t	*backlog;	//!< Messages received, but not yet decoded.
+	fr_atomic_queue_t	*local;		//!< Messages received from listeners which track
+						//!< duplicates, which only this worker may decode.
+	atomic_bool		active;		//!< Whether other workers can take from the backlog.
+	atomic_bool		claimed;	//!< Whether a worker is using this slot.
+} fr_worker_steal_slot_t;
+
+struct fr_worker_steal_s {
+	unsigned int		num_slots;	//!< Maximum number of workers in the group.
+	atomic_uint		used;		//!< Highest slot which has been claimed, plus one.
+	fr_worker_steal_slot_t	*slot;		//!< One per worker.
+};
+
+/** Maximum number of unstarted messages a worker holds in its backlog
+ */
+#define WORKER_STEAL_BACKLOG	1024
+
 /**
  *  A worker which takes packets from a master, and processes them.
  */
@@ -124,6 +166,7 @@ struct fr_worker_s {
 	uint64_t    		num_active;	//!< number of active requests
 
 	fr_time_delta_t		predicted;	//!< How long we predict a request will take to execute.
+	fr_time_delta_t		queue_delay;	//!< Moving average of how long requests wait to start.
 	fr_time_tracking_t	tracking;	//!< how much time the worker has spent doing things.
 
 	bool			was_sleeping;	//!< used to suppress multiple sleep signals in a row
@@ -134,6 +177,21 @@ struct fr_worker_s {
 	fr_event_timer_t const	*ev_cleanup;	//!< timer for max_request_time
 
 	fr_worker_channel_t	*channel;	//!< list of channels
+
+	fr_worker_steal_slot_t	*steal;		//!< our slot in the work stealing group, if any.
+	unsigned int		steal_next;	//!< slot we look at first, when stealing.
+	uint64_t		num_stolen;	//!< number of requests taken from other workers.
+
+	request_free_list_stats_t const *request_pool;	//!< hits and misses for the request free list.
+
+#ifdef WITH_PERF
+	uint64_t		num_sampled;	//!< requests considered for tracing.
+	uint64_t		num_slow;	//!< traced requests which exceeded slow_request_threshold.
+
+	void const		*unlang_perf;		//!< per-instruction profile for this thread.
+#endif
+
+	fr_metrics_source_t	*metrics;	//!< our entry in the metrics registry.
 };
 
 typedef struct {
@@ -166,6 +224,61 @@ static int _fr_worker_rb_free(void *arg)
 	return talloc_free(arg);
 }
 
+static fr_metric_family_t const worker_metric_in = {
+	.name = "freeradius_worker_requests_received", .type = FR_METRIC_COUNTER,
+	.help = "Requests received by a worker from the network threads."
+};
+static fr_metric_family_t const worker_metric_out = {
+	.name = "freeradius_worker_replies_sent", .type = FR_METRIC_COUNTER,
+	.help = "Replies sent by a worker to the network threads."
+};
+static fr_metric_family_t const worker_metric_dup = {
+	.name = "freeradius_worker_requests_duplicate", .type = FR_METRIC_COUNTER,
+	.help = "Duplicate requests received by a worker."
+};
+static fr_metric_family_t const worker_metric_dropped = {
+	.name = "freeradius_worker_requests_dropped", .type = FR_METRIC_COUNTER,
+	.help = "Requests dropped by a worker without a reply."
+};
+static fr_metric_family_t const worker_metric_naks = {
+	.name = "freeradius_worker_requests_nak", .type = FR_METRIC_COUNTER,
+	.help = "Requests which a worker could not accept, and returned to the network thread."
+};
+static fr_metric_family_t const worker_metric_active = {
+	.name = "freeradius_worker_requests_active", .type = FR_METRIC_GAUGE,
+	.help = "Requests currently being processed by a worker."
+};
+static fr_metric_family_t const worker_metric_pool_hits = {
+	.name = "freeradius_worker_request_pool_hits", .type = FR_METRIC_COUNTER,
+	.help = "Requests allocated from the worker's free list."
+};
+static fr_metric_family_t const worker_metric_pool_misses = {
+	.name = "freeradius_worker_request_pool_misses", .type = FR_METRIC_COUNTER,
+	.help = "Requests which had to be allocated from the heap."
+};
+
+/** Add the worker's counters to a scrape
+ *
+ * Each counter has only one writer, the worker thread, so we read them
+ * without locking.
+ */
+static void worker_metrics(fr_metrics_t *m, void const *uctx)
+{
+	fr_worker_t const	*worker = uctx;
+	uint64_t		stats[8];
+
+	if (fr_worker_stats(worker, 8, stats) != 8) return;
+
+	fr_metrics_add(m, &worker_metric_in, stats[0], "worker", worker->name, NULL);
+	fr_metrics_add(m, &worker_metric_out, stats[1], "worker", worker->name, NULL);
+	fr_metrics_add(m, &worker_metric_dup, stats[2], "worker", worker->name, NULL);
+	fr_metrics_add(m, &worker_metric_dropped, stats[3], "worker", worker->name, NULL);
+	fr_metrics_add(m, &worker_metric_naks, stats[4], "worker", worker->name, NULL);
+	fr_metrics_add(m, &worker_metric_active, stats[5], "worker", worker->name, NULL);
+	fr_metrics_add(m, &worker_metric_pool_hits, stats[6], "worker", worker->name, NULL);
+	fr_metrics_add(m, &worker_metric_pool_misses, stats[7], "worker", worker->name, NULL);
+}
+
 /** Initialise thread local storage
  *
  * @return fr_ring_buffer_t for messages
@@ -193,7 +306,9 @@ static inline bool is_worker_thread(fr_worker_t const *worker)
 	return (pthread_equal(pthread_self(), worker->thread_id) != 0);
 }
 
-static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now);
+static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
+				     fr_worker_steal_slot_t *owner, fr_time_t now);
+static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_worker_steal_slot_t *owner, fr_time_t now);
 static void worker_send_reply(fr_worker_t *worker, request_t *request, bool do_not_respond, fr_time_t now);
 static void worker_max_request_time(UNUSED fr_event_list_t *el, UNUSED fr_time_t when, void *uctx);
 static void worker_max_request_timer(fr_worker_t *worker);
@@ -211,7 +326,82 @@ static void worker_recv_request(void *ctx, fr_channel_t *ch, fr_channel_data_t *
 	worker->stats.in++;
 	DEBUG3("Received request %" PRIu64 "", worker->stats.in);
 	cd->channel.ch = ch;
-	worker_request_bootstrap(worker, cd, fr_time());
+
+	/*
+	 *	Duplicates and conflicting packets are found in our
+	 *	dedup tree, so the request has to run here.  If
+	 *	another worker is draining the channel, leave the
+	 *	message where only we will find it.
+	 */
+	if (worker->steal && cd->listen->track_duplicates) {
+		if (is_worker_thread(worker)) goto bootstrap;
+
+		if (!fr_atomic_queue_push(worker->steal->local, cd)) worker_nak(worker, cd, worker->steal, fr_time());
+		return;
+	}
+
+	/*
+	 *	If we're busy, leave the message in the backlog,
+	 *	where an idle worker can find it.  The channel is
+	 *	also drained when another worker sends a reply
+	 *	through it, in which case the message has to go into
+	 *	the backlog, as only we can run requests here.
+	 */
+	if (worker->steal && (!is_worker_thread(worker) || (fr_heap_num_elements(worker->runnable) > 0))) {
+		if (fr_atomic_queue_push(worker->steal->backlog, cd)) return;
+
+		if (!is_worker_thread(worker)) {
+			worker_nak(worker, cd, worker->steal, fr_time());
+			return;
+		}
+	}
+
+bootstrap:
+	worker_request_bootstrap(worker, cd, worker->steal, fr_time());
+}
+
+/** Lock a worker's channels, if they're shared with other workers
+ *
+ */
+static inline CC_HINT(always_inline) void worker_channel_lock(pthread_mutex_t *mutex)
+{
+	if (mutex) pthread_mutex_lock(mutex);
+}
+
+static inline CC_HINT(always_inline) void worker_channel_unlock(pthread_mutex_t *mutex)
+{
+	if (mutex) pthread_mutex_unlock(mutex);
+}
+
+/** NAK messages in our backlog which were received on a particular channel
+ *
+ * Must be called with our mutex held, so that no other worker adds
+ * messages to the backlog.
+ *
+ * @param[in] worker	the worker
+ * @param[in] ch	the channel, or NULL for all channels.
+ */
+static void worker_backlog_nak(fr_worker_t *worker, fr_channel_t *ch)
+{
+	fr_atomic_queue_t	*queues[] = { worker->steal->local, worker->steal->backlog };
+	size_t			i, j, num;
+	void			*data;
+	fr_channel_data_t	*cd;
+
+	for (j = 0; j < NUM_ELEMENTS(queues); j++) {
+		num = fr_atomic_queue_length(queues[j]);
+		for (i = 0; i < num; i++) {
+			if (!fr_atomic_queue_pop(queues[j], &data)) break;
+
+			cd = data;
+			if (!ch || (cd->channel.ch == ch)) {
+				worker_nak(worker, cd, worker->steal, fr_time());
+				continue;
+			}
+
+			(void) fr_atomic_queue_push(queues[j], cd);
+		}
+	}
 }
 
 static void worker_requests_cancel(fr_worker_channel_t *ch)
@@ -227,6 +417,11 @@ static void worker_exit(fr_worker_t *worker)
 {
 	worker->exiting = true;
 
+	/*
+	 *	Other workers can't take any more messages from us.
+	 */
+	if (worker->steal) atomic_store(&worker->steal->active, false);
+
 	/*
 	 *	Don't allow the post event to run
 	 *	any more requests.  They'll be
@@ -253,6 +448,7 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 	fr_message_set_t	*ms;
 	fr_channel_event_t	ce;
 	fr_worker_t		*worker = ctx;
+	pthread_mutex_t		*mutex = worker->steal ? &worker->steal->mutex : NULL;
 
 	was_sleeping = worker->was_sleeping;
 	worker->was_sleeping = false;
@@ -261,18 +457,19 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 	 *	We were woken up by a signal to do something.  We're
 	 *	not sleeping.
 	 */
+	worker_channel_lock(mutex);
 	ce = fr_channel_service_message(now, &ch, data, data_size);
 	DEBUG3("Channel %s",
 	       fr_table_str_by_value(channel_signals, ce, "<INVALID>"));
 	switch (ce) {
 	case FR_CHANNEL_ERROR:
-		return;
+		break;
 
 	case FR_CHANNEL_EMPTY:
-		return;
+		break;
 
 	case FR_CHANNEL_NOOP:
-		return;
+		break;
 
 	case FR_CHANNEL_DATA_READY_REQUESTOR:
 		fr_assert(0 == 1);
@@ -305,6 +502,12 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 						   sizeof(fr_channel_data_t),
 						   worker->config.ring_buffer_size);
 			fr_assert(ms != NULL);
+
+			if (fr_message_set_pages(ms) != FR_RING_BUFFER_PAGES_NORMAL) {
+				DEBUG2("Message buffers for channel %d are backed by %s pages", i,
+				       fr_table_str_by_value(fr_ring_buffer_pages_table, fr_message_set_pages(ms),
+							     "<INVALID>"));
+			}
 			fr_channel_responder_uctx_add(ch, ms);
 
 			worker->num_channels++;
@@ -329,6 +532,8 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 
 			if (worker->channel[i].ch != ch) continue;
 
+			if (worker->steal) worker_backlog_nak(worker, ch);
+
 			worker_requests_cancel(&worker->channel[i]);
 
 			ms = fr_channel_responder_uctx_get(ch);
@@ -360,6 +565,7 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 		if (worker->num_channels == 0) worker_exit(worker);
 		break;
 	}
+	worker_channel_unlock(mutex);
 }
 
 static int fr_worker_listen_cancel_self(fr_worker_t *worker, fr_listen_t const *li)
@@ -409,9 +615,10 @@ static void worker_listen_cancel_callback(void *ctx, void const *data, NDEBUG_UN
  *
  * @param[in] worker	the worker
  * @param[in] cd	the message to NAK
+ * @param[in] owner	the worker which received the message, when work stealing is enabled.
  * @param[in] now	when the message is NAKd
  */
-static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now)
+static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_worker_steal_slot_t *owner, fr_time_t now)
 {
 	size_t			size;
 	fr_channel_data_t	*reply;
@@ -427,6 +634,20 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	ch = cd->channel.ch;
 	listen = cd->listen;
 
+	worker_channel_lock(owner ? &owner->mutex : NULL);
+
+	/*
+	 *	We took the message from another worker, which has
+	 *	since closed the channel.  There's no one to send the
+	 *	NAK to.
+	 */
+	if (owner && (owner != worker->steal) && !fr_channel_active(ch)) {
+		fr_message_done(&cd->m);
+		(void) fr_channel_responder_release(ch);
+		worker_channel_unlock(&owner->mutex);
+		return;
+	}
+
 	/*
 	 *	If the channel has been closed, but we haven't
 	 *	been informed, that is extremely bad.
@@ -435,6 +656,7 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	 *	leak memory or SEGV soon.
 	 */
 	if (!fr_cond_assert_msg(fr_channel_active(ch), "Wanted to send NAK but channel has been closed")) {
+		worker_channel_unlock(owner ? &owner->mutex : NULL);
 		fr_message_done(&cd->m);
 		return;
 	}
@@ -470,6 +692,7 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	reply->reply.cpu_time = worker->tracking.running_total;
 	reply->reply.processing_time = fr_time_delta_from_sec(10); /* @todo - set to something better? */
 	reply->reply.request_time = cd->request.recv_time;
+	reply->reply.queue_time = fr_time_sub(now, cd->request.recv_time);
 
 	reply->listen = cd->listen;
 	reply->packet_ctx = cd->packet_ctx;
@@ -486,6 +709,10 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 		DEBUG2("Failed sending reply to channel");
 	}
 
+	if (owner && (owner != worker->steal)) (void) fr_channel_responder_release(ch);
+
+	worker_channel_unlock(owner ? &owner->mutex : NULL);
+
 	worker->stats.out++;
 }
 
@@ -651,6 +878,20 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, bool send
 	ch = request->async->channel;
 	fr_assert(ch != NULL);
 
+	worker_channel_lock(request->async->channel_mutex);
+
+	/*
+	 *	We took the request from another worker, which has
+	 *	since closed the channel.  There's no one to send
+	 *	the reply to.
+	 */
+	if (request->async->channel_mutex && !fr_channel_active(ch) &&
+	    (request->async->channel_mutex != &worker->steal->mutex)) {
+		worker_channel_unlock(request->async->channel_mutex);
+		RDEBUG("Discarding reply, as the channel has been closed");
+		return;
+	}
+
 	/*
 	 *	If the channel has been closed, but we haven't
 	 *	been informed, that is extremely bad.
@@ -659,6 +900,7 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, bool send
 	 *	leak memory or SEGV soon.
 	 */
 	if (!fr_cond_assert_msg(fr_channel_active(ch), "Wanted to send reply but channel has been closed")) {
+		worker_channel_unlock(request->async->channel_mutex);
 		return;
 	}
 
@@ -706,6 +948,8 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, bool send
 	reply->reply.cpu_time = worker->tracking.running_total;
 	reply->reply.processing_time = request->async->tracking.running_total;
 	reply->reply.request_time = request->async->recv_time;
+	reply->reply.queue_time = fr_time_delta_isneg(request->async->queue_time) ?
+				  fr_time_sub(now, request->async->recv_time) : request->async->queue_time;
 
 	reply->listen = request->async->listen;
 	reply->packet_ctx = request->async->packet_ctx;
@@ -717,6 +961,10 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, bool send
 	fr_time_elapsed_update(&worker->wall_clock, reply->reply.request_time, now);
 
 	RDEBUG("Finished request");
+	FR_PROBE(request_reply, request->number, reply->m.data_size,
+		 fr_time_delta_unwrap(reply->reply.processing_time));
+	fr_trace_ring_event(FR_TRACE_REPLY_SENT, request->number, NULL, request->async->listen->fd,
+			    (uint32_t) reply->m.data_size);
 
 	/*
 	 *	Send the reply, which also polls the request queue.
@@ -732,6 +980,8 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, bool send
 		RPERROR("Failed sending reply to network thread");
 	}
 
+	worker_channel_unlock(request->async->channel_mutex);
+
 	worker->stats.out++;
 
 	fr_assert(!fr_minmax_heap_entry_inserted(request->time_order_id));
@@ -787,6 +1037,11 @@ void worker_request_init(fr_worker_t *worker, request_t *request, fr_time_t now)
 	request->async = talloc_zero(request, fr_async_t);
 	request->async->recv_time = now;
 	request->async->el = worker->el;
+
+	/*
+	 *	Children of other requests inherit the parent's deadline.
+	 */
+	if (!fr_time_ispos(request->deadline)) request->deadline = fr_time_add(now, worker->config.max_request_time);
 	fr_dlist_entry_init(&request->async->entry);
 }
 
@@ -798,7 +1053,15 @@ void worker_request_name_number(request_t *request)
 	request->name = itoa_internal(request, request->number);
 }
 
-static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now)
+/** Turn a message from the network into a request, and mark it runnable
+ *
+ * @param[in] worker	the worker which will run the request.
+ * @param[in] cd	the message to decode.
+ * @param[in] owner	the worker which received the message, when work stealing is enabled.
+ * @param[in] now	the current time.
+ */
+static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
+				     fr_worker_steal_slot_t *owner, fr_time_t now)
 {
 	int			ret = -1;
 	request_t		*request;
@@ -807,11 +1070,15 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 
 	if (fr_minmax_heap_num_elements(worker->time_order) >= (uint32_t) worker->config.max_requests) goto nak;
 
-	ctx = request = request_alloc_external(NULL, NULL);
+	ctx = request = request_alloc_external(NULL, &(request_init_args_t){
+							.pair_pool_size = worker->config.talloc_pool_size
+						});
 	if (!request) goto nak;
 
 	worker_request_init(worker, request, now);
 	worker_request_name_number(request);
+	FR_PROBE(request_start, request->number, cd->listen->fd);
+	fr_trace_ring_event(FR_TRACE_WORKER_ASSIGNED, request->number, worker->name, cd->listen->fd, 0);
 
 	/*
 	 *	Associate our interpreter with the request
@@ -830,8 +1097,11 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	 *	Update the transport-specific fields.
 	 */
 	request->async->channel = cd->channel.ch;
+	if (owner) request->async->channel_mutex = &owner->mutex;
 
 	request->async->recv_time = cd->request.recv_time;
+	request->async->queue_time = fr_time_delta_wrap(-1);
+	request->deadline = fr_time_add(cd->request.recv_time, worker->config.max_request_time);
 
 	request->async->listen = cd->listen;
 	request->async->packet_ctx = cd->packet_ctx;
@@ -852,16 +1122,27 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	if (ret < 0) {
 		talloc_free(ctx);
 nak:
-		worker_nak(worker, cd, now);
+		worker_nak(worker, cd, owner, now);
 		return;
 	}
 
+#ifdef WITH_PERF
+	/*
+	 *	Trace a sample of requests, so that we can say where
+	 *	the time went if they turn out to be slow.
+	 */
+	if (fr_time_delta_ispos(worker->config.slow_request_threshold) &&
+	    ((worker->num_sampled++ % worker->config.slow_request_sample) == 0)) {
+		unlang_trace_start(request);
+	}
+#endif
+
 	/*
 	 *	Set the entry point for this virtual server.
 	 */
 	if (unlang_call_push(request, cd->listen->server_cs, UNLANG_TOP_FRAME) < 0) {
 		RERROR("Protocol failed to set 'process' function");
-		worker_nak(worker, cd, now);
+		worker_nak(worker, cd, owner, now);
 		return;
 	}
 
@@ -905,7 +1186,9 @@ nak:
 		if (fr_time_eq(old->async->recv_time, request->async->recv_time)) {
 			RWARN("Discarding duplicate of request (%"PRIu64")", old->number);
 
+			worker_channel_lock(request->async->channel_mutex);
 			fr_channel_null_reply(request->async->channel);
+			worker_channel_unlock(request->async->channel_mutex);
 			talloc_free(request);
 
 			/*
@@ -1016,6 +1299,11 @@ void fr_worker_destroy(fr_worker_t *worker)
 
 //	WORKER_VERIFY;
 
+	/*
+	 *	Stop scrapes from looking at us while we tear down.
+	 */
+	TALLOC_FREE(worker->metrics);
+
 	/*
 	 *	Stop any new requests running with this interpreter
 	 */
@@ -1036,6 +1324,17 @@ void fr_worker_destroy(fr_worker_t *worker)
 	}
 	fr_assert(fr_heap_num_elements(worker->runnable) == 0);
 
+	/*
+	 *	NAK any messages which are still in our backlog, and
+	 *	stop other workers from using our channels.
+	 */
+	if (worker->steal) {
+		atomic_store(&worker->steal->active, false);
+
+		pthread_mutex_lock(&worker->steal->mutex);
+		worker_backlog_nak(worker, NULL);
+	}
+
 	/*
 	 *	Signal the channels that we're closing.
 	 *
@@ -1056,6 +1355,15 @@ void fr_worker_destroy(fr_worker_t *worker)
 		fr_channel_responder_ack_close(worker->channel[i].ch);
 	}
 
+	if (worker->steal) {
+		pthread_mutex_unlock(&worker->steal->mutex);
+
+		/*
+		 *	Let a worker which is started later use our slot.
+		 */
+		atomic_store(&worker->steal->claimed, false);
+	}
+
 	talloc_free(worker);
 }
 
@@ -1077,6 +1385,42 @@ static void _worker_request_internal_init(request_t *request, void *uctx)
 	worker_request_time_tracking_start(worker, request, now);
 }
 
+#ifdef WITH_PERF
+/** Log the breakdown of a traced request, if it took too long
+ *
+ * The breakdown is written by the log thread, so a slow log destination
+ * doesn't make the worker slower still.
+ */
+static void worker_slow_request(fr_worker_t *worker, request_t *request, fr_time_t now)
+{
+	fr_time_delta_t	elapsed;
+	char		*trace, *msg;
+
+	if (likely(!unlang_trace_active(request))) return;
+
+	elapsed = fr_time_sub(now, request->async->recv_time);
+	if (fr_time_delta_lt(elapsed, worker->config.slow_request_threshold)) return;
+
+	worker->num_slow++;
+
+	trace = unlang_trace_print(request, request);
+	if (!trace) return;
+
+	msg = talloc_asprintf(request, "Slow request (%" PRIu64 ") via %s took %.3fms "
+			      "(cpu %.3fms, waiting %.3fms, threshold %.3fms)\n%s",
+			      request->number, request->async->listen->name,
+			      fr_time_delta_unwrap(elapsed) / 1000000.0,
+			      fr_time_delta_unwrap(request->async->tracking.running_total) / 1000000.0,
+			      fr_time_delta_unwrap(request->async->tracking.waiting_total) / 1000000.0,
+			      fr_time_delta_unwrap(worker->config.slow_request_threshold) / 1000000.0,
+			      trace);
+	talloc_free(trace);
+	if (!msg) return;
+
+	(void) fr_log_async(worker->log, L_WARN, msg, talloc_array_length(msg) - 1);
+	talloc_free(msg);
+}
+#endif
 
 /** External request is now complete
  *
@@ -1085,6 +1429,8 @@ static void _worker_request_done_external(request_t *request, UNUSED rlm_rcode_t
 {
 	fr_worker_t	*worker = talloc_get_type_abort(uctx, fr_worker_t);
 	fr_time_t 	now = fr_time();
+	fr_channel_t	*ch = request->async->channel;
+	pthread_mutex_t	*mutex = request->async->channel_mutex;
 
 	/*
 	 *	All external requests MUST have a listener.
@@ -1124,6 +1470,10 @@ static void _worker_request_done_external(request_t *request, UNUSED rlm_rcode_t
 	 */
 	worker_request_time_tracking_end(worker, request, now);
 
+#ifdef WITH_PERF
+	worker_slow_request(worker, request, now);
+#endif
+
 	/*
 	 *	Remove it from the list of requests associated with this channel.
 	 */
@@ -1140,11 +1490,22 @@ static void _worker_request_done_external(request_t *request, UNUSED rlm_rcode_t
 	if (unlikely((request->master_state == REQUEST_STOP_PROCESSING) &&
 		     !fr_channel_active(request->async->channel))) {
 		talloc_free(request);
-		return;
+		goto release;
 	}
 
 	worker_send_reply(worker, request, request->master_state != REQUEST_STOP_PROCESSING, now);
 	talloc_free(request);
+
+release:
+	/*
+	 *	We took the request from another worker, so it can now
+	 *	acknowledge the channel closing.
+	 */
+	if (mutex && (mutex != &worker->steal->mutex)) {
+		worker_channel_lock(mutex);
+		(void) fr_channel_responder_release(ch);
+		worker_channel_unlock(mutex);
+	}
 }
 
 /** Internal request (i.e. one generated by the interpreter) is now complete
@@ -1294,6 +1655,79 @@ static bool _worker_request_scheduled(request_t const *request, UNUSED void *uct
 	return fr_heap_entry_inserted(request->runnable_id);
 }
 
+/** Decode a message which is waiting in a backlog
+ *
+ *  Our own backlogs are checked first.  If they're empty, we take the
+ *  oldest unstarted message from another worker.  Requests which have
+ *  already started running are never moved between workers, and
+ *  neither are messages which only the worker which received them may
+ *  decode.
+ *
+ * @param[in] worker	the worker
+ * @param[in] now	the current time
+ * @return
+ *	- true if a message was found.
+ *	- false if all of the backlogs are empty.
+ */
+static bool worker_backlog_pop(fr_worker_t *worker, fr_time_t now)
+{
+	fr_worker_steal_t	*steal = worker->config.steal;
+	fr_worker_steal_slot_t	*owner;
+	fr_channel_data_t	*cd;
+	unsigned int		i, num;
+	void			*data;
+
+	if (fr_atomic_queue_pop(worker->steal->local, &data) ||
+	    fr_atomic_queue_pop(worker->steal->backlog, &data)) {
+		cd = data;
+		worker_request_bootstrap(worker, cd, worker->steal, now);
+		return true;
+	}
+
+	if (worker->exiting) return false;
+
+	num = atomic_load(&steal->used);
+	if (num > steal->num_slots) num = steal->num_slots;
+
+	for (i = 0; i < num; i++) {
+		owner = &steal->slot[(worker->steal_next + i) % num];
+		if (owner == worker->steal) continue;
+
+		if (!atomic_load(&owner->active)) continue;
+
+		if (fr_atomic_queue_length(owner->backlog) == 0) continue;
+
+		/*
+		 *	The other worker NAKs its backlog and closes
+		 *	its channels with the mutex held.  So once we
+		 *	hold the channel, it stays open for as long as
+		 *	we need it.
+		 */
+		pthread_mutex_lock(&owner->mutex);
+		if (!fr_atomic_queue_pop(owner->backlog, &data)) {
+			pthread_mutex_unlock(&owner->mutex);
+			continue;
+		}
+
+		cd = data;
+		fr_channel_responder_hold(cd->channel.ch);
+		pthread_mutex_unlock(&owner->mutex);
+
+		/*
+		 *	Start with the same worker next time, as it's
+		 *	probably still busy.
+		 */
+		worker->steal_next = (worker->steal_next + i) % num;
+		worker->num_stolen++;
+
+		DEBUG3("Took request from the backlog of another worker");
+		worker_request_bootstrap(worker, cd, owner, now);
+		return true;
+	}
+
+	return false;
+}
+
 /** Run a request
  *
  *  Until it either yields, or is done.
@@ -1320,8 +1754,14 @@ static inline CC_HINT(always_inline) void worker_run_request(fr_worker_t *worker
 	 *	ongoing requests, at the expense of sometimes ignoring
 	 *	new ones.
 	 */
-	while (fr_time_delta_lt(fr_time_sub(now, start), fr_time_delta_from_msec(1)) &&
-	       ((request = fr_heap_pop(&worker->runnable)) != NULL)) {
+	while (fr_time_delta_lt(fr_time_sub(now, start), fr_time_delta_from_msec(1))) {
+		request = fr_heap_pop(&worker->runnable);
+		if (!request) {
+			if (!worker->steal || !worker_backlog_pop(worker, now)) break;
+
+			now = fr_time();
+			continue;
+		}
 
 		REQUEST_VERIFY(request);
 		fr_assert(!fr_heap_entry_inserted(request->runnable_id));
@@ -1335,12 +1775,84 @@ static inline CC_HINT(always_inline) void worker_run_request(fr_worker_t *worker
 			return;
 		}
 
+		/*
+		 *	Record how long the request was queued for, so
+		 *	that the network side can tell when we're
+		 *	overloaded.
+		 */
+		if (fr_time_delta_isneg(request->async->queue_time)) {
+			request->async->queue_time = fr_time_sub(now, request->async->recv_time);
+			worker->queue_delay = fr_time_delta_wrap((fr_time_delta_unwrap(request->async->queue_time) +
+								  (fr_time_delta_unwrap(worker->queue_delay) * 7)) / 8);
+		}
+
 		(void)unlang_interpret(request);
 
 		now = fr_time();
 	}
 }
 
+static int _worker_steal_free(fr_worker_steal_t *steal)
+{
+	unsigned int i;
+
+	for (i = 0; i < steal->num_slots; i++) pthread_mutex_destroy(&steal->slot[i].mutex);
+
+	return 0;
+}
+
+/** Allocate the state shared by workers which take work from each other
+ *
+ * The result should be placed into #fr_worker_config_t before any of the
+ * workers are created, and must outlive all of them.
+ *
+ * @param[in] ctx		the talloc context.
+ * @param[in] max_workers	the maximum number of workers in the group.
+ * @return
+ *	- NULL on error.
+ *	- fr_worker_steal_t on success.
+ */
+fr_worker_steal_t *fr_worker_steal_alloc(TALLOC_CTX *ctx, unsigned int max_workers)
+{
+	fr_worker_steal_t	*steal;
+	pthread_mutexattr_t	attr;
+	unsigned int		i;
+	int			ret;
+
+	MEM(steal = talloc_zero(ctx, fr_worker_steal_t));
+	MEM(steal->slot = talloc_zero_array(steal, fr_worker_steal_slot_t, max_workers));
+	talloc_set_destructor(steal, _worker_steal_free);
+
+	/*
+	 *	Draining a channel can NAK messages, which also
+	 *	uses the channel.  So the mutex has to be recursive.
+	 */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+	for (i = 0; i < max_workers; i++) {
+		ret = pthread_mutex_init(&steal->slot[i].mutex, &attr);
+		if (ret != 0) {
+			fr_strerror_printf("Failed initialising mutex: %s", fr_syserror(ret));
+		fail:
+			pthread_mutexattr_destroy(&attr);
+			talloc_free(steal);
+			return NULL;
+		}
+		steal->num_slots++;
+
+		steal->slot[i].backlog = fr_atomic_queue_alloc(steal, WORKER_STEAL_BACKLOG);
+		steal->slot[i].local = fr_atomic_queue_alloc(steal, WORKER_STEAL_BACKLOG);
+		if (!steal->slot[i].backlog || !steal->slot[i].local) {
+			fr_strerror_const("Failed creating atomic queue");
+			goto fail;
+		}
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	return steal;
+}
+
 /** Create a worker
  *
  * @param[in] ctx the talloc context
@@ -1368,6 +1880,9 @@ nomem:
 	worker->name = talloc_strdup(worker, name); /* thread locality */
 
 	unlang_thread_instantiate(worker);
+#ifdef WITH_PERF
+	worker->unlang_perf = unlang_thread_perf();
+#endif
 
 	if (config) worker->config = *config;
 
@@ -1385,9 +1900,14 @@ nomem:
 	CHECK_CONFIG(max_requests,1024,(1 << 30));
 	CHECK_CONFIG(max_channels, 64, 1024);
 	CHECK_CONFIG(talloc_pool_size, 4096, 65536);
+	CHECK_CONFIG(request_pool_max, 256, 65536);
+	if (worker->config.request_pool_init > worker->config.request_pool_max) {
+		worker->config.request_pool_init = worker->config.request_pool_max;
+	}
 	CHECK_CONFIG(message_set_size, 1024, 8192);
 	CHECK_CONFIG(ring_buffer_size, (1 << 17), (1 << 20));
 	CHECK_CONFIG_TIME_DELTA(max_request_time, fr_time_delta_from_sec(5), fr_time_delta_from_sec(120));
+	CHECK_CONFIG(slow_request_sample, 1, (1 << 30));
 
 	worker->channel = talloc_zero_array(worker, fr_worker_channel_t, worker->config.max_channels);
 	if (!worker->channel) {
@@ -1478,6 +1998,40 @@ nomem:
 	}
 	unlang_interpret_set_thread_default(worker->intp);
 
+	/*
+	 *	Warm the request free list, so that the first burst
+	 *	of traffic doesn't have to wait on allocations.
+	 */
+	request_free_list_init(worker->config.request_pool_max, worker->config.request_pool_init,
+			       worker->config.talloc_pool_size);
+	worker->request_pool = request_free_list_stats();
+
+	/*
+	 *	Claim a slot in the work stealing group.  This is
+	 *	done last, as other workers can start taking messages
+	 *	from us as soon as the slot is active.
+	 */
+	if (worker->config.steal) {
+		fr_worker_steal_t	*steal = worker->config.steal;
+		unsigned int		slot, used;
+
+		for (slot = 0; slot < steal->num_slots; slot++) {
+			bool claimed = false;
+
+			if (!atomic_compare_exchange_strong(&steal->slot[slot].claimed, &claimed, true)) continue;
+
+			used = atomic_load(&steal->used);
+			while ((used <= slot) && !atomic_compare_exchange_weak(&steal->used, &used, slot + 1));
+
+			worker->steal = &steal->slot[slot];
+			worker->steal_next = slot + 1;
+			atomic_store(&worker->steal->active, true);
+			break;
+		}
+	}
+
+	MEM(worker->metrics = fr_metrics_source_alloc(worker, worker_metrics, worker));
+
 	return worker;
 }
 
@@ -1505,12 +2059,30 @@ void fr_worker(fr_worker_t *worker)
 		 *	the event loop, but we don't wait for events.
 		 */
 		wait_for_event = (fr_heap_num_elements(worker->runnable) == 0);
+		if (wait_for_event && worker->steal &&
+		    ((fr_atomic_queue_length(worker->steal->local) > 0) ||
+		     (fr_atomic_queue_length(worker->steal->backlog) > 0))) {
+			wait_for_event = false;
+		}
+
 		if (wait_for_event) {
 			if (worker->exiting && (fr_minmax_heap_num_elements(worker->time_order) == 0)) break;
 
 			DEBUG4("Ready to process requests");
 		}
 
+		/*
+		 *	No request is running, so we hold no references
+		 *	to reloadable data.
+		 */
+		if (wait_for_event) {
+			fr_reload_thread_offline();
+		} else {
+			fr_reload_thread_quiescent();
+		}
+
+		fr_memory_thread_sample();
+
 		/*
 		 *	Check the event list.  If there's an error
 		 *	(e.g. exit), we stop looping and clean up.
@@ -1550,7 +2122,10 @@ int fr_worker_pre_event(UNUSED fr_time_t now, UNUSED fr_time_delta_t wake, void
 	request_t *request;
 
 	request = fr_heap_peek(worker->runnable);
-	if (!request) return 0;
+	if (!request) {
+		fr_reload_thread_offline();
+		return 0;
+	}
 
 	/*
 	 *	There's work to do.  Tell the event handler to poll
@@ -1570,6 +2145,9 @@ void fr_worker_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void
 	fr_worker_t *worker = talloc_get_type_abort(uctx, fr_worker_t);
 
 	worker_run_request(worker, fr_time());	/* Event loop time can be too old, and trigger asserts */
+
+	fr_reload_thread_quiescent();
+	fr_memory_thread_sample();
 }
 
 /** Print debug information about the worker structure
@@ -1583,6 +2161,7 @@ void fr_worker_debug(fr_worker_t *worker, FILE *fp)
 
 	fprintf(fp, "\tnum_channels = %d\n", worker->num_channels);
 	fprintf(fp, "\tstats.in = %" PRIu64 "\n", worker->stats.in);
+	if (worker->steal) fprintf(fp, "\tnum_stolen = %" PRIu64 "\n", worker->num_stolen);
 
 	fprintf(fp, "\tcalculated (predicted) total CPU time = %" PRIu64 "\n",
 		fr_time_delta_unwrap(worker->predicted) * worker->stats.in);
@@ -1690,9 +2269,40 @@ int fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats)
 	if (num >= 5) stats[4] = worker->num_naks;
 	if (num >= 6) stats[5] = worker->num_active;
 
-	if (num <= 6) return num;
+	if (num >= 7) stats[6] = worker->request_pool->hits;
+	if (num >= 8) stats[7] = worker->request_pool->misses;
 
-	return 6;
+	if (num <= 8) return num;
+
+	return 8;
+}
+
+/** Return how much work a worker has waiting
+ *
+ * This is called by the scheduler from another thread.  As with
+ * fr_worker_stats(), each value has only one writer, the worker
+ * thread, so we read them without locking.
+ *
+ * @param[in] worker		to check.
+ * @param[out] in		number of requests the worker has received.
+ * @param[out] queue_delay	moving average of how long requests wait
+ *				before they start running.
+ * @return the number of requests which are waiting to run.
+ */
+uint64_t fr_worker_load(fr_worker_t const *worker, uint64_t *in, fr_time_delta_t *queue_delay)
+{
+	uint64_t runnable;
+
+	*in = worker->stats.in;
+	*queue_delay = worker->queue_delay;
+
+	runnable = fr_heap_num_elements(worker->runnable);
+	if (worker->steal) {
+		runnable += fr_atomic_queue_length(worker->steal->local);
+		runnable += fr_atomic_queue_length(worker->steal->backlog);
+	}
+
+	return runnable;
 }
 
 static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
@@ -1708,6 +2318,14 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fprintf(fp, "count.naks\t\t\t%" PRIu64 "\n", worker->num_naks);
 		fprintf(fp, "count.active\t\t\t%" PRIu64 "\n", worker->num_active);
 		fprintf(fp, "count.runnable\t\t\t%u\n", fr_heap_num_elements(worker->runnable));
+		if (worker->steal) fprintf(fp, "count.stolen\t\t\t%" PRIu64 "\n", worker->num_stolen);
+		fprintf(fp, "count.request_pool_hits\t\t%" PRIu64 "\n", worker->request_pool->hits);
+		fprintf(fp, "count.request_pool_misses\t%" PRIu64 "\n", worker->request_pool->misses);
+#ifdef WITH_PERF
+		if (fr_time_delta_ispos(worker->config.slow_request_threshold)) {
+			fprintf(fp, "count.slow\t\t\t%" PRIu64 "\n", worker->num_slow);
+		}
+#endif
 	}
 
 	if ((info->argc == 0) || (strcmp(info->argv[0], "cpu") == 0)) {
@@ -1731,6 +2349,20 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 	return 0;
 }
 
+#ifdef WITH_PERF
+static int cmd_stats_worker_unlang(FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	fr_worker_t const *worker = ctx;
+
+	if (unlang_perf_fprint(fp, worker->unlang_perf, (info->argc > 0) ? info->argv[0] : NULL) < 0) {
+		fprintf(fp_err, "%s\n", fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
 fr_cmd_table_t cmd_worker_table[] = {
 	{
 		.parent = "stats",
@@ -1749,5 +2381,17 @@ fr_cmd_table_t cmd_worker_table[] = {
 		.read_only = true
 	},
 
+#ifdef WITH_PERF
+	{
+		.parent = "stats worker",
+		.add_name = true,
+		.name = "unlang",
+		.syntax = "[(count|cpu|wall|yield|folded)]",
+		.func = cmd_stats_worker_unlang,
+		.help = "Show per-instruction counters for a worker thread, sorted by the given column.  'folded' prints stacks for flamegraph.pl.",
+		.read_only = true
+	},
+#endif
+
 	CMD_TABLE_END
 };
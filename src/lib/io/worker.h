@@ -37,6 +37,11 @@ extern "C" {
  */
 typedef struct fr_worker_s fr_worker_t;
 
+/**
+ *  State shared by a group of workers which take work from each other.
+ */
+typedef struct fr_worker_steal_s fr_worker_steal_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -66,8 +71,20 @@ typedef struct {
 	fr_time_delta_t	max_request_time;	//!< maximum time a request can be processed
 
 	size_t		talloc_pool_size;	//!< for each request
+
+	unsigned int	request_pool_init;	//!< number of requests to allocate at startup
+	unsigned int	request_pool_max;	//!< maximum number of free requests to keep for reuse
+
+	fr_worker_steal_t *steal;		//!< if set, idle workers take unstarted requests
+						//!< from busy ones.
+
+	fr_time_delta_t	slow_request_threshold;	//!< log a breakdown of traced requests which
+						//!< take longer than this.  Zero disables tracing.
+	uint32_t	slow_request_sample;	//!< trace one in this many requests.
 } fr_worker_config_t;
 
+fr_worker_steal_t *fr_worker_steal_alloc(TALLOC_CTX *ctx, unsigned int max_workers) CC_HINT(nonnull);
+
 fr_worker_t	*fr_worker_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const *name,
 				  fr_log_t const *logger, fr_log_lvl_t lvl, fr_worker_config_t *config) CC_HINT(nonnull(2,3,4));
 
@@ -85,6 +102,8 @@ fr_channel_t	*fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_
 
 int		fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats) CC_HINT(nonnull);
 
+uint64_t	fr_worker_load(fr_worker_t const *worker, uint64_t *in, fr_time_delta_t *queue_delay) CC_HINT(nonnull);
+
 int		fr_worker_listen_cancel(fr_worker_t *worker, fr_listen_t const *li);
 
 #include <freeradius-devel/server/module.h>
@@ -247,6 +247,18 @@ char		*fr_jpath_asprint(TALLOC_CTX *ctx, fr_jpath_node_t const *head);
 
 ssize_t		fr_jpath_parse(TALLOC_CTX *ctx, fr_jpath_node_t **head, char const *in, size_t inlen);
 
+typedef struct fr_jpath_set_s fr_jpath_set_t;
+
+fr_jpath_set_t	*fr_jpath_set_alloc(TALLOC_CTX *ctx);
+
+unsigned int	fr_jpath_set_num(fr_jpath_set_t const *set) CC_HINT(nonnull);
+
+int		fr_jpath_set_add(fr_jpath_set_t *set, fr_jpath_node_t const *jpath,
+				 fr_type_t dst_type, fr_dict_attr_t const *dst_enumv) CC_HINT(nonnull(1,2));
+
+int		fr_jpath_set_evaluate(TALLOC_CTX *ctx, fr_value_box_list_t *out, fr_jpath_set_t const *set,
+				      char const *in, size_t inlen) CC_HINT(nonnull(2,3,4));
+
 /* json.c */
 int		fr_json_object_to_value_box(TALLOC_CTX *ctx, fr_value_box_t *out, json_object *object,
 					    fr_dict_attr_t const *enumv, bool tainted);
@@ -257,6 +269,12 @@ fr_slen_t	fr_json_str_from_value(fr_sbuff_t *out, fr_value_box_t *vb, bool inclu
 
 void		fr_json_version_print(void);
 
+json_object	*fr_json_object_afrom_pair_list(TALLOC_CTX *ctx, fr_pair_list_t *vps,
+					       fr_json_format_t const *format);
+
+fr_slen_t	fr_json_str_from_pair_list(fr_sbuff_t *out, fr_pair_list_t *vps,
+					   fr_json_format_t const *format);
+
 char		*fr_json_afrom_pair_list(TALLOC_CTX *ctx, fr_pair_list_t *vps,
 					 fr_json_format_t const *format);
 
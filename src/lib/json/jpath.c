@@ -125,6 +125,37 @@ size_t fr_jpath_escape_func(UNUSED request_t *request, char *out, size_t outlen,
 	return q - out;
 }
 
+/** Convert a leaf of the json-c tree to a value box, and add it to the output list
+ *
+ * @param[in,out] ctx to allocate fr_value_box_t in.
+ * @param[out] tail Where to write fr_value_box_t.
+ * @param[in] dst_type FreeRADIUS type to convert to.
+ * @param[in] dst_enumv Enumeration values to allow string to integer conversions.
+ * @param[in] object to convert.
+ * @return
+ *	- 1 on success.
+ *	- -1 on error.
+ */
+static int jpath_leaf_to_value_box(TALLOC_CTX *ctx, fr_value_box_list_t *tail,
+				   fr_type_t dst_type, fr_dict_attr_t const *dst_enumv, json_object *object)
+{
+	fr_value_box_t *value;
+
+	MEM(value = fr_value_box_alloc_null(ctx));
+	if (fr_json_object_to_value_box(value, value, object, dst_enumv, true) < 0) {
+		talloc_free(value);
+		return -1;
+	}
+
+	if (fr_value_box_cast_in_place(value, value, dst_type, dst_enumv) < 0) {
+		talloc_free(value);
+		return -1;
+	}
+
+	fr_value_box_list_insert_tail(tail, value);
+	return 1;
+}
+
 /** Recursive function for jpath_expr_evaluate
  *
  * @param[in,out] ctx to allocate fr_value_box_t in.
@@ -142,7 +173,6 @@ static int jpath_evaluate(TALLOC_CTX *ctx, fr_value_box_list_t *tail,
 			  fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
 			  json_object *object, fr_jpath_node_t const *jpath)
 {
-	fr_value_box_t		*value;
 	fr_jpath_node_t const	*node;
 	jpath_selector_t const	*selector;
 	bool			child_matched = false;
@@ -349,19 +379,7 @@ static int jpath_evaluate(TALLOC_CTX *ctx, fr_value_box_list_t *tail,
 	 *	we now attempt conversion of the leaf to
 	 *	the specified value.
 	 */
-	MEM(value = fr_value_box_alloc_null(ctx));
-	if (fr_json_object_to_value_box(value, value, object, dst_enumv, true) < 0) {
-		talloc_free(value);
-		return -1;
-	}
-
-	if (fr_value_box_cast_in_place(value, value, dst_type, dst_enumv) < 0) {
-		talloc_free(value);
-		return -1;
-	}
-
-	fr_value_box_list_insert_tail(tail, value);
-	return 1;
+	return jpath_leaf_to_value_box(ctx, tail, dst_type, dst_enumv, object);
 }
 
 /** Evaluate a parsed jpath expression against a json-c tree
@@ -950,3 +968,819 @@ do { \
 	return p - in;
 }
 
+
+/*
+ *	Single pass evaluation of a set of jpath expressions
+ *
+ *	The expressions are compiled into a tree of states, where
+ *	expressions with a common prefix share the states for that
+ *	prefix.  The document is then tokenized, without building a
+ *	json-c tree, and at each level we track which states match the
+ *	current position in the document.  Subtrees which no state
+ *	matches are validated, but nothing else is done with them.
+ *
+ *	Only expressions whose results don't depend on anything after
+ *	the current position in the document can be evaluated this way.
+ *	That's fields, wildcards, indexes, and ascending slices with
+ *	a non-negative start and end.
+ *
+ *	Anything we don't handle in exactly the same way as json-c, e.g.
+ *	syntax errors, json-c extensions, duplicate keys, or expressions
+ *	which match an object or array, causes evaluation to stop, and
+ *	the caller should fall back to parsing the document with json-c.
+ */
+
+/** Nesting limit
+ *
+ * Below json-c's default limit of 32, so we never accept a document
+ * which json-c would reject.
+ */
+#define JPATH_STREAM_MAX_DEPTH		30
+
+typedef struct jpath_state_s jpath_state_t;
+
+/** A state in the automaton built from a set of jpath expressions
+ *
+ */
+struct jpath_state_s {
+	jpath_selector_t const	*selector;	//!< Which selects the JSON nodes this state matches.
+						///< NULL for the root state.
+	size_t			field_len;	//!< Length of the field, for field selectors.
+	jpath_state_t		**child;	//!< States matching the children of nodes we match.
+	unsigned int		*accept;	//!< Expressions which end at this state.
+};
+
+/** Where the results of an expression should go
+ *
+ */
+typedef struct {
+	fr_type_t		type;		//!< FreeRADIUS type to convert to.
+	fr_dict_attr_t const	*enumv;		//!< Enumeration values to allow string to integer conversions.
+} jpath_set_dst_t;
+
+/** A set of jpath expressions which can be evaluated in a single pass
+ *
+ */
+struct fr_jpath_set_s {
+	jpath_state_t		root;		//!< Matches the root of the document.
+	jpath_set_dst_t		*dst;		//!< One for each expression.
+	unsigned int		num_states;	//!< Including the root.
+};
+
+/** A key we've matched in the current object
+ *
+ * Used to detect duplicate keys, which json-c handles by keeping
+ * the last value.
+ */
+typedef struct {
+	char const		*name;		//!< As it appears in the document.
+	size_t			len;
+} jpath_stream_key_t;
+
+typedef struct {
+	char const		*p;		//!< Where we are in the document.
+	char const		*end;		//!< End of the document.
+	unsigned int		depth;		//!< Of nested objects and arrays.
+
+	TALLOC_CTX		*ctx;		//!< To allocate value boxes in.
+	fr_value_box_list_t	*out;		//!< One list for each expression.
+	fr_jpath_set_t const	*set;
+
+	jpath_state_t const	**active;	//!< States which match the current node, and its parents.
+	unsigned int		active_used;
+
+	jpath_stream_key_t	*keys;		//!< Keys matched in the current object, and its parents.
+	unsigned int		keys_used;
+
+	char			*buff;		//!< For unescaping strings.
+} jpath_stream_t;
+
+typedef enum {
+	JPATH_STREAM_ERROR = -1,		//!< A value couldn't be converted.
+	JPATH_STREAM_OK = 0,
+	JPATH_STREAM_UNSUPPORTED = 1		//!< The document must be parsed by json-c.
+} jpath_stream_rcode_t;
+
+/** Allocate an empty set of jpath expressions
+ *
+ * @param[in] ctx	to allocate the set in.
+ * @return a new set.
+ */
+fr_jpath_set_t *fr_jpath_set_alloc(TALLOC_CTX *ctx)
+{
+	fr_jpath_set_t *set;
+
+	MEM(set = talloc_zero(ctx, fr_jpath_set_t));
+	MEM(set->dst = talloc_array(set, jpath_set_dst_t, 0));
+	set->num_states = 1;
+
+	return set;
+}
+
+/** Return the number of expressions in the set
+ *
+ */
+unsigned int fr_jpath_set_num(fr_jpath_set_t const *set)
+{
+	return talloc_array_length(set->dst);
+}
+
+static bool jpath_selector_cmp(jpath_selector_t const *a, jpath_selector_t const *b)
+{
+	if (a->type != b->type) return false;
+
+	switch (a->type) {
+	case JPATH_SELECTOR_FIELD:
+		return (strcmp(a->field, b->field) == 0);
+
+	case JPATH_SELECTOR_INDEX:
+	case JPATH_SELECTOR_SLICE:
+		return (memcmp(a->slice, b->slice, sizeof(a->slice)) == 0);
+
+	default:
+		return true;
+	}
+}
+
+/** Add a jpath expression to a set
+ *
+ * The set references the expression, which must not be freed
+ * before the set is.
+ *
+ * @param[in] set	to add the expression to.
+ * @param[in] jpath	to add.
+ * @param[in] dst_type	FreeRADIUS type to convert values to.
+ * @param[in] dst_enumv	Enumeration values to allow string to integer conversions.
+ * @return
+ *	- >= 0 the index of the expression's results in the output of #fr_jpath_set_evaluate.
+ *	- -1 if the expression can't be evaluated in a single pass.
+ */
+int fr_jpath_set_add(fr_jpath_set_t *set, fr_jpath_node_t const *jpath,
+		     fr_type_t dst_type, fr_dict_attr_t const *dst_enumv)
+{
+	fr_jpath_node_t const	*node;
+	jpath_state_t		*state;
+	unsigned int		idx;
+
+	switch (jpath->selector->type) {
+	case JPATH_SELECTOR_ROOT:
+	case JPATH_SELECTOR_CURRENT:
+		break;
+
+	default:
+	unsupported:
+		fr_strerror_const("Expression can't be evaluated in a single pass");
+		return -1;
+	}
+
+	/*
+	 *	Check the whole expression before we
+	 *	change anything.
+	 */
+	for (node = jpath->next; node; node = node->next) {
+		jpath_selector_t const *selector = node->selector;
+
+		switch (selector->type) {
+		case JPATH_SELECTOR_FIELD:
+		case JPATH_SELECTOR_WILDCARD:
+			break;
+
+		/*
+		 *	Multiple selectors produce results in the
+		 *	order of the selectors, not the document.
+		 */
+		case JPATH_SELECTOR_INDEX:
+			if (selector->next) goto unsupported;
+			break;
+
+		/*
+		 *	Anything relative to the end of the array
+		 *	needs us to know how long it is.
+		 */
+		case JPATH_SELECTOR_SLICE:
+			if (selector->next) goto unsupported;
+			if ((selector->slice[2] != SELECTOR_INDEX_UNSET) && (selector->slice[2] <= 0)) goto unsupported;
+			if (selector->slice[0] < 0) goto unsupported;
+			if ((selector->slice[1] == SELECTOR_INDEX_UNSET) || (selector->slice[1] < 0)) goto unsupported;
+			break;
+
+		default:
+			goto unsupported;
+		}
+	}
+
+	state = &set->root;
+	for (node = jpath->next; node; node = node->next) {
+		jpath_state_t	*child = NULL;
+		size_t		i, num = talloc_array_length(state->child);
+
+		for (i = 0; i < num; i++) {
+			if (jpath_selector_cmp(state->child[i]->selector, node->selector)) {
+				child = state->child[i];
+				break;
+			}
+		}
+
+		if (!child) {
+			MEM(child = talloc_zero(set, jpath_state_t));
+			child->selector = node->selector;
+			if (node->selector->type == JPATH_SELECTOR_FIELD) child->field_len = strlen(node->selector->field);
+
+			MEM(state->child = talloc_realloc(set, state->child, jpath_state_t *, num + 1));
+			state->child[num] = child;
+			set->num_states++;
+		}
+
+		state = child;
+	}
+
+	idx = talloc_array_length(set->dst);
+
+	MEM(set->dst = talloc_realloc(set, set->dst, jpath_set_dst_t, idx + 1));
+	set->dst[idx] = (jpath_set_dst_t) { .type = dst_type, .enumv = dst_enumv };
+
+	MEM(state->accept = talloc_realloc(set, state->accept, unsigned int,
+					   talloc_array_length(state->accept) + 1));
+	state->accept[talloc_array_length(state->accept) - 1] = idx;
+
+	return idx;
+}
+
+static inline CC_HINT(always_inline) void jpath_stream_ws(jpath_stream_t *js)
+{
+	while ((js->p < js->end) &&
+	       ((*js->p == ' ') || (*js->p == '\t') || (*js->p == '\n') || (*js->p == '\r'))) js->p++;
+}
+
+/** Find the end of a string
+ *
+ * @param[in] js	tokenizer state, pointing at the opening quote.
+ * @param[out] out	the string, as it appears in the document.
+ * @param[out] outlen	length of the string.
+ * @param[out] escaped	whether the string contains escape sequences.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the string isn't terminated.
+ */
+static int jpath_stream_string(jpath_stream_t *js, char const **out, size_t *outlen, bool *escaped)
+{
+	char const *p = js->p + 1;
+
+	*escaped = false;
+
+	while (p < js->end) {
+		switch (*p) {
+		case '"':
+			*out = js->p + 1;
+			*outlen = p - *out;
+			js->p = p + 1;
+			return 0;
+
+		case '\\':
+			*escaped = true;
+			p += 2;
+			continue;
+
+		default:
+			p++;
+			continue;
+		}
+	}
+
+	return -1;
+}
+
+static int jpath_stream_hex4(uint32_t *out, char const *p, char const *end)
+{
+	int i;
+
+	if ((end - p) < 4) return -1;
+
+	*out = 0;
+	for (i = 0; i < 4; i++) {
+		char c = p[i];
+
+		*out <<= 4;
+		if ((c >= '0') && (c <= '9')) *out |= c - '0';
+		else if ((c >= 'a') && (c <= 'f')) *out |= c - 'a' + 10;
+		else if ((c >= 'A') && (c <= 'F')) *out |= c - 'A' + 10;
+		else return -1;
+	}
+
+	return 0;
+}
+
+/** Unescape a string into the tokenizer's buffer
+ *
+ * The unescaped string is never longer than the escaped one.
+ *
+ * @return
+ *	- >= 0 the length of the unescaped string.
+ *	- -1 if it contains escape sequences we don't handle in the same way as json-c.
+ */
+static ssize_t jpath_stream_unescape(jpath_stream_t *js, char const *in, size_t inlen)
+{
+	char const	*p = in, *end = in + inlen;
+	char		*q;
+
+	if (talloc_array_length(js->buff) <= inlen) MEM(js->buff = talloc_realloc(js->ctx, js->buff, char, inlen + 1));
+	q = js->buff;
+
+	while (p < end) {
+		uint32_t cp, low;
+
+		if (*p != '\\') {
+			*q++ = *p++;
+			continue;
+		}
+
+		if (++p == end) return -1;
+
+		switch (*p++) {
+		case '"':
+		case '\\':
+		case '/':
+			*q++ = p[-1];
+			continue;
+
+		case 'b':
+			*q++ = '\b';
+			continue;
+
+		case 'f':
+			*q++ = '\f';
+			continue;
+
+		case 'n':
+			*q++ = '\n';
+			continue;
+
+		case 'r':
+			*q++ = '\r';
+			continue;
+
+		case 't':
+			*q++ = '\t';
+			continue;
+
+		case 'u':
+			if (jpath_stream_hex4(&cp, p, end) < 0) return -1;
+			p += 4;
+			break;
+
+		default:
+			return -1;
+		}
+
+		/*
+		 *	Surrogate pairs must be complete.
+		 */
+		if ((cp >= 0xd800) && (cp <= 0xdbff)) {
+			if (((end - p) < 6) || (p[0] != '\\') || (p[1] != 'u') ||
+			    (jpath_stream_hex4(&low, p + 2, end) < 0) || (low < 0xdc00) || (low > 0xdfff)) return -1;
+			p += 6;
+			cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+		} else if ((cp >= 0xdc00) && (cp <= 0xdfff)) {
+			return -1;
+		}
+
+		if (cp < 0x80) {
+			*q++ = cp;
+		} else if (cp < 0x800) {
+			*q++ = 0xc0 | (cp >> 6);
+			*q++ = 0x80 | (cp & 0x3f);
+		} else if (cp < 0x10000) {
+			*q++ = 0xe0 | (cp >> 12);
+			*q++ = 0x80 | ((cp >> 6) & 0x3f);
+			*q++ = 0x80 | (cp & 0x3f);
+		} else {
+			*q++ = 0xf0 | (cp >> 18);
+			*q++ = 0x80 | ((cp >> 12) & 0x3f);
+			*q++ = 0x80 | ((cp >> 6) & 0x3f);
+			*q++ = 0x80 | (cp & 0x3f);
+		}
+	}
+
+	return q - js->buff;
+}
+
+/** Find the end of a number
+ *
+ * Only accepts numbers in the format described by RFC 8259.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the number is malformed.
+ */
+static int jpath_stream_number(jpath_stream_t *js, char const **out, size_t *outlen, bool *is_double)
+{
+	char const *p = js->p, *end = js->end;
+
+	*is_double = false;
+
+	if ((p < end) && (*p == '-')) p++;
+
+	if ((p < end) && (*p == '0')) {
+		p++;
+	} else {
+		if ((p == end) || !isdigit((uint8_t) *p)) return -1;
+		while ((p < end) && isdigit((uint8_t) *p)) p++;
+	}
+
+	if ((p < end) && (*p == '.')) {
+		*is_double = true;
+		p++;
+		if ((p == end) || !isdigit((uint8_t) *p)) return -1;
+		while ((p < end) && isdigit((uint8_t) *p)) p++;
+	}
+
+	if ((p < end) && ((*p == 'e') || (*p == 'E'))) {
+		*is_double = true;
+		p++;
+		if ((p < end) && ((*p == '+') || (*p == '-'))) p++;
+		if ((p == end) || !isdigit((uint8_t) *p)) return -1;
+		while ((p < end) && isdigit((uint8_t) *p)) p++;
+	}
+
+	/*
+	 *	json-c can't tell if a number at the end
+	 *	of the input is complete.
+	 */
+	if (p == end) return -1;
+
+	*out = js->p;
+	*outlen = p - js->p;
+	js->p = p;
+
+	return 0;
+}
+
+static jpath_stream_rcode_t jpath_stream_value(jpath_stream_t *js, jpath_state_t const **active, unsigned int num);
+
+/** Evaluate an object
+ *
+ */
+static jpath_stream_rcode_t jpath_stream_object(jpath_stream_t *js, jpath_state_t const **active, unsigned int num)
+{
+	jpath_state_t const	**child = js->active + js->active_used;
+	unsigned int		keys_start = js->keys_used;
+
+	js->p++;	/* '{' */
+
+	for (;;) {
+		char const		*key;
+		size_t			key_len;
+		bool			escaped;
+		unsigned int		i, num_child = 0;
+		jpath_stream_rcode_t	ret;
+
+		jpath_stream_ws(js);
+		if (js->p == js->end) return JPATH_STREAM_UNSUPPORTED;
+
+		/*
+		 *	Empty objects, and trailing commas,
+		 *	which json-c allows.
+		 */
+		if (*js->p == '}') break;
+
+		if ((*js->p != '"') || (jpath_stream_string(js, &key, &key_len, &escaped) < 0)) {
+			return JPATH_STREAM_UNSUPPORTED;
+		}
+
+		jpath_stream_ws(js);
+		if ((js->p == js->end) || (*js->p != ':')) return JPATH_STREAM_UNSUPPORTED;
+		js->p++;
+
+		/*
+		 *	Find the states which match this
+		 *	key's value.
+		 */
+		if (num) {
+			char const	*name = key;
+			ssize_t		name_len = key_len;
+
+			if (escaped) {
+				name_len = jpath_stream_unescape(js, key, key_len);
+				if (name_len < 0) return JPATH_STREAM_UNSUPPORTED;
+				name = js->buff;
+			}
+
+			for (i = 0; i < num; i++) {
+				size_t j;
+
+				for (j = 0; j < talloc_array_length(active[i]->child); j++) {
+					jpath_state_t const *state = active[i]->child[j];
+
+					switch (state->selector->type) {
+					case JPATH_SELECTOR_FIELD:
+						if (((size_t)name_len != state->field_len) ||
+						    (memcmp(name, state->selector->field, name_len) != 0)) continue;
+						break;
+
+					case JPATH_SELECTOR_WILDCARD:
+						break;
+
+					default:
+						continue;
+					}
+
+					child[num_child++] = state;
+				}
+			}
+		}
+
+		/*
+		 *	json-c keeps the last value for duplicate
+		 *	keys, which we can't do without going back.
+		 */
+		if (num_child) {
+			for (i = keys_start; i < js->keys_used; i++) {
+				if ((js->keys[i].len == key_len) &&
+				    (memcmp(js->keys[i].name, key, key_len) == 0)) return JPATH_STREAM_UNSUPPORTED;
+			}
+
+			if (js->keys_used == talloc_array_length(js->keys)) {
+				MEM(js->keys = talloc_realloc(js->ctx, js->keys, jpath_stream_key_t,
+							      js->keys_used ? js->keys_used * 2 : 16));
+			}
+			js->keys[js->keys_used++] = (jpath_stream_key_t) { .name = key, .len = key_len };
+		}
+
+		js->active_used += num_child;
+		ret = jpath_stream_value(js, child, num_child);
+		js->active_used -= num_child;
+		if (ret != JPATH_STREAM_OK) return ret;
+
+		jpath_stream_ws(js);
+		if (js->p == js->end) return JPATH_STREAM_UNSUPPORTED;
+		if (*js->p == '}') break;
+		if (*js->p != ',') return JPATH_STREAM_UNSUPPORTED;
+		js->p++;
+	}
+
+	js->p++;	/* '}' */
+	js->keys_used = keys_start;
+
+	return JPATH_STREAM_OK;
+}
+
+/** Evaluate an array
+ *
+ */
+static jpath_stream_rcode_t jpath_stream_array(jpath_stream_t *js, jpath_state_t const **active, unsigned int num)
+{
+	jpath_state_t const	**child = js->active + js->active_used;
+	int64_t			idx;
+
+	js->p++;	/* '[' */
+
+	for (idx = 0; ; idx++) {
+		unsigned int		i, num_child = 0;
+		jpath_stream_rcode_t	ret;
+
+		jpath_stream_ws(js);
+		if (js->p == js->end) return JPATH_STREAM_UNSUPPORTED;
+		if (*js->p == ']') break;
+
+		for (i = 0; i < num; i++) {
+			size_t j;
+
+			for (j = 0; j < talloc_array_length(active[i]->child); j++) {
+				jpath_state_t const	*state = active[i]->child[j];
+				int32_t const		*slice = state->selector->slice;
+
+				switch (state->selector->type) {
+				case JPATH_SELECTOR_INDEX:
+					if (idx != slice[0]) continue;
+					break;
+
+				case JPATH_SELECTOR_SLICE:
+				{
+					int64_t start = (slice[0] == SELECTOR_INDEX_UNSET) ? 0 : slice[0];
+					int64_t step = (slice[2] == SELECTOR_INDEX_UNSET) ? 1 : slice[2];
+
+					if ((idx < start) || (idx >= slice[1]) || (((idx - start) % step) != 0)) continue;
+				}
+					break;
+
+				case JPATH_SELECTOR_WILDCARD:
+					break;
+
+				default:
+					continue;
+				}
+
+				child[num_child++] = state;
+			}
+		}
+
+		js->active_used += num_child;
+		ret = jpath_stream_value(js, child, num_child);
+		js->active_used -= num_child;
+		if (ret != JPATH_STREAM_OK) return ret;
+
+		jpath_stream_ws(js);
+		if (js->p == js->end) return JPATH_STREAM_UNSUPPORTED;
+		if (*js->p == ']') break;
+		if (*js->p != ',') return JPATH_STREAM_UNSUPPORTED;
+		js->p++;
+	}
+
+	js->p++;	/* ']' */
+
+	return JPATH_STREAM_OK;
+}
+
+/** Evaluate any JSON value
+ *
+ * @param[in] js	tokenizer state.
+ * @param[in] active	states which match this value.
+ * @param[in] num	number of active states.
+ */
+static jpath_stream_rcode_t jpath_stream_value(jpath_stream_t *js, jpath_state_t const **active, unsigned int num)
+{
+	json_object		*object = NULL;
+	unsigned int		i;
+	bool			accept = false;
+	jpath_stream_rcode_t	ret = JPATH_STREAM_OK;
+
+	for (i = 0; i < num; i++) {
+		if (active[i]->accept) {
+			accept = true;
+			break;
+		}
+	}
+
+	jpath_stream_ws(js);
+	if (js->p == js->end) return JPATH_STREAM_UNSUPPORTED;
+
+	switch (*js->p) {
+	/*
+	 *	json-c would print objects and arrays which are
+	 *	matched, and we don't have the object to print.
+	 */
+	case '{':
+	case '[':
+		if (accept) return JPATH_STREAM_UNSUPPORTED;
+		if (++js->depth > JPATH_STREAM_MAX_DEPTH) return JPATH_STREAM_UNSUPPORTED;
+
+		ret = (*js->p == '{') ? jpath_stream_object(js, active, num) : jpath_stream_array(js, active, num);
+
+		js->depth--;
+		return ret;
+
+	case '"':
+	{
+		char const	*str;
+		size_t		len;
+		bool		escaped;
+
+		if (jpath_stream_string(js, &str, &len, &escaped) < 0) return JPATH_STREAM_UNSUPPORTED;
+		if (!accept) return JPATH_STREAM_OK;
+
+		if (escaped) {
+			ssize_t slen;
+
+			slen = jpath_stream_unescape(js, str, len);
+			if (slen < 0) return JPATH_STREAM_UNSUPPORTED;
+			str = js->buff;
+			len = slen;
+		}
+
+		MEM(object = json_object_new_string_len(str, len));
+	}
+		break;
+
+	case 't':
+		if (((js->end - js->p) < 4) || (memcmp(js->p, "true", 4) != 0)) return JPATH_STREAM_UNSUPPORTED;
+		js->p += 4;
+		if (!accept) return JPATH_STREAM_OK;
+
+		MEM(object = json_object_new_boolean(1));
+		break;
+
+	case 'f':
+		if (((js->end - js->p) < 5) || (memcmp(js->p, "false", 5) != 0)) return JPATH_STREAM_UNSUPPORTED;
+		js->p += 5;
+		if (!accept) return JPATH_STREAM_OK;
+
+		MEM(object = json_object_new_boolean(0));
+		break;
+
+	/*
+	 *	json-c represents null as a NULL object.
+	 */
+	case 'n':
+		if (((js->end - js->p) < 4) || (memcmp(js->p, "null", 4) != 0)) return JPATH_STREAM_UNSUPPORTED;
+		js->p += 4;
+		if (!accept) return JPATH_STREAM_OK;
+		break;
+
+	case '-':
+	case '0': case '1': case '2': case '3': case '4':
+	case '5': case '6': case '7': case '8': case '9':
+	{
+		char const	*num_str;
+		size_t		len;
+		bool		is_double;
+		char		buffer[64];
+
+		if (jpath_stream_number(js, &num_str, &len, &is_double) < 0) return JPATH_STREAM_UNSUPPORTED;
+		if (!accept) return JPATH_STREAM_OK;
+
+		if (len >= sizeof(buffer)) return JPATH_STREAM_UNSUPPORTED;
+		memcpy(buffer, num_str, len);
+		buffer[len] = '\0';
+
+		if (is_double) {
+			MEM(object = json_object_new_double(strtod(buffer, NULL)));
+		} else {
+#ifdef HAVE_JSON_OBJECT_NEW_INT64
+			MEM(object = json_object_new_int64(strtoll(buffer, NULL, 10)));
+#else
+			long long num_int = strtoll(buffer, NULL, 10);
+
+			if (num_int > INT32_MAX) num_int = INT32_MAX;
+			if (num_int < INT32_MIN) num_int = INT32_MIN;
+			MEM(object = json_object_new_int(num_int));
+#endif
+		}
+	}
+		break;
+
+	default:
+		return JPATH_STREAM_UNSUPPORTED;
+	}
+
+	/*
+	 *	Convert the value once for each expression
+	 *	which ends here.
+	 */
+	for (i = 0; (i < num) && (ret == JPATH_STREAM_OK); i++) {
+		size_t j;
+
+		for (j = 0; j < talloc_array_length(active[i]->accept); j++) {
+			unsigned int		idx = active[i]->accept[j];
+			jpath_set_dst_t const	*dst = &js->set->dst[idx];
+
+			if (jpath_leaf_to_value_box(js->ctx, &js->out[idx], dst->type, dst->enumv, object) < 0) {
+				ret = JPATH_STREAM_ERROR;
+				break;
+			}
+		}
+	}
+
+	if (object) json_object_put(object);
+
+	return ret;
+}
+
+/** Evaluate all the expressions in a set, in a single pass over a JSON document
+ *
+ * @param[in] ctx	to allocate fr_value_box_t in.
+ * @param[out] out	An array of lists, one for each expression in the set,
+ *			which must be initialised.  See #fr_jpath_set_num.
+ * @param[in] set	of expressions to evaluate.
+ * @param[in] in	JSON document.
+ * @param[in] inlen	length of the document.
+ * @return
+ *	- 0 on success.
+ *	- 1 if the document can't be evaluated in a single pass.  The caller
+ *	  should parse it with json-c, and use #fr_jpath_evaluate_leaf instead.
+ *	- -1 if a value couldn't be converted.
+ */
+int fr_jpath_set_evaluate(TALLOC_CTX *ctx, fr_value_box_list_t *out, fr_jpath_set_t const *set,
+			  char const *in, size_t inlen)
+{
+	jpath_stream_t		js = {
+					.p = in,
+					.end = in + inlen,
+					.ctx = ctx,
+					.out = out,
+					.set = set
+				};
+	jpath_stream_rcode_t	ret = JPATH_STREAM_UNSUPPORTED;
+	unsigned int		i;
+
+	MEM(js.active = talloc_array(ctx, jpath_state_t const *, set->num_states));
+	js.active[0] = &set->root;
+	js.active_used = 1;
+
+	/*
+	 *	json-c only knows that a top level number
+	 *	is complete if it's followed by something,
+	 *	so we leave scalars to it.
+	 */
+	jpath_stream_ws(&js);
+	if ((js.p < js.end) && ((*js.p == '{') || (*js.p == '['))) ret = jpath_stream_value(&js, js.active, 1);
+
+	talloc_free(js.active);
+	talloc_free(js.keys);
+	talloc_free(js.buff);
+
+	if (ret != JPATH_STREAM_OK) {
+		for (i = 0; i < fr_jpath_set_num(set); i++) fr_value_box_list_talloc_free(&out[i]);
+	}
+
+	return ret;
+}
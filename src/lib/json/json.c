@@ -266,6 +266,102 @@ json_object *json_object_from_value_box(fr_value_box_t const *data)
 	}
 }
 
+/** Escape a string in the same way as json-c does
+ *
+ * This is identical to json-c's escaping function, but we avoid
+ * creating JSON objects just to be able to escape strings.
+ *
+ * @param[out] out	buffer to write to.
+ * @param[in] in	string to escape.  Doesn't need to be \0 terminated.
+ * @param[in] inlen	length of the string.
+ * @return
+ *	- <0 on error.
+ *	- >= number of bytes written.
+ */
+static fr_slen_t json_str_escape(fr_sbuff_t *out, char const *in, size_t inlen)
+{
+	fr_sbuff_t	our_out = FR_SBUFF(out);
+	uint8_t const	*p, *end, *last_app;
+
+	last_app = p = (uint8_t const *)in;
+	end = p + inlen;
+
+	while (p < end) {
+		char const *esc;
+
+		switch (*p) {
+		case '\b':
+			esc = "\\b";
+			break;
+
+		case '\n':
+			esc = "\\n";
+			break;
+
+		case '\r':
+			esc = "\\r";
+			break;
+
+		case '\t':
+			esc = "\\t";
+			break;
+
+		case '\f':
+			esc = "\\f";
+			break;
+
+		case '"':
+			esc = "\\\"";
+			break;
+
+		case '\\':
+			esc = "\\\\";
+			break;
+
+		case '/':
+			esc = "\\/";
+			break;
+
+		default:
+			if (*p >= ' ') {
+				p++;
+				continue;
+			}
+			esc = NULL;
+			break;
+		}
+
+		if (p > last_app) FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, (char const *)last_app, p - last_app);
+
+		if (esc) {
+			FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, esc, 2);
+		} else {
+			FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\\u00");
+			FR_SBUFF_RETURN(fr_base16_encode, &our_out, &FR_DBUFF_TMP(p, 1));
+		}
+
+		last_app = ++p;
+	}
+	if (end > last_app) FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, (char const *)last_app, end - last_app);
+
+	FR_SBUFF_SET_RETURN(out, &our_out);
+}
+
+/** Escape a string, and wrap it in quotes
+ *
+ */
+static inline CC_HINT(always_inline)
+fr_slen_t json_str_quoted(fr_sbuff_t *out, char const *in, size_t inlen)
+{
+	fr_sbuff_t our_out = FR_SBUFF(out);
+
+	FR_SBUFF_IN_CHAR_RETURN(&our_out, '"');
+	FR_SBUFF_RETURN(json_str_escape, &our_out, in, inlen);
+	FR_SBUFF_IN_CHAR_RETURN(&our_out, '"');
+
+	FR_SBUFF_SET_RETURN(out, &our_out);
+}
+
 /** Print a value box as its equivalent JSON format without going via a struct json_object (in most cases)
  *
  * @param[out] out		buffer to write to.
@@ -296,63 +392,9 @@ fr_slen_t fr_json_str_from_value(fr_sbuff_t *out, fr_value_box_t *vb, bool inclu
 	 */
 	case FR_TYPE_STRING:
 	case FR_TYPE_OCTETS:
-	{
-		char const *last_app, *p, *end;
-
 		if (include_quotes) FR_SBUFF_IN_CHAR_RETURN(&our_out, '"');
-
-		last_app = p = vb->vb_strvalue;
-		end = p + vb->vb_length;
-
-		while (p < end) {
-			if (*p < ' ') {
-				if (p > last_app) FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, last_app, p - last_app);
-
-				switch (*p) {
-				case '\b':
-					FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\\b");
-					break;
-
-				case '\n':
-					FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\\n");
-					break;
-
-				case '\r':
-					FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\\r");
-					break;
-
-				case '\t':
-					FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\\t");
-					break;
-
-				case '\f':
-					FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\\f");
-					break;
-
-				case '"':
-					FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\\\"");
-					break;
-
-				case '\\':
-					FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\\\\");
-					break;
-
-				case '/':
-					FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\\/");
-					break;
-
-				default:
-					FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\\u00");
-					fr_base16_encode(&our_out, &FR_DBUFF_TMP((uint8_t const *)p, 1));
-				}
-
-				last_app = p + 1;
-			}
-			p++;
-		}
-		if (end > last_app) FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, last_app, end - last_app);
+		FR_SBUFF_RETURN(json_str_escape, &our_out, vb->vb_strvalue, vb->vb_length);
 		if (include_quotes) FR_SBUFF_IN_CHAR_RETURN(&our_out, '"');
-	}
 		break;
 
 	case FR_TYPE_UINT8:
@@ -368,7 +410,7 @@ fr_slen_t fr_json_str_from_value(fr_sbuff_t *out, fr_value_box_t *vb, bool inclu
 		break;
 
 	case FR_TYPE_UINT64:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%u", vb->vb_uint64);
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%" PRIu64, vb->vb_uint64);
 		break;
 
 	case FR_TYPE_INT8:
@@ -384,7 +426,7 @@ fr_slen_t fr_json_str_from_value(fr_sbuff_t *out, fr_value_box_t *vb, bool inclu
 		break;
 
 	case FR_TYPE_INT64:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%i", vb->vb_int64);
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%" PRId64, vb->vb_int64);
 		break;
 
 	case FR_TYPE_SIZE:
@@ -613,7 +655,7 @@ do { \
  *
  * The result is a struct json_object, which should be free'd with
  * json_object_put() by the caller. Intended to only be called by
- * fr_json_afrom_pair_list().
+ * fr_json_object_afrom_pair_list().
  *
  * This function generates the "object" format, JSON_MODE_OBJECT.
  * @see fr_json_format_s
@@ -788,7 +830,7 @@ static json_object *json_object_afrom_pair_list(TALLOC_CTX *ctx, fr_pair_list_t
  *
  * The result is a struct json_object, which should be free'd with
  * json_object_put() by the caller. Intended to only be called by
- * fr_json_afrom_pair_list().
+ * fr_json_object_afrom_pair_list().
  *
  * This function generates the "simple object" format, JSON_MODE_OBJECT_SIMPLE.
  * @see fr_json_format_s
@@ -937,7 +979,7 @@ static json_object *json_smplobj_afrom_pair_list(TALLOC_CTX *ctx, fr_pair_list_t
  *
  * The result is a struct json_object, which should be free'd with
  * json_object_put() by the caller. Intended to only be called by
- * fr_json_afrom_pair_list().
+ * fr_json_object_afrom_pair_list().
  *
  * This function generates the "array" format, JSON_MODE_ARRAY.
  * @see fr_json_format_s
@@ -1081,7 +1123,7 @@ static struct json_object *json_array_afrom_pair_list(TALLOC_CTX *ctx, fr_pair_l
  *
  * The result is a struct json_object, which should be free'd with
  * json_object_put() by the caller. Intended to only be called by
- * fr_json_afrom_pair_list().
+ * fr_json_object_afrom_pair_list().
  *
  * This function generates the "array_of_values" format,
  * JSON_MODE_ARRAY_OF_VALUES, listing just the attribute values.
@@ -1143,7 +1185,7 @@ static struct json_object *json_value_array_afrom_pair_list(TALLOC_CTX *ctx, fr_
  *
  * The result is a struct json_object, which should be free'd with
  * json_object_put() by the caller. Intended to only be called by
- * fr_json_afrom_pair_list().
+ * fr_json_object_afrom_pair_list().
  *
  * This function generates the "array_of_names" format,
  * JSON_MODE_ARRAY_OF_NAMES, listing just the attribute names.
@@ -1204,6 +1246,416 @@ static struct json_object *json_attr_array_afrom_pair_list(TALLOC_CTX *ctx, fr_p
 }
 
 
+/** Returns a JSON object representation of a list of value pairs
+ *
+ * The result is a struct json_object, which should be free'd with
+ * json_object_put() by the caller.
+ *
+ * This builds a complete json-c tree, with at least one allocation
+ * for each attribute, and is only needed if the caller wants to
+ * manipulate the tree.  fr_json_afrom_pair_list() and
+ * fr_json_str_from_pair_list() write the same document without
+ * creating any intermediate objects.
+ *
+ * @param[in] ctx	Talloc context.
+ * @param[in] vps	a list of value pairs.
+ * @param[in] format	Formatting control, can be NULL to use default format.
+ * @return JSON object with the generated representation.
+ */
+json_object *fr_json_object_afrom_pair_list(TALLOC_CTX *ctx, fr_pair_list_t *vps,
+					    fr_json_format_t const *format)
+{
+	struct json_object	*obj = NULL;
+
+	if (!format) format = &default_json_format;
+
+	switch (format->output_mode) {
+	case JSON_MODE_OBJECT:
+		MEM(obj = json_object_afrom_pair_list(ctx, vps, format));
+		break;
+	case JSON_MODE_OBJECT_SIMPLE:
+		MEM(obj = json_smplobj_afrom_pair_list(ctx, vps, format));
+		break;
+	case JSON_MODE_ARRAY:
+		MEM(obj = json_array_afrom_pair_list(ctx, vps, format));
+		break;
+	case JSON_MODE_ARRAY_OF_VALUES:
+		MEM(obj = json_value_array_afrom_pair_list(ctx, vps, format));
+		break;
+	case JSON_MODE_ARRAY_OF_NAMES:
+		MEM(obj = json_attr_array_afrom_pair_list(ctx, vps, format));
+		break;
+	default:
+		/* This should never happen */
+		fr_assert(0);
+	}
+
+	return obj;
+}
+
+/*
+ *	The streaming encoder.
+ *
+ *	This writes the same documents as the functions above, byte for
+ *	byte, as json-c would print them with JSON_C_TO_STRING_PLAIN.
+ *	There are no intermediate objects, so the only allocations are
+ *	for the output buffer, and for values which have to be cast.
+ *
+ *	Where the tree builders look up attributes they've already seen
+ *	in a json-c object, we scan the list instead.  Pair lists are
+ *	short, and comparing pointers is cheaper than hashing names.
+ */
+static fr_slen_t json_str_from_pair_list(fr_sbuff_t *out, fr_pair_list_t *vps, fr_json_format_t const *format);
+
+/** Check whether this is the first pair in the list with this attribute
+ *
+ */
+static inline CC_HINT(always_inline)
+bool json_pair_is_first(fr_pair_list_t *vps, fr_pair_t *vp)
+{
+	fr_pair_t *prev;
+
+	for (prev = fr_pair_list_head(vps);
+	     prev != vp;
+	     prev = fr_pair_list_next(vps, prev)) {
+		if (!prev->vp_raw && (prev->da == vp->da)) return false;
+	}
+
+	return true;
+}
+
+/** Find the next pair in the list with the same attribute
+ *
+ */
+static inline CC_HINT(always_inline)
+fr_pair_t *json_pair_next_same(fr_pair_list_t *vps, fr_pair_t *vp)
+{
+	fr_pair_t *next;
+
+	for (next = fr_pair_list_next(vps, vp);
+	     next;
+	     next = fr_pair_list_next(vps, next)) {
+		if (!next->vp_raw && (next->da == vp->da)) return next;
+	}
+
+	return NULL;
+}
+
+/** Write a value box in the same format as json_object_from_value_box() would produce
+ *
+ */
+static fr_slen_t json_str_from_value_box(fr_sbuff_t *out, fr_value_box_t const *data)
+{
+	fr_sbuff_t our_out = FR_SBUFF(out);
+
+	if (data->enumv) {
+		fr_dict_enum_value_t *enumv;
+
+		enumv = fr_dict_enum_by_value(data->enumv, data);
+		if (enumv) {
+			FR_SBUFF_RETURN(json_str_quoted, &our_out, enumv->name, enumv->name_len);
+			FR_SBUFF_SET_RETURN(out, &our_out);
+		}
+	}
+
+	switch (data->type) {
+	default:
+	do_string:
+	{
+		char		buffer[64];
+		fr_sbuff_t	sbuff = FR_SBUFF_IN(buffer, sizeof(buffer));
+
+		if (fr_value_box_print(&sbuff, data, NULL) <= 0) {
+			fr_strerror_printf("Failed printing %s value", fr_type_to_str(data->type));
+			return -1;
+		}
+
+		FR_SBUFF_RETURN(json_str_quoted, &our_out, buffer, fr_sbuff_used(&sbuff));
+	}
+		break;
+
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		FR_SBUFF_RETURN(json_str_quoted, &our_out, data->vb_strvalue, data->vb_length);
+		break;
+
+	case FR_TYPE_BOOL:
+		FR_SBUFF_IN_STRCPY_RETURN(&our_out, data->vb_bool ? "true" : "false");
+		break;
+
+	case FR_TYPE_UINT8:
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%u", data->vb_uint8);
+		break;
+
+	case FR_TYPE_UINT16:
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%u", data->vb_uint16);
+		break;
+
+#ifdef HAVE_JSON_OBJECT_GET_INT64
+	case FR_TYPE_UINT32:
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%u", data->vb_uint32);
+		break;
+
+	case FR_TYPE_UINT64:
+		if (data->vb_uint64 > INT64_MAX) goto do_string;
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%" PRIu64, data->vb_uint64);
+		break;
+#else
+	case FR_TYPE_UINT32:
+		if (data->vb_uint32 > INT32_MAX) goto do_string;
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%u", data->vb_uint32);
+		break;
+#endif
+
+	case FR_TYPE_INT8:
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%i", data->vb_int8);
+		break;
+
+	case FR_TYPE_INT16:
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%i", data->vb_int16);
+		break;
+
+	case FR_TYPE_INT32:
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%i", data->vb_int32);
+		break;
+
+#ifdef HAVE_JSON_OBJECT_GET_INT64
+	case FR_TYPE_INT64:
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%" PRId64, data->vb_int64);
+		break;
+
+	case FR_TYPE_SIZE:
+		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%" PRId64, (int64_t)data->vb_size);
+		break;
+#endif
+
+	case FR_TYPE_STRUCTURAL:
+		FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "null");
+		break;
+	}
+
+	FR_SBUFF_SET_RETURN(out, &our_out);
+}
+
+/** Write the value of a pair, in the same format as json_afrom_value_box() would produce
+ *
+ * Structural pairs are written using the same output mode as their parent.
+ */
+static fr_slen_t json_str_from_pair_value(fr_sbuff_t *out, fr_pair_t *vp, fr_json_format_t const *format)
+{
+	fr_value_box_t const	*vb;
+	fr_value_box_t		vb_str = FR_VALUE_BOX_INITIALISER_NULL(vb_str);
+	fr_slen_t		slen;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_LEAF:
+		break;
+
+	case FR_TYPE_STRUCTURAL:
+		return json_str_from_pair_list(out, &vp->vp_group, format);
+
+	default:
+		fr_assert(0);
+		fr_strerror_printf("Invalid type %s for attribute %s", fr_type_to_str(vp->vp_type), vp->da->name);
+		return -1;
+	}
+
+	vb = &vp->data;
+
+	if (format->value.enum_as_int) (void) fr_pair_value_enum_box(&vb, vp);
+
+	if (!format->value.always_string) return json_str_from_value_box(out, vb);
+
+	if (fr_value_box_cast(NULL, &vb_str, FR_TYPE_STRING, NULL, vb) < 0) return -1;
+	slen = json_str_from_value_box(out, &vb_str);
+	fr_value_box_clear(&vb_str);
+
+	return slen;
+}
+
+/** Write the value of a pair, and of all the pairs after it with the same attribute
+ *
+ * If there's more than one, or value_is_always_array is set, the values
+ * are written as an array.
+ */
+static fr_slen_t json_str_from_pair_values(fr_sbuff_t *out, fr_pair_list_t *vps, fr_pair_t *vp,
+					   fr_json_format_t const *format)
+{
+	fr_sbuff_t	our_out = FR_SBUFF(out);
+	fr_pair_t	*next;
+
+	next = json_pair_next_same(vps, vp);
+	if (!next && !format->value.value_is_always_array) return json_str_from_pair_value(out, vp, format);
+
+	FR_SBUFF_IN_CHAR_RETURN(&our_out, '[');
+	for (;;) {
+		FR_SBUFF_RETURN(json_str_from_pair_value, &our_out, vp, format);
+		if (!next) break;
+
+		FR_SBUFF_IN_CHAR_RETURN(&our_out, ',');
+		vp = next;
+		next = json_pair_next_same(vps, vp);
+	}
+	FR_SBUFF_IN_CHAR_RETURN(&our_out, ']');
+
+	FR_SBUFF_SET_RETURN(out, &our_out);
+}
+
+/** Write an attribute name, with the optional prefix, as a JSON string
+ *
+ */
+static fr_slen_t json_str_from_attr_name(fr_sbuff_t *out, fr_dict_attr_t const *da, fr_json_format_t const *format)
+{
+	fr_sbuff_t our_out = FR_SBUFF(out);
+
+	FR_SBUFF_IN_CHAR_RETURN(&our_out, '"');
+	if (format->attr.prefix) {
+		FR_SBUFF_RETURN(json_str_escape, &our_out, format->attr.prefix, strlen(format->attr.prefix));
+		FR_SBUFF_IN_CHAR_RETURN(&our_out, ':');
+	}
+	FR_SBUFF_RETURN(json_str_escape, &our_out, da->name, da->name_len);
+	FR_SBUFF_IN_CHAR_RETURN(&our_out, '"');
+
+	FR_SBUFF_SET_RETURN(out, &our_out);
+}
+
+/** Write a list of pairs using the output mode from the format
+ *
+ * @see json_object_afrom_pair_list
+ * @see json_smplobj_afrom_pair_list
+ * @see json_array_afrom_pair_list
+ * @see json_value_array_afrom_pair_list
+ * @see json_attr_array_afrom_pair_list
+ */
+static fr_slen_t json_str_from_pair_list(fr_sbuff_t *out, fr_pair_list_t *vps, fr_json_format_t const *format)
+{
+	fr_sbuff_t	our_out = FR_SBUFF(out);
+	fr_pair_t	*vp;
+	bool		object, first = true;
+
+	switch (format->output_mode) {
+	case JSON_MODE_OBJECT:
+	case JSON_MODE_OBJECT_SIMPLE:
+		object = true;
+		break;
+
+	case JSON_MODE_ARRAY:
+	case JSON_MODE_ARRAY_OF_VALUES:
+	case JSON_MODE_ARRAY_OF_NAMES:
+		object = false;
+		break;
+
+	default:
+		fr_assert(0);
+		fr_strerror_const("Invalid JSON output mode");
+		return -1;
+	}
+
+	FR_SBUFF_IN_CHAR_RETURN(&our_out, object ? '{' : '[');
+
+	for (vp = fr_pair_list_head(vps);
+	     vp;
+	     vp = fr_pair_list_next(vps, vp)) {
+		if (vp->vp_raw) continue;
+
+		/*
+		 *	Attributes with multiple values are written
+		 *	once, at the position of the first value.
+		 */
+		if ((object || ((format->output_mode == JSON_MODE_ARRAY) && format->value.value_is_always_array)) &&
+		    !json_pair_is_first(vps, vp)) continue;
+
+		if (!first) FR_SBUFF_IN_CHAR_RETURN(&our_out, ',');
+		first = false;
+
+		switch (format->output_mode) {
+		/*
+		 *	"<attribute>":{"type":"<type>","value":<value>}
+		 */
+		case JSON_MODE_OBJECT:
+			FR_SBUFF_RETURN(json_str_from_attr_name, &our_out, vp->da, format);
+			FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, ":{\"type\":\"");
+			FR_SBUFF_IN_STRCPY_RETURN(&our_out, fr_type_to_str(vp->vp_type));
+			FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\",\"value\":");
+			FR_SBUFF_RETURN(json_str_from_pair_values, &our_out, vps, vp, format);
+			FR_SBUFF_IN_CHAR_RETURN(&our_out, '}');
+			break;
+
+		/*
+		 *	"<attribute>":<value>
+		 */
+		case JSON_MODE_OBJECT_SIMPLE:
+			FR_SBUFF_RETURN(json_str_from_attr_name, &our_out, vp->da, format);
+			FR_SBUFF_IN_CHAR_RETURN(&our_out, ':');
+			FR_SBUFF_RETURN(json_str_from_pair_values, &our_out, vps, vp, format);
+			break;
+
+		/*
+		 *	{"name":"<attribute>","type":"<type>","value":<value>}
+		 */
+		case JSON_MODE_ARRAY:
+			FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "{\"name\":");
+			FR_SBUFF_RETURN(json_str_from_attr_name, &our_out, vp->da, format);
+			FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, ",\"type\":\"");
+			FR_SBUFF_IN_STRCPY_RETURN(&our_out, fr_type_to_str(vp->vp_type));
+			FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, "\",\"value\":");
+			if (format->value.value_is_always_array) {
+				FR_SBUFF_RETURN(json_str_from_pair_values, &our_out, vps, vp, format);
+			} else {
+				FR_SBUFF_RETURN(json_str_from_pair_value, &our_out, vp, format);
+			}
+			FR_SBUFF_IN_CHAR_RETURN(&our_out, '}');
+			break;
+
+		/*
+		 *	<value>
+		 */
+		case JSON_MODE_ARRAY_OF_VALUES:
+			FR_SBUFF_RETURN(json_str_from_pair_value, &our_out, vp, format);
+			break;
+
+		/*
+		 *	"<attribute>", followed by an array of the
+		 *	children for structural attributes.
+		 */
+		case JSON_MODE_ARRAY_OF_NAMES:
+			FR_SBUFF_RETURN(json_str_from_attr_name, &our_out, vp->da, format);
+			if (fr_type_is_structural(vp->vp_type)) {
+				FR_SBUFF_IN_CHAR_RETURN(&our_out, ',');
+				FR_SBUFF_RETURN(json_str_from_pair_list, &our_out, &vp->vp_group, format);
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	FR_SBUFF_IN_CHAR_RETURN(&our_out, object ? '}' : ']');
+
+	FR_SBUFF_SET_RETURN(out, &our_out);
+}
+
+/** Write a JSON document representing a list of value pairs
+ *
+ * The output is identical to fr_json_afrom_pair_list(), but is written
+ * directly to the sbuff, without building a json-c object tree.
+ *
+ * @param[out] out	Where to write the document.
+ * @param[in] vps	a list of value pairs.
+ * @param[in] format	Formatting control, can be NULL to use default format.
+ * @return
+ *	- >= 0 the number of bytes written.
+ *	- < 0 on error.  If this is because we ran out of buffer space,
+ *	  the value is the negative number of bytes we would have needed.
+ */
+fr_slen_t fr_json_str_from_pair_list(fr_sbuff_t *out, fr_pair_list_t *vps, fr_json_format_t const *format)
+{
+	if (!format) format = &default_json_format;
+
+	return json_str_from_pair_list(out, vps, format);
+}
+
 /** Returns a JSON string of a list of value pairs
  *
  * The result is a talloc-ed string, freeing the string is
@@ -1234,49 +1686,23 @@ static struct json_object *json_attr_array_afrom_pair_list(TALLOC_CTX *ctx, fr_p
  * @param[in] ctx	Talloc context.
  * @param[in] vps	a list of value pairs.
  * @param[in] format	Formatting control, can be NULL to use default format.
- * @return JSON string representation of the value pairs
+ * @return
+ *	- JSON string representation of the value pairs.
+ *	- NULL on error.
  */
 char *fr_json_afrom_pair_list(TALLOC_CTX *ctx, fr_pair_list_t *vps,
 			      fr_json_format_t const *format)
 {
-	struct json_object	*obj = NULL;
-	const char		*p;
-	char			*out;
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
 
-	if (!format) format = &default_json_format;
+	if (unlikely(fr_sbuff_init_talloc(ctx, &sbuff, &tctx, 1024, SIZE_MAX) == NULL)) return NULL;
 
-	switch (format->output_mode) {
-	case JSON_MODE_OBJECT:
-		MEM(obj = json_object_afrom_pair_list(ctx, vps, format));
-		break;
-	case JSON_MODE_OBJECT_SIMPLE:
-		MEM(obj = json_smplobj_afrom_pair_list(ctx, vps, format));
-		break;
-	case JSON_MODE_ARRAY:
-		MEM(obj = json_array_afrom_pair_list(ctx, vps, format));
-		break;
-	case JSON_MODE_ARRAY_OF_VALUES:
-		MEM(obj = json_value_array_afrom_pair_list(ctx, vps, format));
-		break;
-	case JSON_MODE_ARRAY_OF_NAMES:
-		MEM(obj = json_attr_array_afrom_pair_list(ctx, vps, format));
-		break;
-	default:
-		/* This should never happen */
-		fr_assert(0);
+	if ((fr_json_str_from_pair_list(&sbuff, vps, format) < 0) ||
+	    unlikely(fr_sbuff_trim_talloc(&sbuff, SIZE_MAX) < 0)) {
+		talloc_free(sbuff.buff);
+		return NULL;
 	}
 
-	/*
-	 *	p is a buff inside obj, and will be freed
-	 *	when it is freed.
-	 */
-	MEM(p = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN));
-	MEM(out = talloc_typed_strdup(ctx, p));
-
-	/*
-	 * Free the JSON structure, it's not needed any more
-	 */
-	json_object_put_assert(obj);
-
-	return out;
+	return sbuff.buff;
 }
@@ -63,11 +63,41 @@ static int _kafka_conf_free(fr_kafka_conf_t *kc)
 	return 0;
 }
 
+/** Subsections of the base configuration which set client wide properties
+ *
+ */
+static char const *kafka_conf_subsections[] = {
+	"connection",
+	"group",
+	"kerberos",
+	"metadata",
+	"oauth",
+	"sasl",
+	"tls",
+	"version"
+};
+
 static inline CC_HINT(always_inline)
 fr_kafka_conf_t *kafka_conf_from_cs(CONF_SECTION *cs)
 {
 	CONF_DATA const	*cd;
 	fr_kafka_conf_t	*kc;
+	CONF_SECTION	*parent;
+	size_t		i;
+
+	/*
+	 *	Properties set in subsections like tls { ... } apply to
+	 *	the whole client, so they must all end up in the handle
+	 *	attached to the section the kafka configuration starts at.
+	 */
+again:
+	parent = cf_item_to_section(cf_parent(cs));
+	if (parent) for (i = 0; i < NUM_ELEMENTS(kafka_conf_subsections); i++) {
+		if (strcmp(cf_section_name1(cs), kafka_conf_subsections[i]) == 0) {
+			cs = parent;
+			goto again;
+		}
+	}
 
 	cd = cf_data_find(cs, fr_kafka_conf_t, "conf");
 	if (cd) {
@@ -112,6 +142,46 @@ fr_kafka_topic_conf_t *kafka_topic_conf_from_cs(CONF_SECTION *cs)
 	return ktc;
 }
 
+/** Return a copy of the client configuration parsed from a section
+ *
+ * @param[in] cs	the kafka configuration was parsed from.
+ * @return
+ *	- A new configuration handle.  Ownership passes to the caller, and to librdkafka
+ *	  when it is passed to rd_kafka_new().
+ *	- NULL if no kafka configuration was parsed from this section.
+ */
+rd_kafka_conf_t *kafka_conf_dup(CONF_SECTION *cs)
+{
+	CONF_DATA const	*cd;
+	fr_kafka_conf_t	*kc;
+
+	cd = cf_data_find(cs, fr_kafka_conf_t, "conf");
+	if (!cd) return NULL;
+
+	kc = cf_data_value(cd);
+	return rd_kafka_conf_dup(kc->conf);
+}
+
+/** Return a copy of the topic configuration parsed from a section
+ *
+ * @param[in] cs	the topic configuration was parsed from, i.e. topic { <name> { ... } }.
+ * @return
+ *	- A new topic configuration handle.  Ownership passes to the caller, and to
+ *	  librdkafka when it is passed to rd_kafka_topic_new().
+ *	- NULL if no topic configuration was parsed from this section.
+ */
+rd_kafka_topic_conf_t *kafka_topic_conf_dup(CONF_SECTION *cs)
+{
+	CONF_DATA const		*cd;
+	fr_kafka_topic_conf_t	*ktc;
+
+	cd = cf_data_find(cs, fr_kafka_topic_conf_t, "conf");
+	if (!cd) return NULL;
+
+	ktc = cf_data_value(cd);
+	return rd_kafka_topic_conf_dup(ktc->conf);
+}
+
 /** Perform any conversions necessary to map kafka defaults to our values
  *
  * @param[out] out	Where to write the pair.
@@ -899,7 +969,7 @@ static conf_parser_t const kafka_base_consumer_topic_config[] = {
 	 *	Action to take when there is no initial offset
 	 *	in offset store or the desired offset is out of range.
 	 */
-	{ FR_CONF_FUNC("auto_offset_reset", FR_TYPE_STRING, 0, kafka_config_parse, kafka_config_dflt),
+	{ FR_CONF_FUNC("auto_offset_reset", FR_TYPE_STRING, 0, kafka_topic_config_parse, kafka_topic_config_dflt),
 	  .uctx = &(fr_kafka_conf_ctx_t){ .property = "auto.offset.reset" }},
 
 	CONF_PARSER_TERMINATOR
@@ -935,7 +1005,7 @@ conf_parser_t const kafka_base_consumer_config[] = {
 	 *	Toggle auto commit
 	 */
 	{ FR_CONF_FUNC("auto_commit", FR_TYPE_BOOL, 0, kafka_config_parse, kafka_config_dflt),
-	  .uctx = &(fr_kafka_conf_ctx_t){ .property = "enable_auto.commit" }},
+	  .uctx = &(fr_kafka_conf_ctx_t){ .property = "enable.auto.commit" }},
 
 	/*
 	 *	Auto commit interval
@@ -689,6 +689,46 @@ do { \
 	} \
 } while (0)
 
+/** Build the key identical searches are coalesced on
+ *
+ * The scope, base DN, filter and attributes, each NUL terminated.
+ *
+ * @param[in] ctx	to allocate the key in.
+ * @param[out] len	of the key.
+ * @param[in] query	to build the key for.
+ * @return The key.
+ */
+static uint8_t *ldap_search_key(TALLOC_CTX *ctx, size_t *len, fr_ldap_query_t const *query)
+{
+	char const * const	*attrs = query->search.attrs;
+	size_t			i, need;
+	uint8_t			*key, *p;
+
+#define KEY_PART_LEN(_s) ((_s) ? strlen(_s) : 0)
+#define KEY_PART_ADD(_s) do { \
+	size_t _l = KEY_PART_LEN(_s); \
+	if (_l) memcpy(p, _s, _l); \
+	p += _l; \
+	*p++ = '\0'; \
+} while (0)
+
+	need = 1 + KEY_PART_LEN(query->dn) + 1 + KEY_PART_LEN(query->search.filter) + 1;
+	if (attrs) for (i = 0; attrs[i]; i++) need += strlen(attrs[i]) + 1;
+
+	MEM(p = key = talloc_array(ctx, uint8_t, need));
+	*p++ = (uint8_t)query->search.scope;
+	KEY_PART_ADD(query->dn);
+	KEY_PART_ADD(query->search.filter);
+	if (attrs) for (i = 0; attrs[i]; i++) KEY_PART_ADD(attrs[i]);
+
+#undef KEY_PART_LEN
+#undef KEY_PART_ADD
+
+	*len = need;
+
+	return key;
+}
+
 /** Run an async search LDAP query on a trunk connection
  *
  * @param[in] ctx		to allocate the query in.
@@ -712,10 +752,27 @@ unlang_action_t fr_ldap_trunk_search(TALLOC_CTX *ctx,
 {
 	unlang_action_t action;
 	fr_ldap_query_t *query;
+	trunk_enqueue_t	ret;
 
 	query = fr_ldap_search_alloc(ctx, base_dn, scope, filter, attrs, serverctrls, clientctrls);
 
-	switch (trunk_request_enqueue(&query->treq, ttrunk->trunk, request, query, NULL)) {
+	/*
+	 *	Controls may change what the server returns, so
+	 *	only plain searches are coalesced.
+	 */
+	if (ttrunk->t->trunk_conf->coalesce && !serverctrls && !clientctrls) {
+		uint8_t	*key;
+		size_t	key_len;
+
+		key = ldap_search_key(NULL, &key_len, query);
+		ret = trunk_request_enqueue_coalesce(&query->treq, ttrunk->trunk, request, query, NULL,
+						     key, key_len);
+		talloc_free(key);
+	} else {
+		ret = trunk_request_enqueue(&query->treq, ttrunk->trunk, request, query, NULL);
+	}
+
+	switch (ret) {
 	case TRUNK_ENQUEUE_OK:
 	case TRUNK_ENQUEUE_IN_BACKLOG:
 		break;
@@ -945,9 +1002,14 @@ static int _ldap_query_free(fr_ldap_query_t *query)
 	int 	i;
 
 	/*
-	 *	Free any results which were retrieved
+	 *	Free any results which were retrieved, unless
+	 *	other queries are still using them.
 	 */
-	if (query->result) ldap_msgfree(query->result);
+	if (query->shared) {
+		if (--query->shared->refs == 0) talloc_free(query->shared);
+	} else if (query->result) {
+		ldap_msgfree(query->result);
+	}
 
 	/*
 	 *	Free any server and client controls that need freeing
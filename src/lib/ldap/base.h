@@ -410,8 +410,30 @@ typedef struct fr_ldap_referral_s fr_ldap_referral_t;
 
 typedef struct fr_ldap_query_s fr_ldap_query_t;
 
+/** Search results shared between coalesced queries
+ *
+ * Freed, along with the results, when the last query referencing it is freed.
+ */
+typedef struct {
+	LDAPMessage		*result;		//!< Head of LDAP results list.
+	unsigned int		refs;			//!< How many queries are using the results.
+} fr_ldap_shared_result_t;
+
 typedef void (*fr_ldap_result_parser_t)(LDAP *handle, fr_ldap_query_t *query, LDAPMessage *head, void *rctx);
 
+/** Process a single search entry as soon as it has been received
+ *
+ * @param[in] handle	the query is running on.
+ * @param[in] query	the entry belongs to.
+ * @param[in] entry	to process.  Freed once the callback returns.
+ * @param[in] uctx	as set in the query.
+ * @return
+ *	- 0 to continue receiving entries.
+ *	- 1 if no more entries are needed.  The search is abandoned and treated as successful.
+ *	- -1 on error.  The search is abandoned and treated as failed.
+ */
+typedef int (*fr_ldap_entry_parser_t)(LDAP *handle, fr_ldap_query_t *query, LDAPMessage *entry, void *uctx);
+
 /** LDAP query structure
  *
  * Used to hold the elements of an LDAP query and track its progress.
@@ -464,7 +486,13 @@ struct fr_ldap_query_s {
 
 	fr_ldap_result_parser_t	parser;			//!< Custom results parser.
 
+	fr_ldap_entry_parser_t	entry_parser;		//!< Called for each search entry as it arrives, rather
+							///< than gathering the complete set of results first.
+	void			*entry_uctx;		//!< Context to pass to the entry parser.
+	unsigned int		entries;		//!< How many entries have been passed to the entry parser.
+
 	LDAPMessage		*result;		//!< Head of LDAP results list.
+	fr_ldap_shared_result_t	*shared;		//!< Set if result is shared with coalesced queries.
 
 	fr_ldap_result_code_t	ret;			//!< Result code
 };
@@ -529,6 +529,63 @@ static void ldap_request_fail(request_t *request, void *preq, UNUSED void *rctx,
 	if (request) unlang_interpret_mark_runnable(request);
 }
 
+static int _ldap_shared_result_free(fr_ldap_shared_result_t *shared)
+{
+	ldap_msgfree(shared->result);
+	return 0;
+}
+
+/** Give a coalesced query the results of the identical query which was sent
+ *
+ * The results are shared, rather than copied, and freed when the last query
+ * using them is freed.
+ */
+static int ldap_request_coalesce(request_t *request, void *preq, void *rctx,
+				 void *leader_preq, UNUSED void *uctx)
+{
+	fr_ldap_query_t		*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+	fr_ldap_query_t		*leader = talloc_get_type_abort(leader_preq, fr_ldap_query_t);
+
+	/*
+	 *	Referrals are followed by each query separately,
+	 *	and entries which were streamed aren't in the results.
+	 */
+	if ((leader->ret == LDAP_RESULT_PENDING) || !leader->ldap_conn ||
+	    leader->entry_parser || query->entry_parser) return -1;
+
+	if (leader->result) {
+		if (!leader->shared) {
+			MEM(leader->shared = talloc(NULL, fr_ldap_shared_result_t));
+			leader->shared->result = leader->result;
+			leader->shared->refs = 1;
+			talloc_set_destructor(leader->shared, _ldap_shared_result_free);
+		}
+		leader->shared->refs++;
+		query->shared = leader->shared;
+		query->result = leader->result;
+	}
+
+	/*
+	 *	The results can only be read with the handle they were received on.
+	 */
+	query->ldap_conn = leader->ldap_conn;
+	fr_dlist_insert_tail(&query->ldap_conn->refs, query);
+
+	query->ret = leader->ret;
+	if (query->parser && query->result &&
+	    ((query->ret == LDAP_RESULT_SUCCESS) || (query->ret == LDAP_RESULT_NO_RESULT))) {
+		query->parser(query->ldap_conn->handle, query, query->result, rctx);
+	}
+
+	/*
+	 *	The trunk request is freed once this returns.
+	 */
+	query->treq = NULL;
+	unlang_interpret_mark_runnable(request);
+
+	return 0;
+}
+
 TRUNK_NOTIFY_FUNC(ldap_trunk_connection_notify, fr_ldap_connection_t)
 
 /** Allocate an LDAP trunk connection
@@ -673,6 +730,287 @@ static void ldap_trunk_request_mux(UNUSED fr_event_list_t *el, trunk_connection_
 
 }
 
+/** Mark a query as complete and resume the request which sent it
+ *
+ * @param[in] query	which has completed.
+ * @param[in] request	the query relates to.  May be NULL.
+ */
+static void ldap_trunk_query_done(fr_ldap_query_t *query, request_t *request)
+{
+	trunk_request_t		*treq;
+
+	/*
+	 *	Remove the timeout event
+	 */
+	if (query->ev) fr_event_timer_delete(&query->ev);
+
+	/*
+	 *	Set the request as runnable
+	 */
+	if (request) unlang_interpret_mark_runnable(request);
+
+	/*
+	 *	If referral following failed, there is no active trunk request.
+	 */
+	if (!query->treq) return;
+
+	/*
+	 *	If the query is parented off the treq then it will be freed when
+	 *	the request is completed.  If it is parented by something else then it will not.
+	 */
+	treq = query->treq;
+	query->treq = NULL;
+	trunk_request_signal_complete(treq);
+}
+
+/** Pass the entries in a chain of search results to a query's entry parser
+ *
+ * @param[in] ldap_conn	the results were received on.
+ * @param[in] query	the results belong to.
+ * @param[in] head	of the chain of results.
+ * @return
+ *	- 0 if all entries were processed, or the parser needed no more.
+ *	- -1 if the parser failed.
+ */
+static int ldap_trunk_query_entries(fr_ldap_connection_t *ldap_conn, fr_ldap_query_t *query, LDAPMessage *head)
+{
+	LDAPMessage	*entry;
+	int		ret;
+
+	for (entry = ldap_first_entry(ldap_conn->handle, head);
+	     entry;
+	     entry = ldap_next_entry(ldap_conn->handle, entry)) {
+		query->entries++;
+		ret = query->entry_parser(ldap_conn->handle, query, entry, query->entry_uctx);
+		if (ret < 0) return -1;
+		if (ret > 0) break;
+	}
+
+	return 0;
+}
+
+/** Process the final result of a query
+ *
+ * The query must already have been removed from the tree of outstanding queries.
+ *
+ * @param[in] ttrunk	the query was sent on.
+ * @param[in] ldap_conn	the result was received on.
+ * @param[in] query	the result belongs to.
+ * @param[in] result	Head of the chain of result messages.
+ */
+static void ldap_trunk_query_result(fr_ldap_thread_trunk_t *ttrunk, fr_ldap_connection_t *ldap_conn,
+				    fr_ldap_query_t *query, LDAPMessage *result)
+{
+	int			msgtype;
+	fr_ldap_rcode_t		rcode;
+	request_t		*request;
+
+	/*
+	 *	Add the query to the list of queries referencing this connection.
+	 *	Prevents the connection from being freed until the query has finished using it.
+	 */
+	fr_dlist_insert_tail(&ldap_conn->refs, query);
+
+	/*
+	 *	This really shouldn't happen - as we only retrieve complete sets of results -
+	 *	but as the query data structure will last until its results are fully handled
+	 *	better to have this safety check here.
+	 */
+	if (query->ret != LDAP_RESULT_PENDING) {
+		WARN("Received results for msgid %i which has already been handled - ignoring", query->msgid);
+		ldap_msgfree(result);
+		return;
+	}
+
+	msgtype = ldap_msgtype(result);
+
+	/*
+	 *	Request to reference in debug output
+	 */
+	request = query->treq->request;
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Got %s response for message %d",
+		  ldap_msg_types[msgtype], query->msgid);
+	rcode = fr_ldap_error_check(NULL, ldap_conn, result, query->dn);
+
+	switch (rcode) {
+	case LDAP_PROC_SUCCESS:
+		switch (query->type) {
+		case LDAP_REQUEST_SEARCH:
+			/*
+			 *	Any entries which weren't streamed as they arrived are
+			 *	in the chain with the final result.
+			 */
+			if (query->entry_parser) {
+				if (ldap_trunk_query_entries(ldap_conn, query, result) < 0) {
+					query->ret = LDAP_RESULT_ERROR;
+					break;
+				}
+				query->ret = (query->entries == 0) ? LDAP_RESULT_NO_RESULT : LDAP_RESULT_SUCCESS;
+				break;
+			}
+
+			query->ret = (ldap_count_entries(ldap_conn->handle, result) == 0) ?
+					LDAP_RESULT_NO_RESULT : LDAP_RESULT_SUCCESS;
+			break;
+
+		default:
+			query->ret = LDAP_RESULT_SUCCESS;
+			break;
+		}
+		break;
+
+	case LDAP_PROC_REFERRAL:
+		if (!ttrunk->t->config->chase_referrals) {
+			ROPTIONAL(REDEBUG, ERROR,
+				  "LDAP referral received but 'chase_referrals' is set to 'no'");
+			query->ret = LDAP_RESULT_EXCESS_REFERRALS;
+			break;
+		}
+
+		if (query->referral_depth >= ttrunk->t->config->referral_depth) {
+			ROPTIONAL(REDEBUG, ERROR, "Maximum LDAP referral depth (%d) exceeded",
+				  ttrunk->t->config->referral_depth);
+			query->ret = LDAP_RESULT_EXCESS_REFERRALS;
+			break;
+		}
+
+		/*
+		 *	If we've come here as the result of an existing referral
+		 *	clear the previous list of URLs before getting the next list.
+		 */
+		if (query->referral_urls) ldap_memvfree((void **)query->referral_urls);
+
+		ldap_get_option(ldap_conn->handle, LDAP_OPT_REFERRAL_URLS, &query->referral_urls);
+		if (!(query->referral_urls) || (!(query->referral_urls[0]))) {
+			ROPTIONAL(REDEBUG, ERROR, "LDAP referral missing referral URL");
+			query->ret = LDAP_RESULT_MISSING_REFERRAL;
+			break;
+		}
+
+		query->referral_depth ++;
+
+		if (fr_ldap_referral_follow(ttrunk->t, request, query) == 0) {
+		next_follow:
+			ldap_msgfree(result);
+			return;
+		}
+
+		ROPTIONAL(REDEBUG, ERROR, "Unable to follow any LDAP referral URLs");
+		query->ret = LDAP_RESULT_REFERRAL_FAIL;
+		break;
+
+	case LDAP_PROC_BAD_DN:
+		ROPTIONAL(RDEBUG2, DEBUG2, "DN %s does not exist", query->dn);
+		query->ret = LDAP_RESULT_BAD_DN;
+		break;
+
+	default:
+		ROPTIONAL(RPERROR, PERROR, "LDAP server returned an error");
+
+		if (query->referral_depth > 0) {
+			/*
+			 *	We're processing a referral - see if there are any more to try
+			 */
+			fr_dlist_talloc_free_item(&query->referrals, query->referral);
+			query->referral = NULL;
+
+			if ((fr_dlist_num_elements(&query->referrals) > 0) &&
+			    (fr_ldap_referral_next(ttrunk->t, request, query) == 0)) goto next_follow;
+		}
+
+		query->ret = LDAP_RESULT_REFERRAL_FAIL;
+		break;
+	}
+
+	query->result = result;
+
+	/*
+	 *	If we have a specific parser to handle the result, call it
+	 */
+	if (query->parser && (rcode == LDAP_PROC_SUCCESS)) query->parser(ldap_conn->handle, query,
+									 result, query->treq->rctx);
+
+	ldap_trunk_query_done(query, request);
+}
+
+/** Pass search entries which have already been received to queries which stream them
+ *
+ * ldap_result() with LDAP_MSG_ALL only returns a search response once its final message
+ * has been received.  Queries with an entry_parser are instead polled individually, so
+ * the entries can be processed (and freed) as they arrive, and searches which have found
+ * what they were looking for can be abandoned early.
+ *
+ * @param[in] tconn	Trunk connection associated with these results.
+ * @param[in] ttrunk	Thread specific trunk structure.
+ * @param[in] ldap_conn	to retrieve entries from.
+ * @return
+ *	- The number of messages processed.
+ *	- -1 if the connection failed.
+ */
+static int ldap_trunk_query_stream(trunk_connection_t *tconn, fr_ldap_thread_trunk_t *ttrunk,
+				   fr_ldap_connection_t *ldap_conn)
+{
+	fr_rb_iter_inorder_t	iter;
+	fr_ldap_query_t		*query;
+	LDAPMessage		*msg;
+	struct timeval		poll = { 0, 0 };
+	int			ret, processed = 0;
+
+again:
+	for (query = fr_rb_iter_init_inorder(&iter, ldap_conn->queries);
+	     query;
+	     query = fr_rb_iter_next_inorder(&iter)) {
+		if (!query->entry_parser) continue;
+
+		while ((ret = ldap_result(ldap_conn->handle, query->msgid, LDAP_MSG_ONE, &poll, &msg)) != 0) {
+			if (ret < 0) {
+				if (fr_ldap_error_check(NULL, ldap_conn, NULL, NULL) == LDAP_PROC_BAD_CONN) {
+					ERROR("Bad LDAP connection");
+					connection_signal_reconnect(tconn->conn, CONNECTION_FAILED);
+				}
+				return -1;
+			}
+
+			processed++;
+			switch (ldap_msgtype(msg)) {
+			case LDAP_RES_SEARCH_ENTRY:
+				query->entries++;
+				ret = query->entry_parser(ldap_conn->handle, query, msg, query->entry_uctx);
+				ldap_msgfree(msg);
+				if (ret == 0) continue;
+
+				/*
+				 *	The parser doesn't want any more entries, tell
+				 *	the server to stop sending them.
+				 */
+				ldap_abandon_ext(ldap_conn->handle, query->msgid, NULL, NULL);
+
+				fr_rb_iter_delete_inorder(&iter);
+				fr_dlist_insert_tail(&ldap_conn->refs, query);
+
+				query->ret = (ret < 0) ? LDAP_RESULT_ERROR : LDAP_RESULT_SUCCESS;
+				ldap_trunk_query_done(query, query->treq->request);
+				goto again;
+
+			case LDAP_RES_SEARCH_REFERENCE:
+				ldap_msgfree(msg);
+				continue;
+
+			default:
+				/*
+				 *	Final result of the search
+				 */
+				fr_rb_iter_delete_inorder(&iter);
+				ldap_trunk_query_result(ttrunk, ldap_conn, query, msg);
+				goto again;
+			}
+		}
+	}
+
+	return processed;
+}
+
 /** Read LDAP responses
  *
  * Responses from the LDAP server will cause the fd to become readable and trigger this
@@ -680,6 +1018,9 @@ static void ldap_trunk_request_mux(UNUSED fr_event_list_t *el, trunk_connection_
  * only gather those which are complete before either following a referral or passing
  * the head of the resulting chain of messages back.
  *
+ * The exception is searches with an entry_parser, whose entries are passed to
+ * the parser as they arrive, see ldap_trunk_query_stream().
+ *
  * @param[in] el	To insert timers into.
  * @param[in] tconn	Trunk connection associated with these results.
  * @param[in] conn	Connection handle for these results.
@@ -691,14 +1032,12 @@ static void ldap_trunk_request_demux(fr_event_list_t *el, trunk_connection_t *tc
 	fr_ldap_connection_t	*ldap_conn = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
 	fr_ldap_thread_trunk_t	*ttrunk = talloc_get_type_abort(uctx, fr_ldap_thread_trunk_t);
 
-	int 			ret = 0, msgtype;
+	int 			ret = 0;
 	struct timeval		poll = { 0, 10 };
 	LDAPMessage		*result = NULL;
 	fr_ldap_rcode_t		rcode;
 	fr_ldap_query_t		find = { .msgid = -1 }, *query = NULL;
-	request_t		*request;
 	bool			really_no_result = false;
-	trunk_request_t		*treq;
 
 	/*
 	 *  Reset the idle timeout event
@@ -721,9 +1060,17 @@ static void ldap_trunk_request_demux(fr_event_list_t *el, trunk_connection_t *tc
 		ret = ldap_result(ldap_conn->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &poll, &result);
 		switch (ret) {
 		case 0:
-			if (really_no_result) return;
-			really_no_result = true;
-			continue;
+			if (!really_no_result) {
+				really_no_result = true;
+				continue;
+			}
+
+			/*
+			 *	Entries passed to streaming queries may unblock
+			 *	complete results queued behind them.
+			 */
+			if (ldap_trunk_query_stream(tconn, ttrunk, ldap_conn) > 0) continue;
+			return;
 
 		case -1:
 			rcode = fr_ldap_error_check(NULL, ldap_conn, NULL, NULL);
@@ -756,141 +1103,7 @@ static void ldap_trunk_request_demux(fr_event_list_t *el, trunk_connection_t *tc
 		 */
 		fr_rb_remove(ldap_conn->queries, query);
 
-		/*
-		 *	Add the query to the list of queries referencing this connection.
-		 *	Prevents the connection from being freed until the query has finished using it.
-		 */
-		fr_dlist_insert_tail(&ldap_conn->refs, query);
-
-		/*
-		 *	This really shouldn't happen - as we only retrieve complete sets of results -
-		 *	but as the query data structure will last until its results are fully handled
-		 *	better to have this safety check here.
-		 */
-		if (query->ret != LDAP_RESULT_PENDING) {
-			WARN("Received results for msgid %i which has already been handled - ignoring", find.msgid);
-			ldap_msgfree(result);
-			continue;
-		}
-
-		msgtype = ldap_msgtype(result);
-
-		/*
-		 *	Request to reference in debug output
-		 */
-		request = query->treq->request;
-
-		ROPTIONAL(RDEBUG2, DEBUG2, "Got %s response for message %d",
-			  ldap_msg_types[msgtype], query->msgid);
-		rcode = fr_ldap_error_check(NULL, ldap_conn, result, query->dn);
-
-		switch (rcode) {
-		case LDAP_PROC_SUCCESS:
-			switch (query->type) {
-			case LDAP_REQUEST_SEARCH:
-				query->ret = (ldap_count_entries(ldap_conn->handle, result) == 0) ?
-						LDAP_RESULT_NO_RESULT : LDAP_RESULT_SUCCESS;
-				break;
-
-			default:
-				query->ret = LDAP_RESULT_SUCCESS;
-				break;
-			}
-			break;
-
-		case LDAP_PROC_REFERRAL:
-			if (!ttrunk->t->config->chase_referrals) {
-				ROPTIONAL(REDEBUG, ERROR,
-					  "LDAP referral received but 'chase_referrals' is set to 'no'");
-				query->ret = LDAP_RESULT_EXCESS_REFERRALS;
-				break;
-			}
-
-			if (query->referral_depth >= ttrunk->t->config->referral_depth) {
-				ROPTIONAL(REDEBUG, ERROR, "Maximum LDAP referral depth (%d) exceeded",
-					  ttrunk->t->config->referral_depth);
-				query->ret = LDAP_RESULT_EXCESS_REFERRALS;
-				break;
-			}
-
-			/*
-			 *	If we've come here as the result of an existing referral
-			 *	clear the previous list of URLs before getting the next list.
-			 */
-			if (query->referral_urls) ldap_memvfree((void **)query->referral_urls);
-
-			ldap_get_option(ldap_conn->handle, LDAP_OPT_REFERRAL_URLS, &query->referral_urls);
-			if (!(query->referral_urls) || (!(query->referral_urls[0]))) {
-				ROPTIONAL(REDEBUG, ERROR, "LDAP referral missing referral URL");
-				query->ret = LDAP_RESULT_MISSING_REFERRAL;
-				break;
-			}
-
-			query->referral_depth ++;
-
-			if (fr_ldap_referral_follow(ttrunk->t, request, query) == 0) {
-			next_follow:
-				ldap_msgfree(result);
-				continue;
-			}
-
-			ROPTIONAL(REDEBUG, ERROR, "Unable to follow any LDAP referral URLs");
-			query->ret = LDAP_RESULT_REFERRAL_FAIL;
-			break;
-
-		case LDAP_PROC_BAD_DN:
-			ROPTIONAL(RDEBUG2, DEBUG2, "DN %s does not exist", query->dn);
-			query->ret = LDAP_RESULT_BAD_DN;
-			break;
-
-		default:
-			ROPTIONAL(RPERROR, PERROR, "LDAP server returned an error");
-
-			if (query->referral_depth > 0) {
-				/*
-				 *	We're processing a referral - see if there are any more to try
-				 */
-				fr_dlist_talloc_free_item(&query->referrals, query->referral);
-				query->referral = NULL;
-
-				if ((fr_dlist_num_elements(&query->referrals) > 0) &&
-				    (fr_ldap_referral_next(ttrunk->t, request, query) == 0)) goto next_follow;
-			}
-
-			query->ret = LDAP_RESULT_REFERRAL_FAIL;
-			break;
-		}
-
-		/*
-		 *	Remove the timeout event
-		 */
-		if (query->ev) fr_event_timer_delete(&query->ev);
-
-		query->result = result;
-
-		/*
-		 *	If we have a specific parser to handle the result, call it
-		 */
-		if (query->parser && (rcode == LDAP_PROC_SUCCESS)) query->parser(ldap_conn->handle, query,
-										 result, query->treq->rctx);
-
-		/*
-		 *	Set the request as runnable
-		 */
-		if (request) unlang_interpret_mark_runnable(request);
-
-		/*
-		 *	If referral following failed, there is no active trunk request.
-		 */
-		if (!query->treq) continue;
-
-		/*
-		 *	If the query is parented off the treq then it will be freed when
-		 *	the request is completed.  If it is parented by something else then it will not.
-		 */
-		treq = query->treq;
-		query->treq = NULL;
-		trunk_request_signal_complete(treq);
+		ldap_trunk_query_result(ttrunk, ldap_conn, query, result);
 	} while (1);
 }
 
@@ -955,6 +1168,7 @@ fr_ldap_thread_trunk_t *fr_thread_ldap_trunk_get(fr_ldap_thread_t *thread, char
 					      .request_cancel = ldap_request_cancel,
 					      .request_cancel_mux = ldap_request_cancel_mux,
 					      .request_fail = ldap_request_fail,
+					      .request_coalesce = ldap_request_coalesce,
 					},
 				      thread->trunk_conf,
 				      "rlm_ldap", found, false);
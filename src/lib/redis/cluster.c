@@ -1500,6 +1500,17 @@ void *fr_redis_cluster_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delt
 			return NULL;
 		}
 
+		/*
+		 *	Reconnections, and new pool connections,
+		 *	resume the last session with this node.
+		 */
+		{
+			char peer[sizeof(node->name) + sizeof(":65535")];
+
+			snprintf(peer, sizeof(peer), "%s:%i", node->name, node->addr.inet.dst_port);
+			fr_tls_cache_client_resume(tls_session, peer);
+		}
+
 		// redisInitiateSSL() takes ownership of SSL object on success
 		SSL_up_ref(tls_session->ssl);
 		if (redisInitiateSSL(handle, tls_session->ssl) != REDIS_OK) {
@@ -2123,6 +2134,53 @@ int fr_redis_cluster_pool_by_node_addr(fr_pool_t **pool, fr_redis_cluster_t *clu
 	return 0;
 }
 
+/** Open a new connection to a node, which isn't part of the node's pool
+ *
+ * Used where a connection is dedicated to a single task, such as receiving
+ * key invalidation messages, and so can't be shared.
+ *
+ * @param[in] ctx to allocate the connection in.  Must be freed by the caller.
+ * @param[in] cluster to search for node in.
+ * @param[in] node_addr to connect to.  Specifies IP and port of node.
+ * @param[in] timeout The maximum time allowed to complete the connection.
+ * @return
+ *	- New #fr_redis_conn_t on success.
+ *	- NULL if no such node exists, or we couldn't connect to it.
+ */
+fr_redis_conn_t *fr_redis_cluster_conn_by_node_addr(TALLOC_CTX *ctx, fr_redis_cluster_t *cluster,
+						    fr_socket_t *node_addr, fr_time_delta_t timeout)
+{
+	fr_redis_cluster_node_t	find, *found;
+
+	find.addr = (fr_socket_t) {
+		.inet = {
+			.dst_ipaddr = node_addr->inet.dst_ipaddr,
+			.dst_port = node_addr->inet.dst_port,
+		}
+	};
+
+	pthread_mutex_lock(&cluster->mutex);
+	found = fr_rb_find(cluster->used_nodes, &find);
+	pthread_mutex_unlock(&cluster->mutex);
+	if (!found) {
+		char buffer[INET6_ADDRSTRLEN];
+		char const *hostname;
+
+		hostname = inet_ntop(node_addr->inet.dst_ipaddr.af, &node_addr->inet.dst_ipaddr.addr, buffer, sizeof(buffer));
+		fr_assert(hostname);	/* addr.ipaddr is probably corrupt */
+		fr_strerror_printf("No existing node found with address %s, port %i",
+				   hostname, node_addr->inet.dst_port);
+		return NULL;
+	}
+
+	/*
+	 *	Same as the pool's connection callback, the
+	 *	connection is established without holding
+	 *	the mutex, so slow nodes don't block remaps.
+	 */
+	return fr_redis_cluster_conn_create(ctx, found, timeout);
+}
+
 /** Return an array of IP addresses belonging to masters or slaves
  *
  * @note We return IP addresses as they're safe to use across cluster remaps.
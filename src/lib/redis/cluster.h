@@ -120,6 +120,8 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
  */
 int fr_redis_cluster_pool_by_node_addr(fr_pool_t **pool, fr_redis_cluster_t *cluster,
 				       fr_socket_t *node, bool create);
+fr_redis_conn_t *fr_redis_cluster_conn_by_node_addr(TALLOC_CTX *ctx, fr_redis_cluster_t *cluster,
+						    fr_socket_t *node_addr, fr_time_delta_t timeout);
 ssize_t fr_redis_cluster_node_addr_by_role(TALLOC_CTX *ctx, fr_socket_t *out[],
 					   fr_redis_cluster_t *cluster, bool is_master, bool is_slave);
 
@@ -0,0 +1,751 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/redis/tracking.c
+ * @brief Client side caching of read only commands, using RESP3 key tracking.
+ *
+ * Each worker has its own cache of replies to read only commands, keyed by
+ * the full command.  A single thread holds a dedicated connection to the
+ * server, with "CLIENT TRACKING ON BCAST" enabled, and removes entries from
+ * every worker's cache as the server tells us their keys have changed.
+ *
+ * Broadcast mode is used because the pooled connections the commands are
+ * sent on are idle most of the time, so nothing would read the invalidation
+ * messages the server sends on them.  The server sends invalidations for
+ * every key matching the configured prefixes, whether or not we've read it.
+ *
+ * If the tracking connection fails, the caches are flushed, and nothing is
+ * cached until it's re-established.
+ *
+ * Each cache has its own mutex, which is only ever contended by the tracking
+ * thread, and a generation counter which is incremented on every invalidation.
+ * The generation is recorded when a lookup misses, and the reply is only
+ * inserted if the generation is unchanged, so that a reply can't be cached
+ * after the invalidation for it has already been processed.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rb.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include "tracking.h"
+
+#ifdef HAVE_REDIS_TRACKING
+#include <pthread.h>
+#include <sys/socket.h>
+
+/** Longest command we'll cache, once encoded
+ *
+ * Allows commands to be encoded on the stack for lookups.
+ */
+#define TRACKING_MAX_CMD		1024
+
+/** How long we wait for the tracking connection to be established
+ *
+ */
+#define TRACKING_CONNECT_TIMEOUT	fr_time_delta_from_sec(5)
+
+/** A read only command we know how to cache
+ *
+ * All of these take a single key, as the first argument.
+ */
+typedef struct {
+	char const		*name;		//!< Of the command.
+	size_t			name_len;	//!< Length of the name.
+	int			min_argc;	//!< Minimum number of arguments, including the command.
+	int			max_argc;	//!< Maximum number of arguments.  0 for no limit.
+} tracking_command_t;
+
+#define TRACKING_COMMAND(_name, _min, _max) { .name = _name, .name_len = sizeof(_name) - 1, .min_argc = _min, .max_argc = _max }
+
+static tracking_command_t const tracking_commands[] = {
+	TRACKING_COMMAND("EXISTS", 2, 2),
+	TRACKING_COMMAND("GET", 2, 2),
+	TRACKING_COMMAND("GETRANGE", 4, 4),
+	TRACKING_COMMAND("HEXISTS", 3, 3),
+	TRACKING_COMMAND("HGET", 3, 3),
+	TRACKING_COMMAND("HGETALL", 2, 2),
+	TRACKING_COMMAND("HKEYS", 2, 2),
+	TRACKING_COMMAND("HLEN", 2, 2),
+	TRACKING_COMMAND("HMGET", 3, 0),
+	TRACKING_COMMAND("HVALS", 2, 2),
+	TRACKING_COMMAND("LINDEX", 3, 3),
+	TRACKING_COMMAND("LLEN", 2, 2),
+	TRACKING_COMMAND("LRANGE", 4, 4),
+	TRACKING_COMMAND("SCARD", 2, 2),
+	TRACKING_COMMAND("SISMEMBER", 3, 3),
+	TRACKING_COMMAND("SMEMBERS", 2, 2),
+	TRACKING_COMMAND("STRLEN", 2, 2),
+	TRACKING_COMMAND("TYPE", 2, 2),
+	TRACKING_COMMAND("ZCARD", 2, 2),
+	TRACKING_COMMAND("ZRANGE", 4, 0),
+	TRACKING_COMMAND("ZSCORE", 3, 3)
+};
+
+struct fr_redis_tracking_s {
+	fr_redis_tracking_conf_t const	*conf;		//!< Limits and prefixes.
+	char const			*log_prefix;	//!< What to prepend to log messages.
+
+	fr_redis_cluster_t		*cluster;	//!< To connect to.
+	fr_socket_t			node_addr;	//!< Of the node to track keys on.
+
+	int				track_argc;	//!< Number of arguments in the CLIENT TRACKING command.
+	char const			**track_argv;	//!< CLIENT TRACKING command.
+	size_t				*track_arg_len;	//!< Lengths of the CLIENT TRACKING arguments.
+
+	pthread_t			thread;		//!< Reading invalidation messages.
+	bool				running;	//!< Whether the thread was started.
+	TALLOC_CTX			*thread_ctx;	//!< The only ctx the thread allocates in.
+
+	pthread_mutex_t			mutex;		//!< Protects the fields below.
+	pthread_cond_t			cond;		//!< Signalled when the thread should stop.
+	bool				stop;		//!< Tells the thread to exit.
+	bool				connected;	//!< Whether the tracking connection is up.
+	fr_redis_conn_t			*conn;		//!< The tracking connection.
+	fr_dlist_head_t			caches;		//!< Of every worker.
+};
+
+struct fr_redis_tracking_cache_s {
+	fr_dlist_t			entry;		//!< Entry in the list of caches.
+	fr_redis_tracking_t		*tracking;	//!< This cache belongs to.
+
+	pthread_mutex_t			mutex;		//!< Protects the fields below.
+	bool				valid;		//!< False if invalidations may have been missed.
+	uint64_t			gen;		//!< Incremented on every invalidation.
+	fr_rb_tree_t			*entries;	//!< By command.
+	fr_rb_tree_t			*keys;		//!< By key.
+	fr_dlist_head_t			lru;		//!< Entries, most recently used first.
+};
+
+/** All the entries for a single Redis key
+ *
+ */
+typedef struct {
+	fr_rb_node_t			node;		//!< Entry in the tree of keys.
+	uint8_t const			*key;		//!< Redis key.
+	size_t				key_len;	//!< Length of the key.
+	fr_dlist_head_t			entries;	//!< Reading this key.
+} tracking_key_t;
+
+/** A cached reply
+ *
+ */
+typedef struct {
+	fr_rb_node_t			node;		//!< Entry in the tree of entries.
+	fr_dlist_t			lru_entry;	//!< Entry in the LRU list.
+	fr_dlist_t			key_entry;	//!< Entry in the key's list of entries.
+	tracking_key_t			*key;		//!< This entry reads.
+
+	uint8_t const			*cmd;		//!< Encoded command.
+	size_t				cmd_len;	//!< Length of the encoded command.
+
+	fr_time_t			expires;	//!< When the entry must be discarded.
+	fr_value_box_t			value;		//!< The reply.
+} tracking_entry_t;
+
+static int8_t tracking_entry_cmp(void const *one, void const *two)
+{
+	tracking_entry_t const *a = one, *b = two;
+
+	return memcmp_return(a->cmd, b->cmd, a->cmd_len, b->cmd_len);
+}
+
+static int8_t tracking_key_cmp(void const *one, void const *two)
+{
+	tracking_key_t const *a = one, *b = two;
+
+	return memcmp_return(a->key, b->key, a->key_len, b->key_len);
+}
+
+/** Encode a command as a length prefixed list of arguments
+ *
+ * The command name is upper cased, as Redis doesn't care about its case.
+ *
+ * @return
+ *	- Length of the encoded command.
+ *	- -1 if the command was too long.
+ */
+static ssize_t tracking_cmd_encode(uint8_t out[static TRACKING_MAX_CMD],
+				   int argc, char const **argv, size_t const arg_len[])
+{
+	uint8_t	*p = out, *end = out + TRACKING_MAX_CMD;
+	int	i;
+
+	for (i = 0; i < argc; i++) {
+		uint16_t len;
+
+		if ((size_t)(end - p) < (sizeof(len) + arg_len[i])) return -1;
+
+		len = arg_len[i];
+		memcpy(p, &len, sizeof(len));
+		p += sizeof(len);
+
+		if (i == 0) {
+			size_t j;
+
+			for (j = 0; j < arg_len[i]; j++) p[j] = toupper((uint8_t)argv[i][j]);
+		} else {
+			memcpy(p, argv[i], arg_len[i]);
+		}
+		p += arg_len[i];
+	}
+
+	return p - out;
+}
+
+/** Free an entry, and its key if no other entries read it
+ *
+ * Entries aren't freed with a talloc destructor, as the trees may
+ * already have been freed when the whole cache is freed.
+ */
+static void tracking_entry_free(fr_redis_tracking_cache_t *cache, tracking_entry_t *entry)
+{
+	tracking_key_t *key = entry->key;
+
+	fr_rb_remove_by_inline_node(cache->entries, &entry->node);
+	fr_dlist_remove(&cache->lru, entry);
+	fr_dlist_remove(&key->entries, entry);
+	talloc_free(entry);
+
+	if (!fr_dlist_empty(&key->entries)) return;
+
+	fr_rb_remove_by_inline_node(cache->keys, &key->node);
+	talloc_free(key);
+}
+
+/** Free every entry in a cache
+ *
+ * Must be called with the cache's mutex held.
+ */
+static void tracking_cache_flush(fr_redis_tracking_cache_t *cache)
+{
+	tracking_entry_t *entry;
+
+	while ((entry = fr_dlist_tail(&cache->lru))) tracking_entry_free(cache, entry);
+}
+
+/** Free every entry which reads a key
+ *
+ * Must be called with the cache's mutex held.
+ */
+static void tracking_cache_invalidate(fr_redis_tracking_cache_t *cache, uint8_t const *key, size_t key_len)
+{
+	tracking_key_t	find = { .key = key, .key_len = key_len }, *found;
+	bool		more;
+
+	found = fr_rb_find(cache->keys, &find);
+	if (!found) return;
+
+	do {
+		more = (fr_dlist_num_elements(&found->entries) > 1);
+		tracking_entry_free(cache, fr_dlist_head(&found->entries));
+	} while (more);
+}
+
+/** Mark every cache as usable, or not
+ *
+ * Caches are flushed when they become unusable, as we won't be told
+ * about any of the keys modified until the tracking connection is
+ * re-established.
+ *
+ * Must be called with the tracking mutex held.
+ */
+static void tracking_caches_valid(fr_redis_tracking_t *tracking, bool valid)
+{
+	tracking->connected = valid;
+
+	fr_dlist_foreach(&tracking->caches, fr_redis_tracking_cache_t, cache) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->valid = valid;
+		cache->gen++;
+		if (!valid) tracking_cache_flush(cache);
+		pthread_mutex_unlock(&cache->mutex);
+	}
+}
+
+/** Process an invalidation message
+ *
+ * The message is a push reply of ["invalidate", [key, ...]], or
+ * ["invalidate", nil] if the server flushed its database.
+ */
+static void tracking_push(fr_redis_tracking_t *tracking, redisReply *reply)
+{
+	redisReply	*keys;
+	size_t		i;
+
+	if ((reply->type != REDIS_REPLY_PUSH) || (reply->elements != 2) ||
+	    (reply->element[0]->type != REDIS_REPLY_STRING) ||
+	    (strcmp(reply->element[0]->str, "invalidate") != 0)) {
+		DEBUG3("%s - Ignoring unexpected %s reply on tracking connection", tracking->log_prefix,
+		       fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
+		return;
+	}
+	keys = reply->element[1];
+
+	pthread_mutex_lock(&tracking->mutex);
+	fr_dlist_foreach(&tracking->caches, fr_redis_tracking_cache_t, cache) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->gen++;
+		if (keys->type != REDIS_REPLY_ARRAY) {
+			tracking_cache_flush(cache);
+		} else for (i = 0; i < keys->elements; i++) {
+			if (keys->element[i]->type != REDIS_REPLY_STRING) continue;
+
+			tracking_cache_invalidate(cache, (uint8_t const *)keys->element[i]->str, keys->element[i]->len);
+		}
+		pthread_mutex_unlock(&cache->mutex);
+	}
+	pthread_mutex_unlock(&tracking->mutex);
+}
+
+/** Check the reply to a command sent on the tracking connection
+ *
+ */
+static int tracking_reply_check(fr_redis_tracking_t *tracking, fr_redis_conn_t *conn, redisReply *reply,
+				char const *command)
+{
+	if (!reply) {
+		ERROR("%s - Failed sending %s: %s", tracking->log_prefix, command, conn->handle->errstr);
+		return -1;
+	}
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		ERROR("%s - %s failed: %s", tracking->log_prefix, command, reply->str);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Open the tracking connection, and enable tracking on it
+ *
+ */
+static fr_redis_conn_t *tracking_connect(fr_redis_tracking_t *tracking)
+{
+	fr_redis_conn_t	*conn;
+	redisReply	*reply;
+
+	conn = fr_redis_cluster_conn_by_node_addr(tracking->thread_ctx, tracking->cluster, &tracking->node_addr,
+						  TRACKING_CONNECT_TIMEOUT);
+	if (!conn) {
+		PERROR("%s - Failed opening tracking connection", tracking->log_prefix);
+		return NULL;
+	}
+
+	/*
+	 *	Have push replies (invalidation messages)
+	 *	returned by redisGetReply().
+	 */
+	redisSetPushCallback(conn->handle, NULL);
+
+	reply = redisCommand(conn->handle, "HELLO 3");
+	if (tracking_reply_check(tracking, conn, reply, "HELLO 3") < 0) {
+	error:
+		fr_redis_reply_free(&reply);
+		talloc_free(conn);
+		return NULL;
+	}
+	fr_redis_reply_free(&reply);
+
+	reply = redisCommandArgv(conn->handle, tracking->track_argc, tracking->track_argv, tracking->track_arg_len);
+	if (tracking_reply_check(tracking, conn, reply, "CLIENT TRACKING") < 0) goto error;
+	fr_redis_reply_free(&reply);
+
+	return conn;
+}
+
+static void *tracking_thread(void *arg)
+{
+	fr_redis_tracking_t	*tracking = talloc_get_type_abort(arg, fr_redis_tracking_t);
+	fr_redis_conn_t		*conn;
+	redisReply		*reply;
+	struct timespec		ts;
+
+	pthread_mutex_lock(&tracking->mutex);
+	while (!tracking->stop) {
+		pthread_mutex_unlock(&tracking->mutex);
+		conn = tracking_connect(tracking);
+		pthread_mutex_lock(&tracking->mutex);
+
+		if (conn) {
+			if (tracking->stop) {
+				talloc_free(conn);
+				break;
+			}
+
+			tracking->conn = conn;
+			tracking_caches_valid(tracking, true);
+			pthread_mutex_unlock(&tracking->mutex);
+
+			INFO("%s - Tracking connection established", tracking->log_prefix);
+
+			while (redisGetReply(conn->handle, (void **)&reply) == REDIS_OK) {
+				tracking_push(tracking, reply);
+				fr_redis_reply_free(&reply);
+			}
+
+			pthread_mutex_lock(&tracking->mutex);
+			tracking->conn = NULL;
+			tracking_caches_valid(tracking, false);
+			if (tracking->stop) {
+				talloc_free(conn);
+				break;
+			}
+
+			ERROR("%s - Tracking connection failed: %s.  Cache disabled until it's re-established",
+			      tracking->log_prefix, conn->handle->errstr);
+			talloc_free(conn);
+		}
+
+		ts = fr_time_to_timespec(fr_time_add(fr_time(), tracking->conf->reconnection_delay));
+		pthread_cond_timedwait(&tracking->cond, &tracking->mutex, &ts);
+	}
+	pthread_mutex_unlock(&tracking->mutex);
+
+	return NULL;
+}
+
+static int _tracking_free(fr_redis_tracking_t *tracking)
+{
+	if (tracking->running) {
+		pthread_mutex_lock(&tracking->mutex);
+		tracking->stop = true;
+
+		/*
+		 *	Wake the thread if it's blocked
+		 *	reading from the connection.
+		 */
+		if (tracking->conn) shutdown(tracking->conn->handle->fd, SHUT_RDWR);
+		pthread_cond_signal(&tracking->cond);
+		pthread_mutex_unlock(&tracking->mutex);
+
+		pthread_join(tracking->thread, NULL);
+	}
+
+	fr_assert(fr_dlist_empty(&tracking->caches));
+
+	talloc_free(tracking->thread_ctx);
+	pthread_cond_destroy(&tracking->cond);
+	pthread_mutex_destroy(&tracking->mutex);
+
+	return 0;
+}
+
+/** Start tracking keys on a node
+ *
+ * @param[in] ctx		to allocate the tracker in.
+ * @param[in] cluster		containing the node.
+ * @param[in] node_addr		of the node to track keys on.
+ * @param[in] conf		limits and prefixes.  Must remain valid for the
+ *				lifetime of the tracker.
+ * @param[in] log_prefix	to prepend to log messages.
+ * @return
+ *	- A new tracker on success.
+ *	- NULL on failure.
+ */
+fr_redis_tracking_t *fr_redis_tracking_alloc(TALLOC_CTX *ctx, fr_redis_cluster_t *cluster,
+					     fr_socket_t const *node_addr,
+					     fr_redis_tracking_conf_t const *conf, char const *log_prefix)
+{
+	fr_redis_tracking_t	*tracking;
+	size_t			num_prefix = talloc_array_length(conf->prefix);
+	size_t			i;
+	int			ret;
+
+	MEM(tracking = talloc_zero(ctx, fr_redis_tracking_t));
+	tracking->conf = conf;
+	tracking->log_prefix = talloc_strdup(tracking, log_prefix);
+	tracking->cluster = cluster;
+	tracking->node_addr = *node_addr;
+
+	/*
+	 *	CLIENT TRACKING ON BCAST [PREFIX <prefix> ...]
+	 */
+	tracking->track_argc = 4 + (num_prefix * 2);
+	MEM(tracking->track_argv = talloc_array(tracking, char const *, tracking->track_argc));
+	MEM(tracking->track_arg_len = talloc_array(tracking, size_t, tracking->track_argc));
+	tracking->track_argv[0] = "CLIENT";
+	tracking->track_argv[1] = "TRACKING";
+	tracking->track_argv[2] = "ON";
+	tracking->track_argv[3] = "BCAST";
+	for (i = 0; i < num_prefix; i++) {
+		tracking->track_argv[4 + (i * 2)] = "PREFIX";
+		tracking->track_argv[5 + (i * 2)] = conf->prefix[i];
+	}
+	for (i = 0; i < (size_t)tracking->track_argc; i++) tracking->track_arg_len[i] = strlen(tracking->track_argv[i]);
+
+	pthread_mutex_init(&tracking->mutex, NULL);
+	pthread_cond_init(&tracking->cond, NULL);
+	fr_dlist_init(&tracking->caches, fr_redis_tracking_cache_t, entry);
+	MEM(tracking->thread_ctx = talloc_new(NULL));
+	talloc_set_destructor(tracking, _tracking_free);
+
+	ret = pthread_create(&tracking->thread, NULL, tracking_thread, tracking);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating tracking thread: %s", fr_syserror(ret));
+		talloc_free(tracking);
+		return NULL;
+	}
+	tracking->running = true;
+
+	return tracking;
+}
+
+static int _tracking_cache_free(fr_redis_tracking_cache_t *cache)
+{
+	fr_redis_tracking_t *tracking = cache->tracking;
+
+	pthread_mutex_lock(&tracking->mutex);
+	fr_dlist_remove(&tracking->caches, cache);
+	pthread_mutex_unlock(&tracking->mutex);
+
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache for a worker
+ *
+ * The cache isn't allocated in ctx, as the tracking thread frees entries
+ * in it, which would race with the worker allocating other memory in ctx.
+ * It's freed when ctx is freed.
+ *
+ * @param[in] ctx		to tie the lifetime of the cache to.
+ * @param[in] tracking		to receive invalidations from.
+ * @return A new cache.
+ */
+fr_redis_tracking_cache_t *fr_redis_tracking_cache_alloc(TALLOC_CTX *ctx, fr_redis_tracking_t *tracking)
+{
+	fr_redis_tracking_cache_t *cache;
+
+	MEM(cache = talloc_zero(NULL, fr_redis_tracking_cache_t));
+	cache->tracking = tracking;
+	pthread_mutex_init(&cache->mutex, NULL);
+	MEM(cache->entries = fr_rb_inline_talloc_alloc(cache, tracking_entry_t, node, tracking_entry_cmp, NULL));
+	MEM(cache->keys = fr_rb_inline_talloc_alloc(cache, tracking_key_t, node, tracking_key_cmp, NULL));
+	fr_dlist_init(&cache->lru, tracking_entry_t, lru_entry);
+
+	pthread_mutex_lock(&tracking->mutex);
+	cache->valid = tracking->connected;
+	fr_dlist_insert_tail(&tracking->caches, cache);
+	pthread_mutex_unlock(&tracking->mutex);
+
+	talloc_set_destructor(cache, _tracking_cache_free);
+	talloc_link_ctx(ctx, cache);
+
+	return cache;
+}
+
+/** Check whether the reply to a command can be cached
+ *
+ * @param[in] tracking	the command would be cached with.
+ * @param[in] argc	Number of arguments, including the command.
+ * @param[in] argv	Command and arguments.
+ * @param[in] arg_len	Lengths of the command and arguments.
+ * @return true if the command reads a single key we're tracking.
+ */
+bool fr_redis_tracking_cacheable(fr_redis_tracking_t const *tracking,
+				 int argc, char const **argv, size_t const arg_len[])
+{
+	tracking_command_t const	*cmd = NULL;
+	size_t				i, len = 0;
+	int				j;
+
+	if (argc < 2) return false;
+
+	for (i = 0; i < NUM_ELEMENTS(tracking_commands); i++) {
+		if ((arg_len[0] == tracking_commands[i].name_len) &&
+		    (strncasecmp(argv[0], tracking_commands[i].name, arg_len[0]) == 0)) {
+			cmd = &tracking_commands[i];
+			break;
+		}
+	}
+	if (!cmd) return false;
+
+	if (argc < cmd->min_argc) return false;
+	if (cmd->max_argc && (argc > cmd->max_argc)) return false;
+
+	for (j = 0; j < argc; j++) len += sizeof(uint16_t) + arg_len[j];
+	if (len > TRACKING_MAX_CMD) return false;
+
+	/*
+	 *	We're only told about changes to keys
+	 *	matching the prefixes.
+	 */
+	if (!tracking->conf->prefix) return true;
+
+	talloc_foreach(tracking->conf->prefix, prefix) {
+		size_t prefix_len = talloc_array_length(prefix) - 1;
+
+		if ((arg_len[1] >= prefix_len) && (memcmp(argv[1], prefix, prefix_len) == 0)) return true;
+	}
+
+	return false;
+}
+
+/** Find a cached reply to a command
+ *
+ * @param[in] ctx	to allocate the reply in.
+ * @param[out] out	Where to write a copy of the reply.
+ * @param[out] gen	To pass to #fr_redis_tracking_cache_insert if there's no entry.
+ * @param[in] cache	to search in.
+ * @param[in] argc	Number of arguments, including the command.
+ * @param[in] argv	Command and arguments.
+ * @param[in] arg_len	Lengths of the command and arguments.
+ * @return
+ *	- 1 if a reply was found.
+ *	- 0 if no reply was found.
+ *	- -1 if the reply couldn't be copied.
+ */
+int fr_redis_tracking_cache_find(TALLOC_CTX *ctx, fr_value_box_t *out, uint64_t *gen,
+				 fr_redis_tracking_cache_t *cache,
+				 int argc, char const **argv, size_t const arg_len[])
+{
+	uint8_t			buff[TRACKING_MAX_CMD];
+	ssize_t			slen;
+	tracking_entry_t	find, *found;
+	int			ret = 0;
+
+	slen = tracking_cmd_encode(buff, argc, argv, arg_len);
+	if (slen < 0) return 0;
+	find.cmd = buff;
+	find.cmd_len = slen;
+
+	pthread_mutex_lock(&cache->mutex);
+	*gen = cache->gen;
+	if (!cache->valid) goto done;
+
+	found = fr_rb_find(cache->entries, &find);
+	if (!found) goto done;
+
+	if (fr_time_lt(found->expires, fr_time())) {
+		tracking_entry_free(cache, found);
+		goto done;
+	}
+
+	fr_dlist_remove(&cache->lru, found);
+	fr_dlist_insert_head(&cache->lru, found);
+
+	ret = (fr_value_box_copy(ctx, out, &found->value) < 0) ? -1 : 1;
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+
+	return ret;
+}
+
+/** Cache the reply to a command
+ *
+ * @param[in] cache	to insert the reply into.
+ * @param[in] gen	returned by #fr_redis_tracking_cache_find.  If the key
+ *			may have been modified since, the reply isn't cached.
+ * @param[in] argc	Number of arguments, including the command.
+ * @param[in] argv	Command and arguments.
+ * @param[in] arg_len	Lengths of the command and arguments.
+ * @param[in] value	The reply.
+ */
+void fr_redis_tracking_cache_insert(fr_redis_tracking_cache_t *cache, uint64_t gen,
+				    int argc, char const **argv, size_t const arg_len[],
+				    fr_value_box_t const *value)
+{
+	uint8_t			buff[TRACKING_MAX_CMD];
+	ssize_t			slen;
+	tracking_entry_t	find, *entry;
+	tracking_key_t		find_key, *key;
+
+	slen = tracking_cmd_encode(buff, argc, argv, arg_len);
+	if (slen < 0) return;
+	find.cmd = buff;
+	find.cmd_len = slen;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (!cache->valid || (gen != cache->gen)) goto done;
+
+	entry = fr_rb_find(cache->entries, &find);
+	if (entry) tracking_entry_free(cache, entry);
+
+	while (fr_rb_num_elements(cache->entries) >= cache->tracking->conf->max_entries) {
+		tracking_entry_free(cache, fr_dlist_tail(&cache->lru));
+	}
+
+	MEM(entry = talloc_zero(cache, tracking_entry_t));
+	if (fr_value_box_copy(entry, &entry->value, value) < 0) {
+		talloc_free(entry);
+		goto done;
+	}
+	MEM(entry->cmd = talloc_memdup(entry, buff, slen));
+	entry->cmd_len = slen;
+	entry->expires = fr_time_add(fr_time(), cache->tracking->conf->lifetime);
+
+	find_key.key = (uint8_t const *)argv[1];
+	find_key.key_len = arg_len[1];
+	key = fr_rb_find(cache->keys, &find_key);
+	if (!key) {
+		MEM(key = talloc_zero(cache, tracking_key_t));
+		MEM(key->key = talloc_memdup(key, argv[1], arg_len[1]));
+		key->key_len = arg_len[1];
+		fr_dlist_init(&key->entries, tracking_entry_t, key_entry);
+		fr_rb_insert(cache->keys, key);
+	}
+
+	entry->key = key;
+	fr_dlist_insert_tail(&key->entries, entry);
+	fr_dlist_insert_head(&cache->lru, entry);
+	fr_rb_insert(cache->entries, entry);
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+}
+#else
+fr_redis_tracking_t *fr_redis_tracking_alloc(UNUSED TALLOC_CTX *ctx, UNUSED fr_redis_cluster_t *cluster,
+					     UNUSED fr_socket_t const *node_addr,
+					     UNUSED fr_redis_tracking_conf_t const *conf,
+					     UNUSED char const *log_prefix)
+{
+	fr_strerror_const("Client side caching requires hiredis >= 1.0.0");
+	return NULL;
+}
+
+fr_redis_tracking_cache_t *fr_redis_tracking_cache_alloc(UNUSED TALLOC_CTX *ctx, UNUSED fr_redis_tracking_t *tracking)
+{
+	return NULL;
+}
+
+bool fr_redis_tracking_cacheable(UNUSED fr_redis_tracking_t const *tracking,
+				 UNUSED int argc, UNUSED char const **argv, UNUSED size_t const arg_len[])
+{
+	return false;
+}
+
+int fr_redis_tracking_cache_find(UNUSED TALLOC_CTX *ctx, UNUSED fr_value_box_t *out, UNUSED uint64_t *gen,
+				 UNUSED fr_redis_tracking_cache_t *cache,
+				 UNUSED int argc, UNUSED char const **argv, UNUSED size_t const arg_len[])
+{
+	return 0;
+}
+
+void fr_redis_tracking_cache_insert(UNUSED fr_redis_tracking_cache_t *cache, UNUSED uint64_t gen,
+				    UNUSED int argc, UNUSED char const **argv, UNUSED size_t const arg_len[],
+				    UNUSED fr_value_box_t const *value)
+{
+}
+#endif
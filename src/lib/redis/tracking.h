@@ -0,0 +1,76 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/redis/tracking.h
+ * @brief Client side caching of read only commands, using RESP3 key tracking.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(redis_tracking_h, "$Id$")
+
+#include <freeradius-devel/redis/base.h>
+#include <freeradius-devel/redis/cluster.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	RESP3, and push replies, were added in hiredis 1.0.0
+ */
+#if defined(HIREDIS_MAJOR) && (HIREDIS_MAJOR >= 1)
+#  define HAVE_REDIS_TRACKING 1
+#endif
+
+typedef struct fr_redis_tracking_s fr_redis_tracking_t;
+typedef struct fr_redis_tracking_cache_s fr_redis_tracking_cache_t;
+
+/** Configuration for client side caching
+ *
+ */
+typedef struct {
+	uint32_t		max_entries;		//!< Maximum number of entries in each worker's cache.
+							//!< 0 disables caching.
+	fr_time_delta_t		lifetime;		//!< Maximum time an entry is kept for, even if it's
+							//!< never invalidated.
+	fr_time_delta_t		reconnection_delay;	//!< How long to wait before re-establishing the
+							//!< tracking connection.
+	char const		**prefix;		//!< Only cache keys starting with one of these.
+} fr_redis_tracking_conf_t;
+
+fr_redis_tracking_t		*fr_redis_tracking_alloc(TALLOC_CTX *ctx, fr_redis_cluster_t *cluster,
+							 fr_socket_t const *node_addr,
+							 fr_redis_tracking_conf_t const *conf, char const *log_prefix);
+
+fr_redis_tracking_cache_t	*fr_redis_tracking_cache_alloc(TALLOC_CTX *ctx, fr_redis_tracking_t *tracking);
+
+bool				fr_redis_tracking_cacheable(fr_redis_tracking_t const *tracking,
+							    int argc, char const **argv, size_t const arg_len[]);
+
+int				fr_redis_tracking_cache_find(TALLOC_CTX *ctx, fr_value_box_t *out, uint64_t *gen,
+							     fr_redis_tracking_cache_t *cache,
+							     int argc, char const **argv, size_t const arg_len[]);
+
+void				fr_redis_tracking_cache_insert(fr_redis_tracking_cache_t *cache, uint64_t gen,
+							       int argc, char const **argv, size_t const arg_len[],
+							       fr_value_box_t const *value);
+
+#ifdef __cplusplus
+}
+#endif
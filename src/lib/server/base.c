@@ -26,6 +26,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/memory.h>
 #include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/server/trigger.h>
 #include <freeradius-devel/server/password.h>
@@ -55,6 +56,12 @@ int server_init(CONF_SECTION *cs)
 	 */
 	if (trigger_exec_init(cs) < 0) return -1;
 
+	/*
+	 *	Register the memory report before anything
+	 *	registers memory with it.
+	 */
+	if (fr_memory_init() < 0) return -1;
+
 	/*
 	 *	Set up dictionaries and attributes for password comparisons
 	 */
@@ -121,4 +128,6 @@ void server_free(void)
 	 *	Free xlat instance data, and call any detach methods
 	 */
 	xlat_instances_free();
+
+	fr_memory_free();
 }
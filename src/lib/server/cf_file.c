@@ -879,6 +879,27 @@ static int8_t filename_cmp(void const *one, void const *two)
 }
 
 
+/** Ask the kernel to start reading a file which we're about to parse
+ *
+ * When a directory or a wildcard is included, every file is prefetched
+ * before the first one is parsed.  On a cold start the reads then
+ * happen in parallel, in the background, rather than one at a time as
+ * each file is reached.  The files are still parsed one at a time, and
+ * in order, as later items can refer to earlier ones.
+ */
+static void cf_file_prefetch(UNUSED char const *filename)
+{
+#ifdef POSIX_FADV_WILLNEED
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) return;
+
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+#endif
+}
+
 static int process_include(cf_stack_t *stack, CONF_SECTION *parent, char const *ptr, bool required, bool relative)
 {
 	char const *value;
@@ -974,6 +995,8 @@ static int process_include(cf_stack_t *stack, CONF_SECTION *parent, char const *
 			return -1;
 		}
 
+		for (size_t i = 0; i < frame->glob.gl_pathc; i++) cf_file_prefetch(frame->glob.gl_pathv[i]);
+
 		return 1;
 #endif
 	}
@@ -1124,6 +1147,8 @@ static int process_include(cf_stack_t *stack, CONF_SECTION *parent, char const *
 			MEM(h->filename = talloc_typed_strdup(h, stack->buff[1]));
 			h->heap_id = FR_HEAP_INDEX_INVALID;
 			(void) fr_heap_insert(&frame->heap, h);
+
+			cf_file_prefetch(h->filename);
 		}
 		closedir(dir);
 		return 1;
@@ -1762,6 +1787,87 @@ alloc_section:
 }
 
 
+/** Parse "limit [global] [adaptive] <value> {"
+ *
+ *  The value becomes name2, and any options are put into argv.
+ */
+static CONF_ITEM *process_limit(cf_stack_t *stack)
+{
+	CONF_SECTION	*css;
+	fr_token_t	token;
+	char const	*ptr = stack->ptr;
+	cf_stack_frame_t *frame = &stack->frame[stack->depth];
+	CONF_SECTION	*parent = frame->current;
+	char		*buff = stack->buff[1];
+	char const	*argv[2];
+	int		argc = 0;
+
+	fr_skip_whitespace(ptr);
+
+	while (true) {
+		if (cf_get_token(parent, &ptr, &token, buff, stack->bufsize,
+				 frame->filename, frame->lineno) < 0) {
+			return NULL;
+		}
+
+		/*
+		 *	The last thing before the brace is the value.
+		 */
+		if (*ptr == '{') {
+			ptr++;
+			break;
+		}
+
+		if (token != T_BARE_WORD) {
+		invalid:
+			ERROR("%s[%d]: Invalid syntax for 'limit' - expected 'global', 'adaptive', or '{' after '%s'",
+			      frame->filename, frame->lineno, buff);
+			return NULL;
+		}
+
+		if ((strcmp(buff, "global") == 0) && (argc < 2)) {
+			argv[argc++] = "global";
+
+		} else if ((strcmp(buff, "adaptive") == 0) && (argc < 2)) {
+			argv[argc++] = "adaptive";
+
+		} else {
+			goto invalid;
+		}
+	}
+
+	css = cf_section_alloc(parent, parent, "limit", buff);
+	if (!css) {
+		ERROR("%s[%d]: Failed allocating memory for section",
+		      frame->filename, frame->lineno);
+		return NULL;
+	}
+	cf_filename_set(css, frame->filename);
+	cf_lineno_set(css, frame->lineno);
+	css->name2_quote = token;
+
+	css->argc = argc;
+	if (argc) {
+		int i;
+
+		css->argv = talloc_array(css, char const *, argc + 1);
+		css->argv_quote = talloc_array(css, fr_token_t, argc);
+
+		for (i = 0; i < argc; i++) {
+			css->argv[i] = talloc_typed_strdup(css->argv, argv[i]);
+			css->argv_quote[i] = T_BARE_WORD;
+		}
+
+		css->argv[argc] = NULL;
+	}
+
+	stack->ptr = ptr;
+
+	css->allow_locals = true;
+	css->unlang = CF_UNLANG_ALLOW;
+	return cf_section_to_item(css);
+}
+
 static CONF_ITEM *process_subrequest(cf_stack_t *stack)
 {
 	char const *mod = NULL;
@@ -2209,6 +2315,7 @@ static fr_table_ptr_sorted_t unlang_keywords[] = {
 	{ L("elsif"),		(void *) process_if },
 	{ L("foreach"),		(void *) process_foreach },
 	{ L("if"),		(void *) process_if },
+	{ L("limit"),		(void *) process_limit },
 	{ L("map"),		(void *) process_map },
 	{ L("subrequest"),	(void *) process_subrequest }
 };
@@ -2316,6 +2423,12 @@ static int parse_input(cf_stack_t *stack)
 	 */
 	if ((name1_token == T_BARE_WORD) && isalpha((uint8_t) *buff[1])) {
 		process = (cf_process_func_t) fr_table_value_by_str(unlang_keywords, buff[1], NULL);
+
+		/*
+		 *	"limit" is also used for configuration sections, so it's only a keyword in unlang.
+		 */
+		if ((process == process_limit) && (parent->unlang != CF_UNLANG_ALLOW)) process = NULL;
+
 		if (process) {
 			CONF_ITEM *ci;
 
@@ -425,6 +425,9 @@ static conf_parser_t limit_config[] = {
 	{ FR_CONF_OFFSET("lifetime", fr_client_t, limit.lifetime), .dflt = "0" },
 
 	{ FR_CONF_OFFSET("idle_timeout", fr_client_t, limit.idle_timeout), .dflt = "30s" },
+
+	{ FR_CONF_OFFSET("max_packets_per_second", fr_client_t, max_packets_per_second), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_packets_burst", fr_client_t, max_packets_burst), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -142,6 +142,9 @@ struct fr_client_s {
 
 	int			proto;			//!< Protocol number.
 	fr_socket_limit_t	limit;			//!< Connections per client (TCP clients only).
+
+	uint32_t		max_packets_per_second;	//!< Rate limit for new packets.  0 for no limit.
+	uint32_t		max_packets_burst;	//!< How many packets can arrive above the rate.
 };
 
 fr_client_list_t	*client_list_init(CONF_SECTION *cs);
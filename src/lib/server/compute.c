@@ -0,0 +1,510 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/compute.c
+ * @brief Run CPU intensive work, like password hashing, on a dedicated pool of threads.
+ *
+ * Something like a PBKDF2 with a high iteration count can occupy a worker
+ * for tens of milliseconds, during which it can't process any other
+ * requests.  Instead, the worker copies the inputs into a job, submits it
+ * to a compute pool, and yields.  A compute thread runs the job, and hands
+ * it back to the worker which submitted it, which then resumes the request.
+ *
+ * Each worker has a #fr_compute_thread_t, which holds the jobs which have
+ * completed, and a pipe the compute threads use to wake the worker's event
+ * loop.  All talloc operations on jobs happen in the worker, the compute
+ * threads only call the job's function.
+ *
+ * The number of jobs waiting for a compute thread is bounded.  When the
+ * queue is full, or the pool has no threads, the caller runs the job
+ * itself, as it would have done without a pool.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "compute"
+
+#include <freeradius-devel/server/compute.h>
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/server/tmpl.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef enum {
+	COMPUTE_JOB_QUEUED = 0,			//!< Waiting for a compute thread.
+	COMPUTE_JOB_RUNNING,			//!< Being run by a compute thread.
+	COMPUTE_JOB_COMPLETE			//!< Waiting to be collected by the worker.
+} compute_job_state_t;
+
+struct fr_compute_job_s {
+	fr_dlist_t		entry;		//!< In the pool's queue, or the thread's completed list.
+	fr_compute_thread_t	*ct;		//!< Worker which submitted the job.
+
+	compute_job_state_t	state;		//!< Protected by the pool's mutex.
+	bool			delivered;	//!< The worker has collected the job.  Only used by the worker.
+
+	request_t		*request;	//!< To mark as runnable.  NULL if the job was cancelled.
+	fr_compute_func_t	func;		//!< Does the work.
+	void			*data;		//!< Passed to func.
+
+	fr_time_t		queued;		//!< When the job was submitted.
+};
+
+struct fr_compute_thread_s {
+	fr_compute_pool_t	*pool;		//!< Jobs are submitted to.
+	fr_event_list_t		*el;		//!< The worker's event list.
+	int			pipe[2];	//!< Written to when jobs complete.
+
+	fr_dlist_head_t		completed;	//!< Jobs waiting to be collected.  Protected by
+						///< the pool's mutex.
+	uint32_t		running;	//!< How many of our jobs are being run.  Protected by
+						///< the pool's mutex.
+};
+
+struct fr_compute_pool_s {
+	char const		*name;		//!< For logging and metrics.
+
+	pthread_mutex_t		mutex;		//!< Protects everything below, and the thread
+						///< completed lists.
+	pthread_cond_t		work;		//!< Signalled when jobs are queued.
+	pthread_cond_t		idle;		//!< Signalled when a worker has no jobs running.
+
+	pthread_t		*threads;	//!< Compute threads.
+	uint32_t		num_threads;	//!< How many were started.
+	uint32_t		max_queued;	//!< Queue limit.
+	bool			stopping;	//!< Threads should exit.
+
+	fr_dlist_head_t		queue;		//!< Jobs waiting for a compute thread.
+	uint32_t		num_queued;	//!< Length of the queue.
+	uint32_t		num_running;	//!< Jobs being run.
+
+	uint64_t		submitted;	//!< Jobs queued.
+	uint64_t		completed;	//!< Jobs run by a compute thread.
+	uint64_t		cancelled;	//!< Jobs whose request went away before they were collected.
+	uint64_t		overflowed;	//!< Jobs run inline, as the queue was full.
+	uint64_t		wait_time;	//!< Total nanoseconds jobs spent in the queue.
+	uint64_t		run_time;	//!< Total nanoseconds compute threads spent running jobs.
+
+	fr_metrics_source_t	*metrics;	//!< Our entry in the metrics registry.
+};
+
+conf_parser_t const fr_compute_config[] = {
+	{ FR_CONF_OFFSET("threads", fr_compute_conf_t, threads), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_queued", fr_compute_conf_t, max_queued), .dflt = "1024" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_metric_family_t const compute_metric_jobs = {
+	.name = "freeradius_compute_jobs", .type = FR_METRIC_COUNTER,
+	.help = "Jobs handled by a compute pool, by outcome."
+};
+static fr_metric_family_t const compute_metric_queued = {
+	.name = "freeradius_compute_jobs_queued", .type = FR_METRIC_GAUGE,
+	.help = "Jobs waiting for a compute thread."
+};
+static fr_metric_family_t const compute_metric_running = {
+	.name = "freeradius_compute_jobs_running", .type = FR_METRIC_GAUGE,
+	.help = "Jobs being run by a compute thread."
+};
+static fr_metric_family_t const compute_metric_wait = {
+	.name = "freeradius_compute_wait_seconds", .type = FR_METRIC_COUNTER,
+	.help = "Time jobs spent waiting for a compute thread."
+};
+static fr_metric_family_t const compute_metric_run = {
+	.name = "freeradius_compute_run_seconds", .type = FR_METRIC_COUNTER,
+	.help = "Time compute threads spent running jobs."
+};
+
+/** Add the pool's counters to a scrape
+ *
+ */
+static void compute_metrics(fr_metrics_t *m, void const *uctx)
+{
+	fr_compute_pool_t	*pool = UNCONST(fr_compute_pool_t *, uctx);
+	uint64_t		submitted, completed, cancelled, overflowed, wait_time, run_time;
+	uint32_t		num_queued, num_running;
+
+	pthread_mutex_lock(&pool->mutex);
+	submitted = pool->submitted;
+	completed = pool->completed;
+	cancelled = pool->cancelled;
+	overflowed = pool->overflowed;
+	wait_time = pool->wait_time;
+	run_time = pool->run_time;
+	num_queued = pool->num_queued;
+	num_running = pool->num_running;
+	pthread_mutex_unlock(&pool->mutex);
+
+	fr_metrics_add(m, &compute_metric_jobs, submitted, "pool", pool->name, "outcome", "submitted", NULL);
+	fr_metrics_add(m, &compute_metric_jobs, completed, "pool", pool->name, "outcome", "completed", NULL);
+	fr_metrics_add(m, &compute_metric_jobs, cancelled, "pool", pool->name, "outcome", "cancelled", NULL);
+	fr_metrics_add(m, &compute_metric_jobs, overflowed, "pool", pool->name, "outcome", "overflowed", NULL);
+	fr_metrics_add(m, &compute_metric_queued, num_queued, "pool", pool->name, NULL);
+	fr_metrics_add(m, &compute_metric_running, num_running, "pool", pool->name, NULL);
+	fr_metrics_add(m, &compute_metric_wait, wait_time / (double)NSEC, "pool", pool->name, NULL);
+	fr_metrics_add(m, &compute_metric_run, run_time / (double)NSEC, "pool", pool->name, NULL);
+}
+
+static void *compute_thread_main(void *arg)
+{
+	fr_compute_pool_t	*pool = arg;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		fr_compute_job_t	*job;
+		fr_compute_thread_t	*ct;
+		fr_time_t		start, end;
+		bool			wake;
+
+		while (!pool->stopping && (fr_dlist_num_elements(&pool->queue) == 0)) {
+			pthread_cond_wait(&pool->work, &pool->mutex);
+		}
+		if (pool->stopping) break;
+
+		job = fr_dlist_pop_head(&pool->queue);
+		pool->num_queued--;
+		pool->num_running++;
+		job->state = COMPUTE_JOB_RUNNING;
+		job->ct->running++;
+
+		start = fr_time();
+		pool->wait_time += fr_time_delta_unwrap(fr_time_sub(start, job->queued));
+		pthread_mutex_unlock(&pool->mutex);
+
+		job->func(job->data);
+
+		end = fr_time();
+		pthread_mutex_lock(&pool->mutex);
+		pool->run_time += fr_time_delta_unwrap(fr_time_sub(end, start));
+		pool->num_running--;
+		pool->completed++;
+
+		ct = job->ct;
+		job->state = COMPUTE_JOB_COMPLETE;
+		wake = (fr_dlist_num_elements(&ct->completed) == 0);
+		fr_dlist_insert_tail(&ct->completed, job);
+
+		/*
+		 *	Only wake the worker for the first job,
+		 *	it collects all of them at once.
+		 */
+		if (wake) {
+			while ((write(ct->pipe[1], ".", 1) < 0) && (errno == EINTR));
+		}
+
+		if (--ct->running == 0) pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static int _compute_pool_free(fr_compute_pool_t *pool)
+{
+	uint32_t i;
+
+	TALLOC_FREE(pool->metrics);
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+
+	/*
+	 *	All the worker threads should have
+	 *	been freed before the pool.
+	 */
+	fr_assert(fr_dlist_num_elements(&pool->queue) == 0);
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->mutex);
+
+	return 0;
+}
+
+/** Allocate a compute pool, and start its threads
+ *
+ * Should be called when a module is instantiated.
+ *
+ * @param[in] ctx	to allocate the pool in.  Freeing it stops the threads.
+ * @param[in] conf	for the pool.
+ * @param[in] name	of the pool, used in metrics.
+ * @return
+ *	- A new compute pool.
+ *	- NULL on error.
+ */
+fr_compute_pool_t *fr_compute_pool_alloc(TALLOC_CTX *ctx, fr_compute_conf_t const *conf, char const *name)
+{
+	fr_compute_pool_t	*pool;
+	uint32_t		i;
+
+	MEM(pool = talloc_zero(ctx, fr_compute_pool_t));
+	MEM(pool->name = talloc_typed_strdup(pool, name));
+	pool->max_queued = conf->max_queued;
+	fr_dlist_talloc_init(&pool->queue, fr_compute_job_t, entry);
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	talloc_set_destructor(pool, _compute_pool_free);
+
+	if (conf->threads) MEM(pool->threads = talloc_array(pool, pthread_t, conf->threads));
+	for (i = 0; i < conf->threads; i++) {
+		int ret;
+
+		ret = pthread_create(&pool->threads[i], NULL, compute_thread_main, pool);
+		if (ret != 0) {
+			fr_strerror_printf("Failed creating compute thread: %s", fr_syserror(ret));
+			talloc_free(pool);
+			return NULL;
+		}
+		pool->num_threads++;
+	}
+
+	MEM(pool->metrics = fr_metrics_source_alloc(pool, compute_metrics, pool));
+
+	DEBUG2("Started compute pool \"%s\" with %u threads", pool->name, pool->num_threads);
+
+	return pool;
+}
+
+/** Resume the requests whose jobs have completed
+ *
+ */
+static void _compute_thread_readable(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_compute_thread_t	*ct = talloc_get_type_abort(uctx, fr_compute_thread_t);
+	fr_dlist_head_t		done;
+	fr_compute_job_t	*job;
+	char			buffer[64];
+
+	while (read(fd, buffer, sizeof(buffer)) > 0);
+
+	fr_dlist_talloc_init(&done, fr_compute_job_t, entry);
+
+	pthread_mutex_lock(&ct->pool->mutex);
+	fr_dlist_move(&done, &ct->completed);
+	pthread_mutex_unlock(&ct->pool->mutex);
+
+	while ((job = fr_dlist_pop_head(&done))) {
+		if (!job->request) {
+			talloc_free(job);
+			continue;
+		}
+
+		job->delivered = true;
+		unlang_interpret_mark_runnable(job->request);
+	}
+}
+
+static int _compute_thread_free(fr_compute_thread_t *ct)
+{
+	fr_compute_pool_t	*pool = ct->pool;
+	fr_compute_job_t	*job, *next;
+	fr_dlist_head_t		done;
+
+	fr_dlist_talloc_init(&done, fr_compute_job_t, entry);
+
+	pthread_mutex_lock(&pool->mutex);
+	for (job = fr_dlist_head(&pool->queue); job; job = next) {
+		next = fr_dlist_next(&pool->queue, job);
+		if (job->ct != ct) continue;
+
+		fr_dlist_remove(&pool->queue, job);
+		pool->num_queued--;
+		fr_dlist_insert_tail(&done, job);
+	}
+
+	/*
+	 *	Jobs which are running can't be stopped,
+	 *	but they don't take long.
+	 */
+	while (ct->running) pthread_cond_wait(&pool->idle, &pool->mutex);
+
+	fr_dlist_move(&done, &ct->completed);
+	pthread_mutex_unlock(&pool->mutex);
+
+	fr_dlist_talloc_free(&done);
+
+	fr_event_fd_delete(ct->el, ct->pipe[0], FR_EVENT_FILTER_IO);
+	close(ct->pipe[0]);
+	close(ct->pipe[1]);
+
+	return 0;
+}
+
+/** Allocate the per-worker state for submitting jobs to a pool
+ *
+ * Should be called when a module's thread is instantiated.
+ *
+ * @param[in] ctx	to allocate the thread state in.  Must be freed before the pool.
+ * @param[in] pool	to submit jobs to.
+ * @param[in] el	of the worker.
+ * @return
+ *	- New thread state.
+ *	- NULL on error.
+ */
+fr_compute_thread_t *fr_compute_thread_alloc(TALLOC_CTX *ctx, fr_compute_pool_t *pool, fr_event_list_t *el)
+{
+	fr_compute_thread_t	*ct;
+
+	MEM(ct = talloc_zero(ctx, fr_compute_thread_t));
+	ct->pool = pool;
+	ct->el = el;
+	fr_dlist_talloc_init(&ct->completed, fr_compute_job_t, entry);
+
+	if (pipe(ct->pipe) < 0) {
+		fr_strerror_printf("Failed opening pipe for compute pool: %s", fr_syserror(errno));
+		talloc_free(ct);
+		return NULL;
+	}
+
+	(void) fcntl(ct->pipe[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+	(void) fcntl(ct->pipe[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+
+	if (fr_event_fd_insert(ct, NULL, el, ct->pipe[0], _compute_thread_readable, NULL, NULL, ct) < 0) {
+		fr_strerror_const_push("Failed adding compute pool pipe to event list");
+		close(ct->pipe[0]);
+		close(ct->pipe[1]);
+		talloc_free(ct);
+		return NULL;
+	}
+	talloc_set_destructor(ct, _compute_thread_free);
+
+	return ct;
+}
+
+/** Submit a job to a compute pool
+ *
+ * On success the caller should yield, with a signal handler which calls
+ * #fr_compute_job_free, and a resume function which retrieves the result
+ * with #fr_compute_job_data, then frees the job.
+ *
+ * @param[out] job_out	The queued job.
+ * @param[in] ct	worker's state for the pool.
+ * @param[in] request	to mark as runnable when the job completes.
+ * @param[in] func	to run.
+ * @param[in] data	for func.  Must be a talloc chunk, which isn't shared with
+ *			anything else.  If queued it is stolen by the job.
+ * @return
+ *	- 0 if the job was queued.
+ *	- -1 if the job couldn't be queued, and the caller should call func itself.
+ */
+int fr_compute_submit(fr_compute_job_t **job_out, fr_compute_thread_t *ct, request_t *request,
+		      fr_compute_func_t func, void *data)
+{
+	fr_compute_pool_t	*pool = ct->pool;
+	fr_compute_job_t	*job;
+
+	if (!pool->num_threads) return -1;
+
+	/*
+	 *	Allocated outside of the lock.
+	 */
+	MEM(job = talloc_zero(NULL, fr_compute_job_t));
+	job->ct = ct;
+	job->request = request;
+	job->func = func;
+	job->queued = fr_time();
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->num_queued >= pool->max_queued) {
+		pool->overflowed++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		RDEBUG2("Compute pool \"%s\" queue is full, running job inline", pool->name);
+		talloc_free(job);
+		return -1;
+	}
+
+	job->data = talloc_steal(job, data);
+	job->state = COMPUTE_JOB_QUEUED;
+	fr_dlist_insert_tail(&pool->queue, job);
+	pool->num_queued++;
+	pool->submitted++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	*job_out = job;
+
+	return 0;
+}
+
+/** Return the data of a completed job
+ *
+ * @param[in] job	as returned by #fr_compute_submit.
+ * @return The data passed to #fr_compute_submit.
+ */
+void *fr_compute_job_data(fr_compute_job_t *job)
+{
+	fr_assert(job->delivered);
+
+	return job->data;
+}
+
+/** Free a job, cancelling it if it hasn't completed
+ *
+ * Jobs which are already being run are freed once the compute thread is
+ * done with them, and their results are discarded.
+ *
+ * @param[in] job	to free.  May be NULL.
+ */
+void fr_compute_job_free(fr_compute_job_t *job)
+{
+	fr_compute_pool_t	*pool;
+
+	if (!job) return;
+
+	if (job->delivered) {
+		talloc_free(job);
+		return;
+	}
+
+	pool = job->ct->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->cancelled++;
+
+	if (job->state == COMPUTE_JOB_QUEUED) {
+		fr_dlist_remove(&pool->queue, job);
+		pool->num_queued--;
+		pthread_mutex_unlock(&pool->mutex);
+
+		talloc_free(job);
+		return;
+	}
+
+	/*
+	 *	Running, or waiting to be collected,
+	 *	freed when the worker collects it.
+	 */
+	job->request = NULL;
+	pthread_mutex_unlock(&pool->mutex);
+}
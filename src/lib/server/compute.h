@@ -0,0 +1,81 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/compute.h
+ * @brief Run CPU intensive work, like password hashing, on a dedicated pool of threads.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(compute_h, "$Id$")
+
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/util/event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_compute_pool_s fr_compute_pool_t;
+
+typedef struct fr_compute_thread_s fr_compute_thread_t;
+
+typedef struct fr_compute_job_s fr_compute_job_t;
+
+/** Configuration for a compute pool
+ *
+ */
+typedef struct {
+	uint32_t		threads;	//!< Number of compute threads.  0 runs all jobs inline.
+	uint32_t		max_queued;	//!< Maximum number of jobs waiting for a compute thread.
+						///< Further jobs are run inline by the worker.
+} fr_compute_conf_t;
+
+extern conf_parser_t const fr_compute_config[];
+
+/** Do the work for a job
+ *
+ * Called from a compute thread, or from the worker if the job couldn't be queued.
+ *
+ * Must only use the data passed to it.  In particular it must not log
+ * against, or allocate from, any request, or anything else owned by
+ * a worker.
+ *
+ * @param[in] data	passed to #fr_compute_submit.
+ */
+typedef void (*fr_compute_func_t)(void *data);
+
+fr_compute_pool_t	*fr_compute_pool_alloc(TALLOC_CTX *ctx, fr_compute_conf_t const *conf, char const *name)
+			CC_HINT(nonnull(2,3));
+
+fr_compute_thread_t	*fr_compute_thread_alloc(TALLOC_CTX *ctx, fr_compute_pool_t *pool, fr_event_list_t *el)
+			CC_HINT(nonnull);
+
+int			fr_compute_submit(fr_compute_job_t **job_out, fr_compute_thread_t *ct, request_t *request,
+					  fr_compute_func_t func, void *data)
+			CC_HINT(nonnull);
+
+void			*fr_compute_job_data(fr_compute_job_t *job) CC_HINT(nonnull);
+
+void			fr_compute_job_free(fr_compute_job_t *job);
+
+#ifdef __cplusplus
+}
+#endif
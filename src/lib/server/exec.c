@@ -34,8 +34,18 @@ RCSID("$Id$")
 #include <freeradius-devel/server/util.h>
 #include <freeradius-devel/util/debug.h>
 
+#include <sys/socket.h>
+
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+#  include <spawn.h>
+#endif
+
 #define MAX_ENVP 1024
 
+#define EXEC_HELPER_MAX_MSG	65536	//!< Largest argv + envp we'll pass to the exec helper.
+
+static int exec_helper_fd = -1;		//!< Our end of the socket connected to the exec helper.
+
 static _Thread_local char *env_exec_arr[MAX_ENVP];	/* Avoid allocing 8k on the stack */
 
 /** Flatten a list into individual "char *" argv-style array
@@ -391,6 +401,91 @@ static NEVER_RETURNS void exec_child(char **argv, char **envp,
 	exit(2);
 }
 
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+/** Start a child process with posix_spawn()
+ *
+ * Does the same as fork() and exec_child(), but the file descriptor
+ * manipulation is done by libc as part of the spawn.  On Linux this
+ * uses clone(CLONE_VM | CLONE_VFORK), so the page tables of the server
+ * don't need to be copied, which makes starting a process much cheaper
+ * when the server is large.
+ *
+ * Unlike exec_child(), a failure to execute the program is reported to
+ * the caller, instead of via the exit code of the child.
+ *
+ * @param[out] pid_p		The PID of the child.
+ * @param[in] argv		array of arguments to pass to child.
+ * @param[in] envp		array of environment variables in form `<attr>=<val>`
+ * @param[in] exec_wait		as with exec_child().
+ * @param[in] debug		as with exec_child().
+ * @param[in] stdin_pipe	as with exec_child().
+ * @param[in] stdout_pipe	as with exec_child().
+ * @param[in] stderr_pipe	as with exec_child().
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  Error retrievable fr_strerror().
+ */
+static int exec_spawn(pid_t *pid_p, char **argv, char **envp,
+		      bool exec_wait, bool debug,
+		      int stdin_pipe[static 2], int stdout_pipe[static 2], int stderr_pipe[static 2])
+{
+	posix_spawn_file_actions_t	actions;
+	int				ret;
+
+	ret = posix_spawn_file_actions_init(&actions);
+	if (ret != 0) {
+		fr_strerror_printf("Failed initialising spawn actions: %s", fr_syserror(ret));
+		return -1;
+	}
+
+	/*
+	 *	Only massage the pipe handles if the parent
+	 *	has created them.  Everything else points to
+	 *	/dev/null.
+	 *
+	 *	There's no need to close the other ends of
+	 *	the pipes, closefrom() below deals with them.
+	 */
+#define SPAWN_DUP2_OR_NULL(_fd, _to) \
+	(((_fd) >= 0) ? posix_spawn_file_actions_adddup2(&actions, _fd, _to) : \
+			posix_spawn_file_actions_addopen(&actions, _to, "/dev/null", O_RDWR, 0))
+
+	if (exec_wait) {
+		ret = SPAWN_DUP2_OR_NULL(stdin_pipe[1] >= 0 ? stdin_pipe[0] : -1, STDIN_FILENO);
+		if (ret == 0) ret = SPAWN_DUP2_OR_NULL(stdout_pipe[1] >= 0 ? stdout_pipe[1] : -1, STDOUT_FILENO);
+		if (ret == 0) ret = SPAWN_DUP2_OR_NULL(stderr_pipe[1] >= 0 ? stderr_pipe[1] : -1, STDERR_FILENO);
+	} else {
+		ret = SPAWN_DUP2_OR_NULL(-1, STDIN_FILENO);
+		if (ret == 0) ret = SPAWN_DUP2_OR_NULL(-1, STDOUT_FILENO);
+
+		/*
+		 *	As with exec_child(), if we're debugging, the
+		 *	error messages go to the STDERR of the server.
+		 */
+		if ((ret == 0) && !debug) ret = SPAWN_DUP2_OR_NULL(-1, STDERR_FILENO);
+	}
+#undef SPAWN_DUP2_OR_NULL
+
+	if (ret == 0) ret = posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+	if (ret != 0) {
+		fr_strerror_printf("Failed setting up spawn actions: %s", fr_syserror(ret));
+	error:
+		posix_spawn_file_actions_destroy(&actions);
+		return -1;
+	}
+
+	ret = posix_spawn(pid_p, argv[0], &actions, NULL, argv, envp);
+	if (ret != 0) {
+		fr_strerror_printf("Failed to execute \"%s\": %s", argv[0], fr_syserror(ret));
+		goto error;
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+
+	return 0;
+}
+#endif
+
 /** Merge extra environmental variables and potentially the inherited environment
  *
  * @param[in] env_in		to merge.
@@ -440,6 +535,229 @@ char **exec_build_env(char **env_in, bool env_inherit)
 	return env_exec_arr;
 }
 
+/** Serialise argv and envp into a message for the exec helper
+ *
+ * The message is the number of arguments, the number of environmental
+ * variables, and then all of the strings, each with its trailing '\0'.
+ *
+ * @param[out] out	Where to write the message.
+ * @param[in] outlen	Length of out.
+ * @param[in] argv	to serialise.
+ * @param[in] envp	to serialise, may be NULL.
+ * @return
+ *	- The length of the message.
+ *	- -1 if the message doesn't fit in out.
+ */
+static ssize_t exec_helper_encode(uint8_t *out, size_t outlen, char **argv, char **envp)
+{
+	uint8_t		*p = out + (sizeof(uint32_t) * 2), *end = out + outlen;
+	uint32_t	count[2] = { 0, 0 };
+	char		**list[2] = { argv, envp };
+	size_t		i;
+
+	for (i = 0; i < NUM_ELEMENTS(list); i++) {
+		char **q;
+
+		if (!list[i]) continue;
+
+		for (q = list[i]; *q; q++) {
+			size_t len = strlen(*q) + 1;
+
+			if ((size_t)(end - p) < len) return -1;
+			if (++count[i] >= MAX_ENVP) return -1;
+
+			memcpy(p, *q, len);
+			p += len;
+		}
+	}
+
+	memcpy(out, count, sizeof(count));
+
+	return p - out;
+}
+
+/** Unpack a message from the server into argv and envp arrays
+ *
+ * @param[out] argv	Where to write pointers to the arguments.
+ * @param[out] envp	Where to write pointers to the environmental variables.
+ * @param[in] msg	to unpack.  Must be followed by at least one byte
+ *			which we can write a '\0' to.
+ * @param[in] len	of the message.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the message is malformed.
+ */
+static int exec_helper_decode(char **argv, char **envp, uint8_t *msg, size_t len)
+{
+	uint8_t		*p = msg + (sizeof(uint32_t) * 2), *end = msg + len;
+	uint32_t	count[2];
+	char		**list[2] = { argv, envp };
+	size_t		i, j;
+
+	if (len < sizeof(count)) return -1;
+	memcpy(count, msg, sizeof(count));
+	if ((count[0] == 0) || (count[0] >= MAX_ENVP) || (count[1] >= MAX_ENVP)) return -1;
+
+	*end = '\0';	/* Ensure the last string is terminated */
+
+	for (i = 0; i < NUM_ELEMENTS(list); i++) {
+		for (j = 0; j < count[i]; j++) {
+			if (p >= end) return -1;
+
+			list[i][j] = (char *)p;
+			p += strlen((char *)p) + 1;
+		}
+		list[i][j] = NULL;
+	}
+
+	return 0;
+}
+
+/** Ask the exec helper to run a program
+ *
+ * @param[in] argv	arg[0] is the path to the program, arg[...] are arguments
+ *			to pass to the program.
+ * @param[in] envp	environmental variables to pass to the program.
+ * @return
+ *	- 0 if the helper accepted the request.
+ *	- -1 if there's no helper, or it couldn't take the request.
+ *	  The caller should start the program itself.
+ */
+static int exec_helper_send(char **argv, char **envp)
+{
+	static _Thread_local uint8_t	*buff;
+	ssize_t				len;
+
+	if (exec_helper_fd < 0) return -1;
+
+	if (!buff) {
+		uint8_t *new;
+
+		new = talloc_array(NULL, uint8_t, EXEC_HELPER_MAX_MSG);
+		if (!new) return -1;
+		fr_atexit_thread_local(buff, fr_atexit_talloc_free, new);
+	}
+
+	len = exec_helper_encode(buff, EXEC_HELPER_MAX_MSG, argv, envp);
+	if (len < 0) return -1;
+
+	/*
+	 *	Datagrams are delivered whole, so the worker
+	 *	threads can share the socket without locking.
+	 */
+	if (send(exec_helper_fd, buff, len, MSG_DONTWAIT) != len) return -1;
+
+	return 0;
+}
+
+/** Main loop of the exec helper process
+ *
+ * Reads requests from the server, and starts the programs.  Exits when
+ * the server closes its end of the socket.
+ *
+ * @param[in] fd	to read requests from.
+ */
+static NEVER_RETURNS void exec_helper_main(int fd)
+{
+	static uint8_t	buff[EXEC_HELPER_MAX_MSG + 1];
+	static char	*argv[MAX_ENVP], *envp[MAX_ENVP];
+
+	/*
+	 *	We never care about the exit status of the
+	 *	children, so let the kernel reap them.
+	 */
+	signal(SIGCHLD, SIG_IGN);
+
+	for (;;) {
+		ssize_t	len;
+		pid_t	pid;
+
+		len = recv(fd, buff, EXEC_HELPER_MAX_MSG, 0);
+		if (len == 0) _exit(0);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			_exit(1);
+		}
+
+		if (exec_helper_decode(argv, envp, buff, len) < 0) continue;
+
+		pid = fork();
+		if (pid == 0) {
+			int unused[2] = { -1, -1 };
+
+			/*
+			 *	Ignoring SIGCHLD is inherited across
+			 *	exec, and would break any program
+			 *	which waits for its own children.
+			 */
+			signal(SIGCHLD, SIG_DFL);
+
+			exec_child(argv, envp, false, false, unused, unused, unused);
+		}
+	}
+}
+
+/** Start a helper process which runs programs for fr_exec_fork_nowait()
+ *
+ * Forking a large, multi-threaded server is expensive, as all of its page
+ * tables must be copied.  This should be called early during startup,
+ * while the server is still small.  Programs which are run without the
+ * server waiting for them are then forked from the helper.
+ *
+ * The helper permanently drops any privileges the server holds, and
+ * exits when the server does.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  Error retrievable fr_strerror().
+ */
+int fr_exec_helper_start(void)
+{
+	int	sockets[2];
+	pid_t	pid;
+
+	if (exec_helper_fd >= 0) return 0;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0) {
+		fr_strerror_printf("Failed creating exec helper socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		fr_strerror_printf("Failed forking exec helper: %s", fr_syserror(errno));
+		close(sockets[0]);
+		close(sockets[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		int fd = STDERR_FILENO + 1;
+
+		/*
+		 *	Don't keep copies of any other descriptors
+		 *	the server has open.
+		 */
+		if (sockets[1] != fd) {
+			dup2(sockets[1], fd);
+			close(sockets[1]);
+		}
+		fr_closefrom(fd + 1);
+
+		fr_atexit_thread_local_disarm_all();
+		fr_atexit_global_disarm_all();
+
+		rad_suid_down_permanent();
+
+		exec_helper_main(fd);
+	}
+
+	close(sockets[1]);
+	exec_helper_fd = sockets[0];
+
+	return 0;
+}
+
 /** Execute a program without waiting for the program to finish.
  *
  * @param[in] el		event list to insert reaper child into.
@@ -464,6 +782,26 @@ int fr_exec_fork_nowait(fr_event_list_t *el, char **argv_in, char **env_in, bool
 	pid_t		pid;
 
 	env = exec_build_env(env_in, env_inherit);
+
+	/*
+	 *	The helper can't give the child our STDERR, so
+	 *	when debugging we always start the child ourselves.
+	 *
+	 *	If the helper is busy or has gone away, we also
+	 *	fall back to starting the child ourselves.
+	 */
+	if (!debug && (exec_helper_send(argv_in, env) == 0)) return 0;
+
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+	{
+		int unused[2] = { -1, -1 };
+
+		if (exec_spawn(&pid, argv_in, env, false, debug, unused, unused, unused) < 0) {
+		error:
+			return -1;
+		}
+	}
+#else
 	pid = fork();
 	/*
 	 *	The child never returns from calling exec_child();
@@ -479,6 +817,7 @@ int fr_exec_fork_nowait(fr_event_list_t *el, char **argv_in, char **env_in, bool
 	error:
 		return -1;
 	}
+#endif
 
 	/*
 	 *	Ensure that we can clean up any child processes.  We
@@ -570,6 +909,14 @@ int fr_exec_fork_wait(pid_t *pid_p,
 	}
 
 	env = exec_build_env(env_in, env_inherit);
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+	if (exec_spawn(&pid, argv_in, env, true, debug, stdin_pipe, stdout_pipe, stderr_pipe) < 0) {
+		close(stderr_pipe[0]);
+		close(stderr_pipe[1]);
+		*pid_p = -1;	/* Ensure the PID is set even if the caller didn't check the return code */
+		goto error3;
+	}
+#else
 	pid = fork();
 
 	/*
@@ -581,6 +928,7 @@ int fr_exec_fork_wait(pid_t *pid_p,
 		*pid_p = -1;	/* Ensure the PID is set even if the caller didn't check the return code */
 		goto error3;
 	}
+#endif
 
 	/*
 	 *	Tell the caller the childs PID, and the FD to read from.
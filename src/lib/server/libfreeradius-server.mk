@@ -8,6 +8,7 @@ SOURCES	:= \
 	cf_util.c \
 	client.c \
 	command.c \
+	compute.c \
 	connection.c \
 	dependency.c \
 	dl_module.c \
@@ -16,11 +17,14 @@ SOURCES	:= \
 	exfile.c \
 	global_lib.c \
 	log.c \
+	log_async.c \
 	main_config.c \
 	main_loop.c \
 	map.c \
 	map_async.c \
 	map_proc.c \
+	memory.c \
+	metrics.c \
 	module.c \
 	module_method.c \
 	module_rlm.c \
@@ -30,6 +34,7 @@ SOURCES	:= \
 	password.c \
 	pool.c \
 	rcode.c \
+	reload.c \
 	regex.c \
 	request.c \
 	request_data.c \
@@ -61,6 +66,9 @@ endif
 # way of building clients.  Once that's fixed we can remove the dependency.
 TGT_PREREQS	+= libfreeradius-util$(L) libfreeradius-radius$(L)
 
+# Session-state can be stored using the internal encoder.
+TGT_PREREQS	+= libfreeradius-internal$(L)
+
 ifneq ($(MAKECMDGOALS),scan)
 SRC_CFLAGS	+= -DBUILT_WITH_CPPFLAGS=\"$(CPPFLAGS)\" -DBUILT_WITH_CFLAGS=\"$(CFLAGS)\" -DBUILT_WITH_LDFLAGS=\"$(LDFLAGS)\" -DBUILT_WITH_LIBS=\"$(LIBS)\"
 endif
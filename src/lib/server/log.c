@@ -298,6 +298,7 @@ void vlog_request(fr_log_type_t type, fr_log_lvl_t lvl, request_t *request,
 {
 	char const	*filename;
 	FILE		*fp = NULL;
+	int		fd = -1;
 
 	char		*p;
 	char const	*extra = "";
@@ -341,13 +342,17 @@ void vlog_request(fr_log_type_t type, fr_log_lvl_t lvl, request_t *request,
 		/*
 		 *	If we're debugging to a file, then use that.
 		 *
-		 *	@todo: have fr_vlog() take a fr_log_t*, so
-		 *	that we can cache the opened descriptor, and
-		 *	we don't need to re-open it on every log
-		 *	message.
+		 *	Destinations from a "log" section already have
+		 *	the file open, so write to that.  Re-opening the
+		 *	file for every message is slow.
 		 */
 		switch (log_dst->dst) {
 		case L_DST_FILES:
+			if (log_dst->handle) {
+				fd = log_dst->fd;
+				break;
+			}
+
 			fp = fopen(log_dst->file, "a");
 			if (!fp) goto finish;
 			break;
@@ -478,8 +483,9 @@ print_fmt:
 	/*
 	 *	Logging to a file descriptor
 	 */
-	if (fp) {
+	if (fp || (fd >= 0)) {
 		char time_buff[64];	/* The current timestamp */
+		char *msg;
 
 		time_t timeval;
 		timeval = time(NULL);
@@ -505,23 +511,35 @@ print_fmt:
 		p = strrchr(time_buff, '\n');
 		if (p) p[0] = '\0';
 
-		fprintf(fp,
-			"%s"		/* location */
-			"%s"		/* prefix */
-			"%s : "		/* time */
-			"%s"		/* facility */
-			"%.*s"		/* indent */
-			"%s"		/* module */
-			"%s"		/* message */
-			"\n",
-			fmt_location,
-			fmt_prefix,
-			time_buff,
-			fr_table_str_by_value(fr_log_levels, type, ""),
-			unlang_indent, spaces,
-			fmt_module,
-			fmt_exp);
-		fclose(fp);
+		msg = talloc_typed_asprintf(pool,
+					    "%s"		/* location */
+					    "%s"		/* prefix */
+					    "%s : "		/* time */
+					    "%s"		/* facility */
+					    "%.*s"		/* indent */
+					    "%s"		/* module */
+					    "%s"		/* message */
+					    "\n",
+					    fmt_location,
+					    fmt_prefix,
+					    time_buff,
+					    fr_table_str_by_value(fr_log_levels, type, ""),
+					    unlang_indent, spaces,
+					    fmt_module,
+					    fmt_exp);
+
+		/*
+		 *	One write() per line, so lines from different
+		 *	threads don't get mixed together.
+		 */
+		if (fp) {
+			fputs(msg, fp);
+			fclose(fp);
+		} else {
+			size_t len = talloc_array_length(msg) - 1;
+
+			if ((size_t) write(fd, msg, len) < len) goto finish;	/* there's nowhere to report errors */
+		}
 		goto finish;
 	}
 
@@ -0,0 +1,232 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/log_async.c
+ * @brief Write log messages from a dedicated thread.
+ *
+ * Workers which want to log something large, e.g. the breakdown of a
+ * slow request, hand it to a writer thread instead of blocking on the
+ * log destination themselves.
+ *
+ * Messages are copied onto a bounded queue.  When the queue is full,
+ * messages are dropped and counted, so that a slow log destination
+ * never slows down request processing.  The writer thread is started
+ * by #fr_log_async_start, from the main thread, and is stopped, after
+ * writing out anything still queued, when the server exits.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/log_async.h>
+#include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/syserror.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#include <pthread.h>
+
+#define LOG_ASYNC_MAX_PENDING	(1024)		//!< Messages queued before we start dropping them.
+
+typedef struct log_async_msg_s log_async_msg_t;
+
+struct log_async_msg_s {
+	log_async_msg_t		*next;		//!< Next message in the queue.
+	fr_log_t const		*log;		//!< Where the message is written.
+	fr_log_type_t		type;		//!< Of the message.
+	size_t			len;		//!< Of the text.
+	char			text[];		//!< One or more lines.
+};
+
+static pthread_mutex_t		log_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		log_async_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t		log_async_thread;
+static bool			log_async_running;
+static bool			log_async_stopping;
+
+static log_async_msg_t		*log_async_head;
+static log_async_msg_t		**log_async_tail = &log_async_head;
+static unsigned int		log_async_pending;
+
+static atomic_uint_fast64_t	log_async_dropped = ATOMIC_VAR_INIT(0);
+
+/** Write one message, a line at a time
+ *
+ */
+static void log_async_write(log_async_msg_t const *msg)
+{
+	char const *p = msg->text, *end = msg->text + msg->len;
+
+	while (p < end) {
+		char const *q;
+
+		q = memchr(p, '\n', end - p);
+		if (!q) q = end;
+
+		fr_log(msg->log, msg->type, __FILE__, __LINE__, "%.*s", (int) (q - p), p);
+		p = q + 1;
+	}
+}
+
+static void *log_async_main(UNUSED void *arg)
+{
+	pthread_mutex_lock(&log_async_mutex);
+	for (;;) {
+		log_async_msg_t *msg;
+
+		while (!log_async_head && !log_async_stopping) pthread_cond_wait(&log_async_cond, &log_async_mutex);
+
+		msg = log_async_head;
+		if (!msg) break;	/* stopping, and nothing left to write */
+
+		log_async_head = NULL;
+		log_async_tail = &log_async_head;
+		log_async_pending = 0;
+
+		/*
+		 *	Write without the lock held, so that the workers
+		 *	can keep queueing messages.
+		 */
+		pthread_mutex_unlock(&log_async_mutex);
+		while (msg) {
+			log_async_msg_t *next = msg->next;
+
+			log_async_write(msg);
+			free(msg);
+			msg = next;
+		}
+		pthread_mutex_lock(&log_async_mutex);
+	}
+	pthread_mutex_unlock(&log_async_mutex);
+
+	return NULL;
+}
+
+static int _log_async_stop(UNUSED void *uctx)
+{
+	pthread_mutex_lock(&log_async_mutex);
+	if (!log_async_running) {
+		pthread_mutex_unlock(&log_async_mutex);
+		return 0;
+	}
+	log_async_stopping = true;
+	pthread_cond_signal(&log_async_cond);
+	pthread_mutex_unlock(&log_async_mutex);
+
+	pthread_join(log_async_thread, NULL);
+
+	log_async_running = false;
+	log_async_stopping = false;
+
+	return 0;
+}
+
+/** Start the log thread
+ *
+ * Must be called from the main thread, before any workers are started.
+ *
+ * @return
+ *	- 0 on success, or if the thread is already running.
+ *	- -1 on failure.
+ */
+int fr_log_async_start(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&log_async_mutex);
+	if (log_async_running) {
+		pthread_mutex_unlock(&log_async_mutex);
+		return 0;
+	}
+
+	ret = pthread_create(&log_async_thread, NULL, log_async_main, NULL);
+	if (ret != 0) {
+		pthread_mutex_unlock(&log_async_mutex);
+		fr_strerror_printf("Failed creating log thread: %s", fr_syserror(ret));
+		return -1;
+	}
+	log_async_running = true;
+	pthread_mutex_unlock(&log_async_mutex);
+
+	fr_atexit_global(_log_async_stop, NULL);
+
+	return 0;
+}
+
+/** Queue a message to be written by the log thread
+ *
+ * @param[in] log	destination.  It must remain valid until the server exits.
+ * @param[in] type	of the message.
+ * @param[in] msg	text to write.  It can contain multiple lines,
+ *			which are written as separate log messages.
+ * @param[in] len	of the text.
+ * @return
+ *	- 0 if the message was queued.
+ *	- -1 if the message was dropped, because the queue was full,
+ *	  or the log thread isn't running.
+ */
+int fr_log_async(fr_log_t const *log, fr_log_type_t type, char const *msg, size_t len)
+{
+	log_async_msg_t *m;
+
+	/*
+	 *	Don't use talloc, the message is freed by a
+	 *	different thread.
+	 */
+	m = malloc(sizeof(*m) + len);
+	if (!m) {
+	drop:
+		atomic_fetch_add_explicit(&log_async_dropped, 1, memory_order_relaxed);
+		return -1;
+	}
+
+	m->next = NULL;
+	m->log = log;
+	m->type = type;
+	m->len = len;
+	memcpy(m->text, msg, len);
+
+	pthread_mutex_lock(&log_async_mutex);
+	if (unlikely(!log_async_running || log_async_stopping) || (log_async_pending >= LOG_ASYNC_MAX_PENDING)) {
+		pthread_mutex_unlock(&log_async_mutex);
+		free(m);
+		goto drop;
+	}
+
+	*log_async_tail = m;
+	log_async_tail = &m->next;
+	log_async_pending++;
+
+	pthread_cond_signal(&log_async_cond);
+	pthread_mutex_unlock(&log_async_mutex);
+
+	return 0;
+}
+
+/** Return how many messages have been dropped, because the queue was full
+ *
+ */
+uint64_t fr_log_async_dropped(void)
+{
+	return atomic_load_explicit(&log_async_dropped, memory_order_relaxed);
+}
@@ -0,0 +1,42 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/log_async.h
+ * @brief Write log messages from a dedicated thread.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(log_async_h, "$Id$")
+
+#include <freeradius-devel/util/log.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int		fr_log_async_start(void);
+
+int		fr_log_async(fr_log_t const *log, fr_log_type_t type, char const *msg, size_t len) CC_HINT(nonnull);
+
+uint64_t	fr_log_async_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
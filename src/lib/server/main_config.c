@@ -173,9 +173,33 @@ static const conf_parser_t thread_config[] = {
 	  .func = num_networks_parse },
 	{ FR_CONF_OFFSET("num_workers", main_config_t, max_workers), .dflt = STRINGIFY(0),
 	  .func = num_workers_parse, .dflt_func = num_workers_dflt },
+	{ FR_CONF_OFFSET("min_workers", main_config_t, min_workers), .dflt = "0" },
+
+	{ FR_CONF_OFFSET("scale_interval", main_config_t, scale_interval), .dflt = "1" },
+	{ FR_CONF_OFFSET("scale_up_delay", main_config_t, scale_up_delay), .dflt = "0.01" },
+	{ FR_CONF_OFFSET("scale_up_runnable", main_config_t, scale_up_runnable), .dflt = "8" },
+	{ FR_CONF_OFFSET("scale_down_idle", main_config_t, scale_down_idle), .dflt = "60" },
 
 	{ FR_CONF_OFFSET_TYPE_FLAGS("stats_interval", FR_TYPE_TIME_DELTA, CONF_FLAG_HIDDEN, main_config_t, stats_interval) },
 
+	{ FR_CONF_OFFSET("work_stealing", main_config_t, work_stealing), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("request_pool_init", main_config_t, request_pool_init), .dflt = "0" },
+	{ FR_CONF_OFFSET("request_pool_max", main_config_t, request_pool_max), .dflt = "256" },
+
+	{ FR_CONF_OFFSET("slow_request_threshold", main_config_t, slow_request_threshold), .dflt = "0" },
+	{ FR_CONF_OFFSET("slow_request_sample", main_config_t, slow_request_sample), .dflt = "1" },
+
+	{ FR_CONF_OFFSET("queue_delay_target", main_config_t, queue_delay_target), .dflt = "0" },
+	{ FR_CONF_OFFSET("queue_delay_interval", main_config_t, queue_delay_interval), .dflt = "0.1" },
+
+	{ FR_CONF_OFFSET("network_cpus", main_config_t, network_cpus) },
+	{ FR_CONF_OFFSET("worker_cpus", main_config_t, worker_cpus) },
+	{ FR_CONF_OFFSET("numa_local", main_config_t, numa_local), .dflt = "no" },
+	{ FR_CONF_OFFSET("huge_pages", main_config_t, huge_pages), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("instantiate_threads", main_config_t, instantiate_threads), .dflt = "4" },
+
 #ifdef WITH_TLS
 	{ FR_CONF_OFFSET_TYPE_FLAGS("openssl_async_pool_init", FR_TYPE_SIZE, 0, main_config_t, openssl_async_pool_init), .dflt = "64" },
 	{ FR_CONF_OFFSET_TYPE_FLAGS("openssl_async_pool_max", FR_TYPE_SIZE, 0, main_config_t, openssl_async_pool_max), .dflt = "1024" },
@@ -227,9 +251,12 @@ static const conf_parser_t server_config[] = {
 	{ FR_CONF_OFFSET("hostname_lookups", main_config_t, hostname_lookups), .dflt = "yes", .func = hostname_lookups_parse },
 	{ FR_CONF_OFFSET("max_request_time", main_config_t, max_request_time), .dflt = STRINGIFY(MAX_REQUEST_TIME), .func = max_request_time_parse },
 	{ FR_CONF_OFFSET("pidfile", main_config_t, pid_file), .dflt = "${run_dir}/radiusd.pid"},
+	{ FR_CONF_OFFSET("hot_restart", main_config_t, hot_restart) },
 
 	{ FR_CONF_OFFSET_FLAGS("debug_level", CONF_FLAG_HIDDEN, main_config_t, debug_level), .dflt = "0" },
 	{ FR_CONF_OFFSET("max_requests", main_config_t, max_requests), .dflt = "0" },
+	{ FR_CONF_OFFSET("memoise_xlat", main_config_t, xlat_memoise), .dflt = "no" },
+	{ FR_CONF_OFFSET("exec_helper", main_config_t, exec_helper), .dflt = "no" },
 
 	{ FR_CONF_POINTER("log", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) log_config },
 
@@ -1505,6 +1532,15 @@ void main_config_hup(main_config_t *config)
 	}
 	last_hup = when;
 
+	/*
+	 *	Tell the admin which virtual servers would need to
+	 *	be recompiled.  Unchanged ones can be skipped.
+	 */
+	if (virtual_servers_changed() == 0) {
+		INFO("HUP - No virtual servers have changed");
+		return;
+	}
+
 	INFO("HUP - NYI in version 4");	/* Not yet implemented in v4 */
 }
 
@@ -58,6 +58,9 @@ struct main_config_s {
 	bool		spawn_workers;			//!< Should the server spawn threads.
 	char const      *pid_file;			//!< Path to write out PID file.
 
+	char const	*hot_restart;			//!< Unix socket used to hand listening sockets
+							///< to a new server on restart.
+
 	fr_time_delta_t	max_request_time;		//!< How long a request can be processed for before
 							//!< timing out.
 
@@ -149,7 +152,32 @@ struct main_config_s {
 
 	uint32_t	max_networks;			//!< for the scheduler
 	uint32_t	max_workers;			//!< for the scheduler
+	uint32_t	min_workers;			//!< for the scheduler
+	fr_time_delta_t	scale_interval;			//!< for the scheduler
+	fr_time_delta_t	scale_up_delay;			//!< for the scheduler
+	uint32_t	scale_up_runnable;		//!< for the scheduler
+	fr_time_delta_t	scale_down_idle;		//!< for the scheduler
 	fr_time_delta_t	stats_interval;			//!< for the scheduler
+	bool		work_stealing;			//!< for the scheduler
+	uint32_t	request_pool_init;		//!< for the scheduler
+	uint32_t	request_pool_max;		//!< for the scheduler
+	fr_time_delta_t	slow_request_threshold;		//!< for the scheduler
+	uint32_t	slow_request_sample;		//!< for the scheduler
+	fr_time_delta_t	queue_delay_target;		//!< for the scheduler
+	fr_time_delta_t	queue_delay_interval;		//!< for the scheduler
+	char const	*network_cpus;			//!< for the scheduler
+	char const	*worker_cpus;			//!< for the scheduler
+	bool		numa_local;			//!< for the scheduler
+	bool		huge_pages;			//!< back message sets with huge pages
+
+	uint32_t	instantiate_threads;		//!< Maximum number of threads used to instantiate
+							///< modules at startup.
+
+	bool		xlat_memoise;			//!< Cache the results of pure and idempotent
+							///< xlat functions for the lifetime of a request.
+
+	bool		exec_helper;			//!< Run programs we don't wait for from a helper
+							///< process forked at startup.
 
 #ifndef NDEBUG
 	uint32_t	ins_max;			//!< max instruction count
@@ -0,0 +1,464 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/memory.c
+ * @brief Attribute memory use to modules and subsystems.
+ *
+ * Modules and subsystems register the memory they own here, labelled
+ * with a subsystem and a name.  The report is available via radmin
+ * "show memory", and in the metrics scrape.
+ *
+ * Nothing is counted on the allocation path.  There are three kinds of
+ * source:
+ *
+ *	- Sources which keep their own counters, e.g. the state tree,
+ *	  which adds the size of each entry as it's stored.  These are
+ *	  read whenever a report is generated.
+ *	- Talloc trees which don't change once the server is running,
+ *	  e.g. module instance data.  These are walked whenever a report
+ *	  is generated.
+ *	- Talloc trees owned by a single thread, e.g. module thread
+ *	  instance data.  These can't be walked from another thread.
+ *	  Instead each report asks the owning threads for a new sample,
+ *	  which they take the next time they pass through their event
+ *	  loop, and the report shows the previous sample.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/command.h>
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/server/memory.h>
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifdef HAVE_MALLOC_H
+#  include <malloc.h>
+#endif
+
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#  if __GLIBC_PREREQ(2, 33)
+#    define HAVE_MALLINFO2
+#  endif
+#endif
+
+/** One registered source
+ *
+ */
+struct fr_memory_source_s {
+	fr_dlist_t		entry;		//!< In the list of sources.
+	char const		*subsystem;	//!< e.g. "module".
+	char const		*name;		//!< e.g. the module instance name.
+
+	fr_memory_collect_t	collect;	//!< Called to read the source's memory use.
+	void const		*uctx;		//!< Passed to collect.
+
+	/*
+	 *	Thread local sources only.
+	 */
+	fr_dlist_t		thread_entry;	//!< In the owning thread's list of sources.
+	void const		*root;		//!< Talloc tree to sample.
+	atomic_size_t		bytes;		//!< From the last sample.
+	atomic_size_t		blocks;		//!< From the last sample.
+};
+
+/** One line of a report
+ *
+ */
+typedef struct {
+	char const		*subsystem;
+	char const		*name;
+	fr_memory_usage_t	usage;
+} fr_memory_report_t;
+
+static pthread_mutex_t		memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t		memory_sources;
+static bool			memory_sources_init = false;
+
+/** Incremented by each report, to ask threads for a new sample
+ */
+static _Atomic(uint64_t)	memory_generation = 1;
+
+static _Thread_local fr_dlist_head_t	*memory_thread_sources;
+static _Thread_local uint64_t		memory_thread_generation;
+
+static fr_metrics_source_t	*memory_metrics_source;
+
+static int _memory_source_free(fr_memory_source_t *source)
+{
+	pthread_mutex_lock(&memory_mutex);
+	fr_dlist_remove(&memory_sources, source);
+	pthread_mutex_unlock(&memory_mutex);
+
+	if (source->root) {
+		fr_assert(memory_thread_sources && fr_dlist_in_list(memory_thread_sources, source));
+		fr_dlist_remove(memory_thread_sources, source);
+
+		if (!fr_dlist_num_elements(memory_thread_sources)) TALLOC_FREE(memory_thread_sources);
+	}
+
+	return 0;
+}
+
+static fr_memory_source_t *memory_source_alloc(TALLOC_CTX *ctx, char const *subsystem, char const *name)
+{
+	fr_memory_source_t *source;
+
+	source = talloc_zero(ctx, fr_memory_source_t);
+	if (!source) return NULL;
+
+	source->subsystem = talloc_typed_strdup(source, subsystem);
+	source->name = talloc_typed_strdup(source, name);
+	if (!source->subsystem || !source->name) {
+		talloc_free(source);
+		return NULL;
+	}
+
+	return source;
+}
+
+static void memory_source_insert(fr_memory_source_t *source)
+{
+	pthread_mutex_lock(&memory_mutex);
+	if (!memory_sources_init) {
+		fr_dlist_talloc_init(&memory_sources, fr_memory_source_t, entry);
+		memory_sources_init = true;
+	}
+	fr_dlist_insert_tail(&memory_sources, source);
+	pthread_mutex_unlock(&memory_mutex);
+
+	talloc_set_destructor(source, _memory_source_free);
+}
+
+/** Register a source of memory use
+ *
+ * The source is unregistered when the returned handle is freed.  As with
+ * metrics sources, objects with destructors should free the handle
+ * explicitly, before they start tearing themselves down.
+ *
+ * @param[in] ctx		to allocate the handle in.  Usually the object being measured.
+ * @param[in] subsystem		the memory belongs to, e.g. "state".
+ * @param[in] name		of the object within the subsystem.  Sources with the same
+ *				subsystem and name are summed.
+ * @param[in] collect		called whenever a report is generated.
+ * @param[in] uctx		passed to collect.
+ * @return
+ *	- The handle for the source.
+ *	- NULL on error.
+ */
+fr_memory_source_t *fr_memory_source_alloc(TALLOC_CTX *ctx, char const *subsystem, char const *name,
+					   fr_memory_collect_t collect, void const *uctx)
+{
+	fr_memory_source_t *source;
+
+	source = memory_source_alloc(ctx, subsystem, name);
+	if (!source) return NULL;
+
+	source->collect = collect;
+	source->uctx = uctx;
+
+	memory_source_insert(source);
+
+	return source;
+}
+
+/** Register a talloc tree which is only used by the calling thread
+ *
+ * The tree is sampled by the calling thread from #fr_memory_thread_sample,
+ * so the handle must be freed by the calling thread, too.
+ *
+ * @param[in] ctx		to allocate the handle in.  Usually the object being measured.
+ * @param[in] subsystem		the memory belongs to, e.g. "module_thread".
+ * @param[in] name		of the object within the subsystem.
+ * @param[in] root		of the talloc tree.
+ * @return
+ *	- The handle for the source.
+ *	- NULL on error.
+ */
+fr_memory_source_t *fr_memory_source_thread_alloc(TALLOC_CTX *ctx, char const *subsystem, char const *name,
+						  void const *root)
+{
+	fr_memory_source_t	*source;
+	fr_memory_usage_t	usage = { 0 };
+
+	source = memory_source_alloc(ctx, subsystem, name);
+	if (!source) return NULL;
+
+	if (!memory_thread_sources) {
+		memory_thread_sources = talloc_zero(NULL, fr_dlist_head_t);
+		if (!memory_thread_sources) {
+			talloc_free(source);
+			return NULL;
+		}
+		fr_dlist_talloc_init(memory_thread_sources, fr_memory_source_t, thread_entry);
+	}
+
+	source->root = root;
+
+	/*
+	 *	So the first report has something to show.
+	 */
+	fr_memory_talloc_usage(&usage, root);
+	atomic_init(&source->bytes, usage.bytes);
+	atomic_init(&source->blocks, usage.blocks);
+
+	fr_dlist_insert_tail(memory_thread_sources, source);
+
+	memory_source_insert(source);
+
+	return source;
+}
+
+/** Add the size of a talloc tree to a report
+ *
+ * The tree must not be changing, or must be owned by the calling thread.
+ *
+ * @param[in,out] usage		to add to.
+ * @param[in] root		of the tree.  May be NULL.
+ */
+void fr_memory_talloc_usage(fr_memory_usage_t *usage, void const *root)
+{
+	if (!root) return;
+
+	usage->bytes += talloc_total_size(root);
+	usage->blocks += talloc_total_blocks(root);
+}
+
+/** Sample the thread local sources, if a report has asked for it
+ *
+ * Is cheap enough to call on every pass through the event loop.
+ */
+void fr_memory_thread_sample(void)
+{
+	uint64_t generation;
+
+	if (!memory_thread_sources) return;
+
+	generation = atomic_load_explicit(&memory_generation, memory_order_relaxed);
+	if (generation == memory_thread_generation) return;
+	memory_thread_generation = generation;
+
+	fr_dlist_foreach(memory_thread_sources, fr_memory_source_t, source) {
+		fr_memory_usage_t usage = { 0 };
+
+		fr_memory_talloc_usage(&usage, source->root);
+		atomic_store_explicit(&source->bytes, usage.bytes, memory_order_relaxed);
+		atomic_store_explicit(&source->blocks, usage.blocks, memory_order_relaxed);
+	}
+}
+
+static void memory_source_usage(fr_memory_usage_t *usage, fr_memory_source_t const *source)
+{
+	if (source->collect) {
+		source->collect(usage, source->uctx);
+		return;
+	}
+
+	usage->bytes += atomic_load_explicit(&UNCONST(fr_memory_source_t *, source)->bytes, memory_order_relaxed);
+	usage->blocks += atomic_load_explicit(&UNCONST(fr_memory_source_t *, source)->blocks, memory_order_relaxed);
+}
+
+static int memory_report_cmp(void const *one, void const *two)
+{
+	fr_memory_report_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->subsystem, b->subsystem);
+	if (ret != 0) return ret;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Read every source, summing those with the same subsystem and name
+ *
+ * @param[in] ctx	to allocate the report in.
+ * @return
+ *	- The report, with one entry per subsystem and name.
+ *	- NULL if there are no sources, or on error.
+ */
+static fr_memory_report_t *memory_report(TALLOC_CTX *ctx)
+{
+	fr_memory_report_t	*report;
+	size_t			i, j, num = 0;
+
+	pthread_mutex_lock(&memory_mutex);
+	if (!memory_sources_init || !fr_dlist_num_elements(&memory_sources)) {
+		pthread_mutex_unlock(&memory_mutex);
+		return NULL;
+	}
+
+	report = talloc_zero_array(ctx, fr_memory_report_t, fr_dlist_num_elements(&memory_sources));
+	if (!report) {
+		pthread_mutex_unlock(&memory_mutex);
+		return NULL;
+	}
+
+	fr_dlist_foreach(&memory_sources, fr_memory_source_t, source) {
+		report[num].subsystem = talloc_typed_strdup(report, source->subsystem);
+		report[num].name = talloc_typed_strdup(report, source->name);
+		memory_source_usage(&report[num].usage, source);
+		num++;
+	}
+	pthread_mutex_unlock(&memory_mutex);
+
+	atomic_fetch_add_explicit(&memory_generation, 1, memory_order_relaxed);
+
+	qsort(report, num, sizeof(report[0]), memory_report_cmp);
+
+	for (i = 0, j = 0; i < num; i++) {
+		if ((j > 0) && (memory_report_cmp(&report[j - 1], &report[i]) == 0)) {
+			report[j - 1].usage.bytes += report[i].usage.bytes;
+			report[j - 1].usage.blocks += report[i].usage.blocks;
+			continue;
+		}
+		report[j++] = report[i];
+	}
+
+	return talloc_realloc(ctx, report, fr_memory_report_t, j);
+}
+
+static fr_metric_family_t const memory_metric_bytes = {
+	.name = "freeradius_memory_bytes", .type = FR_METRIC_GAUGE,
+	.help = "Memory attributed to a module or subsystem."
+};
+static fr_metric_family_t const memory_metric_blocks = {
+	.name = "freeradius_memory_blocks", .type = FR_METRIC_GAUGE,
+	.help = "Allocations, or objects, attributed to a module or subsystem."
+};
+#ifdef HAVE_MALLINFO2
+static fr_metric_family_t const memory_metric_allocator = {
+	.name = "freeradius_memory_allocator_bytes", .type = FR_METRIC_GAUGE,
+	.help = "Memory held by the allocator."
+};
+#endif
+
+static void memory_metrics(fr_metrics_t *m, UNUSED void const *uctx)
+{
+	TALLOC_CTX		*ctx;
+	fr_memory_report_t	*report;
+	size_t			i;
+
+	ctx = talloc_new(NULL);
+	if (!ctx) return;
+
+	report = memory_report(ctx);
+	for (i = 0; i < talloc_array_length(report); i++) {
+		fr_metrics_add(m, &memory_metric_bytes, report[i].usage.bytes,
+			       "subsystem", report[i].subsystem, "name", report[i].name, NULL);
+		fr_metrics_add(m, &memory_metric_blocks, report[i].usage.blocks,
+			       "subsystem", report[i].subsystem, "name", report[i].name, NULL);
+	}
+	talloc_free(ctx);
+
+#ifdef HAVE_MALLINFO2
+	{
+		struct mallinfo2 mi = mallinfo2();
+
+		fr_metrics_add(m, &memory_metric_allocator, mi.uordblks + mi.hblkhd, "type", "in_use", NULL);
+		fr_metrics_add(m, &memory_metric_allocator, mi.fordblks, "type", "free", NULL);
+		fr_metrics_add(m, &memory_metric_allocator, mi.arena, "type", "arena", NULL);
+		fr_metrics_add(m, &memory_metric_allocator, mi.hblkhd, "type", "mmap", NULL);
+	}
+#endif
+}
+
+static int cmd_show_memory(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	TALLOC_CTX		*tmp_ctx;
+	fr_memory_report_t	*report;
+	size_t			i, bytes = 0, blocks = 0;
+
+	tmp_ctx = talloc_new(NULL);
+	if (!tmp_ctx) return -1;
+
+	report = memory_report(tmp_ctx);
+	for (i = 0; i < talloc_array_length(report); i++) {
+		fprintf(fp, "%s.%s\t%zu bytes\t%zu blocks\n", report[i].subsystem, report[i].name,
+			report[i].usage.bytes, report[i].usage.blocks);
+		bytes += report[i].usage.bytes;
+		blocks += report[i].usage.blocks;
+	}
+	talloc_free(tmp_ctx);
+
+	fprintf(fp, "total\t%zu bytes\t%zu blocks\n", bytes, blocks);
+
+#ifdef HAVE_MALLINFO2
+	{
+		struct mallinfo2 mi = mallinfo2();
+
+		/*
+		 *	The difference between what's in use, and what
+		 *	we can account for, is fragmentation, and memory
+		 *	which isn't registered with us.
+		 */
+		fprintf(fp, "allocator.in_use\t%zu bytes\n", mi.uordblks + mi.hblkhd);
+		fprintf(fp, "allocator.free\t%zu bytes\n", mi.fordblks);
+		fprintf(fp, "allocator.arena\t%zu bytes\n", mi.arena);
+		fprintf(fp, "allocator.mmap\t%zu bytes\n", mi.hblkhd);
+	}
+#endif
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_memory_table[] = {
+	{
+		.parent = "show",
+		.name = "memory",
+		.func = cmd_show_memory,
+		.help = "Show memory used by modules and subsystems.  Thread local memory is as of the previous call.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
+/** Register the memory report with radmin and the metrics registry
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_memory_init(void)
+{
+	if (memory_metrics_source) return 0;
+
+	if (fr_command_register_hook(NULL, NULL, NULL, cmd_memory_table) < 0) {
+		PERROR("Failed registering memory commands");
+		return -1;
+	}
+
+	memory_metrics_source = fr_metrics_source_alloc(NULL, memory_metrics, NULL);
+	if (!memory_metrics_source) return -1;
+
+	return 0;
+}
+
+/** Unregister the memory report from the metrics registry
+ *
+ */
+void fr_memory_free(void)
+{
+	TALLOC_FREE(memory_metrics_source);
+}
@@ -0,0 +1,73 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/memory.h
+ * @brief Attribute memory use to modules and subsystems.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(memory_h, "$Id$")
+
+#include <freeradius-devel/util/talloc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Memory used by one source
+ *
+ */
+typedef struct {
+	size_t			bytes;		//!< Total size of the allocations.
+	size_t			blocks;		//!< Number of allocations, or of objects for
+						///< sources which keep their own count.
+} fr_memory_usage_t;
+
+typedef struct fr_memory_source_s fr_memory_source_t;
+
+/** Add the memory used by a source to a report
+ *
+ * Like #fr_metrics_collect_t this is called from the reporting thread,
+ * and must only read values which are safe to read from any thread.
+ *
+ * @param[in,out] usage	to add the source's memory use to.
+ * @param[in] uctx	passed to #fr_memory_source_alloc.
+ */
+typedef void (*fr_memory_collect_t)(fr_memory_usage_t *usage, void const *uctx);
+
+fr_memory_source_t	*fr_memory_source_alloc(TALLOC_CTX *ctx, char const *subsystem, char const *name,
+						fr_memory_collect_t collect, void const *uctx)
+			CC_HINT(nonnull(2, 3, 4));
+
+fr_memory_source_t	*fr_memory_source_thread_alloc(TALLOC_CTX *ctx, char const *subsystem, char const *name,
+						       void const *root)
+			CC_HINT(nonnull(2, 3, 4));
+
+void			fr_memory_talloc_usage(fr_memory_usage_t *usage, void const *root);
+
+void			fr_memory_thread_sample(void);
+
+int			fr_memory_init(void);
+
+void			fr_memory_free(void);
+
+#ifdef __cplusplus
+}
+#endif
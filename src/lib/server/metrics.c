@@ -0,0 +1,296 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/metrics.c
+ * @brief Registry of metric sources, rendered as OpenMetrics text.
+ *
+ * Workers, networks, trunks, etc. register a source when they're
+ * created, and free it when they're destroyed.  A scrape walks the
+ * registered sources, asks each one for its current values, and
+ * renders the result.
+ *
+ * The sources read the owning thread's counters without taking any
+ * locks.  The only lock is around the list of sources, and it's only
+ * contended when a source is added or removed during a scrape.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/sbuff.h>
+
+#include <pthread.h>
+#include <stdarg.h>
+
+/** One registered source
+ *
+ */
+struct fr_metrics_source_s {
+	fr_dlist_t		entry;		//!< In the list of sources.
+	fr_metrics_collect_t	collect;	//!< Called to add samples to a scrape.
+	void const		*uctx;		//!< Passed to collect.
+};
+
+typedef struct {
+	fr_metric_family_t const *family;	//!< Which family this sample belongs to.
+	char			*labels;	//!< Pre-rendered label set, or NULL.
+	double			value;		//!< Current value.
+} fr_metric_sample_t;
+
+/** The samples collected during one scrape
+ *
+ */
+struct fr_metrics_s {
+	TALLOC_CTX		*ctx;		//!< For labels and the sample array.
+	fr_metric_sample_t	*sample;	//!< Array of samples.
+	size_t			num;		//!< How many samples are used.
+};
+
+static pthread_mutex_t	metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t	metrics_sources;
+static bool		metrics_sources_init = false;
+
+static int _metrics_source_free(fr_metrics_source_t *source)
+{
+	pthread_mutex_lock(&metrics_mutex);
+	fr_dlist_remove(&metrics_sources, source);
+	pthread_mutex_unlock(&metrics_mutex);
+
+	return 0;
+}
+
+/** Register a source of metrics
+ *
+ * The source is unregistered when the returned handle is freed.  Objects
+ * with destructors should free the handle explicitly, before they start
+ * tearing themselves down, so that a concurrent scrape never sees a half
+ * freed object.
+ *
+ * @param[in] ctx	to allocate the handle in.  Usually the object being measured.
+ * @param[in] collect	called on every scrape.
+ * @param[in] uctx	passed to collect.
+ * @return
+ *	- The handle for the source.
+ *	- NULL on error.
+ */
+fr_metrics_source_t *fr_metrics_source_alloc(TALLOC_CTX *ctx, fr_metrics_collect_t collect, void const *uctx)
+{
+	fr_metrics_source_t *source;
+
+	source = talloc_zero(ctx, fr_metrics_source_t);
+	if (!source) return NULL;
+
+	source->collect = collect;
+	source->uctx = uctx;
+
+	pthread_mutex_lock(&metrics_mutex);
+	if (!metrics_sources_init) {
+		fr_dlist_talloc_init(&metrics_sources, fr_metrics_source_t, entry);
+		metrics_sources_init = true;
+	}
+	fr_dlist_insert_tail(&metrics_sources, source);
+	pthread_mutex_unlock(&metrics_mutex);
+
+	talloc_set_destructor(source, _metrics_source_free);
+
+	return source;
+}
+
+/** Escape a label value as required by OpenMetrics
+ *
+ */
+static void metrics_label_escape(char **labels, char const *value)
+{
+	char const *p, *q;
+
+	for (p = q = value; *q; q++) {
+		char const *esc;
+
+		switch (*q) {
+		case '\\':
+			esc = "\\\\";
+			break;
+
+		case '"':
+			esc = "\\\"";
+			break;
+
+		case '\n':
+			esc = "\\n";
+			break;
+
+		default:
+			continue;
+		}
+
+		*labels = talloc_asprintf_append_buffer(*labels, "%.*s%s", (int) (q - p), p, esc);
+		p = q + 1;
+	}
+
+	*labels = talloc_asprintf_append_buffer(*labels, "%s", p);
+}
+
+/** Add a sample to a scrape
+ *
+ * Samples with the same family and labels are summed.  That lets
+ * per-thread sources (e.g. module thread instances) report their own
+ * values, with the scrape showing the total.
+ *
+ * @param[in] m		passed to the collect callback.
+ * @param[in] family	the sample belongs to.
+ * @param[in] value	of the sample.
+ * @param[in] ...	pairs of label name / label value, terminated by NULL.
+ */
+void fr_metrics_add(fr_metrics_t *m, fr_metric_family_t const *family, double value, ...)
+{
+	va_list			ap;
+	char const		*name, *label;
+	char			*labels = NULL;
+	fr_metric_sample_t	*sample;
+
+	va_start(ap, value);
+	while ((name = va_arg(ap, char const *))) {
+		label = va_arg(ap, char const *);
+		if (!label) label = "";
+
+		labels = talloc_asprintf_append_buffer(labels ? labels : talloc_strdup(m->ctx, ""),
+						       "%s%s=\"", labels ? "," : "", name);
+		metrics_label_escape(&labels, label);
+		labels = talloc_asprintf_append_buffer(labels, "\"");
+	}
+	va_end(ap);
+
+	if (m->num >= talloc_array_length(m->sample)) {
+		MEM(m->sample = talloc_realloc(m->ctx, m->sample, fr_metric_sample_t,
+					       m->num ? m->num * 2 : 64));
+	}
+
+	sample = &m->sample[m->num++];
+	sample->family = family;
+	sample->labels = labels;
+	sample->value = value;
+}
+
+static int8_t metrics_sample_cmp(void const *one, void const *two)
+{
+	fr_metric_sample_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->family->name, b->family->name);
+	if (ret != 0) return CMP(ret, 0);
+
+	if (!a->labels || !b->labels) return CMP(a->labels != NULL, b->labels != NULL);
+
+	ret = strcmp(a->labels, b->labels);
+	return CMP(ret, 0);
+}
+
+static int metrics_sample_qsort_cmp(void const *one, void const *two)
+{
+	return metrics_sample_cmp(one, two);
+}
+
+static void metrics_value_print(fr_sbuff_t *out, double value)
+{
+	/*
+	 *	Nearly everything is an integer count, so print those
+	 *	exactly, instead of in scientific notation.
+	 */
+	if ((value >= 0) && (value < 9007199254740992.0) && (value == (double) (uint64_t) value)) {
+		(void) fr_sbuff_in_sprintf(out, "%" PRIu64, (uint64_t) value);
+		return;
+	}
+
+	(void) fr_sbuff_in_sprintf(out, "%.9f", value);
+}
+
+/** Collect all registered sources, and render them as OpenMetrics text
+ *
+ * @param[in] ctx	to allocate the output in.
+ * @return
+ *	- The rendered text, terminated by "# EOF".
+ *	- NULL on error.
+ */
+char *fr_metrics_print(TALLOC_CTX *ctx)
+{
+	fr_metrics_t		m = { 0 };
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+	size_t			i, j;
+
+	m.ctx = talloc_new(NULL);
+	if (!m.ctx) return NULL;
+
+	pthread_mutex_lock(&metrics_mutex);
+	if (metrics_sources_init) {
+		fr_dlist_foreach(&metrics_sources, fr_metrics_source_t, source) {
+			source->collect(&m, source->uctx);
+		}
+	}
+	pthread_mutex_unlock(&metrics_mutex);
+
+	if (m.num > 1) qsort(m.sample, m.num, sizeof(m.sample[0]), metrics_sample_qsort_cmp);
+
+	/*
+	 *	Sum samples with identical family and labels.
+	 */
+	for (i = 0, j = 0; i < m.num; i++) {
+		if ((j > 0) && (metrics_sample_cmp(&m.sample[j - 1], &m.sample[i]) == 0)) {
+			m.sample[j - 1].value += m.sample[i].value;
+			continue;
+		}
+		m.sample[j++] = m.sample[i];
+	}
+	m.num = j;
+
+	if (unlikely(fr_sbuff_init_talloc(ctx, &sbuff, &tctx, 8192, SIZE_MAX) == NULL)) {
+		talloc_free(m.ctx);
+		return NULL;
+	}
+
+	for (i = 0; i < m.num; i++) {
+		fr_metric_family_t const *family = m.sample[i].family;
+
+		if ((i == 0) || (strcmp(m.sample[i - 1].family->name, family->name) != 0)) {
+			(void) fr_sbuff_in_sprintf(&sbuff, "# TYPE %s %s\n", family->name,
+						   (family->type == FR_METRIC_COUNTER) ? "counter" : "gauge");
+			if (family->help) (void) fr_sbuff_in_sprintf(&sbuff, "# HELP %s %s\n", family->name, family->help);
+		}
+
+		(void) fr_sbuff_in_sprintf(&sbuff, "%s%s", family->name,
+					   (family->type == FR_METRIC_COUNTER) ? "_total" : "");
+		if (m.sample[i].labels) (void) fr_sbuff_in_sprintf(&sbuff, "{%s}", m.sample[i].labels);
+		(void) fr_sbuff_in_char(&sbuff, ' ');
+		metrics_value_print(&sbuff, m.sample[i].value);
+		(void) fr_sbuff_in_char(&sbuff, '\n');
+	}
+	(void) fr_sbuff_in_strcpy_literal(&sbuff, "# EOF\n");
+
+	talloc_free(m.ctx);
+
+	if (unlikely(fr_sbuff_trim_talloc(&sbuff, SIZE_MAX) < 0)) {
+		talloc_free(sbuff.buff);
+		return NULL;
+	}
+
+	return sbuff.buff;
+}
@@ -0,0 +1,75 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/metrics.h
+ * @brief Registry of metric sources, rendered as OpenMetrics text.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(metrics_h, "$Id$")
+
+#include <freeradius-devel/util/talloc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	FR_METRIC_COUNTER = 0,			//!< Monotonically increasing value.
+	FR_METRIC_GAUGE				//!< Value which can go up and down.
+} fr_metric_type_t;
+
+/** Static description of a metric family
+ *
+ * Sources declare these as static const, and pass them to #fr_metrics_add.
+ */
+typedef struct {
+	char const		*name;		//!< e.g. freeradius_worker_requests.  Counters
+						///< have "_total" appended to each sample.
+	char const		*help;		//!< One line description.
+	fr_metric_type_t	type;		//!< Counter or gauge.
+} fr_metric_family_t;
+
+typedef struct fr_metrics_s fr_metrics_t;
+
+typedef struct fr_metrics_source_s fr_metrics_source_t;
+
+/** Add the current values of a source to a scrape
+ *
+ * This is called from the scraping thread, and NOT from the thread which
+ * owns the source.  It must only read counters which are safe to read
+ * without locks, i.e. aligned integers with a single writer, or atomics.
+ *
+ * @param[in] m		to add samples to with #fr_metrics_add.
+ * @param[in] uctx	passed to #fr_metrics_source_alloc.
+ */
+typedef void (*fr_metrics_collect_t)(fr_metrics_t *m, void const *uctx);
+
+fr_metrics_source_t	*fr_metrics_source_alloc(TALLOC_CTX *ctx, fr_metrics_collect_t collect, void const *uctx)
+			CC_HINT(nonnull(2));
+
+void			fr_metrics_add(fr_metrics_t *m, fr_metric_family_t const *family, double value, ...)
+			CC_HINT(nonnull(1, 2)) CC_HINT(sentinel);
+
+char			*fr_metrics_print(TALLOC_CTX *ctx);
+
+#ifdef __cplusplus
+}
+#endif
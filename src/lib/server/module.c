@@ -40,6 +40,8 @@ RCSID("$Id$")
 #include <freeradius-devel/util/talloc.h>
 #include <freeradius-devel/unlang/xlat_func.h>
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <talloc.h>
 #include <sys/mman.h>
 
@@ -1031,6 +1033,45 @@ void modules_thread_detach(module_list_t *ml)
 	if (ml->type->thread.free) ml->type->thread.free(ml);
 }
 
+static fr_metric_family_t const module_metric_calls = {
+	.name = "freeradius_module_calls", .type = FR_METRIC_COUNTER,
+	.help = "Calls made to a module."
+};
+static fr_metric_family_t const module_metric_calls_completed = {
+	.name = "freeradius_module_calls_completed", .type = FR_METRIC_COUNTER,
+	.help = "Calls to a module which have returned a result."
+};
+static fr_metric_family_t const module_metric_call_time = {
+	.name = "freeradius_module_call_duration_seconds", .type = FR_METRIC_COUNTER,
+	.help = "Wall clock time spent in completed calls to a module, including time spent yielded."
+};
+static fr_metric_family_t const module_metric_calls_active = {
+	.name = "freeradius_module_calls_active", .type = FR_METRIC_GAUGE,
+	.help = "Calls to a module which are currently yielded."
+};
+
+/** Add a module thread instance's counters to a scrape
+ *
+ * Every thread reports separately, with the same labels, so the scrape
+ * shows the sum across all threads.
+ */
+static void module_thread_metrics(fr_metrics_t *m, void const *uctx)
+{
+	module_thread_instance_t const *ti = uctx;
+
+	/*
+	 *	Don't clutter the output with modules which are never
+	 *	called from unlang, e.g. listeners.
+	 */
+	if (!ti->total_calls) return;
+
+	fr_metrics_add(m, &module_metric_calls, ti->total_calls, "module", ti->mi->name, NULL);
+	fr_metrics_add(m, &module_metric_calls_completed, ti->completed_calls, "module", ti->mi->name, NULL);
+	fr_metrics_add(m, &module_metric_call_time, fr_time_delta_unwrap(ti->total_time) / (double)NSEC,
+		       "module", ti->mi->name, NULL);
+	fr_metrics_add(m, &module_metric_calls_active, ti->active_callers, "module", ti->mi->name, NULL);
+}
+
 /** Callback to free thread local data
  *
  * ti->data is allocated in the context of ti, so will be freed too.
@@ -1044,6 +1085,9 @@ static int _module_thread_inst_free(module_thread_instance_t *ti)
 {
 	module_instance_t const *mi = ti->mi;
 
+	TALLOC_FREE(ti->metrics);
+	TALLOC_FREE(ti->memory);
+
 	/*
 	 *	Never allocated a thread instance, so we don't need
 	 *	to clean it up...
@@ -1143,6 +1187,15 @@ int module_thread_instantiate(TALLOC_CTX *ctx, module_instance_t *mi, fr_event_l
 		goto error;
 	}
 
+	MEM(ti->metrics = fr_metrics_source_alloc(ti, module_thread_metrics, ti));
+	{
+		char *name;
+
+		MEM(name = talloc_asprintf(NULL, "%s.%s", ml->name, mi->name));
+		MEM(ti->memory = fr_memory_source_thread_alloc(ti, "module_thread", name, ti));
+		talloc_free(name);
+	}
+
 	return 0;
 }
 
@@ -1185,18 +1238,37 @@ int modules_thread_instantiate(TALLOC_CTX *ctx, module_list_t const *ml, fr_even
 	return 0;
 }
 
-/** Manually complete module setup by calling its instantiate function
+/** Maximum number of threads used to call instantiate callbacks
  *
- * @param[in] instance	of module to complete instantiation for.
+ * Only modules with #MODULE_TYPE_INSTANTIATE_PARALLEL set are instantiated
+ * in parallel.  0 or 1 means every module is instantiated by the caller.
+ */
+static unsigned int module_instantiate_threads;
+
+/** Set the maximum number of threads used to instantiate modules
+ *
+ * Must only be set when nothing else relies on talloc's NULL context
+ * tracking, as modules instantiated in parallel may allocate in the NULL
+ * context.
+ *
+ * @param[in] num	Maximum number of threads.  0 to instantiate
+ *			modules serially.
+ */
+void modules_instantiate_threads_set(unsigned int num)
+{
+	module_instantiate_threads = num;
+}
+
+/** Prepare a module for instantiation
+ *
+ * @param[in] mi	to prepare.
  * @return
- *	- 0 on success.
+ *	- 1 if the module should be instantiated.
+ *	- 0 if the module doesn't need instantiating.
  *	- -1 on failure.
  */
-int module_instantiate(module_instance_t *instance)
+static int module_instantiate_prepare(module_instance_t *mi)
 {
-	module_instance_t *mi = talloc_get_type_abort(instance, module_instance_t);
-	CONF_SECTION *cs = mi->conf;
-
 	/*
 	 *	If we're instantiating, then nothing should be able to
 	 *	modify the boot data for this module.
@@ -1235,25 +1307,59 @@ int module_instantiate(module_instance_t *instance)
 	if (mi->exported->config && (cf_section_parse_pass2(mi->data,
 							    mi->conf) < 0)) return -1;
 
+	return 1;
+}
+
+/** Call a module's instantiate callback
+ *
+ * @param[in] mi	to instantiate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int module_instantiate_call(module_instance_t *mi)
+{
+	if (!mi->exported->instantiate) return 0;
+
+	cf_log_debug(mi->conf, "Instantiating %s_%s \"%s\"",
+		     module_instance_root_prefix_str(mi),
+		     mi->module->exported->name,
+		     mi->name);
+
 	/*
-	 *	Call the instantiate method, if any.
+	 *	Call the module's instantiation routine.
 	 */
-	if (mi->exported->instantiate) {
-		cf_log_debug(cs, "Instantiating %s_%s \"%s\"",
-			     module_instance_root_prefix_str(mi),
-			     mi->module->exported->name,
-			     mi->name);
+	if (mi->exported->instantiate(MODULE_INST_CTX(mi)) < 0) {
+		cf_log_err(mi->conf, "Instantiation failed for module \"%s\"", mi->name);
 
-		/*
-		 *	Call the module's instantiation routine.
-		 */
-		if (mi->exported->instantiate(MODULE_INST_CTX(mi)) < 0) {
-			cf_log_err(mi->conf, "Instantiation failed for module \"%s\"", mi->name);
-
-			return -1;
-		}
+		return -1;
 	}
 
+	return 0;
+}
+
+/** Add a module's instance data to a memory report
+ *
+ * Instance data doesn't change once the module has been instantiated,
+ * so it's safe to walk from any thread.
+ */
+static void module_memory(fr_memory_usage_t *usage, void const *uctx)
+{
+	module_instance_t const *mi = uctx;
+
+	fr_memory_talloc_usage(usage, mi->boot);
+	fr_memory_talloc_usage(usage, mi->data);
+}
+
+/** Mark a module as instantiated
+ *
+ * @param[in] mi	which has been instantiated.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int module_instantiate_done(module_instance_t *mi)
+{
 	/*
 	 *	Instantiate shouldn't modify any global resources
 	 *	so we can protect the data now without the side
@@ -1265,14 +1371,155 @@ int module_instantiate(module_instance_t *instance)
 	}
 	mi->state |= MODULE_INSTANCE_INSTANTIATED;
 
+	if (!mi->memory) {
+		char *name;
+
+		MEM(name = talloc_asprintf(NULL, "%s.%s", mi->ml->name, mi->name));
+		MEM(mi->memory = fr_memory_source_alloc(mi, "module", name, module_memory, mi));
+		talloc_free(name);
+	}
+
 	return 0;
 }
 
+/** Manually complete module setup by calling its instantiate function
+ *
+ * @param[in] instance	of module to complete instantiation for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int module_instantiate(module_instance_t *instance)
+{
+	module_instance_t	*mi = talloc_get_type_abort(instance, module_instance_t);
+	int			ret;
+
+	ret = module_instantiate_prepare(mi);
+	if (ret <= 0) return ret;
+
+	if (module_instantiate_call(mi) < 0) return -1;
+
+	return module_instantiate_done(mi);
+}
+
+/** Modules whose instantiate callbacks are being called in parallel
+ *
+ */
+typedef struct {
+	module_instance_t	**mi;		//!< Modules to instantiate.
+	size_t			num;		//!< Number of modules.
+	atomic_size_t		next;		//!< Next module to instantiate.
+	atomic_bool		failed;		//!< A module failed to instantiate.
+} module_instantiate_batch_t;
+
+static void *module_instantiate_thread(void *uctx)
+{
+	module_instantiate_batch_t	*batch = uctx;
+	size_t				i;
+
+	while ((i = atomic_fetch_add(&batch->next, 1)) < batch->num) {
+		if (atomic_load(&batch->failed)) break;
+
+		if (module_instantiate_call(batch->mi[i]) < 0) atomic_store(&batch->failed, true);
+	}
+
+	return NULL;
+}
+
+/** Instantiate the modules which can be instantiated in parallel
+ *
+ * Anything which touches shared state, i.e. radmin registration,
+ * pass2 parsing of the config, and protecting the instance data, is
+ * done by the caller.  Only the instantiate callbacks themselves are
+ * called from other threads.
+ *
+ * @param[in] ml containing modules to instantiate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int modules_instantiate_parallel(module_list_t const *ml)
+{
+	void				*inst;
+	fr_rb_iter_inorder_t		iter;
+	module_instantiate_batch_t	batch = { .num = 0 };
+	pthread_t			*threads;
+	unsigned int			num_threads, i, started = 0;
+	int				ret = 0;
+
+	MEM(batch.mi = talloc_array(NULL, module_instance_t *, fr_rb_num_elements(ml->name_tree)));
+
+	for (inst = fr_rb_iter_init_inorder(&iter, ml->name_tree);
+	     inst;
+	     inst = fr_rb_iter_next_inorder(&iter)) {
+	     	module_instance_t *mi = talloc_get_type_abort(inst, module_instance_t);
+
+		if (!(mi->exported->flags & MODULE_TYPE_INSTANTIATE_PARALLEL) || !mi->exported->instantiate) continue;
+
+		ret = module_instantiate_prepare(mi);
+		if (ret < 0) goto done;
+		if (ret == 0) continue;
+
+		batch.mi[batch.num++] = mi;
+	}
+	ret = 0;
+
+	if (batch.num == 0) goto done;
+
+	num_threads = module_instantiate_threads;
+	if (num_threads > batch.num) num_threads = batch.num;
+
+	DEBUG2("Instantiating %zu %s modules using %u threads", batch.num, ml->name, num_threads);
+
+	atomic_init(&batch.next, 0);
+	atomic_init(&batch.failed, false);
+
+	/*
+	 *	We run one of the threads ourselves.  If we can't
+	 *	create enough threads, the ones we have do the work.
+	 */
+	MEM(threads = talloc_array(batch.mi, pthread_t, num_threads));
+	for (i = 1; i < num_threads; i++) {
+		int err;
+
+		err = pthread_create(&threads[started], NULL, module_instantiate_thread, &batch);
+		if (err != 0) {
+			WARN("Failed creating module instantiation thread: %s", fr_syserror(err));
+			break;
+		}
+		started++;
+	}
+
+	module_instantiate_thread(&batch);
+
+	for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+	if (atomic_load(&batch.failed)) {
+		ret = -1;
+		goto done;
+	}
+
+	for (i = 0; i < batch.num; i++) {
+		if (module_instantiate_done(batch.mi[i]) < 0) {
+			ret = -1;
+			goto done;
+		}
+	}
+
+done:
+	talloc_free(batch.mi);
+
+	return ret;
+}
+
 /** Completes instantiation of modules
  *
  * Allows the module to initialise connection pools, and complete any registrations that depend on
  * attributes created during the bootstrap phase.
  *
+ * Modules which have #MODULE_TYPE_INSTANTIATE_PARALLEL set are instantiated first, in parallel,
+ * if modules_instantiate_threads_set() has been called.
+ *
  * @param[in] ml containing modules to instantiate.
  * @return
  *	- 0 on success.
@@ -1285,6 +1532,8 @@ int modules_instantiate(module_list_t const *ml)
 
 	DEBUG2("#### Instantiating %s modules ####", ml->name);
 
+	if ((module_instantiate_threads > 1) && (modules_instantiate_parallel(ml) < 0)) return -1;
+
 	for (inst = fr_rb_iter_init_inorder(&iter, ml->name_tree);
 	     inst;
 	     inst = fr_rb_iter_next_inorder(&iter)) {
@@ -1462,6 +1711,8 @@ static int _module_instance_free(module_instance_t *mi)
 
 	DEBUG3("Freeing %s (%p)", mi->name, mi);
 
+	TALLOC_FREE(mi->memory);
+
 	/*
 	 *	Allow writing to instance and bootstrap data again
 	 *	so we can clean up without segving.
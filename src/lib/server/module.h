@@ -39,6 +39,8 @@ typedef struct module_thread_instance_s		module_thread_instance_t;
 typedef struct module_list_type_s		module_list_type_t;
 typedef struct module_list_s			module_list_t;
 
+#include <freeradius-devel/server/memory.h>
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/server/module_ctx.h>
 #include <freeradius-devel/server/rcode.h>
 #include <freeradius-devel/server/request.h>
@@ -49,8 +51,13 @@ typedef enum CC_HINT(flag_enum) {
 							//!< Server will protect calls with mutex.
 	MODULE_TYPE_RETRY		= (1 << 2), 	//!< can handle retries
 
-	MODULE_TYPE_DYNAMIC_UNSAFE	= (1 << 3)	//!< Instances of this module cannot be
+	MODULE_TYPE_DYNAMIC_UNSAFE	= (1 << 3),	//!< Instances of this module cannot be
 							///< created at runtime.
+
+	MODULE_TYPE_INSTANTIATE_PARALLEL = (1 << 4)	//!< The instantiate callback may run at the same time as
+							///< the instantiate callbacks of other modules.  It must
+							///< only modify its own instance data, and must not
+							///< register xlats, or reference other module instances.
 } module_flags_t;
 DIAG_ON(attributes)
 
@@ -337,6 +344,8 @@ struct module_instance_s {
 	module_instance_t const		*parent;	//!< Parent module's instance (if any).
 
 	void				*uctx;		//!< Extra data passed to module_instance_alloc.
+
+	fr_memory_source_t		*memory;	//!< Our entry in the memory accounting registry.
 	/** @} */
 };
 
@@ -357,6 +366,12 @@ struct module_thread_instance_s {
 
 	uint64_t			total_calls;	//! total number of times we've been called
 	uint64_t			active_callers; //! number of active callers.  i.e. number of current yields
+
+	uint64_t			completed_calls; //!< number of calls which have returned a result.
+	fr_time_delta_t			total_time;	//!< wall clock time spent in completed calls.
+
+	fr_metrics_source_t		*metrics;	//!< Our entry in the metrics registry.
+	fr_memory_source_t		*memory;	//!< Our entry in the memory accounting registry.
 };
 
 /** Callback to retrieve thread-local data for a module
@@ -500,6 +515,8 @@ int			modules_thread_instantiate(TALLOC_CTX *ctx, module_list_t const *ml, fr_ev
 
 int			module_instantiate(module_instance_t *mi) CC_HINT(nonnull) CC_HINT(warn_unused_result);
 
+void			modules_instantiate_threads_set(unsigned int num);
+
 int			modules_instantiate(module_list_t const *ml) CC_HINT(nonnull) CC_HINT(warn_unused_result);
 
 int			module_bootstrap(module_instance_t *mi) CC_HINT(nonnull) CC_HINT(warn_unused_result);
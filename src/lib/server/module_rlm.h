@@ -35,9 +35,21 @@ typedef struct module_rlm_instance_s module_rlm_instance_t;
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/virtual_servers.h>
 
+/** Report how busy a module instance is in the current thread
+ *
+ * Used by "load-balance" and "redundant-load-balance" to pick the least
+ * loaded of two randomly chosen children.
+ *
+ * @param[in] mctx	with the instance and thread data of the module.
+ * @return The cost of sending another request to this module instance.
+ *	Only the relative values matter, lower is better.
+ */
+typedef uint64_t (*module_rlm_load_t)(module_ctx_t const *mctx);
+
 struct module_rlm_s {
 	module_t			common;			//!< Common fields presented by all modules.
 	module_method_group_t		method_group;		//!< named methods
+	module_rlm_load_t		get_load;		//!< Optional, report how busy the module is.
 };
 
 struct module_rlm_instance_s {
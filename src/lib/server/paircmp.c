@@ -106,8 +106,8 @@ int paircmp_pairs(UNUSED request_t *request, fr_pair_t const *check, fr_pair_t *
 		/*
 		 *	Include substring matches.
 		 */
-		slen = regex_compile(request, &preg, expr_p, talloc_array_length(expr_p) - 1,
-				     NULL, true, true);
+		slen = regex_compile_cached(request, &preg, expr_p, talloc_array_length(expr_p) - 1,
+					    NULL, true);
 		if (slen <= 0) {
 			REMARKER(expr_p, -slen, "%s", fr_strerror());
 
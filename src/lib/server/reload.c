@@ -0,0 +1,494 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/reload.c
+ * @brief Reload data parsed from a file when the file changes.
+ *
+ * Modules which parse large files at startup, e.g. rlm_files, can
+ * register the file here, with a function to parse it.  A single reload
+ * thread checks each file for changes, and when it has changed, parses
+ * it into a new version of the data.  Parsing happens in the reload
+ * thread, so requests continue to be processed using the old data until
+ * the new data is ready.
+ *
+ * The new version is then published with a single atomic store.  Workers
+ * never lock anything, they load the current pointer when they need it.
+ *
+ * Old versions can't be freed straight away, as a worker may still be
+ * using them.  They're reclaimed using epochs.  Each swap advances a
+ * global epoch, and the old version is tagged with the new value.  Each
+ * thread which calls fr_reload_data() records the epoch it last passed
+ * through a quiescent state, i.e. a point where it holds no pointers
+ * returned by fr_reload_data(), or zero when it's idle.  Once every
+ * thread is either idle, or has passed through a quiescent state since
+ * the swap, the old version is freed by the reload thread.
+ *
+ * Workers report quiescent states between requests, so callers of
+ * fr_reload_data() must not keep the pointer across a yield.  Other
+ * threads which read the data should call fr_reload_thread_quiescent()
+ * or fr_reload_thread_offline() periodically.  A thread which never
+ * does only delays freeing old versions, it never causes them to be
+ * freed early.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/server/main_config.h>
+#include <freeradius-devel/server/reload.h>
+
+#include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+/** A version of the data which has been replaced, but may still be in use
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< In the list of retired versions.
+	uint64_t		epoch;		//!< Readers must reach before it's freed.
+	TALLOC_CTX		*ctx;		//!< Containing the data.
+} fr_reload_retired_t;
+
+/** Per-thread record of which epoch the thread was last quiescent in
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< In the list of readers.
+	atomic_uint_fast64_t	epoch;		//!< Last quiescent epoch, or 0 if idle.
+} fr_reload_reader_t;
+
+struct fr_reload_s {
+	fr_dlist_t		entry;		//!< In the list of files being checked.
+
+	char const		*name;		//!< For log messages, e.g. the module name.
+	char const		*filename;	//!< Which is checked for changes.
+
+	fr_reload_load_t	load_func;	//!< Called to parse a new version.
+	void			*uctx;		//!< Passed to load_func.
+
+	fr_time_delta_t		interval;	//!< How often to check the file.
+	fr_time_t		next;		//!< When the file should next be checked.
+
+	struct stat		sb;		//!< Of the file when it was last loaded.
+
+	_Atomic(void *)		data;		//!< The current version.
+	TALLOC_CTX		*data_ctx;	//!< Containing the current version.
+
+	fr_dlist_head_t		retired;	//!< Old versions, waiting to be freed.
+};
+
+static pthread_mutex_t	reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	reload_cond = PTHREAD_COND_INITIALIZER;
+static fr_dlist_head_t	reload_list;		//!< Of files being checked.
+static bool		reload_thread_running;
+static bool		reload_thread_stop;
+static pthread_t	reload_thread;
+
+static atomic_uint_fast64_t	reload_epoch = 1;	//!< 0 is reserved for idle readers.
+
+static _Thread_local fr_reload_reader_t *reload_reader;
+
+static pthread_mutex_t	reload_reader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t	reload_reader_list;
+static bool		reload_reader_list_init = false;
+
+static int _reload_reader_free(void *uctx)
+{
+	fr_reload_reader_t *reader = uctx;
+
+	pthread_mutex_lock(&reload_reader_mutex);
+	fr_dlist_remove(&reload_reader_list, reader);
+	pthread_mutex_unlock(&reload_reader_mutex);
+
+	free(reader);
+	reload_reader = NULL;
+
+	return 0;
+}
+
+/** Register this thread as a reader
+ *
+ * The reader is malloc'd, rather than talloc'd, because it's read by
+ * the reload thread.
+ */
+static fr_reload_reader_t *reload_reader_alloc(void)
+{
+	fr_reload_reader_t *reader;
+
+	if (fr_atexit_thread_is_exiting()) return NULL;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader) return NULL;
+
+	atomic_init(&reader->epoch, 0);
+
+	pthread_mutex_lock(&reload_reader_mutex);
+	if (!reload_reader_list_init) {
+		fr_dlist_init(&reload_reader_list, fr_reload_reader_t, entry);
+		reload_reader_list_init = true;
+	}
+	fr_dlist_insert_tail(&reload_reader_list, reader);
+	pthread_mutex_unlock(&reload_reader_mutex);
+
+	fr_atexit_thread_local(reload_reader, _reload_reader_free, reader);
+
+	return reader;
+}
+
+/** Whether every reader has moved on from epochs before the one given
+ *
+ */
+static bool reload_epoch_reached(uint64_t epoch)
+{
+	bool reached = true;
+
+	pthread_mutex_lock(&reload_reader_mutex);
+	if (reload_reader_list_init) {
+		fr_dlist_foreach(&reload_reader_list, fr_reload_reader_t, reader) {
+			uint64_t seen = atomic_load_explicit(&reader->epoch, memory_order_acquire);
+
+			if (seen && (seen < epoch)) {
+				reached = false;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&reload_reader_mutex);
+
+	return reached;
+}
+
+/** Whether a file has changed since it was last loaded
+ *
+ * Files which have only just changed are left alone for another pass,
+ * so that we're less likely to read a file which is still being written.
+ * Files should still be updated by writing a new file, and renaming it
+ * over the old one.
+ */
+static bool reload_file_changed(fr_reload_t *reload, struct stat *sb)
+{
+	if (stat(reload->filename, sb) < 0) return false;
+
+	if ((sb->st_mtime == reload->sb.st_mtime) &&
+	    (sb->st_size == reload->sb.st_size) &&
+	    (sb->st_ino == reload->sb.st_ino) &&
+	    (sb->st_dev == reload->sb.st_dev)) return false;
+
+	if ((time(NULL) - sb->st_mtime) < 1) return false;
+
+	return true;
+}
+
+/** Parse a new version of the data, and swap it in
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The current version is unchanged.
+ */
+static int reload_load(fr_reload_t *reload, struct stat const *sb)
+{
+	TALLOC_CTX		*ctx;
+	void			*data = NULL;
+	fr_reload_retired_t	*retired;
+
+	ctx = talloc_named_const(NULL, 0, reload->name);
+	if (!ctx) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	if (reload->load_func(&data, ctx, reload->filename, reload->uctx) < 0) {
+		talloc_free(ctx);
+		return -1;
+	}
+
+	reload->sb = *sb;
+
+	/*
+	 *	First version, allocated from fr_reload_alloc(),
+	 *	so nothing can be using the data yet.
+	 */
+	if (!reload->data_ctx) {
+		reload->data_ctx = ctx;
+		atomic_store_explicit(&reload->data, data, memory_order_release);
+		return 0;
+	}
+
+	retired = talloc_zero(NULL, fr_reload_retired_t);
+	if (!retired) {
+		fr_strerror_const("Out of memory");
+		talloc_free(ctx);
+		return -1;
+	}
+	retired->ctx = reload->data_ctx;
+
+	reload->data_ctx = ctx;
+	atomic_store_explicit(&reload->data, data, memory_order_seq_cst);
+
+	/*
+	 *	Readers which pass through a quiescent state after
+	 *	this can only see the new version.
+	 */
+	retired->epoch = atomic_fetch_add_explicit(&reload_epoch, 1, memory_order_seq_cst) + 1;
+	fr_dlist_insert_tail(&reload->retired, retired);
+
+	return 0;
+}
+
+/** Free old versions which can no longer be in use
+ *
+ */
+static void reload_retired_free(fr_reload_t *reload, bool all)
+{
+	fr_reload_retired_t	*retired;
+
+	while ((retired = fr_dlist_head(&reload->retired))) {
+		if (!all && !reload_epoch_reached(retired->epoch)) break;
+
+		fr_dlist_remove(&reload->retired, retired);
+		talloc_free(retired->ctx);
+		talloc_free(retired);
+	}
+}
+
+static void *reload_thread_main(UNUSED void *uctx)
+{
+	pthread_mutex_lock(&reload_mutex);
+	while (!reload_thread_stop) {
+		struct timespec	ts;
+		fr_time_t	now = fr_time();
+
+		fr_dlist_foreach(&reload_list, fr_reload_t, reload) {
+			struct stat sb;
+
+			reload_retired_free(reload, false);
+
+			if (fr_time_lt(now, reload->next)) continue;
+			reload->next = fr_time_add(now, reload->interval);
+
+			if (!reload_file_changed(reload, &sb)) continue;
+
+			INFO("%s - Reloading %s", reload->name, reload->filename);
+			if (reload_load(reload, &sb) < 0) {
+				PERROR("%s - Failed reloading %s, continuing to use the previous version",
+				       reload->name, reload->filename);
+
+				/*
+				 *	Don't try again until the file
+				 *	changes again.
+				 */
+				reload->sb = sb;
+				continue;
+			}
+			INFO("%s - Reloaded %s", reload->name, reload->filename);
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&reload_cond, &reload_mutex, &ts);
+	}
+	pthread_mutex_unlock(&reload_mutex);
+
+	return NULL;
+}
+
+static int _reload_free(fr_reload_t *reload)
+{
+	bool stop;
+
+	pthread_mutex_lock(&reload_mutex);
+	if (fr_dlist_entry_in_list(&reload->entry)) fr_dlist_remove(&reload_list, reload);
+	stop = reload_thread_running && (fr_dlist_num_elements(&reload_list) == 0);
+	if (stop) {
+		reload_thread_stop = true;
+		pthread_cond_signal(&reload_cond);
+	}
+	pthread_mutex_unlock(&reload_mutex);
+
+	if (stop) {
+		pthread_join(reload_thread, NULL);
+		reload_thread_running = false;
+		reload_thread_stop = false;
+	}
+
+	reload_retired_free(reload, true);
+	talloc_free(reload->data_ctx);
+
+	return 0;
+}
+
+/** Load data from a file, and reload it whenever the file changes
+ *
+ * The first version of the data is loaded before this function returns.
+ *
+ * Reloading is disabled when the server is producing a talloc memory
+ * report, as that needs talloc's NULL context tracking, which isn't
+ * thread safe.
+ *
+ * @param[in] ctx	to allocate the reload structure in.  Freeing it
+ *			frees all versions of the data.
+ * @param[in] name	to use in log messages.  Usually the module name.
+ * @param[in] filename	to load, and check for changes.
+ * @param[in] load	called to parse the file.
+ * @param[in] uctx	passed to load.
+ * @param[in] interval	how often to check the file for changes.
+ *			0 to never reload.
+ * @return
+ *	- A new reload structure.
+ *	- NULL if the file couldn't be loaded.
+ */
+fr_reload_t *fr_reload_alloc(TALLOC_CTX *ctx, char const *name, char const *filename,
+			     fr_reload_load_t load, void *uctx, fr_time_delta_t interval)
+{
+	fr_reload_t	*reload;
+	struct stat	sb;
+
+	reload = talloc_zero(ctx, fr_reload_t);
+	if (!reload) {
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+
+	reload->name = talloc_strdup(reload, name);
+	reload->filename = talloc_strdup(reload, filename);
+	if (!reload->name || !reload->filename) {
+		fr_strerror_const("Out of memory");
+	error:
+		talloc_free(reload);
+		return NULL;
+	}
+	reload->load_func = load;
+	reload->uctx = uctx;
+	reload->interval = interval;
+	fr_dlist_entry_init(&reload->entry);
+	fr_dlist_init(&reload->retired, fr_reload_retired_t, entry);
+
+	/*
+	 *	It's OK for the file to not exist yet, the load
+	 *	function decides what to do about that.
+	 */
+	if (stat(filename, &sb) < 0) memset(&sb, 0, sizeof(sb));
+
+	if (reload_load(reload, &sb) < 0) goto error;
+
+	talloc_set_destructor(reload, _reload_free);
+
+	if (!fr_time_delta_ispos(interval)) return reload;
+
+	if (main_config && main_config->talloc_memory_report) {
+		WARN("%s - Not reloading %s, as talloc_memory_report is enabled", name, filename);
+		return reload;
+	}
+
+	reload->next = fr_time_add(fr_time(), interval);
+
+	pthread_mutex_lock(&reload_mutex);
+	if (!reload_thread_running) {
+		int ret;
+
+		fr_dlist_init(&reload_list, fr_reload_t, entry);
+
+		ret = pthread_create(&reload_thread, NULL, reload_thread_main, NULL);
+		if (ret != 0) {
+			pthread_mutex_unlock(&reload_mutex);
+			WARN("%s - Not reloading %s, failed creating reload thread: %s",
+			     name, filename, fr_syserror(ret));
+			return reload;
+		}
+		reload_thread_running = true;
+	}
+	fr_dlist_insert_tail(&reload_list, reload);
+	pthread_mutex_unlock(&reload_mutex);
+
+	return reload;
+}
+
+/** Return the current version of the data
+ *
+ * The data must not be used after the caller yields, or after the
+ * calling thread reports a quiescent state, as it may be freed once a
+ * new version has been loaded.
+ *
+ * @param[in] reload	to return the data for.
+ * @return the current version of the data.
+ */
+void *fr_reload_data(fr_reload_t const *reload)
+{
+	fr_reload_reader_t *reader = reload_reader;
+
+	if (unlikely(!reader)) reader = reload_reader_alloc();
+
+	/*
+	 *	Going from idle to active has to be visible to the
+	 *	reload thread before we load the pointer.
+	 */
+	if (reader && !atomic_load_explicit(&reader->epoch, memory_order_relaxed)) {
+		atomic_store_explicit(&reader->epoch,
+				      atomic_load_explicit(&reload_epoch, memory_order_seq_cst),
+				      memory_order_seq_cst);
+	}
+
+	return atomic_load_explicit(&UNCONST(fr_reload_t *, reload)->data, memory_order_seq_cst);
+}
+
+/** Record that this thread holds no pointers returned by fr_reload_data()
+ *
+ * Is cheap enough to call between every request.  Does nothing if the
+ * thread is idle, or has never called fr_reload_data().
+ */
+void fr_reload_thread_quiescent(void)
+{
+	fr_reload_reader_t	*reader = reload_reader;
+	uint64_t		seen, epoch;
+
+	if (!reader) return;
+
+	/*
+	 *	Idle threads stay idle until they next call
+	 *	fr_reload_data().
+	 */
+	seen = atomic_load_explicit(&reader->epoch, memory_order_relaxed);
+	if (!seen) return;
+
+	epoch = atomic_load_explicit(&reload_epoch, memory_order_relaxed);
+	if (seen == epoch) return;
+
+	atomic_store_explicit(&reader->epoch, epoch, memory_order_release);
+}
+
+/** Record that this thread is idle, and holds no pointers returned by fr_reload_data()
+ *
+ * Should be called before a thread blocks waiting for events, so that
+ * idle threads don't prevent old versions being freed.
+ */
+void fr_reload_thread_offline(void)
+{
+	fr_reload_reader_t *reader = reload_reader;
+
+	if (!reader || !atomic_load_explicit(&reader->epoch, memory_order_relaxed)) return;
+
+	atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
@@ -0,0 +1,66 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/reload.h
+ * @brief Reload data parsed from a file when the file changes.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(reload_h, "$Id$")
+
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/talloc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_reload_s fr_reload_t;
+
+/** Load a new version of the data
+ *
+ * Is called once from fr_reload_alloc(), and then from the reload thread
+ * whenever the file changes.  It must not modify anything other than the
+ * data it allocates.
+ *
+ * @param[out] out	Where to write the new data.
+ * @param[in] ctx	To allocate the new data in.  Is freed when
+ *			the data is no longer in use.
+ * @param[in] filename	To load.
+ * @param[in] uctx	passed to fr_reload_alloc().
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The previous version of the data is kept.
+ */
+typedef int (*fr_reload_load_t)(void **out, TALLOC_CTX *ctx, char const *filename, void *uctx);
+
+fr_reload_t	*fr_reload_alloc(TALLOC_CTX *ctx, char const *name, char const *filename,
+				 fr_reload_load_t load, void *uctx, fr_time_delta_t interval)
+		CC_HINT(nonnull(2,3,4));
+
+void		*fr_reload_data(fr_reload_t const *reload) CC_HINT(nonnull);
+
+void		fr_reload_thread_quiescent(void);
+
+void		fr_reload_thread_offline(void);
+
+#ifdef __cplusplus
+}
+#endif
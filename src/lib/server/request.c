@@ -65,6 +65,16 @@ fr_dict_attr_autoload_t request_dict_attr[] = {
  */
 static _Thread_local fr_dlist_head_t *request_free_list; /* macro */
 
+/** Maximum number of requests to keep in the thread local free list
+ *
+ */
+static _Thread_local unsigned int request_free_list_max = 256;
+
+/** How often the thread local free list satisfied an allocation
+ *
+ */
+static _Thread_local request_free_list_stats_t request_free_list_counters;
+
 #ifndef NDEBUG
 static int _state_ctx_free(fr_pair_t *state)
 {
@@ -208,6 +218,7 @@ static inline CC_HINT(always_inline) int request_child_init(request_t *child, re
 	}
 	child->seq_start = 0;	/* children always start with their own sequence */
 	child->parent = parent;
+	child->deadline = parent->deadline;
 
 	/*
 	 *	For new server support.
@@ -352,6 +363,33 @@ static inline CC_HINT(always_inline) int request_init(char const *file, int line
 	return 0;
 }
 
+/** Reset a request and insert it into a free list
+ *
+ * @note The request's children must have been freed already.
+ *
+ * @param[in] free_list	to insert the request into.
+ * @param[in] request	to reset.
+ */
+static inline CC_HINT(always_inline) void request_free_list_insert(fr_dlist_head_t *free_list, request_t *request)
+{
+	memset(request, 0, sizeof(*request));
+	request->component = "free_list";
+#ifndef NDEBUG
+	/*
+	 *	So we don't trip heap asserts
+	 *	if the request is freed out of
+	 *	the free list.
+	 */
+	request->time_order_id = FR_HEAP_INDEX_INVALID;
+	request->runnable_id = FR_HEAP_INDEX_INVALID;
+#endif
+
+	/*
+	 *	Reinsert into the free list
+	 */
+	fr_dlist_insert_head(free_list, request);
+}
+
 /** Callback for freeing a request struct
  *
  * @param[in] request		to free or return to the free list.
@@ -389,7 +427,7 @@ static int _request_free(request_t *request)
 	 *	We keep a buffer of <active> + N requests per
 	 *	thread, to avoid spurious allocations.
 	 */
-	if (fr_dlist_num_elements(request_free_list) <= 256) {
+	if (fr_dlist_num_elements(request_free_list) < request_free_list_max) {
 		fr_dlist_head_t		*free_list;
 
 		if (request->session_state_ctx) {
@@ -403,23 +441,7 @@ static int _request_free(request_t *request)
 		 */
 		talloc_free_children(request);
 
-		memset(request, 0, sizeof(*request));
-		request->component = "free_list";
-#ifndef NDEBUG
-		/*
-		 *	So we don't trip heap asserts
-		 *	if the request is freed out of
-		 *	the free list.
-		 */
-		request->time_order_id = FR_HEAP_INDEX_INVALID;
-		request->runnable_id = FR_HEAP_INDEX_INVALID;
-#endif
-
-		/*
-		 *	Reinsert into the free list
-		 */
-		fr_dlist_insert_head(free_list, request);
-		request_free_list = free_list;
+		request_free_list_insert(free_list, request);
 
 		return -1;	/* Prevent free */
  	}
@@ -459,7 +481,14 @@ static int _request_free_list_free_on_exit(void *arg)
 	return talloc_free(list);
 }
 
-static inline CC_HINT(always_inline) request_t *request_alloc_pool(TALLOC_CTX *ctx)
+/** Rough number of talloc chunks needed per byte of pair pool
+ *
+ * Most pairs are a single chunk, strings and octets have a second
+ * chunk for their value.
+ */
+#define REQUEST_POOL_PAIR_CHUNKS(_size)	(((_size) / sizeof(fr_pair_t)) * 2)
+
+static inline CC_HINT(always_inline) request_t *request_alloc_pool(TALLOC_CTX *ctx, size_t pair_pool_size)
 {
 	request_t *request;
 
@@ -471,15 +500,26 @@ static inline CC_HINT(always_inline) request_t *request_alloc_pool(TALLOC_CTX *c
 	 *	hierarchy means that child requests
 	 *	cannot be returned to a free list
 	 *	and would have to be freed.
+	 *
+	 *	Pairs decoded into the request lists
+	 *	are carved from the remainder of the
+	 *	pool, and are all released at once
+	 *	when the request is recycled.  Pairs
+	 *	which are stolen out of the request
+	 *	(e.g. into session-state) keep the
+	 *	pool alive until they're freed, as
+	 *	per normal talloc pool semantics.
 	 */
 	MEM(request = talloc_pooled_object(ctx, request_t,
 					   1 + 					/* Stack pool */
 					   UNLANG_STACK_MAX + 			/* Stack Frames */
 					   2 + 					/* packets */
+					   REQUEST_POOL_PAIR_CHUNKS(pair_pool_size) + /* pairs */
 					   10,					/* extra */
 					   (UNLANG_FRAME_PRE_ALLOC * UNLANG_STACK_MAX) +	/* Stack memory */
 					   (sizeof(fr_pair_t) * 5) +		/* pair lists and root*/
 					   (sizeof(fr_packet_t) * 2) +	/* packets */
+					   pair_pool_size +			/* pairs */
 					   128					/* extra */
 					   ));
 	fr_assert(ctx != request);
@@ -487,6 +527,60 @@ static inline CC_HINT(always_inline) request_t *request_alloc_pool(TALLOC_CTX *c
 	return request;
 }
 
+/** Setup the free list, or return the free list for this thread
+ *
+ */
+static inline CC_HINT(always_inline) fr_dlist_head_t *request_free_list_get(void)
+{
+	fr_dlist_head_t *free_list;
+
+	if (likely(request_free_list != NULL)) return request_free_list;
+
+	MEM(free_list = talloc(NULL, fr_dlist_head_t));
+	fr_dlist_init(free_list, request_t, free_entry);
+	fr_atexit_thread_local(request_free_list, _request_free_list_free_on_exit, free_list);
+
+	return free_list;
+}
+
+/** Size and pre-allocate the free list for this thread
+ *
+ * Allocating requests at startup, instead of when the first packets
+ * arrive, avoids allocation latency when there's a burst of traffic
+ * (e.g. after a failover) to a server that's been idle.
+ *
+ * @param[in] max		Maximum number of requests to keep in the free list.
+ * @param[in] prealloc		How many requests to allocate now.  Capped at max.
+ * @param[in] pair_pool_size	Space to reserve in each preallocated request for pairs.
+ *				See #request_init_args_t.
+ */
+void request_free_list_init(unsigned int max, unsigned int prealloc, size_t pair_pool_size)
+{
+	fr_dlist_head_t *free_list = request_free_list_get();
+
+	request_free_list_max = max;
+	if (prealloc > max) prealloc = max;
+
+	while (fr_dlist_num_elements(free_list) < prealloc) {
+		request_t *request;
+
+		request = request_alloc_pool(NULL, pair_pool_size);
+		talloc_set_destructor(request, _request_free);
+
+		request_free_list_insert(free_list, request);
+	}
+}
+
+/** Return the free list counters for this thread
+ *
+ * The counters are thread local, but the pointer returned remains valid
+ * for the lifetime of the thread, so it may be stashed by the caller.
+ */
+request_free_list_stats_t const *request_free_list_stats(void)
+{
+	return &request_free_list_counters;
+}
+
 /** Create a new request_t data structure
  *
  * @param[in] file	where the request was allocated.
@@ -506,17 +600,7 @@ request_t *_request_alloc(char const *file, int line, TALLOC_CTX *ctx,
 
 	if (!args) args = &default_args;
 
-	/*
-	 *	Setup the free list, or return the free
-	 *	list for this thread.
-	 */
-	if (unlikely(!request_free_list)) {
-		MEM(free_list = talloc(NULL, fr_dlist_head_t));
-		fr_dlist_init(free_list, request_t, free_entry);
-		fr_atexit_thread_local(request_free_list, _request_free_list_free_on_exit, free_list);
-	} else {
-		free_list = request_free_list;
-	}
+	free_list = request_free_list_get();
 
 	request = fr_dlist_head(free_list);
 	if (!request) {
@@ -524,14 +608,16 @@ request_t *_request_alloc(char const *file, int line, TALLOC_CTX *ctx,
 		 *	Must be allocated with in the NULL ctx
 		 *	as chunk is returned to the free list.
 		 */
-		request = request_alloc_pool(NULL);
+		request = request_alloc_pool(NULL, args->pair_pool_size);
 		talloc_set_destructor(request, _request_free);
+		request_free_list_counters.misses++;
 	} else {
 		/*
 		 *	Remove from the free list, as we're
 		 *	about to use it!
 		 */
 		fr_dlist_remove(free_list, request);
+		request_free_list_counters.hits++;
 	}
 
 	if (request_init(file, line, request, type, args) < 0) {
@@ -612,7 +698,7 @@ request_t *_request_local_alloc(char const *file, int line, TALLOC_CTX *ctx,
 
 	if (!args) args = &default_args;
 
-	request = request_alloc_pool(ctx);
+	request = request_alloc_pool(ctx, args->pair_pool_size);
 	if (request_init(file, line, request, type, args) < 0) return NULL;
 
 	talloc_set_destructor(request, _request_local_free);
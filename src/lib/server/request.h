@@ -240,6 +240,10 @@ struct request_s {
 
 	fr_async_t		*async;		//!< for new async listeners
 
+	fr_time_t		deadline;	//!< After which the reply won't be used, so there's
+						///< no point doing any more work for this request.
+						///< Zero if there is no deadline.
+
 	char const		*alloc_file;	//!< File the request was allocated in.
 
 	int			alloc_line;	//!< Line the request was allocated on.
@@ -263,6 +267,11 @@ typedef struct {
 
 	bool			detachable;	//!< Request should be detachable, i.e. able to run even
 						///< if its parent exits.
+
+	size_t			pair_pool_size;	//!< Additional space to reserve in the request's talloc
+						///< pool for pairs and their values.  Only used when a
+						///< new request is allocated, not when one is taken from
+						///< the free list.
 } request_init_args_t;
 
 #ifdef WITH_VERIFY_PTR
@@ -308,6 +317,18 @@ typedef struct {
 request_t	*_request_alloc(char const *file, int line, TALLOC_CTX *ctx,
 				request_type_t type, request_init_args_t const *args);
 
+/** Counters for the thread local request free list
+ *
+ */
+typedef struct {
+	uint64_t		hits;		//!< Requests taken from the free list.
+	uint64_t		misses;		//!< Requests which had to be allocated.
+} request_free_list_stats_t;
+
+void		request_free_list_init(unsigned int max, unsigned int prealloc, size_t pair_pool_size);
+
+request_free_list_stats_t const *request_free_list_stats(void);
+
 /** Allocate a new external request outside of the request pool
  *
  * @param[in] _ctx	Talloc ctx to allocate the request in.
@@ -336,6 +357,33 @@ void		request_global_free(void);
 
 void		request_log_prepend(request_t *request, fr_log_t *log, fr_log_lvl_t lvl);
 
+/** Limit a timeout to the time the request has left
+ *
+ * @param[in] request	the timeout is for.
+ * @param[in] timeout	configured for the operation.  Zero means no timeout.
+ * @return The smaller of timeout, and the time until the request's deadline.
+ *	May be zero or negative if the deadline has passed.
+ */
+static inline fr_time_delta_t request_deadline_timeout(request_t const *request, fr_time_delta_t timeout)
+{
+	fr_time_delta_t	left;
+
+	if (!request || !fr_time_ispos(request->deadline)) return timeout;
+
+	left = fr_time_sub(request->deadline, fr_time());
+	if (!fr_time_delta_ispos(timeout)) return left;
+
+	return fr_time_delta_lt(left, timeout) ? left : timeout;
+}
+
+/** Whether the request's deadline has passed
+ *
+ */
+static inline bool request_expired(request_t const *request, fr_time_t now)
+{
+	return request && fr_time_ispos(request->deadline) && fr_time_gt(now, request->deadline);
+}
+
 #ifdef WITH_VERIFY_PTR
 void		request_verify(char const *file, int line, request_t const *request);	/* only for special debug builds */
 #endif
@@ -46,18 +46,28 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/server/memory.h>
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/server/request_data.h>
 #include <freeradius-devel/server/state.h>
 
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/io/listen.h>
 
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 /** Holds a state value, and associated fr_pair_ts and data
  *
  */
@@ -115,11 +125,15 @@ typedef struct {
 	int			tries;
 
 	fr_pair_t		*ctx;				//!< for all session specific data.
+	uint8_t			*compact;			//!< session-state pairs in internal format,
+								///< also parented by ctx.
 
 	fr_dlist_head_t		data;				//!< Persistable request data, also parented by ctx.
 
 	request_t		*thawed;			//!< The request that thawed this entry.
 
+	size_t			size;				//!< Memory accounted to the tree for this entry.
+
 	fr_state_tree_t		*state_tree;			//!< Tree this entry belongs to.
 } fr_state_entry_t;
 
@@ -142,31 +156,65 @@ typedef struct {
 	request_t		*thawed;			//!< The request that thawed this entry.
 } state_child_entry_t;
 
+/** A subset of the state entries, with its own lock
+ *
+ * Entries are assigned to a shard by hashing their state value, so
+ * rounds of different sessions rarely contend for the same mutex.
+ */
+typedef struct {
+	fr_rb_tree_t		*tree;				//!< rbtree used to lookup state value.
+	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+} fr_state_shard_t;
+
+/** Number of shards a thread safe state tree is split into.  Must be a power of 2.
+ */
+#define STATE_TREE_SHARDS	16
+
 struct fr_state_tree_s {
-	uint64_t		id;				//!< Next ID to assign.
-	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
+	_Atomic(uint64_t)	id;				//!< Next ID to assign.
+	_Atomic(uint64_t)	timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
 	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	uint32_t		used_sessions;			//!< How many sessions are currently in progress.
-	fr_rb_tree_t		*tree;				//!< rbtree used to lookup state value.
-	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+	_Atomic(uint32_t)	used_sessions;			//!< How many sessions are currently in progress.
+	_Atomic(uint64_t)	used_bytes;			//!< Memory used by the stored session-state.
+
+	fr_state_shard_t	*shard;				//!< Array of shards, each holding part of the tree.
+	uint32_t		num_shards;			//!< How many shards there are.
 
 	fr_time_delta_t		timeout;			//!< How long to wait before cleaning up state entries.
 
-	bool			thread_safe;			//!< Whether we lock the tree whilst modifying it.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	bool			thread_safe;			//!< Whether we lock the shards whilst modifying them.
+	bool			compact;			//!< Whether session-state pairs are stored
+								///< encoded between rounds.
+	bool			intern;				//!< Whether string and octets values
+								///< are interned between rounds.
 
 	uint8_t			server_id;			//!< ID to use for load balancing.
 	uint32_t		context_id;			//!< ID binding state values to a context such
 								///< as a virtual server.
 
 	fr_dict_attr_t const	*da;				//!< State attribute used.
+
+	fr_metrics_source_t	*metrics;			//!< Our entry in the metrics registry.
+	fr_memory_source_t	*memory;			//!< Our entry in the memory accounting registry.
 };
 
 #define PTHREAD_MUTEX_LOCK if (state->thread_safe) pthread_mutex_lock
 #define PTHREAD_MUTEX_UNLOCK if (state->thread_safe) pthread_mutex_unlock
 
-static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+static void state_entry_unlink(fr_state_shard_t *shard, fr_state_entry_t *entry);
+
+/** Return the shard holding a particular state value
+ *
+ */
+static inline CC_HINT(always_inline)
+fr_state_shard_t *state_shard(fr_state_tree_t *state, fr_state_entry_t const *entry)
+{
+	if (state->num_shards == 1) return &state->shard[0];
+
+	return &state->shard[fr_hash(entry->state, sizeof(entry->state)) & (state->num_shards - 1)];
+}
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -180,27 +228,87 @@ static int8_t state_entry_cmp(void const *one, void const *two)
 	return CMP(ret, 0);
 }
 
+static fr_metric_family_t const state_metric_tracked = {
+	.name = "freeradius_state_entries_tracked", .type = FR_METRIC_GAUGE,
+	.help = "Multi-round sessions currently being tracked."
+};
+static fr_metric_family_t const state_metric_created = {
+	.name = "freeradius_state_entries_created", .type = FR_METRIC_COUNTER,
+	.help = "Multi-round sessions which have been started."
+};
+static fr_metric_family_t const state_metric_timeout = {
+	.name = "freeradius_state_entries_timeout", .type = FR_METRIC_COUNTER,
+	.help = "Multi-round sessions which were cleaned up because they timed out."
+};
+static fr_metric_family_t const state_metric_max = {
+	.name = "freeradius_state_entries_max", .type = FR_METRIC_GAUGE,
+	.help = "Maximum number of multi-round sessions which can be tracked."
+};
+
+/** Add the state tree's counters to a scrape
+ *
+ * fr_state_entries_tracked() locks every shard, so we use the atomic
+ * session count instead.  It counts the same sessions, but can be read
+ * without blocking the workers.
+ */
+static void state_tree_metrics(fr_metrics_t *m, void const *uctx)
+{
+	fr_state_tree_t *state = UNCONST(fr_state_tree_t *, uctx);
+	char		context[9];
+
+	snprintf(context, sizeof(context), "%08" PRIx32, state->context_id);
+
+	fr_metrics_add(m, &state_metric_tracked, atomic_load(&state->used_sessions),
+		       "attribute", state->da->name, "context", context, NULL);
+	fr_metrics_add(m, &state_metric_created, atomic_load(&state->id),
+		       "attribute", state->da->name, "context", context, NULL);
+	fr_metrics_add(m, &state_metric_timeout, atomic_load(&state->timed_out),
+		       "attribute", state->da->name, "context", context, NULL);
+	fr_metrics_add(m, &state_metric_max, state->max_sessions,
+		       "attribute", state->da->name, "context", context, NULL);
+}
+
+/** Add the stored session-state to a memory report
+ *
+ */
+static void state_tree_memory(fr_memory_usage_t *usage, void const *uctx)
+{
+	fr_state_tree_t *state = UNCONST(fr_state_tree_t *, uctx);
+
+	usage->bytes += atomic_load(&state->used_bytes);
+	usage->blocks += atomic_load(&state->used_sessions);
+}
+
 /** Free the state tree
  *
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
-	fr_state_entry_t *entry;
-
-	if (state->thread_safe) pthread_mutex_destroy(&state->mutex);
+	fr_state_entry_t	*entry;
+	fr_state_shard_t	*shard;
+	uint32_t		i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while ((entry = fr_dlist_head(&state->to_expire))) {
-		DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
-		state_entry_unlink(state, entry);
-		talloc_free(entry);
-	}
+	TALLOC_FREE(state->metrics);
+	TALLOC_FREE(state->memory);
 
-	/*
-	 *	Free the rbtree
-	 */
-	talloc_free(state->tree);
+	for (i = 0; i < state->num_shards; i++) {
+		shard = &state->shard[i];
+
+		if (state->thread_safe) pthread_mutex_destroy(&shard->mutex);
+
+		while ((entry = fr_dlist_head(&shard->to_expire))) {
+			DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
+			state_entry_unlink(shard, entry);
+			talloc_free(entry);
+		}
+
+		/*
+		 *	Free the rbtree
+		 */
+		talloc_free(shard->tree);
+	}
 
 	return 0;
 }
@@ -224,6 +332,7 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 				    uint8_t server_id, uint32_t context_id)
 {
 	fr_state_tree_t *state;
+	uint32_t	i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
@@ -240,47 +349,107 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 	 */
 	talloc_link_ctx(ctx, state);
 
-	if (thread_safe && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
-
-	fr_dlist_talloc_init(&state->to_expire, fr_state_entry_t, free_entry);
-
 	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
+	 *	Only split the tree up if multiple threads
+	 *	will be using it.
 	 */
-	state->tree = fr_rb_inline_talloc_alloc(NULL, fr_state_entry_t, node, state_entry_cmp, NULL);
-	if (!state->tree) {
+	state->num_shards = thread_safe ? STATE_TREE_SHARDS : 1;
+	state->shard = talloc_zero_array(state, fr_state_shard_t, state->num_shards);
+	if (!state->shard) {
 		talloc_free(state);
 		return NULL;
 	}
 	talloc_set_destructor(state, _state_tree_free);
 
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shard[i];
+
+		fr_dlist_talloc_init(&shard->to_expire, fr_state_entry_t, free_entry);
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	rbtree, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->tree = fr_rb_inline_talloc_alloc(NULL, fr_state_entry_t, node, state_entry_cmp, NULL);
+		if (!shard->tree) {
+		fail:
+			state->num_shards = i;	/* Only clean up the shards we initialised */
+			talloc_free(state);
+			return NULL;
+		}
+
+		if (thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(shard->tree);
+			goto fail;
+		}
+	}
+
 	state->da = da;		/* Remember which attribute we use to load/store state */
 	state->server_id = server_id;
 	state->context_id = context_id;
 	state->thread_safe = thread_safe;
 
+	MEM(state->metrics = fr_metrics_source_alloc(state, state_tree_metrics, state));
+	{
+		char *name;
+
+		MEM(name = talloc_asprintf(NULL, "%s.%08" PRIx32, da->name, context_id));
+		MEM(state->memory = fr_memory_source_alloc(state, "state", name, state_tree_memory, state));
+		talloc_free(name);
+	}
+
 	return state;
 }
 
+/** Store session-state pairs encoded between rounds
+ *
+ * The pairs are encoded with the internal encoder when the entry is
+ * created, and decoded again when the next round thaws the entry.
+ * This uses much less memory than keeping the pairs themselves.
+ *
+ * @note Must be called before the tree is used.
+ *
+ * @param[in] state	tree to change.
+ * @param[in] compact	whether session-state is encoded.
+ */
+void fr_state_tree_compact_set(fr_state_tree_t *state, bool compact)
+{
+	state->compact = compact;
+}
+
+/** Intern string and octets session-state values between rounds
+ *
+ * Sessions often carry the same values, e.g. the NAS-Identifier or
+ * Called-Station-Id of the NAS they came from.  With interning, the
+ * entries holding a value share a single copy of it.
+ *
+ * Session-state which is compacted is not interned.
+ *
+ * @note Must be called before the tree is used.
+ *
+ * @param[in] state	tree to change.
+ * @param[in] intern	whether session-state values are interned.
+ */
+void fr_state_tree_intern_set(fr_state_tree_t *state, bool intern)
+{
+	state->intern = intern;
+}
+
 /** Unlink an entry and remove if from the tree
  *
  */
 static inline CC_HINT(always_inline)
-void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
+void state_entry_unlink(fr_state_shard_t *shard, fr_state_entry_t *entry)
 {
 	/*
 	 *	Check the memory is still valid
 	 */
 	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 
-	fr_dlist_remove(&state->to_expire, entry);
-	fr_rb_delete(state->tree, entry);
+	fr_dlist_remove(&shard->to_expire, entry);
+	fr_rb_delete(shard->tree, entry);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
@@ -318,25 +487,202 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	 */
 	if (entry->ctx) TALLOC_FREE(entry->ctx);
 
+	atomic_fetch_sub(&entry->state_tree->used_bytes, entry->size);
+	entry->size = 0;
+
 	DEBUG4("State ID %" PRIu64 " freed", entry->id);
 
-	entry->state_tree->used_sessions--;
+	atomic_fetch_sub(&entry->state_tree->used_sessions, 1);
 
 	return 0;
 }
 
-/** Create a new state entry
+/** Reserve a session, if we're not at the limit
+ *
+ */
+static inline CC_HINT(always_inline)
+bool state_session_reserve(fr_state_tree_t *state)
+{
+	uint32_t used = atomic_load(&state->used_sessions);
+
+	do {
+		if (used >= state->max_sessions) return false;
+	} while (!atomic_compare_exchange_weak(&state->used_sessions, &used, used + 1));
+
+	return true;
+}
+
+/** Move expired entries from a shard to a list of entries to free
+ *
+ * @note Called with the shard mutex held.
+ *
+ * @return the number of entries which expired.
+ */
+static uint64_t state_shard_expire(fr_state_shard_t *shard, fr_dlist_head_t *to_free, fr_time_t now)
+{
+	fr_state_entry_t	*entry, *next;
+	uint64_t		timed_out = 0;
+
+	for (entry = fr_dlist_head(&shard->to_expire);
+	     entry != NULL;
+	     entry = next) {
+ 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
+		next = fr_dlist_next(&shard->to_expire, entry);		/* Advance *before* potential unlinking */
+
+		/*
+		 *	Too old, we can delete it.
+		 */
+		if (fr_time_lt(entry->cleanup, now)) {
+			state_entry_unlink(shard, entry);
+			fr_dlist_insert_tail(to_free, entry);
+			timed_out++;
+			continue;
+		}
+
+		break;
+	}
+
+	return timed_out;
+}
+
+/** Free entries which have been unlinked from their shards
+ *
+ * We do it outside of the critical region as freeing may involve
+ * significantly more work than just freeing the data.
+ *
+ * If there's request data that was persisted it will now be freed
+ * also, and it may have complex destructors associated with it.
  *
- * @note Called with the mutex held.
+ * @note Called with no mutexes held.
+ */
+static void state_entries_free(fr_dlist_head_t *to_free)
+{
+	fr_state_entry_t *entry;
+
+	while ((entry = fr_dlist_head(to_free)) != NULL) {
+		fr_dlist_remove(to_free, entry);
+		talloc_free(entry);
+	}
+}
+
+/** Encode session-state pairs, and free the originals
+ *
+ * The pairs are decoded relative to the dictionary of the State
+ * attribute, so sessions containing pairs from any other protocol
+ * (or from a local dictionary) are left alone.
+ *
+ * @param[in] state		tree the entry will be inserted into.
+ * @param[in] request		the session-state came from.
+ * @param[in] state_ctx		holding the session-state pairs.
+ * @return
+ *	- The encoded pairs, parented by state_ctx.
+ *	- NULL if the pairs were left as they are.
+ */
+static uint8_t *state_compact(fr_state_tree_t *state, request_t *request, fr_pair_t *state_ctx)
+{
+	fr_dict_t const			*dict = fr_dict_by_da(state->da);
+	fr_internal_encode_ctx_t	encode_ctx = { .allow_name_only = true };
+	fr_dbuff_t			dbuff;
+	fr_dbuff_uctx_talloc_t		tctx;
+	uint8_t				*compact;
+
+	if (fr_pair_list_empty(&state_ctx->children)) return NULL;
+
+	fr_pair_list_foreach(&state_ctx->children, vp) {
+		fr_dict_t const *vp_dict = fr_dict_by_da(vp->da);
+
+		if ((vp_dict != dict) && (vp_dict != fr_dict_internal())) {
+			RDEBUG3("Not compacting &session-state - &%s is from another dictionary", vp->da->name);
+			return NULL;
+		}
+	}
+
+	if (!fr_dbuff_init_talloc(state_ctx, &dbuff, &tctx, 256, SIZE_MAX)) return NULL;
+
+	if ((fr_internal_encode_list(&dbuff, &state_ctx->children, &encode_ctx) <= 0) ||
+	    !(compact = talloc_realloc(state_ctx, fr_dbuff_buff(&dbuff), uint8_t, fr_dbuff_used(&dbuff)))) {
+		RPWDEBUG("Failed compacting &session-state");
+		talloc_free(fr_dbuff_buff(&dbuff));
+		return NULL;
+	}
+
+	fr_pair_list_free(&state_ctx->children);
+
+	RDEBUG3("Compacted &session-state to %zu bytes", talloc_array_length(compact));
+
+	return compact;
+}
+
+/** Intern the values of session-state pairs
+ *
+ * @param[in] request		the pairs came from.
+ * @param[in] state_ctx		holding the session-state pairs.
+ */
+static void state_intern(request_t *request, fr_pair_t *state_ctx)
+{
+	fr_pair_list_foreach_leaf(&state_ctx->children, vp) {
+		if (fr_value_box_intern(&vp->data) < 0) {
+			RPWDEBUG("Failed interning &session-state");
+			return;
+		}
+	}
+}
+
+/** Decode compacted session-state pairs into the request
+ *
+ * @param[in] state		tree the entry came from.
+ * @param[in] request		to add the session-state pairs to.
+ * @param[in] compact		encoded pairs.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int state_expand(fr_state_tree_t *state, request_t *request, uint8_t const *compact)
+{
+	fr_pair_list_t	tmp;
+
+	fr_pair_list_init(&tmp);
+
+	if (fr_internal_decode_list_dbuff(request->session_state_ctx, &tmp, fr_dict_root(fr_dict_by_da(state->da)),
+					  &FR_DBUFF_TMP(compact, talloc_array_length(compact)), NULL) < 0) {
+		RPERROR("Failed restoring &session-state");
+		fr_pair_list_free(&tmp);
+		return -1;
+	}
+
+	fr_pair_list_append(&request->session_state_pairs, &tmp);
+
+	return 0;
+}
+
+/** Create a new state entry, and insert it into the state tree
+ *
+ * @note Called with no mutexes held.
+ *
+ * @param[in] state		tree to insert the entry into.
+ * @param[in] request		the entry is being created for.
+ * @param[in] reply_list	to add the State attribute to.
+ * @param[in] old		entry to reuse, if any.
+ * @param[in] state_ctx		holding the session-state pairs.  Owned by the
+ *				entry on success.
+ * @param[in] compact		encoded session-state pairs, parented by state_ctx.
+ *				May be NULL.
+ * @param[in,out] data		persistable request data.  Moved to the entry
+ *				on success.
+ * @return
+ *	- The new entry.
+ *	- NULL on failure.
  */
 static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request,
-					    fr_pair_list_t *reply_list, fr_state_entry_t *old)
+					    fr_pair_list_t *reply_list, fr_state_entry_t *old,
+					    fr_pair_t *state_ctx, uint8_t *compact, fr_dlist_head_t *data)
 {
 	size_t			i;
 	uint32_t		x;
 	fr_time_t		now = fr_time();
 	fr_pair_t		*vp;
-	fr_state_entry_t	*entry, *next;
+	fr_state_entry_t	*entry;
+	fr_state_shard_t	*shard;
 
 	uint8_t			old_state[sizeof(old->state)];
 	int			old_tries = 0;
@@ -353,68 +699,39 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 
 	fr_dlist_init(&to_free, fr_state_entry_t, free_entry);
 
-	/*
-	 *	Clean up expired entries
-	 */
-	for (entry = fr_dlist_head(&state->to_expire);
-	     entry != NULL;
-	     entry = next) {
- 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
-		next = fr_dlist_next(&state->to_expire, entry);		/* Advance *before* potential unlinking */
-
-		if (entry == old) continue;
-
+	if (!old) {
 		/*
-		 *	Too old, we can delete it.
+		 *	We're at the limit.  Expired entries are
+		 *	normally cleaned up from one shard at a time
+		 *	as new entries are inserted, so check all of
+		 *	them before giving up.
 		 */
-		if (fr_time_lt(entry->cleanup, now)) {
-			state_entry_unlink(state, entry);
-			fr_dlist_insert_tail(&to_free, entry);
-			timed_out++;
-			continue;
-		}
-
-		break;
-	}
+		if (!state_session_reserve(state)) {
+			for (i = 0; i < state->num_shards; i++) {
+				shard = &state->shard[i];
 
-	state->timed_out += timed_out;
+				PTHREAD_MUTEX_LOCK(&shard->mutex);
+				timed_out += state_shard_expire(shard, &to_free, now);
+				PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+			}
+			state_entries_free(&to_free);
 
-	if (!old) {
-		too_many = (state->used_sessions == (uint32_t) state->max_sessions);
-		if (!too_many) state->used_sessions++;	/* preemptively increment whilst we hold the mutex */
+			too_many = !state_session_reserve(state);
+		}
 	} else {
 		old_tries = old->tries;
 		memcpy(old_state, old->state, sizeof(old_state));
 	}
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
-
-	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
-
-	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
-	 */
-	while ((entry = fr_dlist_head(&to_free)) != NULL) {
-		fr_dlist_remove(&to_free, entry);
-		talloc_free(entry);
-	}
-
 	/*
 	 *	Have to do this post-cleanup, else we end up returning with
 	 *	a list full of entries to free with none of them being
 	 *	freed which is bad...
 	 */
 	if (too_many) {
+		atomic_fetch_add(&state->timed_out, timed_out);
 		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
 		       state->max_sessions);
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
 		return NULL;
 	}
 
@@ -435,13 +752,19 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		talloc_free_children(old);
 		memset(old, 0, sizeof(*old));
 		entry = old;
+
+		/*
+		 *	The session is still in progress, so undo
+		 *	the decrement done by _state_entry_free().
+		 */
+		atomic_fetch_add(&state->used_sessions, 1);
 	}
 
 	entry->state_tree = state;
 
 	request_data_list_init(&entry->data);
 
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add(&state->id, 1);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -531,8 +854,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	       entry->id, fr_box_octets(entry->state, sizeof(entry->state)),
 	       fr_box_time_delta(fr_time_sub(entry->cleanup, now)));
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -541,28 +862,73 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	 */
 	*((uint32_t *)(&entry->state_comp.context_id)) ^= state->context_id;
 
-	if (!fr_rb_insert(state->tree, entry)) {
+	/*
+	 *	Fill in everything before the entry becomes
+	 *	visible to other threads.
+	 */
+	entry->seq_start = request->seq_start;
+	entry->ctx = state_ctx;
+	entry->compact = compact;
+	fr_dlist_move(&entry->data, data);
+
+	/*
+	 *	The session-state is only touched by this thread
+	 *	until the entry is inserted, so it's safe to walk.
+	 */
+	entry->size = sizeof(*entry) + (state_ctx ? talloc_total_size(state_ctx) : 0);
+	atomic_fetch_add(&state->used_bytes, entry->size);
+
+	shard = state_shard(state, entry);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	/*
+	 *	Clean up expired entries
+	 */
+	timed_out += state_shard_expire(shard, &to_free, now);
+
+	if (!fr_rb_insert(shard->tree, entry)) {
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		RERROR("Failed inserting state entry - Insertion into state tree failed");
 		fr_pair_delete_by_da(reply_list, state->da);
+
+		/*
+		 *	The caller still owns these.
+		 */
+		entry->ctx = NULL;
+		entry->compact = NULL;
+		fr_dlist_move(data, &entry->data);
 		talloc_free(entry);
-		return NULL;
+		entry = NULL;
+		goto done;
 	}
 
 	/*
 	 *	Link it to the end of the list, which is implicitly
 	 *	ordered by cleanup time.
 	 */
-	fr_dlist_insert_tail(&state->to_expire, entry);
+	fr_dlist_insert_tail(&shard->to_expire, entry);
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+done:
+	if (timed_out > 0) {
+		atomic_fetch_add(&state->timed_out, timed_out);
+		RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
+	}
+	state_entries_free(&to_free);
 
 	return entry;
 }
 
 /** Find the entry based on the State attribute and remove it from the state tree
  *
+ * @note Called with no mutexes held.
  */
 static fr_state_entry_t *state_entry_find_and_unlink(fr_state_tree_t *state, fr_value_box_t const *vb)
 {
 	fr_state_entry_t *entry, my_entry;
+	fr_state_shard_t *shard;
 
 	/*
 	 *	Assume our own State first.
@@ -591,11 +957,15 @@ static fr_state_entry_t *state_entry_find_and_unlink(fr_state_tree_t *state, fr_
 	 */
 	my_entry.state_comp.context_id ^= state->context_id;
 
-	entry = fr_rb_remove(state->tree, &my_entry);
+	shard = state_shard(state, &my_entry);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = fr_rb_remove(shard->tree, &my_entry);
 	if (entry) {
 		(void) talloc_get_type_abort(entry, fr_state_entry_t);
-		fr_dlist_remove(&state->to_expire, entry);
+		fr_dlist_remove(&shard->to_expire, entry);
 	}
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	return entry;
 }
@@ -611,13 +981,8 @@ void fr_state_discard(fr_state_tree_t *state, request_t *request)
 	vp = fr_pair_find_by_da(&request->request_pairs, NULL, state->da);
 	if (!vp) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
 	entry = state_entry_find_and_unlink(state, &vp->data);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		return;
-	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	if (!entry) return;
 
 	/*
 	 *	If fr_state_to_request was never called, this ensures
@@ -655,12 +1020,14 @@ void fr_state_discard(fr_state_tree_t *state, request_t *request)
  *	- 2 if the state attribute didn't match any known states.
  *	- 1 if no state attribute existed.
  *	- 0 on success (state restored)
- *	- -1 if a state entry has already been thawed by a another request.
+ *	- -1 if the compacted session-state couldn't be decoded.
+ *	- -2 if a state entry has already been thawed by a another request.
  */
 int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 {
 	fr_state_entry_t	*entry;
 	fr_pair_t		*vp;
+	int			ret = 0;
 
 	/*
 	 *	No State, don't do anything.
@@ -672,14 +1039,11 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 		return 1;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
 	entry = state_entry_find_and_unlink(state, &vp->data);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		RDEBUG2("No state entry matching &request.%pP found", vp);
 		return 2;
 	}
-   	PTHREAD_MUTEX_UNLOCK(&state->mutex);
 
 	/* Probably impossible in the current code */
 	if (unlikely(entry->thawed != NULL)) {
@@ -695,6 +1059,12 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 	talloc_free(request_state_replace(request, entry->ctx));
 	entry->ctx = NULL;
 
+	/*
+	 *	The session-state belongs to the request now.
+	 */
+	atomic_fetch_sub(&state->used_bytes, entry->size - sizeof(*entry));
+	entry->size = sizeof(*entry);
+
 	request->seq_start = entry->seq_start;
 
 	/*
@@ -711,6 +1081,15 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 
 	entry->thawed = request;
 
+	/*
+	 *	The encoded pairs are parented by the ctx, which
+	 *	now belongs to the request.
+	 */
+	if (entry->compact) {
+		ret = state_expand(state, request, entry->compact);
+		TALLOC_FREE(entry->compact);
+	}
+
 	if (!fr_pair_list_empty(&request->session_state_pairs)) {
 		RDEBUG2("Restored &session-state");
 		log_request_pair_list(L_DBG_LVL_2, request, NULL, &request->session_state_pairs, "&session-state.");
@@ -723,7 +1102,7 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 	 */
 	request->async->sequence = entry->tries;
 	REQUEST_VERIFY(request);
-	return 0;
+	return ret;
 }
 
 
@@ -739,6 +1118,7 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 	fr_state_entry_t	*entry, *old;
 	fr_dlist_head_t		data;
 	fr_pair_t		*state_ctx;
+	uint8_t			*compact = NULL;
 
 	old = request_data_get(request, state, 0);
 	request_data_list_init(&data);
@@ -761,29 +1141,28 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 	}
 
 	MEM(state_ctx = request_state_replace(request, NULL));
-	PTHREAD_MUTEX_LOCK(&state->mutex);
+
+	if (state->compact) compact = state_compact(state, request, state_ctx);
+	if (!compact && state->intern) state_intern(request, state_ctx);
 
 	/*
 	 *	Reuses old if possible
 	 */
-	entry = state_entry_create(state, request, &request->reply_pairs, old);
+	entry = state_entry_create(state, request, &request->reply_pairs, old, state_ctx, compact, &data);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		RERROR("Creating state entry failed");
 
 		talloc_free(request_state_replace(request, state_ctx));
+		if (compact) {
+			(void) state_expand(state, request, compact);
+			talloc_free(compact);
+		}
 		request_data_restore(request, &data);	/* Put it back again */
 		return -1;
 	}
 
-	fr_assert(entry->ctx == NULL);
 	fr_assert(request->session_state_ctx);
 
-	entry->seq_start = request->seq_start;
-	entry->ctx = state_ctx;
-	fr_dlist_move(&entry->data, &data);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
-
 	RDEBUG3("%s - saved", state->da->name);
 	REQUEST_VERIFY(request);
 
@@ -919,12 +1298,31 @@ void fr_state_discard_child(request_t *parent, void const *unique_ptr, int uniqu
 	talloc_free(child_entry);
 }
 
+/** Return the server ID from a State value
+ *
+ * This allows a server which receives a State value it didn't create
+ * to pass the request to the server which did, even when the state
+ * tree isn't shared between them.
+ *
+ * @param[in] vp	the State attribute.
+ * @return
+ *	- 0..255 the server_id of the server which created the State value.
+ *	- -1 if the State value wasn't created by a state tree.
+ */
+int fr_state_server_id(fr_pair_t const *vp)
+{
+	if ((vp->vp_type != FR_TYPE_OCTETS) ||
+	    (vp->vp_length != sizeof(((fr_state_entry_t *)NULL)->state))) return -1;
+
+	return ((struct state_comp const *) vp->vp_octets)->server_id;
+}
+
 /** Return number of entries created
  *
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	return atomic_load(&state->id);
 }
 
 /** Return number of entries that timed out
@@ -932,7 +1330,7 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	return atomic_load(&state->timed_out);
 }
 
 /** Return number of entries we're currently tracking
@@ -940,5 +1338,14 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return fr_rb_num_elements(state->tree);
+	uint64_t	num = 0;
+	uint32_t	i;
+
+	for (i = 0; i < state->num_shards; i++) {
+		PTHREAD_MUTEX_LOCK(&state->shard[i].mutex);
+		num += fr_rb_num_elements(state->shard[i].tree);
+		PTHREAD_MUTEX_UNLOCK(&state->shard[i].mutex);
+	}
+
+	return num;
 }
@@ -39,6 +39,10 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 				    uint32_t max_sessions, fr_time_delta_t timeout,
 				    uint8_t server_id, uint32_t context_id);
 
+void	fr_state_tree_compact_set(fr_state_tree_t *state, bool compact);
+
+void	fr_state_tree_intern_set(fr_state_tree_t *state, bool intern);
+
 void	fr_state_discard(fr_state_tree_t *state, request_t *request);
 
 int	fr_state_to_request(fr_state_tree_t *state, request_t *request);
@@ -48,6 +52,8 @@ void	fr_state_store_in_parent(request_t *request, void const *unique_ptr, int un
 void	fr_state_restore_to_child(request_t *child, void const *unique_ptr, int unique_int);
 void	fr_state_discard_child(request_t *parent, void const *unique_ptr, int unique_int);
 
+int	fr_state_server_id(fr_pair_t const *vp);
+
 /*
  *	Stats
  */
@@ -570,6 +570,9 @@ struct tmpl_s {
 								///< with a '&'.
 			FR_DLIST_HEAD(tmpl_request_list)	rr;	//!< Request to search or insert in.
 			FR_DLIST_HEAD(tmpl_attr_list)		ar;	//!< Head of the attribute reference list.
+			bool			simple;		//!< Every reference is a normal, non-raw attribute
+								///< with no filter, or a filter selecting the
+								///< first instance.  Lookups can skip the cursor.
 		} attribute;
 
 		/*
@@ -714,6 +717,15 @@ static inline bool tmpl_attr_head_is_list(tmpl_t const *vpt)
 	return tmpl_attr_is_list_attr(ar);
 }
 
+/** Whether the attribute references can be resolved with direct lookups
+ *
+ * @hidecallergraph
+ */
+static inline bool tmpl_attr_is_simple(tmpl_t const *vpt)
+{
+	return tmpl_is_attr(vpt) && vpt->data.attribute.simple;
+}
+
 /** Return true if the last attribute reference is "normal"
  *
  * @hidecallergraph
@@ -1331,6 +1343,8 @@ int			tmpl_eval_pair(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *reque
 int			tmpl_eval(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *request, tmpl_t const *vpt);
 
 int			tmpl_eval_cast_in_place(fr_value_box_list_t *out, request_t *request, tmpl_t const *vpt);
+
+int			tmpl_eval_segments_in_place(fr_value_box_list_t *out, request_t *request, tmpl_t const *vpt);
 /** @} */
 
 ssize_t			tmpl_preparse(char const **out, size_t *outlen, char const *in, size_t inlen,
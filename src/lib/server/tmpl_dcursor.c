@@ -105,7 +105,7 @@ void _tmpl_cursor_pair_init(TALLOC_CTX *list_ctx, fr_pair_list_t *list, tmpl_att
 	 *	Iterates over all attributes at this level
 	 */
 	} else if (ar_is_unspecified(ar)) {
-		fr_dcursor_init(&ns->cursor, fr_pair_list_to_dlist(list));
+		fr_pair_dcursor_init(&ns->cursor, list);
 	} else {
 		fr_assert_msg(0, "Invalid attr reference type");
 	}
@@ -483,6 +483,58 @@ fr_pair_t *_tmpl_dcursor_init(int *err, TALLOC_CTX *ctx, tmpl_dcursor_ctx_t *cc,
 	return tmpl_dcursor_init_relative(err, ctx, cc, cursor, request, list, vpt, build, uctx);
 }
 
+/** Find the first pair matching a simple attribute reference
+ *
+ * Walks the pair tree directly using the indexed pair list lookups,
+ * avoiding the cursor machinery entirely.  Only valid for tmpls where
+ * the attribute references are all normal, and select the first
+ * instance at each level.
+ *
+ * @param[out] err		May be NULL if no error code is required.
+ *				Will be set to:
+ *				- 0 on success.
+ *				- -1 if no matching #fr_pair_t could be found.
+ *				- -3 if context could not be found (no parent #request_t available).
+ * @param[in] request		The current #request_t.
+ * @param[in] vpt		specifying the #fr_pair_t to find.
+ * @return
+ *	- The first matching #fr_pair_t.
+ *	- NULL if no matching #fr_pair_t was found.
+ */
+fr_pair_t *tmpl_dcursor_simple_find(int *err, request_t *request, tmpl_t const *vpt)
+{
+	fr_pair_t	*list, *vp = NULL;
+	tmpl_attr_t	*ar = NULL;
+
+	fr_assert(tmpl_attr_is_simple(vpt));
+
+	if (err) *err = 0;
+
+	if (tmpl_request_ptr(&request, tmpl_request(vpt)) < 0) {
+		if (err) *err = -3;
+		return NULL;
+	}
+	list = request->pair_root;
+
+	while ((ar = tmpl_attr_list_next(tmpl_attr(vpt), ar))) {
+		vp = fr_pair_find_by_da(&list->vp_group, NULL, ar->ar_da);
+		if (!vp) {
+			if (err) {
+				*err = -1;
+				if (tmpl_is_list(vpt)) {
+					fr_strerror_printf("List \"%s\" is empty", vpt->name);
+				} else {
+					fr_strerror_printf("No matching \"%s\" pairs found", tmpl_attr_tail_da(vpt)->name);
+				}
+			}
+			return NULL;
+		}
+		list = vp;
+	}
+
+	return vp;
+}
+
 /** Clear any temporary state allocations
  *
  */
@@ -92,6 +92,8 @@ fr_pair_t		*_tmpl_dcursor_init(int *err, TALLOC_CTX *ctx, tmpl_dcursor_ctx_t *cc
 					    fr_dcursor_t *cursor, request_t *request,
 					    tmpl_t const *vpt, tmpl_dcursor_build_t build, void *uctx);
 
+fr_pair_t		*tmpl_dcursor_simple_find(int *err, request_t *request, tmpl_t const *vpt);
+
 void			tmpl_dcursor_clear(tmpl_dcursor_ctx_t *cc);
 
 fr_pair_t *tmpl_dcursor_pair_build(fr_pair_t *parent, fr_dcursor_t *cursor, fr_dict_attr_t const *da, UNUSED void *uctx);
@@ -458,6 +458,19 @@ ssize_t _tmpl_to_type(void *out,
 			break;
 		}
 
+		/*
+		 *	Common types can be printed straight into the
+		 *	expansion buffer, without casting.
+		 */
+		if ((dst_type == FR_TYPE_STRING) && buff) {
+			slen = fr_value_box_print_fast((char *)buff, bufflen, to_cast);
+			if (slen >= 0) {
+				fr_value_box_bstrndup_shallow(&value_from_cast, NULL,
+							      (char *)buff, slen, to_cast->tainted);
+				break;
+			}
+		}
+
 		MEM(ctx = talloc_new(request));
 
 		from_cast = &value_from_cast;
@@ -895,8 +908,12 @@ int tmpl_find_vp(fr_pair_t **out, request_t *request, tmpl_t const *vpt)
 
 	TMPL_VERIFY(vpt);
 
-	vp = tmpl_dcursor_init(&err, request, &cc, &cursor, request, vpt);
-	tmpl_dcursor_clear(&cc);
+	if (tmpl_attr_is_simple(vpt)) {
+		vp = tmpl_dcursor_simple_find(&err, request, vpt);
+	} else {
+		vp = tmpl_dcursor_init(&err, request, &cc, &cursor, request, vpt);
+		tmpl_dcursor_clear(&cc);
+	}
 
 	if (out) *out = vp;
 
@@ -927,8 +944,12 @@ int tmpl_find_or_add_vp(fr_pair_t **out, request_t *request, tmpl_t const *vpt)
 
 	*out = NULL;
 
-	vp = tmpl_dcursor_init(&err, NULL, &cc, &cursor, request, vpt);
-	tmpl_dcursor_clear(&cc);
+	if (tmpl_attr_is_simple(vpt)) {
+		vp = tmpl_dcursor_simple_find(&err, request, vpt);
+	} else {
+		vp = tmpl_dcursor_init(&err, NULL, &cc, &cursor, request, vpt);
+		tmpl_dcursor_clear(&cc);
+	}
 
 	switch (err) {
 	case 0:
@@ -1455,6 +1476,111 @@ int tmpl_eval_cast_in_place(fr_value_box_list_t *list, request_t *request, tmpl_
 	goto success;
 }
 
+/** Move the members of any groups in a list into the list itself
+ *
+ * @param[in,out] list	to flatten.
+ */
+static void tmpl_eval_flatten(fr_value_box_list_t *list)
+{
+	fr_value_box_list_foreach_safe(list, vb) {
+		TALLOC_CTX *ctx;
+
+		if (!fr_type_is_group(vb->type)) continue;
+
+		tmpl_eval_flatten(&vb->vb_group);
+
+		ctx = talloc_parent(vb);
+		fr_value_box_list_foreach_safe(&vb->vb_group, child) {
+			fr_value_box_list_remove(&vb->vb_group, child);
+			talloc_steal(ctx, child);
+			fr_value_box_list_insert_before(list, vb, child);
+		}}
+		fr_value_box_list_remove(list, vb);
+		talloc_free(vb);
+	}}
+}
+
+/** Escape the output of a quoted tmpl, but leave it as a list of segments
+ *
+ * Like #tmpl_eval_cast_in_place, except the output of quoted tmpls isn't
+ * concatenated into a single buffer.  Each segment is escaped as it would be
+ * before concatenation, and left as a string or octets box, so the caller can
+ * consume the segments directly, e.g. with #fr_iovec_afrom_value_box_list.
+ *
+ * The segments of a quoted tmpl together are one value, so the caller must
+ * not add separators between them.
+ *
+ * Tmpls which aren't quoted, are cast to a type other than string, or whose
+ * escape function needs to see the whole string, are passed to
+ * #tmpl_eval_cast_in_place as before.
+ *
+ * @param[in,out] list	Where to write the boxed value.
+ * @param[in] request	The current request.
+ * @param[in] vpt	Representing the attribute.
+ * @return
+ *	- <0		the cast failed
+ *	- 0		we successfully evaluated the tmpl
+ */
+int tmpl_eval_segments_in_place(fr_value_box_list_t *list, request_t *request, tmpl_t const *vpt)
+{
+	fr_type_t	cast = tmpl_rules_cast(vpt);
+	void		*uctx;
+	int		ret = 0;
+
+	switch (vpt->quote) {
+	case T_DOUBLE_QUOTED_STRING:
+	case T_SINGLE_QUOTED_STRING:
+	case T_BACK_QUOTED_STRING:
+		break;
+
+	default:
+		return tmpl_eval_cast_in_place(list, request, vpt);
+	}
+
+	if ((!fr_type_is_null(cast) && !fr_type_is_string(cast)) || tmpl_escape_post_concat(vpt)) {
+		return tmpl_eval_cast_in_place(list, request, vpt);
+	}
+
+	tmpl_eval_flatten(list);
+
+	if (tmpl_escape_pre_concat(vpt)) {
+		uctx = tmpl_eval_escape_uctx_alloc(request, &vpt->rules.escape);
+		ret = fr_value_box_list_escape_in_place(list, vpt->rules.escape.func,
+							vpt->rules.escape.safe_for, uctx);
+		tmpl_eval_escape_uctx_free(&vpt->rules.escape, uctx);
+		if (unlikely(ret < 0)) return -1;
+	}
+
+	/*
+	 *	Concatenation would print any other types as
+	 *	strings, and skip nulls.  Do the same here.
+	 */
+	fr_value_box_list_foreach_safe(list, vb) {
+		switch (vb->type) {
+		case FR_TYPE_STRING:
+		case FR_TYPE_OCTETS:
+			break;
+
+		case FR_TYPE_NULL:
+			fr_value_box_list_remove(list, vb);
+			talloc_free(vb);
+			break;
+
+		default:
+			if (fr_value_box_cast_in_place(vb, vb, FR_TYPE_STRING, NULL) < 0) return -1;
+			break;
+		}
+	}}
+
+	if (!vpt->rules.escape.func && vpt->rules.escape.safe_for) {
+		fr_value_box_list_mark_safe_for(list, vpt->rules.escape.safe_for);
+	}
+
+	VALUE_BOX_LIST_VERIFY(list);
+
+	return 0;
+}
+
 static int _tmpl_global_free(UNUSED void *uctx)
 {
 	fr_dict_autofree(tmpl_dict);
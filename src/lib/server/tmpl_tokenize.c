@@ -965,6 +965,29 @@ tmpl_t *tmpl_alloc(TALLOC_CTX *ctx, tmpl_type_t type, fr_token_t quote, char con
  * @{
  */
 
+/** Record whether a tmpl's attribute references can be resolved without a cursor
+ *
+ * Must be called whenever the attribute reference list is modified.
+ */
+static void tmpl_attr_simple_update(tmpl_t *vpt)
+{
+	tmpl_attr_t *ar = NULL;
+
+	vpt->data.attribute.simple = false;
+
+	if (!tmpl_is_attr(vpt) || (tmpl_attr_list_num_elements(tmpl_attr(vpt)) == 0)) return;
+
+	while ((ar = tmpl_attr_list_next(tmpl_attr(vpt), ar))) {
+		if (!ar_is_normal(ar) || ar_is_raw(ar)) return;
+
+		if (ar_filter_is_none(ar)) continue;
+
+		if (!ar_filter_is_num(ar) || ((ar->ar_num != NUM_UNSPEC) && (ar->ar_num != 0))) return;
+	}
+
+	vpt->data.attribute.simple = true;
+}
+
 /** Allocate a new attribute reference and add it to the end of the attribute reference list
  *
  */
@@ -1075,6 +1098,7 @@ int tmpl_attr_copy(tmpl_t *dst, tmpl_t const *src)
 	 */
 	tmpl_request_list_talloc_reverse_free(&dst->data.attribute.rr);
 	tmpl_request_ref_list_copy(dst, &dst->data.attribute.rr, &src->data.attribute.rr);
+	tmpl_attr_simple_update(dst);
 
 	TMPL_ATTR_VERIFY(dst);
 
@@ -1108,6 +1132,7 @@ int tmpl_attr_set_da(tmpl_t *vpt, fr_dict_attr_t const *da)
 		ref->da = da;
 	}
 	ref->ar_parent = fr_dict_root(fr_dict_by_da(da));	/* Parent is the root of the dictionary */
+	tmpl_attr_simple_update(vpt);
 
 	TMPL_ATTR_VERIFY(vpt);
 
@@ -1169,6 +1194,7 @@ int tmpl_attr_set_leaf_da(tmpl_t *vpt, fr_dict_attr_t const *da)
 	 *	FIXME - Should be calculated from existing ar
 	 */
 	ref->ar_parent = fr_dict_root(fr_dict_by_da(da));	/* Parent is the root of the dictionary */
+	tmpl_attr_simple_update(vpt);
 
 	TMPL_ATTR_VERIFY(vpt);
 
@@ -1204,6 +1230,7 @@ void tmpl_attr_rewrite_leaf_num(tmpl_t *vpt, int16_t to)
 	} else if (ref->ar_num == NUM_UNSPEC) {
 		ref->ar_num = to;
 	}
+	tmpl_attr_simple_update(vpt);
 
 	TMPL_ATTR_VERIFY(vpt);
 }
@@ -1261,6 +1288,7 @@ int tmpl_attr_afrom_list(TALLOC_CTX *ctx, tmpl_t **out, tmpl_t const *list, fr_d
 	}
 
 	ar->ar_parent = fr_dict_root(fr_dict_by_da(da));
+	tmpl_attr_simple_update(vpt);
 
 	/*
 	 *	We need to rebuild the attribute name, to be the
@@ -2454,6 +2482,8 @@ ssize_t tmpl_afrom_attr_substr(TALLOC_CTX *ctx, tmpl_attr_error_t *err,
 		goto error;
 	}
 
+	tmpl_attr_simple_update(vpt);
+
 	TMPL_VERIFY(vpt);	/* Because we want to ensure we produced something sane */
 
 	*out = vpt;
@@ -4108,6 +4138,7 @@ static inline CC_HINT(always_inline) int tmpl_attr_resolve(tmpl_t *vpt, tmpl_res
 	}
 
 	RESOLVED_SET(&vpt->type);
+	tmpl_attr_simple_update(vpt);
 	TMPL_VERIFY(vpt);
 
 	return 0;
@@ -4403,6 +4434,7 @@ static void attr_to_raw(tmpl_t *vpt, tmpl_attr_t *ref)
 void tmpl_attr_to_raw(tmpl_t *vpt)
 {
 	attr_to_raw(vpt, tmpl_attr_list_tail(tmpl_attr(vpt)));
+	tmpl_attr_simple_update(vpt);
 }
 
 /** Add an unknown #fr_dict_attr_t specified by a #tmpl_t to the main dictionary
@@ -4491,6 +4523,7 @@ int tmpl_attr_unknown_add(tmpl_t *vpt)
 			return -1;
 		}
 	}
+	tmpl_attr_simple_update(vpt);
 
 	return 0;
 }
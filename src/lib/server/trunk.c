@@ -37,8 +37,11 @@ typedef struct trunk_s trunk_t;
 #include <freeradius-devel/server/trunk.h>
 
 #include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/server/trigger.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/probe.h>
+#include <freeradius-devel/util/rb.h>
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/table.h>
 #include <freeradius-devel/util/minmax_heap.h>
@@ -51,6 +54,15 @@ typedef struct trunk_s trunk_t;
 
 static atomic_uint_fast64_t request_counter = ATOMIC_VAR_INIT(1);
 
+/** Connection counts shared between trunks
+ *
+ * Trunks are owned by a single thread, so this is the only part of a
+ * trunk's state which is modified by more than one thread.
+ */
+struct trunk_shared_s {
+	atomic_uint_fast32_t	conns;			//!< Connections across all trunks sharing this.
+};
+
 #ifdef TESTING_TRUNK
 static fr_time_t test_time_base = fr_time_wrap(1);
 
@@ -110,6 +122,9 @@ struct trunk_request_s {
 
 	fr_time_t		last_freed;		//!< Last time this request was freed.
 
+	fr_time_t		first_sent;		//!< When the request was first sent.  Used to
+							///< calculate the trunk's latency.
+
 	bool			bound_to_conn;		//!< Fail the request if there's an attempt to
 							///< re-enqueue it.
 
@@ -117,6 +132,24 @@ struct trunk_request_s {
 							///< Used so that re-queueing doesn't increase trunk
 							///< `sent` count.
 
+	/** @name Coalescing
+	 * @{
+ 	 */
+	fr_rb_node_t		coalesce_node;		//!< Entry in the trunk's tree of requests which
+							///< others can be coalesced with.
+
+	uint8_t const		*key;			//!< Identifies requests with the same result.
+							///< NULL if we're not in the coalesce tree.
+
+	size_t			key_len;		//!< Length of the key.
+
+	trunk_request_t		*leader;		//!< Request we're waiting for the result of.
+
+	fr_dlist_t		follower_entry;		//!< Entry in the leader's list of followers.
+
+	fr_dlist_head_t		followers;		//!< Requests waiting for our result.
+	/** @} */
+
 #ifndef NDEBUG
 	fr_dlist_head_t		log;			//!< State change log.
 #endif
@@ -209,6 +242,9 @@ struct trunk_s {
 	fr_heap_t		*backlog;		//!< The request backlog.  Requests we couldn't
 							///< immediately assign to a connection.
 
+	fr_rb_tree_t		*coalesce;		//!< Requests in progress which identical requests
+							///< can wait for, ordered by key.
+
 	/** @name Connection lists
 	 *
 	 * A connection must always be in exactly one of these lists
@@ -270,6 +306,15 @@ struct trunk_s {
  	fr_event_timer_t const	*manage_ev;		//!< Periodic connection management event.
 	/** @} */
 
+	/** @name Arrival rate sampling
+	 * @{
+ 	 */
+	fr_time_t		rate_last;		//!< When the arrival rate was last sampled.
+
+	uint64_t		rate_last_count;	//!< Requests allocated when the arrival rate
+							///< was last sampled.
+	/** @} */
+
 	/** @name Log rate limiting entries
 	 * @{
  	 */
@@ -291,12 +336,15 @@ struct trunk_s {
 
 	uint64_t		last_req_per_conn;	//!< The last request to connection ratio we calculated.
 	/** @} */
+
+	fr_metrics_source_t	*metrics;		//!< Our entry in the metrics registry.
 };
 
 static conf_parser_t const trunk_config_request[] = {
 	{ FR_CONF_OFFSET("per_connection_max", trunk_conf_t, max_req_per_conn), .dflt = "2000" },
 	{ FR_CONF_OFFSET("per_connection_target", trunk_conf_t, target_req_per_conn), .dflt = "1000" },
 	{ FR_CONF_OFFSET("free_delay", trunk_conf_t, req_cleanup_delay), .dflt = "10.0" },
+	{ FR_CONF_OFFSET("coalesce", trunk_conf_t, coalesce), .dflt = "no" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -324,6 +372,11 @@ conf_parser_t const trunk_config[] = {
 
 	{ FR_CONF_OFFSET("max_backlog", trunk_conf_t, max_backlog), .dflt = "1000" },
 
+	{ FR_CONF_OFFSET("predictive", trunk_conf_t, predictive), .dflt = "no" },
+	{ FR_CONF_OFFSET("headroom", trunk_conf_t, headroom), .dflt = "25" },
+	{ FR_CONF_OFFSET("spare", trunk_conf_t, spare), .dflt = "0" },
+	{ FR_CONF_OFFSET("shared_max", trunk_conf_t, shared_max), .dflt = "0" },
+
 	{ FR_CONF_OFFSET_SUBSECTION("connection", 0, trunk_conf_t, conn_conf, trunk_config_connection), .subcs_size = sizeof(trunk_config_connection) },
 	{ FR_CONF_POINTER("request", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) trunk_config_request },
 
@@ -350,6 +403,7 @@ static fr_table_num_indexed_bit_pos_t const trunk_req_trigger_names[] = {
 	{ L("pool.request_state_cancel_sent"),		TRUNK_REQUEST_STATE_CANCEL_SENT		},	/* 0x0200 - bit 10 */
 	{ L("pool.request_state_cancel_partial"),	TRUNK_REQUEST_STATE_CANCEL_PARTIAL	},	/* 0x0400 - bit 11 */
 	{ L("pool.request_state_cancel_complete"),	TRUNK_REQUEST_STATE_CANCEL_COMPLETE	},	/* 0x0800 - bit 12 */
+	{ L("pool.request_state_coalesced"),		TRUNK_REQUEST_STATE_COALESCED		},	/* 0x1000 - bit 13 */
 };
 static size_t trunk_req_trigger_names_len = NUM_ELEMENTS(trunk_req_trigger_names);
 #endif
@@ -367,7 +421,8 @@ static fr_table_num_ordered_t const trunk_request_states[] = {
 	{ L("CANCEL"),					TRUNK_REQUEST_STATE_CANCEL		},
 	{ L("CANCEL-SENT"),				TRUNK_REQUEST_STATE_CANCEL_SENT		},
 	{ L("CANCEL-PARTIAL"),				TRUNK_REQUEST_STATE_CANCEL_PARTIAL	},
-	{ L("CANCEL-COMPLETE"),				TRUNK_REQUEST_STATE_CANCEL_COMPLETE	}
+	{ L("CANCEL-COMPLETE"),				TRUNK_REQUEST_STATE_CANCEL_COMPLETE	},
+	{ L("COALESCED"),				TRUNK_REQUEST_STATE_COALESCED		}
 };
 static size_t trunk_request_states_len = NUM_ELEMENTS(trunk_request_states);
 
@@ -588,6 +643,24 @@ do { \
 	} \
 } while(0)
 
+/** Call the coalesce callback, to copy a leader's result to a follower
+ *
+ */
+#define DO_REQUEST_COALESCE(_ret, _treq, _leader) \
+do { \
+	request_t *request = (_treq)->pub.request; \
+	void *_prev = (_treq)->pub.trunk->in_handler; \
+	ROPTIONAL(RDEBUG3, DEBUG3, "Calling request_coalesce(request=%p, preq=%p, rctx=%p, leader_preq=%p, uctx=%p)", \
+		  (_treq)->pub.request, \
+		  (_treq)->pub.preq, \
+		  (_treq)->pub.rctx, \
+		  (_leader)->pub.preq, \
+		  (_treq)->pub.trunk->uctx); \
+	(_treq)->pub.trunk->in_handler = (void *)(_treq)->pub.trunk->funcs.request_coalesce; \
+	_ret = (_treq)->pub.trunk->funcs.request_coalesce((_treq)->pub.request, (_treq)->pub.preq, (_treq)->pub.rctx, (_leader)->pub.preq, (_treq)->pub.trunk->uctx); \
+	(_treq)->pub.trunk->in_handler = _prev; \
+} while(0)
+
 /** Call the free callback (if set)
  *
  */
@@ -675,6 +748,7 @@ do { \
 	if (!(_tconn)->pub.conn) { \
 		ERROR("Failed creating new connection"); \
 		talloc_free(tconn); \
+		trunk_shared_conn_release(trunk); \
 		return -1; \
 	} \
 } while(0)
@@ -897,6 +971,8 @@ static void trunk_request_enter_complete(trunk_request_t *treq);
 static void trunk_request_enter_cancel(trunk_request_t *treq, trunk_cancel_reason_t reason);
 static void trunk_request_enter_cancel_sent(trunk_request_t *treq);
 static void trunk_request_enter_cancel_complete(trunk_request_t *treq);
+static trunk_enqueue_t trunk_request_enqueue_existing(trunk_request_t *treq);
+static void trunk_request_coalesce_release(trunk_request_t *treq);
 
 static uint64_t trunk_requests_per_connection(uint16_t *conn_count_out, uint32_t *req_conn_out,
 					      trunk_t *trunk, fr_time_t now, NDEBUG_UNUSED bool verify);
@@ -942,6 +1018,42 @@ static int8_t _trunk_request_prioritise(void const *a, void const *b)
 	return treq_a->pub.trunk->funcs.request_prioritise(treq_a->pub.preq, treq_b->pub.preq);
 }
 
+/** Order requests which can be coalesced with, by key
+ *
+ */
+static int8_t _trunk_request_key_cmp(void const *one, void const *two)
+{
+	trunk_request_t const	*a = one, *b = two;
+	int			ret;
+
+	CMP_RETURN(a, b, key_len);
+
+	ret = memcmp(a->key, b->key, a->key_len);
+	return CMP(ret, 0);
+}
+
+/** Stop new requests from being coalesced with this one
+ *
+ * @param[in] treq	to remove from the trunk's coalesce tree.
+ */
+static inline void trunk_request_coalesce_remove(trunk_request_t *treq)
+{
+	if (!treq->key) return;
+
+	fr_rb_remove_by_inline_node(treq->pub.trunk->coalesce, &treq->coalesce_node);
+	treq->key = NULL;	/* Freed with the treq's children */
+}
+
+/** Remove a follower from its leader's list of followers
+ *
+ * @param[in] treq	to detach from its leader.
+ */
+static inline void trunk_request_coalesce_detach(trunk_request_t *treq)
+{
+	fr_dlist_remove(&treq->leader->followers, treq);
+	treq->leader = NULL;
+}
+
 /** Remove a request from all connection lists
  *
  * A common function used by init, fail, complete state functions to disassociate
@@ -1069,6 +1181,10 @@ static void trunk_request_enter_unassigned(trunk_request_t *treq)
 		trunk_request_remove_from_conn(treq);
 		break;
 
+	case TRUNK_REQUEST_STATE_COALESCED:
+		trunk_request_coalesce_detach(treq);
+		break;
+
 	default:
 		REQUEST_BAD_STATE_TRANSITION(TRUNK_REQUEST_STATE_UNASSIGNED);
 	}
@@ -1134,6 +1250,36 @@ static void trunk_request_enter_backlog(trunk_request_t *treq, bool new)
 	}
 }
 
+/** Transition a request to the coalesced state, so that it receives the result of its leader
+ *
+ * @param[in] treq	to trigger a state change for.
+ * @param[in] leader	to wait for the result of.
+ */
+static void trunk_request_enter_coalesced(trunk_request_t *treq, trunk_request_t *leader)
+{
+	trunk_t		*trunk = treq->pub.trunk;
+
+	switch (treq->pub.state) {
+	case TRUNK_REQUEST_STATE_INIT:
+		break;
+
+	default:
+		REQUEST_BAD_STATE_TRANSITION(TRUNK_REQUEST_STATE_COALESCED);
+	}
+
+	treq->leader = leader;
+	fr_dlist_insert_tail(&leader->followers, treq);
+
+	REQUEST_STATE_TRANSITION(TRUNK_REQUEST_STATE_COALESCED);
+
+	{
+		request_t *request = treq->pub.request;
+
+		ROPTIONAL(RDEBUG3, DEBUG3, "Trunk request %" PRIu64 " coalesced with request %" PRIu64,
+			  treq->id, leader->id);
+	}
+}
+
 /** Transition a request to the pending state, adding it to the backlog of an active connection
  *
  * All trunk requests being added to a connection get passed to this function.
@@ -1278,6 +1424,7 @@ static void trunk_request_enter_sent(trunk_request_t *treq)
 	if (!treq->sent) {
 		tconn->sent_count++;
 		treq->sent = true;
+		treq->first_sent = fr_time();
 
 		/*
 		 *	Enforces max_uses
@@ -1327,6 +1474,7 @@ static void trunk_request_enter_reapable(trunk_request_t *treq)
 	if (!treq->sent) {
 		tconn->sent_count++;
 		treq->sent = true;
+		treq->first_sent = fr_time();
 
 		if ((trunk->conf.max_uses > 0) && (tconn->sent_count >= trunk->conf.max_uses)) {
 			trunk_connection_enter_draining_to_free(tconn);
@@ -1517,6 +1665,33 @@ static void trunk_request_enter_cancel_complete(trunk_request_t *treq)
 	trunk_request_free(&treq);	/* Free the request */
 }
 
+/** Fold the time a request took to complete into the trunk's latency
+ *
+ * This is an EWMA with a weight of 1/8, as with the smoothed RTT in RFC 6298.
+ * It reacts quickly enough to move load away from a slow destination, without
+ * being thrown around by a single slow reply.
+ *
+ * @param[in] trunk	the request was sent on.
+ * @param[in] treq	which has completed, or failed after being sent.
+ */
+static inline void trunk_latency_update(trunk_t *trunk, trunk_request_t *treq)
+{
+	int64_t sample, latency;
+
+	if (!treq->sent) return;
+
+	sample = fr_time_delta_unwrap(fr_time_sub(fr_time(), treq->first_sent));
+	latency = fr_time_delta_unwrap(trunk->pub.latency);
+
+	if (latency == 0) {
+		latency = sample;
+	} else {
+		latency += (sample - latency) / 8;
+	}
+
+	trunk->pub.latency = fr_time_delta_wrap(latency);
+}
+
 /** Request completed successfully, inform the API client and free the request
  *
  * @note treq will be inviable after a call to this function.
@@ -1539,11 +1714,46 @@ static void trunk_request_enter_complete(trunk_request_t *treq)
 		trunk_request_remove_from_conn(treq);
 		break;
 
+	case TRUNK_REQUEST_STATE_COALESCED:
+		trunk_request_coalesce_detach(treq);
+		break;
+
 	default:
 		REQUEST_BAD_STATE_TRANSITION(TRUNK_REQUEST_STATE_COMPLETE);
 	}
 
+	trunk_request_coalesce_remove(treq);
+
+	trunk_latency_update(trunk, treq);
+
 	REQUEST_STATE_TRANSITION(TRUNK_REQUEST_STATE_COMPLETE);
+
+	/*
+	 *	Followers get the result before the leader's
+	 *	complete callback is run, as that may alter
+	 *	the preq.
+	 */
+	if (fr_dlist_num_elements(&treq->followers) > 0) {
+		trunk_request_t	*follower, *next;
+		int		ret;
+
+		for (follower = fr_dlist_head(&treq->followers); follower; follower = next) {
+			next = fr_dlist_next(&treq->followers, follower);
+
+			DO_REQUEST_COALESCE(ret, follower, treq);
+			if (ret < 0) continue;
+
+			trunk->pub.req_coalesced++;
+			trunk_request_enter_complete(follower);
+		}
+
+		/*
+		 *	Anything left couldn't use our result,
+		 *	so has to be sent by itself.
+		 */
+		trunk_request_coalesce_release(treq);
+	}
+
 	DO_REQUEST_COMPLETE(treq);
 	trunk_request_free(&treq);	/* Free the request */
 }
@@ -1569,12 +1779,38 @@ static void trunk_request_enter_failed(trunk_request_t *treq)
 		REQUEST_EXTRACT_BACKLOG(treq);
 		break;
 
+	case TRUNK_REQUEST_STATE_COALESCED:
+		trunk_request_coalesce_detach(treq);
+		break;
+
 	default:
 		trunk_request_remove_from_conn(treq);
 		break;
 	}
 
+	trunk_request_coalesce_remove(treq);
+
+	/*
+	 *	A request which was sent and then failed usually timed
+	 *	out.  Counting it means the latency rises as soon as
+	 *	the destination stops responding, instead of staying
+	 *	at the last good value.
+	 */
+	if (prev == TRUNK_REQUEST_STATE_SENT) trunk_latency_update(trunk, treq);
+
 	REQUEST_STATE_TRANSITION(TRUNK_REQUEST_STATE_FAILED);
+
+	/*
+	 *	Followers share our result, even if it's a
+	 *	failure.  Otherwise they'd all be sent to a
+	 *	destination which has just failed.
+	 */
+	{
+		trunk_request_t	*follower;
+
+		while ((follower = fr_dlist_head(&treq->followers))) trunk_request_enter_failed(follower);
+	}
+
 	DO_REQUEST_FAIL(treq, prev);
 	trunk_request_free(&treq);	/* Free the request */
 }
@@ -2101,6 +2337,8 @@ void trunk_request_signal_complete(trunk_request_t *treq)
 	 */
 	if (IN_REQUEST_DEMUX(trunk)) trunk->pub.last_read_success = fr_time();
 
+	FR_PROBE(trunk_request_complete, treq->pub.request ? treq->pub.request->number : 0, treq->id);
+
 	switch (treq->pub.state) {
 	case TRUNK_REQUEST_STATE_SENT:
 	case TRUNK_REQUEST_STATE_PENDING:	/* Got immediate response, i.e. cached */
@@ -2153,6 +2391,12 @@ void trunk_request_signal_cancel(trunk_request_t *treq)
 
  	trunk = treq->pub.trunk;
 
+	/*
+	 *	Requests waiting for our result need
+	 *	to be sent without us.
+	 */
+	trunk_request_coalesce_release(treq);
+
 	switch (treq->pub.state) {
 	/*
 	 *	We don't call the complete or failed callbacks
@@ -2330,6 +2574,12 @@ void trunk_request_free(trunk_request_t **treq_to_free)
 		if (!fr_cond_assert(0)) return;
 	}
 
+	/*
+	 *	Shouldn't have followers by now, but if
+	 *	we do, they mustn't be left waiting.
+	 */
+	trunk_request_coalesce_release(treq);
+
 	/*
 	 *	Zero out the pointer to prevent double frees
 	 */
@@ -2514,6 +2764,7 @@ trunk_request_t *trunk_request_alloc(trunk_t *trunk, request_t *request)
 
 	trunk->pub.req_alloc++;
 	treq->id = atomic_fetch_add_explicit(&request_counter, 1, memory_order_relaxed);
+	fr_dlist_init(&treq->followers, trunk_request_t, follower_entry);
 	/* heap_id	- initialised when treq inserted into pending */
 	/* list		- empty */
 	/* preq		- populated later */
@@ -2627,6 +2878,8 @@ trunk_enqueue_t trunk_request_enqueue(trunk_request_t **treq_out, trunk_t *trunk
 		break;
 
 	default:
+		FR_PROBE(trunk_request_enqueue, request ? request->number : 0, 0, ret);
+
 		/*
 		 *	If a trunk request was provided
 		 *	populate the preq and rctx fields
@@ -2642,9 +2895,185 @@ trunk_enqueue_t trunk_request_enqueue(trunk_request_t **treq_out, trunk_t *trunk
 		return ret;
 	}
 
+	FR_PROBE(trunk_request_enqueue, request ? request->number : 0, treq->id, ret);
+
 	return ret;
 }
 
+/** Enqueue a request, or wait for the result of an identical request which is already in progress
+ *
+ * If the trunk was configured with `coalesce = yes`, and a #trunk_request_coalesce_t
+ * callback was provided, requests with the same key share a single request to the
+ * external datastore.
+ *
+ * The first request with a given key is enqueued as normal, and becomes the leader.
+ * Later requests with the same key, enqueued whilst the leader is still waiting
+ * to be sent, or waiting for its response, become followers.  Followers are never
+ * sent.  When the leader completes the #trunk_request_coalesce_t callback is called
+ * to copy the leader's result to each follower, before the follower completes.
+ *
+ * If the leader fails, its followers fail too.  If the leader is cancelled, or
+ * its result can't be shared, its followers are enqueued without it.
+ *
+ * The key must identify the result of the request completely.  Requests should
+ * only be coalesced if they don't modify the datastore, and if it doesn't matter
+ * which of them is actually sent.
+ *
+ * @param[in,out] treq_out	A trunk request handle.  As per #trunk_request_enqueue.
+ * @param[in] trunk		to enqueue request on.
+ * @param[in] request		to enqueue.
+ * @param[in] preq		Protocol request to write out.
+ * @param[in] rctx		The resume context to write any result to.
+ * @param[in] key		identifying requests which have the same result.
+ *				If NULL, the request is enqueued as normal.
+ * @param[in] key_len		Length of the key.
+ * @return
+ *	- TRUNK_ENQUEUE_OK.
+ *	- TRUNK_ENQUEUE_IN_BACKLOG.
+ *	- TRUNK_ENQUEUE_NO_CAPACITY.
+ *	- TRUNK_ENQUEUE_DST_UNAVAILABLE
+ *	- TRUNK_ENQUEUE_FAIL
+ */
+trunk_enqueue_t trunk_request_enqueue_coalesce(trunk_request_t **treq_out, trunk_t *trunk, request_t *request,
+					       void *preq, void *rctx, uint8_t const *key, size_t key_len)
+{
+	trunk_request_t	*treq, *leader;
+	trunk_enqueue_t	ret;
+
+	if (!key || !trunk->conf.coalesce || !trunk->funcs.request_coalesce) {
+		return trunk_request_enqueue(treq_out, trunk, request, preq, rctx);
+	}
+
+	if (!fr_cond_assert_msg(!IN_HANDLER(trunk),
+				"%s cannot be called within a handler", __FUNCTION__)) return TRUNK_ENQUEUE_FAIL;
+
+	if (!fr_cond_assert_msg(!*treq_out || ((*treq_out)->pub.state == TRUNK_REQUEST_STATE_INIT),
+				"%s requests must be in \"init\" state", __FUNCTION__)) return TRUNK_ENQUEUE_FAIL;
+
+	leader = fr_rb_find(trunk->coalesce, &(trunk_request_t){ .key = key, .key_len = key_len });
+	if (leader) {
+		switch (leader->pub.state) {
+		/*
+		 *	Still waiting for a response
+		 */
+		case TRUNK_REQUEST_STATE_BACKLOG:
+		case TRUNK_REQUEST_STATE_PENDING:
+		case TRUNK_REQUEST_STATE_PARTIAL:
+		case TRUNK_REQUEST_STATE_SENT:
+			if (*treq_out) {
+				treq = *treq_out;
+			} else {
+				*treq_out = treq = trunk_request_alloc(trunk, request);
+				if (!treq) return TRUNK_ENQUEUE_FAIL;
+			}
+			treq->pub.preq = preq;
+			treq->pub.rctx = rctx;
+			trunk_request_enter_coalesced(treq, leader);
+
+			FR_PROBE(trunk_request_enqueue, request ? request->number : 0, treq->id, TRUNK_ENQUEUE_OK);
+			return TRUNK_ENQUEUE_OK;
+
+		/*
+		 *	The leader's response may already have
+		 *	been processed, so this request replaces
+		 *	it as the one to coalesce with.
+		 */
+		default:
+			trunk_request_coalesce_remove(leader);
+			break;
+		}
+	}
+
+	ret = trunk_request_enqueue(treq_out, trunk, request, preq, rctx);
+	switch (ret) {
+	case TRUNK_ENQUEUE_OK:
+	case TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		return ret;
+	}
+
+	/*
+	 *	If the connection is always writable,
+	 *	the request may already be complete.
+	 */
+	treq = *treq_out;
+	if (!treq) return ret;
+	switch (treq->pub.state) {
+	case TRUNK_REQUEST_STATE_BACKLOG:
+	case TRUNK_REQUEST_STATE_PENDING:
+	case TRUNK_REQUEST_STATE_PARTIAL:
+	case TRUNK_REQUEST_STATE_SENT:
+		break;
+
+	default:
+		return ret;
+	}
+
+	MEM(treq->key = talloc_memdup(treq, key, key_len));
+	treq->key_len = key_len;
+	fr_rb_insert(trunk->coalesce, treq);
+
+	return ret;
+}
+
+/** Enqueue the followers of a request without it
+ *
+ * The first follower is enqueued, and becomes the leader of the others.
+ *
+ * @param[in] treq	whose followers should be released.
+ */
+static void trunk_request_coalesce_release(trunk_request_t *treq)
+{
+	trunk_t		*trunk = treq->pub.trunk;
+	trunk_request_t	*leader, *follower;
+
+	leader = fr_dlist_head(&treq->followers);
+	if (!leader) {
+		trunk_request_coalesce_remove(treq);
+		return;
+	}
+
+	trunk_request_enter_unassigned(leader);
+
+	while ((follower = fr_dlist_pop_head(&treq->followers))) {
+		follower->leader = leader;
+		fr_dlist_insert_tail(&leader->followers, follower);
+	}
+
+	/*
+	 *	The new leader shares its failure
+	 *	with the other followers.
+	 */
+	if (trunk->freeing) {
+	fail:
+		trunk_request_coalesce_remove(treq);
+		trunk_request_enter_failed(leader);
+		return;
+	}
+
+	switch (trunk_request_enqueue_existing(leader)) {
+	case TRUNK_ENQUEUE_OK:
+	case TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		goto fail;
+	}
+
+	/*
+	 *	New requests coalesce with the
+	 *	new leader.
+	 */
+	if (treq->key) {
+		MEM(leader->key = talloc_memdup(leader, treq->key, treq->key_len));
+		leader->key_len = treq->key_len;
+		trunk_request_coalesce_remove(treq);
+		fr_rb_insert(trunk->coalesce, leader);
+	}
+}
+
 /** Re-enqueue a request on the same connection
  *
  * If the treq has been sent, we assume that we're being signalled to requeue
@@ -3647,6 +4076,39 @@ static void _trunk_connection_on_halted(UNUSED connection_t *conn,
 	talloc_free(tconn);
 }
 
+/** Reserve one of the connections shared between trunks
+ *
+ * @param[in] trunk	wanting to open a connection.
+ * @return
+ *	- true if the connection can be opened.
+ *	- false if all the shared connections are in use.
+ */
+static bool trunk_shared_conn_reserve(trunk_t *trunk)
+{
+	uint_fast32_t	conns;
+
+	if (!trunk->conf.shared) return true;
+
+	conns = atomic_load_explicit(&trunk->conf.shared->conns, memory_order_relaxed);
+	do {
+		if (conns >= trunk->conf.shared_max) return false;
+	} while (!atomic_compare_exchange_weak_explicit(&trunk->conf.shared->conns, &conns, conns + 1,
+							memory_order_relaxed, memory_order_relaxed));
+
+	return true;
+}
+
+/** Return a connection reserved with #trunk_shared_conn_reserve
+ *
+ * @param[in] trunk	the connection belonged to.
+ */
+static inline void trunk_shared_conn_release(trunk_t *trunk)
+{
+	if (!trunk->conf.shared) return;
+
+	atomic_fetch_sub_explicit(&trunk->conf.shared->conns, 1, memory_order_relaxed);
+}
+
 /** Free a connection
  *
  * Enforces orderly free order of children of the tconn
@@ -3708,6 +4170,8 @@ static int _trunk_connection_free(trunk_connection_t *tconn)
 	(void)talloc_free(tconn->pub.conn);
 	tconn->pub.conn = NULL;
 
+	trunk_shared_conn_release(tconn->pub.trunk);
+
 	return 0;
 }
 
@@ -3723,6 +4187,10 @@ static int trunk_connection_spawn(trunk_t *trunk, fr_time_t now)
 {
 	trunk_connection_t	*tconn;
 
+	if (!trunk_shared_conn_reserve(trunk)) {
+		DEBUG4("Not opening connection - All %u shared connections are in use", trunk->conf.shared_max);
+		return -1;
+	}
 
 	/*
 	 *	Call the API client's callback to create
@@ -3845,6 +4313,8 @@ int trunk_connection_pop_cancellation(trunk_request_t **treq_out, trunk_connecti
  *
  * - #trunk_request_signal_sent Successfully sent a request.
  *
+ * Pending requests whose deadline has passed are failed, instead of being returned.
+ *
  * @param[out] treq_out	to process
  * @param[in] tconn	to pop a request from.
  * @return
@@ -3862,10 +4332,34 @@ int trunk_connection_pop_request(trunk_request_t **treq_out, trunk_connection_t
 				"%s can only be called from within request_mux handler",
 				__FUNCTION__)) return -2;
 
-	*treq_out = tconn->partial ? tconn->partial : fr_heap_peek(tconn->pending);
-	if (!*treq_out) return 1;
+	if (tconn->partial) {
+		*treq_out = tconn->partial;
+		return 0;
+	}
 
-	return 0;
+	/*
+	 *	Don't send requests whose replies would arrive
+	 *	too late to be used.
+	 */
+	while ((*treq_out = fr_heap_peek(tconn->pending))) {
+		trunk_request_t	*treq = *treq_out;
+		request_t	*request = treq->pub.request;
+
+		/*
+		 *	Requests coalesced with this one may
+		 *	still have time, so it's sent for them.
+		 */
+		if (!request_expired(request, fr_time()) || !fr_dlist_empty(&treq->followers)) return 0;
+
+		RDEBUG2("Not sending request %" PRIu64 " - Deadline has passed", treq->id);
+		tconn->pub.trunk->pub.req_expired++;
+
+		trunk_request_enter_failed(treq);
+
+		if (unlikely(tconn->pub.state == TRUNK_CONN_HALTED)) return -1;
+	}
+
+	return 1;
 }
 
 /** Signal that a trunk connection is writable
@@ -4095,6 +4589,190 @@ static void trunk_rebalance(trunk_t *trunk)
 	       					      TRUNK_REQUEST_STATE_PENDING, 1, false));
 }
 
+/** Fold the number of requests allocated since the last call into the trunk's arrival rate
+ *
+ * The weight is 1/4, so a surge is reflected within a few management
+ * intervals.
+ *
+ * @param[in] trunk	to update the arrival rate for.
+ * @param[in] now	The current time.
+ */
+static inline void trunk_arrival_rate_update(trunk_t *trunk, fr_time_t now)
+{
+	uint64_t	count = trunk->pub.req_alloc_new + trunk->pub.req_alloc_reused;
+	fr_time_delta_t	elapsed;
+	int64_t		sample, rate;
+
+	if (fr_time_ispos(trunk->rate_last)) {
+		elapsed = fr_time_sub(now, trunk->rate_last);
+		if (!fr_time_delta_ispos(elapsed)) return;
+
+		sample = ((count - trunk->rate_last_count) * NSEC) / fr_time_delta_unwrap(elapsed);
+		rate = trunk->pub.arrival_rate;
+		rate += (sample - rate) / 4;
+		trunk->pub.arrival_rate = (rate > UINT32_MAX) ? UINT32_MAX : rate;
+	}
+
+	trunk->rate_last = now;
+	trunk->rate_last_count = count;
+}
+
+/** Predict how many connections we'll need for the current arrival rate
+ *
+ * By Little's law, the number of outstanding requests is the arrival
+ * rate multiplied by the time each request takes.  That, plus the
+ * configured headroom, is spread across connections at the target
+ * number of requests per connection.
+ *
+ * @param[in] trunk	to predict the number of connections for.
+ * @return
+ *	- 0 if there's no prediction to make.
+ *	- The number of connections needed, capped at the configured maximum.
+ */
+static uint16_t trunk_connections_predicted(trunk_t *trunk)
+{
+	uint64_t	outstanding, needed;
+
+	if (!trunk->conf.target_req_per_conn) return 0;
+
+	outstanding = ((uint64_t)trunk->pub.arrival_rate * fr_time_delta_unwrap(trunk->pub.latency)) / NSEC;
+	outstanding += (outstanding * trunk->conf.headroom) / 100;
+	if (!outstanding) return 0;
+
+	needed = ROUND_UP_DIV(outstanding, trunk->conf.target_req_per_conn);
+	if ((trunk->conf.max > 0) && (needed > trunk->conf.max)) return trunk->conf.max;
+
+	return (needed > UINT16_MAX) ? UINT16_MAX : needed;
+}
+
+/** Open a connection if the predicted demand is more than our current connections can handle
+ *
+ * Unlike the reactive checks in #trunk_manage, this doesn't wait to be
+ * above target for open_delay, so connections are coming up before
+ * requests start backing up.  The connecting limit still applies.
+ *
+ * @param[in] trunk	to manage.
+ * @param[in] now	The current time.
+ * @return
+ *	- true if a connection was opened or reactivated, or opening was throttled.
+ *	- false if no more connections are predicted to be needed.
+ */
+static bool trunk_manage_predictive(trunk_t *trunk, fr_time_t now)
+{
+	trunk_connection_t	*tconn;
+	uint16_t		predicted, conn_count;
+	uint32_t		req_count;
+
+	predicted = trunk_connections_predicted(trunk);
+	if (!predicted) return false;
+
+	trunk_requests_per_connection(&conn_count, &req_count, trunk, now, true);
+	if (conn_count >= predicted) return false;
+
+	if ((trunk->conf.connecting > 0) &&
+	    (trunk_connection_count_by_state(trunk, TRUNK_CONN_CONNECTING) >= trunk->conf.connecting)) {
+		DEBUG4("Not opening predicted connection - Too many (%u) connections in the connecting state",
+		       trunk->conf.connecting);
+		return true;
+	}
+
+	/*
+	 *	Connections which are draining can be
+	 *	used immediately.
+	 */
+	tconn = fr_dlist_head(&trunk->draining);
+	if (tconn) {
+		if (trunk_connection_is_full(tconn)) {
+			trunk_connection_enter_full(tconn);
+		} else {
+			trunk_connection_enter_active(tconn);
+		}
+		return true;
+	}
+
+	DEBUG4("Opening connection - Arrival rate %u/s with latency %pVs predicts %u connections, have %u",
+	       trunk->pub.arrival_rate, fr_box_time_delta(trunk->pub.latency), predicted, conn_count);
+	(void)trunk_connection_spawn(trunk, now);
+
+	return true;
+}
+
+/** Calculate how many connections we need to have spares available
+ *
+ * @param[in] trunk	to calculate the number of connections for.
+ * @param[in] req_count	Requests currently outstanding on the trunk.
+ * @return The number of connections carrying requests at the target
+ *	level, plus the configured number of spares, capped at the
+ *	configured maximum.
+ */
+static uint16_t trunk_connections_spare(trunk_t *trunk, uint32_t req_count)
+{
+	uint64_t	needed = trunk->conf.spare;
+
+	if (trunk->conf.target_req_per_conn) {
+		needed += ROUND_UP_DIV(req_count, trunk->conf.target_req_per_conn);
+	} else if (req_count) {
+		needed++;
+	}
+	if ((trunk->conf.max > 0) && (needed > trunk->conf.max)) return trunk->conf.max;
+
+	return (needed > UINT16_MAX) ? UINT16_MAX : needed;
+}
+
+/** Open a connection if we don't have enough spare connections
+ *
+ * Spare connections have already finished connecting, including any
+ * TLS handshake, so when the load increases, or another connection
+ * fails, requests can be moved onto them immediately.
+ *
+ * Like #trunk_manage_predictive, this doesn't wait for open_delay,
+ * but the connecting limit still applies.
+ *
+ * @param[in] trunk	to manage.
+ * @param[in] now	The current time.
+ * @return
+ *	- true if a connection was opened or reactivated, or opening was throttled.
+ *	- false if we already have enough spare connections.
+ */
+static bool trunk_manage_spare(trunk_t *trunk, fr_time_t now)
+{
+	trunk_connection_t	*tconn;
+	uint16_t		needed, conn_count;
+	uint32_t		req_count;
+
+	trunk_requests_per_connection(&conn_count, &req_count, trunk, now, true);
+
+	needed = trunk_connections_spare(trunk, req_count);
+	if (conn_count >= needed) return false;
+
+	if ((trunk->conf.connecting > 0) &&
+	    (trunk_connection_count_by_state(trunk, TRUNK_CONN_CONNECTING) >= trunk->conf.connecting)) {
+		DEBUG4("Not opening spare connection - Too many (%u) connections in the connecting state",
+		       trunk->conf.connecting);
+		return true;
+	}
+
+	/*
+	 *	Connections which are draining can be
+	 *	used immediately.
+	 */
+	tconn = fr_dlist_head(&trunk->draining);
+	if (tconn) {
+		if (trunk_connection_is_full(tconn)) {
+			trunk_connection_enter_full(tconn);
+		} else {
+			trunk_connection_enter_active(tconn);
+		}
+		return true;
+	}
+
+	DEBUG4("Opening connection - %u requests with %u spare need %u connections, have %u",
+	       req_count, trunk->conf.spare, needed, conn_count);
+	(void)trunk_connection_spawn(trunk, now);
+
+	return true;
+}
+
 /** Implements the algorithm we use to manage requests per connection levels
  *
  * This is executed periodically using a timer event, and opens/closes
@@ -4133,6 +4811,15 @@ static void trunk_rebalance(trunk_t *trunk)
  * - Return if closing a new connection will take us above the load target.
  * - Return if we last closed a connection within 'closed_delay'.
  * - Otherwise we move a connection to draining state.
+ *
+ * If 'predictive' is set, before either of the above, we open a connection
+ * if the arrival rate and latency predict more connections will be needed
+ * than we have (see #trunk_manage_predictive), and we don't close any
+ * connections the prediction says we still need.
+ *
+ * If 'spare' is set, we also open a connection if we have fewer than
+ * are needed for the current requests plus 'spare' (see #trunk_manage_spare),
+ * and we don't close any connections which would take us below that.
  */
 static void trunk_manage(trunk_t *trunk, fr_time_t now)
 {
@@ -4145,6 +4832,8 @@ static void trunk_manage(trunk_t *trunk, fr_time_t now)
 
 	DEBUG4("Managing trunk");
 
+	trunk_arrival_rate_update(trunk, now);
+
 	/*
 	 *	Cleanup requests in our request cache which
 	 *	have been reapable for too long.
@@ -4198,6 +4887,18 @@ static void trunk_manage(trunk_t *trunk, fr_time_t now)
 	 */
 	if (!trunk->managing_connections) return;
 
+	/*
+	 *	Open connections for the load we expect,
+	 *	not just the load we have.
+	 */
+	if (trunk->conf.predictive && trunk_manage_predictive(trunk, now)) return;
+
+	/*
+	 *	Keep connections ready for the load
+	 *	we might get.
+	 */
+	if (trunk->conf.spare && trunk_manage_spare(trunk, now)) return;
+
 	/*
 	 *	We're above the target requests per connection
 	 *	spawn more connections!
@@ -4332,6 +5033,18 @@ static void trunk_manage(trunk_t *trunk, fr_time_t now)
 			return;
 		}
 
+		if (trunk->conf.predictive && (trunk_connections_predicted(trunk) >= conn_count)) {
+			DEBUG4("Not closing connection - Arrival rate %u/s predicts we still need %u connections",
+			       trunk->pub.arrival_rate, conn_count);
+			return;
+		}
+
+		if (trunk->conf.spare && (trunk_connections_spare(trunk, req_count) >= conn_count)) {
+			DEBUG4("Not closing connection - Need %u spare connections above %u requests",
+			       trunk->conf.spare, req_count);
+			return;
+		}
+
 		if (!req_count) {
 			DEBUG4("Closing connection - No outstanding requests");
 			goto close;
@@ -4791,6 +5504,55 @@ static int8_t _trunk_connection_order_by_shortest_queue(void const *one, void co
 	return ((a_count > b_count) && ((a_count - b_count) > 1)) - ((b_count > a_count) && ((b_count - a_count) > 1));
 }
 
+static fr_metric_family_t const trunk_metric_connections = {
+	.name = "freeradius_trunk_connections", .type = FR_METRIC_GAUGE,
+	.help = "Connections in a trunk, by connection state."
+};
+static fr_metric_family_t const trunk_metric_requests = {
+	.name = "freeradius_trunk_requests", .type = FR_METRIC_COUNTER,
+	.help = "Requests allocated by a trunk."
+};
+static fr_metric_family_t const trunk_metric_requests_outstanding = {
+	.name = "freeradius_trunk_requests_outstanding", .type = FR_METRIC_GAUGE,
+	.help = "Requests allocated by a trunk, and not yet complete."
+};
+static fr_metric_family_t const trunk_metric_requests_backlog = {
+	.name = "freeradius_trunk_requests_backlog", .type = FR_METRIC_GAUGE,
+	.help = "Requests waiting for a connection to become available."
+};
+static fr_metric_family_t const trunk_metric_latency = {
+	.name = "freeradius_trunk_request_latency_seconds", .type = FR_METRIC_GAUGE,
+	.help = "Moving average of the time between a request being sent, and it completing."
+};
+
+/** Add the trunk's counters to a scrape
+ *
+ * Only the list and heap element counts are read, so we don't walk any
+ * structures the owning thread may be modifying.
+ */
+static void trunk_metrics(fr_metrics_t *m, void const *uctx)
+{
+	trunk_t		*trunk = UNCONST(trunk_t *, uctx);
+	size_t		i;
+
+	for (i = 0; i < trunk_connection_states_len; i++) {
+		if (trunk_connection_states[i].value == TRUNK_CONN_HALTED) continue;
+
+		fr_metrics_add(m, &trunk_metric_connections,
+			       trunk_connection_count_by_state(trunk, trunk_connection_states[i].value),
+			       "trunk", trunk->log_prefix, "state", trunk_connection_states[i].name.str, NULL);
+	}
+
+	fr_metrics_add(m, &trunk_metric_requests, trunk->pub.req_alloc_new + trunk->pub.req_alloc_reused,
+		       "trunk", trunk->log_prefix, NULL);
+	fr_metrics_add(m, &trunk_metric_requests_outstanding, trunk->pub.req_alloc,
+		       "trunk", trunk->log_prefix, NULL);
+	fr_metrics_add(m, &trunk_metric_requests_backlog, fr_heap_num_elements(trunk->backlog),
+		       "trunk", trunk->log_prefix, NULL);
+	fr_metrics_add(m, &trunk_metric_latency, fr_time_delta_unwrap(trunk->pub.latency) / (double)NSEC,
+		       "trunk", trunk->log_prefix, NULL);
+}
+
 /** Free a trunk, gracefully closing all connections.
  *
  */
@@ -4803,6 +5565,8 @@ static int _trunk_free(trunk_t *trunk)
 
 	DEBUG4("Trunk free %p", trunk);
 
+	TALLOC_FREE(trunk->metrics);
+
 	trunk->freeing = true;	/* Prevent re-enqueuing */
 
 	/*
@@ -4852,6 +5616,24 @@ static int _trunk_free(trunk_t *trunk)
 	return 0;
 }
 
+/** Allocate the state shared between all trunks using a configuration
+ *
+ * Must be called before any trunks are allocated with the configuration,
+ * usually when a module is instantiated.  Does nothing if there's no
+ * shared_max.
+ *
+ * @param[in] ctx	to allocate the shared state in.  Must outlive
+ *			all trunks using the configuration.
+ * @param[in] conf	to allocate shared state for.
+ */
+void trunk_conf_shared_alloc(TALLOC_CTX *ctx, trunk_conf_t *conf)
+{
+	if (!conf->shared_max) return;
+
+	MEM(conf->shared = talloc_zero(ctx, trunk_shared_t));
+	atomic_init(&conf->shared->conns, 0);
+}
+
 /** Allocate a new collection of connections
  *
  * This function should be called first to allocate a new trunk connection.
@@ -4916,6 +5698,12 @@ trunk_t *trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 	MEM(trunk->backlog = fr_heap_talloc_alloc(trunk, _trunk_request_prioritise,
 						   trunk_request_t, heap_id, 0));
 
+	/*
+	 *	Requests which can be coalesced with
+	 */
+	MEM(trunk->coalesce = fr_rb_inline_talloc_alloc(trunk, trunk_request_t, coalesce_node,
+							 _trunk_request_key_cmp, NULL));
+
 	/*
 	 *	Connection queues and trees
 	 */
@@ -4938,6 +5726,8 @@ trunk_t *trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 		fr_dlist_talloc_init(&trunk->watch[i], trunk_watch_entry_t, entry);
 	}
 
+	MEM(trunk->metrics = fr_metrics_source_alloc(trunk, trunk_metrics, trunk));
+
 	DEBUG4("Trunk allocated %p", trunk);
 
 	if (!delay_start) {
@@ -186,6 +186,8 @@ typedef enum {
 								///< the request has been cancelled.
 	TRUNK_REQUEST_STATE_CANCEL_PARTIAL	= 0x0400,	//!< We partially wrote a cancellation request.
 	TRUNK_REQUEST_STATE_CANCEL_COMPLETE	= 0x0800,	//!< Remote server has acknowledged our cancellation.
+	TRUNK_REQUEST_STATE_COALESCED		= 0x1000,	//!< Waiting for the result of an identical request
+								///< which is already in progress.
 
 } trunk_request_state_t;
 
@@ -204,7 +206,8 @@ typedef enum {
 	TRUNK_REQUEST_STATE_CANCEL | \
 	TRUNK_REQUEST_STATE_CANCEL_PARTIAL | \
 	TRUNK_REQUEST_STATE_CANCEL_SENT | \
-	TRUNK_REQUEST_STATE_CANCEL_COMPLETE \
+	TRUNK_REQUEST_STATE_CANCEL_COMPLETE | \
+	TRUNK_REQUEST_STATE_COALESCED \
 )
 
 /** All requests in various cancellation states
@@ -221,6 +224,11 @@ typedef enum {
 /** Common configuration parameters for a trunk
  *
  */
+/** State shared between all the trunks using the same configuration
+ *
+ */
+typedef struct trunk_shared_s trunk_shared_t;
+
 typedef struct {
 	connection_conf_t const *conn_conf;		//!< Connection configuration.
 
@@ -279,6 +287,28 @@ typedef struct {
 	bool			backlog_on_failed_conn;	//!< Assign requests to the backlog when there are no
 							//!< available connections and the last connection event
 							//!< was a failure, instead of failing them immediately.
+
+	bool			coalesce;		//!< Let requests enqueued with a key wait for the
+							///< result of an identical request which is already
+							///< in progress, instead of being sent themselves.
+
+	bool			predictive;		//!< Open connections ahead of demand, based on the
+							///< arrival rate of requests and their latency.
+
+	uint32_t		headroom;		//!< Percentage of extra capacity to open, above the
+							///< predicted demand.
+
+	uint16_t		spare;			//!< Number of connections to keep open above the
+							///< number needed for the current requests, so
+							///< extra load can be moved onto connections which
+							///< have already finished connecting.
+
+	uint16_t		shared_max;		//!< Maximum number of connections across all trunks
+							///< using this configuration, i.e. across all threads.
+							///< 0 means no limit.
+
+	trunk_shared_t		*shared;		//!< Connection counts shared between trunks.
+							///< Allocated by #trunk_conf_shared_alloc.
 } trunk_conf_t;
 
 /** Public fields for the trunk
@@ -322,6 +352,18 @@ struct trunk_pub_s {
 	uint64_t _CONST		req_alloc_new;		//!< How many requests we've allocated.
 
 	uint64_t _CONST		req_alloc_reused;	//!< How many requests were reused.
+
+	uint64_t _CONST		req_coalesced;		//!< How many requests received the result of an
+							///< identical request, instead of being sent.
+
+	uint64_t _CONST		req_expired;		//!< How many requests were failed instead of being
+							///< sent, because their deadline had passed.
+
+	fr_time_delta_t _CONST	latency;		//!< Moving average of the time between a request
+							///< first being sent, and it completing.
+
+	uint32_t _CONST		arrival_rate;		//!< Moving average of the number of requests
+							///< allocated per second.
 	/** @} */
 
 	bool _CONST		triggers;		//!< do we run the triggers?
@@ -688,6 +730,30 @@ typedef void (*trunk_request_complete_t)(request_t *request, void *preq, void *r
 typedef void (*trunk_request_fail_t)(request_t *request, void *preq, void *rctx,
 					trunk_request_state_t state, void *uctx);
 
+/** Copy the result of a request to an identical request which was waiting for it
+ *
+ * Called for each request coalesced with a request which has just completed,
+ * before the request_complete callback is called for the completed request.
+ *
+ * The result should be copied, or shared, so that it remains valid after the
+ * leader's preq has been freed.
+ *
+ * If the result is copied, the coalesced request is then completed, as if it had
+ * been sent itself.  If the result can't be shared, the coalesced request is
+ * enqueued by itself.
+ *
+ * @param[in] request		The coalesced request.
+ * @param[in] preq		of the coalesced request, to copy the result into.
+ * @param[in] rctx		of the coalesced request.
+ * @param[in] leader_preq	of the request which was sent, holding the result.
+ * @param[in] uctx		User context data passed to #trunk_alloc.
+ * @return
+ *	- 0 if the result was copied.
+ *	- -1 if the result can't be shared.
+ */
+typedef int (*trunk_request_coalesce_t)(request_t *request, void *preq, void *rctx,
+					void *leader_preq, void *uctx);
+
 /** Free resources associated with a trunk request
  *
  * The trunk request is complete.  If there's a request still associated with the
@@ -751,6 +817,9 @@ typedef struct {
 
 	trunk_request_fail_t		request_fail;		//!< Request failed, write out a canned response.
 
+	trunk_request_coalesce_t	request_coalesce;	//!< Copy the result of a request to requests
+								///< which were coalesced with it.
+
 	trunk_request_free_t		request_free;		//!< Free the preq and any resources it holds and
 								///< provide a chance to mark the request as runnable.
 } trunk_io_funcs_t;
@@ -800,6 +869,10 @@ trunk_request_t *trunk_request_alloc(trunk_t *trunk, request_t *request) CC_HINT
 trunk_enqueue_t trunk_request_enqueue(trunk_request_t **treq, trunk_t *trunk, request_t *request,
 					    void *preq, void *rctx) CC_HINT(nonnull(2));
 
+trunk_enqueue_t trunk_request_enqueue_coalesce(trunk_request_t **treq, trunk_t *trunk, request_t *request,
+					       void *preq, void *rctx, uint8_t const *key, size_t key_len)
+					       CC_HINT(nonnull(2));
+
 trunk_enqueue_t trunk_request_requeue(trunk_request_t *treq) CC_HINT(nonnull);
 
 trunk_enqueue_t trunk_request_enqueue_on_conn(trunk_request_t **treq_out, trunk_connection_t *tconn,
@@ -902,6 +975,8 @@ int		trunk_connection_manage_schedule(trunk_t *trunk) CC_HINT(nonnull);
 trunk_t	*trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 				trunk_io_funcs_t const *funcs, trunk_conf_t const *conf,
 				char const *log_prefix, void const *uctx, bool delay_start) CC_HINT(nonnull(2, 3, 4));
+
+void		trunk_conf_shared_alloc(TALLOC_CTX *ctx, trunk_conf_t *conf) CC_HINT(nonnull);
 /** @} */
 
 /** @name Watchers
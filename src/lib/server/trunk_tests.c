@@ -16,6 +16,8 @@ typedef struct {
 	bool			freed;			//!< Seen by the free callback.
 	bool			signal_partial;		//!< Muxer should signal that this request is partially written.
 	bool			signal_cancel_partial;	//!< Muxer should signal that this request is partially cancelled.
+	bool			coalesced;		//!< Seen by the coalesce callback.
+	bool			refuse_coalesce;	//!< Coalesce callback should refuse to share the result.
 	int			priority;		//!< Priority of request
 } test_proto_request_t;
 
@@ -234,6 +236,19 @@ static void test_request_fail(UNUSED request_t *request, void *preq, UNUSED void
 	if (stats) stats->failed++;
 }
 
+static int test_request_coalesce(UNUSED request_t *request, void *preq, UNUSED void *rctx,
+				 void *leader_preq, UNUSED void *uctx)
+{
+	test_proto_request_t	*our_preq = talloc_get_type_abort(preq, test_proto_request_t);
+
+	(void)talloc_get_type_abort(leader_preq, test_proto_request_t);
+
+	if (our_preq->refuse_coalesce) return -1;
+
+	our_preq->coalesced = true;
+	return 0;
+}
+
 static void test_request_free(UNUSED request_t *request, void *preq, void *uctx)
 {
 	test_proto_stats_t	*stats = uctx;
@@ -365,6 +380,7 @@ static trunk_t *test_setup_trunk(TALLOC_CTX *ctx, fr_event_list_t *el, trunk_con
 					.request_cancel = test_request_cancel,
 					.request_complete = test_request_complete,
 					.request_fail = test_request_fail,
+					.request_coalesce = test_request_coalesce,
 					.request_free = test_request_free
 				};
 
@@ -756,6 +772,200 @@ static void test_enqueue_basic(void)
 	talloc_free(ctx);
 }
 
+/*
+ *	Test the latency average is updated as requests complete
+ */
+static void test_enqueue_latency(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	trunk_t		*trunk;
+	fr_event_list_t		*el;
+	trunk_conf_t		conf = {
+					.start = 1,
+					.min = 1,
+					.manage_interval = fr_time_delta_from_nsec(NSEC * 0.5)
+				};
+	test_proto_request_t	*preq;
+	trunk_request_t	*treq = NULL;
+	fr_time_delta_t		delay[] = { fr_time_delta_from_msec(100), fr_time_delta_from_msec(900) };
+	fr_time_delta_t		expected[] = { fr_time_delta_from_msec(100), fr_time_delta_from_msec(200) };
+	size_t			i;
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+
+	TEST_CHECK(fr_time_delta_eq(trunk->pub.latency, fr_time_delta_wrap(0)));
+
+	for (i = 0; i < NUM_ELEMENTS(delay); i++) {
+		preq = talloc_zero(NULL, test_proto_request_t);
+		treq = NULL;
+		TEST_CHECK(trunk_request_enqueue(&treq, trunk, NULL, preq, NULL) >= 0);
+		preq->treq = treq;
+
+		/*
+		 *	Establish the connection (first time only), then
+		 *	write the request.
+		 */
+		while (trunk_request_count_by_state(trunk, TRUNK_CONN_ALL, TRUNK_REQUEST_STATE_SENT) == 0) {
+			fr_event_corral(el, test_time_base, false);
+			fr_event_service(el);
+		}
+
+		/*
+		 *	The response takes this long to come back.
+		 */
+		test_time_base = fr_time_add(test_time_base, delay[i]);
+
+		while (!preq->completed) {
+			fr_event_corral(el, test_time_base, false);
+			fr_event_service(el);
+		}
+
+		TEST_CHECK(fr_time_delta_eq(trunk->pub.latency, expected[i]));
+		TEST_MSG("Expected latency %"PRId64", got %"PRId64,
+			 fr_time_delta_unwrap(expected[i]), fr_time_delta_unwrap(trunk->pub.latency));
+		talloc_free(preq);
+	}
+
+	talloc_free(trunk);
+	talloc_free(ctx);
+}
+
+static test_proto_request_t *test_enqueue_keyed(trunk_t *trunk, char const *key)
+{
+	test_proto_request_t	*preq;
+	trunk_request_t		*treq = NULL;
+
+	preq = talloc_zero(NULL, test_proto_request_t);
+	TEST_CHECK(trunk_request_enqueue_coalesce(&treq, trunk, NULL, preq, NULL,
+						  (uint8_t const *)key, strlen(key)) >= 0);
+	preq->treq = treq;
+
+	return preq;
+}
+
+static void test_enqueue_coalesce_run(fr_event_list_t *el, test_proto_request_t **preqs, size_t num)
+{
+	size_t	i;
+
+	for (i = 0; i < num; i++) {
+		while (!preqs[i]->completed && !preqs[i]->failed) {
+			fr_event_corral(el, test_time_base, false);
+			fr_event_service(el);
+		}
+	}
+}
+
+/*
+ *	Test identical requests waiting for the result of a request in progress
+ */
+static void test_enqueue_coalesce(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	trunk_t			*trunk;
+	fr_event_list_t		*el;
+	trunk_conf_t		conf = {
+					.start = 1,
+					.min = 1,
+					.manage_interval = fr_time_delta_from_nsec(NSEC * 0.5),
+					.coalesce = true
+				};
+	test_proto_request_t	*preq[4];
+	size_t			i;
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	TEST_CASE("Followers receive the leader's result");
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+	preq[0] = test_enqueue_keyed(trunk, "a");
+	preq[1] = test_enqueue_keyed(trunk, "a");
+	preq[2] = test_enqueue_keyed(trunk, "a");
+	preq[3] = test_enqueue_keyed(trunk, "b");
+
+	TEST_CHECK(preq[1]->treq->pub.state == TRUNK_REQUEST_STATE_COALESCED);
+	TEST_CHECK(preq[2]->treq->pub.state == TRUNK_REQUEST_STATE_COALESCED);
+	TEST_CHECK(preq[3]->treq->pub.state != TRUNK_REQUEST_STATE_COALESCED);
+
+	test_enqueue_coalesce_run(el, preq, NUM_ELEMENTS(preq));
+
+	TEST_CHECK(preq[0]->completed && !preq[0]->coalesced);
+	TEST_CHECK(preq[1]->completed && preq[1]->coalesced);
+	TEST_CHECK(preq[2]->completed && preq[2]->coalesced);
+	TEST_CHECK(preq[3]->completed && !preq[3]->coalesced);
+	for (i = 0; i < NUM_ELEMENTS(preq); i++) {
+		TEST_CHECK(preq[i]->freed);
+		talloc_free(preq[i]);
+	}
+	TEST_CHECK(trunk->pub.req_coalesced == 2);
+	TEST_CHECK(fr_rb_num_elements(trunk->coalesce) == 0);
+	talloc_free(trunk);
+
+	TEST_CASE("Followers are sent when the leader is cancelled");
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+	preq[0] = test_enqueue_keyed(trunk, "a");
+	preq[1] = test_enqueue_keyed(trunk, "a");
+	preq[2] = test_enqueue_keyed(trunk, "a");
+
+	trunk_request_signal_cancel(preq[0]->treq);
+	TEST_CHECK(preq[0]->freed);
+	TEST_CHECK(preq[1]->treq->pub.state != TRUNK_REQUEST_STATE_COALESCED);
+	TEST_CHECK(preq[2]->treq->pub.state == TRUNK_REQUEST_STATE_COALESCED);
+
+	test_enqueue_coalesce_run(el, &preq[1], 2);
+
+	TEST_CHECK(preq[1]->completed && !preq[1]->coalesced);
+	TEST_CHECK(preq[2]->completed && preq[2]->coalesced);
+	for (i = 0; i < 3; i++) talloc_free(preq[i]);
+	talloc_free(trunk);
+
+	TEST_CASE("Followers which can't use the result are sent by themselves");
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+	preq[0] = test_enqueue_keyed(trunk, "a");
+	preq[1] = test_enqueue_keyed(trunk, "a");
+	preq[1]->refuse_coalesce = true;
+
+	test_enqueue_coalesce_run(el, preq, 2);
+
+	TEST_CHECK(preq[0]->completed);
+	TEST_CHECK(preq[1]->completed && !preq[1]->coalesced);
+	TEST_CHECK(trunk->pub.req_coalesced == 0);
+	for (i = 0; i < 2; i++) talloc_free(preq[i]);
+	talloc_free(trunk);
+
+	TEST_CASE("Followers fail with the leader");
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+	preq[0] = test_enqueue_keyed(trunk, "a");
+	preq[1] = test_enqueue_keyed(trunk, "a");
+
+	talloc_free(trunk);	/* Fails requests in the backlog */
+
+	TEST_CHECK(preq[0]->failed);
+	TEST_CHECK(preq[1]->failed && !preq[1]->coalesced);
+	TEST_CHECK(preq[1]->freed);
+	for (i = 0; i < 2; i++) talloc_free(preq[i]);
+
+	TEST_CASE("Requests aren't coalesced unless enabled");
+	conf.coalesce = false;
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+	preq[0] = test_enqueue_keyed(trunk, "a");
+	preq[1] = test_enqueue_keyed(trunk, "a");
+	TEST_CHECK(preq[1]->treq->pub.state != TRUNK_REQUEST_STATE_COALESCED);
+
+	test_enqueue_coalesce_run(el, preq, 2);
+	TEST_CHECK(preq[0]->completed && preq[1]->completed && !preq[1]->coalesced);
+	for (i = 0; i < 2; i++) talloc_free(preq[i]);
+	talloc_free(trunk);
+
+	talloc_free(ctx);
+}
+
 /*
  *	Test request cancellations when the connection is in various states
  */
@@ -1429,6 +1639,148 @@ static void test_connection_start_on_enqueue(void)
 	talloc_free(preq);
 }
 
+static void test_connection_predictive(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	trunk_t		*trunk;
+	fr_event_list_t		*el;
+	trunk_conf_t		conf = {
+					.start = 0,
+					.min = 0,
+					.max = 4,
+					.target_req_per_conn = 10,
+					.predictive = true,
+					.headroom = 0,
+					.manage_interval = fr_time_delta_from_nsec(NSEC * 0.5)
+				};
+	fr_time_t		now;
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	test_time_base = fr_time_add_time_delta(test_time_base, fr_time_delta_from_nsec(NSEC * 0.5));
+	now = test_time_base;
+
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+
+	TEST_CASE("No latency - No prediction");
+	trunk_arrival_rate_update(trunk, now);
+	trunk->pub.req_alloc_new += 400;
+	now = fr_time_add(now, fr_time_delta_from_sec(1));
+	trunk_arrival_rate_update(trunk, now);
+	TEST_CHECK_LEN(trunk->pub.arrival_rate, 100);
+	TEST_CHECK_LEN(trunk_connections_predicted(trunk), 0);
+
+	TEST_CASE("100/s at 100ms - One connection");
+	trunk->pub.latency = fr_time_delta_from_msec(100);
+	TEST_CHECK_LEN(trunk_connections_predicted(trunk), 1);
+
+	TEST_CASE("100/s at 100ms, 100% headroom - Two connections");
+	trunk->conf.headroom = 100;
+	TEST_CHECK_LEN(trunk_connections_predicted(trunk), 2);
+
+	TEST_CASE("Surge - Capped at max");
+	trunk->pub.req_alloc_new += 16000;
+	now = fr_time_add(now, fr_time_delta_from_sec(1));
+	trunk_arrival_rate_update(trunk, now);
+	TEST_CHECK_LEN(trunk->pub.arrival_rate, 4075);
+	TEST_CHECK_LEN(trunk_connections_predicted(trunk), 4);
+
+	TEST_CASE("No connections - Predictive management spawns");
+	TEST_CHECK(trunk_manage_predictive(trunk, now));
+	TEST_CHECK_LEN(trunk_connection_count_by_state(trunk, TRUNK_CONN_ALL), 1);
+
+	talloc_free(trunk);
+	talloc_free(ctx);
+}
+
+static void test_connection_shared_max(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	trunk_t		*trunk_a, *trunk_b;
+	fr_event_list_t		*el;
+	trunk_conf_t		conf = {
+					.start = 0,
+					.min = 0,
+					.max = 2,
+					.shared_max = 2,
+					.manage_interval = fr_time_delta_from_nsec(NSEC * 0.5)
+				};
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	trunk_conf_shared_alloc(ctx, &conf);
+	trunk_a = test_setup_trunk(ctx, el, &conf, true, NULL);
+	trunk_b = test_setup_trunk(ctx, el, &conf, true, NULL);
+
+	TEST_CASE("Spawn up to the shared limit");
+	TEST_CHECK(trunk_connection_spawn(trunk_a, test_time_base) == 0);
+	TEST_CHECK(trunk_connection_spawn(trunk_b, test_time_base) == 0);
+
+	TEST_CASE("Shared limit reached - MUST NOT spawn");
+	TEST_CHECK(trunk_connection_spawn(trunk_a, test_time_base) < 0);
+	TEST_CHECK(trunk_connection_spawn(trunk_b, test_time_base) < 0);
+	TEST_CHECK_LEN(trunk_connection_count_by_state(trunk_a, TRUNK_CONN_ALL), 1);
+
+	TEST_CASE("Freeing a trunk releases its connections");
+	talloc_free(trunk_a);
+	TEST_CHECK(trunk_connection_spawn(trunk_b, test_time_base) == 0);
+
+	talloc_free(trunk_b);
+	talloc_free(ctx);
+}
+
+static void test_connection_spare(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	trunk_t		*trunk;
+	fr_event_list_t		*el;
+	trunk_conf_t		conf = {
+					.start = 0,
+					.min = 0,
+					.max = 4,
+					.target_req_per_conn = 10,
+					.spare = 2,
+					.manage_interval = fr_time_delta_from_nsec(NSEC * 0.5)
+				};
+	fr_time_t		now;
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	test_time_base = fr_time_add_time_delta(test_time_base, fr_time_delta_from_nsec(NSEC * 0.5));
+	now = test_time_base;
+
+	trunk = test_setup_trunk(ctx, el, &conf, true, NULL);
+
+	TEST_CASE("No requests - Spares only");
+	TEST_CHECK_LEN(trunk_connections_spare(trunk, 0), 2);
+
+	TEST_CASE("15 requests - Two busy connections plus spares");
+	TEST_CHECK_LEN(trunk_connections_spare(trunk, 15), 4);
+
+	TEST_CASE("Many requests - Capped at max");
+	TEST_CHECK_LEN(trunk_connections_spare(trunk, 100), 4);
+
+	TEST_CASE("No connections - Spare management spawns until we have the spares");
+	TEST_CHECK(trunk_manage_spare(trunk, now));
+	TEST_CHECK_LEN(trunk_connection_count_by_state(trunk, TRUNK_CONN_ALL), 1);
+	TEST_CHECK(trunk_manage_spare(trunk, now));
+	TEST_CHECK_LEN(trunk_connection_count_by_state(trunk, TRUNK_CONN_ALL), 2);
+	TEST_CHECK(!trunk_manage_spare(trunk, now));
+	TEST_CHECK_LEN(trunk_connection_count_by_state(trunk, TRUNK_CONN_ALL), 2);
+
+	talloc_free(trunk);
+	talloc_free(ctx);
+}
+
 static void test_connection_rebalance_requests(void)
 {
 	TALLOC_CTX		*ctx = talloc_init_const("test");
@@ -1951,6 +2303,8 @@ TEST_LIST = {
 	{ "Enqueue - Basic",				test_enqueue_basic },
 	{ "Enqueue - Cancellation points",		test_enqueue_cancellation_points },
 	{ "Enqueue - Partial state transitions",	test_partial_to_complete_states },
+	{ "Enqueue - Latency",				test_enqueue_latency },
+	{ "Enqueue - Coalesce",				test_enqueue_coalesce },
 	{ "Requeue - On reconnect",			test_requeue_on_reconnect },
 
 	/*
@@ -1964,6 +2318,9 @@ TEST_LIST = {
 	{ "Spawn - Test connection start on enqueue",	test_connection_start_on_enqueue },
 	{ "Spawn - Connection levels max",		test_connection_levels_max },
 	{ "Spawn - Connection levels alternating edges",test_connection_levels_alternating_edges },
+	{ "Spawn - Predictive",				test_connection_predictive },
+	{ "Spawn - Spare",				test_connection_spare },
+	{ "Spawn - Shared max",				test_connection_shared_max },
 
 	/*
 	 *	Performance tests
@@ -45,12 +45,20 @@ RCSID("$Id$")
 #include <freeradius-devel/io/master.h>
 #include <freeradius-devel/io/listen.h>
 
+#include <sys/stat.h>
+
 typedef struct {
 	module_instance_t		*proto_mi;		//!< The proto_* module for a listen section.
 	fr_app_t const			*proto_module;		//!< Public interface to the proto_mi.
 								///< cached for convenience.
 } fr_virtual_listen_t;
 
+typedef struct {
+	char const			*filename;		//!< The server was (partly) read from.
+	struct stat			buf;			//!< stat of the file when it was read.
+	uint32_t			hash;			//!< Of the file's contents.
+} fr_virtual_server_file_t;
+
 struct virtual_server_s {
 	CONF_SECTION			*server_cs;		//!< The server section.
 	fr_virtual_listen_t		**listeners;		//!< Listeners in this virtual server.
@@ -62,6 +70,9 @@ struct virtual_server_s {
 								///< cached for convenience.
 
 	fr_rb_tree_t			*sections;		//!< List of sections that need to be compiled.
+
+	fr_virtual_server_file_t	*files;			//!< Files the server was read from.  Used
+								///< to tell which servers have changed on HUP.
 };
 
 static fr_dict_t const *dict_freeradius;
@@ -524,6 +535,82 @@ static int8_t virtual_server_compile_name_cmp(void const *a, void const *b)
  *	- 0 on success.
  *	- -1 on failure.
  */
+/** Hash the contents of a file
+ *
+ * @param[out] out	Where to write the hash.
+ * @param[out] buf	Where to write the stat of the file which was hashed.
+ * @param[in] filename	to hash.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the file couldn't be read.
+ */
+static int virtual_server_file_hash(uint32_t *out, struct stat *buf, char const *filename)
+{
+	FILE		*fp;
+	uint8_t		data[8192];
+	size_t		len;
+	uint32_t	hash = 0;
+
+	fp = fopen(filename, "r");
+	if (!fp) return -1;
+
+	if (fstat(fileno(fp), buf) < 0) {
+		fclose(fp);
+		return -1;
+	}
+
+	while ((len = fread(data, 1, sizeof(data), fp)) > 0) hash = fr_hash_update(data, len, hash);
+
+	if (ferror(fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	*out = hash;
+	return 0;
+}
+
+/** Record every file the items in a section were read from
+ *
+ */
+static void virtual_server_files_add(virtual_server_t *server, CONF_SECTION *cs)
+{
+	CONF_ITEM	*ci = NULL;
+	char const	*filename;
+	size_t		i, num;
+
+	filename = cf_filename(cs);
+	if (filename) {
+		num = talloc_array_length(server->files);
+
+		for (i = 0; i < num; i++) {
+			if ((server->files[i].filename == filename) ||
+			    (strcmp(server->files[i].filename, filename) == 0)) break;
+		}
+
+		if (i == num) {
+			fr_virtual_server_file_t file = { .filename = filename };
+
+			/*
+			 *	We've just read it, so this should only
+			 *	fail if it's been removed since.
+			 */
+			if (virtual_server_file_hash(&file.hash, &file.buf, filename) == 0) {
+				MEM(server->files = talloc_realloc(server, server->files,
+								   fr_virtual_server_file_t, num + 1));
+				server->files[num] = file;
+			}
+		}
+	}
+
+	while ((ci = cf_item_next(cs, ci))) {
+		if (!cf_item_is_section(ci)) continue;
+
+		virtual_server_files_add(server, cf_item_to_section(ci));
+	}
+}
+
 static int server_parse(UNUSED TALLOC_CTX *ctx, void *out, UNUSED void *parent,
 			CONF_ITEM *ci, UNUSED conf_parser_t const *rule)
 {
@@ -546,6 +633,12 @@ static int server_parse(UNUSED TALLOC_CTX *ctx, void *out, UNUSED void *parent,
 	 */
 	if (cf_section_parse(out, server, server_cs) < 0) return -1;
 
+	/*
+	 *	Remember what the server was read from, so that
+	 *	we can tell if it's changed.
+	 */
+	virtual_server_files_add(server, server_cs);
+
 	/*
 	 *	And cache this struct for later referencing.
 	 */
@@ -1618,6 +1711,52 @@ int virtual_servers_bootstrap(CONF_SECTION *config)
 	return 0;
 }
 
+/** Check which virtual servers have changed since they were loaded
+ *
+ * A virtual server has changed if the contents of any of the files
+ * it was read from have changed.  Files whose size, mtime and inode
+ * are unchanged aren't re-read.
+ *
+ * @return the number of virtual servers which have changed.
+ */
+int virtual_servers_changed(void)
+{
+	size_t	i, j, server_cnt, file_cnt;
+	int	changed = 0;
+
+	if (!virtual_servers) return 0;
+
+	server_cnt = talloc_array_length(virtual_servers);
+	for (i = 0; i < server_cnt; i++) {
+		virtual_server_t const *vs = virtual_servers[i];
+
+		file_cnt = talloc_array_length(vs->files);
+		for (j = 0; j < file_cnt; j++) {
+			fr_virtual_server_file_t const	*file = &vs->files[j];
+			struct stat			buf;
+			uint32_t			hash;
+
+			if ((stat(file->filename, &buf) == 0) &&
+			    (buf.st_size == file->buf.st_size) &&
+			    (buf.st_mtime == file->buf.st_mtime) &&
+			    (buf.st_ino == file->buf.st_ino) &&
+			    (buf.st_dev == file->buf.st_dev)) continue;
+
+			if ((virtual_server_file_hash(&hash, &buf, file->filename) == 0) &&
+			    (hash == file->hash)) continue;
+
+			break;
+		}
+
+		if (j == file_cnt) continue;
+
+		INFO("Virtual server %s has changed (%s)", cf_section_name2(vs->server_cs), vs->files[j].filename);
+		changed++;
+	}
+
+	return changed;
+}
+
 int virtual_servers_free(void)
 {
 	if (talloc_free(listen_addr_root) < 0) return -1;
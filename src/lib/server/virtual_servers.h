@@ -135,6 +135,8 @@ int		virtual_servers_instantiate(void) CC_HINT(nonnull);
 
 int		virtual_servers_bootstrap(CONF_SECTION *config) CC_HINT(nonnull);
 
+int		virtual_servers_changed(void);
+
 int		virtual_servers_free(void);
 
 int		virtual_servers_init(void) CC_HINT(nonnull);
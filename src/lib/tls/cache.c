@@ -46,6 +46,8 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #include <openssl/ssl.h>
 #include <openssl/kdf.h>
+#include <openssl/core_names.h>
+#include <openssl/rand.h>
 
 /** Retrieve session ID (in binary form) from the session
  *
@@ -338,45 +340,37 @@ static void tls_cache_delete_request(SSL_SESSION *sess)
 	if (tls_session->can_pause) ASYNC_pause_job();
 }
 
-/** Process the result of `session load { ... }`
+/** Deserialise session data, and make it available to tls_cache_load_cb
+ *
+ * @param[in] request		The current request.
+ * @param[in] tls_session	The current TLS session.
+ * @param[in] data		Serialised session.
+ * @param[in] data_len		Length of the serialised session.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSED int *priority,
-					     request_t *request, void *uctx)
+static int tls_cache_session_load(request_t *request, fr_tls_session_t *tls_session,
+				  uint8_t const *data, size_t data_len)
 {
-	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
 	fr_tls_cache_t		*tls_cache = tls_session->cache;
-	fr_pair_t		*vp;
 	uint8_t const		*q, **p;
 	SSL_SESSION		*sess;
 
-	vp = fr_pair_find_by_da(&request->reply_pairs, NULL, attr_tls_packet_type);
-	if (!vp || (vp->vp_uint32 != enum_tls_packet_type_success->vb_uint32)) {
-		RWDEBUG("Failed acquiring session data");
-	error:
-		tls_cache->load.state = FR_TLS_CACHE_LOAD_FAILED;
-		return UNLANG_ACTION_CALCULATE_RESULT;
-	}
-
-	vp = fr_pair_find_by_da(&request->reply_pairs, NULL, attr_tls_session_data);
-	if (!vp) {
-		RWDEBUG("No cached session found");
-		goto error;
-	}
-
-	q = vp->vp_octets;	/* openssl will mutate q, so we can't use vp_octets directly */
+	q = data;	/* openssl will mutate q, so we can't use data directly */
 	p = (unsigned char const **)&q;
 
-	sess = d2i_SSL_SESSION(NULL, p, vp->vp_length);
+	sess = d2i_SSL_SESSION(NULL, p, data_len);
 	if (!sess) {
 		fr_tls_log(request, "Failed loading persisted session");
-		goto error;
+		return -1;
 	}
 
 	if (RDEBUG_ENABLED3) {
 		SESSION_ID(sess_id, sess);
 
 		RDEBUG3("Session ID %pV - Read %zu bytes of data.  "
-			"Session de-serialized successfully", &sess_id, vp->vp_length);
+			"Session de-serialized successfully", &sess_id, data_len);
 		SSL_SESSION_print(fr_tls_request_log_bio(request, L_DBG, L_DBG_LVL_3), sess);
 	}
 
@@ -394,6 +388,78 @@ static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSE
 	tls_cache->load.state = FR_TLS_CACHE_LOAD_RETRIEVED;
 	tls_cache->load.sess = sess;	/* This is consumed in tls_cache_load_cb */
 
+	return 0;
+}
+
+/** Serialise a session so that it can be stored
+ *
+ * @param[in] ctx		to allocate the serialised session in.
+ * @param[in] request		The current request.
+ * @param[in] sess		to serialise.
+ * @return
+ *	- The serialised session on success.
+ *	- NULL on failure.
+ */
+static uint8_t *tls_cache_session_serialise(TALLOC_CTX *ctx, request_t *request, SSL_SESSION *sess)
+{
+	size_t			len, ret;
+	uint8_t			*p, *data;
+
+	len = i2d_SSL_SESSION(sess, NULL);	/* find out what length data we need */
+	if (len < 1) {
+		fr_value_box_t	id;
+ 		fr_tls_cache_id_to_box_shallow(&id, sess);
+
+		/* something went wrong */
+		fr_tls_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
+		RPWDEBUG("Session ID %pV - Serialisation failed, couldn't determine "
+			 "required buffer length", &id);
+		return NULL;
+	}
+
+	MEM(data = talloc_array(ctx, uint8_t, len));
+
+	/* openssl mutates &p */
+	p = data;
+	ret = i2d_SSL_SESSION(sess, &p);	/* Serialize as ASN.1 */
+	if (ret != len) {
+		fr_value_box_t	id;
+ 		fr_tls_cache_id_to_box_shallow(&id, sess);
+
+		fr_tls_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
+		RPWDEBUG("Session ID %pV - Serialisation failed", &id);
+		talloc_free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+/** Process the result of `session load { ... }`
+ */
+static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSED int *priority,
+					     request_t *request, void *uctx)
+{
+	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
+	fr_tls_cache_t		*tls_cache = tls_session->cache;
+	fr_pair_t		*vp;
+
+	vp = fr_pair_find_by_da(&request->reply_pairs, NULL, attr_tls_packet_type);
+	if (!vp || (vp->vp_uint32 != enum_tls_packet_type_success->vb_uint32)) {
+		RWDEBUG("Failed acquiring session data");
+	error:
+		tls_cache->load.state = FR_TLS_CACHE_LOAD_FAILED;
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
+	vp = fr_pair_find_by_da(&request->reply_pairs, NULL, attr_tls_session_data);
+	if (!vp) {
+		RWDEBUG("No cached session found");
+		goto error;
+	}
+
+	if (tls_cache_session_load(request, tls_session, vp->vp_octets, vp->vp_length) < 0) goto error;
+
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
@@ -484,9 +550,7 @@ static inline CC_HINT(always_inline)
 unlang_action_t tls_cache_store_push(request_t *request, fr_tls_conf_t *conf, fr_tls_session_t *tls_session)
 {
 	fr_tls_cache_t		*tls_cache = tls_session->cache;
-	size_t			len, ret;
-
-	uint8_t			*p, *data = NULL;
+	uint8_t			*data;
 
 	request_t		*child;
 	fr_pair_t		*vp;
@@ -538,36 +602,14 @@ unlang_action_t tls_cache_store_push(request_t *request, fr_tls_conf_t *conf, fr
 	/*
 	 *	Serialize the session
 	 */
-	len = i2d_SSL_SESSION(sess, NULL);	/* find out what length data we need */
-	if (len < 1) {
-		fr_value_box_t	id;
- 		fr_tls_cache_id_to_box_shallow(&id, sess);
-
-		/* something went wrong */
-		fr_tls_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
-		RPWDEBUG("Session ID %pV - Serialisation failed, couldn't determine "
-			 "required buffer length", &id);
+	MEM(pair_update_request(&vp, attr_tls_session_data) >= 0);
+	data = tls_cache_session_serialise(vp, request, sess);
+	if (!data) {
 	error:
 		tls_cache_store_state_reset(request, tls_cache);
 		talloc_free(child);
 		return UNLANG_ACTION_FAIL;
 	}
-
-	MEM(pair_update_request(&vp, attr_tls_session_data) >= 0);
-	MEM(data = talloc_array(vp, uint8_t, len));
-
-	/* openssl mutates &p */
-	p = data;
-	ret = i2d_SSL_SESSION(sess, &p);	/* Serialize as ASN.1 */
-	if (ret != len) {
-		fr_value_box_t	id;
- 		fr_tls_cache_id_to_box_shallow(&id, sess);
-
-		fr_tls_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
-		RPWDEBUG("Session ID %pV - Serialisation failed", &id);
-		talloc_free(data);
-		goto error;
-	}
 	fr_pair_value_memdup_buffer_shallow(vp, data, true);
 
 	/*
@@ -653,6 +695,318 @@ unlang_action_t tls_cache_clear_push(request_t *request, fr_tls_conf_t *conf, fr
 	return ua;
 }
 
+/** Number of shards in the shared session cache
+ *
+ * Must be a power of 2.  Each shard has its own lock, so
+ * workers performing lookups on different sessions rarely
+ * contend with each other.
+ */
+#define TLS_CACHE_SHARED_SHARDS	16
+
+/** An entry in the shared session cache
+ *
+ */
+typedef struct {
+	uint8_t			*id;			//!< Session ID.
+	uint8_t			*data;			//!< Serialised session.
+	fr_time_t		expires;		//!< When the session can no longer be resumed.
+	size_t			size;			//!< How much memory this entry is accounted as using.
+	fr_dlist_t		entry;			//!< Entry in the shard's LRU list.
+} tls_cache_shared_entry_t;
+
+typedef struct {
+	pthread_mutex_t		mutex;			//!< Protects everything in the shard.
+	fr_hash_table_t		*ht;			//!< Entries, by session ID.
+	fr_dlist_head_t		lru;			//!< Least recently used entries at the head.
+	size_t			used;			//!< Memory used by entries in this shard.
+	size_t			max;			//!< Maximum memory entries in this shard may use.
+} tls_cache_shared_shard_t;
+
+/** Session cache shared between all workers
+ *
+ * Used for stateful session resumption when there's no virtual server
+ * to persist the sessions, and a shared_cache_size has been configured.
+ */
+struct fr_tls_cache_shared_s {
+	tls_cache_shared_shard_t	shard[TLS_CACHE_SHARED_SHARDS];
+};
+
+static uint32_t tls_cache_shared_entry_hash(void const *data)
+{
+	tls_cache_shared_entry_t const *e = data;
+
+	return fr_hash(e->id, talloc_array_length(e->id));
+}
+
+static int8_t tls_cache_shared_entry_cmp(void const *one, void const *two)
+{
+	tls_cache_shared_entry_t const *a = one, *b = two;
+	size_t a_len = talloc_array_length(a->id), b_len = talloc_array_length(b->id);
+	int ret;
+
+	ret = CMP(a_len, b_len);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->id, b->id, a_len);
+	return CMP(ret, 0);
+}
+
+/** Select the shard a session ID lives in
+ *
+ * Uses the high bits of the hash, as the low bits select
+ * the bucket within the shard's hash table.
+ */
+static inline CC_HINT(always_inline)
+tls_cache_shared_shard_t *tls_cache_shared_shard(fr_tls_cache_shared_t *shared, uint8_t const *id, size_t id_len)
+{
+	return &shared->shard[(fr_hash(id, id_len) >> 28) & (TLS_CACHE_SHARED_SHARDS - 1)];
+}
+
+/** Remove an entry from its shard and free it
+ *
+ * @note Must be called with the shard locked.
+ */
+static void tls_cache_shared_entry_remove(tls_cache_shared_shard_t *shard, tls_cache_shared_entry_t *e)
+{
+	fr_dlist_remove(&shard->lru, e);
+	shard->used -= e->size;
+	fr_hash_table_delete(shard->ht, e);	/* Frees e */
+}
+
+static void tls_cache_shared_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int _tls_cache_shared_free(fr_tls_cache_shared_t *shared)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(shared->shard); i++) {
+		talloc_free(shared->shard[i].ht);
+		pthread_mutex_destroy(&shared->shard[i].mutex);
+	}
+
+	return 0;
+}
+
+/** Allocate a session cache which can be used by all workers
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_size		Maximum amount of memory the cached sessions
+ *				will use.
+ * @return
+ *	- A new shared session cache.
+ *	- NULL on error.
+ */
+fr_tls_cache_shared_t *fr_tls_cache_shared_alloc(TALLOC_CTX *ctx, size_t max_size)
+{
+	fr_tls_cache_shared_t	*shared;
+	size_t			i;
+
+	MEM(shared = talloc_zero(ctx, fr_tls_cache_shared_t));
+
+	for (i = 0; i < NUM_ELEMENTS(shared->shard); i++) {
+		tls_cache_shared_shard_t *shard = &shared->shard[i];
+
+		/*
+		 *	Entries aren't parented by the hash table, so
+		 *	that allocating and freeing them only ever
+		 *	touches the shard the entry belongs to.
+		 */
+		shard->ht = fr_hash_table_alloc(NULL, tls_cache_shared_entry_hash,
+						tls_cache_shared_entry_cmp, tls_cache_shared_entry_free);
+		if (!shard->ht) {
+			while (i-- > 0) {
+				talloc_free(shared->shard[i].ht);
+				pthread_mutex_destroy(&shared->shard[i].mutex);
+			}
+			talloc_free(shared);
+			return NULL;
+		}
+		fr_dlist_talloc_init(&shard->lru, tls_cache_shared_entry_t, entry);
+		shard->max = max_size / TLS_CACHE_SHARED_SHARDS;
+		pthread_mutex_init(&shard->mutex, NULL);
+	}
+	talloc_set_destructor(shared, _tls_cache_shared_free);
+
+	return shared;
+}
+
+/** Insert a session into the shared cache, evicting older sessions if required
+ *
+ * @param[in] shared		cache to insert the session into.
+ * @param[in] id		Session ID.  Ownership is taken.
+ * @param[in] data		Serialised session.  Ownership is taken.
+ * @param[in] expires		When the session expires.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the session is too large to cache.
+ */
+static int tls_cache_shared_insert(fr_tls_cache_shared_t *shared, uint8_t *id, uint8_t *data, fr_time_t expires)
+{
+	tls_cache_shared_shard_t	*shard = tls_cache_shared_shard(shared, id, talloc_array_length(id));
+	tls_cache_shared_entry_t	*e, *old;
+	size_t				size;
+
+	size = sizeof(*e) + talloc_array_length(id) + talloc_array_length(data);
+	if (size > shard->max) {
+		talloc_free(id);
+		talloc_free(data);
+		return -1;
+	}
+
+	MEM(e = talloc(NULL, tls_cache_shared_entry_t));
+	*e = (tls_cache_shared_entry_t){
+		.id = talloc_steal(e, id),
+		.data = talloc_steal(e, data),
+		.expires = expires,
+		.size = size
+	};
+
+	pthread_mutex_lock(&shard->mutex);
+	old = fr_hash_table_find(shard->ht, e);
+	if (old) tls_cache_shared_entry_remove(shard, old);
+
+	/*
+	 *	All sessions have similar lifetimes, so the
+	 *	least recently used entries are also the
+	 *	closest to expiring.
+	 */
+	while ((shard->used + size) > shard->max) {
+		old = fr_dlist_head(&shard->lru);
+		if (!old) break;
+		tls_cache_shared_entry_remove(shard, old);
+	}
+
+	if (!fr_hash_table_insert(shard->ht, e)) {
+		pthread_mutex_unlock(&shard->mutex);
+		talloc_free(e);
+		return -1;
+	}
+	fr_dlist_insert_tail(&shard->lru, e);
+	shard->used += size;
+	pthread_mutex_unlock(&shard->mutex);
+
+	return 0;
+}
+
+/** Retrieve a copy of a session from the shared cache
+ *
+ * @param[in] ctx		to allocate the copy in.
+ * @param[in] shared		cache to search in.
+ * @param[in] id		Session ID.
+ * @return
+ *	- A copy of the serialised session.
+ *	- NULL if the session wasn't found, or has expired.
+ */
+static uint8_t *tls_cache_shared_find(TALLOC_CTX *ctx, fr_tls_cache_shared_t *shared, uint8_t const *id)
+{
+	tls_cache_shared_shard_t	*shard = tls_cache_shared_shard(shared, id, talloc_array_length(id));
+	tls_cache_shared_entry_t	*e;
+	uint8_t				*data = NULL;
+
+	pthread_mutex_lock(&shard->mutex);
+	e = fr_hash_table_find(shard->ht, &(tls_cache_shared_entry_t){ .id = UNCONST(uint8_t *, id) });
+	if (e) {
+		if (fr_time_lteq(e->expires, fr_time())) {
+			tls_cache_shared_entry_remove(shard, e);
+		} else {
+			fr_dlist_remove(&shard->lru, e);
+			fr_dlist_insert_tail(&shard->lru, e);
+			data = talloc_memdup(ctx, e->data, talloc_array_length(e->data));
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	return data;
+}
+
+/** Remove a session from the shared cache
+ *
+ * @param[in] shared		cache to remove the session from.
+ * @param[in] id		Session ID.
+ * @return
+ *	- true if the session was removed.
+ *	- false if the session wasn't found.
+ */
+static bool tls_cache_shared_remove(fr_tls_cache_shared_t *shared, uint8_t const *id)
+{
+	tls_cache_shared_shard_t	*shard = tls_cache_shared_shard(shared, id, talloc_array_length(id));
+	tls_cache_shared_entry_t	*e;
+
+	pthread_mutex_lock(&shard->mutex);
+	e = fr_hash_table_find(shard->ht, &(tls_cache_shared_entry_t){ .id = UNCONST(uint8_t *, id) });
+	if (e) tls_cache_shared_entry_remove(shard, e);
+	pthread_mutex_unlock(&shard->mutex);
+
+	return (e != NULL);
+}
+
+/** Load a session from the shared cache
+ *
+ */
+static void tls_cache_shared_load(request_t *request, fr_tls_session_t *tls_session, fr_tls_cache_shared_t *shared)
+{
+	fr_tls_cache_t	*tls_cache = tls_session->cache;
+	uint8_t		*data;
+
+	fr_assert(tls_cache->load.id);
+
+	data = tls_cache_shared_find(NULL, shared, tls_cache->load.id);
+	if (!data) {
+		RDEBUG2("Session ID %pV - Not found in shared session cache", fr_box_octets_buffer(tls_cache->load.id));
+	error:
+		tls_cache->load.state = FR_TLS_CACHE_LOAD_FAILED;
+		return;
+	}
+
+	if (tls_cache_session_load(request, tls_session, data, talloc_array_length(data)) < 0) {
+		talloc_free(data);
+		goto error;
+	}
+	talloc_free(data);
+}
+
+/** Store a session in the shared cache
+ *
+ */
+static unlang_action_t tls_cache_shared_store(request_t *request, fr_tls_session_t *tls_session,
+					      fr_tls_cache_shared_t *shared)
+{
+	fr_tls_cache_t	*tls_cache = tls_session->cache;
+	SSL_SESSION	*sess = tls_cache->store.sess;
+	uint8_t		*id, *data;
+	fr_time_t	expires = fr_time_add(fr_time(), fr_time_delta_from_sec(SSL_SESSION_get_timeout(sess)));
+
+	/*
+	 *	Add the current session-state list
+	 *	contents to the ssl-data
+	 */
+	if (tls_cache_app_data_set(request, sess) < 0) {
+	error:
+		tls_cache_store_state_reset(request, tls_cache);
+		return UNLANG_ACTION_FAIL;
+	}
+
+	data = tls_cache_session_serialise(NULL, request, sess);
+	if (!data) goto error;
+
+	MEM(id = fr_tls_cache_id(NULL, sess));
+
+	RDEBUG3("Session ID %pV - Storing %zu bytes in shared session cache",
+		fr_box_octets_buffer(id), talloc_array_length(data));
+
+	tls_cache_store_state_reset(request, tls_cache);
+	if (tls_cache_shared_insert(shared, id, data, expires) < 0) {
+		RWDEBUG("Failed storing session data, session is larger than shared_cache_size allows");
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+	tls_cache->store.state = FR_TLS_CACHE_STORE_PERSISTED;	/* Avoid spurious clear calls */
+
+	return UNLANG_ACTION_CALCULATE_RESULT;
+}
+
 /** Push a `session store { ... }` or session clear { ... }` or `session load { ... }` depending on what operations are pending
  *
  * @param[in] request		The current request.
@@ -672,7 +1026,14 @@ unlang_action_t fr_tls_cache_pending_push(request_t *request, fr_tls_session_t *
 	 *	Load stateful session data
 	 */
 	if (tls_cache->load.state == FR_TLS_CACHE_LOAD_REQUESTED) {
-		return tls_cache_load_push(request, tls_session);
+		if (!conf->cache.shared) return tls_cache_load_push(request, tls_session);
+
+		/*
+		 *	The shared cache doesn't need to yield, so
+		 *	we can service all the pending operations
+		 *	in one pass.
+		 */
+		tls_cache_shared_load(request, tls_session, conf->cache.shared);
 	}
 
 	/*
@@ -696,11 +1057,19 @@ unlang_action_t fr_tls_cache_pending_push(request_t *request, fr_tls_session_t *
 			}
 		}
 
-		return tls_cache_clear_push(request, conf, tls_session);
+		if (!conf->cache.shared) return tls_cache_clear_push(request, conf, tls_session);
+
+		if (!tls_cache_shared_remove(conf->cache.shared, tls_cache->clear.id)) {
+			RDEBUG3("Session ID %pV - Not found in shared session cache",
+				fr_box_octets_buffer(tls_cache->clear.id));
+		}
+		tls_cache_clear_state_reset(request, tls_cache);
 	}
 
 	if (tls_cache->store.state == FR_TLS_CACHE_STORE_REQUESTED) {
-		return tls_cache_store_push(request, conf, tls_session);
+		if (!conf->cache.shared) return tls_cache_store_push(request, conf, tls_session);
+
+		return tls_cache_shared_store(request, tls_session, conf->cache.shared);
 	}
 
 	return UNLANG_ACTION_CALCULATE_RESULT;
@@ -1352,6 +1721,194 @@ static SSL_TICKET_RETURN tls_cache_session_ticket_app_data_get(SSL *ssl, SSL_SES
 	return (status == SSL_TICKET_SUCCESS_RENEW) ? SSL_TICKET_RETURN_USE_RENEW : SSL_TICKET_RETURN_USE;
 }
 
+#define TICKET_KEY_LABEL	"freeradius-session-ticket"
+
+/** Derive key material for session tickets from the configured session_ticket_key
+ *
+ * @param[out] out		Where to write the derived key material.
+ * @param[in] outlen		How much key material to derive.
+ * @param[in] secret		session_ticket_key, as provided by the user.
+ * @param[in] info		HKDF info (label).
+ * @param[in] info_len		Length of the info.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int tls_cache_ticket_key_derive(uint8_t *out, size_t outlen, uint8_t const *secret,
+				       uint8_t const *info, size_t info_len)
+{
+	EVP_PKEY_CTX *pkey_ctx;
+
+	if (unlikely((pkey_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL)) == NULL)) {
+		fr_tls_strerror_printf("Failed initialising KDF");
+		return -1;
+	}
+	if (unlikely(EVP_PKEY_derive_init(pkey_ctx) != 1)) {
+		fr_tls_strerror_printf("Failed initialising KDF derivation ctx");
+	error:
+		EVP_PKEY_CTX_free(pkey_ctx);
+		return -1;
+	}
+	if (unlikely(EVP_PKEY_CTX_set_hkdf_md(pkey_ctx, UNCONST(struct evp_md_st *, EVP_sha256())) != 1)) {
+		fr_tls_strerror_printf("Failed setting KDF MD");
+		goto error;
+	}
+	if (unlikely(EVP_PKEY_CTX_set1_hkdf_key(pkey_ctx, UNCONST(unsigned char *, secret),
+						talloc_array_length(secret)) != 1)) {
+		fr_tls_strerror_printf("Failed setting KDF key");
+		goto error;
+	}
+	if (unlikely(EVP_PKEY_CTX_add1_hkdf_info(pkey_ctx, UNCONST(unsigned char *, info), info_len) != 1)) {
+		fr_tls_strerror_printf("Failed setting KDF label");
+		goto error;
+	}
+	if (unlikely(EVP_PKEY_derive(pkey_ctx, out, &outlen) != 1)) {
+		fr_tls_strerror_printf("Failed deriving key");
+		goto error;
+	}
+	EVP_PKEY_CTX_free(pkey_ctx);
+
+	return 0;
+}
+
+/** Key material for one rotation period
+ *
+ * The key name is the period number, followed by a tag derived from the
+ * session_ticket_key.  The tag lets us reject tickets encrypted by servers
+ * using a different session_ticket_key without attempting decryption.
+ */
+typedef struct {
+	uint8_t		name[16];			//!< Period (8 bytes, network order) + tag (8 bytes).
+	uint8_t		aes_key[32];			//!< AES-256-CBC key.
+	uint8_t		hmac_key[32];			//!< HMAC-SHA256 key.
+} tls_cache_ticket_key_t;
+
+/** Derive the ticket keys for a particular rotation period
+ *
+ * All servers sharing a session_ticket_key derive the same keys for the
+ * same period, so tickets can be issued by one and decrypted by any other,
+ * without the keys ever needing to be distributed.
+ */
+static int tls_cache_ticket_key_period(tls_cache_ticket_key_t *key, uint8_t const *secret, uint64_t period)
+{
+	uint8_t		info[sizeof(TICKET_KEY_LABEL) - 1 + sizeof(uint64_t)];
+	uint8_t		derived[8 + sizeof(key->aes_key) + sizeof(key->hmac_key)];
+
+	memcpy(info, TICKET_KEY_LABEL, sizeof(TICKET_KEY_LABEL) - 1);
+	fr_nbo_from_uint64(info + sizeof(TICKET_KEY_LABEL) - 1, period);
+
+	if (tls_cache_ticket_key_derive(derived, sizeof(derived), secret, info, sizeof(info)) < 0) return -1;
+
+	fr_nbo_from_uint64(key->name, period);
+	memcpy(key->name + 8, derived, 8);
+	memcpy(key->aes_key, derived + 8, sizeof(key->aes_key));
+	memcpy(key->hmac_key, derived + 8 + sizeof(key->aes_key), sizeof(key->hmac_key));
+	memset_explicit(derived, 0, sizeof(derived));
+
+	return 0;
+}
+
+/** Provide OpenSSL with session ticket keys which rotate every session_ticket_key_rotation
+ *
+ * New tickets are always encrypted with the key for the current period.
+ * Tickets encrypted with keys from previous periods are accepted for as
+ * long as the session could still be resumed (the cache lifetime), and
+ * are re-issued using the current key.
+ *
+ * @param[in] ssl	session the ticket is being issued for, or was presented in.
+ * @param[in] key_name	Name of the key.  Written when encrypting, read when decrypting.
+ * @param[in] iv	Initialisation vector.  Written when encrypting.
+ * @param[in] cipher	To initialise with the AES key.
+ * @param[in] mac	To initialise with the HMAC key.
+ * @param[in] enc	1 if we're encrypting a new ticket, 0 if we're decrypting.
+ * @return
+ *	- -1 on error.
+ *	- 0 if no key was found (full handshake is performed).
+ *	- 1 if the key is current.
+ *	- 2 if the ticket should be renewed with the current key.
+ */
+static int tls_cache_session_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+					   EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc)
+{
+	fr_tls_cache_conf_t const	*cache_conf = &fr_tls_session_conf(ssl)->cache;
+	request_t			*request = NULL;
+	tls_cache_ticket_key_t		key;
+	int64_t				rotation = fr_time_delta_to_sec(cache_conf->session_ticket_key_rotation);
+	uint64_t			current, period, window;
+	int				ret = 1;
+	OSSL_PARAM			params[3];
+
+	if (fr_tls_session_request_bound(ssl)) request = fr_tls_session_request(ssl);
+
+	if (rotation <= 0) rotation = 1;
+	current = (uint64_t)fr_unix_time_to_sec(fr_time_to_unix_time(fr_time())) / (uint64_t)rotation;
+
+	if (enc) {
+		period = current;
+		if (tls_cache_ticket_key_period(&key, cache_conf->session_ticket_key, period) < 0) {
+		error:
+			ROPTIONAL(RPERROR, PERROR, "Failed deriving session ticket key");
+			return -1;
+		}
+		if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) {
+			fr_tls_log(request, "Failed generating session ticket IV");
+			return -1;
+		}
+		memcpy(key_name, key.name, sizeof(key.name));
+
+		if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1) {
+			fr_tls_log(request, "Failed initialising session ticket cipher");
+			ret = -1;
+			goto done;
+		}
+	} else {
+		period = fr_nbo_to_uint64(key_name);
+
+		/*
+		 *	Accept keys for as long as the session they
+		 *	encrypt could be resumed.  Anything older
+		 *	(or newer, i.e. clocks which are wildly out)
+		 *	results in a full handshake.
+		 */
+		window = (uint64_t)((fr_time_delta_to_sec(cache_conf->lifetime) + rotation - 1) / rotation);
+		if ((period > current) || ((current - period) > window)) {
+			ROPTIONAL(RDEBUG3, DEBUG3, "Session ticket key period %" PRIu64 " outside the acceptable window",
+				  period);
+			return 0;
+		}
+		if (tls_cache_ticket_key_period(&key, cache_conf->session_ticket_key, period) < 0) goto error;
+
+		/*
+		 *	Issued by a server with a different session_ticket_key
+		 */
+		if (memcmp(key_name + 8, key.name + 8, 8) != 0) {
+			ROPTIONAL(RDEBUG3, DEBUG3, "Session ticket key name not recognised");
+			ret = 0;
+			goto done;
+		}
+
+		if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1) {
+			fr_tls_log(request, "Failed initialising session ticket cipher");
+			ret = -1;
+			goto done;
+		}
+		if (period != current) ret = 2;
+	}
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, UNCONST(char *, "sha256"), 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (EVP_MAC_CTX_set_params(mac, params) != 1) {
+		fr_tls_log(request, "Failed initialising session ticket HMAC");
+		ret = -1;
+	}
+
+done:
+	memset_explicit(&key, 0, sizeof(key));
+
+	return ret;
+}
+
 /** Sets callbacks and flags on a SSL_CTX to enable/disable session resumption
  *
  * @param[in] ctx			to modify.
@@ -1404,10 +1961,22 @@ int fr_tls_cache_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf)
 	{
 		size_t key_len;
 		uint8_t *key_buff;
-		EVP_PKEY_CTX *pkey_ctx = NULL;
 
 		if (!(cache_conf->mode & FR_TLS_CACHE_STATEFUL)) tls_cache_disable_statefull_resumption(ctx);
 
+		/*
+		 *	Keys are rotated, so OpenSSL asks us for the
+		 *	key every time a ticket is issued or presented.
+		 */
+		if (fr_time_delta_ispos(cache_conf->session_ticket_key_rotation)) {
+			if (unlikely(SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_cache_session_ticket_key_cb) != 1)) {
+				fr_tls_strerror_printf(NULL);
+				PERROR("Failed setting session ticket key callback");
+				return -1;
+			}
+			goto ticket_cb;
+		}
+
 		/*
 		 *	If keys is NULL, then OpenSSL returns the expected
 		 *	key length, which may be different across different
@@ -1419,51 +1988,17 @@ int fr_tls_cache_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf)
 		 */
 		key_len = SSL_CTX_set_tlsext_ticket_keys(ctx, NULL, 0);
 
-		if (unlikely((pkey_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL)) == NULL)) {
-			fr_tls_strerror_printf(NULL);
-			PERROR("Failed initialising KDF");
-		kdf_error:
-			if (pkey_ctx) EVP_PKEY_CTX_free(pkey_ctx);
-			return -1;
-		}
-		if (unlikely(EVP_PKEY_derive_init(pkey_ctx) != 1)) {
-			fr_tls_strerror_printf(NULL);
-			PERROR("Failed initialising KDF derivation ctx");
-			goto kdf_error;
-		}
-		if (unlikely(EVP_PKEY_CTX_set_hkdf_md(pkey_ctx, UNCONST(struct evp_md_st *, EVP_sha256())) != 1)) {
-			fr_tls_strerror_printf(NULL);
-			PERROR("Failed setting KDF MD");
-			goto kdf_error;
-		}
-		if (unlikely(EVP_PKEY_CTX_set1_hkdf_key(pkey_ctx,
-							UNCONST(unsigned char *, cache_conf->session_ticket_key),
-							talloc_array_length(cache_conf->session_ticket_key)) != 1)) {
-			fr_tls_strerror_printf(NULL);
-			PERROR("Failed setting KDF key");
-			goto kdf_error;
-		}
-		if (unlikely(EVP_PKEY_CTX_add1_hkdf_info(pkey_ctx,
-							 UNCONST(unsigned char *, "freeradius-session-ticket"),
-							 sizeof("freeradius-session-ticket") - 1) != 1)) {
-			fr_tls_strerror_printf(NULL);
-			PERROR("Failed setting KDF label");
-			goto kdf_error;
-		}
-
 		/*
 		 *	SSL_CTX_set_tlsext_ticket_keys memcpys its
 		 *	inputs so this is just a temporary buffer.
 		 */
 		MEM(key_buff = talloc_array(NULL, uint8_t, key_len));
-		if (EVP_PKEY_derive(pkey_ctx, key_buff, &key_len) != 1) {
-			fr_tls_strerror_printf(NULL);
+		if (tls_cache_ticket_key_derive(key_buff, key_len, cache_conf->session_ticket_key,
+						(uint8_t const *)TICKET_KEY_LABEL, sizeof(TICKET_KEY_LABEL) - 1) < 0) {
 			PERROR("Failed deriving session ticket key");
-
 			talloc_free(key_buff);
-			goto kdf_error;
+			return -1;
 		}
-		EVP_PKEY_CTX_free(pkey_ctx);
 
 		fr_assert(talloc_array_length(key_buff) == key_len);
 		/*
@@ -1480,6 +2015,7 @@ int fr_tls_cache_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf)
 		HEXDUMP3(key_buff, key_len, NULL);
 		talloc_free(key_buff);
 
+	ticket_cb:
 		/*
 		 *	These callbacks embed and extract the
 		 *	session-state list from the session-ticket.
@@ -1509,4 +2045,191 @@ int fr_tls_cache_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf)
 
 	return 0;
 }
+
+/** The most recent session established with a server
+ *
+ */
+typedef struct {
+	char const		*peer;			//!< Server the session was established with.
+	SSL_SESSION		*session;		//!< Session to offer when reconnecting.
+} tls_cache_client_entry_t;
+
+/** Sessions established by client connections
+ *
+ * Shared by every worker using the same client configuration, so
+ * a connection opened by any of them, or a reconnection after the
+ * server went away, can skip the full handshake.
+ */
+struct fr_tls_cache_client_s {
+	pthread_mutex_t		mutex;			//!< Connections can be opened in any worker.
+	fr_hash_table_t		*ht;			//!< Entries, by peer.
+};
+
+static uint32_t tls_cache_client_entry_hash(void const *data)
+{
+	tls_cache_client_entry_t const *e = data;
+
+	return fr_hash_string(e->peer);
+}
+
+static int8_t tls_cache_client_entry_cmp(void const *one, void const *two)
+{
+	tls_cache_client_entry_t const *a = one, *b = two;
+
+	return CMP(strcmp(a->peer, b->peer), 0);
+}
+
+static int _tls_cache_client_entry_free(tls_cache_client_entry_t *e)
+{
+	SSL_SESSION_free(e->session);
+
+	return 0;
+}
+
+static void tls_cache_client_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int _tls_cache_client_free(fr_tls_cache_client_t *client)
+{
+	TALLOC_FREE(client->ht);
+	pthread_mutex_destroy(&client->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache for sessions established by client connections
+ *
+ * @param[in] ctx	to allocate the cache in.  Usually the client #fr_tls_conf_t.
+ * @return
+ *	- A new client session cache.
+ *	- NULL on error.
+ */
+fr_tls_cache_client_t *fr_tls_cache_client_alloc(TALLOC_CTX *ctx)
+{
+	fr_tls_cache_client_t *client;
+
+	MEM(client = talloc_zero(ctx, fr_tls_cache_client_t));
+
+	client->ht = fr_hash_table_alloc(client, tls_cache_client_entry_hash,
+					 tls_cache_client_entry_cmp, tls_cache_client_entry_free);
+	if (!client->ht) {
+		talloc_free(client);
+		return NULL;
+	}
+	pthread_mutex_init(&client->mutex, NULL);
+	talloc_set_destructor(client, _tls_cache_client_free);
+
+	return client;
+}
+
+/** Remember a new session from the server, so that later connections can resume it
+ *
+ * Called by OpenSSL when the handshake completes, or, with TLS 1.3,
+ * when the server sends a session ticket.
+ *
+ * @param[in] ssl	the session was established on.
+ * @param[in] sess	the new session.
+ * @return
+ *	- 0 if we didn't keep a reference to the session.
+ *	- 1 if we did.
+ */
+static int tls_cache_client_store_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	fr_tls_conf_t			*conf = fr_tls_session_conf(ssl);
+	fr_tls_session_t		*tls_session = fr_tls_session(ssl);
+	fr_tls_cache_client_t		*client = conf->cache.client;
+	tls_cache_client_entry_t	*e, *old;
+
+	if (!client || !tls_session->peer || !SSL_SESSION_is_resumable(sess)) return 0;
+
+	MEM(e = talloc(NULL, tls_cache_client_entry_t));
+	*e = (tls_cache_client_entry_t){
+		.peer = talloc_strdup(e, tls_session->peer),
+		.session = sess
+	};
+	talloc_set_destructor(e, _tls_cache_client_entry_free);
+
+	pthread_mutex_lock(&client->mutex);
+	old = fr_hash_table_find(client->ht, e);
+	if (old) fr_hash_table_delete(client->ht, old);		/* Frees old */
+
+	if (!fr_hash_table_insert(client->ht, e)) {
+		pthread_mutex_unlock(&client->mutex);
+		talloc_set_destructor(e, NULL);
+		talloc_free(e);
+		return 0;
+	}
+	pthread_mutex_unlock(&client->mutex);
+
+	DEBUG3("Stored session for %s", tls_session->peer);
+
+	return 1;	/* We now own the reference */
+}
+
+/** Offer the server the last session we established with it
+ *
+ * Must be called after the session is allocated, and before the
+ * handshake starts.  Sessions are only ever offered to the peer
+ * they were established with.
+ *
+ * @param[in] tls_session	client session which is about to connect.
+ * @param[in] peer		identifies the server, e.g. its address and port.
+ */
+void fr_tls_cache_client_resume(fr_tls_session_t *tls_session, char const *peer)
+{
+	fr_tls_conf_t			*conf = fr_tls_session_conf(tls_session->ssl);
+	fr_tls_cache_client_t		*client = conf->cache.client;
+	tls_cache_client_entry_t	*e;
+
+	if (!client) return;
+
+	tls_session->peer = talloc_strdup(tls_session, peer);
+
+	pthread_mutex_lock(&client->mutex);
+	e = fr_hash_table_find(client->ht, &(tls_cache_client_entry_t){ .peer = peer });
+	if (e) {
+		/*
+		 *	The server won't accept expired sessions,
+		 *	so there's no point in offering them.
+		 */
+		if ((uint64_t)(SSL_SESSION_get_time(e->session) + SSL_SESSION_get_timeout(e->session)) <=
+		    (uint64_t)time(NULL)) {
+			fr_hash_table_delete(client->ht, e);
+		} else if (SSL_set_session(tls_session->ssl, e->session) != 1) {
+			fr_tls_log_clear();
+		} else {
+			DEBUG3("Offering stored session to %s", peer);
+		}
+	}
+	pthread_mutex_unlock(&client->mutex);
+}
+
+/** Setup session resumption for a client SSL_CTX
+ *
+ * @param[in] ctx		to configure.
+ * @param[in] cache_conf	of the client.  If client sessions aren't being
+ *				cached, resumption is disabled.
+ * @return 0.
+ */
+int fr_tls_cache_client_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf)
+{
+	if (!cache_conf->client) {
+		tls_cache_disable_stateless_resumption(ctx);
+		tls_cache_disable_statefull_resumption(ctx);
+		return 0;
+	}
+
+	/*
+	 *	Sessions are stored by tls_cache_client_store_cb,
+	 *	and offered by fr_tls_cache_client_resume.
+	 *	OpenSSL's own client cache is never consulted
+	 *	when connecting.
+	 */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tls_cache_client_store_cb);
+
+	return 0;
+}
 #endif /* WITH_TLS */
@@ -113,6 +113,14 @@ void		fr_tls_cache_session_alloc(fr_tls_session_t *tls_session);
 
 int		fr_tls_cache_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf);
 
+fr_tls_cache_shared_t	*fr_tls_cache_shared_alloc(TALLOC_CTX *ctx, size_t max_size);
+
+int		fr_tls_cache_client_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf);
+
+fr_tls_cache_client_t	*fr_tls_cache_client_alloc(TALLOC_CTX *ctx);
+
+void		fr_tls_cache_client_resume(fr_tls_session_t *tls_session, char const *peer) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
@@ -81,6 +81,10 @@ static fr_table_num_sorted_t const verify_mode_table[] = {
 static size_t verify_mode_table_len = NUM_ELEMENTS(verify_mode_table);
 
 static conf_parser_t tls_cache_config[] = {
+	/*
+	 *	Must be parsed before "mode", which checks it.
+	 */
+	{ FR_CONF_OFFSET("shared_cache_size", fr_tls_cache_conf_t, shared_cache_size), .dflt = "0" },
 	{ FR_CONF_OFFSET("mode", fr_tls_cache_conf_t, mode),
 			 .func = tls_conf_parse_cache_mode,
 			 .uctx = &(cf_table_parse_ctx_t){
@@ -96,6 +100,7 @@ static conf_parser_t tls_cache_config[] = {
 	{ FR_CONF_OFFSET("require_perfect_forward_secrecy", fr_tls_cache_conf_t, require_pfs), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("session_ticket_key", fr_tls_cache_conf_t, session_ticket_key) },
+	{ FR_CONF_OFFSET("session_ticket_key_rotation", fr_tls_cache_conf_t, session_ticket_key_rotation), .dflt = "0" },
 
 	/*
 	 *	Deprecated
@@ -150,6 +155,8 @@ static conf_parser_t tls_verify_config[] = {
 	{ FR_CONF_OFFSET("check_crl", fr_tls_verify_conf_t, check_crl), .dflt = "no" },
 	{ FR_CONF_OFFSET("allow_expired_crl", fr_tls_verify_conf_t, allow_expired_crl) },
 	{ FR_CONF_OFFSET("allow_not_yet_valid_crl", fr_tls_verify_conf_t, allow_not_yet_valid_crl) },
+	{ FR_CONF_OFFSET("cache_max_entries", fr_tls_verify_conf_t, cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_lifetime", fr_tls_verify_conf_t, cache_lifetime), .dflt = "1h" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -219,6 +226,8 @@ conf_parser_t fr_tls_client_config[] = {
 
 	{ FR_CONF_OFFSET("keylog_file", fr_tls_conf_t, keylog_file) },
 
+	{ FR_CONF_OFFSET("session_resumption", fr_tls_conf_t, cache.client_resumption), .dflt = "yes" },
+
 	{ FR_CONF_OFFSET("verify_depth", fr_tls_conf_t, verify_depth), .dflt = "0" },
 	{ FR_CONF_OFFSET_FLAGS("ca_path", CONF_FLAG_FILE_INPUT, fr_tls_conf_t, ca_path) },
 
@@ -260,6 +269,8 @@ static int tls_conf_parse_cache_mode(TALLOC_CTX *ctx, void *out, void *parent, C
 		break;
 
 	case FR_TLS_CACHE_STATEFUL:
+		if (conf->cache.shared_cache_size) goto check_version;
+
 		if (!conf->virtual_server) {
 			cf_log_err(ci, "A virtual_server must be set when cache.mode = \"stateful\"");
 		error:
@@ -284,6 +295,7 @@ static int tls_conf_parse_cache_mode(TALLOC_CTX *ctx, void *out, void *parent, C
 			goto error;
 		}
 
+	check_version:
 		if (conf->tls_min_version >= (float)1.3) {
 			cf_log_err(ci, "cache.mode = \"stateful\" is not supported with tls_min_version >= 1.3");
 			goto error;
@@ -291,6 +303,8 @@ static int tls_conf_parse_cache_mode(TALLOC_CTX *ctx, void *out, void *parent, C
 		break;
 
 	case FR_TLS_CACHE_AUTO:
+		if (conf->cache.shared_cache_size) goto check_auto_version;
+
 		if (!conf->virtual_server) {
 			WARN("A virtual_server must be provided for stateful caching. "
 			     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
@@ -317,6 +331,7 @@ static int tls_conf_parse_cache_mode(TALLOC_CTX *ctx, void *out, void *parent, C
 			goto cache_stateless;
 		}
 
+	check_auto_version:
 		if (conf->tls_min_version >= (float)1.3) {
 			cf_log_err(ci, "stateful session-resumption is not supported with tls_min_version >= 1.3. "
 			           "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
@@ -494,6 +509,36 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 
 	FR_INTEGER_BOUND_CHECK("padding", conf->padding_block_size, <=, SSL3_RT_MAX_PLAIN_LENGTH);
 
+	/*
+	 *	Sessions are shared between all workers, so
+	 *	resumption works without a virtual server.
+	 */
+	if (conf->cache.shared_cache_size && (conf->cache.mode & FR_TLS_CACHE_STATEFUL)) {
+		FR_SIZE_BOUND_CHECK("session.shared_cache_size", conf->cache.shared_cache_size, >=, (size_t)(64 * 1024));
+
+		conf->cache.shared = fr_tls_cache_shared_alloc(conf, conf->cache.shared_cache_size);
+		if (!conf->cache.shared) {
+			ERROR("Failed allocating shared session cache");
+			talloc_free(conf);
+			return NULL;
+		}
+	}
+
+	/*
+	 *	Devices present the same certificate chain every
+	 *	time they reconnect, so remember which chains
+	 *	have already been verified.
+	 */
+	if (conf->verify.cache_max_entries) {
+		conf->verify.cache = fr_tls_verify_cache_alloc(conf, conf->verify.cache_max_entries,
+							       conf->verify.cache_lifetime);
+		if (!conf->verify.cache) {
+			ERROR("Failed allocating certificate verification cache");
+			talloc_free(conf);
+			return NULL;
+		}
+	}
+
 #ifdef __APPLE__
 	if (conf_cert_admin_password(conf) < 0) goto error;
 #endif
@@ -534,6 +579,19 @@ fr_tls_conf_t *fr_tls_conf_parse_client(CONF_SECTION *cs)
 	 */
 	if (conf->fragment_size < 100) conf->fragment_size = 100;
 
+	/*
+	 *	Connections opened by any worker can resume
+	 *	the sessions established by the others.
+	 */
+	if (conf->cache.client_resumption) {
+		conf->cache.client = fr_tls_cache_client_alloc(conf);
+		if (!conf->cache.client) {
+			ERROR("Failed allocating client session cache");
+			talloc_free(conf);
+			return NULL;
+		}
+	}
+
 	/*
 	 *	Initialize TLS
 	 */
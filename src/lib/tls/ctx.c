@@ -914,6 +914,14 @@ post_ca:
 		SSL_CTX_set_verify_depth(ctx, conf->verify_depth);
 	}
 
+	/*
+	 *	Skip chain building and signature checks for
+	 *	chains we've already verified.
+	 */
+	if (conf->verify.cache) {
+		SSL_CTX_set_cert_verify_callback(ctx, fr_tls_verify_cert_cache_cb, UNCONST(fr_tls_conf_t *, conf));
+	}
+
 #ifdef HAVE_OPENSSL_OCSP_H
 	/*
 	 *	Configure OCSP stapling for the server cert
@@ -966,7 +974,9 @@ post_ca:
 	/*
 	 *	Setup session caching
 	 */
-	if (fr_tls_cache_ctx_init(ctx, &conf->cache) < 0) goto error;
+	if (client) {
+		if (fr_tls_cache_client_ctx_init(ctx, &conf->cache) < 0) goto error;
+	} else if (fr_tls_cache_ctx_init(ctx, &conf->cache) < 0) goto error;
 
 	/*
 	 *	Set the keylog file if the admin requested it.
@@ -46,6 +46,7 @@
 #include "attrs.h"
 #include "base.h"
 #include "log.h"
+#include "strerror.h"
 
 #include <openssl/x509v3.h>
 #include <openssl/ssl.h>
@@ -921,6 +922,43 @@ void fr_tls_session_keylog_cb(const SSL *ssl, const char *line)
 	close(fd);
 }
 
+/** Feed a fragment of encrypted data directly into OpenSSL's input BIO
+ *
+ * Callers which reassemble records from fragments (e.g. EAP-TLS) should
+ * use this in preference to dirty_in.  The memory BIO already accumulates
+ * partial records, so there's no need to copy each fragment into an
+ * intermediary buffer, only to copy the whole record again when it's
+ * complete.
+ *
+ * @param[in] tls_session	The current TLS session.
+ * @param[in] data		Fragment to write.
+ * @param[in] data_len		Length of the fragment.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the fragment would exceed the maximum record size, or
+ *	  couldn't be written.
+ */
+int fr_tls_session_dirty_in_write(fr_tls_session_t *tls_session, uint8_t const *data, size_t data_len)
+{
+	size_t pending;
+
+	if (!data_len) return 0;
+
+	pending = BIO_ctrl_pending(tls_session->into_ssl) + tls_session->dirty_in.used;
+	if ((pending + data_len) > FR_TLS_MAX_RECORD_SIZE) {
+		fr_strerror_printf("Fragment of %zu bytes would exceed maximum record size (%zu bytes pending)",
+				   data_len, pending);
+		return -1;
+	}
+
+	if (BIO_write(tls_session->into_ssl, data, data_len) != (int)data_len) {
+		fr_tls_strerror_printf("Failed writing %zu bytes to TLS BIO", data_len);
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Decrypt application data
  *
  * @note Handshake must have completed before this function may be called.
@@ -1278,6 +1316,90 @@ static unlang_action_t tls_session_async_handshake_done_round(UNUSED rlm_rcode_t
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
+/** An async job we don't own has something for us to do
+ *
+ */
+static void tls_session_async_job_resume(fr_tls_session_t *tls_session)
+{
+	request_t *request = fr_tls_session_request(tls_session->ssl);
+
+	TALLOC_FREE(tls_session->async_wait);
+
+	RDEBUG3("Resuming async job");
+	unlang_interpret_mark_runnable(request);
+}
+
+static void tls_session_async_job_fd_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	tls_session_async_job_resume(talloc_get_type_abort(uctx, fr_tls_session_t));
+}
+
+static void tls_session_async_job_fd_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+					   UNUSED int fd_errno, void *uctx)
+{
+	/*
+	 *	SSL_read() will report the failure.
+	 */
+	tls_session_async_job_resume(talloc_get_type_abort(uctx, fr_tls_session_t));
+}
+
+/** Yield until an async job paused by an engine or provider can make progress
+ *
+ * Engines and providers which offload operations, e.g. signing with a
+ * private key on an accelerator, pause the async job, and signal
+ * completion via one or more "wait" FDs.  We insert those into the
+ * request's event loop, so the worker processes other requests in the
+ * mean time.
+ *
+ * @param[in] request		The current request.
+ * @param[in] tls_session	with the paused async job.
+ * @return
+ *	- UNLANG_ACTION_YIELD - Waiting for the job.
+ *	- UNLANG_ACTION_CALCULATE_RESULT - No FDs to wait on, continue the job immediately.
+ *	- UNLANG_ACTION_FAIL - Failed inserting events.
+ */
+static unlang_action_t tls_session_async_job_wait(request_t *request, fr_tls_session_t *tls_session)
+{
+	fr_event_list_t	*el = unlang_interpret_event_list(request);
+	OSSL_ASYNC_FD	*fds;
+	size_t		numfds = 0, i;
+
+	fr_assert(!tls_session->async_wait);
+
+	if (!SSL_get_all_async_fds(tls_session->ssl, NULL, &numfds)) {
+		fr_tls_log(request, "Failed retrieving async job wait FDs");
+		return UNLANG_ACTION_FAIL;
+	}
+
+	/*
+	 *	Our own callbacks pause the job without any FDs,
+	 *	and whatever they wanted has already been done.
+	 */
+	if (!numfds) return UNLANG_ACTION_CALCULATE_RESULT;
+
+	MEM(tls_session->async_wait = talloc_new(tls_session));
+	MEM(fds = talloc_array(tls_session->async_wait, OSSL_ASYNC_FD, numfds));
+	if (!SSL_get_all_async_fds(tls_session->ssl, fds, &numfds)) {
+		fr_tls_log(request, "Failed retrieving async job wait FDs");
+	error:
+		TALLOC_FREE(tls_session->async_wait);
+		return UNLANG_ACTION_FAIL;
+	}
+
+	for (i = 0; i < numfds; i++) {
+		if (fr_event_fd_insert(tls_session->async_wait, NULL, el, fds[i],
+				       tls_session_async_job_fd_read, NULL, tls_session_async_job_fd_error,
+				       tls_session) < 0) {
+			RPERROR("Failed inserting async job wait FD");
+			goto error;
+		}
+	}
+
+	RDEBUG3("Async job paused, waiting on %zu FD(s)", numfds);
+
+	return UNLANG_ACTION_YIELD;
+}
+
 /** Try very hard to get the SSL * into a consistent state where it's not yielded
  *
  * ...because if it's yielded, we'll probably leak thread contexts and all kinds of memory.
@@ -1297,6 +1419,11 @@ static void tls_session_async_handshake_signal(UNUSED request_t *request, UNUSED
 	 *	cache code.
 	 */
 
+	/*
+	 *	Don't resume a request which is going away.
+	 */
+	TALLOC_FREE(tls_session->async_wait);
+
 	/*
 	 *	If SSL_get_error returns SSL_ERROR_WANT_ASYNC
 	 *	it means we're yielded in the middle of a
@@ -1340,6 +1467,8 @@ static unlang_action_t tls_session_async_handshake_cont(rlm_rcode_t *p_result, i
 
 	RDEBUG3("(re-)entered state %s", __FUNCTION__);
 
+	TALLOC_FREE(tls_session->async_wait);
+
 	/*
 	 *	Magic/More magic? Although SSL_read is normally
 	 *	used to read application data, it will also
@@ -1466,9 +1595,25 @@ DIAG_ON(DIAG_UNKNOWN_PRAGMAS)
 			IGNORE(unlang_function_clear(request), int);
 			goto error;
 
-		default:
+		case UNLANG_ACTION_PUSHED_CHILD:
 			return ua;
+
+		default:
+			break;
+		}
+
+		/*
+		 *	If an engine or provider paused the job, e.g. for
+		 *	a private key operation which has been
+		 *	offloaded, wait for it to complete.
+		 */
+		ua = tls_session_async_job_wait(request, tls_session);
+		if (ua == UNLANG_ACTION_FAIL) {
+			IGNORE(unlang_function_clear(request), int);
+			goto error;
 		}
+
+		return ua;
 	}
 
 	case SSL_ERROR_WANT_ASYNC_JOB:
@@ -138,6 +138,9 @@ struct fr_tls_session_s {
 	bool			client_cert_ok;			//!< whether or not the client certificate was validated
 	bool			can_pause;			//!< If true, it's ok to pause the request
 								///< using the OpenSSL async API.
+	TALLOC_CTX		*async_wait;			//!< Events we inserted to wait for an async job
+								///< paused by an engine or provider, e.g. a
+								///< private key operation on an accelerator.
 
 	uint8_t			alerts_sent;
 	bool			pending_alert;
@@ -146,6 +149,9 @@ struct fr_tls_session_s {
 
 	fr_pair_list_t		extra_pairs;			//!< Pairs to add to cache and certificate validation
 								///< calls.  These will be duplicated for every call.
+
+	char const		*peer;				//!< Server a client session is connecting to.
+								///< Used to find sessions it can resume.
 };
 
 /** Return the tls config associated with a tls_session
@@ -305,6 +311,8 @@ void		fr_tls_session_keylog_cb(const SSL *ssl, const char *line);
 int		fr_tls_session_pairs_from_x509_cert(fr_pair_list_t *pair_list, TALLOC_CTX *ctx,
 				     		    request_t *request, X509 *cert) CC_HINT(nonnull);
 
+int		fr_tls_session_dirty_in_write(fr_tls_session_t *tls_session, uint8_t const *data, size_t data_len);
+
 int		fr_tls_session_recv(request_t *request, fr_tls_session_t *tls_session);
 
 int 		fr_tls_session_send(request_t *request, fr_tls_session_t *tls_session);
@@ -40,6 +40,7 @@
 
 #include "attrs.h"
 #include "base.h"
+#include "utils.h"
 
 /** Check to see if a verification operation should apply to a certificate
  *
@@ -64,6 +65,8 @@ bool verify_applies(fr_tls_verify_mode_t mode, int depth, int untrusted)
 	return false;
 }
 
+static int tls_verify_cert(int ok, X509_STORE_CTX *x509_ctx, int untrusted);
+
 DIAG_OFF(DIAG_UNKNOWN_PRAGMAS)
 DIAG_OFF(used-but-marked-unused)	/* fix spurious warnings for sk macros */
 
@@ -128,6 +131,22 @@ static void tls_verify_error_detail(request_t *request, SSL_CTX *ctx, int err)
  *	- 1 if valid.
  */
 int fr_tls_verify_cert_cb(int ok, X509_STORE_CTX *x509_ctx)
+{
+	return tls_verify_cert(ok, x509_ctx, X509_STORE_CTX_get_num_untrusted(x509_ctx));
+}
+
+/** Validate a single certificate in a chain
+ *
+ * @param ok		preverify ok.  1 if true, 0 if false.
+ * @param x509_ctx	containing certs to verify.
+ * @param untrusted	The number of untrusted certificates in the chain.
+ *			Passed in, as it's not available when replaying
+ *			a cached chain.
+ * @return
+ *	- 0 if not valid.
+ *	- 1 if valid.
+ */
+static int tls_verify_cert(int ok, X509_STORE_CTX *x509_ctx, int untrusted)
 {
 	X509			*cert;
 
@@ -137,7 +156,6 @@ int fr_tls_verify_cert_cb(int ok, X509_STORE_CTX *x509_ctx)
 	int			err, depth;
 	fr_tls_conf_t		*conf;
 	int			my_ok = ok;
-	int			untrusted;
 
 	request_t		*request;
 	fr_pair_t		*container = NULL;
@@ -145,7 +163,6 @@ int fr_tls_verify_cert_cb(int ok, X509_STORE_CTX *x509_ctx)
 	cert = X509_STORE_CTX_get_current_cert(x509_ctx);
 	err = X509_STORE_CTX_get_error(x509_ctx);
 	depth = X509_STORE_CTX_get_error_depth(x509_ctx);
-	untrusted = X509_STORE_CTX_get_num_untrusted(x509_ctx);
 
 	/*
 	 *	Retrieve the pointer to the SSL of the connection currently treated
@@ -326,6 +343,320 @@ done:
 DIAG_ON(used-but-marked-unused)
 DIAG_ON(DIAG_UNKNOWN_PRAGMAS)
 
+/** A client certificate chain which has previously been verified
+ *
+ */
+typedef struct {
+	uint8_t			key[SHA256_DIGEST_LENGTH];	//!< Digest of the presented certificates,
+								///< and the verification parameters.
+	STACK_OF(X509)		*chain;			//!< The chain OpenSSL built.
+	int			untrusted;		//!< Number of untrusted certificates in the chain.
+	fr_time_t		expires;		//!< Earliest notAfter or CRL nextUpdate.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} tls_verify_cache_entry_t;
+
+struct fr_tls_verify_cache_s {
+	pthread_mutex_t		mutex;			//!< Lookups and updates can happen in any worker.
+	fr_hash_table_t		*ht;			//!< Entries by key.
+	fr_dlist_head_t		lru;			//!< Least recently used entries at the head.
+	uint32_t		max_entries;		//!< Maximum number of cached chains.
+	fr_time_delta_t		lifetime;		//!< Maximum time a chain is cached for.
+};
+
+static uint32_t tls_verify_cache_entry_hash(void const *data)
+{
+	tls_verify_cache_entry_t const *e = data;
+
+	return fr_hash(e->key, sizeof(e->key));
+}
+
+static int8_t tls_verify_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_verify_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = memcmp(a->key, b->key, sizeof(a->key));
+	return CMP(ret, 0);
+}
+
+static int _tls_verify_cache_entry_free(tls_verify_cache_entry_t *e)
+{
+	sk_X509_pop_free(e->chain, X509_free);
+
+	return 0;
+}
+
+static void tls_verify_cache_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int _tls_verify_cache_free(fr_tls_verify_cache_t *cache)
+{
+	talloc_free(cache->ht);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache of verified certificate chains
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of chains to cache.
+ * @param[in] lifetime		Maximum time a chain is cached for.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+fr_tls_verify_cache_t *fr_tls_verify_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, fr_time_delta_t lifetime)
+{
+	fr_tls_verify_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, fr_tls_verify_cache_t));
+
+	/*
+	 *	Entries are allocated in the NULL ctx, so that
+	 *	workers only ever touch the chunks belonging
+	 *	to the entries they're manipulating.
+	 */
+	cache->ht = fr_hash_table_alloc(NULL, tls_verify_cache_entry_hash, tls_verify_cache_entry_cmp,
+					tls_verify_cache_entry_free);
+	if (!cache->ht) {
+		talloc_free(cache);
+		return NULL;
+	}
+	fr_dlist_talloc_init(&cache->lru, tls_verify_cache_entry_t, entry);
+	cache->max_entries = max_entries;
+	cache->lifetime = lifetime;
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _tls_verify_cache_free);
+
+	return cache;
+}
+
+/** Calculate the cache key for the certificates presented by the peer
+ *
+ * The key covers every certificate the peer presented, and the parameters
+ * which affect the outcome of verification.  The same client certificate,
+ * presented with a different intermediary, will be verified separately.
+ */
+static int tls_verify_cache_key(uint8_t key[static SHA256_DIGEST_LENGTH], X509_STORE_CTX *x509_ctx)
+{
+	EVP_MD_CTX		*md_ctx;
+	STACK_OF(X509)		*untrusted = X509_STORE_CTX_get0_untrusted(x509_ctx);
+	X509_VERIFY_PARAM const	*param = X509_STORE_CTX_get0_param(x509_ctx);
+	unsigned long		flags = X509_VERIFY_PARAM_get_flags(param);
+	int			depth = X509_VERIFY_PARAM_get_depth(param);
+	uint8_t			digest[EVP_MAX_MD_SIZE];
+	unsigned int		digest_len;
+	int			i, num;
+	int			ret = -1;
+
+	md_ctx = EVP_MD_CTX_new();
+	if (!md_ctx) return -1;
+
+	if (EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL) != 1) goto finish;
+
+	if (X509_digest(X509_STORE_CTX_get0_cert(x509_ctx), EVP_sha256(), digest, &digest_len) != 1) goto finish;
+	EVP_DigestUpdate(md_ctx, digest, digest_len);
+
+	num = untrusted ? sk_X509_num(untrusted) : 0;
+	for (i = 0; i < num; i++) {
+		if (X509_digest(sk_X509_value(untrusted, i), EVP_sha256(), digest, &digest_len) != 1) goto finish;
+		EVP_DigestUpdate(md_ctx, digest, digest_len);
+	}
+
+	EVP_DigestUpdate(md_ctx, &flags, sizeof(flags));
+	EVP_DigestUpdate(md_ctx, &depth, sizeof(depth));
+
+	digest_len = SHA256_DIGEST_LENGTH;
+	if (EVP_DigestFinal_ex(md_ctx, key, &digest_len) != 1) goto finish;
+
+	ret = 0;
+
+finish:
+	EVP_MD_CTX_free(md_ctx);
+
+	return ret;
+}
+
+/** Find a previously verified chain
+ *
+ * @return
+ *	- A copy of the chain (with references to the certificates).
+ *	- NULL if no unexpired chain was found.
+ */
+static STACK_OF(X509) *tls_verify_cache_find(int *untrusted, fr_tls_verify_cache_t *cache,
+					     uint8_t const key[static SHA256_DIGEST_LENGTH])
+{
+	tls_verify_cache_entry_t	*e, find;
+	STACK_OF(X509)			*chain = NULL;
+
+	memcpy(find.key, key, sizeof(find.key));
+
+	pthread_mutex_lock(&cache->mutex);
+	e = fr_hash_table_find(cache->ht, &find);
+	if (e) {
+		if (fr_time_lteq(e->expires, fr_time())) {
+			fr_dlist_remove(&cache->lru, e);
+			fr_hash_table_delete(cache->ht, e);
+		} else {
+			fr_dlist_remove(&cache->lru, e);
+			fr_dlist_insert_tail(&cache->lru, e);
+			chain = X509_chain_up_ref(e->chain);
+			*untrusted = e->untrusted;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return chain;
+}
+
+/** Record a verified chain
+ *
+ * The chain is cached until the earliest notAfter of the certificates in it,
+ * or, if CRLs were checked, the earliest nextUpdate of the CRLs used.
+ */
+static void tls_verify_cache_insert(fr_tls_verify_cache_t *cache, uint8_t const key[static SHA256_DIGEST_LENGTH],
+				    X509_STORE_CTX *x509_ctx)
+{
+	tls_verify_cache_entry_t	*e, *old;
+	STACK_OF(X509)			*chain = X509_STORE_CTX_get0_chain(x509_ctx);
+	bool				check_crl;
+	time_t				now = fr_time_to_sec(fr_time()), earliest = 0, t;
+	fr_time_delta_t			ttl;
+	int				i;
+
+	if (!chain) return;
+
+	check_crl = (X509_VERIFY_PARAM_get_flags(X509_STORE_CTX_get0_param(x509_ctx)) & X509_V_FLAG_CRL_CHECK);
+
+	for (i = 0; i < sk_X509_num(chain); i++) {
+		X509 *cert = sk_X509_value(chain, i);
+
+		if (fr_tls_utils_asn1time_to_epoch(&t, X509_get0_notAfter(cert)) < 0) return;
+		if (!earliest || (t < earliest)) earliest = t;
+
+		if (check_crl) {
+			STACK_OF(X509_CRL)	*crls;
+			int			j;
+
+			crls = X509_STORE_CTX_get1_crls(x509_ctx, X509_get_issuer_name(cert));
+			for (j = 0; crls && (j < sk_X509_CRL_num(crls)); j++) {
+				ASN1_TIME const *next = X509_CRL_get0_nextUpdate(sk_X509_CRL_value(crls, j));
+
+				if (!next || (fr_tls_utils_asn1time_to_epoch(&t, next) < 0)) continue;
+				if (t < earliest) earliest = t;
+			}
+			sk_X509_CRL_pop_free(crls, X509_CRL_free);
+		}
+	}
+
+	if (earliest <= now) return;
+
+	ttl = fr_time_delta_from_sec(earliest - now);
+	if (fr_time_delta_gt(ttl, cache->lifetime)) ttl = cache->lifetime;
+
+	MEM(e = talloc_zero(NULL, tls_verify_cache_entry_t));
+	memcpy(e->key, key, sizeof(e->key));
+	e->chain = X509_chain_up_ref(chain);
+	e->untrusted = X509_STORE_CTX_get_num_untrusted(x509_ctx);
+	e->expires = fr_time_add(fr_time(), ttl);
+	talloc_set_destructor(e, _tls_verify_cache_entry_free);
+
+	pthread_mutex_lock(&cache->mutex);
+	old = fr_hash_table_find(cache->ht, e);
+	if (old) {
+		fr_dlist_remove(&cache->lru, old);
+		fr_hash_table_delete(cache->ht, old);
+	}
+
+	while (fr_hash_table_num_elements(cache->ht) >= cache->max_entries) {
+		old = fr_dlist_pop_head(&cache->lru);
+		if (!old) break;
+		fr_hash_table_delete(cache->ht, old);
+	}
+
+	if (!fr_hash_table_insert(cache->ht, e)) {
+		pthread_mutex_unlock(&cache->mutex);
+		talloc_free(e);
+		return;
+	}
+	fr_dlist_insert_tail(&cache->lru, e);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Verify a certificate chain, using the cache of previously verified chains
+ *
+ * On a cache hit, chain building and signature checks are skipped, but
+ * our per-certificate callback is still run for every certificate in
+ * the chain.  The certificate attributes are still created, and the
+ * `verify certificate { ... }` section is still called.
+ *
+ * @param x509_ctx	containing the certificates presented by the peer.
+ * @param arg		The #fr_tls_conf_t.
+ * @return
+ *	- 1 if the chain is valid.
+ *	- 0 if the chain is not valid.
+ */
+int fr_tls_verify_cert_cache_cb(X509_STORE_CTX *x509_ctx, void *arg)
+{
+	fr_tls_conf_t		*conf = talloc_get_type_abort(arg, fr_tls_conf_t);
+	SSL			*ssl = X509_STORE_CTX_get_ex_data(x509_ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+	request_t		*request = fr_tls_session_request(ssl);
+	uint8_t			key[SHA256_DIGEST_LENGTH];
+	STACK_OF(X509)		*chain;
+	int			untrusted = 0, depth, ret;
+
+	if (tls_verify_cache_key(key, x509_ctx) < 0) {
+		fr_tls_log_clear();
+		return X509_verify_cert(x509_ctx);
+	}
+
+	chain = tls_verify_cache_find(&untrusted, conf->verify.cache, key);
+	if (!chain) {
+		ret = X509_verify_cert(x509_ctx);
+
+		/*
+		 *	If the request was cancelled, verification
+		 *	errors were ignored, so don't cache the result.
+		 */
+		if ((ret == 1) && (X509_STORE_CTX_get_error(x509_ctx) == X509_V_OK) &&
+		    !unlang_request_is_cancelled(request)) {
+			tls_verify_cache_insert(conf->verify.cache, key, x509_ctx);
+		}
+		return ret;
+	}
+
+	RDEBUG2("Certificate chain was previously verified, skipping chain building");
+
+	/*
+	 *	OpenSSL takes its copy of the verified chain
+	 *	from the X509_STORE_CTX after we return.
+	 */
+	X509_STORE_CTX_set0_verified_chain(x509_ctx, chain);
+
+	/*
+	 *	Process the certificates in the same order
+	 *	X509_verify_cert would, i.e. root first.
+	 */
+	for (depth = sk_X509_num(chain) - 1; depth >= 0; depth--) {
+		X509_STORE_CTX_set_current_cert(x509_ctx, sk_X509_value(chain, depth));
+		X509_STORE_CTX_set_error_depth(x509_ctx, depth);
+		X509_STORE_CTX_set_error(x509_ctx, X509_V_OK);
+
+		if (!tls_verify_cert(1, x509_ctx, untrusted)) {
+			if (X509_STORE_CTX_get_error(x509_ctx) == X509_V_OK) {
+				X509_STORE_CTX_set_error(x509_ctx, X509_V_ERR_APPLICATION_VERIFICATION);
+			}
+			return 0;
+		}
+	}
+	X509_STORE_CTX_set_error(x509_ctx, X509_V_OK);
+
+	return 1;
+}
+
 /** Revalidates the client's certificate chain
  *
  * Wraps the fr_tls_verify_cert_cb callback, allowing us to use the same
@@ -381,7 +712,11 @@ int fr_tls_verify_cert_chain(request_t *request, SSL *ssl)
 	X509_STORE_CTX_set_ex_data(store_ctx, SSL_get_ex_data_X509_STORE_CTX_idx(), ssl);
 	X509_STORE_CTX_set_verify_cb(store_ctx, fr_tls_verify_cert_cb);
 
-	verify = X509_verify_cert(store_ctx);
+	if (fr_tls_session_conf(ssl)->verify.cache) {
+		verify = fr_tls_verify_cert_cache_cb(store_ctx, fr_tls_session_conf(ssl));
+	} else {
+		verify = X509_verify_cert(store_ctx);
+	}
 	if (verify != 1) {
 		err = X509_STORE_CTX_get_error(store_ctx);
 
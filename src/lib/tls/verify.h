@@ -55,6 +55,8 @@ typedef enum {
 		FR_TLS_VERIFY_MODE_UNTRUSTED
 } fr_tls_verify_mode_t;
 
+typedef struct fr_tls_verify_cache_s fr_tls_verify_cache_t;
+
 /** Certificate validation state
  *
  */
@@ -78,6 +80,10 @@ extern "C" {
 
 int		fr_tls_verify_cert_cb(int ok, X509_STORE_CTX *ctx);
 
+fr_tls_verify_cache_t	*fr_tls_verify_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, fr_time_delta_t lifetime);
+
+int		fr_tls_verify_cert_cache_cb(X509_STORE_CTX *ctx, void *arg);
+
 int		fr_tls_verify_cert_chain(request_t *request, SSL *ssl);
 
 bool		fr_tls_verify_cert_result(fr_tls_session_t *tls_session);
@@ -42,6 +42,16 @@ int			unlang_thread_instantiate(TALLOC_CTX *ctx) CC_HINT(nonnull);
 
 #ifdef WITH_PERF
 void			unlang_perf_virtual_server(fr_log_t *log, char const *name);
+
+void const		*unlang_thread_perf(void);
+
+int			unlang_perf_fprint(FILE *fp, void const *perf, char const *sort);
+
+void			unlang_trace_start(request_t *request) CC_HINT(nonnull);
+
+bool			unlang_trace_active(request_t const *request) CC_HINT(nonnull);
+
+char			*unlang_trace_print(TALLOC_CTX *ctx, request_t const *request) CC_HINT(nonnull(2));
 #endif
 
 #ifdef __cplusplus
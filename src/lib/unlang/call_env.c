@@ -230,7 +230,7 @@ static unlang_action_t call_env_expand_start(UNUSED rlm_rcode_t *p_result, UNUSE
 	}
 
 	if (unlang_tmpl_push(ctx, &call_env_rctx->tmpl_expanded, request, call_env_rctx->last_expanded->data.tmpl,
-			     NULL) < 0) return UNLANG_ACTION_FAIL;
+			     call_env_segments(env->rule->flags) ? TMPL_ARGS_SEGMENTS : NULL) < 0) return UNLANG_ACTION_FAIL;
 
 	return UNLANG_ACTION_PUSHED_CHILD;
 }
@@ -89,6 +89,10 @@ typedef enum CC_HINT(flag_enum) {
 								///< there is a callback which always needs to be run to set up required
 								///< data structures.
 	CALL_ENV_FLAG_SECRET		= (1 << 10),		//!< The value is a secret, and should not be logged.
+	CALL_ENV_FLAG_SEGMENTS		= (1 << 11),		//!< Leave quoted expansions as a list of escaped segments,
+								///< which together make up the value.  Avoids copying
+								///< them into one buffer when the consumer can take a
+								///< vector.  Only valid with #fr_value_box_list_t results.
 } call_env_flags_t;
 DIAG_ON(attributes)
 
@@ -106,7 +110,7 @@ DIAG_ON(attributes)
  *
  * @param[in] _flags to evaluate
  */
-#define call_env_subsection_flags(_flags)	(((_flags) & (CALL_ENV_FLAG_CONCAT | CALL_ENV_FLAG_SINGLE | CALL_ENV_FLAG_MULTI | CALL_ENV_FLAG_NULLABLE | CALL_ENV_FLAG_FORCE_QUOTE | CALL_ENV_FLAG_ATTRIBUTE | CALL_ENV_FLAG_PARSE_MISSING)) == 0)
+#define call_env_subsection_flags(_flags)	(((_flags) & (CALL_ENV_FLAG_CONCAT | CALL_ENV_FLAG_SINGLE | CALL_ENV_FLAG_MULTI | CALL_ENV_FLAG_NULLABLE | CALL_ENV_FLAG_FORCE_QUOTE | CALL_ENV_FLAG_ATTRIBUTE | CALL_ENV_FLAG_PARSE_MISSING | CALL_ENV_FLAG_SEGMENTS)) == 0)
 
 #define call_env_required(_flags)		((_flags) & CALL_ENV_FLAG_REQUIRED)
 
@@ -129,6 +133,8 @@ DIAG_ON(attributes)
 #define call_env_parse_missing(_flags)		((_flags) & CALL_ENV_FLAG_PARSE_MISSING)
 
 #define call_env_secret(_flags)			((_flags) & CALL_ENV_FLAG_SECRET)
+
+#define call_env_segments(_flags)		((_flags) & CALL_ENV_FLAG_SEGMENTS)
 /** @} */
 
 /** Callback for performing custom parsing of a #CONF_PAIR
@@ -59,6 +59,13 @@ RCSID("$Id$")
 
 #define UNLANG_IGNORE ((unlang_t *) -1)
 
+/*
+ *	Per configuration item estimate of the chunks and bytes an
+ *	instruction needs, used to size the pool for a whole section.
+ */
+#define UNLANG_COMPILE_POOL_HEADERS	(8)
+#define UNLANG_COMPILE_POOL_LEN		(384)
+
 extern bool tmpl_require_enum_prefix;
 
 static unsigned int unlang_number = 1;
@@ -372,7 +379,6 @@ static void unlang_dump(unlang_t *instruction, int depth)
 		case UNLANG_TYPE_REDUNDANT:
 		case UNLANG_TYPE_REDUNDANT_LOAD_BALANCE:
 		case UNLANG_TYPE_SUBREQUEST:
-		case UNLANG_TYPE_SWITCH:
 		case UNLANG_TYPE_TIMEOUT:
 		case UNLANG_TYPE_LIMIT:
 		case UNLANG_TYPE_TRANSACTION:
@@ -384,6 +390,20 @@ static void unlang_dump(unlang_t *instruction, int depth)
 			DEBUG("%.*s}", depth, unlang_spaces);
 			break;
 
+		case UNLANG_TYPE_SWITCH:
+		{
+			unlang_switch_t *gext;
+
+			g = unlang_generic_to_group(c);
+			gext = unlang_group_to_switch(g);
+			DEBUG("%.*s%s {", depth, unlang_spaces, c->debug_name);
+			DEBUG("%.*s# %u case(s), dispatch via %s", depth + 1, unlang_spaces,
+			      fr_htrie_num_elements(gext->ht), fr_htrie_type_to_str(gext->ht->type));
+			unlang_dump(g->children, depth + 1);
+			DEBUG("%.*s}", depth, unlang_spaces);
+		}
+			break;
+
 		case UNLANG_TYPE_BREAK:
 		case UNLANG_TYPE_DETACH:
 		case UNLANG_TYPE_RETURN:
@@ -1358,6 +1378,126 @@ static int unlang_fixup_edit(map_t *map, void *ctx)
 	return 0;
 }
 
+/** Whether two attribute references may refer to the same attributes
+ *
+ *  This is deliberately conservative.  Any attribute which is in one
+ *  reference, and at the end of the other, is counted as an overlap.
+ */
+static bool edit_attr_overlap(tmpl_t const *a, tmpl_t const *b)
+{
+	tmpl_attr_t		*ar = NULL;
+	fr_dict_attr_t const	*a_da = tmpl_attr_tail_da(a);
+	fr_dict_attr_t const	*b_da = tmpl_attr_tail_da(b);
+
+	while ((ar = tmpl_attr_list_next(tmpl_attr(a), ar))) {
+		if (ar->ar_da == b_da) return true;
+	}
+
+	while ((ar = tmpl_attr_list_next(tmpl_attr(b), ar))) {
+		if (ar->ar_da == a_da) return true;
+	}
+
+	return false;
+}
+
+/** Whether any map in an edit list may write to the attributes referenced by vpt
+ *
+ */
+static bool edit_list_may_write(map_list_t const *list, map_t const *parent, tmpl_t const *vpt)
+{
+	map_t const *map = NULL;
+
+	/*
+	 *	&foo := { a, b, c }
+	 *
+	 *	The children of leaf attributes are values, not edits.
+	 */
+	if (parent && fr_type_is_leaf(tmpl_attr_tail_da(parent->lhs)->type)) return false;
+
+	while ((map = map_list_next(list, map))) {
+		/*
+		 *	We can't tell what an expanded LHS refers to.
+		 */
+		if (!tmpl_is_attr(map->lhs)) return true;
+
+		if (edit_attr_overlap(map->lhs, vpt)) return true;
+
+		if (edit_list_may_write(&map->child, map, vpt)) return true;
+	}
+
+	return false;
+}
+
+static int _edit_rhs_depends(tmpl_t const *vpt, void *uctx)
+{
+	unlang_edit_t *edit = uctx;
+
+	return edit_list_may_write(&edit->maps, NULL, vpt);
+}
+
+/** Find the RHS expansions which call functions, and so may yield
+ *
+ */
+static void edit_prefetch_collect(TALLOC_CTX *ctx, tmpl_t const ***out, map_list_t const *list)
+{
+	map_t const	*map = NULL;
+	size_t		num;
+
+	while ((map = map_list_next(list, map))) {
+		if (!map->rhs) {
+			/*
+			 *	The children of -= are filters, which are
+			 *	expanded and compared one at a time.
+			 */
+			if ((map->op != T_OP_SUB_EQ) && tmpl_is_attr(map->lhs)) {
+				edit_prefetch_collect(ctx, out, &map->child);
+			}
+			continue;
+		}
+
+		if (!tmpl_is_xlat(map->rhs) || xlat_needs_resolving(tmpl_xlat(map->rhs)) ||
+		    !xlat_impure_func(tmpl_xlat(map->rhs))) continue;
+
+		num = talloc_array_length(*out);
+		MEM(*out = talloc_realloc(ctx, *out, tmpl_t const *, num + 1));
+		(*out)[num] = map->rhs;
+	}
+}
+
+/** Find RHS expansions in an edit list which can be started at the same time
+ *
+ *  Expansions which call module functions such as %sql() or %ldap() usually
+ *  yield.  If they're run one after the other, each list waits for the sum of
+ *  their latencies.
+ *
+ *  The edits are applied only after all of the RHS in the list have been
+ *  expanded.  So the only expansions which can't be started together are
+ *  ones which read attributes the list may be editing.
+ */
+static void compile_edit_prefetch(unlang_edit_t *edit)
+{
+	tmpl_t const	**candidates = NULL, **prefetch = NULL;
+	size_t		i, num;
+
+	edit_prefetch_collect(edit, &candidates, &edit->maps);
+
+	for (i = 0; i < talloc_array_length(candidates); i++) {
+		if (xlat_attr_walk(tmpl_xlat(candidates[i]), _edit_rhs_depends, edit) != 0) continue;
+
+		num = talloc_array_length(prefetch);
+		MEM(prefetch = talloc_realloc(edit, prefetch, tmpl_t const *, num + 1));
+		prefetch[num] = candidates[i];
+	}
+	talloc_free(candidates);
+
+	if (talloc_array_length(prefetch) < 2) {
+		talloc_free(prefetch);
+		return;
+	}
+
+	edit->prefetch = prefetch;
+}
+
 /** Compile one edit section.
  */
 static unlang_t *compile_edit_section(unlang_t *parent, unlang_compile_t *unlang_ctx, CONF_SECTION *cs)
@@ -1519,6 +1659,8 @@ static unlang_t *compile_edit_section(unlang_t *parent, unlang_compile_t *unlang
 
 	map_list_insert_tail(&edit->maps, map);
 
+	compile_edit_prefetch(edit);
+
 	return out;
 }
 
@@ -2033,6 +2175,28 @@ static bool compile_action_subsection(unlang_t *c, CONF_SECTION *cs, CONF_SECTIO
 }
 
 
+/** Record the instruction that follows each if / elsif / else chain
+ *
+ * When an "if" or "elsif" is taken, execution continues at the first
+ * sibling which isn't part of the same chain.  That target is fixed
+ * once the children are linked, so resolve it here rather than at
+ * run time.
+ */
+static void compile_cond_chains(unlang_group_t *g)
+{
+	unlang_t *c, *end;
+
+	for (c = g->children; c; c = c->next) {
+		if ((c->type != UNLANG_TYPE_IF) && (c->type != UNLANG_TYPE_ELSIF)) continue;
+
+		for (end = c->next;
+		     end && ((end->type == UNLANG_TYPE_ELSE) || (end->type == UNLANG_TYPE_ELSIF));
+		     end = end->next);
+
+		unlang_group_to_cond(unlang_generic_to_group(c))->chain_end = end;
+	}
+}
+
 static unlang_t *compile_children(unlang_group_t *g, unlang_compile_t *unlang_ctx_in, bool set_action_defaults)
 {
 	CONF_ITEM	*ci = NULL;
@@ -2262,6 +2426,13 @@ static unlang_t *compile_children(unlang_group_t *g, unlang_compile_t *unlang_ct
 		}
 	}
 
+	/*
+	 *	Resolve where each "if" / "elsif" continues when it
+	 *	is taken, so that the interpreter doesn't have to walk
+	 *	over the trailing "else" / "elsif" blocks at run time.
+	 */
+	compile_cond_chains(g);
+
 	/*
 	 *	Set the default actions, if they haven't already been
 	 *	set by an "actions" section above.
@@ -2733,6 +2904,12 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		goto error;
 	}
 
+	/*
+	 *	Integer cases are only ever matched exactly, so a hash
+	 *	gives constant time dispatch instead of walking a tree.
+	 */
+	if (fr_type_is_integer(type)) htype = FR_HTRIE_HASH;
+
 	gext->ht = fr_htrie_alloc(gext, htype,
 				  (fr_hash_t) case_hash,
 				  (fr_cmp_t) case_cmp,
@@ -2823,6 +3000,15 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		g->num_children++;
 	}
 
+	/*
+	 *	Say which lookup structure the cases ended up in, so
+	 *	that large switches can be checked for sequential
+	 *	matching.  All of them give sub-linear dispatch.
+	 */
+	cf_log_debug(cs, "%s - %u case(s) dispatched via %s%s", c->debug_name,
+		     fr_htrie_num_elements(gext->ht), fr_htrie_type_to_str(htype),
+		     gext->default_case ? ", with default" : "");
+
 	compile_action_defaults(c, unlang_ctx);
 
 	return c;
@@ -3069,6 +3255,9 @@ static unlang_t *compile_limit(unlang_t *parent, unlang_compile_t *unlang_ctx, C
 	unlang_limit_t		*gext;
 	tmpl_t			*vpt = NULL;
 	uint32_t		limit = 0;
+	bool			global = false, adaptive = false;
+	char const		*option;
+	int			i;
 	fr_token_t		token;
 	ssize_t			slen;
 	tmpl_rules_t		t_rules;
@@ -3080,7 +3269,7 @@ static unlang_t *compile_limit(unlang_t *parent, unlang_compile_t *unlang_ctx, C
 	};
 
 	/*
-	 *	limit <number>
+	 *	limit [global] [adaptive] <number>
 	 */
 	name2 = cf_section_name2(cs);
 	if (!name2) {
@@ -3088,6 +3277,19 @@ static unlang_t *compile_limit(unlang_t *parent, unlang_compile_t *unlang_ctx, C
 		return NULL;
 	}
 
+	for (i = 0; (option = cf_section_argv(cs, i)) != NULL; i++) {
+		if (strcmp(option, "global") == 0) {
+			global = true;
+
+		} else if (strcmp(option, "adaptive") == 0) {
+			adaptive = true;
+
+		} else {
+			cf_log_err(cs, "Invalid option '%s' for 'limit' statement", option);
+			return NULL;
+		}
+	}
+
 	if (!cf_item_next(cs, NULL)) return UNLANG_IGNORE;
 
 	g = group_allocate(parent, cs, &limit_ext);
@@ -3162,6 +3364,8 @@ static unlang_t *compile_limit(unlang_t *parent, unlang_compile_t *unlang_ctx, C
 	gext = unlang_group_to_limit(g);
 	gext->limit = limit;
 	gext->vpt = vpt;
+	gext->global = global;
+	gext->adaptive = adaptive;
 
 	return c;
 }
@@ -3558,6 +3762,22 @@ static unlang_t *compile_if_subsection(unlang_t *parent, unlang_compile_t *unlan
 			return NULL;
 		}
 
+		/*
+		 *	Evaluate any pure function calls with constant
+		 *	arguments now, so that they aren't re-run for
+		 *	every request.  A failure here isn't fatal, the
+		 *	condition is just evaluated as-is at run time.
+		 */
+		{
+			unsigned folded = 0;
+
+			if (xlat_purify(head, NULL, &folded) < 0) {
+				cf_log_debug(cs, "Not folding condition - %s", fr_strerror());
+			} else if (folded) {
+				cf_log_debug(cs, "Folded %u constant expression(s) in condition", folded);
+			}
+		}
+
 		is_truthy = xlat_is_truthy(head, &value);
 
 		/*
@@ -3849,6 +4069,7 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 
 	bool				clone = true;
 	bool				detach = false;
+	bool				shared = false;
 
 	static unlang_ext_t const 	parallel_ext = {
 						.type = UNLANG_TYPE_PARALLEL,
@@ -3872,6 +4093,14 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 		} else if (strcmp(name2, "detach") == 0) {
 			detach = true;
 
+		} else if (strcmp(name2, "shared") == 0) {
+			/*
+			 *	The children use the parent's
+			 *	attributes, so nothing is copied.
+			 */
+			clone = false;
+			shared = true;
+
 		} else {
 			cf_log_err(cs, "Invalid argument '%s'", name2);
 			return NULL;
@@ -3894,6 +4123,7 @@ static unlang_t *compile_parallel(unlang_t *parent, unlang_compile_t *unlang_ctx
 	gext = unlang_group_to_parallel(g);
 	gext->clone = clone;
 	gext->detach = detach;
+	gext->shared = shared;
 
 	return c;
 }
@@ -4964,6 +5194,26 @@ check_for_module:
 	return NULL;
 }
 
+/** Count the configuration items which may become instructions
+ *
+ */
+static size_t compile_count_items(CONF_SECTION const *cs)
+{
+	CONF_ITEM	*ci = NULL;
+	size_t		count = 0;
+
+	while ((ci = cf_item_next(cs, ci))) {
+		if (cf_item_is_section(ci)) {
+			count += 1 + compile_count_items(cf_item_to_section(ci));
+			continue;
+		}
+
+		if (cf_item_is_pair(ci)) count++;
+	}
+
+	return count;
+}
+
 /** Compile an unlang section for a virtual server
  *
  * @param[in] vs		Virtual server to compile section for.
@@ -4982,7 +5232,8 @@ int unlang_compile(virtual_server_t const *vs,
 	tmpl_rules_t			my_rules;
 	char const			*name1, *name2;
 	CONF_DATA const			*cd;
-	static unlang_ext_t const 	group_ext = {
+	size_t				count;
+	unlang_ext_t			group_ext = {
 						.type = UNLANG_TYPE_GROUP,
 						.len = sizeof(unlang_group_t),
 						.type_name = "unlang_group_t",
@@ -5013,6 +5264,17 @@ int unlang_compile(virtual_server_t const *vs,
 		rules = &my_rules;
 	}
 
+	/*
+	 *	Carve the whole instruction tree out of one pool owned
+	 *	by the top level group.  The interpreter walks the
+	 *	children depth first, which is also the order they're
+	 *	allocated in, so keeping them together improves
+	 *	locality when the section is run.
+	 */
+	count = compile_count_items(cs);
+	group_ext.pool_headers = (unsigned) (count * UNLANG_COMPILE_POOL_HEADERS);
+	group_ext.pool_len = count * UNLANG_COMPILE_POOL_LEN;
+
 	c = compile_section(NULL,
 			    &(unlang_compile_t){
 				.vs = vs,
@@ -5131,22 +5393,74 @@ void *unlang_thread_instance(unlang_t const *instruction)
 }
 
 #ifdef WITH_PERF
-void unlang_frame_perf_init(unlang_stack_frame_t *frame)
+/** The maximum number of instructions recorded in one trace
+ *
+ */
+#define UNLANG_TRACE_MAX	(256)
+
+/** Add an entry to the trace for a frame which is being pushed
+ *
+ */
+static inline CC_HINT(always_inline) void unlang_frame_trace_init(unlang_stack_t *stack, unlang_stack_frame_t *frame,
+								  fr_time_t now)
+{
+	unlang_trace_t		*trace = stack->trace;
+	unlang_trace_entry_t	*entry;
+
+	frame->trace = NULL;
+	if (likely(!trace)) return;
+
+	if (trace->num >= talloc_array_length(trace->entry)) {
+		unsigned int size = talloc_array_length(trace->entry) * 2;
+
+		if (size > UNLANG_TRACE_MAX) {
+		drop:
+			trace->dropped++;
+			return;
+		}
+
+		trace->entry = talloc_realloc(trace, trace->entry, unlang_trace_entry_t, size);
+		if (!trace->entry) goto drop;
+	}
+
+	frame->trace = trace;
+	frame->trace_id = trace->num++;
+
+	entry = &trace->entry[frame->trace_id];
+	*entry = (unlang_trace_entry_t) {
+		.instruction = frame->instruction,
+		.depth = stack->depth,
+		.start = fr_time_sub(now, trace->start),
+	};
+}
+
+void unlang_frame_perf_init(unlang_stack_t *stack, unlang_stack_frame_t *frame)
 {
 	unlang_thread_t *t;
 	fr_time_t now;
 	unlang_t const *instruction = frame->instruction;
 
-	if (!instruction->number || !unlang_thread_array) return;
+	if (!instruction->number || !unlang_thread_array) {
+		frame->trace = NULL;
+		return;
+	}
 
 	fr_assert(instruction->number <= unlang_number);
 
 	t = &unlang_thread_array[instruction->number];
 
+	/*
+	 *	Only instructions with thread instance data have
+	 *	this set at instantiation time.
+	 */
+	if (!t->instruction) t->instruction = instruction;
+
 	t->use_count++;
 	t->yielded++;			// everything starts off as yielded
 	now = fr_time();
 
+	unlang_frame_trace_init(stack, frame, now);
+
 	fr_time_tracking_start(NULL, &frame->tracking, now);
 	fr_time_tracking_yield(&frame->tracking, fr_time());
 }
@@ -5162,6 +5476,8 @@ void unlang_frame_perf_yield(unlang_stack_frame_t *frame)
 	t->yielded++;
 	t->running--;
 
+	if (frame->trace) frame->trace->entry[frame->trace_id].yields++;
+
 	fr_time_tracking_yield(&frame->tracking, fr_time());
 }
 
@@ -5202,6 +5518,104 @@ void unlang_frame_perf_cleanup(unlang_stack_frame_t *frame)
 	fr_time_tracking_end(NULL, &frame->tracking, fr_time());
 	t->tracking.running_total = fr_time_delta_add(t->tracking.running_total, frame->tracking.running_total);
 	t->tracking.waiting_total = fr_time_delta_add(t->tracking.waiting_total, frame->tracking.waiting_total);
+
+	if (frame->trace) {
+		unlang_trace_entry_t *entry = &frame->trace->entry[frame->trace_id];
+
+		entry->running = frame->tracking.running_total;
+		entry->waiting = frame->tracking.waiting_total;
+		frame->trace = NULL;
+	}
+}
+
+/** Start recording a per-instruction breakdown for a request
+ *
+ * Every instruction which is pushed onto the request's stack from now
+ * on is recorded, along with the cpu time it used, the time it spent
+ * yielded, and the number of times it yielded.  The times include
+ * those of its children.
+ *
+ * This costs an allocation per request, so callers should only trace
+ * a sample of requests.
+ *
+ * @param[in] request	to trace.
+ */
+void unlang_trace_start(request_t *request)
+{
+	unlang_stack_t	*stack = request->stack;
+	unlang_trace_t	*trace;
+
+	if (stack->trace) return;
+
+	trace = talloc_zero(stack, unlang_trace_t);
+	if (!trace) return;
+
+	trace->entry = talloc_array(trace, unlang_trace_entry_t, 32);
+	if (!trace->entry) {
+		talloc_free(trace);
+		return;
+	}
+	trace->start = fr_time();
+
+	stack->trace = trace;
+}
+
+/** Whether a request is being traced
+ *
+ */
+bool unlang_trace_active(request_t const *request)
+{
+	unlang_stack_t const *stack = request->stack;
+
+	return (stack->trace != NULL);
+}
+
+/** Print the breakdown for a traced request
+ *
+ * One line is printed per instruction, indented by stack depth, in the
+ * order the instructions were executed.  Instructions which are still
+ * running are marked as such.
+ *
+ * @param[in] ctx	to allocate the output in.
+ * @param[in] request	which was traced with #unlang_trace_start.
+ * @return
+ *	- The breakdown, with one instruction per line.
+ *	- NULL if the request wasn't traced, or on error.
+ */
+char *unlang_trace_print(TALLOC_CTX *ctx, request_t const *request)
+{
+	unlang_stack_t const	*stack = request->stack;
+	unlang_trace_t const	*trace = stack->trace;
+	char			*out;
+	unsigned int		i;
+
+	if (!trace) return NULL;
+
+	out = talloc_strdup(ctx, "");
+	if (!out) return NULL;
+
+	for (i = 0; i < trace->num; i++) {
+		unlang_trace_entry_t const	*entry = &trace->entry[i];
+		unlang_t const			*instruction = entry->instruction;
+		bool				done = fr_time_delta_ispos(entry->running) ||
+						       fr_time_delta_ispos(entry->waiting);
+
+		out = talloc_asprintf_append_buffer(out, "%*s+%.3fms %s %s - cpu %.3fms, waiting %.3fms, yields %u%s\n",
+						    entry->depth * 2, "",
+						    fr_time_delta_unwrap(entry->start) / 1000000.0,
+						    unlang_ops[instruction->type].name,
+						    instruction->debug_name ? instruction->debug_name : "",
+						    fr_time_delta_unwrap(entry->running) / 1000000.0,
+						    fr_time_delta_unwrap(entry->waiting) / 1000000.0,
+						    entry->yields, done ? "" : " (not finished)");
+		if (!out) return NULL;
+	}
+
+	if (trace->dropped) {
+		out = talloc_asprintf_append_buffer(out, "... %u more instructions not recorded\n", trace->dropped);
+	}
+
+	return out;
 }
 
 
@@ -5313,4 +5727,144 @@ void unlang_perf_virtual_server(fr_log_t *log, char const *name)
 
 	fr_log(log, L_DBG, file, line, "}\n");
 }
+
+/** Return the profile of the calling thread
+ *
+ * The result is opaque, and only valid for the lifetime of the thread.
+ * It's intended to be stored by the worker, so that the profile can be
+ * printed by #unlang_perf_fprint from another thread.  The counters
+ * are only ever written by the owning thread, so no locking is done.
+ */
+void const *unlang_thread_perf(void)
+{
+	return unlang_thread_array;
+}
+
+#define UNLANG_PERF_CMP(_name, _expr) \
+static int unlang_perf_cmp_ ## _name(void const *one, void const *two) \
+{ \
+	unlang_thread_t const *a = *(unlang_thread_t const * const *) one; \
+	unlang_thread_t const *b = *(unlang_thread_t const * const *) two; \
+	return CMP(_expr(b), _expr(a)); \
+}
+
+#define PERF_COUNT(_t)	((_t)->use_count)
+#define PERF_CPU(_t)	fr_time_delta_unwrap((_t)->tracking.running_total)
+#define PERF_YIELD(_t)	fr_time_delta_unwrap((_t)->tracking.waiting_total)
+#define PERF_WALL(_t)	(PERF_CPU(_t) + PERF_YIELD(_t))
+
+UNLANG_PERF_CMP(count, PERF_COUNT)
+UNLANG_PERF_CMP(cpu, PERF_CPU)
+UNLANG_PERF_CMP(wall, PERF_WALL)
+UNLANG_PERF_CMP(yield, PERF_YIELD)
+
+/** Print the folded call stack of an instruction, in the format used by flamegraph.pl
+ *
+ */
+static void unlang_perf_fprint_stack(FILE *fp, unlang_t const *instruction)
+{
+	if (instruction->parent) {
+		unlang_perf_fprint_stack(fp, instruction->parent);
+		fputc(';', fp);
+	}
+
+	fputs(instruction->debug_name, fp);
+}
+
+/** Print the profile of a thread
+ *
+ * Times include the time spent in any child instructions.
+ *
+ * @param[in] fp	to print to.
+ * @param[in] perf	as returned by #unlang_thread_perf.
+ * @param[in] sort	one of "count", "cpu", "wall", or "yield" to print a
+ *			table ordered by that column, or "folded" to print
+ *			folded stacks weighted by the CPU time (in
+ *			microseconds) used by each instruction and not its
+ *			children.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the sort order is invalid.
+ */
+int unlang_perf_fprint(FILE *fp, void const *perf, char const *sort)
+{
+	unlang_thread_t const	*array = perf;
+	unlang_thread_t const	**used;
+	fr_time_delta_t		*self;
+	unsigned int		i, num = 0;
+	int			(*cmp)(void const *, void const *) = NULL;
+	bool			folded = false;
+
+	if (!array) return 0;
+
+	if (!sort || (strcmp(sort, "cpu") == 0)) {
+		cmp = unlang_perf_cmp_cpu;
+	} else if (strcmp(sort, "count") == 0) {
+		cmp = unlang_perf_cmp_count;
+	} else if (strcmp(sort, "wall") == 0) {
+		cmp = unlang_perf_cmp_wall;
+	} else if (strcmp(sort, "yield") == 0) {
+		cmp = unlang_perf_cmp_yield;
+	} else if (strcmp(sort, "folded") == 0) {
+		folded = true;
+	} else {
+		fr_strerror_printf("Invalid sort order '%s'", sort);
+		return -1;
+	}
+
+	if (folded) {
+		/*
+		 *	Subtract the time of each instruction from its
+		 *	parent, so that the stacks add up correctly.
+		 */
+		MEM(self = talloc_zero_array(NULL, fr_time_delta_t, unlang_number + 1));
+		for (i = 1; i <= unlang_number; i++) {
+			unlang_t const *parent;
+
+			if (!array[i].instruction || !array[i].use_count) continue;
+
+			self[i] = fr_time_delta_add(self[i], array[i].tracking.running_total);
+
+			parent = array[i].instruction->parent;
+			if (!parent || !parent->number) continue;
+
+			self[parent->number] = fr_time_delta_sub(self[parent->number], array[i].tracking.running_total);
+		}
+
+		for (i = 1; i <= unlang_number; i++) {
+			if (!array[i].instruction || !array[i].use_count) continue;
+			if (!fr_time_delta_ispos(self[i])) continue;
+
+			unlang_perf_fprint_stack(fp, array[i].instruction);
+			fprintf(fp, " %" PRId64 "\n", fr_time_delta_to_usec(self[i]));
+		}
+
+		talloc_free(self);
+		return 0;
+	}
+
+	MEM(used = talloc_array(NULL, unlang_thread_t const *, unlang_number));
+	for (i = 1; i <= unlang_number; i++) {
+		if (!array[i].instruction || !array[i].use_count) continue;
+
+		used[num++] = &array[i];
+	}
+
+	qsort(used, num, sizeof(used[0]), cmp);
+
+	fprintf(fp, "%12s %14s %14s %14s  %s\n", "count", "cpu", "wall", "yield", "instruction");
+	for (i = 0; i < num; i++) {
+		unlang_thread_t const *t = used[i];
+
+		fprintf(fp, "%12" PRIu64 " %14.6f %14.6f %14.6f  %s\n",
+			PERF_COUNT(t),
+			PERF_CPU(t) / (double)NSEC,
+			PERF_WALL(t) / (double)NSEC,
+			PERF_YIELD(t) / (double)NSEC,
+			t->instruction->debug_name);
+	}
+
+	talloc_free(used);
+	return 0;
+}
 #endif
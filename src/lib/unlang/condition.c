@@ -57,13 +57,10 @@ static unlang_action_t unlang_if_resume(rlm_rcode_t *p_result, request_t *reques
 
 	/*
 	 *	Tell the main interpreter to skip over the else /
-	 *	elsif blocks, as this "if" condition was taken.
+	 *	elsif blocks, as this "if" condition was taken.  The
+	 *	target was resolved when the section was compiled.
 	 */
-	while (frame->next &&
-	       ((frame->next->type == UNLANG_TYPE_ELSE) ||
-		(frame->next->type == UNLANG_TYPE_ELSIF))) {
-		frame->next = frame->next->next;
-	}
+	if (frame->next) frame->next = unlang_group_to_cond(unlang_generic_to_group(frame->instruction))->chain_end;
 
 	/*
 	 *	We took the "if".  Go recurse into its' children.
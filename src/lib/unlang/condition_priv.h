@@ -33,6 +33,8 @@ typedef struct {
 	xlat_exp_head_t	*head;
 	bool		is_truthy;
 	bool		value;
+	unlang_t	*chain_end;	//!< First instruction after the else / elsif blocks
+					///< which follow this condition.  NULL if there is none.
 } unlang_cond_t;
 
 /** Cast a group structure to the cond keyword extension
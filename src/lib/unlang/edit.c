@@ -35,6 +35,8 @@ RCSID("$Id$")
 #include <freeradius-devel/unlang/transaction.h>
 #include <freeradius-devel/unlang/unlang_priv.h>
 #include "edit_priv.h"
+#include "function.h"
+#include "interpret_priv.h"
 
 #undef XDEBUG
 #if 1
@@ -59,6 +61,21 @@ typedef struct unlang_frame_state_edit_s unlang_frame_state_edit_t;
 
 typedef int (*unlang_edit_expand_t)(request_t *request, unlang_frame_state_edit_t *state, edit_map_t *current);
 
+/** An RHS expansion which is run in a child request, at the same time as the others in the list
+ *
+ *  The child shares the parent's attributes.  The parent is yielded until all
+ *  of the children are done, and nothing is edited until then.
+ */
+typedef struct {
+	unlang_frame_state_edit_t *state;		//!< which started the expansion.
+	tmpl_t const		*vpt;			//!< RHS being expanded.
+	request_t		*child;			//!< running the expansion.
+	fr_value_box_list_t	result;			//!< of the expansion.
+	bool			success;		//!< whether the expansion succeeded.
+	bool			running;		//!< the child has been started.
+	bool			done;			//!< the child has finished the expansion.
+} edit_prefetch_t;
+
 struct edit_map_s {
 	fr_edit_list_t		*el;			//!< edit list
 
@@ -91,6 +108,9 @@ struct unlang_frame_state_edit_s {
 
 	edit_map_t		*current;		//!< what we're currently doing.
 	edit_map_t		first;
+
+	edit_prefetch_t		*prefetch;		//!< RHS expansions which were started together.
+	unsigned int		prefetch_done;		//!< How many of them have finished.
 };
 
 #define MAP_INFO cf_filename(map->ci), cf_lineno(map->ci)
@@ -1094,6 +1114,27 @@ static int expand_rhs(request_t *request, unlang_frame_state_edit_t *state, edit
 
 	XDEBUG("%s map %s %s %s", __FUNCTION__, map->lhs->name, fr_tokens[map->op], map->rhs->name);
 
+	/*
+	 *	The RHS may already have been expanded, along with the others in the list.
+	 */
+	if (state->prefetch) {
+		size_t i;
+
+		for (i = 0; i < talloc_array_length(state->prefetch); i++) {
+			edit_prefetch_t *pf = &state->prefetch[i];
+
+			if (pf->vpt != map->rhs) continue;
+
+			if (!pf->success) {
+				REDEBUG("%s[%d] Failed expanding %s", MAP_INFO, map->rhs->name);
+				return -1;
+			}
+
+			fr_value_box_list_move(&current->rhs.result, &pf->result);
+			return check_rhs(request, state, current);
+		}
+	}
+
 	/*
 	 *	Turn the RHS into a tmpl_t.  This can involve just referencing an existing
 	 *	tmpl in map->rhs, or expanding an xlat to get an attribute name.
@@ -1543,6 +1584,7 @@ static unlang_action_t process_edit(rlm_rcode_t *p_result, request_t *request, u
 				if (state->success) *state->success = false;
 
 				if (state->ours) fr_edit_list_abort(state->el);
+				xlat_memo_invalidate(request);
 				TALLOC_FREE(frame->state);
 				repeatable_clear(frame);
 				*p_result = RLM_MODULE_FAIL;
@@ -1572,6 +1614,11 @@ static unlang_action_t process_edit(rlm_rcode_t *p_result, request_t *request, u
 
 	*p_result = RLM_MODULE_NOOP;
 	if (state->success) *state->success = true;
+
+	/*
+	 *	Memoised expansions may have used the old values.
+	 */
+	xlat_memo_invalidate(request);
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
@@ -1610,6 +1657,104 @@ static void edit_state_init_internal(request_t *request, unlang_frame_state_edit
 	RINDENT_SAVE(state, request);
 }
 
+/** Free the child requests used for the RHS expansions
+ *
+ *  Children which are still running are cancelled.
+ */
+static void edit_prefetch_free(unlang_frame_state_edit_t *state)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(state->prefetch); i++) {
+		edit_prefetch_t *pf = &state->prefetch[i];
+
+		if (!pf->child) continue;
+
+		if (pf->running && !pf->done) unlang_interpret_signal(pf->child, FR_SIGNAL_CANCEL);
+
+		TALLOC_FREE(pf->child);
+	}
+}
+
+/** A child has finished its expansion.  Resume the parent once they all have
+ *
+ */
+static unlang_action_t edit_prefetch_done(UNUSED rlm_rcode_t *p_result, UNUSED int *p_priority,
+					  request_t *request, void *uctx)
+{
+	edit_prefetch_t			*pf = uctx;
+	unlang_frame_state_edit_t	*state = pf->state;
+
+	pf->done = true;
+
+	if (++state->prefetch_done == talloc_array_length(state->prefetch)) {
+		unlang_interpret_mark_runnable(request->parent);
+	}
+
+	return UNLANG_ACTION_CALCULATE_RESULT;
+}
+
+/** Start all of the independent RHS expansions in a list, each in its own child
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the children couldn't be created.  Any which were have been freed.
+ */
+static int edit_prefetch_start(request_t *request, unlang_frame_state_edit_t *state, unlang_edit_t const *edit)
+{
+	size_t i, num = talloc_array_length(edit->prefetch);
+
+	MEM(state->prefetch = talloc_zero_array(state, edit_prefetch_t, num));
+	state->prefetch_done = 0;
+
+	RDEBUG3("Expanding %zu values in parallel", num);
+
+	for (i = 0; i < num; i++) {
+		edit_prefetch_t *pf = &state->prefetch[i];
+
+		pf->state = state;
+		pf->vpt = edit->prefetch[i];
+		fr_value_box_list_init(&pf->result);
+
+		pf->child = unlang_io_subrequest_alloc_shared(request);
+		if (!pf->child) goto error;
+
+		/*
+		 *	Tell the parent when the expansion is done.
+		 */
+		if (unlang_function_push(pf->child, NULL, edit_prefetch_done, NULL, 0,
+					 UNLANG_TOP_FRAME, pf) < 0) goto error;
+		return_point_set(frame_current(pf->child));
+
+		if (unlang_xlat_push(state, &pf->success, &pf->result, pf->child, tmpl_xlat(pf->vpt),
+				     UNLANG_SUB_FRAME) < 0) goto error;
+
+		interpret_child_init(pf->child);
+		pf->running = true;
+	}
+
+	return 0;
+
+error:
+	RPEDEBUG("Failed starting parallel expansions");
+	edit_prefetch_free(state);
+	TALLOC_FREE(state->prefetch);
+	return -1;
+}
+
+/** All of the children have finished.  Go process the maps
+ *
+ */
+static unlang_action_t edit_prefetch_resume(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
+{
+	unlang_frame_state_edit_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_edit_t);
+
+	edit_prefetch_free(state);
+
+	frame_repeat(frame, process_edit);
+	return process_edit(p_result, request, frame);
+}
+
 /** Execute an update block
  *
  * Update blocks execute in two phases, first there's an evaluation phase where
@@ -1630,6 +1775,16 @@ static unlang_action_t unlang_edit_state_init(rlm_rcode_t *p_result, request_t *
 
 	edit_state_init_internal(request, state, el, &edit->maps);
 
+	/*
+	 *	Start the independent expansions together, and wait
+	 *	for all of them before processing the maps.  If they
+	 *	can't be started, the maps expand them as usual.
+	 */
+	if (edit->prefetch && (edit_prefetch_start(request, state, edit) == 0)) {
+		frame_repeat(frame, edit_prefetch_resume);
+		return UNLANG_ACTION_YIELD;
+	}
+
 	/*
 	 *	Call process_edit to do all of the work.
 	 */
@@ -1637,6 +1792,30 @@ static unlang_action_t unlang_edit_state_init(rlm_rcode_t *p_result, request_t *
 	return process_edit(p_result, request, frame);
 }
 
+/** Cancel or signal any children running RHS expansions
+ *
+ */
+static void unlang_edit_signal(UNUSED request_t *request, unlang_stack_frame_t *frame, fr_signal_t action)
+{
+	unlang_frame_state_edit_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_edit_t);
+	size_t				i;
+
+	if (!state->prefetch) return;
+
+	if (action == FR_SIGNAL_CANCEL) {
+		edit_prefetch_free(state);
+		return;
+	}
+
+	for (i = 0; i < talloc_array_length(state->prefetch); i++) {
+		edit_prefetch_t *pf = &state->prefetch[i];
+
+		if (!pf->child || !pf->running || pf->done) continue;
+
+		unlang_interpret_signal(pf->child, action);
+	}
+}
+
 
 /** Push a map onto the stack for edit evaluation
  *
@@ -1705,6 +1884,7 @@ void unlang_edit_init(void)
 			   &(unlang_op_t){
 				.name = "edit",
 				.interpret = unlang_edit_state_init,
+				.signal = unlang_edit_signal,
 				.frame_state_size = sizeof(unlang_frame_state_edit_t),
 				.frame_state_type = "unlang_frame_state_edit_t",
 			   });
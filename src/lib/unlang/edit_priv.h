@@ -31,6 +31,9 @@ extern "C" {
 typedef struct {
 	unlang_t		self;
 	map_list_t		maps;		//!< Head of the map list
+	tmpl_t const		**prefetch;	//!< RHS expansions which are started together,
+						///< before the maps are evaluated.  NULL if there are
+						///< fewer than two.
 } unlang_edit_t;
 
 /** Cast a generic structure to the edit extension
@@ -98,6 +98,11 @@ typedef struct {
  *  Then this horrific function copies the pairs by number, which re-parents them to the correct
  *  destination da.  It's brute-force and expensive, but it's easy.  And for now, it's less work than
  *  re-doing substantial parts of the server core and utility libraries.
+ *
+ *  The values of the copies borrow the buffers of the originals, so only the pairs themselves are
+ *  allocated.  The originals are immutable while we loop over them, so the buffers can't change
+ *  underneath us.  If the loop body edits the local variable, the value box code gives the copy its
+ *  own buffer first.
  */
 static int unlang_foreach_pair_copy(fr_pair_t *to, fr_pair_t *from, fr_dict_attr_t const *from_parent)
 {
@@ -125,7 +130,7 @@ static int unlang_foreach_pair_copy(fr_pair_t *to, fr_pair_t *from, fr_dict_attr
 		fr_pair_append(&to->vp_group, child);
 
 		if (fr_type_is_leaf(child->vp_type)) {
-			if (fr_value_box_copy(child, &child->data, &vp->data) < 0) return -1;
+			fr_value_box_borrow(&child->data, &vp->data);
 			continue;
 		}
 
@@ -135,6 +140,67 @@ static int unlang_foreach_pair_copy(fr_pair_t *to, fr_pair_t *from, fr_dict_attr
 	return 0;
 }
 
+/** Copy the members of a group, borrowing their values
+ *
+ *  Members of a group aren't parented by the group da, so they can be copied as-is.
+ */
+static int unlang_foreach_group_copy(fr_pair_t *to, fr_pair_t *from)
+{
+	fr_assert(fr_type_is_structural(to->vp_type));
+	fr_assert(fr_type_is_structural(from->vp_type));
+
+	fr_pair_list_foreach(&from->vp_group, vp) {
+		fr_pair_t *child;
+
+		child = fr_pair_afrom_da(to, vp->da);
+		if (!child) return -1;
+
+		fr_pair_append(&to->vp_group, child);
+
+		if (fr_type_is_leaf(child->vp_type)) {
+			fr_value_box_borrow(&child->data, &vp->data);
+			continue;
+		}
+
+		if (unlang_foreach_group_copy(child, vp) < 0) return -1;
+	}
+
+	return 0;
+}
+
+/** Set or clear the immutable flag on a pair, and on all of its leaf children
+ *
+ */
+static void unlang_foreach_pair_immutable(fr_pair_t *vp, bool immutable)
+{
+	if (fr_type_is_leaf(vp->vp_type)) {
+		if (immutable) {
+			fr_pair_set_immutable(vp);
+		} else {
+			fr_pair_clear_immutable(vp);
+		}
+		return;
+	}
+
+	fr_pair_list_foreach(&vp->vp_group, child) unlang_foreach_pair_immutable(child, immutable);
+}
+
+/** Set the local variable to a leaf value
+ *
+ *  If the types match, the local variable borrows the buffer of the original value.
+ */
+static int unlang_foreach_leaf_set(fr_pair_t *key, fr_pair_t const *vp)
+{
+	fr_value_box_clear_value(&key->data);
+
+	if (vp->vp_type == key->vp_type) {
+		fr_value_box_borrow(&key->data, &vp->data);
+		return 0;
+	}
+
+	return fr_value_box_cast(key, &key->data, key->vp_type, key->da, &vp->data);
+}
+
 static xlat_action_t unlang_foreach_xlat_func(TALLOC_CTX *ctx, fr_dcursor_t *out,
 					      xlat_ctx_t const *xctx,
 					      request_t *request, UNUSED fr_value_box_list_t *in);
@@ -160,8 +226,7 @@ static int _free_unlang_frame_state_foreach(unlang_frame_state_foreach_t *state)
 		fr_assert(vp != NULL);
 
 		do {
-			if (fr_type_is_leaf(vp->vp_type)) fr_pair_clear_immutable(vp);
-		
+			unlang_foreach_pair_immutable(vp, false);
 		} while ((vp = fr_dcursor_next(&state->cursor)) != NULL);
 		tmpl_dcursor_clear(&state->cc);
 
@@ -318,9 +383,20 @@ static unlang_action_t unlang_foreach_attr_next(rlm_rcode_t *p_result, request_t
 	 *	interpreter.
 	 */
 	if (fr_type_is_leaf(vp->vp_type)) {
-		if (vp->vp_type == state->key->vp_type) {
-			fr_value_box_clear_value(&vp->data);
-			(void) fr_value_box_copy(vp, &vp->data, &state->key->data);
+		if ((vp->vp_type == state->key->vp_type) &&
+		    (fr_value_box_cmp(&vp->data, &state->key->data) != 0)) {
+			fr_value_box_t tmp;
+
+			fr_value_box_init_null(&tmp);
+
+			/*
+			 *	The local variable may still borrow (part of)
+			 *	the original buffer, so copy before clearing.
+			 */
+			if (fr_value_box_copy(vp, &tmp, &state->key->data) == 0) {
+				fr_value_box_clear_value(&vp->data);
+				fr_value_box_steal(vp, &vp->data, &tmp);
+			}
 		}
 	} else {
 		/*
@@ -346,7 +422,7 @@ next:
 
 		fr_pair_list_free(&state->key->vp_group);
 
-		if (fr_pair_list_copy(state->key, &state->key->vp_group, &vp->vp_group) < 0) {
+		if (unlang_foreach_group_copy(state->key, vp) < 0) {
 			REDEBUG("Failed copying members of %s", state->key->da->name);
 			*p_result = RLM_MODULE_FAIL;
 			return UNLANG_ACTION_CALCULATE_RESULT;
@@ -364,8 +440,7 @@ next:
 		}
 
 	} else {
-		fr_value_box_clear_value(&state->key->data);
-		if (fr_value_box_cast(state->key, &state->key->data, state->key->vp_type, state->key->da, &vp->data) < 0) {
+		if (unlang_foreach_leaf_set(state->key, vp) < 0) {
 			RDEBUG("Failed casting 'foreach' iteration variable '%s' from %pP", state->key->da->name, vp);
 			goto next;
 		}
@@ -405,8 +480,7 @@ static unlang_action_t unlang_foreach_attr_init(rlm_rcode_t *p_result, request_t
 	 *	under us.
 	 */
 	do {
-		if (fr_type_is_leaf(vp->vp_type)) fr_pair_set_immutable(vp);
-		
+		unlang_foreach_pair_immutable(vp, true);
 	} while ((vp = fr_dcursor_next(&state->cursor)) != NULL);
 	tmpl_dcursor_clear(&state->cc);
 
@@ -416,7 +490,7 @@ static unlang_action_t unlang_foreach_attr_init(rlm_rcode_t *p_result, request_t
 	if (vp->vp_type == FR_TYPE_GROUP) {
 		fr_assert(state->key->vp_type == FR_TYPE_GROUP);
 
-		if (fr_pair_list_copy(state->key, &state->key->vp_group, &vp->vp_group) < 0) {
+		if (unlang_foreach_group_copy(state->key, vp) < 0) {
 			REDEBUG("Failed copying members of %s", state->key->da->name);
 			*p_result = RLM_MODULE_FAIL;
 			return UNLANG_ACTION_CALCULATE_RESULT;
@@ -432,8 +506,7 @@ static unlang_action_t unlang_foreach_attr_init(rlm_rcode_t *p_result, request_t
 		}
 
 	} else {
-		fr_value_box_clear_value(&state->key->data);
-		while (vp && (fr_value_box_cast(state->key, &state->key->data, state->key->vp_type, state->key->da, &vp->data) < 0)) {
+		while (vp && (unlang_foreach_leaf_set(state->key, vp) < 0)) {
 			RDEBUG("Failed casting 'foreach' iteration variable '%s' from %pP", state->key->da->name, vp);
 			vp = fr_dcursor_next(&state->cursor);
 		}
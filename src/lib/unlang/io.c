@@ -27,25 +27,11 @@ RCSID("$Id$")
 #include <freeradius-devel/io/listen.h>
 #include "unlang_priv.h"
 
-/** Allocate a child request based on the parent.
- *
- * @param[in] parent		spawning the child request.
- * @param[in] namespace		the child request operates in. If NULL the parent's namespace is used.
- * @param[in] detachable	Allow/disallow the child to be detached.
- * @return
- *      - The new child request.
- *	- NULL on error.
- */
-request_t *unlang_io_subrequest_alloc(request_t *parent, fr_dict_t const *namespace, bool detachable)
+static request_t *subrequest_alloc(request_t *parent, request_init_args_t const *args)
 {
 	request_t		*child;
 
-	child = request_alloc_internal(detachable ? NULL : parent,
-				       (&(request_init_args_t){
-						.parent = parent,
-						.namespace = namespace,
-						.detachable = detachable
-				       }));
+	child = request_alloc_internal(args->detachable ? NULL : parent, args);
 	if (!child) return NULL;
 
 	/*
@@ -76,3 +62,63 @@ request_t *unlang_io_subrequest_alloc(request_t *parent, fr_dict_t const *namesp
 
 	return child;
 }
+
+/** Allocate a child request based on the parent.
+ *
+ * @param[in] parent		spawning the child request.
+ * @param[in] namespace		the child request operates in. If NULL the parent's namespace is used.
+ * @param[in] detachable	Allow/disallow the child to be detached.
+ * @return
+ *      - The new child request.
+ *	- NULL on error.
+ */
+request_t *unlang_io_subrequest_alloc(request_t *parent, fr_dict_t const *namespace, bool detachable)
+{
+	return subrequest_alloc(parent,
+				(&(request_init_args_t){
+					.parent = parent,
+					.namespace = namespace,
+					.detachable = detachable
+				}));
+}
+
+/** Allocate a child request which shares its parent's attributes
+ *
+ * The child has its own interpreter stack, but uses the parent's request,
+ * reply, control and local lists.  Nothing is copied, and any edits the child
+ * makes are made directly to the parent's lists.  Attribute references,
+ * including ones to session-state, resolve to the parent's attributes.
+ *
+ * The child can't be detached, as it doesn't own its attributes.
+ *
+ * @param[in] parent		spawning the child request.
+ * @return
+ *      - The new child request.
+ *	- NULL on error.
+ */
+request_t *unlang_io_subrequest_alloc_shared(request_t *parent)
+{
+	request_t		*child;
+
+	child = subrequest_alloc(parent,
+				 (&(request_init_args_t){
+					.parent = parent,
+					.namespace = parent->dict,
+					.pair_list = {
+						.request = parent->pair_list.request,
+						.reply = parent->pair_list.reply,
+						.control = parent->pair_list.control,
+						.local = parent->pair_list.local
+					}
+				 }));
+	if (!child) return NULL;
+
+	/*
+	 *	Attribute references are resolved from the pair root,
+	 *	so use the parent's.  The child's own root is freed
+	 *	along with the child.
+	 */
+	child->pair_root = parent->pair_root;
+
+	return child;
+}
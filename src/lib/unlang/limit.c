@@ -28,17 +28,84 @@ RCSID("$Id$")
 #include "limit_priv.h"
 
 typedef struct {
-	uint32_t				active_callers;
+	unlang_limit_count_t			count;
 } unlang_thread_limit_t;
 
 typedef struct {
-	unlang_thread_limit_t			*thread;
+	unlang_limit_count_t			*count;		//!< Per-thread, or global counters.
 	uint32_t				limit;
+	bool					adaptive;
+	bool					active;		//!< We hold a slot in the limit.
+	fr_time_t				start;		//!< When we started running the children.
 	request_t				*request;
 
 	fr_value_box_list_t			result;
 } unlang_frame_state_limit_t;
 
+/** Adjust an adaptive limit, using AIMD
+ *
+ * Failures, and callers which take more than twice the long term
+ * average latency, cut the limit by 10%.  Other callers raise the
+ * limit by one, if the limit is being used.
+ *
+ * Threads sharing a global limit can race.  The loser's update is
+ * dropped, and the latency average is approximate.  That's fine, as
+ * the next caller will correct it.
+ *
+ * @param[in] count	for the limit section.
+ * @param[in] max	the configured limit.  The adaptive limit is never higher.
+ * @param[in] latency	of this caller.
+ * @param[in] failed	whether this caller failed.
+ */
+static void unlang_limit_adapt(unlang_limit_count_t *count, uint32_t max, fr_time_delta_t latency, bool failed)
+{
+	uint_fast32_t	old, limit, active;
+	uint_fast64_t	avg;
+	int64_t		ns = fr_time_delta_unwrap(latency);
+	bool		slow = false;
+
+	if (ns < 0) ns = 0;
+
+	avg = atomic_load_explicit(&count->latency, memory_order_relaxed);
+	if (avg) {
+		slow = ((uint_fast64_t) ns > (avg * 2));
+		atomic_store_explicit(&count->latency, avg - (avg >> 6) + ((uint_fast64_t) ns >> 6), memory_order_relaxed);
+	} else {
+		atomic_store_explicit(&count->latency, ns ? ns : 1, memory_order_relaxed);
+	}
+
+	old = atomic_load_explicit(&count->limit, memory_order_relaxed);
+	limit = (!old || (old > max)) ? max : old;
+
+	if (failed || slow) {
+		limit -= (limit > 10) ? (limit / 10) : 1;
+
+	} else {
+		active = atomic_load_explicit(&count->active_callers, memory_order_relaxed);
+		if ((limit >= max) || ((active * 2) < limit)) return;
+
+		limit++;
+	}
+
+	if (!limit) limit = 1;
+
+	(void) atomic_compare_exchange_strong_explicit(&count->limit, &old, limit,
+						       memory_order_relaxed, memory_order_relaxed);
+}
+
+/** Give up our slot in the limit
+ *
+ */
+static void unlang_limit_release(unlang_frame_state_limit_t *state, bool failed)
+{
+	if (!state->active) return;
+
+	atomic_fetch_sub_explicit(&state->count->active_callers, 1, memory_order_relaxed);
+	state->active = false;
+
+	if (state->adaptive) unlang_limit_adapt(state->count, state->limit, fr_time_sub(fr_time(), state->start), failed);
+}
+
 /** Send a signal (usually stop) to a request
  *
  * @param[in] request		The current request.
@@ -49,16 +116,18 @@ static void unlang_limit_signal(UNUSED request_t *request, unlang_stack_frame_t
 {
 	unlang_frame_state_limit_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_limit_t);
 
-	if (action == FR_SIGNAL_CANCEL) {
-		state->thread->active_callers--;
-	}
+	/*
+	 *	Being cancelled usually means that the request took
+	 *	too long, so adaptive limits treat it as a failure.
+	 */
+	if (action == FR_SIGNAL_CANCEL) unlang_limit_release(state, true);
 }
 
-static unlang_action_t unlang_limit_resume_done(UNUSED rlm_rcode_t *p_result, UNUSED request_t *request, unlang_stack_frame_t *frame)
+static unlang_action_t unlang_limit_resume_done(rlm_rcode_t *p_result, UNUSED request_t *request, unlang_stack_frame_t *frame)
 {
 	unlang_frame_state_limit_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_limit_t);
 
-	state->thread->active_callers--;
+	unlang_limit_release(state, (*p_result == RLM_MODULE_FAIL));
 
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
@@ -66,18 +135,44 @@ static unlang_action_t unlang_limit_resume_done(UNUSED rlm_rcode_t *p_result, UN
 static unlang_action_t unlang_limit_enforce(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
 {
 	unlang_frame_state_limit_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_limit_t);
+	unlang_limit_t			*gext = unlang_group_to_limit(unlang_generic_to_group(frame->instruction));
 	unlang_action_t			action;
+	uint_fast32_t			limit = state->limit;
 
-	state->thread = unlang_thread_instance(frame->instruction);
-	fr_assert(state->thread != NULL);
+	if (gext->global) {
+		state->count = &gext->shared;
+	} else {
+		unlang_thread_limit_t *thread = unlang_thread_instance(frame->instruction);
+
+		fr_assert(thread != NULL);
+		state->count = &thread->count;
+	}
 
-	if (state->thread->active_callers >= state->limit) return UNLANG_ACTION_FAIL;
+	if (gext->adaptive) {
+		uint_fast32_t current = atomic_load_explicit(&state->count->limit, memory_order_relaxed);
+
+		if (current && (current < limit)) limit = current;
+		state->adaptive = true;
+		state->start = fr_time();
+	}
+
+	/*
+	 *	Take a slot first, so that threads sharing a global
+	 *	limit can't all get in at once.
+	 */
+	if (atomic_fetch_add_explicit(&state->count->active_callers, 1, memory_order_relaxed) >= limit) {
+		atomic_fetch_sub_explicit(&state->count->active_callers, 1, memory_order_relaxed);
+		return UNLANG_ACTION_FAIL;
+	}
+	state->active = true;
 
 	frame_repeat(frame, unlang_limit_resume_done);
 
 	action = unlang_interpret_push_children(p_result, request, frame->result, UNLANG_NEXT_STOP);
-
-	state->thread->active_callers += (action == UNLANG_ACTION_PUSHED_CHILD);
+	if (action != UNLANG_ACTION_PUSHED_CHILD) {
+		atomic_fetch_sub_explicit(&state->count->active_callers, 1, memory_order_relaxed);
+		state->active = false;
+	}
 
 	return action;
 }
@@ -28,10 +28,29 @@ extern "C" {
 
 #include <freeradius-devel/server/tmpl.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** Callers in a limit section, and what we know about them
+ *
+ * Used per thread, or shared by all threads for "global" limits.
+ */
+typedef struct {
+	atomic_uint_fast32_t	active_callers;
+	atomic_uint_fast32_t	limit;		//!< Current adaptive limit.  0 means use the maximum.
+	atomic_uint_fast64_t	latency;	//!< Long term average latency of callers, in nanoseconds.
+} unlang_limit_count_t;
+
 typedef struct {
-	unlang_group_t	group;
-	tmpl_t		*vpt;
-	uint32_t	limit;
+	unlang_group_t		group;
+	tmpl_t			*vpt;
+	uint32_t		limit;
+	bool			global;		//!< The limit is shared by all threads.
+	bool			adaptive;	//!< Back off when callers fail, or are slow.
+	unlang_limit_count_t	shared;		//!< Counters for global limits.
 } unlang_limit_t;
 
 /** Cast a group structure to the limit keyword extension
@@ -30,6 +30,64 @@
 
 #define unlang_redundant_load_balance unlang_load_balance
 
+/** Ask a child how busy it is
+ *
+ * Only module calls can answer, and only if the module provides a
+ * load callback.
+ *
+ * @param[out] out	The cost of sending the request to this child.
+ * @param[in] child	to check.
+ * @return
+ *	- true if the child reported its load.
+ *	- false if it can't.
+ */
+static bool unlang_load_balance_cost(uint64_t *out, unlang_t const *child)
+{
+	unlang_module_t		*m;
+
+	if (child->type != UNLANG_TYPE_MODULE) return false;
+
+	m = unlang_generic_to_module(child);
+	if (!m->mmc.rlm || !m->mmc.rlm->get_load || m->mmc.key) return false;
+
+	*out = m->mmc.rlm->get_load(MODULE_CTX(m->mmc.mi, module_thread(m->mmc.mi)->data, NULL, NULL));
+	return true;
+}
+
+/** Pick two children at random, and choose the least loaded of the two
+ *
+ * This is the "power of two choices".  It avoids the herd behaviour of
+ * always choosing the least loaded child, while still moving load away
+ * from children which are slow, or have a lot of outstanding requests.
+ *
+ * @param[in] g		load-balance section.
+ * @return
+ *	- The chosen child.
+ *	- NULL if the children can't report their load.
+ */
+static unlang_t *unlang_load_balance_p2c(unlang_group_t *g)
+{
+	unlang_t	*child, *a = NULL, *b = NULL;
+	uint32_t	i, first, second;
+	uint64_t	cost_a, cost_b;
+
+	if (g->num_children < 2) return NULL;
+
+	first = fr_rand() % g->num_children;
+	second = fr_rand() % (g->num_children - 1);
+	if (second >= first) second++;
+
+	for (child = g->children, i = 0; child != NULL; child = child->next, i++) {
+		if (i == first) a = child;
+		if (i == second) b = child;
+	}
+	if (!a || !b) return NULL;
+
+	if (!unlang_load_balance_cost(&cost_a, a) || !unlang_load_balance_cost(&cost_b, b)) return NULL;
+
+	return (cost_b < cost_a) ? b : a;
+}
+
 static unlang_action_t unlang_load_balance_next(rlm_rcode_t *p_result, request_t *request,
 						unlang_stack_frame_t *frame)
 {
@@ -104,6 +162,53 @@ static unlang_action_t unlang_load_balance_next(rlm_rcode_t *p_result, request_t
 	return UNLANG_ACTION_PUSHED_CHILD;
 }
 
+/** Pick the child which "owns" a key
+ *
+ *  This is rendezvous hashing.  Each child gets a score from the key
+ *  and its own name, and the highest score wins.  Adding or removing a
+ *  child only moves the keys which that child owns, unlike "hash % num",
+ *  where almost every key moves.  So when each child is a different
+ *  server, sessions mostly stay where they are when the list changes.
+ *
+ *  Children with the same name (e.g. "group") are told apart by how
+ *  many of them came before.
+ */
+static unlang_t *load_balance_owner(unlang_group_t *g, uint32_t hash)
+{
+	unlang_t	*child, *prev, *found = NULL;
+	uint32_t	score, best = 0;
+
+	for (child = g->children; child != NULL; child = child->next) {
+		uint32_t	dup = 0;
+		char const	*name = child->name ? child->name : "";
+
+		for (prev = g->children; prev != child; prev = prev->next) {
+			if (prev->name && (strcmp(prev->name, name) == 0)) dup++;
+		}
+
+		score = fr_hash_update(name, strlen(name), hash);
+		score = fr_hash_update(&dup, sizeof(dup), score);
+
+		/*
+		 *	Finalise the score, so that similar names
+		 *	don't give similar scores.  This is the
+		 *	murmur3 fmix32 function.
+		 */
+		score ^= score >> 16;
+		score *= 0x85ebca6b;
+		score ^= score >> 13;
+		score *= 0xc2b2ae35;
+		score ^= score >> 16;
+
+		if (!found || (score > best)) {
+			found = child;
+			best = score;
+		}
+	}
+
+	return found;
+}
+
 static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
 {
 	unlang_frame_state_redundant_t	*redundant;
@@ -177,7 +282,9 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 
 			hash = fr_hash(p, slen);
 
-			start = hash % g->num_children;
+			redundant->found = load_balance_owner(g, hash);
+			RDEBUG3("load-balance key is owned by %s", redundant->found->debug_name);
+			goto done;
 		}
 
 		RDEBUG3("load-balance starting at child %d", (int) start);
@@ -186,11 +293,11 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 		for (redundant->child = redundant->found = g->children;
 		     redundant->child != NULL;
 		     redundant->child = redundant->child->next) {
-			count++;
 			if (count == start) {
 				redundant->found = redundant->child;
 				break;
 			}
+			count++;
 		}
 
 	} else {
@@ -198,18 +305,18 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 		count = 0;
 
 		/*
-		 *	Choose a child at random.
-		 *
-		 *	@todo - leverage the "power of 2", as per
-		 *      lib/io/network.c.  This is good enough for
-		 *      most purposes.  However, in order to do this,
-		 *      we need to track active callers across
-		 *      *either* multiple modules in one thread, *or*
-		 *      across multiple threads.
-		 *
-		 *	We don't have thread-specific instance data
-		 *	for this load-balance section.  So for now,
-		 *	just pick a random child.
+		 *	If the children are modules which can tell
+		 *	us how busy they are in this thread, use the
+		 *	"power of 2", as per lib/io/network.c.
+		 */
+		redundant->found = unlang_load_balance_p2c(g);
+		if (redundant->found) {
+			RDEBUG3("load-balance chose %s", redundant->found->debug_name);
+			goto done;
+		}
+
+		/*
+		 *	Otherwise choose a child at random.
 		 */
 		for (redundant->child = redundant->found = g->children;
 		     redundant->child != NULL;
@@ -222,6 +329,7 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 		}
 	}
 
+done:
 	/*
 	 *	Plain "load-balance".  Just do one child.
 	 */
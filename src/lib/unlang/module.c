@@ -30,6 +30,8 @@ RCSID("$Id$")
 #include <freeradius-devel/server/request_data.h>
 #include <freeradius-devel/server/rcode.h>
 #include <freeradius-devel/unlang/call_env.h>
+#include <freeradius-devel/util/probe.h>
+#include <freeradius-devel/util/trace_ring.h>
 
 #include "module_priv.h"
 
@@ -677,6 +679,21 @@ static unlang_action_t unlang_module_done(rlm_rcode_t *p_result, request_t *requ
 	*p_result = rcode;
 	request->module = state->previous_module;
 
+	/*
+	 *	Forced return codes never call the module, and
+	 *	don't have thread data.
+	 */
+	if (state->thread) {
+		char const *name = unlang_generic_to_module(frame->instruction)->mmc.mi->name;
+
+		FR_PROBE(module_exit, request->number, name, rcode);
+		fr_trace_ring_event(FR_TRACE_MODULE_DONE, request->number, name, -1, rcode);
+
+		state->thread->completed_calls++;
+		state->thread->total_time = fr_time_delta_add(state->thread->total_time,
+							      fr_time_sub(fr_time(), state->start));
+	}
+
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
@@ -728,6 +745,9 @@ static unlang_action_t unlang_module_resume(rlm_rcode_t *p_result, request_t *re
 	/*
 	 *	Lock is noop unless instance->mutex is set.
 	 */
+	FR_PROBE(module_resume, request->number, m->mmc.mi->name);
+	fr_trace_ring_event(FR_TRACE_MODULE_RESUME, request->number, m->mmc.mi->name, -1, 0);
+
 	safe_lock(m->mmc.mi);
 	ua = resume(&state->rcode, MODULE_CTX(m->mmc.mi, state->thread->data,
 					      state->env_data, state->rctx), request);
@@ -751,6 +771,9 @@ static unlang_action_t unlang_module_resume(rlm_rcode_t *p_result, request_t *re
 		 *	and when the I/O operation completes
 		 *	it shouldn't be called again.
 		 */
+		FR_PROBE(module_yield, request->number, m->mmc.mi->name);
+		fr_trace_ring_event(FR_TRACE_MODULE_YIELD, request->number, m->mmc.mi->name, -1, 0);
+
 		if (!state->resume) {
 			frame_repeat(frame, unlang_module_resume_done);
 		} else {
@@ -950,12 +973,15 @@ static unlang_action_t unlang_module(rlm_rcode_t *p_result, request_t *request,
 	state->thread->total_calls++;
 
 	/*
-	 *	If we're doing retries, remember when we started
-	 *	running the module.
+	 *	Remember when we started running the module, for
+	 *	the call latency metrics, and for retries.
 	 */
-	if (fr_time_delta_ispos(frame->instruction->actions.retry.irt)) now = fr_time();
+	now = state->start = fr_time();
 
 	request->module = m->mmc.mi->name;
+	FR_PROBE(module_enter, request->number, m->mmc.mi->name);
+	fr_trace_ring_event(FR_TRACE_MODULE_ENTER, request->number, m->mmc.mi->name, -1, 0);
+
 	safe_lock(m->mmc.mi);	/* Noop unless instance->mutex set */
 	ua = m->mmc.mmb.method(&state->rcode,
 			       MODULE_CTX(m->mmc.mi, state->thread->data, state->env_data, NULL),
@@ -978,6 +1004,8 @@ static unlang_action_t unlang_module(rlm_rcode_t *p_result, request_t *request,
 
 	case UNLANG_ACTION_YIELD:
 		state->thread->active_callers++;
+		FR_PROBE(module_yield, request->number, m->mmc.mi->name);
+		fr_trace_ring_event(FR_TRACE_MODULE_YIELD, request->number, m->mmc.mi->name, -1, 0);
 
 		/*
 		 *	The module yielded but didn't set a
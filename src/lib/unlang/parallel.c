@@ -274,8 +274,12 @@ static unlang_action_t unlang_parallel_process(rlm_rcode_t *p_result, request_t
 	 */
 	for (i = 0; i < state->num_children; i++) {
 		fr_assert(state->children[i].instruction != NULL);
-		child = unlang_io_subrequest_alloc(request,
-						   request->dict, state->detach);
+		if (state->shared) {
+			child = unlang_io_subrequest_alloc_shared(request);
+		} else {
+			child = unlang_io_subrequest_alloc(request,
+							   request->dict, state->detach);
+		}
 		child->packet->code = request->packet->code;
 
 		RDEBUG3("parallel - child %s (%d/%d) INIT",
@@ -476,6 +480,7 @@ static unlang_action_t unlang_parallel(rlm_rcode_t *p_result, request_t *request
 	state->priority = -1;				/* as-yet unset */
 	state->detach = gext->detach;
 	state->clone = gext->clone;
+	state->shared = gext->shared;
 	state->num_children = g->num_children;
 
 	/*
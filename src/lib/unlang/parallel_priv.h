@@ -65,6 +65,7 @@ typedef struct {
 
 	bool				detach;		//!< are we creating the child detached
 	bool				clone;		//!< are the children cloned
+	bool				shared;		//!< do the children share the parent's attributes
 
 	unlang_parallel_child_t		children[];	//!< Array of children.
 } unlang_parallel_state_t;
@@ -73,6 +74,7 @@ typedef struct {
 	unlang_group_t			group;
 	bool				detach;		//!< are we creating the child detached
 	bool				clone;
+	bool				shared;		//!< children use the parent's attributes
 } unlang_parallel_t;
 
 /** Cast a group structure to the parallel keyword extension
@@ -134,7 +134,12 @@ static unlang_action_t unlang_subrequest_parent_resume(rlm_rcode_t *p_result, re
 			return UNLANG_ACTION_CALCULATE_RESULT;
 		}
 
-		MEM(fr_pair_list_copy(vp, &vp->vp_group, &child->reply_pairs) >= 0);
+		/*
+		 *	The child is freed below, so its reply
+		 *	attributes are moved, rather than copied.
+		 */
+		fr_pair_list_steal(vp, &child->reply_pairs);
+		fr_pair_list_append(&vp->vp_group, &child->reply_pairs);
 
 		tmpl_dcursor_clear(&cc);
 	}
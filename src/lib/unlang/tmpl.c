@@ -79,7 +79,9 @@ static unlang_action_t unlang_tmpl_resume(rlm_rcode_t *p_result, request_t *requ
 	unlang_frame_state_tmpl_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_tmpl_t);
 	unlang_tmpl_t			*ut = unlang_generic_to_tmpl(frame->instruction);
 
-	if (tmpl_eval_cast_in_place(&state->list, request, ut->tmpl) < 0) {
+	if (((state->args.type & UNLANG_TMPL_ARGS_TYPE_SEGMENTS) ?
+	     tmpl_eval_segments_in_place(&state->list, request, ut->tmpl) :
+	     tmpl_eval_cast_in_place(&state->list, request, ut->tmpl)) < 0) {
 		RPEDEBUG("Failed casting expansion");
 		*p_result = RLM_MODULE_FAIL;
 		return UNLANG_ACTION_CALCULATE_RESULT;
@@ -255,6 +257,8 @@ push:
  * @param[in] tmpl		the tmpl to expand
  * @param[in] args		additional controls for expanding #TMPL_TYPE_EXEC,
  * 				and where the status of exited programs will be stored.
+ *				#TMPL_ARGS_SEGMENTS leaves the output of quoted tmpls
+ *				unconcatenated.
  */
 int unlang_tmpl_push(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *request,
 		     tmpl_t const *tmpl, unlang_tmpl_args_t *args)
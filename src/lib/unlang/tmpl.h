@@ -39,6 +39,8 @@ extern "C" {
  */
 typedef enum {
 	UNLANG_TMPL_ARGS_TYPE_EXEC = 1,				//!< We have arguments for performing an exec.
+	UNLANG_TMPL_ARGS_TYPE_SEGMENTS = 2,			//!< Leave the output of quoted tmpls as a list of
+								///< escaped segments, instead of concatenating them.
 } unlang_tmpl_args_type_t;
 
 /** Arguments for evaluating different types of tmpls
@@ -83,6 +85,15 @@ typedef struct {
 		}, \
 	}
 
+/** Create a temporary argument structure for expanding a quoted tmpl as a list of segments
+ *
+ * @see tmpl_eval_segments_in_place
+ */
+#define TMPL_ARGS_SEGMENTS \
+	&(unlang_tmpl_args_t){ \
+		.type = UNLANG_TMPL_ARGS_TYPE_SEGMENTS, \
+	}
+
 /** A callback when the request gets a fr_signal_t.
  *
  * A module may call unlang_yeild(), but still need to do something on FR_SIGNAL_DUP.  If so, it's
@@ -97,6 +97,7 @@ typedef enum {
 
 typedef struct unlang_s unlang_t;
 typedef struct unlang_stack_frame_s unlang_stack_frame_t;
+typedef struct unlang_stack_s unlang_stack_t;
 
 /** A node in a graph of #unlang_op_t (s) that we execute
  *
@@ -243,12 +244,37 @@ typedef struct {
 void	*unlang_thread_instance(unlang_t const *instruction);
 
 #ifdef WITH_PERF
-void		unlang_frame_perf_init(unlang_stack_frame_t *frame);
+/** One instruction executed by a traced request
+ *
+ */
+typedef struct {
+	unlang_t const		*instruction;			//!< which was executed.
+	int			depth;				//!< of the frame it was executed in.
+	uint32_t		yields;				//!< how many times it yielded.
+	fr_time_delta_t		start;				//!< when it was pushed, relative to the
+								///< start of the trace.
+	fr_time_delta_t		running;			//!< cpu time, including children.
+	fr_time_delta_t		waiting;			//!< time yielded, including children.
+} unlang_trace_entry_t;
+
+/** Per-instruction breakdown of one request
+ *
+ * Only allocated for requests which are being traced.
+ */
+typedef struct {
+	fr_time_t		start;				//!< when tracing started.
+	unsigned int		num;				//!< number of entries used.
+	unsigned int		dropped;			//!< instructions not recorded, because
+								///< the trace was full.
+	unlang_trace_entry_t	*entry;				//!< talloc array of entries.
+} unlang_trace_t;
+
+void		unlang_frame_perf_init(unlang_stack_t *stack, unlang_stack_frame_t *frame);
 void		unlang_frame_perf_yield(unlang_stack_frame_t *frame);
 void		unlang_frame_perf_resume(unlang_stack_frame_t *frame);
 void		unlang_frame_perf_cleanup(unlang_stack_frame_t *frame);
 #else
-#define		unlang_frame_perf_init(_x)
+#define		unlang_frame_perf_init(_x, _y)
 #define		unlang_frame_perf_yield(_x)
 #define		unlang_frame_perf_resume(_x)
 #define		unlang_frame_perf_cleanup(_x)
@@ -305,13 +331,15 @@ struct unlang_stack_frame_s {
 	uint8_t			uflags;				//!< Unwind markers
 #ifdef WITH_PERF
 	fr_time_tracking_t	tracking;			//!< track this instance of this instruction
+	unlang_trace_t		*trace;				//!< if the request is being traced.
+	unsigned int		trace_id;			//!< our entry in the trace.
 #endif
 };
 
 /** An unlang stack associated with a request
  *
  */
-typedef struct {
+struct unlang_stack_s {
 	unlang_interpret_t	*intp;				//!< Interpreter that the request is currently
 								///< associated with.
 	int			priority;			//!< Current priority.
@@ -319,8 +347,12 @@ typedef struct {
 	int			depth;				//!< Current depth we're executing at.
 	uint8_t			unwind;				//!< Unwind to this frame if it exists.
 								///< This is used for break and return.
+#ifdef WITH_PERF
+	unlang_trace_t		*trace;				//!< Per-instruction breakdown, if the
+								///< request is being traced.
+#endif
 	unlang_stack_frame_t	frame[UNLANG_STACK_MAX];	//!< The stack...
-} unlang_stack_t;
+};
 
 /** Different operations the interpreter can execute
  */
@@ -403,7 +435,7 @@ static inline void frame_state_init(unlang_stack_t *stack, unlang_stack_frame_t
 	unlang_op_t	*op;
 	char const	*name;
 
-	unlang_frame_perf_init(frame);
+	unlang_frame_perf_init(stack, frame);
 
 	op = &unlang_ops[instruction->type];
 	name = op->frame_state_type ? op->frame_state_type : __location__;
@@ -579,6 +611,8 @@ void		unlang_op_free(void);
  */
 request_t		*unlang_io_subrequest_alloc(request_t *parent, fr_dict_t const *namespace, bool detachable);
 
+request_t		*unlang_io_subrequest_alloc_shared(request_t *parent);
+
 /** @} */
 
 /** @name op init functions
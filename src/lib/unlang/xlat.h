@@ -385,6 +385,8 @@ int		xlat_aeval_compiled_argv(TALLOC_CTX *ctx, char ***argv, request_t *request,
 
 int		xlat_flatten_compiled_argv(TALLOC_CTX *ctx, xlat_exp_head_t ***argv, xlat_exp_head_t *head);
 
+void		xlat_memo_invalidate(request_t *request);
+
 fr_slen_t	xlat_tokenize_expression(TALLOC_CTX *ctx, xlat_exp_head_t **head, fr_sbuff_t *in,
 					 fr_sbuff_parse_rules_t const *p_rules, tmpl_rules_t const *t_rules);
 
@@ -436,6 +438,10 @@ int		xlat_from_tmpl_attr(TALLOC_CTX *ctx, xlat_exp_head_t **head, tmpl_t **vpt_p
 
 bool		xlat_impure_func(xlat_exp_head_t const *head) CC_HINT(nonnull);
 
+typedef int (*xlat_attr_walker_t)(tmpl_t const *vpt, void *uctx);
+
+int		xlat_attr_walk(xlat_exp_head_t const *head, xlat_attr_walker_t walker, void *uctx) CC_HINT(nonnull(1,2));
+
 /*
  *	xlat_alloc.c
  */
@@ -475,7 +481,7 @@ void		xlat_instances_free(void);
  *	xlat_purify.c
  */
 typedef struct unlang_interpret_s unlang_interpret_t;
-int		xlat_purify(xlat_exp_head_t *head, unlang_interpret_t *intp);
+int		xlat_purify(xlat_exp_head_t *head, unlang_interpret_t *intp, unsigned *folded);
 
 int		xlat_purify_op(TALLOC_CTX *ctx, xlat_exp_t **out, xlat_exp_t *lhs, fr_token_t op, xlat_exp_t *rhs);
 
@@ -3267,9 +3267,9 @@ static int xlat_func_subst_regex(TALLOC_CTX *ctx, fr_dcursor_t *out,
 		/*
 		*	Process the substitution
 		*/
-		if (regex_compile(NULL, &our_pattern,
-				  fr_sbuff_current(&start_m), fr_sbuff_current(&end_m) - fr_sbuff_current(&start_m),
-				  &our_flags, true, true) <= 0) {
+		if (regex_compile_cached(NULL, &our_pattern,
+					 fr_sbuff_current(&start_m), fr_sbuff_current(&end_m) - fr_sbuff_current(&start_m),
+					 &our_flags, true) <= 0) {
 			RPEDEBUG("Failed compiling regex");
 			return -1;
 		}
@@ -3409,6 +3409,127 @@ static xlat_action_t xlat_func_subst(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	return XLAT_ACTION_DONE;
 }
 
+#ifdef HAVE_REGEX
+/** The expressions to match, compiled together
+ */
+typedef struct {
+	fr_regex_set_t		*set;
+} xlat_regex_first_inst_t;
+
+/** Compile the patterns passed to %regex.first()
+ *
+ * The patterns must be literal strings of the form /<regex>/[flags].
+ */
+static int xlat_instantiate_regex_first(xlat_inst_ctx_t const *xctx)
+{
+	xlat_regex_first_inst_t	*inst = talloc_get_type_abort(xctx->inst, xlat_regex_first_inst_t);
+	xlat_exp_t		*arg, *patt_exp;
+
+	MEM(inst->set = regex_set_alloc(inst));
+
+	/* args #2 onwards (patterns) */
+	arg = fr_dlist_next(&xctx->ex->call.args->dlist, fr_dlist_head(&xctx->ex->call.args->dlist));
+	for (; arg; arg = fr_dlist_next(&xctx->ex->call.args->dlist, arg)) {
+		fr_regex_flags_t	flags = {};
+		fr_sbuff_t		sbuff;
+		char const		*start, *end;
+
+		fr_assert(arg->type == XLAT_GROUP);	/* args must be groups */
+
+		if (!xlat_is_literal(arg->group) || (fr_dlist_num_elements(&arg->group->dlist) != 1)) {
+		not_a_regex:
+			ERROR("Patterns passed to %%regex.first() must be literal /<regex>/[flags] strings");
+			return -1;
+		}
+
+		patt_exp = fr_dlist_head(&arg->group->dlist);
+		if (!fr_type_is_string(patt_exp->data.type)) goto not_a_regex;
+
+		start = patt_exp->data.vb_strvalue;
+		end = start + patt_exp->data.vb_length;
+
+		if ((start == end) || (*start != '/')) goto not_a_regex;
+		start++;
+
+		/*
+		 *	Flags follow the last slash
+		 */
+		while ((end > start) && (end[-1] != '/')) end--;
+		if (end == start) goto not_a_regex;
+
+		sbuff = FR_SBUFF_IN(end, patt_exp->data.vb_strvalue + patt_exp->data.vb_length);
+		if (fr_sbuff_remaining(&sbuff) && (regex_flags_parse(NULL, &flags, &sbuff, NULL, true) < 0)) {
+			PERROR("Failed parsing regex flags in \"%s\"", patt_exp->data.vb_strvalue);
+			return -1;
+		}
+
+		if (regex_set_add(inst->set, start, (end - 1) - start, &flags) <= 0) {
+			PERROR("Failed compiling regex \"%s\"", patt_exp->data.vb_strvalue);
+			return -1;
+		}
+	}
+
+	if (regex_set_compile(inst->set) < 0) {
+		PERROR("Failed compiling regexes");
+		return -1;
+	}
+
+	return 0;
+}
+
+static xlat_arg_parser_t const xlat_func_regex_first_args[] = {
+	{ .required = true, .concat = true, .type = FR_TYPE_STRING },
+	{ .required = true, .concat = true, .variadic = XLAT_ARG_VARIADIC_EMPTY_KEEP, .type = FR_TYPE_STRING },
+	XLAT_ARG_PARSER_TERMINATOR
+};
+
+/** Return the index of the first pattern which matches the subject
+ *
+ * All of the patterns are compiled when the server starts, and
+ * where the regex library allows, merged into a single expression
+ * so that the subject is only scanned once.
+ *
+@verbatim
+%regex.first(<subject>, /<regex>/[flags], ...)
+@endverbatim
+ *
+ * Example: (User-Name = "bob@example.org")
+@verbatim
+%regex.first(%{User-Name}, '/@example\.com$/', '/@example\.org$/i') == 1
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_func_regex_first(TALLOC_CTX *ctx, fr_dcursor_t *out,
+					   xlat_ctx_t const *xctx,
+					   request_t *request, fr_value_box_list_t *args)
+{
+	xlat_regex_first_inst_t const	*inst = talloc_get_type_abort_const(xctx->inst, xlat_regex_first_inst_t);
+	fr_value_box_t			*subject_vb, *vb;
+	uint32_t			idx;
+
+	XLAT_ARGS(args, &subject_vb);
+
+	switch (regex_set_exec(&idx, inst->set, subject_vb->vb_strvalue, subject_vb->vb_length)) {
+	case 0:
+		return XLAT_ACTION_DONE;
+
+	case 1:
+		break;
+
+	default:
+		RPEDEBUG("Failed matching regexes");
+		return XLAT_ACTION_FAIL;
+	}
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT32, NULL));
+	vb->vb_uint32 = idx;
+	fr_dcursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
+}
+#endif
+
 static xlat_arg_parser_t const xlat_func_time_args[] = {
 	{ .required = false, .single = true, .type = FR_TYPE_STRING },
 	XLAT_ARG_PARSER_TERMINATOR
@@ -4125,6 +4246,10 @@ do { \
 	XLAT_REGISTER_ARGS("subst", xlat_func_subst, FR_TYPE_STRING, xlat_func_subst_args);
 #ifdef HAVE_REGEX_PCRE2
 	xlat_func_instantiate_set(xlat, xlat_instantiate_subst_regex, xlat_subst_regex_inst_t, NULL, NULL);
+#endif
+#ifdef HAVE_REGEX
+	XLAT_REGISTER_ARGS("regex.first", xlat_func_regex_first, FR_TYPE_UINT32, xlat_func_regex_first_args);
+	xlat_func_instantiate_set(xlat, xlat_instantiate_regex_first, xlat_regex_first_inst_t, NULL, NULL);
 #endif
 	XLAT_REGISTER_ARGS("time", xlat_func_time, FR_TYPE_VOID, xlat_func_time_args);
 	XLAT_REGISTER_ARGS("trigger", trigger_xlat, FR_TYPE_STRING, trigger_xlat_args);
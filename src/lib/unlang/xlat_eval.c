@@ -606,6 +606,211 @@ bool xlat_process_return(request_t *request, xlat_t const *func, fr_value_box_li
 	return true;
 }
 
+/** Per-request store of memoised xlat function results
+ *
+ */
+typedef struct {
+	fr_rb_tree_t		*tree;			//!< Entries keyed by function and arguments.
+	fr_dlist_head_t		pending;		//!< Entries waiting for a function to return.
+} xlat_memo_t;
+
+typedef struct {
+	fr_rb_node_t		node;			//!< Entry in the memo tree.
+	fr_dlist_t		pending_entry;		//!< Entry in the pending list.
+
+	xlat_t const		*func;			//!< Function which produced the result.
+	char const		*key;			//!< Printed arguments the function was called with.
+
+	xlat_exp_t const	*pending;		//!< Call which is currently producing the result.
+	bool			done;			//!< Whether result is complete.
+	fr_value_box_list_t	result;			//!< Copy of the function's output.
+} xlat_memo_entry_t;
+
+static int8_t xlat_memo_cmp(void const *one, void const *two)
+{
+	xlat_memo_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->func, b->func);
+	if (ret != 0) return ret;
+
+	ret = strcmp(a->key, b->key);
+	return CMP(ret, 0);
+}
+
+/** Whether the results of a function may be memoised
+ *
+ * Only functions whose output depends entirely on their arguments are
+ * memoised.  Internal functions (operators, casts etc.) are cheaper to
+ * run than to look up, so they're skipped.
+ */
+static inline CC_HINT(always_inline) bool xlat_memoise(xlat_t const *func)
+{
+	if (!main_config || !main_config->xlat_memoise) return false;
+
+	return func->idempotent || (func->flags.pure && !func->internal);
+}
+
+/** Print the arguments of a function call into a key for the memo tree
+ *
+ */
+static char *xlat_memo_key(TALLOC_CTX *ctx, fr_value_box_list_t const *args)
+{
+	char	*key, *value;
+
+	MEM(key = talloc_strdup(ctx, ""));
+
+	fr_value_box_list_foreach(args, vb) {
+		if (fr_value_box_aprint(key, &value, vb, &fr_value_escape_double) < 0) {
+			talloc_free(key);
+			return NULL;
+		}
+
+		MEM(key = talloc_asprintf_append_buffer(key, "%s:\"%s\",", fr_type_to_str(vb->type), value));
+		talloc_free(value);
+	}
+
+	return key;
+}
+
+/** Find a memoised result for a call
+ *
+ * If no completed result exists, the call is recorded as pending so
+ * that its output can be stored by #xlat_memo_store when it returns.
+ *
+ * @param[in] request	The current request.
+ * @param[in] node	being called.
+ * @param[in] args	the function will be called with.
+ * @return
+ *	- The memo entry containing the result.
+ *	- NULL if there's no result, or it's still being produced.
+ */
+static xlat_memo_entry_t *xlat_memo_find(request_t *request, xlat_exp_t const *node, fr_value_box_list_t const *args)
+{
+	xlat_memo_t		*memo;
+	xlat_memo_entry_t	*entry;
+	char			*key;
+
+	memo = request_data_reference(request, xlat_memo_cmp, 0);
+	if (!memo) {
+		MEM(memo = talloc_zero(NULL, xlat_memo_t));
+		MEM(memo->tree = fr_rb_inline_talloc_alloc(memo, xlat_memo_entry_t, node, xlat_memo_cmp, NULL));
+		fr_dlist_talloc_init(&memo->pending, xlat_memo_entry_t, pending_entry);
+
+		if (request_data_add(request, xlat_memo_cmp, 0, memo, true, true, false) < 0) {
+			talloc_free(memo);
+			return NULL;
+		}
+	}
+
+	key = xlat_memo_key(memo, args);
+	if (!key) return NULL;
+
+	entry = fr_rb_find(memo->tree, &(xlat_memo_entry_t){ .func = node->call.func, .key = key });
+	if (entry) {
+		talloc_free(key);
+		if (entry->done) return entry;
+	} else {
+		MEM(entry = talloc_zero(memo, xlat_memo_entry_t));
+		entry->func = node->call.func;
+		entry->key = talloc_steal(entry, key);
+		fr_value_box_list_init(&entry->result);
+		fr_rb_insert(memo->tree, entry);
+	}
+
+	/*
+	 *	A previous call from this node may have failed, and
+	 *	never been completed.  Only the latest call can
+	 *	store its result.
+	 */
+	fr_dlist_foreach(&memo->pending, xlat_memo_entry_t, p) {
+		if (p->pending != node) continue;
+
+		fr_dlist_remove(&memo->pending, p);
+		p->pending = NULL;
+		break;
+	}
+
+	entry->pending = node;
+	if (!fr_dlist_entry_in_list(&entry->pending_entry)) fr_dlist_insert_tail(&memo->pending, entry);
+
+	return NULL;
+}
+
+/** Record the output of a call which was marked pending by #xlat_memo_find
+ *
+ * @param[in] request	The current request.
+ * @param[in] node	which returned.
+ * @param[in] out	the output list.
+ * @param[in] first	box the function produced, or NULL if none.
+ */
+static void xlat_memo_store(request_t *request, xlat_exp_t const *node,
+			    fr_value_box_list_t const *out, fr_value_box_t const *first)
+{
+	xlat_memo_t		*memo;
+	xlat_memo_entry_t	*entry = NULL;
+	fr_value_box_t const	*vb;
+
+	memo = request_data_reference(request, xlat_memo_cmp, 0);
+	if (!memo) return;
+
+	fr_dlist_foreach(&memo->pending, xlat_memo_entry_t, p) {
+		if (p->pending == node) {
+			entry = p;
+			break;
+		}
+	}
+	if (!entry) return;
+
+	fr_dlist_remove(&memo->pending, entry);
+	entry->pending = NULL;
+
+	for (vb = first; vb; vb = fr_value_box_list_next(out, vb)) {
+		fr_value_box_t *copy;
+
+		MEM(copy = fr_value_box_alloc_null(entry));
+		if (unlikely(fr_value_box_copy(copy, copy, vb) < 0)) {
+			talloc_free(copy);
+			fr_value_box_list_talloc_free(&entry->result);
+			return;
+		}
+		fr_value_box_list_insert_tail(&entry->result, copy);
+	}
+
+	entry->done = true;
+}
+
+/** Copy a memoised result to the output list
+ *
+ */
+static int xlat_memo_copy(TALLOC_CTX *ctx, fr_value_box_list_t *out, xlat_memo_entry_t const *entry)
+{
+	fr_value_box_list_foreach(&entry->result, vb) {
+		fr_value_box_t *copy;
+
+		MEM(copy = fr_value_box_alloc_null(ctx));
+		if (unlikely(fr_value_box_copy(copy, copy, vb) < 0)) {
+			talloc_free(copy);
+			return -1;
+		}
+		fr_value_box_list_insert_tail(out, copy);
+	}
+
+	return 0;
+}
+
+/** Discard all memoised xlat results for a request
+ *
+ * Called whenever attributes are edited, as the results may depend on
+ * the old values.
+ *
+ * @param[in] request	to discard results for.
+ */
+void xlat_memo_invalidate(request_t *request)
+{
+	talloc_free(request_data_get(request, xlat_memo_cmp, 0));
+}
+
 /** One letter expansions
  *
  * @param[in] ctx	to allocate boxed value, and buffers in.
@@ -909,6 +1114,10 @@ xlat_action_t xlat_frame_eval_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
 			RDEBUG2("| --> %pV", fr_dcursor_current(out));
 			if (!xlat_process_return(request, node->call.func, (fr_value_box_list_t *)out->dlist,
 					 fr_dcursor_current(out))) return XLAT_ACTION_FAIL;
+
+			if ((node->type == XLAT_FUNC) && xlat_memoise(node->call.func)) {
+				xlat_memo_store(request, node, (fr_value_box_list_t *)out->dlist, fr_dcursor_current(out));
+			}
 		}
 
 		/*
@@ -958,6 +1167,7 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 		xlat_action_t		xa;
 		xlat_thread_inst_t	*t;
 		fr_value_box_list_t	result_copy;
+		bool			memoise;
 
 		t = xlat_thread_instance_find(node);
 		fr_assert(t);
@@ -986,6 +1196,25 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 			return xa;
 		}
 
+		/*
+		 *	Use the result of an earlier call with the same
+		 *	arguments, if there was one.
+		 */
+		memoise = xlat_memoise(node->call.func);
+		if (memoise) {
+			xlat_memo_entry_t const *entry = xlat_memo_find(request, node, result);
+
+			if (entry) {
+				fr_value_box_list_talloc_free(&result_copy);
+				RDEBUG2("| %%%s(...) (memoised)", node->call.func->name);
+				memoise = false;
+
+				if (xlat_memo_copy(ctx, (fr_value_box_list_t *)out->dlist, entry) < 0) return XLAT_ACTION_FAIL;
+				xa = XLAT_ACTION_DONE;
+				goto process;
+			}
+		}
+
 		VALUE_BOX_LIST_VERIFY(result);
 		xa = node->call.func->func(ctx, out,
 					   XLAT_CTX(node->call.inst->data, t->data, t->mctx, env_data, NULL),
@@ -999,6 +1228,7 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 		}
 		fr_value_box_list_talloc_free(&result_copy);
 
+	process:
 		switch (xa) {
 		case XLAT_ACTION_FAIL:
 			return xa;
@@ -1022,6 +1252,7 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 			if (!xlat_process_return(request, node->call.func,
 						 (fr_value_box_list_t *)out->dlist,
 						 fr_dcursor_current(out))) return XLAT_ACTION_FAIL;
+			if (memoise) xlat_memo_store(request, node, (fr_value_box_list_t *)out->dlist, fr_dcursor_current(out));
 			RINDENT();
 			break;
 		}
@@ -1375,19 +1606,34 @@ static ssize_t xlat_eval_sync(TALLOC_CTX *ctx, char **out, request_t *request, x
 				fr_value_box_entry_t entry;
 				size_t len, real_len;
 				char *escaped;
+				char buff[FR_VALUE_BOX_PRINT_FAST_LEN];
+				char const *in;
+				fr_slen_t slen;
 
 				if (!vb->tainted) continue;
 
-				if (fr_value_box_cast_in_place(pool, vb, FR_TYPE_STRING, NULL) < 0) {
-					RPEDEBUG("Failed casting result to string");
-				error:
-					talloc_free(pool);
-					return -1;
+				/*
+				 *	Integers and addresses don't need a
+				 *	string box to be escaped.
+				 */
+				slen = (vb->type == FR_TYPE_STRING) ? -1 : fr_value_box_print_fast(buff, sizeof(buff), vb);
+				if (slen >= 0) {
+					in = buff;
+					len = slen;
+				} else {
+					if (fr_value_box_cast_in_place(pool, vb, FR_TYPE_STRING, NULL) < 0) {
+						RPEDEBUG("Failed casting result to string");
+					error:
+						talloc_free(pool);
+						return -1;
+					}
+					in = vb->vb_strvalue;
+					len = vb->vb_length;
 				}
 
-				len = vb->vb_length * 3;
+				len *= 3;
 				MEM(escaped = talloc_array(pool, char, len));
-				real_len = escape(request, escaped, len, vb->vb_strvalue, UNCONST(void *, escape_ctx));
+				real_len = escape(request, escaped, len, in, UNCONST(void *, escape_ctx));
 
 				entry = vb->entry;
 				fr_value_box_clear_value(vb);
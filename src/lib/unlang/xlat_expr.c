@@ -711,8 +711,8 @@ static xlat_action_t xlat_regex_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
 
 	fr_assert(inst->regex == NULL);
 
-	slen = regex_compile(rctx, &preg, fr_sbuff_start(agg), fr_sbuff_used(agg),
-			     tmpl_regex_flags(inst->xlat->vpt), true, true); /* flags, allow subcaptures, at runtime */
+	slen = regex_compile_cached(rctx, &preg, fr_sbuff_start(agg), fr_sbuff_used(agg),
+				    tmpl_regex_flags(inst->xlat->vpt), true); /* flags, allow subcaptures */
 	if (slen <= 0) return XLAT_ACTION_FAIL;
 
 	return xlat_regex_match(ctx, request, in, &preg, out, inst->op);
@@ -36,7 +36,9 @@ DIAG_OFF(attributes)
 typedef enum CC_HINT(flag_enum) {
 	XLAT_FUNC_FLAG_NONE = 0x00,
 	XLAT_FUNC_FLAG_PURE = 0x01,
-	XLAT_FUNC_FLAG_INTERNAL = 0x02
+	XLAT_FUNC_FLAG_INTERNAL = 0x02,
+	XLAT_FUNC_FLAG_IDEMPOTENT = 0x04	//!< Repeated calls with the same arguments
+						///< in a request give the same result.
 } xlat_func_flags_t;
 DIAG_ON(attributes)
 
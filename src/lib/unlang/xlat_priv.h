@@ -65,6 +65,8 @@ typedef struct xlat_s {
 	xlat_func_t		func;			//!< async xlat function (async unsafe).
 
 	bool			internal;		//!< If true, cannot be redefined.
+	bool			idempotent;		//!< Results may be memoised for the
+							///< lifetime of a request.
 	fr_token_t		token;			//!< for expressions
 
 	module_inst_ctx_t	*mctx;			//!< Original module instantiation ctx if this
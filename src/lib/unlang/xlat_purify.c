@@ -57,10 +57,57 @@ static void xlat_value_list_to_xlat(xlat_exp_head_t *head, fr_value_box_list_t *
 }
 
 
-int xlat_purify_list(xlat_exp_head_t *head, request_t *request)
+/** Evaluate a pure function call, writing its results to list
+ *
+ * Calls which come from the configuration files are only instantiated
+ * once everything has been compiled, so they cannot be run yet.  For
+ * those we evaluate an ephemeral copy of the call instead, which is
+ * instantiated on the spot and thrown away afterwards.
+ */
+static int xlat_purify_eval(TALLOC_CTX *ctx, fr_value_box_list_t *list, request_t *request, xlat_exp_t *node)
+{
+	bool			success = false;
+	xlat_exp_head_t		*copy;
+	xlat_exp_t		*eval;
+	fr_event_list_t		*el;
+
+	if (node->call.ephemeral) {
+		if (unlang_xlat_push_node(ctx, &success, list, request, node) < 0) return -1;
+
+		/*
+		 *	Hope to god it doesn't yield. :)
+		 */
+		(void) unlang_interpret_synchronous(NULL, request);
+		return success ? 0 : -1;
+	}
+
+	MEM(copy = xlat_exp_head_alloc(request));
+	MEM(el = fr_event_list_alloc(request, NULL, NULL));
+
+	MEM(eval = xlat_exp_alloc(copy, XLAT_FUNC, NULL, 0));
+	if (node->fmt) xlat_exp_set_name(eval, node->fmt, talloc_array_length(node->fmt) - 1);
+	eval->flags = node->flags;
+	eval->call.func = node->call.func;
+	eval->call.dict = node->call.dict;
+	if (xlat_copy(eval, eval->call.args, node->call.args) < 0) goto done;
+	xlat_exp_insert_tail(copy, eval);
+
+	if (xlat_finalize(copy, el) < 0) goto done;
+
+	if (unlang_xlat_push_node(ctx, &success, list, request, eval) < 0) goto done;
+
+	(void) unlang_interpret_synchronous(NULL, request);
+
+done:
+	talloc_free(copy);
+	talloc_free(el);
+
+	return success ? 0 : -1;
+}
+
+static int xlat_purify_list_count(xlat_exp_head_t *head, request_t *request, unsigned *folded)
 {
 	int rcode;
-	bool success;
 	fr_value_box_list_t list;
 	xlat_flags_t our_flags;
 
@@ -82,7 +129,7 @@ int xlat_purify_list(xlat_exp_head_t *head, request_t *request)
 			if (tmpl_is_xlat(node->vpt)) {
 				xlat_exp_head_t *child = tmpl_xlat(node->vpt);
 
-				rcode = xlat_purify_list(child, request);
+				rcode = xlat_purify_list_count(child, request, folded);
 				if (rcode < 0) return rcode;
 
 				node->flags = child->flags;
@@ -95,7 +142,7 @@ int xlat_purify_list(xlat_exp_head_t *head, request_t *request)
 			return -1;
 
 		case XLAT_GROUP:
-			rcode = xlat_purify_list(node->group, request);
+			rcode = xlat_purify_list_count(node->group, request, folded);
 			if (rcode < 0) return rcode;
 
 			node->flags = node->group->flags;
@@ -124,7 +171,7 @@ int xlat_purify_list(xlat_exp_head_t *head, request_t *request)
 					if (node->call.func->purify(node, node->call.inst->data, request) < 0) return -1;
 					request->dict = dict;
 				} else {
-					if (xlat_purify_list(node->call.args, request) < 0) return -1;
+					if (xlat_purify_list_count(node->call.args, request, folded) < 0) return -1;
 				}
 
 				/*
@@ -146,17 +193,7 @@ int xlat_purify_list(xlat_exp_head_t *head, request_t *request)
 			 */
 			fr_assert(node->flags.pure);
 			fr_value_box_list_init(&list);
-			success = false;
-			if (unlang_xlat_push_node(head, &success, &list, request, node) < 0) {
-				return -1;
-			}
-
-			/*
-			 *	Hope to god it doesn't yield. :)
-			 */
-
-			(void) unlang_interpret_synchronous(NULL, request);
-			if (!success) return -1;
+			if (xlat_purify_eval(head, &list, request, node) < 0) return -1;
 
 			/*
 			 *	The function call becomes a GROUP of boxes
@@ -166,6 +203,7 @@ int xlat_purify_list(xlat_exp_head_t *head, request_t *request)
 
 			xlat_value_list_to_xlat(node->group, &list);
 			node->flags = node->group->flags;
+			(*folded)++;
 			break;
 		}
 
@@ -185,15 +223,28 @@ int xlat_purify_list(xlat_exp_head_t *head, request_t *request)
 	return 0;
 }
 
+int xlat_purify_list(xlat_exp_head_t *head, request_t *request)
+{
+	unsigned folded = 0;
+
+	return xlat_purify_list_count(head, request, &folded);
+}
+
 /**  Purify an xlat
+ *
+ *  Pure function calls whose arguments are all constant are evaluated
+ *  and replaced by their results.
  *
  *  @param head		the xlat to be purified
  *  @param intp		the interpreter to use.
+ *  @param folded	where to write the number of function calls which
+ *			were replaced by their results.  May be NULL.
  *
  */
-int xlat_purify(xlat_exp_head_t *head, unlang_interpret_t *intp)
+int xlat_purify(xlat_exp_head_t *head, unlang_interpret_t *intp, unsigned *folded)
 {
 	int rcode;
+	unsigned count = 0;
 	request_t *request;
 
 	if (!head->flags.can_purify) return 0;
@@ -203,9 +254,11 @@ int xlat_purify(xlat_exp_head_t *head, unlang_interpret_t *intp)
 
 	if (intp) unlang_interpret_set(request, intp);
 
-	rcode = xlat_purify_list(head, request);
+	rcode = xlat_purify_list_count(head, request, &count);
 	talloc_free(request);
 
+	if (folded) *folded = count;
+
 	return rcode;
 }
 
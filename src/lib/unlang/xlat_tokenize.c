@@ -1878,3 +1878,52 @@ bool xlat_impure_func(xlat_exp_head_t const *head)
 {
 	return head->flags.impure_func;
 }
+
+/** Call a function for each attribute reference in an xlat
+ *
+ * Function arguments and groups are walked, too.
+ *
+ * @param[in] head	to walk.
+ * @param[in] walker	to call for each attribute reference.
+ * @param[in] uctx	passed to the walker.
+ * @return
+ *	- 0 if the walker returned 0 for every reference.
+ *	- the first non-zero value returned by the walker.
+ */
+int xlat_attr_walk(xlat_exp_head_t const *head, xlat_attr_walker_t walker, void *uctx)
+{
+	int ret;
+
+	xlat_exp_foreach(head, node) {
+		switch (node->type) {
+		case XLAT_TMPL:
+			if (tmpl_is_attr(node->vpt)) {
+				ret = walker(node->vpt, uctx);
+				if (ret != 0) return ret;
+
+			} else if (tmpl_contains_xlat(node->vpt)) {
+				ret = xlat_attr_walk(tmpl_xlat(node->vpt), walker, uctx);
+				if (ret != 0) return ret;
+			}
+			break;
+
+		case XLAT_FUNC:
+		case XLAT_FUNC_UNRESOLVED:
+			if (!node->call.args) break;
+
+			ret = xlat_attr_walk(node->call.args, walker, uctx);
+			if (ret != 0) return ret;
+			break;
+
+		case XLAT_GROUP:
+			ret = xlat_attr_walk(node->group, walker, uctx);
+			if (ret != 0) return ret;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
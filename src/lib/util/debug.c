@@ -25,6 +25,7 @@
 #include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/trace_ring.h>
 
 #include <pthread.h>
 #include <stdio.h>
@@ -1008,6 +1009,15 @@ NEVER_RETURNS void fr_fault(int sig)
 
 	fr_fault_backtrace();
 
+	/*
+	 *	What each thread was doing just before we crashed.
+	 *	The last 128 events per thread is usually plenty.
+	 */
+	if (fr_fault_log_fd >= 0) {
+		FR_FAULT_LOG("Recent events:");
+		fr_trace_ring_fault_dump(fr_fault_log_fd, 128);
+	}
+
 	/* No panic action set... */
 	if (panic_action[0] == '\0') {
 		FR_FAULT_LOG("No panic action set");
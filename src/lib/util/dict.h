@@ -711,6 +711,10 @@ fr_dict_gctx_t		*fr_dict_global_ctx_init(TALLOC_CTX *ctx, bool free_at_exit, cha
 
 void			fr_dict_global_ctx_perm_check(fr_dict_gctx_t *gctx, bool enable);
 
+int			fr_dict_global_ctx_cache(fr_dict_gctx_t *gctx, char const *path);
+
+int			fr_dict_global_ctx_cache_write(fr_dict_gctx_t const *gctx);
+
 void			fr_dict_global_ctx_set(fr_dict_gctx_t const *gctx);
 
 int			fr_dict_global_ctx_free(fr_dict_gctx_t const *gctx);
@@ -0,0 +1,582 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/util/dict_cache.c
+ * @brief Cache of pre-tokenised dictionary files.
+ *
+ * Most of the time spent loading dictionaries goes on reading many
+ * small files, and splitting each line into fields.  The cache
+ * holds the output of that step, i.e. the fields of every line of
+ * every dictionary file which was read, in one image which is
+ * mmap'd on startup.
+ *
+ * The cache is only an accelerator.  Each entry records the size and
+ * mtime of the file it was made from, and if the file no longer
+ * matches, it's read as normal.  If the image is truncated, or its
+ * checksum doesn't match, it's ignored entirely.  Either way, a new
+ * image is written once the dictionaries have loaded.
+ *
+ * The fields are still handed to the normal dictionary parser, so the
+ * dictionaries built from the cache are identical to the ones built
+ * from the files.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/dict_priv.h>
+#include <freeradius-devel/util/file.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/math.h>
+#include <freeradius-devel/util/shared_image.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DICT_CACHE_MAGIC	"FRDICTC"
+#define DICT_CACHE_VERSION	1
+
+/** Header at the start of the image
+ *
+ * The checksum covers everything after the header.
+ */
+typedef struct {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		num_files;
+	uint64_t		len;		//!< Of the image, including this header.
+	uint32_t		checksum;
+	uint32_t		pad;
+} dict_cache_hdr_t;
+
+/** Header for each file in the image
+ *
+ * Followed by the NUL terminated path, padded to 8 bytes, then
+ * the lines, again padded to 8 bytes.
+ */
+typedef struct {
+	uint64_t		size;		//!< Of the dictionary file.
+	int64_t			mtime;		//!< Of the dictionary file.
+	uint32_t		num_lines;
+	uint32_t		lines_len;
+	uint32_t		path_len;	//!< Excluding the NUL.
+	uint32_t		pad;
+} dict_cache_file_hdr_t;
+
+/** Header for each line
+ *
+ * Followed by argc offsets, then len bytes of NUL separated fields,
+ * padded to 4 bytes.
+ */
+typedef struct {
+	uint32_t		line;		//!< Line number in the dictionary file.
+	uint16_t		len;		//!< Of the fields.
+	uint8_t			argc;
+	uint8_t			pad;
+} dict_cache_line_hdr_t;
+
+struct dict_cache_file_s {
+	char const		*path;
+	uint64_t		size;
+	int64_t			mtime;
+
+	uint32_t		num_lines;
+	uint8_t const		*lines;		//!< In the image, or in buffer.
+	size_t			lines_len;
+
+	uint8_t			*buffer;	//!< Lines recorded in this run.
+	size_t			buffer_len;	//!< Allocated length of the buffer.
+
+	bool			used;		//!< Read in this run, so written out again.
+	bool			complete;	//!< All lines of the file were recorded.
+	bool			failed;		//!< A line couldn't be recorded.
+};
+
+struct dict_cache_s {
+	char const		*path;		//!< Of the image.
+
+	uint8_t			*image;		//!< mmap'd image, or NULL.
+	size_t			image_len;
+
+	fr_hash_table_t		*files;		//!< dict_cache_file_t, by path.
+
+	bool			changed;	//!< Something was recorded, so the image needs rewriting.
+};
+
+static uint32_t dict_cache_file_hash(void const *data)
+{
+	dict_cache_file_t const *file = data;
+
+	return fr_hash_string(file->path);
+}
+
+static int8_t dict_cache_file_cmp(void const *one, void const *two)
+{
+	dict_cache_file_t const *a = one, *b = two;
+
+	return CMP(strcmp(a->path, b->path), 0);
+}
+
+static int _dict_cache_free(dict_cache_t *cache)
+{
+	if (cache->image) munmap(cache->image, cache->image_len);
+
+	return 0;
+}
+
+/** Parse an image, adding the files in it to the cache
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the image is invalid.  Any entries added must be discarded.
+ */
+static int dict_cache_image_parse(dict_cache_t *cache, uint8_t const *image, size_t image_len)
+{
+	dict_cache_hdr_t	hdr;
+	uint8_t const		*p, *end = image + image_len;
+	uint32_t		i;
+
+	if (image_len < sizeof(hdr)) {
+		fr_strerror_const("Image is truncated");
+		return -1;
+	}
+
+	memcpy(&hdr, image, sizeof(hdr));
+	if ((memcmp(hdr.magic, DICT_CACHE_MAGIC, sizeof(hdr.magic)) != 0) || (hdr.version != DICT_CACHE_VERSION)) {
+		fr_strerror_const("Image has the wrong magic number or version");
+		return -1;
+	}
+
+	if (hdr.len != image_len) {
+		fr_strerror_const("Image is truncated");
+		return -1;
+	}
+
+	if (fr_hash(image + sizeof(hdr), image_len - sizeof(hdr)) != hdr.checksum) {
+		fr_strerror_const("Image checksum does not match");
+		return -1;
+	}
+
+	p = image + sizeof(hdr);
+	for (i = 0; i < hdr.num_files; i++) {
+		dict_cache_file_hdr_t	fhdr;
+		dict_cache_file_t	*file;
+		char const		*path;
+
+		if ((size_t)(end - p) < sizeof(fhdr)) {
+		truncated:
+			fr_strerror_const("Image is truncated");
+			return -1;
+		}
+		memcpy(&fhdr, p, sizeof(fhdr));
+		p += sizeof(fhdr);
+
+		path = (char const *) p;
+		if ((fhdr.path_len >= (size_t)(end - p)) ||
+		    ((size_t)(end - p) < ROUND_UP_POW2((size_t) fhdr.path_len + 1, 8))) goto truncated;
+		if (path[fhdr.path_len] != '\0') {
+			fr_strerror_const("Image contains an invalid path");
+			return -1;
+		}
+		p += ROUND_UP_POW2((size_t) fhdr.path_len + 1, 8);
+
+		if ((size_t)(end - p) < ROUND_UP_POW2((size_t) fhdr.lines_len, 8)) goto truncated;
+
+		file = talloc_zero(cache, dict_cache_file_t);
+		if (!file) {
+			fr_strerror_const("Out of memory");
+			return -1;
+		}
+		file->path = path;
+		file->size = fhdr.size;
+		file->mtime = fhdr.mtime;
+		file->num_lines = fhdr.num_lines;
+		file->lines = p;
+		file->lines_len = fhdr.lines_len;
+		file->complete = true;
+
+		if (!fr_hash_table_insert(cache->files, file)) {
+			fr_strerror_const("Image contains duplicate files");
+			return -1;
+		}
+		p += ROUND_UP_POW2(fhdr.lines_len, 8);
+	}
+
+	return 0;
+}
+
+/** Allocate a cache, loading any existing image
+ *
+ * A missing or invalid image isn't an error.  The cache starts empty,
+ * and the image is written out again once the dictionaries are loaded.
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[in] path	of the image.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+dict_cache_t *dict_cache_alloc(TALLOC_CTX *ctx, char const *path)
+{
+	dict_cache_t	*cache;
+	int		fd;
+	struct stat	sb;
+	void		*image;
+
+	cache = talloc_zero(ctx, dict_cache_t);
+	if (!cache) {
+	oom:
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+	talloc_set_destructor(cache, _dict_cache_free);
+
+	cache->path = talloc_strdup(cache, path);
+	cache->files = fr_hash_table_alloc(cache, dict_cache_file_hash, dict_cache_file_cmp, NULL);
+	if (!cache->path || !cache->files) {
+		TALLOC_FREE(cache);
+		goto oom;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		cache->changed = true;
+		return cache;
+	}
+
+	if ((fstat(fd, &sb) < 0) || !S_ISREG(sb.st_mode) || (sb.st_size == 0)) {
+	invalid:
+		close(fd);
+		cache->changed = true;
+		return cache;
+	}
+
+	/*
+	 *	Private, so that a partially written image can't
+	 *	change underneath us.  We never write to it.
+	 */
+#ifdef S_IWOTH
+	/*
+	 *	The image is as good as the dictionaries, so gets
+	 *	the same check.
+	 */
+	if (dict_gctx->perm_check && ((sb.st_mode & S_IWOTH) != 0)) goto invalid;
+#endif
+
+	image = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image == MAP_FAILED) goto invalid;
+	close(fd);
+
+	cache->image = image;
+	cache->image_len = sb.st_size;
+
+	if (dict_cache_image_parse(cache, cache->image, cache->image_len) < 0) {
+		fr_hash_iter_t		iter;
+		dict_cache_file_t	*file;
+
+		/*
+		 *	Discard everything, we can't trust any of it.
+		 */
+		while ((file = fr_hash_table_iter_init(cache->files, &iter))) {
+			fr_hash_table_remove(cache->files, file);
+			talloc_free(file);
+		}
+
+		munmap(cache->image, cache->image_len);
+		cache->image = NULL;
+		cache->image_len = 0;
+		cache->changed = true;
+		fr_strerror_clear();
+	}
+
+	return cache;
+}
+
+/** Find the cached lines for a dictionary file
+ *
+ * @param[in] cache	to search.
+ * @param[in] path	of the dictionary file.
+ * @param[in] sb	of the dictionary file, as it is now.
+ * @return
+ *	- The cached file, if it's up to date.
+ *	- NULL if there's no entry, or the file has changed.
+ */
+dict_cache_file_t const *dict_cache_file_find(dict_cache_t *cache, char const *path, struct stat const *sb)
+{
+	dict_cache_file_t	*file;
+
+	file = fr_hash_table_find(cache->files, &(dict_cache_file_t){ .path = path });
+	if (!file || !file->complete ||
+	    (file->size != (uint64_t) sb->st_size) || (file->mtime != (int64_t) sb->st_mtime)) return NULL;
+
+	file->used = true;
+
+	return file;
+}
+
+/** Get the next line from a cached file
+ *
+ * @param[in] file	to read from.
+ * @param[in,out] pos	offset of the next line.  Should be 0 for the first line.
+ * @param[out] line	number of the line in the dictionary file.
+ * @param[out] buf	to copy the fields into.
+ * @param[in] buf_len	length of the buffer.
+ * @param[out] argv	pointers to the fields in buf.
+ * @param[in] max_argc	maximum number of fields.
+ * @return
+ *	- >0 the number of fields.
+ *	- 0 there are no more lines.
+ *	- -1 the line doesn't fit into the buffers.
+ */
+int dict_cache_file_line(dict_cache_file_t const *file, size_t *pos, int *line,
+			 char *buf, size_t buf_len, char **argv, int max_argc)
+{
+	dict_cache_line_hdr_t	lhdr;
+	uint8_t const		*p = file->lines + *pos, *end = file->lines + file->lines_len;
+	int			i;
+
+	if (p >= end) return 0;
+
+	if ((size_t)(end - p) < sizeof(lhdr)) {
+	invalid:
+		fr_strerror_const("Cached dictionary line is invalid");
+		return -1;
+	}
+	memcpy(&lhdr, p, sizeof(lhdr));
+	p += sizeof(lhdr);
+
+	if ((lhdr.argc == 0) || (lhdr.argc > max_argc) || (lhdr.len > buf_len)) goto invalid;
+	if ((size_t)(end - p) < (size_t) lhdr.argc + lhdr.len) goto invalid;
+
+	memcpy(buf, p + lhdr.argc, lhdr.len);
+	for (i = 0; i < lhdr.argc; i++) {
+		if (p[i] >= lhdr.len) goto invalid;
+		argv[i] = buf + p[i];
+	}
+	if (buf[lhdr.len - 1] != '\0') goto invalid;
+
+	*line = lhdr.line;
+	*pos += ROUND_UP_POW2(sizeof(lhdr) + lhdr.argc + lhdr.len, 4);
+
+	return lhdr.argc;
+}
+
+/** Start recording the lines of a dictionary file
+ *
+ * Replaces any entry for the same path, unless that entry is itself
+ * still being recorded.
+ *
+ * @param[in] cache	to record the file in.
+ * @param[in] path	of the dictionary file.
+ * @param[in] sb	of the dictionary file.
+ * @return
+ *	- The new entry.
+ *	- NULL if the file shouldn't be recorded.
+ */
+dict_cache_file_t *dict_cache_file_record(dict_cache_t *cache, char const *path, struct stat const *sb)
+{
+	dict_cache_file_t	*file, *old = NULL;
+
+	file = fr_hash_table_find(cache->files, &(dict_cache_file_t){ .path = path });
+	if (file && !file->complete) return NULL;
+
+	file = talloc_zero(cache, dict_cache_file_t);
+	if (!file) return NULL;
+
+	file->path = talloc_strdup(file, path);
+	if (!file->path) {
+		talloc_free(file);
+		return NULL;
+	}
+	file->size = sb->st_size;
+	file->mtime = sb->st_mtime;
+	file->used = true;
+
+	if (fr_hash_table_replace((void **) &old, cache->files, file) < 0) {
+		talloc_free(file);
+		return NULL;
+	}
+	talloc_free(old);
+
+	cache->changed = true;
+
+	return file;
+}
+
+/** Record one line of a dictionary file
+ *
+ * Lines which can't be recorded are ignored, and the file won't be
+ * cached.
+ *
+ * @param[in] file	being recorded.
+ * @param[in] line	number of the line in the dictionary file.
+ * @param[in] argv	fields of the line.
+ * @param[in] argc	number of fields.
+ */
+void dict_cache_file_record_line(dict_cache_file_t *file, int line, char **argv, int argc)
+{
+	dict_cache_line_hdr_t	lhdr;
+	uint8_t			off[UINT8_MAX];
+	size_t			len = 0, need;
+	uint8_t			*p;
+	int			i;
+
+	if (file->failed) return;
+
+	for (i = 0; i < argc; i++) {
+		size_t arg_len = strlen(argv[i]) + 1;
+
+		if ((i >= (int) sizeof(off)) || ((len + arg_len) > UINT8_MAX)) {
+		fail:
+			file->failed = true;
+			return;
+		}
+
+		off[i] = len;
+		len += arg_len;
+	}
+
+	need = file->lines_len + ROUND_UP_POW2(sizeof(lhdr) + argc + len, 4);
+	if (need > file->buffer_len) {
+		size_t new_len = file->buffer_len ? file->buffer_len * 2 : 4096;
+
+		while (new_len < need) new_len *= 2;
+
+		p = talloc_realloc(file, file->buffer, uint8_t, new_len);
+		if (!p) goto fail;
+
+		file->buffer = p;
+		file->buffer_len = new_len;
+	}
+
+	p = file->buffer + file->lines_len;
+	memset(p, 0, need - file->lines_len);
+
+	lhdr = (dict_cache_line_hdr_t){ .line = line, .len = len, .argc = argc };
+	memcpy(p, &lhdr, sizeof(lhdr));
+	p += sizeof(lhdr);
+
+	memcpy(p, off, argc);
+	p += argc;
+
+	for (i = 0; i < argc; i++) {
+		size_t arg_len = strlen(argv[i]) + 1;
+
+		memcpy(p, argv[i], arg_len);
+		p += arg_len;
+	}
+
+	file->lines = file->buffer;
+	file->lines_len = need;
+	file->num_lines++;
+}
+
+/** Mark a dictionary file as having been recorded in full
+ *
+ */
+void dict_cache_file_record_done(dict_cache_file_t *file)
+{
+	if (file->failed) return;
+
+	file->complete = true;
+}
+
+/** Write out the cache if anything has changed
+ *
+ * Only files which were read in this run are written, so that the
+ * image doesn't accumulate files which are no longer used.  The image
+ * is written to a temporary file, and renamed over the old one, so
+ * that other processes never see a partial image.
+ *
+ * @param[in] cache	to write.
+ * @return
+ *	- 0 on success, or if nothing has changed.
+ *	- -1 on error.
+ */
+int dict_cache_write(dict_cache_t *cache)
+{
+	fr_hash_iter_t		iter;
+	dict_cache_file_t	*file;
+	dict_cache_hdr_t	hdr = { .magic = DICT_CACHE_MAGIC, .version = DICT_CACHE_VERSION };
+	uint8_t			*image, *body, *p;
+	size_t			body_len = 0;
+	bool			unused = false;
+
+	for (file = fr_hash_table_iter_init(cache->files, &iter);
+	     file;
+	     file = fr_hash_table_iter_next(cache->files, &iter)) {
+		if (!file->used || !file->complete) {
+			unused = true;
+			continue;
+		}
+
+		body_len += sizeof(dict_cache_file_hdr_t) + ROUND_UP_POW2(strlen(file->path) + 1, 8) + ROUND_UP_POW2(file->lines_len, 8);
+		hdr.num_files++;
+	}
+
+	if (!cache->changed && !unused) return 0;
+
+	image = talloc_zero_array(NULL, uint8_t, sizeof(hdr) + body_len);
+	if (!image) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	body = p = image + sizeof(hdr);
+
+	for (file = fr_hash_table_iter_init(cache->files, &iter);
+	     file;
+	     file = fr_hash_table_iter_next(cache->files, &iter)) {
+		dict_cache_file_hdr_t	fhdr;
+
+		if (!file->used || !file->complete) continue;
+
+		fhdr = (dict_cache_file_hdr_t){
+			.size = file->size,
+			.mtime = file->mtime,
+			.num_lines = file->num_lines,
+			.lines_len = file->lines_len,
+			.path_len = strlen(file->path)
+		};
+		memcpy(p, &fhdr, sizeof(fhdr));
+		p += sizeof(fhdr);
+
+		memcpy(p, file->path, fhdr.path_len);
+		p += ROUND_UP_POW2(fhdr.path_len + 1, 8);
+
+		if (file->lines_len) memcpy(p, file->lines, file->lines_len);
+		p += ROUND_UP_POW2(file->lines_len, 8);
+	}
+
+	hdr.len = sizeof(hdr) + body_len;
+	hdr.checksum = fr_hash(body, body_len);
+	memcpy(image, &hdr, sizeof(hdr));
+
+	if (fr_shared_image_write(cache->path, image, hdr.len) < 0) {
+		fr_strerror_printf_push("Failed writing dictionary cache");
+		talloc_free(image);
+		return -1;
+	}
+	talloc_free(image);
+
+	cache->changed = false;
+
+	return 0;
+}
@@ -34,6 +34,8 @@ extern "C" {
 #include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/value.h>
 
+#include <sys/stat.h>
+
 #define DICT_POOL_SIZE		(1024 * 1024 * 2)
 #define DICT_FIXUP_POOL_SIZE	(1024)
 
@@ -116,6 +118,9 @@ struct fr_dict {
 	fr_rb_tree_t		*dependents;		//!< Which files are using this dictionary.
 };
 
+typedef struct dict_cache_s dict_cache_t;
+typedef struct dict_cache_file_s dict_cache_file_t;
+
 struct fr_dict_gctx_s {
 	bool			free_at_exit;		//!< This gctx will be freed on exit.
 
@@ -145,10 +150,32 @@ struct fr_dict_gctx_s {
 	fr_dict_t		*internal;
 
 	fr_dict_attr_t const	*attr_protocol_encapsulation;
+
+	dict_cache_t		*cache;			//!< Of pre-tokenised dictionary files.  May be NULL.
 };
 
 extern fr_dict_gctx_t *dict_gctx;
 
+/** @name Cache of pre-tokenised dictionary files
+ *
+ * @{
+ */
+dict_cache_t		*dict_cache_alloc(TALLOC_CTX *ctx, char const *path);
+
+dict_cache_file_t const	*dict_cache_file_find(dict_cache_t *cache, char const *path, struct stat const *sb);
+
+int			dict_cache_file_line(dict_cache_file_t const *file, size_t *pos, int *line,
+					     char *buf, size_t buf_len, char **argv, int max_argc);
+
+dict_cache_file_t	*dict_cache_file_record(dict_cache_t *cache, char const *path, struct stat const *sb);
+
+void			dict_cache_file_record_line(dict_cache_file_t *file, int line, char **argv, int argc);
+
+void			dict_cache_file_record_done(dict_cache_file_t *file);
+
+int			dict_cache_write(dict_cache_t *cache);
+/** @} */
+
 bool			dict_has_dependents(fr_dict_t *dict);
 
 int			dict_dependent_add(fr_dict_t *dict, char const *dependent);
@@ -2039,6 +2039,10 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	int			argc;
 	fr_dict_attr_t const	*da;
 
+	dict_cache_file_t const	*cached = NULL;
+	dict_cache_file_t	*record = NULL;
+	size_t			cached_pos = 0;
+
 	/*
 	 *	Base flags are only set for the current file
 	 */
@@ -2135,28 +2139,50 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 
 	memset(&base_flags, 0, sizeof(base_flags));
 
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
+	/*
+	 *	If the file hasn't changed since it was cached, use
+	 *	the cached fields, otherwise record them.
+	 */
+	if (dict_gctx->cache) {
+		cached = dict_cache_file_find(dict_gctx->cache, fn, &statbuf);
+		if (!cached) record = dict_cache_file_record(dict_gctx->cache, fn, &statbuf);
+	}
+
+	for (;;) {
 		dict_tokenize_frame_t const *frame;
 
-		ctx->stack[ctx->stack_depth].line = ++line;
+		if (cached) {
+			argc = dict_cache_file_line(cached, &cached_pos, &line, buf, sizeof(buf), argv, MAX_ARGV);
+			if (argc == 0) break;
+			if (argc < 0) goto error;
 
-		switch (buf[0]) {
-		case '#':
-		case '\0':
-		case '\n':
-		case '\r':
-			continue;
-		}
+			ctx->stack[ctx->stack_depth].line = line;
 
-		/*
-		 *  Comment characters should NOT be appearing anywhere but
-		 *  as start of a comment;
-		 */
-		p = strchr(buf, '#');
-		if (p) *p = '\0';
+		} else {
+			if (!fgets(buf, sizeof(buf), fp)) break;
 
-		argc = fr_dict_str_to_argv(buf, argv, MAX_ARGV);
-		if (argc == 0) continue;
+			ctx->stack[ctx->stack_depth].line = ++line;
+
+			switch (buf[0]) {
+			case '#':
+			case '\0':
+			case '\n':
+			case '\r':
+				continue;
+			}
+
+			/*
+			 *  Comment characters should NOT be appearing anywhere but
+			 *  as start of a comment;
+			 */
+			p = strchr(buf, '#');
+			if (p) *p = '\0';
+
+			argc = fr_dict_str_to_argv(buf, argv, MAX_ARGV);
+			if (argc == 0) continue;
+
+			if (record) dict_cache_file_record_line(record, line, argv, argc);
+		}
 
 		if (argc == 1) {
 			fr_strerror_const("Invalid entry");
@@ -2710,6 +2736,8 @@ static int _dict_from_file(dict_tokenize_ctx_t *ctx,
 	 */
 	fclose(fp);
 
+	if (record) dict_cache_file_record_done(record);
+
 	return 0;
 }
 
@@ -4089,6 +4089,53 @@ void fr_dict_global_ctx_perm_check(fr_dict_gctx_t *gctx, bool enable)
 	gctx->perm_check = enable;
 }
 
+/** Use a cache of pre-tokenised dictionary files
+ *
+ * Dictionary files which are in the cache, and which haven't changed
+ * since it was written, are parsed from the cache instead of being
+ * read and split into fields again.
+ *
+ * Should be called before any dictionaries are loaded.  A missing or
+ * invalid cache isn't an error, the dictionaries are read as normal.
+ * Call fr_dict_global_ctx_cache_write() once they've been loaded to
+ * (re)write the cache.
+ *
+ * @param[in] gctx	to alter.
+ * @param[in] path	of the cache file.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dict_global_ctx_cache(fr_dict_gctx_t *gctx, char const *path)
+{
+	dict_cache_t *cache;
+
+	cache = dict_cache_alloc(gctx, path);
+	if (!cache) return -1;
+
+	talloc_free(gctx->cache);
+	gctx->cache = cache;
+
+	return 0;
+}
+
+/** Write the cache of pre-tokenised dictionary files
+ *
+ * Does nothing if no cache was set, or if every dictionary was
+ * loaded from the cache.
+ *
+ * @param[in] gctx	whose cache to write.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dict_global_ctx_cache_write(fr_dict_gctx_t const *gctx)
+{
+	if (!gctx->cache) return 0;
+
+	return dict_cache_write(gctx->cache);
+}
+
 /** Set a new, active, global dictionary context
  *
  * @param[in] gctx	To set.
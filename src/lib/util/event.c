@@ -21,6 +21,13 @@
  * By non-thread-safe we mean multiple threads can't insert/delete
  * events concurrently into the same event list without synchronization.
  *
+ * When built with WITH_EVENT_EPOLL (--with-epoll), I/O filters for sockets
+ * and pipes are registered with epoll directly, instead of going through
+ * libkqueue's kevent() emulation.  The kqueue is then itself a member of
+ * the epoll set, and is only read when it has events.  It's still used
+ * for user events, processes, vnode filters, and I/O on regular files,
+ * which epoll doesn't support.
+ *
  * @file src/lib/util/event.c
  *
  * @copyright 2007-2016 The FreeRADIUS server project
@@ -33,6 +40,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/lst.h>
 #include <freeradius-devel/util/log.h>
+#include <freeradius-devel/util/math.h>
 #include <freeradius-devel/util/rb.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/syserror.h>
@@ -44,6 +52,11 @@ RCSID("$Id$")
 #include <sys/wait.h>
 #include <pthread.h>
 
+#ifdef WITH_EVENT_EPOLL
+#  include <sys/epoll.h>
+#  include <sys/ioctl.h>
+#endif
+
 #ifdef NDEBUG
 /*
  *	Turn off documentation warnings as file/line
@@ -113,6 +126,10 @@ struct fr_event_timer {
 	fr_lst_index_t		lst_id;	     	  	//!< Where to store opaque lst data.
 	fr_dlist_t		entry;			//!< List of deferred timer events.
 
+	fr_dlist_head_t		*wheel_slot;		//!< Timer wheel slot this event is in, or NULL
+							///< if the event is in the lst.
+	fr_dlist_t		wheel_entry;		//!< Entry in the timer wheel slot.
+
 	fr_event_list_t		*el;			//!< Event list containing this timer.
 
 #ifndef NDEBUG
@@ -314,6 +331,12 @@ struct fr_event_fd {
 	bool			is_registered;		//!< Whether this fr_event_fd_t's FD has been registered with
 							///< kevent.  Mostly for debugging.
 
+#ifdef WITH_EVENT_EPOLL
+	bool			epoll;			//!< The FD's filters are in the epoll set, not the kqueue.
+	uint32_t		epoll_events;		//!< The events the FD is registered for in the epoll set.
+							///< Zero means "not in the epoll set".
+#endif
+
 	void			*uctx;			//!< Context pointer to pass to each file descriptor callback.
 	TALLOC_CTX		*linked_ctx;		//!< talloc ctx this event was bound to.
 
@@ -405,11 +428,40 @@ typedef struct {
 	void			*uctx;			//!< Context for the callback.
 } fr_event_post_t;
 
+#define FR_EVENT_WHEEL_TICK_SHIFT	20		//!< Each tick is 2^20ns, or ~1ms.
+#define FR_EVENT_WHEEL_SLOT_BITS	6		//!< 64 slots per level, so we can use a uint64_t bitmap.
+#define FR_EVENT_WHEEL_SLOTS		(1 << FR_EVENT_WHEEL_SLOT_BITS)
+#define FR_EVENT_WHEEL_LEVELS		4		//!< 2^(20 + 24)ns, or ~4.8 hours.
+
+/** Hierarchical timer wheel
+ *
+ * Timers which are due in the future are parked in a slot of the
+ * wheel, where insertion and removal are O(1).  Most timers are
+ * deleted or re-armed long before they fire, and never make it any
+ * further.
+ *
+ * Level 0 has one slot per tick.  Each slot at level N covers 64
+ * slots of level N - 1.  When time reaches the start of a slot, its
+ * timers are moved down a level, or into the lst if they are due in
+ * the current tick.  The lst then orders them exactly, so timers
+ * still fire at the time they were scheduled for.
+ *
+ * Timers in the current tick, or which are too far in the future for
+ * the wheel, go directly into the lst.
+ */
+typedef struct {
+	uint64_t		tick;			//!< All timers up to and including this tick are in the lst.
+	uint64_t		num;			//!< Number of timers in the wheel.
+	uint64_t		occupied[FR_EVENT_WHEEL_LEVELS];	//!< Bitmap of non-empty slots.
+	fr_dlist_head_t		slots[FR_EVENT_WHEEL_LEVELS][FR_EVENT_WHEEL_SLOTS];
+} fr_event_wheel_t;
+
 /** Stores all information relating to an event list
  *
  */
 struct fr_event_list {
 	fr_lst_t		*times;			//!< of timer events to be executed.
+	fr_event_wheel_t	*wheel;			//!< of timer events which are not yet due.  May be NULL.
 	fr_rb_tree_t		*fds;			//!< Tree used to track FDs with filters in kqueue.
 
 	int			will_exit;		//!< Will exit on next call to fr_event_corral.
@@ -433,6 +485,18 @@ struct fr_event_list {
 
 	struct kevent		events[FR_EV_BATCH_FDS]; /* so it doesn't go on the stack every time */
 
+	struct kevent		changes[FR_EV_BATCH_FDS]; //!< Filter updates which haven't been submitted
+							///< to the kqueue yet.  They're submitted with
+							///< the next call to kevent() in #fr_event_corral.
+	int			num_changes;		//!< Number of pending filter updates.
+
+#ifdef WITH_EVENT_EPOLL
+	int			epfd;			//!< epoll set for sockets and pipes.  Also contains the kqueue.
+
+	struct epoll_event	epoll_events[FR_EV_BATCH_FDS];	//!< Events returned by epoll_wait().
+	int			num_epoll_events;	//!< Number of entries in epoll_events.
+#endif
+
 	bool			in_handler;		//!< Deletes should be deferred until after the
 							///< handlers complete.
 
@@ -607,7 +671,7 @@ uint64_t fr_event_list_num_timers(fr_event_list_t *el)
 {
 	if (unlikely(!el)) return -1;
 
-	return fr_lst_num_elements(el->times);
+	return fr_lst_num_elements(el->times) + (el->wheel ? el->wheel->num : 0);
 }
 
 /** Return the kq associated with an event list.
@@ -790,6 +854,99 @@ static ssize_t fr_event_build_evset(
 	return out - out_kev;
 }
 
+/** Submit any deferred filter updates to the kqueue
+ *
+ * Filter updates are normally submitted in the same kevent() call which
+ * waits for events.  But changes to a file descriptor must be submitted
+ * in order, so this function is called before any synchronous changes are
+ * made to a file descriptor's filters.
+ *
+ * EV_RECEIPT means that we get a result for each change, and that
+ * no pending events are drained from the kqueue.
+ *
+ * @param[in] el	to submit the updates for.
+ */
+static void event_changes_flush(fr_event_list_t *el)
+{
+	struct kevent	receipts[64];
+	int		i, done = 0;
+
+	while (done < el->num_changes) {
+		int count = el->num_changes - done;
+		int ret;
+
+		if (count > (int)NUM_ELEMENTS(receipts)) count = NUM_ELEMENTS(receipts);
+
+		for (i = 0; i < count; i++) el->changes[done + i].flags |= EV_RECEIPT;
+
+		ret = kevent(el->kq, el->changes + done, count, receipts, count, &(struct timespec){});
+		if (!fr_cond_assert_msg(ret >= 0, "Failed submitting filter updates: %s", fr_syserror(errno))) break;
+
+		for (i = 0; i < ret; i++) {
+			if (!(receipts[i].flags & EV_ERROR) || (receipts[i].data == 0)) continue;
+
+			(void) fr_cond_assert_msg(0, "Failed updating filters for FD %i: %s",
+						  (int)receipts[i].ident, fr_syserror((int)receipts[i].data));
+		}
+
+		done += count;
+	}
+
+	el->num_changes = 0;
+}
+
+#ifdef WITH_EVENT_EPOLL
+/** Make an FD's registration in the epoll set match its active I/O callbacks
+ *
+ * @param[in] el	the FD is registered with.
+ * @param[in] ef	to update.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, with errno set.
+ */
+static int event_epoll_update(fr_event_list_t *el, fr_event_fd_t *ef)
+{
+	struct epoll_event	ev = { .data.ptr = ef };
+	int			op;
+
+	if (ef->active.io.read && (ef->active.io.read != fr_event_fd_noop)) ev.events |= EPOLLIN | EPOLLRDHUP;
+	if (ef->active.io.write && (ef->active.io.write != fr_event_fd_noop)) ev.events |= EPOLLOUT;
+
+	if (ev.events == ef->epoll_events) return 0;
+
+	/*
+	 *	Suspended FDs are removed from the set, as epoll
+	 *	always reports hangups and errors.
+	 */
+	if (!ev.events) {
+		op = EPOLL_CTL_DEL;
+	} else if (!ef->epoll_events) {
+		op = EPOLL_CTL_ADD;
+	} else {
+		op = EPOLL_CTL_MOD;
+	}
+
+	if (epoll_ctl(el->epfd, op, ef->fd, &ev) < 0) return -1;
+
+	ef->epoll_events = ev.events;
+
+	return 0;
+}
+
+/** Get the pending error for an FD
+ *
+ */
+static int event_epoll_fd_errno(int fd)
+{
+	int		fd_errno = 0;
+	socklen_t	len = sizeof(fd_errno);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &fd_errno, &len) < 0) return EPIPE;	/* e.g. a pipe */
+
+	return fd_errno;
+}
+#endif
+
 /** Discover the type of a file descriptor
  *
  * This function writes the result of the discovery to the ef->type,
@@ -874,6 +1031,31 @@ static int _event_fd_delete(fr_event_fd_t *ef)
 
 		fr_assert(ef->armour == 0);
 
+#ifdef WITH_EVENT_EPOLL
+		if (ef->epoll) {
+			if (ef->epoll_events) {
+				int ret;
+
+				ret = epoll_ctl(el->epfd, EPOLL_CTL_DEL, ef->fd, NULL);
+				if (!fr_cond_assert_msg(ret >= 0,
+							"FD %i was closed without being removed from the epoll set: %s",
+							ef->fd, fr_syserror(errno))) {
+					return -1;	/* Prevent the free, and leave the fd in the trees */
+				}
+				ef->epoll_events = 0;
+			}
+			goto unregister;
+		}
+#endif
+
+		/*
+		 *	The kqueue has to see any deferred updates
+		 *	before the filters are deleted.  Otherwise an
+		 *	update could re-add a filter for an FD which
+		 *	has been closed.
+		 */
+		if (el->num_changes) event_changes_flush(el);
+
 		/*
 		 *	If this fails, it's a pretty catastrophic error.
 		 */
@@ -893,6 +1075,9 @@ static int _event_fd_delete(fr_event_fd_t *ef)
 			}
 		}
 
+#ifdef WITH_EVENT_EPOLL
+	unregister:
+#endif
 		fr_rb_delete(el->fds, ef);
 		ef->is_registered = false;
 	}
@@ -974,6 +1159,13 @@ int _fr_event_fd_move(NDEBUG_LOCATION_ARGS
  *
  * This function trades producing useful errors for speed.
  *
+ * The changes are not submitted to the kqueue immediately.  Instead,
+ * they're batched with any other updates, and submitted with the next
+ * call to kevent() which waits for events.  Suspending and resuming
+ * filters therefore costs no system calls.  The callbacks are changed
+ * immediately, so a suspended callback will not be called, even if its
+ * event has already been received.
+ *
  * An example of suspending the read filter for an FD would be:
  @code {.c}
    static fr_event_update_t pause_read[] = {
@@ -1040,16 +1232,31 @@ int _fr_event_filter_update(NDEBUG_LOCATION_ARGS
 
 	count = fr_event_build_evset(el, evset, sizeof(evset)/sizeof(*evset), &ef->active,
 				     ef, &ef->active, &curr_active);
+#ifdef WITH_EVENT_EPOLL
+	/*
+	 *	epoll has no way of batching changes.
+	 */
+	if ((count >= 0) && ef->epoll && unlikely(event_epoll_update(el, ef) < 0)) {
+		fr_strerror_printf("Failed updating filters for FD %i: %s", ef->fd, fr_syserror(errno));
+		count = -1;
+	}
+#endif
+
 	if (unlikely(count < 0)) {
-	error:
 		memcpy(&ef->active, &curr_active, sizeof(curr_active));
 		memcpy(&ef->stored, &curr_stored, sizeof(curr_stored));
 		return -1;
 	}
 
-	if (count && unlikely(kevent(el->kq, evset, count, NULL, 0, NULL) < 0)) {
-		fr_strerror_printf("Failed updating filters for FD %i: %s", ef->fd, fr_syserror(errno));
-		goto error;
+#ifdef WITH_EVENT_EPOLL
+	if (ef->epoll) return 0;
+#endif
+
+	if (count) {
+		if ((size_t)(el->num_changes + count) > NUM_ELEMENTS(el->changes)) event_changes_flush(el);
+
+		memcpy(el->changes + el->num_changes, evset, count * sizeof(evset[0]));
+		el->num_changes += count;
 	}
 
 	return 0;
@@ -1154,6 +1361,24 @@ int _fr_event_filter_insert(NDEBUG_LOCATION_ARGS
 		count = fr_event_build_evset(el, evset, sizeof(evset)/sizeof(*evset),
 					     &ef->active, ef, funcs, &ef->active);
 		if (count < 0) goto free;
+
+#ifdef WITH_EVENT_EPOLL
+		/*
+		 *	epoll returns EPERM for regular files and
+		 *	directories.  Those stay in the kqueue.
+		 */
+		if (filter == FR_EVENT_FILTER_IO) {
+			if (event_epoll_update(el, ef) == 0) {
+				ef->epoll = true;
+				count = 0;
+
+			} else if (errno != EPERM) {
+				fr_strerror_printf("Failed inserting filters for FD %i: %s", fd, fr_syserror(errno));
+				goto free;
+			}
+		}
+#endif
+
 		if (count && (unlikely(kevent(el->kq, evset, count, NULL, 0, NULL) < 0))) {
 			fr_strerror_printf("Failed inserting filters for FD %i: %s", fd, fr_syserror(errno));
 			goto free;
@@ -1179,6 +1404,8 @@ int _fr_event_filter_insert(NDEBUG_LOCATION_ARGS
 
 		fr_assert((ef->armour == 0) || ef->active.io.read);
 
+		if (el->num_changes) event_changes_flush(el);
+
 		count = fr_event_build_evset(el, evset, sizeof(evset)/sizeof(*evset),
 					     &ef->active, ef, funcs, &ef->active);
 		if (count < 0) {
@@ -1186,6 +1413,17 @@ int _fr_event_filter_insert(NDEBUG_LOCATION_ARGS
 			memcpy(&ef->active, &active, sizeof(ef->active));
 			return -1;
 		}
+
+#ifdef WITH_EVENT_EPOLL
+		if (ef->epoll) {
+			if (unlikely(event_epoll_update(el, ef) < 0)) {
+				fr_strerror_printf("Failed modifying filters for FD %i: %s", fd, fr_syserror(errno));
+				goto error;
+			}
+			count = 0;
+		}
+#endif
+
 		if (count && (unlikely(kevent(el->kq, evset, count, NULL, 0, NULL) < 0))) {
 			fr_strerror_printf("Failed modifying filters for FD %i: %s", fd, fr_syserror(errno));
 			goto error;
@@ -1379,6 +1617,200 @@ int fr_event_fd_unarmour(fr_event_list_t *el, int fd, fr_event_filter_t filter,
 }
 #endif
 
+/** Convert a time to a timer wheel tick
+ *
+ */
+static inline uint64_t event_wheel_tick(fr_time_t when)
+{
+	int64_t ns = fr_time_unwrap(when);
+
+	if (ns <= 0) return 0;
+
+	return ((uint64_t) ns) >> FR_EVENT_WHEEL_TICK_SHIFT;
+}
+
+/** Park a timer event in the timer wheel
+ *
+ * @param[in] wheel	to insert the event into.
+ * @param[in] ev	to insert.
+ * @return
+ *	- true if the event was inserted.
+ *	- false if the event is due in the current tick, or is too far
+ *	  in the future, and should be inserted into the lst.
+ */
+static bool event_wheel_insert(fr_event_wheel_t *wheel, fr_event_timer_t *ev)
+{
+	uint64_t	tick = event_wheel_tick(ev->when);
+	unsigned int	level, slot;
+
+	if (tick <= wheel->tick) return false;
+
+	/*
+	 *	Find the lowest level where the event is in the same
+	 *	block of slots as the current tick.
+	 */
+	level = (fr_high_bit_pos(tick ^ wheel->tick) - 1) / FR_EVENT_WHEEL_SLOT_BITS;
+	if (level >= FR_EVENT_WHEEL_LEVELS) return false;
+
+	slot = (tick >> (level * FR_EVENT_WHEEL_SLOT_BITS)) & (FR_EVENT_WHEEL_SLOTS - 1);
+
+	ev->wheel_slot = &wheel->slots[level][slot];
+	fr_dlist_insert_tail(ev->wheel_slot, ev);
+	wheel->occupied[level] |= ((uint64_t) 1) << slot;
+	wheel->num++;
+
+	return true;
+}
+
+/** Remove a timer event from the timer wheel
+ *
+ */
+static void event_wheel_extract(fr_event_wheel_t *wheel, fr_event_timer_t *ev)
+{
+	fr_dlist_head_t *head = ev->wheel_slot;
+
+	(void) fr_dlist_remove(head, ev);
+	ev->wheel_slot = NULL;
+	wheel->num--;
+
+	if (fr_dlist_empty(head)) {
+		size_t i = head - &wheel->slots[0][0];
+
+		wheel->occupied[i / FR_EVENT_WHEEL_SLOTS] &= ~(((uint64_t) 1) << (i % FR_EVENT_WHEEL_SLOTS));
+	}
+}
+
+/** Find the next tick at which a slot of the timer wheel is due
+ *
+ * Every slot at a given level is after the slot for the current tick,
+ * and in the same block as the current tick, so the first occupied slot
+ * at the lowest occupied level is the next one due.
+ *
+ * @param[in] wheel	to search.
+ * @param[out] level_p	the level of the slot.
+ * @return the tick at which the slot is due, or UINT64_MAX if the wheel is empty.
+ */
+static uint64_t event_wheel_next(fr_event_wheel_t *wheel, unsigned int *level_p)
+{
+	unsigned int level;
+
+	for (level = 0; level < FR_EVENT_WHEEL_LEVELS; level++) {
+		unsigned int	shift = level * FR_EVENT_WHEEL_SLOT_BITS;
+		unsigned int	pos = (wheel->tick >> shift) & (FR_EVENT_WHEEL_SLOTS - 1);
+		uint64_t	bits;
+
+		bits = wheel->occupied[level] & ~((((uint64_t) 2) << pos) - 1);
+		if (!bits) continue;
+
+		if (level_p) *level_p = level;
+
+		return ((wheel->tick >> (shift + FR_EVENT_WHEEL_SLOT_BITS)) << (shift + FR_EVENT_WHEEL_SLOT_BITS)) |
+			(((uint64_t) (fr_low_bit_pos(bits) - 1)) << shift);
+	}
+
+	return UINT64_MAX;
+}
+
+/** Insert a timer event into the timer wheel, or if that's not possible, the lst
+ *
+ */
+static inline int event_timer_insert(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (el->wheel && event_wheel_insert(el->wheel, ev)) return 0;
+
+	return fr_lst_insert(el->times, ev);
+}
+
+/** Advance the timer wheel, moving any timers which are now due into the lst
+ *
+ * @param[in] el	containing the timer wheel.
+ * @param[in] now	the current time.
+ */
+static void event_wheel_advance(fr_event_list_t *el, fr_time_t now)
+{
+	fr_event_wheel_t	*wheel = el->wheel;
+	uint64_t		target = event_wheel_tick(now);
+
+	while (wheel->tick < target) {
+		fr_dlist_head_t		*head;
+		fr_event_timer_t	*ev;
+		unsigned int		level;
+		uint64_t		next;
+
+		next = event_wheel_next(wheel, &level);
+		if (next > target) {
+			wheel->tick = target;
+			break;
+		}
+
+		/*
+		 *	Everything in the slot is now either due in
+		 *	this tick, or belongs in a lower level.
+		 */
+		wheel->tick = next;
+		head = &wheel->slots[level][(next >> (level * FR_EVENT_WHEEL_SLOT_BITS)) & (FR_EVENT_WHEEL_SLOTS - 1)];
+
+		while ((ev = fr_dlist_head(head)) != NULL) {
+			event_wheel_extract(wheel, ev);
+			if (unlikely(event_timer_insert(el, ev) < 0)) {
+				talloc_free(ev);
+				fr_assert_msg(0, "failed inserting lst event: %s", fr_strerror());	/* Die in debug builds */
+			}
+		}
+	}
+}
+
+/** Move all timers from the timer wheel into the lst
+ *
+ */
+static void event_wheel_flush(fr_event_list_t *el)
+{
+	fr_event_wheel_t	*wheel = el->wheel;
+	unsigned int		level, slot;
+
+	for (level = 0; level < FR_EVENT_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < FR_EVENT_WHEEL_SLOTS; slot++) {
+			fr_event_timer_t *ev;
+
+			while ((ev = fr_dlist_head(&wheel->slots[level][slot])) != NULL) {
+				event_wheel_extract(wheel, ev);
+				if (unlikely(fr_lst_insert(el->times, ev) < 0)) {
+					talloc_free(ev);
+					fr_assert_msg(0, "failed inserting lst event: %s", fr_strerror());
+				}
+			}
+		}
+	}
+}
+
+/** Return when the next timer event, or timer wheel slot, is due
+ *
+ * @param[in] el	to check.
+ * @param[out] when	the next timer event is due.
+ * @return
+ *	- true if there are timer events.
+ *	- false if there are no timer events.
+ */
+static bool event_timer_next(fr_event_list_t *el, fr_time_t *when)
+{
+	fr_event_timer_t	*ev = fr_lst_peek(el->times);
+	bool			found = false;
+
+	if (ev) {
+		*when = ev->when;
+		found = true;
+	}
+
+	if (el->wheel && el->wheel->num) {
+		fr_time_t slot = fr_time_wrap((int64_t) (event_wheel_next(el->wheel, NULL) << FR_EVENT_WHEEL_TICK_SHIFT));
+
+		if (!found || fr_time_lt(slot, *when)) *when = slot;
+		found = true;
+	}
+
+	return found;
+}
+
 /** Remove an event from the event loop
  *
  * @param[in] ev	to free.
@@ -1393,6 +1825,8 @@ static int _event_timer_free(fr_event_timer_t *ev)
 
 	if (fr_dlist_entry_in_list(&ev->entry)) {
 		(void) fr_dlist_remove(&el->ev_to_add, ev);
+	} else if (ev->wheel_slot) {
+		event_wheel_extract(el->wheel, ev);
 	} else {
 		int		ret = fr_lst_extract(el->times, ev);
 		char const	*err_file;
@@ -1511,8 +1945,13 @@ int _fr_event_timer_at(NDEBUG_LOCATION_ARGS
 		 *	Event may have fired, in which case the event
 		 *	will no longer be in the event loop, so check
 		 *	if it's in the lst before extracting it.
+		 *
+		 *	Re-arming an event in the timer wheel is cheap.
 		 */
-		if (!fr_dlist_entry_in_list(&ev->entry)) {
+		if (ev->wheel_slot) {
+			event_wheel_extract(el->wheel, ev);
+
+		} else if (!fr_dlist_entry_in_list(&ev->entry)) {
 			int		ret;
 			char const	*err_file;
 			int		err_line;
@@ -1555,7 +1994,7 @@ int _fr_event_timer_at(NDEBUG_LOCATION_ARGS
 		 *	multiple times.
 		 */
 		if (!fr_dlist_entry_in_list(&ev->entry)) fr_dlist_insert_head(&el->ev_to_add, ev);
-	} else if (unlikely(fr_lst_insert(el->times, ev) < 0)) {
+	} else if (unlikely(event_timer_insert(el, ev) < 0)) {
 		fr_strerror_const_push("Failed inserting event");
 		talloc_set_destructor(ev, NULL);
 		*ev_p = NULL;
@@ -2361,22 +2800,14 @@ int fr_event_timer_run(fr_event_list_t *el, fr_time_t *when)
 
 	if (unlikely(!el)) return 0;
 
-	if (fr_lst_num_elements(el->times) == 0) {
-		*when = fr_time_wrap(0);
-		return 0;
-	}
-
-	ev = fr_lst_peek(el->times);
-	if (!ev) {
-		*when = fr_time_wrap(0);
-		return 0;
-	}
+	if (el->wheel) event_wheel_advance(el, *when);
 
 	/*
 	 *	See if it's time to do this one.
 	 */
-	if (fr_time_gt(ev->when, *when)) {
-		*when = ev->when;
+	ev = fr_lst_peek(el->times);
+	if (!ev || fr_time_gt(ev->when, *when)) {
+		if (!event_timer_next(el, when)) *when = fr_time_wrap(0);
 		return 0;
 	}
 
@@ -2395,6 +2826,101 @@ int fr_event_timer_run(fr_event_list_t *el, fr_time_t *when)
 	return 1;
 }
 
+#ifdef WITH_EVENT_EPOLL
+/** Wait for events from the epoll set, and from the kqueue
+ *
+ * Sets el->num_fd_events to the number of kqueue events, and
+ * el->num_epoll_events to the number of epoll events.
+ *
+ * @param[in] el	to wait for events on.
+ * @param[in] ts_wake	how long to wait.  NULL means "forever".
+ * @return
+ *	- <0 on error, with errno set.  EINTR is not logged.
+ *	- the total number of events.
+ */
+static int event_epoll_wait(fr_event_list_t *el, struct timespec const *ts_wake)
+{
+	int	num_kq_events = 0, num_epoll_events, timeout, i, j;
+	bool	kq_ready = false;
+
+	el->num_fd_events = 0;
+	el->num_epoll_events = 0;
+
+	/*
+	 *	Submit any deferred kqueue updates.  This also
+	 *	returns any events which are already waiting.
+	 */
+	if (el->num_changes) {
+		num_kq_events = kevent(el->kq, el->changes, el->num_changes, el->events, FR_EV_BATCH_FDS,
+				       &(struct timespec){});
+		el->num_changes = 0;
+		if (unlikely(num_kq_events < 0)) {
+			if (errno == EINTR) return -1;
+		kq_error:
+			fr_strerror_printf("Failed calling kevent: %s", fr_syserror(errno));
+			return -1;
+		}
+		el->num_fd_events = num_kq_events;
+	}
+
+	/*
+	 *	epoll_wait() only has millisecond resolution.  Round
+	 *	up, so that we don't wake up just before the next
+	 *	timer, and spin.
+	 */
+	if ((num_kq_events > 0) || (ts_wake && !ts_wake->tv_sec && !ts_wake->tv_nsec)) {
+		timeout = 0;
+	} else if (!ts_wake) {
+		timeout = -1;
+	} else if (ts_wake->tv_sec >= (INT_MAX / 1000)) {
+		timeout = INT_MAX;
+	} else {
+		timeout = (ts_wake->tv_sec * 1000) + ((ts_wake->tv_nsec + 999999) / 1000000);
+	}
+
+	num_epoll_events = epoll_wait(el->epfd, el->epoll_events, FR_EV_BATCH_FDS, timeout);
+	if (unlikely(num_epoll_events < 0)) {
+		if (errno == EINTR) return num_kq_events ? num_kq_events : -1;
+
+		fr_strerror_printf("Failed calling epoll_wait: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	The kqueue is the only member of the set with a NULL
+	 *	pointer.  Remove it from the list of events, and read
+	 *	its events if it's readable.
+	 */
+	for (i = 0, j = 0; i < num_epoll_events; i++) {
+		if (!el->epoll_events[i].data.ptr) {
+			kq_ready = true;
+			continue;
+		}
+		if (i != j) el->epoll_events[j] = el->epoll_events[i];
+		j++;
+	}
+	el->num_epoll_events = j;
+
+	if (kq_ready && (num_kq_events < FR_EV_BATCH_FDS)) {
+		int ret;
+
+		ret = kevent(el->kq, NULL, 0, el->events + num_kq_events, FR_EV_BATCH_FDS - num_kq_events,
+			     &(struct timespec){});
+		if (unlikely(ret < 0)) {
+			if (errno != EINTR) goto kq_error;
+			ret = 0;
+		}
+		num_kq_events += ret;
+	}
+	el->num_fd_events = num_kq_events;
+
+	EVENT_DEBUG("%p - %s - epoll returned %u FD events, and kevent returned %u events",
+		    el, __FUNCTION__, el->num_epoll_events, el->num_fd_events);
+
+	return el->num_fd_events + el->num_epoll_events;
+}
+#endif
+
 /** Gather outstanding timer and file descriptor events
  *
  * @param[in] el	to process events for.
@@ -2411,7 +2937,7 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	fr_event_pre_t		*pre;
 	int			num_fd_events;
 	bool			timer_event_ready = false;
-	fr_event_timer_t	*ev;
+	fr_time_t		next;
 
 	el->num_fd_events = 0;
 
@@ -2430,18 +2956,23 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	wake = &when;
 	el->now = now;
 
+	if (el->wheel) event_wheel_advance(el, now);
+
 	/*
 	 *	See when we have to wake up.  Either now, if the timer
 	 *	events are in the past.  Or, we wait for a future
 	 *	timer event.
+	 *
+	 *	If the next thing due is a slot in the timer wheel,
+	 *	we wake up when the slot is due, and move its timers
+	 *	into the lst.
 	 */
-	ev = fr_lst_peek(el->times);
-	if (ev) {
-		if (fr_time_lteq(ev->when, el->now)) {
+	if (event_timer_next(el, &next)) {
+		if (fr_time_lteq(next, el->now)) {
 			timer_event_ready = true;
 
 		} else if (wait) {
-			when = fr_time_sub(ev->when, el->now);
+			when = fr_time_sub(next, el->now);
 
 		} /* else we're not waiting, leave "when == 0" */
 
@@ -2488,8 +3019,17 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	 *	Populate el->events with the list of I/O events
 	 *	that occurred since this function was last called
 	 *	or wait for the next timer event.
+	 *
+	 *	Deferred filter updates are submitted in the same
+	 *	call.  If any of them fail, the error is returned
+	 *	as an EV_ERROR event for the FD.
 	 */
-	num_fd_events = kevent(el->kq, NULL, 0, el->events, FR_EV_BATCH_FDS, ts_wake);
+#ifdef WITH_EVENT_EPOLL
+	num_fd_events = event_epoll_wait(el, ts_wake);
+	if (unlikely(num_fd_events < 0)) return (errno == EINTR) ? 0 : -1;
+#else
+	num_fd_events = kevent(el->kq, el->changes, el->num_changes, el->events, FR_EV_BATCH_FDS, ts_wake);
+	el->num_changes = 0;
 
 	/*
 	 *	Interrupt is different from timeout / FD events.
@@ -2504,6 +3044,7 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	}
 
 	el->num_fd_events = num_fd_events;
+#endif
 
 	EVENT_DEBUG("%p - %s - kevent returned %u FD events", el, __FUNCTION__, el->num_fd_events);
 
@@ -2654,6 +3195,62 @@ void fr_event_service(fr_event_list_t *el)
 		}
 	}
 
+#ifdef WITH_EVENT_EPOLL
+	/*
+	 *	Run the events for sockets and pipes.  These behave
+	 *	the same as the kqueue events above.  In particular,
+	 *	EOF is passed to the callbacks as EV_EOF.
+	 */
+	for (i = 0; i < el->num_epoll_events; i++) {
+		fr_event_fd_t		*ef = talloc_get_type_abort(el->epoll_events[i].data.ptr, fr_event_fd_t);
+		uint32_t		events = el->epoll_events[i].events;
+		int			flags, fd_errno;
+
+		if (!ef->is_registered) continue;	/* Was deleted between corral and service */
+
+		if (unlikely(events & EPOLLERR)) {
+			flags = EV_ERROR;
+			fd_errno = event_epoll_fd_errno(ef->fd);
+			goto epoll_error;
+		}
+
+		if (events & (EPOLLHUP | EPOLLRDHUP)) {
+			int pending = 0;
+
+			/*
+			 *	The other end of a pipe has gone away.
+			 *	As with files, the read callback is told
+			 *	via the flags, and decides what to do.
+			 */
+			if ((ef->type == FR_EVENT_FD_FILE) && (ef->epoll_events & EPOLLIN)) {
+				ef->active.io.read(el, ef->fd, EV_EOF, ef->uctx);
+				continue;
+			}
+
+			/*
+			 *	The read side of the socket has been
+			 *	closed, but there may still be pending
+			 *	data.  Dispatch the read event and then
+			 *	error.
+			 */
+			if ((events & EPOLLIN) && (ioctl(ef->fd, FIONREAD, &pending) == 0) && (pending > 0)) {
+				ef->active.io.read(el, ef->fd, EV_EOF, ef->uctx);
+			}
+
+			flags = EV_EOF;
+			fd_errno = event_epoll_fd_errno(ef->fd);
+
+		epoll_error:
+			if (ef->is_registered && ef->error) ef->error(el, ef->fd, flags, fd_errno, ef->uctx);
+			TALLOC_FREE(ef);
+			continue;
+		}
+
+		if (events & EPOLLIN) ef->active.io.read(el, ef->fd, 0, ef->uctx);
+		if ((events & EPOLLOUT) && ef->is_registered) ef->active.io.write(el, ef->fd, 0, ef->uctx);
+	}
+#endif
+
 	/*
 	 *	Process any deferred frees performed
 	 *	by the I/O handlers.
@@ -2684,7 +3281,7 @@ void fr_event_service(fr_event_list_t *el)
 	 *	Run all of the timer events.  Note that these can add
 	 *	new timers!
 	 */
-	if (fr_lst_num_elements(el->times) > 0) {
+	if (fr_event_list_num_timers(el) > 0) {
 		el->in_handler = true;
 
 		do {
@@ -2710,7 +3307,7 @@ void fr_event_service(fr_event_list_t *el)
 	 */
 	while ((ev = fr_dlist_head(&el->ev_to_add)) != NULL) {
 		(void)fr_dlist_remove(&el->ev_to_add, ev);
-		if (unlikely(fr_lst_insert(el->times, ev) < 0)) {
+		if (unlikely(event_timer_insert(el, ev) < 0)) {
 			talloc_free(ev);
 			fr_assert_msg(0, "failed inserting lst event: %s", fr_strerror());	/* Die in debug builds */
 		}
@@ -2788,12 +3385,16 @@ static int _event_list_free(fr_event_list_t *el)
 {
 	fr_event_timer_t const *ev;
 
+	if (el->wheel) event_wheel_flush(el);
 	while ((ev = fr_lst_peek(el->times)) != NULL) fr_event_timer_delete(&ev);
 
 	fr_event_list_reap_signal(el, fr_time_delta_wrap(0), SIGKILL);
 
 	talloc_free_children(el);
 
+#ifdef WITH_EVENT_EPOLL
+	if (el->epfd >= 0) close(el->epfd);
+#endif
 	if (el->kq >= 0) close(el->kq);
 
 	return 0;
@@ -2911,6 +3512,9 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 	}
 	el->time = fr_time;
 	el->kq = -1;	/* So destructor can be used before kqueue() provides us with fd */
+#ifdef WITH_EVENT_EPOLL
+	el->epfd = -1;
+#endif
 	talloc_set_destructor(el, _event_list_free);
 
 	el->times = fr_lst_talloc_alloc(el, fr_event_timer_cmp, fr_event_timer_t, lst_id, 0);
@@ -2933,6 +3537,23 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 		goto error;
 	}
 
+#ifdef WITH_EVENT_EPOLL
+	el->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (el->epfd < 0) {
+		fr_strerror_printf("Failed allocating epoll set: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	/*
+	 *	The kqueue is readable when it has events.  It's
+	 *	identified by a NULL pointer.
+	 */
+	if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, el->kq, &(struct epoll_event){ .events = EPOLLIN }) < 0) {
+		fr_strerror_printf("Failed adding kqueue to epoll set: %s", fr_syserror(errno));
+		goto error;
+	}
+#endif
+
 	fr_dlist_talloc_init(&el->pre_callbacks, fr_event_pre_t, entry);
 	fr_dlist_talloc_init(&el->post_callbacks, fr_event_post_t, entry);
 	fr_dlist_talloc_init(&el->ev_to_add, fr_event_timer_t, entry);
@@ -2964,6 +3585,60 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 void fr_event_list_set_time_func(fr_event_list_t *el, fr_event_time_source_t func)
 {
 	el->time = func;
+
+	/*
+	 *	The timer wheel is relative to the old time source.
+	 */
+	if (el->wheel) {
+		event_wheel_flush(el);
+		el->wheel->tick = event_wheel_tick(el->time());
+	}
+}
+
+/** Enable or disable the timer wheel for an event list
+ *
+ * With the timer wheel enabled, inserting and deleting timers which
+ * are not yet due is O(1), instead of O(log n).  This helps when
+ * there are many timers, and most of them are deleted or re-armed
+ * before they fire.  Timers still fire at the time they were
+ * scheduled for.
+ *
+ * @param[in] el	to enable the timer wheel for.
+ * @param[in] enable	the timer wheel, or disable it.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_event_list_set_timer_wheel(fr_event_list_t *el, bool enable)
+{
+	fr_event_wheel_t	*wheel;
+	unsigned int		level, slot;
+
+	if (!enable) {
+		if (!el->wheel) return 0;
+
+		event_wheel_flush(el);
+		TALLOC_FREE(el->wheel);
+		return 0;
+	}
+
+	if (el->wheel) return 0;
+
+	wheel = talloc_zero(el, fr_event_wheel_t);
+	if (!wheel) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	for (level = 0; level < FR_EVENT_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < FR_EVENT_WHEEL_SLOTS; slot++) {
+			fr_dlist_init(&wheel->slots[level][slot], fr_event_timer_t, wheel_entry);
+		}
+	}
+	wheel->tick = event_wheel_tick(el->time());
+	el->wheel = wheel;
+
+	return 0;
 }
 
 /** Return whether the event loop has any active events
@@ -2971,7 +3646,7 @@ void fr_event_list_set_time_func(fr_event_list_t *el, fr_event_time_source_t fun
  */
 bool fr_event_list_empty(fr_event_list_t *el)
 {
-	return !fr_lst_num_elements(el->times) && !fr_rb_num_elements(el->fds);
+	return !fr_event_list_num_timers(el) && !fr_rb_num_elements(el->fds);
 }
 
 #ifdef WITH_EVENT_DEBUG
@@ -3011,6 +3686,42 @@ static int8_t event_timer_location_cmp(void const *one, void const *two)
 }
 
 
+/** Add a timer event to the report statistics
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on out of memory.
+ */
+static int event_report_timer(fr_rb_tree_t **locations, size_t *array, fr_event_timer_t const *ev, fr_time_t now)
+{
+	fr_time_delta_t diff = fr_time_sub(ev->when, now);
+	size_t		i;
+
+	for (i = 0; i < NUM_ELEMENTS(decades); i++) {
+		if ((fr_time_delta_cmp(diff, decades[i]) <= 0) || (i == NUM_ELEMENTS(decades) - 1)) {
+			fr_event_counter_t find = { .file = ev->file, .line = ev->line };
+			fr_event_counter_t *counter;
+
+			counter = fr_rb_find(locations[i], &find);
+			if (!counter) {
+				counter = talloc(locations[i], fr_event_counter_t);
+				if (!counter) return -1;
+				counter->file = ev->file;
+				counter->line = ev->line;
+				counter->count = 1;
+				fr_rb_insert(locations[i], counter);
+			} else {
+				counter->count++;
+			}
+
+			array[i]++;
+			break;
+		}
+	}
+
+	return 0;
+}
+
 /** Print out information about the number of events in the event loop
  *
  */
@@ -3045,27 +3756,17 @@ void fr_event_report(fr_event_list_t *el, fr_time_t now, void *uctx)
 	for (ev = fr_lst_iter_init(el->times, &iter);
 	     ev != NULL;
 	     ev = fr_lst_iter_next(el->times, &iter)) {
-		fr_time_delta_t diff = fr_time_sub(ev->when, now);
-
-		for (i = 0; i < NUM_ELEMENTS(decades); i++) {
-			if ((fr_time_delta_cmp(diff, decades[i]) <= 0) || (i == NUM_ELEMENTS(decades) - 1)) {
-				fr_event_counter_t find = { .file = ev->file, .line = ev->line };
-				fr_event_counter_t *counter;
-
-				counter = fr_rb_find(locations[i], &find);
-				if (!counter) {
-					counter = talloc(locations[i], fr_event_counter_t);
-					if (!counter) goto oom;
-					counter->file = ev->file;
-					counter->line = ev->line;
-					counter->count = 1;
-					fr_rb_insert(locations[i], counter);
-				} else {
-					counter->count++;
-				}
+		if (event_report_timer(locations, array, ev, now) < 0) goto oom;
+	}
 
-				array[i]++;
-				break;
+	if (el->wheel) {
+		fr_dlist_head_t *head;
+
+		for (head = &el->wheel->slots[0][0];
+		     head < &el->wheel->slots[FR_EVENT_WHEEL_LEVELS - 1][FR_EVENT_WHEEL_SLOTS - 1] + 1;
+		     head++) {
+			fr_dlist_foreach(head, fr_event_timer_t const, wev) {
+				if (event_report_timer(locations, array, wev, now) < 0) goto oom;
 			}
 		}
 	}
@@ -3124,6 +3825,19 @@ void fr_event_timer_dump(fr_event_list_t *el)
 			    ev->file, ev->line, ev, fr_time_unwrap(ev->when),
 			    fr_time_gt(now, ev->when) ? '<' : '>', ev->callback);
 	}
+
+	if (el->wheel) {
+		fr_dlist_head_t *head;
+
+		for (head = &el->wheel->slots[0][0];
+		     head < &el->wheel->slots[FR_EVENT_WHEEL_LEVELS - 1][FR_EVENT_WHEEL_SLOTS - 1] + 1;
+		     head++) {
+			fr_dlist_foreach(head, fr_event_timer_t, wev) {
+				EVENT_DEBUG("%s[%u]: %p time=%" PRId64 " (wheel), callback=%p",
+					    wev->file, wev->line, wev, fr_time_unwrap(wev->when), wev->callback);
+			}
+		}
+	}
 }
 #endif
 #endif
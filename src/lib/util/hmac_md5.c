@@ -181,3 +181,78 @@ int fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t inl
 	return 0;
 }
 #endif /* HAVE_OPENSSL_EVP_H */
+
+/** Calculate HMACs of multiple messages in parallel
+ *
+ * Uses fr_md5_calc_multi() for both the inner and outer hashes, so
+ * MD5_MULTI_LANES HMACs are calculated for not much more than the
+ * cost of one.  Each message can use a different key.
+ *
+ * @param[out] digest	Where to write the HMACs, one per input.
+ * @param[in] in	Messages and keys.
+ * @param[in] num	Number of messages.
+ * @return
+ *	- 0 on success.
+ *      - -1 on error.
+ */
+int fr_hmac_md5_multi(uint8_t digest[][MD5_DIGEST_LENGTH], fr_hmac_md5_multi_t const *in, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i += MD5_MULTI_LANES) {
+		fr_md5_multi_t	md[MD5_MULTI_LANES];
+		uint8_t		k_ipad[MD5_MULTI_LANES][MD5_BLOCK_LENGTH];
+		uint8_t		k_opad[MD5_MULTI_LANES][MD5_BLOCK_LENGTH];
+		uint8_t		tk[MD5_MULTI_LANES][MD5_DIGEST_LENGTH];
+		uint8_t		inner[MD5_MULTI_LANES][MD5_DIGEST_LENGTH];
+		size_t		j, l, lanes = ((num - i) < MD5_MULTI_LANES) ? (num - i) : MD5_MULTI_LANES;
+
+		for (l = 0; l < lanes; l++) {
+			uint8_t const	*key = in[i + l].key;
+			size_t		key_len = in[i + l].key_len;
+
+			/* if key is longer than 64 bytes reset it to key=MD5(key) */
+			if (key_len > MD5_BLOCK_LENGTH) {
+				fr_md5_calc(tk[l], key, key_len);
+				key = tk[l];
+				key_len = MD5_DIGEST_LENGTH;
+			}
+
+			memset(k_ipad[l], 0, sizeof(k_ipad[l]));
+			if (key_len) memcpy(k_ipad[l], key, key_len);
+			memcpy(k_opad[l], k_ipad[l], sizeof(k_opad[l]));
+
+			for (j = 0; j < MD5_BLOCK_LENGTH; j++) {
+				k_ipad[l][j] ^= 0x36;
+				k_opad[l][j] ^= 0x5c;
+			}
+
+			md[l] = (fr_md5_multi_t) {
+				.prefix = k_ipad[l],
+				.prefix_len = MD5_BLOCK_LENGTH,
+				.in = in[i + l].in,
+				.inlen = in[i + l].inlen
+			};
+		}
+
+		/*
+		 *	MD5(K XOR ipad, in)
+		 */
+		fr_md5_calc_multi(inner, md, lanes);
+
+		/*
+		 *	MD5(K XOR opad, MD5(K XOR ipad, in))
+		 */
+		for (l = 0; l < lanes; l++) {
+			md[l] = (fr_md5_multi_t) {
+				.prefix = k_opad[l],
+				.prefix_len = MD5_BLOCK_LENGTH,
+				.in = inner[l],
+				.inlen = MD5_DIGEST_LENGTH
+			};
+		}
+		fr_md5_calc_multi(digest + i, md, lanes);
+	}
+
+	return 0;
+}
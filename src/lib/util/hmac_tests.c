@@ -23,9 +23,14 @@
 
 #include <freeradius-devel/util/acutest.h>
 #include <freeradius-devel/util/acutest_helpers.h>
+#include <freeradius-devel/util/md4.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/sha1.h>
 
+#ifdef HAVE_OPENSSL_EVP_H
+#  include <openssl/provider.h>
+#endif
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
@@ -129,6 +134,65 @@ static void test_hmac_md5(void)
 			      sizeof(digest)), 0);
 }
 
+/*
+ *	The parallel versions must give the same results as the
+ *	serial ones, for any mix of message and key lengths.
+ */
+static void test_hmac_md5_multi(void)
+{
+	uint8_t			data[300];
+	uint8_t			key[100];
+	uint8_t			digest[7][MD5_DIGEST_LENGTH];
+	uint8_t			expected[MD5_DIGEST_LENGTH];
+	fr_hmac_md5_multi_t	hmac[7];
+	fr_md5_multi_t		md5[7];
+	size_t			i, len;
+
+	for (i = 0; i < sizeof(data); i++) data[i] = i * 7;
+	for (i = 0; i < sizeof(key); i++) key[i] = i * 13;
+
+	for (len = 0; len < 200; len++) {
+		for (i = 0; i < NUM_ELEMENTS(hmac); i++) {
+			hmac[i] = (fr_hmac_md5_multi_t) {
+				.in = data + i,
+				.inlen = len + (i * 11),
+				.key = key,
+				.key_len = ((len + (i * 23)) % (sizeof(key) - 1)) + 1
+			};
+			md5[i] = (fr_md5_multi_t) {
+				.prefix = key,
+				.prefix_len = i * 9,
+				.in = data + i,
+				.inlen = len + (i * 11),
+				.suffix = key + 1,
+				.suffix_len = (len * i) % 40
+			};
+		}
+
+		fr_hmac_md5_multi(digest, hmac, NUM_ELEMENTS(hmac));
+		for (i = 0; i < NUM_ELEMENTS(hmac); i++) {
+			fr_hmac_md5(expected, hmac[i].in, hmac[i].inlen, hmac[i].key, hmac[i].key_len);
+			TEST_CHECK(memcmp(digest[i], expected, sizeof(expected)) == 0);
+			TEST_MSG("hmac-md5 mismatch for message %zu of length %zu", i, hmac[i].inlen);
+		}
+
+		fr_md5_calc_multi(digest, md5, NUM_ELEMENTS(md5));
+		for (i = 0; i < NUM_ELEMENTS(md5); i++) {
+			fr_md5_ctx_t *ctx;
+
+			ctx = fr_md5_ctx_alloc_from_list();
+			fr_md5_update(ctx, md5[i].prefix, md5[i].prefix_len);
+			fr_md5_update(ctx, md5[i].in, md5[i].inlen);
+			fr_md5_update(ctx, md5[i].suffix, md5[i].suffix_len);
+			fr_md5_final(expected, ctx);
+			fr_md5_ctx_free_from_list(&ctx);
+
+			TEST_CHECK(memcmp(digest[i], expected, sizeof(expected)) == 0);
+			TEST_MSG("md5 mismatch for message %zu of length %zu", i, md5[i].inlen);
+		}
+	}
+}
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
@@ -205,12 +269,73 @@ static void test_hmac_sha1(void)
 			      sizeof(digest)), 0);
 }
 
+/*
+ *	As with MD5, the parallel MD4 and SHA1 functions must match
+ *	the serial ones, including across block boundaries.
+ */
+static void test_md4_sha1_multi(void)
+{
+	uint8_t			data[300];
+	uint8_t			md4_digest[7][MD4_DIGEST_LENGTH];
+	uint8_t			sha1_digest[7][SHA1_DIGEST_LENGTH];
+	uint8_t			md4_expected[MD4_DIGEST_LENGTH];
+	uint8_t			sha1_expected[SHA1_DIGEST_LENGTH];
+	fr_md4_multi_t		md4[7];
+	fr_sha1_multi_t		sha1[7];
+	size_t			i, len;
+#ifdef HAVE_OPENSSL_EVP_H
+	OSSL_PROVIDER		*default_provider, *legacy_provider;
+
+	/*
+	 *	The serial MD4 functions use OpenSSL, which only
+	 *	provides MD4 in its legacy provider.
+	 */
+	default_provider = OSSL_PROVIDER_load(NULL, "default");
+	legacy_provider = OSSL_PROVIDER_load(NULL, "legacy");
+	TEST_ASSERT(default_provider != NULL);
+	TEST_ASSERT(legacy_provider != NULL);
+#endif
+
+	for (i = 0; i < sizeof(data); i++) data[i] = i * 7;
+
+	for (len = 0; len < 200; len++) {
+		for (i = 0; i < NUM_ELEMENTS(md4); i++) {
+			md4[i] = (fr_md4_multi_t) { .in = data + i, .inlen = len + (i * 11) };
+			sha1[i] = (fr_sha1_multi_t) { .in = data + i, .inlen = len + (i * 11) };
+		}
+
+		fr_md4_calc_multi(md4_digest, md4, NUM_ELEMENTS(md4));
+		fr_sha1_calc_multi(sha1_digest, sha1, NUM_ELEMENTS(sha1));
+
+		for (i = 0; i < NUM_ELEMENTS(md4); i++) {
+			fr_sha1_ctx ctx;
+
+			fr_md4_calc(md4_expected, md4[i].in, md4[i].inlen);
+			TEST_CHECK(memcmp(md4_digest[i], md4_expected, sizeof(md4_expected)) == 0);
+			TEST_MSG("md4 mismatch for message %zu of length %zu", i, md4[i].inlen);
+
+			fr_sha1_init(&ctx);
+			fr_sha1_update(&ctx, sha1[i].in, sha1[i].inlen);
+			fr_sha1_final(sha1_expected, &ctx);
+			TEST_CHECK(memcmp(sha1_digest[i], sha1_expected, sizeof(sha1_expected)) == 0);
+			TEST_MSG("sha1 mismatch for message %zu of length %zu", i, sha1[i].inlen);
+		}
+	}
+
+#ifdef HAVE_OPENSSL_EVP_H
+	OSSL_PROVIDER_unload(legacy_provider);
+	OSSL_PROVIDER_unload(default_provider);
+#endif
+}
+
 TEST_LIST = {
 	/*
 	 *	Allocation and management
 	 */
 	{ "hmac-md5",			test_hmac_md5	},
+	{ "hmac-md5-multi",		test_hmac_md5_multi	},
 	{ "hmac-sha1",			test_hmac_sha1	},
+	{ "md4-sha1-multi",		test_md4_sha1_multi	},
 
 	{ NULL }
 };
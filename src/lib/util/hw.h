@@ -30,6 +30,18 @@ extern "C" {
 #include <stddef.h>
 #include <stdint.h>
 
+/** Build copies of a function for newer x86 vector extensions
+ *
+ * The dynamic linker picks the best one for the CPU when the library
+ * is loaded.  Only useful for loops written so that the compiler can
+ * vectorise them.
+ */
+#if defined(__x86_64__) && defined(__gnu_linux__) && !defined(__clang__) && __GNUC_PREREQ__(11, 0)
+#  define FR_HW_TARGET_CLONES CC_HINT(target_clones("arch=x86-64-v4", "avx2", "default"))
+#else
+#  define FR_HW_TARGET_CLONES
+#endif
+
 size_t		fr_hw_cache_line_size(void);
 
 uint32_t	fr_hw_num_cores_active(void);
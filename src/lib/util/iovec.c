@@ -142,3 +142,89 @@ ssize_t fr_writev(int fd, struct iovec vector[], int iovcnt, fr_time_delta_t tim
 
 	return total;
 }
+
+/** Count the leaf boxes in a list, descending into groups
+ *
+ */
+static size_t iovec_value_box_list_count(fr_value_box_list_t const *list)
+{
+	size_t count = 0;
+
+	fr_value_box_list_foreach(list, vb) {
+		if (fr_type_is_group(vb->type)) {
+			count += iovec_value_box_list_count(&vb->vb_group);
+			continue;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+/** Point vector entries at the buffers of the leaf boxes in a list
+ *
+ */
+static struct iovec *iovec_value_box_list_fill(struct iovec *vector_p, fr_value_box_list_t *list)
+{
+	fr_value_box_list_foreach(list, vb) {
+		switch (vb->type) {
+		case FR_TYPE_GROUP:
+			vector_p = iovec_value_box_list_fill(vector_p, &vb->vb_group);
+			if (!vector_p) return NULL;
+			continue;
+
+		case FR_TYPE_NULL:
+			continue;
+
+		case FR_TYPE_STRING:
+		case FR_TYPE_OCTETS:
+			break;
+
+		default:
+			if (unlikely(fr_value_box_cast_in_place(vb, vb, FR_TYPE_STRING, vb->enumv) < 0)) return NULL;
+			break;
+		}
+
+		vector_p->iov_base = UNCONST(void *, vb->datum.ptr);
+		vector_p->iov_len = vb->vb_length;
+		vector_p++;
+	}
+
+	return vector_p;
+}
+
+/** Build a vector referencing the buffers of a list of value boxes
+ *
+ * The buffers of string and octets boxes are referenced, not copied.
+ * Boxes of other types are cast to strings in place first.  Groups are
+ * descended into, and null boxes are skipped, so the vector has the same
+ * contents as the list would if it were concatenated.
+ *
+ * @param[in] ctx	to allocate the vector in.
+ * @param[out] out	Where to write the vector.  It's only valid for as long
+ *			as the boxes in the list are.
+ * @param[in] list	of boxes.
+ * @return
+ *	- Number of elements in the vector.
+ *	- -1 on failure.
+ */
+ssize_t fr_iovec_afrom_value_box_list(TALLOC_CTX *ctx, struct iovec **out, fr_value_box_list_t *list)
+{
+	struct iovec	*vector, *vector_p;
+
+	vector = talloc_array(ctx, struct iovec, iovec_value_box_list_count(list));
+	if (unlikely(!vector)) {
+		fr_strerror_const("Failed allocating vector");
+		return -1;
+	}
+
+	vector_p = iovec_value_box_list_fill(vector, list);
+	if (unlikely(!vector_p)) {
+		talloc_free(vector);
+		return -1;
+	}
+
+	*out = vector;
+
+	return vector_p - vector;
+}
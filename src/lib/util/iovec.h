@@ -26,6 +26,7 @@ RCSIDH(iovec_h, "$Id$")
 
 #include <freeradius-devel/util/dbuff.h>
 #include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/value.h>
 #include <unistd.h>
 #include <sys/uio.h>
 
@@ -36,6 +37,9 @@ extern "C" {
 fr_slen_t	fr_concatv(fr_dbuff_t *out, struct iovec vector[], int iovcnt);
 ssize_t		fr_writev(int fd, struct iovec vector[], int iovcnt, fr_time_delta_t timeout);
 
+ssize_t		fr_iovec_afrom_value_box_list(TALLOC_CTX *ctx, struct iovec **out, fr_value_box_list_t *list)
+		CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
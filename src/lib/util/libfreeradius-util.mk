@@ -21,6 +21,7 @@ SOURCES		:= \
 		   dbuff.c \
 		   debug.c \
 		   decode.c \
+		   dict_cache.c \
 		   dict_ext.c \
 		   dict_fixup.c \
 		   dict_print.c \
@@ -76,6 +77,7 @@ SOURCES		:= \
 		   sbuff.c \
 		   sem.c \
 		   sha1.c \
+		   shared_image.c \
 		   size.c \
 		   snprintf.c \
 		   socket.c \
@@ -90,6 +92,7 @@ SOURCES		:= \
 		   time.c \
 		   timeval.c \
 		   token.c \
+		   trace_ring.c \
 		   trie.c \
 		   types.c \
 		   udp.c \
@@ -9,6 +9,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/hw.h>
 
 /*
  *  FORCE MD4 TO USE OUR MD4 HEADER FILE!
@@ -489,6 +490,204 @@ void fr_md4_calc(uint8_t out[static MD4_DIGEST_LENGTH], uint8_t const *in, size_
 	fr_md4_ctx_free_from_list(&ctx);
 }
 
+/** Per-message state for fr_md4_calc_multi()
+ *
+ */
+typedef struct {
+	fr_md4_multi_t const	*in;			//!< Message being hashed.
+	size_t			offset;			//!< How much of the message has been read.
+	bool			padded;			//!< Whether the 0x80 terminator has been added.
+	bool			done;			//!< Whether the final block has been returned.
+} fr_md4_lane_t;
+
+/** Fill the next block of a message, including any MD4 padding
+ *
+ * @param[out] block	to fill.
+ * @param[in] lane	to read from.
+ * @return
+ *	- true if the block was filled.
+ *	- false if the message has been completely hashed.
+ */
+static bool fr_md4_lane_fill(uint8_t block[static MD4_BLOCK_LENGTH], fr_md4_lane_t *lane)
+{
+	size_t		n, i;
+	uint64_t	total;
+
+	if (lane->done) return false;
+
+	n = lane->in->inlen - lane->offset;
+	if (n > MD4_BLOCK_LENGTH) n = MD4_BLOCK_LENGTH;
+	if (n > 0) {
+		memcpy(block, lane->in->in + lane->offset, n);
+		lane->offset += n;
+	}
+
+	if (n == MD4_BLOCK_LENGTH) return true;
+
+	if (!lane->padded) {
+		block[n++] = 0x80;
+		lane->padded = true;
+	}
+
+	/*
+	 *	No room for the length, it goes into the next block.
+	 */
+	if (n > (MD4_BLOCK_LENGTH - 8)) {
+		memset(block + n, 0, MD4_BLOCK_LENGTH - n);
+		return true;
+	}
+
+	memset(block + n, 0, (MD4_BLOCK_LENGTH - 8) - n);
+
+	total = (uint64_t) lane->in->inlen << 3;
+	for (i = 0; i < 8; i++) block[(MD4_BLOCK_LENGTH - 8) + i] = (uint8_t) (total >> (i * 8));
+
+	lane->done = true;
+
+	return true;
+}
+
+/*
+ *	Message word, shift, and constant for each step of the MD4
+ *	transform, in the same order as the MD4STEP() calls in
+ *	fr_md4_local_transform().
+ */
+static uint8_t const md4_idx[48] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+	0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15
+};
+
+static uint8_t const md4_s[3][4] = {
+	{ 3, 7, 11, 19 }, { 3, 5, 9, 13 }, { 3, 9, 11, 15 }
+};
+
+static uint32_t const md4_k[3] = { 0x00000000, 0x5a827999, 0x6ed9eba1 };
+
+/*
+ *	One step for all lanes, see MD5STEP_MULTI() in md5.c.
+ */
+#define MD4STEP_MULTI(f, i) do { \
+	for (l = 0; l < MD4_MULTI_LANES; l++) { \
+		uint32_t t = a[l] + f(b[l], c[l], d[l]) + in[md4_idx[i]][l] + md4_k[(i) >> 4]; \
+		a[l] = d[l]; \
+		d[l] = c[l]; \
+		c[l] = b[l]; \
+		b[l] = (t << md4_s[(i) >> 4][(i) & 0x03]) | (t >> (32 - md4_s[(i) >> 4][(i) & 0x03])); \
+	} \
+} while (0)
+
+/** Run the MD4 transform over one block from each of MD4_MULTI_LANES messages
+ *
+ * The state is stored as [word][lane], so that the same word of each
+ * lane is contiguous in memory.
+ *
+ * @param[in,out] state	of each lane.
+ * @param[in] block	for each lane.
+ */
+static void FR_HW_TARGET_CLONES fr_md4_multi_transform(uint32_t state[static 4][MD4_MULTI_LANES],
+						    uint8_t const block[static MD4_MULTI_LANES][MD4_BLOCK_LENGTH])
+{
+	uint32_t	in[MD4_BLOCK_LENGTH / 4][MD4_MULTI_LANES];
+	uint32_t	a[MD4_MULTI_LANES], b[MD4_MULTI_LANES], c[MD4_MULTI_LANES], d[MD4_MULTI_LANES];
+	unsigned int	i, l;
+
+	for (i = 0; i < (MD4_BLOCK_LENGTH / 4); i++) {
+		for (l = 0; l < MD4_MULTI_LANES; l++) {
+			uint8_t const *p = block[l] + (i * 4);
+
+			in[i][l] = (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+		}
+	}
+
+	memcpy(a, state[0], sizeof(a));
+	memcpy(b, state[1], sizeof(b));
+	memcpy(c, state[2], sizeof(c));
+	memcpy(d, state[3], sizeof(d));
+
+	for (i = 0; i < 16; i++) MD4STEP_MULTI(MD4_F1, i);
+	for (; i < 32; i++) MD4STEP_MULTI(MD4_F2, i);
+	for (; i < 48; i++) MD4STEP_MULTI(MD4_F3, i);
+
+	for (l = 0; l < MD4_MULTI_LANES; l++) {
+		state[0][l] += a[l];
+		state[1][l] += b[l];
+		state[2][l] += c[l];
+		state[3][l] += d[l];
+	}
+}
+
+/** Calculate the MD4 digests of multiple messages
+ *
+ * Up to MD4_MULTI_LANES messages are hashed at the same time.  This is
+ * intended for short messages such as passwords when calculating NT
+ * hashes, where it's significantly faster than hashing them one by one.
+ *
+ * This always uses the local MD4 implementation, as OpenSSL has no
+ * interface for hashing independent messages in parallel.
+ *
+ * @param[out] out	Where to write the digests, one per message.
+ * @param[in] in	Messages to hash.
+ * @param[in] num	Number of messages.
+ */
+void fr_md4_calc_multi(uint8_t out[][MD4_DIGEST_LENGTH], fr_md4_multi_t const *in, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i += MD4_MULTI_LANES) {
+		fr_md4_lane_t	lane[MD4_MULTI_LANES] = {};
+		uint32_t	state[4][MD4_MULTI_LANES];
+		uint8_t		block[MD4_MULTI_LANES][MD4_BLOCK_LENGTH];
+		unsigned int	l, w, lanes = ((num - i) < MD4_MULTI_LANES) ? (unsigned int) (num - i) : MD4_MULTI_LANES;
+
+		for (l = 0; l < MD4_MULTI_LANES; l++) {
+			/*
+			 *	Unused lanes hash the first message again,
+			 *	and the result is ignored.
+			 */
+			lane[l].in = &in[i + ((l < lanes) ? l : 0)];
+			state[0][l] = 0x67452301;
+			state[1][l] = 0xefcdab89;
+			state[2][l] = 0x98badcfe;
+			state[3][l] = 0x10325476;
+		}
+
+		for (;;) {
+			uint32_t	saved[4][MD4_MULTI_LANES];
+			bool		active[MD4_MULTI_LANES];
+			bool		any = false;
+
+			for (l = 0; l < MD4_MULTI_LANES; l++) {
+				active[l] = fr_md4_lane_fill(block[l], &lane[l]);
+				any |= active[l];
+			}
+			if (!any) break;
+
+			/*
+			 *	Finished lanes have their state
+			 *	restored after the transform.
+			 */
+			memcpy(saved, state, sizeof(saved));
+			fr_md4_multi_transform(state, (uint8_t const (*)[MD4_BLOCK_LENGTH]) block);
+
+			for (l = 0; l < MD4_MULTI_LANES; l++) {
+				if (active[l]) continue;
+
+				for (w = 0; w < 4; w++) state[w][l] = saved[w][l];
+			}
+		}
+
+		for (l = 0; l < lanes; l++) {
+			for (w = 0; w < 4; w++) {
+				out[i + l][(w * 4)] = (uint8_t) state[w][l];
+				out[i + l][(w * 4) + 1] = (uint8_t) (state[w][l] >> 8);
+				out[i + l][(w * 4) + 2] = (uint8_t) (state[w][l] >> 16);
+				out[i + l][(w * 4) + 3] = (uint8_t) (state[w][l] >> 24);
+			}
+		}
+	}
+}
+
 static int _md4_ctx_free_on_exit(void *arg)
 {
 	int i;
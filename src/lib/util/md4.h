@@ -25,6 +25,19 @@ extern "C" {
 #  define MD4_DIGEST_LENGTH 16
 #endif
 
+/** Number of messages fr_md4_calc_multi() hashes in parallel
+ *
+ */
+#define MD4_MULTI_LANES	4
+
+/** A message for fr_md4_calc_multi()
+ *
+ */
+typedef struct {
+	uint8_t const	*in;
+	size_t		inlen;
+} fr_md4_multi_t;
+
 typedef void fr_md4_ctx_t;
 
 /* md4.c */
@@ -84,6 +97,11 @@ extern		fr_md4_final_t		fr_md4_final;
  */
 void		fr_md4_calc(uint8_t out[static MD4_DIGEST_LENGTH], uint8_t const *in, size_t inlen);
 
+/** Calculate the MD4 hashes of multiple messages
+ *
+ */
+void		fr_md4_calc_multi(uint8_t out[][MD4_DIGEST_LENGTH], fr_md4_multi_t const *in, size_t num);
+
 /** Allocate an md4 context from a free list
  *
  */
@@ -25,8 +25,41 @@ extern "C" {
 #  define MD5_DIGEST_LENGTH 16
 #endif
 
+#ifndef MD5_BLOCK_LENGTH
+#  define MD5_BLOCK_LENGTH 64
+#endif
+
+/** Number of messages fr_md5_calc_multi() hashes in parallel
+ *
+ */
+#define MD5_MULTI_LANES	4
+
 typedef void fr_md5_ctx_t;
 
+/** A message for fr_md5_calc_multi()
+ *
+ * The digest is calculated over prefix, in, and suffix, in that order.
+ * Parts which aren't needed should be NULL, with a length of zero.
+ */
+typedef struct {
+	uint8_t const	*prefix;
+	size_t		prefix_len;
+	uint8_t const	*in;
+	size_t		inlen;
+	uint8_t const	*suffix;
+	size_t		suffix_len;
+} fr_md5_multi_t;
+
+/** An input for fr_hmac_md5_multi()
+ *
+ */
+typedef struct {
+	uint8_t const	*in;
+	size_t		inlen;
+	uint8_t const	*key;
+	size_t		key_len;
+} fr_hmac_md5_multi_t;
+
 /* md5.c */
 
 /** Reset the ctx to allow reuse
@@ -83,6 +116,11 @@ extern		fr_md5_final_t		fr_md5_final;
  */
 void		fr_md5_calc(uint8_t out[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen);
 
+/** Perform digest operations on multiple input buffers in parallel
+ *
+ */
+void		fr_md5_calc_multi(uint8_t out[][MD5_DIGEST_LENGTH], fr_md5_multi_t const *in, size_t num);
+
 /** Allocate an MD5 context from a free list
  *
  */
@@ -96,6 +134,8 @@ void		fr_md5_ctx_free_from_list(fr_md5_ctx_t **ctx);
 /* hmac.c */
 int		fr_hmac_md5(uint8_t digest[static MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
 			    uint8_t const *key, size_t key_len);
+
+int		fr_hmac_md5_multi(uint8_t digest[][MD5_DIGEST_LENGTH], fr_hmac_md5_multi_t const *in, size_t num);
 #ifdef __cplusplus
 }
 #endif
@@ -56,6 +56,7 @@ void fr_pair_list_init(fr_pair_list_t *list)
 #ifdef WITH_VERIFY_PTR
 	list->verified = true;
 #endif
+	list->index = NULL;
 	list->is_child = false;
 }
 
@@ -92,6 +93,14 @@ static int _fr_pair_free(fr_pair_t *vp)
 
 	case FR_TYPE_STRING:
 	case FR_TYPE_OCTETS:
+		/*
+		 *	Interned buffers aren't parented by the pair,
+		 *	so release our reference explicitly.
+		 */
+		if (vp->data.interned) {
+			fr_value_box_clear_value(&vp->data);
+			break;
+		}
 		if (vp->data.secret) memset_explicit(vp->vp_ptr, 0, vp->vp_length);
 		break;
 
@@ -325,6 +334,12 @@ int fr_pair_reinit_from_da(fr_pair_list_t *list, fr_pair_t *vp, fr_dict_attr_t c
 		fr_value_box_init(&vp->data, da->type, da, false);
 	}
 
+	/*
+	 *	Remove the pair while it still has its old da,
+	 *	so the attribute index in the parent can find it.
+	 */
+	if (list) fr_pair_remove(list, vp);
+
 	to_free = vp->da;
 	vp->da = da;
 
@@ -336,11 +351,7 @@ int fr_pair_reinit_from_da(fr_pair_list_t *list, fr_pair_t *vp, fr_dict_attr_t c
 	/*
 	 *	Ensure we update the attribute index in the parent.
 	 */
-	if (list) {
-		fr_pair_remove(list, vp);
-
-		fr_pair_append(list, vp);
-	}
+	if (list) fr_pair_append(list, vp);
 
 	return 0;
 }
@@ -588,6 +599,7 @@ int fr_pair_steal_prepend(TALLOC_CTX *list_ctx, fr_pair_list_t *list, fr_pair_t
 int fr_pair_raw_afrom_pair(fr_pair_t *vp, uint8_t const *data, size_t data_len)
 {
 	fr_dict_attr_t *unknown;
+	fr_pair_list_t *parent;
 
 	PAIR_VERIFY(vp);
 
@@ -598,6 +610,9 @@ int fr_pair_raw_afrom_pair(fr_pair_t *vp, uint8_t const *data, size_t data_len)
 	unknown = fr_dict_unknown_afrom_da(vp, vp->da);
 	if (!unknown) return -1;
 
+	parent = fr_pair_parent_list(vp);
+	if (parent && parent->index) fr_pair_list_index_invalidate(parent);
+
 	vp->da = unknown;
 	fr_assert(vp->da->type == FR_TYPE_OCTETS);
 
@@ -623,6 +638,12 @@ static void *fr_pair_iter_next_by_da(fr_dlist_head_t *list, void *current, void
 	fr_pair_t	*c = current;
 	fr_dict_attr_t	*da = uctx;
 
+	/*
+	 *	Jump straight to the first instance if
+	 *	the list is indexed.
+	 */
+	if (!c) return fr_pair_find_by_da(fr_pair_list_from_dlist(list), NULL, da);
+
 	while ((c = fr_dlist_next(list, c))) {
 		PAIR_VERIFY(c);
 		if (c->da == da) break;
@@ -654,6 +675,291 @@ static void *fr_pair_iter_next_by_ancestor(fr_dlist_head_t *list, void *current,
 	return c;
 }
 
+/** Minimum number of pairs a list must contain before we build an attribute index for it
+ *
+ * Below this a linear scan is cheaper than hashing, and the memory
+ * used by the index isn't worth it.
+ */
+#ifndef FR_PAIR_LIST_INDEX_MIN
+#  define FR_PAIR_LIST_INDEX_MIN	32
+#endif
+
+/** Number of lookups to perform linearly before rebuilding an invalidated index
+ *
+ * Stops us thrashing between rebuilding the index and invalidating it
+ * when lookups are interleaved with modifications we can't track.
+ */
+#ifndef FR_PAIR_LIST_INDEX_REBUILD
+#  define FR_PAIR_LIST_INDEX_REBUILD	4
+#endif
+
+/** An entry in the attribute index
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const		*da;		//!< Attribute this slot tracks.  NULL if the slot is free.
+	fr_pair_t			*first;		//!< First instance of da in the list.
+	unsigned int			count;		//!< Number of instances of da in the list.
+} fr_pair_list_index_slot_t;
+
+/** Maps fr_dict_attr_t to the first instance of that attribute in a list
+ *
+ * The index is built lazily the first time a large list is searched, and
+ * is kept up to date by the functions which append, prepend and remove pairs.
+ * Any other modification (sorting, moving, arbitrary cursor inserts) marks the
+ * index as invalid, and it's rebuilt on a subsequent lookup.
+ *
+ * Indexes are only built for the children of structural pairs, as the parent
+ * pair gives us a talloc ctx that's guaranteed to live as long as the list.
+ */
+struct fr_pair_list_index_s {
+	fr_pair_list_index_slot_t	*slots;		//!< Open addressed hash table, linear probing.
+	unsigned int			mask;		//!< Number of slots - 1.
+	unsigned int			used;		//!< Number of slots with a da.
+	unsigned int			lookups;	//!< Lookups since the index was invalidated.
+	bool				valid;		//!< Whether the index reflects the current list.
+};
+
+static inline CC_HINT(always_inline) unsigned int pair_list_index_hash(fr_dict_attr_t const *da)
+{
+	uint64_t h = (uint64_t)(uintptr_t)da;
+
+	/*
+	 *	Pointer values share their low bits, so mix
+	 *	them before masking.
+	 */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return (unsigned int)h;
+}
+
+/** Find or create the slot for a da
+ *
+ * @param[in] idx	to search in.
+ * @param[in] da	to search for.
+ * @param[in] create	a new slot if one doesn't exist for da.
+ * @return
+ *	- The slot for da.
+ *	- NULL if there's no slot and create is false.
+ */
+static inline CC_HINT(always_inline)
+fr_pair_list_index_slot_t *pair_list_index_slot(fr_pair_list_index_t *idx, fr_dict_attr_t const *da, bool create)
+{
+	unsigned int i = pair_list_index_hash(da) & idx->mask;
+
+	/*
+	 *	The table is never allowed to fill up, so
+	 *	this always terminates.
+	 */
+	for (;;) {
+		fr_pair_list_index_slot_t *slot = &idx->slots[i];
+
+		if (slot->da == da) return slot;
+
+		if (!slot->da) {
+			if (!create) return NULL;
+
+			slot->da = da;
+			idx->used++;
+			return slot;
+		}
+
+		i = (i + 1) & idx->mask;
+	}
+}
+
+/** (Re)build the attribute index for a list
+ *
+ * @param[in] list	to index.
+ * @return
+ *	- true if the index was built.
+ *	- false on allocation failure.
+ */
+static bool pair_list_index_build(fr_pair_list_t *list)
+{
+	fr_pair_list_index_t	*idx = list->index;
+	size_t			num = fr_pair_list_num_elements(list);
+	unsigned int		size = 16;
+
+	/*
+	 *	Size for every pair being a different attribute,
+	 *	while keeping the table no more than half full.
+	 */
+	while (size < (num * 2)) size <<= 1;
+
+	if (!idx) {
+		idx = talloc_zero(fr_pair_list_parent(list), fr_pair_list_index_t);
+		if (unlikely(!idx)) return false;
+		list->index = idx;
+	}
+
+	if (!idx->slots || ((idx->mask + 1) != size)) {
+		talloc_free(idx->slots);
+		idx->slots = talloc_zero_array(idx, fr_pair_list_index_slot_t, size);
+		if (unlikely(!idx->slots)) {
+			idx->valid = false;
+			return false;
+		}
+		idx->mask = size - 1;
+	} else {
+		memset(idx->slots, 0, sizeof(idx->slots[0]) * size);
+	}
+	idx->used = 0;
+
+	fr_pair_list_foreach(list, vp) {
+		fr_pair_list_index_slot_t *slot = pair_list_index_slot(idx, vp->da, true);
+
+		if (slot->count++ == 0) slot->first = vp;
+	}
+
+	idx->lookups = 0;
+	idx->valid = true;
+
+	return true;
+}
+
+/** Return the attribute index for a list, building it if that's worthwhile
+ *
+ * @param[in] list	to return the index for.
+ * @return
+ *	- A valid index.
+ *	- NULL if the list should be searched linearly.
+ */
+static inline CC_HINT(always_inline) fr_pair_list_index_t *pair_list_index(fr_pair_list_t const *list)
+{
+	fr_pair_list_index_t *idx = list->index;
+
+	if (likely(idx && idx->valid)) return idx;
+
+	if (!list->is_child || (fr_pair_list_num_elements(list) < FR_PAIR_LIST_INDEX_MIN)) return NULL;
+
+	if (idx && (++idx->lookups < FR_PAIR_LIST_INDEX_REBUILD)) return NULL;
+
+	if (!pair_list_index_build(UNCONST(fr_pair_list_t *, list))) return NULL;
+
+	return list->index;
+}
+
+/** Record a pair being added to a list
+ *
+ * @param[in] list	the pair was added to.
+ * @param[in] vp	that was added.
+ * @param[in] is_first	true if vp is now the first instance of its da in the list.
+ */
+static inline CC_HINT(always_inline) void pair_list_index_add(fr_pair_list_t *list, fr_pair_t *vp, bool is_first)
+{
+	fr_pair_list_index_t		*idx = list->index;
+	fr_pair_list_index_slot_t	*slot;
+
+	if (!idx || !idx->valid) return;
+
+	slot = pair_list_index_slot(idx, vp->da, true);
+	if ((slot->count++ == 0) || is_first) slot->first = vp;
+
+	/*
+	 *	Getting full, rebuild at a larger size on the
+	 *	next lookup.
+	 */
+	if ((idx->used * 4) > ((idx->mask + 1) * 3)) {
+		idx->valid = false;
+		idx->lookups = FR_PAIR_LIST_INDEX_REBUILD;
+	}
+}
+
+/** Record a pair being inserted at an arbitrary position in a list
+ *
+ * We can only track this if it's the only instance of its da,
+ * otherwise we'd need to walk the list to find out if it's now
+ * the first one.
+ *
+ * @param[in] list	the pair was added to.
+ * @param[in] vp	that was added.
+ */
+static inline CC_HINT(always_inline) void pair_list_index_insert(fr_pair_list_t *list, fr_pair_t *vp)
+{
+	fr_pair_list_index_t		*idx = list->index;
+	fr_pair_list_index_slot_t	*slot;
+
+	if (!idx || !idx->valid) return;
+
+	slot = pair_list_index_slot(idx, vp->da, false);
+	if (slot && slot->count) {
+		fr_pair_list_index_invalidate(list);
+		return;
+	}
+
+	pair_list_index_add(list, vp, true);
+}
+
+/** Record a pair being removed from a list
+ *
+ * @note Must be called before the pair is unlinked.
+ *
+ * @param[in] list	the pair will be removed from.
+ * @param[in] vp	that will be removed.
+ */
+void fr_pair_list_index_remove(fr_pair_list_t *list, fr_pair_t *vp)
+{
+	fr_pair_list_index_t		*idx = list->index;
+	fr_pair_list_index_slot_t	*slot;
+	fr_pair_t			*next;
+
+	if (!idx || !idx->valid || !fr_pair_order_list_in_list(&list->order, vp)) return;
+
+	slot = pair_list_index_slot(idx, vp->da, false);
+	if (unlikely(!slot || !slot->count)) {
+		fr_pair_list_index_invalidate(list);
+		return;
+	}
+
+	if (--slot->count == 0) {
+		slot->first = NULL;
+		return;
+	}
+
+	if (slot->first != vp) return;
+
+	/*
+	 *	Removing the first instance, the next one
+	 *	must be somewhere after it.
+	 */
+	next = vp;
+	while ((next = fr_pair_list_next(list, next))) if (next->da == vp->da) break;
+
+	if (unlikely(!next)) {
+		fr_pair_list_index_invalidate(list);
+		return;
+	}
+	slot->first = next;
+}
+
+/** Mark the attribute index of a list as stale
+ *
+ * The memory is retained, and the index is rebuilt after a few more lookups.
+ *
+ * @param[in] list	whose index should be invalidated.
+ */
+void fr_pair_list_index_invalidate(fr_pair_list_t *list)
+{
+	fr_pair_list_index_t *idx = list->index;
+
+	if (!idx) return;
+
+	idx->valid = false;
+	idx->lookups = 0;
+}
+
+/** Free the attribute index of a list
+ *
+ * @param[in] list	whose index should be freed.
+ */
+void fr_pair_list_index_free(fr_pair_list_t *list)
+{
+	TALLOC_FREE(list->index);
+}
+
 /** Return the number of instances of a given da in the specified list
  *
  * @param[in] list	to search in.
@@ -664,11 +970,19 @@ static void *fr_pair_iter_next_by_ancestor(fr_dlist_head_t *list, void *current,
  */
 unsigned int fr_pair_count_by_da(fr_pair_list_t const *list, fr_dict_attr_t const *da)
 {
-	fr_pair_t	*vp = NULL;
-	unsigned int	count = 0;
+	fr_pair_t		*vp = NULL;
+	fr_pair_list_index_t	*idx;
+	unsigned int		count = 0;
 
 	if (fr_pair_list_empty(list)) return 0;
 
+	idx = pair_list_index(list);
+	if (idx) {
+		fr_pair_list_index_slot_t *slot = pair_list_index_slot(idx, da, false);
+
+		return slot ? slot->count : 0;
+	}
+
 	while ((vp = fr_pair_list_next(list, vp))) if (da == vp->da) count++;
 
 	return count;
@@ -687,12 +1001,19 @@ unsigned int fr_pair_count_by_da(fr_pair_list_t const *list, fr_dict_attr_t cons
  */
 fr_pair_t *fr_pair_find_by_da(fr_pair_list_t const *list, fr_pair_t const *prev, fr_dict_attr_t const *da)
 {
-	fr_pair_t *vp = UNCONST(fr_pair_t *, prev);
+	fr_pair_t		*vp = UNCONST(fr_pair_t *, prev);
+	fr_pair_list_index_t	*idx;
 
 	if (fr_pair_list_empty(list)) return NULL;
 
 	PAIR_LIST_VERIFY(list);
 
+	if (!prev && (idx = pair_list_index(list))) {
+		fr_pair_list_index_slot_t *slot = pair_list_index_slot(idx, da, false);
+
+		return slot ? slot->first : NULL;
+	}
+
 	while ((vp = fr_pair_list_next(list, vp))) if (da == vp->da) return vp;
 
 	return NULL;
@@ -735,12 +1056,27 @@ fr_pair_t *fr_pair_find_last_by_da(fr_pair_list_t const *list, fr_pair_t const *
  */
 fr_pair_t *fr_pair_find_by_da_idx(fr_pair_list_t const *list, fr_dict_attr_t const *da, unsigned int idx)
 {
-	fr_pair_t *vp = NULL;
+	fr_pair_t		*vp = NULL;
+	fr_pair_list_index_t	*index;
 
 	if (fr_pair_list_empty(list)) return NULL;
 
 	PAIR_LIST_VERIFY(list);
 
+	index = pair_list_index(list);
+	if (index) {
+		fr_pair_list_index_slot_t *slot = pair_list_index_slot(index, da, false);
+
+		if (!slot || (idx >= slot->count)) return NULL;
+
+		/*
+		 *	Start from the first instance, we're
+		 *	guaranteed to find the one we want.
+		 */
+		vp = slot->first;
+		if (idx == 0) return vp;
+	}
+
 	while ((vp = fr_pair_list_next(list, vp))) {
 		if (da != vp->da) continue;
 
@@ -965,13 +1301,19 @@ fr_pair_t *fr_pair_list_parent(fr_pair_list_t const *list)
  * @return
  *	- 0 on success.
  */
-static int _pair_list_dcursor_insert(fr_dlist_head_t *list, void *to_insert, UNUSED void *uctx)
+static int _pair_list_dcursor_insert(fr_dlist_head_t *list, void *to_insert, void *uctx)
 {
 	fr_pair_t *vp = to_insert;
 	fr_tlist_head_t *tlist;
 
 	tlist = fr_tlist_head_from_dlist(list);
 
+	/*
+	 *	We don't know where in the list the cursor
+	 *	is inserting the pair.
+	 */
+	pair_list_index_insert(uctx, vp);
+
 	/*
 	 *	Mark the pair as inserted into the list.
 	 */
@@ -1009,6 +1351,8 @@ static int _pair_list_dcursor_remove(NDEBUG_UNUSED fr_dlist_head_t *list, void *
 	parent = fr_pair_parent_list(vp);
 #endif
 
+	if (parent->index) fr_pair_list_index_remove(parent, vp);
+
 	/*
 	 *	Mark the pair as removed from the list.
 	 */
@@ -1321,6 +1665,7 @@ int fr_pair_prepend(fr_pair_list_t *list, fr_pair_t *to_add)
 	}
 
 	fr_pair_order_list_insert_head(&list->order, to_add);
+	pair_list_index_add(list, to_add, true);
 
 	return 0;
 }
@@ -1352,6 +1697,7 @@ int fr_pair_append(fr_pair_list_t *list, fr_pair_t *to_add)
 	}
 
 	fr_pair_order_list_insert_tail(&list->order, to_add);
+	pair_list_index_add(list, to_add, false);
 
 	return 0;
 }
@@ -1385,6 +1731,7 @@ int fr_pair_insert_after(fr_pair_list_t *list, fr_pair_t *pos, fr_pair_t *to_add
 	}
 
 	fr_pair_order_list_insert_after(&list->order, pos, to_add);
+	pair_list_index_insert(list, to_add);
 
 	return 0;
 }
@@ -1419,6 +1766,7 @@ int fr_pair_insert_before(fr_pair_list_t *list, fr_pair_t *pos, fr_pair_t *to_ad
 	}
 
 	fr_pair_order_list_insert_before(&list->order, pos, to_add);
+	pair_list_index_insert(list, to_add);
 
 	return 0;
 }
@@ -1995,8 +2343,8 @@ int fr_pair_cmp(fr_pair_t const *a, fr_pair_t const *b)
 
 			if (!fr_cond_assert(a->vp_type == FR_TYPE_STRING)) return -1;
 
-			slen = regex_compile(NULL, &preg, a->vp_strvalue, talloc_array_length(a->vp_strvalue) - 1,
-					     NULL, false, true);
+			slen = regex_compile_cached(NULL, &preg, a->vp_strvalue, talloc_array_length(a->vp_strvalue) - 1,
+						    NULL, false);
 			if (slen <= 0) {
 				fr_strerror_printf_push("Error at offset %zu compiling regex for %s", -slen,
 							a->da->name);
@@ -2324,6 +2672,7 @@ int fr_pair_list_copy(TALLOC_CTX *ctx, fr_pair_list_t *to, fr_pair_list_t const
 
 		new_vp = fr_pair_copy(ctx, vp);
 		if (!new_vp) {
+			fr_pair_list_index_invalidate(to);
 			fr_pair_order_list_talloc_free_to_tail(&to->order, first_added);
 			return -1;
 		}
@@ -2423,6 +2772,7 @@ int fr_pair_list_copy_by_da(TALLOC_CTX *ctx, fr_pair_list_t *to,
 		cnt++;
 		new_vp = fr_pair_copy(ctx, vp);
 		if (!new_vp) {
+			fr_pair_list_index_invalidate(to);
 			fr_pair_order_list_talloc_free_to_tail(&to->order, first_added);
 			return -1;
 		}
@@ -3217,6 +3567,8 @@ void fr_pair_verify(char const *file, int line, fr_pair_list_t const *list, fr_p
 		TALLOC_CTX *parent;
 
 		if (!vp->vp_octets) break;	/* We might be in the middle of initialisation */
+		if (vp->data.borrowed) break;	/* Buffer belongs to the packet */
+		if (vp->data.interned) break;	/* Buffer belongs to the intern table */
 
 		if (!talloc_get_type(vp->vp_ptr, uint8_t)) {
 			fr_fatal_assert_fail("CONSISTENCY CHECK FAILED %s[%u]: fr_pair_t \"%s\" data buffer type should be "
@@ -3245,6 +3597,7 @@ void fr_pair_verify(char const *file, int line, fr_pair_list_t const *list, fr_p
 		TALLOC_CTX *parent;
 
 		if (!vp->vp_octets) break;	/* We might be in the middle of initialisation */
+		if (vp->data.borrowed || vp->data.interned) break;	/* Buffer isn't parented by the pair */
 
 		if (!talloc_get_type(vp->vp_ptr, char)) {
 			fr_fatal_assert_fail("CONSISTENCY CHECK FAILED %s[%u]: fr_pair_t \"%s\" data buffer type should be "
@@ -47,11 +47,17 @@ extern "C" {
 
 typedef struct value_pair_s fr_pair_t;
 
+typedef struct fr_pair_list_index_s fr_pair_list_index_t;
+
 FR_TLIST_TYPES(fr_pair_order_list)
 
 typedef struct pair_list_s {
         FR_TLIST_HEAD(fr_pair_order_list)	order;			//!< Maintains the relative order of pairs in a list.
 
+	fr_pair_list_index_t		* _CONST index;			//!< Lazily built da -> first pair index, used to
+									///< speed up searches of large lists.  Only the
+									///< functions in pair.c should touch this.
+
 	bool				 _CONST is_child;		//!< is a child of a VP
 
 #ifdef WITH_VERIFY_PTR
@@ -551,6 +557,15 @@ fr_pair_t	*fr_pair_list_parent(fr_pair_list_t const *list);
 
 fr_pair_t	*fr_pair_list_iter_leaf(fr_pair_list_t *list, fr_pair_t *vp);
 
+#ifdef _PAIR_PRIVATE
+/* Attribute index maintenance, for use by pair_inline.c only */
+void		fr_pair_list_index_remove(fr_pair_list_t *list, fr_pair_t *vp) CC_HINT(nonnull);
+
+void		fr_pair_list_index_invalidate(fr_pair_list_t *list) CC_HINT(nonnull);
+
+void		fr_pair_list_index_free(fr_pair_list_t *list) CC_HINT(nonnull);
+#endif
+
 /** Initialises a special dcursor with callbacks that will maintain the attr sublists correctly
  *
  * Filters can be applied later with fr_dcursor_filter_set.
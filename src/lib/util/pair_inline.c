@@ -103,6 +103,8 @@ _INLINE fr_pair_t *fr_pair_remove(fr_pair_list_t *list, fr_pair_t *vp)
 	list->verified = false;
 #endif
 
+	if (list->index) fr_pair_list_index_remove(list, vp);
+
 	return fr_pair_order_list_remove(&list->order, vp);
 }
 
@@ -113,6 +115,7 @@ _INLINE fr_pair_t *fr_pair_remove(fr_pair_list_t *list, fr_pair_t *vp)
 _INLINE void fr_pair_list_free(fr_pair_list_t *list)
 {
 	fr_pair_order_list_talloc_free(&list->order);
+	if (list->index) fr_pair_list_index_free(list);
 }
 
 /** Is a valuepair list empty
@@ -140,6 +143,7 @@ _INLINE bool fr_pair_list_empty(fr_pair_list_t const *list)
 _INLINE void fr_pair_list_sort(fr_pair_list_t *list, fr_cmp_t cmp)
 {
 	fr_pair_order_list_sort(&list->order, cmp);
+	if (list->index) fr_pair_list_index_invalidate(list);
 }
 
 /** Get the length of a list of fr_pair_t
@@ -171,7 +175,7 @@ _INLINE fr_dlist_head_t *fr_pair_list_to_dlist(fr_pair_list_t const *list)
  */
 _INLINE fr_pair_list_t *fr_pair_list_from_dlist(fr_dlist_head_t const *list)
 {
-	return (fr_pair_list_t *)((uintptr_t)list - offsetof(fr_pair_list_t, order));
+	return (fr_pair_list_t *)((uintptr_t)list - offsetof(fr_pair_list_t, order.head.dlist_head));
 }
 
 /** Appends a list of fr_pair_t from a temporary list to a destination list
@@ -185,6 +189,8 @@ _INLINE void fr_pair_list_append(fr_pair_list_t *dst, fr_pair_list_t *src)
 	dst->verified = false;
 #endif
 	fr_pair_order_list_move(&dst->order, &src->order);
+	if (dst->index) fr_pair_list_index_invalidate(dst);
+	if (src->index) fr_pair_list_index_invalidate(src);
 }
 
 /** Move a list of fr_pair_t from a temporary list to the head of a destination list
@@ -195,4 +201,6 @@ _INLINE void fr_pair_list_append(fr_pair_list_t *dst, fr_pair_list_t *src)
 _INLINE void fr_pair_list_prepend(fr_pair_list_t *dst, fr_pair_list_t *src)
 {
 	fr_pair_order_list_move_head(&dst->order, &src->order);
+	if (dst->index) fr_pair_list_index_invalidate(dst);
+	if (src->index) fr_pair_list_index_invalidate(src);
 }
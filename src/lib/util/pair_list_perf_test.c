@@ -483,6 +483,79 @@ static void do_test_fr_pair_list_free(unsigned int len, unsigned int perc, unsig
 	TEST_MSG_ALWAYS("per_sec=%0.0lf", (reps * len)/(fr_time_delta_unwrap(used) / (double)NSEC));
 }
 
+/** Compare linear lookups with indexed lookups
+ *
+ * The attribute index is only built for the children of structural
+ * pairs, so the same pairs are inserted into a top level list (searched
+ * linearly) and a Test-Group (searched using the index once it's large
+ * enough).  Comparing the two for different list lengths shows where
+ * the crossover point is.
+ */
+static void do_test_find_by_da_indexed(unsigned int len, unsigned int perc, unsigned int reps, fr_pair_t *source_vps[])
+{
+	fr_pair_list_t		test_vps;
+	fr_pair_t		*group;
+	unsigned int		i, j;
+	fr_time_t		start, end;
+	fr_time_delta_t		used_linear = fr_time_delta_wrap(0), used_indexed = fr_time_delta_wrap(0);
+	fr_dict_attr_t const	*da;
+	size_t			input_count = talloc_array_length(source_vps);
+	fr_fast_rand_t		rand_ctx;
+
+	fr_pair_list_init(&test_vps);
+	if (input_count > len) input_count = len;
+	rand_ctx.a = fr_rand();
+	rand_ctx.b = fr_rand();
+
+	group = fr_pair_afrom_da(autofree, fr_dict_attr_test_group);
+	TEST_ASSERT(group != NULL);
+
+	/*
+	 *  Initialise both lists with the same pairs
+	 */
+	for (i = 0; i < len; i++) {
+		int idx = fr_fast_rand(&rand_ctx) % input_count;
+
+		fr_pair_append(&test_vps, fr_pair_copy(autofree, source_vps[idx]));
+		fr_pair_append(&group->vp_group, fr_pair_copy(group, source_vps[idx]));
+	}
+
+	for (i = 0; i < reps; i++) {
+		for (j = 0; j < len; j++) {
+			int idx = fr_fast_rand(&rand_ctx) % input_count;
+
+			da = source_vps[idx]->da;
+			start = fr_time();
+			(void) fr_pair_find_by_da(&test_vps, NULL, da);
+			end = fr_time();
+			used_linear = fr_time_delta_add(used_linear, fr_time_sub(end, start));
+
+			start = fr_time();
+			(void) fr_pair_find_by_da(&group->vp_group, NULL, da);
+			end = fr_time();
+			used_indexed = fr_time_delta_add(used_indexed, fr_time_sub(end, start));
+		}
+	}
+
+	/*
+	 *  Both lists must agree
+	 */
+	for (j = 0; j < input_count; j++) {
+		da = source_vps[j]->da;
+		TEST_CHECK(fr_pair_count_by_da(&test_vps, da) == fr_pair_count_by_da(&group->vp_group, da));
+	}
+
+	fr_pair_list_free(&test_vps);
+	talloc_free(group);
+	TEST_MSG_ALWAYS("repetitions=%d", reps);
+	TEST_MSG_ALWAYS("perc_rep=%d", perc);
+	TEST_MSG_ALWAYS("list_length=%d", len);
+	TEST_MSG_ALWAYS("used_linear=%"PRId64, fr_time_delta_unwrap(used_linear));
+	TEST_MSG_ALWAYS("used_indexed=%"PRId64, fr_time_delta_unwrap(used_indexed));
+	TEST_MSG_ALWAYS("per_sec_linear=%0.0lf", (reps * len)/(fr_time_delta_unwrap(used_linear) / (double)NSEC));
+	TEST_MSG_ALWAYS("per_sec_indexed=%0.0lf", (reps * len)/(fr_time_delta_unwrap(used_indexed) / (double)NSEC));
+}
+
 #define test_func(_func, _count, _perc, _source_vps) \
 static void test_ ## _func ## _ ## _count ## _ ## _perc(void)\
 {\
@@ -508,6 +581,22 @@ all_test_funcs(fr_pair_find_by_da_idx)
 all_test_funcs(find_nth)
 all_test_funcs(fr_pair_list_free)
 
+/*
+ *  Index crossover tests use a wider range of lengths, either
+ *  side of FR_PAIR_LIST_INDEX_MIN.
+ */
+#define index_test_funcs(_perc) \
+	test_func(find_by_da_indexed, 10, _perc, source_vps_ ## _perc) \
+	test_func(find_by_da_indexed, 20, _perc, source_vps_ ## _perc) \
+	test_func(find_by_da_indexed, 40, _perc, source_vps_ ## _perc) \
+	test_func(find_by_da_indexed, 80, _perc, source_vps_ ## _perc) \
+	test_func(find_by_da_indexed, 160, _perc, source_vps_ ## _perc) \
+	test_func(find_by_da_indexed, 320, _perc, source_vps_ ## _perc)
+
+index_test_funcs(0)
+index_test_funcs(50)
+index_test_funcs(100)
+
 #define repetition_tests(_func, _perc) \
 	{ #_func "_20_" #_perc, test_ ## _func ## _20_ ## _perc},\
 	{ #_func "_40_" #_perc, test_ ## _func ## _40_ ## _perc},\
@@ -515,6 +604,14 @@ all_test_funcs(fr_pair_list_free)
 	{ #_func "_80_" #_perc, test_ ## _func ## _80_ ## _perc},\
 	{ #_func "_100_" #_perc, test_ ## _func ## _100_ ## _perc},\
 
+#define index_tests(_perc) \
+	{ "find_by_da_indexed_10_" #_perc, test_find_by_da_indexed_10_ ## _perc},\
+	{ "find_by_da_indexed_20_" #_perc, test_find_by_da_indexed_20_ ## _perc},\
+	{ "find_by_da_indexed_40_" #_perc, test_find_by_da_indexed_40_ ## _perc},\
+	{ "find_by_da_indexed_80_" #_perc, test_find_by_da_indexed_80_ ## _perc},\
+	{ "find_by_da_indexed_160_" #_perc, test_find_by_da_indexed_160_ ## _perc},\
+	{ "find_by_da_indexed_320_" #_perc, test_find_by_da_indexed_320_ ## _perc},\
+
 #define all_repetition_tests(_func) \
 	repetition_tests(_func, 0) \
 	repetition_tests(_func, 25) \
@@ -527,6 +624,9 @@ TEST_LIST = {
 	all_repetition_tests(fr_pair_find_by_da_idx)
 	all_repetition_tests(find_nth)
 	all_repetition_tests(fr_pair_list_free)
+	index_tests(0)
+	index_tests(50)
+	index_tests(100)
 
 	{ NULL }
 };
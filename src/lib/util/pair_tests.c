@@ -1369,6 +1369,55 @@ static void test_fr_pair_value_mem_append_buffer(void)
 	talloc_free(copy_test_octets);
 }
 
+static void test_fr_pair_value_intern(void)
+{
+	fr_pair_t	*a, *b, *c;
+	size_t		count = fr_value_box_intern_count();
+
+	TEST_CASE("Allocate two 'Test-String' pairs with the same value");
+	TEST_CHECK((a = fr_pair_afrom_da(autofree, fr_dict_attr_test_string)) != NULL);
+	TEST_CHECK((b = fr_pair_afrom_da(autofree, fr_dict_attr_test_string)) != NULL);
+	TEST_CHECK(fr_pair_value_strdup(a, test_string, false) == 0);
+	TEST_CHECK(fr_pair_value_strdup(b, test_string, false) == 0);
+
+	TEST_CASE("Intern both values using fr_value_box_intern()");
+	TEST_CHECK(fr_value_box_intern(&a->data) == 0);
+	TEST_CHECK(fr_value_box_intern(&b->data) == 0);
+	TEST_CHECK(a->data.interned && b->data.interned);
+
+	TEST_CASE("Validating PAIR_VERIFY()");
+	PAIR_VERIFY(a);
+	PAIR_VERIFY(b);
+
+	TEST_CASE("Check the pairs share one buffer");
+	TEST_CHECK(a->vp_strvalue == b->vp_strvalue);
+	TEST_CHECK(strcmp(a->vp_strvalue, test_string) == 0);
+	TEST_CHECK(fr_value_box_intern_count() == count + 1);
+
+	TEST_CASE("A shallow copy of an interned value holds its own reference");
+	TEST_CHECK((c = fr_pair_afrom_da(autofree, fr_dict_attr_test_string)) != NULL);
+	fr_value_box_copy_shallow(NULL, &c->data, &b->data);
+	TEST_CHECK(c->data.interned && !c->data.borrowed);
+	TEST_CHECK(c->vp_strvalue == b->vp_strvalue);
+
+	TEST_CASE("Appending to one pair gives it its own buffer");
+	TEST_CHECK(fr_pair_value_bstrn_append(a, "x", 1, false) == 0);
+	TEST_CHECK(!a->data.interned);
+	TEST_CHECK(a->vp_strvalue != b->vp_strvalue);
+	TEST_CHECK(strcmp(b->vp_strvalue, test_string) == 0);
+
+	TEST_CASE("The shallow copy outlives the pair it was copied from");
+	talloc_free(b);
+	TEST_CHECK(fr_value_box_intern_count() == count + 1);
+	TEST_CHECK(strcmp(c->vp_strvalue, test_string) == 0);
+
+	TEST_CASE("Freeing the last pair holding the value removes it from the table");
+	talloc_free(c);
+	TEST_CHECK(fr_value_box_intern_count() == count);
+
+	talloc_free(a);
+}
+
 static void test_fr_pair_value_enum(void)
 {
 	fr_pair_t   *vp;
@@ -1485,6 +1534,9 @@ TEST_LIST = {
 	{ "fr_pair_value_mem_append",             test_fr_pair_value_mem_append },
 	{ "fr_pair_value_mem_append_buffer",      test_fr_pair_value_mem_append_buffer },
 
+	/* Interned values */
+	{ "fr_pair_value_intern",                 test_fr_pair_value_intern },
+
 	/* Enum functions */
 	{ "fr_pair_value_enum",                   test_fr_pair_value_enum },
 	{ "fr_pair_value_enum_box",               test_fr_pair_value_enum_box },
@@ -32,6 +32,10 @@
 #include <sys/ioctl.h>
 #include <sys/uio.h>
 
+#ifdef HAVE_LINUX_IF_PACKET_H
+#  include <linux/if_packet.h>
+#endif
+
 #ifndef SIOCGIFHWADDR
 #  include <ifaddrs.h>
 #  ifdef HAVE_NET_IF_DL_H
@@ -415,6 +419,49 @@ int fr_pcap_apply_filter(fr_pcap_t *pcap, char const *expression)
 	return 0;
 }
 
+/** Add a live capture handle to a fanout group
+ *
+ * The kernel distributes packets between all the handles in a group
+ * using a symmetric hash of the flow, so requests and their responses
+ * are always delivered to the same handle.
+ *
+ * Every handle capturing on behalf of the group (including the first)
+ * must be added to it, and they must all be bound to the same interface.
+ *
+ * @param pcap handle to add.  Must be open.
+ * @param group to join.  Groups are shared between all processes on the
+ *	host, so the caller should pick something unique.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, or if fanout isn't supported on this platform.
+ */
+int fr_pcap_fanout(fr_pcap_t *pcap, uint16_t group)
+{
+#if defined(HAVE_LINUX_IF_PACKET_H) && defined(PACKET_FANOUT)
+	uint32_t arg;
+
+	if (pcap->type != PCAP_INTERFACE_IN) {
+		fr_strerror_const("Fanout is only supported for live capture handles");
+		return -1;
+	}
+
+	/*
+	 *	Reassemble fragments before hashing, otherwise large
+	 *	packets would be split between handles.
+	 */
+	arg = group | ((uint32_t) (PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+	if (setsockopt(pcap_fileno(pcap->handle), SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+		fr_strerror_printf("Failed adding %s to fanout group %u: %s", pcap->name, group, fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+#else
+	fr_strerror_const("Fanout is not supported on this platform");
+	return -1;
+#endif
+}
+
 /** Retrieve list of interface names that will be used for capture.
  * Only used for debugging.
  *
@@ -0,0 +1,62 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** USDT probes for SystemTap, bpftrace, etc.
+ *
+ * When <sys/sdt.h> is available, each probe compiles to a single nop,
+ * plus a note in the ELF file describing where the probe is, and where
+ * its arguments can be found.  When nothing is attached to a probe,
+ * the only cost is the nop.  Without <sys/sdt.h>, the probes compile
+ * to nothing.
+ *
+ * All probes use the "freeradius" provider.  e.g.
+ *
+ @verbatim
+   bpftrace -e 'usdt:/usr/sbin/radiusd:freeradius:module_enter { @[str(arg1)] = count(); }'
+ @endverbatim
+ *
+ * | Probe                  | Arguments                                          |
+ * |------------------------|----------------------------------------------------|
+ * | network_read           | fd, packet length                                  |
+ * | network_send_request   | fd, packet length, requests outstanding at worker  |
+ * | request_start          | request number, fd                                 |
+ * | module_enter           | request number, module name                        |
+ * | module_yield           | request number, module name                        |
+ * | module_resume          | request number, module name                        |
+ * | module_exit            | request number, module name, rcode                 |
+ * | trunk_request_enqueue  | request number, trunk request id, trunk_enqueue_t  |
+ * | trunk_request_complete | request number, trunk request id                   |
+ * | request_reply          | request number, reply length, processing time (ns) |
+ *
+ * @file src/lib/util/probe.h
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(probe_h, "$Id$")
+
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+
+/** Fire a USDT probe
+ *
+ * @param[in] _name	of the probe, without the provider.
+ * @param[in] ...	arguments.  Up to 12 integers or pointers.
+ */
+#  define FR_PROBE(_name, ...)	STAP_PROBEV(freeradius, _name, ## __VA_ARGS__)
+#else
+#  define FR_PROBE(_name, ...)
+#endif
@@ -27,6 +27,8 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/regex.h>
 #include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rb.h>
 
 #if defined(HAVE_REGEX_PCRE) || (defined(HAVE_REGEX_PCRE2) && defined(PCRE2_CONFIG_JIT))
 #ifndef FR_PCRE_JIT_STACK_MIN
@@ -37,6 +39,10 @@ RCSID("$Id$")
 #endif
 #endif
 
+#ifndef FR_REGEX_CACHE_MAX
+#  define FR_REGEX_CACHE_MAX	128
+#endif
+
 /*
  *######################################
  *#      FUNCTIONS FOR LIBPCRE2        #
@@ -60,12 +66,36 @@ typedef struct {
 	pcre2_general_context	*gcontext;	//!< General context.
 	pcre2_compile_context	*ccontext;	//!< Compile context.
 	pcre2_match_context	*mcontext;	//!< Match context.
+	pcre2_match_data	*match_data;	//!< Used when the caller doesn't want the match data.
+						///< Grown to fit the pattern with the most subcaptures.
 #ifdef PCRE2_CONFIG_JIT
 	pcre2_jit_stack		*jit_stack;	//!< Jit stack for executing jit'd patterns.
 	bool			do_jit;		//!< Whether we have runtime JIT support.
 #endif
+	fr_rb_tree_t		*cache;		//!< Runtime compiled expressions, by pattern and options.
+	fr_dlist_head_t		lru;		//!< Cached expressions, most recently used first.
 } fr_pcre2_tls_t;
 
+/** A runtime compiled expression, kept for reuse
+ *
+ * Callers get handles which share the compiled expression.  Entries
+ * which are evicted while handles still reference them are freed
+ * when the last handle is freed.
+ */
+struct fr_regex_cache_entry_s {
+	fr_rb_node_t		node;		//!< Entry in the tree of cached expressions.
+	fr_dlist_t		lru_entry;	//!< Entry in the LRU list.
+
+	uint8_t const		*pattern;	//!< The uncompiled expression.
+	size_t			len;		//!< Length of the pattern.
+	uint32_t		cflags;		//!< Options the pattern was compiled with.
+
+	regex_t			*preg;		//!< The compiled expression.
+	uint32_t		hits;		//!< How many times this entry has been reused.
+	uint32_t		refs;		//!< How many handles reference this entry.
+	bool			cached;		//!< Still in the cache.
+};
+
 /** Thread local storage for pcre2
  *
  */
@@ -91,12 +121,29 @@ static void _pcre2_talloc_free(void *to_free, UNUSED void *uctx)
 	talloc_free(to_free);
 }
 
+/** Remove an entry from the cache, freeing it if no handles reference it
+ *
+ */
+static void regex_cache_entry_evict(fr_pcre2_tls_t *tls, fr_regex_cache_entry_t *entry)
+{
+	fr_rb_remove_by_inline_node(tls->cache, &entry->node);
+	fr_dlist_remove(&tls->lru, entry);
+	entry->cached = false;
+
+	if (entry->refs == 0) talloc_free(entry);
+}
+
 /** Free thread local data
  *
  * @param[in] tls	Thread local data to free.
  */
 static int _pcre2_tls_free(fr_pcre2_tls_t *tls)
 {
+	fr_regex_cache_entry_t *entry;
+
+	if (tls->cache) while ((entry = fr_dlist_head(&tls->lru))) regex_cache_entry_evict(tls, entry);
+
+	if (tls->match_data) pcre2_match_data_free(tls->match_data);
 	if (tls->gcontext) pcre2_general_context_free(tls->gcontext);
 	if (tls->ccontext) pcre2_compile_context_free(tls->ccontext);
 	if (tls->mcontext) pcre2_match_context_free(tls->mcontext);
@@ -112,6 +159,15 @@ static int _pcre2_tls_free_on_exit(void *arg)
 	return talloc_free(arg);
 }
 
+static int8_t _regex_cache_entry_cmp(void const *one, void const *two)
+{
+	fr_regex_cache_entry_t const *a = one, *b = two;
+
+	CMP_RETURN(a, b, cflags);
+
+	return memcmp_return(a->pattern, b->pattern, a->len, b->len);
+}
+
 /** Thread local init for pcre2
  *
  */
@@ -123,6 +179,7 @@ static int fr_pcre2_tls_init(void)
 
 	fr_pcre2_tls = tls = talloc_zero(NULL, fr_pcre2_tls_t);
 	if (!tls) return -1;
+	fr_dlist_init(&tls->lru, fr_regex_cache_entry_t, lru_entry);
 	talloc_set_destructor(tls, _pcre2_tls_free);
 
 	tls->gcontext = pcre2_general_context_create(_pcre2_talloc, _pcre2_talloc_free, NULL);
@@ -146,6 +203,12 @@ static int fr_pcre2_tls_init(void)
 		goto error;
 	}
 
+	tls->cache = fr_rb_inline_talloc_alloc(tls, fr_regex_cache_entry_t, node, _regex_cache_entry_cmp, NULL);
+	if (!tls->cache) {
+		fr_strerror_const("Failed allocating regex cache");
+		goto error;
+	}
+
 #ifdef PCRE2_CONFIG_JIT
 	pcre2_config(PCRE2_CONFIG_JIT, &tls->do_jit);
 	if (tls->do_jit) {
@@ -175,11 +238,42 @@ static int fr_pcre2_tls_init(void)
  */
 static int _regex_free(regex_t *preg)
 {
+	fr_regex_cache_entry_t *entry = preg->cached;
+
+	/*
+	 *	Handles don't own the compiled expression
+	 */
+	if (entry) {
+		if ((--entry->refs == 0) && !entry->cached) talloc_free(entry);
+		return 0;
+	}
+
 	if (preg->compiled) pcre2_code_free(preg->compiled);
 
 	return 0;
 }
 
+/** Convert our flags to pcre2 compile options
+ *
+ */
+static inline CC_HINT(always_inline) uint32_t regex_pcre2_cflags(fr_regex_flags_t const *flags, bool subcaptures)
+{
+	uint32_t cflags = 0;
+
+	if (flags) {
+		 /* flags->global implemented by substitution function */
+		if (flags->ignore_case) cflags |= PCRE2_CASELESS;
+		if (flags->multiline) cflags |= PCRE2_MULTILINE;
+		if (flags->dot_all) cflags |= PCRE2_DOTALL;
+		if (flags->unicode) cflags |= PCRE2_UTF;
+		if (flags->extended) cflags |= PCRE2_EXTENDED;
+	}
+
+	if (!subcaptures) cflags |= PCRE2_NO_AUTO_CAPTURE;
+
+	return cflags;
+}
+
 /** Wrapper around pcre2_compile
  *
  * Allows the rest of the code to do compilations using one function signature.
@@ -205,7 +299,7 @@ ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_
 {
 	int		ret;
 	PCRE2_SIZE	offset;
-	uint32_t	cflags = 0;
+	uint32_t	cflags;
 	regex_t		*preg;
 
 	/*
@@ -223,19 +317,7 @@ ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_
 		return 0;
 	}
 
-	/*
-	 *	Options
-	 */
-	if (flags) {
-		 /* flags->global implemented by substitution function */
-		if (flags->ignore_case) cflags |= PCRE2_CASELESS;
-		if (flags->multiline) cflags |= PCRE2_MULTILINE;
-		if (flags->dot_all) cflags |= PCRE2_DOTALL;
-		if (flags->unicode) cflags |= PCRE2_UTF;
-		if (flags->extended) cflags |= PCRE2_EXTENDED;
-	}
-
-	if (!subcaptures) cflags |= PCRE2_NO_AUTO_CAPTURE;
+	cflags = regex_pcre2_cflags(flags, subcaptures);
 
 	preg = talloc_zero(ctx, regex_t);
 	talloc_set_destructor(preg, _regex_free);
@@ -282,6 +364,108 @@ ssize_t regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_
 	return len;
 }
 
+/** Compile a runtime expression, reusing an earlier compilation of the same pattern if possible
+ *
+ * Each thread keeps the most recently used #FR_REGEX_CACHE_MAX expressions.
+ * Expressions are run through the JIT (if available) the first time they're
+ * reused, so patterns which are only ever seen once don't pay for it.
+ *
+ * @note The returned expression is a handle which must be freed with talloc_free,
+ *	 by the thread which compiled it.
+ *
+ * @param[in] ctx		to allocate the handle in.
+ * @param[out] out		Where to write out a pointer to the structure containing
+ *				the compiled expression.
+ * @param[in] pattern		to compile.
+ * @param[in] len		of pattern.
+ * @param[in] flags		controlling matching. May be NULL.
+ * @param[in] subcaptures	Whether to compile the regular expression to store subcapture
+ *				data.
+ * @return
+ *	- >= 1 on success.
+ *	- <= 0 on error. Negative value is offset of parse error.
+ */
+ssize_t regex_compile_cached(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_t len,
+			     fr_regex_flags_t const *flags, bool subcaptures)
+{
+	fr_regex_cache_entry_t	*entry;
+	regex_t			*preg;
+	ssize_t			slen;
+
+	*out = NULL;
+
+	/*
+	 *	Thread local initialisation
+	 */
+	if (unlikely(!fr_pcre2_tls) && (fr_pcre2_tls_init() < 0)) return -1;
+
+	entry = fr_rb_find(fr_pcre2_tls->cache, &(fr_regex_cache_entry_t){
+				.pattern = (uint8_t const *)pattern,
+				.len = len,
+				.cflags = regex_pcre2_cflags(flags, subcaptures)
+			   });
+	if (entry) {
+		fr_dlist_remove(&fr_pcre2_tls->lru, entry);
+		fr_dlist_insert_head(&fr_pcre2_tls->lru, entry);
+
+#ifdef PCRE2_CONFIG_JIT
+		/*
+		 *	The pattern has been seen more than once,
+		 *	so it's probably worth the cost.  If the JIT
+		 *	fails, we just carry on interpreting it.
+		 */
+		if ((entry->hits++ == 0) && fr_pcre2_tls->do_jit &&
+		    (pcre2_jit_compile(entry->preg->compiled, PCRE2_JIT_COMPLETE) == 0)) entry->preg->jitd = true;
+#endif
+	} else {
+		slen = regex_compile(NULL, &preg, pattern, len, flags, subcaptures, true);
+		if (slen <= 0) return slen;
+
+		entry = talloc_zero(NULL, fr_regex_cache_entry_t);
+		if (!entry) {
+		oom:
+			talloc_free(preg);
+			fr_strerror_const("Out of memory");
+			return -1;
+		}
+		entry->pattern = talloc_memdup(entry, pattern, len);
+		if (!entry->pattern) {
+			talloc_free(entry);
+			goto oom;
+		}
+		entry->len = len;
+		entry->cflags = regex_pcre2_cflags(flags, subcaptures);
+		entry->preg = talloc_steal(entry, preg);
+
+		while (fr_rb_num_elements(fr_pcre2_tls->cache) >= FR_REGEX_CACHE_MAX) {
+			regex_cache_entry_evict(fr_pcre2_tls, fr_dlist_tail(&fr_pcre2_tls->lru));
+		}
+
+		entry->cached = true;
+		fr_rb_insert(fr_pcre2_tls->cache, entry);
+		fr_dlist_insert_head(&fr_pcre2_tls->lru, entry);
+	}
+
+	/*
+	 *	Handles look like runtime expressions, so
+	 *	they're reparented along with their match
+	 *	data, and the entry lives as long as they do.
+	 */
+	preg = talloc(ctx, regex_t);
+	if (!preg) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	*preg = *entry->preg;
+	preg->cached = entry;
+	entry->refs++;
+	talloc_set_destructor(preg, _regex_free);
+
+	*out = preg;
+
+	return len;
+}
+
 /** Wrapper around pcre2_exec
  *
  * @param[in] preg	The compiled expression.
@@ -354,16 +538,28 @@ int regex_exec(regex_t *preg, char const *subject, size_t len, fr_regmatch_t *re
 	}
 
 	/*
-	 *	If we weren't given match data we
-	 *	need to alloc it else pcre2_match
-	 *	fails when passed NULL match data.
+	 *	If we weren't given match data we use
+	 *	the thread's, as pcre2_match fails when
+	 *	passed NULL match data.  It's grown to
+	 *	fit the pattern with the most subcaptures
+	 *	so it's only reallocated a few times.
 	 */
 	if (!regmatch) {
-		match_data = pcre2_match_data_create_from_pattern(preg->compiled, fr_pcre2_tls->gcontext);
-		if (!match_data) {
-			fr_strerror_const("Failed allocating temporary match data");
-			return -1;
+		uint32_t count;
+
+		if (pcre2_pattern_info(preg->compiled, PCRE2_INFO_CAPTURECOUNT, &count) != 0) count = 0;
+		count++;	/* +1 for the whole match */
+
+		if (!fr_pcre2_tls->match_data || (pcre2_get_ovector_count(fr_pcre2_tls->match_data) < count)) {
+			if (fr_pcre2_tls->match_data) pcre2_match_data_free(fr_pcre2_tls->match_data);
+
+			fr_pcre2_tls->match_data = pcre2_match_data_create(count, fr_pcre2_tls->gcontext);
+			if (!fr_pcre2_tls->match_data) {
+				fr_strerror_const("Failed allocating temporary match data");
+				return -1;
+			}
 		}
+		match_data = fr_pcre2_tls->match_data;
 	} else {
 		match_data = regmatch->match_data;
 	}
@@ -378,7 +574,6 @@ int regex_exec(regex_t *preg, char const *subject, size_t len, fr_regmatch_t *re
 		ret = pcre2_match(preg->compiled, (PCRE2_SPTR8)subject, len, 0, options,
 				  match_data, fr_pcre2_tls->mcontext);
 	}
-	if (!regmatch) pcre2_match_data_free(match_data);
 	if (ret < 0) {
 		PCRE2_UCHAR	errbuff[128];
 
@@ -1258,6 +1453,246 @@ fr_regmatch_t *regex_match_data_alloc(TALLOC_CTX *ctx, uint32_t count)
  *########################################
  */
 
+#ifndef HAVE_REGEX_PCRE2
+/** Compile a runtime expression
+ *
+ * Only the libpcre2 wrappers cache compiled expressions.  For the other
+ * libraries this is the same as calling #regex_compile for a runtime expression.
+ */
+ssize_t regex_compile_cached(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_t len,
+			     fr_regex_flags_t const *flags, bool subcaptures)
+{
+	return regex_compile(ctx, out, pattern, len, flags, subcaptures, true);
+}
+#endif
+
+/** A set of expressions matched against a subject together
+ *
+ */
+struct fr_regex_set_s {
+	regex_t			**pregs;	//!< Each expression, in the order it was added.
+	fr_regex_flags_t	*flags;		//!< The flags each expression was compiled with.
+	char const		**patterns;	//!< The uncompiled expressions.
+	size_t			*lens;		//!< Lengths of the uncompiled expressions.
+	uint32_t		num;		//!< How many expressions are in the set.
+#ifdef HAVE_REGEX_PCRE2
+	regex_t			*merged;	//!< All the expressions as a single one.
+#endif
+};
+
+/** Allocate an empty set of expressions
+ *
+ * @param[in] ctx	to allocate the set in.
+ * @return
+ *	- A new set.
+ *	- NULL on error.
+ */
+fr_regex_set_t *regex_set_alloc(TALLOC_CTX *ctx)
+{
+	fr_regex_set_t *set;
+
+	set = talloc_zero(ctx, fr_regex_set_t);
+	if (!set) fr_strerror_const("Out of memory");
+
+	return set;
+}
+
+/** Add an expression to a set
+ *
+ * Expressions are tried in the order they're added.
+ *
+ * @param[in] set	to add the expression to.
+ * @param[in] pattern	to compile.
+ * @param[in] len	of pattern.
+ * @param[in] flags	controlling matching. May be NULL.
+ * @return
+ *	- >= 1 on success.
+ *	- <= 0 on error. Negative value is offset of parse error.
+ */
+ssize_t regex_set_add(fr_regex_set_t *set, char const *pattern, size_t len, fr_regex_flags_t const *flags)
+{
+	regex_t	*preg;
+	ssize_t	slen;
+
+	slen = regex_compile(set, &preg, pattern, len, flags, false, false);
+	if (slen <= 0) return slen;
+
+	if (((set->pregs = talloc_realloc(set, set->pregs, regex_t *, set->num + 1)) == NULL) ||
+	    ((set->flags = talloc_realloc(set, set->flags, fr_regex_flags_t, set->num + 1)) == NULL) ||
+	    ((set->patterns = talloc_realloc(set, set->patterns, char const *, set->num + 1)) == NULL) ||
+	    ((set->lens = talloc_realloc(set, set->lens, size_t, set->num + 1)) == NULL) ||
+	    ((set->patterns[set->num] = talloc_bstrndup(set, pattern, len)) == NULL)) {
+		talloc_free(preg);
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	set->pregs[set->num] = preg;
+	if (flags) {
+		set->flags[set->num] = *flags;
+	} else {
+		set->flags[set->num] = (fr_regex_flags_t) {};
+	}
+	set->lens[set->num] = len;
+	set->num++;
+
+#ifdef HAVE_REGEX_PCRE2
+	TALLOC_FREE(set->merged);
+#endif
+
+	return len;
+}
+
+#ifdef HAVE_REGEX_PCRE2
+/** Combine all the expressions in a set into one, so the subject is only passed to libpcre2 once
+ *
+ * Each expression becomes a lookahead in an alternation anchored at the
+ * start of the subject, so the first expression (in order) which matches
+ * anywhere in the subject is the one which is selected, exactly as if
+ * they'd been tried one by one.  A (*MARK) records which one it was.
+ *
+ * Expressions which can't be combined without changing their meaning,
+ * i.e. ones with back references, named groups or embedded NULs, or sets
+ * where only some expressions need unicode matching, are left to be tried
+ * one by one.
+ *
+ * @return
+ *	- 0 on success, or if the expressions can't be combined.
+ *	- -1 on error.
+ */
+static int regex_set_merge(fr_regex_set_t *set)
+{
+	char			*merged;
+	uint32_t		i, value;
+	fr_regex_flags_t	merged_flags = {};
+
+	if (set->num < 2) return 0;
+
+	for (i = 0; i < set->num; i++) {
+		if ((pcre2_pattern_info(set->pregs[i]->compiled, PCRE2_INFO_BACKREFMAX, &value) != 0) || value) return 0;
+		if ((pcre2_pattern_info(set->pregs[i]->compiled, PCRE2_INFO_NAMECOUNT, &value) != 0) || value) return 0;
+		if (set->flags[i].unicode != set->flags[0].unicode) return 0;
+		if (memchr(set->patterns[i], '\0', set->lens[i])) return 0;
+	}
+	merged_flags.unicode = set->flags[0].unicode;
+
+	merged = talloc_strdup(NULL, "\\A(?:");
+	if (!merged) {
+	oom:
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < set->num; i++) {
+		fr_regex_flags_t const *flags = &set->flags[i];
+
+		merged = talloc_asprintf_append_buffer(merged, "%s(?=[\\s\\S]*?(?%s%s%s%s:%.*s%s))(*MARK:%u)",
+						       i ? "|" : "",
+						       flags->ignore_case ? "i" : "",
+						       flags->multiline ? "m" : "",
+						       flags->dot_all ? "s" : "",
+						       flags->extended ? "x" : "",
+						       (int)set->lens[i], set->patterns[i],
+						       flags->extended ? "\n" : "",	/* Terminate any trailing comment */
+						       i);
+		if (!merged) goto oom;
+	}
+
+	merged = talloc_strdup_append_buffer(merged, ")");
+	if (!merged) goto oom;
+
+	/*
+	 *	If the combination doesn't compile, e.g. because one of
+	 *	the expressions starts with an option setting verb,
+	 *	they're just tried one by one.
+	 */
+	if (regex_compile(set, &set->merged, merged, talloc_array_length(merged) - 1, &merged_flags, false, false) <= 0) {
+		set->merged = NULL;
+		fr_strerror_clear();
+	}
+	talloc_free(merged);
+
+	return 0;
+}
+#endif
+
+/** Prepare a set of expressions for matching
+ *
+ * Must be called after the last expression is added, and before
+ * #regex_set_exec.
+ *
+ * @param[in] set	to prepare.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int regex_set_compile(fr_regex_set_t *set)
+{
+	if (!set->num) {
+		fr_strerror_const("No expressions to match");
+		return -1;
+	}
+
+#ifdef HAVE_REGEX_PCRE2
+	if (!set->merged) return regex_set_merge(set);
+#endif
+
+	return 0;
+}
+
+/** Find the first expression in a set which matches the subject
+ *
+ * @param[out] idx	Index of the first expression (in the order they
+ *			were added) which matched.
+ * @param[in] set	of expressions to match.
+ * @param[in] subject	to match.
+ * @param[in] len	Length of subject.
+ * @return
+ *	- -1 on failure.
+ *	- 0 on no match.
+ *	- 1 on match.
+ */
+int regex_set_exec(uint32_t *idx, fr_regex_set_t const *set, char const *subject, size_t len)
+{
+	uint32_t	i;
+	int		ret;
+
+#ifdef HAVE_REGEX_PCRE2
+	if (set->merged) {
+		PCRE2_SPTR	mark;
+		unsigned long	num;
+		char		*end;
+
+		ret = regex_exec(set->merged, subject, len, NULL);
+		if (ret <= 0) return ret;
+
+		mark = pcre2_get_mark(fr_pcre2_tls->match_data);
+		if (!mark) {
+		bad_mark:
+			fr_strerror_const("Combined expression matched without setting a mark");
+			return -1;
+		}
+
+		num = strtoul((char const *)mark, &end, 10);
+		if ((*end != '\0') || (num >= set->num)) goto bad_mark;
+
+		*idx = num;
+		return 1;
+	}
+#endif
+
+	for (i = 0; i < set->num; i++) {
+		ret = regex_exec(set->pregs[i], subject, len, NULL);
+		if (ret == 0) continue;
+		if (ret < 0) return ret;
+
+		*idx = i;
+		return 1;
+	}
+
+	return 0;
+}
+
 /** Parse a string containing one or more regex flags
  *
  * @param[out] err		May be NULL. If not NULL will be set to:
@@ -1393,7 +1828,7 @@ int fr_regex_cmp_op(fr_token_t op, fr_value_box_t const *a, fr_value_box_t const
 		lhs_len = a->vb_length;
 	}
 
-	if (regex_compile(ctx, &regex, b->vb_strvalue, b->vb_length, NULL, false, true) < 0) {
+	if (regex_compile_cached(ctx, &regex, b->vb_strvalue, b->vb_length, NULL, false) < 0) {
 		talloc_free(ctx);
 		return -1;
 	}
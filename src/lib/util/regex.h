@@ -62,6 +62,8 @@ typedef struct {
 #endif
 } fr_regmatch_t;
 
+typedef struct fr_regex_cache_entry_s fr_regex_cache_entry_t;
+
 typedef struct {
 	pcre2_code		*compiled;	//!< Compiled regular expression.
 	uint32_t		subcaptures;	//!< Number of subcaptures contained within the expression.
@@ -69,6 +71,8 @@ typedef struct {
 	bool			precompiled;	//!< Whether this regex was precompiled,
 						///< or compiled for one off evaluation.
 	bool			jitd;		//!< Whether JIT data is available.
+	fr_regex_cache_entry_t	*cached;	//!< Cache entry which owns the compiled expression,
+						///< if this is a handle returned by #regex_compile_cached.
 } regex_t;
 /*
  *######################################
@@ -176,6 +180,8 @@ ssize_t		regex_flags_print(fr_sbuff_t *sbuff, fr_regex_flags_t const *flags);
 
 	ssize_t		regex_compile(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_t len,
 			      fr_regex_flags_t const *flags, bool subcaptures, bool runtime);
+ssize_t		regex_compile_cached(TALLOC_CTX *ctx, regex_t **out, char const *pattern, size_t len,
+				     fr_regex_flags_t const *flags, bool subcaptures);
 int		regex_exec(regex_t *preg, char const *subject, size_t len, fr_regmatch_t *regmatch) CC_HINT(nonnull(1,2));
 #ifdef HAVE_REGEX_PCRE2
 int		regex_substitute(TALLOC_CTX *ctx, char **out, size_t max_out, regex_t *preg, fr_regex_flags_t const *flags,
@@ -184,6 +190,15 @@ int		regex_substitute(TALLOC_CTX *ctx, char **out, size_t max_out, regex_t *preg
 				 fr_regmatch_t *regmatch);
 #endif
 uint32_t	regex_subcapture_count(regex_t const *preg);
+
+typedef struct fr_regex_set_s fr_regex_set_t;
+
+fr_regex_set_t	*regex_set_alloc(TALLOC_CTX *ctx);
+ssize_t		regex_set_add(fr_regex_set_t *set, char const *pattern, size_t len, fr_regex_flags_t const *flags)
+		CC_HINT(nonnull(1,2));
+int		regex_set_compile(fr_regex_set_t *set) CC_HINT(nonnull);
+int		regex_set_exec(uint32_t *idx, fr_regex_set_t const *set, char const *subject, size_t len)
+		CC_HINT(nonnull(1,2,3));
 fr_regmatch_t	*regex_match_data_alloc(TALLOC_CTX *ctx, uint32_t count);
 
 int		fr_regex_cmp_op(fr_token_t op, fr_value_box_t const *a, fr_value_box_t const *b) CC_HINT(nonnull);
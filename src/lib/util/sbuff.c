@@ -26,6 +26,14 @@ RCSID("$Id$")
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/atexit.h>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  include <immintrin.h>
+#  define SBUFF_SCAN_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define SBUFF_SCAN_NEON 1
+#endif
+
 
 static _Thread_local char *sbuff_scratch;
 
@@ -483,6 +491,239 @@ int fr_sbuff_reset_talloc(fr_sbuff_t *sbuff)
 	(((_max) - (_used)) > fr_sbuff_remaining(_sbuff) ? (_sbuff)->end : (_sbuff)->p + ((_max) - (_used)))
 
 
+/*
+ *	Character set scanning
+ *
+ *	A set of characters is held as a bitmap, indexed by the low nibble
+ *	of the character, with one bit for each value of the high nibble.
+ *	Characters with the top bit set are in a separate table.  Checking
+ *	16 or 32 characters against the set then takes three table lookups
+ *	(pshufb, or tbl on ARM), which works for any set of characters,
+ *	not just small ones.
+ *
+ *	Building the set costs more than scanning a short string a byte
+ *	at a time, and most tokens are short.  So the first
+ *	SBUFF_SCAN_PREFIX bytes are always checked a byte at a time, and
+ *	the set is only built if the run continues past them.
+ */
+#define SBUFF_SCAN_PREFIX	32
+
+typedef struct {
+	uint8_t		lo[16];		//!< Bit n is set if (n << 4) | idx is in the set.
+	uint8_t		hi[16];		//!< Bit n is set if ((n + 8) << 4) | idx is in the set.
+	bool		init;		//!< Whether the set has been built.
+} sbuff_charset_t;
+
+static inline CC_HINT(always_inline) bool sbuff_charset_has(sbuff_charset_t const *cs, uint8_t c)
+{
+	return (((c & 0x80) ? cs->hi : cs->lo)[c & 0x0f] & (1 << ((c >> 4) & 0x07))) != 0;
+}
+
+static inline CC_HINT(always_inline) void sbuff_charset_del(sbuff_charset_t *cs, uint8_t c)
+{
+	((c & 0x80) ? cs->hi : cs->lo)[c & 0x0f] &= (uint8_t)~(1 << ((c >> 4) & 0x07));
+}
+
+/** Build a set of bytes which are allowed, and can't start a terminal
+ *
+ */
+static void sbuff_charset_init_allowed(sbuff_charset_t *cs, bool const allowed[static UINT8_MAX + 1],
+				       fr_sbuff_term_t const *tt)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 16; i++) {
+		uint8_t lo = 0, hi = 0;
+
+		for (j = 0; j < 8; j++) {
+			lo |= (uint8_t)(allowed[(j << 4) | i] << j);
+			hi |= (uint8_t)(allowed[((j + 8) << 4) | i] << j);
+		}
+		cs->lo[i] = lo;
+		cs->hi[i] = hi;
+	}
+
+	if (tt) for (i = 0; i < tt->len; i++) sbuff_charset_del(cs, (uint8_t)tt->elem[i].str[0]);
+
+	cs->init = true;
+}
+
+/** Build a set of bytes which can't start a terminal, and aren't the escape character
+ *
+ */
+static void sbuff_charset_init_until(sbuff_charset_t *cs, fr_sbuff_term_t const *tt, char escape_chr)
+{
+	unsigned int i;
+
+	memset(cs->lo, 0xff, sizeof(cs->lo));
+	memset(cs->hi, 0xff, sizeof(cs->hi));
+
+	if (tt) for (i = 0; i < tt->len; i++) sbuff_charset_del(cs, (uint8_t)tt->elem[i].str[0]);
+	if (escape_chr != '\0') sbuff_charset_del(cs, (uint8_t)escape_chr);
+
+	cs->init = true;
+}
+
+static size_t sbuff_span_scalar(sbuff_charset_t const *cs, uint8_t const *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; (i < len) && sbuff_charset_has(cs, p[i]); i++);
+
+	return i;
+}
+
+#ifdef SBUFF_SCAN_X86
+CC_HINT(target("avx2")) static size_t sbuff_span_avx2(sbuff_charset_t const *cs, uint8_t const *p, size_t len)
+{
+	__m256i	lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)cs->lo));
+	__m256i	hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)cs->hi));
+	__m256i	bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+					1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	__m256i	nibble = _mm256_set1_epi8(0x0f);
+	__m256i	top = _mm256_set1_epi8((char)0x80);
+	size_t	i;
+
+	for (i = 0; (i + 32) <= len; i += 32) {
+		__m256i		c = _mm256_loadu_si256((__m256i const *)(p + i));
+		__m256i		row, col;
+		uint32_t	miss;
+
+		/*
+		 *	shuffle returns 0 for indexes with the top bit set,
+		 *	so each character only matches in one of the tables.
+		 */
+		row = _mm256_or_si256(_mm256_shuffle_epi8(lo, c), _mm256_shuffle_epi8(hi, _mm256_xor_si256(c, top)));
+		col = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble));
+
+		miss = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, col),
+									 _mm256_setzero_si256()));
+		if (miss) return i + __builtin_ctz(miss);
+	}
+
+	return i + sbuff_span_scalar(cs, p + i, len - i);
+}
+
+CC_HINT(target("ssse3")) static size_t sbuff_span_ssse3(sbuff_charset_t const *cs, uint8_t const *p, size_t len)
+{
+	__m128i	lo = _mm_loadu_si128((__m128i const *)cs->lo);
+	__m128i	hi = _mm_loadu_si128((__m128i const *)cs->hi);
+	__m128i	bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	__m128i	nibble = _mm_set1_epi8(0x0f);
+	__m128i	top = _mm_set1_epi8((char)0x80);
+	size_t	i;
+
+	for (i = 0; (i + 16) <= len; i += 16) {
+		__m128i		c = _mm_loadu_si128((__m128i const *)(p + i));
+		__m128i		row, col;
+		uint32_t	miss;
+
+		row = _mm_or_si128(_mm_shuffle_epi8(lo, c), _mm_shuffle_epi8(hi, _mm_xor_si128(c, top)));
+		col = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(c, 4), nibble));
+
+		miss = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, col), _mm_setzero_si128()));
+		if (miss) return i + __builtin_ctz(miss);
+	}
+
+	return i + sbuff_span_scalar(cs, p + i, len - i);
+}
+#endif
+
+#ifdef SBUFF_SCAN_NEON
+static size_t sbuff_span_neon(sbuff_charset_t const *cs, uint8_t const *p, size_t len)
+{
+	static uint8_t const bits_table[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t	lo = vld1q_u8(cs->lo);
+	uint8x16_t	hi = vld1q_u8(cs->hi);
+	uint8x16_t	bits = vld1q_u8(bits_table);
+	uint8x16_t	mask = vdupq_n_u8(0x8f);
+	uint8x16_t	top = vdupq_n_u8(0x80);
+	size_t		i;
+
+	for (i = 0; (i + 16) <= len; i += 16) {
+		uint8x16_t	c = vld1q_u8(p + i);
+		uint8x16_t	row, col;
+
+		/*
+		 *	tbl returns 0 for indexes >= 16, so each character
+		 *	only matches in one of the tables.
+		 */
+		row = vorrq_u8(vqtbl1q_u8(lo, vandq_u8(c, mask)), vqtbl1q_u8(hi, vandq_u8(veorq_u8(c, top), mask)));
+		col = vqtbl1q_u8(bits, vshrq_n_u8(c, 4));
+
+		if (vminvq_u8(vtstq_u8(row, col)) != 0xff) break;
+	}
+
+	return i + sbuff_span_scalar(cs, p + i, len - i);
+}
+#endif
+
+/** Return the number of bytes at the start of p which are in the set
+ *
+ */
+static size_t sbuff_span(sbuff_charset_t const *cs, char const *p, char const *end)
+{
+	size_t len = end - p;
+
+#ifdef SBUFF_SCAN_X86
+	if (__builtin_cpu_supports("avx2")) return sbuff_span_avx2(cs, (uint8_t const *)p, len);
+	if (__builtin_cpu_supports("ssse3")) return sbuff_span_ssse3(cs, (uint8_t const *)p, len);
+#elif defined(SBUFF_SCAN_NEON)
+	return sbuff_span_neon(cs, (uint8_t const *)p, len);
+#endif
+
+	return sbuff_span_scalar(cs, (uint8_t const *)p, len);
+}
+
+/** Advance past characters which are allowed, and can't start a terminal
+ *
+ * @param[in] p		where to start.
+ * @param[in] end	where to stop.
+ * @param[in] allowed	characters.
+ * @param[in] tt	terminals, or NULL if there are none.
+ * @param[in] idx	terminal index, populated by fr_sbuff_terminal_idx_init.
+ * @param[in,out] cs	set of characters to skip.  Built on first use.
+ * @return the first character which isn't allowed, or may start a terminal.
+ */
+static inline CC_HINT(always_inline) char const *sbuff_skip_allowed(char const *p, char const *end,
+								    bool const allowed[static UINT8_MAX + 1],
+								    fr_sbuff_term_t const *tt, uint8_t const *idx,
+								    sbuff_charset_t *cs)
+{
+	char const *prefix_end = ((end - p) > SBUFF_SCAN_PREFIX) ? p + SBUFF_SCAN_PREFIX : end;
+
+	while ((p < prefix_end) && allowed[(uint8_t)*p] && !(tt && idx[(uint8_t)*p])) p++;
+	if ((p < prefix_end) || (p == end)) return p;
+
+	if (!cs->init) sbuff_charset_init_allowed(cs, allowed, tt);
+
+	return p + sbuff_span(cs, p, end);
+}
+
+/** Advance past characters which can't start a terminal, and aren't the escape character
+ *
+ * @param[in] p		where to start.
+ * @param[in] end	where to stop.
+ * @param[in] tt	terminals, or NULL if there are none.
+ * @param[in] idx	terminal index, populated by fr_sbuff_terminal_idx_init.
+ * @param[in] escape_chr	to stop at, or '\0'.
+ * @param[in,out] cs	set of characters to skip.  Built on first use.
+ * @return the first character which may start a terminal, or is the escape character.
+ */
+static inline CC_HINT(always_inline) char const *sbuff_skip_until(char const *p, char const *end,
+								  fr_sbuff_term_t const *tt, uint8_t const *idx,
+								  char escape_chr, sbuff_charset_t *cs)
+{
+	char const *prefix_end = ((end - p) > SBUFF_SCAN_PREFIX) ? p + SBUFF_SCAN_PREFIX : end;
+
+	while ((p < prefix_end) && !(tt && idx[(uint8_t)*p]) && ((escape_chr == '\0') || (*p != escape_chr))) p++;
+	if ((p < prefix_end) || (p == end)) return p;
+
+	if (!cs->init) sbuff_charset_init_until(cs, tt, escape_chr);
+
+	return p + sbuff_span(cs, p, end);
+}
+
 /** Populate a terminal index
  *
  * @param[out] needle_len	the longest needle.  Will not be set
@@ -794,6 +1035,7 @@ size_t fr_sbuff_out_bstrncpy_allowed(fr_sbuff_t *out, fr_sbuff_t *in, size_t len
 				     bool const allowed[static UINT8_MAX + 1])
 {
 	fr_sbuff_t 	our_in = FR_SBUFF_BIND_CURRENT(in);
+	sbuff_charset_t	cs = { .init = false };
 
 	CHECK_SBUFF_INIT(in);
 
@@ -806,7 +1048,7 @@ size_t fr_sbuff_out_bstrncpy_allowed(fr_sbuff_t *out, fr_sbuff_t *in, size_t len
 		p = fr_sbuff_current(&our_in);
 		end = CONSTRAINED_END(&our_in, len, fr_sbuff_used_total(&our_in));
 
-		while ((p < end) && allowed[(uint8_t)*p]) p++;
+		p = UNCONST(char *, sbuff_skip_allowed(p, end, allowed, NULL, NULL, &cs));
 
 		FILL_OR_GOTO_DONE(out, &our_in, p - our_in.p);
 
@@ -846,6 +1088,7 @@ size_t fr_sbuff_out_bstrncpy_until(fr_sbuff_t *out, fr_sbuff_t *in, size_t len,
 	uint8_t		idx[UINT8_MAX + 1];		/* Fast path index */
 	size_t		needle_len = 1;
 	char		escape_chr = u_rules ? u_rules->chr : '\0';
+	sbuff_charset_t	cs = { .init = false };
 
 	CHECK_SBUFF_INIT(in);
 
@@ -867,7 +1110,11 @@ size_t fr_sbuff_out_bstrncpy_until(fr_sbuff_t *out, fr_sbuff_t *in, size_t len,
 		if (p == end) break;
 
 		if (escape_chr == '\0') {
-			while ((p < end) && !fr_sbuff_terminal_search(in, p, idx, tt, needle_len)) p++;
+			while (p < end) {
+				p = UNCONST(char *, sbuff_skip_until(p, end, tt, idx, '\0', &cs));
+				if ((p == end) || fr_sbuff_terminal_search(in, p, idx, tt, needle_len)) break;
+				p++;
+			}
 		} else {
 			while (p < end) {
 				if (do_escape) {
@@ -876,6 +1123,9 @@ size_t fr_sbuff_out_bstrncpy_until(fr_sbuff_t *out, fr_sbuff_t *in, size_t len,
 					do_escape = true;
 				} else if (fr_sbuff_terminal_search(in, p, idx, tt, needle_len)) {
 					break;
+				} else {
+					p = UNCONST(char *, sbuff_skip_until(p + 1, end, tt, idx, escape_chr, &cs));
+					continue;
 				}
 				p++;
 			}
@@ -1759,6 +2009,7 @@ size_t fr_sbuff_adv_past_allowed(fr_sbuff_t *sbuff, size_t len, bool
 	char const	*p;
 	uint8_t		idx[UINT8_MAX + 1];	/* Fast path index */
 	size_t		needle_len = 0;
+	sbuff_charset_t	cs = { .init = false };
 
 	CHECK_SBUFF_INIT(sbuff);
 
@@ -1771,11 +2022,13 @@ size_t fr_sbuff_adv_past_allowed(fr_sbuff_t *sbuff, size_t len, bool
 
 		end = CONSTRAINED_END(sbuff, len, total);
 		p = sbuff->p;
-		while ((p < end) && allowed[(uint8_t)*p]) {
-			if (needle_len == 0) {
-				p++;
-				continue;
-			}
+		while (p < end) {
+			/*
+			 *	Skip characters which are allowed, and
+			 *	can't start a terminal sequence.
+			 */
+			p = sbuff_skip_allowed(p, end, allowed, needle_len ? tt : NULL, idx, &cs);
+			if ((p == end) || !allowed[(uint8_t)*p]) break;
 
 		       /*
 			*	If this character is allowed, BUT is also listed as a one-character terminal,
@@ -1835,6 +2088,7 @@ size_t fr_sbuff_adv_until(fr_sbuff_t *sbuff, size_t len, fr_sbuff_term_t const *
 
 	uint8_t		idx[UINT8_MAX + 1];		/* Fast path index */
 	size_t		needle_len = 1;
+	sbuff_charset_t	cs = { .init = false };
 
 	CHECK_SBUFF_INIT(sbuff);
 
@@ -1853,7 +2107,11 @@ size_t fr_sbuff_adv_until(fr_sbuff_t *sbuff, size_t len, fr_sbuff_term_t const *
 		p = sbuff->p;
 
 		if (escape_chr == '\0') {
-			while ((p < end) && !fr_sbuff_terminal_search(sbuff, p, idx, tt, needle_len)) p++;
+			while (p < end) {
+				p = sbuff_skip_until(p, end, tt, idx, '\0', &cs);
+				if ((p == end) || fr_sbuff_terminal_search(sbuff, p, idx, tt, needle_len)) break;
+				p++;
+			}
 		} else {
 			while (p < end) {
 				if (do_escape) {
@@ -1862,6 +2120,9 @@ size_t fr_sbuff_adv_until(fr_sbuff_t *sbuff, size_t len, fr_sbuff_term_t const *
 					do_escape = true;
 				} else if (fr_sbuff_terminal_search(sbuff, p, idx, tt, needle_len)) {
 					break;
+				} else {
+					p = sbuff_skip_until(p + 1, end, tt, idx, escape_chr, &cs);
+					continue;
 				}
 				p++;
 			}
@@ -24,6 +24,7 @@
 #include <freeradius-devel/util/acutest_helpers.h>
 
 #include "sbuff.h"
+#include "time.h"
 
 //#include <gperftools/profiler.h>
 
@@ -1301,6 +1302,181 @@ static void test_adv_until(void)
 	TEST_CHECK(sbuff.p == (sbuff.start + 5));
 }
 
+/*
+ *	Long runs are scanned 16 or 32 bytes at a time, so put the terminal
+ *	at, and either side of, every offset up to a few vectors in.
+ */
+#define TEST_LONG_LEN	200
+
+static void test_adv_until_long(void)
+{
+	fr_sbuff_t	sbuff;
+	char		in[TEST_LONG_LEN + 1];
+	size_t		i;
+
+	TEST_CASE("Check for terminal at every offset");
+	for (i = 0; i < TEST_LONG_LEN; i++) {
+		memset(in, 'a', TEST_LONG_LEN);
+		in[TEST_LONG_LEN] = '\0';
+		in[i] = '|';
+
+		fr_sbuff_init_in(&sbuff, in, TEST_LONG_LEN);
+		TEST_CHECK_LEN(fr_sbuff_adv_until(&sbuff, SIZE_MAX, &FR_SBUFF_TERM("|"), '\0'), i);
+		TEST_CHECK(sbuff.p == (in + i));
+	}
+
+	TEST_CASE("Check for high bit terminal at every offset");
+	for (i = 0; i < TEST_LONG_LEN; i++) {
+		memset(in, 0xc3, TEST_LONG_LEN);
+		in[TEST_LONG_LEN] = '\0';
+		in[i] = (char)0xa9;
+
+		fr_sbuff_init_in(&sbuff, in, TEST_LONG_LEN);
+		TEST_CHECK_LEN(fr_sbuff_adv_until(&sbuff, SIZE_MAX, &FR_SBUFF_TERM("\xa9"), '\0'), i);
+	}
+
+	TEST_CASE("Check multi-char terminal prefix doesn't stop the scan");
+	memset(in, 'a', TEST_LONG_LEN);
+	in[TEST_LONG_LEN] = '\0';
+	in[100] = '=';
+	in[150] = '=';
+	in[151] = '=';
+	fr_sbuff_init_in(&sbuff, in, TEST_LONG_LEN);
+	TEST_CHECK_LEN(fr_sbuff_adv_until(&sbuff, SIZE_MAX, &FR_SBUFF_TERM("=="), '\0'), 150);
+
+	TEST_CASE("Check escaped terminals are skipped");
+	memset(in, 'a', TEST_LONG_LEN);
+	in[TEST_LONG_LEN] = '\0';
+	in[63] = '\\';
+	in[64] = '|';
+	in[130] = '|';
+	fr_sbuff_init_in(&sbuff, in, TEST_LONG_LEN);
+	TEST_CHECK_LEN(fr_sbuff_adv_until(&sbuff, SIZE_MAX, &FR_SBUFF_TERM("|"), '\\'), 130);
+
+	TEST_CASE("Check length constraint in a long run");
+	memset(in, 'a', TEST_LONG_LEN);
+	in[TEST_LONG_LEN] = '\0';
+	fr_sbuff_init_in(&sbuff, in, TEST_LONG_LEN);
+	TEST_CHECK_LEN(fr_sbuff_adv_until(&sbuff, 77, &FR_SBUFF_TERM("|"), '\0'), 77);
+}
+
+static void test_adv_past_allowed_long(void)
+{
+	fr_sbuff_t	sbuff;
+	char		in[TEST_LONG_LEN + 1];
+	size_t		i;
+
+	TEST_CASE("Check for disallowed char at every offset");
+	for (i = 0; i < TEST_LONG_LEN; i++) {
+		memset(in, '0', TEST_LONG_LEN);
+		in[TEST_LONG_LEN] = '\0';
+		in[i] = 'x';
+
+		fr_sbuff_init_in(&sbuff, in, TEST_LONG_LEN);
+		TEST_CHECK_LEN(fr_sbuff_adv_past_allowed(&sbuff, SIZE_MAX, sbuff_char_class_int, NULL), i);
+	}
+
+	TEST_CASE("Check for high bit disallowed char at every offset");
+	for (i = 0; i < TEST_LONG_LEN; i++) {
+		memset(in, '0', TEST_LONG_LEN);
+		in[TEST_LONG_LEN] = '\0';
+		in[i] = (char)0x80;
+
+		fr_sbuff_init_in(&sbuff, in, TEST_LONG_LEN);
+		TEST_CHECK_LEN(fr_sbuff_adv_past_allowed(&sbuff, SIZE_MAX, sbuff_char_class_int, NULL), i);
+	}
+
+	TEST_CASE("Check disallowed char with terminals");
+	memset(in, '0', TEST_LONG_LEN);
+	in[TEST_LONG_LEN] = '\0';
+	in[99] = '9';
+	in[150] = 'x';
+	fr_sbuff_init_in(&sbuff, in, TEST_LONG_LEN);
+	TEST_CHECK_LEN(fr_sbuff_adv_past_allowed(&sbuff, SIZE_MAX, sbuff_char_class_int, &FR_SBUFF_TERM("9")), 150);
+
+	TEST_CASE("Check for whole buffer");
+	memset(in, '0', TEST_LONG_LEN);
+	in[TEST_LONG_LEN] = '\0';
+	fr_sbuff_init_in(&sbuff, in, TEST_LONG_LEN);
+	TEST_CHECK_LEN(fr_sbuff_adv_past_allowed(&sbuff, SIZE_MAX, sbuff_char_class_int, NULL), TEST_LONG_LEN);
+	TEST_CHECK(sbuff.p == sbuff.end);
+}
+
+static void test_bstrncpy_until_long(void)
+{
+	fr_sbuff_t	sbuff;
+	char		in[TEST_LONG_LEN + 1];
+	char		out[TEST_LONG_LEN + 1];
+	size_t		i;
+
+	TEST_CASE("Copy up to terminal at every offset");
+	for (i = 0; i < TEST_LONG_LEN; i++) {
+		memset(in, 'a', TEST_LONG_LEN);
+		in[TEST_LONG_LEN] = '\0';
+		in[i] = ' ';
+
+		fr_sbuff_init_in(&sbuff, in, TEST_LONG_LEN);
+		TEST_CHECK_LEN(fr_sbuff_out_bstrncpy_until(&FR_SBUFF_OUT(out, sizeof(out)), &sbuff, SIZE_MAX,
+							    &FR_SBUFF_TERM(" "), NULL), i);
+		TEST_CHECK(strspn(out, "a") == i);
+		TEST_CHECK(out[i] == '\0');
+	}
+}
+
+/*
+ *	Throughput of the scanning functions over long runs
+ */
+#define SBUFF_BENCH_LEN		4096
+#define SBUFF_BENCH_ROUNDS	10000
+
+static void test_adv_until_benchmark(void)
+{
+	fr_sbuff_t	sbuff;
+	static char	in[SBUFF_BENCH_LEN];
+	fr_time_t	start, stop;
+	uint64_t	rate;
+	size_t		i;
+
+	memset(in, 'a', sizeof(in));
+
+	start = fr_time();
+	for (i = 0; i < SBUFF_BENCH_ROUNDS; i++) {
+		fr_sbuff_init_in(&sbuff, in, sizeof(in));
+		fr_sbuff_adv_until(&sbuff, SIZE_MAX, &FR_SBUFF_TERMS(L("\t"), L("\n"), L(" "), L("==")), '\\');
+	}
+	stop = fr_time();
+
+	rate = (uint64_t)((float)NSEC / (fr_time_delta_unwrap(fr_time_sub(stop, start)) / SBUFF_BENCH_ROUNDS));
+	printf("adv_until rate %" PRIu64 " (%" PRIu64 " MB/s)\n", rate, (rate * SBUFF_BENCH_LEN) / (1024 * 1024));
+
+	/* shared runners are terrible for performance tests */
+	if (!getenv("NO_PERFORMANCE_TESTS")) TEST_CHECK(rate > 10000);
+}
+
+static void test_adv_past_allowed_benchmark(void)
+{
+	fr_sbuff_t	sbuff;
+	static char	in[SBUFF_BENCH_LEN];
+	fr_time_t	start, stop;
+	uint64_t	rate;
+	size_t		i;
+
+	memset(in, '7', sizeof(in));
+
+	start = fr_time();
+	for (i = 0; i < SBUFF_BENCH_ROUNDS; i++) {
+		fr_sbuff_init_in(&sbuff, in, sizeof(in));
+		fr_sbuff_adv_past_allowed(&sbuff, SIZE_MAX, sbuff_char_class_hex, NULL);
+	}
+	stop = fr_time();
+
+	rate = (uint64_t)((float)NSEC / (fr_time_delta_unwrap(fr_time_sub(stop, start)) / SBUFF_BENCH_ROUNDS));
+	printf("adv_past_allowed rate %" PRIu64 " (%" PRIu64 " MB/s)\n", rate, (rate * SBUFF_BENCH_LEN) / (1024 * 1024));
+
+	/* shared runners are terrible for performance tests */
+	if (!getenv("NO_PERFORMANCE_TESTS")) TEST_CHECK(rate > 10000);
+}
+
 static void test_adv_to_utf8(void)
 {
 	fr_sbuff_t	sbuff;
@@ -1609,6 +1785,9 @@ TEST_LIST = {
 	{ "fr_sbuff_adv_past_whitespace",	test_adv_past_whitespace },
 	{ "fr_sbuff_adv_past_allowed",		test_adv_past_allowed },
 	{ "fr_sbuff_adv_until",			test_adv_until },
+	{ "fr_sbuff_adv_until_long",		test_adv_until_long },
+	{ "fr_sbuff_adv_past_allowed_long",	test_adv_past_allowed_long },
+	{ "fr_sbuff_out_bstrncpy_until_long",	test_bstrncpy_until_long },
 
 	/*
 	 *	Token searching
@@ -1624,5 +1803,11 @@ TEST_LIST = {
 	{ "fr_sbuff_next_if_char",		test_next_if_char },
 	{ "fr_sbuff_next_unless_char", 		test_next_unless_char },
 
+	/*
+	 *	Performance
+	 */
+	{ "fr_sbuff_adv_until_benchmark",	test_adv_until_benchmark },
+	{ "fr_sbuff_adv_past_allowed_benchmark",test_adv_past_allowed_benchmark },
+
 	{ NULL }
 };
@@ -8,6 +8,7 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/util/hw.h>
 #include <freeradius-devel/util/sha1.h>
 
 
@@ -192,3 +193,225 @@ void fr_sha1_final_no_len(uint8_t digest[static SHA1_DIGEST_LENGTH], fr_sha1_ctx
 #  endif
 }
 #endif
+
+#define SHA1_BLOCK_LENGTH 64
+
+/** Per-message state for fr_sha1_calc_multi()
+ *
+ */
+typedef struct {
+	fr_sha1_multi_t const	*in;			//!< Message being hashed.
+	size_t			offset;			//!< How much of the message has been read.
+	bool			padded;			//!< Whether the 0x80 terminator has been added.
+	bool			done;			//!< Whether the final block has been returned.
+} fr_sha1_lane_t;
+
+/** Fill the next block of a message, including any SHA1 padding
+ *
+ * @param[out] block	to fill.
+ * @param[in] lane	to read from.
+ * @return
+ *	- true if the block was filled.
+ *	- false if the message has been completely hashed.
+ */
+static bool fr_sha1_lane_fill(uint8_t block[static SHA1_BLOCK_LENGTH], fr_sha1_lane_t *lane)
+{
+	size_t		n, i;
+	uint64_t	total;
+
+	if (lane->done) return false;
+
+	n = lane->in->inlen - lane->offset;
+	if (n > SHA1_BLOCK_LENGTH) n = SHA1_BLOCK_LENGTH;
+	if (n > 0) {
+		memcpy(block, lane->in->in + lane->offset, n);
+		lane->offset += n;
+	}
+
+	if (n == SHA1_BLOCK_LENGTH) return true;
+
+	if (!lane->padded) {
+		block[n++] = 0x80;
+		lane->padded = true;
+	}
+
+	/*
+	 *	No room for the length, it goes into the next block.
+	 */
+	if (n > (SHA1_BLOCK_LENGTH - 8)) {
+		memset(block + n, 0, SHA1_BLOCK_LENGTH - n);
+		return true;
+	}
+
+	memset(block + n, 0, (SHA1_BLOCK_LENGTH - 8) - n);
+
+	total = (uint64_t) lane->in->inlen << 3;
+	for (i = 0; i < 8; i++) block[(SHA1_BLOCK_LENGTH - 8) + i] = (uint8_t) (total >> ((7 - i) * 8));
+
+	lane->done = true;
+
+	return true;
+}
+
+#define SHA1_ROL_MULTI(_v, _bits) (((_v) << (_bits)) | ((_v) >> (32 - (_bits))))
+
+/*
+ *	One step for all lanes.  Each lane is independent, so the
+ *	compiler can turn the loop into SIMD instructions.
+ */
+#define SHA1STEP_MULTI(_f, _k) do { \
+	for (l = 0; l < SHA1_MULTI_LANES; l++) { \
+		uint32_t t = SHA1_ROL_MULTI(a[l], 5) + _f(b[l], c[l], d[l]) + e[l] + (_k) + w[i & 15][l]; \
+		e[l] = d[l]; \
+		d[l] = c[l]; \
+		c[l] = SHA1_ROL_MULTI(b[l], 30); \
+		b[l] = a[l]; \
+		a[l] = t; \
+	} \
+} while (0)
+
+/*
+ *	Expand the message schedule in place, as blk() does.
+ */
+#define SHA1_EXPAND_MULTI() do { \
+	for (l = 0; l < SHA1_MULTI_LANES; l++) { \
+		uint32_t x = w[(i + 13) & 15][l] ^ w[(i + 8) & 15][l] ^ w[(i + 2) & 15][l] ^ w[i & 15][l]; \
+		w[i & 15][l] = SHA1_ROL_MULTI(x, 1); \
+	} \
+} while (0)
+
+#define SHA1_F1(_x, _y, _z)	((_z) ^ ((_x) & ((_y) ^ (_z))))
+#define SHA1_F2(_x, _y, _z)	((_x) ^ (_y) ^ (_z))
+#define SHA1_F3(_x, _y, _z)	(((_x) & (_y)) | (((_x) | (_y)) & (_z)))
+
+/** Run the SHA1 transform over one block from each of SHA1_MULTI_LANES messages
+ *
+ * The state is stored as [word][lane], so that the same word of each
+ * lane is contiguous in memory.
+ *
+ * On x86_64 AVX2 and AVX-512 versions are also built, and the best one
+ * for the CPU is used.
+ *
+ * @param[in,out] state	of each lane.
+ * @param[in] block	for each lane.
+ */
+static void FR_HW_TARGET_CLONES fr_sha1_multi_transform(uint32_t state[static 5][SHA1_MULTI_LANES],
+						     uint8_t const block[static SHA1_MULTI_LANES][SHA1_BLOCK_LENGTH])
+{
+	uint32_t	w[16][SHA1_MULTI_LANES];
+	uint32_t	a[SHA1_MULTI_LANES], b[SHA1_MULTI_LANES], c[SHA1_MULTI_LANES];
+	uint32_t	d[SHA1_MULTI_LANES], e[SHA1_MULTI_LANES];
+	unsigned int	i, l;
+
+	for (i = 0; i < 16; i++) {
+		for (l = 0; l < SHA1_MULTI_LANES; l++) {
+			uint8_t const *p = block[l] + (i * 4);
+
+			w[i][l] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+		}
+	}
+
+	memcpy(a, state[0], sizeof(a));
+	memcpy(b, state[1], sizeof(b));
+	memcpy(c, state[2], sizeof(c));
+	memcpy(d, state[3], sizeof(d));
+	memcpy(e, state[4], sizeof(e));
+
+	for (i = 0; i < 16; i++) SHA1STEP_MULTI(SHA1_F1, 0x5A827999);
+	for (; i < 20; i++) {
+		SHA1_EXPAND_MULTI();
+		SHA1STEP_MULTI(SHA1_F1, 0x5A827999);
+	}
+	for (; i < 40; i++) {
+		SHA1_EXPAND_MULTI();
+		SHA1STEP_MULTI(SHA1_F2, 0x6ED9EBA1);
+	}
+	for (; i < 60; i++) {
+		SHA1_EXPAND_MULTI();
+		SHA1STEP_MULTI(SHA1_F3, 0x8F1BBCDC);
+	}
+	for (; i < 80; i++) {
+		SHA1_EXPAND_MULTI();
+		SHA1STEP_MULTI(SHA1_F2, 0xCA62C1D6);
+	}
+
+	for (l = 0; l < SHA1_MULTI_LANES; l++) {
+		state[0][l] += a[l];
+		state[1][l] += b[l];
+		state[2][l] += c[l];
+		state[3][l] += d[l];
+		state[4][l] += e[l];
+	}
+}
+
+/** Calculate the SHA1 digests of multiple messages
+ *
+ * Up to SHA1_MULTI_LANES messages are hashed at the same time, which
+ * is significantly faster than hashing them one by one when there are
+ * several short messages.
+ *
+ * This always uses the local SHA1 implementation, as OpenSSL has no
+ * interface for hashing independent messages in parallel.
+ *
+ * @param[out] out	Where to write the digests, one per message.
+ * @param[in] in	Messages to hash.
+ * @param[in] num	Number of messages.
+ */
+void fr_sha1_calc_multi(uint8_t out[][SHA1_DIGEST_LENGTH], fr_sha1_multi_t const *in, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i += SHA1_MULTI_LANES) {
+		fr_sha1_lane_t	lane[SHA1_MULTI_LANES] = {};
+		uint32_t	state[5][SHA1_MULTI_LANES];
+		uint8_t		block[SHA1_MULTI_LANES][SHA1_BLOCK_LENGTH];
+		unsigned int	l, w, lanes = ((num - i) < SHA1_MULTI_LANES) ? (unsigned int) (num - i) : SHA1_MULTI_LANES;
+
+		for (l = 0; l < SHA1_MULTI_LANES; l++) {
+			/*
+			 *	Unused lanes hash the first message again,
+			 *	and the result is ignored.
+			 */
+			lane[l].in = &in[i + ((l < lanes) ? l : 0)];
+			state[0][l] = 0x67452301;
+			state[1][l] = 0xEFCDAB89;
+			state[2][l] = 0x98BADCFE;
+			state[3][l] = 0x10325476;
+			state[4][l] = 0xC3D2E1F0;
+		}
+
+		for (;;) {
+			uint32_t	saved[5][SHA1_MULTI_LANES];
+			bool		active[SHA1_MULTI_LANES];
+			bool		any = false;
+
+			for (l = 0; l < SHA1_MULTI_LANES; l++) {
+				active[l] = fr_sha1_lane_fill(block[l], &lane[l]);
+				any |= active[l];
+			}
+			if (!any) break;
+
+			/*
+			 *	Finished lanes have their state
+			 *	restored after the transform.
+			 */
+			memcpy(saved, state, sizeof(saved));
+			fr_sha1_multi_transform(state, (uint8_t const (*)[SHA1_BLOCK_LENGTH]) block);
+
+			for (l = 0; l < SHA1_MULTI_LANES; l++) {
+				if (active[l]) continue;
+
+				for (w = 0; w < 5; w++) state[w][l] = saved[w][l];
+			}
+		}
+
+		for (l = 0; l < lanes; l++) {
+			for (w = 0; w < 5; w++) {
+				out[i + l][(w * 4)] = (uint8_t) (state[w][l] >> 24);
+				out[i + l][(w * 4) + 1] = (uint8_t) (state[w][l] >> 16);
+				out[i + l][(w * 4) + 2] = (uint8_t) (state[w][l] >> 8);
+				out[i + l][(w * 4) + 3] = (uint8_t) state[w][l];
+			}
+		}
+	}
+}
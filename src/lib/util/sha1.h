@@ -21,6 +21,7 @@ extern "C" {
 #  include <openssl/sha.h>
 #endif
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -29,6 +30,19 @@ extern "C" {
 #  define SHA1_DIGEST_LENGTH 20
 #endif
 
+/** Number of messages fr_sha1_calc_multi() hashes in parallel
+ *
+ */
+#define SHA1_MULTI_LANES	4
+
+/** A message for fr_sha1_calc_multi()
+ *
+ */
+typedef struct {
+	uint8_t const	*in;
+	size_t		inlen;
+} fr_sha1_multi_t;
+
 #ifndef WITH_OPENSSL_SHA1
 typedef struct {
     uint32_t state[5];
@@ -56,6 +70,8 @@ USES_APPLE_DEPRECATED_API
 #  define fr_sha1_transform SHA1_Transform
 #endif
 
+void fr_sha1_calc_multi(uint8_t out[][SHA1_DIGEST_LENGTH], fr_sha1_multi_t const *in, size_t num);
+
 /* hmacsha1.c */
 
 int fr_hmac_sha1(uint8_t digest[static SHA1_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
@@ -0,0 +1,258 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/util/shared_image.c
+ * @brief Read only images, built once, and shared between processes via the page cache.
+ *
+ * Large immutable data, e.g. the index of a big CSV file, can be
+ * written out as a flat image, with offsets rather than pointers.  The
+ * image is then mmap'd read only by every process which needs it, so
+ * there's only ever one copy in memory, no matter how many radiusd
+ * processes are running on the host.
+ *
+ * When the image is missing or stale, it's rebuilt while holding an
+ * exclusive lock on a companion ".lock" file.  A process which starts
+ * while another is building waits for the lock, then finds a valid
+ * image and maps it, rather than building its own.  Images are
+ * written to a temporary file and renamed into place, so readers never
+ * see a partial image, and existing mappings of the old image stay
+ * valid.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/shared_image.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Map an existing image, and check it
+ *
+ * @return
+ *	- 0 if the image was mapped, and is valid.
+ *	- -1 if it doesn't exist, or isn't valid.
+ */
+static int shared_image_map(fr_shared_image_t *image, char const *path,
+			    fr_shared_image_check_t check, void *uctx)
+{
+	int		fd;
+	struct stat	sb;
+	void		*data;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+
+	if ((fstat(fd, &sb) < 0) || !S_ISREG(sb.st_mode) || (sb.st_size == 0)) {
+		close(fd);
+		return -1;
+	}
+
+	data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return -1;
+
+	if (check(data, sb.st_size, uctx) < 0) {
+		munmap(data, sb.st_size);
+		return -1;
+	}
+
+	*image = (fr_shared_image_t) {
+		.data = data,
+		.len = sb.st_size,
+		.mapped = true
+	};
+
+	return 0;
+}
+
+/** Write an image to a file
+ *
+ * The image is written to a temporary file, and renamed over the old
+ * one, so that other processes never see a partial image.
+ *
+ * @param[in] path	to write the image to.
+ * @param[in] data	of the image.
+ * @param[in] len	of the image.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_shared_image_write(char const *path, uint8_t const *data, size_t len)
+{
+	char	*tmp;
+	int	fd;
+
+	tmp = talloc_asprintf(NULL, "%s.%ld.tmp", path, (long) getpid());
+	if (!tmp) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fr_strerror_printf("Failed creating \"%s\" - %s", tmp, fr_syserror(errno));
+		talloc_free(tmp);
+		return -1;
+	}
+
+	while (len > 0) {
+		ssize_t slen;
+
+		slen = write(fd, data, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("Failed writing \"%s\" - %s", tmp, fr_syserror(errno));
+			close(fd);
+			goto error;
+		}
+
+		data += slen;
+		len -= slen;
+	}
+
+	if (close(fd) < 0) {
+		fr_strerror_printf("Failed writing \"%s\" - %s", tmp, fr_syserror(errno));
+		goto error;
+	}
+
+	if (rename(tmp, path) < 0) {
+		fr_strerror_printf("Failed renaming \"%s\" to \"%s\" - %s", tmp, path, fr_syserror(errno));
+	error:
+		unlink(tmp);
+		talloc_free(tmp);
+		return -1;
+	}
+
+	talloc_free(tmp);
+	return 0;
+}
+
+/** Map an image, building it first if it's missing or stale
+ *
+ * If the image can't be written, e.g. because the directory is read
+ * only, the newly built image is used as a private copy.  It works
+ * the same, it just isn't shared.
+ *
+ * @param[out] image	Where to write the image details.
+ * @param[in] ctx	to allocate a private copy of the image in.
+ * @param[in] path	of the image file.
+ * @param[in] check	called to check the image is valid.
+ * @param[in] build	called to build a new image.
+ * @param[in] uctx	passed to check and build.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the image couldn't be built.
+ */
+int fr_shared_image_open(fr_shared_image_t *image, TALLOC_CTX *ctx, char const *path,
+			 fr_shared_image_check_t check, fr_shared_image_build_t build, void *uctx)
+{
+	char		*lock_path;
+	int		lock_fd = -1;
+	uint8_t		*data;
+	size_t		len;
+
+	*image = (fr_shared_image_t) {};
+
+	if (shared_image_map(image, path, check, uctx) == 0) return 0;
+
+	/*
+	 *	Serialise builders.  If we can't create the lock
+	 *	file, we'll probably fail to write the image too,
+	 *	so just build a private copy.
+	 */
+	lock_path = talloc_asprintf(NULL, "%s.lock", path);
+	if (!lock_path) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+	talloc_free(lock_path);
+	if (lock_fd >= 0) {
+		while (flock(lock_fd, LOCK_EX) < 0) {
+			if (errno == EINTR) continue;
+
+			close(lock_fd);
+			lock_fd = -1;
+			break;
+		}
+	}
+
+	/*
+	 *	Someone else may have built it while we were
+	 *	waiting for the lock.
+	 */
+	if ((lock_fd >= 0) && (shared_image_map(image, path, check, uctx) == 0)) {
+		close(lock_fd);
+		return 0;
+	}
+
+	data = build(ctx, &len, uctx);
+	if (!data) {
+		if (lock_fd >= 0) close(lock_fd);
+		return -1;
+	}
+
+	if (fr_shared_image_write(path, data, len) == 0) {
+		if (shared_image_map(image, path, check, uctx) == 0) {
+			if (lock_fd >= 0) close(lock_fd);
+			talloc_free(data);
+			return 0;
+		}
+	}
+	if (lock_fd >= 0) close(lock_fd);
+
+	if (check(data, len, uctx) < 0) {
+		fr_strerror_printf("Built an invalid image for \"%s\"", path);
+		talloc_free(data);
+		return -1;
+	}
+
+	*image = (fr_shared_image_t) {
+		.data = data,
+		.len = len,
+		.mapped = false
+	};
+
+	return 0;
+}
+
+/** Release an image
+ *
+ * @param[in] image	to release.
+ */
+void fr_shared_image_close(fr_shared_image_t *image)
+{
+	if (!image->data) return;
+
+	if (image->mapped) {
+		munmap(image->data, image->len);
+	} else {
+		talloc_free(image->data);
+	}
+
+	*image = (fr_shared_image_t) {};
+}
@@ -0,0 +1,81 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Read only images, built once, and shared between processes via the page cache
+ *
+ * @file src/lib/util/shared_image.h
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(shared_image_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+#include <freeradius-devel/util/talloc.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** An image, either mapped from a file, or a private copy
+ *
+ */
+typedef struct {
+	uint8_t		*data;		//!< Start of the image.  Must not be written to.
+	size_t		len;		//!< Length of the image.
+	bool		mapped;		//!< If true, data is mmap'd, otherwise it's talloc'd.
+} fr_shared_image_t;
+
+/** Check whether an image can be used
+ *
+ * Is called for each candidate image.  If it returns 0, that image is
+ * kept, so the callback may store pointers into it.
+ *
+ * @param[in] data	of the image.
+ * @param[in] len	of the image.
+ * @param[in] uctx	passed to fr_shared_image_open().
+ * @return
+ *	- 0 if the image is valid.
+ *	- -1 if it's stale or corrupt.
+ */
+typedef int (*fr_shared_image_check_t)(uint8_t const *data, size_t len, void *uctx);
+
+/** Build a new image
+ *
+ * @param[in] ctx	to allocate the image in.
+ * @param[out] len	of the image.
+ * @param[in] uctx	passed to fr_shared_image_open().
+ * @return
+ *	- The new image.
+ *	- NULL on error.
+ */
+typedef uint8_t *(*fr_shared_image_build_t)(TALLOC_CTX *ctx, size_t *len, void *uctx);
+
+int	fr_shared_image_open(fr_shared_image_t *image, TALLOC_CTX *ctx, char const *path,
+			     fr_shared_image_check_t check, fr_shared_image_build_t build, void *uctx)
+			     CC_HINT(nonnull(1,3,4,5));
+
+void	fr_shared_image_close(fr_shared_image_t *image) CC_HINT(nonnull);
+
+int	fr_shared_image_write(char const *path, uint8_t const *data, size_t len) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
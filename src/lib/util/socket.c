@@ -36,6 +36,14 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <ifaddrs.h>
+#include <pthread.h>
+
+/*
+ *	Sockets which were bound by another process, and passed to us.
+ */
+static pthread_mutex_t	socket_inherited_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int		*socket_inherited;
+static size_t		socket_inherited_num;
 
 /** Resolve a named service to a port
  *
@@ -209,6 +217,151 @@ static int socket_dont_fragment(UNUSED int sockfd, UNUSED int af)
 }
 #endif	/* lots of things */
 
+/** Add a socket which was bound by another process
+ *
+ * When fr_socket_bind() is asked to bind a socket to the same address,
+ * port, type and interface, it uses this socket instead.  That lets a
+ * new server take over the listeners of the one it's replacing, without
+ * missing any packets.
+ *
+ * @param[in] fd	of the bound socket.  We take ownership of it.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_socket_inherit(int fd)
+{
+	int *fds;
+
+	pthread_mutex_lock(&socket_inherited_mutex);
+	fds = talloc_realloc(NULL, socket_inherited, int, socket_inherited_num + 1);
+	if (!fds) {
+		pthread_mutex_unlock(&socket_inherited_mutex);
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	fds[socket_inherited_num++] = fd;
+	socket_inherited = fds;
+	pthread_mutex_unlock(&socket_inherited_mutex);
+
+	return 0;
+}
+
+/** Close any inherited sockets which weren't used
+ *
+ * @return the number of sockets which were closed.
+ */
+size_t fr_socket_inherit_free(void)
+{
+	size_t i, num;
+
+	pthread_mutex_lock(&socket_inherited_mutex);
+	for (i = 0; i < socket_inherited_num; i++) close(socket_inherited[i]);
+	num = socket_inherited_num;
+
+	TALLOC_FREE(socket_inherited);
+	socket_inherited_num = 0;
+	pthread_mutex_unlock(&socket_inherited_mutex);
+
+	return num;
+}
+
+/** Compare the type, protocol and interface of two sockets
+ *
+ */
+static bool socket_inherit_match(int a, int b)
+{
+	int		opt_a, opt_b;
+	socklen_t	len;
+
+	len = sizeof(opt_a);
+	if (getsockopt(a, SOL_SOCKET, SO_TYPE, &opt_a, &len) < 0) return false;
+	len = sizeof(opt_b);
+	if (getsockopt(b, SOL_SOCKET, SO_TYPE, &opt_b, &len) < 0) return false;
+	if (opt_a != opt_b) return false;
+
+#ifdef SO_PROTOCOL
+	len = sizeof(opt_a);
+	if (getsockopt(a, SOL_SOCKET, SO_PROTOCOL, &opt_a, &len) < 0) return false;
+	len = sizeof(opt_b);
+	if (getsockopt(b, SOL_SOCKET, SO_PROTOCOL, &opt_b, &len) < 0) return false;
+	if (opt_a != opt_b) return false;
+#endif
+
+#ifdef SO_BINDTODEVICE
+	{
+		char	if_a[IFNAMSIZ + 1] = "", if_b[IFNAMSIZ + 1] = "";
+
+		len = IFNAMSIZ;
+		if (getsockopt(a, SOL_SOCKET, SO_BINDTODEVICE, if_a, &len) < 0) return false;
+		len = IFNAMSIZ;
+		if (getsockopt(b, SOL_SOCKET, SO_BINDTODEVICE, if_b, &len) < 0) return false;
+		if (strcmp(if_a, if_b) != 0) return false;
+	}
+#endif
+
+	return true;
+}
+
+/** Replace a socket with an inherited one which is bound to the same address
+ *
+ * @param[in] sockfd	which we were about to bind.
+ * @param[in] ipaddr	we were going to bind to.
+ * @param[in] port	we were going to bind to.
+ * @return
+ *	- 1 if sockfd now refers to an inherited socket.
+ *	- 0 if there was no matching socket.
+ *	- -1 on error.
+ */
+static int socket_inherit_take(int sockfd, fr_ipaddr_t const *ipaddr, uint16_t port)
+{
+	size_t i;
+
+	if (!socket_inherited_num) return 0;
+
+	pthread_mutex_lock(&socket_inherited_mutex);
+	for (i = 0; i < socket_inherited_num; i++) {
+		int			fd = socket_inherited[i];
+		struct sockaddr_storage	salocal;
+		socklen_t		salen = sizeof(salocal);
+		fr_ipaddr_t		my_ipaddr;
+		uint16_t		my_port;
+
+		if (getsockname(fd, (struct sockaddr *) &salocal, &salen) < 0) continue;
+		if (fr_ipaddr_from_sockaddr(&my_ipaddr, &my_port, &salocal, salen) < 0) continue;
+
+		/*
+		 *	Binding to an interface sets the scope, but the
+		 *	kernel only reports it for link-local addresses.
+		 */
+		if (!my_ipaddr.scope_id) my_ipaddr.scope_id = ipaddr->scope_id;
+
+		if ((my_port != port) || (fr_ipaddr_cmp(&my_ipaddr, ipaddr) != 0)) continue;
+		if (!socket_inherit_match(fd, sockfd)) continue;
+
+		/*
+		 *	Keep the caller's descriptor number, so that
+		 *	nothing else needs to change.
+		 */
+		if (dup2(fd, sockfd) < 0) {
+			fr_strerror_printf("Failed using inherited socket: %s", fr_syserror(errno));
+			pthread_mutex_unlock(&socket_inherited_mutex);
+			return -1;
+		}
+		close(fd);
+
+		socket_inherited[i] = socket_inherited[--socket_inherited_num];
+		pthread_mutex_unlock(&socket_inherited_mutex);
+
+		if (socket_dont_inherit(sockfd) < 0) return -1;
+
+		return 1;
+	}
+	pthread_mutex_unlock(&socket_inherited_mutex);
+
+	return 0;
+}
+
 /** Bind a UDP/TCP v4/v6 socket to a given ipaddr src port, and interface.
  *
  * Use one of:
@@ -429,6 +582,16 @@ int fr_socket_bind(int sockfd, char const *ifname, fr_ipaddr_t *src_ipaddr, uint
 	 */
 	if (fr_ipaddr_to_sockaddr(&salocal, &salen, &my_ipaddr, my_port) < 0) return -1;
 
+	/*
+	 *	A process we're replacing may have given us a socket
+	 *	which is already bound to this address.
+	 */
+	if (my_port) {
+		ret = socket_inherit_take(sockfd, &my_ipaddr, my_port);
+		if (ret < 0) return -1;
+		if (ret > 0) goto bound;
+	}
+
 	ret = bind(sockfd, (struct sockaddr *) &salocal, salen);
 	if (ret < 0) {
 		fr_strerror_printf_push("Bind failed with source address %pV:%pV on interface %s: %s",
@@ -439,6 +602,7 @@ int fr_socket_bind(int sockfd, char const *ifname, fr_ipaddr_t *src_ipaddr, uint
 		return ret;
 	}
 
+bound:
 	if (!src_port) goto done;
 
 	/*
@@ -305,6 +305,10 @@ int		fr_socket_server_tcp(fr_ipaddr_t const *ipaddr, uint16_t *port, char const
 
 int		fr_socket_bind(int sockfd, char const *ifname, fr_ipaddr_t *src_ipaddr, uint16_t *src_port);
 
+int		fr_socket_inherit(int fd);
+
+size_t		fr_socket_inherit_free(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,299 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/util/trace_ring.c
+ * @brief Per-thread rings of recent events, for post-mortem debugging.
+ *
+ * Each thread records compact, fixed size events into its own ring.
+ * Recording is always on, so it has to be cheap: there's no locking,
+ * no allocation, and no formatting.  Names are stored as pointers, and
+ * so must point to something which lives as long as the server does,
+ * e.g. module instance names.
+ *
+ * The rings are only read when someone asks for them, via radmin, or
+ * when the server crashes.  Only the ring's owner writes to it, so a
+ * reader copies the events it wants, then checks that the owner hasn't
+ * wrapped around and overwritten them while they were being copied.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/trace_ring.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+typedef struct {
+	fr_time_t		when;		//!< When the event happened.
+	uint64_t		number;		//!< Request number, or 0.
+	char const		*name;		//!< Module, worker, etc.  Must be long lived.
+	int32_t			fd;		//!< Socket the event relates to, or -1.
+	uint32_t		arg;		//!< Event specific.
+	uint8_t			event;		//!< One of #fr_trace_event_t.
+} fr_trace_ring_entry_t;
+
+typedef struct {
+	fr_dlist_t		entry;		//!< In the list of all rings.
+	char			name[32];	//!< of the thread which owns the ring.
+	atomic_uint_fast64_t	head;		//!< Total number of events ever written.
+	fr_trace_ring_entry_t	event[FR_TRACE_RING_SIZE];
+} fr_trace_ring_t;
+
+static_assert((FR_TRACE_RING_SIZE & (FR_TRACE_RING_SIZE - 1)) == 0, "FR_TRACE_RING_SIZE must be a power of 2");
+
+typedef struct {
+	char const		*name;		//!< Of the event.
+	char const		*name_label;	//!< What the name field means.
+	char const		*arg_label;	//!< What the arg field means.
+} fr_trace_ring_event_info_t;
+
+static fr_trace_ring_event_info_t const trace_ring_event_info[FR_TRACE_MAX] = {
+	[FR_TRACE_PACKET_RECEIVED]	= { .name = "packet-received", .arg_label = "length" },
+	[FR_TRACE_WORKER_ASSIGNED]	= { .name = "worker-assigned", .name_label = "worker" },
+	[FR_TRACE_MODULE_ENTER]		= { .name = "module-enter", .name_label = "module" },
+	[FR_TRACE_MODULE_YIELD]		= { .name = "module-yield", .name_label = "module" },
+	[FR_TRACE_MODULE_RESUME]	= { .name = "module-resume", .name_label = "module" },
+	[FR_TRACE_MODULE_DONE]		= { .name = "module-done", .name_label = "module", .arg_label = "rcode" },
+	[FR_TRACE_REPLY_SENT]		= { .name = "reply-sent", .arg_label = "length" }
+};
+
+static _Thread_local fr_trace_ring_t *trace_ring;
+
+static pthread_mutex_t	trace_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t	trace_ring_list;
+static bool		trace_ring_list_init = false;
+
+static int _trace_ring_free(void *uctx)
+{
+	fr_trace_ring_t *ring = uctx;
+
+	pthread_mutex_lock(&trace_ring_mutex);
+	fr_dlist_remove(&trace_ring_list, ring);
+	pthread_mutex_unlock(&trace_ring_mutex);
+
+	free(ring);
+	trace_ring = NULL;
+
+	return 0;
+}
+
+/** Allocate the ring for this thread
+ *
+ * The ring is malloc'd, rather than talloc'd, because it's read from
+ * other threads, and it's never touched by talloc.
+ */
+static fr_trace_ring_t *trace_ring_alloc(void)
+{
+	fr_trace_ring_t *ring;
+
+	if (fr_atexit_thread_is_exiting()) return NULL;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) return NULL;
+
+	snprintf(ring->name, sizeof(ring->name), "thread %lu", (unsigned long) pthread_self());
+	atomic_init(&ring->head, 0);
+
+	pthread_mutex_lock(&trace_ring_mutex);
+	if (!trace_ring_list_init) {
+		fr_dlist_init(&trace_ring_list, fr_trace_ring_t, entry);
+		trace_ring_list_init = true;
+	}
+	fr_dlist_insert_tail(&trace_ring_list, ring);
+	pthread_mutex_unlock(&trace_ring_mutex);
+
+	fr_atexit_thread_local(trace_ring, _trace_ring_free, ring);
+
+	return ring;
+}
+
+/** Record an event in this thread's ring
+ *
+ * @param[in] event	what happened.
+ * @param[in] number	of the request the event relates to, or 0.
+ * @param[in] name	of the module, worker, etc. the event relates to.
+ *			Is stored as a pointer, so must be long lived.  May be NULL.
+ * @param[in] fd	of the socket the event relates to, or -1.
+ * @param[in] arg	event specific, e.g. a packet length.
+ */
+void fr_trace_ring_event(fr_trace_event_t event, uint64_t number, char const *name, int fd, uint32_t arg)
+{
+	fr_trace_ring_t		*ring = trace_ring;
+	fr_trace_ring_entry_t	*e;
+	uint64_t		head;
+
+	if (unlikely(!ring)) {
+		ring = trace_ring_alloc();
+		if (!ring) return;
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	e = &ring->event[head & (FR_TRACE_RING_SIZE - 1)];
+
+	e->when = fr_time();
+	e->number = number;
+	e->name = name;
+	e->fd = fd;
+	e->arg = arg;
+	e->event = event;
+
+	/*
+	 *	Publish the event only after it's been written.
+	 */
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/** Set the name this thread's events are printed under
+ *
+ * @param[in] name	of the thread, e.g. "Worker 1".  Is copied.
+ */
+void fr_trace_ring_thread_name(char const *name)
+{
+	fr_trace_ring_t *ring = trace_ring;
+
+	if (!ring) {
+		ring = trace_ring_alloc();
+		if (!ring) return;
+	}
+
+	strlcpy(ring->name, name, sizeof(ring->name));
+}
+
+typedef void (*trace_ring_write_t)(void *uctx, char const *line, size_t len);
+
+/** Copy out, and print, the most recent events in one ring
+ *
+ */
+static void trace_ring_print(fr_trace_ring_t *ring, unsigned int count, trace_ring_write_t write_line, void *uctx)
+{
+	fr_trace_ring_entry_t	copy[64];
+	uint64_t		head, start, i;
+	char			line[256];
+	size_t			len;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (count > FR_TRACE_RING_SIZE) count = FR_TRACE_RING_SIZE;
+	start = (head > count) ? head - count : 0;
+
+	len = snprintf(line, sizeof(line), "%s: %" PRIu64 " events, showing the last %" PRIu64 "\n",
+		       ring->name, head, head - start);
+	write_line(uctx, line, len);
+
+	/*
+	 *	Copy in small batches, so that this works from a
+	 *	signal handler, without allocating memory.
+	 */
+	for (i = start; i < head; ) {
+		uint64_t	j, num, now;
+
+		num = head - i;
+		if (num > NUM_ELEMENTS(copy)) num = NUM_ELEMENTS(copy);
+
+		for (j = 0; j < num; j++) copy[j] = ring->event[(i + j) & (FR_TRACE_RING_SIZE - 1)];
+
+		/*
+		 *	Anything the owner may have overwritten
+		 *	while we were copying is discarded.
+		 */
+		atomic_thread_fence(memory_order_acquire);
+		now = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+		for (j = 0; j < num; j++) {
+			fr_trace_ring_entry_t const		*e = &copy[j];
+			fr_trace_ring_event_info_t const	*info;
+			int64_t					when;
+			char					*p = line, *end = line + sizeof(line);
+
+			if ((now - (i + j)) >= FR_TRACE_RING_SIZE) continue;
+			if (!e->event || (e->event >= FR_TRACE_MAX)) continue;
+
+			info = &trace_ring_event_info[e->event];
+			when = fr_unix_time_unwrap(fr_time_to_unix_time(e->when));
+
+			p += snprintf(p, end - p, "  %" PRId64 ".%06" PRId64 " %s",
+				      when / NSEC, (when % NSEC) / 1000, info->name);
+			if (e->number && (p < end)) p += snprintf(p, end - p, " request=%" PRIu64, e->number);
+			if (e->name && (p < end)) p += snprintf(p, end - p, " %s=%s",
+								 info->name_label ? info->name_label : "name", e->name);
+			if ((e->fd >= 0) && (p < end)) p += snprintf(p, end - p, " fd=%d", e->fd);
+			if (info->arg_label && (p < end)) p += snprintf(p, end - p, " %s=%u", info->arg_label, e->arg);
+			if (p >= (end - 1)) p = end - 2;
+			*p++ = '\n';
+
+			write_line(uctx, line, p - line);
+		}
+
+		i += num;
+	}
+}
+
+static void trace_ring_write_fp(void *uctx, char const *line, size_t len)
+{
+	fwrite(line, 1, len, (FILE *) uctx);
+}
+
+/** Print the most recent events from every thread
+ *
+ * @param[in] fp	to print to.
+ * @param[in] count	maximum number of events to print per thread.
+ */
+void fr_trace_ring_dump(FILE *fp, unsigned int count)
+{
+	pthread_mutex_lock(&trace_ring_mutex);
+	if (trace_ring_list_init) {
+		fr_dlist_foreach(&trace_ring_list, fr_trace_ring_t, ring) {
+			trace_ring_print(ring, count, trace_ring_write_fp, fp);
+		}
+	}
+	pthread_mutex_unlock(&trace_ring_mutex);
+}
+
+static void trace_ring_write_fd(void *uctx, char const *line, size_t len)
+{
+	if (write(*((int *) uctx), line, len) < 0) return;
+}
+
+/** Write the most recent events from every thread, when the server has crashed
+ *
+ * Doesn't wait for the ring list lock, as the thread which crashed
+ * may be holding it.
+ *
+ * @param[in] fd	to write to.
+ * @param[in] count	maximum number of events to write per thread.
+ */
+void fr_trace_ring_fault_dump(int fd, unsigned int count)
+{
+	bool locked;
+
+	if (!trace_ring_list_init) return;
+
+	locked = (pthread_mutex_trylock(&trace_ring_mutex) == 0);
+
+	fr_dlist_foreach(&trace_ring_list, fr_trace_ring_t, ring) {
+		trace_ring_print(ring, count, trace_ring_write_fd, &fd);
+	}
+
+	if (locked) pthread_mutex_unlock(&trace_ring_mutex);
+}
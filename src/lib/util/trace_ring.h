@@ -0,0 +1,62 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Per-thread rings of recent events, for post-mortem debugging
+ *
+ * @file src/lib/util/trace_ring.h
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(trace_ring_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Number of events kept per thread.  Must be a power of 2
+ *
+ */
+#define FR_TRACE_RING_SIZE	4096
+
+typedef enum {
+	FR_TRACE_PACKET_RECEIVED = 1,		//!< Network read a packet.  fd, arg = length.
+	FR_TRACE_WORKER_ASSIGNED,		//!< Worker created a request.  name = worker, fd.
+	FR_TRACE_MODULE_ENTER,			//!< name = module instance.
+	FR_TRACE_MODULE_YIELD,			//!< name = module instance.
+	FR_TRACE_MODULE_RESUME,			//!< name = module instance.
+	FR_TRACE_MODULE_DONE,			//!< name = module instance, arg = rcode.
+	FR_TRACE_REPLY_SENT,			//!< Worker sent a reply.  arg = length.
+	FR_TRACE_MAX
+} fr_trace_event_t;
+
+void	fr_trace_ring_event(fr_trace_event_t event, uint64_t number, char const *name, int fd, uint32_t arg);
+
+void	fr_trace_ring_thread_name(char const *name);
+
+void	fr_trace_ring_dump(FILE *fp, unsigned int count);
+
+void	fr_trace_ring_fault_dump(int fd, unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
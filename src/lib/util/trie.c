@@ -422,7 +422,7 @@ static void write_chunk(uint8_t *out, int start_bit, int num_bits, uint16_t chun
 	 *	Special-case 1-bit writes.
 	 */
 	if (num_bits == 1) {
-		out[0] &= ~((1 << (7 - start_bit)) - 1);
+		out[0] &= ~((1 << (8 - start_bit)) - 1);
 		out[0] |= chunk << (7 - start_bit);
 		return;
 	}
@@ -723,12 +723,93 @@ static fr_trie_comp_t *fr_trie_comp_alloc(TALLOC_CTX *ctx, int bits)
 }
 #endif	/* WITH_NODE_COMPRESSION */
 
+/** Bits of the key used at each level of a compiled trie
+ *
+ *  One bit per chunk value fits the node bitmaps into a uint64_t.
+ */
+#define FLAT_STRIDE	(6)
+
+/** Longest key which can be compiled, i.e. an IPv6 address
+ *
+ */
+#define FLAT_MAX_KEY_BITS (128)
+
+/** A node in a compiled trie
+ *
+ *  Children and leaves are stored contiguously, so the index of the
+ *  N'th chunk is found by counting the bits set below it.  Runs of
+ *  chunks with the same leaf share one entry in the leaf array.
+ */
+typedef struct {
+	uint64_t	vector;		//!< Bit N is set if chunk N has a child node.
+	uint64_t	leafvec;	//!< Bit N is set if chunk N starts a new run of leaves.
+	uint32_t	base_node;	//!< Index of the first child node.
+	uint32_t	base_leaf;	//!< Index of the first leaf.
+} trie_flat_node_t;
+
+/** Read-only copy of a trie, for fast longest prefix lookups
+ *
+ */
+typedef struct {
+	size_t			keylen;		//!< Length in bits of the keys this table answers for.
+	trie_flat_node_t	*node;		//!< Node 0 is the root.
+	void			**leaf;		//!< Data for each run of leaves, NULL for no match.
+	uint32_t		num_nodes;
+	uint32_t		num_leaves;
+} trie_flat_t;
+
 typedef struct {
 	uint8_t		buffer[16]; /* for get_key callbacks */
 	fr_trie_key_t	get_key;
 	fr_free_t	free_data;
+	trie_flat_t	*flat;	/* compiled lookup table, see fr_trie_compile() */
 } fr_trie_ctx_t;
 
+/** Get FLAT_STRIDE bits from a key, starting at depth
+ *
+ *  Bits past the end of the key are zero.
+ */
+static inline CC_HINT(always_inline) unsigned int trie_flat_chunk(uint8_t const *key, size_t keybytes, int depth)
+{
+	size_t		byte = BYTEOF(depth);
+	unsigned int	word;
+
+	word = (byte < keybytes) ? (key[byte] << 8) : 0;
+	if ((byte + 1) < keybytes) word |= key[byte + 1];
+
+	return (word >> (16 - FLAT_STRIDE - (depth & 0x07))) & ((1 << FLAT_STRIDE) - 1);
+}
+
+/** Find the longest prefix match for a full length key in a compiled trie
+ *
+ */
+static inline CC_HINT(always_inline) void *trie_flat_lookup(trie_flat_t const *flat, uint8_t const *key)
+{
+	trie_flat_node_t const	*node = &flat->node[0];
+	size_t			keybytes = BYTES(flat->keylen);
+	int			depth = 0;
+	uint64_t		bit;
+
+	for (;;) {
+		bit = ((uint64_t) 1) << trie_flat_chunk(key, keybytes, depth);
+		if (!(node->vector & bit)) break;
+
+		node = &flat->node[node->base_node + __builtin_popcountll(node->vector & (bit - 1))];
+		depth += FLAT_STRIDE;
+	}
+
+	/*
+	 *	For the top chunk, (bit << 1) wraps to zero, and the
+	 *	mask is all ones.
+	 */
+	return flat->leaf[node->base_leaf + __builtin_popcountll(node->leafvec & ((bit << 1) - 1)) - 1];
+}
+
+static void trie_flat_free(fr_trie_ctx_t *uctx)
+{
+	TALLOC_FREE(uctx->flat);
+}
+
 /** Allocate a trie
  *
  * @param ctx		The talloc ctx.
@@ -1262,6 +1343,7 @@ static void *trie_key_match(fr_trie_t *trie, uint8_t const *key, int start_bit,
 void *fr_trie_lookup_by_key(fr_trie_t const *ft, void const *key, size_t keylen)
 {
 	fr_trie_user_t *user;
+	fr_trie_ctx_t *uctx;
 
 	if (keylen > MAX_KEY_BITS) return NULL;
 
@@ -1269,6 +1351,13 @@ void *fr_trie_lookup_by_key(fr_trie_t const *ft, void const *key, size_t keylen)
 
 	user = UNCONST(fr_trie_user_t *, ft);
 
+	/*
+	 *	Full length keys can use the compiled table, if
+	 *	there is one.
+	 */
+	uctx = user->data;
+	if (uctx->flat && (uctx->flat->keylen == keylen)) return trie_flat_lookup(uctx->flat, key);
+
 	return trie_key_match(user->trie, key, 0, keylen, false);
 }
 
@@ -1899,6 +1988,8 @@ int fr_trie_insert_by_key(fr_trie_t *ft, void const *key, size_t keylen, void co
 	my_data = UNCONST(void *, data);
 	MPRINT2("No match for data, inserting...\n");
 
+	trie_flat_free(user->data);
+
 	MPRINT3("%.*srecurse STARTS at %d with %.*s=%s\n", 0, spaces, __LINE__,
 		(int) keylen, key, my_data);
 	return trie_key_insert(user->data, &user->trie, key, 0, keylen, my_data);
@@ -2161,6 +2252,8 @@ void *fr_trie_remove_by_key(fr_trie_t *ft, void const *key, size_t keylen)
 
 	user = (fr_trie_user_t *) ft;
 
+	trie_flat_free(user->data);
+
 	/*
 	 *	Remove the user trie, not ft->trie.
 	 */
@@ -2623,6 +2716,239 @@ int fr_trie_walk(fr_trie_t *ft, void *ctx, fr_trie_walk_t callback)
 	return trie_key_walk(ft->trie, &my_cb, 0, false);
 }
 
+/* COMPILE FUNCTIONS */
+
+typedef struct {
+	uint8_t		key[FLAT_MAX_KEY_BITS / 8];	//!< Zero past the prefix length.
+	size_t		bits;
+	void		*data;
+} trie_flat_entry_t;
+
+typedef struct {
+	trie_flat_entry_t	*entry;
+	size_t			num;
+	size_t			keylen;
+} trie_flat_collect_t;
+
+static int _trie_flat_collect(uint8_t const *key, size_t keylen, void *data, void *uctx)
+{
+	trie_flat_collect_t	*collect = uctx;
+	trie_flat_entry_t	*entry;
+
+	if (keylen > collect->keylen) {
+		fr_strerror_printf("Key length %zu is longer than the compiled key length %zu",
+				   keylen, collect->keylen);
+		return -1;
+	}
+
+	if (collect->num == talloc_array_length(collect->entry)) {
+		entry = talloc_realloc(NULL, collect->entry, trie_flat_entry_t, collect->num * 2);
+		if (!entry) {
+			fr_strerror_const("Out of memory");
+			return -1;
+		}
+		collect->entry = entry;
+	}
+
+	entry = &collect->entry[collect->num++];
+	memset(entry->key, 0, sizeof(entry->key));
+	memcpy(entry->key, key, BYTES(keylen));
+
+	/*
+	 *	The walk doesn't clear bits past the end of the key.
+	 */
+	if (keylen & 0x07) entry->key[BYTEOF(keylen)] &= (0xff00 >> (keylen & 0x07)) & 0xff;
+	entry->bits = keylen;
+	entry->data = data;
+
+	return 0;
+}
+
+/** Sort by key, and shorter prefixes first
+ *
+ *  This means that the entries below any chunk are contiguous.
+ */
+static int _trie_flat_entry_cmp(void const *one, void const *two)
+{
+	trie_flat_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = memcmp(a->key, b->key, sizeof(a->key));
+	if (ret != 0) return ret;
+
+	return CMP(a->bits, b->bits);
+}
+
+/** Fill in a node of a compiled trie, and recurse to its children
+ *
+ * @param[in] flat	being built.
+ * @param[in] idx	of the node to fill in.
+ * @param[in] entry	all of the prefixes which start with the path to this node.
+ * @param[in] num	number of entries.
+ * @param[in] depth	bit offset of this node's chunk.
+ * @param[in] parent	data of the longest match for shorter prefixes.
+ */
+static int trie_flat_build(trie_flat_t *flat, uint32_t idx, trie_flat_entry_t const *entry, size_t num,
+			   size_t depth, void *parent)
+{
+	void		*leaf[1 << FLAT_STRIDE];
+	size_t		start[1 << FLAT_STRIDE], end[1 << FLAT_STRIDE];
+	uint64_t	vector = 0, leafvec = 0;
+	uint32_t	base_node, base_leaf, child;
+	size_t		i, len, chunk, count;
+	void		*prev = NULL;
+
+	for (i = 0; i < NUM_ELEMENTS(leaf); i++) leaf[i] = parent;
+
+	/*
+	 *	Paint the short prefixes over the leaves, shortest
+	 *	first, so that longer prefixes win.
+	 */
+	for (len = depth; len <= depth + FLAT_STRIDE; len++) {
+		for (i = 0; i < num; i++) {
+			if (entry[i].bits != len) continue;
+
+			count = 1 << (depth + FLAT_STRIDE - len);
+			chunk = trie_flat_chunk(entry[i].key, sizeof(entry[i].key), depth) & ~(count - 1);
+			while (count--) leaf[chunk++] = entry[i].data;
+		}
+	}
+
+	/*
+	 *	Longer prefixes go into a child node.  The entries are
+	 *	sorted, so the entries for each child are contiguous.
+	 */
+	for (i = 0; i < num; i++) {
+		if (entry[i].bits <= depth + FLAT_STRIDE) continue;
+
+		chunk = trie_flat_chunk(entry[i].key, sizeof(entry[i].key), depth);
+		if (!(vector & (((uint64_t) 1) << chunk))) {
+			vector |= ((uint64_t) 1) << chunk;
+			start[chunk] = i;
+		}
+		end[chunk] = i + 1;
+	}
+
+	/*
+	 *	Chunks without children get leaves.  Adjacent chunks
+	 *	with the same data share a leaf.
+	 */
+	base_leaf = flat->num_leaves;
+	for (i = 0; i < NUM_ELEMENTS(leaf); i++) {
+		if (vector & (((uint64_t) 1) << i)) continue;
+
+		if ((flat->num_leaves != base_leaf) && (leaf[i] == prev)) continue;
+
+		if (flat->num_leaves == talloc_array_length(flat->leaf)) {
+			void **new_leaf;
+
+			new_leaf = talloc_realloc(flat, flat->leaf, void *, flat->num_leaves * 2);
+			if (!new_leaf) return -1;
+			flat->leaf = new_leaf;
+		}
+
+		leafvec |= ((uint64_t) 1) << i;
+		flat->leaf[flat->num_leaves++] = prev = leaf[i];
+	}
+
+	/*
+	 *	Reserve space for all of the children together.
+	 */
+	base_node = flat->num_nodes;
+	flat->num_nodes += __builtin_popcountll(vector);
+	if (flat->num_nodes > talloc_array_length(flat->node)) {
+		trie_flat_node_t *new_node;
+
+		new_node = talloc_realloc(flat, flat->node, trie_flat_node_t, flat->num_nodes * 2);
+		if (!new_node) return -1;
+		flat->node = new_node;
+	}
+
+	flat->node[idx] = (trie_flat_node_t) {
+		.vector = vector,
+		.leafvec = leafvec,
+		.base_node = base_node,
+		.base_leaf = base_leaf
+	};
+
+	for (i = 0, child = base_node; i < NUM_ELEMENTS(leaf); i++) {
+		if (!(vector & (((uint64_t) 1) << i))) continue;
+
+		if (trie_flat_build(flat, child++, entry + start[i], end[i] - start[i],
+				    depth + FLAT_STRIDE, leaf[i]) < 0) return -1;
+	}
+
+	return 0;
+}
+
+/** Build a read-only copy of the trie for fast lookups
+ *
+ *  Longest prefix lookups in a trie which is built once and then only
+ *  read, like a list of networks, chase a pointer per node, and check
+ *  the node type at each step.  This builds a compact table (similar to
+ *  a Poptrie) where each step uses FLAT_STRIDE bits of the key, and
+ *  needs only a popcount to find the next node.
+ *
+ *  The table is used by #fr_trie_lookup_by_key for keys of exactly
+ *  keylen bits, e.g. IP addresses.  Other lookups use the trie as
+ *  before.  Any insertion or removal frees the table, and the trie
+ *  will have to be compiled again.
+ *
+ * @param[in] ft	to compile.
+ * @param[in] keylen	length in bits of the keys which will be looked up.
+ *			Must be a multiple of 8, and no more than 128.
+ * @return
+ *	- 0 on success.
+ *	- <0 on error, in which case lookups use the trie.
+ */
+int fr_trie_compile(fr_trie_t *ft, size_t keylen)
+{
+	fr_trie_user_t		*user = (fr_trie_user_t *) ft;
+	fr_trie_ctx_t		*uctx = talloc_get_type_abort(user->data, fr_trie_ctx_t);
+	trie_flat_collect_t	collect = { .keylen = keylen };
+	trie_flat_t		*flat = NULL;
+
+	trie_flat_free(uctx);
+
+	if (!keylen || (keylen & 0x07) || (keylen > FLAT_MAX_KEY_BITS)) {
+		fr_strerror_printf("Cannot compile trie for key length %zu", keylen);
+		return -1;
+	}
+
+	collect.entry = talloc_array(NULL, trie_flat_entry_t, 16);
+	if (!collect.entry) goto oom;
+
+	if (fr_trie_walk(ft, &collect, _trie_flat_collect) < 0) {
+		talloc_free(collect.entry);
+		return -1;
+	}
+
+	qsort(collect.entry, collect.num, sizeof(collect.entry[0]), _trie_flat_entry_cmp);
+
+	flat = talloc_zero(uctx, trie_flat_t);
+	if (!flat) goto fail;
+
+	flat->keylen = keylen;
+	flat->node = talloc_array(flat, trie_flat_node_t, 16);
+	flat->leaf = talloc_array(flat, void *, 16);
+	if (!flat->node || !flat->leaf) goto fail;
+	flat->num_nodes = 1;
+
+	if (trie_flat_build(flat, 0, collect.entry, collect.num, 0, NULL) < 0) goto fail;
+	talloc_free(collect.entry);
+
+	uctx->flat = flat;
+
+	return 0;
+
+fail:
+	talloc_free(flat);
+	talloc_free(collect.entry);
+oom:
+	fr_strerror_const("Out of memory");
+	return -1;
+}
+
 
 /**********************************************************************/
 
@@ -2991,6 +3317,19 @@ static int command_insert(fr_trie_t *ft, UNUSED int argc, char **argv, UNUSED ch
 	return 0;
 }
 
+/**  Compile a trie for lookups of keys with a particular length.
+ *
+ */
+static int command_compile(fr_trie_t *ft, UNUSED int argc, char **argv, UNUSED char *out, UNUSED size_t outlen)
+{
+	if (fr_trie_compile(ft, atoi(argv[0])) < 0) {
+		MPRINT("Failed compiling trie - %s\n", fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
 /**  Verify a trie recursively
  *
  *  For sanity reasons, this command runs but doesn't do anything if
@@ -3075,6 +3414,7 @@ static int command_clear(fr_trie_t *ft, UNUSED int argc, UNUSED char **argv, UNU
 
 	trie_free(ft->trie);
 	ft->trie = NULL;
+	trie_flat_free(((fr_trie_user_t *) ft)->data);
 
 	/*
 	 *	Clean up our internal data ctx, too.
@@ -3419,6 +3759,7 @@ static fr_trie_command_t commands[] = {
 	{ "chunk",	command_chunk,	3, 3, true },
 	{ "path",	command_path,	2, 2, true },
 	{ "insert",	command_insert,	2, 2, false },
+	{ "compile",	command_compile, 1, 1, false },
 	{ "match",	command_match,	1, 1, true },
 	{ "lookup",	command_lookup,	1, 1, true },
 	{ "remove",	command_remove,	1, 1, true },
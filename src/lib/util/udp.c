@@ -208,3 +208,417 @@ done:
 
 	return slen;
 }
+
+/** Space for IP_PKTINFO / IPV6_PKTINFO and SO_TIMESTAMP control messages
+ *
+ */
+#define UDP_RECV_BATCH_CMSG_SIZE	(256)
+
+/** A set of datagrams read from a socket with a single recvmmsg() call
+ *
+ */
+struct udp_recv_batch_s {
+	uint32_t		num;			//!< Maximum number of datagrams to read at once.
+	uint32_t		count;			//!< How many datagrams the last read returned.
+	uint32_t		next;			//!< The next datagram to return to the caller.
+	size_t			max_packet_size;	//!< Size of each datagram buffer.
+
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr		*msgvec;		//!< One entry per datagram.
+	struct iovec		*iov;			//!< Points into "buffer".
+	struct sockaddr_storage	*src;			//!< Source address of each datagram.
+	uint8_t			*cmsg;			//!< Control message buffers.
+	uint8_t			*buffer;		//!< Datagram data.
+
+	struct sockaddr_storage	local;			//!< Local address of the socket, from getsockname().
+	socklen_t		local_len;		//!< Length of the local address.
+#endif
+	fr_time_t		when;			//!< When we read the batch.
+};
+
+/** Allocate a structure for reading multiple datagrams with one system call
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] num		maximum number of datagrams to read at once.
+ * @param[in] max_packet_size	maximum size of a datagram.  Larger datagrams
+ *				are truncated, in the same way as with udp_recv().
+ * @return
+ *	- NULL on error.
+ *	- the batch structure on success.
+ */
+udp_recv_batch_t *udp_recv_batch_alloc(TALLOC_CTX *ctx, uint32_t num, size_t max_packet_size)
+{
+	udp_recv_batch_t	*batch;
+
+	fr_assert(num > 0);
+	fr_assert(max_packet_size > 0);
+
+	batch = talloc_zero(ctx, udp_recv_batch_t);
+	if (!batch) return NULL;
+
+	batch->num = num;
+	batch->max_packet_size = max_packet_size;
+
+#ifdef HAVE_RECVMMSG
+	{
+		uint32_t i;
+
+		batch->msgvec = talloc_zero_array(batch, struct mmsghdr, num);
+		batch->iov = talloc_zero_array(batch, struct iovec, num);
+		batch->src = talloc_zero_array(batch, struct sockaddr_storage, num);
+		batch->cmsg = talloc_zero_array(batch, uint8_t, num * UDP_RECV_BATCH_CMSG_SIZE);
+		batch->buffer = talloc_array(batch, uint8_t, num * max_packet_size);
+		if (!batch->msgvec || !batch->iov || !batch->src || !batch->cmsg || !batch->buffer) {
+			talloc_free(batch);
+			return NULL;
+		}
+
+		for (i = 0; i < num; i++) {
+			batch->iov[i].iov_base = batch->buffer + (i * max_packet_size);
+			batch->iov[i].iov_len = max_packet_size;
+
+			batch->msgvec[i].msg_hdr.msg_iov = &batch->iov[i];
+			batch->msgvec[i].msg_hdr.msg_iovlen = 1;
+		}
+	}
+#endif
+
+	return batch;
+}
+
+#ifdef HAVE_RECVMMSG
+/** Read as many datagrams as are available, up to batch->num
+ *
+ * @return
+ *	- >0 the number of datagrams read.
+ *	- 0 no datagrams were available.
+ *	- <0 on error.
+ */
+static int udp_recv_batch_read(udp_recv_batch_t *batch, int sockfd, int flags)
+{
+	int		ret;
+	uint32_t	i;
+	bool		connected = ((flags & UDP_FLAGS_CONNECTED) != 0);
+
+	for (i = 0; i < batch->num; i++) {
+		struct msghdr *msgh = &batch->msgvec[i].msg_hdr;
+
+		if (connected) {
+			msgh->msg_name = NULL;
+			msgh->msg_namelen = 0;
+			msgh->msg_control = NULL;
+			msgh->msg_controllen = 0;
+		} else {
+			msgh->msg_name = &batch->src[i];
+			msgh->msg_namelen = sizeof(batch->src[i]);
+			msgh->msg_control = batch->cmsg + (i * UDP_RECV_BATCH_CMSG_SIZE);
+			msgh->msg_controllen = UDP_RECV_BATCH_CMSG_SIZE;
+		}
+		msgh->msg_flags = 0;
+		batch->msgvec[i].msg_len = 0;
+	}
+
+	batch->count = batch->next = 0;
+
+	ret = recvmmsg(sockfd, batch->msgvec, batch->num, MSG_DONTWAIT, NULL);
+	if (ret < 0) {
+		if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return 0;
+
+		fr_strerror_printf("Failed reading socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	batch->when = fr_time();
+
+	/*
+	 *	recvmsg() doesn't provide the destination port, so we
+	 *	get it (and the address of wildcard sockets) once for
+	 *	the whole batch.
+	 */
+	if (!connected && (ret > 0)) {
+		batch->local_len = sizeof(batch->local);
+		if (getsockname(sockfd, (struct sockaddr *) &batch->local, &batch->local_len) < 0) {
+			fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	batch->count = ret;
+	return ret;
+}
+#endif
+
+/** Read a UDP packet, using a batch of datagrams read with recvmmsg()
+ *
+ * Datagrams are read from the socket in batches of up to batch->num.  Each
+ * call returns the next datagram in the batch, and the socket is only read
+ * when the batch is empty.  The caller should therefore keep calling this
+ * function until it returns 0.
+ *
+ * The arguments and return values are the same as for udp_recv().
+ *
+ * @param[in] batch		as allocated by udp_recv_batch_alloc().  If NULL,
+ *				this function is identical to udp_recv().
+ * @param[in] sockfd		we're reading from.
+ * @param[in] flags		for things
+ * @param[out] socket_out	Information about the src/dst address of the packet
+ *				and the interface it was received on.
+ * @param[out] data		pointer where data will be written
+ * @param[in] data_len		length of data to read
+ * @param[out] when		the packet was received.
+ * @return
+ *	- > 0 on success (number of bytes read).
+ *	- 0 if there is no more data.
+ *	- < 0 on failure.
+ */
+ssize_t udp_recv_batch(udp_recv_batch_t *batch, int sockfd, int flags,
+		       fr_socket_t *socket_out, void *data, size_t data_len, fr_time_t *when)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr		*mmsg;
+	size_t			len;
+	struct sockaddr_storage	dst;
+	socklen_t		sizeof_dst;
+	fr_time_t		packet_time;
+#endif
+
+	if (!batch || ((flags & UDP_FLAGS_PEEK) != 0)) return udp_recv(sockfd, flags, socket_out, data, data_len, when);
+
+#ifndef HAVE_RECVMMSG
+	return udp_recv(sockfd, flags, socket_out, data, data_len, when);
+#else
+	if (batch->next >= batch->count) {
+		int ret;
+
+		ret = udp_recv_batch_read(batch, sockfd, flags);
+		if (ret <= 0) {
+			if (when) *when = fr_time_wrap(0);
+			return ret;
+		}
+	}
+
+	mmsg = &batch->msgvec[batch->next++];
+
+	*socket_out = (fr_socket_t){
+		.fd = sockfd,
+		.type = SOCK_DGRAM,
+	};
+
+	/*
+	 *	The OS discards any data in the packet after
+	 *	max_packet_size bytes.  We do the same when copying it
+	 *	to the caller.
+	 */
+	len = mmsg->msg_len;
+	if (len > data_len) len = data_len;
+	memcpy(data, mmsg->msg_hdr.msg_iov->iov_base, len);
+
+	packet_time = fr_time_wrap(0);
+
+	if ((flags & UDP_FLAGS_CONNECTED) == 0) {
+		memcpy(&dst, &batch->local, sizeof(dst));
+		sizeof_dst = batch->local_len;
+
+		recvfromto_cmsg(&mmsg->msg_hdr, &socket_out->inet.ifindex,
+				(struct sockaddr *) &dst, &sizeof_dst, &packet_time);
+
+		if (fr_ipaddr_from_sockaddr(&socket_out->inet.src_ipaddr, &socket_out->inet.src_port,
+					    mmsg->msg_hdr.msg_name, mmsg->msg_hdr.msg_namelen) < 0) {
+			fr_strerror_const_push("Failed converting src sockaddr to ipaddr");
+			return -1;
+		}
+		if (fr_ipaddr_from_sockaddr(&socket_out->inet.dst_ipaddr, &socket_out->inet.dst_port,
+					    &dst, sizeof_dst) < 0) {
+			fr_strerror_const_push("Failed converting dst sockaddr to ipaddr");
+			return -1;
+		}
+	}
+
+	/*
+	 *	We didn't get it from the kernel, so use the time we
+	 *	read the batch.
+	 */
+	if (when) *when = fr_time_eq(packet_time, fr_time_wrap(0)) ? batch->when : packet_time;
+
+	return len;
+#endif
+}
+
+/** A set of datagrams to be written to a socket with a single sendmmsg() call
+ *
+ */
+struct udp_send_batch_s {
+	uint32_t		num;			//!< Maximum number of datagrams to queue.
+	uint32_t		count;			//!< How many datagrams are queued.
+	size_t			max_packet_size;	//!< Size of each datagram buffer.
+	int			sockfd;			//!< The socket the queued datagrams are for.
+
+	struct mmsghdr		*msgvec;		//!< One entry per datagram.
+	struct iovec		*iov;			//!< Points into "buffer".
+	struct sockaddr_storage	*dst;			//!< Destination address of each datagram.
+	uint8_t			*cmsg;			//!< Control message buffers.
+	uint8_t			*buffer;		//!< Datagram data.
+};
+
+/** Allocate a structure for writing multiple datagrams with one system call
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] num		maximum number of datagrams to queue before
+ *				they are written to the socket.
+ * @param[in] max_packet_size	maximum size of a datagram.  Larger datagrams
+ *				are written immediately, with udp_send().
+ * @return
+ *	- NULL on error.
+ *	- the batch structure on success.
+ */
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, uint32_t num, size_t max_packet_size)
+{
+	udp_send_batch_t	*batch;
+	uint32_t		i;
+
+	fr_assert(num > 0);
+	fr_assert(max_packet_size > 0);
+
+	batch = talloc_zero(ctx, udp_send_batch_t);
+	if (!batch) return NULL;
+
+	batch->num = num;
+	batch->max_packet_size = max_packet_size;
+	batch->sockfd = -1;
+
+	batch->msgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->dst = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->cmsg = talloc_zero_array(batch, uint8_t, num * UDP_RECV_BATCH_CMSG_SIZE);
+	batch->buffer = talloc_array(batch, uint8_t, num * max_packet_size);
+	if (!batch->msgvec || !batch->iov || !batch->dst || !batch->cmsg || !batch->buffer) {
+		talloc_free(batch);
+		return NULL;
+	}
+
+	for (i = 0; i < num; i++) {
+		batch->iov[i].iov_base = batch->buffer + (i * max_packet_size);
+
+		batch->msgvec[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->msgvec[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return batch;
+}
+
+/** Write all queued datagrams to the socket
+ *
+ * Datagrams which cannot be written are discarded, in the same way as
+ * the kernel discards datagrams it cannot deliver.
+ *
+ * @param[in] batch		as allocated by udp_send_batch_alloc().
+ * @return
+ *	- 0 on success.
+ *	- -1 if one or more datagrams could not be written.
+ */
+int udp_send_batch_flush(udp_send_batch_t *batch)
+{
+	uint32_t	sent = 0;
+	uint32_t	failed = 0;
+
+	if (!batch || !batch->count) return 0;
+
+	while (sent < batch->count) {
+		int ret;
+
+		ret = sendmmsg(batch->sockfd, batch->msgvec + sent, batch->count - sent, 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+
+			/*
+			 *	The first datagram couldn't be written.  Skip it,
+			 *	and try the rest.
+			 */
+			fr_strerror_printf("udp_send failed: %s", fr_syserror(errno));
+			failed++;
+			sent++;
+			continue;
+		}
+
+		sent += ret;
+	}
+
+	batch->count = 0;
+
+	return (failed > 0) ? -1 : 0;
+}
+
+/** Queue a packet to be written to a UDP socket
+ *
+ * The packet is copied, and written on the next call to
+ * udp_send_batch_flush(), or when the batch is full.
+ *
+ * @param[in] batch		as allocated by udp_send_batch_alloc().  If NULL,
+ *				this function is identical to udp_send().
+ * @param[in] sock		we're writing to.
+ * @param[in] flags		for things
+ * @param[in] data		to data to send
+ * @param[in] data_len		length of data to send
+ * @return
+ *	- data_len if the packet was queued.
+ *	- the return value of udp_send() if the packet was written immediately.
+ *	- -1 on failure.
+ */
+int udp_send_batch(udp_send_batch_t *batch, fr_socket_t const *sock, int flags, void *data, size_t data_len)
+{
+	struct msghdr		*msgh;
+	struct sockaddr_storage	src;
+	socklen_t		sizeof_src, sizeof_dst;
+
+	if (!batch) return udp_send(sock, flags, data, data_len);
+
+	fr_assert(sock->type == SOCK_DGRAM);
+
+	/*
+	 *	Keep the datagrams in order.  Anything queued for
+	 *	another socket, or which would overflow the batch, is
+	 *	written first.
+	 */
+	if ((batch->count > 0) && ((batch->sockfd != sock->fd) || (batch->count == batch->num))) {
+		(void) udp_send_batch_flush(batch);
+	}
+
+	if (data_len > batch->max_packet_size) {
+		(void) udp_send_batch_flush(batch);
+		return udp_send(sock, flags, data, data_len);
+	}
+
+	batch->sockfd = sock->fd;
+	msgh = &batch->msgvec[batch->count].msg_hdr;
+
+	msgh->msg_name = NULL;
+	msgh->msg_namelen = 0;
+	msgh->msg_control = NULL;
+	msgh->msg_controllen = 0;
+	msgh->msg_flags = 0;
+
+	if ((flags & UDP_FLAGS_CONNECTED) == 0) {
+		struct sockaddr_storage *dst = &batch->dst[batch->count];
+
+		if (fr_ipaddr_to_sockaddr(dst, &sizeof_dst,
+					  &sock->inet.dst_ipaddr, sock->inet.dst_port) < 0) return -1;
+		if (fr_ipaddr_to_sockaddr(&src, &sizeof_src,
+					  &sock->inet.src_ipaddr, sock->inet.src_port) < 0) return -1;
+
+		msgh->msg_name = dst;
+		msgh->msg_namelen = sizeof_dst;
+
+		if (sendfromto_cmsg(sock->fd, msgh, batch->cmsg + (batch->count * UDP_RECV_BATCH_CMSG_SIZE),
+				    UDP_RECV_BATCH_CMSG_SIZE, sock->inet.ifindex,
+				    (struct sockaddr *) &src, sizeof_src) < 0) {
+			fr_strerror_printf("udp_send failed: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	memcpy(batch->iov[batch->count].iov_base, data, data_len);
+	batch->iov[batch->count].iov_len = data_len;
+	batch->count++;
+
+	return data_len;
+}
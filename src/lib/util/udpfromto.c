@@ -161,6 +161,90 @@ int udpfromto_init(int s, int af)
 	return setsockopt(s, proto, flag, &opt, sizeof(opt));
 }
 
+/** Process the control messages returned by recvmsg() or recvmmsg()
+ *
+ * @param[in] msgh	as filled in by recvmsg().
+ * @param[out] ifindex	The interface which received the datagram (may be NULL).
+ * @param[out] to	The destination address.  Must already be initialised with
+ *			the local address of the socket, as only the IP address
+ *			is overwritten.
+ * @param[out] to_len	Length of the structure pointed to by to.
+ * @param[out] when	the packet was received (may be NULL).  Set to zero if
+ *			no timestamp was found.
+ */
+void recvfromto_cmsg(struct msghdr *msgh, int *ifindex,
+		     struct sockaddr *to, socklen_t *to_len, fr_time_t *when)
+{
+	struct cmsghdr		*cmsg;
+
+	if (ifindex) *ifindex = 0;
+	if (when) *when = fr_time_wrap(0);
+
+/*
+ *	Needed for emscripten, seems to be an issue in CMSG_NXTHDR
+ */
+DIAG_OFF(sign-compare)
+	/* Process auxiliary received data in msgh */
+	for (cmsg = CMSG_FIRSTHDR(msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+DIAG_ON(sign-compare)
+
+#ifdef IP_PKTINFO
+		if ((cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
+			*to_len = sizeof(struct sockaddr_in);
+
+			if (ifindex) *ifindex = i->ipi_ifindex;
+
+			break;
+		}
+#endif
+
+#ifdef IP_RECVDSTADDR
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
+			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = *i;
+
+			*to_len = sizeof(struct sockaddr_in);
+
+			break;
+		}
+#endif
+
+#ifdef IPV6_PKTINFO
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
+			*to_len = sizeof(struct sockaddr_in6);
+
+			if (ifindex) *ifindex = i->ipi6_ifindex;
+
+			break;
+		}
+#endif
+
+#ifdef SO_TIMESTAMP
+		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
+			*when = fr_time_from_timeval((struct timeval *)CMSG_DATA(cmsg));
+		}
+#endif
+
+#ifdef SO_TIMESTAMPNS
+		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMPNS)) {
+			*when = fr_time_from_timespec((struct timespec *)CMSG_DATA(cmsg));
+		}
+#endif
+	}
+}
+
 /** Read a packet from a file descriptor, retrieving additional header information
  *
  * Abstracts away the complexity of using the complexity of using recvmsg().
@@ -195,7 +279,6 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 	       fr_time_t *when)
 {
 	struct msghdr		msgh;
-	struct cmsghdr		*cmsg;
 	struct iovec		iov;
 	char			cbuf[256];
 	int			ret;
@@ -298,105 +381,34 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 
 	if (from_len) *from_len = msgh.msg_namelen;
 
-	if (ifindex) *ifindex = 0;
-	if (when) *when = fr_time_wrap(0);
-
-/*
- *	Needed for emscripten, seems to be an issue in CMSG_NXTHDR
- */
-DIAG_OFF(sign-compare)
-	/* Process auxiliary received data in msgh */
-	for (cmsg = CMSG_FIRSTHDR(&msgh);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
-DIAG_ON(sign-compare)
-
-#ifdef IP_PKTINFO
-		if ((cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == IP_PKTINFO)) {
-			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
-
-			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
-			*to_len = sizeof(struct sockaddr_in);
-
-			if (ifindex) *ifindex = i->ipi_ifindex;
-
-			break;
-		}
-#endif
-
-#ifdef IP_RECVDSTADDR
-		if ((cmsg->cmsg_level == IPPROTO_IP) &&
-		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
-			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
-
-			((struct sockaddr_in *)to)->sin_addr = *i;
-
-			*to_len = sizeof(struct sockaddr_in);
-
-			break;
-		}
-#endif
-
-#ifdef IPV6_PKTINFO
-		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
-		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
-			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
-
-			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
-			*to_len = sizeof(struct sockaddr_in6);
-
-			if (ifindex) *ifindex = i->ipi6_ifindex;
-
-			break;
-		}
-#endif
-
-#ifdef SO_TIMESTAMP
-		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
-			*when = fr_time_from_timeval((struct timeval *)CMSG_DATA(cmsg));
-		}
-#endif
-
-#ifdef SO_TIMESTAMPNS
-		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMPNS)) {
-			*when = fr_time_from_timespec((struct timespec *)CMSG_DATA(cmsg));
-		}
-#endif
-	}
+	recvfromto_cmsg(&msgh, ifindex, to, to_len, when);
 
 	if (when && fr_time_eq(*when, fr_time_wrap(0))) *when = fr_time();
 
 	return ret;
 }
 
-/** Send packet via a file descriptor, setting the src address and outbound interface
+/** Add the control data needed to set the src address and outbound interface of a datagram
  *
- * Abstracts away the complexity of using the complexity of using sendmsg().
+ * Used by sendfromto(), and by callers which build their own msghdr
+ * structures for sendmmsg().
  *
- * @param[in] fd	The file descriptor to write to.
- * @param[in] buf	Where to read datagram data from.
- * @param[in] len	of datagram data.
- * @param[in] flags	passed unmolested to sendmsg.
+ * @param[in] fd	The file descriptor the datagram will be written to.
+ * @param[in] msgh	to add the control data to.
+ * @param[in] cbuf	Buffer to write the control data to.
+ * @param[in] cbuf_len	Length of cbuf.  Must be at least 256 bytes.
  * @param[in] ifindex	The interface on which to send the datagram.
  *			If automatic interface selection is desired, value should be 0.
  * @param[in] from	The source address.
  * @param[in] from_len	Length of the structure pointed to by from.
- * @param[in] to	The destination address.
- * @param[in] to_len	Length of the structure pointed to by to.
  * @return
- *	- 0 on success.
+ *	- 1 if control data was added to msgh.
+ *	- 0 if no control data is needed.  The datagram can be sent with sendto().
  *	- -1 on failure.
  */
-int sendfromto(int fd, void *buf, size_t len, int flags,
-	       int ifindex,
-	       struct sockaddr *from, socklen_t from_len,
-	       struct sockaddr *to, socklen_t to_len)
+int sendfromto_cmsg(int fd, struct msghdr *msgh, void *cbuf, size_t cbuf_len,
+		    int ifindex, struct sockaddr *from, socklen_t from_len)
 {
-	struct msghdr	msgh;
-	struct iovec	iov;
-	char		cbuf[256];
-
 	/*
 	 *	Unknown address family, die.
 	 */
@@ -434,6 +446,8 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		break;
 	}
 	}
+#else
+	(void) fd;
 #endif	/* !__FreeBSD__ */
 
 	/*
@@ -460,20 +474,10 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 			(((struct sockaddr_in *) from)->sin_addr.s_addr == INADDR_ANY)) ||
 		(from->sa_family == AF_INET6 &&
 			IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) from)->sin6_addr))))) {
-		return sendto(fd, buf, len, flags, to, to_len);
+		return 0;
 	}
 
-	/* Set up control buffer iov and msgh structures. */
-	memset(&cbuf, 0, sizeof(cbuf));
-	memset(&msgh, 0, sizeof(msgh));
-	memset(&iov, 0, sizeof(iov));
-	iov.iov_base = buf;
-	iov.iov_len = len;
-
-	msgh.msg_iov = &iov;
-	msgh.msg_iovlen = 1;
-	msgh.msg_name = to;
-	msgh.msg_namelen = to_len;
+	memset(cbuf, 0, cbuf_len);
 
 # if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
 	if (from->sa_family == AF_INET) {
@@ -483,10 +487,10 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = SOL_IP;
 		cmsg->cmsg_type = IP_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -500,10 +504,10 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in_addr *in;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IP;
 		cmsg->cmsg_type = IP_SENDSRCADDR;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
@@ -521,10 +525,10 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 		struct cmsghdr *cmsg;
 		struct in6_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IPV6;
 		cmsg->cmsg_type = IPV6_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -536,6 +540,57 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 	}
 #  endif	/* IPV6_PKTINFO */
 
+	return 1;
+}
+
+/** Send packet via a file descriptor, setting the src address and outbound interface
+ *
+ * Abstracts away the complexity of using the complexity of using sendmsg().
+ *
+ * @param[in] fd	The file descriptor to write to.
+ * @param[in] buf	Where to read datagram data from.
+ * @param[in] len	of datagram data.
+ * @param[in] flags	passed unmolested to sendmsg.
+ * @param[in] ifindex	The interface on which to send the datagram.
+ *			If automatic interface selection is desired, value should be 0.
+ * @param[in] from	The source address.
+ * @param[in] from_len	Length of the structure pointed to by from.
+ * @param[in] to	The destination address.
+ * @param[in] to_len	Length of the structure pointed to by to.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int sendfromto(int fd, void *buf, size_t len, int flags,
+	       int ifindex,
+	       struct sockaddr *from, socklen_t from_len,
+	       struct sockaddr *to, socklen_t to_len)
+{
+	struct msghdr	msgh;
+	struct iovec	iov;
+	char		cbuf[256];
+	int		ret;
+
+	memset(&msgh, 0, sizeof(msgh));
+
+	ret = sendfromto_cmsg(fd, &msgh, cbuf, sizeof(cbuf), ifindex, from, from_len);
+	if (ret < 0) return -1;
+
+	/*
+	 *	No control data needed, just use regular sendto.
+	 */
+	if (ret == 0) return sendto(fd, buf, len, flags, to, to_len);
+
+	/* Set up iov and msgh structures. */
+	memset(&iov, 0, sizeof(iov));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_name = to;
+	msgh.msg_namelen = to_len;
+
 	return sendmsg(fd, &msgh, flags);
 }
 
@@ -45,10 +45,16 @@ int	recvfromto(int s, void *buf, size_t len, int flags,
 		   struct sockaddr *to, socklen_t *tolen,
 		   fr_time_t *when);
 
+void	recvfromto_cmsg(struct msghdr *msgh, int *ifindex,
+			struct sockaddr *to, socklen_t *to_len, fr_time_t *when);
+
 int	sendfromto(int s, void *buf, size_t len, int flags,
 		   int ifindex,
 		   struct sockaddr *from, socklen_t fromlen,
 		   struct sockaddr *to, socklen_t tolen);
+
+int	sendfromto_cmsg(int fd, struct msghdr *msgh, void *cbuf, size_t cbuf_len,
+			int ifindex, struct sockaddr *from, socklen_t from_len);
 #ifdef __cplusplus
 }
 #endif
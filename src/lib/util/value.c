@@ -51,10 +51,12 @@ RCSID("$Id$")
 #include <freeradius-devel/util/atexit.h>
 #include <freeradius-devel/util/base16.h>
 #include <freeradius-devel/util/dcursor.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/size.h>
 #include <freeradius-devel/util/time.h>
 
 #include <math.h>
+#include <pthread.h>
 
 /** Sanity checks
  *
@@ -3294,6 +3296,288 @@ bad_cast:
 }
 
 
+/** Pairs of decimal digits, for printing integers two digits at a time
+ *
+ */
+static char const value_box_digits[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/** Print an unsigned integer in decimal
+ *
+ * @param[out] out	Where to write the \0 terminated string.  Must have room for 21 bytes.
+ * @param[in] num	to print.
+ * @return the length of the string.
+ */
+static inline CC_HINT(always_inline) size_t value_box_uint_to_str(char *out, uint64_t num)
+{
+	char	tmp[20];
+	char	*p = tmp + sizeof(tmp);
+	size_t	len;
+
+	while (num >= 100) {
+		unsigned int i = (num % 100) * 2;
+
+		num /= 100;
+		*--p = value_box_digits[i + 1];
+		*--p = value_box_digits[i];
+	}
+
+	if (num >= 10) {
+		*--p = value_box_digits[(num * 2) + 1];
+		*--p = value_box_digits[num * 2];
+	} else {
+		*--p = '0' + num;
+	}
+
+	len = (tmp + sizeof(tmp)) - p;
+	memcpy(out, p, len);
+	out[len] = '\0';
+
+	return len;
+}
+
+/** Print a signed integer in decimal
+ *
+ * @param[out] out	Where to write the \0 terminated string.  Must have room for 21 bytes.
+ * @param[in] num	to print.
+ * @return the length of the string.
+ */
+static inline CC_HINT(always_inline) size_t value_box_int_to_str(char *out, int64_t num)
+{
+	if (num >= 0) return value_box_uint_to_str(out, (uint64_t)num);
+
+	out[0] = '-';
+	return value_box_uint_to_str(out + 1, ~((uint64_t)num) + 1) + 1;
+}
+
+/** Print the common scalar types, without allocating, or going through fr_sbuff_t
+ *
+ * The output is the same as #fr_value_box_print, for the types which are supported.
+ *
+ * @param[out] out	Where to write the \0 terminated string.
+ * @param[in] outlen	Length of out.  Should be at least #FR_VALUE_BOX_PRINT_FAST_LEN.
+ * @param[in] vb	to print.
+ * @return
+ *	- >= 0 the length of the string written to out.
+ *	- -1 if there's no fast path for the box, or out is too small.
+ *	  The caller should use #fr_value_box_print or #fr_value_box_cast instead.
+ *	  No error is set.
+ */
+fr_slen_t fr_value_box_print_fast(char *out, size_t outlen, fr_value_box_t const *vb)
+{
+	char		buff[FR_VALUE_BOX_PRINT_FAST_LEN];
+	size_t		len;
+
+	/*
+	 *	Might need to print the name instead
+	 */
+	if (vb->enumv && vb->enumv->flags.has_value) return -1;
+
+	switch (vb->type) {
+	case FR_TYPE_UINT8:
+		len = value_box_uint_to_str(buff, vb->vb_uint8);
+		break;
+
+	case FR_TYPE_UINT16:
+		len = value_box_uint_to_str(buff, vb->vb_uint16);
+		break;
+
+	case FR_TYPE_UINT32:
+		len = value_box_uint_to_str(buff, vb->vb_uint32);
+		break;
+
+	case FR_TYPE_UINT64:
+		len = value_box_uint_to_str(buff, vb->vb_uint64);
+		break;
+
+	case FR_TYPE_INT8:
+		len = value_box_int_to_str(buff, vb->vb_int8);
+		break;
+
+	case FR_TYPE_INT16:
+		len = value_box_int_to_str(buff, vb->vb_int16);
+		break;
+
+	case FR_TYPE_INT32:
+		len = value_box_int_to_str(buff, vb->vb_int32);
+		break;
+
+	case FR_TYPE_INT64:
+		len = value_box_int_to_str(buff, vb->vb_int64);
+		break;
+
+	case FR_TYPE_BOOL:
+		if (vb->vb_bool) {
+			len = sizeof("yes") - 1;
+			memcpy(buff, "yes", sizeof("yes"));
+		} else {
+			len = sizeof("no") - 1;
+			memcpy(buff, "no", sizeof("no"));
+		}
+		break;
+
+	case FR_TYPE_IPV4_ADDR:
+	{
+		uint8_t const	*octets = (uint8_t const *)&vb->vb_ip.addr.v4.s_addr;
+		size_t		i;
+
+		if (vb->vb_ip.af != AF_INET) return -1;
+
+		len = 0;
+		for (i = 0; i < 4; i++) {
+			if (i) buff[len++] = '.';
+			len += value_box_uint_to_str(buff + len, octets[i]);
+		}
+	}
+		break;
+
+	default:
+		return -1;
+	}
+
+	if (len >= outlen) return -1;
+	memcpy(out, buff, len + 1);
+
+	return len;
+}
+
+/** Convert the common scalar types to a string, without the sbuff and talloc'd intermediary
+ *
+ */
+static int fr_value_box_cast_fast_to_strvalue(TALLOC_CTX *ctx, fr_value_box_t *dst,
+					      fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+					      fr_value_box_t const *src)
+{
+	char		buff[FR_VALUE_BOX_PRINT_FAST_LEN];
+	fr_slen_t	slen;
+
+	slen = fr_value_box_print_fast(buff, sizeof(buff), src);
+	if (slen < 0) return fr_value_box_cast_to_strvalue(ctx, dst, dst_type, dst_enumv, src);
+
+	return fr_value_box_bstrndup(ctx, dst, dst_enumv, buff, slen, src->tainted);
+}
+
+/** Convert plain decimal strings to integers, without copying them into a temporary buffer
+ *
+ * Anything else, i.e. hex, octal, whitespace, enumeration names, or
+ * values which are out of range, is passed to the generic parser so
+ * that the results and errors are the same.
+ */
+static int fr_value_box_cast_fast_str_to_integer(TALLOC_CTX *ctx, fr_value_box_t *dst,
+						 fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+						 fr_value_box_t const *src)
+{
+	char const	*p = src->vb_strvalue, *end = p + src->vb_length;
+	uint64_t	num = 0, max;
+	bool		neg = false;
+
+	if (dst_enumv && dst_enumv->flags.has_value) goto generic;
+
+	if ((p < end) && (*p == '-')) {
+		neg = true;
+		p++;
+	}
+
+	/*
+	 *	19 digits always fits in a uint64_t.  Leading zeros mean octal.
+	 */
+	if ((p == end) || ((end - p) > 19) || ((*p == '0') && (neg || ((end - p) > 1)))) goto generic;
+
+	while (p < end) {
+		if (!isdigit((uint8_t) *p)) goto generic;
+		num = (num * 10) + (*p++ - '0');
+	}
+
+	switch (dst_type) {
+	case FR_TYPE_UINT8:	max = UINT8_MAX; break;
+	case FR_TYPE_UINT16:	max = UINT16_MAX; break;
+	case FR_TYPE_UINT32:	max = UINT32_MAX; break;
+	case FR_TYPE_UINT64:	max = UINT64_MAX; break;
+	case FR_TYPE_INT8:	max = (uint64_t)INT8_MAX + neg; break;
+	case FR_TYPE_INT16:	max = (uint64_t)INT16_MAX + neg; break;
+	case FR_TYPE_INT32:	max = (uint64_t)INT32_MAX + neg; break;
+	case FR_TYPE_INT64:	max = (uint64_t)INT64_MAX + neg; break;
+	default:
+		goto generic;
+	}
+	if (num > max) goto generic;
+	if (neg && !fr_type_is_signed(dst_type)) goto generic;
+
+	fr_value_box_init(dst, dst_type, dst_enumv, src->tainted);
+
+	switch (dst_type) {
+	case FR_TYPE_UINT8:	dst->vb_uint8 = num; break;
+	case FR_TYPE_UINT16:	dst->vb_uint16 = num; break;
+	case FR_TYPE_UINT32:	dst->vb_uint32 = num; break;
+	case FR_TYPE_UINT64:	dst->vb_uint64 = num; break;
+	default:
+	{
+		int64_t snum = neg ? -(int64_t)(num - 1) - 1 : (int64_t)num;
+
+		switch (dst_type) {
+		case FR_TYPE_INT8:	dst->vb_int8 = snum; break;
+		case FR_TYPE_INT16:	dst->vb_int16 = snum; break;
+		case FR_TYPE_INT32:	dst->vb_int32 = snum; break;
+		default:		dst->vb_int64 = snum; break;
+		}
+	}
+		break;
+	}
+
+	return 0;
+
+generic:
+	return fr_value_box_from_str(ctx, dst, dst_type, dst_enumv,
+				     src->vb_strvalue, src->vb_length, NULL, src->tainted);
+}
+
+typedef int (*fr_value_box_cast_func_t)(TALLOC_CTX *ctx, fr_value_box_t *dst,
+					fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
+					fr_value_box_t const *src);
+
+#define CAST_FAST_TO_STRING	[FR_TYPE_STRING] = fr_value_box_cast_fast_to_strvalue
+
+/** Specialised functions for the most common casts, indexed by [src][dst]
+ *
+ * These are mostly the conversions done by xlat and tmpl expansions,
+ * i.e. printing integers and addresses into strings, and parsing
+ * function arguments.
+ *
+ * Anything not listed here goes through the generic code in #fr_value_box_cast.
+ */
+static fr_value_box_cast_func_t const value_box_cast_fast[FR_TYPE_MAX + 1][FR_TYPE_MAX + 1] = {
+	[FR_TYPE_STRING] = {
+		[FR_TYPE_UINT8] = fr_value_box_cast_fast_str_to_integer,
+		[FR_TYPE_UINT16] = fr_value_box_cast_fast_str_to_integer,
+		[FR_TYPE_UINT32] = fr_value_box_cast_fast_str_to_integer,
+		[FR_TYPE_UINT64] = fr_value_box_cast_fast_str_to_integer,
+		[FR_TYPE_INT8] = fr_value_box_cast_fast_str_to_integer,
+		[FR_TYPE_INT16] = fr_value_box_cast_fast_str_to_integer,
+		[FR_TYPE_INT32] = fr_value_box_cast_fast_str_to_integer,
+		[FR_TYPE_INT64] = fr_value_box_cast_fast_str_to_integer,
+	},
+
+	[FR_TYPE_BOOL] = { CAST_FAST_TO_STRING },
+	[FR_TYPE_UINT8] = { CAST_FAST_TO_STRING },
+	[FR_TYPE_UINT16] = { CAST_FAST_TO_STRING },
+	[FR_TYPE_UINT32] = { CAST_FAST_TO_STRING },
+	[FR_TYPE_UINT64] = { CAST_FAST_TO_STRING },
+	[FR_TYPE_INT8] = { CAST_FAST_TO_STRING },
+	[FR_TYPE_INT16] = { CAST_FAST_TO_STRING },
+	[FR_TYPE_INT32] = { CAST_FAST_TO_STRING },
+	[FR_TYPE_INT64] = { CAST_FAST_TO_STRING },
+	[FR_TYPE_IPV4_ADDR] = { CAST_FAST_TO_STRING },
+};
+
 /** Convert one type of fr_value_box_t to another
  *
  * This should be the canonical function used to convert between INTERNAL data formats.
@@ -3359,6 +3643,13 @@ int fr_value_box_cast(TALLOC_CTX *ctx, fr_value_box_t *dst,
 	 */
 	fr_value_box_init(dst, dst_type, NULL, src->tainted);
 
+	/*
+	 *	Common conversions with their own functions
+	 */
+	if (value_box_cast_fast[src->type][dst_type]) {
+		return value_box_cast_fast[src->type][dst_type](ctx, dst, dst_type, dst_enumv, src);
+	}
+
 	/*
 	 *	Dispatch to specialised cast functions
 	 */
@@ -3636,6 +3927,89 @@ int fr_value_unbox_ipaddr(fr_ipaddr_t *dst, fr_value_box_t *src)
 	return 0;
 }
 
+/** A value shared by all the boxes interned with it
+ *
+ * The buffer is the only child of the entry, so the entry can be found
+ * from a box with talloc_parent().
+ */
+typedef struct {
+	fr_type_t		type;		//!< #FR_TYPE_STRING or #FR_TYPE_OCTETS.
+	size_t			len;		//!< Length of the value, not including the \0 of strings.
+	void const		*ptr;		//!< The value.
+	uint32_t		hash;		//!< Of the type and value.
+	uint64_t		refs;		//!< How many boxes are holding the value.
+} value_box_intern_t;
+
+static fr_hash_table_t	*value_box_intern_table;
+static pthread_mutex_t	value_box_intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t _value_box_intern_hash(void const *data)
+{
+	value_box_intern_t const *entry = data;
+
+	return entry->hash;
+}
+
+static int8_t _value_box_intern_cmp(void const *one, void const *two)
+{
+	value_box_intern_t const *a = one, *b = two;
+
+	CMP_RETURN(a, b, type);
+	MEMCMP_RETURN(a, b, ptr, len);
+
+	return 0;
+}
+
+/** Free the intern table on exit
+ *
+ * Entries still held by boxes aren't children of the table, and are
+ * freed when they're released.
+ */
+static int _value_box_intern_table_free(UNUSED void *uctx)
+{
+	pthread_mutex_lock(&value_box_intern_mutex);
+	TALLOC_FREE(value_box_intern_table);
+	pthread_mutex_unlock(&value_box_intern_mutex);
+
+	return 0;
+}
+
+/** Release a box's reference to an interned value, freeing the value if it was the last one
+ *
+ */
+static void value_box_intern_release(fr_value_box_t *vb)
+{
+	value_box_intern_t *entry;
+
+	entry = talloc_get_type_abort(talloc_parent(vb->datum.ptr), value_box_intern_t);
+
+	pthread_mutex_lock(&value_box_intern_mutex);
+	if (--entry->refs == 0) {
+		if (value_box_intern_table) fr_hash_table_remove(value_box_intern_table, entry);
+		talloc_free(entry);
+	}
+	pthread_mutex_unlock(&value_box_intern_mutex);
+
+	vb->interned = 0;
+}
+
+/** Take another reference to the interned value held by src, for dst
+ *
+ */
+static void value_box_intern_ref(fr_value_box_t *dst, fr_value_box_t const *src)
+{
+	value_box_intern_t *entry;
+
+	entry = talloc_get_type_abort(talloc_parent(src->datum.ptr), value_box_intern_t);
+
+	pthread_mutex_lock(&value_box_intern_mutex);
+	entry->refs++;
+	pthread_mutex_unlock(&value_box_intern_mutex);
+
+	dst->datum.ptr = src->datum.ptr;
+	dst->interned = 1;
+}
+
 /** Clear/free any existing value
  *
  * @note Do not use on uninitialised memory.
@@ -3647,6 +4021,17 @@ void fr_value_box_clear_value(fr_value_box_t *data)
 	switch (data->type) {
 	case FR_TYPE_OCTETS:
 	case FR_TYPE_STRING:
+		/*
+		 *	Borrowed buffers belong to someone else
+		 */
+		if (data->borrowed) {
+			data->borrowed = 0;
+			break;
+		}
+		if (data->interned) {
+			value_box_intern_release(data);
+			break;
+		}
 		if (data->secret) memset_explicit(data->datum.ptr, 0, data->vb_length);
 		talloc_free(data->datum.ptr);
 		break;
@@ -3727,6 +4112,8 @@ int fr_value_box_copy(TALLOC_CTX *ctx, fr_value_box_t *dst, const fr_value_box_t
 		}
 		dst->vb_strvalue = str;
 		fr_value_box_copy_meta(dst, src);
+		dst->borrowed = 0;
+		dst->interned = 0;
 	}
 		break;
 
@@ -3746,6 +4133,8 @@ int fr_value_box_copy(TALLOC_CTX *ctx, fr_value_box_t *dst, const fr_value_box_t
 		}
 		dst->vb_octets = bin;
 		fr_value_box_copy_meta(dst, src);
+		dst->borrowed = 0;
+		dst->interned = 0;
 	}
 		break;
 
@@ -3789,7 +4178,9 @@ int fr_value_box_copy(TALLOC_CTX *ctx, fr_value_box_t *dst, const fr_value_box_t
  * Like #fr_value_box_copy, but does not duplicate the buffers of the src value_box.
  *
  * For #FR_TYPE_STRING and #FR_TYPE_OCTETS adds a reference from ctx so that the
- * buffer cannot be freed until the ctx is freed.
+ * buffer cannot be freed until the ctx is freed.  Borrowed buffers aren't
+ * referenced, the copy borrows them, and src must outlive dst.  Interned buffers
+ * gain a reference in the intern table, which is released when dst is cleared.
  *
  * @param[in] ctx	to add reference from.  If NULL no reference will be added.
  * @param[in] dst	to copy value to.
@@ -3804,8 +4195,60 @@ void fr_value_box_copy_shallow(TALLOC_CTX *ctx, fr_value_box_t *dst, fr_value_bo
 
 	case FR_TYPE_STRING:
 	case FR_TYPE_OCTETS:
+		/*
+		 *	Borrowed buffers aren't talloc chunks, so can't be referenced.
+		 */
+		if (src->borrowed) {
+			dst->datum.ptr = src->datum.ptr;
+			fr_value_box_copy_meta(dst, src);
+			dst->borrowed = 1;
+			dst->interned = 0;
+			break;
+		}
+
+		/*
+		 *	Interned buffers are accounted for by the intern table.
+		 *	The box holding src may be freed by another thread, so
+		 *	dst needs its own reference.
+		 */
+		if (src->interned) {
+			fr_value_box_copy_meta(dst, src);
+			dst->borrowed = 0;
+			value_box_intern_ref(dst, src);
+			break;
+		}
 		dst->datum.ptr = ctx ? talloc_reference(ctx, src->datum.ptr) : src->datum.ptr;
 		fr_value_box_copy_meta(dst, src);
+		dst->borrowed = 0;
+		dst->interned = 0;
+		break;
+	}
+}
+
+/** Borrow the buffer of another box
+ *
+ * Like #fr_value_box_copy_shallow, but never adds a reference.  The buffer
+ * is never freed by dst, and is copied by #fr_value_box_unborrow before any
+ * operation which would modify it.
+ *
+ * src must outlive dst, and must not be modified while dst borrows from it.
+ *
+ * @param[in] dst	to copy value to.
+ * @param[in] src	to borrow from.
+ */
+void fr_value_box_borrow(fr_value_box_t *dst, fr_value_box_t const *src)
+{
+	switch (src->type) {
+	default:
+		fr_value_box_copy(NULL, dst, src);
+		break;
+
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		dst->datum.ptr = src->datum.ptr;
+		fr_value_box_copy_meta(dst, src);
+		dst->borrowed = 1;
+		dst->interned = 0;
 		break;
 	}
 }
@@ -3831,6 +4274,9 @@ int fr_value_box_steal(TALLOC_CTX *ctx, fr_value_box_t *dst, fr_value_box_t *src
 	{
 		char const *str;
 
+		if (src->borrowed) return fr_value_box_copy(ctx, dst, src);
+		if (src->interned) goto move_interned;
+
 		str = talloc_steal(ctx, src->vb_strvalue);
 		if (!str) {
 			fr_strerror_const("Failed stealing string buffer");
@@ -3847,6 +4293,9 @@ int fr_value_box_steal(TALLOC_CTX *ctx, fr_value_box_t *dst, fr_value_box_t *src
 	{
 		uint8_t const *bin;
 
+		if (src->borrowed) return fr_value_box_copy(ctx, dst, src);
+		if (src->interned) goto move_interned;
+
  		bin = talloc_steal(ctx, src->vb_octets);
 		if (!bin) {
 			fr_strerror_const("Failed stealing octets buffer");
@@ -3875,6 +4324,19 @@ int fr_value_box_steal(TALLOC_CTX *ctx, fr_value_box_t *dst, fr_value_box_t *src
 	}
 		return 0;
 	}
+
+move_interned:
+	/*
+	 *	The reference to the interned buffer moves with the value
+	 */
+	dst->datum.ptr = src->datum.ptr;
+	fr_value_box_copy_meta(dst, src);
+	dst->borrowed = 0;
+	dst->interned = 1;
+	memset(&src->datum, 0, sizeof(src->datum));
+	src->interned = 0;
+
+	return 0;
 }
 
 /** Copy a nul terminated string to a #fr_value_box_t
@@ -3921,6 +4383,8 @@ int fr_value_box_strtrim(TALLOC_CTX *ctx, fr_value_box_t *vb)
 
 	if (!fr_cond_assert(vb->type == FR_TYPE_STRING)) return -1;
 
+	if (unlikely(fr_value_box_unborrow(ctx, vb) < 0)) return -1;
+
 	len = strlen(vb->vb_strvalue);
 	str = talloc_realloc(ctx, UNCONST(char *, vb->vb_strvalue), char, len + 1);
 	if (!str) {
@@ -4073,6 +4537,8 @@ int fr_value_box_bstr_realloc(TALLOC_CTX *ctx, char **out, fr_value_box_t *dst,
 
 	fr_assert(dst->type == FR_TYPE_STRING);
 
+	if (unlikely(fr_value_box_unborrow(ctx, dst) < 0)) return -1;
+
 	memcpy(&cstr, &dst->vb_strvalue, sizeof(cstr));
 
 	clen = talloc_array_length(dst->vb_strvalue) - 1;
@@ -4259,9 +4725,11 @@ int fr_value_box_bstrn_append(TALLOC_CTX *ctx, fr_value_box_t *dst, char const *
 		return -1;
 	}
 
-	ptr = dst->datum.ptr;
-	if (!fr_cond_assert(ptr)) return -1;
+	if (!fr_cond_assert(dst->datum.ptr)) return -1;
 
+	if (unlikely(fr_value_box_unborrow(ctx, dst) < 0)) return -1;
+
+	ptr = dst->datum.ptr;
 	if (talloc_reference_count(ptr) > 0) {
 		fr_strerror_printf("%s: Boxed value has too many references", __FUNCTION__);
 		return -1;
@@ -4373,6 +4841,8 @@ int fr_value_box_mem_realloc(TALLOC_CTX *ctx, uint8_t **out, fr_value_box_t *dst
 
 	fr_assert(dst->type == FR_TYPE_OCTETS);
 
+	if (unlikely(fr_value_box_unborrow(ctx, dst) < 0)) return -1;
+
 	memcpy(&cbin, &dst->vb_octets, sizeof(cbin));
 
 	clen = talloc_array_length(dst->vb_octets);
@@ -4517,6 +4987,170 @@ void fr_value_box_memdup_shallow(fr_value_box_t *dst, fr_dict_attr_t const *enum
 	dst->vb_length = len;
 }
 
+/** Assign a buffer owned by something else to a box, without copying or referencing it
+ *
+ * Used where the buffer is a slice of a larger allocation, such as a packet, which
+ * outlives the box.  The buffer is never freed or resized by the box, and is copied
+ * by #fr_value_box_unborrow before any operation which would modify it.
+ *
+ * @param[in] dst 	to assign buffer to.
+ * @param[in] enumv	Aliases for values.
+ * @param[in] src	a buffer which must outlive dst.
+ * @param[in] len	of buffer.
+ * @param[in] tainted	Whether the value came from a trusted source.
+ */
+void fr_value_box_memdup_borrowed(fr_value_box_t *dst, fr_dict_attr_t const *enumv,
+				  uint8_t const *src, size_t len, bool tainted)
+{
+	fr_value_box_init(dst, FR_TYPE_OCTETS, enumv, tainted);
+	dst->vb_octets = src;
+	dst->vb_length = len;
+	dst->borrowed = 1;
+}
+
+/** Give a box its own copy of a borrowed or interned buffer
+ *
+ * @param[in] ctx	to allocate the copy in.
+ * @param[in] vb	to take ownership of its buffer.
+ * @return
+ *	- 0 on success (or if the buffer wasn't borrowed or interned).
+ *	- -1 on failure.
+ */
+int fr_value_box_unborrow(TALLOC_CTX *ctx, fr_value_box_t *vb)
+{
+	void *ptr;
+
+	if (!vb->borrowed && !vb->interned) return 0;
+
+	switch (vb->type) {
+	case FR_TYPE_STRING:
+		ptr = talloc_bstrndup(ctx, vb->vb_strvalue, vb->vb_length);
+		break;
+
+	case FR_TYPE_OCTETS:
+		ptr = talloc_memdup(ctx, vb->vb_octets, vb->vb_length);
+		if (ptr) talloc_set_type(ptr, uint8_t);
+		break;
+
+	default:
+		fr_assert(0);
+		return 0;
+	}
+	if (!ptr) {
+		fr_strerror_const("Failed allocating buffer");
+		return -1;
+	}
+
+	if (vb->interned) value_box_intern_release(vb);
+	vb->datum.ptr = ptr;
+	vb->borrowed = 0;
+
+	return 0;
+}
+
+/** Return the number of distinct values in the intern table
+ *
+ */
+size_t fr_value_box_intern_count(void)
+{
+	size_t count = 0;
+
+	pthread_mutex_lock(&value_box_intern_mutex);
+	if (value_box_intern_table) count = fr_hash_table_num_elements(value_box_intern_table);
+	pthread_mutex_unlock(&value_box_intern_mutex);
+
+	return count;
+}
+
+/** Replace the buffer of a string or octets box with one from the intern table
+ *
+ * Boxes holding the same value share a single, refcounted, copy of it, which is
+ * freed when the last box holding it is cleared.  This is intended for values
+ * which are stored for a long time, and repeat across many stored entries, such
+ * as those held by caches and session-state.
+ *
+ * The interned buffer is immutable.  Functions which modify a box's buffer in
+ * place give it its own copy first, see #fr_value_box_unborrow.  Copies of an
+ * interned box get their own buffer.
+ *
+ * Secret values aren't interned, as a shared buffer can't be wiped when a box
+ * holding it is cleared.
+ *
+ * @param[in] vb	to intern.  Boxes of other types are left unchanged.
+ * @return
+ *	- 0 on success (or if the box isn't interned).
+ *	- -1 on failure, in which case the box is left unchanged.
+ */
+int fr_value_box_intern(fr_value_box_t *vb)
+{
+	value_box_intern_t	find, *entry;
+
+	switch (vb->type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		break;
+
+	default:
+		return 0;
+	}
+
+	if (vb->interned || vb->secret) return 0;
+
+	find = (value_box_intern_t) {
+		.type = vb->type,
+		.len = vb->vb_length,
+		.ptr = vb->datum.ptr
+	};
+	find.hash = fr_hash_update(find.ptr, find.len, fr_hash(&find.type, sizeof(find.type)));
+
+	pthread_mutex_lock(&value_box_intern_mutex);
+	if (unlikely(!value_box_intern_table)) {
+		value_box_intern_table = fr_hash_table_alloc(NULL, _value_box_intern_hash, _value_box_intern_cmp, NULL);
+		if (!value_box_intern_table) {
+			pthread_mutex_unlock(&value_box_intern_mutex);
+			fr_strerror_const("Failed allocating intern table");
+			return -1;
+		}
+		fr_atexit_global(_value_box_intern_table_free, NULL);
+	}
+
+	entry = fr_hash_table_find(value_box_intern_table, &find);
+	if (!entry) {
+		void *ptr;
+
+		entry = talloc(NULL, value_box_intern_t);
+		if (!entry) {
+		oom:
+			pthread_mutex_unlock(&value_box_intern_mutex);
+			talloc_free(entry);
+			fr_strerror_const("Failed allocating interned value");
+			return -1;
+		}
+		*entry = find;
+		entry->refs = 0;
+
+		if (vb->type == FR_TYPE_STRING) {
+			ptr = talloc_bstrndup(entry, vb->vb_strvalue, vb->vb_length);
+		} else {
+			ptr = talloc_array(entry, uint8_t, vb->vb_length);
+			if (ptr && vb->vb_length) memcpy(ptr, vb->vb_octets, vb->vb_length);
+		}
+		if (!ptr) goto oom;
+		entry->ptr = ptr;
+
+		if (!fr_hash_table_insert(value_box_intern_table, entry)) goto oom;
+	}
+	entry->refs++;
+	pthread_mutex_unlock(&value_box_intern_mutex);
+
+	if (!vb->borrowed) talloc_free(vb->datum.ptr);
+	vb->datum.ptr = UNCONST(void *, entry->ptr);
+	vb->borrowed = 0;
+	vb->interned = 1;
+
+	return 0;
+}
+
 /** Assign a talloced buffer to a box, but don't copy it
  *
  * Adds a reference to the src buffer so that it cannot be freed until the ctx is freed.
@@ -4564,6 +5198,8 @@ int fr_value_box_mem_append(TALLOC_CTX *ctx, fr_value_box_t *dst, uint8_t const
 
 	if (!fr_cond_assert(dst->datum.ptr)) return -1;
 
+	if (unlikely(fr_value_box_unborrow(ctx, dst) < 0)) return -1;
+
 	if (talloc_reference_count(dst->datum.ptr) > 0) {
 		fr_strerror_printf("%s: Boxed value has too many references", __FUNCTION__);
 		return -1;
@@ -5379,35 +6015,35 @@ ssize_t fr_value_box_print(fr_sbuff_t *out, fr_value_box_t const *data, fr_sbuff
 		break;
 
 	case FR_TYPE_UINT8:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%u", data->vb_uint8);
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, buf, value_box_uint_to_str(buf, data->vb_uint8));
 		break;
 
 	case FR_TYPE_UINT16:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%u", data->vb_uint16);
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, buf, value_box_uint_to_str(buf, data->vb_uint16));
 		break;
 
 	case FR_TYPE_UINT32:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%u", data->vb_uint32);
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, buf, value_box_uint_to_str(buf, data->vb_uint32));
 		break;
 
 	case FR_TYPE_UINT64:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%" PRIu64, data->vb_uint64);
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, buf, value_box_uint_to_str(buf, data->vb_uint64));
 		break;
 
 	case FR_TYPE_INT8:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%d", data->vb_int8);
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, buf, value_box_int_to_str(buf, data->vb_int8));
 		break;
 
 	case FR_TYPE_INT16:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%d", data->vb_int16);
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, buf, value_box_int_to_str(buf, data->vb_int16));
 		break;
 
 	case FR_TYPE_INT32:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%d", data->vb_int32);
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, buf, value_box_int_to_str(buf, data->vb_int32));
 		break;
 
 	case FR_TYPE_INT64:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%" PRId64, data->vb_int64);
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, buf, value_box_int_to_str(buf, data->vb_int64));
 		break;
 
 	case FR_TYPE_FLOAT32:
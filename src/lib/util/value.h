@@ -172,6 +172,10 @@ struct value_box_s {
 	unsigned int   				secret : 1;		//!< Same as #fr_dict_attr_flags_t secret
 	unsigned int				immutable : 1;		//!< once set, the value cannot be changed
 	unsigned int				talloced : 1;		//!< Talloced, not stack or text allocated.
+	unsigned int				borrowed : 1;		//!< Buffer is owned by something else, i.e. a
+									///< packet.  Must be copied before being modified.
+	unsigned int				interned : 1;		//!< Buffer is shared via the interned value table.
+									///< Must be copied before being modified.
 	fr_value_box_safe_for_t	_CONST		safe_for;		//!< A unique value to indicate if that value box is safe
 									///< for consumption by a particular module for a particular
 									///< purpose.  e.g. LDAP, SQL, etc.
@@ -686,6 +690,9 @@ void		fr_value_box_copy_shallow(TALLOC_CTX *ctx, fr_value_box_t *dst,
 					  const fr_value_box_t *src)
 		CC_HINT(nonnull(2,3));
 
+void		fr_value_box_borrow(fr_value_box_t *dst, const fr_value_box_t *src)
+		CC_HINT(nonnull);
+
 int		fr_value_box_steal(TALLOC_CTX *ctx, fr_value_box_t *dst, fr_value_box_t *src)
 		CC_HINT(nonnull(2,3));
 
@@ -1178,6 +1185,18 @@ void		fr_value_box_memdup_buffer_shallow(TALLOC_CTX *ctx, fr_value_box_t *dst, f
 						   uint8_t const *src, bool tainted)
 		CC_HINT(nonnull(2,4));
 
+void		fr_value_box_memdup_borrowed(fr_value_box_t *dst, fr_dict_attr_t const *enumv,
+					     uint8_t const *src, size_t len, bool tainted)
+		CC_HINT(nonnull(1,3));
+
+int		fr_value_box_unborrow(TALLOC_CTX *ctx, fr_value_box_t *vb)
+		CC_HINT(nonnull(2));
+
+int		fr_value_box_intern(fr_value_box_t *vb)
+		CC_HINT(nonnull);
+
+size_t		fr_value_box_intern_count(void);
+
 int		fr_value_box_mem_append(TALLOC_CTX *ctx, fr_value_box_t *dst,
 				       uint8_t const *src, size_t len, bool tainted)
 		CC_HINT(nonnull(2,3));
@@ -1256,6 +1275,14 @@ void		fr_value_box_list_untaint(fr_value_box_list_t *head)
 ssize_t		fr_value_box_print(fr_sbuff_t *out, fr_value_box_t const *data, fr_sbuff_escape_rules_t const *e_rules)
 		CC_HINT(nonnull(1,2));
 
+/** Size of buffer which will hold anything printed by #fr_value_box_print_fast
+ *
+ */
+#define FR_VALUE_BOX_PRINT_FAST_LEN	32
+
+fr_slen_t	fr_value_box_print_fast(char *out, size_t outlen, fr_value_box_t const *vb)
+		CC_HINT(nonnull);
+
 ssize_t		fr_value_box_print_quoted(fr_sbuff_t *out, fr_value_box_t const *data, fr_token_t quote)
 		CC_HINT(nonnull);
 
@@ -0,0 +1,824 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file winbind/base.c
+ * @brief Asynchronous client for the winbindd pipe protocol
+ *
+ * libwbclient only provides a blocking API, so every authentication ties
+ * up a worker until winbindd, and usually a domain controller, responds.
+ *
+ * This speaks winbindd's native protocol directly over connections
+ * managed by the trunk API.  Requests and responses are fixed size
+ * structures, optionally followed by extra data in the response.
+ *
+ * winbindd processes the requests from each client in the order they were
+ * received, one at a time.  We write requests as soon as they're queued and
+ * correlate responses using a FIFO of the requests written to each connection.
+ * This avoids a round trip per request, but a slow authentication will delay
+ * those queued behind it on the same connection, so the trunk should be
+ * allowed to open multiple connections.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "winbind"
+
+#include <freeradius-devel/winbind/base.h>
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/socket.h>
+
+#include <sys/types.h>
+#include <winbind_struct_protocol.h>
+
+struct fr_winbind_s {
+	fr_winbind_conf_t const	*conf;			//!< Our configuration.
+	fr_event_list_t		*el;			//!< Event list.
+	trunk_t			*trunk;			//!< Connections to winbindd.
+};
+
+/** A request which has been written, and is awaiting a response
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the connection's list of outstanding requests.
+	trunk_request_t		*treq;			//!< NULL if the request went away before the response arrived.
+} winbind_sent_t;
+
+/** Track the handle, which is tightly correlated with the FD
+ *
+ */
+typedef struct {
+	char const		*name;			//!< Path of the pipe.
+	int			fd;			//!< File descriptor.
+
+	fr_winbind_t		*wb;			//!< Thread instance we belong to.
+
+	uint8_t			*partial;		//!< Remainder of a partially written request.
+	size_t			partial_written;	//!< How much of the remainder has been written.
+
+	struct winbindd_response	rsp;		//!< Response currently being read.
+	size_t			rsp_read;		//!< How much of the fixed part of the response we have.
+	size_t			extra_len;		//!< How much extra data still needs to be discarded.
+
+	fr_dlist_head_t		sent;			//!< Requests awaiting responses, oldest first.
+
+	trunk_connection_event_t	events;		//!< Events the trunk last asked us to listen for.
+} winbind_handle_t;
+
+/** Per request state
+ *
+ */
+typedef struct {
+	struct winbindd_request	req;			//!< Request as it'll be written to winbindd.
+	winbind_sent_t		*sent;			//!< Entry in the outstanding request list.
+} winbind_request_t;
+
+conf_parser_t const fr_winbind_conf_config[] = {
+	{ FR_CONF_OFFSET("path", fr_winbind_conf_t, path), .dflt = "/var/lib/samba/winbindd_privileged/pipe" },
+
+	{ FR_CONF_OFFSET_SUBSECTION("pool", 0, fr_winbind_conf_t, trunk_conf, trunk_config ) },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Free a connection handle, closing associated resources
+ *
+ */
+static int _winbind_handle_free(winbind_handle_t *h)
+{
+	winbind_sent_t *sent;
+
+	/*
+	 *	Ensure requests don't hold references
+	 *	to entries which are about to be freed.
+	 */
+	while ((sent = fr_dlist_pop_head(&h->sent))) {
+		if (sent->treq) {
+			winbind_request_t *u = talloc_get_type_abort(sent->treq->preq, winbind_request_t);
+
+			u->sent = NULL;
+		}
+		talloc_free(sent);
+	}
+
+	fr_assert(h->fd >= 0);
+
+	fr_event_fd_delete(h->wb->el, h->fd, FR_EVENT_FILTER_IO);
+
+	if (shutdown(h->fd, SHUT_RDWR) < 0) {
+		DEBUG3("Failed shutting down connection %s: %s", h->name, fr_syserror(errno));
+	}
+
+	if (close(h->fd) < 0) {
+		DEBUG3("Failed closing connection %s: %s", h->name, fr_syserror(errno));
+	}
+
+	h->fd = -1;
+
+	DEBUG("Connection closed - %s", h->name);
+
+	return 0;
+}
+
+/** Initialise a new connection to winbindd
+ *
+ * @param[out] h_out	Where to write the new connection handle.
+ * @param[in] conn	to initialise.
+ * @param[in] uctx	A #fr_winbind_t.
+ */
+static connection_state_t conn_init(void **h_out, connection_t *conn, void *uctx)
+{
+	int			fd;
+	winbind_handle_t	*h;
+	fr_winbind_t		*wb = talloc_get_type_abort(uctx, fr_winbind_t);
+
+	fd = fr_socket_client_unix(wb->conf->path, true);
+	if (fd < 0) {
+		PERROR("Failed opening connection to %s", wb->conf->path);
+		return CONNECTION_STATE_FAILED;
+	}
+
+	MEM(h = talloc_zero(conn, winbind_handle_t));
+	h->fd = fd;
+	h->wb = wb;
+	h->name = wb->conf->path;
+	fr_dlist_talloc_init(&h->sent, winbind_sent_t, entry);
+	talloc_set_destructor(h, _winbind_handle_free);
+
+	/*
+	 *	Signal the connection
+	 *	as open as soon as it becomes writable.
+	 */
+	connection_signal_on_fd(conn, fd);
+
+	*h_out = h;
+
+	return CONNECTION_STATE_CONNECTING;
+}
+
+/** Shutdown/close a file descriptor
+ *
+ */
+static void conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uctx)
+{
+	winbind_handle_t *h = talloc_get_type_abort(handle, winbind_handle_t);
+
+	DEBUG4("Freeing winbind handle %p", handle);
+
+	talloc_free(h);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_t *thread_conn_alloc(trunk_connection_t *tconn, fr_event_list_t *el,
+				       connection_conf_t const *conf,
+				       char const *log_prefix, void *uctx)
+{
+	connection_t		*conn;
+	fr_winbind_t		*wb = talloc_get_type_abort(uctx, fr_winbind_t);
+
+	conn = connection_alloc(tconn, el,
+				&(connection_funcs_t){
+					.init = conn_init,
+					.close = conn_close,
+				},
+				conf,
+				log_prefix,
+				wb);
+	if (!conn) {
+		PERROR("Failed allocating state handler for new connection");
+		return NULL;
+	}
+
+	return conn;
+}
+
+/** Write to the connection, dealing with transient errors
+ *
+ * @return
+ *	- >= 0 the number of bytes written.
+ *	- -1 on failure.  The connection has been signalled to reconnect.
+ */
+static ssize_t winbind_write(winbind_handle_t *h, trunk_connection_t *tconn, void const *data, size_t data_len)
+{
+	ssize_t slen;
+
+	slen = write(h->fd, data, data_len);
+	if (slen >= 0) return slen;
+
+	switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+	case EWOULDBLOCK:
+#endif
+	case EAGAIN:
+	case EINTR:
+	case ENOBUFS:
+	case ENOMEM:
+		return 0;
+
+	default:
+		ERROR("Failed sending request over connection %s: %s", h->name, fr_syserror(errno));
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		return -1;
+	}
+}
+
+/** Finish writing a partially written request
+ *
+ * @return
+ *	- 0 on success (even if not all data was written).
+ *	- -1 on failure.  The connection has been signalled to reconnect.
+ */
+static int winbind_flush(winbind_handle_t *h, trunk_connection_t *tconn)
+{
+	size_t	len;
+	ssize_t	slen;
+
+	if (!h->partial) return 0;
+
+	len = talloc_array_length(h->partial);
+	slen = winbind_write(h, tconn, h->partial + h->partial_written, len - h->partial_written);
+	if (slen < 0) return -1;
+
+	h->partial_written += slen;
+	if (h->partial_written == len) {
+		TALLOC_FREE(h->partial);
+		h->partial_written = 0;
+	}
+
+	return 0;
+}
+
+static void conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx);
+static void conn_error(fr_event_list_t *el, int fd, int flags, int fd_errno, void *uctx);
+
+/** Register for the I/O events the trunk wants, and any we need to finish writing
+ *
+ */
+static void winbind_events_update(winbind_handle_t *h, fr_event_list_t *el, trunk_connection_t *tconn)
+{
+	fr_event_fd_cb_t	read_fn = NULL;
+	fr_event_fd_cb_t	write_fn = NULL;
+
+	switch (h->events) {
+	case TRUNK_CONN_EVENT_NONE:
+		break;
+
+	case TRUNK_CONN_EVENT_READ:
+		read_fn = trunk_connection_callback_readable;
+		break;
+
+	case TRUNK_CONN_EVENT_WRITE:
+		write_fn = conn_writable;
+		break;
+
+	case TRUNK_CONN_EVENT_BOTH:
+		read_fn = trunk_connection_callback_readable;
+		write_fn = conn_writable;
+		break;
+	}
+
+	/*
+	 *	A partially written request must be
+	 *	finished before winbindd will respond
+	 *	to it, or to anything queued behind it.
+	 */
+	if (h->partial) write_fn = conn_writable;
+
+	if (!read_fn && !write_fn) {
+		fr_event_fd_delete(el, h->fd, FR_EVENT_FILTER_IO);
+		return;
+	}
+
+	if (fr_event_fd_insert(h, NULL, el, h->fd, read_fn, write_fn, conn_error, tconn) < 0) {
+		PERROR("Failed inserting FD event");
+
+		/*
+		 *	May free the connection!
+		 */
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+	}
+}
+
+/** Connection errored
+ *
+ * We were signalled by the event loop that a fatal error occurred on this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that errored.
+ * @param[in] flags	El flags.
+ * @param[in] fd_errno	The nature of the error.
+ * @param[in] uctx	The trunk connection handle (tconn).
+ */
+static void conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	connection_t		*conn = tconn->conn;
+	winbind_handle_t	*h = talloc_get_type_abort(conn->h, winbind_handle_t);
+
+	ERROR("Connection %s failed: %s", h->name, fr_syserror(fd_errno));
+
+	connection_signal_reconnect(conn, CONNECTION_FAILED);
+}
+
+/** Connection is writable
+ *
+ * Finish writing any partially written request, then let the trunk write new ones.
+ */
+static void conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	winbind_handle_t	*h = talloc_get_type_abort(tconn->conn->h, winbind_handle_t);
+
+	if ((h->events == TRUNK_CONN_EVENT_WRITE) || (h->events == TRUNK_CONN_EVENT_BOTH)) {
+		trunk_connection_callback_writable(el, fd, flags, tconn);
+		return;
+	}
+
+	if (winbind_flush(h, tconn) < 0) return;
+
+	if (!h->partial) winbind_events_update(h, el, tconn);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void thread_conn_notify(trunk_connection_t *tconn, connection_t *conn,
+			       fr_event_list_t *el,
+			       trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	winbind_handle_t	*h = talloc_get_type_abort(conn->h, winbind_handle_t);
+
+	h->events = notify_on;
+
+	winbind_events_update(h, el, tconn);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void request_mux(fr_event_list_t *el,
+			trunk_connection_t *tconn, connection_t *conn, UNUSED void *uctx)
+{
+	winbind_handle_t	*h = talloc_get_type_abort(conn->h, winbind_handle_t);
+
+	/*
+	 *	Finish writing the last request before
+	 *	starting on the next one.
+	 */
+	if (winbind_flush(h, tconn) < 0) return;
+	if (h->partial) return;
+
+	for (;;) {
+		trunk_request_t		*treq;
+		winbind_request_t	*u;
+		ssize_t			slen;
+
+		if (unlikely(trunk_connection_pop_request(&treq, tconn) < 0)) return;
+		if (!treq) break;
+
+		u = talloc_get_type_abort(treq->preq, winbind_request_t);
+
+		slen = winbind_write(h, tconn, &u->req, sizeof(u->req));
+		if (slen < 0) return;
+
+		/*
+		 *	Socket is full, the request stays pending
+		 *	and we'll be called again when it drains.
+		 */
+		if (slen == 0) break;
+
+		MEM(u->sent = talloc_zero(h, winbind_sent_t));
+		u->sent->treq = treq;
+		fr_dlist_insert_tail(&h->sent, u->sent);
+
+		/*
+		 *	The remainder of the request is copied
+		 *	so it can still be written if the request
+		 *	goes away before we finish.
+		 */
+		if ((size_t)slen < sizeof(u->req)) {
+			MEM(h->partial = talloc_memdup(h, ((uint8_t *)&u->req) + slen, sizeof(u->req) - slen));
+			h->partial_written = 0;
+		}
+
+		trunk_request_signal_sent(treq);
+
+		if (h->partial) break;
+	}
+
+	/*
+	 *	Verify nothing accidentally freed the connection handle
+	 */
+	(void)talloc_get_type_abort(h, winbind_handle_t);
+
+	/*
+	 *	Didn't write everything, make sure we're told
+	 *	when we can write the rest.
+	 */
+	if (h->partial) winbind_events_update(h, el, tconn);
+}
+
+/** Read from the connection, dealing with transient errors
+ *
+ * @return
+ *	- > 0 the number of bytes read.
+ *	- 0 if no data is available.
+ *	- -1 on failure.  The connection has been signalled to reconnect.
+ */
+static ssize_t winbind_read(winbind_handle_t *h, trunk_connection_t *tconn, void *out, size_t outlen)
+{
+	ssize_t slen;
+
+	slen = read(h->fd, out, outlen);
+	if (slen == 0) {
+		ERROR("Connection %s closed by winbindd", h->name);
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		return -1;
+	}
+	if (slen < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		ERROR("Failed reading response from connection %s: %s", h->name, fr_syserror(errno));
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		return -1;
+	}
+
+	return slen;
+}
+
+/** Copy the result of an authentication out of a response
+ *
+ */
+static void winbind_auth_result(fr_winbind_auth_t *auth, struct winbindd_response const *rsp)
+{
+	auth->nt_status = rsp->data.auth.nt_status;
+
+	if (rsp->result == WINBINDD_OK) {
+		auth->status = FR_WINBIND_AUTH_OK;
+		memcpy(auth->user_session_key, rsp->data.auth.user_session_key, sizeof(auth->user_session_key));
+		return;
+	}
+
+	/*
+	 *	Without an NT status winbindd didn't get as far
+	 *	as checking the credentials.
+	 */
+	auth->status = (auth->nt_status == 0) ? FR_WINBIND_AUTH_FAIL : FR_WINBIND_AUTH_REJECT;
+
+	if (rsp->data.auth.error_string[0]) {
+		MEM(auth->error = talloc_strndup(auth, rsp->data.auth.error_string,
+						 sizeof(rsp->data.auth.error_string)));
+	} else if (rsp->data.auth.nt_status_string[0]) {
+		MEM(auth->error = talloc_strndup(auth, rsp->data.auth.nt_status_string,
+						 sizeof(rsp->data.auth.nt_status_string)));
+	}
+}
+
+static void request_demux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn, connection_t *conn, UNUSED void *uctx)
+{
+	winbind_handle_t	*h = talloc_get_type_abort(conn->h, winbind_handle_t);
+
+	DEBUG3("Reading data for connection %s", h->name);
+
+	for (;;) {
+		winbind_sent_t		*sent;
+		trunk_request_t		*treq;
+		winbind_request_t	*u;
+		ssize_t			slen;
+
+		/*
+		 *	Read the fixed part of the response
+		 */
+		if (h->rsp_read < sizeof(h->rsp)) {
+			slen = winbind_read(h, tconn, ((uint8_t *)&h->rsp) + h->rsp_read, sizeof(h->rsp) - h->rsp_read);
+			if (slen <= 0) return;
+
+			h->rsp_read += slen;
+			if (h->rsp_read < sizeof(h->rsp)) continue;
+
+			if (h->rsp.length < sizeof(h->rsp)) {
+				ERROR("Received malformed response on connection %s, "
+				      "length %u is smaller than the minimum %zu.  "
+				      "Is winbindd using a different protocol version?",
+				      h->name, h->rsp.length, sizeof(h->rsp));
+				trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+				return;
+			}
+			h->extra_len = h->rsp.length - sizeof(h->rsp);
+		}
+
+		/*
+		 *	We don't ask for anything which is returned
+		 *	as extra data, but it still needs to be read
+		 *	to find the start of the next response.
+		 */
+		while (h->extra_len > 0) {
+			uint8_t	discard[1024];
+
+			slen = winbind_read(h, tconn, discard, h->extra_len < sizeof(discard) ? h->extra_len : sizeof(discard));
+			if (slen <= 0) return;
+
+			h->extra_len -= slen;
+		}
+		h->rsp_read = 0;
+
+		sent = fr_dlist_pop_head(&h->sent);
+		if (!sent) {
+			ERROR("Received response on connection %s with no outstanding requests", h->name);
+			trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+			return;
+		}
+
+		treq = sent->treq;
+		talloc_free(sent);
+
+		/*
+		 *	Request was cancelled, or timed out
+		 */
+		if (!treq) continue;
+
+		u = talloc_get_type_abort(treq->preq, winbind_request_t);
+		u->sent = NULL;
+
+		winbind_auth_result(talloc_get_type_abort(treq->rctx, fr_winbind_auth_t), &h->rsp);
+
+		trunk_request_signal_complete(treq);
+	}
+}
+
+/** Clear out anything associated with the handle from the request
+ *
+ */
+static void request_conn_release(UNUSED connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	winbind_request_t	*u = talloc_get_type_abort(preq_to_reset, winbind_request_t);
+
+	/*
+	 *	The response will still arrive,
+	 *	and will just be discarded.
+	 */
+	if (u->sent) {
+		u->sent->treq = NULL;
+		u->sent = NULL;
+	}
+}
+
+/** Let the request know winbindd didn't give us an answer
+ *
+ */
+static void request_fail(request_t *request, UNUSED void *preq, void *rctx,
+			 UNUSED trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_winbind_auth_t	*auth = talloc_get_type_abort(rctx, fr_winbind_auth_t);
+
+	auth->status = FR_WINBIND_AUTH_FAIL;
+	auth->treq = NULL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Result has already been written to the auth ctx at this point
+ *
+ */
+static void request_complete(request_t *request, UNUSED void *preq, void *rctx, UNUSED void *uctx)
+{
+	fr_winbind_auth_t	*auth = talloc_get_type_abort(rctx, fr_winbind_auth_t);
+
+	auth->treq = NULL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Explicitly free resources associated with the protocol request
+ *
+ */
+static void request_free(UNUSED request_t *request, void *preq_to_free, UNUSED void *uctx)
+{
+	winbind_request_t	*u = talloc_get_type_abort(preq_to_free, winbind_request_t);
+
+	fr_assert(!u->sent);	/* Dealt with by request_conn_release */
+
+	talloc_free(u);
+}
+
+/** Allocate per-thread connections to winbindd
+ *
+ * @param[in] ctx		to allocate the handle in.
+ * @param[in] el		to run connections on.
+ * @param[in] conf		Configuration, must remain valid for the lifetime of the handle.
+ * @param[in] log_prefix	Used for trunk and connection log messages.
+ * @return
+ *	- A new handle on success.
+ *	- NULL on failure.
+ */
+fr_winbind_t *fr_winbind_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, fr_winbind_conf_t const *conf,
+			       char const *log_prefix)
+{
+	fr_winbind_t		*wb;
+
+	static trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = thread_conn_alloc,
+						.connection_notify = thread_conn_notify,
+						.request_mux = request_mux,
+						.request_demux = request_demux,
+						.request_conn_release = request_conn_release,
+						.request_complete = request_complete,
+						.request_fail = request_fail,
+						.request_free = request_free
+					};
+
+	MEM(wb = talloc_zero(ctx, fr_winbind_t));
+	wb->conf = conf;
+	wb->el = el;
+
+	wb->trunk = trunk_alloc(wb, el, &io_funcs, &conf->trunk_conf, log_prefix, wb, false);
+	if (!wb->trunk) {
+		talloc_free(wb);
+		return NULL;
+	}
+
+	return wb;
+}
+
+/** Cancel the request if the caller loses interest
+ *
+ */
+static int _winbind_auth_free(fr_winbind_auth_t *auth)
+{
+	if (auth->treq) trunk_request_signal_cancel(auth->treq);
+
+	return 0;
+}
+
+/** Allocate a trunk request, and the winbindd request which will be written
+ *
+ */
+static winbind_request_t *winbind_request_alloc(trunk_request_t **treq_out, fr_winbind_t *wb, request_t *request,
+						enum winbindd_cmd cmd)
+{
+	trunk_request_t		*treq;
+	winbind_request_t	*u;
+
+	treq = trunk_request_alloc(wb->trunk, request);
+	if (!treq) return NULL;
+
+	MEM(u = talloc_zero(treq, winbind_request_t));
+	u->req.length = sizeof(u->req);
+	u->req.cmd = cmd;
+	u->req.pid = getpid();
+
+	*treq_out = treq;
+
+	return u;
+}
+
+/** Queue a request, allocating the structure the result will be written to
+ *
+ */
+static int winbind_request_enqueue(fr_winbind_auth_t **out, TALLOC_CTX *ctx, fr_winbind_t *wb, request_t *request,
+				   trunk_request_t *treq, winbind_request_t *u)
+{
+	fr_winbind_auth_t	*auth;
+
+	MEM(auth = talloc_zero(ctx, fr_winbind_auth_t));
+
+	switch (trunk_request_enqueue(&treq, wb->trunk, request, u, auth)) {
+	case TRUNK_ENQUEUE_OK:
+	case TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		REDEBUG("Unable to queue request for winbindd");
+		trunk_request_free(&treq);	/* Return to the free list */
+		talloc_free(auth);
+		return -1;
+	}
+
+	auth->treq = treq;
+	talloc_set_destructor(auth, _winbind_auth_free);
+
+	*out = auth;
+
+	return 0;
+}
+
+#define WINBIND_STRCPY(_request, _treq, _field, _value, _name) \
+do { \
+	if (strlcpy(_field, _value, sizeof(_field)) >= sizeof(_field)) { \
+		REDEBUG(_name " too long for winbindd, maximum length is %zu", sizeof(_field) - 1); \
+		trunk_request_free(&(_treq)); \
+		return -1; \
+	} \
+} while (0)
+
+/** Queue a challenge/response authentication, as used by MS-CHAP
+ *
+ * The request is marked runnable when the result is available.
+ *
+ * @param[out] out		Where to write the authentication state.  Check
+ *				status once the request is resumed.
+ * @param[in] ctx		to allocate the authentication state in.
+ * @param[in] wb		Thread's connections to winbindd.
+ * @param[in] request		The current request.
+ * @param[in] user		to authenticate, without the domain.
+ * @param[in] domain		the user belongs to.  May be NULL.
+ * @param[in] challenge		the response was calculated with.
+ * @param[in] nt_response	provided by the client.
+ * @param[in] nt_response_len	Length of nt_response.
+ * @param[in] logon_parameters	MSV1_0_* parameter control flags.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_winbind_auth_crap(fr_winbind_auth_t **out, TALLOC_CTX *ctx, fr_winbind_t *wb, request_t *request,
+			 char const *user, char const *domain,
+			 uint8_t const challenge[static 8],
+			 uint8_t const *nt_response, size_t nt_response_len,
+			 uint32_t logon_parameters)
+{
+	trunk_request_t		*treq;
+	winbind_request_t	*u;
+
+	u = winbind_request_alloc(&treq, wb, request, WINBINDD_PAM_AUTH_CRAP);
+	if (!u) return -1;
+
+	u->req.flags = WBFLAG_PAM_USER_SESSION_KEY;
+
+	WINBIND_STRCPY(request, treq, u->req.data.auth_crap.user, user, "Username");
+	if (domain) WINBIND_STRCPY(request, treq, u->req.data.auth_crap.domain, domain, "Domain");
+
+	memcpy(u->req.data.auth_crap.chal, challenge, sizeof(u->req.data.auth_crap.chal));
+
+	if (nt_response_len > sizeof(u->req.data.auth_crap.nt_resp)) {
+		REDEBUG("NT response too long for winbindd, maximum length is %zu",
+			sizeof(u->req.data.auth_crap.nt_resp));
+		trunk_request_free(&treq);
+		return -1;
+	}
+	memcpy(u->req.data.auth_crap.nt_resp, nt_response, nt_response_len);
+	u->req.data.auth_crap.nt_resp_len = nt_response_len;
+
+	u->req.data.auth_crap.logon_parameters = logon_parameters;
+
+	return winbind_request_enqueue(out, ctx, wb, request, treq, u);
+}
+
+/** Queue a plaintext password authentication
+ *
+ * The request is marked runnable when the result is available.
+ *
+ * @note winbindd splits the username and domain using its configured
+ *	separator.  We always use the default, '\\'.
+ *
+ * @param[out] out		Where to write the authentication state.  Check
+ *				status once the request is resumed.
+ * @param[in] ctx		to allocate the authentication state in.
+ * @param[in] wb		Thread's connections to winbindd.
+ * @param[in] request		The current request.
+ * @param[in] user		to authenticate, without the domain.
+ * @param[in] domain		the user belongs to.  May be NULL.
+ * @param[in] password		provided by the client.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_winbind_auth_plain(fr_winbind_auth_t **out, TALLOC_CTX *ctx, fr_winbind_t *wb, request_t *request,
+			  char const *user, char const *domain, char const *password)
+{
+	trunk_request_t		*treq;
+	winbind_request_t	*u;
+	size_t			len;
+
+	u = winbind_request_alloc(&treq, wb, request, WINBINDD_PAM_AUTH);
+	if (!u) return -1;
+
+	if (domain && *domain) {
+		len = snprintf(u->req.data.auth.user, sizeof(u->req.data.auth.user), "%s\\%s", domain, user);
+		if (len >= sizeof(u->req.data.auth.user)) {
+			REDEBUG("Username and domain too long for winbindd, maximum length is %zu",
+				sizeof(u->req.data.auth.user) - 1);
+			trunk_request_free(&treq);
+			return -1;
+		}
+	} else {
+		WINBIND_STRCPY(request, treq, u->req.data.auth.user, user, "Username");
+	}
+
+	WINBIND_STRCPY(request, treq, u->req.data.auth.pass, password, "Password");
+
+	return winbind_request_enqueue(out, ctx, wb, request, treq, u);
+}
@@ -0,0 +1,89 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/winbind/base.h
+ * @brief Asynchronous client for the winbindd pipe protocol
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(winbind_base_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/event.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WINBIND_SESSION_KEY_LEN	16		//!< Length of the user session key returned by winbindd.
+
+/** Connections to winbindd for a single thread
+ *
+ */
+typedef struct fr_winbind_s fr_winbind_t;
+
+/** Configuration for the connections to winbindd
+ *
+ */
+typedef struct {
+	char const		*path;			//!< Path to winbindd's (privileged) pipe.
+	trunk_conf_t		trunk_conf;		//!< Trunk configuration.
+} fr_winbind_conf_t;
+
+typedef enum {
+	FR_WINBIND_AUTH_PENDING = 0,			//!< Waiting for winbindd to respond.
+	FR_WINBIND_AUTH_OK,				//!< Credentials were accepted.
+	FR_WINBIND_AUTH_REJECT,				//!< Credentials were rejected, see nt_status.
+	FR_WINBIND_AUTH_FAIL				//!< No usable response from winbindd.
+} fr_winbind_auth_status_t;
+
+/** State of an authentication request sent to winbindd
+ *
+ * Freeing this structure cancels the request if it's still outstanding.
+ */
+typedef struct {
+	fr_winbind_auth_status_t	status;		//!< Result of the authentication.
+	uint32_t			nt_status;	//!< NT status code returned by winbindd.
+	char const			*error;		//!< Human readable error returned by winbindd.
+	uint8_t				user_session_key[WINBIND_SESSION_KEY_LEN];	//!< Session key returned
+											///< by a successful CRAP authentication.
+
+	trunk_request_t			*treq;		//!< Outstanding trunk request, NULL once complete.
+} fr_winbind_auth_t;
+
+extern conf_parser_t const fr_winbind_conf_config[];
+
+fr_winbind_t	*fr_winbind_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, fr_winbind_conf_t const *conf,
+				  char const *log_prefix);
+
+int		fr_winbind_auth_crap(fr_winbind_auth_t **out, TALLOC_CTX *ctx, fr_winbind_t *wb, request_t *request,
+				     char const *user, char const *domain,
+				     uint8_t const challenge[static 8],
+				     uint8_t const *nt_response, size_t nt_response_len,
+				     uint32_t logon_parameters) CC_HINT(nonnull(1,2,3,4,5,7,8));
+
+int		fr_winbind_auth_plain(fr_winbind_auth_t **out, TALLOC_CTX *ctx, fr_winbind_t *wb, request_t *request,
+				      char const *user, char const *domain, char const *password)
+				      CC_HINT(nonnull(1,2,3,4,5,7));
+
+#ifdef __cplusplus
+}
+#endif
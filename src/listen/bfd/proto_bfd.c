@@ -40,6 +40,8 @@ static conf_parser_t const proto_bfd_config[] = {
 	{ FR_CONF_OFFSET_TYPE_FLAGS("transport", FR_TYPE_VOID, 0, proto_bfd_t, io.submodule),
 	  .func = transport_parse },
 
+	{ FR_CONF_OFFSET("dedicated_network", proto_bfd_t, io.dedicated_network) },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -76,6 +76,8 @@ struct proto_cron_tab_s {
 
 	cron_tab_t			tab[5];
 
+	fr_time_delta_t			jitter;			//!< maximum random delay added to each run
+
 	fr_client_t			*client;		//!< static client
 
 	fr_dict_t const			*dict;			//!< our namespace.
@@ -90,6 +92,8 @@ static const conf_parser_t crontab_listen_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("timespec", CONF_FLAG_NOT_EMPTY | CONF_FLAG_REQUIRED, proto_cron_crontab_t, spec),
 	  		.func = time_parse },
 
+	{ FR_CONF_OFFSET("jitter", proto_cron_crontab_t, jitter), .dflt = "0" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -524,6 +528,7 @@ static void do_cron(fr_event_list_t *el, fr_time_t now, void *uctx)
 	proto_cron_crontab_thread_t	*thread = uctx;
 	struct tm tm;
 	time_t start = time(NULL), end;
+	fr_time_delta_t delay;
 
 	thread->recv_time = now;
 
@@ -625,15 +630,28 @@ set:
 	fr_assert(end >= start);
 
 use_time:
+	delay = fr_time_delta_from_sec(end - start);
+
+	/*
+	 *	Spread the runs out, so that multiple servers with the
+	 *	same crontab don't all run the job at the same time.
+	 */
+	if (fr_time_delta_ispos(thread->inst->jitter)) {
+		uint64_t jitter = (((uint64_t) fr_rand()) << 32) | fr_rand();
+
+		delay = fr_time_delta_add(delay,
+					  fr_time_delta_wrap(jitter % fr_time_delta_unwrap(thread->inst->jitter)));
+	}
+
 	if (DEBUG_ENABLED2) {
 		char buffer[256];
 
 		ctime_r(&end, buffer);
-		DEBUG("TIMER - virtual server %s next cron is at %s, in %ld seconds",
-		      cf_section_name2(thread->inst->parent->server_cs), buffer, end - start);
+		DEBUG("TIMER - virtual server %s next cron is at %s, in %pV",
+		      cf_section_name2(thread->inst->parent->server_cs), buffer, fr_box_time_delta(delay));
 	}
 
-	if (fr_event_timer_at(thread, el, &thread->ev, fr_time_add(now, fr_time_delta_from_sec(end - start)),
+	if (fr_event_timer_at(thread, el, &thread->ev, fr_time_add(now, delay),
 			      do_cron, thread) < 0) {
 		fr_assert(0);
 	}
@@ -703,6 +721,8 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	FR_TIME_DELTA_BOUND_CHECK("jitter", inst->jitter, <=, fr_time_delta_from_sec(3600));
+
 	fr_pair_list_init(&inst->pair_list);
 	inst->client = client = talloc_zero(inst, fr_client_t);
 	if (!inst->client) return 0;
@@ -1 +1 @@
-SUBMAKEFILES := proto_detail.mk proto_detail_file.mk proto_detail_work.mk
+SUBMAKEFILES := proto_detail.mk proto_detail_file.mk proto_detail_kafka.mk proto_detail_work.mk
@@ -22,6 +22,7 @@
  * @copyright 2017 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
  * @copyright 2016 Alan DeKok (aland@freeradius.org)
  */
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
@@ -160,9 +161,9 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *
 	}
 
 	/*
-	 *	If we're not loading the work submodule directly, then try to load it here.
+	 *	The file reader needs a work submodule to read the files it finds.
 	 */
-	if (strcmp(inst->io_submodule->module->dl->name, "proto_detail_work") != 0) {
+	if (strcmp(inst->io_submodule->module->dl->name, "proto_detail_file") == 0) {
 		CONF_SECTION		*transport_cs;
 		module_instance_t	*mi;
 		char const		*inst_name;
@@ -214,6 +215,53 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *
 /** Decode the packet, and set the request->process function
  *
  */
+/** Decode a record from a binary detail file
+ *
+ */
+static int mod_decode_record(request_t *request, uint8_t const *data, size_t data_len)
+{
+	fr_internal_record_t	record;
+	fr_pair_list_t		tmp_list;
+	fr_pair_t		*vp;
+
+	if (fr_internal_record_decode(&record, data, data_len) <= 0) {
+		RPEDEBUG("Malformed record");
+		return -1;
+	}
+
+	fr_pair_list_init(&tmp_list);
+	if (fr_internal_decode_list_dbuff(request->request_ctx, &tmp_list, fr_dict_root(request->dict),
+					  &FR_DBUFF_TMP(record.payload, record.payload_len), NULL) < 0) {
+		RPEDEBUG("Failed decoding record");
+		fr_pair_list_free(&tmp_list);
+		return -1;
+	}
+	fr_pair_list_append(&request->request_pairs, &tmp_list);
+
+	/*
+	 *	Set the original src/dst ip/port
+	 */
+	vp = fr_pair_find_by_da_nested(&request->request_pairs, NULL, attr_packet_src_ip_address);
+	if (vp) request->packet->socket.inet.src_ipaddr = vp->vp_ip;
+
+	vp = fr_pair_find_by_da_nested(&request->request_pairs, NULL, attr_packet_dst_ip_address);
+	if (vp) request->packet->socket.inet.dst_ipaddr = vp->vp_ip;
+
+	vp = fr_pair_find_by_da_nested(&request->request_pairs, NULL, attr_packet_src_port);
+	if (vp) request->packet->socket.inet.src_port = vp->vp_uint16;
+
+	vp = fr_pair_find_by_da_nested(&request->request_pairs, NULL, attr_packet_dst_port);
+	if (vp) request->packet->socket.inet.dst_port = vp->vp_uint16;
+
+	vp = fr_pair_afrom_da(request->request_ctx, attr_packet_original_timestamp);
+	if (vp) {
+		vp->vp_date = fr_unix_time_from_sec(record.timestamp);
+		fr_pair_append(&request->request_pairs, vp);
+	}
+
+	return 0;
+}
+
 static int mod_decode(void const *instance, request_t *request, uint8_t *const data, size_t data_len)
 {
 	proto_detail_t const	*inst = talloc_get_type_abort_const(instance, proto_detail_t);
@@ -241,6 +289,15 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 	request->reply->socket.inet.src_ipaddr = request->packet->socket.inet.src_ipaddr;
 	request->reply->socket.inet.dst_ipaddr = request->packet->socket.inet.src_ipaddr;
 
+	/*
+	 *	Text entries never start with a zero byte.
+	 */
+	if ((data_len > 0) && (data[0] == '\0')) {
+		if (mod_decode_record(request, data, data_len) < 0) return -1;
+
+		return inst->app_io->decode(inst->app_io_instance, request, data, data_len);
+	}
+
 	end = data + data_len;
 
 	MPRINT("HEADER %s", data);
@@ -471,9 +528,10 @@ static int mod_open(void *instance, fr_schedule_t *sc, CONF_SECTION *conf)
 
 	/*
 	 *	Testing: allow it to read a "detail.work" file
-	 *	directly.
+	 *	directly.  Other transports which don't spawn
+	 *	workers (e.g. kafka) are added the same way.
 	 */
-	if (strcmp(inst->io_submodule->module->dl->name, "proto_detail_work") == 0) {
+	if (!inst->work_submodule) {
 		if (!fr_schedule_listen_add(sc, li)) {
 			talloc_free(li);
 			return -1;
@@ -86,6 +86,8 @@ struct proto_detail_work_s {
 	char const			*filename_work;		//!< work file name
 
 	uint32_t			poll_interval;		//!< interval between polling
+	uint32_t			decompress_chunk_size;	//!< how much of a compressed file to
+								//!< decompress on each pass of the event loop.
 
 	fr_retry_config_t		retry_config;		//!< retry config with irt, mrt, etc.
 	uint16_t			max_outstanding;	//!< number of packets to run in parallel
@@ -94,6 +96,16 @@ struct proto_detail_work_s {
 	bool				retransmit;		//!< are we retransmitting on error?
 	bool				immediate;		//!< start reading the detail files immediately
 
+	char const			*order_by;		//!< attribute used to order related records.
+	fr_dict_attr_t const		*order_da;		//!< resolved order_by attribute.
+
+	bool				coalesce;		//!< drop interim updates superseded by newer ones.
+	fr_dict_attr_t const		*status_da;		//!< Acct-Status-Type, when coalescing.
+	fr_dict_enum_value_t const	*interim;		//!< Interim-Update, when coalescing.
+	uint8_t				interim_net[sizeof(uint64_t)];	//!< interim value, as it's encoded
+								///< in binary records.
+	size_t				interim_net_len;	//!< length of the encoded interim value.
+
 	int				mode;			//!< O_RDWR or O_RDONLY
 
 	fr_rb_node_t			filename_node;		//!< for dedup
@@ -103,12 +115,16 @@ struct proto_detail_work_s {
 
 typedef struct proto_detail_work_thread_s proto_detail_work_thread_t;
 
+typedef struct proto_detail_file_decompress_s proto_detail_file_decompress_t;
+
 struct proto_detail_work_thread_s {
 	char const			*name;			//!< debug name for printing
 	proto_detail_work_t const	*inst;			//!< instance data
 
 	int				fd;			//!< file descriptor
 	int				vnode_fd;      		//!< file descriptor for vnode_delete
+	ino_t				vnode_ino;		//!< inode of the file being watched.
+	int				inotify_fd;		//!< directory watch, if we're using inotify.
 
 	fr_event_list_t			*el;			//!< for various timers
 	fr_network_t			*nr;			//!< for Linux-specific callbacks
@@ -138,8 +154,15 @@ struct proto_detail_work_thread_s {
 	off_t				header_offset;		//!< offset of the current header we're reading
 	off_t				read_offset;		//!< where we're reading from in filename_work
 
+	uint8_t const			*map;			//!< mmap()ed file, for binary detail files.
+	size_t				map_len;		//!< length of the mapping.
+
+	fr_hash_table_t			*keys;			//!< order_by keys of records being processed.
+
 	fr_event_timer_t const		*ev;			//!< for detail file timers.
 
+	proto_detail_file_decompress_t	*decompress;		//!< compressed file being expanded to the work file.
+
 	pthread_mutex_t			worker_mutex;		//!< for the workers
 	int				num_workers;		//!< number of workers
 };
@@ -46,6 +46,18 @@
 #error proto_detail_file requires <glob.h>
 #endif
 
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
 DIAG_OFF(unused-macros)
 #if 0
 /*
@@ -70,6 +82,66 @@ typedef struct proto_detail_work_thread_s proto_detail_file_thread_t;
 
 static void work_init(proto_detail_file_thread_t *thread, bool triggered_by_delete);
 static void mod_vnode_delete(fr_event_list_t *el, int fd, UNUSED int fflags, void *ctx);
+static void work_deleted(proto_detail_file_thread_t *thread);
+static void work_retry_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx);
+static int work_decompress_start(proto_detail_file_thread_t *thread, char const *filename);
+
+/** A streaming decompressor for one type of compressed detail file
+ *
+ */
+typedef struct {
+	char const		*name;		//!< Of the compression scheme.
+	char const		*suffix;	//!< Files with this suffix are compressed with this scheme.
+
+	/** Prepare to read the file open in dc->in_fd
+	 */
+	int			(*init)(proto_detail_file_decompress_t *dc);
+
+	/** Read up to len bytes of decompressed data
+	 *
+	 * @return
+	 *	- >0 the number of bytes read.
+	 *	- 0 at the end of the file.
+	 *	- <0 on error.
+	 */
+	ssize_t			(*read)(proto_detail_file_decompress_t *dc, uint8_t *out, size_t len);
+
+	/** Release any decompression state
+	 */
+	void			(*free)(proto_detail_file_decompress_t *dc);
+} detail_decompress_type_t;
+
+/** A compressed detail file which is being expanded into the work file
+ *
+ * The file is expanded in chunks from a timer, so that large archives don't
+ * block the event loop.  Output goes to a hidden file in the same directory,
+ * which is renamed to the work file once the archive has been completely
+ * read.  That way a partially expanded file is never processed.
+ */
+struct proto_detail_file_decompress_s {
+	proto_detail_file_thread_t	*thread;	//!< Which owns us.
+	detail_decompress_type_t const	*type;		//!< Of compression.
+
+	char const			*filename;	//!< Compressed file we're reading.
+	char const			*filename_partial;	//!< Where we're writing the decompressed data.
+
+	int				in_fd;		//!< Of the compressed file.
+	int				out_fd;		//!< Of the partial file.
+	bool				done;		//!< The partial file has been renamed to the work file.
+
+	uint64_t			total;		//!< Bytes written so far.
+	fr_event_timer_t const		*ev;		//!< For the next chunk.
+
+#ifdef HAVE_ZLIB_H
+	gzFile				gz;		//!< zlib stream.
+#endif
+#ifdef HAVE_ZSTD_H
+	ZSTD_DStream			*zds;		//!< zstd stream.
+	ZSTD_inBuffer			zin;		//!< Compressed data not yet consumed.
+	uint8_t				*zin_buff;	//!< Storage for zin.
+	size_t				zhint;		//!< Last return from ZSTD_decompressStream.
+#endif
+};
 
 static const conf_parser_t file_listen_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("filename", CONF_FLAG_REQUIRED, proto_detail_file_t, filename ) },
@@ -80,9 +152,142 @@ static const conf_parser_t file_listen_config[] = {
 
 	{ FR_CONF_OFFSET("immediate", proto_detail_file_t, immediate) },
 
+	{ FR_CONF_OFFSET("decompress_chunk_size", proto_detail_file_t, decompress_chunk_size), .dflt = "1048576" },
+
 	CONF_PARSER_TERMINATOR
 };
 
+#ifdef HAVE_ZLIB_H
+static int gzip_init(proto_detail_file_decompress_t *dc)
+{
+	dc->gz = gzdopen(dc->in_fd, "rb");
+	if (!dc->gz) {
+		fr_strerror_printf("Failed opening gzip stream: %s", fr_syserror(errno));
+		return -1;
+	}
+	dc->in_fd = -1;		/* Now owned by the gzip stream */
+
+	(void) gzbuffer(dc->gz, 65536);
+
+	return 0;
+}
+
+static ssize_t gzip_read(proto_detail_file_decompress_t *dc, uint8_t *out, size_t len)
+{
+	int	ret;
+	int	err;
+
+	ret = gzread(dc->gz, out, len);
+	if (ret < 0) {
+		fr_strerror_printf("Failed decompressing: %s", gzerror(dc->gz, &err));
+		return -1;
+	}
+
+	return ret;
+}
+
+static void gzip_free(proto_detail_file_decompress_t *dc)
+{
+	if (dc->gz) gzclose(dc->gz);
+	dc->gz = NULL;
+}
+#endif
+
+#ifdef HAVE_ZSTD_H
+static int zstd_init(proto_detail_file_decompress_t *dc)
+{
+	dc->zds = ZSTD_createDStream();
+	if (!dc->zds) {
+		fr_strerror_const("Failed allocating zstd stream");
+		return -1;
+	}
+
+	MEM(dc->zin_buff = talloc_array(dc, uint8_t, ZSTD_DStreamInSize()));
+	dc->zin = (ZSTD_inBuffer) { .src = dc->zin_buff };
+
+	return 0;
+}
+
+static ssize_t zstd_read(proto_detail_file_decompress_t *dc, uint8_t *out, size_t len)
+{
+	ZSTD_outBuffer	zout = { .dst = out, .size = len };
+
+	while (zout.pos == 0) {
+		if (dc->zin.pos == dc->zin.size) {
+			ssize_t slen;
+
+			slen = read(dc->in_fd, dc->zin_buff, talloc_array_length(dc->zin_buff));
+			if (slen < 0) {
+				fr_strerror_printf("Failed reading: %s", fr_syserror(errno));
+				return -1;
+			}
+
+			if (slen == 0) {
+				/*
+				 *	Non-zero means a frame is incomplete.
+				 */
+				if (dc->zhint != 0) {
+					fr_strerror_const("File is truncated");
+					return -1;
+				}
+				return 0;
+			}
+
+			dc->zin.size = slen;
+			dc->zin.pos = 0;
+		}
+
+		dc->zhint = ZSTD_decompressStream(dc->zds, &zout, &dc->zin);
+		if (ZSTD_isError(dc->zhint)) {
+			fr_strerror_printf("Failed decompressing: %s", ZSTD_getErrorName(dc->zhint));
+			return -1;
+		}
+	}
+
+	return zout.pos;
+}
+
+static void zstd_free(proto_detail_file_decompress_t *dc)
+{
+	if (dc->zds) ZSTD_freeDStream(dc->zds);
+	dc->zds = NULL;
+}
+#endif
+
+/** Compression schemes we recognise
+ *
+ * Schemes we weren't built with are still listed, so that those files are
+ * skipped, rather than being read as plain text.
+ */
+static detail_decompress_type_t const detail_decompress_types[] = {
+#ifdef HAVE_ZLIB_H
+	{ .name = "gzip", .suffix = ".gz", .init = gzip_init, .read = gzip_read, .free = gzip_free },
+#else
+	{ .name = "gzip", .suffix = ".gz" },
+#endif
+#ifdef HAVE_ZSTD_H
+	{ .name = "zstd", .suffix = ".zst", .init = zstd_init, .read = zstd_read, .free = zstd_free },
+#else
+	{ .name = "zstd", .suffix = ".zst" },
+#endif
+};
+
+static detail_decompress_type_t const *decompress_type(char const *filename)
+{
+	size_t	len = strlen(filename);
+	size_t	i;
+
+	for (i = 0; i < NUM_ELEMENTS(detail_decompress_types); i++) {
+		size_t slen = strlen(detail_decompress_types[i].suffix);
+
+		if ((len > slen) && (strcmp(filename + len - slen, detail_decompress_types[i].suffix) == 0)) {
+			return &detail_decompress_types[i];
+		}
+	}
+
+	return NULL;
+}
+
 
 /*
  *	All of the decoding is done by proto_detail and proto_detail_work
@@ -110,23 +315,94 @@ static ssize_t mod_write(UNUSED fr_listen_t *li, UNUSED void *packet_ctx, UNUSED
 }
 #endif
 
-static void mod_vnode_extend(fr_listen_t *li, UNUSED uint32_t fflags)
+/** Something in the directory changed, see if there's a new file to process
+ *
+ */
+static void work_dir_changed(proto_detail_file_thread_t *thread)
 {
-	proto_detail_file_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_file_thread_t);
-
 	bool has_worker = false;
 
 	pthread_mutex_lock(&thread->worker_mutex);
 	has_worker = (thread->num_workers != 0);
 	pthread_mutex_unlock(&thread->worker_mutex);
 
-	if (has_worker) return;
+	if (has_worker || thread->decompress) return;
 
 	if (thread->ev) fr_event_timer_delete(&thread->ev);
 
 	work_init(thread, false);
 }
 
+static void mod_vnode_extend(fr_listen_t *li, UNUSED uint32_t fflags)
+{
+	proto_detail_file_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_file_thread_t);
+
+	work_dir_changed(thread);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/** Handle changes to the directory
+ *
+ * Replaces the kqueue vnode notifications for both the directory, and the
+ * work file.  Using inotify directly means we don't rely on libkqueue
+ * being able to read /proc/PID/fd.
+ */
+static void mod_inotify_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	proto_detail_file_thread_t	*thread = talloc_get_type_abort(uctx, proto_detail_file_thread_t);
+	proto_detail_file_t const	*inst = thread->inst;
+	char const			*work_name;
+	bool				changed = false, work_changed = false;
+	uint8_t				buffer[4096] CC_HINT(aligned(__alignof__(struct inotify_event)));
+	ssize_t				len;
+
+	work_name = strrchr(inst->filename_work, '/');
+	work_name = work_name ? work_name + 1 : inst->filename_work;
+
+	while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+		uint8_t const *p = buffer, *end = buffer + len;
+
+		while (p < end) {
+			struct inotify_event const *iev = (struct inotify_event const *) p;
+
+			p += sizeof(*iev) + iev->len;
+
+			if (!iev->len) continue;
+
+			if (strcmp(iev->name, work_name) == 0) {
+				work_changed = true;
+				continue;
+			}
+
+			/*
+			 *	Our own partial files don't count.
+			 */
+			if (iev->name[0] == '.') continue;
+
+			changed = true;
+		}
+	}
+
+	/*
+	 *	The work file was removed, or something was moved
+	 *	over the top of it.  Check that it's no longer the
+	 *	file we're processing, as we rename files to the
+	 *	work file ourselves.
+	 */
+	if (work_changed && (thread->vnode_fd >= 0)) {
+		struct stat st;
+
+		if ((stat(inst->filename_work, &st) < 0) || (st.st_ino != thread->vnode_ino)) {
+			DEBUG("proto_detail (%s): Deleted %s", thread->name, inst->filename_work);
+			work_deleted(thread);
+			return;
+		}
+	}
+
+	if (changed) work_dir_changed(thread);
+}
+#endif
+
 /** Open a detail listener
  *
  */
@@ -135,6 +411,13 @@ static int mod_open(fr_listen_t *li)
 	proto_detail_file_t const  *inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_file_t);
 	proto_detail_file_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_file_thread_t);
 
+	thread->inotify_fd = -1;
+
+	/*
+	 *	With inotify the directory is watched from
+	 *	mod_event_list_set(), and not via the listener FD.
+	 */
+#ifndef HAVE_SYS_INOTIFY_H
 	if (inst->poll_interval == 0) {
 		int oflag;
 
@@ -148,7 +431,9 @@ static int mod_open(fr_listen_t *li)
 			cf_log_err(inst->cs, "Failed opening %s: %s", inst->directory, fr_syserror(errno));
 			return -1;
 		}
-	} else {
+	} else
+#endif
+	{
 		li->fd = thread->fd = -1;
 		li->non_socket_listener = true;
 		li->needs_full_setup = true;
@@ -163,6 +448,171 @@ static int mod_open(fr_listen_t *li)
 	return 0;
 }
 
+static int _work_decompress_free(proto_detail_file_decompress_t *dc)
+{
+	if (dc->type->free) dc->type->free(dc);
+	if (dc->in_fd >= 0) close(dc->in_fd);
+	if (dc->out_fd >= 0) close(dc->out_fd);
+	if (!dc->done) unlink(dc->filename_partial);
+
+	if (dc->thread->decompress == dc) dc->thread->decompress = NULL;
+
+	return 0;
+}
+
+/*
+ *	Expand the next chunk of a compressed file.
+ */
+static void work_decompress_chunk(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	proto_detail_file_decompress_t	*dc = talloc_get_type_abort(uctx, proto_detail_file_decompress_t);
+	proto_detail_file_thread_t	*thread = dc->thread;
+	proto_detail_file_t const	*inst = thread->inst;
+	uint8_t				buffer[65536];
+	size_t				chunk = 0;
+	ssize_t				slen;
+
+	while (chunk < inst->decompress_chunk_size) {
+		uint8_t const *p, *end;
+
+		slen = dc->type->read(dc, buffer, sizeof(buffer));
+		if (slen < 0) {
+			PERROR("proto_detail (%s): Failed expanding %s", thread->name, dc->filename);
+		error:
+			talloc_free(dc);
+
+			/*
+			 *	Leave the compressed file where it is,
+			 *	and try again later.
+			 */
+			if (fr_event_timer_in(thread, thread->el, &thread->ev,
+					      fr_time_delta_from_sec(inst->poll_interval ? inst->poll_interval : 5),
+					      work_retry_timer, thread) < 0) {
+				ERROR("Failed inserting poll timer for %s", inst->filename_work);
+			}
+			return;
+		}
+		if (slen == 0) goto done;
+
+		for (p = buffer, end = buffer + slen; p < end; p += slen) {
+			slen = write(dc->out_fd, p, end - p);
+			if (slen < 0) {
+				if (errno == EINTR) {
+					slen = 0;
+					continue;
+				}
+				ERROR("proto_detail (%s): Failed writing %s: %s",
+				      thread->name, dc->filename_partial, fr_syserror(errno));
+				goto error;
+			}
+		}
+		chunk += end - buffer;
+	}
+	dc->total += chunk;
+
+	/*
+	 *	Give everything else a chance to run.
+	 */
+	if (fr_event_timer_in(dc, thread->el, &dc->ev, fr_time_delta_wrap(0), work_decompress_chunk, dc) < 0) {
+		ERROR("Failed inserting decompression timer for %s", dc->filename);
+		goto error;
+	}
+	return;
+
+done:
+	dc->total += chunk;
+
+	if (fsync(dc->out_fd) < 0) {
+		ERROR("proto_detail (%s): Failed writing %s: %s",
+		      thread->name, dc->filename_partial, fr_syserror(errno));
+		goto error;
+	}
+
+	if (rename(dc->filename_partial, inst->filename_work) < 0) {
+		ERROR("proto_detail (%s): Failed renaming %s to %s: %s",
+		      thread->name, dc->filename_partial, inst->filename_work, fr_syserror(errno));
+		goto error;
+	}
+	dc->done = true;
+
+	DEBUG("proto_detail (%s): Expanded %s (%" PRIu64 " bytes) -> %s",
+	      thread->name, dc->filename, dc->total, inst->filename_work);
+
+	/*
+	 *	The records are all in detail.work now.
+	 */
+	if (unlink(dc->filename) < 0) {
+		ERROR("proto_detail (%s): Failed removing %s: %s",
+		      thread->name, dc->filename, fr_syserror(errno));
+	}
+
+	talloc_free(dc);
+
+	work_init(thread, false);
+}
+
+/*
+ *	Start expanding a compressed file into "detail.work".
+ */
+static int work_decompress_start(proto_detail_file_thread_t *thread, char const *filename)
+{
+	proto_detail_file_t const	*inst = thread->inst;
+	proto_detail_file_decompress_t	*dc;
+	char const			*p;
+
+	fr_assert(!thread->decompress);
+
+	MEM(dc = talloc_zero(thread, proto_detail_file_decompress_t));
+	dc->thread = thread;
+	dc->type = decompress_type(filename);
+	dc->filename = talloc_strdup(dc, filename);
+	dc->in_fd = dc->out_fd = -1;
+	dc->done = true;		/* Nothing to clean up yet */
+	talloc_set_destructor(dc, _work_decompress_free);
+
+	/*
+	 *	Partial files are hidden, so that they don't match
+	 *	the glob.
+	 */
+	p = strrchr(inst->filename_work, '/');
+	fr_assert(p);
+	dc->filename_partial = talloc_typed_asprintf(dc, "%.*s/.%s.partial",
+						     (int) (p - inst->filename_work), inst->filename_work, p + 1);
+
+	dc->in_fd = open(filename, O_RDONLY);
+	if (dc->in_fd < 0) {
+		ERROR("proto_detail (%s): Failed opening %s: %s", thread->name, filename, fr_syserror(errno));
+	error:
+		talloc_free(dc);
+		return -1;
+	}
+
+	dc->out_fd = open(dc->filename_partial, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (dc->out_fd < 0) {
+		ERROR("proto_detail (%s): Failed opening %s: %s",
+		      thread->name, dc->filename_partial, fr_syserror(errno));
+		goto error;
+	}
+	dc->done = false;
+
+	if (dc->type->init(dc) < 0) {
+		PERROR("proto_detail (%s): Failed reading %s", thread->name, filename);
+		goto error;
+	}
+
+	if (fr_event_timer_in(dc, thread->el, &dc->ev, fr_time_delta_wrap(0), work_decompress_chunk, dc) < 0) {
+		ERROR("Failed inserting decompression timer for %s", filename);
+		goto error;
+	}
+
+	DEBUG("proto_detail (%s): Expanding %s compressed file %s -> %s",
+	      thread->name, dc->type->name, filename, inst->filename_work);
+
+	thread->decompress = dc;
+
+	return 0;
+}
+
 /*
  *	The "detail.work" file doesn't exist.  Let's see if we can rename one.
  */
@@ -195,9 +645,22 @@ static int work_rename(proto_detail_file_thread_t *thread)
 	chtime = 0;
 	found = -1;
 	for (i = 0; i < files.gl_pathc; i++) {
+		detail_decompress_type_t const *type;
+
 		if (stat(files.gl_pathv[i], &st) < 0) continue;
 
-		if ((i == 0) || (st.st_ctime < chtime)) {
+		/*
+		 *	Don't try to read compressed files
+		 *	we can't decompress.
+		 */
+		type = decompress_type(files.gl_pathv[i]);
+		if (type && !type->init) {
+			DEBUG3("proto_detail (%s): Ignoring %s, built without %s support",
+			       thread->name, files.gl_pathv[i], type->name);
+			continue;
+		}
+
+		if ((found < 0) || (st.st_ctime < chtime)) {
 			chtime = st.st_ctime;
 			found = i;
 		}
@@ -208,11 +671,21 @@ static int work_rename(proto_detail_file_thread_t *thread)
 	 */
 	if (found < 0) goto noop;
 
+	filename = files.gl_pathv[found];
+
 	/*
-	 *	Rename detail to detail.work
+	 *	Compressed files are expanded into detail.work,
+	 *	which happens in the background.
 	 */
-	filename = files.gl_pathv[found];
+	if (decompress_type(filename)) {
+		(void) work_decompress_start(thread, filename);
+		globfree(&files);
+		return -1;
+	}
 
+	/*
+	 *	Rename detail to detail.work
+	 */
 	DEBUG("proto_detail (%s): Renaming %s -> %s", thread->name, filename, inst->filename_work);
 	if (rename(filename, inst->filename_work) < 0) {
 		ERROR("detail (%s): Failed renaming %s to %s: %s",
@@ -355,9 +828,13 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 	 *
 	 *	@todo - ensure that proto_detail_work is done the file...
 	 *	maybe by creating a new instance?
+	 *
+	 *	With inotify, the directory watch tells us when
+	 *	this happens.
 	 */
-	if (fr_event_filter_insert(thread, NULL, thread->el, fd, FR_EVENT_FILTER_VNODE,
-				   &funcs, NULL, thread) < 0) {
+	if ((thread->inotify_fd < 0) &&
+	    (fr_event_filter_insert(thread, NULL, thread->el, fd, FR_EVENT_FILTER_VNODE,
+				    &funcs, NULL, thread) < 0)) {
 		PERROR("Failed adding work socket to event loop");
 		close(fd);
 		talloc_free(li);
@@ -368,6 +845,7 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 	 *	Remember this for later.
 	 */
 	thread->vnode_fd = fd;
+	thread->vnode_ino = st.st_ino;
 
 	/*
 	 *	For us, this is the worker listener.
@@ -401,7 +879,8 @@ static int work_exists(proto_detail_file_thread_t *thread, int fd)
 
 	if (!fr_schedule_listen_add(inst->parent->sc, li)) {
 	error:
-		if (fr_event_fd_delete(thread->el, thread->vnode_fd, FR_EVENT_FILTER_VNODE) < 0) {
+		if ((thread->inotify_fd < 0) &&
+		    (fr_event_fd_delete(thread->el, thread->vnode_fd, FR_EVENT_FILTER_VNODE) < 0)) {
 			PERROR("Failed removing DELETE callback when opening work file");
 		}
 		close(thread->vnode_fd);
@@ -449,7 +928,16 @@ static void mod_vnode_delete(fr_event_list_t *el, int fd, UNUSED int fflags, voi
 	if (fr_event_fd_delete(el, fd, FR_EVENT_FILTER_VNODE) < 0) {
 		PERROR("Failed removing DELETE callback after deletion");
 	}
-	close(fd);
+
+	work_deleted(thread);
+}
+
+/** The work file was deleted, or replaced
+ *
+ */
+static void work_deleted(proto_detail_file_thread_t *thread)
+{
+	close(thread->vnode_fd);
 	thread->vnode_fd = -1;
 
 	/*
@@ -481,6 +969,12 @@ static void work_init(proto_detail_file_thread_t *thread, bool triggered_by_dele
 	int fd, rcode;
 	bool has_worker;
 
+	/*
+	 *	We'll be called again when the compressed file has
+	 *	been expanded.
+	 */
+	if (thread->decompress) return;
+
 	pthread_mutex_lock(&thread->worker_mutex);
 	has_worker = (thread->num_workers != 0);
 	pthread_mutex_unlock(&thread->worker_mutex);
@@ -518,6 +1012,11 @@ static void work_init(proto_detail_file_thread_t *thread, bool triggered_by_dele
 
 retry:
 		fd = work_rename(thread);
+
+		/*
+		 *	A compressed file is being expanded.
+		 */
+		if (thread->decompress) return;
 	}
 
 	/*
@@ -595,6 +1094,30 @@ static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, UNUSED void
 
 	thread->el = el;
 
+#ifdef HAVE_SYS_INOTIFY_H
+	thread->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (thread->inotify_fd < 0) {
+		ERROR("proto_detail (%s): Failed initialising inotify: %s", thread->name, fr_syserror(errno));
+	} else if (inotify_add_watch(thread->inotify_fd, inst->directory,
+				     IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM) < 0) {
+		ERROR("proto_detail (%s): Failed watching %s: %s", thread->name, inst->directory, fr_syserror(errno));
+	error:
+		close(thread->inotify_fd);
+		thread->inotify_fd = -1;
+	} else if (fr_event_fd_insert(thread, NULL, el, thread->inotify_fd, mod_inotify_read, NULL, NULL, thread) < 0) {
+		PERROR("proto_detail (%s): Failed adding inotify watch to event loop", thread->name);
+		goto error;
+	}
+
+	/*
+	 *	Without notifications we have to poll.
+	 */
+	if ((thread->inotify_fd < 0) && !inst->poll_interval) {
+		ERROR("proto_detail (%s): Cannot watch %s for changes, and 'poll_interval = 0'",
+		      thread->name, inst->directory);
+	}
+#endif
+
 	if (inst->immediate) {
 		work_init(thread, false);
 		return;
@@ -649,7 +1172,7 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	module_instance_t const	*mi;
 	char			*p;
 
-#ifdef __linux__
+#if defined(__linux__) && !defined(HAVE_SYS_INOTIFY_H)
 	/*
 	 *	The kqueue API takes an FD, but inotify requires a filename.
 	 *	libkqueue uses /proc/PID/fd/# to look up the FD -> filename mapping.
@@ -686,6 +1209,9 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 #endif
 	FR_INTEGER_BOUND_CHECK("poll_interval", inst->poll_interval, <=, 3600);
 
+	FR_INTEGER_BOUND_CHECK("decompress_chunk_size", inst->decompress_chunk_size, >=, 65536);
+	FR_INTEGER_BOUND_CHECK("decompress_chunk_size", inst->decompress_chunk_size, <=, (1 << 30));
+
 	inst->parent = talloc_get_type_abort(mi->parent->data, proto_detail_t);
 	inst->cs = conf;
 
@@ -754,10 +1280,18 @@ static int mod_close(fr_listen_t *li)
 	 */
 	if (thread->fd >= 0) close(thread->fd);
 
+	TALLOC_FREE(thread->decompress);
+
+	if (thread->inotify_fd >= 0) {
+		(void) fr_event_fd_delete(thread->el, thread->inotify_fd, FR_EVENT_FILTER_IO);
+		close(thread->inotify_fd);
+		thread->inotify_fd = -1;
+	}
+
 	if (thread->vnode_fd >= 0) {
 		if (thread->nr) {
 			(void) fr_network_listen_delete(thread->nr, inst->parent->listen);
-		} else {
+		} else if (thread->inotify_fd < 0) {
 			if (fr_event_fd_delete(thread->el, thread->vnode_fd, FR_EVENT_FILTER_VNODE) < 0) {
 				PERROR("Failed removing DELETE callback on detach");
 			}
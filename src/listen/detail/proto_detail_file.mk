@@ -7,3 +7,5 @@ endif
 SOURCES		:= proto_detail_file.c
 
 TGT_PREREQS	:= libfreeradius-util$(L)
+TGT_LDLIBS	:= $(ZLIB_LIBS) $(ZSTD_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(ZLIB_LDFLAGS) $(ZSTD_LDFLAGS)
@@ -0,0 +1,723 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_detail_kafka.c
+ * @brief Detail handler which consumes records from Kafka topics
+ *
+ * Each message is one detail record, in the same text format as written to
+ * detail files (or the binary internal format).  Messages are decoded by
+ * proto_detail, exactly as records read from a detail file would be.
+ *
+ * Offsets are only stored once a record, and all of the records before it in
+ * the same partition, have been processed.  librdkafka commits the stored
+ * offsets in the background, so a restart (or a rebalance) re-delivers any
+ * records which were not finished.
+ *
+ * @copyright 2024 The FreeRADIUS server project.
+ */
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/network.h>
+#include <freeradius-devel/kafka/base.h>
+#include <freeradius-devel/server/pair.h>
+#include <freeradius-devel/server/protocol.h>
+#include <freeradius-devel/util/rb.h>
+#include <freeradius-devel/util/syserror.h>
+#include "proto_detail.h"
+
+typedef struct {
+	CONF_SECTION			*cs;			//!< our configuration section
+
+	proto_detail_t			*parent;		//!< The module that spawned us!
+
+	CONF_SECTION			*topics;		//!< topic { ... } section.
+	char const			*name;			//!< debug name for printing.
+
+	fr_retry_config_t		retry_config;		//!< retry config with irt, mrt, etc.
+	uint16_t			max_outstanding;	//!< number of records to process in parallel.
+
+	bool				retransmit;		//!< are we retransmitting on error?
+
+	fr_client_t			*client;		//!< so the rest of the server doesn't complain
+} proto_detail_kafka_t;
+
+/** Records we've read from a single partition, in offset order
+ *
+ */
+typedef struct {
+	char const			*topic;			//!< Name of the topic.
+	int32_t				partition;		//!< Partition number.
+
+	fr_dlist_head_t			outstanding;		//!< Records which haven't been stored yet.
+	fr_rb_node_t			node;			//!< Entry in the thread's partition tree.
+} proto_detail_kafka_partition_t;
+
+typedef struct {
+	char const			*name;			//!< debug name for printing
+	proto_detail_kafka_t const	*inst;			//!< instance data
+
+	fr_event_list_t			*el;			//!< for various timers
+	fr_network_t			*nr;			//!< so we can ask to be read
+	fr_listen_t			*listen;		//!< talloc_parent() is slow
+
+	rd_kafka_t			*rk;			//!< Consumer handle.
+	rd_kafka_queue_t		*queue;			//!< Consumer queue.
+	int				fd[2];			//!< librdkafka writes to fd[1] when the queue becomes
+								///< non-empty.  fd[0] is the listener's FD.
+
+	fr_rb_tree_t			*partitions;		//!< Partitions we've read records from.
+	fr_dlist_head_t			retry;			//!< Records waiting to be processed again.
+
+	uint32_t       			outstanding;		//!< number of currently outstanding records.
+	int				count;			//!< number of records we've read.
+	bool				paused;			//!< Is reading paused?
+} proto_detail_kafka_thread_t;
+
+typedef struct {
+	proto_detail_kafka_thread_t	*parent;		//!< talloc_parent is SLOW!
+	proto_detail_kafka_partition_t	*partition;		//!< the record came from.
+	int64_t				offset;			//!< of the record in the partition.
+	fr_time_t			timestamp;		//!< when we read the entry.
+
+	int				id;			//!< for retransmission counters
+
+	uint8_t				*packet;		//!< for retransmissions
+	size_t				packet_len;		//!< for retransmissions
+
+	fr_retry_t			retry;			//!< our retry timers
+	fr_event_timer_t const		*ev;			//!< retransmission timer
+
+	fr_dlist_t			entry;			//!< in the partition's outstanding list.
+	fr_dlist_t			retry_entry;		//!< in the thread's retry list.
+
+	bool				done;			//!< processing has finished.
+} proto_detail_kafka_entry_t;
+
+static conf_parser_t limit_config[] = {
+	{ FR_CONF_OFFSET("initial_rtx_time", proto_detail_kafka_t, retry_config.irt), .dflt = STRINGIFY(2) },
+	{ FR_CONF_OFFSET("max_rtx_time", proto_detail_kafka_t, retry_config.mrt), .dflt = STRINGIFY(16) },
+	{ FR_CONF_OFFSET("max_rtx_count", proto_detail_kafka_t, retry_config.mrc), .dflt = STRINGIFY(0) },
+	{ FR_CONF_OFFSET("max_rtx_duration", proto_detail_kafka_t, retry_config.mrd), .dflt = STRINGIFY(0) },
+	{ FR_CONF_OFFSET("max_outstanding", proto_detail_kafka_t, max_outstanding), .dflt = STRINGIFY(16) },
+	CONF_PARSER_TERMINATOR
+};
+
+/*
+ *	The kafka client configuration is pushed onto the section
+ *	in mod_instantiate().
+ */
+static const conf_parser_t kafka_listen_config[] = {
+	{ FR_CONF_OFFSET("retransmit", proto_detail_kafka_t, retransmit ), .dflt = "yes" },
+
+	{ FR_CONF_POINTER("limit", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) limit_config },
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_freeradius;
+
+extern fr_dict_autoload_t proto_detail_kafka_dict[];
+fr_dict_autoload_t proto_detail_kafka_dict[] = {
+	{ .out = &dict_freeradius, .proto = "freeradius" },
+
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_packet_transmit_counter;
+
+extern fr_dict_attr_autoload_t proto_detail_kafka_dict_attr[];
+fr_dict_attr_autoload_t proto_detail_kafka_dict_attr[] = {
+	{ .out = &attr_packet_transmit_counter, .name = "Packet-Transmit-Counter", .type = FR_TYPE_UINT32, .dict = &dict_freeradius },
+	{ NULL }
+};
+
+static fr_event_update_t pause_read[] = {
+	FR_EVENT_SUSPEND(fr_event_io_func_t, read),
+	{ 0 }
+};
+
+static fr_event_update_t resume_read[] = {
+	FR_EVENT_RESUME(fr_event_io_func_t, read),
+	{ 0 }
+};
+
+static int8_t kafka_partition_cmp(void const *one, void const *two)
+{
+	proto_detail_kafka_partition_t const *a = one, *b = two;
+	int8_t ret;
+
+	ret = CMP(a->partition, b->partition);
+	if (ret != 0) return ret;
+
+	return CMP(strcmp(a->topic, b->topic), 0);
+}
+
+static proto_detail_kafka_partition_t *kafka_partition_find(proto_detail_kafka_thread_t *thread,
+							     char const *topic, int32_t partition)
+{
+	proto_detail_kafka_partition_t *p;
+
+	p = fr_rb_find(thread->partitions, &(proto_detail_kafka_partition_t){ .topic = topic, .partition = partition });
+	if (p) return p;
+
+	MEM(p = talloc_zero(thread->partitions, proto_detail_kafka_partition_t));
+	MEM(p->topic = talloc_strdup(p, topic));
+	p->partition = partition;
+	fr_dlist_init(&p->outstanding, proto_detail_kafka_entry_t, entry);
+
+	fr_rb_insert(thread->partitions, p);
+
+	return p;
+}
+
+/*
+ *	All of the decoding is done by proto_detail.c
+ */
+static int mod_decode(void const *instance, request_t *request, UNUSED uint8_t *const data, UNUSED size_t data_len)
+{
+	proto_detail_kafka_t const		*inst = talloc_get_type_abort_const(instance, proto_detail_kafka_t);
+	proto_detail_kafka_entry_t const	*track = talloc_get_type_abort_const(request->async->packet_ctx,
+										     proto_detail_kafka_entry_t);
+	fr_pair_t *vp;
+
+	request->client = inst->client;
+
+	request->packet->id = track->id;
+	request->reply->id = track->id;
+	REQUEST_VERIFY(request);
+
+	MEM(pair_update_request(&vp, attr_packet_transmit_counter) >= 0);
+	vp->vp_uint32 = track->retry.count;
+
+	return 0;
+}
+
+/** Copy a message into the buffer in the format proto_detail expects
+ *
+ * Text records have their lines separated by zero bytes, exactly as
+ * proto_detail_work does when reading the file.
+ */
+static ssize_t kafka_record_copy(uint8_t *buffer, size_t buffer_len, uint8_t const *payload, size_t payload_len)
+{
+	uint8_t *p, *end;
+
+	/*
+	 *	Room for the trailing zero bytes.
+	 */
+	if ((payload_len + 2) > buffer_len) return -1;
+
+	memcpy(buffer, payload, payload_len);
+
+	/*
+	 *	Binary records start with a zero byte.
+	 */
+	if (!payload_len || !payload[0]) return payload_len;
+
+	for (p = buffer, end = buffer + payload_len; p < end; p++) {
+		if (*p == '\n') *p = '\0';
+	}
+
+	/*
+	 *	End of record.
+	 */
+	*(p++) = '\0';
+	*(p++) = '\0';
+
+	return p - buffer;
+}
+
+/** Store the offsets of records which have been processed
+ *
+ * Offsets are only stored when every earlier record in the partition
+ * has been processed, so that records can't be lost on restart.
+ */
+static void work_done(proto_detail_kafka_thread_t *thread, proto_detail_kafka_entry_t *track)
+{
+	proto_detail_kafka_partition_t		*p = track->partition;
+	rd_kafka_topic_partition_list_t		*list;
+	rd_kafka_resp_err_t			err;
+	int64_t					offset = -1;
+
+	track->done = true;
+	TALLOC_FREE(track->packet);
+
+	while ((track = fr_dlist_head(&p->outstanding)) && track->done) {
+		fr_dlist_remove(&p->outstanding, track);
+		offset = track->offset;
+		talloc_free(track);
+	}
+
+	if (offset < 0) return;
+
+	/*
+	 *	The stored offset is the next one we want to read.
+	 */
+	MEM(list = rd_kafka_topic_partition_list_new(1));
+	rd_kafka_topic_partition_list_add(list, p->topic, p->partition)->offset = offset + 1;
+
+	err = rd_kafka_offsets_store(thread->rk, list);
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		/*
+		 *	Usually because the partition was assigned to
+		 *	another consumer, which will re-read the records.
+		 */
+		DEBUG("%s - Failed storing offset %" PRId64 " for %s[%d]: %s",
+		      thread->name, offset + 1, p->topic, p->partition, rd_kafka_err2str(err));
+	}
+	rd_kafka_topic_partition_list_destroy(list);
+}
+
+static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len,
+			UNUSED size_t *leftover)
+{
+	proto_detail_kafka_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_kafka_t);
+	proto_detail_kafka_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_detail_kafka_thread_t);
+	proto_detail_kafka_entry_t	*track;
+	rd_kafka_message_t		*rkm;
+	ssize_t				packet_len;
+	bool				drained = false;
+
+	/*
+	 *	Process retransmissions before reading anything else.
+	 */
+	track = fr_dlist_head(&thread->retry);
+	if (track) {
+		fr_dlist_remove(&thread->retry, track);
+
+		fr_assert(buffer_len >= track->packet_len);
+		memcpy(buffer, track->packet, track->packet_len);
+
+		DEBUG("%s - Retrying record %d (retransmission %u)", thread->name, track->id, track->retry.count);
+
+		*packet_ctx = track;
+		*recv_time_p = track->timestamp;
+		return track->packet_len;
+	}
+
+	/*
+	 *	The network side tries to read many packets once the
+	 *	FD is ready.  So if we want to stop it from reading,
+	 *	we have to check this ourselves.
+	 */
+	if (thread->outstanding >= inst->max_outstanding) {
+		fr_assert(thread->paused);
+		return 0;
+	}
+
+again:
+	rkm = rd_kafka_consumer_poll(thread->rk, 0);
+	if (!rkm) {
+		uint8_t tmp[64];
+
+		if (drained) return 0;
+
+		/*
+		 *	librdkafka only writes to the pipe when the
+		 *	queue becomes non-empty.  So we only drain it
+		 *	once the queue is empty, and check again in
+		 *	case a message arrived in the mean time.
+		 */
+		while (read(li->fd, tmp, sizeof(tmp)) > 0);
+		drained = true;
+		goto again;
+	}
+
+	/*
+	 *	We've drained the pipe, but there may be more
+	 *	messages.  Make sure we're called again.
+	 */
+	if (drained && (write(thread->fd[1], "1", 1) < 0) && (errno != EAGAIN)) {
+		ERROR("%s - Failed writing to notification pipe: %s", thread->name, fr_syserror(errno));
+	}
+
+	if (rkm->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		if (rkm->err != RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+			RATE_LIMIT_GLOBAL(ERROR, "%s - Consumer error: %s", thread->name, rd_kafka_message_errstr(rkm));
+		}
+		rd_kafka_message_destroy(rkm);
+		drained = false;
+		goto again;
+	}
+
+	MEM(track = talloc_zero(thread, proto_detail_kafka_entry_t));
+	track->parent = thread;
+	track->partition = kafka_partition_find(thread, rd_kafka_topic_name(rkm->rkt), rkm->partition);
+	track->offset = rkm->offset;
+	track->timestamp = fr_time();
+	track->id = thread->count++;
+
+	fr_dlist_insert_tail(&track->partition->outstanding, track);
+	thread->outstanding++;
+
+	packet_len = kafka_record_copy(buffer, buffer_len, rkm->payload, rkm->len);
+	if (packet_len <= 0) {
+		ERROR("%s - Ignoring record at %s[%d] offset %" PRId64 ", size %zu is %s",
+		      thread->name, track->partition->topic, track->partition->partition, track->offset, rkm->len,
+		      packet_len < 0 ? "too large" : "zero");
+		rd_kafka_message_destroy(rkm);
+
+		/*
+		 *	Done, and nothing to process.
+		 */
+		thread->outstanding--;
+		work_done(thread, track);
+		drained = false;
+		goto again;
+	}
+	rd_kafka_message_destroy(rkm);
+
+	if (inst->retransmit) {
+		MEM(track->packet = talloc_memdup(track, buffer, packet_len));
+		track->packet_len = packet_len;
+	}
+
+	/*
+	 *	Pause reading until such time as we need more records.
+	 */
+	if (!thread->paused && (thread->outstanding >= inst->max_outstanding)) {
+		(void) fr_event_filter_update(thread->el, li->fd, FR_EVENT_FILTER_IO, pause_read);
+		thread->paused = true;
+	}
+
+	*packet_ctx = track;
+	*recv_time_p = track->timestamp;
+
+	return packet_len;
+}
+
+static void work_retransmit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	proto_detail_kafka_entry_t	*track = talloc_get_type_abort(uctx, proto_detail_kafka_entry_t);
+	proto_detail_kafka_thread_t	*thread = track->parent;
+
+	DEBUG("%s - retransmitting record %d", thread->name, track->id);
+
+	fr_dlist_insert_tail(&thread->retry, track);
+
+	fr_network_listen_read(thread->nr, thread->listen);
+}
+
+static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
+			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
+{
+	proto_detail_kafka_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_kafka_t);
+	proto_detail_kafka_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_detail_kafka_thread_t);
+	proto_detail_kafka_entry_t	*track = talloc_get_type_abort(packet_ctx, proto_detail_kafka_entry_t);
+
+	if (buffer_len < 1) return -1;
+
+	fr_assert(thread->outstanding > 0);
+
+	if (!buffer[0] && inst->retransmit) {
+		if (fr_time_eq(track->retry.start, fr_time_wrap(0))) {
+			fr_retry_init(&track->retry, fr_time(), &inst->retry_config);
+		} else {
+			fr_retry_state_t state;
+
+			state = fr_retry_next(&track->retry, fr_time());
+			if (state == FR_RETRY_MRC) {
+				ERROR("%s - record %d at %s[%d] offset %" PRId64 " failed after %u retransmissions",
+				      thread->name, track->id, track->partition->topic, track->partition->partition,
+				      track->offset, track->retry.count);
+				goto done;
+			}
+
+			if (state == FR_RETRY_MRD) {
+				ERROR("%s - record %d at %s[%d] offset %" PRId64 " failed after %u seconds",
+				      thread->name, track->id, track->partition->topic, track->partition->partition,
+				      track->offset, (unsigned int) fr_time_delta_to_sec(inst->retry_config.mrd));
+				goto done;
+			}
+		}
+
+		DEBUG("%s - record %d failed during processing.  Will retransmit in %.6fs",
+		      thread->name, track->id, fr_time_delta_unwrap(track->retry.rt) / (double)NSEC);
+
+		if (fr_event_timer_at(track, thread->el, &track->ev,
+				      track->retry.next, work_retransmit, track) < 0) {
+			ERROR("%s - Failed inserting retransmission timeout", thread->name);
+			goto done;
+		}
+
+		return buffer_len;
+	}
+
+done:
+	thread->outstanding--;
+
+	work_done(thread, track);
+
+	/*
+	 *	If we need to read some more records, let's do so.
+	 *	The pipe is still readable if there are messages
+	 *	waiting.
+	 */
+	if (thread->paused && (thread->outstanding < inst->max_outstanding)) {
+		(void) fr_event_filter_update(thread->el, li->fd, FR_EVENT_FILTER_IO, resume_read);
+		thread->paused = false;
+	}
+
+	return buffer_len;
+}
+
+static void _kafka_error_cb(UNUSED rd_kafka_t *rk, int err, char const *reason, void *opaque)
+{
+	proto_detail_kafka_thread_t *thread = talloc_get_type_abort(opaque, proto_detail_kafka_thread_t);
+
+	ERROR("%s - %s: %s", thread->name, rd_kafka_err2str(err), reason);
+}
+
+/** Close the consumer
+ *
+ * Leaves the consumer group, and commits any offsets we've stored.
+ */
+static int mod_close_internal(proto_detail_kafka_thread_t *thread)
+{
+	if (thread->rk) {
+		rd_kafka_resp_err_t err;
+
+		if (thread->queue) {
+			rd_kafka_queue_io_event_enable(thread->queue, -1, NULL, 0);
+			rd_kafka_queue_destroy(thread->queue);
+			thread->queue = NULL;
+		}
+
+		err = rd_kafka_consumer_close(thread->rk);
+		if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+			ERROR("%s - Failed closing consumer: %s", thread->name, rd_kafka_err2str(err));
+		}
+
+		if (thread->outstanding) {
+			WARN("%s - %u record(s) weren't finished, and will be read again", thread->name,
+			     thread->outstanding);
+		}
+
+		rd_kafka_destroy(thread->rk);
+		thread->rk = NULL;
+	}
+
+	if (thread->fd[0] >= 0) close(thread->fd[0]);
+	if (thread->fd[1] >= 0) close(thread->fd[1]);
+	thread->fd[0] = thread->fd[1] = -1;
+
+	TALLOC_FREE(thread->partitions);
+
+	return 0;
+}
+
+static int mod_close(fr_listen_t *li)
+{
+	proto_detail_kafka_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_kafka_thread_t);
+
+	DEBUG("Closing %s", thread->name);
+
+	return mod_close_internal(thread);
+}
+
+/** Create the consumer, and subscribe to the topics
+ *
+ */
+static int mod_open(fr_listen_t *li)
+{
+	proto_detail_kafka_t const		*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_kafka_t);
+	proto_detail_kafka_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_detail_kafka_thread_t);
+	rd_kafka_conf_t				*conf;
+	rd_kafka_topic_partition_list_t		*topics;
+	rd_kafka_resp_err_t			err;
+	CONF_SECTION				*cs = NULL;
+	char					errstr[512];
+
+	thread->inst = inst;
+	thread->name = inst->name;
+	thread->listen = li;
+	thread->fd[0] = thread->fd[1] = -1;
+
+	MEM(thread->partitions = fr_rb_inline_talloc_alloc(thread, proto_detail_kafka_partition_t, node,
+							   kafka_partition_cmp, NULL));
+	fr_dlist_init(&thread->retry, proto_detail_kafka_entry_t, retry_entry);
+
+	conf = kafka_conf_dup(inst->cs);
+	if (!conf) {
+		cf_log_err(inst->cs, "No kafka configuration found");
+		return -1;
+	}
+
+	/*
+	 *	We store offsets ourselves, once records have been
+	 *	processed.  librdkafka commits them in the background.
+	 */
+	if (rd_kafka_conf_set(conf, "enable.auto.offset.store", "false", errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+		cf_log_err(inst->cs, "Failed disabling automatic offset store: %s", errstr);
+	error:
+		rd_kafka_conf_destroy(conf);
+		return -1;
+	}
+
+	/*
+	 *	Topic properties apply to all of the topics we
+	 *	subscribe to.
+	 */
+	cs = cf_section_first(inst->topics);
+	if (cs) {
+		rd_kafka_topic_conf_t *tconf;
+
+		tconf = kafka_topic_conf_dup(cs);
+		if (tconf) rd_kafka_conf_set_default_topic_conf(conf, tconf);
+	}
+
+	rd_kafka_conf_set_opaque(conf, thread);
+	rd_kafka_conf_set_error_cb(conf, _kafka_error_cb);
+
+	thread->rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof(errstr));
+	if (!thread->rk) {
+		cf_log_err(inst->cs, "Failed creating consumer: %s", errstr);
+		goto error;
+	}
+
+	/*
+	 *	Serve everything from the consumer queue.
+	 */
+	rd_kafka_poll_set_consumer(thread->rk);
+
+	if (pipe(thread->fd) < 0) {
+		cf_log_err(inst->cs, "Failed creating notification pipe: %s", fr_syserror(errno));
+	fail:
+		mod_close_internal(thread);
+		return -1;
+	}
+	if ((fr_nonblock(thread->fd[0]) < 0) || (fr_nonblock(thread->fd[1]) < 0)) {
+		cf_log_perr(inst->cs, "Failed setting notification pipe to non-blocking");
+		goto fail;
+	}
+
+	thread->queue = rd_kafka_queue_get_consumer(thread->rk);
+	rd_kafka_queue_io_event_enable(thread->queue, thread->fd[1], "1", 1);
+
+	MEM(topics = rd_kafka_topic_partition_list_new(1));
+	for (cs = cf_section_first(inst->topics);
+	     cs;
+	     cs = cf_section_next(inst->topics, cs)) {
+		rd_kafka_topic_partition_list_add(topics, cf_section_name1(cs), RD_KAFKA_PARTITION_UA);
+	}
+
+	err = rd_kafka_subscribe(thread->rk, topics);
+	rd_kafka_topic_partition_list_destroy(topics);
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		cf_log_err(inst->cs, "Failed subscribing to topics: %s", rd_kafka_err2str(err));
+		goto fail;
+	}
+
+	li->fd = thread->fd[0];
+	li->no_write_callback = true;
+
+	return 0;
+}
+
+/** Set the event list for a new IO instance
+ *
+ * @param[in] li the listener
+ * @param[in] el the event list
+ * @param[in] nr context from the network side
+ */
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, void *nr)
+{
+	proto_detail_kafka_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_kafka_thread_t);
+
+	thread->el = el;
+	thread->nr = nr;
+}
+
+static char const *mod_name(fr_listen_t *li)
+{
+	proto_detail_kafka_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_kafka_thread_t);
+
+	return thread->name;
+}
+
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	proto_detail_kafka_t	*inst = talloc_get_type_abort(mctx->mi->data, proto_detail_kafka_t);
+	CONF_SECTION		*cs = mctx->mi->conf;
+	CONF_SECTION		*topic;
+	fr_client_t		*client;
+	char			*name;
+
+	inst->parent = talloc_get_type_abort(mctx->mi->parent->data, proto_detail_t);
+	inst->cs = cs;
+
+	if (cf_section_rules_push(cs, kafka_base_consumer_config) < 0) return -1;
+	if (cf_section_parse(inst, inst, cs) < 0) return -1;
+
+	inst->topics = cf_section_find(cs, "topic", NULL);
+	if (!inst->topics || !cf_section_first(inst->topics)) {
+		cf_log_err(cs, "At least one topic must be configured in a 'topic { ... }' section");
+		return -1;
+	}
+
+	if (inst->retransmit) {
+		FR_TIME_DELTA_BOUND_CHECK("limit.initial_rtx_time", inst->retry_config.irt, >=, fr_time_delta_from_sec(1));
+		FR_TIME_DELTA_BOUND_CHECK("limit.initial_rtx_time", inst->retry_config.irt, <=, fr_time_delta_from_sec(60));
+		FR_INTEGER_BOUND_CHECK("limit.max_rtx_count", inst->retry_config.mrc, <=, 20);
+		FR_TIME_DELTA_BOUND_CHECK("limit.max_rtx_duration", inst->retry_config.mrd, <=, fr_time_delta_from_sec(600));
+		FR_TIME_DELTA_BOUND_CHECK("limit.max_rtx_timer", inst->retry_config.mrt, <=, fr_time_delta_from_sec(30));
+	}
+
+	FR_INTEGER_BOUND_CHECK("limit.max_outstanding", inst->max_outstanding, >=, 1);
+	FR_INTEGER_BOUND_CHECK("limit.max_outstanding", inst->max_outstanding, <=, 65535);
+
+	MEM(name = talloc_strdup(inst, "detail_kafka consuming from"));
+	for (topic = cf_section_first(inst->topics);
+	     topic;
+	     topic = cf_section_next(inst->topics, topic)) {
+		MEM(name = talloc_asprintf_append(name, " %s", cf_section_name1(topic)));
+	}
+	inst->name = name;
+
+	client = inst->client = talloc_zero(inst, fr_client_t);
+	if (!inst->client) return 0;
+
+	client->ipaddr.af = AF_INET;
+	client->ipaddr.addr.v4.s_addr = htonl(INADDR_NONE);
+	client->src_ipaddr = client->ipaddr;
+
+	client->longname = client->shortname = client->secret = inst->name;
+	client->nas_type = talloc_strdup(client, "other");
+
+	return 0;
+}
+
+extern fr_app_io_t proto_detail_kafka;
+fr_app_io_t proto_detail_kafka = {
+	.common = {
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "detail_kafka",
+		.config			= kafka_listen_config,
+		.inst_size		= sizeof(proto_detail_kafka_t),
+		.thread_inst_size	= sizeof(proto_detail_kafka_thread_t),
+		.instantiate		= mod_instantiate
+	},
+	.default_message_size	= 65536,
+	.default_reply_size	= 32,
+
+	.open			= mod_open,
+	.close			= mod_close,
+	.read			= mod_read,
+	.decode			= mod_decode,
+	.write			= mod_write,
+	.event_list_set		= mod_event_list_set,
+	.get_name		= mod_name,
+};
@@ -0,0 +1,12 @@
+TARGETNAME=
+-include $(top_builddir)/src/lib/kafka/all.mk
+
+ifneq "${TARGETNAME}" ""
+  TARGETNAME	:= proto_detail_kafka
+  TARGET	:= $(TARGETNAME)$(L)
+endif
+
+SOURCES		:= proto_detail_kafka.c
+
+SRC_CFLAGS	+= -I$(top_builddir)/lib/kafka
+TGT_PREREQS	:= libfreeradius-util$(L) libfreeradius-kafka$(L)
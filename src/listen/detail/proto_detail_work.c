@@ -23,6 +23,7 @@
  * @copyright 2017 Alan DeKok (aland@deployingradius.com)
  */
 #include <netdb.h>
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/server/pair.h>
 #include <freeradius-devel/server/main_loop.h>
@@ -32,6 +33,7 @@
 #include "proto_detail.h"
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #ifndef NDEBUG
@@ -49,6 +51,17 @@
 #define MPRINT(_x, ...)
 #endif
 
+/** Records with the same order_by key
+ *
+ * Only one record per key is processed at a time.  The others wait
+ * here, in the order in which they were read from the file.
+ */
+typedef struct {
+	uint8_t				*key;			//!< value of the order_by attribute.
+	size_t				key_len;		//!< length of the key.
+	fr_dlist_head_t			held;			//!< records waiting for the current one.
+} fr_detail_key_t;
+
 typedef struct {
 	proto_detail_work_thread_t	*parent;		//!< talloc_parent is SLOW!
 	fr_time_t			timestamp;		//!< when we read the entry.
@@ -61,7 +74,11 @@ typedef struct {
 
 	fr_retry_t			retry;			//!< our retry timers
 	fr_event_timer_t const		*ev;			//!< retransmission timer
-	fr_dlist_t			entry;			//!< for the retransmission list
+	fr_dlist_t			entry;			//!< for the retransmission list, or the held list
+
+	fr_detail_key_t			*key;			//!< order_by key, if there is one.
+	bool				held;			//!< waiting for an earlier record with the same key.
+	bool				interim;		//!< an interim update, which can be superseded.
 } fr_detail_entry_t;
 
 static conf_parser_t limit_config[] = {
@@ -88,6 +105,9 @@ static const conf_parser_t file_listen_config[] = {
 
 	{ FR_CONF_OFFSET("retransmit", proto_detail_work_t, retransmit ), .dflt = "yes" },
 
+	{ FR_CONF_OFFSET("order_by", proto_detail_work_t, order_by ) },
+	{ FR_CONF_OFFSET("coalesce", proto_detail_work_t, coalesce ), .dflt = "no" },
+
 	{ FR_CONF_POINTER("limit", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	CONF_PARSER_TERMINATOR
 };
@@ -141,6 +161,332 @@ static fr_event_update_t resume_read[] = {
 	{ 0 }
 };
 
+static uint32_t work_key_hash(void const *data)
+{
+	fr_detail_key_t const *k = data;
+
+	return fr_hash(k->key, k->key_len);
+}
+
+static int8_t work_key_cmp(void const *one, void const *two)
+{
+	fr_detail_key_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->key_len, b->key_len);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->key, b->key, a->key_len);
+	return CMP(ret, 0);
+}
+
+/** Find the value of a top level attribute in a record
+ *
+ */
+static int work_attr_find(uint8_t const **out, size_t *outlen, fr_dict_attr_t const *da,
+			  uint8_t const *packet, size_t packet_len)
+{
+	uint8_t const	*p, *q, *end = packet + packet_len;
+	char const	*name = da->name;
+	size_t		name_len = strlen(name);
+
+	/*
+	 *	Binary records can be searched without decoding them.
+	 */
+	if ((packet_len > 0) && (packet[0] == '\0')) {
+		fr_internal_record_t	record;
+		ssize_t			slen;
+
+		if (fr_internal_record_decode(&record, packet, packet_len) <= 0) return -1;
+
+		slen = fr_internal_record_find(out, &record, da);
+		if (slen < 0) return -1;
+
+		*outlen = slen;
+		return 0;
+	}
+
+	/*
+	 *	Text records have had their LFs replaced with zeros,
+	 *	so each line is "\0\tName = value".
+	 */
+	for (p = packet; p < end; p++) {
+		if (*p) continue;
+
+		if ((size_t) (end - p) < (name_len + 5)) break;
+
+		if ((p[1] != '\t') ||
+		    (memcmp(p + 2, name, name_len) != 0) ||
+		    (memcmp(p + 2 + name_len, " = ", 3) != 0)) continue;
+
+		p += name_len + 5;
+		for (q = p; (q < end) && *q; q++) { /* nothing */ }
+
+		*out = p;
+		*outlen = q - p;
+		return 0;
+	}
+
+	return -1;
+}
+
+/** See if a record is an interim update
+ *
+ */
+static bool work_is_interim(proto_detail_work_t const *inst, uint8_t const *packet, size_t packet_len)
+{
+	uint8_t const	*value;
+	size_t		value_len;
+
+	if (work_attr_find(&value, &value_len, inst->status_da, packet, packet_len) < 0) return false;
+
+	if (packet[0] == '\0') {
+		return (value_len == inst->interim_net_len) && (memcmp(value, inst->interim_net, value_len) == 0);
+	}
+
+	return (value_len == inst->interim->name_len) && (memcmp(value, inst->interim->name, value_len) == 0);
+}
+
+/** Mark a record in the file as done
+ *
+ */
+static void work_mark_done(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+			   fr_detail_entry_t *track)
+{
+	/*
+	 *	Seek to the entry, mark it as done, and then seek to
+	 *	the point in the file where we were reading from.
+	 */
+	(void) lseek(thread->fd, track->done_offset, SEEK_SET);
+	if (thread->map) {
+		uint8_t flags = thread->map[track->done_offset] | FR_INTERNAL_RECORD_FLAG_DONE;
+
+		if (inst->track_progress && (write(thread->fd, &flags, 1) < 0)) goto mark_failed;
+
+	} else if (write(thread->fd, "Done", 4) < 0) {
+	mark_failed:
+		ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
+	}
+	(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
+}
+
+/** Hold back a record if another one with the same key is being processed
+ *
+ * @return
+ *	- true if the record was held, and must not be processed yet.
+ *	- false if the record can be processed now.
+ */
+static bool work_order_hold(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+			    fr_detail_entry_t *track, uint8_t const *packet, size_t packet_len)
+{
+	fr_detail_key_t	*k, find;
+	uint8_t const	*key;
+	size_t		key_len;
+
+	if (!thread->keys) return false;
+
+	/*
+	 *	Records without a key aren't ordered.
+	 */
+	if (work_attr_find(&key, &key_len, inst->order_da, packet, packet_len) < 0) return false;
+
+	find.key = UNCONST(uint8_t *, key);
+	find.key_len = key_len;
+
+	k = fr_hash_table_find(thread->keys, &find);
+	if (!k) {
+		MEM(k = talloc_zero(thread->keys, fr_detail_key_t));
+		MEM(k->key = talloc_memdup(k, key, key_len));
+		k->key_len = key_len;
+		fr_dlist_init(&k->held, fr_detail_entry_t, entry);
+
+		if (!fr_hash_table_insert(thread->keys, k)) {
+			talloc_free(k);
+			return false;
+		}
+
+		track->key = k;
+		return false;
+	}
+
+	/*
+	 *	Only the most recent interim update for a key
+	 *	matters.  If the record at the back of the queue has
+	 *	been superseded by this one, it doesn't need to be
+	 *	processed.  Other records stay where they are, so
+	 *	a Start or Stop is never re-ordered.
+	 */
+	if (inst->coalesce && work_is_interim(inst, packet, packet_len)) {
+		fr_detail_entry_t *prev = fr_dlist_tail(&k->held);
+
+		if (prev && prev->interim) {
+			fr_dlist_remove(&k->held, prev);
+
+			DEBUG("%s - packet %d superseded by packet %d", thread->name, prev->id, track->id);
+
+			if (inst->track_progress && (prev->done_offset > 0)) work_mark_done(inst, thread, prev);
+			thread->outstanding--;
+			talloc_free(prev);
+		}
+		track->interim = true;
+	}
+
+	/*
+	 *	The network buffer will be re-used, so we need our
+	 *	own copy of the record.
+	 */
+	if (!track->packet) {
+		MEM(track->packet = talloc_memdup(track, packet, packet_len));
+		track->packet_len = packet_len;
+	}
+
+	track->key = k;
+	track->held = true;
+	fr_dlist_insert_tail(&k->held, track);
+
+	MPRINT("Holding packet %d until earlier records with the same key are done", track->id);
+	return true;
+}
+
+/** Release the next record with the same key as one which is finished
+ *
+ */
+static void work_order_release(proto_detail_work_thread_t *thread, fr_detail_entry_t *track)
+{
+	fr_detail_key_t		*k = track->key;
+	fr_detail_entry_t	*next;
+
+	if (!k) return;
+	track->key = NULL;
+
+	next = fr_dlist_pop_head(&k->held);
+	if (!next) {
+		(void) fr_hash_table_remove(thread->keys, k);
+		talloc_free(k);
+		return;
+	}
+
+	/*
+	 *	Held records already count as outstanding, so they're
+	 *	put on the retransmission list, which mod_read()
+	 *	processes before reading anything else.
+	 */
+	fr_dlist_insert_tail(&thread->list, next);
+
+	if (thread->paused) {
+		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, resume_read);
+		thread->paused = false;
+	}
+
+	(void) lseek(thread->fd, 0, SEEK_SET);
+}
+
+/** Read the next record from a binary detail file
+ *
+ * The file is mapped into memory, so there's no need to search for
+ * record boundaries.  Each record is copied once, from the mapping
+ * into the network buffer, and then decoded by proto_detail.
+ */
+static ssize_t work_read_record(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+				void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len)
+{
+	fr_internal_record_t	record;
+	fr_detail_entry_t	*track;
+	ssize_t			slen;
+	size_t			packet_len;
+	off_t			offset;
+
+again:
+	for (;;) {
+		offset = thread->read_offset;
+		record.payload = NULL;
+
+		slen = fr_internal_record_decode(&record, thread->map + offset, thread->map_len - offset);
+		if (slen == 0) {
+			if ((size_t) offset < thread->map_len) {
+				WARN("proto_detail (%s): Ignoring truncated record at offset %zu of file %s",
+				     thread->name, (size_t) offset, thread->filename_work);
+			}
+
+		eof:
+			thread->eof = thread->closing = true;
+			MPRINT("AT EOF, outstanding %u", thread->outstanding);
+
+			/*
+			 *	Nothing left to wait for, tell the
+			 *	network side to close us.
+			 */
+			if (!thread->outstanding) return -1;
+			return 0;
+		}
+
+		if (slen < 0) {
+			/*
+			 *	We can't find the next record, so stop
+			 *	reading the file.
+			 */
+			if (!record.payload) {
+				PERROR("proto_detail (%s): Failed reading record at offset %zu of file %s",
+				       thread->name, (size_t) offset, thread->filename_work);
+				goto eof;
+			}
+
+			PERROR("proto_detail (%s): Skipping record at offset %zu of file %s",
+			       thread->name, (size_t) offset, thread->filename_work);
+			thread->read_offset += FR_INTERNAL_RECORD_HEADER_LEN + record.payload_len;
+			continue;
+		}
+
+		thread->read_offset += slen;
+		packet_len = slen;
+
+		if (record.flags & FR_INTERNAL_RECORD_FLAG_DONE) continue;
+
+		if ((packet_len > buffer_len) || (packet_len > inst->parent->max_packet_size)) {
+			DEBUG("Ignoring 'too large' entry at offset %zu of %s",
+			      (size_t) offset, thread->filename_work);
+			continue;
+		}
+
+		break;
+	}
+
+	memcpy(buffer, thread->map + offset, packet_len);
+
+	MEM(track = talloc_zero(thread, fr_detail_entry_t));
+	track->parent = thread;
+	track->timestamp = fr_time();
+	track->id = thread->count++;
+	track->done_offset = offset + FR_INTERNAL_RECORD_FLAGS_OFFSET;
+
+	if (inst->retransmit) {
+		MEM(track->packet = talloc_memdup(track, buffer, packet_len));
+		track->packet_len = packet_len;
+	}
+
+	thread->header_offset = thread->read_offset;
+
+	thread->outstanding++;
+
+	if (!thread->paused && (thread->outstanding >= inst->max_outstanding)) {
+		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
+		thread->paused = true;
+	}
+
+	/*
+	 *	Keep reading ahead past records which have to wait.
+	 */
+	if (work_order_hold(inst, thread, track, buffer, packet_len)) {
+		if (thread->paused) return 0;
+		goto again;
+	}
+
+	*packet_ctx = track;
+	*recv_time_p = track->timestamp;
+
+	return packet_len;
+}
+
 static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover)
 {
 	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
@@ -182,7 +528,17 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 		fr_assert(buffer_len >= track->packet_len);
 		memcpy(buffer, track->packet, track->packet_len);
 
-		DEBUG("Retrying packet %d (retransmission %u)", track->id, track->retry.count);
+		if (track->held) {
+			track->held = false;
+			MPRINT("Releasing held packet %d", track->id);
+
+			if (!thread->paused && (thread->outstanding >= inst->max_outstanding)) {
+				(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
+				thread->paused = true;
+			}
+		} else {
+			DEBUG("Retrying packet %d (retransmission %u)", track->id, track->retry.count);
+		}
 		*packet_ctx = track;
 		*recv_time_p = track->timestamp;
 		return track->packet_len;
@@ -208,6 +564,8 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 		return 0;
 	}
 
+	if (thread->map) return work_read_record(inst, thread, packet_ctx, recv_time_p, buffer, buffer_len);
+
 	/*
 	 *	If we've cached leftover data from the ring buffer,
 	 *	copy it back.
@@ -500,6 +858,35 @@ redo:
 	 */
 	thread->header_offset += packet_len;
 
+	if (work_order_hold(inst, thread, track, buffer, packet_len)) {
+		thread->outstanding++;
+
+		/*
+		 *	Keep reading ahead, if there's room.
+		 */
+		if (next && (next < end) && (thread->outstanding < inst->max_outstanding)) {
+			memmove(buffer, next, (end - next));
+			end = buffer + (end - next);
+			*leftover = 0;
+			thread->last_search = 0;
+			goto redo;
+		}
+
+		if (*leftover) memmove(buffer, next, *leftover);
+
+		if (thread->eof) thread->closing = (*leftover == 0);
+
+		if (!thread->paused && (thread->outstanding >= inst->max_outstanding)) {
+			(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
+			thread->paused = true;
+
+			if (*leftover) (void) lseek(thread->fd, thread->read_offset - 1, SEEK_SET);
+		}
+
+		thread->last_search = 0;
+		return 0;
+	}
+
 	*packet_ctx = track;
 	*recv_time_p = track->timestamp;
 
@@ -625,20 +1012,14 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 	} else if (inst->track_progress && (track->done_offset > 0)) {
 	mark_done:
-		/*
-		 *	Seek to the entry, mark it as done, and then seek to
-		 *	the point in the file where we were reading from.
-		 */
-		(void) lseek(thread->fd, track->done_offset, SEEK_SET);
-		if (write(thread->fd, "Done", 4) < 0) {
-			ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
-		}
-		(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
+		work_mark_done(inst, thread, track);
 	}
 
 free_track:
 	thread->outstanding--;
 
+	work_order_release(thread, track);
+
 	/*
 	 *	If we need to read some more packet, let's do so.
 	 */
@@ -682,6 +1063,14 @@ static int mod_open(fr_listen_t *li)
 
 	fr_dlist_init(&thread->list, fr_detail_entry_t, entry);
 
+	if (inst->order_da) {
+		thread->keys = fr_hash_table_alloc(thread, work_key_hash, work_key_cmp, NULL);
+		if (!thread->keys) {
+			cf_log_err(inst->cs, "Failed allocating key table");
+			return -1;
+		}
+	}
+
 	/*
 	 *	Open the file if we haven't already been given one.
 	 */
@@ -714,6 +1103,35 @@ static int mod_open(fr_listen_t *li)
 		thread->file_size = 1;
 	}
 
+	/*
+	 *	Binary detail files are read from a mapping of the
+	 *	whole file.  The writers have given the file up by the
+	 *	time we get it, so it won't grow underneath us.
+	 */
+	{
+		uint8_t		hdr[FR_INTERNAL_RECORD_FILE_HEADER_LEN];
+		struct stat	buf;
+		void		*map;
+
+		if ((pread(thread->fd, hdr, sizeof(hdr), 0) == sizeof(hdr)) &&
+		    fr_internal_record_file_header_ok(hdr, sizeof(hdr))) {
+			if (fstat(thread->fd, &buf) < 0) {
+				cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
+				return -1;
+			}
+
+			map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, thread->fd, 0);
+			if (map == MAP_FAILED) {
+				cf_log_err(inst->cs, "Failed mapping %s: %s", thread->filename_work, fr_syserror(errno));
+				return -1;
+			}
+
+			thread->map = map;
+			thread->map_len = buf.st_size;
+			thread->read_offset = thread->header_offset = FR_INTERNAL_RECORD_FILE_HEADER_LEN;
+		}
+	}
+
 	fr_assert(thread->name == NULL);
 	fr_assert(thread->filename_work != NULL);
 	thread->name = talloc_typed_asprintf(thread, "detail_work reading file %s", thread->filename_work);
@@ -758,6 +1176,11 @@ static int mod_close_internal(proto_detail_work_thread_t *thread)
 
 	if (thread->outstanding == 0) unlink(thread->filename_work);
 
+	if (thread->map) {
+		(void) munmap(UNCONST(void *, thread->map), thread->map_len);
+		thread->map = NULL;
+	}
+
 	close(thread->fd);
 	thread->fd = -1;
 
@@ -869,6 +1292,47 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 
 	FR_INTEGER_BOUND_CHECK("limit.max_outstanding", inst->max_outstanding, >=, 1);
 
+	if (inst->order_by) {
+		inst->order_da = fr_dict_attr_by_name(NULL, fr_dict_root(inst->parent->dict), inst->order_by);
+		if (!inst->order_da) {
+			cf_log_err(cs, "Unknown attribute '%s' for 'order_by'", inst->order_by);
+			return -1;
+		}
+
+		if (!fr_type_is_leaf(inst->order_da->type)) {
+			cf_log_err(cs, "'order_by' attribute '%s' must be a leaf attribute", inst->order_by);
+			return -1;
+		}
+	}
+
+	if (inst->coalesce) {
+		fr_dbuff_t	dbuff = FR_DBUFF_TMP(inst->interim_net, sizeof(inst->interim_net));
+		ssize_t		slen;
+
+		/*
+		 *	Records can only be superseded while they're
+		 *	waiting for an earlier record with the same key.
+		 */
+		if (!inst->order_da) {
+			cf_log_err(cs, "'coalesce' requires 'order_by' to be set");
+			return -1;
+		}
+
+		inst->status_da = fr_dict_attr_by_name(NULL, fr_dict_root(inst->parent->dict), "Acct-Status-Type");
+		if (inst->status_da) inst->interim = fr_dict_enum_by_name(inst->status_da, "Interim-Update", -1);
+		if (!inst->interim) {
+			cf_log_err(cs, "'coalesce' requires a dictionary with Acct-Status-Type = Interim-Update");
+			return -1;
+		}
+
+		slen = fr_value_box_to_network(&dbuff, inst->interim->value);
+		if (slen <= 0) {
+			cf_log_perr(cs, "Failed encoding Interim-Update");
+			return -1;
+		}
+		inst->interim_net_len = slen;
+	}
+
 	client = inst->client = talloc_zero(inst, fr_client_t);
 	if (!inst->client) return 0;
 
@@ -42,6 +42,14 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_recv_batch_t		*recv_batch;		//!< for reading multiple datagrams at once.
+	udp_send_batch_t		*send_batch;		//!< for writing multiple datagrams at once.
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+	int				raw_fd;			//!< for unicast replies to clients without an IP.
+	struct sockaddr_ll		link_layer;		//!< for the raw socket.
+#endif
+
 	fr_stats_t			stats;			//!< statistics for this socket
 }  proto_dhcpv4_udp_thread_t;
 
@@ -58,12 +66,17 @@ typedef struct {
 	uint32_t			recv_buff;		//!< How big the kernel's receive buffer should be.
 
 	uint32_t			max_packet_size;	//!< for message ring buffer.
+	uint32_t			recv_batch;		//!< How many datagrams to read at once.
+	uint32_t			send_batch;		//!< How many replies to write at once.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
 	uint16_t			port;			//!< Port to listen on.
 	uint16_t			client_port;		//!< Client port to reply to.
 
 	bool				broadcast;		//!< whether we listen for broadcast packets
+	bool				raw;			//!< whether we send unicast replies at layer 2.
+
+	fr_ethernet_t			ethernet;		//!< MAC address of the interface, for raw replies.
 
 	bool				recv_buff_is_set;	//!< Whether we were provided with a receive
 								//!< buffer value.
@@ -100,11 +113,14 @@ static const conf_parser_t udp_listen_config[] = {
 	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, 0, proto_dhcpv4_udp_t, recv_buff) },
 
 	{ FR_CONF_OFFSET("broadcast", proto_dhcpv4_udp_t, broadcast) } ,
+	{ FR_CONF_OFFSET("raw", proto_dhcpv4_udp_t, raw) } ,
 
 	{ FR_CONF_OFFSET("dynamic_clients", proto_dhcpv4_udp_t, dynamic_clients) } ,
 	{ FR_CONF_POINTER("networks", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) networks_config },
 
 	{ FR_CONF_OFFSET("max_packet_size", proto_dhcpv4_udp_t, max_packet_size), .dflt = "4096" } ,
+	{ FR_CONF_OFFSET("recv_batch", proto_dhcpv4_udp_t, recv_batch), .dflt = "1" } ,
+	{ FR_CONF_OFFSET("send_batch", proto_dhcpv4_udp_t, send_batch), .dflt = "1" } ,
        	{ FR_CONF_OFFSET("max_attributes", proto_dhcpv4_udp_t, max_attributes), .dflt = STRINGIFY(DHCPV4_MAX_ATTRIBUTES) } ,
 
 	CONF_PARSER_TERMINATOR
@@ -155,7 +171,7 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	data_size = udp_recv_batch(thread->recv_batch, thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
 	if (data_size < 0) {
 		RATE_LIMIT_GLOBAL(PERROR, "Read error (%zd)", data_size);
 		return data_size;
@@ -236,6 +252,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	if (!thread->connection) {
 		uint8_t const *code, *sid;
 		dhcp_packet_t *packet = (dhcp_packet_t *) buffer;
+		bool raw = false;
 #ifdef WITH_IFINDEX_IPADDR_RESOLUTION
 		fr_ipaddr_t primary;
 #endif
@@ -424,6 +441,16 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 			if (memcmp(&socket.inet.dst_ipaddr.addr.v4.s_addr, &packet->yiaddr, 4) == 0) {
 				DEBUG("Reply will be unicast to YIADDR.");
 
+			} else if (inst->raw) {
+				/*
+				 *	Write the Ethernet frame
+				 *	ourselves, so we don't need
+				 *	to touch the ARP table.
+				 */
+				DEBUG("Reply will be unicast to YIADDR and CHADDR.");
+				memcpy(&socket.inet.dst_ipaddr.addr.v4.s_addr, &packet->yiaddr, 4);
+				raw = true;
+
 #ifdef SIOCSARP
 			} else if (inst->broadcast && inst->interface) {
 				uint8_t macaddr[6];
@@ -437,10 +464,9 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 				 *	This socket is listening for
 				 *	broadcast packets on a
 				 *	particular interface.  We're
-				 *	too lazy to write raw UDP
-				 *	packets, so we update our
-				 *	local ARP table and then
-				 *	unicast the reply.
+				 *	not writing raw packets, so
+				 *	we update our local ARP table
+				 *	and then unicast the reply.
 				 */
 				if (fr_arp_entry_add(thread->sockfd, inst->interface, ipaddr, macaddr) == 0) {
 					DEBUG("Reply will be unicast to YIADDR, done ARP table updates.");
@@ -452,7 +478,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 #endif
 			} else {
-				DEBUG("Reply will be broadcast as we do not create raw UDP sockets.");
+				DEBUG("Reply will be broadcast, as 'raw' is not set.");
 				socket.inet.dst_ipaddr.addr.v4.s_addr = INADDR_BROADCAST;
 			}
 			break;
@@ -463,6 +489,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 		case FR_DHCP_ACK:
 			DEBUG("Reply will be unicast to YIADDR.");
 			memcpy(&socket.inet.dst_ipaddr.addr.v4.s_addr, &packet->yiaddr, 4);
+			raw = inst->raw;
 			break;
 
 		default:
@@ -474,12 +501,42 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 		DEBUG("Sending %s XID %08x from %pV:%d to %pV:%d", dhcp_message_types[code[2]], packet->xid,
 		      fr_box_ipaddr(socket.inet.src_ipaddr), socket.inet.src_port,
 		      fr_box_ipaddr(socket.inet.dst_ipaddr), socket.inet.dst_port);
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+		/*
+		 *	The client doesn't have an IP address yet, so
+		 *	we send the reply directly to its MAC address.
+		 *
+		 *	We need a source IP, as there's no kernel to
+		 *	fill it in for us.  If we can't do that, or the
+		 *	write fails, the reply is broadcast instead.
+		 */
+		if (raw) {
+			if ((packet->htype != 1) || (packet->hlen != 6) ||
+			    (socket.inet.src_ipaddr.addr.v4.s_addr == htonl(INADDR_ANY))) {
+				DEBUG("Cannot send reply via raw socket.  Reply will be broadcast.");
+
+			} else if (fr_dhcpv4_raw_send(thread->raw_fd, &thread->link_layer,
+						      inst->ethernet.addr, packet->chaddr,
+						      &socket, buffer, buffer_len) < 0) {
+				RATE_LIMIT_GLOBAL(ERROR, "Failed writing to raw socket: %s.  Reply will be broadcast.",
+						  fr_syserror(errno));
+
+			} else {
+				return buffer_len;
+			}
+
+			socket.inet.dst_ipaddr.addr.v4.s_addr = INADDR_BROADCAST;
+		}
+#else
+		(void) raw;
+#endif
 	}
 
 	/*
 	 *	proto_dhcpv4 takes care of suppressing do-not-respond, etc.
 	 */
-	data_size = udp_send(&socket, flags, buffer, buffer_len);
+	data_size = udp_send_batch(thread->send_batch, &socket, flags, buffer, buffer_len);
 
 	/*
 	 *	This socket is dead.  That's an error...
@@ -490,6 +547,36 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 }
 
 
+/** Write any replies which have been queued
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
+
+	return udp_send_batch_flush(thread->send_batch);
+}
+
+static int mod_close(fr_listen_t *li)
+{
+#ifdef HAVE_LINUX_IF_PACKET_H
+	proto_dhcpv4_udp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_dhcpv4_udp_t);
+	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
+
+	/*
+	 *	Connected sockets don't have a raw socket.
+	 */
+	if (inst->raw && !thread->connection && (thread->raw_fd >= 0)) {
+		close(thread->raw_fd);
+		thread->raw_fd = -1;
+	}
+#endif
+
+	close(li->fd);
+
+	return 0;
+}
+
 static int mod_connection_set(fr_listen_t *li, fr_io_address_t *connection)
 {
 	proto_dhcpv4_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv4_udp_thread_t);
@@ -574,6 +661,46 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+#ifdef HAVE_LINUX_IF_PACKET_H
+	/*
+	 *	This socket is only used for writing.  The kernel
+	 *	doesn't queue any packets to it.
+	 */
+	if (inst->raw) {
+		thread->raw_fd = fr_dhcpv4_raw_socket_open_send(&thread->link_layer, if_nametoindex(inst->interface));
+		if (thread->raw_fd < 0) {
+			PERROR("Failed opening raw socket on interface %s", inst->interface);
+			close(sockfd);
+			goto error;
+		}
+	}
+#endif
+
+	/*
+	 *	Read multiple datagrams with one system call.
+	 */
+	if (inst->recv_batch > 1) {
+		thread->recv_batch = udp_recv_batch_alloc(thread, inst->recv_batch, inst->max_packet_size);
+		if (!thread->recv_batch) {
+			ERROR("Failed allocating receive batch");
+			close(sockfd);
+			goto error;
+		}
+	}
+	li->recv_batch = inst->recv_batch;
+
+	/*
+	 *	Write multiple replies with one system call.
+	 */
+	if (inst->send_batch > 1) {
+		thread->send_batch = udp_send_batch_alloc(thread, inst->send_batch, inst->max_packet_size);
+		if (!thread->send_batch) {
+			ERROR("Failed allocating send batch");
+			close(sockfd);
+			goto error;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_dhcpv4_udp,
@@ -730,6 +857,12 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, MIN_PACKET_SIZE);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, <=, 1024);
+
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, <=, 1024);
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -747,6 +880,23 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		inst->port = ntohl(s->s_port);
 	}
 
+	if (inst->raw) {
+#ifdef HAVE_LINUX_IF_PACKET_H
+		if (!inst->interface) {
+			cf_log_err(conf, "'raw = yes' requires 'interface' to be set");
+			return -1;
+		}
+
+		if (fr_interface_to_ethernet(inst->interface, &inst->ethernet) < 0) {
+			cf_log_err(conf, "Failed finding the Ethernet address of interface %s", inst->interface);
+			return -1;
+		}
+#else
+		cf_log_err(conf, "'raw = yes' is not supported on this platform");
+		return -1;
+#endif
+	}
+
 #ifdef SIOCSARP
 	/*
 	 *	If we're listening for broadcast requests, we MUST
@@ -844,6 +994,8 @@ fr_app_io_t proto_dhcpv4_udp = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
+	.close			= mod_close,
 	.fd_set			= mod_fd_set,
 	.track_create  		= mod_track_create,
 	.track_compare		= mod_track_compare,
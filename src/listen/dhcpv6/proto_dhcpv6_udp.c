@@ -26,6 +26,7 @@
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/util/udp.h>
 #include <freeradius-devel/util/trie.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
@@ -40,9 +41,36 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_recv_batch_t		*recv_batch;		//!< for reading multiple datagrams at once.
+	udp_send_batch_t		*send_batch;		//!< for writing multiple datagrams at once.
+
+	fr_hash_table_t			*leases;		//!< cached replies, by lease key.
+	fr_dlist_head_t			lease_list;		//!< cached replies, oldest first.
+	uint8_t				*lease_reply;		//!< where cached replies are edited before sending.
+
 	fr_stats_t			stats;			//!< statistics for this socket
 }  proto_dhcpv6_udp_thread_t;
 
+/*
+ *	A Reply which we sent to a Request, Renew, or Rebind.
+ */
+typedef struct {
+	fr_dlist_t			entry;			//!< in lease_list.
+	fr_time_t			created;		//!< when the reply was sent.
+	uint8_t				*reply;			//!< including any Relay-Reply wrappers.
+	size_t				reply_len;
+	size_t				inner;			//!< offset of the Reply in the reply data.
+	size_t				inner_len;		//!< length of the Reply.
+	uint8_t const			*key;			//!< see lease_key()
+	size_t				key_len;
+} proto_dhcpv6_lease_t;
+
+/*
+ *	Large enough for a few relays, a Client-ID, and a handful of
+ *	IAs.  Anything bigger isn't cached.
+ */
+#define LEASE_KEY_MAX (512)
+
 typedef struct {
 	CONF_SECTION			*cs;			//!< our configuration
 
@@ -58,8 +86,13 @@ typedef struct {
 
 	uint32_t			hop_limit;		//!< for multicast addresses
 	uint32_t			max_packet_size;	//!< for message ring buffer.
+	uint32_t			recv_batch;		//!< How many datagrams to read at once.
+	uint32_t			send_batch;		//!< How many replies to write at once.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
+	uint32_t			lease_cache_size;	//!< Maximum number of cached replies.  0 is disabled.
+	fr_time_delta_t			lease_cache_lifetime;	//!< How long a cached reply can be re-used.
+
 	uint16_t			port;			//!< Port to listen on.
 
 	bool				multicast;		//!< whether or not we listen for multicast packets
@@ -84,6 +117,13 @@ static const conf_parser_t networks_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const conf_parser_t lease_cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", proto_dhcpv6_udp_t, lease_cache_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("lifetime", proto_dhcpv6_udp_t, lease_cache_lifetime), .dflt = "30" },
+
+	CONF_PARSER_TERMINATOR
+};
+
 
 static const conf_parser_t udp_listen_config[] = {
 	{ FR_CONF_OFFSET_TYPE_FLAGS("ipaddr", FR_TYPE_IPV6_ADDR, 0, proto_dhcpv6_udp_t, ipaddr) },
@@ -103,8 +143,12 @@ static const conf_parser_t udp_listen_config[] = {
 	{ FR_CONF_POINTER("networks", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) networks_config },
 
 	{ FR_CONF_OFFSET("max_packet_size", proto_dhcpv6_udp_t, max_packet_size), .dflt = "8192" } ,
+	{ FR_CONF_OFFSET("recv_batch", proto_dhcpv6_udp_t, recv_batch), .dflt = "1" } ,
+	{ FR_CONF_OFFSET("send_batch", proto_dhcpv6_udp_t, send_batch), .dflt = "1" } ,
 	{ FR_CONF_OFFSET("max_attributes", proto_dhcpv6_udp_t, max_attributes), .dflt = STRINGIFY(DHCPV6_MAX_ATTRIBUTES) } ,
 
+	{ FR_CONF_POINTER("lease_cache", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) lease_cache_config },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -119,15 +163,434 @@ fr_dict_autoload_t proto_dhcpv6_udp_dict[] = {
 static fr_dict_attr_t const *attr_packet_type;
 static fr_dict_attr_t const *attr_client_id;
 static fr_dict_attr_t const *attr_relay_message;
+static fr_dict_attr_t const *attr_interface_id;
+static fr_dict_attr_t const *attr_server_id;
+static fr_dict_attr_t const *attr_status_code;
+static fr_dict_attr_t const *attr_ia_na;
+static fr_dict_attr_t const *attr_ia_ta;
+static fr_dict_attr_t const *attr_ia_pd;
+static fr_dict_attr_t const *attr_ia_addr;
+static fr_dict_attr_t const *attr_ia_pd_prefix;
 
 extern fr_dict_attr_autoload_t proto_dhcpv6_udp_dict_attr[];
 fr_dict_attr_autoload_t proto_dhcpv6_udp_dict_attr[] = {
 	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_dhcpv6},
 	{ .out = &attr_client_id, .name = "Client-ID", .type = FR_TYPE_STRUCT, .dict = &dict_dhcpv6},
 	{ .out = &attr_relay_message, .name = "Relay-Message", .type = FR_TYPE_GROUP, .dict = &dict_dhcpv6 },
+	{ .out = &attr_interface_id, .name = "Interface-ID", .type = FR_TYPE_OCTETS, .dict = &dict_dhcpv6 },
+	{ .out = &attr_server_id, .name = "Server-ID", .type = FR_TYPE_STRUCT, .dict = &dict_dhcpv6 },
+	{ .out = &attr_status_code, .name = "Status-Code", .type = FR_TYPE_STRUCT, .dict = &dict_dhcpv6 },
+	{ .out = &attr_ia_na, .name = "IA-NA", .type = FR_TYPE_STRUCT, .dict = &dict_dhcpv6 },
+	{ .out = &attr_ia_ta, .name = "IA-TA", .type = FR_TYPE_STRUCT, .dict = &dict_dhcpv6 },
+	{ .out = &attr_ia_pd, .name = "IA-PD", .type = FR_TYPE_STRUCT, .dict = &dict_dhcpv6 },
+	{ .out = &attr_ia_addr, .name = "IA-Addr", .type = FR_TYPE_STRUCT, .dict = &dict_dhcpv6 },
+	{ .out = &attr_ia_pd_prefix, .name = "IA-PD-Prefix", .type = FR_TYPE_STRUCT, .dict = &dict_dhcpv6 },
 	{ NULL }
 };
 
+static int ia_cmp(void const *one, void const *two)
+{
+	return memcmp(one, two, 6);
+}
+
+/** Build the lease cache key for a packet, without decoding it
+ *
+ *  The key is made from the relay headers and Interface-IDs, the
+ *  Client-ID, and the option number and IAID of each IA.  A
+ *  Relay-Reply / Reply carries the same data as the Relay-Forward /
+ *  Renew it answers, so the key can be built from either one.
+ *
+ * @param[out] key		where the key is written.  Must be LEASE_KEY_MAX bytes.
+ * @param[out] inner_p		the client message, inside any relay messages.
+ * @param[out] inner_len_p	the length of the client message.
+ * @param[in] packet		to build the key from.
+ * @param[in] packet_len	length of the packet.
+ * @return
+ *	- 0 if the packet can't be cached.
+ *	- >0 the length of the key.
+ */
+static size_t lease_key(uint8_t *key, uint8_t const **inner_p, size_t *inner_len_p,
+			uint8_t const *packet, size_t packet_len)
+{
+	uint8_t		*p = key, *end = key + LEASE_KEY_MAX;
+	uint8_t		*ia_start;
+	uint8_t const	*option, *options_end;
+	size_t		option_len;
+	unsigned int	depth = 0;
+
+	while ((packet_len > 0) &&
+	       ((packet[0] == FR_DHCPV6_RELAY_FORWARD) || (packet[0] == FR_DHCPV6_RELAY_REPLY))) {
+		if ((packet_len < DHCPV6_RELAY_HDR_LEN) || (++depth > DHCPV6_MAX_RELAY_NESTING)) return 0;
+
+		/*
+		 *	Hop count, link address, and peer address.
+		 *	The message type differs between the request
+		 *	and the reply.
+		 */
+		if ((size_t) (end - p) < (DHCPV6_RELAY_HDR_LEN - 1)) return 0;
+		memcpy(p, packet + 1, DHCPV6_RELAY_HDR_LEN - 1);
+		p += DHCPV6_RELAY_HDR_LEN - 1;
+
+		options_end = packet + packet_len;
+
+		option = fr_dhcpv6_option_find(packet + DHCPV6_RELAY_HDR_LEN, options_end, attr_interface_id->attr);
+		if (option) {
+			option_len = DHCPV6_OPT_HDR_LEN + DHCPV6_GET_OPTION_LEN(option);
+			if ((size_t) (end - p) < option_len) return 0;
+
+			memcpy(p, option, option_len);
+			p += option_len;
+		}
+
+		option = fr_dhcpv6_option_find(packet + DHCPV6_RELAY_HDR_LEN, options_end, attr_relay_message->attr);
+		if (!option) return 0;
+
+		packet = option + DHCPV6_OPT_HDR_LEN;
+		packet_len = DHCPV6_GET_OPTION_LEN(option);
+	}
+
+	if (packet_len < DHCPV6_HDR_LEN) return 0;
+
+	*inner_p = packet;
+	*inner_len_p = packet_len;
+
+	options_end = packet + packet_len;
+
+	option = fr_dhcpv6_option_find(packet + DHCPV6_HDR_LEN, options_end, attr_client_id->attr);
+	if (!option) return 0;
+
+	option_len = DHCPV6_OPT_HDR_LEN + DHCPV6_GET_OPTION_LEN(option);
+	if ((size_t) (end - p) < option_len) return 0;
+
+	memcpy(p, option, option_len);
+	p += option_len;
+
+	/*
+	 *	Option number and IAID of each IA.  These are sorted,
+	 *	as the reply doesn't have to list them in the same
+	 *	order as the request.
+	 */
+	ia_start = p;
+
+	for (option = packet + DHCPV6_HDR_LEN; option < options_end; option += option_len) {
+		unsigned int num;
+
+		if ((size_t) (options_end - option) < DHCPV6_OPT_HDR_LEN) return 0;
+
+		num = DHCPV6_GET_OPTION_NUM(option);
+		option_len = DHCPV6_OPT_HDR_LEN + DHCPV6_GET_OPTION_LEN(option);
+		if ((size_t) (options_end - option) < option_len) return 0;
+
+		if ((num != attr_ia_na->attr) && (num != attr_ia_ta->attr) && (num != attr_ia_pd->attr)) continue;
+
+		if ((option_len < (DHCPV6_OPT_HDR_LEN + 4)) || ((size_t) (end - p) < 6)) return 0;
+
+		memcpy(p, option, 2);
+		memcpy(p + 2, option + DHCPV6_OPT_HDR_LEN, 4);
+		p += 6;
+	}
+
+	/*
+	 *	No IAs means there's no lease.
+	 */
+	if (p == ia_start) return 0;
+
+	qsort(ia_start, (p - ia_start) / 6, 6, ia_cmp);
+
+	return p - key;
+}
+
+/*
+ *	Return the sub-options of an IA option.
+ */
+static uint8_t const *ia_options(uint8_t const *option)
+{
+	size_t hdr_len = (DHCPV6_GET_OPTION_NUM(option) == attr_ia_ta->attr) ? 4 : 12; /* IAID, T1, T2 */
+
+	if (DHCPV6_GET_OPTION_LEN(option) < hdr_len) return NULL;
+
+	return option + DHCPV6_OPT_HDR_LEN + hdr_len;
+}
+
+static bool is_ia(unsigned int num)
+{
+	return (num == attr_ia_na->attr) || (num == attr_ia_ta->attr) || (num == attr_ia_pd->attr);
+}
+
+/** Check whether a Reply can be re-used for later Renews
+ *
+ *  Replies which have a non-zero Status-Code at the top level, or in
+ *  any IA, aren't cached.
+ */
+static bool lease_reply_ok(uint8_t const *inner, size_t inner_len)
+{
+	uint8_t const	*option, *end = inner + inner_len;
+	size_t		option_len;
+
+	if (inner[0] != FR_DHCPV6_REPLY) return false;
+
+	for (option = inner + DHCPV6_HDR_LEN; option < end; option += option_len) {
+		uint8_t const	*sub;
+		unsigned int	num;
+
+		if ((size_t) (end - option) < DHCPV6_OPT_HDR_LEN) return false;
+
+		num = DHCPV6_GET_OPTION_NUM(option);
+		option_len = DHCPV6_OPT_HDR_LEN + DHCPV6_GET_OPTION_LEN(option);
+		if ((size_t) (end - option) < option_len) return false;
+
+		if (num == attr_status_code->attr) {
+			sub = option;
+			goto check_status;
+		}
+
+		if (!is_ia(num)) continue;
+
+		sub = ia_options(option);
+		if (!sub) return false;
+
+		sub = fr_dhcpv6_option_find(sub, option + option_len, attr_status_code->attr);
+		if (!sub) continue;
+
+	check_status:
+		if ((DHCPV6_GET_OPTION_LEN(sub) < 2) || (fr_nbo_to_uint16(sub + DHCPV6_OPT_HDR_LEN) != 0)) return false;
+	}
+
+	return true;
+}
+
+/*
+ *	Reduce a lifetime by the time since the reply was cached.
+ *	"Infinity" is left alone.
+ */
+static uint32_t lifetime_age(uint8_t *p, uint32_t elapsed)
+{
+	uint32_t value = fr_nbo_to_uint32(p);
+
+	if (value == UINT32_MAX) return value;
+
+	value = (value > elapsed) ? (value - elapsed) : 0;
+	fr_nbo_from_uint32(p, value);
+
+	return value;
+}
+
+/** Age the T1, T2, and lifetimes in a cached Reply
+ *
+ *  The Reply was built when the lease was last written to the
+ *  database.  Reducing the times by how long ago that was means the
+ *  client's view of the lease stays the same as the database's.
+ *
+ * @return
+ *	- false if an address or prefix has expired.
+ *	- true if the reply can be sent.
+ */
+static bool lease_reply_age(uint8_t *inner, size_t inner_len, uint32_t elapsed)
+{
+	uint8_t		*option, *end = inner + inner_len;
+	size_t		option_len;
+
+	for (option = inner + DHCPV6_HDR_LEN; option < end; option += option_len) {
+		uint8_t		*sub, *sub_end;
+		size_t		sub_len;
+
+		if ((size_t) (end - option) < DHCPV6_OPT_HDR_LEN) return false;
+
+		option_len = DHCPV6_OPT_HDR_LEN + DHCPV6_GET_OPTION_LEN(option);
+		if ((size_t) (end - option) < option_len) return false;
+
+		if (!is_ia(DHCPV6_GET_OPTION_NUM(option))) continue;
+
+		sub = UNCONST(uint8_t *, ia_options(option));
+		if (!sub) return false;
+
+		if (DHCPV6_GET_OPTION_NUM(option) != attr_ia_ta->attr) {
+			lifetime_age(option + DHCPV6_OPT_HDR_LEN + 4, elapsed);	/* T1 */
+			lifetime_age(option + DHCPV6_OPT_HDR_LEN + 8, elapsed);	/* T2 */
+		}
+
+		sub_end = option + option_len;
+
+		for (/* nothing */; sub < sub_end; sub += sub_len) {
+			uint8_t *lifetimes;
+
+			if ((size_t) (sub_end - sub) < DHCPV6_OPT_HDR_LEN) return false;
+
+			sub_len = DHCPV6_OPT_HDR_LEN + DHCPV6_GET_OPTION_LEN(sub);
+			if ((size_t) (sub_end - sub) < sub_len) return false;
+
+			/*
+			 *	IA-Addr is address, preferred, valid.
+			 *	IA-PD-Prefix is preferred, valid, prefix.
+			 */
+			if (DHCPV6_GET_OPTION_NUM(sub) == attr_ia_addr->attr) {
+				if (sub_len < (DHCPV6_OPT_HDR_LEN + 16 + 8)) return false;
+				lifetimes = sub + DHCPV6_OPT_HDR_LEN + 16;
+
+			} else if (DHCPV6_GET_OPTION_NUM(sub) == attr_ia_pd_prefix->attr) {
+				if (sub_len < (DHCPV6_OPT_HDR_LEN + 8 + 1 + 16)) return false;
+				lifetimes = sub + DHCPV6_OPT_HDR_LEN;
+
+			} else {
+				continue;
+			}
+
+			lifetime_age(lifetimes, elapsed);
+			if (!lifetime_age(lifetimes + 4, elapsed)) return false;
+		}
+	}
+
+	return true;
+}
+
+static uint32_t lease_hash(void const *data)
+{
+	proto_dhcpv6_lease_t const *lease = data;
+
+	return fr_hash(lease->key, lease->key_len);
+}
+
+static int8_t lease_cmp(void const *one, void const *two)
+{
+	proto_dhcpv6_lease_t const *a = one, *b = two;
+	int8_t ret;
+
+	ret = CMP(a->key_len, b->key_len);
+	if (ret != 0) return ret;
+
+	return CMP(memcmp(a->key, b->key, a->key_len), 0);
+}
+
+static void lease_remove(proto_dhcpv6_udp_thread_t *thread, proto_dhcpv6_lease_t *lease)
+{
+	(void) fr_hash_table_remove(thread->leases, lease);
+	fr_dlist_remove(&thread->lease_list, lease);
+	talloc_free(lease);
+}
+
+/** Answer a Renew or Rebind from the lease cache
+ *
+ * @return
+ *	- true if a cached Reply was sent.
+ *	- false if the packet should be processed as normal.
+ */
+static bool lease_cache_reply(proto_dhcpv6_udp_t const *inst, proto_dhcpv6_udp_thread_t *thread,
+			      fr_io_address_t const *address, uint8_t const *packet, size_t packet_len)
+{
+	uint8_t			key[LEASE_KEY_MAX];
+	uint8_t const		*inner, *server_id;
+	uint8_t			*reply;
+	size_t			inner_len;
+	proto_dhcpv6_lease_t	*lease, my_lease;
+	fr_socket_t		socket;
+	fr_time_t		now;
+
+	my_lease.key_len = lease_key(key, &inner, &inner_len, packet, packet_len);
+	if (!my_lease.key_len) return false;
+
+	if ((inner[0] != FR_DHCPV6_RENEW) && (inner[0] != FR_DHCPV6_REBIND)) return false;
+
+	my_lease.key = key;
+
+	lease = fr_hash_table_find(thread->leases, &my_lease);
+	if (!lease) return false;
+
+	now = fr_time();
+	if (fr_time_gt(now, fr_time_add(lease->created, inst->lease_cache_lifetime))) {
+	expired:
+		lease_remove(thread, lease);
+		return false;
+	}
+
+	reply = thread->lease_reply;
+	memcpy(reply, lease->reply, lease->reply_len);
+
+	/*
+	 *	A Renew is for one particular server.  If that isn't
+	 *	us, then the normal processing deals with it.
+	 */
+	server_id = fr_dhcpv6_option_find(inner + DHCPV6_HDR_LEN, inner + inner_len, attr_server_id->attr);
+	if (server_id) {
+		uint8_t const *ours;
+
+		ours = fr_dhcpv6_option_find(reply + lease->inner + DHCPV6_HDR_LEN,
+					     reply + lease->inner + lease->inner_len, attr_server_id->attr);
+		if (!ours || (DHCPV6_GET_OPTION_LEN(ours) != DHCPV6_GET_OPTION_LEN(server_id)) ||
+		    (memcmp(ours, server_id, DHCPV6_OPT_HDR_LEN + DHCPV6_GET_OPTION_LEN(server_id)) != 0)) return false;
+
+	} else if (inner[0] == FR_DHCPV6_RENEW) {
+		return false;
+	}
+
+	if (!lease_reply_age(reply + lease->inner, lease->inner_len,
+			     fr_time_delta_to_sec(fr_time_sub(now, lease->created)))) goto expired;
+
+	memcpy(reply + lease->inner + 1, inner + 1, DHCPV6_TRANSACTION_ID_LEN);
+
+	fr_socket_addr_swap(&socket, &address->socket);
+	if (!fr_ipaddr_is_inaddr_any(&inst->src_ipaddr)) socket.inet.src_ipaddr = inst->src_ipaddr;
+
+	if (udp_send(&socket, UDP_FLAGS_CONNECTED * (thread->connection != NULL), reply, lease->reply_len) < 0) {
+		RATE_LIMIT_GLOBAL(ERROR, "Failed sending cached reply: %s", fr_syserror(errno));
+		return false;
+	}
+
+	thread->stats.total_responses++;
+
+	DEBUG2("Sent cached Reply to %s XID %08x %s", fr_dhcpv6_packet_names[inner[0]],
+	       fr_nbo_to_uint24(inner + 1), thread->name);
+
+	return true;
+}
+
+/** Remember a Reply, so that later Renews and Rebinds can be answered from the cache
+ *
+ */
+static void lease_cache_insert(proto_dhcpv6_udp_t const *inst, proto_dhcpv6_udp_thread_t *thread,
+			       uint8_t const *reply, size_t reply_len)
+{
+	uint8_t			key[LEASE_KEY_MAX];
+	uint8_t const		*inner;
+	size_t			inner_len, key_len;
+	proto_dhcpv6_lease_t	*lease, *old;
+
+	if (reply_len > inst->max_packet_size) return;
+
+	key_len = lease_key(key, &inner, &inner_len, reply, reply_len);
+	if (!key_len) return;
+
+	if (!lease_reply_ok(inner, inner_len)) return;
+
+	lease = talloc_zero_pooled_object(thread, proto_dhcpv6_lease_t, 2, key_len + reply_len);
+	if (!lease) return;
+
+	lease->key = talloc_memdup(lease, key, key_len);
+	lease->reply = talloc_memdup(lease, reply, reply_len);
+	if (!lease->key || !lease->reply) {
+		talloc_free(lease);
+		return;
+	}
+
+	lease->key_len = key_len;
+	lease->reply_len = reply_len;
+	lease->inner = inner - reply;
+	lease->inner_len = inner_len;
+	lease->created = fr_time();
+
+	old = fr_hash_table_find(thread->leases, lease);
+	if (old) lease_remove(thread, old);
+
+	if (!fr_hash_table_insert(thread->leases, lease)) {
+		talloc_free(lease);
+		return;
+	}
+	fr_dlist_insert_tail(&thread->lease_list, lease);
+
+	while (fr_dlist_num_elements(&thread->lease_list) > inst->lease_cache_size) {
+		lease_remove(thread, fr_dlist_head(&thread->lease_list));
+	}
+}
+
 static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len,
 			size_t *leftover)
 {
@@ -155,7 +618,7 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	data_size = udp_recv_batch(thread->recv_batch, thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
 	if (data_size < 0) {
 		RATE_LIMIT_GLOBAL(PERROR, "Read error (%zd)", data_size);
 		return data_size;
@@ -191,6 +654,15 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 		}
 	} /* else it was multicast... remember that */
 
+	/*
+	 *	Renews and Rebinds for leases we know about can be
+	 *	answered without decoding the packet.
+	 */
+	if (thread->leases &&
+	    ((packet->code == FR_DHCPV6_RENEW) || (packet->code == FR_DHCPV6_REBIND) ||
+	     (packet->code == FR_DHCPV6_RELAY_FORWARD)) &&
+	    lease_cache_reply(inst, thread, address, buffer, packet_len)) return 0;
+
 	/*
 	 *	proto_dhcpv6 sets the priority
 	 */
@@ -244,17 +716,45 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	/*
 	 *	proto_dhcpv6 takes care of suppressing do-not-respond, etc.
 	 */
-	data_size = udp_send(&socket, flags, buffer, buffer_len);
+	data_size = udp_send_batch(thread->send_batch, &socket, flags, buffer, buffer_len);
 
 	/*
 	 *	This socket is dead.  That's an error...
 	 */
 	if (data_size <= 0) return data_size;
 
+	/*
+	 *	Cache replies to Request, Renew, and Rebind.  The
+	 *	tracking structure starts with the code of the
+	 *	client message.
+	 */
+	if (thread->leases && track->packet) {
+		switch (track->packet[0]) {
+		case FR_DHCPV6_REQUEST:
+		case FR_DHCPV6_RENEW:
+		case FR_DHCPV6_REBIND:
+			lease_cache_insert(inst, thread, buffer, buffer_len);
+			break;
+
+		default:
+			break;
+		}
+	}
+
 	return data_size;
 }
 
 
+/** Write any replies which have been queued
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_dhcpv6_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv6_udp_thread_t);
+
+	return udp_send_batch_flush(thread->send_batch);
+}
+
 static int mod_connection_set(fr_listen_t *li, fr_io_address_t *connection)
 {
 	proto_dhcpv6_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_dhcpv6_udp_thread_t);
@@ -360,6 +860,42 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Read multiple datagrams with one system call.
+	 */
+	if (inst->recv_batch > 1) {
+		thread->recv_batch = udp_recv_batch_alloc(thread, inst->recv_batch, inst->max_packet_size);
+		if (!thread->recv_batch) {
+			ERROR("Failed allocating receive batch");
+			goto close_error;
+		}
+	}
+	li->recv_batch = inst->recv_batch;
+
+	/*
+	 *	Write multiple replies with one system call.
+	 */
+	if (inst->send_batch > 1) {
+		thread->send_batch = udp_send_batch_alloc(thread, inst->send_batch, inst->max_packet_size);
+		if (!thread->send_batch) {
+			ERROR("Failed allocating send batch");
+			goto close_error;
+		}
+	}
+
+	/*
+	 *	Replies which can be re-used for Renew and Rebind.
+	 */
+	if (inst->lease_cache_size) {
+		thread->leases = fr_hash_table_talloc_alloc(thread, proto_dhcpv6_lease_t, lease_hash, lease_cmp, NULL);
+		thread->lease_reply = talloc_array(thread, uint8_t, inst->max_packet_size);
+		if (!thread->leases || !thread->lease_reply) {
+			ERROR("Failed allocating lease cache");
+			goto close_error;
+		}
+		fr_dlist_talloc_init(&thread->lease_list, proto_dhcpv6_lease_t, entry);
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_dhcpv6_udp,
@@ -510,6 +1046,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	 */
 	inst->multicast = (fr_ipaddr_is_multicast(&inst->ipaddr) == 1);
 
+	if (inst->lease_cache_size) {
+		FR_TIME_DELTA_BOUND_CHECK("lease_cache.lifetime", inst->lease_cache_lifetime, >=, fr_time_delta_from_sec(1));
+		FR_TIME_DELTA_BOUND_CHECK("lease_cache.lifetime", inst->lease_cache_lifetime, <=, fr_time_delta_from_sec(86400));
+	}
+
 	/*
 	 *	Set src_ipaddr to ipaddr if not otherwise specified
 	 */
@@ -571,6 +1112,12 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 4);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, <=, 1024);
+
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, <=, 1024);
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -678,6 +1225,7 @@ fr_app_io_t proto_dhcpv6_udp = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.fd_set			= mod_fd_set,
 	.track_create  		= mod_track_create,
 	.track_compare		= mod_track_compare,
@@ -36,6 +36,27 @@ extern fr_app_io_t proto_load_step;
 
 typedef struct proto_load_step_s proto_load_step_t;
 
+/** Configuration for finding the maximum rate which meets a latency target
+ *
+ */
+typedef struct {
+	fr_time_delta_t			latency;		//!< the target latency, zero for "don't search".
+	double				percentile;		//!< of replies which must be faster than "latency".
+	char const			*report;		//!< where to write the JSON report.
+} proto_load_step_search_t;
+
+/** The results of running one rate during the search
+ *
+ */
+typedef struct {
+	uint32_t			pps;			//!< rate we tried
+	uint64_t			sent;			//!< requests we generated
+	uint64_t			received;		//!< replies we received
+	uint64_t			over;			//!< replies which were slower than the target
+	fr_time_delta_t			max;			//!< largest latency we saw
+	bool				pass;			//!< whether this rate met the target
+} proto_load_step_round_t;
+
 typedef struct {
 	fr_event_list_t			*el;			//!< event list
 	fr_network_t			*nr;			//!< network handler
@@ -54,6 +75,11 @@ typedef struct {
 	int				fd;			//!< for CSV files
 	fr_event_timer_t const		*ev;			//!< for writing statistics
 
+	proto_load_step_round_t		round;			//!< the rate we are currently trying
+	proto_load_step_round_t		*rounds;		//!< all rates we've tried
+	uint32_t			pass_pps;		//!< highest rate which met the target
+	uint32_t			fail_pps;		//!< lowest rate which didn't, 0 for "none yet".
+
 	fr_listen_t			*parent;		//!< master IO handler
 } proto_load_step_thread_t;
 
@@ -73,11 +99,20 @@ struct proto_load_step_s {
 	fr_load_config_t		load;			//!< load configuration
 	bool				repeat;			//!, do we repeat the load generation
 	char const     			*csv;			//!< where to write CSV stats
+	proto_load_step_search_t	search;			//!< find the maximum rate under a latency target
 
 	fr_dict_t const			*dict;			//!< Our namespace.
 };
 
 
+static const conf_parser_t search_config[] = {
+	{ FR_CONF_OFFSET("latency", proto_load_step_search_t, latency) },
+	{ FR_CONF_OFFSET("percentile", proto_load_step_search_t, percentile), .dflt = "99" },
+	{ FR_CONF_OFFSET("report", proto_load_step_search_t, report) },
+
+	CONF_PARSER_TERMINATOR
+};
+
 static const conf_parser_t load_listen_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("filename", CONF_FLAG_FILE_INPUT | CONF_FLAG_REQUIRED | CONF_FLAG_NOT_EMPTY, proto_load_step_t, filename) },
 	{ FR_CONF_OFFSET("csv", proto_load_step_t, csv) },
@@ -92,6 +127,8 @@ static const conf_parser_t load_listen_config[] = {
 	{ FR_CONF_OFFSET("parallel", proto_load_step_t, load.parallel) },
 	{ FR_CONF_OFFSET("repeat", proto_load_step_t, repeat) },
 
+	{ FR_CONF_OFFSET_SUBSECTION("search", 0, proto_load_step_t, search, search_config) },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -155,6 +192,119 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 }
 
 
+/** Run the load generator at a fixed rate for one "duration"
+ *
+ *  The generator stops once it tries to go past max_pps, and then
+ *  tells us it's done once all of the replies have come back.
+ */
+static void search_round_start(proto_load_step_thread_t *thread, uint32_t pps)
+{
+	thread->round = (proto_load_step_round_t) {
+		.pps = pps,
+	};
+
+	thread->load.start_pps = pps;
+	thread->load.max_pps = pps;
+	thread->load.step = 1;
+
+	(void) fr_load_generator_stop(thread->l);
+	(void) fr_load_generator_start(thread->l);
+}
+
+static void search_report(proto_load_step_thread_t *thread)
+{
+	proto_load_step_search_t const	*search = &thread->inst->search;
+	size_t				i, num = talloc_array_length(thread->rounds);
+	FILE				*fp;
+
+	INFO("%s - maximum rate with p%g latency below %pV is %u packets/s",
+	     thread->name, search->percentile, fr_box_time_delta(search->latency), thread->pass_pps);
+
+	if (!search->report) return;
+
+	fp = fopen(search->report, "w");
+	if (!fp) {
+		ERROR("Failed opening %s - %s", search->report, fr_syserror(errno));
+		return;
+	}
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"percentile\": %g,\n", search->percentile);
+	fprintf(fp, "\t\"latency_usec\": %" PRId64 ",\n", fr_time_delta_to_usec(search->latency));
+	fprintf(fp, "\t\"duration_usec\": %" PRId64 ",\n", fr_time_delta_to_usec(thread->load.duration));
+	fprintf(fp, "\t\"max_pps\": %u,\n", thread->pass_pps);
+	fprintf(fp, "\t\"rounds\": [\n");
+
+	for (i = 0; i < num; i++) {
+		proto_load_step_round_t const *round = &thread->rounds[i];
+
+		fprintf(fp, "\t\t{ \"pps\": %u, \"sent\": %" PRIu64 ", \"received\": %" PRIu64
+			", \"over\": %" PRIu64 ", \"max_usec\": %" PRId64 ", \"pass\": %s }%s\n",
+			round->pps, round->sent, round->received, round->over,
+			fr_time_delta_to_usec(round->max), round->pass ? "true" : "false",
+			(i + 1) < num ? "," : "");
+	}
+
+	fprintf(fp, "\t]\n}\n");
+	fclose(fp);
+}
+
+/** Decide whether the last rate met the target, and pick the next one
+ *
+ *  We double the rate until we find one which fails, or we hit
+ *  max_pps.  We then binary search between the highest rate which
+ *  passed and the lowest one which failed, until they are within
+ *  "step" of each other.
+ *
+ * @return
+ *	- 0 if there are more rates to try.
+ *	- 1 if the search is done.
+ */
+static int search_round_done(proto_load_step_thread_t *thread)
+{
+	proto_load_step_search_t const	*search = &thread->inst->search;
+	proto_load_step_round_t		*round = &thread->round;
+	size_t				num = talloc_array_length(thread->rounds);
+	uint64_t			expected;
+	uint32_t			pps;
+
+	/*
+	 *	If the backlog gated the generator, then the server
+	 *	didn't keep up with the rate, no matter what the
+	 *	latency of the replies was.
+	 */
+	expected = (round->pps * fr_time_delta_unwrap(thread->load.duration)) / NSEC;
+	round->pass = ((round->sent * 100) >= (expected * 95)) &&
+		      ((double) round->over <= ((double) round->received * (100.0 - search->percentile)) / 100.0);
+
+	DEBUG("%s - %u packets/s %s, %" PRIu64 " of %" PRIu64 " replies were slower than %pV",
+	      thread->name, round->pps, round->pass ? "passed" : "failed",
+	      round->over, round->received, fr_box_time_delta(search->latency));
+
+	MEM(thread->rounds = talloc_realloc(thread, thread->rounds, proto_load_step_round_t, num + 1));
+	thread->rounds[num] = *round;
+
+	if (round->pass) {
+		thread->pass_pps = round->pps;
+	} else {
+		thread->fail_pps = round->pps;
+	}
+
+	if (!thread->fail_pps) {
+		if (round->pps >= thread->inst->load.max_pps) return 1;
+
+		pps = round->pps * 2;
+		if (pps > thread->inst->load.max_pps) pps = thread->inst->load.max_pps;
+	} else {
+		if ((thread->fail_pps - thread->pass_pps) <= thread->inst->load.step) return 1;
+
+		pps = thread->pass_pps + (thread->fail_pps - thread->pass_pps) / 2;
+	}
+
+	search_round_start(thread, pps);
+	return 0;
+}
+
 static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t request_time,
 			 UNUSED uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
@@ -168,6 +318,14 @@ static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t req
 	 */
 	thread->stats.total_responses++;
 
+	if (fr_time_delta_ispos(thread->inst->search.latency)) {
+		fr_time_delta_t latency = fr_time_sub(fr_time(), request_time);
+
+		thread->round.received++;
+		if (fr_time_delta_gt(latency, thread->inst->search.latency)) thread->round.over++;
+		if (fr_time_delta_gt(latency, thread->round.max)) thread->round.max = latency;
+	}
+
 	/*
 	 *	Tell the load generatopr subsystem that we have a
 	 *	reply.  Then if the load test is done, exit the
@@ -175,7 +333,13 @@ static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t req
 	 */
 	state = fr_load_generator_have_reply(thread->l, request_time);
 	if (state == FR_LOAD_DONE) {
-		if (!thread->inst->repeat) {
+		if (fr_time_delta_ispos(thread->inst->search.latency)) {
+			if (search_round_done(thread) == 1) {
+				search_report(thread);
+				thread->done = true;
+			}
+
+		} else if (!thread->inst->repeat) {
 			thread->done = true;
 		} else {
 			(void) fr_load_generator_stop(thread->l); /* ensure l->ev is gone */
@@ -225,6 +389,7 @@ static int mod_generate(fr_time_t now, void *uctx)
 	proto_load_step_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_load_step_thread_t);
 
 	thread->recv_time = now;
+	thread->round.sent++;
 
 	/*
 	 *	Tell the network side to call our read routine.
@@ -312,7 +477,11 @@ static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, void *nr)
 	thread->l = fr_load_generator_create(thread, el, &thread->load, mod_generate, li);
 	if (!thread->l) return;
 
-	(void) fr_load_generator_start(thread->l);
+	if (fr_time_delta_ispos(inst->search.latency)) {
+		search_round_start(thread, inst->load.start_pps);
+	} else {
+		(void) fr_load_generator_start(thread->l);
+	}
 
 	if (!inst->csv) return;
 
@@ -408,6 +577,18 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	FR_INTEGER_BOUND_CHECK("max_backlog", inst->load.milliseconds, >=, 1);
 	FR_INTEGER_BOUND_CHECK("max_backlog", inst->load.milliseconds, <, 100000);
 
+	if (fr_time_delta_ispos(inst->search.latency)) {
+		if (!inst->load.max_pps) {
+			cf_log_err(conf, "'max_pps' must be set when searching for the maximum rate");
+			return -1;
+		}
+
+		if ((inst->search.percentile <= 0) || (inst->search.percentile >= 100)) {
+			cf_log_err(conf, "Invalid value for 'percentile'.  It must be between 0 and 100");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -0,0 +1,183 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_metrics.c
+ * @brief OpenMetrics exporter master protocol handler.
+ *
+ * Serves the values registered with fr_metrics_source_alloc() over HTTP,
+ * so that Prometheus and friends can scrape them.  Nothing is sent to the
+ * workers, the transport answers each scrape itself.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/server/virtual_servers.h>
+#include <freeradius-devel/util/debug.h>
+#include "proto_metrics.h"
+
+extern fr_app_t proto_metrics;
+
+static int transport_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, conf_parser_t const *rule);
+
+static conf_parser_t const limit_config[] = {
+	{ FR_CONF_OFFSET("idle_timeout", proto_metrics_t, io.idle_timeout), .dflt = "30.0" } ,
+	{ FR_CONF_OFFSET("nak_lifetime", proto_metrics_t, io.nak_lifetime), .dflt = "30.0" } ,
+
+	{ FR_CONF_OFFSET("max_connections", proto_metrics_t, io.max_connections), .dflt = "1024" } ,
+	{ FR_CONF_OFFSET("max_clients", proto_metrics_t, io.max_clients), .dflt = "256" } ,
+	{ FR_CONF_OFFSET("max_pending_packets", proto_metrics_t, io.max_pending_packets), .dflt = "256" } ,
+
+	/*
+	 *	For performance tweaking.  NOT for normal humans.
+	 */
+	{ FR_CONF_OFFSET("max_packet_size", proto_metrics_t, max_packet_size) } ,
+	{ FR_CONF_OFFSET("num_messages", proto_metrics_t, num_messages) } ,
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** How to parse a metrics listen section
+ *
+ */
+static conf_parser_t const proto_metrics_config[] = {
+	{ FR_CONF_OFFSET_TYPE_FLAGS("transport", FR_TYPE_VOID, 0, proto_metrics_t, io.submodule),
+	  .func = transport_parse },
+
+	{ FR_CONF_POINTER("limit", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) limit_config },
+	CONF_PARSER_TERMINATOR
+};
+
+static int transport_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, conf_parser_t const *rule)
+{
+	proto_metrics_t		*inst = talloc_get_type_abort(parent, proto_metrics_t);
+	module_instance_t	*mi;
+
+	if (unlikely(virtual_sever_listen_transport_parse(ctx, out, parent, ci, rule) < 0)) {
+		return -1;
+	}
+
+	mi = talloc_get_type_abort(*(void **)out, module_instance_t);
+	inst->io.app_io = (fr_app_io_t const *)mi->exported;
+	inst->io.app_io_instance = mi->data;
+	inst->io.app_io_conf = mi->conf;
+
+	return 0;
+}
+
+/** Open listen sockets/connect to external event source
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] sc	to add our file descriptor to.
+ * @param[in] conf	Listen section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_open(void *instance, fr_schedule_t *sc, UNUSED CONF_SECTION *conf)
+{
+	proto_metrics_t 	*inst = talloc_get_type_abort(instance, proto_metrics_t);
+
+	inst->io.app = &proto_metrics;
+	inst->io.app_instance = instance;
+
+	return fr_master_io_listen(&inst->io, sc,
+				   inst->max_packet_size, inst->num_messages);
+}
+
+/** Instantiate the application
+ *
+ * Instantiate I/O and type submodules.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	proto_metrics_t		*inst = talloc_get_type_abort(mctx->mi->data, proto_metrics_t);
+	CONF_SECTION			*conf = mctx->mi->conf;
+
+	/*
+	 *	Ensure that the server CONF_SECTION is always set.
+	 */
+	inst->io.server_cs = cf_item_to_section(cf_parent(conf));
+
+	/*
+	 *	No IO module, it's an empty listener.
+	 */
+	if (!inst->io.submodule) {
+		cf_log_err(conf, "The metrics listener MUST have a 'transport'.");
+		return -1;
+	}
+
+	/*
+	 *	These timers are usually protocol specific.
+	 */
+	FR_TIME_DELTA_BOUND_CHECK("idle_timeout", inst->io.idle_timeout, >=, fr_time_delta_from_sec(1));
+	FR_TIME_DELTA_BOUND_CHECK("idle_timeout", inst->io.idle_timeout, <=, fr_time_delta_from_sec(600));
+
+	FR_TIME_DELTA_BOUND_CHECK("nak_lifetime", inst->io.nak_lifetime, >=, fr_time_delta_from_sec(1));
+	FR_TIME_DELTA_BOUND_CHECK("nak_lifetime", inst->io.nak_lifetime, <=, fr_time_delta_from_sec(600));
+
+	/*
+	 *	Tell the master handler about the main protocol instance.
+	 */
+	inst->io.app = &proto_metrics;
+	inst->io.app_instance = inst;
+
+	/*
+	 *	We will need this for dynamic clients and connected sockets.
+	 */
+	inst->io.mi = mctx->mi;
+
+	/*
+	 *	These configuration items are not printed by default,
+	 *	because normal people shouldn't be touching them.
+	 */
+	if (!inst->max_packet_size && inst->io.app_io) inst->max_packet_size = inst->io.app_io->default_message_size;
+
+	if (!inst->num_messages) inst->num_messages = 256;
+
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, >=, 32);
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, <=, 65535);
+
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 1024);
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
+
+	/*
+	 *	Instantiate the transport module before calling the
+	 *	common instantiation function.
+	 */
+	if (module_instantiate(inst->io.submodule) < 0) return -1;
+
+	/*
+	 *	Instantiate the master io submodule
+	 */
+	return fr_master_app_io.common.instantiate(MODULE_INST_CTX(inst->io.mi));
+}
+
+fr_app_t proto_metrics = {
+	.common = {
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "metrics",
+		.config			= proto_metrics_config,
+		.inst_size		= sizeof(proto_metrics_t),
+		.instantiate		= mod_instantiate
+	},
+	.open			= mod_open,
+};
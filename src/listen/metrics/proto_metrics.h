@@ -0,0 +1,36 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file proto_metrics.h
+ * @brief Structures for the OpenMetrics exporter
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+#include <freeradius-devel/io/master.h>
+
+/** An instance of a proto_metrics listen section
+ *
+ */
+typedef struct {
+	fr_io_instance_t		io;				//!< wrapper for IO abstraction
+
+	uint32_t			max_packet_size;		//!< for message ring buffer.
+	uint32_t			num_messages;			//!< for message ring buffer.
+} proto_metrics_t;
@@ -0,0 +1,588 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_metrics_tcp.c
+ * @brief OpenMetrics exporter over HTTP.
+ *
+ * This is a minimal HTTP/1.1 server.  It reads one request per
+ * connection, answers it with the output of fr_metrics_print(), and
+ * closes the connection.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/trie.h>
+
+#include <netdb.h>
+
+#include "proto_metrics.h"
+
+extern fr_app_io_t proto_metrics_tcp;
+
+typedef struct {
+	char const			*name;			//!< socket name
+	int				sockfd;
+
+	fr_event_list_t			*el;			//!< for writing large responses.
+
+	fr_io_address_t			*connection;		//!< for connected sockets.
+
+	fr_client_t			radclient;		//!< for faking out clients
+} proto_metrics_tcp_thread_t;
+
+typedef struct {
+	CONF_SECTION			*cs;			//!< our configuration
+
+	fr_ipaddr_t			ipaddr;			//!< IP address to listen on.
+
+	char const			*interface;		//!< Interface to bind to.
+	char const			*port_name;		//!< Name of the port for getservent().
+
+	char const			*path;			//!< HTTP path the metrics are served from.
+
+	fr_time_delta_t			send_timeout;		//!< How long we wait for a scraper to read
+								///< a response.
+
+	uint32_t			max_packet_size;	//!< for message ring buffer.
+
+	uint16_t			port;			//!< Port to listen on.
+
+	fr_ipaddr_t			*allow;			//!< networks which are allowed to scrape.
+	fr_trie_t			*trie;			//!< for parsed networks
+} proto_metrics_tcp_t;
+
+/** A response which didn't fit into the socket buffer
+ *
+ * The listener closes the connection as soon as read() returns, so we
+ * keep a duplicate of the socket, and write the rest of the response
+ * from the network thread's event loop.
+ */
+typedef struct {
+	fr_event_list_t			*el;			//!< we're inserted into.
+	int				fd;			//!< duplicate of the connection.
+	char const			*name;			//!< for logging.
+
+	char				*data;			//!< response.
+	size_t				len;			//!< total length.
+	size_t				written;		//!< how much has been sent.
+
+	fr_event_timer_t const		*ev;			//!< send_timeout.
+} proto_metrics_tcp_flush_t;
+
+static const conf_parser_t tcp_listen_config[] = {
+	{ FR_CONF_OFFSET_TYPE_FLAGS("ipaddr", FR_TYPE_COMBO_IP_ADDR, 0, proto_metrics_tcp_t, ipaddr) },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("ipv4addr", FR_TYPE_IPV4_ADDR, 0, proto_metrics_tcp_t, ipaddr) },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("ipv6addr", FR_TYPE_IPV6_ADDR, 0, proto_metrics_tcp_t, ipaddr) },
+
+	{ FR_CONF_OFFSET("interface", proto_metrics_tcp_t, interface) },
+	{ FR_CONF_OFFSET("port_name", proto_metrics_tcp_t, port_name) },
+
+	{ FR_CONF_OFFSET("port", proto_metrics_tcp_t, port), .dflt = "9812" },
+
+	{ FR_CONF_OFFSET("path", proto_metrics_tcp_t, path), .dflt = "/metrics" },
+	{ FR_CONF_OFFSET("send_timeout", proto_metrics_tcp_t, send_timeout), .dflt = "5.0" },
+
+	{ FR_CONF_OFFSET_TYPE_FLAGS("allow", FR_TYPE_COMBO_IP_PREFIX , CONF_FLAG_MULTI, proto_metrics_tcp_t, allow) },
+
+	{ FR_CONF_OFFSET("max_packet_size", proto_metrics_tcp_t, max_packet_size), .dflt = "4096" } ,
+
+	CONF_PARSER_TERMINATOR
+};
+
+static int _metrics_flush_free(proto_metrics_tcp_flush_t *flush)
+{
+	(void) fr_event_fd_delete(flush->el, flush->fd, FR_EVENT_FILTER_IO);
+	close(flush->fd);
+
+	return 0;
+}
+
+static void metrics_flush_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	proto_metrics_tcp_flush_t *flush = talloc_get_type_abort(uctx, proto_metrics_tcp_flush_t);
+
+	DEBUG("proto_metrics_tcp - Timed out sending response to %s", flush->name);
+	talloc_free(flush);
+}
+
+static void metrics_flush_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	proto_metrics_tcp_flush_t *flush = talloc_get_type_abort(uctx, proto_metrics_tcp_flush_t);
+
+	DEBUG("proto_metrics_tcp - Failed sending response to %s: %s", flush->name, fr_syserror(fd_errno));
+	talloc_free(flush);
+}
+
+static void metrics_flush_write(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	proto_metrics_tcp_flush_t	*flush = talloc_get_type_abort(uctx, proto_metrics_tcp_flush_t);
+	ssize_t				rcode;
+
+	rcode = write(fd, flush->data + flush->written, flush->len - flush->written);
+	if (rcode < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+		DEBUG("proto_metrics_tcp - Failed sending response to %s: %s", flush->name, fr_syserror(errno));
+		talloc_free(flush);
+		return;
+	}
+
+	flush->written += rcode;
+	if (flush->written == flush->len) talloc_free(flush);
+}
+
+/** Send a response, and hand off anything which doesn't fit to the event loop
+ *
+ */
+static void metrics_send(proto_metrics_tcp_t const *inst, proto_metrics_tcp_thread_t *thread,
+			 char *data, size_t len)
+{
+	proto_metrics_tcp_flush_t	*flush;
+	size_t				written = 0;
+	ssize_t				rcode;
+	int				fd;
+
+	while (written < len) {
+		rcode = write(thread->sockfd, data + written, len - written);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+
+			DEBUG("proto_metrics_tcp - Failed sending response to %s: %s", thread->name, fr_syserror(errno));
+		error:
+			talloc_free(data);
+			return;
+		}
+		written += rcode;
+	}
+
+	if (written == len) goto error;
+
+	if (!thread->el) {
+		DEBUG("proto_metrics_tcp - Socket buffer full, discarding response to %s", thread->name);
+		goto error;
+	}
+
+	fd = dup(thread->sockfd);
+	if (fd < 0) {
+		DEBUG("proto_metrics_tcp - Failed duplicating socket for %s: %s", thread->name, fr_syserror(errno));
+		goto error;
+	}
+
+	/*
+	 *	Parented from the event list, as our listener is about
+	 *	to be freed.
+	 */
+	MEM(flush = talloc_zero(thread->el, proto_metrics_tcp_flush_t));
+	flush->el = thread->el;
+	flush->fd = fd;
+	flush->name = talloc_strdup(flush, thread->name);
+	flush->data = talloc_steal(flush, data);
+	flush->len = len;
+	flush->written = written;
+
+	if (fr_event_fd_insert(flush, NULL, flush->el, fd, NULL, metrics_flush_write, metrics_flush_error, flush) < 0) {
+		PERROR("proto_metrics_tcp - Failed inserting socket for %s", thread->name);
+		close(fd);
+		talloc_free(flush);
+		return;
+	}
+	talloc_set_destructor(flush, _metrics_flush_free);
+
+	if (fr_event_timer_in(flush, flush->el, &flush->ev, inst->send_timeout, metrics_flush_timeout, flush) < 0) {
+		PERROR("proto_metrics_tcp - Failed inserting timer for %s", thread->name);
+		talloc_free(flush);
+	}
+}
+
+/** Build and send a response
+ *
+ */
+static void metrics_respond(proto_metrics_tcp_t const *inst, proto_metrics_tcp_thread_t *thread,
+			    char const *status, char const *extra, char const *content_type,
+			    char const *body, bool head)
+{
+	char		*data;
+	size_t		body_len = body ? strlen(body) : 0;
+
+	data = talloc_typed_asprintf(NULL, "HTTP/1.1 %s\r\n"
+				     "Content-Type: %s\r\n"
+				     "Content-Length: %zu\r\n"
+				     "%s"
+				     "Connection: close\r\n"
+				     "\r\n",
+				     status, content_type, body_len, extra ? extra : "");
+	if (!data) return;
+
+	if (body && !head) MEM(data = talloc_bstr_append(NULL, data, body, body_len));
+
+	metrics_send(inst, thread, data, talloc_array_length(data) - 1);
+}
+
+static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover)
+{
+	proto_metrics_tcp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_metrics_tcp_t);
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+	ssize_t				data_size;
+	char				*p, *end, *method, *path;
+	size_t				i, path_len, in_buffer;
+	bool				head = false;
+	char				*body;
+
+	/*
+	 *	Leave room for a trailing zero, so we can use string
+	 *	functions on the request.
+	 */
+	if (*leftover >= (buffer_len - 1)) {
+		metrics_respond(inst, thread, "431 Request Header Fields Too Large", NULL, "text/plain", NULL, false);
+		return -1;
+	}
+
+	data_size = read(thread->sockfd, buffer + *leftover, buffer_len - *leftover - 1);
+	if (data_size < 0) {
+		switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+		case EWOULDBLOCK:
+#endif
+		case EAGAIN:
+			return 0;
+
+		default:
+			break;
+		}
+
+		DEBUG2("proto_metrics_tcp got read error %zd: %s", data_size, fr_syserror(errno));
+		return data_size;
+	}
+
+	/*
+	 *	The other end closed the connection.
+	 */
+	if (!data_size) return -1;
+
+	in_buffer = *leftover + data_size;
+	buffer[in_buffer] = '\0';
+
+	/*
+	 *	Wait until we have all of the headers.  We ignore
+	 *	them, but a client which hasn't finished sending
+	 *	doesn't expect an answer yet.
+	 */
+	for (i = 0; i < in_buffer; i++) {
+		if (buffer[i] != '\n') continue;
+
+		if ((i + 1 < in_buffer) && (buffer[i + 1] == '\n')) break;
+		if ((i + 2 < in_buffer) && (buffer[i + 1] == '\r') && (buffer[i + 2] == '\n')) break;
+	}
+	if (i == in_buffer) {
+		*leftover = in_buffer;
+		return 0;
+	}
+
+	*recv_time_p = fr_time();
+	*leftover = 0;
+
+	/*
+	 *	Request-Line = Method SP Request-URI SP HTTP-Version CRLF
+	 */
+	method = (char *) buffer;
+	p = strchr(method, ' ');
+	if (!p) {
+	bad_request:
+		metrics_respond(inst, thread, "400 Bad Request", NULL, "text/plain", NULL, false);
+		return -1;
+	}
+	*p++ = '\0';
+
+	path = p;
+	end = strpbrk(path, " \r\n");
+	if (!end || (*end != ' ') || (strncmp(end + 1, "HTTP/1.", 7) != 0)) goto bad_request;
+	*end = '\0';
+
+	DEBUG3("proto_metrics_tcp - Received %s %s on %s", method, path, thread->name);
+
+	if (strcmp(method, "HEAD") == 0) {
+		head = true;
+
+	} else if (strcmp(method, "GET") != 0) {
+		metrics_respond(inst, thread, "405 Method Not Allowed", "Allow: GET, HEAD\r\n", "text/plain", NULL, false);
+		return -1;
+	}
+
+	/*
+	 *	Ignore any query string.
+	 */
+	path_len = strcspn(path, "?");
+	if ((path_len != strlen(inst->path)) || (strncmp(path, inst->path, path_len) != 0)) {
+		metrics_respond(inst, thread, "404 Not Found", NULL, "text/plain", NULL, head);
+		return -1;
+	}
+
+	body = fr_metrics_print(NULL);
+	if (!body) {
+		metrics_respond(inst, thread, "500 Internal Server Error", NULL, "text/plain", NULL, head);
+		return -1;
+	}
+
+	metrics_respond(inst, thread, "200 OK", NULL,
+			"application/openmetrics-text; version=1.0.0; charset=utf-8", body, head);
+	talloc_free(body);
+
+	/*
+	 *	We don't do keep-alive.  Returning an error closes
+	 *	the connection.
+	 */
+	return -1;
+}
+
+/** We never send anything to the workers, so there's nothing to write
+ *
+ */
+static ssize_t mod_write(UNUSED fr_listen_t *li, UNUSED void *packet_ctx, UNUSED fr_time_t request_time,
+			 UNUSED uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
+{
+	return buffer_len;
+}
+
+static int mod_connection_set(fr_listen_t *li, fr_io_address_t *connection)
+{
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+
+	thread->connection = connection;
+
+	return 0;
+}
+
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, UNUSED void *nr)
+{
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+
+	thread->el = el;
+}
+
+static void mod_network_get(int *ipproto, bool *dynamic_clients, fr_trie_t const **trie, UNUSED void *instance)
+{
+	*ipproto = IPPROTO_TCP;
+	*dynamic_clients = false;
+	*trie = NULL;
+}
+
+/** Open a TCP listener for scrapes
+ *
+ */
+static int mod_open(fr_listen_t *li)
+{
+	proto_metrics_tcp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_metrics_tcp_t);
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+
+	int				sockfd;
+	fr_ipaddr_t			ipaddr = inst->ipaddr;
+	uint16_t			port = inst->port;
+	CONF_ITEM			*ci;
+
+	fr_assert(!thread->connection);
+
+	li->fd = sockfd = fr_socket_server_tcp(&inst->ipaddr, &port, inst->port_name, true);
+	if (sockfd < 0) {
+		PERROR("Failed opening TCP socket");
+	error:
+		return -1;
+	}
+
+	(void) fr_nonblock(sockfd);
+
+	if (fr_socket_bind(sockfd, inst->interface, &ipaddr, &port) < 0) {
+		close(sockfd);
+		PERROR("Failed binding socket");
+		goto error;
+	}
+
+	if (listen(sockfd, 8) < 0) {
+		close(sockfd);
+		PERROR("Failed listening on socket");
+		goto error;
+	}
+
+	thread->sockfd = sockfd;
+
+	thread->name = fr_app_io_socket_name(thread, &proto_metrics_tcp,
+					     NULL, 0,
+					     &inst->ipaddr, inst->port,
+					     inst->interface);
+
+	ci = cf_parent(inst->cs); /* listen { ... } */
+	fr_assert(ci != NULL);
+	ci = cf_parent(ci);
+	fr_assert(ci != NULL);
+
+	/*
+	 *	Set up the fake client
+	 */
+	thread->radclient.longname = thread->name;
+	thread->radclient.shortname = "metrics";
+	thread->radclient.ipaddr = inst->ipaddr;
+	thread->radclient.src_ipaddr.af = inst->ipaddr.af;
+
+	thread->radclient.server_cs = cf_item_to_section(ci);
+	fr_assert(thread->radclient.server_cs != NULL);
+	thread->radclient.server = cf_section_name2(thread->radclient.server_cs);
+
+	return 0;
+}
+
+/** Set the file descriptor for this socket.
+ *
+ */
+static int mod_fd_set(fr_listen_t *li, int fd)
+{
+	proto_metrics_tcp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_metrics_tcp_t);
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+
+	thread->sockfd = fd;
+
+	thread->name = fr_app_io_socket_name(thread, &proto_metrics_tcp,
+					     &thread->connection->socket.inet.src_ipaddr, thread->connection->socket.inet.src_port,
+					     &inst->ipaddr, inst->port,
+					     inst->interface);
+
+	return 0;
+}
+
+static char const *mod_name(fr_listen_t *li)
+{
+	proto_metrics_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+
+	return thread->name;
+}
+
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	proto_metrics_tcp_t	*inst = talloc_get_type_abort(mctx->mi->data, proto_metrics_tcp_t);
+	CONF_SECTION		*conf = mctx->mi->conf;
+	size_t			i, num;
+
+	inst->cs = conf;
+
+	/*
+	 *	Complain if no "ipaddr" is set.
+	 */
+	if (inst->ipaddr.af == AF_UNSPEC) {
+		cf_log_err(conf, "No 'ipaddr' was specified in the 'tcp' section");
+		return -1;
+	}
+
+	if (!inst->path || (inst->path[0] != '/')) {
+		cf_log_err(conf, "The 'path' must start with '/'");
+		return -1;
+	}
+
+	FR_TIME_DELTA_BOUND_CHECK("send_timeout", inst->send_timeout, >=, fr_time_delta_from_sec(1));
+	FR_TIME_DELTA_BOUND_CHECK("send_timeout", inst->send_timeout, <=, fr_time_delta_from_sec(60));
+
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 1024);
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
+
+	if (!inst->port) {
+		struct servent *s;
+
+		if (!inst->port_name) {
+			cf_log_err(conf, "No 'port' was specified in the 'tcp' section");
+			return -1;
+		}
+
+		s = getservbyname(inst->port_name, "tcp");
+		if (!s) {
+			cf_log_err(conf, "Unknown value for 'port_name = %s", inst->port_name);
+			return -1;
+		}
+
+		inst->port = ntohl(s->s_port);
+	}
+
+	/*
+	 *	No "allow" means anyone who can reach the socket can
+	 *	scrape it.
+	 */
+	num = talloc_array_length(inst->allow);
+	if (!num) return 0;
+
+	MEM(inst->trie = fr_trie_alloc(inst, NULL, NULL));
+
+	for (i = 0; i < num; i++) {
+		if (inst->allow[i].af != inst->ipaddr.af) {
+			cf_log_err(conf, "Address family in entry %zd - 'allow = %pV' does not match 'ipaddr'",
+				   i + 1, fr_box_ipaddr(inst->allow[i]));
+			return -1;
+		}
+
+		if (fr_trie_match_by_key(inst->trie, &inst->allow[i].addr, inst->allow[i].prefix)) {
+			cf_log_err(conf, "Cannot add duplicate entry 'allow = %pV'",
+				   fr_box_ipaddr(inst->allow[i]));
+			return -1;
+		}
+
+		if (fr_trie_insert_by_key(inst->trie, &inst->allow[i].addr, inst->allow[i].prefix,
+					  &inst->allow[i]) < 0) {
+			cf_log_err(conf, "Failed adding 'allow = %pV' to tracking table",
+				   fr_box_ipaddr(inst->allow[i]));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static fr_client_t *mod_client_find(fr_listen_t *li, fr_ipaddr_t const *ipaddr, UNUSED int ipproto)
+{
+	proto_metrics_tcp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_metrics_tcp_t);
+	proto_metrics_tcp_thread_t    	*thread = talloc_get_type_abort(li->thread_instance, proto_metrics_tcp_thread_t);
+
+	if (inst->trie && !fr_trie_lookup_by_key(inst->trie, &ipaddr->addr, ipaddr->prefix)) {
+		DEBUG2("proto_metrics_tcp - Refusing scrape from %pV, it is not in an 'allow' network",
+		       fr_box_ipaddr(*ipaddr));
+		return NULL;
+	}
+
+	return &thread->radclient;
+}
+
+fr_app_io_t proto_metrics_tcp = {
+	.common = {
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "metrics_tcp",
+		.config			= tcp_listen_config,
+		.inst_size		= sizeof(proto_metrics_tcp_t),
+		.thread_inst_size	= sizeof(proto_metrics_tcp_thread_t),
+		.instantiate		= mod_instantiate
+	},
+	.default_message_size	= 4096,
+
+	.open			= mod_open,
+	.read			= mod_read,
+	.write			= mod_write,
+	.fd_set			= mod_fd_set,
+	.connection_set		= mod_connection_set,
+	.event_list_set		= mod_event_list_set,
+	.network_get		= mod_network_get,
+	.client_find		= mod_client_find,
+	.get_name      		= mod_name,
+};
@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_metrics_tcp
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME)$(L)
+endif
+
+SOURCES		:= proto_metrics_tcp.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io$(L)
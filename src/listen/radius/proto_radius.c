@@ -38,6 +38,7 @@ static conf_parser_t const limit_config[] = {
 	{ FR_CONF_OFFSET("cleanup_delay", proto_radius_t, io.cleanup_delay), .dflt = "5.0" } ,
 	{ FR_CONF_OFFSET("idle_timeout", proto_radius_t, io.idle_timeout), .dflt = "30.0" } ,
 	{ FR_CONF_OFFSET("nak_lifetime", proto_radius_t, io.nak_lifetime), .dflt = "30.0" } ,
+	{ FR_CONF_OFFSET("max_nak_lifetime", proto_radius_t, io.max_nak_lifetime), .dflt = "0" } ,
 
 	{ FR_CONF_OFFSET("max_connections", proto_radius_t, io.max_connections), .dflt = "1024" } ,
 	{ FR_CONF_OFFSET("max_clients", proto_radius_t, io.max_clients), .dflt = "256" } ,
@@ -84,6 +85,12 @@ static conf_parser_t const proto_radius_config[] = {
 	{ FR_CONF_POINTER("limit", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	{ FR_CONF_POINTER("priority", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) priority_config },
 
+	{ FR_CONF_OFFSET("shard_networks", proto_radius_t, io.shard_networks) } ,
+	{ FR_CONF_OFFSET("shard_by_cpu", proto_radius_t, io.shard_by_cpu) } ,
+	{ FR_CONF_OFFSET("flat_tracking", proto_radius_t, io.flat_tracking) } ,
+
+	{ FR_CONF_OFFSET_FLAGS("accounting_decode_only", CONF_FLAG_MULTI, proto_radius_t, accounting_decode_only) },
+
 	{ FR_CONF_OFFSET("require_message_authenticator", proto_radius_t, require_message_authenticator),
 	  .func = cf_table_parse_int,
 	  .uctx = &(cf_table_parse_ctx_t){ .table = fr_radius_require_ma_table, .len = &fr_radius_require_ma_table_len },
@@ -110,6 +117,10 @@ static fr_dict_attr_t const *attr_user_name;
 static fr_dict_attr_t const *attr_state;
 static fr_dict_attr_t const *attr_proxy_state;
 static fr_dict_attr_t const *attr_message_authenticator;
+static fr_dict_attr_t const *attr_original_request_authenticator;
+static fr_dict_attr_t const *attr_acct_status_type;
+static fr_dict_attr_t const *attr_acct_delay_time;
+static fr_dict_attr_t const *attr_event_timestamp;
 
 extern fr_dict_attr_autoload_t proto_radius_dict_attr[];
 fr_dict_attr_autoload_t proto_radius_dict_attr[] = {
@@ -118,6 +129,10 @@ fr_dict_attr_autoload_t proto_radius_dict_attr[] = {
 	{ .out = &attr_state, .name = "State", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_proxy_state, .name = "Proxy-State", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_message_authenticator, .name = "Message-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_original_request_authenticator, .name = "Vendor-Specific.FreeRADIUS.Original-Request-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_acct_status_type, .name = "Acct-Status-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_acct_delay_time, .name = "Acct-Delay-Time", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_event_timestamp, .name = "Event-Timestamp", .type = FR_TYPE_DATE, .dict = &dict_radius},
 	{ NULL }
 };
 
@@ -216,6 +231,10 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 		.verify = client->active,
 	};
 
+	if (inst->accounting_decode_only && (request->packet->code == FR_RADIUS_CODE_ACCOUNTING_REQUEST)) {
+		decode_ctx.decode_only = inst->accounting_decode;
+	}
+
 	if (request->packet->code == FR_RADIUS_CODE_ACCESS_REQUEST) {
 		/*
 		 *	bit1 is set if we've seen a packet, and the auto bit in require_message_authenticator is set/
@@ -244,6 +263,13 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 	request->packet->data = talloc_memdup(request->packet, data, data_len);
 	request->packet->data_len = data_len;
 
+	/*
+	 *	The copy lives as long as the request, so octets
+	 *	attributes can reference it instead of being
+	 *	duplicated.
+	 */
+	decode_ctx.borrow = request->packet->data;
+
 	/*
 	 *	!client->active means a fake packet defining a dynamic client - so there will
 	 *	be no secret defined yet - so can't verify.
@@ -459,6 +485,18 @@ static ssize_t mod_encode(UNUSED void const *instance, request_t *request, uint8
 		request->reply->socket.inet.src_ipaddr = client->src_ipaddr;
 	}
 
+	/*
+	 *	We track packets from this client by ID *and* Request
+	 *	Authenticator, so it can re-use IDs.  Tell it which
+	 *	request this is a reply to.
+	 */
+	if (client->dedup_authenticator) {
+		fr_pair_t *vp;
+
+		MEM(pair_update_reply(&vp, attr_original_request_authenticator) >= 0);
+		fr_pair_value_memdup(vp, request->packet->data + 4, RADIUS_AUTH_VECTOR_LENGTH, false);
+	}
+
 	common_ctx = (fr_radius_ctx_t) {
 		.secret = client->secret,
 		.secret_length = talloc_array_length(client->secret) - 1,
@@ -579,6 +617,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	FR_TIME_DELTA_BOUND_CHECK("nak_lifetime", inst->io.nak_lifetime, >=, fr_time_delta_from_sec(1));
 	FR_TIME_DELTA_BOUND_CHECK("nak_lifetime", inst->io.nak_lifetime, <=, fr_time_delta_from_sec(600));
 
+	if (fr_time_delta_ispos(inst->io.max_nak_lifetime)) {
+		FR_TIME_DELTA_BOUND_CHECK("max_nak_lifetime", inst->io.max_nak_lifetime, >=, inst->io.nak_lifetime);
+		FR_TIME_DELTA_BOUND_CHECK("max_nak_lifetime", inst->io.max_nak_lifetime, <=, fr_time_delta_from_sec(86400));
+	}
+
 	FR_TIME_DELTA_BOUND_CHECK("cleanup_delay", inst->io.cleanup_delay, <=, fr_time_delta_from_sec(30));
 	FR_TIME_DELTA_BOUND_CHECK("cleanup_delay", inst->io.cleanup_delay, >, fr_time_delta_from_sec(0));
 
@@ -610,6 +653,39 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 1024);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
 
+	if (inst->accounting_decode_only) {
+		size_t i;
+		fr_dict_attr_t const *always[] = { attr_proxy_state, attr_message_authenticator, attr_acct_status_type,
+						   attr_acct_delay_time, attr_event_timestamp };
+
+		/*
+		 *	The server needs these to process the packet, and
+		 *	to build the reply.
+		 */
+		for (i = 0; i < NUM_ELEMENTS(always); i++) {
+			inst->accounting_decode[always[i]->attr >> 3] |= 1 << (always[i]->attr & 0x07);
+		}
+
+		for (i = 0; i < talloc_array_length(inst->accounting_decode_only); i++) {
+			fr_dict_attr_t const *da;
+
+			da = fr_dict_attr_by_name(NULL, fr_dict_root(dict_radius), inst->accounting_decode_only[i]);
+			if (!da) {
+				cf_log_err(mctx->mi->conf, "Unknown attribute '%s' in 'accounting_decode_only'",
+					   inst->accounting_decode_only[i]);
+				return -1;
+			}
+
+			if (da->attr > UINT8_MAX) {
+				cf_log_err(mctx->mi->conf, "Cannot use internal attribute '%s' in 'accounting_decode_only'",
+					   da->name);
+				return -1;
+			}
+
+			inst->accounting_decode[da->attr >> 3] |= 1 << (da->attr & 0x07);
+		}
+	}
+
 	/*
 	 *	Tell the master handler about the main protocol instance.
 	 */
@@ -45,4 +45,9 @@ typedef struct {
 	fr_radius_require_ma_t		require_message_authenticator;			//!< Require Message-Authenticator in all requests.
 	fr_radius_limit_proxy_state_t	limit_proxy_state;		//!< Limit Proxy-State to packets containing
 									///< Message-Authenticator.
+
+	char const			**accounting_decode_only;	//!< Names of the attributes to decode
+									///< in Accounting-Request packets.
+	uint8_t				accounting_decode[UINT8_MAX / 8 + 1];	//!< Bitmap of attribute numbers
+									///< built from accounting_decode_only.
 } proto_radius_t;
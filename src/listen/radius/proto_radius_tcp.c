@@ -61,6 +61,7 @@ typedef struct {
 	bool				recv_buff_is_set;	//!< Whether we were provided with a recv_buff
 	bool				dynamic_clients;	//!< whether we have dynamic clients
 	bool				dedup_authenticator;	//!< dedup using the request authenticator
+	bool				worker_affinity;	//!< send all packets from a connection to one worker.
 
 	fr_client_list_t			*clients;		//!< local clients
 
@@ -90,6 +91,7 @@ static const conf_parser_t tcp_listen_config[] = {
 	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, 0, proto_radius_tcp_t, recv_buff) },
 
 	{ FR_CONF_OFFSET("dynamic_clients", proto_radius_tcp_t, dynamic_clients) } ,
+	{ FR_CONF_OFFSET("worker_affinity", proto_radius_tcp_t, worker_affinity), .dflt = "no" } ,
 	{ FR_CONF_OFFSET("accept_conflicting_packets", proto_radius_tcp_t, dedup_authenticator) } ,
 	{ FR_CONF_POINTER("networks", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) networks_config },
 
@@ -363,6 +365,7 @@ static int mod_open(fr_listen_t *li)
 	}
 
 	thread->sockfd = sockfd;
+	li->worker_affinity = inst->worker_affinity;
 
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
@@ -422,6 +425,18 @@ static int mod_track_compare(void const *instance, UNUSED void *thread_instance,
 	return (a[0] < b[0]) - (a[0] > b[0]);
 }
 
+/** Hash the fields compared by mod_track_compare()
+ *
+ *  The authenticator is only used to break ties, so it isn't included.
+ */
+static uint32_t mod_track_hash(UNUSED void const *instance, UNUSED void *thread_instance, UNUSED fr_client_t *client,
+			       void const *packet)
+{
+	uint8_t const *a = packet;
+
+	return ((uint32_t) a[0] << 8) | a[1];
+}
+
 
 static char const *mod_name(fr_listen_t *li)
 {
@@ -675,6 +690,7 @@ fr_app_io_t proto_radius_tcp = {
 	.write			= mod_write,
 	.fd_set			= mod_fd_set,
 	.track_compare		= mod_track_compare,
+	.track_hash		= mod_track_hash,
 	.connection_set		= mod_connection_set,
 	.network_get		= mod_network_get,
 	.client_find		= mod_client_find,
@@ -41,6 +41,9 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_recv_batch_t		*recv_batch;		//!< for reading multiple datagrams at once.
+	udp_send_batch_t		*send_batch;		//!< for writing multiple datagrams at once.
+
 	fr_stats_t			stats;			//!< statistics for this socket
 
 } proto_radius_udp_thread_t;
@@ -61,6 +64,8 @@ typedef struct {
 	uint32_t			send_buff;		//!< How big the kernel's send buffer should be.
 
 	uint32_t			max_packet_size;	//!< for message ring buffer.
+	uint32_t			recv_batch;		//!< How many datagrams to read at once.
+	uint32_t			send_batch;		//!< How many replies to write at once.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
 	uint16_t			port;			//!< Port to listen on.
@@ -106,6 +111,8 @@ static const conf_parser_t udp_listen_config[] = {
 	{ FR_CONF_POINTER("networks", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) networks_config },
 
 	{ FR_CONF_OFFSET("max_packet_size", proto_radius_udp_t, max_packet_size), .dflt = "4096" } ,
+	{ FR_CONF_OFFSET("recv_batch", proto_radius_udp_t, recv_batch), .dflt = "1" } ,
+	{ FR_CONF_OFFSET("send_batch", proto_radius_udp_t, send_batch), .dflt = "1" } ,
        	{ FR_CONF_OFFSET("max_attributes", proto_radius_udp_t, max_attributes), .dflt = STRINGIFY(RADIUS_MAX_ATTRIBUTES) } ,
 
 	CONF_PARSER_TERMINATOR
@@ -138,7 +145,7 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	data_size = udp_recv_batch(thread->recv_batch, thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
 	if (data_size < 0) {
 		PDEBUG2("proto_radius_udp got read error");
 		return data_size;
@@ -245,7 +252,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 			memcpy(&packet, &track->reply, sizeof(packet)); /* const issues */
 
-			return udp_send(&socket, flags, packet, track->reply_len);
+			return udp_send_batch(thread->send_batch, &socket, flags, packet, track->reply_len);
 		}
 
 		return buffer_len;
@@ -260,7 +267,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	 *	Only write replies if they're RADIUS packets.
 	 *	sometimes we want to NOT send a reply...
 	 */
-	data_size = udp_send(&socket, flags, buffer, buffer_len);
+	data_size = udp_send_batch(thread->send_batch, &socket, flags, buffer, buffer_len);
 
 	/*
 	 *	This socket is dead.  That's an error...
@@ -279,6 +286,16 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 }
 
 
+/** Write any replies which have been queued
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	return udp_send_batch_flush(thread->send_batch);
+}
+
 static int mod_connection_set(fr_listen_t *li, fr_io_address_t *connection)
 {
 	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
@@ -361,6 +378,31 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+	/*
+	 *	Read multiple datagrams with one system call.
+	 */
+	if (inst->recv_batch > 1) {
+		thread->recv_batch = udp_recv_batch_alloc(thread, inst->recv_batch, inst->max_packet_size);
+		if (!thread->recv_batch) {
+			ERROR("Failed allocating receive batch");
+			close(sockfd);
+			goto error;
+		}
+	}
+	li->recv_batch = inst->recv_batch;
+
+	/*
+	 *	Write multiple replies with one system call.
+	 */
+	if (inst->send_batch > 1) {
+		thread->send_batch = udp_send_batch_alloc(thread, inst->send_batch, inst->max_packet_size);
+		if (!thread->send_batch) {
+			ERROR("Failed allocating send batch");
+			close(sockfd);
+			goto error;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_radius_udp,
@@ -426,6 +468,18 @@ static int mod_track_compare(void const *instance, UNUSED void *thread_instance,
 }
 
 
+/** Hash the fields compared by mod_track_compare()
+ *
+ *  The authenticator is only used to break ties, so it isn't included.
+ */
+static uint32_t mod_track_hash(UNUSED void const *instance, UNUSED void *thread_instance, UNUSED fr_client_t *client,
+			       void const *packet)
+{
+	uint8_t const *a = packet;
+
+	return ((uint32_t) a[0] << 8) | a[1];
+}
+
 static char const *mod_name(fr_listen_t *li)
 {
 	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
@@ -465,6 +519,12 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 20);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, <=, 1024);
+
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, <=, 1024);
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -555,9 +615,11 @@ fr_app_io_t proto_radius_udp = {
 	.open			= mod_open,
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.fd_set			= mod_fd_set,
 	.track_create  		= mod_track_create,
 	.track_compare		= mod_track_compare,
+	.track_hash		= mod_track_hash,
 	.connection_set		= mod_connection_set,
 	.network_get		= mod_network_get,
 	.client_find		= mod_client_find,
@@ -26,6 +26,7 @@
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/master.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
 
 #include <freeradius-devel/tacacs/tacacs.h>
 
@@ -436,6 +437,21 @@ static int mod_priority_set(void const *instance, uint8_t const *buffer, UNUSED
 	return inst->priorities[buffer[1]];
 }
 
+/** Keep all of the packets in an authentication session on one worker
+ *
+ * Authentication can take multiple rounds, and the session state is
+ * then hot in that worker's cache.  Authorization and accounting are
+ * one round, so they go to whichever worker is least busy.
+ */
+static uint32_t mod_affinity_get(UNUSED void const *instance, uint8_t const *buffer, size_t buflen)
+{
+	fr_tacacs_packet_hdr_t const *hdr = (fr_tacacs_packet_hdr_t const *) buffer;
+
+	if ((buflen < sizeof(*hdr)) || (hdr->type != FR_TAC_PLUS_AUTHEN)) return 0;
+
+	return fr_hash(&hdr->session_id, sizeof(hdr->session_id)) | 0x01;
+}
+
 /** Open listen sockets/connect to external event source
  *
  * @param[in] instance	Ctx data for this application.
@@ -558,5 +574,6 @@ fr_app_t proto_tacacs = {
 	.open			= mod_open,
 	.decode			= mod_decode,
 	.encode			= mod_encode,
-	.priority		= mod_priority_set
+	.priority		= mod_priority_set,
+	.affinity		= mod_affinity_get
 };
@@ -62,6 +62,8 @@ typedef struct {
 
 	bool				recv_buff_is_set;	//!< Whether we were provided with a recv_buff
 	bool				dynamic_clients;	//!< whether we have dynamic clients
+	bool				single_connect;		//!< Offer single connection mode to all clients.
+	bool				worker_affinity;	//!< send all packets from a connection to one worker.
 
 	fr_client_list_t		*clients;		//!< local clients
 
@@ -89,6 +91,8 @@ static const conf_parser_t tcp_listen_config[] = {
 	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, 0, proto_tacacs_tcp_t, recv_buff) },
 
 	{ FR_CONF_OFFSET("dynamic_clients", proto_tacacs_tcp_t, dynamic_clients) } ,
+	{ FR_CONF_OFFSET("worker_affinity", proto_tacacs_tcp_t, worker_affinity), .dflt = "no" } ,
+	{ FR_CONF_OFFSET("single_connect", proto_tacacs_tcp_t, single_connect), .dflt = "no" } ,
 	{ FR_CONF_POINTER("networks", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) networks_config },
 
 	{ FR_CONF_OFFSET("max_packet_size", proto_tacacs_tcp_t, max_packet_size), .dflt = "4096" } ,
@@ -251,6 +255,7 @@ have_packet:
 static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, UNUSED fr_time_t request_time,
 			 uint8_t *buffer, size_t buffer_len, size_t written)
 {
+	proto_tacacs_tcp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_tacacs_tcp_t);
 	proto_tacacs_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_tacacs_tcp_thread_t);
 	ssize_t				data_size;
 
@@ -270,6 +275,14 @@ static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, UNUSED fr_tim
 	 */
 	if (written == 0) {
 		thread->stats.total_responses++;
+
+		/*
+		 *	Tell the client that it can send more sessions
+		 *	over this connection.  The header isn't
+		 *	encrypted, and the flags aren't part of the
+		 *	pseudo-pad, so we can just set the flag here.
+		 */
+		if (inst->single_connect) buffer[3] |= FR_TAC_PLUS_SINGLE_CONNECT_FLAG;
 	}
 
 	/*
@@ -365,6 +378,7 @@ static int mod_open(fr_listen_t *li)
 	}
 
 	thread->sockfd = sockfd;
+	li->worker_affinity = inst->worker_affinity;
 
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
@@ -0,0 +1,510 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_tftp.c
+ * @brief TFTP master protocol handler.
+ *
+ * The virtual server only sees the Read-Request (or Write-Request).  If
+ * it replies with Packet-Type = Data, the transport is handed a
+ * Read-Request for the file to send, and it runs the transfer itself.
+ * Any other reply is sent back to the client as an Error.
+ *
+ * @copyright 2024 The FreeRADIUS server project.
+ */
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/server/pair.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "proto_tftp.h"
+
+extern fr_app_t proto_tftp;
+static int type_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, conf_parser_t const *rule);
+static int transport_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, conf_parser_t const *rule);
+
+static const conf_parser_t priority_config[] = {
+	{ FR_CONF_OFFSET("Read-Request", proto_tftp_t, priorities[FR_PACKET_TYPE_VALUE_READ_REQUEST]),
+	   .func = cf_table_parse_int, .uctx = &(cf_table_parse_ctx_t){ .table = channel_packet_priority, .len = &channel_packet_priority_len }, .dflt = "normal" },
+	{ FR_CONF_OFFSET("Write-Request", proto_tftp_t, priorities[FR_PACKET_TYPE_VALUE_WRITE_REQUEST]),
+	   .func = cf_table_parse_int, .uctx = &(cf_table_parse_ctx_t){ .table = channel_packet_priority, .len = &channel_packet_priority_len }, .dflt = "low" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static conf_parser_t const limit_config[] = {
+	{ FR_CONF_OFFSET("idle_timeout", proto_tftp_t, io.idle_timeout), .dflt = "30.0" } ,
+	{ FR_CONF_OFFSET("nak_lifetime", proto_tftp_t, io.nak_lifetime), .dflt = "30.0" } ,
+
+	{ FR_CONF_OFFSET("max_connections", proto_tftp_t, io.max_connections), .dflt = "1024" } ,
+	{ FR_CONF_OFFSET("max_clients", proto_tftp_t, io.max_clients), .dflt = "256" } ,
+	{ FR_CONF_OFFSET("max_pending_packets", proto_tftp_t, io.max_pending_packets), .dflt = "256" } ,
+
+	/*
+	 *	For performance tweaking.  NOT for normal humans.
+	 */
+	{ FR_CONF_OFFSET("max_packet_size", proto_tftp_t, max_packet_size) } ,
+	{ FR_CONF_OFFSET("num_messages", proto_tftp_t, num_messages) } ,
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** How to parse a TFTP listen section
+ *
+ */
+static conf_parser_t const proto_tftp_config[] = {
+	{ FR_CONF_OFFSET_FLAGS("type", CONF_FLAG_NOT_EMPTY, proto_tftp_t, allowed_types), .func = type_parse },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("transport", FR_TYPE_VOID, 0, proto_tftp_t, io.submodule), .func = transport_parse },
+
+	{ FR_CONF_POINTER("limit", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) limit_config },
+	{ FR_CONF_POINTER("priority", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) priority_config },
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_tftp;
+
+extern fr_dict_autoload_t proto_tftp_dict[];
+fr_dict_autoload_t proto_tftp_dict[] = {
+	{ .out = &dict_tftp, .proto = "tftp" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_packet_type;
+static fr_dict_attr_t const *attr_tftp_block_size;
+static fr_dict_attr_t const *attr_tftp_error_code;
+static fr_dict_attr_t const *attr_tftp_filename;
+static fr_dict_attr_t const *attr_tftp_mode;
+static fr_dict_attr_t const *attr_tftp_opcode;
+static fr_dict_attr_t const *attr_tftp_timeout;
+static fr_dict_attr_t const *attr_tftp_transfer_size;
+static fr_dict_attr_t const *attr_tftp_window_size;
+
+extern fr_dict_attr_autoload_t proto_tftp_dict_attr[];
+fr_dict_attr_autoload_t proto_tftp_dict_attr[] = {
+	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_tftp},
+	{ .out = &attr_tftp_block_size, .name = "Block-Size", .type = FR_TYPE_UINT16, .dict = &dict_tftp},
+	{ .out = &attr_tftp_error_code, .name = "Error-Code", .type = FR_TYPE_UINT16, .dict = &dict_tftp},
+	{ .out = &attr_tftp_filename, .name = "Filename", .type = FR_TYPE_STRING, .dict = &dict_tftp},
+	{ .out = &attr_tftp_mode, .name = "Mode", .type = FR_TYPE_UINT8, .dict = &dict_tftp},
+	{ .out = &attr_tftp_opcode, .name = "Opcode", .type = FR_TYPE_UINT16, .dict = &dict_tftp},
+	{ .out = &attr_tftp_timeout, .name = "Timeout", .type = FR_TYPE_UINT8, .dict = &dict_tftp},
+	{ .out = &attr_tftp_transfer_size, .name = "Transfer-Size", .type = FR_TYPE_UINT64, .dict = &dict_tftp},
+	{ .out = &attr_tftp_window_size, .name = "Window-Size", .type = FR_TYPE_UINT16, .dict = &dict_tftp},
+	{ NULL }
+};
+
+/** Translates the packet-type into a submodule name
+ *
+ * @param[in] ctx	to allocate data in (instance of proto_tftp).
+ * @param[out] out	Where to write a module_instance_t containing the module handle and instance.
+ * @param[in] parent	Base structure address.
+ * @param[in] ci	#CONF_PAIR specifying the name of the type module.
+ * @param[in] rule	unused.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int type_parse(UNUSED TALLOC_CTX *ctx, void *out, void *parent,
+		      CONF_ITEM *ci, UNUSED conf_parser_t const *rule)
+{
+	proto_tftp_t		*inst = talloc_get_type_abort(parent, proto_tftp_t);
+	fr_dict_enum_value_t	*dv;
+	CONF_PAIR		*cp;
+	char const		*value;
+
+	cp = cf_item_to_pair(ci);
+	value = cf_pair_value(cp);
+
+	dv = fr_dict_enum_by_name(attr_packet_type, value, -1);
+	if (!dv ||
+	    ((dv->value->vb_uint32 != FR_PACKET_TYPE_VALUE_READ_REQUEST) &&
+	     (dv->value->vb_uint32 != FR_PACKET_TYPE_VALUE_WRITE_REQUEST))) {
+		cf_log_err(ci, "Unknown TFTP packet type '%s'", value);
+		return -1;
+	}
+
+	inst->allowed[dv->value->vb_uint32] = true;
+	*((char const **) out) = value;
+
+	return 0;
+}
+
+static int transport_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, conf_parser_t const *rule)
+{
+	proto_tftp_t		*inst = talloc_get_type_abort(parent, proto_tftp_t);
+	module_instance_t	*mi;
+
+	if (unlikely(virtual_sever_listen_transport_parse(ctx, out, parent, ci, rule) < 0)) {
+		return -1;
+	}
+
+	mi = talloc_get_type_abort(*(void **)out, module_instance_t);
+	inst->io.app_io = (fr_app_io_t const *)mi->exported;
+	inst->io.app_io_instance = mi->data;
+	inst->io.app_io_conf = mi->conf;
+
+	return 0;
+}
+
+/** Decode the packet
+ *
+ */
+static int mod_decode(UNUSED void const *instance, request_t *request, uint8_t *const data, size_t data_len)
+{
+	fr_io_track_t const *track = talloc_get_type_abort_const(request->async->packet_ctx, fr_io_track_t);
+	fr_io_address_t const *address = track->address;
+	fr_client_t const *client;
+	fr_packet_t *packet = request->packet;
+
+	RHEXDUMP3(data, data_len, "proto_tftp decode packet");
+
+	/*
+	 *	Set the request dictionary so that we can do
+	 *	generic->protocol attribute conversions as
+	 *	the request runs through the server.
+	 */
+	request->dict = dict_tftp;
+
+	client = address->radclient;
+
+	/*
+	 *	The opcodes for the packets we receive are the same
+	 *	as the Packet-Type values.
+	 */
+	request->packet->code = fr_nbo_to_uint16(data);
+	fr_assert(FR_TFTP_PACKET_CODE_VALID(request->packet->code));
+
+	request->packet->data = talloc_memdup(request->packet, data, data_len);
+	request->packet->data_len = data_len;
+
+	if (fr_tftp_decode(request->request_ctx, &request->request_pairs,
+			   packet->data, packet->data_len) < 0) {
+		RPEDEBUG("Failed decoding packet");
+		return -1;
+	}
+
+	/*
+	 *	Set the rest of the fields.
+	 */
+	request->client = UNCONST(fr_client_t *, client);
+
+	request->packet->socket = address->socket;
+	fr_socket_addr_swap(&request->reply->socket, &address->socket);
+
+	if (fr_packet_pairs_from_packet(request->request_ctx, &request->request_pairs, request->packet) < 0) {
+		RPEDEBUG("Failed decoding 'Net.*' packet");
+		return -1;
+	}
+
+	REQUEST_VERIFY(request);
+
+	return 0;
+}
+
+/** Add an attribute to the Read-Request which is handed to the transport
+ *
+ * The reply wins, so that policies can rewrite the filename, or reduce
+ * the options which the client asked for.  Options which the client
+ * didn't ask for can't be acknowledged, so they are never added.
+ */
+static void transfer_pair_add(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *request, fr_dict_attr_t const *da)
+{
+	fr_pair_t *vp, *copy;
+
+	vp = fr_pair_find_by_da(&request->request_pairs, NULL, da);
+	if (!vp) return;
+
+	if (da != attr_tftp_mode) {
+		fr_pair_t *reply;
+
+		reply = fr_pair_find_by_da(&request->reply_pairs, NULL, da);
+		if (reply) vp = reply;
+	}
+
+	MEM(copy = fr_pair_copy(ctx, vp));
+	fr_pair_append(out, copy);
+}
+
+static ssize_t mod_encode(UNUSED void const *instance, request_t *request, uint8_t *buffer, size_t buffer_len)
+{
+	fr_io_track_t *track = talloc_get_type_abort(request->async->packet_ctx, fr_io_track_t);
+	fr_io_address_t const *address = track->address;
+	ssize_t data_len;
+	fr_client_t const *client;
+	fr_pair_t *vp, *filename = NULL;
+
+	/*
+	 *	Process layer NAK, never respond, or "Do not respond".
+	 */
+	if ((buffer_len == 1) ||
+	    (request->reply->code == FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND) ||
+	    (request->reply->code >= FR_TFTP_MAX_CODE)) {
+		track->do_not_respond = true;
+		return 1;
+	}
+
+	client = address->radclient;
+	fr_assert(client);
+
+	/*
+	 *	Dynamic client stuff
+	 */
+	if (client->dynamic && !client->active) {
+		fr_client_t *new_client;
+
+		fr_assert(buffer_len >= sizeof(client));
+
+		/*
+		 *	Allocate the client.  If that fails, send back a NAK.
+		 */
+		new_client = client_afrom_request(NULL, request);
+		if (!new_client) {
+			PERROR("Failed creating new client");
+			buffer[0] = true;
+			return 1;
+		}
+
+		memcpy(buffer, &new_client, sizeof(new_client));
+		return sizeof(new_client);
+	}
+
+	/*
+	 *	Overwrite the src ip address on the outbound packet
+	 *	with the one specified by the client.  This is useful
+	 *	to work around broken DSR implementations and other
+	 *	routing issues.
+	 */
+	if (client->src_ipaddr.af != AF_UNSPEC) {
+		request->reply->socket.inet.src_ipaddr = client->src_ipaddr;
+	}
+
+	/*
+	 *	We only ever send files, and we have to know which
+	 *	one to send.
+	 */
+	if (request->reply->code == FR_PACKET_TYPE_VALUE_DATA) {
+		filename = fr_pair_find_by_da(&request->reply_pairs, NULL, attr_tftp_filename);
+		if (!filename) filename = fr_pair_find_by_da(&request->request_pairs, NULL, attr_tftp_filename);
+
+		if (request->packet->code != FR_PACKET_TYPE_VALUE_READ_REQUEST) {
+			REDEBUG("Cannot reply with Data to a %s", fr_tftp_codes[request->packet->code]);
+			request->reply->code = FR_PACKET_TYPE_VALUE_ERROR;
+
+		} else if (!filename) {
+			REDEBUG("No %s to send", attr_tftp_filename->name);
+			request->reply->code = FR_PACKET_TYPE_VALUE_ERROR;
+		}
+	}
+
+	if (request->reply->code == FR_PACKET_TYPE_VALUE_DATA) {
+		fr_pair_list_t	list;
+
+		fr_pair_list_init(&list);
+
+		MEM(vp = fr_pair_afrom_da(request->reply_ctx, attr_tftp_opcode));
+		vp->vp_uint16 = FR_OPCODE_VALUE_READ_REQUEST;
+		fr_pair_append(&list, vp);
+
+		MEM(vp = fr_pair_copy(request->reply_ctx, filename));
+		fr_pair_append(&list, vp);
+
+		transfer_pair_add(request->reply_ctx, &list, request, attr_tftp_mode);
+		transfer_pair_add(request->reply_ctx, &list, request, attr_tftp_block_size);
+		transfer_pair_add(request->reply_ctx, &list, request, attr_tftp_window_size);
+		transfer_pair_add(request->reply_ctx, &list, request, attr_tftp_timeout);
+		transfer_pair_add(request->reply_ctx, &list, request, attr_tftp_transfer_size);
+
+		data_len = fr_tftp_encode(&FR_DBUFF_TMP(buffer, buffer_len), &list);
+		fr_pair_list_free(&list);
+		if (data_len < 0) {
+			RPEDEBUG("Failed encoding TFTP transfer");
+			return -1;
+		}
+
+		RDEBUG2("Sending %pV", &filename->data);
+
+	} else {
+		/*
+		 *	Everything else is an error.  Tell the client
+		 *	why, if the policy didn't.
+		 */
+		MEM(pair_update_reply(&vp, attr_tftp_opcode) >= 0);
+		vp->vp_uint16 = FR_OPCODE_VALUE_ERROR;
+
+		if (pair_update_reply(&vp, attr_tftp_error_code) == 0) {
+			vp->vp_uint16 = FR_ERROR_CODE_VALUE_ACCESS_VIOLATION;
+		}
+
+		data_len = fr_tftp_encode(&FR_DBUFF_TMP(buffer, buffer_len), &request->reply_pairs);
+		if (data_len < 0) {
+			RPEDEBUG("Failed encoding TFTP reply");
+			return -1;
+		}
+	}
+
+	fr_packet_net_from_pairs(request->reply, &request->reply_pairs);
+
+	RHEXDUMP3(buffer, data_len, "proto_tftp encode packet");
+
+	return data_len;
+}
+
+static int mod_priority_set(void const *instance, uint8_t const *buffer, UNUSED size_t buflen)
+{
+	proto_tftp_t const *inst = talloc_get_type_abort_const(instance, proto_tftp_t);
+	uint16_t code;
+
+	code = fr_nbo_to_uint16(buffer);
+	fr_assert(FR_TFTP_PACKET_CODE_VALID(code));
+
+	/*
+	 *	Disallowed packet
+	 */
+	if (!inst->priorities[code]) return 0;
+
+	if (!inst->allowed[code]) return -1;
+
+	/*
+	 *	Return the configured priority.
+	 */
+	return inst->priorities[code];
+}
+
+/** Open listen sockets/connect to external event source
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] sc	to add our file descriptor to.
+ * @param[in] conf	Listen section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_open(void *instance, fr_schedule_t *sc, UNUSED CONF_SECTION *conf)
+{
+	proto_tftp_t 	*inst = talloc_get_type_abort(instance, proto_tftp_t);
+
+	inst->io.app = &proto_tftp;
+	inst->io.app_instance = instance;
+
+	return fr_master_io_listen(&inst->io, sc,
+				   inst->max_packet_size, inst->num_messages);
+}
+
+/** Instantiate the application
+ *
+ * Instantiate I/O and type submodules.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	proto_tftp_t		*inst = talloc_get_type_abort(mctx->mi->data, proto_tftp_t);
+	CONF_SECTION		*conf = mctx->mi->conf;
+
+	/*
+	 *	Ensure that the server CONF_SECTION is always set.
+	 */
+	inst->io.server_cs = cf_item_to_section(cf_parent(conf));
+
+	fr_assert(dict_tftp != NULL);
+	fr_assert(attr_packet_type != NULL);
+
+	/*
+	 *	No IO module, it's an empty listener.
+	 */
+	if (!inst->io.submodule) return 0;
+
+	/*
+	 *	These timers are usually protocol specific.
+	 */
+	FR_TIME_DELTA_BOUND_CHECK("idle_timeout", inst->io.idle_timeout, >=, fr_time_delta_from_sec(1));
+	FR_TIME_DELTA_BOUND_CHECK("idle_timeout", inst->io.idle_timeout, <=, fr_time_delta_from_sec(600));
+
+	FR_TIME_DELTA_BOUND_CHECK("nak_lifetime", inst->io.nak_lifetime, >=, fr_time_delta_from_sec(1));
+	FR_TIME_DELTA_BOUND_CHECK("nak_lifetime", inst->io.nak_lifetime, <=, fr_time_delta_from_sec(600));
+
+	/*
+	 *	Tell the master handler about the main protocol instance.
+	 */
+	inst->io.app = &proto_tftp;
+	inst->io.app_instance = inst;
+
+	/*
+	 *	We will need this for dynamic clients and connected sockets.
+	 */
+	inst->io.mi = mctx->mi;
+
+	/*
+	 *	These configuration items are not printed by default,
+	 *	because normal people shouldn't be touching them.
+	 */
+	if (!inst->max_packet_size && inst->io.app_io) inst->max_packet_size = inst->io.app_io->default_message_size;
+
+	if (!inst->num_messages) inst->num_messages = 256;
+
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, >=, 32);
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, <=, 65535);
+
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 1024);
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
+
+	/*
+	 *	Instantiate the transport module before calling the
+	 *	common instantiation function.
+	 */
+	if (module_instantiate(inst->io.submodule) < 0) return -1;
+
+	/*
+	 *	Instantiate the master io submodule
+	 */
+	return fr_master_app_io.common.instantiate(MODULE_INST_CTX(inst->io.mi));
+}
+
+static int mod_load(void)
+{
+	if (fr_tftp_global_init() < 0) {
+		PERROR("Failed initializing the TFTP dictionaries");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void mod_unload(void)
+{
+	fr_tftp_global_free();
+}
+
+fr_app_t proto_tftp = {
+	.common = {
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "tftp",
+		.config			= proto_tftp_config,
+		.inst_size		= sizeof(proto_tftp_t),
+
+		.onload			= mod_load,
+		.unload			= mod_unload,
+		.instantiate		= mod_instantiate
+	},
+	.dict			= &dict_tftp,
+	.open			= mod_open,
+	.decode			= mod_decode,
+	.encode			= mod_encode,
+	.priority		= mod_priority_set
+};
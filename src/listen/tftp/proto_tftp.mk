@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_tftp
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME)$(L)
+endif
+
+SOURCES		:= proto_tftp.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-tftp$(L) libfreeradius-io$(L)
@@ -0,0 +1,1311 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_tftp_udp.c
+ * @brief TFTP handler for UDP.
+ *
+ * Requests arrive on the listening socket, and go through the virtual
+ * server as usual.  When the virtual server accepts a Read-Request,
+ * the transfer runs here, in the network thread, from its own socket
+ * (the server's "TID").  Blocks are sent straight from a read-only
+ * mapping of the file, which is shared by every transfer of that file
+ * in every network thread, so a few boot images can be served to
+ * thousands of clients without touching the disk.
+ *
+ * @copyright 2024 The FreeRADIUS server project.
+ */
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <freeradius-devel/server/protocol.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/udp.h>
+#include <freeradius-devel/util/trie.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/schedule.h>
+
+#include "proto_tftp.h"
+
+extern fr_app_io_t proto_tftp_udp;
+
+/** A file which has been mapped into memory
+ *
+ * Shared by all of the network threads.  All fields other than the
+ * contents are protected by the cache mutex.
+ */
+typedef struct {
+	char const			*filename;		//!< Relative to the directory.  Key for the cache.
+
+	uint8_t const			*data;			//!< Contents of the file.  NULL if the file is empty.
+	size_t				len;			//!< Length of the file.
+
+	dev_t				dev;			//!< So we can tell if the file was replaced.
+	ino_t				ino;
+	time_t				mtime;
+
+	uint32_t			refs;			//!< Transfers which are sending this file.
+	bool				stale;			//!< The file changed on disk.  Unmap it once
+								///< the last transfer has finished.
+} proto_tftp_file_t;
+
+typedef struct {
+	pthread_mutex_t			mutex;
+	fr_hash_table_t			*files;			//!< proto_tftp_file_t, by filename.
+} proto_tftp_cache_t;
+
+typedef struct {
+	char const			*name;			//!< socket name
+
+	int				sockfd;
+
+	fr_io_address_t			*connection;		//!< for connected sockets.
+
+	udp_recv_batch_t		*recv_batch;		//!< for reading multiple datagrams at once.
+	udp_send_batch_t		*send_batch;		//!< for writing multiple datagrams at once.
+
+	fr_event_list_t			*el;			//!< for transfer sockets and timers.
+	uint32_t			transfers;		//!< currently running.
+
+	fr_stats_t			stats;			//!< statistics for this socket
+} proto_tftp_udp_thread_t;
+
+typedef struct {
+	CONF_SECTION			*cs;			//!< our configuration
+
+	fr_ipaddr_t			ipaddr;			//!< IP address to listen on.
+
+	char const			*interface;		//!< Interface to bind to.
+	char const			*port_name;		//!< Name of the port for getservent().
+
+	uint32_t			recv_buff;		//!< How big the kernel's receive buffer should be.
+
+	uint32_t			max_packet_size;	//!< for message ring buffer.
+	uint32_t			recv_batch;		//!< How many datagrams to read at once.
+	uint32_t			send_batch;		//!< How many replies to write at once.
+
+	uint16_t			port;			//!< Port to listen on.
+
+	bool				recv_buff_is_set;	//!< Whether we were provided with a receive
+								//!< buffer value.
+	bool				dynamic_clients;	//!< whether we have dynamic clients
+
+	char const			*directory;		//!< Files are served from here.
+	uint32_t			max_block_size;		//!< Largest "blksize" we agree to.
+	uint32_t			max_window_size;	//!< Largest "windowsize" we agree to.
+	fr_time_delta_t			timeout;		//!< Retransmit timeout, unless the client sets one.
+	uint32_t			max_retransmits;	//!< Before giving up on a client.
+	uint32_t			max_transfers;		//!< Per network thread.
+
+	proto_tftp_cache_t		*cache;			//!< Files which are being served.
+
+	fr_trie_t			*trie;			//!< for parsed networks
+	fr_ipaddr_t			*allow;			//!< allowed networks for dynamic clients
+	fr_ipaddr_t			*deny;			//!< denied networks for dynamic clients
+
+	fr_client_list_t		*clients;		//!< local clients
+} proto_tftp_udp_t;
+
+/** A Read-Request, as handed to us by proto_tftp
+ *
+ */
+typedef struct {
+	char const			*filename;
+	bool				octet;			//!< Only "octet" mode is supported.
+
+	uint32_t			block_size;		//!< 0 if the client didn't ask.
+	uint32_t			window_size;		//!< 0 if the client didn't ask.
+	uint32_t			timeout;		//!< 0 if the client didn't ask.
+	bool				tsize;			//!< Client asked for the file size.
+} proto_tftp_udp_rrq_t;
+
+typedef uint8_t proto_tftp_data_hdr_t[FR_TFTP_HDR_LEN];
+
+/** One file being sent to one client
+ *
+ */
+typedef struct {
+	proto_tftp_udp_t const		*inst;
+	proto_tftp_udp_thread_t		*thread;
+
+	char const			*name;			//!< For debug messages.
+	int				sockfd;			//!< Connected to the client.
+	fr_event_timer_t const		*ev;			//!< Retransmit timer.
+
+	proto_tftp_file_t		*file;
+
+	uint32_t			block_size;
+	uint32_t			window_size;
+	fr_time_delta_t			timeout;
+	uint32_t			retransmits;
+
+	uint64_t			num_blocks;		//!< Including the final short block.
+	uint64_t			acked;			//!< Blocks the client has acknowledged.
+	uint64_t			sent;			//!< Highest block we've sent.
+
+	uint8_t				*oack;			//!< Option-Acknowledgement.  Sent until
+								///< the client acknowledges block 0.
+	size_t				oack_len;
+
+	struct mmsghdr			*msgs;			//!< One window of DATA packets.
+	struct iovec			*iov;			//!< Header and contents for each block.
+	proto_tftp_data_hdr_t		*hdr;			//!< DATA headers for each block.
+} proto_tftp_transfer_t;
+
+static const conf_parser_t networks_config[] = {
+	{ FR_CONF_OFFSET_TYPE_FLAGS("allow", FR_TYPE_COMBO_IP_PREFIX , CONF_FLAG_MULTI, proto_tftp_udp_t, allow) },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("deny", FR_TYPE_COMBO_IP_PREFIX , CONF_FLAG_MULTI, proto_tftp_udp_t, deny) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+
+static const conf_parser_t udp_listen_config[] = {
+	{ FR_CONF_OFFSET_TYPE_FLAGS("ipaddr", FR_TYPE_COMBO_IP_ADDR, 0, proto_tftp_udp_t, ipaddr) },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("ipv4addr", FR_TYPE_IPV4_ADDR, 0, proto_tftp_udp_t, ipaddr) },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("ipv6addr", FR_TYPE_IPV6_ADDR, 0, proto_tftp_udp_t, ipaddr) },
+
+	{ FR_CONF_OFFSET("interface", proto_tftp_udp_t, interface) },
+	{ FR_CONF_OFFSET("port_name", proto_tftp_udp_t, port_name) },
+
+	{ FR_CONF_OFFSET("port", proto_tftp_udp_t, port) },
+	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, 0, proto_tftp_udp_t, recv_buff) },
+
+	{ FR_CONF_OFFSET("dynamic_clients", proto_tftp_udp_t, dynamic_clients) } ,
+	{ FR_CONF_POINTER("networks", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) networks_config },
+
+	{ FR_CONF_OFFSET_FLAGS("directory", CONF_FLAG_REQUIRED | CONF_FLAG_NOT_EMPTY, proto_tftp_udp_t, directory) },
+	{ FR_CONF_OFFSET("max_block_size", proto_tftp_udp_t, max_block_size), .dflt = "1468" } ,
+	{ FR_CONF_OFFSET("max_window_size", proto_tftp_udp_t, max_window_size), .dflt = "16" } ,
+	{ FR_CONF_OFFSET("timeout", proto_tftp_udp_t, timeout), .dflt = "1.0" } ,
+	{ FR_CONF_OFFSET("max_retransmits", proto_tftp_udp_t, max_retransmits), .dflt = "5" } ,
+	{ FR_CONF_OFFSET("max_transfers", proto_tftp_udp_t, max_transfers), .dflt = "2048" } ,
+
+	{ FR_CONF_OFFSET("max_packet_size", proto_tftp_udp_t, max_packet_size), .dflt = "1024" } ,
+	{ FR_CONF_OFFSET("recv_batch", proto_tftp_udp_t, recv_batch), .dflt = "1" } ,
+	{ FR_CONF_OFFSET("send_batch", proto_tftp_udp_t, send_batch), .dflt = "1" } ,
+
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t file_hash(void const *data)
+{
+	proto_tftp_file_t const *file = data;
+
+	return fr_hash_string(file->filename);
+}
+
+static int8_t file_cmp(void const *one, void const *two)
+{
+	proto_tftp_file_t const *a = one, *b = two;
+
+	return CMP(strcmp(a->filename, b->filename), 0);
+}
+
+static int _file_free(proto_tftp_file_t *file)
+{
+	if (file->data) (void) munmap(UNCONST(uint8_t *, file->data), file->len);
+
+	return 0;
+}
+
+static int _cache_free(proto_tftp_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Reject filenames which would escape the directory
+ *
+ */
+static bool filename_valid(char const *filename)
+{
+	char const *p = filename;
+
+	if (!*p) return false;
+
+	while (*p) {
+		char const *q;
+
+		q = strchr(p, '/');
+		if (!q) q = p + strlen(p);
+
+		if (((q - p) == 2) && (p[0] == '.') && (p[1] == '.')) return false;
+
+		p = q;
+		if (*p) p++;
+	}
+
+	return true;
+}
+
+/** Find a file in the cache, or map it into memory
+ *
+ * Files are checked against the disk each time they're requested, so
+ * that a new boot image is picked up without a restart.  Transfers
+ * which are in progress keep sending the old one.
+ *
+ * @param[out] error	TFTP error code if the file can't be sent.
+ * @param[in] inst	of the transport.
+ * @param[in] filename	to look up, relative to the directory.
+ * @return
+ *	- the file, with a reference held for the caller.
+ *	- NULL on error.
+ */
+static proto_tftp_file_t *file_cache_get(uint16_t *error, proto_tftp_udp_t const *inst, char const *filename)
+{
+	proto_tftp_cache_t	*cache = inst->cache;
+	proto_tftp_file_t	*file, find;
+	char			path[PATH_MAX];
+	struct stat		st;
+	int			fd;
+
+	/*
+	 *	PXE firmware often asks for "/pxelinux.0"
+	 */
+	while (*filename == '/') filename++;
+
+	if (!filename_valid(filename)) {
+		fr_strerror_printf("Invalid filename \"%s\"", filename);
+		*error = FR_ERROR_CODE_VALUE_ACCESS_VIOLATION;
+		return NULL;
+	}
+
+	if ((size_t) snprintf(path, sizeof(path), "%s/%s", inst->directory, filename) >= sizeof(path)) {
+		fr_strerror_printf("Filename \"%s\" is too long", filename);
+		*error = FR_ERROR_CODE_VALUE_FILE_NOT_FOUND;
+		return NULL;
+	}
+
+	if (stat(path, &st) < 0) {
+		fr_strerror_printf("Failed examining \"%s\": %s", path, fr_syserror(errno));
+		*error = (errno == EACCES) ? FR_ERROR_CODE_VALUE_ACCESS_VIOLATION : FR_ERROR_CODE_VALUE_FILE_NOT_FOUND;
+		return NULL;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		fr_strerror_printf("\"%s\" is not a regular file", path);
+		*error = FR_ERROR_CODE_VALUE_FILE_NOT_FOUND;
+		return NULL;
+	}
+
+	find.filename = filename;
+
+	pthread_mutex_lock(&cache->mutex);
+	file = fr_hash_table_find(cache->files, &find);
+	if (file) {
+		if ((file->dev == st.st_dev) && (file->ino == st.st_ino) &&
+		    (file->len == (size_t) st.st_size) && (file->mtime == st.st_mtime)) {
+			file->refs++;
+			pthread_mutex_unlock(&cache->mutex);
+			return file;
+		}
+
+		(void) fr_hash_table_remove(cache->files, file);
+		if (!file->refs) {
+			talloc_free(file);
+		} else {
+			file->stale = true;
+		}
+	}
+
+	/*
+	 *	We hold the lock while mapping the file, so that a
+	 *	storm of requests for a new file only maps it once.
+	 */
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening \"%s\": %s", path, fr_syserror(errno));
+	error:
+		*error = (errno == EACCES) ? FR_ERROR_CODE_VALUE_ACCESS_VIOLATION : FR_ERROR_CODE_VALUE_FILE_NOT_FOUND;
+		pthread_mutex_unlock(&cache->mutex);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fr_strerror_printf("Failed examining \"%s\": %s", path, fr_syserror(errno));
+		close(fd);
+		errno = 0;
+		goto error;
+	}
+
+	MEM(file = talloc_zero(cache, proto_tftp_file_t));
+	MEM(file->filename = talloc_strdup(file, filename));
+	file->len = st.st_size;
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	file->mtime = st.st_mtime;
+
+	if (file->len > 0) {
+		void *data;
+
+		data = mmap(NULL, file->len, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			fr_strerror_printf("Failed mapping \"%s\": %s", path, fr_syserror(errno));
+			close(fd);
+			talloc_free(file);
+			errno = 0;
+			goto error;
+		}
+#ifdef MADV_WILLNEED
+		(void) madvise(data, file->len, MADV_WILLNEED);
+#endif
+		file->data = data;
+	}
+	close(fd);
+	talloc_set_destructor(file, _file_free);
+
+	if (!fr_hash_table_insert(cache->files, file)) {
+		fr_strerror_printf("Failed caching \"%s\"", path);
+		talloc_free(file);
+		errno = 0;
+		goto error;
+	}
+	file->refs = 1;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return file;
+}
+
+static void file_cache_release(proto_tftp_udp_t const *inst, proto_tftp_file_t *file)
+{
+	proto_tftp_cache_t *cache = inst->cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	fr_assert(file->refs > 0);
+	file->refs--;
+	if (file->stale && !file->refs) talloc_free(file);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Parse the Read-Request which proto_tftp encoded for us
+ *
+ * proto_tftp has already decoded it once, so all we do here is pick
+ * out the values we need.
+ */
+static int rrq_parse(proto_tftp_udp_rrq_t *rrq, uint8_t const *buffer, size_t buffer_len)
+{
+	uint8_t const *p, *end, *q;
+
+	memset(rrq, 0, sizeof(*rrq));
+
+	if ((buffer_len < FR_TFTP_HDR_LEN) || (buffer[buffer_len - 1] != '\0')) return -1;
+
+	p = buffer + 2;
+	end = buffer + buffer_len;
+
+	rrq->filename = (char const *) p;
+	p += strlen(rrq->filename) + 1;
+	if (p >= end) return -1;
+
+	rrq->octet = (strcasecmp((char const *) p, "octet") == 0);
+	p += strlen((char const *) p) + 1;
+
+	while (p < end) {
+		char const	*name = (char const *) p;
+		unsigned long	value;
+
+		q = p + strlen(name) + 1;
+		if (q >= end) return -1;
+
+		value = strtoul((char const *) q, NULL, 10);
+		p = q + strlen((char const *) q) + 1;
+
+		if (strcasecmp(name, "blksize") == 0) {
+			rrq->block_size = value;
+
+		} else if (strcasecmp(name, "windowsize") == 0) {
+			rrq->window_size = value;
+
+		} else if (strcasecmp(name, "timeout") == 0) {
+			rrq->timeout = value;
+
+		} else if (strcasecmp(name, "tsize") == 0) {
+			rrq->tsize = true;
+		}
+	}
+
+	return 0;
+}
+
+/** Build an Error packet
+ *
+ */
+static size_t error_encode(uint8_t *buffer, size_t buffer_len, uint16_t error, char const *msg)
+{
+	size_t len;
+
+	if (!msg) msg = (error < FR_TFTP_MAX_ERROR_CODE) ? fr_tftp_error_codes[error] : NULL;
+	if (!msg) msg = "";
+
+	len = strlen(msg);
+	if (len > (buffer_len - 5)) len = buffer_len - 5;
+
+	fr_nbo_from_uint16(buffer, FR_OPCODE_VALUE_ERROR);
+	fr_nbo_from_uint16(buffer + 2, error);
+	memcpy(buffer + 4, msg, len);
+	buffer[4 + len] = '\0';
+
+	return len + 5;
+}
+
+/** Add an option to an Option-Acknowledgement
+ *
+ * The buffer always has room for all of the options we know about.
+ */
+static size_t oack_option(uint8_t *p, uint8_t const *end, char const *name, uint64_t value)
+{
+	int len;
+
+	len = snprintf((char *) p, end - p, "%s%c%" PRIu64, name, '\0', value);
+	fr_assert((len > 0) && (len < (end - p)));
+
+	return len + 1;
+}
+
+/** Send the current window of DATA packets
+ *
+ * The blocks are sent straight from the mapped file, with one system
+ * call for the whole window.
+ */
+static int transfer_send(proto_tftp_transfer_t *t)
+{
+	uint64_t	block, last;
+	unsigned int	i = 0;
+
+	if (t->oack) {
+		if (send(t->sockfd, t->oack, t->oack_len, 0) < 0) goto error;
+		return 0;
+	}
+
+	last = t->acked + t->window_size;
+	if (last > t->num_blocks) last = t->num_blocks;
+
+	for (block = t->acked + 1; block <= last; block++, i++) {
+		size_t offset, len;
+
+		offset = (block - 1) * t->block_size;
+		len = t->file->len - offset;
+		if (len > t->block_size) len = t->block_size;
+
+		fr_nbo_from_uint16(t->hdr[i], FR_OPCODE_VALUE_DATA);
+		fr_nbo_from_uint16(t->hdr[i] + 2, block & 0xffff);	/* block numbers wrap */
+
+		t->iov[i * 2].iov_base = t->hdr[i];
+		t->iov[i * 2].iov_len = sizeof(t->hdr[i]);
+		t->iov[(i * 2) + 1].iov_base = UNCONST(uint8_t *, t->file->data ? t->file->data + offset : NULL);
+		t->iov[(i * 2) + 1].iov_len = len;
+
+		t->msgs[i].msg_hdr = (struct msghdr) {
+			.msg_iov = &t->iov[i * 2],
+			.msg_iovlen = 2
+		};
+	}
+
+	/*
+	 *	Anything the kernel didn't take is sent again when
+	 *	the timer fires.
+	 */
+	if ((sendmmsg(t->sockfd, t->msgs, i, 0) < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+	error:
+		ERROR("%s - Failed sending to client: %s", t->name, fr_syserror(errno));
+		return -1;
+	}
+
+	t->sent = last;
+	return 0;
+}
+
+static void transfer_timeout(fr_event_list_t *el, fr_time_t now, void *uctx);
+
+static int transfer_timer_reset(proto_tftp_transfer_t *t)
+{
+	if (fr_event_timer_in(t, t->thread->el, &t->ev, t->timeout, transfer_timeout, t) < 0) {
+		PERROR("%s - Failed adding retransmit timer", t->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void transfer_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	proto_tftp_transfer_t *t = talloc_get_type_abort(uctx, proto_tftp_transfer_t);
+
+	if (++t->retransmits > t->inst->max_retransmits) {
+		DEBUG("%s - No response from client after %u retransmits, giving up", t->name, t->inst->max_retransmits);
+		talloc_free(t);
+		return;
+	}
+
+	DEBUG3("%s - Retransmitting from block %" PRIu64, t->name, t->acked + 1);
+
+	if ((transfer_send(t) < 0) || (transfer_timer_reset(t) < 0)) talloc_free(t);
+}
+
+static void transfer_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	proto_tftp_transfer_t	*t = talloc_get_type_abort(uctx, proto_tftp_transfer_t);
+	uint8_t			buffer[FR_TFTP_HDR_LEN + FR_TFTP_BASE_BLOCK_SIZE];
+	ssize_t			data_size;
+	uint16_t		block, delta;
+
+	data_size = recv(fd, buffer, sizeof(buffer), 0);
+	if (data_size < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+		DEBUG("%s - Failed reading from client: %s", t->name, fr_syserror(errno));
+		talloc_free(t);
+		return;
+	}
+
+	if (data_size < FR_TFTP_HDR_LEN) return;
+
+	switch (fr_nbo_to_uint16(buffer)) {
+	case FR_OPCODE_VALUE_ACKNOWLEDGEMENT:
+		break;
+
+	case FR_OPCODE_VALUE_ERROR:
+		DEBUG("%s - Client aborted the transfer with error %u", t->name, fr_nbo_to_uint16(buffer + 2));
+		talloc_free(t);
+		return;
+
+	default:
+		return;
+	}
+
+	block = fr_nbo_to_uint16(buffer + 2);
+
+	if (t->oack) {
+		if (block != 0) return;
+
+		TALLOC_FREE(t->oack);
+	} else {
+		/*
+		 *	The window is much smaller than the block number
+		 *	space, so the distance from the last ACK tells us
+		 *	which block this is, even after the numbers wrap.
+		 *
+		 *	Duplicate ACKs are ignored, so that we don't
+		 *	retransmit everything twice.
+		 */
+		delta = block - (uint16_t) (t->acked & 0xffff);
+		if (!delta || (delta > (t->sent - t->acked))) return;
+
+		t->acked += delta;
+	}
+
+	t->retransmits = 0;
+
+	if (t->acked == t->num_blocks) {
+		DEBUG2("%s - Sent %zu bytes in %" PRIu64 " blocks", t->name, t->file->len, t->num_blocks);
+		talloc_free(t);
+		return;
+	}
+
+	/*
+	 *	If the client only ACKed part of the window, then the
+	 *	rest was lost, and we carry on from the block after the
+	 *	one it ACKed.
+	 */
+	if ((transfer_send(t) < 0) || (transfer_timer_reset(t) < 0)) talloc_free(t);
+}
+
+static void transfer_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	proto_tftp_transfer_t *t = talloc_get_type_abort(uctx, proto_tftp_transfer_t);
+
+	DEBUG("%s - Socket error: %s", t->name, fr_syserror(fd_errno));
+	talloc_free(t);
+}
+
+static int _transfer_free(proto_tftp_transfer_t *t)
+{
+	if (t->sockfd >= 0) {
+		fr_event_fd_delete(t->thread->el, t->sockfd, FR_EVENT_FILTER_IO);
+		close(t->sockfd);
+	}
+
+	if (t->file) file_cache_release(t->inst, t->file);
+
+	t->thread->transfers--;
+
+	return 0;
+}
+
+/** Start sending a file to a client
+ *
+ * @param[out] msg	to send to the client, if the default message
+ *			for the error code isn't enough.
+ * @param[in] inst	of the transport.
+ * @param[in] thread	which runs the transfer.
+ * @param[in] socket	addresses of the Read-Request, swapped.
+ * @param[in] rrq	what the client asked for.
+ * @return
+ *	- 0 if the transfer started.
+ *	- TFTP error code, if it didn't.
+ */
+static int transfer_start(char const **msg, proto_tftp_udp_t const *inst, proto_tftp_udp_thread_t *thread,
+			  fr_socket_t const *socket, proto_tftp_udp_rrq_t const *rrq)
+{
+	proto_tftp_transfer_t	*t;
+	fr_ipaddr_t		src_ipaddr;
+	uint16_t		src_port = 0;
+	uint16_t		error;
+	uint8_t			oack[128], *p, *end;
+
+	fr_assert(thread->el != NULL);
+
+	if (!rrq->octet) {
+		*msg = "Only octet mode is supported";
+		fr_strerror_const(*msg);
+		return FR_ERROR_CODE_VALUE_ILLEGAL_OPERATION;
+	}
+
+	if (thread->transfers >= inst->max_transfers) {
+		*msg = "Server busy";
+		fr_strerror_printf("Too many transfers in progress (%u)", thread->transfers);
+		return FR_ERROR_CODE_VALUE_NOT_DEFINED;
+	}
+
+	MEM(t = talloc_zero(thread, proto_tftp_transfer_t));
+	t->inst = inst;
+	t->thread = thread;
+	t->sockfd = -1;
+	thread->transfers++;
+	talloc_set_destructor(t, _transfer_free);
+
+	t->file = file_cache_get(&error, inst, rrq->filename);
+	if (!t->file) {
+	error:
+		talloc_free(t);
+		return error;
+	}
+
+	/*
+	 *	Negotiate the options (RFC 2347).  We only acknowledge
+	 *	the options which the client sent.
+	 */
+	t->block_size = FR_TFTP_BASE_BLOCK_SIZE;
+	t->window_size = 1;
+	t->timeout = inst->timeout;
+
+	p = oack;
+	end = oack + sizeof(oack);
+	fr_nbo_from_uint16(p, FR_OPCODE_VALUE_OPTION_ACKNOWLEDGEMENT);
+	p += 2;
+
+	if (rrq->block_size >= FR_TFTP_BLOCK_MIN_SIZE) {
+		t->block_size = rrq->block_size;
+		if (t->block_size > inst->max_block_size) t->block_size = inst->max_block_size;
+		p += oack_option(p, end, "blksize", t->block_size);
+	}
+
+	if (rrq->timeout >= FR_TFTP_TIMEOUT_MIN) {
+		t->timeout = fr_time_delta_from_sec(rrq->timeout);
+		p += oack_option(p, end, "timeout", rrq->timeout);
+	}
+
+	if (rrq->tsize) p += oack_option(p, end, "tsize", t->file->len);
+
+	if (rrq->window_size >= FR_TFTP_WINDOW_MIN_SIZE) {
+		t->window_size = rrq->window_size;
+		if (t->window_size > inst->max_window_size) t->window_size = inst->max_window_size;
+		p += oack_option(p, end, "windowsize", t->window_size);
+	}
+
+	if (p > (oack + 2)) {
+		t->oack_len = p - oack;
+		MEM(t->oack = talloc_memdup(t, oack, t->oack_len));
+	}
+
+	/*
+	 *	The final block is always short, and may be empty.
+	 */
+	t->num_blocks = (t->file->len / t->block_size) + 1;
+
+	MEM(t->msgs = talloc_zero_array(t, struct mmsghdr, t->window_size));
+	MEM(t->iov = talloc_zero_array(t, struct iovec, t->window_size * 2));
+	MEM(t->hdr = talloc_zero_array(t, proto_tftp_data_hdr_t, t->window_size));
+
+	/*
+	 *	Send from the address the client sent the request to,
+	 *	but from a new port.
+	 */
+	src_ipaddr = socket->inet.src_ipaddr;
+	t->sockfd = fr_socket_client_udp(inst->interface, &src_ipaddr, &src_port,
+					 &socket->inet.dst_ipaddr, socket->inet.dst_port, true);
+	if (t->sockfd < 0) {
+		error = FR_ERROR_CODE_VALUE_NOT_DEFINED;
+		goto error;
+	}
+
+	MEM(t->name = talloc_typed_asprintf(t, "proto_tftp_udp - transfer of \"%s\" to %pV port %u",
+					    t->file->filename, fr_box_ipaddr(socket->inet.dst_ipaddr),
+					    socket->inet.dst_port));
+
+	if (fr_event_fd_insert(t, NULL, thread->el, t->sockfd, transfer_read, NULL, transfer_error, t) < 0) {
+		close(t->sockfd);
+		t->sockfd = -1;
+		error = FR_ERROR_CODE_VALUE_NOT_DEFINED;
+		goto error;
+	}
+
+	DEBUG2("%s - Starting, %zu bytes, block size %u, window size %u",
+	       t->name, t->file->len, t->block_size, t->window_size);
+
+	if ((transfer_send(t) < 0) || (transfer_timer_reset(t) < 0)) {
+		error = FR_ERROR_CODE_VALUE_NOT_DEFINED;
+		goto error;
+	}
+
+	return 0;
+}
+
+static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover)
+{
+	proto_tftp_udp_t const		*inst = talloc_get_type_abort_const(li->app_io_instance, proto_tftp_udp_t);
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+	fr_io_address_t			*address, **address_p;
+
+	int				flags;
+	ssize_t				data_size;
+	size_t				packet_len;
+	uint16_t			opcode;
+
+	*leftover = 0;		/* always for UDP */
+
+	/*
+	 *	Where the addresses should go.  This is a special case
+	 *	for proto_tftp.
+	 */
+	address_p = (fr_io_address_t **) packet_ctx;
+	address = *address_p;
+
+	/*
+	 *      Tell udp_recv if we're connected or not.
+	 */
+	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
+
+	data_size = udp_recv_batch(thread->recv_batch, thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	if (data_size < 0) {
+		PDEBUG2("proto_tftp_udp got read error %zd", data_size);
+		return data_size;
+	}
+
+	if (!data_size) {
+		DEBUG2("proto_tftp_udp got no data: ignoring");
+		return 0;
+	}
+
+	packet_len = data_size;
+
+	if (data_size < FR_TFTP_HDR_LEN) {
+		DEBUG2("proto_tftp_udp got 'too short' packet size %zd", data_size);
+		thread->stats.total_malformed_requests++;
+		return 0;
+	}
+
+	if (packet_len > inst->max_packet_size) {
+		DEBUG2("proto_tftp_udp got 'too long' packet size %zd > %u", data_size, inst->max_packet_size);
+		thread->stats.total_malformed_requests++;
+		return 0;
+	}
+
+	/*
+	 *	Only requests are sent to the listening socket.
+	 *	Everything else is sent to the socket for the
+	 *	transfer.
+	 */
+	opcode = fr_nbo_to_uint16(buffer);
+	if ((opcode != FR_OPCODE_VALUE_READ_REQUEST) && (opcode != FR_OPCODE_VALUE_WRITE_REQUEST)) {
+		DEBUG("proto_tftp_udp got invalid packet code %u", opcode);
+		thread->stats.total_unknown_types++;
+		return 0;
+	}
+
+	if (buffer[packet_len - 1] != '\0') {
+		DEBUG2("proto_tftp_udp got a malformed request");
+		thread->stats.total_malformed_requests++;
+		return 0;
+	}
+
+	/*
+	 *	proto_tftp sets the priority
+	 */
+
+	/*
+	 *	Print out what we received.
+	 */
+	DEBUG2("proto_tftp_udp - Received %s for \"%s\" length %d %s",
+	       fr_tftp_codes[opcode], (char const *) buffer + 2,
+	       (int) packet_len, thread->name);
+
+	return packet_len;
+}
+
+
+static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
+			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
+{
+	proto_tftp_udp_t const		*inst = talloc_get_type_abort_const(li->app_io_instance, proto_tftp_udp_t);
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+	fr_io_track_t			*track = talloc_get_type_abort(packet_ctx, fr_io_track_t);
+	fr_socket_t			socket;
+	proto_tftp_udp_rrq_t		rrq;
+	char const			*msg = NULL;
+
+	int				flags, error;
+	ssize_t				data_size;
+	uint8_t				packet[FR_TFTP_HDR_LEN + 128];
+
+	thread->stats.total_responses++;
+
+	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
+
+	fr_socket_addr_swap(&socket, &track->address->socket);
+
+	/*
+	 *	This handles the race condition where we get a DUP,
+	 *	but the original packet replies before we're run.
+	 *
+	 *	Errors are sent again.  A transfer which has started
+	 *	looks after its own retransmissions.
+	 */
+	if (track->reply_len) {
+		if ((track->reply_len >= FR_TFTP_HDR_LEN) &&
+		    (fr_nbo_to_uint16(track->reply) == FR_OPCODE_VALUE_ERROR)) {
+			char *reply;
+
+			memcpy(&reply, &track->reply, sizeof(reply)); /* const issues */
+
+			(void) udp_send_batch(thread->send_batch, &socket, flags, reply, track->reply_len);
+		}
+
+		return buffer_len;
+	}
+
+	fr_assert(buffer_len >= FR_TFTP_HDR_LEN);
+
+	/*
+	 *	The virtual server said no.
+	 */
+	if (fr_nbo_to_uint16(buffer) != FR_OPCODE_VALUE_READ_REQUEST) {
+		data_size = udp_send_batch(thread->send_batch, &socket, flags, buffer, buffer_len);
+
+		/*
+		 *	This socket is dead.  That's an error...
+		 */
+		if (data_size <= 0) return data_size;
+
+		return data_size;
+	}
+
+	if (rrq_parse(&rrq, buffer, buffer_len) < 0) {
+		ERROR("proto_tftp_udp - Invalid transfer request");
+		return buffer_len;
+	}
+
+	/*
+	 *	The virtual server said yes, but we couldn't send the
+	 *	file.  Tell the client why.
+	 */
+	error = transfer_start(&msg, inst, thread, &socket, &rrq);
+	if (error) {
+		PERROR("proto_tftp_udp - Failed sending \"%s\"", rrq.filename);
+
+		(void) udp_send_batch(thread->send_batch, &socket, flags, packet,
+				      error_encode(packet, sizeof(packet), error, msg));
+	}
+
+	return buffer_len;
+}
+
+
+/** Write any replies which have been queued
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_tftp_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+
+	return udp_send_batch_flush(thread->send_batch);
+}
+
+static int mod_connection_set(fr_listen_t *li, fr_io_address_t *connection)
+{
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+
+	thread->connection = connection;
+	return 0;
+}
+
+
+static void mod_network_get(int *ipproto, bool *dynamic_clients, fr_trie_t const **trie, void *instance)
+{
+	proto_tftp_udp_t *inst = talloc_get_type_abort(instance, proto_tftp_udp_t);
+
+	*ipproto = IPPROTO_UDP;
+	*dynamic_clients = inst->dynamic_clients;
+	*trie = inst->trie;
+}
+
+/** Transfers run in the same event loop as the listening socket
+ *
+ */
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, UNUSED void *nr)
+{
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+
+	thread->el = el;
+}
+
+
+/** Open a UDP listener for TFTP
+ *
+ */
+static int mod_open(fr_listen_t *li)
+{
+	proto_tftp_udp_t const		*inst = talloc_get_type_abort_const(li->app_io_instance, proto_tftp_udp_t);
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+
+	int				sockfd;
+	fr_ipaddr_t			ipaddr = inst->ipaddr;
+	uint16_t			port = inst->port;
+
+	li->fd = sockfd = fr_socket_server_udp(&inst->ipaddr, &port, inst->port_name, true);
+	if (sockfd < 0) {
+		PERROR("Failed opening UDP socket");
+	error:
+		return -1;
+	}
+
+	li->app_io_addr = fr_socket_addr_alloc_inet_src(li, IPPROTO_UDP, 0, &inst->ipaddr, port);
+
+	/*
+	 *	Set SO_REUSEPORT before bind, so that all packets can
+	 *	listen on the same destination IP address.
+	 */
+	{
+		int on = 1;
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			ERROR("Failed to set socket 'reuseport': %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+#ifdef SO_RCVBUF
+	if (inst->recv_buff_is_set) {
+		int opt;
+
+		opt = inst->recv_buff;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(int)) < 0) {
+			WARN("Failed setting 'SO_RCVBUF': %s", fr_syserror(errno));
+		}
+	}
+#endif
+
+	if (fr_socket_bind(sockfd, inst->interface, &ipaddr, &port) < 0) {
+		close(sockfd);
+		PERROR("Failed binding socket");
+		goto error;
+	}
+
+	thread->sockfd = sockfd;
+
+	/*
+	 *	Read multiple datagrams with one system call.
+	 */
+	if (inst->recv_batch > 1) {
+		thread->recv_batch = udp_recv_batch_alloc(thread, inst->recv_batch, inst->max_packet_size);
+		if (!thread->recv_batch) {
+			ERROR("Failed allocating receive batch");
+			close(sockfd);
+			goto error;
+		}
+	}
+	li->recv_batch = inst->recv_batch;
+
+	/*
+	 *	Write multiple replies with one system call.
+	 */
+	if (inst->send_batch > 1) {
+		thread->send_batch = udp_send_batch_alloc(thread, inst->send_batch, inst->max_packet_size);
+		if (!thread->send_batch) {
+			ERROR("Failed allocating send batch");
+			close(sockfd);
+			goto error;
+		}
+	}
+
+	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
+
+	thread->name = fr_app_io_socket_name(thread, &proto_tftp_udp,
+					     NULL, 0,
+					     &inst->ipaddr, inst->port,
+					     inst->interface);
+	return 0;
+}
+
+
+/** Set the file descriptor for this socket.
+ *
+ */
+static int mod_fd_set(fr_listen_t *li, int fd)
+{
+	proto_tftp_udp_t const		*inst = talloc_get_type_abort_const(li->app_io_instance, proto_tftp_udp_t);
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+
+	thread->sockfd = fd;
+
+	thread->name = fr_app_io_socket_name(thread, &proto_tftp_udp,
+					     &thread->connection->socket.inet.src_ipaddr, thread->connection->socket.inet.src_port,
+					     &inst->ipaddr, inst->port,
+					     inst->interface);
+
+	return 0;
+}
+
+static void *mod_track_create(UNUSED void const *instance, UNUSED void *thread_instance, UNUSED fr_client_t *client,
+			      fr_io_track_t *track, uint8_t const *buffer, size_t buffer_len)
+{
+	proto_tftp_track_t  *t;
+
+	if (buffer_len < FR_TFTP_HDR_LEN) {
+		ERROR("TFTP packet is too small. (%zu < %d)", buffer_len, FR_TFTP_HDR_LEN);
+		return NULL;
+	}
+
+	t = talloc_zero(track, proto_tftp_track_t);
+
+	if (!t) return NULL;
+
+	talloc_set_name_const(t, "proto_tftp_track_t");
+
+	/*
+	 *	mod_read() checked that the packet ends with a NUL.
+	 */
+	t->opcode = fr_nbo_to_uint16(buffer);
+	t->filename_hash = fr_hash_string((char const *) buffer + 2);
+
+	return t;
+}
+
+static int mod_track_compare(UNUSED void const *instance, UNUSED void *thread_instance, UNUSED fr_client_t *client,
+			     void const *one, void const *two)
+{
+	proto_tftp_track_t const *a = talloc_get_type_abort_const(one, proto_tftp_track_t);
+	proto_tftp_track_t const *b = talloc_get_type_abort_const(two, proto_tftp_track_t);
+	int ret;
+
+	/*
+	 *	The client's port is its transfer ID, so the master
+	 *	has already matched that.  A new request from the same
+	 *	port is for a different file, or is a different type.
+	 */
+	ret = (a->filename_hash < b->filename_hash) - (a->filename_hash > b->filename_hash);
+	if (ret != 0) return ret;
+
+	return (a->opcode < b->opcode) - (a->opcode > b->opcode);
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	proto_tftp_udp_t	*inst = talloc_get_type_abort(mctx->mi->data, proto_tftp_udp_t);
+
+	TALLOC_FREE(inst->cache);
+
+	return 0;
+}
+
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	proto_tftp_udp_t	*inst = talloc_get_type_abort(mctx->mi->data, proto_tftp_udp_t);
+	CONF_SECTION		*conf = mctx->mi->conf;
+	size_t			num;
+	CONF_ITEM		*ci;
+	CONF_SECTION		*server_cs;
+	struct stat		st;
+
+	inst->cs = conf;
+
+	/*
+	 *	Complain if no "ipaddr" is set.
+	 */
+	if (inst->ipaddr.af == AF_UNSPEC) {
+		cf_log_err(conf, "No 'ipaddr' was specified in the 'udp' section");
+		return -1;
+	}
+
+	if (inst->recv_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, >=, 32);
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, <=, INT_MAX);
+	}
+
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 32);
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
+
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, <=, 1024);
+
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, <=, 1024);
+
+	FR_INTEGER_BOUND_CHECK("max_block_size", inst->max_block_size, >=, FR_TFTP_BASE_BLOCK_SIZE);
+	FR_INTEGER_BOUND_CHECK("max_block_size", inst->max_block_size, <=, FR_TFTP_BLOCK_MAX_SIZE);
+
+	FR_INTEGER_BOUND_CHECK("max_window_size", inst->max_window_size, >=, FR_TFTP_WINDOW_MIN_SIZE);
+	FR_INTEGER_BOUND_CHECK("max_window_size", inst->max_window_size, <=, 256);
+
+	FR_TIME_DELTA_BOUND_CHECK("timeout", inst->timeout, >=, fr_time_delta_from_msec(100));
+	FR_TIME_DELTA_BOUND_CHECK("timeout", inst->timeout, <=, fr_time_delta_from_sec(FR_TFTP_TIMEOUT_MAX));
+
+	FR_INTEGER_BOUND_CHECK("max_retransmits", inst->max_retransmits, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_retransmits", inst->max_retransmits, <=, 100);
+
+	FR_INTEGER_BOUND_CHECK("max_transfers", inst->max_transfers, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_transfers", inst->max_transfers, <=, 65536);
+
+	if (stat(inst->directory, &st) < 0) {
+		cf_log_err(conf, "Invalid 'directory = %s': %s", inst->directory, fr_syserror(errno));
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		cf_log_err(conf, "Invalid 'directory = %s': Not a directory", inst->directory);
+		return -1;
+	}
+
+	if (!inst->port) {
+		struct servent *s;
+
+		if (!inst->port_name) {
+			cf_log_err(conf, "No 'port' was specified in the 'udp' section");
+			return -1;
+		}
+
+		s = getservbyname(inst->port_name, "udp");
+		if (!s) {
+			cf_log_err(conf, "Unknown value for 'port_name = %s", inst->port_name);
+			return -1;
+		}
+
+		inst->port = ntohl(s->s_port);
+	}
+
+	/*
+	 *	Parse and create the trie for dynamic clients, even if
+	 *	there's no dynamic clients.
+	 */
+	num = talloc_array_length(inst->allow);
+	if (!num) {
+		if (inst->dynamic_clients) {
+			cf_log_err(conf, "The 'allow' subsection MUST contain at least one 'network' entry when 'dynamic_clients = true'.");
+			return -1;
+		}
+	} else {
+		inst->trie = fr_master_io_network(inst, inst->ipaddr.af, inst->allow, inst->deny);
+		if (!inst->trie) {
+			cf_log_perr(conf, "Failed creating list of networks");
+			return -1;
+		}
+	}
+
+	ci = cf_section_to_item(mctx->mi->parent->conf); /* listen { ... } */
+	fr_assert(ci != NULL);
+	ci = cf_parent(ci);
+	fr_assert(ci != NULL);
+
+	server_cs = cf_item_to_section(ci);
+
+	/*
+	 *	Look up local clients, if they exist.
+	 */
+	if (cf_section_find_next(server_cs, NULL, "client", CF_IDENT_ANY)) {
+		inst->clients = client_list_parse_section(server_cs, IPPROTO_UDP, false);
+		if (!inst->clients) {
+			cf_log_err(conf, "Failed creating local clients");
+			return -1;
+		}
+	}
+
+	/*
+	 *	Allocated outside of inst, as the network threads
+	 *	update it after the instance data is protected.
+	 */
+	MEM(inst->cache = talloc_zero(NULL, proto_tftp_cache_t));
+	pthread_mutex_init(&inst->cache->mutex, NULL);
+	talloc_set_destructor(inst->cache, _cache_free);
+	MEM(inst->cache->files = fr_hash_table_alloc(inst->cache, file_hash, file_cmp, NULL));
+
+	return 0;
+}
+
+static fr_client_t *mod_client_find(fr_listen_t *li, fr_ipaddr_t const *ipaddr, int ipproto)
+{
+	proto_tftp_udp_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_tftp_udp_t);
+	fr_client_t		*client;
+
+	/*
+	 *	Prefer local clients.
+	 */
+	if (inst->clients) {
+		client = client_find(inst->clients, ipaddr, ipproto);
+		if (client) return client;
+	}
+
+	return client_find(NULL, ipaddr, ipproto);
+}
+
+static char const *mod_name(fr_listen_t *li)
+{
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+
+	return thread->name;
+}
+
+fr_app_io_t proto_tftp_udp = {
+	.common = {
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "tftp_udp",
+		.config			= udp_listen_config,
+		.inst_size		= sizeof(proto_tftp_udp_t),
+		.thread_inst_size	= sizeof(proto_tftp_udp_thread_t),
+		.instantiate		= mod_instantiate,
+		.detach			= mod_detach,
+	},
+	.default_message_size	= 4096,
+	.track_duplicates	= true,
+
+	.open			= mod_open,
+	.read			= mod_read,
+	.write			= mod_write,
+	.flush			= mod_flush,
+	.fd_set			= mod_fd_set,
+	.track_create  		= mod_track_create,
+	.track_compare		= mod_track_compare,
+	.connection_set		= mod_connection_set,
+	.network_get		= mod_network_get,
+	.event_list_set		= mod_event_list_set,
+	.client_find		= mod_client_find,
+	.get_name		= mod_name,
+};
@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_tftp_udp
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME)$(L)
+endif
+
+SOURCES		:= proto_tftp_udp.c
+
+TGT_PREREQS	:= libfreeradius-tftp$(L)
@@ -28,6 +28,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/users_file.h>
 
@@ -44,13 +45,42 @@ typedef struct {
 	char const	*filename;
 	tmpl_t		*key;
 	bool		relaxed;
-	PAIR_LIST_LIST	attrs;
+	fr_time_delta_t	reload_interval;	//!< How often to check the file for changes.
+	fr_reload_t	*reload;		//!< Holding the current attr_filter_list_t.
 } rlm_attr_filter_t;
 
+/** An entry from the "attrs" file, compiled for filtering
+ *
+ * The right hand side of every filter is a static value, so the
+ * comparison pairs are created once when the file is loaded, instead
+ * of for every request.
+ */
+typedef struct {
+	fr_dlist_t	entry;			//!< Entry in attr_filter_list_t.
+	char const	*name;			//!< Key for matching entry.
+	int		lineno;			//!< Line number entry read from.
+
+	fr_pair_list_t	set;			//!< ":=" items, added to the output as-is.
+
+	fr_pair_t	**check;		//!< Everything else, sorted by da, so
+						///< the rules for an attribute are adjacent.
+	size_t		num_check;		//!< Number of entries in check.
+	bool		vsa_any;		//!< "Vendor-Specific =* ANY" allows all VSAs.
+
+	bool		fall_through;		//!< Continue to the next matching entry.
+	bool		relax_set;		//!< Relax-Filter was given for this entry.
+	bool		relax;			//!< Value of Relax-Filter.
+} attr_filter_entry_t;
+
+typedef struct {
+	fr_dlist_head_t	head;			//!< of attr_filter_entry_t, in file order.
+} attr_filter_list_t;
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("filename", CONF_FLAG_FILE_INPUT | CONF_FLAG_REQUIRED, rlm_attr_filter_t, filename) },
 	{ FR_CONF_OFFSET("key", rlm_attr_filter_t, key), .dflt = "&Realm", .quote = T_BARE_WORD },
 	{ FR_CONF_OFFSET("relaxed", rlm_attr_filter_t, relaxed), .dflt = "no" },
+	{ FR_CONF_OFFSET("reload_interval", rlm_attr_filter_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -100,6 +130,126 @@ static void check_pair(request_t *request, fr_pair_t *check_item, fr_pair_t *rep
 	return;
 }
 
+static int8_t check_cmp(void const *one, void const *two)
+{
+	fr_pair_t const * const *a = one;
+	fr_pair_t const * const *b = two;
+
+	return CMP((uintptr_t) (*a)->da, (uintptr_t) (*b)->da);
+}
+
+/** Find the first rule for an attribute
+ *
+ */
+static size_t check_find(attr_filter_entry_t const *af, fr_dict_attr_t const *da)
+{
+	size_t lo = 0, hi = af->num_check;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if ((uintptr_t) af->check[mid]->da < (uintptr_t) da) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/** Turn one "attrs" file entry into an attr_filter_entry_t
+ *
+ */
+static attr_filter_entry_t *attr_filter_compile(TALLOC_CTX *ctx, module_inst_ctx_t const *mctx,
+						char const *filename, PAIR_LIST const *pl)
+{
+	attr_filter_entry_t	*af;
+	map_t			*map = NULL;
+	fr_pair_list_t		check;
+	fr_pair_t		*vp;
+	size_t			i;
+
+	MEM(af = talloc_zero(ctx, attr_filter_entry_t));
+	MEM(af->name = talloc_strdup(af, pl->name));
+	af->lineno = pl->lineno;
+	fr_pair_list_init(&af->set);
+	fr_pair_list_init(&check);
+
+	while ((map = map_list_next(&pl->reply, map))) {
+		fr_dict_attr_t const *da = tmpl_attr_tail_da(map->lhs);
+
+		MEM(vp = fr_pair_afrom_da(af, da));
+		vp->op = map->op;
+
+		if ((map->op != T_OP_CMP_TRUE) && (map->op != T_OP_CMP_FALSE)) {
+			fr_value_box_t const *box = tmpl_value(map->rhs);
+			int ret;
+
+			if (da->type == box->type) {
+				ret = fr_value_box_copy(vp, &vp->data, box);
+			} else {
+				ret = fr_value_box_cast(vp, &vp->data, da->type, da, box);
+			}
+
+			if (ret < 0) {
+				PERROR("%s[%d] Invalid value for filter %s", filename, pl->lineno, map->lhs->name);
+				talloc_free(af);
+				return NULL;
+			}
+		}
+
+		if (da == attr_fall_through) {
+			if (vp->vp_bool) {
+				af->fall_through = true;
+				talloc_free(vp);
+				continue;
+			}
+
+		} else if (da == attr_relax_filter) {
+			af->relax_set = true;
+			af->relax = vp->vp_bool;
+		}
+
+		if (map->op == T_OP_SET) {
+			fr_pair_append(&af->set, vp);
+			continue;
+		}
+
+		if ((da == attr_vendor_specific) && (map->op == T_OP_CMP_TRUE)) af->vsa_any = true;
+
+		fr_pair_append(&check, vp);
+	}
+
+	af->num_check = fr_pair_list_num_elements(&check);
+	if (af->num_check) {
+		MEM(af->check = talloc_array(af, fr_pair_t *, af->num_check));
+
+		i = 0;
+		while ((vp = fr_pair_list_head(&check))) {
+			fr_pair_remove(&check, vp);
+			af->check[i++] = vp;
+		}
+
+		/*
+		 *	Insertion sort, so that rules for the same
+		 *	attribute stay in file order.
+		 */
+		for (i = 1; i < af->num_check; i++) {
+			fr_pair_t	*tmp = af->check[i];
+			size_t		j = i;
+
+			while ((j > 0) && (check_cmp(&af->check[j - 1], &tmp) > 0)) {
+				af->check[j] = af->check[j - 1];
+				j--;
+			}
+			af->check[j] = tmp;
+		}
+	}
+
+	return af;
+}
+
 static int attr_filter_getfile(TALLOC_CTX *ctx, module_inst_ctx_t const *mctx, char const *filename, PAIR_LIST_LIST *pair_list)
 {
 	int rcode;
@@ -163,25 +313,85 @@ static int attr_filter_getfile(TALLOC_CTX *ctx, module_inst_ctx_t const *mctx, c
 	return 0;
 }
 
+/** Parse a version of the "attrs" file
+ *
+ * Called at startup, and from the reload thread when the file changes.
+ */
+static int attr_filter_load(void **out, TALLOC_CTX *ctx, char const *filename, void *uctx)
+{
+	module_inst_ctx_t const	*mctx = &(module_inst_ctx_t){ .mi = uctx };
+	PAIR_LIST_LIST		*attrs;
+	PAIR_LIST		*pl = NULL;
+	attr_filter_list_t	*list;
+
+	attrs = talloc_zero(NULL, PAIR_LIST_LIST);
+	if (!attrs) return -1;
+	pairlist_list_init(attrs);
+
+	if (attr_filter_getfile(attrs, mctx, filename, attrs) != 0) {
+	error:
+		talloc_free(attrs);
+		fr_strerror_printf("Errors reading %s", filename);
+		return -1;
+	}
+
+	list = talloc_zero(ctx, attr_filter_list_t);
+	if (!list) goto error;
+	fr_dlist_talloc_init(&list->head, attr_filter_entry_t, entry);
+
+	while ((pl = fr_dlist_next(&attrs->head, pl))) {
+		attr_filter_entry_t *af;
+
+		af = attr_filter_compile(list, mctx, filename, pl);
+		if (!af) {
+			talloc_free(list);
+			goto error;
+		}
+
+		fr_dlist_insert_tail(&list->head, af);
+	}
+
+	/*
+	 *	The compiled entries hold copies of everything we
+	 *	need, so the parsed file can go.
+	 */
+	talloc_free(attrs);
+
+	*out = list;
+	return 0;
+}
+
 /*
- *	(Re-)read the "attrs" file into memory.
+ *	Read the "attrs" file into memory.
  */
 static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	rlm_attr_filter_t *inst = talloc_get_type_abort(mctx->mi->data, rlm_attr_filter_t);
-	int rcode;
-	pairlist_list_init(&inst->attrs);
-
-	rcode = attr_filter_getfile(inst, mctx, inst->filename, &inst->attrs);
-	if (rcode != 0) {
-		ERROR("Errors reading %s", inst->filename);
 
+	/*
+	 *	The reload structure isn't part of the instance data,
+	 *	as the reload thread writes to it after the instance
+	 *	data has been made read only.
+	 */
+	inst->reload = fr_reload_alloc(NULL, mctx->mi->name, inst->filename,
+				       attr_filter_load, mctx->mi, inst->reload_interval);
+	if (!inst->reload) {
+		PERROR("Failed reading %s", inst->filename);
 		return -1;
 	}
 
 	return 0;
 }
 
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_attr_filter_t *inst = talloc_get_type_abort(mctx->mi->data, rlm_attr_filter_t);
+
+	talloc_free(inst->reload);
+
+	return 0;
+}
+
 
 /*
  *	Common attr_filter checks
@@ -191,8 +401,9 @@ static unlang_action_t CC_HINT(nonnull) attr_filter_common(TALLOC_CTX *ctx, rlm_
 							   fr_pair_list_t *list)
 {
 	rlm_attr_filter_t const *inst = talloc_get_type_abort_const(mctx->mi->data, rlm_attr_filter_t);
+	attr_filter_list_t const *attrs = fr_reload_data(inst->reload);
 	fr_pair_list_t	output;
-	PAIR_LIST	*pl = NULL;
+	attr_filter_entry_t const *af = NULL;
 	int		found = 0;
 	int		pass, fail = 0;
 	char const	*keyname = NULL;
@@ -216,74 +427,39 @@ static unlang_action_t CC_HINT(nonnull) attr_filter_common(TALLOC_CTX *ctx, rlm_
 	/*
 	 *      Find the attr_filter profile entry for the entry.
 	 */
-	while ((pl = fr_dlist_next(&inst->attrs.head, pl))) {
-		int fall_through = 0;
-		int relax_filter = inst->relaxed;
-		map_t *map = NULL;
-		fr_pair_list_t tmp_list;
-		fr_pair_t *check_item, *input_item;
-		fr_pair_list_t check_list;
-
-		fr_pair_list_init(&tmp_list);
+	while ((af = fr_dlist_next(&attrs->head, af))) {
+		bool		relax_filter = af->relax_set ? af->relax : inst->relaxed;
+		fr_pair_t	*input_item, *vp;
+		size_t		i;
+
 		/*
 		 *  If the current entry is NOT a default,
 		 *  AND the realm does NOT match the current entry,
 		 *  then skip to the next entry.
 		 */
-		if ((strcmp(pl->name, "DEFAULT") != 0) &&
-		    (strcmp(keyname, pl->name) != 0))  {
+		if ((strcmp(af->name, "DEFAULT") != 0) &&
+		    (strcmp(keyname, af->name) != 0))  {
 			continue;
 		}
 
-		RDEBUG2("Matched entry %s at line %d", pl->name, pl->lineno);
+		RDEBUG2("Matched entry %s at line %d", af->name, af->lineno);
 		found = 1;
 
-		fr_pair_list_init(&check_list);
-
-		while ((map = map_list_next(&pl->reply, map))) {
-			if (map_to_vp(ctx, &tmp_list, request, map, NULL) < 0) {
-				RPWARN("Failed parsing map %s for check item, skipping it", map->lhs->name);
-				continue;
-			}
-
-			check_item = fr_pair_list_head(&tmp_list);
-		     	if (check_item->da == attr_fall_through) {
-				if (check_item->vp_uint32 == 1) {
-					fall_through = 1;
-					fr_pair_list_free(&tmp_list);
-					continue;
-				}
-		     	} else if (check_item->da == attr_relax_filter) {
-				relax_filter = check_item->vp_bool;
-		     	}
-
-			/*
-			 *	Remove pair from temporary list ready to
-			 *	add to the correct destination
-			 */
-			fr_pair_remove(&tmp_list, check_item);
-
-			/*
-			 *    If it is a SET operator, add the attribute to
-			 *    the output list without checking it.
-			 */
-			if (check_item->op == T_OP_SET ) {
-				fr_pair_append(&output, check_item);
-				continue;
-			}
-
-			/*
-			 *	Append the realized VP to the check list.
-			 */
-			fr_pair_append(&check_list, check_item);
+		/*
+		 *    SET operators add the attribute to the output
+		 *    list without checking it.
+		 */
+		fr_pair_list_foreach(&af->set, set_item) {
+			MEM(vp = fr_pair_copy(ctx, set_item));
+			fr_pair_append(&output, vp);
 		}
 
 		/*
 		 *	Iterate through the input items, comparing
-		 *	each item to every rule, then moving it to the
-		 *	output list only if it matches all rules
-		 *	for that attribute.  IE, Idle-Timeout is moved
-		 *	only if it matches all rules that describe an
+		 *	each item to the rules for its attribute, then
+		 *	moving it to the output list only if it matches
+		 *	all of them.  IE, Idle-Timeout is moved only if
+		 *	it matches all rules that describe an
 		 *	Idle-Timeout.
 		 */
 		for (input_item = fr_pair_list_head(list);
@@ -292,25 +468,15 @@ static unlang_action_t CC_HINT(nonnull) attr_filter_common(TALLOC_CTX *ctx, rlm_
 			pass = fail = 0; /* reset the pass,fail vars for each reply item */
 
 			/*
-			 *  Reset the check_item pointer to beginning of the list
+			 *  Vendor-Specific is special, and matches any VSA if the
+			 *  comparison is always true.
 			 */
-			for (check_item = fr_pair_list_head(&check_list);
-			     check_item;
-			     check_item = fr_pair_list_next(&check_list, check_item)) {
-				/*
-				 *  Vendor-Specific is special, and matches any VSA if the
-				 *  comparison is always true.
-				 */
-				if ((check_item->da == attr_vendor_specific) &&
-				    (fr_dict_vendor_num_by_da(input_item->da) != 0) &&
-				    (check_item->op == T_OP_CMP_TRUE)) {
-					pass++;
-					continue;
-				}
+			if (af->vsa_any && (fr_dict_vendor_num_by_da(input_item->da) != 0)) pass++;
 
-				if (input_item->da == check_item->da) {
-					check_pair(request, check_item, input_item, &pass, &fail);
-				}
+			for (i = check_find(af, input_item->da);
+			     (i < af->num_check) && (af->check[i]->da == input_item->da);
+			     i++) {
+				check_pair(request, af->check[i], input_item, &pass, &fail);
 			}
 
 			RDEBUG3("Attribute \"%s\" allowed by %i rules, disallowed by %i rules",
@@ -333,7 +499,7 @@ static unlang_action_t CC_HINT(nonnull) attr_filter_common(TALLOC_CTX *ctx, rlm_
 		}
 
 		/* If we shouldn't fall through, break */
-		if (!fall_through) {
+		if (!af->fall_through) {
 			break;
 		}
 	}
@@ -374,6 +540,7 @@ module_rlm_t rlm_attr_filter = {
 		.inst_size	= sizeof(rlm_attr_filter_t),
 		.config		= module_config,
 		.instantiate	= mod_instantiate,
+		.detach		= mod_detach,
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
@@ -0,0 +1,6 @@
+TARGETNAME	:= rlm_auth_cache
+
+TARGET		:= $(TARGETNAME)$(L)
+SOURCES		:= $(TARGETNAME).c
+
+LOG_ID_LIB	= 63
@@ -0,0 +1,366 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_auth_cache.c
+ * @brief Remember recently verified credentials.
+ *
+ * When a user is accepted, an HMAC of their identity and the credentials
+ * they presented is stored for a short time.  If the same identity presents
+ * the same credentials again, the request can be accepted without fetching
+ * the "known good" password from the backend, or hashing it again.
+ *
+ * Neither the identity, nor the credentials are stored.  Entries are
+ * keyed by HMAC-SHA1 with a random secret generated at startup, so
+ * lookups only ever compare digests an attacker doesn't know, and can't
+ * choose.
+ *
+ * The cache is shared by all worker threads, and protected by a mutex.
+ * Entries are preallocated.  All entries have the same lifetime, so they
+ * are kept on a list in the order they expire, which is also the order
+ * they're evicted when the cache is full.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/sha1.h>
+#include <freeradius-devel/unlang/call_env.h>
+
+#include <pthread.h>
+
+#define AUTH_CACHE_SECRET_LENGTH	32
+
+typedef struct {
+	fr_rb_node_t		node;				//!< Entry in the lookup tree.
+	fr_dlist_t		entry;				//!< Entry in the expiry, or free list.
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< HMAC of the identity and credentials.
+	fr_time_t		expires;			//!< When the entry is no longer valid.
+} rlm_auth_cache_entry_t;
+
+/** Cache state, which is modified at runtime, so can't live in the instance data
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;				//!< Protects everything below.
+
+	rlm_auth_cache_entry_t	*entries;			//!< Preallocated entries.
+	fr_rb_tree_t		*tree;				//!< Entries by key.
+	fr_dlist_head_t		expiry;				//!< Entries in use, oldest first.
+	fr_dlist_head_t		free;				//!< Entries not in use.
+} rlm_auth_cache_mutable_t;
+
+typedef struct {
+	fr_time_delta_t		lifetime;			//!< How long entries are valid for.
+	uint32_t		max_entries;			//!< Size of the cache.
+
+	uint8_t			secret[AUTH_CACHE_SECRET_LENGTH];	//!< For keying the HMAC.
+
+	rlm_auth_cache_mutable_t	*mutable;		//!< Mutable instance data.
+} rlm_auth_cache_t;
+
+static const conf_parser_t module_config[] = {
+	{ FR_CONF_OFFSET("lifetime", rlm_auth_cache_t, lifetime), .dflt = "300" },
+	{ FR_CONF_OFFSET("max_entries", rlm_auth_cache_t, max_entries), .dflt = "65536" },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Call environment used by all of the auth_cache methods
+ *
+ */
+typedef struct {
+	fr_value_box_t		identity;			//!< Who is authenticating.
+	fr_value_box_t		credential;			//!< What they presented.
+	tmpl_t			*credential_tmpl;		//!< Where the credentials came from.  Its name
+								///< is part of the key, so each type of
+								///< credential is cached separately.
+} auth_cache_call_env_t;
+
+static const call_env_method_t auth_cache_method_env = {
+	FR_CALL_ENV_METHOD_OUT(auth_cache_call_env_t),
+	.env = (call_env_parser_t[]){
+		{ FR_CALL_ENV_OFFSET("identity", FR_TYPE_STRING, CALL_ENV_FLAG_REQUIRED | CALL_ENV_FLAG_NULLABLE | CALL_ENV_FLAG_CONCAT,
+				     auth_cache_call_env_t, identity), .pair.dflt = "&User-Name", .pair.dflt_quote = T_BARE_WORD },
+		{ FR_CALL_ENV_PARSE_OFFSET("credential", FR_TYPE_OCTETS, CALL_ENV_FLAG_REQUIRED | CALL_ENV_FLAG_NULLABLE | CALL_ENV_FLAG_CONCAT,
+					   auth_cache_call_env_t, credential, credential_tmpl), .pair.dflt = "&User-Password", .pair.dflt_quote = T_BARE_WORD },
+		CALL_ENV_TERMINATOR
+	}
+};
+
+static int8_t auth_cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_auth_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = memcmp(a->key, b->key, sizeof(a->key));
+	return CMP(ret, 0);
+}
+
+/** Append a length prefixed field to the HMAC input
+ *
+ */
+static inline uint8_t *auth_cache_field(uint8_t *p, uint8_t const *in, size_t inlen)
+{
+	uint32_t len = htonl((uint32_t) inlen);
+
+	memcpy(p, &len, sizeof(len));
+	p += sizeof(len);
+
+	if (inlen > 0) memcpy(p, in, inlen);
+
+	return p + inlen;
+}
+
+/** Calculate the key for the current request
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if there's nothing to cache.
+ */
+static int auth_cache_key(uint8_t key[static SHA1_DIGEST_LENGTH],
+			  rlm_auth_cache_t const *inst, request_t *request, auth_cache_call_env_t const *env)
+{
+	uint8_t		*buff, *p;
+	size_t		len, name_len;
+
+	if ((env->identity.type != FR_TYPE_STRING) || (env->identity.vb_length == 0)) {
+		RDEBUG2("No identity, not using cache");
+		return -1;
+	}
+
+	if ((env->credential.type != FR_TYPE_OCTETS) || (env->credential.vb_length == 0)) {
+		RDEBUG2("No credentials, not using cache");
+		return -1;
+	}
+
+	name_len = strlen(env->credential_tmpl->name);
+	len = (sizeof(uint32_t) * 3) + env->identity.vb_length + name_len + env->credential.vb_length;
+
+	MEM(buff = talloc_array(request, uint8_t, len));
+	p = auth_cache_field(buff, (uint8_t const *) env->identity.vb_strvalue, env->identity.vb_length);
+	p = auth_cache_field(p, (uint8_t const *) env->credential_tmpl->name, name_len);
+	(void) auth_cache_field(p, env->credential.vb_octets, env->credential.vb_length);
+
+	fr_hmac_sha1(key, buff, len, inst->secret, sizeof(inst->secret));
+
+	memset_explicit(buff, 0, len);
+	talloc_free(buff);
+
+	return 0;
+}
+
+/** Return an entry to the free list
+ *
+ * Must be called with the mutex held.
+ */
+static void auth_cache_entry_release(rlm_auth_cache_mutable_t *mutable, rlm_auth_cache_entry_t *entry)
+{
+	fr_rb_remove_by_inline_node(mutable->tree, &entry->node);
+	fr_dlist_remove(&mutable->expiry, entry);
+	fr_dlist_insert_tail(&mutable->free, entry);
+}
+
+/** Free entries which have expired
+ *
+ * Must be called with the mutex held.
+ */
+static void auth_cache_expire(rlm_auth_cache_mutable_t *mutable, fr_time_t now)
+{
+	rlm_auth_cache_entry_t *entry;
+
+	while ((entry = fr_dlist_head(&mutable->expiry)) && fr_time_lteq(entry->expires, now)) {
+		auth_cache_entry_release(mutable, entry);
+	}
+}
+
+/** See if the identity has recently been accepted with the same credentials
+ *
+ * @return
+ *	- #RLM_MODULE_OK if the credentials are in the cache.
+ *	- #RLM_MODULE_NOTFOUND if they're not.
+ *	- #RLM_MODULE_NOOP if there was no identity, or no credentials.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_find(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_auth_cache_t const		*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_auth_cache_t);
+	auth_cache_call_env_t		*env = talloc_get_type_abort(mctx->env_data, auth_cache_call_env_t);
+	rlm_auth_cache_mutable_t	*mutable = inst->mutable;
+	rlm_auth_cache_entry_t		find, *entry;
+
+	if (auth_cache_key(find.key, inst, request, env) < 0) RETURN_MODULE_NOOP;
+
+	pthread_mutex_lock(&mutable->mutex);
+	auth_cache_expire(mutable, fr_time());
+	entry = fr_rb_find(mutable->tree, &find);
+	pthread_mutex_unlock(&mutable->mutex);
+
+	if (!entry) {
+		RDEBUG2("Credentials not found in cache");
+		RETURN_MODULE_NOTFOUND;
+	}
+
+	RDEBUG2("Credentials were verified recently");
+
+	RETURN_MODULE_OK;
+}
+
+/** Remember that the identity was accepted with these credentials
+ *
+ * @return
+ *	- #RLM_MODULE_UPDATED if the credentials were added, or their lifetime extended.
+ *	- #RLM_MODULE_NOOP if there was no identity, or no credentials.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_store(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_auth_cache_t const		*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_auth_cache_t);
+	auth_cache_call_env_t		*env = talloc_get_type_abort(mctx->env_data, auth_cache_call_env_t);
+	rlm_auth_cache_mutable_t	*mutable = inst->mutable;
+	rlm_auth_cache_entry_t		find, *entry;
+	fr_time_t			now;
+
+	if (auth_cache_key(find.key, inst, request, env) < 0) RETURN_MODULE_NOOP;
+
+	now = fr_time();
+
+	pthread_mutex_lock(&mutable->mutex);
+	auth_cache_expire(mutable, now);
+
+	entry = fr_rb_find(mutable->tree, &find);
+	if (entry) {
+		fr_dlist_remove(&mutable->expiry, entry);
+	} else {
+		/*
+		 *	Evict the oldest entry if the cache is full.
+		 */
+		entry = fr_dlist_pop_head(&mutable->free);
+		if (!entry) {
+			entry = fr_dlist_head(&mutable->expiry);
+			auth_cache_entry_release(mutable, entry);
+			entry = fr_dlist_pop_head(&mutable->free);
+		}
+
+		memcpy(entry->key, find.key, sizeof(entry->key));
+		fr_rb_insert(mutable->tree, entry);
+	}
+
+	entry->expires = fr_time_add(now, inst->lifetime);
+	fr_dlist_insert_tail(&mutable->expiry, entry);
+	pthread_mutex_unlock(&mutable->mutex);
+
+	RDEBUG2("Cached credentials for %pV", fr_box_time_delta(inst->lifetime));
+
+	RETURN_MODULE_UPDATED;
+}
+
+/** Forget the credentials, i.e. when they've been rejected by the backend
+ *
+ * @return
+ *	- #RLM_MODULE_OK if the credentials were removed.
+ *	- #RLM_MODULE_NOTFOUND if they weren't in the cache.
+ *	- #RLM_MODULE_NOOP if there was no identity, or no credentials.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_clear(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_auth_cache_t const		*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_auth_cache_t);
+	auth_cache_call_env_t		*env = talloc_get_type_abort(mctx->env_data, auth_cache_call_env_t);
+	rlm_auth_cache_mutable_t	*mutable = inst->mutable;
+	rlm_auth_cache_entry_t		find, *entry;
+
+	if (auth_cache_key(find.key, inst, request, env) < 0) RETURN_MODULE_NOOP;
+
+	pthread_mutex_lock(&mutable->mutex);
+	entry = fr_rb_find(mutable->tree, &find);
+	if (entry) auth_cache_entry_release(mutable, entry);
+	pthread_mutex_unlock(&mutable->mutex);
+
+	if (!entry) RETURN_MODULE_NOTFOUND;
+
+	RDEBUG2("Removed credentials from cache");
+
+	RETURN_MODULE_OK;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_auth_cache_t	*inst = talloc_get_type_abort(mctx->mi->data, rlm_auth_cache_t);
+
+	if (!inst->mutable) return 0;
+
+	pthread_mutex_destroy(&inst->mutable->mutex);
+	TALLOC_FREE(inst->mutable);
+
+	return 0;
+}
+
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	rlm_auth_cache_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_auth_cache_t);
+	rlm_auth_cache_mutable_t	*mutable;
+	uint32_t			i;
+
+	FR_TIME_DELTA_BOUND_CHECK("lifetime", inst->lifetime, >=, fr_time_delta_from_sec(1));
+	FR_TIME_DELTA_BOUND_CHECK("lifetime", inst->lifetime, <=, fr_time_delta_from_sec(86400));
+	FR_INTEGER_BOUND_CHECK("max_entries", inst->max_entries, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_entries", inst->max_entries, <=, (1 << 24));
+
+	/*
+	 *	A new secret every time the server starts,
+	 *	so entries can't be used across restarts.
+	 */
+	fr_rand_buffer(inst->secret, sizeof(inst->secret));
+
+	MEM(mutable = talloc_zero(NULL, rlm_auth_cache_mutable_t));
+	pthread_mutex_init(&mutable->mutex, NULL);
+	inst->mutable = mutable;
+
+	MEM(mutable->entries = talloc_zero_array(mutable, rlm_auth_cache_entry_t, inst->max_entries));
+	MEM(mutable->tree = fr_rb_inline_alloc(mutable, rlm_auth_cache_entry_t, node, auth_cache_entry_cmp, NULL));
+	fr_dlist_init(&mutable->expiry, rlm_auth_cache_entry_t, entry);
+	fr_dlist_init(&mutable->free, rlm_auth_cache_entry_t, entry);
+
+	for (i = 0; i < inst->max_entries; i++) fr_dlist_insert_tail(&mutable->free, &mutable->entries[i]);
+
+	return 0;
+}
+
+extern module_rlm_t rlm_auth_cache;
+module_rlm_t rlm_auth_cache = {
+	.common = {
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "auth_cache",
+		.inst_size		= sizeof(rlm_auth_cache_t),
+		.config			= module_config,
+		.instantiate		= mod_instantiate,
+		.detach			= mod_detach
+	},
+	.method_group = {
+		.bindings = (module_method_binding_t[]){
+			{ .section = SECTION_NAME("recv", "Access-Request"), .method = mod_find, .method_env = &auth_cache_method_env },	/* radius */
+			{ .section = SECTION_NAME("send", "Access-Accept"), .method = mod_store, .method_env = &auth_cache_method_env },	/* radius */
+			{ .section = SECTION_NAME("send", "Access-Reject"), .method = mod_clear, .method_env = &auth_cache_method_env },	/* radius */
+
+			{ .section = SECTION_NAME("find", NULL), .method = mod_find, .method_env = &auth_cache_method_env },			/* verb */
+			{ .section = SECTION_NAME("store", NULL), .method = mod_store, .method_env = &auth_cache_method_env },			/* verb */
+			{ .section = SECTION_NAME("clear", NULL), .method = mod_clear, .method_env = &auth_cache_method_env },			/* verb */
+			MODULE_BINDING_TERMINATOR
+		}
+	}
+};
@@ -345,6 +345,34 @@ static uint64_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void
 	return fr_htrie_num_elements(driver->cache);
 }
 
+/** Visit every entry in the cache
+ *
+ * All entries are in the expiry heap, so walk that.
+ *
+ * @copydetails cache_entry_walk_t
+ */
+static int cache_entry_walk(UNUSED rlm_cache_config_t const *config, void *instance,
+			    cache_entry_walk_cb_t cb, void *uctx)
+{
+	rlm_cache_htrie_t	*driver = talloc_get_type_abort(instance, rlm_cache_htrie_t);
+	fr_heap_iter_t		iter;
+	rlm_cache_entry_t	*c;
+	int			ret = 0;
+
+	pthread_mutex_lock(&driver->mutex);
+	for (c = fr_heap_iter_init(driver->heap, &iter);
+	     c;
+	     c = fr_heap_iter_next(driver->heap, &iter)) {
+		if (cb(c, uctx) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&driver->mutex);
+
+	return ret;
+}
+
 /** Lock the htrie
  *
  * @note handle not used except for sanity checks.
@@ -464,6 +492,7 @@ rlm_cache_driver_t rlm_cache_htrie = {
 	.expire		= cache_entry_expire,
 	.set_ttl	= cache_entry_set_ttl,
 	.count		= cache_entry_count,
+	.walk		= cache_entry_walk,
 
 	.acquire	= cache_acquire,
 	.release	= cache_release,
@@ -0,0 +1,4 @@
+TARGETNAME	:= rlm_cache_memcached
+
+TARGET		:= $(TARGETNAME)$(L)
+SOURCES		:= $(TARGETNAME).c ../../serialize.c
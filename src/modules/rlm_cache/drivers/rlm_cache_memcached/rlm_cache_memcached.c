@@ -19,324 +19,1163 @@
  * @file rlm_cache_memcached.c
  * @brief memcached based cache.
  *
- * @copyright 2014 The FreeRADIUS server project
+ * Speaks the memcached text protocol over connections managed by the
+ * trunk API, so lookups never block the worker.
+ *
+ * Lookups which are queued on the same connection at the same time are
+ * coalesced into a single multi-key "get" command.  Servers respond to
+ * commands in the order they were sent, so the only state we need to
+ * correlate responses is a FIFO of the commands written to each connection.
+ *
+ * Inserts and deletes are not waited for.  They're queued on the trunk
+ * without a request, and their responses are only used for logging.
+ *
+ * @copyright 2014,2024 The FreeRADIUS server project
  */
 
 #define LOG_PREFIX "cache - memcached"
 
-#include <libmemcached/memcached.h>
-
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/socket.h>
 #include <freeradius-devel/util/value.h>
 
 #include "../../rlm_cache.h"
 #include "../../serialize.h"
 
-typedef struct {
-	memcached_st *handle;
-} rlm_cache_memcached_handle_t;
+#define MEMCACHED_MAX_KEY_LEN	250		//!< Maximum key length the text protocol allows.
+#define MEMCACHED_BUFFER_SIZE	16384		//!< Initial size of connection send and receive buffers.
 
 typedef struct {
-	char const 		*options;	//!< Connection options
-	fr_pool_t	*pool;
+	module_instance_t const	*mi;			//!< Our module instance, used to find thread data.
+
+	fr_ipaddr_t		*server;		//!< Servers to distribute keys over.
+	uint16_t		port;			//!< Port the servers listen on.
+
+	uint32_t		max_get_keys;		//!< Maximum number of keys to send in one "get" command.
+	uint32_t		max_entry_size;		//!< Largest serialized entry we'll store or accept.
+
+	trunk_conf_t		trunk_conf;		//!< Trunk configuration.
 } rlm_cache_memcached_t;
 
+typedef struct rlm_cache_memcached_thread_s rlm_cache_memcached_thread_t;
+
+/** A memcached server, and the connections we have open to it
+ *
+ */
+typedef struct {
+	rlm_cache_memcached_thread_t	*thread;	//!< Thread this server belongs to.
+	fr_ipaddr_t const		*ipaddr;	//!< Address of the server.
+	trunk_t				*trunk;		//!< Connections to the server.
+} memcached_server_t;
+
+struct rlm_cache_memcached_thread_s {
+	rlm_cache_memcached_t const	*inst;		//!< Our module instance.
+	fr_event_list_t			*el;		//!< Event list.
+	memcached_server_t		**servers;	//!< One per configured server.
+};
+
+typedef enum {
+	MEMCACHED_CMD_GET = 0,				//!< Retrieve an entry.
+	MEMCACHED_CMD_SET,				//!< Store an entry.
+	MEMCACHED_CMD_DELETE				//!< Delete an entry.
+} memcached_cmd_t;
+
+typedef struct {
+	uint8_t			*data;			//!< Start of the buffer.
+	uint8_t			*read;			//!< Where we read data from.
+	uint8_t			*write;			//!< Where we write data to.
+	uint8_t			*end;			//!< End of the buffer.
+} memcached_buffer_t;
+
+/** A command which has been written, and is awaiting a response
+ *
+ * "get" commands may contain multiple keys, each belonging to a different
+ * trunk request.  Slots are set to NULL if their request goes away before
+ * the response arrives.
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the connection's list of outstanding commands.
+	memcached_cmd_t		cmd;			//!< The command that was sent.
+	unsigned int		num;			//!< How many keys were sent.
+	unsigned int		next;			//!< First key we haven't received a response for.
+	char			**keys;			//!< Keys which were sent.
+	trunk_request_t		**treqs;		//!< Requests associated with each key.
+} memcached_sent_t;
+
+/** Track the handle, which is tightly correlated with the FD
+ *
+ */
+typedef struct {
+	char const		*name;			//!< From IP PORT to IP PORT.
+	int			fd;			//!< File descriptor.
+
+	rlm_cache_memcached_t const	*inst;		//!< Our module instance.
+	memcached_server_t	*server;		//!< Server we're connected to.
+
+	memcached_buffer_t	send;			//!< Commands which haven't been written yet.
+	memcached_buffer_t	recv;			//!< Responses which haven't been processed yet.
+
+	fr_dlist_head_t		sent;			//!< Commands awaiting responses, oldest first.
+
+	trunk_connection_event_t	events;		//!< Events the trunk last asked us to listen for.
+} memcached_handle_t;
+
+/** Per command state
+ *
+ */
+typedef struct {
+	memcached_cmd_t		cmd;			//!< What we're asking the server to do.
+
+	fr_value_box_t		key;			//!< Key of the entry.
+	uint8_t			*data;			//!< Encoded "set" or "delete" command.
+	size_t			data_len;		//!< Length of the encoded command.
+
+	memcached_sent_t	*sent;			//!< Command the key was written in.
+	unsigned int		slot;			//!< Position of the key in the command.
+} memcached_request_t;
+
 static const conf_parser_t driver_config[] = {
-	{ FR_CONF_OFFSET("options", rlm_cache_memcached_t, options), .dflt = "--SERVER=localhost" },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("server", FR_TYPE_COMBO_IP_ADDR, CONF_FLAG_MULTI, rlm_cache_memcached_t, server), .dflt = "localhost" },
+	{ FR_CONF_OFFSET("port", rlm_cache_memcached_t, port), .dflt = "11211" },
+
+	{ FR_CONF_OFFSET("max_get_keys", rlm_cache_memcached_t, max_get_keys), .dflt = "32" },
+	{ FR_CONF_OFFSET("max_entry_size", rlm_cache_memcached_t, max_entry_size), .dflt = "1048576" },
+
+	{ FR_CONF_OFFSET_SUBSECTION("pool", 0, rlm_cache_memcached_t, trunk_conf, trunk_config ) },
 	CONF_PARSER_TERMINATOR
 };
 
-/** Free a connection handle
+/** Check a key can be sent using the text protocol
  *
- * @param mandle to free.
+ * Keys are sent as a single token, so they can't contain whitespace or control characters.
  */
-static int _mod_conn_free(rlm_cache_memcached_handle_t *mandle)
+static int memcached_key_check(request_t *request, fr_value_box_t const *key)
 {
-	if (mandle->handle) memcached_free(mandle->handle);
+	size_t i;
+
+	if ((key->vb_length == 0) || (key->vb_length > MEMCACHED_MAX_KEY_LEN)) {
+		ROPTIONAL(REDEBUG, ERROR, "Key length must be between 1 and %u bytes, got %zu bytes",
+			  MEMCACHED_MAX_KEY_LEN, key->vb_length);
+		return -1;
+	}
+
+	for (i = 0; i < key->vb_length; i++) {
+		uint8_t c = ((uint8_t const *)key->vb_strvalue)[i];
+
+		if ((c <= ' ') || (c == 0x7f)) {
+			ROPTIONAL(REDEBUG, ERROR, "Key must not contain spaces or control characters");
+			return -1;
+		}
+	}
 
 	return 0;
 }
 
-/** Create a new memcached handle
+/** Ensure there's space in a buffer for another len bytes
  *
  */
-static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
+static void memcached_buffer_reserve(TALLOC_CTX *ctx, memcached_buffer_t *buff, size_t len)
 {
-	rlm_cache_memcached_t		*driver = instance;
-	rlm_cache_memcached_handle_t	*mandle;
+	size_t	used = buff->write - buff->read;
+	size_t	size = buff->end - buff->data;
+	size_t	offset;
+
+	if ((size_t)(buff->end - buff->write) >= len) return;
+
+	/*
+	 *	Move any unprocessed data to the
+	 *	start of the buffer.
+	 */
+	if (buff->read > buff->data) {
+		memmove(buff->data, buff->read, used);
+		buff->read = buff->data;
+		buff->write = buff->data + used;
+		if ((size_t)(buff->end - buff->write) >= len) return;
+	}
 
-	memcached_st			*sandle;
-	memcached_return_t		ret;
+	while ((size - used) < len) size *= 2;
 
-	sandle = memcached(driver->options, talloc_array_length(driver->options) -1);
-	if (!sandle) {
-		ERROR("Failed creating memcached connection");
+	offset = buff->read - buff->data;
+	MEM(buff->data = talloc_realloc(ctx, buff->data, uint8_t, size));
+	buff->read = buff->data + offset;
+	buff->write = buff->read + used;
+	buff->end = buff->data + size;
+}
 
-		return NULL;
+static void memcached_buffer_init(TALLOC_CTX *ctx, memcached_buffer_t *buff)
+{
+	MEM(buff->data = talloc_array(ctx, uint8_t, MEMCACHED_BUFFER_SIZE));
+	buff->read = buff->write = buff->data;
+	buff->end = buff->data + MEMCACHED_BUFFER_SIZE;
+}
+
+static void memcached_buffer_append(TALLOC_CTX *ctx, memcached_buffer_t *buff, void const *in, size_t inlen)
+{
+	memcached_buffer_reserve(ctx, buff, inlen);
+	memcpy(buff->write, in, inlen);
+	buff->write += inlen;
+}
+
+/** Free a connection handle, closing associated resources
+ *
+ */
+static int _memcached_handle_free(memcached_handle_t *h)
+{
+	memcached_sent_t *sent;
+
+	/*
+	 *	Ensure requests don't hold references
+	 *	to commands which are about to be freed.
+	 */
+	while ((sent = fr_dlist_pop_head(&h->sent))) {
+		unsigned int i;
+
+		for (i = 0; i < sent->num; i++) {
+			memcached_request_t *u;
+
+			if (!sent->treqs[i]) continue;
+
+			u = talloc_get_type_abort(sent->treqs[i]->preq, memcached_request_t);
+			u->sent = NULL;
+		}
+		talloc_free(sent);
 	}
 
-	ret = memcached_behavior_set(sandle, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, fr_time_delta_to_msec(timeout));
-	if (ret != MEMCACHED_SUCCESS) {
-		ERROR("%s: %s", memcached_strerror(sandle, ret), memcached_last_error_message(sandle));
-	error:
-		memcached_free(sandle);
-		return NULL;
+	fr_assert(h->fd >= 0);
+
+	fr_event_fd_delete(h->server->thread->el, h->fd, FR_EVENT_FILTER_IO);
+
+	if (shutdown(h->fd, SHUT_RDWR) < 0) {
+		DEBUG3("Failed shutting down connection %s: %s", h->name, fr_syserror(errno));
 	}
 
-	ret = memcached_version(sandle);
-	if (ret != MEMCACHED_SUCCESS) {
-		ERROR("%s: %s", memcached_strerror(sandle, ret), memcached_last_error_message(sandle));
-		goto error;
+	if (close(h->fd) < 0) {
+		DEBUG3("Failed closing connection %s: %s", h->name, fr_syserror(errno));
 	}
 
-	mandle = talloc_zero(ctx, rlm_cache_memcached_handle_t);
-	mandle->handle = sandle;
-	talloc_set_destructor(mandle, _mod_conn_free);
+	h->fd = -1;
+
+	DEBUG("Connection closed - %s", h->name);
 
-	return mandle;
+	return 0;
 }
 
-/** Create a new rlm_cache_memcached instance
+/** Initialise a new outbound connection
+ *
+ * @param[out] h_out	Where to write the new connection handle.
+ * @param[in] conn	to initialise.
+ * @param[in] uctx	A #memcached_server_t
+ */
+static connection_state_t conn_init(void **h_out, connection_t *conn, void *uctx)
+{
+	int			fd;
+	memcached_handle_t	*h;
+	memcached_server_t	*server = talloc_get_type_abort(uctx, memcached_server_t);
+	fr_ipaddr_t		src_ipaddr = { .af = AF_UNSPEC };
+
+	fd = fr_socket_client_tcp(NULL, &src_ipaddr, server->ipaddr, server->thread->inst->port, true);
+	if (fd < 0) {
+		PERROR("Failed opening socket");
+		return CONNECTION_STATE_FAILED;
+	}
+
+	MEM(h = talloc_zero(conn, memcached_handle_t));
+	h->fd = fd;
+	h->server = server;
+	h->inst = server->thread->inst;
+	h->name = fr_asprintf(h, "proto tcp remote %pV port %u", fr_box_ipaddr(server->ipaddr[0]), h->inst->port);
+	fr_dlist_talloc_init(&h->sent, memcached_sent_t, entry);
+	memcached_buffer_init(h, &h->send);
+	memcached_buffer_init(h, &h->recv);
+	talloc_set_destructor(h, _memcached_handle_free);
+
+	/*
+	 *	Signal the connection
+	 *	as open as soon as it becomes writable.
+	 */
+	connection_signal_on_fd(conn, fd);
+
+	*h_out = h;
+
+	return CONNECTION_STATE_CONNECTING;
+}
+
+/** Shutdown/close a file descriptor
+ *
+ */
+static void conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uctx)
+{
+	memcached_handle_t *h = talloc_get_type_abort(handle, memcached_handle_t);
+
+	DEBUG4("Freeing memcached handle %p", handle);
+
+	talloc_free(h);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_t *thread_conn_alloc(trunk_connection_t *tconn, fr_event_list_t *el,
+				       connection_conf_t const *conf,
+				       char const *log_prefix, void *uctx)
+{
+	connection_t		*conn;
+	memcached_server_t	*server = talloc_get_type_abort(uctx, memcached_server_t);
+
+	conn = connection_alloc(tconn, el,
+				&(connection_funcs_t){
+					.init = conn_init,
+					.close = conn_close,
+				},
+				conf,
+				log_prefix,
+				server);
+	if (!conn) {
+		PERROR("Failed allocating state handler for new connection");
+		return NULL;
+	}
+
+	return conn;
+}
+
+/** Write as much pending data as the socket will take
  *
- * @param[in] mctx		Data required for instantiation.
  * @return
- *	- 0 on success.
- *	- -1 on failure.
+ *	- 0 on success (even if not all data was written).
+ *	- -1 on failure.  The connection has been signalled to reconnect.
  */
-static int mod_instantiate(module_inst_ctx_t const *mctx)
+static int memcached_flush(memcached_handle_t *h, trunk_connection_t *tconn)
 {
-	rlm_cache_memcached_t		*driver = talloc_get_type_abort(mctx->mi->data, rlm_cache_memcached_t);
-	CONF_SECTION			*conf = mctx->mi->conf;
-	memcached_return_t		ret;
-	char				buffer[256];
-	rlm_cache_config_t const	*config = talloc_get_type_abort(mctx->mi->parent->data, rlm_cache_config_t);
+	ssize_t		slen;
+
+	if (h->send.write == h->send.read) return 0;
+
+	slen = write(h->fd, h->send.read, h->send.write - h->send.read);
+	if (slen < 0) {
+		switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+		case EWOULDBLOCK:
+#endif
+		case EAGAIN:
+		case EINTR:
+		case ENOBUFS:
+		case ENOMEM:
+			return 0;
+
+		default:
+			ERROR("Failed sending data over connection %s: %s", h->name, fr_syserror(errno));
+			trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+			return -1;
+		}
+	}
 
-	fr_assert(config);
+	h->send.read += slen;
+	if (h->send.read == h->send.write) h->send.read = h->send.write = h->send.data;
 
-	snprintf(buffer, sizeof(buffer), "rlm_cache (%s)", mctx->mi->parent->name);
+	return 0;
+}
 
-	ret = libmemcached_check_configuration(driver->options, talloc_array_length(driver->options) -1,
-					       buffer, sizeof(buffer));
-	if (ret != MEMCACHED_SUCCESS) {
-		ERROR("%s", buffer);
-		return -1;
+static void conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx);
+static void conn_error(fr_event_list_t *el, int fd, int flags, int fd_errno, void *uctx);
+
+/** Register for the I/O events the trunk wants, and any we need to finish writing
+ *
+ */
+static void memcached_events_update(memcached_handle_t *h, fr_event_list_t *el, trunk_connection_t *tconn)
+{
+	fr_event_fd_cb_t	read_fn = NULL;
+	fr_event_fd_cb_t	write_fn = NULL;
+
+	switch (h->events) {
+	case TRUNK_CONN_EVENT_NONE:
+		break;
+
+	case TRUNK_CONN_EVENT_READ:
+		read_fn = trunk_connection_callback_readable;
+		break;
+
+	case TRUNK_CONN_EVENT_WRITE:
+		write_fn = conn_writable;
+		break;
+
+	case TRUNK_CONN_EVENT_BOTH:
+		read_fn = trunk_connection_callback_readable;
+		write_fn = conn_writable;
+		break;
 	}
 
-	driver->pool = module_rlm_connection_pool_init(conf, driver, mod_conn_create, NULL,
-						   buffer, "modules.rlm_cache.pool", NULL);
-	if (!driver->pool) return -1;
+	/*
+	 *	Commands which were only partially written
+	 *	need to be finished, even if the trunk has
+	 *	nothing more for us to send.
+	 */
+	if (h->send.write > h->send.read) write_fn = conn_writable;
 
-	talloc_link_ctx(driver, driver->pool);	/* Ensure pool is freed */
+	if (!read_fn && !write_fn) {
+		fr_event_fd_delete(el, h->fd, FR_EVENT_FILTER_IO);
+		return;
+	}
 
-	if (config->max_entries > 0) {
-		ERROR("max_entries is not supported by this driver");
-		return -1;
+	if (fr_event_fd_insert(h, NULL, el, h->fd, read_fn, write_fn, conn_error, tconn) < 0) {
+		PERROR("Failed inserting FD event");
+
+		/*
+		 *	May free the connection!
+		 */
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
 	}
-	return 0;
 }
 
-static int mod_load(void)
+/** Connection errored
+ *
+ * We were signalled by the event loop that a fatal error occurred on this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that errored.
+ * @param[in] flags	El flags.
+ * @param[in] fd_errno	The nature of the error.
+ * @param[in] uctx	The trunk connection handle (tconn).
+ */
+static void conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
 {
-	INFO("%s", memcached_lib_version());
-	return 0;
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	connection_t		*conn = tconn->conn;
+	memcached_handle_t	*h = talloc_get_type_abort(conn->h, memcached_handle_t);
+
+	ERROR("Connection %s failed: %s", h->name, fr_syserror(fd_errno));
+
+	connection_signal_reconnect(conn, CONNECTION_FAILED);
 }
 
-/** Locate a cache entry in memcached
+/** Connection is writable
  *
- * @copydetails cache_entry_free_t
+ * Finish writing any partially written commands, then let the trunk write new ones.
  */
-static void cache_entry_free(rlm_cache_entry_t *c)
+static void conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx)
 {
-	talloc_free(c);
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	memcached_handle_t	*h = talloc_get_type_abort(tconn->conn->h, memcached_handle_t);
+
+	if ((h->events == TRUNK_CONN_EVENT_WRITE) || (h->events == TRUNK_CONN_EVENT_BOTH)) {
+		trunk_connection_callback_writable(el, fd, flags, tconn);
+		return;
+	}
+
+	if (memcached_flush(h, tconn) < 0) return;
+
+	if (h->send.write == h->send.read) memcached_events_update(h, el, tconn);
 }
 
-/** Locate a cache entry in memcached
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void thread_conn_notify(trunk_connection_t *tconn, connection_t *conn,
+			       fr_event_list_t *el,
+			       trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	memcached_handle_t	*h = talloc_get_type_abort(conn->h, memcached_handle_t);
+
+	h->events = notify_on;
+
+	memcached_events_update(h, el, tconn);
+}
+
+/** Record a command which expects a response
  *
- * @copydetails cache_entry_find_t
  */
-static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
-				       UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
-				       request_t *request, void *handle, fr_value_box_t const *key)
+static memcached_sent_t *memcached_sent_alloc(memcached_handle_t *h, memcached_cmd_t cmd, unsigned int max)
 {
-	rlm_cache_memcached_handle_t *mandle = handle;
+	memcached_sent_t	*sent;
 
-	memcached_return_t	mret;
-	size_t			len;
-	int			ret;
-	uint32_t		flags;
+	MEM(sent = talloc_zero(h, memcached_sent_t));
+	sent->cmd = cmd;
+	MEM(sent->keys = talloc_zero_array(sent, char *, max));
+	MEM(sent->treqs = talloc_zero_array(sent, trunk_request_t *, max));
+	fr_dlist_insert_tail(&h->sent, sent);
 
-	char			*from_store;
+	return sent;
+}
 
-	rlm_cache_entry_t	*c;
+static void memcached_sent_add(memcached_sent_t *sent, trunk_request_t *treq, memcached_request_t *u)
+{
+	MEM(sent->keys[sent->num] = talloc_bstrndup(sent->keys, u->key.vb_strvalue, u->key.vb_length));
+	sent->treqs[sent->num] = treq;
 
-	from_store = memcached_get(mandle->handle, (char const *)key->vb_strvalue, key->vb_length, &len, &flags, &mret);
-	if (!from_store) {
-		if (mret == MEMCACHED_NOTFOUND) return CACHE_MISS;
+	u->sent = sent;
+	u->slot = sent->num++;
+}
 
-		RERROR("Failed retrieving entry: %s: %s", memcached_strerror(mandle->handle, mret),
-		       memcached_last_error_message(mandle->handle));
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void request_mux(fr_event_list_t *el,
+			trunk_connection_t *tconn, connection_t *conn, UNUSED void *uctx)
+{
+	memcached_handle_t	*h = talloc_get_type_abort(conn->h, memcached_handle_t);
+	memcached_sent_t	*get = NULL;
+
+	/*
+	 *	Finish writing what we already have before
+	 *	taking on more.  This bounds the size of the
+	 *	send buffer if the server isn't reading.
+	 */
+	if (memcached_flush(h, tconn) < 0) return;
+	if (h->send.write > h->send.read) return;
+
+	/*
+	 *	Everything written to the buffer is considered
+	 *	sent, as the data is written out eventually
+	 *	regardless of whether the request is still
+	 *	around when it is.
+	 */
+	for (;;) {
+		trunk_request_t		*treq;
+		memcached_request_t	*u;
+
+		if (unlikely(trunk_connection_pop_request(&treq, tconn) < 0)) return;
+		if (!treq) break;
+
+		u = talloc_get_type_abort(treq->preq, memcached_request_t);
+
+		switch (u->cmd) {
+		case MEMCACHED_CMD_GET:
+			if (get && (get->num == h->inst->max_get_keys)) {
+				memcached_buffer_append(h, &h->send, "\r\n", 2);
+				get = NULL;
+			}
+
+			if (!get) {
+				get = memcached_sent_alloc(h, MEMCACHED_CMD_GET, h->inst->max_get_keys);
+				memcached_buffer_append(h, &h->send, "get", 3);
+			}
+
+			memcached_buffer_append(h, &h->send, " ", 1);
+			memcached_buffer_append(h, &h->send, u->key.vb_strvalue, u->key.vb_length);
+			memcached_sent_add(get, treq, u);
+			break;
+
+		case MEMCACHED_CMD_SET:
+		case MEMCACHED_CMD_DELETE:
+			if (get) {
+				memcached_buffer_append(h, &h->send, "\r\n", 2);
+				get = NULL;
+			}
+
+			memcached_buffer_append(h, &h->send, u->data, u->data_len);
+			memcached_sent_add(memcached_sent_alloc(h, u->cmd, 1), treq, u);
+			break;
+		}
+
+		trunk_request_signal_sent(treq);
+	}
 
-		return CACHE_ERROR;
+	if (get) memcached_buffer_append(h, &h->send, "\r\n", 2);
+
+	/*
+	 *	Verify nothing accidentally freed the connection handle
+	 */
+	(void)talloc_get_type_abort(h, memcached_handle_t);
+
+	if (memcached_flush(h, tconn) < 0) return;
+
+	/*
+	 *	Didn't write everything, make sure we're told
+	 *	when we can write the rest.
+	 */
+	if (h->send.write > h->send.read) memcached_events_update(h, el, tconn);
+}
+
+/** Find the end of a response line
+ *
+ * @return
+ *	- Length of the line, including the trailing CRLF.
+ *	- 0 if we haven't received a full line.
+ */
+static size_t memcached_line_len(memcached_buffer_t const *buff)
+{
+	uint8_t const *p = buff->read;
+
+	while ((p = memchr(p, '\n', buff->write - p))) {
+		if ((p > buff->read) && (p[-1] == '\r')) return (p + 1) - buff->read;
+		p++;
 	}
-	RDEBUG2("Retrieved %zu bytes from memcached", len);
-	RDEBUG2("%s", from_store);
 
-	MEM(c = talloc_zero(NULL, rlm_cache_entry_t));
-	ret = cache_deserialize(c, request->dict, from_store, len);
-	free(from_store);
-	if (ret < 0) {
-		RPERROR("Invalid entry");
-	error:
+	return 0;
+}
+
+/** Complete the request associated with a key in a response
+ *
+ * @param[in] sent	Command the key was sent in.
+ * @param[in] slot	Position of the key in the command.
+ * @param[in] status	Result of the command.
+ * @param[in] c		Entry which was retrieved, may be NULL.
+ */
+static void memcached_slot_complete(memcached_sent_t *sent, unsigned int slot,
+				    cache_status_t status, rlm_cache_entry_t *c)
+{
+	trunk_request_t		*treq = sent->treqs[slot];
+	cache_fetch_t		*fetch;
+
+	if (!treq) {
 		talloc_free(c);
-		return CACHE_ERROR;
-	}
-	if (unlikely(fr_value_box_copy(c, &c->key, key) < 0)) {
-		RERROR("Failed copying key");
-		goto error;
+		return;
 	}
 
-	*out = c;
+	fetch = treq->rctx;
+	if (fetch) {
+		fetch->status = status;
+		fetch->c = c;
+	} else {
+		talloc_free(c);
+	}
 
-	return CACHE_OK;
+	trunk_request_signal_complete(treq);	/* Clears the slot */
 }
 
-/** Insert a new entry into the data store
+/** Fail all the remaining keys in a command, and stop tracking it
  *
- * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
-					 request_t *request, void *handle, const rlm_cache_entry_t *c)
+static void memcached_sent_done(memcached_handle_t *h, memcached_sent_t *sent, cache_status_t status)
 {
-	rlm_cache_memcached_handle_t *mandle = handle;
+	for (; sent->next < sent->num; sent->next++) memcached_slot_complete(sent, sent->next, status, NULL);
 
-	memcached_return_t ret;
+	fr_dlist_remove(&h->sent, sent);
+	talloc_free(sent);
+}
+
+/** Process a "VALUE <key> <flags> <bytes>" line and the data following it
+ *
+ * @return
+ *	- >0 the number of bytes consumed.
+ *	- 0 if we need more data.
+ *	- -1 if the response was malformed.
+ */
+static ssize_t memcached_value_process(memcached_handle_t *h, memcached_sent_t *sent, size_t line_len)
+{
+	char const		*p = (char const *)h->recv.read + (sizeof("VALUE ") - 1);
+	char const		*end = (char const *)h->recv.read + line_len - 2;
+	char const		*key, *data;
+	size_t			key_len;
+	unsigned long		len;
+	char			*q;
+	unsigned int		slot;
+
+	key = p;
+	while ((p < end) && (*p != ' ')) p++;
+	key_len = p - key;
+	if ((key_len == 0) || (p == end)) return -1;
+
+	(void)strtoul(p, &q, 10);	/* flags, which we don't use */
+	if (q == p) return -1;
+
+	p = q;
+	len = strtoul(p, &q, 10);
+	if ((q == p) || (q != end)) return -1;
+
+	if (len > h->inst->max_entry_size) {
+		ERROR("Entry of %lu bytes exceeds max_entry_size", len);
+		return -1;
+	}
 
-	TALLOC_CTX *pool;
-	char *to_store;
+	if ((size_t)(h->recv.write - h->recv.read) < (line_len + len + 2)) return 0;
 
-	pool = talloc_pool(NULL, 1024);
-	if (!pool) return CACHE_ERROR;
+	data = (char const *)h->recv.read + line_len;
+	if ((data[len] != '\r') || (data[len + 1] != '\n')) return -1;
 
-	if (cache_serialize(pool, &to_store, c) < 0) {
-		talloc_free(pool);
+	/*
+	 *	The server skips keys it doesn't have,
+	 *	so anything before this key was a miss.
+	 */
+	for (slot = sent->next; slot < sent->num; slot++) {
+		if ((strlen(sent->keys[slot]) == key_len) && (memcmp(sent->keys[slot], key, key_len) == 0)) break;
+	}
+	if (slot == sent->num) {
+		ERROR("Received unexpected key \"%.*s\"", (int)key_len, key);
+		return -1;
+	}
 
-		return CACHE_ERROR;
+	for (; sent->next < slot; sent->next++) memcached_slot_complete(sent, sent->next, CACHE_MISS, NULL);
+	sent->next++;
+
+	if (sent->treqs[slot] && sent->treqs[slot]->rctx) {
+		trunk_request_t		*treq = sent->treqs[slot];
+		request_t		*request = treq->request;
+		memcached_request_t	*u = talloc_get_type_abort(treq->preq, memcached_request_t);
+		rlm_cache_entry_t	*c;
+		char			*to_load;
+
+		RDEBUG2("Retrieved %lu bytes from memcached", len);
+
+		MEM(c = talloc_zero(NULL, rlm_cache_entry_t));
+		map_list_init(&c->maps);
+		MEM(to_load = talloc_bstrndup(c, data, len));
+
+		if (cache_deserialize(c, request->dict, to_load, len) < 0) {
+			RPERROR("Invalid entry");
+		error:
+			talloc_free(c);
+			memcached_slot_complete(sent, slot, CACHE_ERROR, NULL);
+			return line_len + len + 2;
+		}
+		talloc_free(to_load);
+
+		if (unlikely(fr_value_box_copy(c, &c->key, &u->key) < 0)) {
+			RERROR("Failed copying key");
+			goto error;
+		}
+
+		memcached_slot_complete(sent, slot, CACHE_OK, c);
 	}
 
-	ret = memcached_set(mandle->handle, (char const *)c->key.vb_strvalue, c->key.vb_length,
-		            to_store ? to_store : "",
-		            to_store ? talloc_array_length(to_store) - 1 : 0, fr_unix_time_to_sec(c->expires), 0);
-	talloc_free(pool);
-	if (ret != MEMCACHED_SUCCESS) {
-		RERROR("Failed storing entry: %s: %s", memcached_strerror(mandle->handle, ret),
-		       memcached_last_error_message(mandle->handle));
+	return line_len + len + 2;
+}
 
-		return CACHE_ERROR;
+static void request_demux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn, connection_t *conn, UNUSED void *uctx)
+{
+	memcached_handle_t	*h = talloc_get_type_abort(conn->h, memcached_handle_t);
+	bool			do_read = true;
+
+	DEBUG3("Reading data for connection %s", h->name);
+
+	while (true) {
+		memcached_sent_t	*sent;
+		size_t			line_len;
+		char const		*line;
+		ssize_t			slen;
+
+		/*
+		 *	Read as much data as possible.
+		 *
+		 *	Like the muxer, we only call read() again if the
+		 *	last read filled the buffer.
+		 */
+		if (do_read) {
+			memcached_buffer_reserve(h, &h->recv, MEMCACHED_BUFFER_SIZE / 2);
+
+			slen = read(h->fd, h->recv.write, h->recv.end - h->recv.write);
+			if (slen == 0) {
+				ERROR("Connection %s closed by server", h->name);
+				trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+				return;
+			}
+			if (slen < 0) {
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+				ERROR("Failed reading response from socket: %s", fr_syserror(errno));
+				trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+				return;
+			}
+
+			h->recv.write += slen;
+			do_read = (h->recv.write == h->recv.end);
+		}
+
+		line_len = memcached_line_len(&h->recv);
+		if (!line_len) {
+			if ((size_t)(h->recv.write - h->recv.read) > (MEMCACHED_MAX_KEY_LEN + 128)) {
+				ERROR("Response line too long");
+				trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+				return;
+			}
+		need_more:
+			if (h->recv.read == h->recv.write) h->recv.read = h->recv.write = h->recv.data;
+			if (do_read) continue;
+			return;
+		}
+		line = (char const *)h->recv.read;
+
+		sent = fr_dlist_head(&h->sent);
+		if (!sent) {
+			ERROR("Received response \"%.*s\" with no outstanding commands",
+			      (int)line_len - 2, line);
+			trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+			return;
+		}
+
+#define LINE_IS(_str) ((line_len == (sizeof(_str) + 1)) && (memcmp(line, _str, sizeof(_str) - 1) == 0))
+#define LINE_STARTS(_str) ((line_len > (sizeof(_str) + 1)) && (memcmp(line, _str, sizeof(_str) - 1) == 0))
+
+		/*
+		 *	Errors can be returned in response to any command.
+		 */
+		if (LINE_IS("ERROR") || LINE_STARTS("CLIENT_ERROR ") || LINE_STARTS("SERVER_ERROR ")) {
+			ERROR("Server returned \"%.*s\"", (int)line_len - 2, line);
+			h->recv.read += line_len;
+			memcached_sent_done(h, sent, CACHE_ERROR);
+			continue;
+		}
+
+		switch (sent->cmd) {
+		case MEMCACHED_CMD_GET:
+			if (LINE_IS("END")) {
+				h->recv.read += line_len;
+				memcached_sent_done(h, sent, CACHE_MISS);
+				continue;
+			}
+
+			if (LINE_STARTS("VALUE ")) {
+				slen = memcached_value_process(h, sent, line_len);
+				if (slen < 0) goto malformed;
+				if (slen == 0) {
+					memcached_buffer_reserve(h, &h->recv, MEMCACHED_BUFFER_SIZE / 2);
+					do_read = true;
+					goto need_more;
+				}
+				h->recv.read += slen;
+				continue;
+			}
+			goto malformed;
+
+		case MEMCACHED_CMD_SET:
+			if (LINE_IS("STORED")) {
+				h->recv.read += line_len;
+				memcached_sent_done(h, sent, CACHE_OK);
+				continue;
+			}
+
+			if (LINE_IS("NOT_STORED")) {
+				WARN("Server did not store entry \"%s\"", sent->keys[0]);
+				h->recv.read += line_len;
+				memcached_sent_done(h, sent, CACHE_ERROR);
+				continue;
+			}
+			goto malformed;
+
+		case MEMCACHED_CMD_DELETE:
+			if (LINE_IS("DELETED") || LINE_IS("NOT_FOUND")) {
+				h->recv.read += line_len;
+				memcached_sent_done(h, sent, LINE_IS("DELETED") ? CACHE_OK : CACHE_MISS);
+				continue;
+			}
+			goto malformed;
+		}
+
+	malformed:
+		ERROR("Received malformed response \"%.*s\"", (int)line_len - 2, line);
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		return;
 	}
+}
 
-	return CACHE_OK;
+/** Clear out anything associated with the handle from the request
+ *
+ */
+static void request_conn_release(UNUSED connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	memcached_request_t	*u = talloc_get_type_abort(preq_to_reset, memcached_request_t);
+
+	/*
+	 *	The response to the command will still
+	 *	arrive, and will just be discarded.
+	 */
+	if (u->sent) {
+		u->sent->treqs[u->slot] = NULL;
+		u->sent = NULL;
+	}
 }
 
-/** Call delete the cache entry from memcached
+/** Let the request know the lookup failed
  *
- * @copydetails cache_entry_expire_t
  */
-static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
-					 request_t *request, void *handle, fr_value_box_t const *key)
+static void request_fail(request_t *request, UNUSED void *preq, void *rctx,
+			 UNUSED trunk_request_state_t state, UNUSED void *uctx)
 {
-	rlm_cache_memcached_handle_t *mandle = handle;
+	cache_fetch_t		*fetch = rctx;
 
-	memcached_return_t ret;
+	if (!fetch) return;
 
-	ret = memcached_delete(mandle->handle, (char const *)key->vb_strvalue, key->vb_length, 0);
-	switch (ret) {
-	case MEMCACHED_SUCCESS:
-		return CACHE_OK;
+	fetch->status = CACHE_ERROR;
+	fetch->treq = NULL;
 
-	case MEMCACHED_DATA_DOES_NOT_EXIST:
-		return CACHE_MISS;
+	unlang_interpret_mark_runnable(request);
+}
 
-	default:
-		RERROR("Failed deleting entry: %s", memcached_last_error_message(mandle->handle));
-		return CACHE_ERROR;
-	}
+/** Result has already been written to the fetch ctx at this point
+ *
+ */
+static void request_complete(request_t *request, UNUSED void *preq, void *rctx, UNUSED void *uctx)
+{
+	cache_fetch_t		*fetch = rctx;
+
+	if (!fetch) return;
+
+	fetch->treq = NULL;
+
+	unlang_interpret_mark_runnable(request);
 }
 
-/** Get a memcached handle
+/** Explicitly free resources associated with the protocol request
  *
- * @copydetails cache_acquire_t
  */
-static int mod_conn_get(void **handle, UNUSED rlm_cache_config_t const *config, void *instance,
-			request_t *request)
+static void request_free(UNUSED request_t *request, void *preq_to_free, UNUSED void *uctx)
 {
-	rlm_cache_memcached_t *driver = instance;
-	rlm_cache_handle_t *mandle;
+	memcached_request_t	*u = talloc_get_type_abort(preq_to_free, memcached_request_t);
+
+	fr_assert(!u->sent);	/* Dealt with by request_conn_release */
 
-	*handle = NULL;
+	talloc_free(u);
+}
 
-	mandle = fr_pool_connection_get(driver->pool, request);
-	if (!mandle) {
-		*handle = NULL;
+/** Pick the server responsible for a key
+ *
+ */
+static memcached_server_t *memcached_server_by_key(rlm_cache_memcached_thread_t *thread, fr_value_box_t const *key)
+{
+	size_t num = talloc_array_length(thread->servers);
+
+	if (num == 1) return thread->servers[0];
+
+	return thread->servers[fr_hash(key->vb_strvalue, key->vb_length) % num];
+}
+
+/** Queue a command on the trunk for the server responsible for the key
+ *
+ * @param[in] thread	Our thread instance.
+ * @param[in] request	the command is for.  NULL if nothing is waiting for the response.
+ * @param[in] cmd	to send.
+ * @param[in] key	of the entry.
+ * @param[in] data	Encoded command for "set" and "delete".  Will be stolen.
+ * @param[in] fetch	Where to write the result of a "get".
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int memcached_enqueue(rlm_cache_memcached_thread_t *thread, request_t *request, memcached_cmd_t cmd,
+			     fr_value_box_t const *key, uint8_t *data, cache_fetch_t *fetch)
+{
+	memcached_server_t		*server = memcached_server_by_key(thread, key);
+	trunk_request_t			*treq;
+	memcached_request_t		*u;
+
+	treq = trunk_request_alloc(server->trunk, request);
+	if (!treq) {
+		talloc_free(data);
 		return -1;
 	}
-	*handle = mandle;
+
+	MEM(u = talloc_zero(treq, memcached_request_t));
+	u->cmd = cmd;
+	if (unlikely(fr_value_box_copy(u, &u->key, key) < 0)) {
+	error:
+		talloc_free(data);
+		trunk_request_free(&treq);	/* Return to the free list */
+		return -1;
+	}
+	if (data) {
+		u->data = talloc_steal(u, data);
+		u->data_len = talloc_array_length(data) - 1;
+	}
+
+	switch (trunk_request_enqueue(&treq, server->trunk, request, u, fetch)) {
+	case TRUNK_ENQUEUE_OK:
+	case TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		ROPTIONAL(REDEBUG, ERROR, "Unable to enqueue memcached command");
+		data = NULL;
+		goto error;
+	}
+
+	if (fetch) fetch->treq = treq;
 
 	return 0;
 }
 
-/** Release a memcached handle
+/** Instantiate thread data for the submodule.
  *
- * @copydetails cache_release_t
  */
-static void mod_conn_release(UNUSED rlm_cache_config_t const *config, void *instance,
-			     request_t *request, rlm_cache_handle_t *handle)
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 {
-	rlm_cache_memcached_t *driver = instance;
+	rlm_cache_memcached_t		*driver = talloc_get_type_abort(mctx->mi->data, rlm_cache_memcached_t);
+	rlm_cache_memcached_thread_t	*thread = talloc_get_type_abort(mctx->thread, rlm_cache_memcached_thread_t);
+	size_t				i;
+
+	static trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = thread_conn_alloc,
+						.connection_notify = thread_conn_notify,
+						.request_mux = request_mux,
+						.request_demux = request_demux,
+						.request_conn_release = request_conn_release,
+						.request_complete = request_complete,
+						.request_fail = request_fail,
+						.request_free = request_free
+					};
+
+	thread->inst = driver;
+	thread->el = mctx->el;
+
+	MEM(thread->servers = talloc_zero_array(thread, memcached_server_t *, talloc_array_length(driver->server)));
+	for (i = 0; i < talloc_array_length(driver->server); i++) {
+		memcached_server_t *server;
+
+		MEM(server = thread->servers[i] = talloc_zero(thread->servers, memcached_server_t));
+		server->thread = thread;
+		server->ipaddr = &driver->server[i];
+		server->trunk = trunk_alloc(thread, mctx->el, &io_funcs,
+					    &driver->trunk_conf, mctx->mi->name, server, false);
+		if (!server->trunk) return -1;
+	}
 
-	fr_pool_connection_release(driver->pool, request, handle);
+	return 0;
 }
 
-/** Reconnect a memcached handle
+/** Create a new rlm_cache_memcached instance
  *
- * @copydetails cache_reconnect_t
+ * @param[in] mctx		Data required for instantiation.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static int mod_conn_reconnect(void **handle, UNUSED rlm_cache_config_t const *config, void *instance,
-			      request_t *request)
+static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
-	rlm_cache_memcached_t *driver = instance;
-	rlm_cache_handle_t *mandle;
+	rlm_cache_memcached_t		*driver = talloc_get_type_abort(mctx->mi->data, rlm_cache_memcached_t);
+	CONF_SECTION			*conf = mctx->mi->conf;
+	rlm_cache_config_t const	*config = talloc_get_type_abort(mctx->mi->parent->data, rlm_cache_config_t);
+	CONF_PAIR			*cp;
+
+	fr_assert(config);
 
-	mandle = fr_pool_connection_reconnect(driver->pool, request, *handle);
-	if (!mandle) {
-		*handle = NULL;
+	driver->mi = mctx->mi;
+
+	/*
+	 *	The libmemcached configuration string is no longer
+	 *	supported.  Don't silently ignore the servers it sets.
+	 */
+	cp = cf_pair_find(conf, "options");
+	if (cp) {
+		cf_log_err(cp, "'options' is no longer supported.  Use 'server', "
+			   "'port', 'max_get_keys' and 'max_entry_size' instead");
 		return -1;
 	}
-	*handle = mandle;
 
+	if (talloc_array_length(driver->server) == 0) {
+		cf_log_err(conf, "At least one 'server' must be specified");
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("max_get_keys", driver->max_get_keys, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_get_keys", driver->max_get_keys, <=, 1024);
+
+	driver->trunk_conf.req_pool_headers = 3;	/* request, key, command */
+	driver->trunk_conf.req_pool_size = sizeof(memcached_request_t) + MEMCACHED_MAX_KEY_LEN + 64;
+
+	if (config->max_entries > 0) {
+		ERROR("max_entries is not supported by this driver");
+		return -1;
+	}
 	return 0;
 }
 
+/** Find our thread instance from the calling thread
+ *
+ * insert and expire aren't passed thread data.
+ */
+static inline rlm_cache_memcached_thread_t *memcached_thread(rlm_cache_memcached_t const *driver)
+{
+	return talloc_get_type_abort(module_thread(driver->mi)->data, rlm_cache_memcached_thread_t);
+}
+
+/** Free an entry retrieved from memcached
+ *
+ * @copydetails cache_entry_free_t
+ */
+static void cache_entry_free(rlm_cache_entry_t *c)
+{
+	talloc_free(c);
+}
+
+/** Start retrieving a cache entry from memcached
+ *
+ * @copydetails cache_entry_fetch_t
+ */
+static int cache_entry_fetch(cache_fetch_t *fetch, UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+			     void *thread, request_t *request, fr_value_box_t const *key)
+{
+	if (memcached_key_check(request, key) < 0) return -1;
+
+	return memcached_enqueue(talloc_get_type_abort(thread, rlm_cache_memcached_thread_t), request, MEMCACHED_CMD_GET, key, NULL, fetch);
+}
+
+/** Insert a new entry into the data store
+ *
+ * The entry is written asynchronously, we don't wait for the server to store it.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
+					 request_t *request, UNUSED void *handle, const rlm_cache_entry_t *c)
+{
+	rlm_cache_memcached_t	*driver = talloc_get_type_abort(instance, rlm_cache_memcached_t);
+	char			*to_store = NULL;
+	size_t			len;
+	char			*cmd;
+
+	if (memcached_key_check(request, &c->key) < 0) return CACHE_ERROR;
+
+	if (cache_serialize(NULL, &to_store, c) < 0) return CACHE_ERROR;
+
+	len = to_store ? talloc_array_length(to_store) - 1 : 0;
+	if (len > driver->max_entry_size) {
+		RERROR("Serialized entry (%zu bytes) exceeds max_entry_size", len);
+		talloc_free(to_store);
+		return CACHE_ERROR;
+	}
+
+	MEM(cmd = talloc_typed_asprintf(NULL, "set %.*s 0 %" PRIu64 " %zu\r\n%s\r\n",
+					(int)c->key.vb_length, c->key.vb_strvalue,
+					(uint64_t)fr_unix_time_to_sec(c->expires), len,
+					to_store ? to_store : ""));
+	talloc_free(to_store);
+
+	if (memcached_enqueue(memcached_thread(driver), NULL, MEMCACHED_CMD_SET, &c->key, (uint8_t *)cmd, NULL) < 0) {
+		return CACHE_ERROR;
+	}
+
+	return CACHE_OK;
+}
+
+/** Delete the cache entry from memcached
+ *
+ * The entry is deleted asynchronously, we don't wait for the server to remove it.
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 request_t *request, UNUSED void *handle, fr_value_box_t const *key)
+{
+	rlm_cache_memcached_t	*driver = talloc_get_type_abort(instance, rlm_cache_memcached_t);
+	char			*cmd;
+
+	if (memcached_key_check(request, key) < 0) return CACHE_ERROR;
+
+	MEM(cmd = talloc_typed_asprintf(NULL, "delete %.*s\r\n", (int)key->vb_length, key->vb_strvalue));
+
+	if (memcached_enqueue(memcached_thread(driver), NULL, MEMCACHED_CMD_DELETE, key, (uint8_t *)cmd, NULL) < 0) {
+		return CACHE_ERROR;
+	}
+
+	return CACHE_OK;
+}
+
 extern rlm_cache_driver_t rlm_cache_memcached;
 rlm_cache_driver_t rlm_cache_memcached = {
 	.common = {
-		.magic		= MODULE_MAGIC_INIT,
-		.name		= "cache_memcached",
-		.inst_size	= sizeof(rlm_cache_memcached_t),
-		.config		= driver_config,
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "cache_memcached",
+		.inst_size		= sizeof(rlm_cache_memcached_t),
+		.config			= driver_config,
 
-		.onload		= mod_load,
-		.instantiate	= mod_instantiate
+		.instantiate		= mod_instantiate,
+
+		.thread_inst_size	= sizeof(rlm_cache_memcached_thread_t),
+		.thread_inst_type	= "rlm_cache_memcached_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
 	},
 
 	.free		= cache_entry_free,
 
-	.find		= cache_entry_find,
+	.fetch		= cache_entry_fetch,
 	.insert		= cache_entry_insert,
-	.expire		= cache_entry_expire,
-
-	.acquire	= mod_conn_get,
-	.release	= mod_conn_release,
-	.reconnect	= mod_conn_reconnect
+	.expire		= cache_entry_expire
 };
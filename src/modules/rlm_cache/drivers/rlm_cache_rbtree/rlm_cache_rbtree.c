@@ -22,16 +22,22 @@
  * @copyright 2014 The FreeRADIUS server project
  */
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/memory.h>
 #include <freeradius-devel/util/heap.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/value.h>
 #include "../../rlm_cache.h"
 
+#include <stdatomic.h>
+
 typedef struct {
 	fr_rb_tree_t			*cache;		//!< Tree for looking up cache keys.
 	fr_heap_t			*heap;		//!< For managing entry expiry.
 
 	pthread_mutex_t			mutex;		//!< Protect the tree from multiple readers/writers.
+
+	_Atomic(uint64_t)		used_bytes;	//!< Memory used by the entries.
+	fr_memory_source_t		*memory;	//!< Our entry in the memory accounting registry.
 } rlm_cache_rbtree_mutable_t;
 
 typedef struct {
@@ -43,6 +49,8 @@ typedef struct {
 
 	fr_rb_node_t			node;		//!< Entry used for lookups.
 	fr_heap_index_t			heap_id;	//!< Offset used for expiry heap.
+
+	size_t				size;		//!< Added to used_bytes when inserted.
 } rlm_cache_rb_entry_t;
 
 /** Compare two entries by key
@@ -68,6 +76,17 @@ static int8_t cache_heap_cmp(void const *one, void const *two)
 	return fr_unix_time_cmp(a->expires, b->expires);
 }
 
+/** Remove an entry from the tree and the heap, and free it
+ *
+ */
+static void cache_entry_free(rlm_cache_rbtree_mutable_t *mutable, rlm_cache_entry_t *c)
+{
+	fr_heap_extract(&mutable->heap, c);
+	fr_rb_delete(mutable->cache, c);
+	atomic_fetch_sub(&mutable->used_bytes, ((rlm_cache_rb_entry_t *)c)->size);
+	talloc_free(c);
+}
+
 /** Custom allocation function for the driver
  *
  * Allows allocation of cache entry structures with additional fields.
@@ -111,9 +130,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 	 */
 	c = fr_heap_peek(mutable->heap);
 	if (c && (fr_unix_time_lt(c->expires, fr_time_to_unix_time(request->packet->timestamp)))) {
-		fr_heap_extract(&mutable->heap, c);
-		fr_rb_delete(mutable->cache, c);
-		talloc_free(c);
+		cache_entry_free(mutable, c);
 	}
 
 	fr_value_box_copy_shallow(NULL, &find.key, key);
@@ -152,9 +169,7 @@ static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config
 	c = fr_rb_find(driver->mutable->cache, &find);
 	if (!c) return CACHE_MISS;
 
-	fr_heap_extract(&driver->mutable->heap, c);
-	fr_rb_delete(driver->mutable->cache, c);
-	talloc_free(c);
+	cache_entry_free(driver->mutable, c);
 
 	return CACHE_OK;
 }
@@ -198,6 +213,12 @@ static cache_status_t cache_entry_insert(rlm_cache_config_t const *config, void
 		return CACHE_ERROR;
 	}
 
+	/*
+	 *	The entry doesn't change once it's inserted.
+	 */
+	((rlm_cache_rb_entry_t *)UNCONST(rlm_cache_entry_t *, c))->size = talloc_total_size(c);
+	atomic_fetch_add(&driver->mutable->used_bytes, ((rlm_cache_rb_entry_t const *)c)->size);
+
 	return CACHE_OK;
 }
 
@@ -246,6 +267,34 @@ static uint64_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void
 	return fr_rb_num_elements(driver->mutable->cache);
 }
 
+/** Visit every entry in the cache
+ *
+ * All entries are in the expiry heap, so walk that.
+ *
+ * @copydetails cache_entry_walk_t
+ */
+static int cache_entry_walk(UNUSED rlm_cache_config_t const *config, void *instance,
+			    cache_entry_walk_cb_t cb, void *uctx)
+{
+	rlm_cache_rbtree_t	*driver = talloc_get_type_abort(instance, rlm_cache_rbtree_t);
+	fr_heap_iter_t		iter;
+	rlm_cache_entry_t	*c;
+	int			ret = 0;
+
+	pthread_mutex_lock(&driver->mutable->mutex);
+	for (c = fr_heap_iter_init(driver->mutable->heap, &iter);
+	     c;
+	     c = fr_heap_iter_next(driver->mutable->heap, &iter)) {
+		if (cb(c, uctx) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&driver->mutable->mutex);
+
+	return ret;
+}
+
 /** Lock the rbtree
  *
  * @note handle not used except for sanity checks.
@@ -282,6 +331,17 @@ static void cache_release(UNUSED rlm_cache_config_t const *config, void *instanc
 	RDEBUG3("Mutex released");
 }
 
+/** Add the cache entries to a memory report
+ *
+ */
+static void cache_memory(fr_memory_usage_t *usage, void const *uctx)
+{
+	rlm_cache_rbtree_mutable_t *mutable = UNCONST(rlm_cache_rbtree_mutable_t *, uctx);
+
+	usage->bytes += atomic_load(&mutable->used_bytes);
+	usage->blocks += fr_rb_num_elements(mutable->cache);
+}
+
 /** Cleanup a cache_rbtree instance
  *
  */
@@ -290,6 +350,8 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 	rlm_cache_rbtree_t		*driver = talloc_get_type_abort(mctx->mi->data, rlm_cache_rbtree_t);
 	rlm_cache_rbtree_mutable_t	*mutable = driver->mutable;
 
+	TALLOC_FREE(mutable->memory);
+
 	if (mutable->cache) {
 		fr_rb_iter_inorder_t	iter;
 		void			*data;
@@ -349,6 +411,14 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		goto error;
 	}
 
+	/*
+	 *	Entries are allocated outside of the instance data,
+	 *	so they need reporting separately.
+	 */
+	MEM(mutable->memory = fr_memory_source_alloc(mutable, "cache",
+						     mctx->mi->parent ? mctx->mi->parent->name : mctx->mi->name,
+						     cache_memory, mutable));
+
 	driver->mutable = mutable;
 
 	return 0;
@@ -371,6 +441,7 @@ rlm_cache_driver_t rlm_cache_rbtree = {
 	.expire		= cache_entry_expire,
 	.set_ttl	= cache_entry_set_ttl,
 	.count		= cache_entry_count,
+	.walk		= cache_entry_walk,
 
 	.acquire	= cache_acquire,
 	.release	= cache_release,
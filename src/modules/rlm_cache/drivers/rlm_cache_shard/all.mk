@@ -0,0 +1,4 @@
+TARGETNAME	:= rlm_cache_shard
+
+TARGET		:= $(TARGETNAME)$(L)
+SOURCES		:= $(TARGETNAME).c
@@ -0,0 +1,463 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_shard.c
+ * @brief Sharded hash table based cache with CLOCK eviction.
+ *
+ * Entries are spread over a fixed number of shards by the hash of their key.
+ * Each shard has its own mutex, so requests operating on different keys
+ * rarely contend.  There's no global expiry heap, expired entries are removed
+ * when they're next looked up, or when the shard needs to reclaim memory.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/value.h>
+#include "../../rlm_cache.h"
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+typedef struct {
+	fr_hash_table_t			*cache;		//!< Hash table for looking up cache keys.
+	fr_dlist_head_t			clock;		//!< Entries in CLOCK order, the head is the hand.
+
+	size_t				memory;		//!< Bytes consumed by entries in this shard.
+
+	pthread_mutex_t			mutex;		//!< Protect the shard from multiple readers/writers.
+} rlm_cache_shard_shard_t;
+
+typedef struct {
+	rlm_cache_shard_shard_t		*shard;		//!< Array of shards.
+	_Atomic(uint64_t)		num_entries;	//!< Total entries across all shards.
+} rlm_cache_shard_mutable_t;
+
+typedef struct {
+	uint32_t			num_shards;	//!< How many shards to split the cache into.
+	size_t				max_memory;	//!< Maximum memory used by entries, across all shards.
+
+	size_t				shard_memory;	//!< max_memory divided between the shards.
+	rlm_cache_shard_mutable_t	*mutable;	//!< Mutable instance data.
+} rlm_cache_shard_t;
+
+typedef struct {
+	rlm_cache_entry_t		fields;		//!< Entry data.
+
+	fr_dlist_t			clock_entry;	//!< Entry in the shard's CLOCK list.
+	bool				referenced;	//!< Entry was hit since the hand last passed it.
+	size_t				size;		//!< Memory accounted to the shard for this entry.
+} rlm_cache_shard_entry_t;
+
+/** Handle recording which shard the current request has locked
+ *
+ */
+typedef struct {
+	rlm_cache_shard_shard_t		*locked;	//!< Shard we currently hold the mutex for.
+} rlm_cache_shard_handle_t;
+
+static conf_parser_t driver_config[] = {
+	{ FR_CONF_OFFSET("shards", rlm_cache_shard_t, num_shards), .dflt = "16" },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("max_memory", FR_TYPE_SIZE, 0, rlm_cache_shard_t, max_memory), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_entry_t const *c = data;
+
+	return fr_value_box_hash(&c->key);
+}
+
+static int8_t cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one, *b = two;
+
+	return fr_value_box_cmp(&a->key, &b->key);
+}
+
+/** Lock the shard responsible for a key
+ *
+ * If the handle already holds a different shard, that shard is released first,
+ * so a request never holds more than one shard mutex at a time.
+ */
+static rlm_cache_shard_shard_t *cache_shard_lock(rlm_cache_shard_t const *driver, request_t *request,
+						 rlm_cache_shard_handle_t *handle, fr_value_box_t const *key)
+{
+	rlm_cache_shard_shard_t *shard;
+
+	shard = &driver->mutable->shard[fr_value_box_hash(key) & (driver->num_shards - 1)];
+	if (handle->locked == shard) return shard;
+
+	if (handle->locked) {
+		pthread_mutex_unlock(&handle->locked->mutex);
+		RDEBUG3("Shard %u mutex released", (unsigned int)(handle->locked - driver->mutable->shard));
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+	RDEBUG3("Shard %u mutex acquired", (unsigned int)(shard - driver->mutable->shard));
+	handle->locked = shard;
+
+	return shard;
+}
+
+/** Unlink an entry from a shard and free it
+ *
+ */
+static void cache_shard_entry_free(rlm_cache_shard_t const *driver, rlm_cache_shard_shard_t *shard,
+				   rlm_cache_shard_entry_t *c)
+{
+	fr_hash_table_remove(shard->cache, c);
+	fr_dlist_remove(&shard->clock, c);
+	shard->memory -= c->size;
+	atomic_fetch_sub_explicit(&driver->mutable->num_entries, 1, memory_order_relaxed);
+	talloc_free(c);
+}
+
+/** Reclaim memory from a shard using the CLOCK algorithm
+ *
+ * The hand sits at the head of the list.  Expired entries and entries which have
+ * not been referenced since the hand last passed them are freed, referenced entries
+ * have their bit cleared and get moved behind the hand.
+ *
+ * @param[in] driver	instance.
+ * @param[in] shard	to reclaim memory from.  Must be locked.
+ * @param[in] keep	entry which must not be evicted (the one just inserted).
+ * @param[in] now	used to identify expired entries.
+ */
+static void cache_shard_evict(rlm_cache_shard_t const *driver, rlm_cache_shard_shard_t *shard,
+			      rlm_cache_shard_entry_t *keep, fr_unix_time_t now)
+{
+	size_t				steps = fr_dlist_num_elements(&shard->clock) * 2;
+	rlm_cache_shard_entry_t		*c;
+
+	while ((shard->memory > driver->shard_memory) && (steps-- > 0)) {
+		c = fr_dlist_head(&shard->clock);
+		if (!c) break;
+
+		if ((c == keep) || (c->referenced && !fr_unix_time_lt(c->fields.expires, now))) {
+			c->referenced = false;
+			fr_dlist_remove(&shard->clock, c);
+			fr_dlist_insert_tail(&shard->clock, c);
+			continue;
+		}
+
+		cache_shard_entry_free(driver, shard, c);
+	}
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    request_t *request)
+{
+	rlm_cache_shard_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_shard_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * Expired entries are removed here, rather than by a global expiry heap.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, void *instance,
+				       request_t *request, void *handle, fr_value_box_t const *key)
+{
+	rlm_cache_shard_t	*driver = talloc_get_type_abort(instance, rlm_cache_shard_t);
+	rlm_cache_shard_shard_t	*shard;
+	rlm_cache_entry_t	find = {};
+	rlm_cache_shard_entry_t	*c;
+
+	shard = cache_shard_lock(driver, request, handle, key);
+
+	fr_value_box_copy_shallow(NULL, &find.key, key);
+
+	c = fr_hash_table_find(shard->cache, &find);
+	if (!c) {
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	if (fr_unix_time_lt(c->fields.expires, fr_time_to_unix_time(request->packet->timestamp))) {
+		cache_shard_entry_free(driver, shard, c);
+		*out = NULL;
+		return CACHE_MISS;
+	}
+
+	c->referenced = true;
+	*out = (rlm_cache_entry_t *)c;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 request_t *request, void *handle,
+					 fr_value_box_t const *key)
+{
+	rlm_cache_shard_t	*driver = talloc_get_type_abort(instance, rlm_cache_shard_t);
+	rlm_cache_shard_shard_t	*shard;
+	rlm_cache_entry_t	find = {};
+	rlm_cache_shard_entry_t	*c;
+
+	if (!request) return CACHE_ERROR;
+
+	shard = cache_shard_lock(driver, request, handle, key);
+
+	fr_value_box_copy_shallow(NULL, &find.key, key);
+
+	c = fr_hash_table_find(shard->cache, &find);
+	if (!c) return CACHE_MISS;
+
+	cache_shard_entry_free(driver, shard, c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * Replaces any existing entry with the same key, then runs the CLOCK hand
+ * if the shard is over its share of max_memory.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
+					 request_t *request, void *handle,
+					 rlm_cache_entry_t const *entry)
+{
+	rlm_cache_shard_t	*driver = talloc_get_type_abort(instance, rlm_cache_shard_t);
+	rlm_cache_shard_shard_t	*shard;
+	rlm_cache_shard_entry_t	*c = UNCONST(rlm_cache_shard_entry_t *, entry), *old;
+
+	if (!request) return CACHE_ERROR;
+
+	shard = cache_shard_lock(driver, request, handle, &entry->key);
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = fr_hash_table_find(shard->cache, c);
+	if (old) cache_shard_entry_free(driver, shard, old);
+
+	if (!fr_hash_table_insert(shard->cache, c)) {
+		RERROR("Failed adding entry");
+		return CACHE_ERROR;
+	}
+
+	c->size = talloc_total_size(c);
+	c->referenced = false;
+	fr_dlist_insert_tail(&shard->clock, c);
+	shard->memory += c->size;
+	atomic_fetch_add_explicit(&driver->mutable->num_entries, 1, memory_order_relaxed);
+
+	if (driver->shard_memory && (shard->memory > driver->shard_memory)) {
+		cache_shard_evict(driver, shard, c, fr_time_to_unix_time(request->packet->timestamp));
+	}
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * Expiry is checked lazily against the entry itself, so there's nothing
+ * to reorder.
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					  request_t *request, UNUSED void *handle,
+					  UNUSED rlm_cache_entry_t *c)
+{
+	if (!request) return CACHE_ERROR;
+
+	return CACHE_OK;
+}
+
+/** Return the number of entries in the cache
+ *
+ * Read from a counter so we don't need to take the mutex of every shard.
+ *
+ * @copydetails cache_entry_count_t
+ */
+static uint64_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *instance,
+				  UNUSED request_t *request, UNUSED void *handle)
+{
+	rlm_cache_shard_t *driver = talloc_get_type_abort(instance, rlm_cache_shard_t);
+
+	return atomic_load_explicit(&driver->mutable->num_entries, memory_order_relaxed);
+}
+
+/** Allocate a handle
+ *
+ * Shards are locked as operations are performed on keys, not here.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+			 request_t *request)
+{
+	rlm_cache_shard_handle_t *h;
+
+	MEM(h = talloc_zero(request, rlm_cache_shard_handle_t));
+	*handle = h;
+
+	return 0;
+}
+
+/** Release a handle, unlocking any shard it holds
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, void *instance, request_t *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_shard_t		*driver = talloc_get_type_abort(instance, rlm_cache_shard_t);
+	rlm_cache_shard_handle_t	*h = talloc_get_type_abort(handle, rlm_cache_shard_handle_t);
+
+	if (h->locked) {
+		pthread_mutex_unlock(&h->locked->mutex);
+		RDEBUG3("Shard %u mutex released", (unsigned int)(h->locked - driver->mutable->shard));
+	}
+	talloc_free(h);
+}
+
+/** Cleanup a cache_shard instance
+ *
+ */
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_cache_shard_t		*driver = talloc_get_type_abort(mctx->mi->data, rlm_cache_shard_t);
+	rlm_cache_shard_mutable_t	*mutable = driver->mutable;
+	uint32_t			i;
+
+	if (!mutable) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_shard_shard_t	*shard = &mutable->shard[i];
+		rlm_cache_shard_entry_t	*c;
+
+		if (!shard->cache) continue;
+
+		while ((c = fr_dlist_pop_head(&shard->clock))) {
+			fr_hash_table_remove(shard->cache, c);
+			talloc_free(c);
+		}
+
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	TALLOC_FREE(driver->mutable);
+
+	return 0;
+}
+
+/** Create a new cache_shard instance
+ *
+ * @param[in] mctx		Data required for instantiation.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	rlm_cache_shard_t		*driver = talloc_get_type_abort(mctx->mi->data, rlm_cache_shard_t);
+	rlm_cache_shard_mutable_t	*mutable;
+	uint32_t			i;
+	int				ret;
+
+	if (!driver->num_shards || (driver->num_shards & (driver->num_shards - 1)) ||
+	    (driver->num_shards > 1024)) {
+		cf_log_err(mctx->mi->conf, "'shards' must be a power of 2 between 1 and 1024");
+		return -1;
+	}
+
+	driver->shard_memory = driver->max_memory / driver->num_shards;
+	if (driver->max_memory && !driver->shard_memory) driver->shard_memory = 1;
+
+	MEM(mutable = talloc_zero(NULL, rlm_cache_shard_mutable_t));
+	MEM(mutable->shard = talloc_zero_array(mutable, rlm_cache_shard_shard_t, driver->num_shards));
+	atomic_init(&mutable->num_entries, 0);
+
+	for (i = 0; i < driver->num_shards; i++) {
+		rlm_cache_shard_shard_t *shard = &mutable->shard[i];
+
+		shard->cache = fr_hash_table_alloc(mutable->shard, cache_entry_hash, cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+		error:
+			driver->mutable = mutable;
+			mod_detach(&(module_detach_ctx_t){ .mi = mctx->mi });
+			return -1;
+		}
+		fr_dlist_talloc_init(&shard->clock, rlm_cache_shard_entry_t, clock_entry);
+
+		if ((ret = pthread_mutex_init(&shard->mutex, NULL)) != 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(ret));
+			shard->cache = NULL;
+			goto error;
+		}
+	}
+
+	driver->mutable = mutable;
+
+	return 0;
+}
+
+extern rlm_cache_driver_t rlm_cache_shard;
+rlm_cache_driver_t rlm_cache_shard = {
+	.common = {
+		.magic		= MODULE_MAGIC_INIT,
+		.name		= "cache_shard",
+		.config		= driver_config,
+		.instantiate	= mod_instantiate,
+		.detach		= mod_detach,
+		.inst_size	= sizeof(rlm_cache_shard_t),
+		.inst_type	= "rlm_cache_shard_t",
+	},
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+	.count		= cache_entry_count,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+};
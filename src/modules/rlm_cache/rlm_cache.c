@@ -33,12 +33,16 @@ RCSID("$Id$")
 #include <freeradius-devel/server/rcode.h>
 #include <freeradius-devel/server/tmpl.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/types.h>
 #include <freeradius-devel/util/value.h>
 #include <freeradius-devel/unlang/xlat_func.h>
 #include <freeradius-devel/unlang/call_env.h>
 
 #include "rlm_cache.h"
+#include "serialize.h"
+#include "snapshot.h"
 
 extern module_rlm_t rlm_cache;
 
@@ -46,15 +50,36 @@ int submodule_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, con
 static int cache_key_parse(TALLOC_CTX *ctx, void *out, tmpl_rules_t const *t_rules, CONF_ITEM *ci, call_env_ctx_t const *cec, call_env_parser_t const *rule);
 static int cache_update_section_parse(TALLOC_CTX *ctx, call_env_parsed_head_t *out, tmpl_rules_t const *t_rules, CONF_ITEM *ci, call_env_ctx_t const *cec, call_env_parser_t const *rule);
 
+static const conf_parser_t l1_config[] = {
+	{ FR_CONF_OFFSET("max_entries", rlm_cache_l1_config_t, max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("ttl", rlm_cache_l1_config_t, ttl), .dflt = "5s" },
+	{ FR_CONF_OFFSET("negative_ttl", rlm_cache_l1_config_t, negative_ttl), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static const conf_parser_t snapshot_config[] = {
+	{ FR_CONF_OFFSET_FLAGS("filename", CONF_FLAG_FILE_OUTPUT, rlm_cache_snapshot_config_t, filename) },
+	{ FR_CONF_OFFSET("interval", rlm_cache_snapshot_config_t, interval), .dflt = "300s" },
+	{ FR_CONF_OFFSET("warm_up", rlm_cache_snapshot_config_t, warm_up), .dflt = "0" },
+	{ FR_CONF_OFFSET("namespace", rlm_cache_snapshot_config_t, namespace_name) },
+	CONF_PARSER_TERMINATOR
+};
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_TYPE_FLAGS("driver", FR_TYPE_VOID, 0, rlm_cache_t, driver_submodule), .dflt = "rbtree",
 			 .func = submodule_parse },
 	{ FR_CONF_OFFSET("ttl", rlm_cache_config_t, ttl), .dflt = "500s" },
+	{ FR_CONF_OFFSET("ttl_jitter", rlm_cache_t, refresh.jitter), .dflt = "0" },
+	{ FR_CONF_OFFSET("stale_ttl", rlm_cache_t, refresh.stale), .dflt = "0" },
+	{ FR_CONF_OFFSET("lock_timeout", rlm_cache_t, refresh.lock_timeout), .dflt = "0" },
 	{ FR_CONF_OFFSET("max_entries", rlm_cache_config_t, max_entries), .dflt = "0" },
 
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", rlm_cache_config_t, stats), .dflt = "no" },
+	{ FR_CONF_OFFSET("intern", rlm_cache_config_t, intern), .dflt = "no" },
+	{ FR_CONF_OFFSET_SUBSECTION("l1", 0, rlm_cache_t, l1, l1_config) },
+	{ FR_CONF_OFFSET_SUBSECTION("snapshot", 0, rlm_cache_t, snapshot_config, snapshot_config) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -68,6 +93,22 @@ typedef struct {
 
 } cache_htrie_t;
 
+/** An entry in the thread local L1 cache
+ *
+ */
+typedef struct {
+	fr_value_box_t		key;			//!< Key used to identify entry.
+	fr_unix_time_t		expires;		//!< When the local copy must be discarded.
+	char			*data;			//!< Serialized entry, or NULL if this is a negative entry.
+	size_t			len;			//!< Length of the serialized entry.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} cache_l1_entry_t;
+
+typedef struct {
+	fr_hash_table_t		*cache;			//!< L1 entries, indexed by key.
+	fr_dlist_head_t		lru;			//!< L1 entries, least recently used first.
+} rlm_cache_thread_t;
+
 static const call_env_method_t cache_method_env = {
 	FR_CALL_ENV_METHOD_OUT(cache_call_env_t),
 	.env = (call_env_parser_t[]) {
@@ -233,6 +274,482 @@ static void cache_free(rlm_cache_t const *inst, rlm_cache_entry_t **c)
 	*c = NULL;
 }
 
+/** When an entry needs refreshing
+ *
+ */
+static inline fr_unix_time_t cache_fresh_until(rlm_cache_t const *inst, rlm_cache_entry_t const *c)
+{
+	return fr_unix_time_sub(c->expires, inst->refresh.stale);
+}
+
+static uint32_t cache_l1_hash(void const *data)
+{
+	cache_l1_entry_t const *e = data;
+
+	return fr_value_box_hash(&e->key);
+}
+
+static int8_t cache_l1_cmp(void const *one, void const *two)
+{
+	cache_l1_entry_t const *a = one, *b = two;
+
+	return fr_value_box_cmp(&a->key, &b->key);
+}
+
+static void cache_l1_remove(rlm_cache_thread_t *t, cache_l1_entry_t *e)
+{
+	fr_hash_table_remove(t->cache, e);
+	fr_dlist_remove(&t->lru, e);
+	talloc_free(e);
+}
+
+/** Discard the L1 copy of an entry
+ *
+ * Only affects the calling thread.  Other threads will hold onto their copies
+ * until the L1 ttl elapses.
+ */
+static void cache_l1_invalidate(rlm_cache_thread_t *t, fr_value_box_t const *key)
+{
+	cache_l1_entry_t	find = {}, *e;
+
+	if (!t || !t->cache) return;
+
+	fr_value_box_copy_shallow(NULL, &find.key, key);
+
+	e = fr_hash_table_find(t->cache, &find);
+	if (e) cache_l1_remove(t, e);
+}
+
+/** Check whether the L1 cache can answer a lookup
+ *
+ * @return true if there's an unexpired positive or negative entry for the key.
+ */
+static bool cache_l1_contains(rlm_cache_thread_t *t, request_t *request, fr_value_box_t const *key)
+{
+	cache_l1_entry_t	find = {}, *e;
+
+	if (!t || !t->cache) return false;
+
+	fr_value_box_copy_shallow(NULL, &find.key, key);
+
+	e = fr_hash_table_find(t->cache, &find);
+	if (!e) return false;
+
+	return !fr_unix_time_lt(e->expires, fr_time_to_unix_time(request->packet->timestamp));
+}
+
+/** Retrieve an entry from the L1 cache
+ *
+ * Positive entries are deserialized into a new #rlm_cache_entry_t parented by
+ * the request, as the driver's free callback may not know how to free it.
+ *
+ * @return
+ *	- 1 if a positive entry was found, *out will point to the entry.
+ *	- 0 if a negative entry was found.
+ *	- -1 if no usable entry was found, and the driver should be queried.
+ */
+static int cache_l1_find(rlm_cache_entry_t **out, rlm_cache_thread_t *t, request_t *request, fr_value_box_t const *key)
+{
+	cache_l1_entry_t	find = {}, *e;
+	rlm_cache_entry_t	*c;
+	char			*buff;
+
+	*out = NULL;
+
+	if (!t || !t->cache) return -1;
+
+	fr_value_box_copy_shallow(NULL, &find.key, key);
+
+	e = fr_hash_table_find(t->cache, &find);
+	if (!e) return -1;
+
+	if (fr_unix_time_lt(e->expires, fr_time_to_unix_time(request->packet->timestamp))) {
+		cache_l1_remove(t, e);
+		return -1;
+	}
+
+	fr_dlist_remove(&t->lru, e);
+	fr_dlist_insert_tail(&t->lru, e);
+
+	if (!e->data) {
+		RDEBUG2("Found negative L1 entry for \"%pV\"", key);
+		return 0;
+	}
+
+	MEM(c = talloc_zero(request, rlm_cache_entry_t));
+	map_list_init(&c->maps);
+	if (unlikely(fr_value_box_copy(c, &c->key, key) < 0)) {
+	error:
+		talloc_free(c);
+		cache_l1_remove(t, e);
+		return -1;
+	}
+
+	/*
+	 *	cache_deserialize() modifies its input
+	 */
+	MEM(buff = talloc_memdup(c, e->data, e->len + 1));
+	if (cache_deserialize(c, request->dict, buff, e->len) < 0) {
+		RPWDEBUG("Discarding invalid L1 entry");
+		goto error;
+	}
+	talloc_free(buff);
+
+	RDEBUG2("Found L1 entry for \"%pV\"", key);
+	*out = c;
+
+	return 1;
+}
+
+/** Store a copy of an entry, or a negative entry, in the L1 cache
+ *
+ * The local copy never outlives the entry held by the driver.
+ */
+static void cache_l1_store(rlm_cache_t const *inst, rlm_cache_thread_t *t, request_t *request,
+			   fr_value_box_t const *key, rlm_cache_entry_t const *c)
+{
+	cache_l1_entry_t	*e;
+	fr_unix_time_t		now;
+
+	if (!t || !t->cache) return;
+	if (!c && !fr_time_delta_ispos(inst->l1.negative_ttl)) return;
+
+	cache_l1_invalidate(t, key);
+
+	now = fr_time_to_unix_time(request->packet->timestamp);
+
+	MEM(e = talloc_zero(t->cache, cache_l1_entry_t));
+	if (unlikely(fr_value_box_copy(e, &e->key, key) < 0)) {
+	error:
+		talloc_free(e);
+		return;
+	}
+
+	if (c) {
+		e->expires = fr_unix_time_add(now, inst->l1.ttl);
+		if (fr_unix_time_lt(cache_fresh_until(inst, c), e->expires)) e->expires = cache_fresh_until(inst, c);
+
+		if (cache_serialize(e, &e->data, c) < 0) {
+			RPWDEBUG("Failed serializing L1 entry");
+			goto error;
+		}
+		e->len = talloc_array_length(e->data) - 1;
+	} else {
+		e->expires = fr_unix_time_add(now, inst->l1.negative_ttl);
+	}
+
+	if (!fr_hash_table_insert(t->cache, e)) goto error;
+	fr_dlist_insert_tail(&t->lru, e);
+
+	while (fr_dlist_num_elements(&t->lru) > inst->l1.max_entries) {
+		cache_l1_remove(t, fr_dlist_head(&t->lru));
+	}
+}
+
+/** Keys which are currently being refreshed
+ *
+ * Shared by all threads.
+ */
+struct rlm_cache_claims_s {
+	fr_hash_table_t		*table;			//!< Claims, indexed by key.
+	pthread_mutex_t		mutex;			//!< Protects the table.
+};
+
+/** A claim on refreshing an entry
+ *
+ * Parented by the request refreshing the entry, so it's released if the
+ * request never stores a new one.
+ */
+typedef struct {
+	fr_value_box_t		key;			//!< Key being refreshed.
+	request_t const		*request;		//!< Request refreshing the entry.
+	rlm_cache_claims_t	*claims;		//!< Table the claim is in.
+} cache_claim_t;
+
+/** Result of #cache_refresh_check
+ *
+ */
+typedef enum {
+	CACHE_REFRESH_NONE = 0,				//!< Use the result of the lookup as it is.
+	CACHE_REFRESH_CLAIMED,				//!< This request refreshes the entry.  Treat the
+							///< lookup as a miss.
+	CACHE_REFRESH_WAIT				//!< Another request is creating the entry.  Wait
+							///< for it, then look it up again.
+} cache_refresh_t;
+
+/** Wait for another request to create an entry
+ *
+ */
+typedef struct {
+	module_method_t		method;			//!< To call again once we're done waiting.
+	fr_time_t		deadline;		//!< When we stop waiting.
+} cache_wait_t;
+
+#define CACHE_WAIT_INTERVAL	fr_time_delta_from_msec(10)
+
+static uint32_t cache_claim_hash(void const *data)
+{
+	cache_claim_t const *claim = data;
+
+	return fr_value_box_hash(&claim->key);
+}
+
+static int8_t cache_claim_cmp(void const *one, void const *two)
+{
+	cache_claim_t const *a = one, *b = two;
+
+	return fr_value_box_cmp(&a->key, &b->key);
+}
+
+static int _cache_claims_free(rlm_cache_claims_t *claims)
+{
+	pthread_mutex_destroy(&claims->mutex);
+
+	return 0;
+}
+
+static int _cache_claim_free(cache_claim_t *claim)
+{
+	pthread_mutex_lock(&claim->claims->mutex);
+	fr_hash_table_delete(claim->claims->table, claim);
+	pthread_mutex_unlock(&claim->claims->mutex);
+
+	return 0;
+}
+
+/** Claim the refresh of an entry
+ *
+ * @return
+ *	- 1 if the request holds the claim.
+ *	- 0 if another request holds the claim.
+ *	- -1 on error.
+ */
+static int cache_claim(rlm_cache_t const *inst, request_t *request, fr_value_box_t const *key)
+{
+	rlm_cache_claims_t	*claims = inst->claims;
+	cache_claim_t		find = {}, *claim;
+	int			ret = -1;
+
+	fr_value_box_copy_shallow(NULL, &find.key, key);
+
+	pthread_mutex_lock(&claims->mutex);
+	claim = fr_hash_table_find(claims->table, &find);
+	if (claim) {
+		ret = (claim->request == request);
+		goto finish;
+	}
+
+	MEM(claim = talloc_zero(request, cache_claim_t));
+	if (unlikely(fr_value_box_copy(claim, &claim->key, key) < 0)) {
+	error:
+		talloc_free(claim);
+		goto finish;
+	}
+	claim->request = request;
+	claim->claims = claims;
+
+	if (!fr_hash_table_insert(claims->table, claim)) goto error;
+	talloc_set_destructor(claim, _cache_claim_free);
+	ret = 1;
+
+finish:
+	pthread_mutex_unlock(&claims->mutex);
+
+	return ret;
+}
+
+/** Release a claim on refreshing an entry, if the request holds one
+ *
+ */
+static void cache_claim_release(rlm_cache_t const *inst, request_t *request, fr_value_box_t const *key)
+{
+	rlm_cache_claims_t	*claims = inst->claims;
+	cache_claim_t		find = {}, *claim;
+
+	if (!claims) return;
+
+	fr_value_box_copy_shallow(NULL, &find.key, key);
+
+	pthread_mutex_lock(&claims->mutex);
+	claim = fr_hash_table_find(claims->table, &find);
+	if (!claim || (claim->request != request)) {
+		pthread_mutex_unlock(&claims->mutex);
+		return;
+	}
+	fr_hash_table_delete(claims->table, claim);
+	talloc_set_destructor(claim, NULL);
+	pthread_mutex_unlock(&claims->mutex);
+
+	talloc_free(claim);
+}
+
+/** Check whether another request holds a claim on refreshing an entry
+ *
+ */
+static bool cache_claim_busy(rlm_cache_t const *inst, request_t *request, fr_value_box_t const *key)
+{
+	rlm_cache_claims_t	*claims = inst->claims;
+	cache_claim_t		find = {}, *claim;
+	bool			busy;
+
+	fr_value_box_copy_shallow(NULL, &find.key, key);
+
+	pthread_mutex_lock(&claims->mutex);
+	claim = fr_hash_table_find(claims->table, &find);
+	busy = claim && (claim->request != request);
+	pthread_mutex_unlock(&claims->mutex);
+
+	return busy;
+}
+
+/** Calculate when an entry should be removed from the cache
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] request	The current request.
+ * @param[in] ttl	How long the entry is fresh for.
+ * @return The TTL, plus a random amount of jitter, plus the stale window,
+ *	from the time the request was received.
+ */
+static fr_unix_time_t cache_expires(rlm_cache_t const *inst, request_t *request, fr_time_delta_t ttl)
+{
+	if (fr_time_delta_ispos(inst->refresh.jitter)) {
+		uint64_t rnd = (((uint64_t)fr_rand()) << 32) | fr_rand();
+
+		ttl = fr_time_delta_add(ttl, fr_time_delta_wrap(rnd % (uint64_t)fr_time_delta_unwrap(inst->refresh.jitter)));
+	}
+
+	return fr_unix_time_add(fr_unix_time_add(fr_time_to_unix_time(request->packet->timestamp), ttl),
+				inst->refresh.stale);
+}
+
+/** Whether an entry is in its stale window
+ *
+ */
+static inline bool cache_entry_stale(rlm_cache_t const *inst, request_t *request, rlm_cache_entry_t const *c)
+{
+	if (!fr_time_delta_ispos(inst->refresh.stale)) return false;
+
+	return fr_unix_time_lt(cache_fresh_until(inst, c), fr_time_to_unix_time(request->packet->timestamp));
+}
+
+/** Decide what to do after looking up an entry which may need refreshing
+ *
+ * Only one request refreshes an entry at a time.  Whilst it's doing so, other
+ * requests use the stale entry if there is one, or wait for the new entry.
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] request	The current request.
+ * @param[in] key	which was looked up.
+ * @param[in] c		The entry which was found, or NULL on a miss.
+ * @return What the caller should do next.
+ */
+static cache_refresh_t cache_refresh_check(rlm_cache_t const *inst, request_t *request,
+					   fr_value_box_t const *key, rlm_cache_entry_t const *c)
+{
+	if (!inst->claims) return CACHE_REFRESH_NONE;
+
+	if (c && !cache_entry_stale(inst, request, c)) return CACHE_REFRESH_NONE;
+
+	switch (cache_claim(inst, request, key)) {
+	case 1:
+		if (c) RDEBUG2("Entry for \"%pV\" is stale, refreshing it", key);
+		return CACHE_REFRESH_CLAIMED;
+
+	case 0:
+		if (c) {
+			RDEBUG2("Entry for \"%pV\" is stale, using it whilst another request refreshes it", key);
+			return CACHE_REFRESH_NONE;
+		}
+
+		/*
+		 *	Only wait once per key.  If the other request
+		 *	is still creating the entry, act as if we
+		 *	missed.
+		 */
+		if (!fr_time_delta_ispos(inst->refresh.lock_timeout) ||
+		    request_data_reference(request, inst->claims, fr_value_box_hash(key))) return CACHE_REFRESH_NONE;
+		return CACHE_REFRESH_WAIT;
+
+	default:
+		RPWDEBUG("Failed claiming refresh of \"%pV\"", key);
+		return CACHE_REFRESH_NONE;
+	}
+}
+
+static void cache_wait_timeout(UNUSED module_ctx_t const *mctx, request_t *request, UNUSED fr_time_t fired)
+{
+	unlang_interpret_mark_runnable(request);
+}
+
+static void cache_wait_signal(module_ctx_t const *mctx, request_t *request, UNUSED fr_signal_t action)
+{
+	(void) unlang_module_timeout_delete(request, mctx->rctx);
+}
+
+/** Check whether the other request is done yet, or call the method again
+ *
+ */
+static unlang_action_t cache_wait_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
+	cache_call_env_t	*env = talloc_get_type_abort(mctx->env_data, cache_call_env_t);
+	cache_wait_t		*wait = talloc_get_type_abort(mctx->rctx, cache_wait_t);
+	module_method_t		method = wait->method;
+	fr_time_t		now = fr_time();
+
+	if (cache_claim_busy(inst, request, env->key)) {
+		if (fr_time_lt(now, wait->deadline)) {
+			if (unlang_module_timeout_add(request, cache_wait_timeout, wait,
+						      fr_time_add(now, CACHE_WAIT_INTERVAL)) < 0) {
+				talloc_free(wait);
+				RETURN_MODULE_FAIL;
+			}
+			return unlang_module_yield(request, cache_wait_resume, cache_wait_signal, ~FR_SIGNAL_CANCEL, wait);
+		}
+		RDEBUG2("Timed out waiting for another request to create the entry for \"%pV\"", env->key);
+	}
+	talloc_free(wait);
+
+	/*
+	 *	A negative entry in our L1 cache would hide
+	 *	the entry the other request created.
+	 */
+	cache_l1_invalidate(t, env->key);
+
+	return method(p_result, MODULE_CTX(mctx->mi, mctx->thread, mctx->env_data, NULL), request);
+}
+
+/** Wait for another request to create an entry, then call the method again
+ *
+ */
+static unlang_action_t cache_wait(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				  module_method_t method)
+{
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_cache_t);
+	cache_call_env_t	*env = talloc_get_type_abort(mctx->env_data, cache_call_env_t);
+	cache_wait_t		*wait;
+	fr_time_t		now = fr_time();
+
+	RDEBUG2("Another request is creating the entry for \"%pV\", waiting for it", env->key);
+
+	if (request_data_add(request, inst->claims, fr_value_box_hash(env->key),
+			     UNCONST(rlm_cache_t *, inst), false, false, false) < 0) RETURN_MODULE_FAIL;
+
+	MEM(wait = talloc(request, cache_wait_t));
+	*wait = (cache_wait_t){
+		.method = method,
+		.deadline = fr_time_add(now, inst->refresh.lock_timeout)
+	};
+
+	if (unlang_module_timeout_add(request, cache_wait_timeout, wait, fr_time_add(now, CACHE_WAIT_INTERVAL)) < 0) {
+		talloc_free(wait);
+		RETURN_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, cache_wait_resume, cache_wait_signal, ~FR_SIGNAL_CANCEL, wait);
+}
+
 /** Merge a cached entry into a #request_t
  *
  * @return
@@ -280,6 +797,10 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, request_t *request, rlm_
 }
 
 /** Find a cached entry.
+ *
+ * If thread is not NULL, the thread local L1 cache is checked first, and updated
+ * with the result from the driver.  Callers which intend to modify the entry
+ * should pass NULL, so they get the driver's copy.
  *
  * @return
  *	- #RLM_MODULE_OK on cache hit.
@@ -287,17 +808,44 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, request_t *request, rlm_
  *	- #RLM_MODULE_NOTFOUND on cache miss.
  */
 static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out,
-				  rlm_cache_t const *inst, request_t *request,
-				  rlm_cache_handle_t **handle, fr_value_box_t const *key)
+				  rlm_cache_t const *inst, rlm_cache_thread_t *thread, request_t *request,
+				  rlm_cache_handle_t **handle, cache_fetch_t *fetch, fr_value_box_t const *key)
 {
 	cache_status_t ret;
 
 	rlm_cache_entry_t *c;
+	bool from_l1 = false;
 
 	*out = NULL;
 
+	switch (cache_l1_find(&c, thread, request, key)) {
+	case 1:
+		from_l1 = true;
+		goto found;
+
+	case 0:
+		RETURN_MODULE_NOTFOUND;
+
+	default:
+		break;
+	}
+
 	for (;;) {
-		ret = inst->driver->find(&c, &inst->config, inst->driver_submodule->data, request, *handle, key);
+		/*
+		 *	Use the result of the lookup the driver
+		 *	performed before the method was called.
+		 */
+		if (fetch && !fetch->used) {
+			ret = fetch->status;
+			c = fetch->c;
+			fetch->c = NULL;
+			fetch->used = true;
+		} else if (inst->driver->find) {
+			ret = inst->driver->find(&c, &inst->config, inst->driver_submodule->data, request, *handle, key);
+		} else {
+			REDEBUG("Driver can only retrieve entries asynchronously");
+			RETURN_MODULE_FAIL;
+		}
 		switch (ret) {
 		case CACHE_RECONNECT:
 			RDEBUG2("Reconnecting...");
@@ -309,6 +857,7 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 
 		case CACHE_MISS:
 			RDEBUG2("No cache entry found for \"%pV\"", key);
+			cache_l1_store(inst, thread, request, key, NULL);
 			RETURN_MODULE_NOTFOUND;
 
 		default:
@@ -319,6 +868,7 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 		break;
 	}
 
+found:
 	/*
 	 *	Yes, but it expired, OR the "forget all" epoch has
 	 *	passed.  Delete it, and pretend it doesn't exist.
@@ -331,7 +881,8 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 			fr_box_time(request->packet->timestamp));
 
 	expired:
-		inst->driver->expire(&inst->config, inst->driver_submodule->data, request, handle, key);
+		cache_l1_invalidate(thread, key);
+		inst->driver->expire(&inst->config, inst->driver_submodule->data, request, *handle, key);
 		cache_free(inst, &c);
 		RETURN_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
@@ -343,12 +894,120 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 	}
 	RDEBUG2("Found entry for \"%pV\"", key);
 
+	if (!from_l1) cache_l1_store(inst, thread, request, key, c);
+
 	c->hits++;
 	*out = c;
 
 	RETURN_MODULE_OK;
 }
 
+/** Free any entry which was retrieved, but never used
+ *
+ */
+static int _cache_fetch_free(cache_fetch_t *fetch)
+{
+	if (fetch->treq) trunk_request_signal_cancel(fetch->treq);
+	talloc_free(fetch->c);
+
+	return 0;
+}
+
+/** Determine whether the driver needs to retrieve an entry before a method runs
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] thread	L1 cache the method will check, may be NULL.
+ * @param[in] rctx	The method's resume ctx.  If set, the lookup has already happened.
+ * @param[in] request	The current request.
+ * @param[in] key	The method will look up.
+ */
+static bool cache_fetch_required(rlm_cache_t const *inst, rlm_cache_thread_t *thread, void *rctx,
+				 request_t *request, fr_value_box_t const *key)
+{
+	if (!inst->driver->fetch || rctx) return false;
+
+	return !cache_l1_contains(thread, request, key);
+}
+
+/** Have the driver start retrieving an entry
+ *
+ * @return
+ *	- A new #cache_fetch_t, parented by the request.
+ *	- NULL on failure.
+ */
+static cache_fetch_t *cache_fetch_start(rlm_cache_t const *inst, request_t *request, fr_value_box_t const *key)
+{
+	cache_fetch_t	*fetch;
+
+	MEM(fetch = talloc_zero(request, cache_fetch_t));
+	fetch->status = CACHE_ERROR;
+	talloc_set_destructor(fetch, _cache_fetch_free);
+
+	if (inst->driver->fetch(fetch, &inst->config, inst->driver_submodule->data,
+				module_thread(inst->driver_submodule)->data, request, key) < 0) {
+		talloc_free(fetch);
+		return NULL;
+	}
+
+	return fetch;
+}
+
+/** Cancel an outstanding lookup
+ *
+ */
+static void cache_fetch_signal(module_ctx_t const *mctx, UNUSED request_t *request, UNUSED fr_signal_t action)
+{
+	cache_fetch_t	*fetch = talloc_get_type_abort(mctx->rctx, cache_fetch_t);
+
+	if (!fetch->treq) return;
+
+	trunk_request_signal_cancel(fetch->treq);
+	fetch->treq = NULL;
+}
+
+/** Retrieve an entry without blocking, then call the method again
+ *
+ * The method receives the #cache_fetch_t as its rctx, and should pass it to #cache_find.
+ */
+static unlang_action_t cache_fetch(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				   fr_value_box_t const *key, module_method_t resume)
+{
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_cache_t);
+	cache_fetch_t		*fetch;
+
+	fetch = cache_fetch_start(inst, request, key);
+	if (!fetch) RETURN_MODULE_FAIL;
+
+	return unlang_module_yield(request, resume, cache_fetch_signal, ~FR_SIGNAL_CANCEL, fetch);
+}
+
+/** Cancel an outstanding lookup started by an xlat
+ *
+ */
+static void cache_xlat_fetch_signal(xlat_ctx_t const *xctx, UNUSED request_t *request, UNUSED fr_signal_t action)
+{
+	cache_fetch_t	*fetch = talloc_get_type_abort(xctx->rctx, cache_fetch_t);
+
+	if (!fetch->treq) return;
+
+	trunk_request_signal_cancel(fetch->treq);
+	fetch->treq = NULL;
+}
+
+/** Retrieve an entry without blocking, then call the xlat again
+ *
+ */
+static xlat_action_t cache_xlat_fetch(request_t *request, rlm_cache_t const *inst, fr_value_box_t const *key,
+				      xlat_func_t resume)
+{
+	cache_fetch_t		*fetch;
+
+	fetch = cache_fetch_start(inst, request, key);
+	if (!fetch) return XLAT_ACTION_FAIL;
+
+	return unlang_xlat_yield(request, resume, cache_xlat_fetch_signal, ~FR_SIGNAL_CANCEL, fetch);
+}
+
 /** Expire a cache entry (removing it from the datastore)
  *
  * @return
@@ -357,10 +1016,11 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
  *	- #RLM_MODULE_FAIL on failure.
  */
 static unlang_action_t cache_expire(rlm_rcode_t *p_result,
-				    rlm_cache_t const *inst, request_t *request,
+				    rlm_cache_t const *inst, rlm_cache_thread_t *thread, request_t *request,
 				    rlm_cache_handle_t **handle, fr_value_box_t const *key)
 {
 	RDEBUG2("Expiring cache entry");
+	cache_l1_invalidate(thread, key);
 	for (;;) switch (inst->driver->expire(&inst->config, inst->driver_submodule->data, request, *handle, key)) {
 	case CACHE_RECONNECT:
 		if (cache_reconnect(handle, inst, request) == 0) continue;
@@ -384,8 +1044,19 @@ static unlang_action_t cache_expire(rlm_rcode_t *p_result,
  *	- #RLM_MODULE_UPDATED if we merged the cache entry.
  *	- #RLM_MODULE_FAIL on failure.
  */
+/** Release an interned value when the cache entry holding it is freed
+ *
+ */
+static int _cache_value_free(tmpl_t *vpt)
+{
+	fr_value_box_clear_value(tmpl_value(vpt));
+
+	return 0;
+}
+
 static unlang_action_t cache_insert(rlm_rcode_t *p_result,
-				    rlm_cache_t const *inst, request_t *request, rlm_cache_handle_t **handle,
+				    rlm_cache_t const *inst, rlm_cache_thread_t *thread,
+				    request_t *request, rlm_cache_handle_t **handle,
 				    fr_value_box_t const *key, map_list_t const *maps, fr_time_delta_t ttl)
 {
 	map_t			const *map = NULL;
@@ -398,7 +1069,7 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 	TALLOC_CTX		*pool;
 
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_submodule->data, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_submodule->data, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		RETURN_MODULE_FAIL;
 	}
@@ -417,8 +1088,8 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 	/*
 	 *	All in NSEC resolution
 	 */
-	c->created = c->expires = fr_time_to_unix_time(request->packet->timestamp);
-	c->expires = fr_unix_time_add(c->expires, ttl);
+	c->created = fr_time_to_unix_time(request->packet->timestamp);
+	c->expires = cache_expires(inst, request, ttl);
 
 	RDEBUG2("Creating new cache entry");
 
@@ -511,6 +1182,18 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 					talloc_free(c);
 					RETURN_MODULE_FAIL;
 				}
+
+				/*
+				 *	Entries often hold the same values, so let
+				 *	them share a single copy.
+				 */
+				if (inst->config.intern) {
+					if (fr_value_box_intern(tmpl_value(c_map->rhs)) < 0) {
+						RPWDEBUG("Failed interning attribute value");
+					} else if (tmpl_value(c_map->rhs)->interned) {
+						talloc_set_destructor(c_map->rhs, _cache_value_free);
+					}
+				}
 			}
 				break;
 
@@ -545,10 +1228,14 @@ skip_maps:
 
 		case CACHE_OK:
 			RDEBUG2("Committed entry, TTL %pV seconds", fr_box_time_delta(ttl));
+			cache_l1_store(inst, thread, request, key, c);
+			cache_claim_release(inst, request, key);
 			cache_free(inst, &c);
 			RETURN_MODULE_RCODE(merge ? RLM_MODULE_UPDATED : RLM_MODULE_OK);
 
 		default:
+			cache_l1_invalidate(thread, key);
+			cache_claim_release(inst, request, key);
 			talloc_free(c);	/* Failed insertion - use talloc_free not the driver free */
 			RETURN_MODULE_FAIL;
 		}
@@ -562,9 +1249,11 @@ skip_maps:
  *	- #RLM_MODULE_FAIL on failure.
  */
 static unlang_action_t cache_set_ttl(rlm_rcode_t *p_result,
-				     rlm_cache_t const *inst, request_t *request,
+				     rlm_cache_t const *inst, rlm_cache_thread_t *thread, request_t *request,
 				     rlm_cache_handle_t **handle, rlm_cache_entry_t *c)
 {
+	cache_l1_invalidate(thread, &c->key);
+
 	/*
 	 *	Call the driver's insert method to overwrite the old entry
 	 */
@@ -621,6 +1310,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 {
 	rlm_cache_entry_t	*c = NULL;
 	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
 	cache_call_env_t	*env = talloc_get_type_abort(mctx->env_data, cache_call_env_t);
 
 	rlm_cache_handle_t	*handle;
@@ -650,11 +1340,15 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 		RDEBUG3("status-only: yes");
 		REXDENT();
 
+		if (cache_fetch_required(inst, t, mctx->rctx, request, env->key)) {
+			return cache_fetch(p_result, mctx, request, env->key, mod_cache_it);
+		}
+
 		if (cache_acquire(&handle, inst, request) < 0) {
 			RETURN_MODULE_FAIL;
 		}
 
-		cache_find(&rcode, &c, inst, request, &handle, env->key);
+		cache_find(&rcode, &c, inst, t, request, &handle, mctx->rctx, env->key);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 		fr_assert(!inst->driver->acquire || handle);
 
@@ -692,6 +1386,10 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	RDEBUG3("expire : %s", expire ? "yes" : "no");
 	RDEBUG3("ttl    : %pV", fr_box_time_delta(ttl));
 	REXDENT();
+	if ((merge || insert || set_ttl) && cache_fetch_required(inst, set_ttl ? NULL : t, mctx->rctx, request, env->key)) {
+		return cache_fetch(p_result, mctx, request, env->key, mod_cache_it);
+	}
+
 	if (cache_acquire(&handle, inst, request) < 0) {
 		RETURN_MODULE_FAIL;
 	}
@@ -701,7 +1399,25 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	 *	recording whether the entry existed.
 	 */
 	if (merge) {
-		cache_find(&rcode, &c, inst, request, &handle, env->key);
+		cache_find(&rcode, &c, inst, set_ttl ? NULL : t, request, &handle, mctx->rctx, env->key);
+		if (rcode != RLM_MODULE_FAIL) switch (cache_refresh_check(inst, request, env->key, c)) {
+		case CACHE_REFRESH_NONE:
+			break;
+
+		case CACHE_REFRESH_CLAIMED:
+			if (c) {
+				cache_free(inst, &c);
+				c = NULL;
+				rcode = RLM_MODULE_NOTFOUND;
+			}
+			break;
+
+		case CACHE_REFRESH_WAIT:
+			cache_release(inst, request, &handle);
+			talloc_free(mctx->rctx);
+			return cache_wait(p_result, mctx, request, mod_cache_it);
+		}
+
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 			goto finish;
@@ -734,7 +1450,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 			rlm_rcode_t tmp;
 
 			fr_assert(!set_ttl);
-			cache_expire(&tmp, inst, request, &handle, env->key);
+			cache_expire(&tmp, inst, t, request, &handle, env->key);
 			switch (tmp) {
 			case RLM_MODULE_FAIL:
 				rcode = RLM_MODULE_FAIL;
@@ -766,7 +1482,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	if ((exists < 0) && (insert || set_ttl)) {
 		rlm_rcode_t tmp;
 
-		cache_find(&tmp, &c, inst, request, &handle, env->key);
+		cache_find(&tmp, &c, inst, set_ttl ? NULL : t, request, &handle, mctx->rctx, env->key);
 		switch (tmp) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -795,9 +1511,9 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 
 		fr_assert(c);
 
-		c->expires = fr_unix_time_add(fr_time_to_unix_time(request->packet->timestamp), ttl);
+		c->expires = cache_expires(inst, request, ttl);
 
-		cache_set_ttl(&tmp, inst, request, &handle, c);
+		cache_set_ttl(&tmp, inst, t, request, &handle, c);
 		switch (tmp) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -822,7 +1538,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	if (insert && (exists == 0)) {
 		rlm_rcode_t tmp;
 
-		cache_insert(&tmp, inst, request, &handle, env->key, env->maps, ttl);
+		cache_insert(&tmp, inst, t, request, &handle, env->key, env->maps, ttl);
 		switch (tmp) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -847,6 +1563,7 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 finish:
 	cache_free(inst, &c);
 	cache_release(inst, request, &handle);
+	talloc_free(mctx->rctx);
 
 	/*
 	 *	Clear control attributes
@@ -891,6 +1608,7 @@ xlat_action_t cache_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 {
 	rlm_cache_entry_t 		*c = NULL;
 	rlm_cache_t			*inst = talloc_get_type_abort(xctx->mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t		*t = talloc_get_type_abort(xctx->mctx->thread, rlm_cache_thread_t);
 	cache_call_env_t		*env = talloc_get_type_abort(xctx->env_data, cache_call_env_t);
 	rlm_cache_handle_t		*handle = NULL;
 
@@ -903,6 +1621,10 @@ xlat_action_t cache_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	map_t				*map = NULL;
 	rlm_rcode_t			rcode = RLM_MODULE_NOOP;
 
+	if (cache_fetch_required(inst, t, xctx->rctx, request, env->key)) {
+		return cache_xlat_fetch(request, inst, env->key, cache_xlat);
+	}
+
 	slen = tmpl_afrom_attr_substr(ctx, NULL, &target,
 				      &FR_SBUFF_IN(attr->vb_strvalue, attr->vb_length),
 				      NULL,
@@ -923,7 +1645,8 @@ xlat_action_t cache_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 		return XLAT_ACTION_FAIL;
 	}
 
-	cache_find(&rcode, &c, inst, request, &handle, env->key);
+	cache_find(&rcode, &c, inst, t, request, &handle, xctx->rctx, env->key);
+	talloc_free(xctx->rctx);
 	switch (rcode) {
 	case RLM_MODULE_OK:		/* found */
 		break;
@@ -964,6 +1687,7 @@ static xlat_action_t cache_ttl_get_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 
 	rlm_cache_entry_t	*c = NULL;
 	rlm_cache_t		*inst = talloc_get_type_abort(xctx->mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(xctx->mctx->thread, rlm_cache_thread_t);
 	cache_call_env_t	*env = talloc_get_type_abort(xctx->env_data, cache_call_env_t);
 	rlm_cache_handle_t	*handle = NULL;
 
@@ -971,11 +1695,16 @@ static xlat_action_t cache_ttl_get_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 
 	fr_value_box_t		*vb;
 
+	if (cache_fetch_required(inst, t, xctx->rctx, request, env->key)) {
+		return cache_xlat_fetch(request, inst, env->key, cache_ttl_get_xlat);
+	}
+
 	if (cache_acquire(&handle, inst, request) < 0) {
 		return XLAT_ACTION_FAIL;
 	}
 
-	cache_find(&rcode, &c, inst, request, &handle, env->key);
+	cache_find(&rcode, &c, inst, t, request, &handle, xctx->rctx, env->key);
+	talloc_free(xctx->rctx);
 	switch (rcode) {
 	case RLM_MODULE_OK:		/* found */
 		break;
@@ -986,7 +1715,7 @@ static xlat_action_t cache_ttl_get_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	}
 
 	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_TIME_DELTA, NULL));
-	vb->vb_time_delta = fr_unix_time_sub(c->expires, fr_time_to_unix_time(request->packet->timestamp));
+	vb->vb_time_delta = fr_unix_time_sub(cache_fresh_until(inst, c), fr_time_to_unix_time(request->packet->timestamp));
 	fr_dcursor_append(out, vb);
 
 	cache_free(inst, &c);
@@ -1044,6 +1773,7 @@ static void cache_unref(request_t *request, rlm_cache_t const *inst, rlm_cache_e
 static unlang_action_t CC_HINT(nonnull) mod_method_status(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_cache_t const	*inst = talloc_get_type_abort(mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
 	cache_call_env_t	*env = talloc_get_type_abort(mctx->env_data, cache_call_env_t);
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 	rlm_cache_entry_t 	*entry = NULL;
@@ -1055,13 +1785,18 @@ static unlang_action_t CC_HINT(nonnull) mod_method_status(rlm_rcode_t *p_result,
 	}
 
 	/* Good to go? */
+	if (cache_fetch_required(inst, t, mctx->rctx, request, env->key)) {
+		return cache_fetch(p_result, mctx, request, env->key, mod_method_status);
+	}
+
 	if (cache_acquire(&handle, inst, request) < 0) {
 		RETURN_MODULE_FAIL;
 	}
 
 	fr_assert(!inst->driver->acquire || handle);
 
-	cache_find(&rcode, &entry, inst, request, &handle, env->key);
+	cache_find(&rcode, &entry, inst, t, request, &handle, mctx->rctx, env->key);
+	talloc_free(mctx->rctx);
 	if (rcode == RLM_MODULE_FAIL) goto finish;
 
 	rcode = (entry) ? RLM_MODULE_OK : RLM_MODULE_NOTFOUND;
@@ -1082,6 +1817,7 @@ finish:
 static unlang_action_t CC_HINT(nonnull) mod_method_load(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_cache_t const	*inst = talloc_get_type_abort(mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
 	cache_call_env_t	*env = talloc_get_type_abort(mctx->env_data, cache_call_env_t);
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 	rlm_cache_entry_t 	*entry = NULL;
@@ -1093,13 +1829,32 @@ static unlang_action_t CC_HINT(nonnull) mod_method_load(rlm_rcode_t *p_result, m
 	}
 
 	/* Good to go? */
+	if (cache_fetch_required(inst, t, mctx->rctx, request, env->key)) {
+		return cache_fetch(p_result, mctx, request, env->key, mod_method_load);
+	}
+
 	if (cache_acquire(&handle, inst, request) < 0) {
 		RETURN_MODULE_FAIL;
 	}
 
-	cache_find(&rcode, &entry, inst, request, &handle, env->key);
+	cache_find(&rcode, &entry, inst, t, request, &handle, mctx->rctx, env->key);
+	talloc_free(mctx->rctx);
 	if (rcode == RLM_MODULE_FAIL) goto finish;
 
+	switch (cache_refresh_check(inst, request, env->key, entry)) {
+	case CACHE_REFRESH_NONE:
+		break;
+
+	case CACHE_REFRESH_CLAIMED:
+		cache_free(inst, &entry);
+		entry = NULL;
+		break;
+
+	case CACHE_REFRESH_WAIT:
+		cache_release(inst, request, &handle);
+		return cache_wait(p_result, mctx, request, mod_method_load);
+	}
+
 	if (!entry) {
 		RDEBUG2("Entry not found to load");
 		rcode = RLM_MODULE_NOTFOUND;
@@ -1124,6 +1879,7 @@ finish:
 static unlang_action_t CC_HINT(nonnull) mod_method_update(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_cache_t const	*inst = talloc_get_type_abort(mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
 	cache_call_env_t	*env = talloc_get_type_abort(mctx->env_data, cache_call_env_t);
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 	fr_time_delta_t		ttl;
@@ -1138,6 +1894,10 @@ static unlang_action_t CC_HINT(nonnull) mod_method_update(rlm_rcode_t *p_result,
 	}
 
 	/* Good to go? */
+	if (cache_fetch_required(inst, NULL, mctx->rctx, request, env->key)) {
+		return cache_fetch(p_result, mctx, request, env->key, mod_method_update);
+	}
+
 	if (cache_acquire(&handle, inst, request) < 0) {
 		RETURN_MODULE_FAIL;
 	}
@@ -1161,7 +1921,8 @@ static unlang_action_t CC_HINT(nonnull) mod_method_update(rlm_rcode_t *p_result,
 	/*
 	 *	We can only alter the TTL on an entry if it exists.
 	 */
-	cache_find(&rcode, &entry, inst, request, &handle, env->key);
+	cache_find(&rcode, &entry, inst, NULL, request, &handle, mctx->rctx, env->key);
+	talloc_free(mctx->rctx);
 	if (rcode == RLM_MODULE_FAIL) goto finish;
 
 	if (rcode == RLM_MODULE_OK) {
@@ -1169,9 +1930,9 @@ static unlang_action_t CC_HINT(nonnull) mod_method_update(rlm_rcode_t *p_result,
 
 		DEBUG3("Updating the TTL -> %pV", fr_box_time_delta(ttl));
 
-		entry->expires = fr_unix_time_add(fr_time_to_unix_time(request->packet->timestamp), ttl);
+		entry->expires = cache_expires(inst, request, ttl);
 
-		cache_set_ttl(&rcode, inst, request, &handle, entry);
+		cache_set_ttl(&rcode, inst, t, request, &handle, entry);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 	}
 
@@ -1185,7 +1946,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_update(rlm_rcode_t *p_result,
 	if (expire) {
 		DEBUG3("Expiring cache entry");
 
-		cache_expire(&rcode, inst, request, &handle, env->key);
+		cache_expire(&rcode, inst, t, request, &handle, env->key);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 	}
 
@@ -1193,7 +1954,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_update(rlm_rcode_t *p_result,
 	 *	Inserts are upserts, so we don't care about the
 	 *	entry state.
 	 */
-	cache_insert(&rcode, inst, request, &handle, env->key, env->maps, ttl);
+	cache_insert(&rcode, inst, t, request, &handle, env->key, env->maps, ttl);
 	if (rcode == RLM_MODULE_OK) rcode = RLM_MODULE_UPDATED;
 
 finish:
@@ -1212,6 +1973,7 @@ finish:
 static unlang_action_t CC_HINT(nonnull) mod_method_store(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_cache_t const	*inst = talloc_get_type_abort(mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
 	cache_call_env_t	*env = talloc_get_type_abort(mctx->env_data, cache_call_env_t);
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 	fr_time_delta_t		ttl;
@@ -1224,6 +1986,10 @@ static unlang_action_t CC_HINT(nonnull) mod_method_store(rlm_rcode_t *p_result,
 		RETURN_MODULE_FAIL;
 	}
 
+	if (cache_fetch_required(inst, t, mctx->rctx, request, env->key)) {
+		return cache_fetch(p_result, mctx, request, env->key, mod_method_store);
+	}
+
 	if (cache_acquire(&handle, inst, request) < 0) {
 		RETURN_MODULE_FAIL;
 	}
@@ -1240,10 +2006,17 @@ static unlang_action_t CC_HINT(nonnull) mod_method_store(rlm_rcode_t *p_result,
 	/*
 	 *	We can only alter the TTL on an entry if it exists.
 	 */
-	cache_find(&rcode, &entry, inst, request, &handle, env->key);
+	cache_find(&rcode, &entry, inst, t, request, &handle, mctx->rctx, env->key);
+	talloc_free(mctx->rctx);
 	switch (rcode) {
-	default:
 	case RLM_MODULE_OK:
+		/*
+		 *	Stale entries are replaced.
+		 */
+		if (cache_entry_stale(inst, request, entry)) break;
+		FALL_THROUGH;
+
+	default:
 		rcode = RLM_MODULE_NOOP;
 		goto finish;
 
@@ -1260,7 +2033,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_store(rlm_rcode_t *p_result,
 	 *	setting the TTL, which precludes performing an
 	 *	insert.
 	 */
-	cache_insert(&rcode, inst, request, &handle, env->key, env->maps, ttl);
+	cache_insert(&rcode, inst, t, request, &handle, env->key, env->maps, ttl);
 
 finish:
 	cache_unref(request, inst, entry, handle);
@@ -1279,6 +2052,7 @@ finish:
 static unlang_action_t CC_HINT(nonnull) mod_method_clear(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_cache_t const	*inst = talloc_get_type_abort(mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
 	cache_call_env_t	*env = talloc_get_type_abort(mctx->env_data, cache_call_env_t);
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 	rlm_cache_entry_t 	*entry = NULL;
@@ -1292,11 +2066,16 @@ static unlang_action_t CC_HINT(nonnull) mod_method_clear(rlm_rcode_t *p_result,
 	}
 
 	/* Good to go? */
+	if (cache_fetch_required(inst, t, mctx->rctx, request, env->key)) {
+		return cache_fetch(p_result, mctx, request, env->key, mod_method_clear);
+	}
+
 	if (cache_acquire(&handle, inst, request) < 0) {
 		RETURN_MODULE_FAIL;
 	}
 
-	cache_find(&rcode, &entry, inst, request, &handle, env->key);
+	cache_find(&rcode, &entry, inst, t, request, &handle, mctx->rctx, env->key);
+	talloc_free(mctx->rctx);
 	if (rcode == RLM_MODULE_FAIL) goto finish;
 
 	if (!entry) {
@@ -1305,7 +2084,7 @@ static unlang_action_t CC_HINT(nonnull) mod_method_clear(rlm_rcode_t *p_result,
 		goto finish;
 	}
 
-	cache_expire(&rcode, inst, request, &handle, env->key);
+	cache_expire(&rcode, inst, t, request, &handle, env->key);
 
 finish:
 	cache_unref(request, inst, entry, handle);
@@ -1323,6 +2102,7 @@ finish:
 static unlang_action_t CC_HINT(nonnull) mod_method_ttl(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_cache_t const	*inst = talloc_get_type_abort(mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
 	cache_call_env_t	*env = talloc_get_type_abort(mctx->env_data, cache_call_env_t);
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 	fr_time_delta_t		ttl;
@@ -1338,6 +2118,10 @@ static unlang_action_t CC_HINT(nonnull) mod_method_ttl(rlm_rcode_t *p_result, mo
 	}
 
 	/* Good to go? */
+	if (cache_fetch_required(inst, NULL, mctx->rctx, request, env->key)) {
+		return cache_fetch(p_result, mctx, request, env->key, mod_method_ttl);
+	}
+
 	if (cache_acquire(&handle, inst, request) < 0) {
 		RETURN_MODULE_FAIL;
 	}
@@ -1359,7 +2143,8 @@ static unlang_action_t CC_HINT(nonnull) mod_method_ttl(rlm_rcode_t *p_result, mo
 	/*
 	 *	We can only alter the TTL on an entry if it exists.
 	 */
-	cache_find(&rcode, &entry, inst, request, &handle, env->key);
+	cache_find(&rcode, &entry, inst, NULL, request, &handle, mctx->rctx, env->key);
+	talloc_free(mctx->rctx);
 	if (rcode == RLM_MODULE_FAIL) goto finish;
 
 	if (rcode == RLM_MODULE_OK) {
@@ -1367,9 +2152,9 @@ static unlang_action_t CC_HINT(nonnull) mod_method_ttl(rlm_rcode_t *p_result, mo
 
 		DEBUG3("Updating the TTL -> %pV", fr_box_time_delta(ttl));
 
-		entry->expires = fr_unix_time_add(fr_time_to_unix_time(request->packet->timestamp), ttl);
+		entry->expires = cache_expires(inst, request, ttl);
 
-		cache_set_ttl(&rcode, inst, request, &handle, entry);
+		cache_set_ttl(&rcode, inst, t, request, &handle, entry);
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 
 		rcode = RLM_MODULE_UPDATED;
@@ -1381,6 +2166,30 @@ finish:
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/** Allocate the thread local L1 cache
+ *
+ * The driver is only guaranteed to be ready once threads are being
+ * instantiated, so this is also where the snapshot is loaded.
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_cache_t);
+	rlm_cache_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_cache_thread_t);
+
+	if (cache_snapshot_start(mctx->mi) < 0) return -1;
+
+	if (!inst->l1.max_entries) return 0;
+
+	t->cache = fr_hash_table_talloc_alloc(t, cache_l1_entry_t, cache_l1_hash, cache_l1_cmp, NULL);
+	if (unlikely(!t->cache)) {
+		PERROR("Failed allocating L1 cache");
+		return -1;
+	}
+	fr_dlist_talloc_init(&t->lru, cache_l1_entry_t, entry);
+
+	return 0;
+}
+
 /** Free any memory allocated under the instance
  *
  */
@@ -1388,6 +2197,14 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 {
 	rlm_cache_t *inst = talloc_get_type_abort(mctx->mi->data, rlm_cache_t);
 
+	/*
+	 *	The driver is detached after us, so its entries
+	 *	are still available for the final snapshot.
+	 */
+	cache_snapshot_stop(mctx->mi);
+	cache_snapshot_free(mctx->mi);
+	TALLOC_FREE(inst->claims);
+
 	/*
 	 *	We need to explicitly free all children, so if the driver
 	 *	parented any memory off the instance, their destructors
@@ -1459,7 +2276,7 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	 *	Non optional fields and callbacks
 	 */
 	fr_assert(inst->driver->common.name);
-	fr_assert(inst->driver->find);
+	fr_assert(inst->driver->find || inst->driver->fetch);
 	fr_assert(inst->driver->insert);
 	fr_assert(inst->driver->expire);
 
@@ -1473,6 +2290,58 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	if (inst->l1.max_entries && !fr_time_delta_ispos(inst->l1.ttl)) {
+		cf_log_err(conf, "Must set 'l1.ttl' to non-zero when 'l1.max_entries' is set");
+		return -1;
+	}
+
+	/*
+	 *	Requests claim the refresh of entries, so they
+	 *	can be refreshed by one request at a time.
+	 */
+	if (fr_time_delta_ispos(inst->refresh.stale) || fr_time_delta_ispos(inst->refresh.lock_timeout)) {
+		rlm_cache_claims_t	*claims;
+		int			ret;
+
+		MEM(claims = talloc_zero(NULL, rlm_cache_claims_t));
+		claims->table = fr_hash_table_alloc(claims, cache_claim_hash, cache_claim_cmp, NULL);
+		if (!claims->table) {
+			cf_log_err(conf, "Failed allocating refresh claims");
+		error:
+			talloc_free(claims);
+			return -1;
+		}
+
+		if ((ret = pthread_mutex_init(&claims->mutex, NULL)) != 0) {
+			cf_log_err(conf, "Failed initializing mutex: %s", fr_syserror(ret));
+			goto error;
+		}
+		talloc_set_destructor(claims, _cache_claims_free);
+
+		inst->claims = claims;
+	}
+
+	if (inst->snapshot_config.filename) {
+		if (!inst->driver->walk) {
+			cf_log_err(conf, "Driver \"%s\" doesn't support snapshots", inst->driver->common.name);
+			return -1;
+		}
+
+		if (!inst->snapshot_config.namespace_name) {
+			cf_log_err(conf, "Must set 'snapshot.namespace' when 'snapshot.filename' is set");
+			return -1;
+		}
+
+		inst->snapshot_config.dict = fr_dict_by_protocol_name(inst->snapshot_config.namespace_name);
+		if (!inst->snapshot_config.dict) {
+			cf_log_err(conf, "Unknown namespace \"%s\" in 'snapshot.namespace'",
+				   inst->snapshot_config.namespace_name);
+			return -1;
+		}
+
+		if (cache_snapshot_alloc(mctx->mi) < 0) return -1;
+	}
+
 	return 0;
 }
 
@@ -1513,7 +2382,11 @@ module_rlm_t rlm_cache = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
-		.detach		= mod_detach
+		.detach		= mod_detach,
+
+		.thread_inst_size	= sizeof(rlm_cache_thread_t),
+		.thread_inst_type	= "rlm_cache_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
@@ -28,6 +28,7 @@ RCSIDH(cache_h, "$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/dl_module.h>
 #include <freeradius-devel/server/map.h>
+#include <freeradius-devel/server/trunk.h>
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.h>
 
 typedef struct rlm_cache_driver_s rlm_cache_driver_t;
@@ -53,8 +54,52 @@ typedef struct {
 	uint32_t		max_entries;		//!< Maximum entries allowed.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
+	bool			intern;			//!< Share one copy of repeated string and
+							///< octets values between entries.
 } rlm_cache_config_t;
 
+/** Configuration for the thread local L1 cache
+ *
+ */
+typedef struct {
+	uint32_t		max_entries;		//!< Maximum entries per thread.  0 disables the L1 cache.
+	fr_time_delta_t		ttl;			//!< Maximum time an entry is held locally.
+	fr_time_delta_t		negative_ttl;		//!< How long to remember misses for.  0 disables
+							///< negative caching.
+} rlm_cache_l1_config_t;
+
+/** Configuration for refreshing entries
+ *
+ */
+typedef struct {
+	fr_time_delta_t		jitter;			//!< Up to this much is added to each entry's TTL,
+							///< so entries created together don't expire together.
+	fr_time_delta_t		stale;			//!< How long an entry is kept after its TTL
+							///< has passed, to be used whilst it's refreshed.
+	fr_time_delta_t		lock_timeout;		//!< Maximum time a request waits for another
+							///< request to create an entry.  0 means don't wait.
+} rlm_cache_refresh_config_t;
+
+typedef struct rlm_cache_claims_s rlm_cache_claims_t;
+
+/** Configuration for cache snapshots
+ *
+ */
+typedef struct {
+	char const		*filename;		//!< Where the snapshot is written.  NULL disables
+							///< snapshots.
+	fr_time_delta_t		interval;		//!< How often a snapshot is written.  0 means the
+							///< snapshot is only written on exit.
+	fr_time_delta_t		warm_up;		//!< Entries loaded from the snapshot expire at a
+							///< random point inside this window, if it's sooner
+							///< than their original expiry.
+	char const		*namespace_name;	//!< Protocol dictionary attribute names are
+							///< resolved in when the snapshot is loaded.
+	fr_dict_t const		*dict;			//!< Resolved from namespace_name.
+} rlm_cache_snapshot_config_t;
+
+typedef struct rlm_cache_snapshot_s rlm_cache_snapshot_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -67,6 +112,14 @@ typedef struct {
 
 	module_instance_t	*driver_submodule;	//!< Driver's instance data.
 	rlm_cache_driver_t const *driver;		//!< Driver's exported interface.
+
+	rlm_cache_l1_config_t	l1;			//!< Thread local cache in front of the driver.
+
+	rlm_cache_refresh_config_t	refresh;	//!< Refreshing entries without stampedes.
+	rlm_cache_claims_t	*claims;		//!< Keys currently being refreshed.
+
+	rlm_cache_snapshot_config_t	snapshot_config;	//!< Persisting entries across restarts.
+	rlm_cache_snapshot_t	*snapshot;		//!< Mutable snapshot state.
 } rlm_cache_t;
 
 typedef struct {
@@ -78,6 +131,18 @@ typedef struct {
 	map_list_t		maps;			//!< Head of the maps list.
 } rlm_cache_entry_t;
 
+/** The result of a lookup started with #cache_entry_fetch_t
+ *
+ */
+typedef struct {
+	cache_status_t		status;			//!< Result of the lookup.
+	rlm_cache_entry_t	*c;			//!< Entry which was retrieved.  If it's not consumed
+							///< by rlm_cache it's freed with talloc_free().
+	trunk_request_t		*treq;			//!< Outstanding trunk request for the lookup.
+							///< Cancelled if the request is signalled.
+	bool			used;			//!< Set by rlm_cache once the result has been used.
+} cache_fetch_t;
+
 /** Allocate a new cache entry
  *
  */
@@ -122,6 +187,26 @@ typedef cache_status_t	(*cache_entry_find_t)(rlm_cache_entry_t **out, rlm_cache_
 					      void *instance, request_t *request, void *handle,
 					      fr_value_box_t const *key);
 
+/** Start retrieving an entry from the cache without blocking
+ *
+ * @note This callback is optional.  If provided, rlm_cache calls it before any method
+ *	which looks up an entry, and yields until the driver marks the request as runnable.
+ *	The result written to fetch is then used instead of calling #cache_entry_find_t.
+ *
+ * @param[out] fetch Where to write the result of the lookup.
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] instance Driver specific instance data.
+ * @param[in] thread Driver specific thread instance data.
+ * @param[in] request The current request.
+ * @param[in] key to use to lookup cache entry.
+ * @return
+ *	- 0 if the lookup was started.
+ *	- -1 if the lookup couldn't be started.
+ */
+typedef int		(*cache_entry_fetch_t)(cache_fetch_t *fetch, rlm_cache_config_t const *config,
+					       void *instance, void *thread, request_t *request,
+					       fr_value_box_t const *key);
+
 /** Insert an entry into the cache
  *
  * Serialize (if necessary) the entry passed to us, and write it to the cache with
@@ -210,6 +295,36 @@ typedef cache_status_t	(*cache_entry_set_ttl_t)(rlm_cache_config_t const *config
 typedef uint64_t	(*cache_entry_count_t)(rlm_cache_config_t const *config, void *instance,
 					       request_t *request, void *handle);
 
+/** Called for each entry by #cache_entry_walk_t
+ *
+ * @param[in] c		Entry being visited.  Must not be modified or retained.
+ * @param[in] uctx	passed to #cache_entry_walk_t.
+ * @return
+ *	- 0 to continue walking.
+ *	- -1 to stop walking.
+ */
+typedef int		(*cache_entry_walk_cb_t)(rlm_cache_entry_t const *c, void *uctx);
+
+/** Visit every entry in the cache
+ *
+ * @note This callback is optional.  It's only provided by drivers which hold entries
+ *	in local memory, and is used to write snapshots of the cache.
+ *
+ * May be called from a thread which isn't a worker, and without a request.  The driver
+ * must take care of any locking itself, and must not call any other callbacks whilst
+ * walking.
+ *
+ * @param[in] config	for this instance of the rlm_cache module.
+ * @param[in] instance	Driver specific instance data.
+ * @param[in] cb	to call for each entry.
+ * @param[in] uctx	to pass to cb.
+ * @return
+ *	- 0 if all entries were visited.
+ *	- -1 if the callback stopped the walk.
+ */
+typedef int		(*cache_entry_walk_t)(rlm_cache_config_t const *config, void *instance,
+					      cache_entry_walk_cb_t cb, void *uctx);
+
 /** Acquire a handle to access the cache
  *
  * @note This callback is optional. If it's not provided the handle argument to other callbacks
@@ -260,12 +375,16 @@ struct rlm_cache_driver_s {
 	cache_entry_alloc_t		alloc;			//!< (optional) Allocate a new entry.
 	cache_entry_free_t		free;			//!< (optional) Free memory used by an entry.
 
-	cache_entry_find_t		find;			//!< Retrieve an existing cache entry.
+	cache_entry_find_t		find;			//!< Retrieve an existing cache entry.  May be NULL
+								///< if fetch is provided.
+	cache_entry_fetch_t		fetch;			//!< (optional) Retrieve an existing cache entry
+								///< without blocking.
 	cache_entry_insert_t		insert;			//!< Add a new entry.
 	cache_entry_expire_t		expire;			//!< Remove an old entry.
 	cache_entry_set_ttl_t		set_ttl;		//!< (Optional) Update the TTL of an entry.
 	cache_entry_count_t		count;			//!< (Optional) Number of entries currently in
 								//!< the cache.
+	cache_entry_walk_t		walk;			//!< (Optional) Visit every entry in the cache.
 
 	cache_acquire_t			acquire;		//!< (optional) Acquire exclusive access to a resource
 								//!< used to retrieve the cache entry.
@@ -1,6 +1,6 @@
 TARGETNAME	:= rlm_cache
 
 TARGET		:= $(TARGETNAME)$(L)
-SOURCES		:= $(TARGETNAME).c
+SOURCES		:= $(TARGETNAME).c serialize.c snapshot.c
 
 LOG_ID_LIB	= 3
@@ -0,0 +1,532 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file snapshot.c
+ * @brief Persist cache entries across restarts.
+ *
+ * Drivers which hold entries in local memory lose them when the server
+ * restarts.  A snapshot of the entries is written to a file periodically,
+ * and on exit, and loaded again when the server starts.
+ *
+ * The file is a short magic string, followed by one record per entry:
+ *
+ @verbatim
+   uint8  key type
+   uint32 key length
+   uint32 entry length
+   key    in network format
+   entry  as produced by cache_serialize()
+ @endverbatim
+ *
+ * Lengths are in network byte order.  The file is mapped into memory
+ * when it's loaded, and entries are deserialized from the mapping directly.
+ *
+ * Entry expiry times are absolute, so any time the server spent down
+ * is accounted for when the snapshot is loaded.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX mi->name
+
+#include <freeradius-devel/util/nbo.h>
+#include <freeradius-devel/util/rand.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rlm_cache.h"
+#include "serialize.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC		"FreeRADIUS cache snapshot 1\n"
+#define SNAPSHOT_MAGIC_LEN	(sizeof(SNAPSHOT_MAGIC) - 1)
+#define SNAPSHOT_HDR_LEN	(1 + sizeof(uint32_t) + sizeof(uint32_t))
+
+struct rlm_cache_snapshot_s {
+	pthread_mutex_t		mutex;			//!< Protects the fields below.
+	pthread_cond_t		cond;			//!< Signalled to wake the snapshot thread early.
+	pthread_t		thread;			//!< Writes snapshots periodically.
+
+	bool			started;		//!< The snapshot has been loaded.  Only
+							///< then do we write new ones.
+	bool			running;		//!< The snapshot thread is running.
+	bool			stop;			//!< Tells the snapshot thread to exit.
+};
+
+typedef struct {
+	module_instance_t const	*mi;
+	FILE			*fp;			//!< Temporary file the snapshot is written to.
+	TALLOC_CTX		*pool;			//!< For serializing each entry.
+	fr_unix_time_t		now;			//!< Expired entries aren't written.
+	uint64_t		count;			//!< Number of entries written.
+} cache_snapshot_write_ctx_t;
+
+static int _cache_snapshot_free(rlm_cache_snapshot_t *snapshot)
+{
+	pthread_cond_destroy(&snapshot->cond);
+	pthread_mutex_destroy(&snapshot->mutex);
+
+	return 0;
+}
+
+/** Allocate the mutable snapshot state for an instance
+ *
+ * @param[in] mi	Instance of rlm_cache to allocate snapshot state for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_snapshot_alloc(module_instance_t const *mi)
+{
+	rlm_cache_t		*inst = talloc_get_type_abort(mi->data, rlm_cache_t);
+	rlm_cache_snapshot_t	*snapshot;
+	int			ret;
+
+	/*
+	 *	Instance data is read only once the server has started,
+	 *	so this has to be allocated elsewhere.
+	 */
+	snapshot = talloc_zero(NULL, rlm_cache_snapshot_t);
+	if (!snapshot) {
+		ERROR("Failed allocating snapshot state");
+		return -1;
+	}
+
+	if ((ret = pthread_mutex_init(&snapshot->mutex, NULL)) != 0) {
+		ERROR("Failed initializing mutex: %s", fr_syserror(ret));
+		talloc_free(snapshot);
+		return -1;
+	}
+
+	if ((ret = pthread_cond_init(&snapshot->cond, NULL)) != 0) {
+		ERROR("Failed initializing condition variable: %s", fr_syserror(ret));
+		pthread_mutex_destroy(&snapshot->mutex);
+		talloc_free(snapshot);
+		return -1;
+	}
+	talloc_set_destructor(snapshot, _cache_snapshot_free);
+
+	inst->snapshot = snapshot;
+
+	return 0;
+}
+
+/** Free the mutable snapshot state for an instance
+ *
+ * @param[in] mi	Instance of rlm_cache to free snapshot state for.
+ */
+void cache_snapshot_free(module_instance_t const *mi)
+{
+	rlm_cache_t		*inst = talloc_get_type_abort(mi->data, rlm_cache_t);
+
+	TALLOC_FREE(inst->snapshot);
+}
+
+/** Write a single entry to the snapshot
+ *
+ * Entries which can't be serialized are skipped, they'll just be missing
+ * from the cache after a restart.
+ */
+static int cache_snapshot_write_entry(rlm_cache_entry_t const *c, void *uctx)
+{
+	cache_snapshot_write_ctx_t	*sctx = uctx;
+	module_instance_t const		*mi = sctx->mi;
+	fr_dbuff_t			key;
+	fr_dbuff_uctx_talloc_t		tctx;
+	uint8_t				hdr[SNAPSHOT_HDR_LEN];
+	char				*data;
+	size_t				key_len, data_len;
+	int				ret = 0;
+
+	if (fr_unix_time_lteq(c->expires, sctx->now)) return 0;
+
+	if (!fr_dbuff_init_talloc(sctx->pool, &key, &tctx, 64, UINT32_MAX)) return -1;
+
+	if (fr_value_box_to_network(&key, &c->key) < 0) {
+		PWARN("Skipping entry \"%pV\", failed encoding key", &c->key);
+		goto finish;
+	}
+	key_len = fr_dbuff_used(&key);
+
+	if (cache_serialize(sctx->pool, &data, c) < 0) {
+		PWARN("Skipping entry \"%pV\", failed serializing it", &c->key);
+		goto finish;
+	}
+	data_len = talloc_strlen(data);
+
+	hdr[0] = c->key.type;
+	fr_nbo_from_uint32(hdr + 1, key_len);
+	fr_nbo_from_uint32(hdr + 1 + sizeof(uint32_t), data_len);
+
+	if ((fwrite(hdr, sizeof(hdr), 1, sctx->fp) != 1) ||
+	    (fwrite(fr_dbuff_start(&key), key_len, 1, sctx->fp) != 1) ||
+	    (data_len && (fwrite(data, data_len, 1, sctx->fp) != 1))) {
+		fr_strerror_printf("Failed writing entry: %s", fr_syserror(errno));
+		ret = -1;
+		goto finish;
+	}
+	sctx->count++;
+
+finish:
+	talloc_free_children(sctx->pool);
+
+	return ret;
+}
+
+/** Write a snapshot of all the entries in the cache
+ *
+ * The snapshot is written to a temporary file, which then replaces the
+ * previous snapshot, so there's always a complete snapshot on disk.
+ *
+ * @param[in] mi	Instance of rlm_cache to write a snapshot for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int cache_snapshot_write(module_instance_t const *mi)
+{
+	rlm_cache_t const		*inst = talloc_get_type_abort_const(mi->data, rlm_cache_t);
+	char const			*filename = inst->snapshot_config.filename;
+	char				*tmp;
+	cache_snapshot_write_ctx_t	sctx = {
+						.mi = mi,
+						.now = fr_time_to_unix_time(fr_time())
+					};
+	int				fd;
+	fr_time_t			start = fr_time();
+
+	tmp = talloc_typed_asprintf(NULL, "%s.tmp", filename);
+	if (!tmp) return -1;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		ERROR("Failed opening snapshot file \"%s\": %s", tmp, fr_syserror(errno));
+	error:
+		talloc_free(tmp);
+		return -1;
+	}
+
+	sctx.fp = fdopen(fd, "w");
+	if (!sctx.fp) {
+		ERROR("Failed opening snapshot file \"%s\": %s", tmp, fr_syserror(errno));
+		close(fd);
+	error_unlink:
+		unlink(tmp);
+		goto error;
+	}
+
+	sctx.pool = talloc_pool(tmp, 4096);
+	if (!sctx.pool) {
+		fclose(sctx.fp);
+		goto error_unlink;
+	}
+
+	if ((fwrite(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN, 1, sctx.fp) != 1) ||
+	    (inst->driver->walk(&inst->config, inst->driver_submodule->data, cache_snapshot_write_entry, &sctx) < 0)) {
+		PERROR("Failed writing snapshot file \"%s\"", tmp);
+		fclose(sctx.fp);
+		goto error_unlink;
+	}
+
+	if ((fflush(sctx.fp) != 0) || (fsync(fileno(sctx.fp)) < 0)) {
+		ERROR("Failed writing snapshot file \"%s\": %s", tmp, fr_syserror(errno));
+		fclose(sctx.fp);
+		goto error_unlink;
+	}
+
+	if (fclose(sctx.fp) != 0) {
+		ERROR("Failed closing snapshot file \"%s\": %s", tmp, fr_syserror(errno));
+		goto error_unlink;
+	}
+
+	if (rename(tmp, filename) < 0) {
+		ERROR("Failed renaming \"%s\" to \"%s\": %s", tmp, filename, fr_syserror(errno));
+		goto error_unlink;
+	}
+	talloc_free(tmp);
+
+	DEBUG2("Wrote %" PRIu64 " entries to snapshot \"%s\" in %pV seconds", sctx.count, filename,
+	       fr_box_time_delta(fr_time_sub(fr_time(), start)));
+
+	return 0;
+}
+
+/** Load the entries from a snapshot into the cache
+ *
+ * Expired entries are discarded.  If warm_up is set, the remaining
+ * entries expire at random points inside the warm up window, so they're
+ * replaced by fresh entries gradually instead of all at once.
+ *
+ * @param[in] mi	Instance of rlm_cache to load the snapshot for.
+ * @return
+ *	- 0 on success, or if there was no snapshot.
+ *	- -1 on failure.
+ */
+static int cache_snapshot_load(module_instance_t const *mi)
+{
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(mi->data, rlm_cache_t);
+	char const		*filename = inst->snapshot_config.filename;
+	int			fd;
+	struct stat		st;
+	uint8_t			*buff, *p, *end;
+	request_t		*request;
+	rlm_cache_handle_t	*handle = NULL;
+	fr_unix_time_t		now = fr_time_to_unix_time(fr_time());
+	uint64_t		loaded = 0, expired = 0, skipped = 0;
+	int			ret = -1;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			DEBUG("No snapshot found at \"%s\"", filename);
+			return 0;
+		}
+		ERROR("Failed opening snapshot file \"%s\": %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ERROR("Failed reading snapshot file \"%s\": %s", filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (((size_t)st.st_size < SNAPSHOT_MAGIC_LEN)) {
+		close(fd);
+	bad_magic:
+		ERROR("\"%s\" isn't a cache snapshot", filename);
+		return -1;
+	}
+
+	/*
+	 *	Private, so deserializing can modify the entries in
+	 *	place without those changes reaching the file.
+	 */
+	buff = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (buff == MAP_FAILED) {
+		ERROR("Failed mapping snapshot file \"%s\": %s", filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (memcmp(buff, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+		munmap(buff, st.st_size);
+		goto bad_magic;
+	}
+	p = buff + SNAPSHOT_MAGIC_LEN;
+	end = buff + st.st_size;
+
+	/*
+	 *	The drivers expect a request for locking and logging.
+	 */
+	request = request_local_alloc_external(NULL, (&(request_init_args_t){ .namespace = inst->snapshot_config.dict }));
+	if (!request) {
+		ERROR("Failed allocating request to load snapshot");
+		goto finish;
+	}
+
+	if (inst->driver->acquire &&
+	    (inst->driver->acquire(&handle, &inst->config, inst->driver_submodule->data, request) < 0)) {
+		ERROR("Failed acquiring handle to load snapshot");
+		goto finish;
+	}
+
+	while (p < end) {
+		rlm_cache_entry_t	*c;
+		fr_type_t		type;
+		size_t			key_len, data_len;
+
+		if ((size_t)(end - p) < SNAPSHOT_HDR_LEN) {
+		truncated:
+			WARN("Snapshot \"%s\" is truncated, ignoring the rest of it", filename);
+			break;
+		}
+
+		type = p[0];
+		key_len = fr_nbo_to_uint32(p + 1);
+		data_len = fr_nbo_to_uint32(p + 1 + sizeof(uint32_t));
+		p += SNAPSHOT_HDR_LEN;
+
+		if ((size_t)(end - p) < (key_len + data_len)) goto truncated;
+
+		if ((inst->config.max_entries > 0) && inst->driver->count &&
+		    (inst->driver->count(&inst->config, inst->driver_submodule->data,
+					 request, handle) >= inst->config.max_entries)) {
+			WARN("Cache is full, ignoring the rest of snapshot \"%s\"", filename);
+			break;
+		}
+
+		c = inst->driver->alloc ? inst->driver->alloc(&inst->config, inst->driver_submodule->data, request) :
+					  talloc_zero(NULL, rlm_cache_entry_t);
+		if (!c) goto finish;
+		map_list_init(&c->maps);
+
+		if (!fr_type_is_leaf(type) ||
+		    (fr_value_box_from_network(c, &c->key, type, NULL,
+					       &FR_DBUFF_TMP(p, key_len), key_len, false) < 0)) {
+			PWARN("Skipping entry with invalid key");
+		skip:
+			talloc_free(c);
+			skipped++;
+			p += key_len + data_len;
+			continue;
+		}
+
+		if (cache_deserialize(c, inst->snapshot_config.dict, (char *)p + key_len, data_len) < 0) {
+			PWARN("Skipping entry \"%pV\"", &c->key);
+			goto skip;
+		}
+		p += key_len + data_len;
+
+		if (fr_unix_time_lteq(c->expires, now)) {
+			talloc_free(c);
+			expired++;
+			continue;
+		}
+
+		if (fr_time_delta_ispos(inst->snapshot_config.warm_up)) {
+			fr_unix_time_t	warm;
+
+			warm = fr_unix_time_add(now, fr_time_delta_wrap(((((uint64_t)fr_rand()) << 32) | fr_rand()) %
+						(uint64_t)fr_time_delta_unwrap(inst->snapshot_config.warm_up)));
+			if (fr_unix_time_lt(warm, c->expires)) c->expires = warm;
+		}
+
+		if (inst->driver->insert(&inst->config, inst->driver_submodule->data, request, handle, c) != CACHE_OK) {
+			talloc_free(c);
+			skipped++;
+			continue;
+		}
+		if (inst->driver->free) inst->driver->free(c);
+
+		loaded++;
+	}
+
+	INFO("Loaded %" PRIu64 " entries from snapshot \"%s\", %" PRIu64 " had expired, %" PRIu64 " were invalid",
+	     loaded, filename, expired, skipped);
+	ret = 0;
+
+finish:
+	if (handle && inst->driver->release) inst->driver->release(&inst->config, inst->driver_submodule->data,
+								   request, handle);
+	talloc_free(request);
+	munmap(buff, st.st_size);
+
+	return ret;
+}
+
+/** Write snapshots periodically
+ *
+ */
+static void *cache_snapshot_thread(void *arg)
+{
+	module_instance_t const	*mi = arg;
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(mi->data, rlm_cache_t);
+	rlm_cache_snapshot_t	*snapshot = inst->snapshot;
+
+	pthread_mutex_lock(&snapshot->mutex);
+	while (!snapshot->stop) {
+		struct timespec ts = fr_time_to_timespec(fr_time_add(fr_time(), inst->snapshot_config.interval));
+
+		pthread_cond_timedwait(&snapshot->cond, &snapshot->mutex, &ts);
+		if (snapshot->stop) break;
+
+		pthread_mutex_unlock(&snapshot->mutex);
+		cache_snapshot_write(mi);
+		pthread_mutex_lock(&snapshot->mutex);
+	}
+	pthread_mutex_unlock(&snapshot->mutex);
+
+	return NULL;
+}
+
+/** Load the snapshot, and start writing new ones
+ *
+ * Called as each thread is instantiated, when the driver is ready for
+ * use.  Only the first call does anything.
+ *
+ * @param[in] mi	Instance of rlm_cache to start snapshots for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int cache_snapshot_start(module_instance_t const *mi)
+{
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(mi->data, rlm_cache_t);
+	rlm_cache_snapshot_t	*snapshot = inst->snapshot;
+	int			ret = 0;
+
+	if (!snapshot) return 0;
+
+	pthread_mutex_lock(&snapshot->mutex);
+	if (snapshot->started) goto finish;
+
+	if (cache_snapshot_load(mi) < 0) {
+		ret = -1;
+		goto finish;
+	}
+	snapshot->started = true;
+
+	if (fr_time_delta_ispos(inst->snapshot_config.interval)) {
+		int err;
+
+		err = pthread_create(&snapshot->thread, NULL, cache_snapshot_thread, UNCONST(module_instance_t *, mi));
+		if (err != 0) {
+			ERROR("Failed creating snapshot thread: %s", fr_syserror(err));
+			ret = -1;
+			goto finish;
+		}
+		snapshot->running = true;
+	}
+
+finish:
+	pthread_mutex_unlock(&snapshot->mutex);
+
+	return ret;
+}
+
+/** Stop writing snapshots, and write a final one
+ *
+ * The final snapshot is only written if the previous one was loaded, so
+ * checking the configuration doesn't overwrite it with an empty cache.
+ *
+ * @param[in] mi	Instance of rlm_cache to stop snapshots for.
+ */
+void cache_snapshot_stop(module_instance_t const *mi)
+{
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(mi->data, rlm_cache_t);
+	rlm_cache_snapshot_t	*snapshot = inst->snapshot;
+
+	if (!snapshot) return;
+
+	pthread_mutex_lock(&snapshot->mutex);
+	snapshot->stop = true;
+	pthread_cond_signal(&snapshot->cond);
+	pthread_mutex_unlock(&snapshot->mutex);
+
+	if (snapshot->running) {
+		pthread_join(snapshot->thread, NULL);
+		snapshot->running = false;
+	}
+
+	if (snapshot->started) cache_snapshot_write(mi);
+}
@@ -0,0 +1,33 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ * @file snapshot.h
+ * @brief Persist cache entries across restarts.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(snapshot_h, "$Id$")
+
+int	cache_snapshot_alloc(module_instance_t const *mi);
+
+void	cache_snapshot_free(module_instance_t const *mi);
+
+int	cache_snapshot_start(module_instance_t const *mi);
+
+void	cache_snapshot_stop(module_instance_t const *mi);
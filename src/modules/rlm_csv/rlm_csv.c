@@ -26,11 +26,18 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/util/htrie.h>
+#include <freeradius-devel/util/shared_image.h>
 #include <freeradius-devel/util/debug.h>
 
 #include <freeradius-devel/server/map_proc.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 static unlang_action_t mod_map_proc(rlm_rcode_t *p_result, void const *mod_inst, UNUSED void *proc_inst, request_t *request,
 				    fr_value_box_list_t *key, map_list_t const *maps);
 
@@ -46,6 +53,10 @@ typedef struct {
 	char const	*delimiter;
 	char const	*fields;
 	char const	*index_field_name;
+	fr_time_delta_t	reload_interval;	//!< How often to check the file for changes.
+
+	bool		mmap;			//!< Map the file, rather than reading it into memory.
+	char const	*index_filename;	//!< Sorted index used when the file is mapped.
 
 	bool		header;
 	bool		allow_multiple_keys;
@@ -58,8 +69,9 @@ typedef struct {
 	char const     	**field_names;
 	int		*field_offsets; /* field X from the file maps to array entry Y here */
 	fr_type_t	*field_types;
-	fr_rb_tree_t	*tree;
-	fr_htrie_t	*trie;
+	fr_htrie_type_t	htype;
+
+	fr_reload_t	*reload;	//!< Holding the current rlm_csv_data_t.
 
 	tmpl_t		*key;
 	fr_type_t	key_data_type;
@@ -86,13 +98,16 @@ static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", rlm_csv_t, allow_multiple_keys) },
 	{ FR_CONF_OFFSET_FLAGS("index_field", CONF_FLAG_REQUIRED | CONF_FLAG_NOT_EMPTY, rlm_csv_t, index_field_name) },
 	{ FR_CONF_OFFSET("key", rlm_csv_t, key) },
+	{ FR_CONF_OFFSET("reload_interval", rlm_csv_t, reload_interval), .dflt = "0" },
+	{ FR_CONF_OFFSET("mmap", rlm_csv_t, mmap), .dflt = "no" },
+	{ FR_CONF_OFFSET("index_filename", rlm_csv_t, index_filename) },
 	CONF_PARSER_TERMINATOR
 };
 
 /*
  *	Allow for quotation marks.
  */
-static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
+static bool buf2entry(rlm_csv_t const *inst, char *buf, char **out)
 {
 	char *p, *q;
 
@@ -185,16 +200,16 @@ static int csv_to_key(uint8_t **out, size_t *outlen, void const *data)
 }
 
 
-static bool insert_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t *e, int lineno)
+static bool insert_entry(fr_htrie_t *trie, rlm_csv_t const *inst, rlm_csv_entry_t *e, int lineno)
 {
 	rlm_csv_entry_t *old;
 
 	fr_assert(e != NULL);
 
-	old = fr_htrie_find(inst->trie, e);
+	old = fr_htrie_find(trie, e);
 	if (old) {
 		if (!inst->allow_multiple_keys && !inst->multiple_index_fields) {
-			cf_log_err(conf, "%s[%d]: Multiple entries are disallowed", inst->filename, lineno);
+			fr_strerror_printf("%s[%d]: Multiple entries are disallowed", inst->filename, lineno);
 			goto fail;
 		}
 
@@ -207,9 +222,9 @@ static bool insert_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t *e
 		return true;
 	}
 
-	if (!fr_htrie_insert(inst->trie, e)) {
-		cf_log_err(conf, "Failed inserting entry for file %s line %d: %s",
-			   inst->filename, lineno, fr_strerror());
+	if (!fr_htrie_insert(trie, e)) {
+		fr_strerror_printf_push("Failed inserting entry for file %s line %d",
+					inst->filename, lineno);
 fail:
 		talloc_free(e);
 		return false;
@@ -219,13 +234,14 @@ fail:
 }
 
 
-static bool duplicate_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t *old, char *p, int lineno)
+static bool duplicate_entry(TALLOC_CTX *ctx, fr_htrie_t *trie, rlm_csv_t const *inst,
+			    rlm_csv_entry_t *old, char *p, int lineno)
 {
 	int i;
 	fr_type_t type = inst->key_data_type;
 	rlm_csv_entry_t *e;
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst, uint8_t,
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(ctx, uint8_t,
 						     sizeof(*e) + (inst->used_fields * sizeof(e->data[0]))));
 	talloc_set_type(e, rlm_csv_entry_t);
 
@@ -233,8 +249,7 @@ static bool duplicate_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t
 	if (!e->key) goto fail;
 
 	if (fr_value_box_from_str(e->key, e->key, type, NULL, p, strlen(p), NULL, false) < 0) {
-		cf_log_err(conf, "Failed parsing key field in file %s line %d - %s", inst->filename, lineno,
-			   fr_strerror());
+		fr_strerror_printf_push("Failed parsing key field in file %s line %d", inst->filename, lineno);
 	fail:
 		talloc_free(e);
 		return false;
@@ -247,32 +262,32 @@ static bool duplicate_entry(CONF_SECTION *conf, rlm_csv_t *inst, rlm_csv_entry_t
 		if (old->data[i]) e->data[i] = old->data[i]; /* no need to dup it, it's never freed... */
 	}
 
-	return insert_entry(conf, inst, e, lineno);
+	return insert_entry(trie, inst, e, lineno);
 }
 
 /*
  *	Convert a buffer to a CSV entry
  */
-static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buffer)
+static bool file2csv(TALLOC_CTX *ctx, fr_htrie_t *trie, rlm_csv_t const *inst, int lineno, char *buffer)
 {
 	rlm_csv_entry_t *e;
 	int i;
 	char *p, *q;
 
-	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(inst, uint8_t,
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(ctx, uint8_t,
 						     sizeof(*e) + (inst->used_fields * sizeof(e->data[0]))));
 	talloc_set_type(e, rlm_csv_entry_t);
 
 	for (p = buffer, i = 0; p != NULL; p = q, i++) {
 		if (!buf2entry(inst, p, &q)) {
-			cf_log_err(conf, "Malformed entry in file %s line %d", inst->filename, lineno);
+			fr_strerror_printf("Malformed entry in file %s line %d", inst->filename, lineno);
 			return false;
 		}
 
 		if (q) *(q++) = '\0';
 
 		if (i >= inst->num_fields) {
-			cf_log_err(conf, "Too many fields at file %s line %d", inst->filename, lineno);
+			fr_strerror_printf("Too many fields at file %s line %d", inst->filename, lineno);
 			return false;
 		}
 
@@ -305,7 +320,7 @@ static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buff
 				while (l) {
 					*l = '\0';
 
-					if (!duplicate_entry(conf, inst, e, p, lineno)) goto fail;
+					if (!duplicate_entry(ctx, trie, inst, e, p, lineno)) goto fail;
 
 					p = l + 1;
 					l = strchr(p, ',');
@@ -320,8 +335,8 @@ static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buff
 
 			if (fr_value_box_from_str(e->key, e->key, type, NULL,
 						  p, strlen(p), NULL, false) < 0) {
-				cf_log_err(conf, "Failed parsing key field in file %s line %d - %s", inst->filename, lineno,
-					   fr_strerror());
+				fr_strerror_printf_push("Failed parsing key field in file %s line %d",
+							inst->filename, lineno);
 			fail:
 				talloc_free(e);
 				return false;
@@ -343,8 +358,8 @@ static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buff
 
 			if (fr_value_box_from_str(e, &box, type, NULL,
 						  p, strlen(p), NULL, false) < 0) {
-				cf_log_err(conf, "Failed parsing field '%s' in file %s line %d - %s", inst->field_names[i],
-					   inst->filename, lineno, fr_strerror());
+				fr_strerror_printf_push("Failed parsing field '%s' in file %s line %d",
+							inst->field_names[i], inst->filename, lineno);
 				goto fail;
 			}
 
@@ -355,11 +370,597 @@ static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buff
 	}
 
 	if (i < inst->num_fields) {
-		cf_log_err(conf, "Too few fields in file %s at line %d (%d < %d)", inst->filename, lineno, i, inst->num_fields);
+		fr_strerror_printf("Too few fields in file %s at line %d (%d < %d)", inst->filename, lineno, i, inst->num_fields);
 		goto fail;
 	}
 
-	return insert_entry(conf, inst, e, lineno);
+	return insert_entry(trie, inst, e, lineno);
+}
+
+/*
+ *	The index file which goes with a CSV file, when "mmap = yes".
+ *
+ *	The CSV file and the index are both mmap'd read only, so they
+ *	live in the page cache, and are shared by every process using
+ *	the same files.  The index is a header, then an array of
+ *	entries sorted by key, then the keys.  Keys are stored in the
+ *	form produced by fr_value_box_to_key(), so that they can be
+ *	compared with memcmp().
+ *
+ *	The index is rebuilt whenever it doesn't match the CSV file.
+ *	It's in host byte order, as it's a cache, not an interchange
+ *	format.  If several processes start at once, only the first
+ *	builds the index, the others wait for it, and map it.
+ */
+#define CSV_INDEX_MAGIC		"FRCSVIX"
+#define CSV_INDEX_VERSION	1
+
+typedef struct {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	key_type;	//!< fr_type_t of the keys.
+	uint32_t	index_field;	//!< Which field is the key.
+	uint32_t	flags;		//!< Delimiter, and how the file was parsed.
+	uint64_t	csv_size;	//!< Of the CSV file the index was built from.
+	int64_t		csv_mtime;
+	uint64_t	csv_ino;
+	uint64_t	num_entries;
+	uint64_t	keys_len;
+} rlm_csv_index_hdr_t;
+
+typedef struct {
+	uint64_t	line_off;	//!< Where the line starts in the CSV file.
+	uint32_t	line_len;	//!< Not including the LF.
+	uint32_t	key_bits;	//!< Length of the key, in bits.
+	uint64_t	key_off;	//!< Where the key starts in the keys.
+} rlm_csv_index_entry_t;
+
+#define CSV_INDEX_HEADER	(1 << 8)
+#define CSV_INDEX_MULTIPLE	(1 << 9)
+
+/** One version of the CSV data
+ *
+ */
+typedef struct {
+	fr_htrie_t			*trie;		//!< Of entries, when the file is read into memory.
+
+	uint8_t const			*csv;		//!< mmap'd CSV file.
+	size_t				csv_len;
+
+	fr_shared_image_t		index;		//!< mmap'd, or private, index.
+
+	rlm_csv_index_entry_t const	*entries;	//!< Sorted by key.
+	uint64_t			num_entries;
+	uint8_t const			*keys;
+	uint64_t			keys_len;
+} rlm_csv_data_t;
+
+static int _csv_data_free(rlm_csv_data_t *data)
+{
+	if (data->csv) munmap(UNCONST(uint8_t *, data->csv), data->csv_len);
+	fr_shared_image_close(&data->index);
+
+	return 0;
+}
+
+static inline CC_HINT(always_inline)
+int8_t csv_index_key_cmp(uint8_t const *a, size_t a_bits, uint8_t const *b, size_t b_bits)
+{
+	size_t	a_len = (a_bits + 7) / 8, b_len = (b_bits + 7) / 8;
+	int	ret;
+
+	ret = memcmp(a, b, (a_len < b_len) ? a_len : b_len);
+	if (ret != 0) return CMP(ret, 0);
+
+	return CMP(a_bits, b_bits);
+}
+
+static uint32_t csv_index_flags(rlm_csv_t const *inst)
+{
+	return (uint8_t) *inst->delimiter |
+		(inst->header ? CSV_INDEX_HEADER : 0) |
+		(inst->multiple_index_fields ? CSV_INDEX_MULTIPLE : 0);
+}
+
+typedef struct {
+	rlm_csv_data_t		*data;
+	rlm_csv_t const		*inst;
+	struct stat const	*sb;		//!< Of the CSV file.
+	uint8_t const		*csv;		//!< Mapped CSV file.
+	size_t			csv_len;
+} csv_index_uctx_t;
+
+/** Point the data at an index image, after checking it
+ *
+ * @return
+ *	- 0 if the index matches the CSV file.
+ *	- -1 if it doesn't, and must be rebuilt.
+ */
+static int csv_index_check(uint8_t const *index, size_t index_len, void *uctx)
+{
+	csv_index_uctx_t		*ictx = uctx;
+	rlm_csv_data_t			*data = ictx->data;
+	rlm_csv_t const			*inst = ictx->inst;
+	struct stat const		*sb = ictx->sb;
+	rlm_csv_index_hdr_t const	*hdr = (rlm_csv_index_hdr_t const *) index;
+	rlm_csv_index_entry_t const	*entries;
+	uint64_t			i;
+
+	if (index_len < sizeof(*hdr)) return -1;
+
+	if ((memcmp(hdr->magic, CSV_INDEX_MAGIC, sizeof(hdr->magic)) != 0) ||
+	    (hdr->version != CSV_INDEX_VERSION) ||
+	    (hdr->key_type != inst->key_data_type) ||
+	    (hdr->index_field != (uint32_t) inst->index_field) ||
+	    (hdr->flags != csv_index_flags(inst)) ||
+	    (hdr->csv_size != (uint64_t) sb->st_size) ||
+	    (hdr->csv_mtime != (int64_t) sb->st_mtime) ||
+	    (hdr->csv_ino != (uint64_t) sb->st_ino)) return -1;
+
+	if ((hdr->num_entries > ((index_len - sizeof(*hdr)) / sizeof(*entries))) ||
+	    (hdr->keys_len != (index_len - sizeof(*hdr) - (hdr->num_entries * sizeof(*entries))))) return -1;
+
+	/*
+	 *	Check every entry, so that lookups don't have to.
+	 */
+	entries = (rlm_csv_index_entry_t const *) (index + sizeof(*hdr));
+	for (i = 0; i < hdr->num_entries; i++) {
+		if ((entries[i].line_off > hdr->csv_size) ||
+		    (entries[i].line_len > (hdr->csv_size - entries[i].line_off)) ||
+		    (entries[i].key_off > hdr->keys_len) ||
+		    (((entries[i].key_bits + 7) / 8) > (hdr->keys_len - entries[i].key_off))) return -1;
+	}
+
+	data->entries = entries;
+	data->num_entries = hdr->num_entries;
+	data->keys = index + sizeof(*hdr) + (hdr->num_entries * sizeof(*entries));
+	data->keys_len = hdr->keys_len;
+
+	return 0;
+}
+
+typedef struct {
+	uint8_t const		*key;
+	rlm_csv_index_entry_t	entry;
+} csv_index_sort_t;
+
+static int csv_index_sort_cmp(void const *one, void const *two)
+{
+	csv_index_sort_t const *a = one;
+	csv_index_sort_t const *b = two;
+	int8_t ret;
+
+	ret = csv_index_key_cmp(a->key, a->entry.key_bits, b->key, b->entry.key_bits);
+	if (ret != 0) return ret;
+
+	/*
+	 *	Entries with the same key are used in file order.
+	 */
+	return CMP(a->entry.line_off, b->entry.line_off);
+}
+
+/** Add one key to the index being built
+ *
+ */
+static int csv_index_add(TALLOC_CTX *ctx, rlm_csv_t const *inst, rlm_csv_index_entry_t **entries, uint64_t *num_entries,
+			 uint8_t **keys, uint64_t *keys_len, uint64_t line_off, uint32_t line_len, char const *p, int lineno)
+{
+	fr_value_box_t	box;
+	uint8_t		buffer[16], *key = buffer;
+	size_t		key_bits = sizeof(buffer) * 8, key_len;
+	int		ret = -1;
+
+	if (fr_value_box_from_str(ctx, &box, inst->key_data_type, NULL, p, strlen(p), NULL, false) < 0) {
+		fr_strerror_printf_push("Failed parsing key field in file %s line %d", inst->filename, lineno);
+		return -1;
+	}
+
+	if (fr_value_box_to_key(&key, &key_bits, &box) < 0) {
+		fr_strerror_printf_push("Failed creating key for file %s line %d", inst->filename, lineno);
+		goto done;
+	}
+	key_len = (key_bits + 7) / 8;
+
+	if (*num_entries == talloc_array_length(*entries)) {
+		rlm_csv_index_entry_t *n;
+
+		n = talloc_realloc(ctx, *entries, rlm_csv_index_entry_t, (*num_entries + 1) * 2);
+		if (!n) goto oom;
+		*entries = n;
+	}
+
+	if ((*keys_len + key_len) > talloc_array_length(*keys)) {
+		uint8_t *n;
+
+		n = talloc_realloc(ctx, *keys, uint8_t, (*keys_len + key_len) * 2);
+		if (!n) {
+		oom:
+			fr_strerror_const("Out of memory");
+			goto done;
+		}
+		*keys = n;
+	}
+
+	memcpy(*keys + *keys_len, key, key_len);
+	(*entries)[(*num_entries)++] = (rlm_csv_index_entry_t) {
+		.line_off = line_off,
+		.line_len = line_len,
+		.key_bits = key_bits,
+		.key_off = *keys_len
+	};
+	*keys_len += key_len;
+	ret = 0;
+
+done:
+	fr_value_box_clear(&box);
+	return ret;
+}
+
+/** Build an index image for the CSV file
+ *
+ * Every line is checked in the same way as when the file is read into
+ * memory, but only the key is kept.
+ */
+static uint8_t *csv_index_build(TALLOC_CTX *ctx, size_t *out_len, void *uctx)
+{
+	csv_index_uctx_t	*ictx = uctx;
+	rlm_csv_t const		*inst = ictx->inst;
+	struct stat const	*sb = ictx->sb;
+	uint8_t const		*csv = ictx->csv;
+	size_t			csv_len = ictx->csv_len;
+	TALLOC_CTX		*tmp_ctx;
+	rlm_csv_index_entry_t	*entries = NULL;
+	uint64_t		num_entries = 0, keys_len = 0, i;
+	uint8_t			*keys = NULL;
+	csv_index_sort_t	*sorted;
+	uint8_t			*image = NULL, *q;
+	size_t			image_len;
+	uint8_t const		*line, *end = csv + csv_len;
+	int			lineno = 1;
+	char			buffer[8192];
+
+	INFO("Building index %s for %s", inst->index_filename, inst->filename);
+
+	tmp_ctx = talloc_new(NULL);
+	if (!tmp_ctx) {
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+
+	for (line = csv; line < end; lineno++) {
+		uint8_t const	*nl;
+		size_t		line_len;
+		char		*p, *next;
+		int		fields;
+
+		nl = memchr(line, '\n', end - line);
+		line_len = nl ? (size_t) (nl - line) : (size_t) (end - line);
+
+		if ((lineno == 1) && inst->header) goto next;
+
+		if (line_len >= sizeof(buffer)) {
+			fr_strerror_printf("Line too long in file %s line %d", inst->filename, lineno);
+			goto error;
+		}
+		memcpy(buffer, line, line_len);
+		buffer[line_len] = '\0';
+
+		/*
+		 *	Find the key, and check the number of fields.
+		 */
+		for (p = buffer, fields = 0; p != NULL; p = next, fields++) {
+			if (!buf2entry(inst, p, &next)) {
+				fr_strerror_printf("Malformed entry in file %s line %d", inst->filename, lineno);
+				goto error;
+			}
+
+			if (next) *(next++) = '\0';
+
+			if (fields >= inst->num_fields) {
+				fr_strerror_printf("Too many fields at file %s line %d", inst->filename, lineno);
+				goto error;
+			}
+
+			if (fields != inst->index_field) continue;
+
+			/*
+			 *	Check for /etc/group style keys,
+			 *	and silently omit empty entries.
+			 */
+			if (inst->multiple_index_fields) {
+				char *l;
+
+				if (!*p) continue;
+
+				while ((l = strchr(p, ','))) {
+					*l = '\0';
+					if (csv_index_add(tmp_ctx, inst, &entries, &num_entries, &keys, &keys_len,
+							  line - csv, line_len, p, lineno) < 0) goto error;
+					p = l + 1;
+				}
+			}
+
+			if (csv_index_add(tmp_ctx, inst, &entries, &num_entries, &keys, &keys_len,
+					  line - csv, line_len, p, lineno) < 0) goto error;
+		}
+
+		if (fields < inst->num_fields) {
+			fr_strerror_printf("Too few fields in file %s at line %d (%d < %d)",
+					   inst->filename, lineno, fields, inst->num_fields);
+			goto error;
+		}
+
+	next:
+		if (!nl) break;
+		line = nl + 1;
+	}
+
+	sorted = talloc_array(tmp_ctx, csv_index_sort_t, num_entries);
+	if (!sorted && num_entries) goto oom;
+
+	for (i = 0; i < num_entries; i++) {
+		sorted[i].key = keys + entries[i].key_off;
+		sorted[i].entry = entries[i];
+	}
+	if (num_entries) qsort(sorted, num_entries, sizeof(sorted[0]), csv_index_sort_cmp);
+
+	image_len = sizeof(rlm_csv_index_hdr_t) + (num_entries * sizeof(rlm_csv_index_entry_t)) + keys_len;
+	image = talloc_array(ctx, uint8_t, image_len);
+	if (!image) {
+	oom:
+		fr_strerror_const("Out of memory");
+		goto error;
+	}
+
+	memset(image, 0, sizeof(rlm_csv_index_hdr_t));
+	memcpy(((rlm_csv_index_hdr_t *) image)->magic, CSV_INDEX_MAGIC, sizeof(CSV_INDEX_MAGIC));
+	((rlm_csv_index_hdr_t *) image)->version = CSV_INDEX_VERSION;
+	((rlm_csv_index_hdr_t *) image)->key_type = inst->key_data_type;
+	((rlm_csv_index_hdr_t *) image)->index_field = inst->index_field;
+	((rlm_csv_index_hdr_t *) image)->flags = csv_index_flags(inst);
+	((rlm_csv_index_hdr_t *) image)->csv_size = sb->st_size;
+	((rlm_csv_index_hdr_t *) image)->csv_mtime = sb->st_mtime;
+	((rlm_csv_index_hdr_t *) image)->csv_ino = sb->st_ino;
+	((rlm_csv_index_hdr_t *) image)->num_entries = num_entries;
+	((rlm_csv_index_hdr_t *) image)->keys_len = keys_len;
+
+	q = image + sizeof(rlm_csv_index_hdr_t);
+	for (i = 0; i < num_entries; i++) {
+		memcpy(q, &sorted[i].entry, sizeof(sorted[i].entry));
+		q += sizeof(sorted[i].entry);
+	}
+	if (keys_len) memcpy(q, keys, keys_len);
+
+	talloc_free(tmp_ctx);
+
+	*out_len = image_len;
+	return image;
+
+error:
+	talloc_free(tmp_ctx);
+	return NULL;
+}
+
+/** Map the CSV file, and its index, building the index if necessary
+ *
+ */
+static int csv_index_load(rlm_csv_data_t *data, rlm_csv_t const *inst, char const *filename)
+{
+	int		fd;
+	struct stat	sb;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Error opening filename %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &sb) < 0) {
+		fr_strerror_printf("Error reading filename %s: %s", filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	/*
+	 *	Empty files can't be mapped, but they can be indexed.
+	 */
+	if (sb.st_size > 0) {
+		void *csv;
+
+		csv = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (csv == MAP_FAILED) {
+			fr_strerror_printf("Error mapping filename %s: %s", filename, fr_syserror(errno));
+			close(fd);
+			return -1;
+		}
+		data->csv = csv;
+		data->csv_len = sb.st_size;
+	}
+	close(fd);
+
+	if (fr_shared_image_open(&data->index, data, inst->index_filename, csv_index_check, csv_index_build,
+				 &(csv_index_uctx_t){ .data = data, .inst = inst, .sb = &sb,
+						      .csv = data->csv, .csv_len = data->csv_len }) < 0) return -1;
+
+	/*
+	 *	If the index can't be written, we can still use it,
+	 *	it just isn't shared with anyone else.
+	 */
+	if (!data->index.mapped) PWARN("Using a private copy of the index for %s", filename);
+
+	return 0;
+}
+
+/** Parse one line of the CSV file into a temporary entry
+ *
+ */
+static rlm_csv_entry_t *csv_index_entry(TALLOC_CTX *ctx, rlm_csv_t const *inst, rlm_csv_data_t const *data,
+					rlm_csv_index_entry_t const *ie)
+{
+	rlm_csv_entry_t	*e;
+	char		*buffer, *p, *next;
+	int		i;
+
+	e = (rlm_csv_entry_t *)talloc_zero_array(ctx, uint8_t,
+						 sizeof(*e) + (inst->used_fields * sizeof(e->data[0])));
+	if (!e) return NULL;
+	talloc_set_type(e, rlm_csv_entry_t);
+
+	buffer = talloc_array(e, char, ie->line_len + 1);
+	if (!buffer) {
+	error:
+		talloc_free(e);
+		return NULL;
+	}
+	memcpy(buffer, data->csv + ie->line_off, ie->line_len);
+	buffer[ie->line_len] = '\0';
+
+	for (p = buffer, i = 0; (p != NULL) && (i < inst->num_fields); p = next, i++) {
+		if (!buf2entry(inst, p, &next)) goto error;
+
+		if (next) *(next++) = '\0';
+
+		if ((i == inst->index_field) || (inst->field_offsets[i] < 0)) continue;
+
+		e->data[inst->field_offsets[i]] = talloc_typed_strdup(e, p);
+		if (!e->data[inst->field_offsets[i]]) goto error;
+	}
+	talloc_free(buffer);
+
+	return e;
+}
+
+/** Find the entries matching a key, using the index
+ *
+ * The entries are parsed from the mapped CSV file on each lookup.  All
+ * of them are allocated from the first one, so freeing it frees them all.
+ *
+ * @return
+ *	- 0 on success.  *out is NULL if there were no matching entries.
+ *	- -1 on failure.
+ */
+static int csv_index_find(rlm_csv_entry_t **out, TALLOC_CTX *ctx, rlm_csv_t const *inst,
+			  rlm_csv_data_t const *data, fr_value_box_t const *key)
+{
+	uint8_t			buffer[16], *k = buffer;
+	size_t			key_bits = sizeof(buffer) * 8;
+	uint64_t		lo = 0, hi = data->num_entries;
+	rlm_csv_entry_t		*head = NULL, **last = &head;
+
+	*out = NULL;
+
+	if (fr_value_box_to_key(&k, &key_bits, key) < 0) return -1;
+
+	/*
+	 *	Find the first entry for the key.
+	 */
+	while (lo < hi) {
+		uint64_t			mid = lo + ((hi - lo) / 2);
+		rlm_csv_index_entry_t const	*ie = &data->entries[mid];
+
+		if (csv_index_key_cmp(data->keys + ie->key_off, ie->key_bits, k, key_bits) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (; lo < data->num_entries; lo++) {
+		rlm_csv_index_entry_t const	*ie = &data->entries[lo];
+		rlm_csv_entry_t			*e;
+
+		if (csv_index_key_cmp(data->keys + ie->key_off, ie->key_bits, k, key_bits) != 0) break;
+
+		e = csv_index_entry(head ? head : ctx, inst, data, ie);
+		if (!e) {
+			fr_strerror_printf("Failed parsing line at offset %" PRIu64 " of %s",
+					   ie->line_off, inst->filename);
+			talloc_free(head);
+			return -1;
+		}
+
+		*last = e;
+		last = &e->next;
+	}
+
+	*out = head;
+	return 0;
+}
+
+/** Parse a version of the CSV file
+ *
+ * Called at startup, and from the reload thread when the file changes.
+ */
+static int csv_load(void **out, TALLOC_CTX *ctx, char const *filename, void *uctx)
+{
+	rlm_csv_t const	*inst = talloc_get_type_abort_const(uctx, rlm_csv_t);
+	rlm_csv_data_t	*data;
+	fr_htrie_t	*trie;
+	int		lineno;
+	FILE		*fp;
+	char		buffer[8192];
+
+	data = talloc_zero(ctx, rlm_csv_data_t);
+	if (!data) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	talloc_set_destructor(data, _csv_data_free);
+
+	if (inst->mmap) {
+		if (csv_index_load(data, inst, filename) < 0) return -1;
+
+		*out = data;
+		return 0;
+	}
+
+	trie = fr_htrie_alloc(ctx, inst->htype,
+			      (fr_hash_t) csv_hash,
+			      (fr_cmp_t) csv_cmp,
+			      (fr_trie_key_t) csv_to_key,
+			      NULL);
+	if (!trie) {
+		fr_strerror_printf_push("Failed creating internal trie");
+		return -1;
+	}
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fr_strerror_printf("Error opening filename %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+	lineno = 1;
+
+	/*
+	 *	If there is a header in the file, then read that first.
+	 *	This time we just ignore it.
+	 */
+	if (inst->header) {
+		char *p = fgets(buffer, sizeof(buffer), fp);
+		if (!p) {
+			fr_strerror_printf("Error reading filename %s: Unexpected EOF", filename);
+			fclose(fp);
+			return -1;
+		}
+		lineno++;
+	}
+
+	/*
+	 *	Read the rest of the file.
+	 */
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		if (!file2csv(ctx, trie, inst, lineno, buffer)) {
+			fclose(fp);
+			return -1;
+		}
+
+		lineno++;
+	}
+	fclose(fp);
+
+	data->trie = trie;
+	*out = data;
+	return 0;
 }
 
 
@@ -520,7 +1121,6 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	char const	*p;
 	char		*q;
 	char		*fields;
-	fr_htrie_type_t	htype;
 
 	if (inst->delimiter[1]) {
 		cf_log_err(conf, "'delimiter' must be one character long");
@@ -550,21 +1150,25 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	/*
 	 *	IP addresses go into tries.  Everything else into binary tries.
 	 */
-	htype = fr_htrie_hint(inst->key_data_type);
-	if (htype == FR_HTRIE_INVALID) {
+	inst->htype = fr_htrie_hint(inst->key_data_type);
+	if (inst->htype == FR_HTRIE_INVALID) {
 		cf_log_err(conf, "Invalid data type '%s' used for CSV file.",
 			   fr_type_to_str(inst->key_data_type));
 		return -1;
 	}
 
-	inst->trie = fr_htrie_alloc(inst, htype,
-				    (fr_hash_t) csv_hash,
-				    (fr_cmp_t) csv_cmp,
-				    (fr_trie_key_t) csv_to_key,
-				    NULL);
-	if (!inst->trie) {
-		cf_log_err(conf, "Failed creating internal trie: %s", fr_strerror());
-		return -1;
+	/*
+	 *	The index only supports exact matches, so it can't be
+	 *	used for longest prefix matching of IP addresses.
+	 */
+	if (inst->mmap) {
+		if (inst->htype == FR_HTRIE_TRIE) {
+			cf_log_err(conf, "'mmap = yes' cannot be used with keys of data type '%s'",
+				   fr_type_to_str(inst->key_data_type));
+			return -1;
+		}
+
+		if (!inst->index_filename) MEM(inst->index_filename = talloc_asprintf(inst, "%s.idx", inst->filename));
 	}
 
 	if ((*inst->index_field_name == ',') || (*inst->index_field_name == *inst->delimiter)) {
@@ -756,14 +1360,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	rlm_csv_t	*inst = talloc_get_type_abort(mctx->mi->data, rlm_csv_t);
 	CONF_SECTION	*conf = mctx->mi->conf;
 	CONF_SECTION	*cs;
-	int		lineno;
-	FILE		*fp;
 	tmpl_rules_t	parse_rules = {
 		.attr = {
 			.allow_foreign = true	/* Because we don't know where we'll be called */
 		}
 	};
-	char buffer[8192];
 
 	map_list_init(&inst->map);
 	/*
@@ -794,41 +1395,26 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	}
 
 	/*
-	 *	Re-open the file and read it all.
+	 *	Re-open the file and read it all.  The reload
+	 *	structure isn't part of the instance data, as the
+	 *	reload thread writes to it after the instance data
+	 *	has been made read only.
 	 */
-	fp = fopen(inst->filename, "r");
-	if (!fp) {
-		cf_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
+	inst->reload = fr_reload_alloc(NULL, mctx->mi->name, inst->filename,
+				       csv_load, inst, inst->reload_interval);
+	if (!inst->reload) {
+		cf_log_perr(conf, "Failed reading %s", inst->filename);
 		return -1;
 	}
-	lineno = 1;
 
-	/*
-	 *	If there is a header in the file, then read that first.
-	 *	This time we just ignore it.
-	 */
-	if (inst->header) {
-		char *p = fgets(buffer, sizeof(buffer), fp);
-		if (!p) {
-			cf_log_err(conf, "Error reading filename %s: Unexpected EOF", inst->filename);
-			fclose(fp);
-			return -1;
-		}
-		lineno++;
-	}
+	return 0;
+}
 
-	/*
-	 *	Read the rest of the file.
-	 */
-	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-		if (!file2csv(conf, inst, lineno, buffer)) {
-			fclose(fp);
-			return -1;
-		}
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_csv_t *inst = talloc_get_type_abort(mctx->mi->data, rlm_csv_t);
 
-		lineno++;
-	}
-	fclose(fp);
+	talloc_free(inst->reload);
 
 	return 0;
 }
@@ -899,10 +1485,19 @@ static rlm_rcode_t mod_map_apply(rlm_csv_t const *inst, request_t *request,
 				fr_value_box_t const *key, map_list_t const *maps)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_UPDATED;
-	rlm_csv_entry_t		*e;
+	rlm_csv_entry_t		*e, *found = NULL;
 	map_t const		*map = NULL;
+	rlm_csv_data_t const	*data = fr_reload_data(inst->reload);
 
-	e = fr_htrie_find(inst->trie, &(rlm_csv_entry_t) { .key = UNCONST(fr_value_box_t *, key) } );
+	if (data->trie) {
+		e = fr_htrie_find(data->trie, &(rlm_csv_entry_t) { .key = UNCONST(fr_value_box_t *, key) } );
+	} else {
+		if (csv_index_find(&found, request, inst, data, key) < 0) {
+			RPEDEBUG("Failed looking up key");
+			return RLM_MODULE_FAIL;
+		}
+		e = found;
+	}
 	if (!e) {
 		rcode = RLM_MODULE_NOOP;
 		goto finish;
@@ -958,6 +1553,7 @@ redo:
 	}
 
 finish:
+	talloc_free(found);
 	return rcode;
 }
 
@@ -1057,6 +1653,7 @@ module_rlm_t rlm_csv = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
+		.detach		= mod_detach,
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
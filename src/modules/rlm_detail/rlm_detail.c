@@ -17,12 +17,13 @@
 /**
  * $Id$
  * @file rlm_detail.c
- * @brief Write plaintext versions of packets to flatfiles.
+ * @brief Write plaintext or binary versions of packets to flatfiles.
  *
  * @copyright 2000,2006 The FreeRADIUS server project
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/cf_util.h>
 #include <freeradius-devel/server/exfile.h>
@@ -33,6 +34,7 @@ RCSID("$Id$")
 #include <ctype.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #ifdef HAVE_UNISTD_H
 #  include <unistd.h>
@@ -42,6 +44,23 @@ RCSID("$Id$")
 #  include <grp.h>
 #endif
 
+#if defined(_POSIX_SYNCHRONIZED_IO) && (_POSIX_SYNCHRONIZED_IO > 0)
+#  define detail_sync(_fd) fdatasync(_fd)
+#else
+#  define detail_sync(_fd) fsync(_fd)
+#endif
+
+typedef enum {
+	DETAIL_FORMAT_TEXT = 0,		//!< Human readable "Attr = value" entries.
+	DETAIL_FORMAT_BINARY		//!< Length prefixed, internally encoded records.
+} rlm_detail_format_t;
+
+static fr_table_num_sorted_t const detail_format_table[] = {
+	{ L("binary"),	DETAIL_FORMAT_BINARY	},
+	{ L("text"),	DETAIL_FORMAT_TEXT	}
+};
+static size_t detail_format_table_len = NUM_ELEMENTS(detail_format_table);
+
 /** Instance configuration for rlm_detail
  *
  * Holds the configuration and preparsed data for a instance of rlm_detail.
@@ -57,6 +76,15 @@ typedef struct {
 
 	bool		escape;		//!< do filename escaping, yes / no
 
+	rlm_detail_format_t format;	//!< Format of the entries written to the file.
+
+	struct {
+		fr_time_delta_t	interval;	//!< How long entries may be buffered for.
+						///< Zero means write each entry immediately.
+		uint32_t	size;		//!< Flush when this much data is buffered.
+		bool		sync;		//!< Wait for entries to reach the disk.
+	} write_behind;
+
 	exfile_t    	*ef;		//!< Log file handler
 } rlm_detail_t;
 
@@ -67,15 +95,55 @@ typedef struct {
 	fr_hash_table_t	*ht;		//!< Holds suppressed attributes.
 } rlm_detail_env_t;
 
+typedef struct {
+	fr_event_list_t		*el;		//!< For flush timers.
+	fr_hash_table_t		*buffers;	//!< Buffered entries, one per file.
+} rlm_detail_thread_t;
+
+/** Entries waiting to be written to a single file
+ *
+ */
+typedef struct {
+	char const		*filename;	//!< File the entries are for.
+	rlm_detail_t const	*inst;		//!< Instance which buffered the entries.
+	rlm_detail_thread_t	*thread;	//!< Thread which owns this buffer.
+
+	fr_dbuff_t		dbuff;		//!< The buffered entries.
+	fr_dbuff_uctx_talloc_t	tctx;		//!< Allocation context for the dbuff.
+
+	fr_dlist_head_t		waiting;	//!< Requests waiting for their entries to be written.
+	fr_event_timer_t const	*ev;		//!< Flush timer.
+} rlm_detail_buffer_t;
+
+/** A request waiting for a group commit
+ *
+ */
+typedef struct {
+	request_t		*request;	//!< Request to resume.
+	rlm_detail_buffer_t	*buffer;	//!< Buffer we're waiting on.  NULL once written.
+	bool			ok;		//!< Whether the entry was written.
+	fr_dlist_t		entry;		//!< Entry in the buffer's waiting list.
+} rlm_detail_waiter_t;
+
 int detail_group_parse(UNUSED TALLOC_CTX *ctx, void *out, void *parent,
 		       CONF_ITEM *ci, conf_parser_t const *rule);
 
+static const conf_parser_t write_behind_config[] = {
+	{ FR_CONF_OFFSET("interval", rlm_detail_t, write_behind.interval), .dflt = "0" },
+	{ FR_CONF_OFFSET("size", rlm_detail_t, write_behind.size), .dflt = "65536" },
+	{ FR_CONF_OFFSET("sync", rlm_detail_t, write_behind.sync), .dflt = "no" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("permissions", rlm_detail_t, perm), .dflt = "0600" },
 	{ FR_CONF_OFFSET_IS_SET("group", FR_TYPE_VOID, 0, rlm_detail_t, group), .func = detail_group_parse },
 	{ FR_CONF_OFFSET("locking", rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET("format", rlm_detail_t, format), .dflt = "text",
+	  .func = cf_table_parse_int, .uctx = &(cf_table_parse_ctx_t){ .table = detail_format_table, .len = &detail_format_table_len } },
+	{ FR_CONF_POINTER("write_behind", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) write_behind_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -183,6 +251,15 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	rlm_detail_t	*inst = talloc_get_type_abort(mctx->mi->data, rlm_detail_t);
 	CONF_SECTION	*conf = mctx->mi->conf;
 
+	if (fr_time_delta_ispos(inst->write_behind.interval)) {
+		FR_TIME_DELTA_BOUND_CHECK("write_behind.interval", inst->write_behind.interval, <=, fr_time_delta_from_sec(10));
+		FR_INTEGER_BOUND_CHECK("write_behind.size", inst->write_behind.size, >=, 1024);
+		FR_INTEGER_BOUND_CHECK("write_behind.size", inst->write_behind.size, <=, 16 * 1024 * 1024);
+	} else if (inst->write_behind.sync) {
+		cf_log_err(conf, "'write_behind.sync' requires 'write_behind.interval' to be set");
+		return -1;
+	}
+
 	inst->ef = module_rlm_exfile_init(inst, conf, 256, fr_time_delta_from_sec(30), inst->locking, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
@@ -317,6 +394,363 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 	return 0;
 }
 
+/** Encode a single binary detail record
+ *
+ * Suppression applies to top level attributes only, as structural
+ * attributes are encoded along with all of their children.
+ *
+ * @param[out] dbuff Where to write the record.
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] request The current request.
+ * @param[in] packet associated with the request (request, reply...).
+ * @param[in] list of pairs to write.
+ * @param[in] compat Write out entry in compatibility mode.
+ * @param[in] ht Hash table containing attributes to be suppressed in the output.
+ */
+static int detail_encode_binary(fr_dbuff_t *dbuff, rlm_detail_t const *inst, request_t *request,
+				fr_packet_t *packet, fr_pair_list_t *list, bool compat, fr_hash_table_t *ht)
+{
+	fr_dbuff_t		work_dbuff = FR_DBUFF(dbuff);
+	fr_dbuff_marker_t	hdr;
+	fr_dcursor_t		cursor;
+	fr_pair_t		*vp;
+	uint8_t			*record;
+
+	if (fr_pair_list_empty(list)) {
+		RWDEBUG("Skipping empty packet");
+		return 0;
+	}
+
+	/*
+	 *	Space for the record header, which is filled in once
+	 *	we know the length of the payload.
+	 */
+	fr_dbuff_marker(&hdr, &work_dbuff);
+	if (fr_dbuff_memset(&work_dbuff, 0, FR_INTERNAL_RECORD_HEADER_LEN) < 0) {
+	oom:
+		RERROR("Out of memory");
+		return -1;
+	}
+
+	if (inst->log_srcdst) {
+		vp = fr_pair_find_by_da(&request->control_pairs, NULL, attr_net);
+		if (vp) {
+			fr_pair_dcursor_init(&cursor, &request->control_pairs);
+			fr_dcursor_set_current(&cursor, vp);
+
+			if (fr_internal_encode_pair(&work_dbuff, &cursor, NULL) < 0) goto encode_error;
+		}
+	}
+
+	for (vp = fr_pair_dcursor_init(&cursor, list);
+	     vp;
+	     vp = fr_dcursor_current(&cursor)) {
+		if ((ht && fr_hash_table_find(ht, vp->da)) ||
+		    (vp->da == attr_net) ||
+		    (compat && (vp->da == attr_user_password))) {
+			fr_dcursor_next(&cursor);
+			continue;
+		}
+
+		if (fr_internal_encode_pair(&work_dbuff, &cursor, NULL) < 0) {
+		encode_error:
+			RPERROR("Failed encoding detail record");
+			return -1;
+		}
+	}
+
+	/*
+	 *	The buffer may have been reallocated, so find the
+	 *	header again.
+	 */
+	record = fr_dbuff_current(&hdr);
+	if (!record) goto oom;
+
+	fr_internal_record_header(record, packet->code, fr_time_to_sec(request->packet->timestamp),
+				  record + FR_INTERNAL_RECORD_HEADER_LEN,
+				  fr_dbuff_current(&work_dbuff) - record - FR_INTERNAL_RECORD_HEADER_LEN);
+
+	fr_dbuff_set(dbuff, &work_dbuff);
+
+	return 0;
+}
+
+/** Write a single binary detail record to a file descriptor
+ *
+ * The whole record is built in memory, and written with one call to
+ * write(), so that readers never see a partial record.
+ *
+ * @param[in] fd Where to write the record.
+ * @param[in] offset Where the end of the file is.  If the file is empty,
+ *	the file header is written first.
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] request The current request.
+ * @param[in] packet associated with the request (request, reply...).
+ * @param[in] list of pairs to write.
+ * @param[in] compat Write out entry in compatibility mode.
+ * @param[in] ht Hash table containing attributes to be suppressed in the output.
+ */
+static int detail_write_binary(int fd, off_t offset, rlm_detail_t const *inst, request_t *request,
+			       fr_packet_t *packet, fr_pair_list_t *list, bool compat, fr_hash_table_t *ht)
+{
+	fr_dbuff_t		dbuff;
+	fr_dbuff_uctx_talloc_t	tctx;
+	int			ret = -1;
+
+	if (!fr_dbuff_init_talloc(NULL, &dbuff, &tctx, 1024, SIZE_MAX)) {
+		RERROR("Out of memory");
+		return -1;
+	}
+
+	/*
+	 *	New files get a header so that the reader knows
+	 *	which format they're in.
+	 */
+	if (offset == 0) {
+		uint8_t file_hdr[FR_INTERNAL_RECORD_FILE_HEADER_LEN];
+
+		fr_internal_record_file_header(file_hdr);
+		if (fr_dbuff_in_memcpy(&dbuff, file_hdr, sizeof(file_hdr)) < 0) {
+			RERROR("Out of memory");
+			goto done;
+		}
+	}
+
+	if (detail_encode_binary(&dbuff, inst, request, packet, list, compat, ht) < 0) goto done;
+
+	if ((fr_dbuff_used(&dbuff) > (offset == 0 ? FR_INTERNAL_RECORD_FILE_HEADER_LEN : 0)) &&
+	    (write(fd, fr_dbuff_start(&dbuff), fr_dbuff_used(&dbuff)) != (ssize_t) fr_dbuff_used(&dbuff))) {
+		RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+		goto done;
+	}
+	ret = 0;
+
+done:
+	talloc_free(fr_dbuff_buff(&dbuff));
+	return ret;
+}
+
+static uint32_t detail_buffer_hash(void const *data)
+{
+	rlm_detail_buffer_t const *buf = data;
+
+	return fr_hash_string(buf->filename);
+}
+
+static int8_t detail_buffer_cmp(void const *a, void const *b)
+{
+	rlm_detail_buffer_t const *buf_a = a, *buf_b = b;
+	int ret;
+
+	ret = strcmp(buf_a->filename, buf_b->filename);
+	return CMP(ret, 0);
+}
+
+/** Write all of the buffered entries for a file, and free the buffer
+ *
+ * Entries from many requests are written with a single writev() while
+ * holding the file lock, so workers don't serialise on the lock for
+ * every entry.  Any requests waiting for the entries are resumed.
+ */
+static int detail_flush(rlm_detail_buffer_t *buf)
+{
+	rlm_detail_t const	*inst = buf->inst;
+	struct iovec		iov[2];
+	int			iovcnt = 0, fd, ret = -1;
+	off_t			offset;
+	ssize_t			total = 0;
+	uint8_t			file_hdr[FR_INTERNAL_RECORD_FILE_HEADER_LEN];
+	rlm_detail_waiter_t	*waiter;
+
+	(void) fr_hash_table_remove(buf->thread->buffers, buf);
+
+	fd = exfile_open(inst->ef, buf->filename, inst->perm, &offset);
+	if (fd < 0) {
+		PERROR("Couldn't open file %s", buf->filename);
+		goto done;
+	}
+
+	if (inst->group_is_set && (chown(buf->filename, -1, inst->group) == -1)) {
+		ERROR("Unable to set detail file group to '%d': %s", inst->group, fr_syserror(errno));
+		goto close;
+	}
+
+	if ((inst->format == DETAIL_FORMAT_BINARY) && (offset == 0)) {
+		fr_internal_record_file_header(file_hdr);
+		iov[iovcnt++] = (struct iovec) { .iov_base = file_hdr, .iov_len = sizeof(file_hdr) };
+		total += sizeof(file_hdr);
+	}
+
+	iov[iovcnt++] = (struct iovec) { .iov_base = fr_dbuff_start(&buf->dbuff), .iov_len = fr_dbuff_used(&buf->dbuff) };
+	total += fr_dbuff_used(&buf->dbuff);
+
+	if (writev(fd, iov, iovcnt) != total) {
+		ERROR("Failed writing to detail file %s: %s", buf->filename, fr_syserror(errno));
+		goto close;
+	}
+
+	if (inst->write_behind.sync && (detail_sync(fd) < 0)) {
+		ERROR("Failed syncing detail file %s: %s", buf->filename, fr_syserror(errno));
+		goto close;
+	}
+	ret = 0;
+
+close:
+	exfile_close(inst->ef, fd);
+
+done:
+	while ((waiter = fr_dlist_pop_head(&buf->waiting))) {
+		waiter->buffer = NULL;
+		waiter->ok = (ret == 0);
+		unlang_interpret_mark_runnable(waiter->request);
+	}
+
+	talloc_free(buf);
+
+	return ret;
+}
+
+static void detail_flush_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_detail_buffer_t *buf = talloc_get_type_abort(uctx, rlm_detail_buffer_t);
+
+	buf->ev = NULL;
+	(void) detail_flush(buf);
+}
+
+/** Find or create the buffer for a file
+ *
+ */
+static rlm_detail_buffer_t *detail_buffer(rlm_detail_t const *inst, rlm_detail_thread_t *thread,
+					  request_t *request, char const *filename)
+{
+	rlm_detail_buffer_t	*buf, find = { .filename = filename };
+
+	buf = fr_hash_table_find(thread->buffers, &find);
+	if (buf) return buf;
+
+	MEM(buf = talloc_zero(thread, rlm_detail_buffer_t));
+	buf->filename = talloc_strdup(buf, filename);
+	buf->inst = inst;
+	buf->thread = thread;
+	fr_dlist_talloc_init(&buf->waiting, rlm_detail_waiter_t, entry);
+
+	if (!fr_dbuff_init_talloc(buf, &buf->dbuff, &buf->tctx, 4096, inst->write_behind.size + UINT16_MAX)) {
+	error:
+		talloc_free(buf);
+		return NULL;
+	}
+
+	if (fr_event_timer_in(buf, thread->el, &buf->ev, inst->write_behind.interval, detail_flush_timer, buf) < 0) {
+		RPERROR("Failed inserting flush timer");
+		goto error;
+	}
+
+	if (!fr_hash_table_insert(thread->buffers, buf)) {
+		RERROR("Failed inserting detail buffer");
+		goto error;
+	}
+
+	return buf;
+}
+
+static unlang_action_t detail_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, UNUSED request_t *request)
+{
+	rlm_detail_waiter_t *waiter = talloc_get_type_abort(mctx->rctx, rlm_detail_waiter_t);
+	bool ok = waiter->ok;
+
+	talloc_free(waiter);
+
+	if (!ok) RETURN_MODULE_FAIL;
+	RETURN_MODULE_OK;
+}
+
+static void detail_signal(module_ctx_t const *mctx, UNUSED request_t *request, UNUSED fr_signal_t action)
+{
+	rlm_detail_waiter_t *waiter = talloc_get_type_abort(mctx->rctx, rlm_detail_waiter_t);
+
+	/*
+	 *	The entry will still be written, we just don't
+	 *	wait for it.
+	 */
+	if (waiter->buffer) fr_dlist_remove(&waiter->buffer->waiting, waiter);
+	talloc_free(waiter);
+}
+
+/** Add an entry to the per-thread buffer, instead of writing it immediately
+ *
+ */
+static unlang_action_t detail_buffered(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				       fr_packet_t *packet, fr_pair_list_t *list, bool compat)
+{
+	rlm_detail_env_t	*env = talloc_get_type_abort(mctx->env_data, rlm_detail_env_t);
+	rlm_detail_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_detail_t);
+	rlm_detail_thread_t	*thread = talloc_get_type_abort(mctx->thread, rlm_detail_thread_t);
+	rlm_detail_buffer_t	*buf;
+	rlm_detail_waiter_t	*waiter;
+	size_t			used;
+
+	buf = detail_buffer(inst, thread, request, env->filename.vb_strvalue);
+	if (!buf) RETURN_MODULE_FAIL;
+
+	used = fr_dbuff_used(&buf->dbuff);
+
+	if (inst->format == DETAIL_FORMAT_BINARY) {
+		if (detail_encode_binary(&buf->dbuff, inst, request, packet, list, compat, env->ht) < 0) RETURN_MODULE_FAIL;
+	} else {
+		char	*entry = NULL;
+		size_t	entry_len = 0;
+		FILE	*fp;
+		int	ret;
+
+		/*
+		 *	Re-use the normal writer, so both modes
+		 *	produce identical entries.
+		 */
+		fp = open_memstream(&entry, &entry_len);
+		if (!fp) {
+			RERROR("Failed creating buffer: %s", fr_syserror(errno));
+			RETURN_MODULE_FAIL;
+		}
+
+		ret = detail_write(fp, inst, request, &env->header, packet, list, compat, env->ht);
+		fclose(fp);
+
+		if ((ret == 0) && (fr_dbuff_in_memcpy(&buf->dbuff, (uint8_t *) entry, entry_len) < 0)) {
+			RERROR("Detail buffer full");
+			ret = -1;
+		}
+		free(entry);
+
+		if (ret < 0) RETURN_MODULE_FAIL;
+	}
+
+	/*
+	 *	Nothing was added.
+	 */
+	if (fr_dbuff_used(&buf->dbuff) == used) {
+		if (used == 0) {
+			(void) fr_hash_table_remove(thread->buffers, buf);
+			talloc_free(buf);
+		}
+		RETURN_MODULE_OK;
+	}
+
+	if (fr_dbuff_used(&buf->dbuff) >= inst->write_behind.size) {
+		if (detail_flush(buf) < 0) RETURN_MODULE_FAIL;
+		RETURN_MODULE_OK;
+	}
+
+	if (!inst->write_behind.sync) RETURN_MODULE_OK;
+
+	MEM(waiter = talloc_zero(unlang_interpret_frame_talloc_ctx(request), rlm_detail_waiter_t));
+	waiter->request = request;
+	waiter->buffer = buf;
+	fr_dlist_insert_tail(&buf->waiting, waiter);
+
+	return unlang_module_yield(request, detail_resume, detail_signal, ~FR_SIGNAL_CANCEL, waiter);
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
@@ -327,12 +761,17 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 	rlm_detail_env_t	*env = talloc_get_type_abort(mctx->env_data, rlm_detail_env_t);
 	int			outfd, dupfd;
 	FILE			*outfp = NULL;
+	off_t			offset;
 
 	rlm_detail_t const *inst = talloc_get_type_abort_const(mctx->mi->data, rlm_detail_t);
 
 	RDEBUG2("%s expands to %pV", env->filename_tmpl->name, &env->filename);
 
-	outfd = exfile_open(inst->ef, env->filename.vb_strvalue, inst->perm, NULL);
+	if (fr_time_delta_ispos(inst->write_behind.interval)) {
+		return detail_buffered(p_result, mctx, request, packet, list, compat);
+	}
+
+	outfd = exfile_open(inst->ef, env->filename.vb_strvalue, inst->perm, &offset);
 	if (outfd < 0) {
 		RPERROR("Couldn't open file %pV", &env->filename);
 		*p_result = RLM_MODULE_FAIL;
@@ -347,6 +786,13 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 		}
 	}
 
+	if (inst->format == DETAIL_FORMAT_BINARY) {
+		if (detail_write_binary(outfd, offset, inst, request, packet, list, compat, env->ht) < 0) goto fail;
+
+		exfile_close(inst->ef, outfd);
+		RETURN_MODULE_OK;
+	}
+
 	dupfd = dup(outfd);
 	if (dupfd < 0) {
 		RERROR("Failed to dup() file descriptor for detail file");
@@ -402,6 +848,31 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 	return detail_do(p_result, mctx, request, request->reply, &request->reply_pairs, false);
 }
 
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_detail_thread_t	*thread = talloc_get_type_abort(mctx->thread, rlm_detail_thread_t);
+
+	thread->el = mctx->el;
+	thread->buffers = fr_hash_table_alloc(thread, detail_buffer_hash, detail_buffer_cmp, NULL);
+	if (!thread->buffers) return -1;
+
+	return 0;
+}
+
+/** Write out anything still buffered
+ *
+ */
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_detail_thread_t	*thread = talloc_get_type_abort(mctx->thread, rlm_detail_thread_t);
+	rlm_detail_buffer_t	*buf;
+	fr_hash_iter_t		iter;
+
+	while ((buf = fr_hash_table_iter_init(thread->buffers, &iter))) (void) detail_flush(buf);
+
+	return 0;
+}
+
 static int call_env_filename_parse(TALLOC_CTX *ctx, void *out, tmpl_rules_t const *t_rules,
 				   CONF_ITEM *ci,
 				   call_env_ctx_t const *cec, UNUSED call_env_parser_t const *rule)
@@ -506,7 +977,12 @@ module_rlm_t rlm_detail = {
 		.name		= "detail",
 		.inst_size	= sizeof(rlm_detail_t),
 		.config		= module_config,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+
+		.thread_inst_size	= sizeof(rlm_detail_thread_t),
+		.thread_inst_type	= "rlm_detail_thread_t",
+		.thread_instantiate	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
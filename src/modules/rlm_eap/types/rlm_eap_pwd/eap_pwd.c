@@ -250,22 +250,12 @@ fail:
 	return ret;
 }
 
-int compute_password_element (request_t *request, pwd_session_t *session, uint16_t grp_num,
-			      char const *password, int password_len,
-			      char const *id_server, int id_server_len,
-			      char const *id_peer, int id_peer_len,
-			      uint32_t *token, BN_CTX *bnctx)
+/** Set up the curve and its parameters for a session
+ *
+ */
+static int pwd_group_init(pwd_session_t *session, uint16_t grp_num)
 {
-	BIGNUM		*x_candidate = NULL, *rnd = NULL, *y_sqrd = NULL, *qr = NULL, *qnr = NULL, *y1 = NULL, *y2 = NULL, *y = NULL, *exp = NULL;
-	EVP_MD_CTX	*hmac_ctx;
-	EVP_PKEY	*hmac_pkey;
-	uint8_t		pwe_digest[SHA256_DIGEST_LENGTH], *prfbuf = NULL, *xbuf = NULL, *pm1buf = NULL, *y1buf = NULL, *y2buf = NULL, *ybuf = NULL, ctr;
-	int		nid, is_odd, primebitlen, primebytelen, ret = 0, found = 0, mask;
-	int		save, i, rbits, qr_or_qnr, save_is_odd = 0, cmp;
-	unsigned int	skip;
-
-	MEM(hmac_ctx = EVP_MD_CTX_new());
-	MEM(hmac_pkey = EVP_PKEY_new_mac_key(EVP_PKEY_HMAC, NULL, allzero, sizeof(allzero)));
+	int nid;
 
 	switch (grp_num) { /* from IANA registry for IKE D-H groups */
 	case 19:
@@ -290,7 +280,7 @@ int compute_password_element (request_t *request, pwd_session_t *session, uint16
 
 	default:
 		DEBUG("unknown group %d", grp_num);
-		goto fail;
+		return -1;
 	}
 
 	session->pwe = NULL;
@@ -299,13 +289,80 @@ int compute_password_element (request_t *request, pwd_session_t *session, uint16
 
 	if ((session->group = EC_GROUP_new_by_curve_name(nid)) == NULL) {
 		DEBUG("unable to create EC_GROUP");
-		goto fail;
+		return -1;
+	}
+
+	if (((session->order = consttime_BN()) == NULL) ||
+	    ((session->prime = consttime_BN()) == NULL)) {
+		DEBUG("unable to create bignums");
+		return -1;
+	}
+
+	if (!EC_GROUP_get_curve(session->group, session->prime, NULL, NULL, NULL)) {
+		DEBUG("unable to get prime for GFp curve");
+		return -1;
+	}
+
+	if (!EC_GROUP_get_order(session->group, session->order, NULL)) {
+		DEBUG("unable to get order for curve");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Use a password element from a previous session
+ *
+ * The element must have been derived from the same token, identities
+ * and password as the current session, which saves us hunting and
+ * pecking for it again.
+ *
+ * @param[in] request		The current request.
+ * @param[in] session		to load the element into.
+ * @param[in] grp_num		the element was derived for.
+ * @param[in] pwe		Octet string encoding of the element.
+ * @param[in] pwe_len		Length of the encoded element.
+ * @param[in] bnctx		to use for bignum operations.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int load_password_element(UNUSED request_t *request, pwd_session_t *session, uint16_t grp_num,
+			  uint8_t const *pwe, size_t pwe_len, BN_CTX *bnctx)
+{
+	if (pwd_group_init(session, grp_num) < 0) return -1;
+
+	if (((session->pwe = EC_POINT_new(session->group)) == NULL) ||
+	    !EC_POINT_oct2point(session->group, session->pwe, pwe, pwe_len, bnctx)) {
+		DEBUG("unable to load password element");
+		return -1;
 	}
+	session->group_num = grp_num;
+
+	return 0;
+}
+
+int compute_password_element (request_t *request, pwd_session_t *session, uint16_t grp_num,
+			      char const *password, int password_len,
+			      char const *id_server, int id_server_len,
+			      char const *id_peer, int id_peer_len,
+			      uint32_t *token, BN_CTX *bnctx)
+{
+	BIGNUM		*x_candidate = NULL, *rnd = NULL, *y_sqrd = NULL, *qr = NULL, *qnr = NULL, *y1 = NULL, *y2 = NULL, *y = NULL, *exp = NULL;
+	EVP_MD_CTX	*hmac_ctx;
+	EVP_PKEY	*hmac_pkey;
+	uint8_t		pwe_digest[SHA256_DIGEST_LENGTH], *prfbuf = NULL, *xbuf = NULL, *pm1buf = NULL, *y1buf = NULL, *y2buf = NULL, *ybuf = NULL, ctr;
+	int		is_odd, primebitlen, primebytelen, ret = 0, found = 0, mask;
+	int		save, i, rbits, qr_or_qnr, save_is_odd = 0, cmp;
+	unsigned int	skip;
+
+	MEM(hmac_ctx = EVP_MD_CTX_new());
+	MEM(hmac_pkey = EVP_PKEY_new_mac_key(EVP_PKEY_HMAC, NULL, allzero, sizeof(allzero)));
+
+	if (pwd_group_init(session, grp_num) < 0) goto fail;
 
 	if (((rnd = consttime_BN()) == NULL) ||
 	    ((session->pwe = EC_POINT_new(session->group)) == NULL) ||
-	    ((session->order = consttime_BN()) == NULL) ||
-	    ((session->prime = consttime_BN()) == NULL) ||
 	    ((qr = consttime_BN()) == NULL) ||
 	    ((qnr = consttime_BN()) == NULL) ||
 	    ((x_candidate = consttime_BN()) == NULL) ||
@@ -318,16 +375,6 @@ int compute_password_element (request_t *request, pwd_session_t *session, uint16
 		goto fail;
 	}
 
-	if (!EC_GROUP_get_curve(session->group, session->prime, NULL, NULL, NULL)) {
-		DEBUG("unable to get prime for GFp curve");
-		goto fail;
-	}
-
-	if (!EC_GROUP_get_order(session->group, session->order, NULL)) {
-		DEBUG("unable to get order for curve");
-		goto fail;
-	}
-
 	primebitlen = BN_num_bits(session->prime);
 	primebytelen = BN_num_bytes(session->prime);
 	if ((prfbuf = talloc_zero_array(session, uint8_t, primebytelen)) == NULL) {
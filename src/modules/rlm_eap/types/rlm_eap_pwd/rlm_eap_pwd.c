@@ -39,6 +39,8 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #include "eap_pwd.h"
 
+typedef struct pwd_cache_s pwd_cache_t;
+
 typedef struct {
     BN_CTX *bnctx;
 
@@ -46,6 +48,10 @@ typedef struct {
     uint32_t	fragment_size;
     char const	*server_id;
     char const	*virtual_server;
+
+    uint32_t		cache_max_entries;
+    fr_time_delta_t	cache_lifetime;
+    pwd_cache_t		*cache;
 } rlm_eap_pwd_t;
 
 #define MPPE_KEY_LEN    32
@@ -55,6 +61,8 @@ static conf_parser_t submodule_config[] = {
 	{ FR_CONF_OFFSET("group", rlm_eap_pwd_t, group), .dflt = "19" },
 	{ FR_CONF_OFFSET("fragment_size", rlm_eap_pwd_t, fragment_size), .dflt = "1020" },
 	{ FR_CONF_OFFSET_FLAGS("server_id", CONF_FLAG_REQUIRED, rlm_eap_pwd_t, server_id) },
+	{ FR_CONF_OFFSET("cache_max_entries", rlm_eap_pwd_t, cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_lifetime", rlm_eap_pwd_t, cache_lifetime), .dflt = "300" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -82,6 +90,225 @@ fr_dict_attr_autoload_t rlm_eap_pwd_dict_attr[] = {
 	{ NULL }
 };
 
+/** A password element from a previous session
+ *
+ * The token is part of the password seed, so a cached element is only
+ * useful if the next session with the same identity is given the same
+ * token.  We therefore look up the token when starting a session, and
+ * check the element was derived from the same token, identities, and
+ * password when processing the ID response.
+ */
+typedef struct {
+	char const		*identity;		//!< EAP-Identity the element was derived for.
+	uint16_t		group_num;		//!< Group the element is on.
+	uint32_t		token;			//!< Token to send in the ID request.
+	uint8_t			digest[SHA256_DIGEST_LENGTH];	//!< Of all inputs used to derive the element.
+	uint8_t			*pwe;			//!< Octet string encoding of the element.
+	fr_time_t		expires;		//!< When the entry must no longer be used.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} pwd_cache_entry_t;
+
+struct pwd_cache_s {
+	pthread_mutex_t		mutex;			//!< Lookups and updates can happen in any worker.
+	fr_hash_table_t		*ht;			//!< Entries by identity and group.
+	fr_dlist_head_t		lru;			//!< Least recently used entries at the head.
+	uint32_t		max_entries;		//!< Maximum number of cached elements.
+	fr_time_delta_t		lifetime;		//!< How long elements (and their tokens) are reused for.
+};
+
+static uint32_t pwd_cache_entry_hash(void const *data)
+{
+	pwd_cache_entry_t const *e = data;
+
+	return fr_hash_update(&e->group_num, sizeof(e->group_num), fr_hash_string(e->identity));
+}
+
+static int8_t pwd_cache_entry_cmp(void const *one, void const *two)
+{
+	pwd_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	CMP_RETURN(a, b, group_num);
+
+	ret = strcmp(a->identity, b->identity);
+	return CMP(ret, 0);
+}
+
+static void pwd_cache_entry_free(void *data)
+{
+	pwd_cache_entry_t *e = data;
+
+	if (e->pwe) memset_explicit(e->pwe, 0, talloc_array_length(e->pwe));
+	memset_explicit(e->digest, 0, sizeof(e->digest));
+	talloc_free(e);
+}
+
+static int _pwd_cache_free(pwd_cache_t *cache)
+{
+	talloc_free(cache->ht);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+static pwd_cache_t *pwd_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, fr_time_delta_t lifetime)
+{
+	pwd_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, pwd_cache_t));
+
+	/*
+	 *	Entries are allocated in the NULL ctx, so that
+	 *	workers only ever touch the chunks belonging
+	 *	to the entries they're manipulating.
+	 */
+	cache->ht = fr_hash_table_alloc(NULL, pwd_cache_entry_hash, pwd_cache_entry_cmp, pwd_cache_entry_free);
+	if (!cache->ht) {
+		talloc_free(cache);
+		return NULL;
+	}
+	fr_dlist_talloc_init(&cache->lru, pwd_cache_entry_t, entry);
+	cache->max_entries = max_entries;
+	cache->lifetime = lifetime;
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _pwd_cache_free);
+
+	return cache;
+}
+
+/** Find a live entry, removing it if it has expired
+ *
+ * @note Must be called with the mutex held.
+ */
+static pwd_cache_entry_t *pwd_cache_find_locked(pwd_cache_t *cache, char const *identity, uint16_t group_num)
+{
+	pwd_cache_entry_t *e;
+
+	e = fr_hash_table_find(cache->ht, &(pwd_cache_entry_t){ .identity = identity, .group_num = group_num });
+	if (!e) return NULL;
+
+	if (fr_time_lteq(e->expires, fr_time())) {
+		fr_dlist_remove(&cache->lru, e);
+		fr_hash_table_delete(cache->ht, e);
+		return NULL;
+	}
+
+	return e;
+}
+
+/** Retrieve the token which was used to derive a cached element
+ *
+ */
+static bool pwd_cache_token(uint32_t *token, pwd_cache_t *cache, char const *identity, uint16_t group_num)
+{
+	pwd_cache_entry_t	*e;
+	bool			found = false;
+
+	pthread_mutex_lock(&cache->mutex);
+	e = pwd_cache_find_locked(cache, identity, group_num);
+	if (e) {
+		*token = e->token;
+		found = true;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+/** Retrieve a cached element, if it was derived from the same inputs
+ *
+ * If the inputs differ, i.e. the password or the peer's identity have
+ * changed, the entry is removed.
+ */
+static bool pwd_cache_find(TALLOC_CTX *ctx, uint8_t **pwe, pwd_cache_t *cache, char const *identity,
+			   uint16_t group_num, uint8_t const digest[static SHA256_DIGEST_LENGTH])
+{
+	pwd_cache_entry_t	*e;
+	bool			found = false;
+
+	pthread_mutex_lock(&cache->mutex);
+	e = pwd_cache_find_locked(cache, identity, group_num);
+	if (!e) goto done;
+
+	if (CRYPTO_memcmp(e->digest, digest, SHA256_DIGEST_LENGTH) != 0) {
+		fr_dlist_remove(&cache->lru, e);
+		fr_hash_table_delete(cache->ht, e);
+		goto done;
+	}
+
+	MEM(*pwe = talloc_memdup(ctx, e->pwe, talloc_array_length(e->pwe)));
+	fr_dlist_remove(&cache->lru, e);
+	fr_dlist_insert_tail(&cache->lru, e);
+	found = true;
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+/** Add or replace the cached element for an identity
+ *
+ * The lifetime isn't extended when an element is reused, so the
+ * token an identity is given changes at least once per lifetime.
+ */
+static void pwd_cache_insert(pwd_cache_t *cache, char const *identity, uint16_t group_num, uint32_t token,
+			     uint8_t const digest[static SHA256_DIGEST_LENGTH], uint8_t const *pwe, size_t pwe_len)
+{
+	pwd_cache_entry_t	*e, *old;
+
+	MEM(e = talloc_zero(NULL, pwd_cache_entry_t));
+	MEM(e->identity = talloc_strdup(e, identity));
+	e->group_num = group_num;
+	e->token = token;
+	memcpy(e->digest, digest, sizeof(e->digest));
+	MEM(e->pwe = talloc_memdup(e, pwe, pwe_len));
+	e->expires = fr_time_add(fr_time(), cache->lifetime);
+
+	pthread_mutex_lock(&cache->mutex);
+	old = fr_hash_table_find(cache->ht, e);
+	if (old) {
+		fr_dlist_remove(&cache->lru, old);
+		fr_hash_table_delete(cache->ht, old);
+	}
+
+	while (fr_hash_table_num_elements(cache->ht) >= cache->max_entries) {
+		old = fr_dlist_pop_head(&cache->lru);
+		if (!old) break;
+		fr_hash_table_delete(cache->ht, old);
+	}
+
+	if (!fr_hash_table_insert(cache->ht, e)) {
+		pthread_mutex_unlock(&cache->mutex);
+		pwd_cache_entry_free(e);
+		return;
+	}
+	fr_dlist_insert_tail(&cache->lru, e);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Digest all the inputs used to derive the password element
+ *
+ */
+static void pwd_cache_digest(uint8_t digest[static SHA256_DIGEST_LENGTH], pwd_session_t *session,
+			     char const *password, size_t password_len, char const *server_id)
+{
+	EVP_MD_CTX	*md_ctx;
+	uint8_t		zero = 0;
+
+	MEM(md_ctx = EVP_MD_CTX_new());
+	EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(md_ctx, &session->group_num, sizeof(session->group_num));
+	EVP_DigestUpdate(md_ctx, &session->token, sizeof(session->token));
+	EVP_DigestUpdate(md_ctx, session->peer_id, session->peer_id_len);
+	EVP_DigestUpdate(md_ctx, &zero, sizeof(zero));
+	EVP_DigestUpdate(md_ctx, server_id, strlen(server_id));
+	EVP_DigestUpdate(md_ctx, &zero, sizeof(zero));
+	EVP_DigestUpdate(md_ctx, password, password_len);
+	EVP_DigestFinal_ex(md_ctx, digest, NULL);
+	EVP_MD_CTX_free(md_ctx);
+}
+
 static int send_pwd_request(request_t *request, pwd_session_t *session, eap_round_t *eap_round)
 {
 	size_t		len;
@@ -278,8 +505,10 @@ static unlang_action_t mod_process(rlm_rcode_t *p_result, module_ctx_t const *mc
 		fr_pair_t		*known_good;
 		fr_dict_attr_t const	*allowed_passwords[] = { attr_cleartext_password };
 		int			ret;
-		bool			ephemeral;
+		bool			ephemeral, cached = false;
 		BIGNUM			*x = NULL, *y = NULL;
+		uint8_t			digest[SHA256_DIGEST_LENGTH];
+		uint8_t			*pwe;
 
 		if (EAP_PWD_GET_EXCHANGE(hdr) != EAP_PWD_EXCH_ID) {
 			REDEBUG("PWD exchange is incorrect, Not ID");
@@ -327,17 +556,61 @@ static unlang_action_t mod_process(rlm_rcode_t *p_result, module_ctx_t const *mc
 			RETURN_MODULE_FAIL;
 		}
 
-		ret = compute_password_element(request, session, session->group_num,
-					       known_good->vp_strvalue, known_good->vp_length,
-					       inst->server_id, strlen(inst->server_id),
-					       session->peer_id, strlen(session->peer_id),
-					       &session->token, inst->bnctx);
+		/*
+		 *	Hunting and pecking is expensive, so reuse the
+		 *	password element from a previous session if it
+		 *	was derived from exactly the same inputs.
+		 */
+		if (inst->cache && eap_session->identity) {
+			pwd_cache_digest(digest, session, known_good->vp_strvalue, known_good->vp_length,
+					 inst->server_id);
+
+			if (pwd_cache_find(request, &pwe, inst->cache, eap_session->identity,
+					   session->group_num, digest)) {
+				RDEBUG2("Using cached password element");
+				ret = load_password_element(request, session, session->group_num,
+							    pwe, talloc_array_length(pwe), inst->bnctx);
+				talloc_free(pwe);
+				if (ret < 0) {
+					if (ephemeral) TALLOC_FREE(known_good);
+					REDEBUG("Failed to load cached password element");
+					RETURN_MODULE_FAIL;
+				}
+				cached = true;
+			}
+		}
+
+		if (!cached) {
+			ret = compute_password_element(request, session, session->group_num,
+						       known_good->vp_strvalue, known_good->vp_length,
+						       inst->server_id, strlen(inst->server_id),
+						       session->peer_id, strlen(session->peer_id),
+						       &session->token, inst->bnctx);
+		}
 		if (ephemeral) TALLOC_FREE(known_good);
 		if (ret < 0) {
 			REDEBUG("Failed to obtain password element");
 			RETURN_MODULE_FAIL;
 		}
 
+		if (!cached && inst->cache && eap_session->identity) {
+			size_t len;
+
+			len = EC_POINT_point2oct(session->group, session->pwe, POINT_CONVERSION_UNCOMPRESSED,
+						 NULL, 0, inst->bnctx);
+			if (len > 0) {
+				MEM(pwe = talloc_array(request, uint8_t, len));
+				if (EC_POINT_point2oct(session->group, session->pwe, POINT_CONVERSION_UNCOMPRESSED,
+						       pwe, len, inst->bnctx) == len) {
+					pwd_cache_insert(inst->cache, eap_session->identity, session->group_num,
+							 session->token, digest, pwe, len);
+				}
+				memset_explicit(pwe, 0, len);
+				talloc_free(pwe);
+			}
+		}
+		memset_explicit(digest, 0, sizeof(digest));
+
 		/*
 		 *	Compute our scalar and element
 		 */
@@ -530,7 +803,16 @@ static unlang_action_t mod_session_init(rlm_rcode_t *p_result, module_ctx_t cons
 	packet->group_num = htons(session->group_num);
 	packet->random_function = EAP_PWD_DEF_RAND_FUN;
 	packet->prf = EAP_PWD_DEF_PRF;
-	session->token = fr_rand();
+
+	/*
+	 *	If we have a cached password element for this
+	 *	identity, send the token it was derived with, so
+	 *	we can use it again.
+	 */
+	if (!inst->cache || !eap_session->identity ||
+	    !pwd_cache_token(&session->token, inst->cache, eap_session->identity, session->group_num)) {
+		session->token = fr_rand();
+	}
 	memcpy(packet->token, (char *)&session->token, 4);
 	packet->prep = EAP_PWD_PREP_NONE;
 	memcpy(packet->identity, inst->server_id, session->out_len - sizeof(pwd_id_packet_t) );
@@ -580,6 +862,14 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	if (inst->cache_max_entries) {
+		inst->cache = pwd_cache_alloc(inst, inst->cache_max_entries, inst->cache_lifetime);
+		if (!inst->cache) {
+			cf_log_err(conf, "Failed allocating password element cache");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
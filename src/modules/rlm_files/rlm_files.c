@@ -27,6 +27,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/server/pairmove.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/server/users_file.h>
 #include <freeradius-devel/util/htrie.h>
 #include <freeradius-devel/unlang/call_env.h>
@@ -38,14 +39,23 @@ RCSID("$Id$")
 
 typedef struct {
 	char const	*filename;
+	fr_time_delta_t	reload_interval;	//!< How often to check the file for changes.
 } rlm_files_t;
 
-/**  Structure produced by custom call_env parser
+/**  One version of the parsed files
  */
 typedef struct {
-	tmpl_t		*key_tmpl;	//!< tmpl used to evaluate lookup key.
 	fr_htrie_t	*htrie;		//!< parsed files "user" data.
 	PAIR_LIST_LIST	*def;		//!< parsed files DEFAULT data.
+} rlm_files_users_t;
+
+/**  Structure produced by custom call_env parser
+ */
+typedef struct {
+	tmpl_t		*key_tmpl;	//!< tmpl used to evaluate lookup key.
+	fr_type_t	keytype;	//!< Data type of the key.
+	fr_dict_t const	*dict;		//!< To parse the files with.
+	fr_reload_t	*reload;	//!< Holding the current rlm_files_users_t.
 } rlm_files_data_t;
 
 /**  Call_env structure
@@ -78,6 +88,7 @@ fr_dict_attr_autoload_t rlm_files_dict_attr[] = {
 
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("filename", CONF_FLAG_REQUIRED | CONF_FLAG_FILE_INPUT, rlm_files_t, filename) },
+	{ FR_CONF_OFFSET("reload_interval", rlm_files_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -406,8 +417,9 @@ static unlang_action_t CC_HINT(nonnull) mod_files_resume(rlm_rcode_t *p_result,
 	uint8_t			key_buffer[16], *key;
 	size_t			keylen = 0;
 	fr_edit_list_t		*el, *child;
-	fr_htrie_t		*tree = env->data->htrie;
-	PAIR_LIST_LIST		*default_list = env->data->def;
+	rlm_files_users_t const	*users = fr_reload_data(env->data->reload);
+	fr_htrie_t		*tree = users->htrie;
+	PAIR_LIST_LIST		*default_list = users->def;
 	fr_value_box_t		*key_vb = fr_value_box_list_head(&env->values);
 
 	if (!key_vb) {
@@ -646,6 +658,25 @@ static unlang_action_t CC_HINT(nonnull) mod_files(rlm_rcode_t *p_result, module_
 	return UNLANG_ACTION_PUSHED_CHILD;
 }
 
+/** Parse a version of the files data
+ *
+ * Called at startup, and from the reload thread when the file changes.
+ */
+static int files_load(void **out, TALLOC_CTX *ctx, char const *filename, void *uctx)
+{
+	rlm_files_data_t const		*files_data = uctx;
+	rlm_files_users_t		*users;
+
+	users = talloc_zero(ctx, rlm_files_users_t);
+	if (!users) return -1;
+
+	if (getrecv_filename(users, filename, &users->htrie, &users->def,
+			     files_data->keytype, files_data->dict) < 0) return -1;
+
+	*out = users;
+	return 0;
+}
+
 /** Custom call_env parser for loading files data
  *
  */
@@ -671,8 +702,12 @@ static int call_env_parse(TALLOC_CTX *ctx, void *out, tmpl_rules_t const *t_rule
 		return -1;
 	}
 
-	if (getrecv_filename(files_data, inst->filename, &files_data->htrie, &files_data->def,
-			     keytype, t_rules->attr.dict_def) < 0) goto error;
+	files_data->keytype = keytype;
+	files_data->dict = t_rules->attr.dict_def;
+
+	files_data->reload = fr_reload_alloc(files_data, cec->mi->name, inst->filename,
+					     files_load, files_data, inst->reload_interval);
+	if (!files_data->reload) goto error;
 
 	*(void **)out = files_data;
 	return 0;
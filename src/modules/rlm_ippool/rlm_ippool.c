@@ -0,0 +1,986 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_ippool.c
+ * @brief In-memory IPv4 address pool.
+ *
+ * The pool is a bitmap with one bit per address, shared by all worker threads.
+ * Free addresses are claimed with a compare and swap on the bitmap word, so
+ * threads allocating different addresses never wait for each other.
+ *
+ * Leases are indexed by a 64bit hash of their owner.  The index is split into
+ * shards, each with its own mutex, which is held while an owner's lease is
+ * looked up and changed.
+ *
+ * Changes are buffered per thread and appended to a journal, which is replayed
+ * and compacted when the server starts.
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/unlang/call_env.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#define IPPOOL_MAX_ADDRESSES	(1 << 24)		//!< Largest pool we support (a /8).
+#define IPPOOL_NUM_SHARDS	64			//!< Shards in the owner index.  Must be a power of 2.
+#define IPPOOL_NONE		UINT32_MAX		//!< End of an owner hash chain.
+#define IPPOOL_JOURNAL_BATCH	128			//!< Journal entries buffered by each thread.
+#define IPPOOL_SWEEP_WORDS	4096			//!< Bitmap words checked for expired leases per sweep.
+
+#define IPPOOL_JOURNAL_MAGIC	"FRIPJ001"
+
+/** An address in the pool
+ *
+ * expires, owner and shard are atomic so that the sweeper can check them
+ * without holding the owner's shard mutex.  They're only changed with the
+ * mutex held.
+ */
+typedef struct {
+	_Atomic(uint64_t)	expires;	//!< When the lease expires (seconds since the epoch).
+						///< 0 if the address is free.
+	_Atomic(uint64_t)	owner;		//!< Hash of the lease owner.
+	_Atomic(uint32_t)	shard;		//!< Shard the lease is indexed in.
+	uint32_t		next;		//!< Next lease in the owner hash chain.
+} rlm_ippool_lease_t;
+
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Protects the chains in this shard.
+	uint32_t		*buckets;	//!< Heads of the owner hash chains.
+} rlm_ippool_shard_t;
+
+/** What's written to the journal for each change
+ *
+ */
+typedef struct {
+	uint64_t		seq;		//!< Orders changes to the same address.
+	uint64_t		owner;		//!< Hash of the lease owner.
+	uint64_t		expires;	//!< When the lease expires, 0 if it was released.
+	uint32_t		index;		//!< Offset of the address from the start of the pool.
+	uint32_t		reserved;
+} rlm_ippool_journal_entry_t;
+
+typedef struct {
+	char			magic[8];	//!< IPPOOL_JOURNAL_MAGIC.
+	uint32_t		start;		//!< First address in the pool (network order).
+	uint32_t		num;		//!< Number of addresses in the pool.
+} rlm_ippool_journal_header_t;
+
+typedef struct {
+	_Atomic(uint64_t)	*bitmap;	//!< One bit per address, set if it's allocated.
+	rlm_ippool_lease_t	*leases;	//!< One per bit in the bitmap.
+	rlm_ippool_shard_t	shard[IPPOOL_NUM_SHARDS];	//!< Owner index.
+
+	_Atomic(uint64_t)	seq;		//!< Next journal sequence number.
+	_Atomic(uint32_t)	sweep;		//!< Next bitmap word to check for expired leases.
+	_Atomic(uint32_t)	num_free;	//!< Addresses with their bit clear.
+
+	int			journal_fd;	//!< Journal we append to.
+} rlm_ippool_mutable_t;
+
+typedef struct {
+	fr_ipaddr_t		start;		//!< First address in the pool.
+	fr_ipaddr_t		end;		//!< Last address in the pool.
+
+	struct {
+		char const		*filename;	//!< Where leases are persisted.
+		fr_time_delta_t		interval;	//!< How often threads flush their journal entries.
+	} journal;
+
+	fr_time_delta_t		sweep_interval;	//!< How often threads look for expired leases.
+
+	uint32_t		num;		//!< Number of addresses in the pool.
+	uint32_t		num_words;	//!< Number of bitmap words.
+	uint32_t		bucket_mask;	//!< Mask to get the bucket from an owner hash.
+
+	rlm_ippool_mutable_t	*mutable;	//!< Mutable instance data.
+} rlm_ippool_t;
+
+typedef struct {
+	rlm_ippool_t const	*inst;		//!< Instance data.
+	fr_event_list_t		*el;		//!< Thread's event list.
+
+	uint32_t		cursor;		//!< Bitmap word we last found a free address in.
+
+	rlm_ippool_journal_entry_t	journal[IPPOOL_JOURNAL_BATCH];	//!< Entries waiting to be written.
+	uint32_t		journal_used;	//!< How many entries are in the buffer.
+	fr_event_timer_t const	*journal_ev;	//!< Journal flush timer.
+	fr_event_timer_t const	*sweep_ev;	//!< Expiry sweep timer.
+} rlm_ippool_thread_t;
+
+static conf_parser_t journal_config[] = {
+	{ FR_CONF_OFFSET_FLAGS("filename", CONF_FLAG_FILE_OUTPUT, rlm_ippool_t, journal.filename) },
+	{ FR_CONF_OFFSET("interval", rlm_ippool_t, journal.interval), .dflt = "1" },
+	CONF_PARSER_TERMINATOR
+};
+
+static conf_parser_t module_config[] = {
+	{ FR_CONF_OFFSET_TYPE_FLAGS("start", FR_TYPE_IPV4_ADDR, CONF_FLAG_REQUIRED, rlm_ippool_t, start) },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("end", FR_TYPE_IPV4_ADDR, CONF_FLAG_REQUIRED, rlm_ippool_t, end) },
+
+	{ FR_CONF_OFFSET("sweep_interval", rlm_ippool_t, sweep_interval), .dflt = "1" },
+
+	{ FR_CONF_POINTER("journal", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) journal_config },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Call environment used by all of the ippool methods
+ *
+ */
+typedef struct {
+	fr_value_box_t	owner;				//!< Unique lease owner identifier.
+
+	fr_value_box_t	offer_time;			//!< How long we should reserve a lease for during
+							///< the pre-allocation stage (typically responding
+							///< to DHCP discover).
+
+	fr_value_box_t	lease_time;			//!< How long an IP address should be allocated for.
+
+	fr_value_box_t	requested_address;		//!< Address the client asked for.
+
+	tmpl_t		*allocated_address_attr;	//!< Attribute to populate with allocated IP.
+
+	tmpl_t		*expiry_attr;			//!< Attribute to populate with the lease time.
+} ippool_call_env_t;
+
+#define IPPOOL_ENV_OWNER \
+	{ FR_CALL_ENV_OFFSET("owner", FR_TYPE_STRING, CALL_ENV_FLAG_REQUIRED | CALL_ENV_FLAG_CONCAT, ippool_call_env_t, owner) }
+
+#define IPPOOL_ENV_REQUESTED_ADDRESS \
+	{ FR_CALL_ENV_OFFSET("requested_address", FR_TYPE_COMBO_IP_ADDR, CALL_ENV_FLAG_REQUIRED | CALL_ENV_FLAG_NULLABLE, ippool_call_env_t, requested_address), \
+			     .pair.dflt = "%{%{Requested-IP-Address} || %{Net.Src.IP}}", .pair.dflt_quote = T_DOUBLE_QUOTED_STRING }
+
+static const call_env_method_t ippool_alloc_method_env = {
+	FR_CALL_ENV_METHOD_OUT(ippool_call_env_t),
+	.env = (call_env_parser_t[]){
+		IPPOOL_ENV_OWNER,
+		{ FR_CALL_ENV_OFFSET("offer_time", FR_TYPE_UINT32, CALL_ENV_FLAG_NONE, ippool_call_env_t, offer_time) },
+		{ FR_CALL_ENV_OFFSET("lease_time", FR_TYPE_UINT32, CALL_ENV_FLAG_REQUIRED, ippool_call_env_t, lease_time) },
+		IPPOOL_ENV_REQUESTED_ADDRESS,
+		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("allocated_address_attr", FR_TYPE_VOID, CALL_ENV_FLAG_ATTRIBUTE | CALL_ENV_FLAG_REQUIRED, ippool_call_env_t, allocated_address_attr) },
+		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("expiry_attr", FR_TYPE_VOID, CALL_ENV_FLAG_ATTRIBUTE, ippool_call_env_t, expiry_attr) },
+		CALL_ENV_TERMINATOR
+	}
+};
+
+static const call_env_method_t ippool_update_method_env = {
+	FR_CALL_ENV_METHOD_OUT(ippool_call_env_t),
+	.env = (call_env_parser_t[]){
+		IPPOOL_ENV_OWNER,
+		{ FR_CALL_ENV_OFFSET("lease_time", FR_TYPE_UINT32, CALL_ENV_FLAG_REQUIRED, ippool_call_env_t, lease_time) },
+		IPPOOL_ENV_REQUESTED_ADDRESS,
+		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("allocated_address_attr", FR_TYPE_VOID, CALL_ENV_FLAG_ATTRIBUTE | CALL_ENV_FLAG_REQUIRED, ippool_call_env_t, allocated_address_attr) },
+		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("expiry_attr", FR_TYPE_VOID, CALL_ENV_FLAG_ATTRIBUTE, ippool_call_env_t, expiry_attr) },
+		CALL_ENV_TERMINATOR
+	}
+};
+
+static const call_env_method_t ippool_release_method_env = {
+	FR_CALL_ENV_METHOD_OUT(ippool_call_env_t),
+	.env = (call_env_parser_t[]){
+		IPPOOL_ENV_OWNER,
+		IPPOOL_ENV_REQUESTED_ADDRESS,
+		CALL_ENV_TERMINATOR
+	}
+};
+
+/** Hash an owner identifier
+ *
+ * Zero is never returned, so it can be used to mean "no owner".
+ */
+static inline uint64_t ippool_owner_hash(fr_value_box_t const *owner)
+{
+	uint64_t hash;
+
+	hash = ((uint64_t)fr_hash(owner->vb_strvalue, owner->vb_length) << 32) |
+		fr_hash_update(owner->vb_strvalue, owner->vb_length, 0x9e3779b9);
+
+	return hash ? hash : 1;
+}
+
+static inline rlm_ippool_shard_t *ippool_shard(rlm_ippool_t const *inst, uint64_t owner)
+{
+	return &inst->mutable->shard[owner & (IPPOOL_NUM_SHARDS - 1)];
+}
+
+static inline uint32_t *ippool_bucket(rlm_ippool_t const *inst, rlm_ippool_shard_t *shard, uint64_t owner)
+{
+	return &shard->buckets[(owner >> 32) & inst->bucket_mask];
+}
+
+/** Find the lease held by an owner
+ *
+ * @note The owner's shard mutex must be held.
+ */
+static uint32_t ippool_owner_find(rlm_ippool_t const *inst, rlm_ippool_shard_t *shard, uint64_t owner)
+{
+	uint32_t idx;
+
+	for (idx = *ippool_bucket(inst, shard, owner);
+	     idx != IPPOOL_NONE;
+	     idx = inst->mutable->leases[idx].next) {
+		if (atomic_load_explicit(&inst->mutable->leases[idx].owner, memory_order_relaxed) == owner) return idx;
+	}
+
+	return IPPOOL_NONE;
+}
+
+/** Remove a lease from its owner's hash chain
+ *
+ * @note The owner's shard mutex must be held.
+ */
+static void ippool_owner_unlink(rlm_ippool_t const *inst, rlm_ippool_shard_t *shard, uint32_t idx)
+{
+	rlm_ippool_lease_t	*leases = inst->mutable->leases;
+	uint32_t		*p;
+
+	for (p = ippool_bucket(inst, shard, atomic_load_explicit(&leases[idx].owner, memory_order_relaxed));
+	     *p != IPPOOL_NONE;
+	     p = &leases[*p].next) {
+		if (*p == idx) {
+			*p = leases[idx].next;
+			leases[idx].next = IPPOOL_NONE;
+			return;
+		}
+	}
+}
+
+/** Try to set the bit for a specific address
+ *
+ */
+static bool ippool_claim(rlm_ippool_t const *inst, uint32_t idx)
+{
+	_Atomic(uint64_t)	*word = &inst->mutable->bitmap[idx / 64];
+	uint64_t		bit = (uint64_t)1 << (idx % 64);
+	uint64_t		w = atomic_load_explicit(word, memory_order_relaxed);
+
+	do {
+		if (w & bit) return false;
+	} while (!atomic_compare_exchange_weak_explicit(word, &w, w | bit,
+							memory_order_acquire, memory_order_relaxed));
+
+	atomic_fetch_sub_explicit(&inst->mutable->num_free, 1, memory_order_relaxed);
+
+	return true;
+}
+
+/** Claim any free address
+ *
+ * Each thread starts searching where it last found a free address, so
+ * threads mostly work on different bitmap words.
+ */
+static uint32_t ippool_claim_any(rlm_ippool_thread_t *t)
+{
+	rlm_ippool_t const	*inst = t->inst;
+	uint32_t		i, wi;
+
+	if (!atomic_load_explicit(&inst->mutable->num_free, memory_order_relaxed)) return IPPOOL_NONE;
+
+	for (i = 0; i < inst->num_words; i++) {
+		_Atomic(uint64_t)	*word;
+		uint64_t		w;
+
+		wi = (t->cursor + i) % inst->num_words;
+		word = &inst->mutable->bitmap[wi];
+		w = atomic_load_explicit(word, memory_order_relaxed);
+
+		while (~w) {
+			uint64_t bit = ~w & -(~w);	/* Lowest clear bit */
+
+			if (atomic_compare_exchange_weak_explicit(word, &w, w | bit,
+								  memory_order_acquire, memory_order_relaxed)) {
+				atomic_fetch_sub_explicit(&inst->mutable->num_free, 1, memory_order_relaxed);
+				t->cursor = wi;
+				return (wi * 64) + __builtin_ctzll(bit);
+			}
+		}
+	}
+
+	return IPPOOL_NONE;
+}
+
+/** Clear the bit for an address
+ *
+ */
+static void ippool_unclaim(rlm_ippool_t const *inst, uint32_t idx)
+{
+	atomic_fetch_and_explicit(&inst->mutable->bitmap[idx / 64], ~((uint64_t)1 << (idx % 64)), memory_order_release);
+	atomic_fetch_add_explicit(&inst->mutable->num_free, 1, memory_order_relaxed);
+}
+
+static int ippool_journal_flush(rlm_ippool_thread_t *t)
+{
+	rlm_ippool_t const	*inst = t->inst;
+	size_t			len = t->journal_used * sizeof(t->journal[0]);
+	ssize_t			slen;
+
+	if (!t->journal_used) return 0;
+
+	slen = write(inst->mutable->journal_fd, t->journal, len);
+	t->journal_used = 0;
+
+	if (slen < 0) {
+		ERROR("Failed writing to journal %s: %s", inst->journal.filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if ((size_t)slen != len) {
+		ERROR("Short write to journal %s", inst->journal.filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ippool_journal_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_ippool_thread_t *t = talloc_get_type_abort(uctx, rlm_ippool_thread_t);
+
+	t->journal_ev = NULL;
+	(void) ippool_journal_flush(t);
+}
+
+/** Record a change to a lease
+ *
+ * The sequence number must be taken before the change is visible to other
+ * threads, i.e. before the bit is cleared when an address is released, and
+ * after it's set when an address is allocated.
+ *
+ * @note The owner's shard mutex must be held.
+ */
+static void ippool_journal(rlm_ippool_thread_t *t, uint32_t idx, uint64_t owner, uint64_t expires)
+{
+	rlm_ippool_t const		*inst = t->inst;
+	rlm_ippool_journal_entry_t	*entry;
+
+	if (!inst->journal.filename) return;
+
+	if (t->journal_used == NUM_ELEMENTS(t->journal)) (void) ippool_journal_flush(t);
+
+	entry = &t->journal[t->journal_used++];
+	*entry = (rlm_ippool_journal_entry_t) {
+		.seq = atomic_fetch_add_explicit(&inst->mutable->seq, 1, memory_order_relaxed),
+		.owner = owner,
+		.expires = expires,
+		.index = idx
+	};
+
+	if (!t->journal_ev &&
+	    (fr_event_timer_in(t, t->el, &t->journal_ev, inst->journal.interval, ippool_journal_timer, t) < 0)) {
+		PERROR("Failed inserting journal timer");
+	}
+}
+
+/** Bind an address to an owner
+ *
+ * @note The owner's shard mutex must be held, and the address must have been claimed.
+ */
+static void ippool_bind(rlm_ippool_thread_t *t, rlm_ippool_shard_t *shard, uint32_t idx,
+			uint64_t owner, uint64_t expires)
+{
+	rlm_ippool_t const	*inst = t->inst;
+	rlm_ippool_lease_t	*lease = &inst->mutable->leases[idx];
+	uint32_t		*bucket = ippool_bucket(inst, shard, owner);
+
+	atomic_store_explicit(&lease->owner, owner, memory_order_relaxed);
+	atomic_store_explicit(&lease->shard, shard - inst->mutable->shard, memory_order_relaxed);
+	lease->next = *bucket;
+	*bucket = idx;
+
+	ippool_journal(t, idx, owner, expires);
+	atomic_store_explicit(&lease->expires, expires, memory_order_release);
+}
+
+/** Return an address to the pool
+ *
+ * @note The owner's shard mutex must be held.
+ */
+static void ippool_unbind(rlm_ippool_thread_t *t, rlm_ippool_shard_t *shard, uint32_t idx)
+{
+	rlm_ippool_t const	*inst = t->inst;
+	rlm_ippool_lease_t	*lease = &inst->mutable->leases[idx];
+
+	ippool_owner_unlink(inst, shard, idx);
+	ippool_journal(t, idx, atomic_load_explicit(&lease->owner, memory_order_relaxed), 0);
+
+	atomic_store_explicit(&lease->expires, 0, memory_order_relaxed);
+	atomic_store_explicit(&lease->owner, 0, memory_order_relaxed);
+	ippool_unclaim(inst, idx);
+}
+
+/** Free addresses whose leases have expired
+ *
+ * Threads take turns checking a slice of the bitmap.
+ */
+static void ippool_sweep_timer(UNUSED fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	rlm_ippool_thread_t	*t = talloc_get_type_abort(uctx, rlm_ippool_thread_t);
+	rlm_ippool_t const	*inst = t->inst;
+	rlm_ippool_mutable_t	*mutable = inst->mutable;
+	uint64_t		now_sec = fr_time_to_sec(now);
+	uint32_t		i, num = IPPOOL_SWEEP_WORDS;
+
+	t->sweep_ev = NULL;
+
+	if (num > inst->num_words) num = inst->num_words;
+
+	for (i = 0; i < num; i++) {
+		uint32_t	wi = atomic_fetch_add_explicit(&mutable->sweep, 1, memory_order_relaxed) % inst->num_words;
+		uint64_t	w = atomic_load_explicit(&mutable->bitmap[wi], memory_order_relaxed);
+
+		while (w) {
+			uint32_t		idx = (wi * 64) + __builtin_ctzll(w);
+			rlm_ippool_lease_t	*lease = &mutable->leases[idx];
+			uint64_t		expires;
+			uint32_t		shard_idx;
+
+			w &= w - 1;
+
+			/*
+			 *	Zero means the address is padding at
+			 *	the end of the bitmap, or it's being
+			 *	allocated right now.
+			 */
+			expires = atomic_load_explicit(&lease->expires, memory_order_acquire);
+			if (!expires || (expires > now_sec)) continue;
+
+			shard_idx = atomic_load_explicit(&lease->shard, memory_order_relaxed);
+			pthread_mutex_lock(&mutable->shard[shard_idx].mutex);
+
+			/*
+			 *	Check again, the lease may have been
+			 *	renewed, or reallocated.
+			 */
+			expires = atomic_load_explicit(&lease->expires, memory_order_relaxed);
+			if (expires && (expires <= now_sec) &&
+			    (atomic_load_explicit(&lease->shard, memory_order_relaxed) == shard_idx)) {
+				ippool_unbind(t, &mutable->shard[shard_idx], idx);
+			}
+
+			pthread_mutex_unlock(&mutable->shard[shard_idx].mutex);
+		}
+	}
+
+	if (fr_event_timer_in(t, t->el, &t->sweep_ev, inst->sweep_interval, ippool_sweep_timer, t) < 0) {
+		PERROR("Failed inserting sweep timer");
+	}
+}
+
+/** Convert a requested address into an offset into the pool
+ *
+ */
+static inline uint32_t ippool_index(rlm_ippool_t const *inst, fr_value_box_t const *requested)
+{
+	uint32_t addr, start;
+
+	if ((requested->type != FR_TYPE_IPV4_ADDR) && (requested->type != FR_TYPE_COMBO_IP_ADDR)) return IPPOOL_NONE;
+	if (requested->vb_ip.af != AF_INET) return IPPOOL_NONE;
+
+	addr = ntohl(requested->vb_ip.addr.v4.s_addr);
+	start = ntohl(inst->start.addr.v4.s_addr);
+
+	if ((addr < start) || ((addr - start) >= inst->num)) return IPPOOL_NONE;
+
+	return addr - start;
+}
+
+/** Write the address and lease time to the request
+ *
+ */
+static int ippool_reply(rlm_ippool_t const *inst, request_t *request, ippool_call_env_t *env,
+			uint32_t idx, uint32_t expires_in)
+{
+	tmpl_t		ip_rhs;
+	map_t		ip_map = { .lhs = env->allocated_address_attr, .op = T_OP_SET, .rhs = &ip_rhs };
+	fr_ipaddr_t	ip = inst->start;
+
+	ip.addr.v4.s_addr = htonl(ntohl(inst->start.addr.v4.s_addr) + idx);
+
+	tmpl_init_shallow(&ip_rhs, TMPL_TYPE_DATA, T_BARE_WORD, "", 0, NULL);
+	fr_value_box_ipaddr(&ip_rhs.data.literal, NULL, &ip, false);
+	if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return -1;
+
+	if (env->expiry_attr) {
+		tmpl_t	expiry_rhs;
+		map_t	expiry_map = { .lhs = env->expiry_attr, .op = T_OP_SET, .rhs = &expiry_rhs };
+
+		tmpl_init_shallow(&expiry_rhs, TMPL_TYPE_DATA, T_BARE_WORD, "", 0, NULL);
+		fr_value_box(&expiry_rhs.data.literal, expires_in, false);
+		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) return -1;
+	}
+
+	return 0;
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_ippool_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_ippool_t);
+	rlm_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ippool_thread_t);
+	ippool_call_env_t	*env = talloc_get_type_abort(mctx->env_data, ippool_call_env_t);
+	uint64_t		owner = ippool_owner_hash(&env->owner);
+	rlm_ippool_shard_t	*shard = ippool_shard(inst, owner);
+	uint64_t		now = fr_time_to_sec(fr_time()), expires;
+	uint32_t		lease_time, idx;
+
+	/*
+	 *	If offer_time is defined, it will be FR_TYPE_UINT32.
+	 *	Fall back to lease_time otherwise.
+	 */
+	lease_time = (env->offer_time.type == FR_TYPE_UINT32) ?
+			env->offer_time.vb_uint32 : env->lease_time.vb_uint32;
+
+	pthread_mutex_lock(&shard->mutex);
+
+	/*
+	 *	The owner already has a lease, which may have
+	 *	expired, but not yet been swept.  Give it back.
+	 */
+	idx = ippool_owner_find(inst, shard, owner);
+	if (idx != IPPOOL_NONE) {
+		rlm_ippool_lease_t *lease = &inst->mutable->leases[idx];
+
+		expires = atomic_load_explicit(&lease->expires, memory_order_relaxed);
+		if (expires < (now + lease_time)) {
+			expires = now + lease_time;
+			ippool_journal(t, idx, owner, expires);
+			atomic_store_explicit(&lease->expires, expires, memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		RDEBUG2("Found existing lease");
+		goto reply;
+	}
+
+	/*
+	 *	Prefer the address the client asked for.
+	 */
+	idx = ippool_index(inst, &env->requested_address);
+	if ((idx != IPPOOL_NONE) && !ippool_claim(inst, idx)) idx = IPPOOL_NONE;
+	if (idx == IPPOOL_NONE) idx = ippool_claim_any(t);
+	if (idx == IPPOOL_NONE) {
+		pthread_mutex_unlock(&shard->mutex);
+		RWDEBUG("Pool contains no free addresses");
+		RETURN_MODULE_NOTFOUND;
+	}
+
+	expires = now + lease_time;
+	ippool_bind(t, shard, idx, owner, expires);
+	pthread_mutex_unlock(&shard->mutex);
+
+	RDEBUG2("IP address lease allocated");
+
+reply:
+	if (ippool_reply(inst, request, env, idx, expires - now) < 0) RETURN_MODULE_FAIL;
+
+	RETURN_MODULE_UPDATED;
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_ippool_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_ippool_t);
+	rlm_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ippool_thread_t);
+	ippool_call_env_t	*env = talloc_get_type_abort(mctx->env_data, ippool_call_env_t);
+	uint64_t		owner = ippool_owner_hash(&env->owner);
+	rlm_ippool_shard_t	*shard = ippool_shard(inst, owner);
+	uint64_t		now = fr_time_to_sec(fr_time()), expires = now + env->lease_time.vb_uint32;
+	uint32_t		idx, current;
+
+	idx = ippool_index(inst, &env->requested_address);
+	if (idx == IPPOOL_NONE) {
+		REDEBUG("Requested IP address \"%pV\" is not a member of the pool", &env->requested_address);
+		RETURN_MODULE_NOTFOUND;
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+
+	current = ippool_owner_find(inst, shard, owner);
+	if (current == idx) {
+		ippool_journal(t, idx, owner, expires);
+		atomic_store_explicit(&inst->mutable->leases[idx].expires, expires, memory_order_relaxed);
+
+	/*
+	 *	The owner is moving to a free address, e.g. they
+	 *	were offered an address by another server, or we
+	 *	lost the lease.  Owners only have one lease, so
+	 *	release the old one.
+	 */
+	} else if (ippool_claim(inst, idx)) {
+		if (current != IPPOOL_NONE) ippool_unbind(t, shard, current);
+		ippool_bind(t, shard, idx, owner, expires);
+
+	} else {
+		pthread_mutex_unlock(&shard->mutex);
+		REDEBUG("Requested IP address \"%pV\" lease allocated to another device", &env->requested_address);
+		RETURN_MODULE_INVALID;
+	}
+
+	pthread_mutex_unlock(&shard->mutex);
+
+	RDEBUG2("Requested IP address \"%pV\" lease updated", &env->requested_address);
+
+	if (ippool_reply(inst, request, env, idx, expires - now) < 0) RETURN_MODULE_FAIL;
+
+	RETURN_MODULE_UPDATED;
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_ippool_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_ippool_t);
+	rlm_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ippool_thread_t);
+	ippool_call_env_t	*env = talloc_get_type_abort(mctx->env_data, ippool_call_env_t);
+	uint64_t		owner = ippool_owner_hash(&env->owner);
+	rlm_ippool_shard_t	*shard = ippool_shard(inst, owner);
+	uint32_t		idx, current;
+
+	idx = ippool_index(inst, &env->requested_address);
+	if (idx == IPPOOL_NONE) {
+		REDEBUG("Requested IP address \"%pV\" is not a member of the pool", &env->requested_address);
+		RETURN_MODULE_NOTFOUND;
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+
+	current = ippool_owner_find(inst, shard, owner);
+	if (current != idx) {
+		pthread_mutex_unlock(&shard->mutex);
+		REDEBUG("Requested IP address \"%pV\" lease allocated to another device", &env->requested_address);
+		RETURN_MODULE_INVALID;
+	}
+
+	ippool_unbind(t, shard, idx);
+	pthread_mutex_unlock(&shard->mutex);
+
+	RDEBUG2("IP address \"%pV\" released", &env->requested_address);
+	RETURN_MODULE_UPDATED;
+}
+
+/** Rebuild the pool from the journal, and rewrite it with just the active leases
+ *
+ */
+static int ippool_journal_load(rlm_ippool_t *inst, CONF_SECTION *conf)
+{
+	rlm_ippool_mutable_t		*mutable = inst->mutable;
+	rlm_ippool_journal_header_t	header;
+	rlm_ippool_journal_entry_t	entry;
+	uint64_t			*seq, max_seq = 0, now = fr_time_to_sec(fr_time());
+	uint32_t			i, active = 0;
+	char				*tmp;
+	int				fd;
+
+	MEM(seq = talloc_zero_array(NULL, uint64_t, inst->num));
+
+	fd = open(inst->journal.filename, O_RDONLY);
+	if (fd >= 0) {
+		if ((read(fd, &header, sizeof(header)) != sizeof(header)) ||
+		    (memcmp(header.magic, IPPOOL_JOURNAL_MAGIC, sizeof(header.magic)) != 0)) {
+			cf_log_err(conf, "Journal %s is not an ippool journal", inst->journal.filename);
+		error:
+			close(fd);
+			talloc_free(seq);
+			return -1;
+		}
+
+		if ((header.start != inst->start.addr.v4.s_addr) || (header.num != inst->num)) {
+			cf_log_err(conf, "Journal %s is for a different pool.  Remove it, or change the filename",
+				   inst->journal.filename);
+			goto error;
+		}
+
+		/*
+		 *	Threads flush their changes independently, so
+		 *	the entries for an address may be out of order.
+		 *	The sequence number says which is the latest.
+		 *	A truncated trailing entry is ignored.
+		 */
+		while (read(fd, &entry, sizeof(entry)) == sizeof(entry)) {
+			if (entry.index >= inst->num) continue;
+			if (entry.seq > max_seq) max_seq = entry.seq;
+			if (seq[entry.index] && (entry.seq < seq[entry.index])) continue;
+
+			seq[entry.index] = entry.seq;
+			atomic_store(&mutable->leases[entry.index].owner, entry.owner);
+			atomic_store(&mutable->leases[entry.index].expires, entry.expires);
+		}
+		close(fd);
+	} else if (errno != ENOENT) {
+		cf_log_err(conf, "Failed opening journal %s: %s", inst->journal.filename, fr_syserror(errno));
+		talloc_free(seq);
+		return -1;
+	}
+	talloc_free(seq);
+
+	memcpy(header.magic, IPPOOL_JOURNAL_MAGIC, sizeof(header.magic));
+	header.start = inst->start.addr.v4.s_addr;
+	header.num = inst->num;
+
+	MEM(tmp = talloc_asprintf(NULL, "%s.tmp", inst->journal.filename));
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		cf_log_err(conf, "Failed creating %s: %s", tmp, fr_syserror(errno));
+	error_tmp:
+		talloc_free(tmp);
+		return -1;
+	}
+
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+	error_write:
+		cf_log_err(conf, "Failed writing %s: %s", tmp, fr_syserror(errno));
+		close(fd);
+		unlink(tmp);
+		goto error_tmp;
+	}
+
+	/*
+	 *	Bind the leases which are still active.
+	 */
+	for (i = 0; i < inst->num; i++) {
+		rlm_ippool_lease_t	*lease = &mutable->leases[i];
+		uint64_t		owner = atomic_load(&lease->owner);
+		uint64_t		expires = atomic_load(&lease->expires);
+		rlm_ippool_shard_t	*shard;
+		uint32_t		*bucket;
+
+		if (!owner || (expires <= now)) {
+			atomic_store(&lease->owner, 0);
+			atomic_store(&lease->expires, 0);
+			continue;
+		}
+
+		shard = ippool_shard(inst, owner);
+		if (ippool_owner_find(inst, shard, owner) != IPPOOL_NONE) {
+			atomic_store(&lease->owner, 0);
+			atomic_store(&lease->expires, 0);
+			continue;
+		}
+
+		if (!ippool_claim(inst, i)) continue;
+
+		bucket = ippool_bucket(inst, shard, owner);
+		atomic_store(&lease->shard, shard - mutable->shard);
+		lease->next = *bucket;
+		*bucket = i;
+
+		entry = (rlm_ippool_journal_entry_t) {
+			.seq = active,
+			.owner = owner,
+			.expires = expires,
+			.index = i
+		};
+		if (write(fd, &entry, sizeof(entry)) != sizeof(entry)) goto error_write;
+		active++;
+	}
+
+	if ((fsync(fd) < 0) || (close(fd) < 0)) {
+		cf_log_err(conf, "Failed writing %s: %s", tmp, fr_syserror(errno));
+		unlink(tmp);
+		goto error_tmp;
+	}
+
+	if (rename(tmp, inst->journal.filename) < 0) {
+		cf_log_err(conf, "Failed renaming %s: %s", tmp, fr_syserror(errno));
+		unlink(tmp);
+		goto error_tmp;
+	}
+	talloc_free(tmp);
+
+	atomic_store(&mutable->seq, (uint64_t)active);
+
+	mutable->journal_fd = open(inst->journal.filename, O_WRONLY | O_APPEND);
+	if (mutable->journal_fd < 0) {
+		cf_log_err(conf, "Failed opening journal %s: %s", inst->journal.filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (max_seq || active) INFO("Loaded %u active lease(s) from %s", active, inst->journal.filename);
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_ippool_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_ippool_t);
+	rlm_ippool_mutable_t	*mutable = inst->mutable;
+	uint32_t		i;
+
+	if (!mutable) return 0;
+
+	for (i = 0; i < IPPOOL_NUM_SHARDS; i++) {
+		if (mutable->shard[i].buckets) pthread_mutex_destroy(&mutable->shard[i].mutex);
+	}
+
+	if (mutable->journal_fd >= 0) close(mutable->journal_fd);
+
+	TALLOC_FREE(inst->mutable);
+
+	return 0;
+}
+
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	rlm_ippool_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_ippool_t);
+	CONF_SECTION		*conf = mctx->mi->conf;
+	rlm_ippool_mutable_t	*mutable;
+	uint32_t		start, end, buckets, i;
+	int			ret;
+
+	start = ntohl(inst->start.addr.v4.s_addr);
+	end = ntohl(inst->end.addr.v4.s_addr);
+
+	if (end < start) {
+		cf_log_err(conf, "'end' must not be less than 'start'");
+		return -1;
+	}
+
+	if ((end - start) >= IPPOOL_MAX_ADDRESSES) {
+		cf_log_err(conf, "Pool may contain no more than %u addresses", IPPOOL_MAX_ADDRESSES);
+		return -1;
+	}
+
+	FR_TIME_DELTA_BOUND_CHECK("sweep_interval", inst->sweep_interval, >=, fr_time_delta_from_msec(100));
+	FR_TIME_DELTA_BOUND_CHECK("sweep_interval", inst->sweep_interval, <=, fr_time_delta_from_sec(60));
+	FR_TIME_DELTA_BOUND_CHECK("journal.interval", inst->journal.interval, >=, fr_time_delta_from_msec(10));
+	FR_TIME_DELTA_BOUND_CHECK("journal.interval", inst->journal.interval, <=, fr_time_delta_from_sec(60));
+
+	inst->num = (end - start) + 1;
+	inst->num_words = (inst->num + 63) / 64;
+
+	/*
+	 *	Aim for chains of about one lease, when the pool is full.
+	 */
+	buckets = (inst->num / IPPOOL_NUM_SHARDS) + 1;
+	buckets--;
+	buckets |= buckets >> 1;
+	buckets |= buckets >> 2;
+	buckets |= buckets >> 4;
+	buckets |= buckets >> 8;
+	buckets |= buckets >> 16;
+	buckets++;
+	inst->bucket_mask = buckets - 1;
+
+	MEM(mutable = talloc_zero(NULL, rlm_ippool_mutable_t));
+	mutable->journal_fd = -1;
+	inst->mutable = mutable;
+
+	MEM(mutable->bitmap = talloc_zero_array(mutable, _Atomic(uint64_t), inst->num_words));
+	MEM(mutable->leases = talloc_zero_array(mutable, rlm_ippool_lease_t, inst->num_words * 64));
+	for (i = 0; i < (inst->num_words * 64); i++) mutable->leases[i].next = IPPOOL_NONE;
+
+	/*
+	 *	Mark the bits past the end of the pool as allocated,
+	 *	so no one can claim them.
+	 */
+	if (inst->num % 64) atomic_init(&mutable->bitmap[inst->num_words - 1], ~(uint64_t)0 << (inst->num % 64));
+	atomic_init(&mutable->num_free, inst->num);
+	atomic_init(&mutable->seq, 0);
+	atomic_init(&mutable->sweep, 0);
+
+	for (i = 0; i < IPPOOL_NUM_SHARDS; i++) {
+		rlm_ippool_shard_t *shard = &mutable->shard[i];
+
+		if ((ret = pthread_mutex_init(&shard->mutex, NULL)) != 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(ret));
+		error:
+			mod_detach(&(module_detach_ctx_t){ .mi = mctx->mi });
+			return -1;
+		}
+
+		MEM(shard->buckets = talloc_array(mutable, uint32_t, buckets));
+		memset(shard->buckets, 0xff, sizeof(shard->buckets[0]) * buckets);	/* IPPOOL_NONE */
+	}
+
+	if (inst->journal.filename && (ippool_journal_load(inst, conf) < 0)) goto error;
+
+	return 0;
+}
+
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_ippool_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_ippool_t);
+	rlm_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ippool_thread_t);
+
+	t->inst = inst;
+	t->el = mctx->el;
+	t->cursor = fr_rand() % inst->num_words;
+
+	if (fr_event_timer_in(t, t->el, &t->sweep_ev, inst->sweep_interval, ippool_sweep_timer, t) < 0) {
+		PERROR("Failed inserting sweep timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ippool_thread_t);
+
+	(void) ippool_journal_flush(t);
+
+	return 0;
+}
+
+extern module_rlm_t rlm_ippool;
+module_rlm_t rlm_ippool = {
+	.common = {
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "ippool",
+		.inst_size		= sizeof(rlm_ippool_t),
+		.config			= module_config,
+		.instantiate		= mod_instantiate,
+		.detach			= mod_detach,
+
+		.thread_inst_size	= sizeof(rlm_ippool_thread_t),
+		.thread_inst_type	= "rlm_ippool_thread_t",
+		.thread_instantiate	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach
+	},
+	.method_group = {
+		.bindings = (module_method_binding_t[]){
+			{ .section = SECTION_NAME("recv", "Access-Request"), .method = mod_alloc, .method_env = &ippool_alloc_method_env },		/* radius */
+			{ .section = SECTION_NAME("accounting", "Start"), .method = mod_update, .method_env = &ippool_update_method_env },		/* radius */
+			{ .section = SECTION_NAME("accounting", "Interim-Update"), .method = mod_update, .method_env = &ippool_update_method_env },	/* radius */
+			{ .section = SECTION_NAME("accounting", "Stop"), .method = mod_release, .method_env = &ippool_release_method_env },		/* radius */
+
+			{ .section = SECTION_NAME("recv", "Discover"), .method = mod_alloc, .method_env = &ippool_alloc_method_env },			/* dhcpv4 */
+			{ .section = SECTION_NAME("recv", "Release"), .method = mod_release, .method_env = &ippool_release_method_env },		/* dhcpv4 */
+			{ .section = SECTION_NAME("send", "Ack"), .method = mod_update, .method_env = &ippool_update_method_env },			/* dhcpv4 */
+
+			{ .section = SECTION_NAME("recv", CF_IDENT_ANY), .method = mod_update, .method_env = &ippool_update_method_env },		/* generic */
+			{ .section = SECTION_NAME("send", CF_IDENT_ANY), .method = mod_alloc, .method_env = &ippool_alloc_method_env },			/* generic */
+
+			{ .section = SECTION_NAME("allocate", NULL), .method = mod_alloc, .method_env = &ippool_alloc_method_env },			/* verb */
+			{ .section = SECTION_NAME("update", NULL), .method = mod_update, .method_env = &ippool_update_method_env },			/* verb */
+			{ .section = SECTION_NAME("renew", NULL), .method = mod_update, .method_env = &ippool_update_method_env },			/* verb */
+			{ .section = SECTION_NAME("release", NULL), .method = mod_release, .method_env = &ippool_release_method_env },		/* verb */
+			MODULE_BINDING_TERMINATOR
+		}
+	}
+};
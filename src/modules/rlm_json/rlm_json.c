@@ -72,6 +72,8 @@ typedef struct rlm_json_jpath_cache rlm_json_jpath_cache_t;
 struct rlm_json_jpath_cache {
 	fr_jpath_node_t		*jpath;		//!< First node in jpath expression.
 	rlm_json_jpath_cache_t	*next;		//!< Next jpath cache entry.
+	fr_jpath_set_t		*set;		//!< All of the jpaths, if they can be evaluated in a
+						///< single pass.  Only set in the first entry.
 };
 
 typedef struct {
@@ -339,6 +341,8 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void const *mod_ins
 		return -1;
 	}
 
+	cache_inst->set = fr_jpath_set_alloc(cache_inst);
+
 	while ((map = map_list_next(maps, map))) {
 		CONF_PAIR	*cp = cf_item_to_pair(map->ci);
 		char const	*p;
@@ -373,9 +377,21 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void const *mod_ins
 			break;
 
 		default:
+			TALLOC_FREE(cache_inst->set);
 			continue;
 		}
 
+		/*
+		 *	If all the jpaths are literals, and are simple enough,
+		 *	we can evaluate them in a single pass over the document.
+		 */
+		if (cache_inst->set &&
+		    (!tmpl_is_attr(map->lhs) ||
+		     (fr_jpath_set_add(cache_inst->set, cache->jpath,
+				       tmpl_attr_tail_da(map->lhs)->type, tmpl_attr_tail_da(map->lhs)) < 0))) {
+			TALLOC_FREE(cache_inst->set);
+		}
+
 		/*
 		 *	Slightly weird... This is here because our first
 		 *	list member was pre-allocated and passed to the
@@ -390,6 +406,31 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void const *mod_ins
 	return 0;
 }
 
+/** Converts a list of value boxes into #fr_pair_t
+ *
+ */
+static int json_map_proc_pairs(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *request,
+			       map_t const *map, fr_value_box_list_t *head)
+{
+	fr_pair_t	*vp;
+	fr_value_box_t	*value;
+
+	for (value = fr_value_box_list_head(head);
+	     value;
+	     fr_pair_append(out, vp), value = fr_value_box_list_next(head, value)) {
+		MEM(vp = fr_pair_afrom_da(ctx, tmpl_attr_tail_da(map->lhs)));
+
+		if (fr_value_box_steal(vp, &vp->data, value) < 0) {
+			RPEDEBUG("Copying data to attribute failed");
+			talloc_free(vp);
+			fr_pair_list_free(out);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 /** Converts a string value into a #fr_pair_t
  *
  * @param[in,out] ctx to allocate #fr_pair_t (s).
@@ -404,9 +445,7 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void const *mod_ins
 static int _json_map_proc_get_value(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *request,
 				    map_t const *map, void *uctx)
 {
-	fr_pair_t			*vp;
 	rlm_json_jpath_to_eval_t	*to_eval = uctx;
-	fr_value_box_t			*value;
 	fr_value_box_list_t		head;
 	int				ret;
 
@@ -422,20 +461,76 @@ static int _json_map_proc_get_value(TALLOC_CTX *ctx, fr_pair_list_t *out, reques
 	if (ret == 0) return 0;
 	fr_assert(!fr_value_box_list_empty(&head));
 
-	for (value = fr_value_box_list_head(&head);
-	     value;
-	     fr_pair_append(out, vp), value = fr_value_box_list_next(&head, value)) {
-		MEM(vp = fr_pair_afrom_da(ctx, tmpl_attr_tail_da(map->lhs)));
+	return json_map_proc_pairs(ctx, out, request, map, &head);
+}
 
-		if (fr_value_box_steal(vp, &vp->data, value) < 0) {
-			RPEDEBUG("Copying data to attribute failed");
-			talloc_free(vp);
-			fr_pair_list_free(out);
+/** Converts values extracted by fr_jpath_set_evaluate() into #fr_pair_t
+ *
+ * @param[in,out] ctx to allocate #fr_pair_t (s).
+ * @param[out] out where to write the resulting #fr_pair_t.
+ * @param[in] request The current request.
+ * @param[in] map to process.
+ * @param[in] uctx The values for this map.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int _json_map_proc_get_values(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *request,
+				     map_t const *map, void *uctx)
+{
+	fr_value_box_list_t *head = uctx;
+
+	fr_pair_list_free(out);
+
+	if (fr_value_box_list_empty(head)) return 0;
+
+	return json_map_proc_pairs(ctx, out, request, map, head);
+}
+
+/** Evaluate all the jpaths in a single pass over the document, then apply the maps
+ *
+ * @param[in] request	The current request.
+ * @param[in] cache	Containing the set of jpaths.
+ * @param[in] json_str	JSON document.
+ * @param[in] len	of the document.
+ * @param[in] maps	Head of the map list.
+ * @return
+ *	- 1 if the maps were applied.
+ *	- 0 if the document needs to be parsed by json-c.
+ *	- -1 on failure.
+ */
+static int json_map_proc_single_pass(request_t *request, rlm_json_jpath_cache_t const *cache,
+				     char const *json_str, size_t len, map_list_t const *maps)
+{
+	fr_value_box_list_t	*values;
+	map_t const		*map = NULL;
+	unsigned int		i, num = fr_jpath_set_num(cache->set);
+	int			ret;
+
+	MEM(values = talloc_array(request, fr_value_box_list_t, num));
+	for (i = 0; i < num; i++) fr_value_box_list_init(&values[i]);
+
+	ret = fr_jpath_set_evaluate(values, values, cache->set, json_str, len);
+	if (ret != 0) {
+		if (ret < 0) RPEDEBUG("Failed evaluating jpath");
+		talloc_free(values);
+		return (ret < 0) ? -1 : 0;
+	}
+
+	/*
+	 *	Every map is in the set, in order.
+	 */
+	for (i = 0; (map = map_list_next(maps, map)); i++) {
+		fr_assert(i < num);
+
+		if (map_to_request(request, map, _json_map_proc_get_values, &values[i]) < 0) {
+			talloc_free(values);
 			return -1;
 		}
 	}
+	talloc_free(values);
 
-	return 0;
+	return 1;
 }
 
 /** Parses a JSON string, and executes jpath queries against it to map values to attributes
@@ -484,6 +579,23 @@ static unlang_action_t mod_map_proc(rlm_rcode_t *p_result, UNUSED void const *mo
 		RETURN_MODULE_FAIL;
 	}
 
+	/*
+	 *	If we can, extract all the values without
+	 *	building a json-c tree.
+	 */
+	if (cache->set) {
+		switch (json_map_proc_single_pass(request, cache, json_str, talloc_array_length(json_str) - 1, maps)) {
+		case 1:
+			RETURN_MODULE_RCODE(rcode);
+
+		case 0:
+			break;
+
+		default:
+			RETURN_MODULE_FAIL;
+		}
+	}
+
 	tok = json_tokener_new();
 	to_eval.root = json_tokener_parse_ex(tok, json_str, (int)(talloc_array_length(json_str) - 1));
 	if (!to_eval.root) {
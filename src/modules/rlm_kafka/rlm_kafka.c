@@ -19,18 +19,369 @@
  * @file rlm_kafka.c
  * @brief Kafka producer module
  *
+ * Each worker thread has its own producer.  Messages are handed to librdkafka,
+ * which batches, compresses and sends them from its own threads.  Delivery
+ * reports are signalled to the worker's event loop via a pipe, so the request
+ * is only yielded when the caller asks to wait for delivery confirmation.
+ *
  * @copyright 2022 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
  */
 RCSID("$Id$")
 USES_APPLE_DEPRECATED_API
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/kafka/base.h>
+#include <freeradius-devel/unlang/call_env.h>
+#include <freeradius-devel/unlang/module.h>
+#include <freeradius-devel/util/rb.h>
+
+/** How long to wait for outstanding messages to be delivered when a thread exits
+ *
+ */
+#define KAFKA_FLUSH_TIMEOUT_MS	5000
 
 typedef struct {
-	char const *foo;
+	CONF_SECTION		*topics;	//!< topic { ... } section, if one was configured.
 } rlm_kafka_t;
 
+/** A topic handle, created on first use by each thread
+ *
+ */
+typedef struct {
+	char const		*name;		//!< Name of the topic.
+	rd_kafka_topic_t	*rkt;		//!< librdkafka topic handle.
+	fr_rb_node_t		node;		//!< Entry in the thread's topic tree.
+} rlm_kafka_topic_t;
+
+typedef struct {
+	rlm_kafka_t const	*inst;		//!< Instance data.
+	fr_event_list_t		*el;		//!< Event list for this thread.
+
+	rd_kafka_t		*rk;		//!< Producer handle.
+	rd_kafka_queue_t	*queue;		//!< Main queue, delivery reports arrive here.
+	int			fd[2];		//!< librdkafka writes to fd[1] when the queue becomes
+						///< non-empty, we read from fd[0].
+
+	fr_rb_tree_t		*topics;	//!< Topic handles, indexed by name.
+
+	uint64_t		failed;		//!< Unconfirmed messages which failed delivery.
+} rlm_kafka_thread_t;
+
+/** Tracks a message the request is waiting on
+ *
+ * Allocated in the NULL ctx as it may outlive the request.
+ */
+typedef struct {
+	request_t		*request;	//!< Waiting for delivery, or NULL if it was cancelled.
+	rd_kafka_resp_err_t	err;		//!< Delivery result.
+	bool			delivered;	//!< The delivery report has been received.
+} rlm_kafka_msg_ctx_t;
+
+typedef struct {
+	fr_value_box_t		topic;		//!< To produce the message on.
+	fr_value_box_t		key;		//!< Used by the partitioner to select a partition.
+	fr_value_box_t		value;		//!< Message payload.
+	fr_value_box_t		wait;		//!< Whether to yield until delivery is confirmed.
+} rlm_kafka_env_t;
+
+static const call_env_method_t kafka_produce_env = {
+	FR_CALL_ENV_METHOD_OUT(rlm_kafka_env_t),
+	.env = (call_env_parser_t[]){
+		{ FR_CALL_ENV_SUBSECTION("produce", NULL, CALL_ENV_FLAG_REQUIRED,
+			((call_env_parser_t[]) {
+				{ FR_CALL_ENV_OFFSET("topic", FR_TYPE_STRING, CALL_ENV_FLAG_REQUIRED | CALL_ENV_FLAG_CONCAT,
+						     rlm_kafka_env_t, topic) },
+				{ FR_CALL_ENV_OFFSET("key", FR_TYPE_STRING, CALL_ENV_FLAG_CONCAT | CALL_ENV_FLAG_NULLABLE,
+						     rlm_kafka_env_t, key) },
+				{ FR_CALL_ENV_OFFSET("value", FR_TYPE_STRING, CALL_ENV_FLAG_REQUIRED | CALL_ENV_FLAG_CONCAT,
+						     rlm_kafka_env_t, value) },
+				{ FR_CALL_ENV_OFFSET("wait", FR_TYPE_BOOL, CALL_ENV_FLAG_SINGLE, rlm_kafka_env_t, wait),
+						     .pair.dflt = "no", .pair.dflt_quote = T_BARE_WORD },
+				CALL_ENV_TERMINATOR
+			}))},
+		CALL_ENV_TERMINATOR
+	}
+};
+
+static int8_t kafka_topic_cmp(void const *one, void const *two)
+{
+	rlm_kafka_topic_t const *a = one, *b = two;
+
+	return CMP(strcmp(a->name, b->name), 0);
+}
+
+static int _kafka_topic_free(rlm_kafka_topic_t *topic)
+{
+	rd_kafka_topic_destroy(topic->rkt);
+	return 0;
+}
+
+/** Find or create the handle for a topic
+ *
+ * Topics with a topic { <name> { ... } } section use that configuration,
+ * others use librdkafka's defaults.
+ */
+static rlm_kafka_topic_t *kafka_topic_find(rlm_kafka_thread_t *t, request_t *request, char const *name)
+{
+	rlm_kafka_topic_t	*topic;
+	rd_kafka_topic_conf_t	*tconf = NULL;
+	CONF_SECTION		*cs;
+
+	topic = fr_rb_find(t->topics, &(rlm_kafka_topic_t){ .name = name });
+	if (topic) return topic;
+
+	if (t->inst->topics && (cs = cf_section_find(t->inst->topics, name, NULL))) {
+		tconf = kafka_topic_conf_dup(cs);
+	}
+
+	MEM(topic = talloc_zero(t->topics, rlm_kafka_topic_t));
+	MEM(topic->name = talloc_strdup(topic, name));
+
+	topic->rkt = rd_kafka_topic_new(t->rk, name, tconf);
+	if (!topic->rkt) {
+		REDEBUG("Failed creating topic \"%s\": %s", name, rd_kafka_err2str(rd_kafka_last_error()));
+		if (tconf) rd_kafka_topic_conf_destroy(tconf);
+		talloc_free(topic);
+		return NULL;
+	}
+	talloc_set_destructor(topic, _kafka_topic_free);
+
+	fr_rb_insert(t->topics, topic);
+
+	return topic;
+}
+
+/** Called by librdkafka, from rd_kafka_poll(), for each message it's finished with
+ *
+ */
+static void _kafka_delivery_cb(UNUSED rd_kafka_t *rk, rd_kafka_message_t const *rkmessage, void *opaque)
+{
+	rlm_kafka_thread_t	*t = talloc_get_type_abort(opaque, rlm_kafka_thread_t);
+	rlm_kafka_msg_ctx_t	*mc = rkmessage->_private;
+
+	/*
+	 *	Nothing was waiting on this message
+	 */
+	if (!mc) {
+		if (rkmessage->err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+			t->failed++;
+			RATE_LIMIT_GLOBAL(ERROR, "Message delivery to topic \"%s\" failed: %s (%" PRIu64 " failed total)",
+					  rd_kafka_topic_name(rkmessage->rkt), rd_kafka_err2str(rkmessage->err),
+					  t->failed);
+		}
+		return;
+	}
+
+	/*
+	 *	Request stopped waiting
+	 */
+	if (!mc->request) {
+		talloc_free(mc);
+		return;
+	}
+
+	mc->err = rkmessage->err;
+	mc->delivered = true;
+	unlang_interpret_mark_runnable(mc->request);
+}
+
+static void _kafka_error_cb(UNUSED rd_kafka_t *rk, int err, char const *reason, UNUSED void *opaque)
+{
+	ERROR("%s: %s", rd_kafka_err2str(err), reason);
+}
+
+/** Serve the producer's queue when librdkafka signals us
+ *
+ */
+static void _kafka_queue_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_kafka_thread_t	*t = talloc_get_type_abort(uctx, rlm_kafka_thread_t);
+	uint8_t			buff[64];
+
+	while (read(fd, buff, sizeof(buff)) > 0);
+
+	rd_kafka_poll(t->rk, 0);
+}
+
+static void _kafka_queue_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno,
+			       UNUSED void *uctx)
+{
+	ERROR("Kafka queue notification pipe failed: %s", fr_syserror(fd_errno));
+}
+
+static unlang_action_t mod_produce_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_kafka_msg_ctx_t	*mc = talloc_get_type_abort(mctx->rctx, rlm_kafka_msg_ctx_t);
+	rd_kafka_resp_err_t	err = mc->err;
+
+	talloc_free(mc);
+
+	if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+		REDEBUG("Message delivery failed: %s", rd_kafka_err2str(err));
+		RETURN_MODULE_FAIL;
+	}
+
+	RDEBUG2("Message delivered");
+
+	RETURN_MODULE_OK;
+}
+
+static void mod_produce_signal(module_ctx_t const *mctx, UNUSED request_t *request, UNUSED fr_signal_t action)
+{
+	rlm_kafka_msg_ctx_t	*mc = talloc_get_type_abort(mctx->rctx, rlm_kafka_msg_ctx_t);
+
+	/*
+	 *	If the delivery report hasn't arrived, leave
+	 *	the callback to free the message ctx.
+	 */
+	if (!mc->delivered) {
+		mc->request = NULL;
+		return;
+	}
+
+	talloc_free(mc);
+}
+
+/** Enqueue a message with the producer
+ *
+ * @return
+ *	- #RLM_MODULE_OK if the message was enqueued (or delivered, if we were asked to wait).
+ *	- #RLM_MODULE_FAIL if the message couldn't be enqueued, or delivery failed.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_produce(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_kafka_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_kafka_thread_t);
+	rlm_kafka_env_t		*env = talloc_get_type_abort(mctx->env_data, rlm_kafka_env_t);
+	rlm_kafka_topic_t	*topic;
+	rlm_kafka_msg_ctx_t	*mc = NULL;
+	void const		*key = NULL;
+	size_t			key_len = 0;
+
+	topic = kafka_topic_find(t, request, env->topic.vb_strvalue);
+	if (!topic) RETURN_MODULE_FAIL;
+
+	if ((env->key.type == FR_TYPE_STRING) && (env->key.vb_length > 0)) {
+		key = env->key.vb_strvalue;
+		key_len = env->key.vb_length;
+	}
+
+	if (env->wait.vb_bool) {
+		MEM(mc = talloc_zero(NULL, rlm_kafka_msg_ctx_t));
+		mc->request = request;
+	}
+
+	/*
+	 *	Payload is copied, so the request can be freed
+	 *	before the message is sent.
+	 */
+	if (rd_kafka_produce(topic->rkt, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY,
+			     UNCONST(char *, env->value.vb_strvalue), env->value.vb_length,
+			     key, key_len, mc) < 0) {
+		REDEBUG("Failed enqueuing message for topic \"%s\": %s",
+			topic->name, rd_kafka_err2str(rd_kafka_last_error()));
+		talloc_free(mc);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (!mc) {
+		RDEBUG2("Enqueued message for topic \"%s\"", topic->name);
+		RETURN_MODULE_OK;
+	}
+
+	RDEBUG2("Enqueued message for topic \"%s\", waiting for delivery", topic->name);
+
+	return unlang_module_yield(request, mod_produce_resume, mod_produce_signal, ~FR_SIGNAL_CANCEL, mc);
+}
+
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_kafka_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_kafka_t);
+	rlm_kafka_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_kafka_thread_t);
+	rd_kafka_conf_t		*conf;
+	char			errstr[512];
+
+	t->inst = inst;
+	t->el = mctx->el;
+	t->fd[0] = t->fd[1] = -1;
+
+	MEM(t->topics = fr_rb_inline_talloc_alloc(t, rlm_kafka_topic_t, node, kafka_topic_cmp, NULL));
+
+	conf = kafka_conf_dup(mctx->mi->conf);
+	if (!conf) {
+		PERROR("No kafka configuration found");
+		return -1;
+	}
+	rd_kafka_conf_set_opaque(conf, t);
+	rd_kafka_conf_set_dr_msg_cb(conf, _kafka_delivery_cb);
+	rd_kafka_conf_set_error_cb(conf, _kafka_error_cb);
+
+	t->rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
+	if (!t->rk) {
+		ERROR("Failed creating producer: %s", errstr);
+		rd_kafka_conf_destroy(conf);
+		return -1;
+	}
+
+	if (pipe(t->fd) < 0) {
+		ERROR("Failed creating notification pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+	if ((fr_nonblock(t->fd[0]) < 0) || (fr_nonblock(t->fd[1]) < 0)) {
+		PERROR("Failed setting notification pipe to non-blocking");
+		return -1;
+	}
+
+	if (fr_event_fd_insert(t, NULL, t->el, t->fd[0], _kafka_queue_read, NULL, _kafka_queue_error, t) < 0) {
+		PERROR("Failed inserting notification pipe into event loop");
+		return -1;
+	}
+
+	/*
+	 *	Have librdkafka tell us when there are delivery
+	 *	reports (or errors) to serve.
+	 */
+	t->queue = rd_kafka_queue_get_main(t->rk);
+	rd_kafka_queue_io_event_enable(t->queue, t->fd[1], "1", 1);
+
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_kafka_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_kafka_thread_t);
+
+	if (t->fd[0] >= 0) fr_event_fd_delete(t->el, t->fd[0], FR_EVENT_FILTER_IO);
+
+	if (t->rk) {
+		if (t->queue) {
+			rd_kafka_queue_io_event_enable(t->queue, -1, NULL, 0);
+			rd_kafka_queue_destroy(t->queue);
+		}
+
+		if (rd_kafka_flush(t->rk, KAFKA_FLUSH_TIMEOUT_MS) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+			WARN("%d message(s) not delivered before exit", rd_kafka_outq_len(t->rk));
+		}
+
+		TALLOC_FREE(t->topics);		/* Must be destroyed before the producer */
+		rd_kafka_destroy(t->rk);
+	}
+
+	if (t->fd[0] >= 0) close(t->fd[0]);
+	if (t->fd[1] >= 0) close(t->fd[1]);
+
+	return 0;
+}
+
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	rlm_kafka_t	*inst = talloc_get_type_abort(mctx->mi->data, rlm_kafka_t);
+
+	inst->topics = cf_section_find(mctx->mi->conf, "topic", NULL);
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -43,9 +394,21 @@ typedef struct {
 extern module_rlm_t rlm_kafka;
 module_rlm_t rlm_kafka = {
 	.common = {
-		.magic		= MODULE_MAGIC_INIT,
-		.name		= "kafka",
-		.inst_size	= sizeof(rlm_kafka_t),
-		.config		= kafka_base_producer_config,
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "kafka",
+		.inst_size		= sizeof(rlm_kafka_t),
+		.config			= kafka_base_producer_config,
+		.instantiate		= mod_instantiate,
+
+		.thread_inst_size	= sizeof(rlm_kafka_thread_t),
+		.thread_inst_type	= "rlm_kafka_thread_t",
+		.thread_instantiate	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach
+	},
+	.method_group = {
+		.bindings = (module_method_binding_t[]){
+			{ .section = SECTION_NAME(CF_IDENT_ANY, CF_IDENT_ANY), .method = mod_produce, .method_env = &kafka_produce_env },
+			MODULE_BINDING_TERMINATOR
+		}
 	}
 };
@@ -0,0 +1,563 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file kdc.c
+ * @brief Asynchronous AS exchanges with Kerberos V5 KDCs.
+ *
+ * libkrb5 builds and parses the AS-REQ/AS-REP messages via the
+ * krb5_init_creds_step() API, we move the messages to and from the
+ * KDCs using sockets registered with the thread's event loop.
+ *
+ * Requests are sent over UDP.  If the KDC indicates the response was too
+ * large, the request is sent again over TCP, using the 4 byte length prefix
+ * described in RFC 4120 section 7.2.2.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX inst->name
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/socket.h>
+#include <sys/uio.h>
+#include "krb5.h"
+
+#ifdef WITH_KRB5_ASYNC_KDC
+#define KDC_UDP_MAX_LEN		(65535)		//!< Largest UDP response we'll accept.
+#define KDC_TCP_MAX_LEN		(1 << 20)	//!< Largest TCP response we'll accept.
+
+struct rlm_krb5_kdc_exchange_s {
+	rlm_krb5_thread_t	*t;		//!< Thread the exchange is running in.
+	request_t		*request;	//!< Request to resume when the exchange completes.
+
+	krb5_init_creds_context	icc;		//!< libkrb5's state for the AS exchange.
+	krb5_data		out;		//!< Message to send to the KDC.
+	krb5_error_code		ret;		//!< Result of the exchange.
+	bool			started;	//!< Whether the caller may have yielded.
+	bool			done;		//!< Whether the exchange has completed.
+
+	int			fd;		//!< Socket connected to the current KDC.
+	bool			tcp;		//!< Whether we're talking to the KDCs over TCP.
+	fr_event_timer_t const	*ev;		//!< Retransmission timer.
+	unsigned int		kdc;		//!< Index of the KDC we're talking to.
+	unsigned int		sent;		//!< How many times the current message has been sent.
+
+	uint8_t			*tcp_buff;	//!< TCP receive buffer.
+	size_t			tcp_len;	//!< Length of the TCP response.
+	size_t			tcp_received;	//!< How much of the TCP response (including the
+						///< length prefix) has been read.
+	uint8_t			tcp_hdr[4];	//!< Length prefix of the TCP response.
+};
+
+static int kdc_send(rlm_krb5_kdc_exchange_t *kx);
+
+/** Close the socket to the current KDC, and disarm the retransmission timer
+ *
+ */
+static void kdc_close(rlm_krb5_kdc_exchange_t *kx)
+{
+	if (kx->ev) (void) fr_event_timer_delete(&kx->ev);
+
+	if (kx->fd >= 0) {
+		(void) fr_event_fd_delete(kx->t->el, kx->fd, FR_EVENT_FILTER_IO);
+		close(kx->fd);
+		kx->fd = -1;
+	}
+
+	TALLOC_FREE(kx->tcp_buff);
+	kx->tcp_len = 0;
+	kx->tcp_received = 0;
+}
+
+/** Record the result of the exchange and resume the request
+ *
+ */
+static void kdc_done(rlm_krb5_kdc_exchange_t *kx, krb5_error_code ret)
+{
+	kdc_close(kx);
+
+	kx->ret = ret;
+	kx->done = true;
+
+	/*
+	 *	If we're still in krb5_kdc_exchange_start()
+	 *	the caller will notice we're done.
+	 */
+	if (kx->started) unlang_interpret_mark_runnable(kx->request);
+}
+
+/** Feed a response from a KDC (or nothing, to start the exchange) to libkrb5
+ *
+ * Sends the next message libkrb5 produces, or completes the exchange.
+ */
+static void kdc_step(rlm_krb5_kdc_exchange_t *kx, krb5_data *in)
+{
+	rlm_krb5_thread_t	*t = kx->t;
+	request_t		*request = kx->request;
+	krb5_data		realm = { 0 };
+	unsigned int		flags = 0;
+	krb5_error_code		ret;
+
+	krb5_free_data_contents(t->context, &kx->out);
+
+	ret = krb5_init_creds_step(t->context, kx->icc, in, &kx->out, &realm, &flags);
+	krb5_free_data_contents(t->context, &realm);
+
+	if (ret == KRB5KRB_ERR_RESPONSE_TOO_BIG) {
+		if (kx->tcp) {
+			REDEBUG("KDC response too big, even over TCP");
+			kdc_done(kx, ret);
+			return;
+		}
+
+		/*
+		 *	libkrb5 gives us the previous request again, so
+		 *	we just need to resend it over a stream.
+		 */
+		RDEBUG2("KDC response too big for UDP, retrying over TCP");
+		kx->tcp = true;
+		kdc_close(kx);
+
+	} else if (ret) {
+		kdc_done(kx, ret);
+		return;
+
+	} else if (!(flags & KRB5_INIT_CREDS_STEP_FLAG_CONTINUE)) {
+		RDEBUG2("AS exchange complete");
+		kdc_done(kx, 0);
+		return;
+	}
+
+	/*
+	 *	A new message, so every KDC gets a chance to answer it.
+	 */
+	kx->sent = 0;
+	if (kdc_send(kx) < 0) kdc_done(kx, KRB5_KDC_UNREACH);
+}
+
+/** Fail over to the next KDC, or give up if we've run out of retries
+ *
+ */
+static void kdc_retry(rlm_krb5_kdc_exchange_t *kx)
+{
+	rlm_krb5_t const	*inst = kx->t->inst;
+	request_t		*request = kx->request;
+
+	kdc_close(kx);
+
+	if (kx->sent > inst->kdc.retries) {
+		REDEBUG("No response from any KDC after %u attempts", kx->sent);
+		kdc_done(kx, KRB5_KDC_UNREACH);
+		return;
+	}
+
+	kx->kdc = (kx->kdc + 1) % talloc_array_length(inst->kdc.servers);
+	if (kdc_send(kx) < 0) kdc_done(kx, KRB5_KDC_UNREACH);
+}
+
+static void _kdc_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_krb5_kdc_exchange_t	*kx = talloc_get_type_abort(uctx, rlm_krb5_kdc_exchange_t);
+	rlm_krb5_t const	*inst = kx->t->inst;
+	request_t		*request = kx->request;
+
+	RWDEBUG("No response from KDC %pV", fr_box_ipaddr(inst->kdc.servers[kx->kdc]));
+
+	kx->ev = NULL;
+	kdc_retry(kx);
+}
+
+static void _kdc_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	rlm_krb5_kdc_exchange_t	*kx = talloc_get_type_abort(uctx, rlm_krb5_kdc_exchange_t);
+	rlm_krb5_t const	*inst = kx->t->inst;
+	request_t		*request = kx->request;
+
+	RWDEBUG("Connection to KDC %pV failed: %s", fr_box_ipaddr(inst->kdc.servers[kx->kdc]),
+		fr_syserror(fd_errno));
+
+	kdc_retry(kx);
+}
+
+static void _kdc_udp_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_krb5_kdc_exchange_t	*kx = talloc_get_type_abort(uctx, rlm_krb5_kdc_exchange_t);
+	request_t		*request = kx->request;
+	ssize_t			slen;
+	krb5_data		in;
+
+	slen = recv(fd, kx->t->buffer, KDC_UDP_MAX_LEN, 0);
+	if (slen < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+		RWDEBUG("Failed reading from KDC: %s", fr_syserror(errno));
+		kdc_retry(kx);
+		return;
+	}
+
+	in = (krb5_data){ .data = (char *)kx->t->buffer, .length = slen };
+	kdc_step(kx, &in);
+}
+
+static void _kdc_tcp_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_krb5_kdc_exchange_t	*kx = talloc_get_type_abort(uctx, rlm_krb5_kdc_exchange_t);
+	request_t		*request = kx->request;
+	ssize_t			slen;
+	krb5_data		in;
+
+	/*
+	 *	Read the length prefix first.
+	 */
+	if (kx->tcp_received < sizeof(kx->tcp_hdr)) {
+		slen = read(fd, kx->tcp_hdr + kx->tcp_received, sizeof(kx->tcp_hdr) - kx->tcp_received);
+		if (slen <= 0) goto error;
+
+		kx->tcp_received += slen;
+		if (kx->tcp_received < sizeof(kx->tcp_hdr)) return;
+
+		kx->tcp_len = fr_nbo_to_uint32(kx->tcp_hdr);
+		if ((kx->tcp_len == 0) || (kx->tcp_len > KDC_TCP_MAX_LEN)) {
+			RWDEBUG("KDC sent response with invalid length %zu", kx->tcp_len);
+			kdc_retry(kx);
+			return;
+		}
+		MEM(kx->tcp_buff = talloc_array(kx, uint8_t, kx->tcp_len));
+	}
+
+	slen = read(fd, kx->tcp_buff + (kx->tcp_received - sizeof(kx->tcp_hdr)),
+		    kx->tcp_len - (kx->tcp_received - sizeof(kx->tcp_hdr)));
+	if (slen <= 0) goto error;
+
+	kx->tcp_received += slen;
+	if (kx->tcp_received < (kx->tcp_len + sizeof(kx->tcp_hdr))) return;
+
+	/*
+	 *	Take ownership of the buffer, kdc_step() may
+	 *	close the connection.
+	 */
+	in = (krb5_data){ .data = (char *)kx->tcp_buff, .length = kx->tcp_len };
+	kx->tcp_buff = NULL;
+	kdc_step(kx, &in);
+	talloc_free(in.data);
+	return;
+
+error:
+	if ((slen < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) return;
+
+	RWDEBUG("Failed reading from KDC: %s", slen == 0 ? "Connection closed" : fr_syserror(errno));
+	kdc_retry(kx);
+}
+
+/** Write the request once the TCP connection is established
+ *
+ * AS-REQs are small, so if the kernel can't take the whole message in one
+ * go we treat the connection as broken.
+ */
+static void _kdc_tcp_write(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_krb5_kdc_exchange_t	*kx = talloc_get_type_abort(uctx, rlm_krb5_kdc_exchange_t);
+	request_t		*request = kx->request;
+	uint8_t			hdr[4];
+	struct iovec		iov[2];
+	ssize_t			slen;
+
+	fr_nbo_from_uint32(hdr, kx->out.length);
+	iov[0] = (struct iovec){ .iov_base = hdr, .iov_len = sizeof(hdr) };
+	iov[1] = (struct iovec){ .iov_base = kx->out.data, .iov_len = kx->out.length };
+
+	slen = writev(fd, iov, NUM_ELEMENTS(iov));
+	if (slen < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+		RWDEBUG("Failed writing to KDC: %s", fr_syserror(errno));
+		kdc_retry(kx);
+		return;
+	}
+
+	if ((size_t)slen < (sizeof(hdr) + kx->out.length)) {
+		RWDEBUG("Short write to KDC");
+		kdc_retry(kx);
+		return;
+	}
+
+	/*
+	 *	Stop watching for writability, we only care
+	 *	about the response now.
+	 */
+	if (fr_event_fd_insert(kx, NULL, kx->t->el, fd, _kdc_tcp_read, NULL, _kdc_error, kx) < 0) {
+		RPWDEBUG("Failed updating KDC socket events");
+		kdc_retry(kx);
+	}
+}
+
+/** Send the current message to the current KDC
+ *
+ * @return
+ *	- 0 if the message was sent (or is waiting for the connection to establish).
+ *	- -1 if no KDC could be contacted.
+ */
+static int kdc_send(rlm_krb5_kdc_exchange_t *kx)
+{
+	rlm_krb5_thread_t	*t = kx->t;
+	rlm_krb5_t const	*inst = t->inst;
+	request_t		*request = kx->request;
+	size_t			num = talloc_array_length(inst->kdc.servers);
+	fr_ipaddr_t const	*ipaddr;
+
+	while (kx->sent <= inst->kdc.retries) {
+		ipaddr = &inst->kdc.servers[kx->kdc];
+		kx->sent++;
+
+		RDEBUG2("Sending %s request (%u bytes) to KDC %pV port %u",
+			kx->tcp ? "TCP" : "UDP", kx->out.length, fr_box_ipaddr(*ipaddr), inst->kdc.port);
+
+		if (kx->tcp) {
+			kx->fd = fr_socket_client_tcp(NULL, NULL, ipaddr, inst->kdc.port, true);
+		} else {
+			kx->fd = fr_socket_client_udp(NULL, NULL, NULL, ipaddr, inst->kdc.port, true);
+		}
+		if (kx->fd < 0) {
+			RPWDEBUG("Failed opening socket to KDC %pV", fr_box_ipaddr(*ipaddr));
+			goto next;
+		}
+
+		if (kx->tcp) {
+			if (fr_event_fd_insert(kx, NULL, t->el, kx->fd, NULL, _kdc_tcp_write, _kdc_error, kx) < 0) {
+				RPWDEBUG("Failed inserting KDC socket into event loop");
+				goto next;
+			}
+		} else {
+			if (write(kx->fd, kx->out.data, kx->out.length) < 0) {
+				RWDEBUG("Failed sending to KDC %pV: %s", fr_box_ipaddr(*ipaddr), fr_syserror(errno));
+				goto next;
+			}
+
+			if (fr_event_fd_insert(kx, NULL, t->el, kx->fd, _kdc_udp_read, NULL, _kdc_error, kx) < 0) {
+				RPWDEBUG("Failed inserting KDC socket into event loop");
+				goto next;
+			}
+		}
+
+		if (fr_event_timer_in(kx, t->el, &kx->ev, inst->kdc.timeout, _kdc_timeout, kx) < 0) {
+			RPERROR("Failed inserting KDC timeout");
+			return -1;
+		}
+
+		return 0;
+
+	next:
+		kdc_close(kx);
+		kx->kdc = (kx->kdc + 1) % num;
+	}
+
+	REDEBUG("No KDCs available");
+	return -1;
+}
+
+static int _kdc_exchange_free(rlm_krb5_kdc_exchange_t *kx)
+{
+	kdc_close(kx);
+
+	krb5_free_data_contents(kx->t->context, &kx->out);
+	if (kx->icc) krb5_init_creds_free(kx->t->context, kx->icc);
+
+	return 0;
+}
+
+/** Start an AS exchange for a client principal
+ *
+ * If this function returns 0 the caller should check whether the exchange
+ * is already complete with #krb5_kdc_exchange_done, and yield if it isn't.
+ * The request will be marked runnable when the exchange completes.
+ *
+ * @param[out] out	Where to write the exchange handle.
+ * @param[in] ctx	to allocate the exchange in.  Freeing the exchange cancels it.
+ * @param[in] t		Thread specific data.
+ * @param[in] request	The current request.
+ * @param[in] client	Principal to retrieve credentials for.
+ * @param[in] password	to decrypt the AS-REP with.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int krb5_kdc_exchange_start(rlm_krb5_kdc_exchange_t **out, TALLOC_CTX *ctx, rlm_krb5_thread_t *t,
+			    request_t *request, krb5_principal client, char const *password)
+{
+	rlm_krb5_kdc_exchange_t	*kx;
+	krb5_error_code		ret;
+
+	MEM(kx = talloc_zero(ctx, rlm_krb5_kdc_exchange_t));
+	kx->t = t;
+	kx->request = request;
+	kx->fd = -1;
+	kx->kdc = t->next_kdc++ % talloc_array_length(t->inst->kdc.servers);
+	talloc_set_destructor(kx, _kdc_exchange_free);
+
+	ret = krb5_init_creds_init(t->context, client, NULL, NULL, 0, t->inst->gic_options, &kx->icc);
+	if (ret) goto error;
+
+	ret = krb5_init_creds_set_password(t->context, kx->icc, password);
+	if (ret) goto error;
+
+	/*
+	 *	Ask for a ticket for our own service principal
+	 *	directly, that way verifying the credentials
+	 *	needs no further round trips to the KDC.
+	 */
+	ret = krb5_init_creds_set_service(t->context, kx->icc, t->server_name);
+	if (ret) goto error;
+
+	*out = kx;
+	kdc_step(kx, &(krb5_data){ .length = 0 });
+	kx->started = true;
+
+	return 0;
+
+error:
+	kx->ret = ret;
+	kx->done = true;
+	*out = kx;
+
+	return 0;
+}
+
+/** Whether an exchange has completed
+ *
+ */
+bool krb5_kdc_exchange_done(rlm_krb5_kdc_exchange_t const *kx)
+{
+	return kx->done;
+}
+
+/** Retrieve the credentials obtained by an exchange
+ *
+ * @param[out] creds	Where to write the credentials.  Must be freed with
+ *			krb5_free_cred_contents() if this function returns 0.
+ * @param[in] kx	Completed exchange.
+ * @return
+ *	- 0 on success.
+ *	- The Kerberos error the exchange failed with.
+ */
+krb5_error_code krb5_kdc_exchange_creds(krb5_creds *creds, rlm_krb5_kdc_exchange_t *kx)
+{
+	fr_assert(kx->done);
+
+	if (kx->ret) return kx->ret;
+
+	return krb5_init_creds_get_creds(kx->t->context, kx->icc, creds);
+}
+
+/** Set up the thread specific context and copy the service keytab into memory
+ *
+ * @param[in] t		Thread specific data, with inst and el already set.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int krb5_kdc_thread_init(rlm_krb5_thread_t *t)
+{
+	rlm_krb5_t const	*inst = t->inst;
+	krb5_error_code		ret;
+	krb5_keytab		keytab;
+	krb5_kt_cursor		cursor;
+	krb5_keytab_entry	entry;
+	char			*name;
+	unsigned int		entries = 0;
+
+	ret = krb5_init_context(&t->context);
+	if (ret) {
+		ERROR("Context initialisation failed: %s", rlm_krb5_error(inst, NULL, ret));
+		return -1;
+	}
+
+	ret = krb5_unparse_name(t->context, inst->server, &name);
+	if (ret) {
+		ERROR("Failed constructing service principal string: %s", rlm_krb5_error(inst, t->context, ret));
+		return -1;
+	}
+	t->server_name = talloc_strdup(t, name);
+	krb5_free_unparsed_name(t->context, name);
+
+	/*
+	 *	MEMORY keytabs are global to the process, so the
+	 *	name must be unique to this thread.
+	 */
+	MEM(name = talloc_asprintf(t, "MEMORY:%s_%p", inst->name, t));
+	ret = krb5_kt_resolve(t->context, name, &t->keytab);
+	talloc_free(name);
+	if (ret) {
+		ERROR("Creating in-memory keytab failed: %s", rlm_krb5_error(inst, t->context, ret));
+		return -1;
+	}
+
+	ret = inst->keytabname ?
+		krb5_kt_resolve(t->context, inst->keytabname, &keytab) :
+		krb5_kt_default(t->context, &keytab);
+	if (ret) {
+		ERROR("Resolving keytab failed: %s", rlm_krb5_error(inst, t->context, ret));
+		return -1;
+	}
+
+	ret = krb5_kt_start_seq_get(t->context, keytab, &cursor);
+	if (ret) {
+		ERROR("Reading keytab failed: %s", rlm_krb5_error(inst, t->context, ret));
+		krb5_kt_close(t->context, keytab);
+		return -1;
+	}
+
+	while ((ret = krb5_kt_next_entry(t->context, keytab, &entry, &cursor)) == 0) {
+		ret = krb5_kt_add_entry(t->context, t->keytab, &entry);
+		krb5_free_keytab_entry_contents(t->context, &entry);
+		if (ret) break;
+		entries++;
+	}
+	krb5_kt_end_seq_get(t->context, keytab, &cursor);
+	krb5_kt_close(t->context, keytab);
+
+	if (ret != KRB5_KT_END) {
+		ERROR("Copying keytab failed: %s", rlm_krb5_error(inst, t->context, ret));
+		return -1;
+	}
+
+	if (!entries) {
+		ERROR("Keytab contains no keys");
+		return -1;
+	}
+
+	DEBUG3("Cached %u keytab entries", entries);
+
+	MEM(t->buffer = talloc_array(t, uint8_t, KDC_UDP_MAX_LEN));
+
+	return 0;
+}
+
+/** Free the thread specific context and keytab
+ *
+ */
+void krb5_kdc_thread_free(rlm_krb5_thread_t *t)
+{
+	if (!t->context) return;
+
+	if (t->keytab) krb5_kt_close(t->context, t->keytab);
+	krb5_free_context(t->context);
+}
+#endif
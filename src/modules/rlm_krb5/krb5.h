@@ -33,6 +33,18 @@ USES_APPLE_DEPRECATED_API
 #  include <freeradius-devel/server/pool.h>
 #endif
 
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/event.h>
+
+/*
+ *	The asynchronous KDC client drives the AS exchange itself using
+ *	the MIT krb5_init_creds_step() API.  Heimdal's version of that
+ *	function has a different signature, so it's MIT only for now.
+ */
+#if defined(HAVE_KRB5_INIT_CREDS_STEP) && !defined(HEIMDAL_KRB5)
+#  define WITH_KRB5_ASYNC_KDC
+#endif
+
 typedef struct {
 	krb5_context	context;
 	krb5_keytab	keytab;
@@ -43,6 +55,17 @@ typedef struct {
 #endif
 } rlm_krb5_handle_t;
 
+/** Configuration for the asynchronous KDC client
+ *
+ */
+typedef struct {
+	fr_ipaddr_t		*servers;	//!< KDCs to send AS requests to.  If none are configured
+						///< the blocking libkrb5 functions are used instead.
+	uint16_t		port;		//!< Port the KDCs listen on.
+	fr_time_delta_t		timeout;	//!< How long to wait for a response before retransmitting.
+	uint32_t		retries;	//!< How many times to retransmit a request before giving up.
+} rlm_krb5_kdc_conf_t;
+
 /** Instance configuration for rlm_krb5
  *
  * Holds the configuration and preparsed data for a instance of rlm_krb5.
@@ -74,8 +97,26 @@ typedef struct {
 	krb5_principal server;			//!< A structure representing the parsed
 						//!< service_princ.
 #endif
+
+	rlm_krb5_kdc_conf_t	kdc;		//!< Asynchronous KDC client configuration.
 } rlm_krb5_t;
 
+/** Thread specific data for rlm_krb5
+ *
+ * Only used when authenticating asynchronously.  Every thread gets its own
+ * context so libkrb5 never needs to lock, and its own in-memory copy of the
+ * service keytab, so verifying a ticket never touches the filesystem.
+ */
+typedef struct {
+	rlm_krb5_t const	*inst;		//!< Instance of rlm_krb5.
+	fr_event_list_t		*el;		//!< This thread's event list.
+	krb5_context		context;	//!< Context used for all asynchronous authentications.
+	krb5_keytab		keytab;		//!< MEMORY: copy of the service keytab.
+	char			*server_name;	//!< Unparsed service principal, for krb5_init_creds_set_service().
+	uint8_t			*buffer;	//!< Receive buffer for UDP responses.
+	unsigned int		next_kdc;	//!< KDC the next exchange starts with.
+} rlm_krb5_thread_t;
+
 /*
  *	MIT Kerberos uses comm_err, so the macro just expands to a call
  *	to error_message.
@@ -94,3 +135,23 @@ char const *rlm_krb5_error(rlm_krb5_t const *inst, krb5_context context, krb5_er
 #endif
 
 void *krb5_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
+
+#ifdef WITH_KRB5_ASYNC_KDC
+/** State of an AS exchange with the KDCs
+ *
+ * Freeing this structure cancels the exchange if it's still in progress.
+ */
+typedef struct rlm_krb5_kdc_exchange_s rlm_krb5_kdc_exchange_t;
+
+int		krb5_kdc_thread_init(rlm_krb5_thread_t *t);
+
+void		krb5_kdc_thread_free(rlm_krb5_thread_t *t);
+
+int		krb5_kdc_exchange_start(rlm_krb5_kdc_exchange_t **out, TALLOC_CTX *ctx, rlm_krb5_thread_t *t,
+					request_t *request, krb5_principal client, char const *password)
+					CC_HINT(nonnull);
+
+bool		krb5_kdc_exchange_done(rlm_krb5_kdc_exchange_t const *kx);
+
+krb5_error_code	krb5_kdc_exchange_creds(krb5_creds *creds, rlm_krb5_kdc_exchange_t *kx);
+#endif
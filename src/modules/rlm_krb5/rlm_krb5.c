@@ -33,9 +33,18 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 #include "krb5.h"
 
+static const conf_parser_t kdc_config[] = {
+	{ FR_CONF_OFFSET_TYPE_FLAGS("server", FR_TYPE_COMBO_IP_ADDR, CONF_FLAG_MULTI, rlm_krb5_kdc_conf_t, servers) },
+	{ FR_CONF_OFFSET("port", rlm_krb5_kdc_conf_t, port), .dflt = "88" },
+	{ FR_CONF_OFFSET("timeout", rlm_krb5_kdc_conf_t, timeout), .dflt = "1s" },
+	{ FR_CONF_OFFSET("retries", rlm_krb5_kdc_conf_t, retries), .dflt = "3" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("keytab", rlm_krb5_t, keytabname) },
 	{ FR_CONF_OFFSET("service_principal", rlm_krb5_t, service_princ) },
+	{ FR_CONF_OFFSET_SUBSECTION("kdc", 0, rlm_krb5_t, kdc, kdc_config) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -218,6 +227,20 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	krb5_verify_init_creds_opt_init(inst->vic_options);
 #endif
 
+	if (inst->kdc.servers) {
+#ifndef WITH_KRB5_ASYNC_KDC
+		cf_log_err(mctx->mi->conf, "Asynchronous KDC client requires a MIT libkrb5 providing "
+			   "krb5_init_creds_step()");
+		return -1;
+#else
+		FR_TIME_DELTA_BOUND_CHECK("kdc.timeout", inst->kdc.timeout, >=, fr_time_delta_from_msec(100));
+		FR_TIME_DELTA_BOUND_CHECK("kdc.timeout", inst->kdc.timeout, <=, fr_time_delta_from_sec(30));
+		FR_INTEGER_BOUND_CHECK("kdc.retries", inst->kdc.retries, <=, 10);
+
+		DEBUG("Sending AS requests to %zu KDC(s) asynchronously", talloc_array_length(inst->kdc.servers));
+#endif
+	}
+
 #ifdef KRB5_IS_THREAD_SAFE
 	/*
 	 *	Initialize the socket pool.
@@ -279,33 +302,33 @@ static rlm_rcode_t krb5_parse_user(krb5_principal *client, KRB5_UNUSED rlm_krb5_
  * @param inst of rlm_krb5.
  * @param request Current request.
  * @param ret code from kerberos.
- * @param conn used in the last operation.
+ * @param context used in the last operation.
  */
-static rlm_rcode_t krb5_process_error(rlm_krb5_t const *inst, request_t *request, rlm_krb5_handle_t *conn, int ret)
+static rlm_rcode_t krb5_process_error(rlm_krb5_t const *inst, request_t *request, KRB5_UNUSED krb5_context context,
+				      int ret)
 {
 	fr_assert(ret != 0);
 
 	if (!fr_cond_assert(inst)) return RLM_MODULE_FAIL;
-	if (!fr_cond_assert(conn)) return RLM_MODULE_FAIL;	/* Silences warnings */
 
 	switch (ret) {
 	case KRB5_LIBOS_BADPWDMATCH:
 	case KRB5KRB_AP_ERR_BAD_INTEGRITY:
-		REDEBUG("Provided password was incorrect (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Provided password was incorrect (%i): %s", ret, rlm_krb5_error(inst, context, ret));
 		return RLM_MODULE_REJECT;
 
 	case KRB5KDC_ERR_KEY_EXP:
 	case KRB5KDC_ERR_CLIENT_REVOKED:
 	case KRB5KDC_ERR_SERVICE_REVOKED:
-		REDEBUG("Account has been locked out (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Account has been locked out (%i): %s", ret, rlm_krb5_error(inst, context, ret));
 		return RLM_MODULE_DISALLOW;
 
 	case KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN:
-		RDEBUG2("User not found (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		RDEBUG2("User not found (%i): %s", ret, rlm_krb5_error(inst, context, ret));
 		return RLM_MODULE_NOTFOUND;
 
 	default:
-		REDEBUG("Error verifying credentials (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Error verifying credentials (%i): %s", ret, rlm_krb5_error(inst, context, ret));
 		return RLM_MODULE_FAIL;
 	}
 }
@@ -363,7 +386,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	 */
 	ret = krb5_verify_user_opt(conn->context, client, password->vp_strvalue, &conn->options);
 	if (ret) {
-		rcode = krb5_process_error(inst, request, conn, ret);
+		rcode = krb5_process_error(inst, request, conn->context, ret);
 		goto cleanup;
 	}
 
@@ -403,6 +426,79 @@ cleanup:
 
 #else  /* HEIMDAL_KRB5 */
 
+#  ifdef WITH_KRB5_ASYNC_KDC
+/** Verify the credentials retrieved by an asynchronous AS exchange
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) mod_authenticate_kdc_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+								     request_t *request)
+{
+	rlm_krb5_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_krb5_t);
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_krb5_thread_t);
+	rlm_krb5_kdc_exchange_t	*kx = talloc_get_type_abort(mctx->rctx, rlm_krb5_kdc_exchange_t);
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	krb5_error_code		ret;
+	krb5_creds		init_creds;
+
+	memset(&init_creds, 0, sizeof(init_creds));
+
+	ret = krb5_kdc_exchange_creds(&init_creds, kx);
+	talloc_free(kx);
+	if (ret) RETURN_MODULE_RCODE(krb5_process_error(inst, request, t->context, ret));
+
+	/*
+	 *	The credentials are for our service principal, and
+	 *	the keytab is in memory, so this doesn't block.
+	 */
+	RDEBUG2("Attempting to authenticate against service principal");
+	ret = krb5_verify_init_creds(t->context, &init_creds, inst->server, t->keytab, NULL, inst->vic_options);
+	if (ret) rcode = krb5_process_error(inst, request, t->context, ret);
+
+	krb5_free_cred_contents(t->context, &init_creds);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static void mod_authenticate_kdc_signal(module_ctx_t const *mctx, request_t *request, UNUSED fr_signal_t action)
+{
+	rlm_krb5_kdc_exchange_t	*kx = talloc_get_type_abort(mctx->rctx, rlm_krb5_kdc_exchange_t);
+
+	RDEBUG2("Cancelling AS exchange");
+	talloc_free(kx);
+}
+
+/** Start an asynchronous AS exchange with the configured KDCs
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) mod_authenticate_kdc(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+							      request_t *request, fr_pair_t const *password)
+{
+	rlm_krb5_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_krb5_t);
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_krb5_thread_t);
+	rlm_krb5_kdc_exchange_t	*kx;
+	krb5_principal		client = NULL;
+	rlm_rcode_t		rcode;
+	int			ret;
+
+	rcode = krb5_parse_user(&client, inst, request, t->context);
+	if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
+
+	RDEBUG2("Retrieving credentials from KDC");
+	ret = krb5_kdc_exchange_start(&kx, unlang_interpret_frame_talloc_ctx(request), t, request,
+				      client, password->vp_strvalue);
+	krb5_free_principal(t->context, client);
+	if (ret < 0) RETURN_MODULE_FAIL;
+
+	if (krb5_kdc_exchange_done(kx)) {
+		return mod_authenticate_kdc_resume(p_result, MODULE_CTX(mctx->mi, mctx->thread, mctx->env_data, kx),
+						   request);
+	}
+
+	return unlang_module_yield(request, mod_authenticate_kdc_resume, mod_authenticate_kdc_signal,
+				   ~FR_SIGNAL_CANCEL, kx);
+}
+#  endif
+
 /*
  *  Validate userid/passwd (MIT)
  */
@@ -442,6 +538,10 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		RDEBUG2("Login attempt with password");
 	}
 
+#  ifdef WITH_KRB5_ASYNC_KDC
+	if (inst->kdc.servers) return mod_authenticate_kdc(p_result, mctx, request, password);
+#  endif
+
 #  ifdef KRB5_IS_THREAD_SAFE
 	conn = fr_pool_connection_get(inst->pool, request);
 	if (!conn) RETURN_MODULE_FAIL;
@@ -468,13 +568,13 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	ret = krb5_get_init_creds_password(conn->context, &init_creds, client, UNCONST(char *, password->vp_strvalue),
 					   NULL, NULL, 0, NULL, inst->gic_options);
 	if (ret) {
-		rcode = krb5_process_error(inst, request, conn, ret);
+		rcode = krb5_process_error(inst, request, conn->context, ret);
 		goto cleanup;
 	}
 
 	RDEBUG2("Attempting to authenticate against service principal");
 	ret = krb5_verify_init_creds(conn->context, &init_creds, inst->server, conn->keytab, NULL, inst->vic_options);
-	if (ret) rcode = krb5_process_error(inst, request, conn, ret);
+	if (ret) rcode = krb5_process_error(inst, request, conn->context, ret);
 
 cleanup:
 	if (client) krb5_free_principal(conn->context, client);
@@ -488,6 +588,30 @@ cleanup:
 
 #endif /* MIT_KRB5 */
 
+#ifdef WITH_KRB5_ASYNC_KDC
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_krb5_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_krb5_t);
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_krb5_thread_t);
+
+	if (!inst->kdc.servers) return 0;
+
+	t->inst = inst;
+	t->el = mctx->el;
+
+	return krb5_kdc_thread_init(t);
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_krb5_thread_t);
+
+	krb5_kdc_thread_free(t);
+
+	return 0;
+}
+#endif
+
 extern module_rlm_t rlm_krb5;
 module_rlm_t rlm_krb5 = {
 	.common = {
@@ -502,7 +626,13 @@ module_rlm_t rlm_krb5 = {
 		.inst_size	= sizeof(rlm_krb5_t),
 		.config		= module_config,
 		.instantiate	= mod_instantiate,
-		.detach		= mod_detach
+		.detach		= mod_detach,
+#ifdef WITH_KRB5_ASYNC_KDC
+		.thread_inst_size	= sizeof(rlm_krb5_thread_t),
+		.thread_inst_type	= "rlm_krb5_thread_t",
+		.thread_instantiate	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach
+#endif
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
@@ -29,6 +29,7 @@ RCSID("$Id$")
 USES_APPLE_DEPRECATED_API
 
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/heap.h>
 
 #define LOG_PREFIX "rlm_ldap groups"
 
@@ -64,6 +65,7 @@ typedef struct {
 	fr_value_box_list_t	expanded_filter;			//!< Values produced by expanding filter xlat.
 	char const		*attrs[2];				//!< For retrieving the group name.
 	fr_ldap_query_t		*query;					//!< Current query performing group lookup.
+	fr_ldap_entry_parser_t	entry_parser;				//!< Processes group objects as they're received.
 	void			*uctx;					//!< Optional context for use in results parsing.
 } ldap_group_groupobj_ctx_t;
 
@@ -577,15 +579,28 @@ static unlang_action_t ldap_cacheable_groupobj_start(rlm_rcode_t *p_result, UNUS
 	ldap_group_groupobj_ctx_t	*group_ctx = talloc_get_type_abort(uctx, ldap_group_groupobj_ctx_t);
 	rlm_ldap_t const		*inst = group_ctx->inst;
 	fr_value_box_t			*filter;
+	unlang_action_t			action;
 
 	filter = fr_value_box_list_head(&group_ctx->expanded_filter);
 
 	if (filter->type != FR_TYPE_STRING) RETURN_MODULE_FAIL;
 
 	group_ctx->attrs[0] = inst->group.obj_name_attr;
-	return fr_ldap_trunk_search(group_ctx, &group_ctx->query, request, group_ctx->ttrunk,
-				    group_ctx->base_dn->vb_strvalue, inst->group.obj_scope,
-				    filter->vb_strvalue, group_ctx->attrs, NULL, NULL);
+	action = fr_ldap_trunk_search(group_ctx, &group_ctx->query, request, group_ctx->ttrunk,
+				      group_ctx->base_dn->vb_strvalue, inst->group.obj_scope,
+				      filter->vb_strvalue, group_ctx->attrs, NULL, NULL);
+
+	/*
+	 *	Users may be members of thousands of groups, so process
+	 *	the group objects as they arrive rather than waiting for
+	 *	the complete set.
+	 */
+	if (group_ctx->query) {
+		group_ctx->query->entry_parser = group_ctx->entry_parser;
+		group_ctx->query->entry_uctx = group_ctx;
+	}
+
+	return action;
 }
 
 /** Cancel a pending group object lookup.
@@ -603,7 +618,70 @@ static void ldap_group_groupobj_cancel(UNUSED request_t *request, UNUSED fr_sign
 	trunk_request_signal_cancel(group_ctx->query->treq);
 }
 
+/** Add a cacheable group object membership to the control list
+ *
+ * Called for each group object as it's received.
+ *
+ * @param[in] handle	the group object was received on.
+ * @param[in] query	performing the group lookup.
+ * @param[in] entry	group object.
+ * @param[in] uctx	Group lookup context.
+ * @return
+ *	- 0 to continue receiving group objects.
+ *	- 1 if the group object could not be processed.
+ */
+static int ldap_cacheable_groupobj_entry(LDAP *handle, fr_ldap_query_t *query, LDAPMessage *entry, void *uctx)
+{
+	ldap_group_groupobj_ctx_t	*group_ctx = talloc_get_type_abort(uctx, ldap_group_groupobj_ctx_t);
+	rlm_ldap_t const		*inst = group_ctx->inst;
+	request_t			*request = query->treq->request;
+	int				ldap_errno;
+	char				*dn;
+	fr_pair_t			*vp;
+
+	if (query->entries == 1) RDEBUG2("Adding cacheable group object memberships");
+
+	if (inst->group.cacheable_dn) {
+		dn = ldap_get_dn(handle, entry);
+		if (!dn) {
+			ldap_get_option(handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+			REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
+
+			return 1;
+		}
+		fr_ldap_util_normalise_dn(dn, dn);
+
+		MEM(pair_append_control(&vp, inst->group.cache_da) == 0);
+		fr_pair_value_strdup(vp, dn, false);
+
+		RINDENT();
+		RDEBUG2("&control.%pP", vp);
+		REXDENT();
+		ldap_memfree(dn);
+	}
+
+	if (inst->group.cacheable_name) {
+		struct berval **values;
+
+		values = ldap_get_values_len(handle, entry, inst->group.obj_name_attr);
+		if (!values) return 0;
+
+		MEM(pair_append_control(&vp, inst->group.cache_da) == 0);
+		fr_pair_value_bstrndup(vp, values[0]->bv_val, values[0]->bv_len, true);
+
+		RINDENT();
+		RDEBUG2("&control.%pP", vp);
+		REXDENT();
+
+		ldap_value_free_len(values);
+	}
+
+	return 0;
+}
+
 /** Process the results of a group object lookup.
+ *
+ * The group objects have already been added by ldap_cacheable_groupobj_entry().
  *
  * @param[out] p_result		Result of processing group lookup.
  * @param[out] priority		Unused.
@@ -615,13 +693,8 @@ static unlang_action_t ldap_cacheable_groupobj_resume(rlm_rcode_t *p_result, UNU
 						      void *uctx)
 {
 	ldap_group_groupobj_ctx_t	*group_ctx = talloc_get_type_abort(uctx, ldap_group_groupobj_ctx_t);
-	rlm_ldap_t const		*inst = group_ctx->inst;
 	fr_ldap_query_t			*query = group_ctx->query;
 	rlm_rcode_t			rcode = RLM_MODULE_OK;
-	LDAPMessage			*entry;
-	int				ldap_errno;
-	char				*dn;
-	fr_pair_t			*vp;
 
 	switch (query->ret) {
 	case LDAP_SUCCESS:
@@ -631,60 +704,13 @@ static unlang_action_t ldap_cacheable_groupobj_resume(rlm_rcode_t *p_result, UNU
 	case LDAP_RESULT_BAD_DN:
 		RDEBUG2("No cacheable group memberships found in group objects");
 		rcode = RLM_MODULE_NOTFOUND;
-		goto finish;
+		break;
 
 	default:
 		rcode = RLM_MODULE_FAIL;
-		goto finish;
-	}
-
-	entry = ldap_first_entry(query->ldap_conn->handle, query->result);
-	if (!entry) {
-		ldap_get_option(query->ldap_conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
-
-		goto finish;
+		break;
 	}
 
-	RDEBUG2("Adding cacheable group object memberships");
-	do {
-		if (inst->group.cacheable_dn) {
-			dn = ldap_get_dn(query->ldap_conn->handle, entry);
-			if (!dn) {
-				ldap_get_option(query->ldap_conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-				REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
-
-				goto finish;
-			}
-			fr_ldap_util_normalise_dn(dn, dn);
-
-			MEM(pair_append_control(&vp, inst->group.cache_da) == 0);
-			fr_pair_value_strdup(vp, dn, false);
-
-			RINDENT();
-			RDEBUG2("&control.%pP", vp);
-			REXDENT();
-			ldap_memfree(dn);
-		}
-
-		if (inst->group.cacheable_name) {
-			struct berval **values;
-
-			values = ldap_get_values_len(query->ldap_conn->handle, entry, inst->group.obj_name_attr);
-			if (!values) continue;
-
-			MEM(pair_append_control(&vp, inst->group.cache_da) == 0);
-			fr_pair_value_bstrndup(vp, values[0]->bv_val, values[0]->bv_len, true);
-
-			RINDENT();
-			RDEBUG2("&control.%pP", vp);
-			REXDENT();
-
-			ldap_value_free_len(values);
-		}
-	} while ((entry = ldap_next_entry(query->ldap_conn->handle, entry)));
-
-finish:
 	talloc_free(group_ctx);
 
 	RETURN_MODULE_RCODE(rcode);
@@ -716,6 +742,7 @@ unlang_action_t rlm_ldap_cacheable_groupobj(rlm_rcode_t *p_result, request_t *re
 	group_ctx->inst = inst;
 	group_ctx->ttrunk = autz_ctx->ttrunk;
 	group_ctx->base_dn = &autz_ctx->call_env->group_base;
+	group_ctx->entry_parser = ldap_cacheable_groupobj_entry;
 	fr_value_box_list_init(&group_ctx->expanded_filter);
 
 	if (unlang_function_push(request, ldap_cacheable_groupobj_start, ldap_cacheable_groupobj_resume,
@@ -730,6 +757,30 @@ unlang_action_t rlm_ldap_cacheable_groupobj(rlm_rcode_t *p_result, request_t *re
 	return UNLANG_ACTION_PUSHED_CHILD;
 }
 
+/** Record the group object the user was found in
+ *
+ * A single matching group object is enough, so the search is stopped at the first one.
+ *
+ * @param[in] handle	the group object was received on.
+ * @param[in] query	performing the group lookup.
+ * @param[in] entry	group object.
+ * @param[in] uctx	Group lookup context.
+ * @return 1, no further group objects are needed.
+ */
+static int ldap_check_groupobj_entry(LDAP *handle, fr_ldap_query_t *query, LDAPMessage *entry, UNUSED void *uctx)
+{
+	request_t	*request = query->treq->request;
+	char		*dn;
+
+	if (RDEBUG_ENABLED2) {
+		dn = ldap_get_dn(handle, entry);
+		RDEBUG2("User found in group object \"%pV\"", fr_box_strvalue(dn));
+		ldap_memfree(dn);
+	}
+
+	return 1;
+}
+
 /** Process the results of a group object lookup.
  *
  * @param[out] p_result		Result of processing group lookup.
@@ -738,7 +789,7 @@ unlang_action_t rlm_ldap_cacheable_groupobj(rlm_rcode_t *p_result, request_t *re
  * @param[in] uctx		Group lookup context.
  * @return One of the RLM_MODULE_* values.
  */
-static unlang_action_t ldap_check_groupobj_resume(rlm_rcode_t *p_result, UNUSED int *priority, request_t *request,
+static unlang_action_t ldap_check_groupobj_resume(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request,
 						      void *uctx)
 {
 	ldap_group_groupobj_ctx_t	*group_ctx = talloc_get_type_abort(uctx, ldap_group_groupobj_ctx_t);
@@ -749,16 +800,6 @@ static unlang_action_t ldap_check_groupobj_resume(rlm_rcode_t *p_result, UNUSED
 	switch (query->ret) {
 	case LDAP_SUCCESS:
 		xlat_ctx->found = true;
-		if (RDEBUG_ENABLED2) {
-			LDAPMessage	*entry = NULL;
-			char		*dn = NULL;
-			entry = ldap_first_entry(query->ldap_conn->handle, query->result);
-			if (entry) {
-				dn = ldap_get_dn(query->ldap_conn->handle, entry);
-				RDEBUG2("User found in group object \"%pV\"", fr_box_strvalue(dn));
-				ldap_memfree(dn);
-			}
-		}
 		break;
 
 	case LDAP_RESULT_NO_RESULT:
@@ -793,6 +834,7 @@ unlang_action_t rlm_ldap_check_groupobj_dynamic(rlm_rcode_t *p_result, request_t
 	*group_ctx = (ldap_group_groupobj_ctx_t) {
 		.inst = inst,
 		.ttrunk = xlat_ctx->ttrunk,
+		.entry_parser = ldap_check_groupobj_entry,
 		.uctx = xlat_ctx
 	};
 	fr_value_box_list_init(&group_ctx->expanded_filter);
@@ -1182,3 +1224,310 @@ unlang_action_t rlm_ldap_check_cached(rlm_rcode_t *p_result,
 
 	RETURN_MODULE_NOTFOUND;
 }
+
+/** Cached group membership results for a single user
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;			//!< Entry in the tree of users.
+	char const		*dn;			//!< DN of the user.
+	fr_rb_tree_t		*groups;		//!< Cached results for this user, keyed by group.
+} ldap_group_cache_user_t;
+
+/** Cached result of a single group membership check
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;			//!< Entry in the user's tree of groups.
+	fr_heap_index_t		heap_id;		//!< Entry in the expiry heap.
+	ldap_group_cache_user_t	*user;			//!< User this result belongs to.
+	char const		*group;			//!< Group name, or normalised group DN.
+	bool			member;			//!< Whether the user is a member of the group.
+	bool			refreshing;		//!< A request is already refreshing this result.
+	fr_time_t		expires;		//!< When the result should be discarded.
+} ldap_group_cache_entry_t;
+
+struct rlm_ldap_group_cache_s {
+	fr_rb_tree_t		*users;			//!< Users with cached results.
+	fr_heap_t		*heap;			//!< Cached results, ordered by expiry.
+	pthread_mutex_t		mutex;			//!< Protects the cache, which is shared between threads.
+};
+
+/** Compare two users by DN
+ *
+ * DNs are compared case insensitively, as the DN provided by a sync notification
+ * may not match the case of the DN retrieved by the user search.
+ */
+static int8_t group_cache_user_cmp(void const *one, void const *two)
+{
+	ldap_group_cache_user_t const *a = one, *b = two;
+
+	return CMP(strcasecmp(a->dn, b->dn), 0);
+}
+
+/** Compare two cached results by group
+ *
+ */
+static int8_t group_cache_entry_cmp(void const *one, void const *two)
+{
+	ldap_group_cache_entry_t const *a = one, *b = two;
+
+	return CMP(strcasecmp(a->group, b->group), 0);
+}
+
+/** Compare two cached results by expiry time
+ *
+ */
+static int8_t group_cache_heap_cmp(void const *one, void const *two)
+{
+	ldap_group_cache_entry_t const *a = one, *b = two;
+
+	return fr_time_cmp(a->expires, b->expires);
+}
+
+/** Remove a cached result, and its user if it was their last one
+ *
+ * @note Must be called with the cache mutex held.
+ */
+static void group_cache_entry_free(rlm_ldap_group_cache_t *cache, ldap_group_cache_entry_t *entry)
+{
+	ldap_group_cache_user_t	*user = entry->user;
+
+	fr_heap_extract(&cache->heap, entry);
+	fr_rb_remove(user->groups, entry);
+	talloc_free(entry);
+
+	if (fr_rb_num_elements(user->groups) > 0) return;
+
+	fr_rb_remove(cache->users, user);
+	talloc_free(user);
+}
+
+/** Remove a user and all of their cached results
+ *
+ * @note Must be called with the cache mutex held.
+ */
+static uint32_t group_cache_user_free(rlm_ldap_group_cache_t *cache, ldap_group_cache_user_t *user)
+{
+	fr_rb_iter_inorder_t		iter;
+	ldap_group_cache_entry_t	*entry;
+	uint32_t			count = fr_rb_num_elements(user->groups);
+
+	for (entry = fr_rb_iter_init_inorder(&iter, user->groups);
+	     entry;
+	     entry = fr_rb_iter_next_inorder(&iter)) fr_heap_extract(&cache->heap, entry);
+
+	talloc_free(user);	/* Frees the user's results too */
+
+	return count;
+}
+
+/** Allocate the group membership cache
+ *
+ * @param[in] inst	to allocate the cache for.
+ * @return
+ *	- 0 on success, or if the cache is disabled.
+ *	- -1 on failure.
+ */
+int rlm_ldap_group_cache_alloc(rlm_ldap_t *inst)
+{
+	rlm_ldap_group_cache_t	*cache;
+	int			ret;
+
+	if (!fr_time_delta_ispos(inst->group.membership_cache.ttl) &&
+	    !fr_time_delta_ispos(inst->group.membership_cache.negative_ttl)) return 0;
+
+	/*
+	 *	Not parented from the instance data, which may be
+	 *	made read only once instantiation is complete.
+	 */
+	MEM(cache = talloc_zero(NULL, rlm_ldap_group_cache_t));
+	MEM(cache->users = fr_rb_inline_talloc_alloc(cache, ldap_group_cache_user_t, node, group_cache_user_cmp, NULL));
+	MEM(cache->heap = fr_heap_talloc_alloc(cache, group_cache_heap_cmp, ldap_group_cache_entry_t, heap_id, 0));
+
+	if ((ret = pthread_mutex_init(&cache->mutex, NULL)) != 0) {
+		ERROR("Failed initializing group cache mutex: %s", fr_syserror(ret));
+		talloc_free(cache);
+		return -1;
+	}
+
+	inst->group.cache = cache;
+
+	return 0;
+}
+
+/** Free the group membership cache
+ *
+ * @param[in] inst	to free the cache of.
+ */
+void rlm_ldap_group_cache_free(rlm_ldap_t *inst)
+{
+	if (!inst->group.cache) return;
+
+	pthread_mutex_destroy(&inst->group.cache->mutex);
+	TALLOC_FREE(inst->group.cache);
+}
+
+/** Look for a cached group membership result
+ *
+ * Expired results are removed as a side effect.
+ *
+ * @param[out] member	Whether the user is a member of the group.  Only set if a
+ *			result was found.
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] user_dn	of the user being checked.
+ * @param[in] group	name, or normalised DN, of the group being checked.
+ * @return One of the LDAP_GROUP_CACHE_* values.
+ */
+ldap_group_cache_status_t rlm_ldap_group_cache_find(bool *member, rlm_ldap_t const *inst,
+						   char const *user_dn, char const *group)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group.cache;
+	ldap_group_cache_user_t		*user;
+	ldap_group_cache_entry_t	*entry;
+	ldap_group_cache_status_t	status = LDAP_GROUP_CACHE_MISS;
+	fr_time_t			now = fr_time();
+
+	if (!cache) return LDAP_GROUP_CACHE_MISS;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	while ((entry = fr_heap_peek(cache->heap)) && fr_time_lteq(entry->expires, now)) {
+		group_cache_entry_free(cache, entry);
+	}
+
+	user = fr_rb_find(cache->users, &(ldap_group_cache_user_t){ .dn = user_dn });
+	if (!user) goto done;
+
+	entry = fr_rb_find(user->groups, &(ldap_group_cache_entry_t){ .group = group });
+	if (!entry) goto done;
+
+	*member = entry->member;
+	status = LDAP_GROUP_CACHE_HIT;
+
+	/*
+	 *	Only the first request to see the result in its
+	 *	refresh period performs the lookup.
+	 */
+	if (!entry->refreshing && fr_time_delta_ispos(inst->group.membership_cache.refresh) &&
+	    fr_time_lt(fr_time_sub(entry->expires, inst->group.membership_cache.refresh), now)) {
+		entry->refreshing = true;
+		status = LDAP_GROUP_CACHE_REFRESH;
+	}
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+
+	return status;
+}
+
+/** Add or update a cached group membership result
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] user_dn	of the user which was checked.
+ * @param[in] group	name, or normalised DN, of the group which was checked.
+ * @param[in] member	Whether the user is a member of the group.
+ */
+void rlm_ldap_group_cache_store(rlm_ldap_t const *inst, char const *user_dn, char const *group, bool member)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group.cache;
+	ldap_group_cache_user_t		*user;
+	ldap_group_cache_entry_t	*entry = NULL, find = { .group = group };
+	fr_time_delta_t			ttl = member ? inst->group.membership_cache.ttl :
+						       inst->group.membership_cache.negative_ttl;
+
+	if (!cache || !fr_time_delta_ispos(ttl)) return;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	user = fr_rb_find(cache->users, &(ldap_group_cache_user_t){ .dn = user_dn });
+	if (user) entry = fr_rb_find(user->groups, &find);
+
+	if (entry) {
+		fr_heap_extract(&cache->heap, entry);
+		goto insert;
+	}
+
+	/*
+	 *	Make space by discarding the results closest to expiry.
+	 *	This may free the user we found.
+	 */
+	if (inst->group.membership_cache.max_entries &&
+	    (fr_heap_num_elements(cache->heap) >= inst->group.membership_cache.max_entries)) {
+		while (fr_heap_num_elements(cache->heap) >= inst->group.membership_cache.max_entries) {
+			group_cache_entry_free(cache, fr_heap_peek(cache->heap));
+		}
+		user = fr_rb_find(cache->users, &(ldap_group_cache_user_t){ .dn = user_dn });
+	}
+
+	if (!user) {
+		MEM(user = talloc_zero(cache, ldap_group_cache_user_t));
+		MEM(user->dn = talloc_strdup(user, user_dn));
+		MEM(user->groups = fr_rb_inline_talloc_alloc(user, ldap_group_cache_entry_t, node,
+							     group_cache_entry_cmp, NULL));
+		fr_rb_insert(cache->users, user);
+	}
+
+	MEM(entry = talloc_zero(user, ldap_group_cache_entry_t));
+	entry->user = user;
+	MEM(entry->group = talloc_strdup(entry, group));
+	fr_rb_insert(user->groups, entry);
+
+insert:
+	entry->member = member;
+	entry->refreshing = false;
+	entry->expires = fr_time_add(fr_time(), ttl);
+	fr_heap_insert(&cache->heap, entry);
+
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/** Discard cached group membership results relating to an object
+ *
+ * Used when the directory reports that the object has changed.  The DN may be
+ * that of a user, in which case all of their results are discarded, or that of
+ * a group, in which case results for that group are discarded for all users.
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @param[in] dn	of the object which changed.
+ * @return The number of results discarded.
+ */
+uint32_t rlm_ldap_group_cache_flush(rlm_ldap_t const *inst, char const *dn)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group.cache;
+	fr_rb_iter_inorder_t		iter;
+	ldap_group_cache_user_t		*user;
+	ldap_group_cache_entry_t	*entry, find = { .group = dn };
+	uint32_t			count = 0;
+
+	if (!cache) return 0;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	for (user = fr_rb_iter_init_inorder(&iter, cache->users);
+	     user;
+	     user = fr_rb_iter_next_inorder(&iter)) {
+		if (strcasecmp(user->dn, dn) == 0) {
+			fr_rb_iter_delete_inorder(&iter);
+			count += group_cache_user_free(cache, user);
+			continue;
+		}
+
+		entry = fr_rb_find(user->groups, &find);
+		if (!entry) continue;
+
+		fr_heap_extract(&cache->heap, entry);
+		fr_rb_remove(user->groups, entry);
+		talloc_free(entry);
+		count++;
+
+		if (fr_rb_num_elements(user->groups) > 0) continue;
+
+		fr_rb_iter_delete_inorder(&iter);
+		talloc_free(user);
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return count;
+}
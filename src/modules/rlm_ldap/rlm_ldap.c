@@ -113,6 +113,17 @@ static conf_parser_t user_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Group membership cache configuration
+ */
+static conf_parser_t group_membership_cache_config[] = {
+	{ FR_CONF_OFFSET("ttl", rlm_ldap_t, group.membership_cache.ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("negative_ttl", rlm_ldap_t, group.membership_cache.negative_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("refresh", rlm_ldap_t, group.membership_cache.refresh), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_entries", rlm_ldap_t, group.membership_cache.max_entries), .dflt = "65536" },
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	Group configuration
  */
@@ -130,6 +141,7 @@ static conf_parser_t group_config[] = {
 	{ FR_CONF_OFFSET("group_attribute", rlm_ldap_t, group.attribute) },
 	{ FR_CONF_OFFSET("allow_dangling_group_ref", rlm_ldap_t, group.allow_dangling_refs), .dflt = "no" },
 	{ FR_CONF_OFFSET("skip_on_suspend", rlm_ldap_t, group.skip_on_suspend), .dflt = "yes"},
+	{ FR_CONF_POINTER("membership_cache", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) group_membership_cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -875,16 +887,36 @@ static unlang_action_t ldap_group_xlat_results(rlm_rcode_t *p_result, UNUSED int
 		if (!xlat_ctx->dn) xlat_ctx->dn = rlm_find_user_dn_cached(request);
 		if (!xlat_ctx->dn) RETURN_MODULE_FAIL;
 
+		switch (rlm_ldap_group_cache_find(&xlat_ctx->found, inst, xlat_ctx->dn, xlat_ctx->group->vb_strvalue)) {
+		case LDAP_GROUP_CACHE_HIT:
+			RDEBUG2("Using cached membership result for \"%pV\"", xlat_ctx->group);
+			RETURN_MODULE_RCODE(xlat_ctx->found ? RLM_MODULE_OK : RLM_MODULE_NOTFOUND);
+
+		case LDAP_GROUP_CACHE_REFRESH:
+			RDEBUG2("Refreshing cached membership result for \"%pV\"", xlat_ctx->group);
+			xlat_ctx->found = false;
+			break;
+
+		case LDAP_GROUP_CACHE_MISS:
+			break;
+		}
+		xlat_ctx->cacheable = true;
+
 		if (inst->group.obj_membership_filter) {
 			REPEAT_LDAP_MEMBEROF_XLAT_RESULTS;
 			if (rlm_ldap_check_groupobj_dynamic(&rcode, request, xlat_ctx) == UNLANG_ACTION_PUSHED_CHILD) {
 				xlat_ctx->status = GROUP_XLAT_MEMB_FILTER;
 				return UNLANG_ACTION_PUSHED_CHILD;
 			}
+			xlat_ctx->cacheable = false;
 		}
 		FALL_THROUGH;
 
 	case GROUP_XLAT_MEMB_FILTER:
+		if ((xlat_ctx->status == GROUP_XLAT_MEMB_FILTER) && (*p_result == RLM_MODULE_FAIL)) {
+			xlat_ctx->cacheable = false;
+		}
+
 		if (xlat_ctx->found) {
 			rcode = RLM_MODULE_OK;
 			goto finish;
@@ -896,15 +928,28 @@ static unlang_action_t ldap_group_xlat_results(rlm_rcode_t *p_result, UNUSED int
 				xlat_ctx->status = GROUP_XLAT_MEMB_ATTR;
 				return UNLANG_ACTION_PUSHED_CHILD;
 			}
+			xlat_ctx->cacheable = false;
 		}
 		FALL_THROUGH;
 
 	case GROUP_XLAT_MEMB_ATTR:
+		if ((xlat_ctx->status == GROUP_XLAT_MEMB_ATTR) && (*p_result == RLM_MODULE_FAIL)) {
+			xlat_ctx->cacheable = false;
+		}
+
 		if (xlat_ctx->found) rcode = RLM_MODULE_OK;
 		break;
 	}
 
 finish:
+	/*
+	 *	Only results from lookups which completed are cached,
+	 *	a failed lookup says nothing about group membership.
+	 */
+	if (xlat_ctx->cacheable && (rcode != RLM_MODULE_FAIL)) {
+		rlm_ldap_group_cache_store(inst, xlat_ctx->dn, xlat_ctx->group->vb_strvalue, xlat_ctx->found);
+	}
+
 	RETURN_MODULE_RCODE(rcode);
 }
 
@@ -929,6 +974,42 @@ static xlat_arg_parser_t const ldap_group_xlat_arg[] = {
 	XLAT_ARG_PARSER_TERMINATOR
 };
 
+static xlat_arg_parser_t const ldap_group_flush_xlat_arg[] = {
+	{ .required = true, .concat = true, .type = FR_TYPE_STRING },
+	XLAT_ARG_PARSER_TERMINATOR
+};
+
+/** Discard cached group membership results for a user or group
+ *
+ * Intended to be called when an ldap_sync virtual server is notified of a change.
+ *
+ * Example:
+@verbatim
+%ldap.group.flush(%{LDAP-Sync.Entry-DN})
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t ldap_group_flush_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out, xlat_ctx_t const *xctx,
+					   request_t *request, fr_value_box_list_t *in)
+{
+	fr_value_box_t		*vb, *dn_vb = fr_value_box_list_head(in);
+	rlm_ldap_t const	*inst = talloc_get_type_abort_const(xctx->mctx->mi->data, rlm_ldap_t);
+	char			*dn;
+
+	MEM(dn = talloc_bstrndup(ctx, dn_vb->vb_strvalue, dn_vb->vb_length));
+	if (fr_ldap_util_is_dn(dn, dn_vb->vb_length)) fr_ldap_util_normalise_dn(dn, dn);
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT32, NULL));
+	vb->vb_uint32 = rlm_ldap_group_cache_flush(inst, dn);
+	talloc_free(dn);
+
+	RDEBUG2("Discarded %u cached membership result(s)", vb->vb_uint32);
+
+	fr_dcursor_append(out, vb);
+	return XLAT_ACTION_DONE;
+}
+
 /** Check for a user being in a LDAP group
  *
  * @ingroup xlat_functions
@@ -2227,6 +2308,8 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 
 	if (inst->user.obj_sort_ctrl) ldap_control_free(inst->user.obj_sort_ctrl);
 
+	rlm_ldap_group_cache_free(inst);
+
 	return 0;
 }
 
@@ -2455,6 +2538,12 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	inst->bind_trunk_conf.req_pool_headers = 2;
 	inst->bind_trunk_conf.req_pool_size = sizeof(fr_ldap_bind_auth_ctx_t) + sizeof(fr_ldap_sasl_ctx_t);
 
+	/*
+	 *	Connection limits shared between all threads.
+	 */
+	trunk_conf_shared_alloc(inst, &inst->trunk_conf);
+	trunk_conf_shared_alloc(inst, &inst->bind_trunk_conf);
+
 	options = cf_section_find(conf, "options", NULL);
 	if (!options || !cf_pair_find(options, "chase_referrals")) {
 		inst->handle_config.chase_referrals_unset = true;	 /* use OpenLDAP defaults */
@@ -2634,6 +2723,8 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		}
 	}
 
+	if (rlm_ldap_group_cache_alloc(inst) < 0) goto error;
+
 	return 0;
 
 error:
@@ -2711,6 +2802,10 @@ static int mod_bootstrap(module_inst_ctx_t const *mctx)
 	xlat_func_args_set(xlat, ldap_group_xlat_arg);
 	xlat_func_call_env_set(xlat, &xlat_memberof_method_env);
 
+	if (unlikely(!(xlat = module_rlm_xlat_register(mctx->mi->boot, mctx, "group.flush", ldap_group_flush_xlat,
+							FR_TYPE_UINT32)))) return -1;
+	xlat_func_args_set(xlat, ldap_group_flush_xlat_arg);
+
 	if (unlikely(!(xlat = module_rlm_xlat_register(mctx->mi->boot, mctx, "profile", ldap_profile_xlat,
 							FR_TYPE_BOOL)))) return -1;
 	xlat_func_args_set(xlat, ldap_xlat_arg);
@@ -23,6 +23,22 @@ typedef struct {
 	char const	*reference;			//!< Configuration reference string.
 } ldap_acct_section_t;
 
+/** Membership results shared by all threads
+ *
+ */
+typedef struct rlm_ldap_group_cache_s rlm_ldap_group_cache_t;
+
+/** Result of looking up a membership result in the group cache
+ *
+ */
+typedef enum {
+	LDAP_GROUP_CACHE_MISS = 0,			//!< No cached result, perform a lookup.
+	LDAP_GROUP_CACHE_HIT,				//!< Cached result found.
+	LDAP_GROUP_CACHE_REFRESH			//!< Cached result is about to expire.  The caller should
+							///< perform a lookup to refresh it, other requests will
+							///< continue to use the cached result in the meantime.
+} ldap_group_cache_status_t;
+
 typedef struct {
 	/*
 	 *	Options
@@ -94,6 +110,15 @@ typedef struct {
 								///< from a user object.
 
 		bool		skip_on_suspend;		//!< Don't process groups if the user is suspended.
+
+		struct {
+			fr_time_delta_t	ttl;			//!< How long to cache positive membership results for.
+			fr_time_delta_t	negative_ttl;		//!< How long to cache negative membership results for.
+			fr_time_delta_t	refresh;		//!< Refresh entries which expire within this period.
+			uint32_t	max_entries;		//!< Maximum number of membership results to cache.
+		} membership_cache;
+
+		rlm_ldap_group_cache_t	*cache;			//!< Membership results shared by all threads.
 	} group;
 
 	char const	*valuepair_attr;		//!< Generic dynamic mapping attribute, contains a RADIUS
@@ -230,6 +255,7 @@ typedef struct {
 	fr_ldap_query_t			*query;
 	ldap_group_xlat_status_t	status;
 	bool				found;
+	bool				cacheable;	//!< Whether the result can be added to the membership cache.
 } ldap_group_xlat_ctx_t;
 
 extern HIDDEN fr_dict_attr_t const *attr_password;
@@ -279,6 +305,17 @@ unlang_action_t rlm_ldap_check_groupobj_dynamic(rlm_rcode_t *p_result, request_t
 unlang_action_t rlm_ldap_check_userobj_dynamic(rlm_rcode_t *p_result, request_t *request,
 					       ldap_group_xlat_ctx_t *xlat_ctx);
 
+int rlm_ldap_group_cache_alloc(rlm_ldap_t *inst);
+
+void rlm_ldap_group_cache_free(rlm_ldap_t *inst);
+
+ldap_group_cache_status_t rlm_ldap_group_cache_find(bool *member, rlm_ldap_t const *inst,
+						   char const *user_dn, char const *group);
+
+void rlm_ldap_group_cache_store(rlm_ldap_t const *inst, char const *user_dn, char const *group, bool member);
+
+uint32_t rlm_ldap_group_cache_flush(rlm_ldap_t const *inst, char const *dn);
+
 unlang_action_t rlm_ldap_check_cached(rlm_rcode_t *p_result,
 				      rlm_ldap_t const *inst, request_t *request, fr_value_box_t const *check);
 
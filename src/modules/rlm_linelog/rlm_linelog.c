@@ -23,6 +23,7 @@
 
 RCSID("$Id$")
 
+#include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/exfile.h>
 #include <freeradius-devel/server/module_rlm.h>
@@ -61,8 +62,11 @@ RCSID("$Id$")
 #  endif
 #endif
 
+#include <poll.h>
 #include <sys/uio.h>
 
+#define LINELOG_ASYNC_BATCH	64		//!< Maximum number of lines written per system call.
+
 static int linelog_escape_func(fr_value_box_t *vb, UNUSED void *uctx);
 static int call_env_filename_parse(TALLOC_CTX *ctx, void *out, tmpl_rules_t const *t_rules, CONF_ITEM *ci,
 				   call_env_ctx_t const *cec, UNUSED call_env_parser_t const *rule);
@@ -91,6 +95,17 @@ static fr_table_num_sorted_t const linefr_log_dst_table[] = {
 };
 static size_t linefr_log_dst_table_len = NUM_ELEMENTS(linefr_log_dst_table);
 
+typedef enum {
+	LINELOG_FULL_DROP_OLDEST = 0,			//!< Discard the oldest queued lines to make room.
+	LINELOG_FULL_BLOCK				//!< Wait (up to the timeout) for room in the queue.
+} linelog_full_t;
+
+static fr_table_num_sorted_t const linelog_full_table[] = {
+	{ L("block"),		LINELOG_FULL_BLOCK		},
+	{ L("drop_oldest"),	LINELOG_FULL_DROP_OLDEST	}
+};
+static size_t linelog_full_table_len = NUM_ELEMENTS(linelog_full_table);
+
 typedef struct {
 	fr_ipaddr_t		dst_ipaddr;		//!< Network server.
 	fr_ipaddr_t		src_ipaddr;		//!< Send requests from a given src_ipaddr.
@@ -131,6 +146,13 @@ typedef struct {
 	linelog_net_t		tcp;			//!< TCP server.
 	linelog_net_t		udp;			//!< UDP server.
 
+	struct {
+		bool			enable;			//!< Queue lines and write them from the event loop.
+		uint32_t		queue_size;		//!< Size of each thread's queue, in bytes.
+		linelog_full_t		full;			//!< What to do when the queue is full.
+		fr_time_delta_t		reconnect_delay;	//!< How long to wait before reconnecting.
+	} async;
+
 	CONF_SECTION		*cs;			//!< #CONF_SECTION to use as the root for #log_ref lookups.
 } rlm_linelog_t;
 
@@ -138,6 +160,29 @@ typedef struct {
 	int			sockfd;			//!< File descriptor associated with socket
 } linelog_conn_t;
 
+/** Per-thread state for asynchronous output
+ *
+ * Each line is stored in the ring buffer as a uint32_t length followed
+ * by the data.
+ */
+typedef struct {
+	rlm_linelog_t const	*inst;			//!< Instance of rlm_linelog.
+	fr_event_list_t		*el;			//!< Event list for this thread.
+
+	fr_ring_buffer_t	*rb;			//!< Lines waiting to be written.
+	uint32_t		queued;			//!< Number of lines in the ring buffer.
+	size_t			written;		//!< Bytes of the oldest line which have already been written.
+
+	int			fd;			//!< Our socket, or -1 if we're not connected.
+	bool			want_write;		//!< Waiting for the socket to become writable.
+	fr_event_timer_t const	*drain_ev;		//!< Drain the queue on the next pass through the event loop.
+	fr_event_timer_t const	*reconnect_ev;		//!< Reconnect timer.
+
+	uint64_t		dropped;		//!< Lines dropped because the queue was full,
+							///< or because they couldn't be sent.
+	fr_rate_limit_t		drop_rate_limit;	//!< So we don't complain about every dropped line.
+} rlm_linelog_thread_t;
+
 
 static const conf_parser_t file_config[] = {
 	{ FR_CONF_OFFSET("permissions", rlm_linelog_t, file.permissions), .dflt = "0600" },
@@ -171,6 +216,15 @@ static const conf_parser_t tcp_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const conf_parser_t async_config[] = {
+	{ FR_CONF_OFFSET("enable", rlm_linelog_t, async.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("queue_size", rlm_linelog_t, async.queue_size), .dflt = "1048576" },
+	{ FR_CONF_OFFSET("full", rlm_linelog_t, async.full), .dflt = "drop_oldest",
+	  .func = cf_table_parse_int, .uctx = &(cf_table_parse_ctx_t){ .table = linelog_full_table, .len = &linelog_full_table_len } },
+	{ FR_CONF_OFFSET("reconnect_delay", rlm_linelog_t, async.reconnect_delay), .dflt = "1" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("destination", CONF_FLAG_REQUIRED, rlm_linelog_t, log_dst_str) },
 
@@ -185,6 +239,8 @@ static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_SUBSECTION("tcp", 0, rlm_linelog_t, tcp, tcp_config) },
 	{ FR_CONF_OFFSET_SUBSECTION("udp", 0, rlm_linelog_t, udp, udp_config) },
 
+	{ FR_CONF_POINTER("async", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) async_config },
+
 	/*
 	 *	Deprecated config items
 	 */
@@ -358,7 +414,344 @@ static void linelog_hexdump(request_t *request, struct iovec *vector_p, size_t v
 	RHEXDUMP3(fr_dbuff_start(agg), fr_dbuff_used(agg), "%s", msg);
 }
 
-static int linelog_write(rlm_linelog_t const *inst, linelog_call_env_t const *call_env, request_t *request, struct iovec *vector_p, size_t vector_len, bool with_delim)
+static void linelog_async_drain(rlm_linelog_thread_t *t);
+
+static void linelog_async_reconnect_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx);
+
+/** Open a non-blocking socket to the log destination
+ *
+ */
+static int linelog_async_connect(rlm_linelog_thread_t *t)
+{
+	rlm_linelog_t const	*inst = t->inst;
+	int			fd = -1;
+
+	switch (inst->log_dst) {
+#ifdef HAVE_SYS_UN_H
+	case LINELOG_DST_UNIX:
+		fd = fr_socket_client_unix(inst->unix_sock.path, true);
+		break;
+#endif
+
+	case LINELOG_DST_TCP:
+		fd = fr_socket_client_tcp(NULL, NULL, &inst->tcp.dst_ipaddr, inst->tcp.port, true);
+		break;
+
+	case LINELOG_DST_UDP:
+		fd = fr_socket_client_udp(NULL, NULL, NULL, &inst->udp.dst_ipaddr, inst->udp.port, true);
+		break;
+
+	default:
+		fr_assert(0);
+		return -1;
+	}
+
+	if (fd < 0) {
+		PERROR("Failed opening socket to log destination");
+
+		if (!t->reconnect_ev &&
+		    (fr_event_timer_in(t, t->el, &t->reconnect_ev, inst->async.reconnect_delay,
+				       linelog_async_reconnect_timer, t) < 0)) {
+			PERROR("Failed inserting reconnect timer");
+		}
+		return -1;
+	}
+
+	t->fd = fd;
+	t->written = 0;
+
+	return 0;
+}
+
+/** Close the socket, and try again later
+ *
+ */
+static void linelog_async_reconnect(rlm_linelog_thread_t *t)
+{
+	if (t->fd >= 0) {
+		if (t->want_write) (void) fr_event_fd_delete(t->el, t->fd, FR_EVENT_FILTER_IO);
+		close(t->fd);
+	}
+
+	t->fd = -1;
+	t->want_write = false;
+
+	/*
+	 *	A partially written line is sent again, in full, on
+	 *	the new connection.
+	 */
+	t->written = 0;
+
+	if (!t->reconnect_ev &&
+	    (fr_event_timer_in(t, t->el, &t->reconnect_ev, t->inst->async.reconnect_delay,
+			       linelog_async_reconnect_timer, t) < 0)) {
+		PERROR("Failed inserting reconnect timer");
+	}
+}
+
+static void linelog_async_reconnect_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_linelog_thread_t *t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	t->reconnect_ev = NULL;
+
+	if (t->fd < 0) {
+		DEBUG2("Reconnecting to log destination");
+		if (linelog_async_connect(t) < 0) return;
+	}
+
+	linelog_async_drain(t);
+}
+
+static void linelog_async_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	rlm_linelog_thread_t *t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	linelog_async_drain(t);
+}
+
+static void linelog_async_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	rlm_linelog_thread_t *t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	ERROR("Log destination failed: %s.  Will reconnect", fr_syserror(fd_errno));
+	linelog_async_reconnect(t);
+}
+
+static void linelog_async_drain_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_linelog_thread_t *t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+
+	t->drain_ev = NULL;
+	linelog_async_drain(t);
+}
+
+/** Remove lines from the front of the queue
+ *
+ */
+static void linelog_async_consume(rlm_linelog_thread_t *t, uint32_t lines, size_t bytes)
+{
+	fr_assert(t->queued >= lines);
+
+	t->queued -= lines;
+	(void) fr_ring_buffer_free(t->rb, bytes);
+}
+
+/** Discard the oldest line in the queue
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the oldest line can't be discarded, because it's partially written.
+ */
+static int linelog_async_drop_oldest(rlm_linelog_thread_t *t)
+{
+	uint8_t		*start;
+	size_t		size;
+	uint32_t	len;
+
+	if (!t->queued || t->written) return -1;
+
+	(void) fr_ring_buffer_start(t->rb, &start, &size);
+	fr_assert(size >= sizeof(len));
+
+	memcpy(&len, start, sizeof(len));
+	linelog_async_consume(t, 1, sizeof(len) + len);
+
+	return 0;
+}
+
+/** Write as many queued lines as the socket will take
+ *
+ * Lines are written with one writev() (streams) or sendmmsg() (UDP)
+ * per batch.  If the socket is full, we wait for it to become
+ * writable again.
+ */
+static void linelog_async_drain(rlm_linelog_thread_t *t)
+{
+	while (t->queued > 0) {
+		struct iovec	iov[LINELOG_ASYNC_BATCH];
+		size_t		lens[LINELOG_ASYNC_BATCH];
+		uint8_t		*start, *p, *end;
+		size_t		size, bytes = 0;
+		uint32_t	len, lines = 0, n = 0;
+		ssize_t		sent;
+
+		if (t->fd < 0) return;
+
+		(void) fr_ring_buffer_start(t->rb, &start, &size);
+		if (!size) break;
+
+		for (p = start, end = start + size; (p < end) && (n < NUM_ELEMENTS(iov)); n++) {
+			memcpy(&len, p, sizeof(len));
+			iov[n].iov_base = p + sizeof(len);
+			iov[n].iov_len = len;
+			lens[n] = sizeof(len) + len;
+			p += lens[n];
+		}
+
+		if (t->inst->log_dst == LINELOG_DST_UDP) {
+#ifdef HAVE_SENDMMSG
+			struct mmsghdr	msg[LINELOG_ASYNC_BATCH];
+			uint32_t	i;
+
+			memset(msg, 0, sizeof(msg[0]) * n);
+			for (i = 0; i < n; i++) {
+				msg[i].msg_hdr.msg_iov = &iov[i];
+				msg[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			sent = sendmmsg(t->fd, msg, n, 0);
+#else
+			sent = (send(t->fd, iov[0].iov_base, iov[0].iov_len, 0) < 0) ? -1 : 1;
+#endif
+			if (sent < 0) {
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) goto wait;
+
+				/*
+				 *	Datagrams stand alone, so there's no
+				 *	need to reconnect.  Just lose the line.
+				 */
+				RATE_LIMIT_LOCAL(&t->drop_rate_limit, ERROR, "Failed sending to log destination: %s",
+						 fr_syserror(errno));
+				t->dropped++;
+				sent = 1;
+			}
+
+			for (lines = 0; lines < (uint32_t) sent; lines++) bytes += lens[lines];
+			linelog_async_consume(t, lines, bytes);
+
+		} else {
+			size_t total;
+
+			iov[0].iov_base = (uint8_t *) iov[0].iov_base + t->written;
+			iov[0].iov_len -= t->written;
+
+			sent = writev(t->fd, iov, n);
+			if (sent < 0) {
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINPROGRESS) ||
+				    (errno == ENOTCONN)) goto wait;
+
+				ERROR("Failed writing to log destination: %s.  Will reconnect", fr_syserror(errno));
+				linelog_async_reconnect(t);
+				return;
+			}
+
+			/*
+			 *	Release the lines which were written
+			 *	completely, and remember how much of the
+			 *	next one was written.
+			 */
+			total = sent + t->written;
+			while ((lines < n) && (total >= (lens[lines] - sizeof(len)))) {
+				total -= lens[lines] - sizeof(len);
+				bytes += lens[lines];
+				lines++;
+			}
+			t->written = total;
+
+			linelog_async_consume(t, lines, bytes);
+		}
+
+		/*
+		 *	Short write, the socket is full.
+		 */
+		if (lines < n) goto wait;
+	}
+
+	if (t->want_write) {
+		(void) fr_event_fd_delete(t->el, t->fd, FR_EVENT_FILTER_IO);
+		t->want_write = false;
+	}
+	return;
+
+wait:
+	if (t->want_write) return;
+
+	if (fr_event_fd_insert(t, NULL, t->el, t->fd, NULL, linelog_async_writable, linelog_async_error, t) < 0) {
+		PERROR("Failed inserting write event for log destination");
+		linelog_async_reconnect(t);
+		return;
+	}
+	t->want_write = true;
+}
+
+/** Wait for the socket to become writable, and drain the queue
+ *
+ * Only used for "full = block".
+ */
+static bool linelog_async_wait(rlm_linelog_thread_t *t, fr_time_delta_t timeout)
+{
+	struct pollfd	pfd = { .fd = t->fd, .events = POLLOUT };
+	uint32_t	queued = t->queued;
+
+	if (t->fd < 0) return false;
+
+	if (poll(&pfd, 1, fr_time_delta_to_msec(timeout)) <= 0) return false;
+
+	linelog_async_drain(t);
+
+	return (t->queued < queued);
+}
+
+/** Add a line to the queue
+ *
+ */
+static ssize_t linelog_async_enqueue(rlm_linelog_thread_t *t, request_t *request,
+				     struct iovec *vector_p, size_t vector_len, fr_time_delta_t timeout)
+{
+	rlm_linelog_t const	*inst = t->inst;
+	size_t			i, len = 0;
+	uint32_t		len32;
+	uint8_t			*p;
+
+	for (i = 0; i < vector_len; i++) len += vector_p[i].iov_len;
+
+	if ((sizeof(len32) + len) > (inst->async.queue_size / 2)) {
+		RERROR("Line is too large (%zu bytes) for the queue", len);
+		return -1;
+	}
+
+	while (!(p = fr_ring_buffer_alloc(t->rb, sizeof(len32) + len))) {
+		if ((inst->async.full == LINELOG_FULL_BLOCK) && linelog_async_wait(t, timeout)) continue;
+
+		if ((inst->async.full == LINELOG_FULL_BLOCK) || (linelog_async_drop_oldest(t) < 0)) {
+			t->dropped++;
+			RATE_LIMIT_LOCAL(&t->drop_rate_limit, RWARN, "Log queue full, dropped %" PRIu64 " line(s) so far",
+					 t->dropped);
+			return -1;
+		}
+
+		t->dropped++;
+		RATE_LIMIT_LOCAL(&t->drop_rate_limit, RWARN, "Log queue full, dropped %" PRIu64 " line(s) so far",
+				 t->dropped);
+	}
+
+	len32 = len;
+	memcpy(p, &len32, sizeof(len32));
+	p += sizeof(len32);
+
+	for (i = 0; i < vector_len; i++) {
+		memcpy(p, vector_p[i].iov_base, vector_p[i].iov_len);
+		p += vector_p[i].iov_len;
+	}
+	t->queued++;
+
+	if (RDEBUG_ENABLED3) linelog_hexdump(request, vector_p, vector_len, "linelog queued data");
+
+	/*
+	 *	Lines queued on this pass through the event loop are
+	 *	written together, on the next one.
+	 */
+	if (!t->want_write && !t->drain_ev &&
+	    (fr_event_timer_in(t, t->el, &t->drain_ev, fr_time_delta_wrap(0), linelog_async_drain_timer, t) < 0)) {
+		RPERROR("Failed inserting drain timer");
+	}
+
+	return len;
+}
+
+static int linelog_write(rlm_linelog_t const *inst, rlm_linelog_thread_t *thread, linelog_call_env_t const *call_env,
+			 request_t *request, struct iovec *vector_p, size_t vector_len, bool with_delim)
 {
 	int 			ret = 0;
 	linelog_conn_t		*conn;
@@ -479,6 +872,8 @@ static int linelog_write(rlm_linelog_t const *inst, linelog_call_env_t const *ca
 		}
 
 	do_write:
+		if (inst->async.enable) return linelog_async_enqueue(thread, request, vector_p, vector_len, timeout);
+
 		num = fr_pool_state(inst->pool)->num;
 		conn = fr_pool_connection_get(inst->pool, request);
 		if (!conn) return -1;
@@ -591,7 +986,7 @@ static xlat_action_t linelog_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 		vector[i].iov_len = inst->delimiter_len;
 		i++;
 	}
-	slen = linelog_write(inst, call_env, request, vector, i, with_delim);
+	slen = linelog_write(inst, xctx->mctx->thread, call_env, request, vector, i, with_delim);
 	if (slen < 0) return XLAT_ACTION_FAIL;
 
 	MEM(wrote = fr_value_box_alloc(ctx, FR_TYPE_SIZE, NULL));
@@ -605,6 +1000,7 @@ static xlat_action_t linelog_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 typedef struct {
 	fr_value_box_list_t	expanded;	//!< The result of expanding the fmt tmpl
 	bool			with_delim;	//!< Whether to add a delimiter
+	bool			segments;	//!< The expansion is the segments of a single line.
 } rlm_linelog_rctx_t;
 
 static unlang_action_t CC_HINT(nonnull) mod_do_linelog_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
@@ -622,6 +1018,30 @@ static unlang_action_t CC_HINT(nonnull) mod_do_linelog_resume(rlm_rcode_t *p_res
 		RETURN_MODULE_NOOP;
 	}
 
+	/*
+	 *	Write the segments out as they are, with one
+	 *	delimiter at the end, instead of copying them
+	 *	into a single buffer first.
+	 */
+	if (rctx->segments) {
+		ssize_t slen;
+
+		slen = fr_iovec_afrom_value_box_list(rctx, &vector, &rctx->expanded);
+		if (slen < 0) {
+			RPEDEBUG("Failed building vector");
+			RETURN_MODULE_FAIL;
+		}
+		vector_len = slen;
+
+		if (rctx->with_delim) {
+			MEM(vector = talloc_realloc(rctx, vector, struct iovec, vector_len + 1));
+			memcpy(&vector[vector_len].iov_base, &(inst->delimiter), sizeof(vector[vector_len].iov_base));
+			vector[vector_len].iov_len = inst->delimiter_len;
+			vector_len++;
+		}
+		goto write;
+	}
+
 	/*
 	 *	Add extra space for the delimiter
 	 */
@@ -660,7 +1080,8 @@ static unlang_action_t CC_HINT(nonnull) mod_do_linelog_resume(rlm_rcode_t *p_res
 		}
 	}
 
-	RETURN_MODULE_RCODE(linelog_write(inst, call_env, request, vector, vector_len, rctx->with_delim) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK);
+write:
+	RETURN_MODULE_RCODE(linelog_write(inst, mctx->thread, call_env, request, vector, vector_len, rctx->with_delim) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK);
 }
 
 /** Write a linelog message
@@ -846,7 +1267,7 @@ build_vector:
 			RDEBUG2("No data to write");
 			rcode = RLM_MODULE_NOOP;
 		} else {
-			rcode = linelog_write(inst, call_env, request, vector_p, vector_len, with_delim) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK;
+			rcode = linelog_write(inst, mctx->thread, call_env, request, vector_p, vector_len, with_delim) < 0 ? RLM_MODULE_FAIL : RLM_MODULE_OK;
 		}
 
 		talloc_free(vpt);
@@ -866,7 +1287,25 @@ build_vector:
 		fr_value_box_list_init(&rctx->expanded);
 		rctx->with_delim = with_delim;
 
-		return unlang_module_yield_to_tmpl(rctx, &rctx->expanded, request, vpt_p, NULL, mod_do_linelog_resume, NULL, 0, rctx);
+		/*
+		 *	A quoted format is a single line.  Destinations
+		 *	which take a vector get its segments, the others
+		 *	write each element of the vector as a line.
+		 */
+		switch (inst->log_dst) {
+		case LINELOG_DST_REQUEST:
+		case LINELOG_DST_SYSLOG:
+			rctx->segments = false;
+			break;
+
+		default:
+			rctx->segments = (vpt_p->quote != T_BARE_WORD);
+			break;
+		}
+
+		return unlang_module_yield_to_tmpl(rctx, &rctx->expanded, request, vpt_p,
+						   rctx->segments ? TMPL_ARGS_SEGMENTS : NULL,
+						   mod_do_linelog_resume, NULL, 0, rctx);
 	}
 	}
 }
@@ -902,6 +1341,53 @@ static int call_env_filename_parse(TALLOC_CTX *ctx, void *out, tmpl_rules_t cons
 	return 0;
 }
 
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_linelog_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_linelog_t);
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_linelog_thread_t);
+
+	t->inst = inst;
+	t->el = mctx->el;
+	t->fd = -1;
+
+	if (!inst->async.enable) return 0;
+
+	t->rb = fr_ring_buffer_create(t, inst->async.queue_size);
+	if (!t->rb) {
+		PERROR("Failed creating log queue");
+		return -1;
+	}
+
+	/*
+	 *	Failure isn't fatal, we retry the connection, and
+	 *	queue lines in the meantime.
+	 */
+	(void) linelog_async_connect(t);
+
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_linelog_thread_t);
+
+	if (!t->rb) return 0;
+
+	/*
+	 *	Write whatever we can without blocking.
+	 */
+	if (t->fd >= 0) {
+		linelog_async_drain(t);
+		if (t->want_write) (void) fr_event_fd_delete(t->el, t->fd, FR_EVENT_FILTER_IO);
+		close(t->fd);
+		t->fd = -1;
+	}
+
+	if (t->queued) WARN("Discarding %u queued line(s)", t->queued);
+
+	return 0;
+}
+
 static int mod_detach(module_detach_ctx_t const *mctx)
 {
 	rlm_linelog_t *inst = talloc_get_type_abort(mctx->mi->data, rlm_linelog_t);
@@ -928,6 +1414,30 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 
 	snprintf(prefix, sizeof(prefix), "rlm_linelog (%s)", mctx->mi->name);
 
+	if (inst->async.enable) {
+		switch (inst->log_dst) {
+		case LINELOG_DST_UNIX:
+		case LINELOG_DST_UDP:
+		case LINELOG_DST_TCP:
+			break;
+
+		default:
+			cf_log_err(conf, "'async' can only be used with the \"unix\", \"udp\" and \"tcp\" destinations");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("async.queue_size", inst->async.queue_size, >=, 4096);
+		FR_INTEGER_BOUND_CHECK("async.queue_size", inst->async.queue_size, <=, 1024 * 1024 * 1024);
+		FR_TIME_DELTA_BOUND_CHECK("async.reconnect_delay", inst->async.reconnect_delay, >=, fr_time_delta_from_msec(100));
+		FR_TIME_DELTA_BOUND_CHECK("async.reconnect_delay", inst->async.reconnect_delay, <=, fr_time_delta_from_sec(60));
+
+		/*
+		 *	Each thread has its own socket, so there's no
+		 *	connection pool.
+		 */
+		goto done;
+	}
+
 	/*
 	 *	Setup the logging destination
 	 */
@@ -1023,6 +1533,7 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		break;
 	}
 
+done:
 	inst->delimiter_len = talloc_array_length(inst->delimiter) - 1;
 	inst->cs = conf;
 
@@ -1057,7 +1568,12 @@ module_rlm_t rlm_linelog = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
-		.detach		= mod_detach
+		.detach		= mod_detach,
+
+		.thread_inst_size	= sizeof(rlm_linelog_thread_t),
+		.thread_inst_type	= "rlm_linelog_thread_t",
+		.thread_instantiate	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
@@ -324,7 +324,6 @@ static int _lua_pair_get(lua_State *L)
 {
 	request_t			*request = fr_lua_util_get_request();
 
-	fr_dcursor_t		cursor;
 	fr_dict_attr_t const	*da;
 	fr_pair_t		*vp = NULL;
 	int			index;
@@ -334,15 +333,14 @@ static int _lua_pair_get(lua_State *L)
 	da = lua_touserdata(L, lua_upvalueindex(1));
 	fr_assert(da);
 
+	index = (int) lua_tointeger(L, -1);
+	if (index < 0) return 0;
+
 	/*
 	 *	@fixme Packet list should be light user data too at some point
 	 */
-	fr_pair_dcursor_by_da_init(&cursor, &request->request_pairs, da);
-
-	for (index = (int) lua_tointeger(L, -1); index >= 0; index--) {
-		vp = fr_dcursor_next(&cursor);
-		if (!vp) return 0;
-	}
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, da, index);
+	if (!vp) return 0;
 
 	if (fr_lua_marshall(request, L, vp) < 0) return -1;
 
@@ -366,7 +364,6 @@ static int _lua_pair_set(lua_State *L)
 	module_ctx_t const	*mctx = fr_lua_util_get_mctx();
 	rlm_lua_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_lua_t);
 	request_t		*request = fr_lua_util_get_request();
-	fr_dcursor_t		cursor;
 	fr_dict_attr_t const	*da;
 	fr_pair_t		*vp = NULL, *new;
 	lua_Integer		index;
@@ -383,22 +380,20 @@ static int _lua_pair_set(lua_State *L)
 
 	delete = lua_isnil(L, -1);
 
+	index = lua_tointeger(L, -2);
+	if (index < 0) return 0;
+
 	/*
 	 *	@fixme Packet list should be light user data too at some point
 	 */
-	fr_pair_dcursor_by_da_init(&cursor, &request->request_pairs, da);
-
-	for (index = lua_tointeger(L, -2); index >= 0; index--) {
-		vp = fr_dcursor_next(&cursor);
-		if (vp) break;
-	}
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, da, (unsigned int)index);
 
 	/*
 	 *	If the value of the Lua stack was nil, we delete the
-	 *	attribute the cursor is currently positioned at.
+	 *	attribute at that index.
 	 */
 	if (delete) {
-		fr_dcursor_remove(&cursor);
+		if (vp) fr_pair_delete(&request->request_pairs, vp);
 		return 0;
 	}
 
@@ -409,9 +404,9 @@ static int _lua_pair_set(lua_State *L)
 	 *	else we add a new VP to the list.
 	 */
 	if (vp) {
-		fr_dcursor_replace(&cursor, new);
+		fr_pair_replace(&request->request_pairs, vp, new);
 	} else {
-		fr_dcursor_append(&cursor, new);
+		fr_pair_append(&request->request_pairs, new);
 	}
 
 	return 0;
@@ -718,7 +713,7 @@ static int fr_lua_get_field(lua_State *L, request_t *request, char const *field)
 	return 0;
 }
 
-static void _lua_fr_request_register(lua_State *L, request_t *request)
+static void _lua_fr_request_register(lua_State *L, request_t *request, bool jit)
 {
 	/* fr = {} */
 	lua_getglobal(L, "fr");
@@ -741,10 +736,19 @@ static void _lua_fr_request_register(lua_State *L, request_t *request)
 		lua_pushcclosure(L, _lua_list_iterator_init, 1);
 		lua_setfield(L, -2, "pairs");
 
-		lua_newtable(L);		/* Attribute list meta-table */
-		lua_pushinteger(L, request_attr_request->attr);
-		lua_pushcclosure(L, _lua_pair_accessor_init, 1);
-		lua_setfield(L, -2, "__index");
+		/*
+		 *	Attribute list meta-table.  With LuaJIT, the
+		 *	accessors use the FFI, and are shared between
+		 *	requests.
+		 */
+		if (jit) {
+			lua_getglobal(L, "_fr_jit_request_mt");
+		} else {
+			lua_newtable(L);
+			lua_pushinteger(L, request_attr_request->attr);
+			lua_pushcclosure(L, _lua_pair_accessor_init, 1);
+			lua_setfield(L, -2, "__index");
+		}
 		lua_setmetatable(L, -2);
 	}
 
@@ -753,6 +757,7 @@ static void _lua_fr_request_register(lua_State *L, request_t *request)
 
 unlang_action_t fr_lua_run(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request, char const *funcname)
 {
+	rlm_lua_t const		*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_lua_t);
 	rlm_lua_thread_t	*thread = talloc_get_type_abort(mctx->thread, rlm_lua_thread_t);
 	lua_State		*L = thread->interpreter;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
@@ -762,7 +767,17 @@ unlang_action_t fr_lua_run(rlm_rcode_t *p_result, module_ctx_t const *mctx, requ
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "Calling %s() in interpreter %p", funcname, L);
 
-	_lua_fr_request_register(L, request);
+	/*
+	 *	The cached attributes are only valid for the
+	 *	dictionary they were resolved in.
+	 */
+	if (inst->jit && request && (thread->jit_dict != request->dict)) {
+		lua_newtable(L);
+		lua_setglobal(L, "_fr_jit_attrs");
+		thread->jit_dict = request->dict;
+	}
+
+	_lua_fr_request_register(L, request, inst->jit);
 
 	/*
 	 *	Get the function were going to be calling
@@ -935,6 +950,11 @@ int fr_lua_init(lua_State **out, module_inst_ctx_t const *mctx)
 	if (inst->jit) {
 		DEBUG4("Initialised new LuaJIT interpreter %p", L);
 		if (fr_lua_util_jit_log_register(L) < 0) goto error;
+
+		/*
+		 *	Setup FFI accessors for "fr.request.{}"
+		 */
+		if (fr_lua_util_jit_pair_register(L) < 0) goto error;
 	} else {
 		DEBUG4("Initialised new Lua interpreter %p", L);
 		if (fr_lua_util_log_register(L) < 0) goto error;
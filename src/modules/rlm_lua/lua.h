@@ -61,8 +61,21 @@ typedef struct {
 
 typedef struct {
 	lua_State	*interpreter;		//!< Thread specific interpreter.
+	fr_dict_t const	*jit_dict;		//!< Dictionary the LuaJIT attribute cache was
+						//!< populated from.
 } rlm_lua_thread_t;
 
+/** A value passed to LuaJIT code via the FFI
+ *
+ * Must match the definition in the cdef block in util.c.
+ */
+typedef struct {
+	int		type;			//!< LUA_TNUMBER or LUA_TSTRING.
+	double		number;			//!< Value, if type is LUA_TNUMBER.
+	char const	*str;			//!< Value, if type is LUA_TSTRING.  Not \0 terminated.
+	size_t		len;			//!< Length of str.
+} fr_lua_jit_value_t;
+
 /* lua.c */
 int		fr_lua_init(lua_State **out, module_inst_ctx_t const *mctx);
 unlang_action_t fr_lua_run(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request, char const *funcname);
@@ -75,7 +88,14 @@ void		fr_lua_util_jit_log_info(char const *msg);
 void		fr_lua_util_jit_log_warn(char const *msg);
 void		fr_lua_util_jit_log_error(char const *msg);
 
+fr_dict_attr_t const *fr_lua_util_jit_attr_by_name(char const *name);
+int		fr_lua_util_jit_pair_get(fr_lua_jit_value_t *out, fr_dict_attr_t const *da, int index);
+int		fr_lua_util_jit_pair_set_number(fr_dict_attr_t const *da, int index, double value);
+int		fr_lua_util_jit_pair_set_string(fr_dict_attr_t const *da, int index, char const *value, size_t len);
+int		fr_lua_util_jit_pair_delete(fr_dict_attr_t const *da, int index);
+
 int		fr_lua_util_jit_log_register(lua_State *L);
+int		fr_lua_util_jit_pair_register(lua_State *L);
 int		fr_lua_util_log_register(lua_State *L);
 void		fr_lua_util_set_mctx(module_ctx_t const *mctx);
 module_ctx_t const *fr_lua_util_get_mctx(void);
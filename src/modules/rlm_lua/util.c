@@ -191,6 +191,262 @@ void fr_lua_util_jit_log_error(char const *msg)
 	ROPTIONAL(RERROR, ERROR, "%s", msg);
 }
 
+/** Resolve an attribute name in the dictionary of the current request
+ *
+ * The result is cached by the Lua code, so this is only called once for
+ * each attribute name, until the dictionary changes.
+ *
+ * @param name	of the attribute.
+ * @return
+ *	- The attribute.
+ *	- NULL if the attribute doesn't exist.
+ */
+fr_dict_attr_t const *fr_lua_util_jit_attr_by_name(char const *name)
+{
+	request_t		*request = fr_lua_request;
+	fr_dict_attr_t const	*da;
+
+	if (!request) return NULL;
+
+	da = fr_dict_attr_by_name(NULL, fr_dict_root(request->dict), name);
+	if (!da) {
+		REDEBUG("Unknown or invalid attribute name \"%s\"", name);
+		return NULL;
+	}
+
+	return da;
+}
+
+/** Get an instance of an attribute from the request list
+ *
+ * Strings and octets strings point directly into the pair, so the
+ * Lua code must copy them before calling any other function here.
+ *
+ * @param out	Where to write the value.
+ * @param da	of the attribute to find.
+ * @param index	of the instance to find, starting from 0.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the attribute doesn't exist, or can't be represented in Lua.
+ */
+int fr_lua_util_jit_pair_get(fr_lua_jit_value_t *out, fr_dict_attr_t const *da, int index)
+{
+	static _Thread_local char	buff[128];
+	request_t			*request = fr_lua_request;
+	fr_pair_t			*vp;
+
+	if (!request || !da || (index < 0)) return -1;
+
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, da, index);
+	if (!vp) return -1;
+
+	out->type = LUA_TNUMBER;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_ETHERNET:
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV6_ADDR:
+	case FR_TYPE_IPV4_PREFIX:
+	case FR_TYPE_IPV6_PREFIX:
+	case FR_TYPE_COMBO_IP_ADDR:
+	case FR_TYPE_COMBO_IP_PREFIX:
+	case FR_TYPE_IFID:
+	case FR_TYPE_TIME_DELTA:
+	{
+		ssize_t	slen;
+
+		slen = fr_pair_print_value_quoted(&FR_SBUFF_OUT(buff, sizeof(buff)), vp, T_BARE_WORD);
+		if (slen < 0) {
+			REDEBUG("Cannot convert %s to Lua type, insufficient buffer space",
+				fr_type_to_str(vp->vp_type));
+			return -1;
+		}
+
+		out->type = LUA_TSTRING;
+		out->str = buff;
+		out->len = (size_t)slen;
+	}
+		break;
+
+	case FR_TYPE_STRING:
+		out->type = LUA_TSTRING;
+		out->str = vp->vp_strvalue;
+		out->len = vp->vp_length;
+		break;
+
+	case FR_TYPE_OCTETS:
+		out->type = LUA_TSTRING;
+		out->str = (char const *)vp->vp_octets;
+		out->len = vp->vp_length;
+		break;
+
+	/*
+	 *	LuaJIT numbers are always doubles, so there's
+	 *	no need for the range checks fr_lua_marshall()
+	 *	does for lua_Integer.
+	 */
+	case FR_TYPE_BOOL:
+		out->number = vp->vp_bool ? 1 : 0;
+		break;
+
+	case FR_TYPE_UINT8:
+		out->number = vp->vp_uint8;
+		break;
+
+	case FR_TYPE_UINT16:
+		out->number = vp->vp_uint16;
+		break;
+
+	case FR_TYPE_UINT32:
+		out->number = vp->vp_uint32;
+		break;
+
+	case FR_TYPE_UINT64:
+		out->number = vp->vp_uint64;
+		break;
+
+	case FR_TYPE_INT8:
+		out->number = vp->vp_int8;
+		break;
+
+	case FR_TYPE_INT16:
+		out->number = vp->vp_int16;
+		break;
+
+	case FR_TYPE_INT32:
+		out->number = vp->vp_int32;
+		break;
+
+	case FR_TYPE_INT64:
+		out->number = vp->vp_int64;
+		break;
+
+	case FR_TYPE_DATE:
+		out->number = fr_unix_time_to_sec(vp->vp_date);
+		break;
+
+	case FR_TYPE_FLOAT32:
+		out->number = vp->vp_float32;
+		break;
+
+	case FR_TYPE_FLOAT64:
+		out->number = vp->vp_float64;
+		break;
+
+	case FR_TYPE_SIZE:
+		out->number = vp->vp_size;
+		break;
+
+	case FR_TYPE_NON_LEAF:
+		REDEBUG("Cannot convert %s to Lua type", fr_type_to_str(vp->vp_type));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Replace or add an instance of an attribute in the request list
+ *
+ * @param da	of the attribute to set.
+ * @param index	of the instance to replace.  If there's no instance at that
+ *		index, a new one is added to the end of the list.
+ * @param vb	value to cast to the type of da.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int fr_lua_util_jit_pair_set(fr_dict_attr_t const *da, int index, fr_value_box_t const *vb)
+{
+	request_t	*request = fr_lua_request;
+	fr_pair_t	*vp, *old;
+
+	if (!request || !da || (index < 0)) return -1;
+
+	MEM(vp = fr_pair_afrom_da(request->request_ctx, da));
+	if (fr_value_box_cast(vp, &vp->data, vp->vp_type, vp->da, vb) < 0) {
+		RPEDEBUG("Failed unmarshalling Lua %s for \"%s\"",
+			 fr_type_is_numeric(vb->type) ? "number" : "string", vp->da->name);
+		talloc_free(vp);
+		return -1;
+	}
+
+	old = fr_pair_find_by_da_idx(&request->request_pairs, da, index);
+	if (old) {
+		fr_pair_replace(&request->request_pairs, old, vp);
+	} else {
+		fr_pair_append(&request->request_pairs, vp);
+	}
+
+	return 0;
+}
+
+/** Set an instance of an attribute from a Lua number
+ *
+ * @param da	of the attribute to set.
+ * @param index	of the instance to replace.
+ * @param value	Lua number.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_util_jit_pair_set_number(fr_dict_attr_t const *da, int index, double value)
+{
+	fr_value_box_t	vb;
+
+	/*
+	 *	Preserve decimal precision, as fr_lua_unmarshall() does.
+	 */
+	if (da && ((da->type == FR_TYPE_FLOAT32) || (da->type == FR_TYPE_FLOAT64))) {
+		fr_value_box_init(&vb, FR_TYPE_FLOAT64, NULL, true);
+		vb.vb_float64 = value;
+	} else {
+		fr_value_box_init(&vb, FR_TYPE_INT64, NULL, true);
+		vb.vb_int64 = (int64_t)value;
+	}
+
+	return fr_lua_util_jit_pair_set(da, index, &vb);
+}
+
+/** Set an instance of an attribute from a Lua string
+ *
+ * @param da	of the attribute to set.
+ * @param index	of the instance to replace.
+ * @param value	Lua string.  May contain embedded '\0's.
+ * @param len	of value.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_util_jit_pair_set_string(fr_dict_attr_t const *da, int index, char const *value, size_t len)
+{
+	fr_value_box_t	vb;
+
+	fr_value_box_bstrndup_shallow(&vb, NULL, value, len, true);
+
+	return fr_lua_util_jit_pair_set(da, index, &vb);
+}
+
+/** Delete an instance of an attribute from the request list
+ *
+ * @param da	of the attribute to delete.
+ * @param index	of the instance to delete.
+ * @return
+ *	- 0 on success, or if there was no instance at index.
+ *	- -1 on failure.
+ */
+int fr_lua_util_jit_pair_delete(fr_dict_attr_t const *da, int index)
+{
+	request_t	*request = fr_lua_request;
+	fr_pair_t	*vp;
+
+	if (!request || !da || (index < 0)) return -1;
+
+	vp = fr_pair_find_by_da_idx(&request->request_pairs, da, index);
+	if (vp) fr_pair_delete(&request->request_pairs, vp);
+
+	return 0;
+}
+
 /** Insert cdefs into the lua environment
  *
  * For LuaJIT using the FFI is significantly faster than the Lua interface.
@@ -272,6 +528,110 @@ int fr_lua_util_jit_log_register(lua_State *L)
 	return 0;
 }
 
+/** Replace the attribute accessors with ones which use the FFI
+ *
+ * Accessing attributes through the Lua C API stops LuaJIT compiling
+ * traces.  These accessors call the fr_lua_util_jit_pair_* functions
+ * through the FFI instead, so scripts which manipulate attributes
+ * can still be JIT compiled.
+ *
+ * Attribute lookups are cached in _fr_jit_attrs, which fr_lua_run()
+ * clears whenever the dictionary of the request changes.
+ *
+ * Must be called after fr_lua_util_jit_log_register(), which loads
+ * the library.
+ *
+ * @param L Lua interpreter.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_lua_util_jit_pair_register(lua_State *L)
+{
+	int ret;
+
+	ret = luaL_dostring(L, "\
+		ffi.cdef [[\
+			typedef struct {\
+				int		type;\
+				double		number;\
+				char const	*str;\
+				size_t		len;\
+			} fr_lua_jit_value_t;\
+			void const *fr_lua_util_jit_attr_by_name(char const *name);\
+			int fr_lua_util_jit_pair_get(fr_lua_jit_value_t *out, void const *da, int index);\
+			int fr_lua_util_jit_pair_set_number(void const *da, int index, double value);\
+			int fr_lua_util_jit_pair_set_string(void const *da, int index, char const *value, size_t len);\
+			int fr_lua_util_jit_pair_delete(void const *da, int index);\
+		]]\
+		local _fr_jit_value = ffi.new(\"fr_lua_jit_value_t\")\
+		local function _fr_jit_pair_get(da, index)\
+			if fr_lua.fr_lua_util_jit_pair_get(_fr_jit_value, da, index) < 0 then\
+				return nil\
+			end\
+			if _fr_jit_value.type == " STRINGIFY(LUA_TSTRING) " then\
+				return ffi.string(_fr_jit_value.str, _fr_jit_value.len)\
+			end\
+			return _fr_jit_value.number\
+		end\
+		local function _fr_jit_pair_set(da, index, value)\
+			local t = type(value)\
+			if t == \"nil\" then\
+				fr_lua.fr_lua_util_jit_pair_delete(da, index)\
+			elseif t == \"number\" then\
+				fr_lua.fr_lua_util_jit_pair_set_number(da, index, value)\
+			elseif t == \"string\" then\
+				fr_lua.fr_lua_util_jit_pair_set_string(da, index, value, #value)\
+			else\
+				_fr_log.error(\"Unmarshalling failed, unsupported Lua type \" .. t)\
+			end\
+		end\
+		local function _fr_jit_attr(name)\
+			local attr = _fr_jit_attrs[name]\
+			if attr then\
+				return attr\
+			end\
+			local da = fr_lua.fr_lua_util_jit_attr_by_name(name)\
+			if da == nil then\
+				return nil\
+			end\
+			attr = {\
+				pairs = function()\
+					local index = -1\
+					return function()\
+						index = index + 1\
+						return _fr_jit_pair_get(da, index)\
+					end\
+				end\
+			}\
+			setmetatable(attr, {\
+				__index = function(table, index)\
+					return _fr_jit_pair_get(da, index)\
+				end,\
+				__newindex = function(table, index, value)\
+					_fr_jit_pair_set(da, index, value)\
+				end\
+			})\
+			_fr_jit_attrs[name] = attr\
+			return attr\
+		end\
+		_fr_jit_attrs = {}\
+		_fr_jit_request_mt = {\
+			__index = function(table, name)\
+				return _fr_jit_attr(name)\
+			end\
+		}\
+		");
+	if (ret != 0) {
+		ERROR("Failed setting up FFI pair accessors: %s",
+		      lua_gettop(L) ? lua_tostring(L, -1) : "Unknown error");
+
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Register utililiary functions in the lua environment
  *
  * @param L Lua interpreter.
@@ -268,3 +268,92 @@ finish:
 
 	return ret;
 }
+
+#ifdef WITH_AUTH_WINBIND_ASYNC
+/** Check NTLM authentication by sending the request directly to winbindd
+ *
+ * The first call queues the request and returns 1, the caller should yield.
+ * When the request is resumed the caller should call this function again
+ * to retrieve the result.
+ *
+ * @param[in,out] auth_p	Outstanding authentication.  Should point to
+ *				NULL on the first call.
+ * @param[in] ctx		to allocate the authentication in.
+ * @param[in] wb		Thread's connections to winbindd.
+ * @param[in] request		Current request.
+ * @param[in] challenge		MS CHAP challenge.
+ * @param[in] response		MS CHAP response.
+ * @param[out] nthashhash	Hash returned on success.
+ * @param[in] env_data		Call_env data for current authentication.
+ * @return
+ *	- 1 caller should yield.
+ *	- 0 success.
+ *	- -1 auth failure.
+ *	- -648 password expired.
+ */
+int do_auth_wbclient_async(fr_winbind_auth_t **auth_p, TALLOC_CTX *ctx, fr_winbind_t *wb, request_t *request,
+			   uint8_t const *challenge, uint8_t const *response,
+			   uint8_t nthashhash[NT_DIGEST_LENGTH], mschap_auth_call_env_t *env_data)
+{
+	fr_winbind_auth_t	*auth = *auth_p;
+	char const		*domain = NULL;
+
+	if (!auth) {
+		if (env_data->wb_domain.type == FR_TYPE_STRING) {
+			domain = env_data->wb_domain.vb_strvalue;
+		} else {
+			RWDEBUG2("No domain specified; authentication may fail because of this");
+		}
+
+		RDEBUG2("Sending authentication request user \"%pV\" domain \"%pV\"",
+			&env_data->wb_username, &env_data->wb_domain);
+
+		if (fr_winbind_auth_crap(auth_p, ctx, wb, request,
+					 env_data->wb_username.vb_strvalue, domain,
+					 challenge, response, NT_LENGTH,
+					 WBC_MSV1_0_ALLOW_MSVCHAPV2 |
+					 WBC_MSV1_0_ALLOW_WORKSTATION_TRUST_ACCOUNT |
+					 WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT) < 0) {
+			RERROR("Unable to send authentication request to winbindd");
+			return -1;
+		}
+
+		return 1;
+	}
+
+	switch (auth->status) {
+	case FR_WINBIND_AUTH_OK:
+		RDEBUG2("Authenticated successfully");
+		memcpy(nthashhash, auth->user_session_key, NT_DIGEST_LENGTH);
+		return 0;
+
+	case FR_WINBIND_AUTH_REJECT:
+		if (auth->error) {
+			REDEBUG2("%s [0x%X]", auth->error, auth->nt_status);
+		} else {
+			REDEBUG2("Authentication failed [0x%X]", auth->nt_status);
+		}
+
+		/*
+		 * The password needs to be changed, so set ret appropriately.
+		 */
+		if (auth->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
+		    auth->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) return -648;
+		return -1;
+
+	case FR_WINBIND_AUTH_PENDING:
+	case FR_WINBIND_AUTH_FAIL:
+		break;
+	}
+
+	if (auth->error) {
+		RERROR("Failed authenticating user: %s", auth->error);
+	} else {
+		RERROR("Unable to contact winbindd!");
+		RDEBUG2("Check that winbind is running and that FreeRADIUS has");
+		RDEBUG2("permission to connect to the winbind privileged socket.");
+	}
+
+	return -1;
+}
+#endif
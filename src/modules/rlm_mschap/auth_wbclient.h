@@ -6,3 +6,10 @@ int do_auth_wbclient(rlm_mschap_t const *inst, request_t *request,
 		     uint8_t const *challenge, uint8_t const *response,
 		     uint8_t nthashhash[NT_DIGEST_LENGTH],
 		     mschap_auth_call_env_t *env_data);
+
+#ifdef WITH_AUTH_WINBIND_ASYNC
+int do_auth_wbclient_async(fr_winbind_auth_t **auth_p, TALLOC_CTX *ctx, fr_winbind_t *wb, request_t *request,
+			   uint8_t const *challenge, uint8_t const *response,
+			   uint8_t nthashhash[NT_DIGEST_LENGTH],
+			   mschap_auth_call_env_t *env_data);
+#endif
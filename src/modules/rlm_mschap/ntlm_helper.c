@@ -0,0 +1,981 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file ntlm_helper.c
+ * @brief NTLM authentication using persistent ntlm_auth helper processes
+ *
+ * Running ntlm_auth once per authentication means a fork and exec for every
+ * request.  Instead we start long lived ntlm_auth processes using the
+ * ntlm-server-1 helper protocol, and talk to them over pipes from the event
+ * loop.
+ *
+ * Each helper process is a trunk connection.  The trunk takes care of
+ * starting helpers, spreading requests across them, and starting new ones
+ * if a helper exits, or stops responding.
+ *
+ * ntlm_auth processes requests one at a time, in the order they were written.
+ * Requests are written as soon as they're queued, and responses are matched
+ * up using a FIFO of the requests written to each helper.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "ntlm_auth_helper"
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/exec.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/base16.h>
+#include <freeradius-devel/util/base64.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+
+#include <sys/wait.h>
+
+#include "ntlm_helper.h"
+
+#define NTLM_HELPER_MAX_ARGV	32
+
+struct mschap_ntlm_helper_s {
+	mschap_ntlm_helper_conf_t const	*conf;		//!< Our configuration.
+	fr_time_delta_t		timeout;		//!< How long to wait for each response.
+	fr_event_list_t		*el;			//!< Event list.
+
+	char			*program;		//!< Copy of the command line, split into argv.
+	char			*argv[NTLM_HELPER_MAX_ARGV + 1];	//!< Arguments to start each helper with.
+
+	trunk_t			*trunk;			//!< Helper processes.
+};
+
+/** A request which has been written, and is awaiting a response
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the helper's list of outstanding requests.
+	trunk_request_t		*treq;			//!< NULL if the request went away before the response arrived.
+} ntlm_helper_sent_t;
+
+/** Track the handle, which is tightly correlated with the helper process
+ *
+ */
+typedef struct {
+	char			name[sizeof("pid -9223372036854775808")];	//!< For log messages.
+
+	mschap_ntlm_helper_t	*helper;		//!< Thread instance we belong to.
+	connection_t		*conn;			//!< Connection this helper is for.
+
+	pid_t			pid;			//!< Of the helper, -1 once reaped.
+	fr_event_pid_t const	*ev_pid;		//!< Tells us when the helper exits.
+
+	int			stdin_fd;		//!< For writing requests.
+	int			stdout_fd;		//!< For reading responses.
+	int			stderr_fd;		//!< For reading log messages.
+
+	uint8_t			*partial;		//!< Remainder of a partially written request.
+	size_t			partial_written;	//!< How much of the remainder has been written.
+
+	char			buff[4096];		//!< Response lines not yet processed.
+	size_t			buff_len;		//!< How much data is in the buffer.
+
+	bool			rsp_started;		//!< We've seen at least one line of the response.
+	mschap_ntlm_helper_status_t	rsp_status;	//!< Status from the response being read.
+	bool			rsp_have_key;		//!< The response included a session key.
+	uint8_t			rsp_key[NT_DIGEST_LENGTH];	//!< Session key from the response being read.
+	char			*rsp_error;		//!< Error from the response being read.
+
+	fr_dlist_head_t		sent;			//!< Requests awaiting responses, oldest first.
+	fr_event_timer_t const	*ev;			//!< Fires if the oldest request isn't answered in time.
+
+	trunk_connection_event_t	events;		//!< Events the trunk last asked us to listen for.
+} ntlm_helper_handle_t;
+
+/** Per request state
+ *
+ */
+typedef struct {
+	char			*data;			//!< Request as it'll be written to the helper.
+	ntlm_helper_sent_t	*sent;			//!< Entry in the outstanding request list.
+} ntlm_helper_request_t;
+
+conf_parser_t const mschap_ntlm_helper_config[] = {
+	{ FR_CONF_OFFSET("program", mschap_ntlm_helper_conf_t, program) },
+
+	{ FR_CONF_OFFSET_SUBSECTION("pool", 0, mschap_ntlm_helper_conf_t, trunk_conf, trunk_config ) },
+	CONF_PARSER_TERMINATOR
+};
+
+/** Free a helper handle, stopping the helper process
+ *
+ */
+static int _ntlm_helper_handle_free(ntlm_helper_handle_t *h)
+{
+	fr_event_list_t		*el = h->helper->el;
+	ntlm_helper_sent_t	*sent;
+
+	/*
+	 *	Ensure requests don't hold references
+	 *	to entries which are about to be freed.
+	 */
+	while ((sent = fr_dlist_pop_head(&h->sent))) {
+		if (sent->treq) {
+			ntlm_helper_request_t *u = talloc_get_type_abort(sent->treq->preq, ntlm_helper_request_t);
+
+			u->sent = NULL;
+		}
+		talloc_free(sent);
+	}
+
+	if (h->stdin_fd >= 0) {
+		fr_event_fd_delete(el, h->stdin_fd, FR_EVENT_FILTER_IO);
+		close(h->stdin_fd);
+	}
+
+	if (h->stdout_fd >= 0) {
+		fr_event_fd_delete(el, h->stdout_fd, FR_EVENT_FILTER_IO);
+		close(h->stdout_fd);
+	}
+
+	if (h->stderr_fd >= 0) {
+		fr_event_fd_delete(el, h->stderr_fd, FR_EVENT_FILTER_IO);
+		close(h->stderr_fd);
+	}
+
+	/*
+	 *	Stop listening for the exit, and leave
+	 *	the reaper to clean up after the process.
+	 */
+	if (h->ev_pid) talloc_const_free(h->ev_pid);
+
+	if (h->pid >= 0) {
+		kill(h->pid, SIGTERM);
+
+		if (unlikely(fr_event_pid_reap(el, h->pid, NULL, NULL) < 0)) {
+			int status;
+
+			PERROR("Failed setting up async PID reaper, PID %u may now be a zombie", h->pid);
+
+			kill(h->pid, SIGKILL);
+			waitpid(h->pid, &status, WNOHANG);
+		}
+		h->pid = -1;
+	}
+
+	DEBUG("Helper stopped - %s", h->name);
+
+	return 0;
+}
+
+/** The helper process exited
+ *
+ */
+static void _ntlm_helper_exited(UNUSED fr_event_list_t *el, pid_t pid, int status, void *uctx)
+{
+	ntlm_helper_handle_t	*h = talloc_get_type_abort(uctx, ntlm_helper_handle_t);
+	int			wait_status;
+
+	/*
+	 *	libkqueue/kqueue doesn't reap the process for us.
+	 */
+	if (waitpid(pid, &wait_status, WNOHANG) > 0) status = wait_status;
+	h->pid = -1;
+
+	if (WIFEXITED(status)) {
+		ERROR("Helper exited with status %i - %s", WEXITSTATUS(status), h->name);
+	} else if (WIFSIGNALED(status)) {
+		ERROR("Helper killed by signal %i - %s", WTERMSIG(status), h->name);
+	} else {
+		ERROR("Helper exited - %s", h->name);
+	}
+
+	/*
+	 *	May free the handle
+	 */
+	connection_signal_reconnect(h->conn, CONNECTION_FAILED);
+}
+
+/** Copy anything the helper logs into the server log
+ *
+ */
+static void _ntlm_helper_stderr_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	ntlm_helper_handle_t	*h = talloc_get_type_abort(uctx, ntlm_helper_handle_t);
+	char			buffer[1024];
+	ssize_t			slen;
+
+	while ((slen = read(fd, buffer, sizeof(buffer))) > 0) {
+		char *p = buffer, *end = buffer + slen, *q;
+
+		while (p < end) {
+			q = memchr(p, '\n', end - p);
+			if (!q) q = end;
+
+			if (q > p) DEBUG2("%s (stderr) - %pV", h->name, fr_box_strvalue_len(p, q - p));
+			p = q + 1;
+		}
+	}
+
+	/*
+	 *	Helper closed stderr.  The exit
+	 *	is dealt with by the PID watcher.
+	 */
+	if (slen == 0) fr_event_fd_delete(h->helper->el, fd, FR_EVENT_FILTER_IO);
+}
+
+/** Start a new helper process
+ *
+ * @param[out] h_out	Where to write the new connection handle.
+ * @param[in] conn	to initialise.
+ * @param[in] uctx	A #mschap_ntlm_helper_t.
+ */
+static connection_state_t conn_init(void **h_out, connection_t *conn, void *uctx)
+{
+	ntlm_helper_handle_t	*h;
+	mschap_ntlm_helper_t	*helper = talloc_get_type_abort(uctx, mschap_ntlm_helper_t);
+
+	MEM(h = talloc_zero(conn, ntlm_helper_handle_t));
+	h->helper = helper;
+	h->conn = conn;
+	h->stdin_fd = h->stdout_fd = h->stderr_fd = -1;
+	fr_dlist_talloc_init(&h->sent, ntlm_helper_sent_t, entry);
+
+	if (fr_exec_fork_wait(&h->pid, &h->stdin_fd, &h->stdout_fd, &h->stderr_fd,
+			      helper->argv, NULL, true, false) < 0) {
+		PERROR("Failed starting %s", helper->argv[0]);
+		talloc_free(h);
+		return CONNECTION_STATE_FAILED;
+	}
+	snprintf(h->name, sizeof(h->name), "pid %u", h->pid);
+	talloc_set_destructor(h, _ntlm_helper_handle_free);
+
+	if (fr_event_fd_insert(h, NULL, helper->el, h->stderr_fd, _ntlm_helper_stderr_read, NULL, NULL, h) < 0) {
+		PERROR("Failed listening for log messages from helper");
+	error:
+		talloc_free(h);
+		return CONNECTION_STATE_FAILED;
+	}
+
+	if (fr_event_pid_wait(h, helper->el, &h->ev_pid, h->pid, _ntlm_helper_exited, h) < 0) {
+		PERROR("Failed listening for helper exit");
+		goto error;
+	}
+
+	DEBUG("Helper started - %s", h->name);
+
+	/*
+	 *	Signal the connection as open
+	 *	as soon as we can write to it.
+	 */
+	connection_signal_on_fd(conn, h->stdin_fd);
+
+	*h_out = h;
+
+	return CONNECTION_STATE_CONNECTING;
+}
+
+/** Stop a helper process
+ *
+ */
+static void conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uctx)
+{
+	ntlm_helper_handle_t *h = talloc_get_type_abort(handle, ntlm_helper_handle_t);
+
+	DEBUG4("Freeing ntlm_auth helper handle %p", handle);
+
+	talloc_free(h);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_t *thread_conn_alloc(trunk_connection_t *tconn, fr_event_list_t *el,
+				       connection_conf_t const *conf,
+				       char const *log_prefix, void *uctx)
+{
+	connection_t		*conn;
+	mschap_ntlm_helper_t	*helper = talloc_get_type_abort(uctx, mschap_ntlm_helper_t);
+
+	conn = connection_alloc(tconn, el,
+				&(connection_funcs_t){
+					.init = conn_init,
+					.close = conn_close,
+				},
+				conf,
+				log_prefix,
+				helper);
+	if (!conn) {
+		PERROR("Failed allocating state handler for new helper");
+		return NULL;
+	}
+
+	return conn;
+}
+
+/** The oldest outstanding request wasn't answered in time
+ *
+ * The helper answers requests in order, so nothing queued behind
+ * this request will complete either.  Fail the request, and replace
+ * the helper.
+ */
+static void _ntlm_helper_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	ntlm_helper_handle_t	*h = talloc_get_type_abort(tconn->conn->h, ntlm_helper_handle_t);
+	ntlm_helper_sent_t	*sent;
+
+	ERROR("No response within %pVs, restarting helper - %s", fr_box_time_delta(h->helper->timeout), h->name);
+
+	sent = fr_dlist_head(&h->sent);
+	if (sent && sent->treq) trunk_request_signal_fail(sent->treq);
+
+	/*
+	 *	May free the connection!
+	 */
+	trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+}
+
+/** Start timing the oldest outstanding request, if we aren't already
+ *
+ */
+static void ntlm_helper_timer_update(ntlm_helper_handle_t *h, trunk_connection_t *tconn)
+{
+	if (fr_dlist_empty(&h->sent)) {
+		if (h->ev) fr_event_timer_delete(&h->ev);
+		return;
+	}
+
+	if (h->ev) return;
+
+	if (fr_event_timer_in(h, h->helper->el, &h->ev, h->helper->timeout, _ntlm_helper_timeout, tconn) < 0) {
+		PERROR("Failed inserting response timer");
+	}
+}
+
+/** Write to the helper, dealing with transient errors
+ *
+ * @return
+ *	- >= 0 the number of bytes written.
+ *	- -1 on failure.  The connection has been signalled to reconnect.
+ */
+static ssize_t ntlm_helper_write(ntlm_helper_handle_t *h, trunk_connection_t *tconn, void const *data, size_t data_len)
+{
+	ssize_t slen;
+
+	slen = write(h->stdin_fd, data, data_len);
+	if (slen >= 0) return slen;
+
+	switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+	case EWOULDBLOCK:
+#endif
+	case EAGAIN:
+	case EINTR:
+		return 0;
+
+	default:
+		ERROR("Failed sending request to helper %s: %s", h->name, fr_syserror(errno));
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		return -1;
+	}
+}
+
+/** Finish writing a partially written request
+ *
+ * @return
+ *	- 0 on success (even if not all data was written).
+ *	- -1 on failure.  The connection has been signalled to reconnect.
+ */
+static int ntlm_helper_flush(ntlm_helper_handle_t *h, trunk_connection_t *tconn)
+{
+	size_t	len;
+	ssize_t	slen;
+
+	if (!h->partial) return 0;
+
+	len = talloc_array_length(h->partial);
+	slen = ntlm_helper_write(h, tconn, h->partial + h->partial_written, len - h->partial_written);
+	if (slen < 0) return -1;
+
+	h->partial_written += slen;
+	if (h->partial_written == len) {
+		TALLOC_FREE(h->partial);
+		h->partial_written = 0;
+	}
+
+	return 0;
+}
+
+static void conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx);
+static void conn_error(fr_event_list_t *el, int fd, int flags, int fd_errno, void *uctx);
+
+/** Register for the I/O events the trunk wants, and any we need to finish writing
+ *
+ * Responses are read from the helper's stdout, and requests written
+ * to its stdin, so the events are split across the two descriptors.
+ */
+static void ntlm_helper_events_update(ntlm_helper_handle_t *h, fr_event_list_t *el, trunk_connection_t *tconn)
+{
+	bool	want_read = false;
+	bool	want_write = false;
+
+	switch (h->events) {
+	case TRUNK_CONN_EVENT_NONE:
+		break;
+
+	case TRUNK_CONN_EVENT_READ:
+		want_read = true;
+		break;
+
+	case TRUNK_CONN_EVENT_WRITE:
+		want_write = true;
+		break;
+
+	case TRUNK_CONN_EVENT_BOTH:
+		want_read = true;
+		want_write = true;
+		break;
+	}
+
+	/*
+	 *	A partially written request must be
+	 *	finished before the helper will respond
+	 *	to it, or to anything queued behind it.
+	 */
+	if (h->partial) want_write = true;
+
+	if (!want_read) {
+		fr_event_fd_delete(el, h->stdout_fd, FR_EVENT_FILTER_IO);
+	} else if (fr_event_fd_insert(h, NULL, el, h->stdout_fd,
+				      trunk_connection_callback_readable, NULL, conn_error, tconn) < 0) {
+	error:
+		PERROR("Failed inserting FD event");
+
+		/*
+		 *	May free the connection!
+		 */
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		return;
+	}
+
+	if (!want_write) {
+		fr_event_fd_delete(el, h->stdin_fd, FR_EVENT_FILTER_IO);
+	} else if (fr_event_fd_insert(h, NULL, el, h->stdin_fd,
+				      NULL, conn_writable, conn_error, tconn) < 0) {
+		goto error;
+	}
+}
+
+/** Helper pipe errored
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that errored.
+ * @param[in] flags	El flags.
+ * @param[in] fd_errno	The nature of the error.
+ * @param[in] uctx	The trunk connection handle (tconn).
+ */
+static void conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	connection_t		*conn = tconn->conn;
+	ntlm_helper_handle_t	*h = talloc_get_type_abort(conn->h, ntlm_helper_handle_t);
+
+	ERROR("Pipe to helper %s failed: %s", h->name, fr_syserror(fd_errno));
+
+	connection_signal_reconnect(conn, CONNECTION_FAILED);
+}
+
+/** Helper's stdin is writable
+ *
+ * Finish writing any partially written request, then let the trunk write new ones.
+ */
+static void conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	ntlm_helper_handle_t	*h = talloc_get_type_abort(tconn->conn->h, ntlm_helper_handle_t);
+
+	if ((h->events == TRUNK_CONN_EVENT_WRITE) || (h->events == TRUNK_CONN_EVENT_BOTH)) {
+		trunk_connection_callback_writable(el, fd, flags, tconn);
+		return;
+	}
+
+	if (ntlm_helper_flush(h, tconn) < 0) return;
+
+	if (!h->partial) ntlm_helper_events_update(h, el, tconn);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void thread_conn_notify(trunk_connection_t *tconn, connection_t *conn,
+			       fr_event_list_t *el,
+			       trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	ntlm_helper_handle_t	*h = talloc_get_type_abort(conn->h, ntlm_helper_handle_t);
+
+	h->events = notify_on;
+
+	ntlm_helper_events_update(h, el, tconn);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void request_mux(fr_event_list_t *el,
+			trunk_connection_t *tconn, connection_t *conn, UNUSED void *uctx)
+{
+	ntlm_helper_handle_t	*h = talloc_get_type_abort(conn->h, ntlm_helper_handle_t);
+
+	/*
+	 *	Finish writing the last request before
+	 *	starting on the next one.
+	 */
+	if (ntlm_helper_flush(h, tconn) < 0) return;
+	if (h->partial) return;
+
+	for (;;) {
+		trunk_request_t		*treq;
+		ntlm_helper_request_t	*u;
+		size_t			len;
+		ssize_t			slen;
+
+		if (unlikely(trunk_connection_pop_request(&treq, tconn) < 0)) return;
+		if (!treq) break;
+
+		u = talloc_get_type_abort(treq->preq, ntlm_helper_request_t);
+		len = talloc_array_length(u->data) - 1;
+
+		slen = ntlm_helper_write(h, tconn, u->data, len);
+		if (slen < 0) return;
+
+		/*
+		 *	Pipe is full, the request stays pending
+		 *	and we'll be called again when it drains.
+		 */
+		if (slen == 0) break;
+
+		MEM(u->sent = talloc_zero(h, ntlm_helper_sent_t));
+		u->sent->treq = treq;
+		fr_dlist_insert_tail(&h->sent, u->sent);
+
+		/*
+		 *	The remainder of the request is copied
+		 *	so it can still be written if the request
+		 *	goes away before we finish.
+		 */
+		if ((size_t)slen < len) {
+			MEM(h->partial = talloc_memdup(h, ((uint8_t *)u->data) + slen, len - slen));
+			h->partial_written = 0;
+		}
+
+		trunk_request_signal_sent(treq);
+
+		if (h->partial) break;
+	}
+
+	/*
+	 *	Verify nothing accidentally freed the connection handle
+	 */
+	(void)talloc_get_type_abort(h, ntlm_helper_handle_t);
+
+	ntlm_helper_timer_update(h, tconn);
+
+	/*
+	 *	Didn't write everything, make sure we're told
+	 *	when we can write the rest.
+	 */
+	if (h->partial) ntlm_helper_events_update(h, el, tconn);
+}
+
+/** Process a single line of a response
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the line couldn't be understood.
+ */
+static int ntlm_helper_line(ntlm_helper_handle_t *h, char const *line, size_t len)
+{
+	fr_sbuff_t	sbuff = FR_SBUFF_IN(line, len);
+
+	h->rsp_started = true;
+
+	if (fr_sbuff_adv_past_str_literal(&sbuff, "Authenticated: ")) {
+		if (fr_sbuff_is_str_literal(&sbuff, "Yes")) {
+			h->rsp_status = MSCHAP_NTLM_HELPER_OK;
+		} else {
+			h->rsp_status = MSCHAP_NTLM_HELPER_REJECT;
+		}
+		return 0;
+	}
+
+	if (fr_sbuff_adv_past_str_literal(&sbuff, "User-Session-Key: ")) {
+		if (fr_base16_decode(NULL, &FR_DBUFF_TMP(h->rsp_key, sizeof(h->rsp_key)),
+				     &sbuff, false) != sizeof(h->rsp_key)) {
+			ERROR("Helper %s returned an invalid User-Session-Key", h->name);
+			return -1;
+		}
+		h->rsp_have_key = true;
+		return 0;
+	}
+
+	if (fr_sbuff_adv_past_str_literal(&sbuff, "Authentication-Error: ") ||
+	    fr_sbuff_adv_past_str_literal(&sbuff, "Error: ")) {
+		talloc_free(h->rsp_error);
+		MEM(h->rsp_error = talloc_bstrndup(h, fr_sbuff_current(&sbuff), fr_sbuff_remaining(&sbuff)));
+		return 0;
+	}
+
+	/*
+	 *	Ignore anything else, newer
+	 *	versions may return more keys.
+	 */
+	DEBUG3("Ignoring \"%pV\" from helper %s", fr_box_strvalue_len(line, len), h->name);
+
+	return 0;
+}
+
+/** Copy the result of an authentication out of the response
+ *
+ */
+static void ntlm_helper_result(mschap_ntlm_helper_auth_t *auth, ntlm_helper_handle_t *h)
+{
+	switch (h->rsp_status) {
+	case MSCHAP_NTLM_HELPER_OK:
+		if (!h->rsp_have_key) {
+			auth->status = MSCHAP_NTLM_HELPER_FAIL;
+			auth->error = "Helper did not return a User-Session-Key";
+			return;
+		}
+		auth->status = MSCHAP_NTLM_HELPER_OK;
+		memcpy(auth->nt_key, h->rsp_key, sizeof(auth->nt_key));
+		return;
+
+	case MSCHAP_NTLM_HELPER_REJECT:
+		auth->status = MSCHAP_NTLM_HELPER_REJECT;
+		break;
+
+	/*
+	 *	No "Authenticated" line, the helper
+	 *	couldn't process the request.
+	 */
+	default:
+		auth->status = MSCHAP_NTLM_HELPER_FAIL;
+		break;
+	}
+
+	if (h->rsp_error) MEM(auth->error = talloc_strdup(auth, h->rsp_error));
+}
+
+/** Reset the response state, ready for the next response
+ *
+ */
+static inline void ntlm_helper_rsp_reset(ntlm_helper_handle_t *h)
+{
+	h->rsp_started = false;
+	h->rsp_status = MSCHAP_NTLM_HELPER_PENDING;
+	h->rsp_have_key = false;
+	TALLOC_FREE(h->rsp_error);
+}
+
+static void request_demux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn, connection_t *conn, UNUSED void *uctx)
+{
+	ntlm_helper_handle_t	*h = talloc_get_type_abort(conn->h, ntlm_helper_handle_t);
+
+	DEBUG3("Reading data from helper %s", h->name);
+
+	for (;;) {
+		ssize_t	slen;
+		char	*p, *end, *nl;
+
+		slen = read(h->stdout_fd, h->buff + h->buff_len, sizeof(h->buff) - h->buff_len);
+		if (slen == 0) {
+			ERROR("Helper %s closed its output", h->name);
+			trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+			return;
+		}
+		if (slen < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+			if (errno == EINTR) continue;
+
+			ERROR("Failed reading response from helper %s: %s", h->name, fr_syserror(errno));
+			trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+			return;
+		}
+		h->buff_len += slen;
+
+		p = h->buff;
+		end = h->buff + h->buff_len;
+
+		while ((nl = memchr(p, '\n', end - p))) {
+			ntlm_helper_sent_t	*sent;
+			trunk_request_t		*treq;
+			ntlm_helper_request_t	*u;
+			size_t			len = nl - p;
+
+			if ((len > 0) && (p[len - 1] == '\r')) len--;
+
+			if ((len != 1) || (p[0] != '.')) {
+				if (ntlm_helper_line(h, p, len) < 0) {
+				fail:
+					trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+					return;
+				}
+				p = nl + 1;
+				continue;
+			}
+			p = nl + 1;
+
+			/*
+			 *	Some versions of ntlm_auth write an extra
+			 *	terminator after an authentication error,
+			 *	so a response must contain at least one line.
+			 */
+			if (!h->rsp_started) continue;
+
+			sent = fr_dlist_pop_head(&h->sent);
+			if (!sent) {
+				ERROR("Received response from helper %s with no outstanding requests", h->name);
+				goto fail;
+			}
+
+			treq = sent->treq;
+			talloc_free(sent);
+
+			/*
+			 *	The next request gets a full timeout.
+			 */
+			if (h->ev) fr_event_timer_delete(&h->ev);
+			ntlm_helper_timer_update(h, tconn);
+
+			/*
+			 *	Request was cancelled, or timed out
+			 */
+			if (!treq) {
+				ntlm_helper_rsp_reset(h);
+				continue;
+			}
+
+			u = talloc_get_type_abort(treq->preq, ntlm_helper_request_t);
+			u->sent = NULL;
+
+			ntlm_helper_result(talloc_get_type_abort(treq->rctx, mschap_ntlm_helper_auth_t), h);
+			ntlm_helper_rsp_reset(h);
+
+			trunk_request_signal_complete(treq);
+		}
+
+		/*
+		 *	Move any partial line to the start of the buffer
+		 */
+		h->buff_len = end - p;
+		if (h->buff_len == sizeof(h->buff)) {
+			ERROR("Response line from helper %s too long", h->name);
+			goto fail;
+		}
+		if (h->buff_len > 0) memmove(h->buff, p, h->buff_len);
+	}
+}
+
+/** Clear out anything associated with the handle from the request
+ *
+ */
+static void request_conn_release(UNUSED connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	ntlm_helper_request_t	*u = talloc_get_type_abort(preq_to_reset, ntlm_helper_request_t);
+
+	/*
+	 *	The response will still arrive,
+	 *	and will just be discarded.
+	 */
+	if (u->sent) {
+		u->sent->treq = NULL;
+		u->sent = NULL;
+	}
+}
+
+/** Let the request know the helper didn't give us an answer
+ *
+ */
+static void request_fail(request_t *request, UNUSED void *preq, void *rctx,
+			 UNUSED trunk_request_state_t state, UNUSED void *uctx)
+{
+	mschap_ntlm_helper_auth_t	*auth = talloc_get_type_abort(rctx, mschap_ntlm_helper_auth_t);
+
+	auth->status = MSCHAP_NTLM_HELPER_FAIL;
+	auth->treq = NULL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Result has already been written to the auth ctx at this point
+ *
+ */
+static void request_complete(request_t *request, UNUSED void *preq, void *rctx, UNUSED void *uctx)
+{
+	mschap_ntlm_helper_auth_t	*auth = talloc_get_type_abort(rctx, mschap_ntlm_helper_auth_t);
+
+	auth->treq = NULL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Explicitly free resources associated with the protocol request
+ *
+ */
+static void request_free(UNUSED request_t *request, void *preq_to_free, UNUSED void *uctx)
+{
+	ntlm_helper_request_t	*u = talloc_get_type_abort(preq_to_free, ntlm_helper_request_t);
+
+	fr_assert(!u->sent);	/* Dealt with by request_conn_release */
+
+	talloc_free(u);
+}
+
+/** Allocate per-thread ntlm_auth helpers
+ *
+ * @param[in] ctx		to allocate the handle in.
+ * @param[in] el		to run the helpers on.
+ * @param[in] conf		Configuration, must remain valid for the lifetime of the handle.
+ * @param[in] timeout		How long to wait for a helper to respond, before replacing it.
+ * @param[in] log_prefix	Used for trunk and connection log messages.
+ * @return
+ *	- A new handle on success.
+ *	- NULL on failure.
+ */
+mschap_ntlm_helper_t *mschap_ntlm_helper_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+					       mschap_ntlm_helper_conf_t const *conf, fr_time_delta_t timeout,
+					       char const *log_prefix)
+{
+	mschap_ntlm_helper_t	*helper;
+	int			argc;
+
+	static trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = thread_conn_alloc,
+						.connection_notify = thread_conn_notify,
+						.request_mux = request_mux,
+						.request_demux = request_demux,
+						.request_conn_release = request_conn_release,
+						.request_complete = request_complete,
+						.request_fail = request_fail,
+						.request_free = request_free
+					};
+
+	MEM(helper = talloc_zero(ctx, mschap_ntlm_helper_t));
+	helper->conf = conf;
+	helper->timeout = timeout;
+	helper->el = el;
+
+	MEM(helper->program = talloc_strdup(helper, conf->program));
+	argc = fr_dict_str_to_argv(helper->program, helper->argv, NTLM_HELPER_MAX_ARGV);
+	if (argc <= 0) {
+		ERROR("Invalid program \"%s\"", conf->program);
+	error:
+		talloc_free(helper);
+		return NULL;
+	}
+	helper->argv[argc] = NULL;
+
+	helper->trunk = trunk_alloc(helper, el, &io_funcs, &conf->trunk_conf, log_prefix, helper, false);
+	if (!helper->trunk) goto error;
+
+	return helper;
+}
+
+/** Cancel the request if the caller loses interest
+ *
+ */
+static int _ntlm_helper_auth_free(mschap_ntlm_helper_auth_t *auth)
+{
+	if (auth->treq) trunk_request_signal_cancel(auth->treq);
+
+	return 0;
+}
+
+/** Queue a challenge/response authentication
+ *
+ * The username and domain are base64 encoded, so the helper
+ * receives them unmodified, whatever characters they contain.
+ *
+ * The request is marked runnable when the result is available.
+ *
+ * @param[out] out		Where to write the authentication state.  Check
+ *				status once the request is resumed.
+ * @param[in] ctx		to allocate the authentication state in.
+ * @param[in] helper		Thread's ntlm_auth helpers.
+ * @param[in] request		The current request.
+ * @param[in] user		to authenticate.
+ * @param[in] domain		the user belongs to.  May be NULL.
+ * @param[in] challenge		the response was calculated with.
+ * @param[in] nt_response	provided by the client.
+ * @param[in] nt_response_len	Length of nt_response.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int mschap_ntlm_helper_auth(mschap_ntlm_helper_auth_t **out, TALLOC_CTX *ctx,
+			    mschap_ntlm_helper_t *helper, request_t *request,
+			    char const *user, char const *domain,
+			    uint8_t const challenge[static MSCHAP_CHALLENGE_LENGTH],
+			    uint8_t const *nt_response, size_t nt_response_len)
+{
+	trunk_request_t			*treq;
+	ntlm_helper_request_t		*u;
+	mschap_ntlm_helper_auth_t	*auth;
+	char				buffer[2048];
+	fr_sbuff_t			sbuff = FR_SBUFF_OUT(buffer, sizeof(buffer));
+
+	if ((fr_sbuff_in_strcpy_literal(&sbuff, "LANMAN-Challenge: ") < 0) ||
+	    (fr_base16_encode(&sbuff, &FR_DBUFF_TMP(challenge, MSCHAP_CHALLENGE_LENGTH)) < 0) ||
+	    (fr_sbuff_in_strcpy_literal(&sbuff, "\nNT-Response: ") < 0) ||
+	    (fr_base16_encode(&sbuff, &FR_DBUFF_TMP(nt_response, nt_response_len)) < 0) ||
+	    (fr_sbuff_in_strcpy_literal(&sbuff, "\nUsername:: ") < 0) ||
+	    (fr_base64_encode(&sbuff, &FR_DBUFF_TMP((uint8_t const *)user, strlen(user)), true) < 0) ||
+	    (fr_sbuff_in_char(&sbuff, '\n') < 0)) {
+	too_long:
+		REDEBUG("Username or domain too long for ntlm_auth helper");
+		return -1;
+	}
+
+	if (domain && *domain) {
+		if ((fr_sbuff_in_strcpy_literal(&sbuff, "NT-Domain:: ") < 0) ||
+		    (fr_base64_encode(&sbuff, &FR_DBUFF_TMP((uint8_t const *)domain, strlen(domain)), true) < 0) ||
+		    (fr_sbuff_in_char(&sbuff, '\n') < 0)) goto too_long;
+	}
+
+	if (fr_sbuff_in_strcpy_literal(&sbuff, "Request-User-Session-Key: Yes\n.\n") < 0) goto too_long;
+
+	treq = trunk_request_alloc(helper->trunk, request);
+	if (!treq) return -1;
+
+	MEM(u = talloc_zero(treq, ntlm_helper_request_t));
+	MEM(u->data = talloc_bstrndup(u, buffer, fr_sbuff_used(&sbuff)));
+
+	MEM(auth = talloc_zero(ctx, mschap_ntlm_helper_auth_t));
+
+	switch (trunk_request_enqueue(&treq, helper->trunk, request, u, auth)) {
+	case TRUNK_ENQUEUE_OK:
+	case TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		REDEBUG("Unable to queue request for ntlm_auth helper");
+		trunk_request_free(&treq);	/* Return to the free list */
+		talloc_free(auth);
+		return -1;
+	}
+
+	auth->treq = treq;
+	talloc_set_destructor(auth, _ntlm_helper_auth_free);
+
+	*out = auth;
+
+	return 0;
+}
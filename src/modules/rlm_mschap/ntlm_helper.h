@@ -0,0 +1,55 @@
+#pragma once
+/* @copyright 2024 The FreeRADIUS server project */
+RCSIDH(ntlm_helper_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/event.h>
+
+#include "mschap.h"
+
+/** Persistent ntlm_auth processes for a single thread
+ *
+ */
+typedef struct mschap_ntlm_helper_s mschap_ntlm_helper_t;
+
+/** Configuration for the ntlm_auth helper processes
+ *
+ */
+typedef struct {
+	char const		*program;		//!< Command line used to start each helper.
+	trunk_conf_t		trunk_conf;		//!< Trunk configuration.  Each connection is a helper process.
+} mschap_ntlm_helper_conf_t;
+
+typedef enum {
+	MSCHAP_NTLM_HELPER_PENDING = 0,			//!< Waiting for the helper to respond.
+	MSCHAP_NTLM_HELPER_OK,				//!< Credentials were accepted.
+	MSCHAP_NTLM_HELPER_REJECT,			//!< Credentials were rejected, see error.
+	MSCHAP_NTLM_HELPER_FAIL				//!< No usable response from the helper.
+} mschap_ntlm_helper_status_t;
+
+/** State of an authentication request sent to a helper
+ *
+ * Freeing this structure cancels the request if it's still outstanding.
+ */
+typedef struct {
+	mschap_ntlm_helper_status_t	status;		//!< Result of the authentication.
+	char const			*error;		//!< Error returned by the helper.
+	uint8_t				nt_key[NT_DIGEST_LENGTH];	//!< User session key (the NT hash hash).
+
+	trunk_request_t			*treq;		//!< Outstanding trunk request, NULL once complete.
+} mschap_ntlm_helper_auth_t;
+
+extern conf_parser_t const mschap_ntlm_helper_config[];
+
+mschap_ntlm_helper_t	*mschap_ntlm_helper_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+						  mschap_ntlm_helper_conf_t const *conf, fr_time_delta_t timeout,
+						  char const *log_prefix);
+
+int			mschap_ntlm_helper_auth(mschap_ntlm_helper_auth_t **out, TALLOC_CTX *ctx,
+						mschap_ntlm_helper_t *helper, request_t *request,
+						char const *user, char const *domain,
+						uint8_t const challenge[static MSCHAP_CHALLENGE_LENGTH],
+						uint8_t const *nt_response, size_t nt_response_len)
+						CC_HINT(nonnull(1,2,3,4,5,7,8));
@@ -89,6 +89,10 @@ static const conf_parser_t winbind_config[] = {
 	{ FR_CONF_OFFSET("username", rlm_mschap_t, wb_username) },
 #ifdef WITH_AUTH_WINBIND
 	{ FR_CONF_OFFSET("retry_with_normalised_username", rlm_mschap_t, wb_retry_with_normalised_username), .dflt = "no" },
+#endif
+#ifdef WITH_AUTH_WINBIND_ASYNC
+	{ FR_CONF_OFFSET("async", rlm_mschap_t, wb_async), .dflt = "no" },
+	{ FR_CONF_OFFSET_SUBSECTION("pipe", 0, rlm_mschap_t, wb_pipe, fr_winbind_conf_config) },
 #endif
 	CONF_PARSER_TERMINATOR
 };
@@ -105,6 +109,7 @@ static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("with_ntdomain_hack", rlm_mschap_t, with_ntdomain_hack), .dflt = "yes" },
 	{ FR_CONF_OFFSET_FLAGS("ntlm_auth", CONF_FLAG_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", rlm_mschap_t, ntlm_auth_timeout) },
+	{ FR_CONF_OFFSET_SUBSECTION("ntlm_auth_helper", 0, rlm_mschap_t, ntlm_helper, mschap_ntlm_helper_config) },
 
 	{ FR_CONF_POINTER("passchange", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
 	{ FR_CONF_OFFSET("allow_retry", rlm_mschap_t, allow_retry), .dflt = "yes" },
@@ -194,6 +199,12 @@ static const call_env_method_t mschap_auth_method_env = {
 				{ FR_CALL_ENV_OFFSET("domain", FR_TYPE_STRING, CALL_ENV_FLAG_NULLABLE, mschap_auth_call_env_t, wb_domain) },
 				CALL_ENV_TERMINATOR
 			}))},
+		{ FR_CALL_ENV_SUBSECTION("ntlm_auth_helper", NULL, CALL_ENV_FLAG_NONE,
+			((call_env_parser_t[]) {
+				{ FR_CALL_ENV_OFFSET("username", FR_TYPE_STRING, CALL_ENV_FLAG_NONE, mschap_auth_call_env_t, ntlm_helper_username) },
+				{ FR_CALL_ENV_OFFSET("domain", FR_TYPE_STRING, CALL_ENV_FLAG_NULLABLE, mschap_auth_call_env_t, ntlm_helper_domain) },
+				CALL_ENV_TERMINATOR
+			}))},
 		CALL_ENV_TERMINATOR
 	}
 };
@@ -231,6 +242,12 @@ typedef struct {
 	fr_pair_t		*smb_ctrl;
 	fr_pair_t		*cpw;
 	mschap_cpw_ctx_t	*cpw_ctx;
+	bool			cpw_done;	//!< Password change has been processed.
+	rlm_mschap_thread_t	*thread;
+	mschap_ntlm_helper_auth_t	*ntlm_helper_auth;	//!< Outstanding or completed ntlm_auth helper authentication.
+#ifdef WITH_AUTH_WINBIND_ASYNC
+	fr_winbind_auth_t	*wb_auth;	//!< Outstanding or completed winbindd authentication.
+#endif
 } mschap_auth_ctx_t;
 
 static fr_dict_t const *dict_freeradius;
@@ -1056,12 +1073,160 @@ ntlm_auth_err:
 	return -1;
 }
 
+/** Map an error reported by ntlm_auth to an MS-CHAP error
+ *
+ * @param[in] request	The current request.
+ * @param[in] buffer	Error text from ntlm_auth.
+ * @return
+ *	- 0 if the error wasn't recognised.
+ *	- <0 the MS-CHAP error code to return.
+ */
+static int ntlm_auth_error_result(request_t *request, char const *buffer)
+{
+	char const	*p;
+	int		result;
+
+	/*
+	 *	Do checks for numbers, which are
+	 *	language neutral.  They're also
+	 *	faster.
+	 */
+	p = strcasestr(buffer, "0xC0000");
+	if (p) {
+		result = 0;
+
+		p += 7;
+		if (strcmp(p, "224") == 0) {
+			result = -648;
+
+		} else if (strcmp(p, "234") == 0) {
+			result = -647;
+
+		} else if (strcmp(p, "072") == 0) {
+			result = -691;
+
+		} else if (strcasecmp(p, "05E") == 0) {
+			result = -2;
+		}
+
+		if (result != 0) {
+			REDEBUG2("%s", buffer);
+			return result;
+		}
+
+		/*
+		 *	Else fall through to more ridiculous checks.
+		 */
+	}
+
+	/*
+	 *	Look for variants of expire password.
+	 */
+	if (strcasestr(buffer, "0xC0000224") ||
+	    strcasestr(buffer, "Password expired") ||
+	    strcasestr(buffer, "Password has expired") ||
+	    strcasestr(buffer, "Password must be changed") ||
+	    strcasestr(buffer, "Must change password")) {
+		return -648;
+	}
+
+	if (strcasestr(buffer, "0xC0000234") ||
+	    strcasestr(buffer, "Account locked out")) {
+		REDEBUG2("%s", buffer);
+		return -647;
+	}
+
+	if (strcasestr(buffer, "0xC0000072") ||
+	    strcasestr(buffer, "Account disabled")) {
+		REDEBUG2("%s", buffer);
+		return -691;
+	}
+
+	if (strcasestr(buffer, "0xC000005E") ||
+	    strcasestr(buffer, "No logon servers")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	if (strcasestr(buffer, "could not obtain winbind separator") ||
+	    strcasestr(buffer, "Reading winbind reply failed")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	return 0;
+}
+
+/** Authenticate using a persistent ntlm_auth helper
+ *
+ * Returns 1 after queuing the request, and should be called again
+ * with the same auth_ctx once the request is resumed.
+ */
+static int do_ntlm_auth_helper(request_t *request, uint8_t const *challenge, uint8_t const *response,
+			       uint8_t nthashhash[static NT_DIGEST_LENGTH], mschap_auth_ctx_t *auth_ctx)
+{
+	mschap_auth_call_env_t		*env_data = auth_ctx->env_data;
+	mschap_ntlm_helper_auth_t	*auth = auth_ctx->ntlm_helper_auth;
+	int				result;
+
+	if (!auth) {
+		char const *domain = NULL;
+
+		if (env_data->ntlm_helper_username.type != FR_TYPE_STRING) {
+			REDEBUG("No ntlm_auth_helper username set, authentication will definitely fail!");
+			return -1;
+		}
+
+		if (env_data->ntlm_helper_domain.type == FR_TYPE_STRING) domain = env_data->ntlm_helper_domain.vb_strvalue;
+
+		RDEBUG2("Sending authentication request user \"%pV\" domain \"%pV\" to ntlm_auth helper",
+			&env_data->ntlm_helper_username, &env_data->ntlm_helper_domain);
+
+		if (mschap_ntlm_helper_auth(&auth_ctx->ntlm_helper_auth, auth_ctx, auth_ctx->thread->ntlm_helper, request,
+					    env_data->ntlm_helper_username.vb_strvalue, domain,
+					    challenge, response, 24) < 0) {
+			RERROR("Unable to send authentication request to ntlm_auth helper");
+			return -1;
+		}
+
+		return 1;
+	}
+
+	switch (auth->status) {
+	case MSCHAP_NTLM_HELPER_OK:
+		memcpy(nthashhash, auth->nt_key, NT_DIGEST_LENGTH);
+		return 0;
+
+	case MSCHAP_NTLM_HELPER_REJECT:
+		if (!auth->error) {
+			REDEBUG("ntlm_auth rejected the credentials");
+			return -1;
+		}
+
+		result = ntlm_auth_error_result(request, auth->error);
+		if (result != 0) return result;
+
+		REDEBUG("ntlm_auth says: %s", auth->error);
+		return -1;
+
+	case MSCHAP_NTLM_HELPER_PENDING:
+	case MSCHAP_NTLM_HELPER_FAIL:
+		break;
+	}
+
+	REDEBUG("ntlm_auth helper failed: %s", auth->error ? auth->error : "No response");
+	return -1;
+}
+
 /*
  *	Do the MS-CHAP stuff.
  *
  *	This function is here so that all of the MS-CHAP related
  *	authentication is in one place, and we can perhaps later replace
  *	it with code to call winbindd, or something similar.
+ *
+ *	Returns 1 if the caller should yield, and call us again
+ *	with the same auth_ctx once the request is resumed.
  */
 static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 						      request_t *request,
@@ -1071,9 +1236,9 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 						      uint8_t nthashhash[static NT_DIGEST_LENGTH],
 						      MSCHAP_AUTH_METHOD method,
 #ifdef WITH_AUTH_WINBIND
-						      mschap_auth_call_env_t *env_data)
+						      mschap_auth_ctx_t *auth_ctx)
 #else
-						      UNUSED mschap_auth_call_env_t *env_data)
+						      UNUSED mschap_auth_ctx_t *auth_ctx)
 #endif
 {
 	uint8_t	calculated[24];
@@ -1120,6 +1285,9 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 		char	buffer[256];
 		size_t	len;
 
+		if (inst->ntlm_helper.program) return do_ntlm_auth_helper(request, challenge, response,
+									  nthashhash, auth_ctx);
+
 		/*
 		 *	Run the program, and expect that we get 16
 		 */
@@ -1128,73 +1296,8 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 		if (result != 0) {
 			char *p;
 
-			/*
-			 *	Do checks for numbers, which are
-			 *	language neutral.  They're also
-			 *	faster.
-			 */
-			p = strcasestr(buffer, "0xC0000");
-			if (p) {
-				result = 0;
-
-				p += 7;
-				if (strcmp(p, "224") == 0) {
-					result = -648;
-
-				} else if (strcmp(p, "234") == 0) {
-					result = -647;
-
-				} else if (strcmp(p, "072") == 0) {
-					result = -691;
-
-				} else if (strcasecmp(p, "05E") == 0) {
-					result = -2;
-				}
-
-				if (result != 0) {
-					REDEBUG2("%s", buffer);
-					return result;
-				}
-
-				/*
-				 *	Else fall through to more ridiculous checks.
-				 */
-			}
-
-			/*
-			 *	Look for variants of expire password.
-			 */
-			if (strcasestr(buffer, "0xC0000224") ||
-			    strcasestr(buffer, "Password expired") ||
-			    strcasestr(buffer, "Password has expired") ||
-			    strcasestr(buffer, "Password must be changed") ||
-			    strcasestr(buffer, "Must change password")) {
-				return -648;
-			}
-
-			if (strcasestr(buffer, "0xC0000234") ||
-			    strcasestr(buffer, "Account locked out")) {
-				REDEBUG2("%s", buffer);
-				return -647;
-			}
-
-			if (strcasestr(buffer, "0xC0000072") ||
-			    strcasestr(buffer, "Account disabled")) {
-				REDEBUG2("%s", buffer);
-				return -691;
-			}
-
-			if (strcasestr(buffer, "0xC000005E") ||
-			    strcasestr(buffer, "No logon servers")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			if (strcasestr(buffer, "could not obtain winbind separator") ||
-			    strcasestr(buffer, "Reading winbind reply failed")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
+			result = ntlm_auth_error_result(request, buffer);
+			if (result != 0) return result;
 
 			RDEBUG2("External script failed");
 			p = strchr(buffer, '\n');
@@ -1242,7 +1345,12 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 	/*
 	 *	Process auth via the wbclient library
 	 */
-		return do_auth_wbclient(inst, request, challenge, response, nthashhash, env_data);
+#ifdef WITH_AUTH_WINBIND_ASYNC
+		if (inst->wb_async) return do_auth_wbclient_async(&auth_ctx->wb_auth, auth_ctx, auth_ctx->thread->wb,
+								   request, challenge, response, nthashhash,
+								   auth_ctx->env_data);
+#endif
+		return do_auth_wbclient(inst, request, challenge, response, nthashhash, auth_ctx->env_data);
 #endif
 	default:
 		/* We should never reach this line */
@@ -1730,7 +1838,7 @@ static int mschap_cpw_prepare(request_t *request, mschap_auth_ctx_t *auth_ctx)
 	return 0;
 }
 
-static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
+static CC_HINT(nonnull(1,2,3,4,5,8,9,12)) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
 									       int *mschap_version,
 									       uint8_t nthashhash[static NT_DIGEST_LENGTH],
 									       rlm_mschap_t const *inst,
@@ -1740,7 +1848,8 @@ static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(r
 									       fr_pair_t *challenge,
 									       fr_pair_t *response,
 									       MSCHAP_AUTH_METHOD method,
-									       mschap_auth_call_env_t *env_data)
+									       mschap_auth_call_env_t *env_data,
+									       mschap_auth_ctx_t *auth_ctx)
 {
 	int			offset;
 	rlm_rcode_t		mschap_result;
@@ -1780,7 +1889,8 @@ static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(r
 	 *	Do the MS-CHAP authentication.
 	 */
 	mschap_result = do_mschap(inst, request, nt_password, challenge->vp_octets,
-				  response->vp_octets + offset, nthashhash, method, env_data);
+				  response->vp_octets + offset, nthashhash, method, auth_ctx);
+	if (mschap_result == 1) return UNLANG_ACTION_YIELD;
 
 	/*
 	 *	Check for errors, and add MSCHAP-Error if necessary.
@@ -1788,7 +1898,7 @@ static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(r
 	return mschap_error(p_result, inst, request, *response->vp_octets, mschap_result, *mschap_version, smb_ctrl, env_data);
 }
 
-static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_response(rlm_rcode_t *p_result,
+static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9,12)) mschap_process_v2_response(rlm_rcode_t *p_result,
 										  int *mschap_version,
 									    	  uint8_t nthashhash[static NT_DIGEST_LENGTH],
 									    	  rlm_mschap_t const *inst,
@@ -1798,7 +1908,8 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 									    	  fr_pair_t *challenge,
 									    	  fr_pair_t *response,
 									    	  MSCHAP_AUTH_METHOD method,
-										  mschap_auth_call_env_t *env_data)
+										  mschap_auth_call_env_t *env_data,
+										  mschap_auth_ctx_t *auth_ctx)
 {
 		uint8_t		mschap_challenge[16];
 		fr_pair_t	*user_name, *name_vp, *response_name, *peer_challenge_attr;
@@ -1905,7 +2016,8 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 				      username_str, username_len);	/* user name */
 
 		mschap_result = do_mschap(inst, request, nt_password, mschap_challenge,
-					  response->vp_octets + 26, nthashhash, method, env_data);
+					  response->vp_octets + 26, nthashhash, method, auth_ctx);
+		if (mschap_result == 1) return UNLANG_ACTION_YIELD;
 
 		/*
 		 *	Check for errors, and add MSCHAP-Error if necessary.
@@ -1956,7 +2068,11 @@ static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, UNUSED int
 	int			mschap_version = 0;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
-	if (auth_ctx->cpw) {
+	/*
+	 *	If we're resuming after yielding for winbindd, the
+	 *	password change has already been processed.
+	 */
+	if (auth_ctx->cpw && !auth_ctx->cpw_done) {
 		uint8_t		*p;
 
 		/*
@@ -1997,6 +2113,8 @@ static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, UNUSED int
 		p[1] = 0;
 		/* peer challenge and client NT response */
 		memcpy(p + 2, auth_ctx->cpw->vp_octets + 18, 48);
+
+		auth_ctx->cpw_done = true;
 	}
 
 	challenge = fr_pair_find_by_da_nested(&request->request_pairs, NULL, tmpl_attr_tail_da(env_data->chap_challenge));
@@ -2017,20 +2135,24 @@ static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, UNUSED int
 	 *	We also require an MS-CHAP-Response.
 	 */
 	if ((response = fr_pair_find_by_da(&parent->vp_group, NULL, tmpl_attr_tail_da(env_data->chap_response)))) {
-		mschap_process_response(&rcode,
-					&mschap_version, nthashhash,
-					inst, request,
-					auth_ctx->smb_ctrl, auth_ctx->nt_password,
-					challenge, response,
-					auth_ctx->method, auth_ctx->env_data);
+		if (mschap_process_response(&rcode,
+					    &mschap_version, nthashhash,
+					    inst, request,
+					    auth_ctx->smb_ctrl, auth_ctx->nt_password,
+					    challenge, response,
+					    auth_ctx->method, auth_ctx->env_data, auth_ctx) == UNLANG_ACTION_YIELD) {
+			return UNLANG_ACTION_YIELD;
+		}
 		if (rcode != RLM_MODULE_OK) goto finish;
 	} else if ((response = fr_pair_find_by_da_nested(&parent->vp_group, NULL, tmpl_attr_tail_da(env_data->chap2_response)))) {
-		mschap_process_v2_response(&rcode,
-					   &mschap_version, nthashhash,
-					   inst, request,
-					   auth_ctx->smb_ctrl, auth_ctx->nt_password,
-					   challenge, response,
-					   auth_ctx->method, auth_ctx->env_data);
+		if (mschap_process_v2_response(&rcode,
+					       &mschap_version, nthashhash,
+					       inst, request,
+					       auth_ctx->smb_ctrl, auth_ctx->nt_password,
+					       challenge, response,
+					       auth_ctx->method, auth_ctx->env_data, auth_ctx) == UNLANG_ACTION_YIELD) {
+			return UNLANG_ACTION_YIELD;
+		}
 		if (rcode != RLM_MODULE_OK) goto finish;
 	} else {		/* Neither CHAPv1 or CHAPv2 response: die */
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s or &%s attributes",
@@ -2090,6 +2212,19 @@ finish:
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/** Cancel any outstanding ntlm_auth helper or winbindd authentication
+ *
+ */
+static void mod_authenticate_signal(UNUSED request_t *request, UNUSED fr_signal_t action, void *uctx)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(uctx, mschap_auth_ctx_t);
+
+	TALLOC_FREE(auth_ctx->ntlm_helper_auth);
+#ifdef WITH_AUTH_WINBIND_ASYNC
+	TALLOC_FREE(auth_ctx->wb_auth);
+#endif
+}
+
 /** When changing passwords using the ntlm_auth helper, evaluate the domain tmpl
  *
  */
@@ -2278,6 +2413,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		.inst = inst,
 		.method = inst->method,
 		.env_data = env_data,
+		.thread = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t),
 	};
 
 	/*
@@ -2367,7 +2503,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 			}
 
 			if (unlang_function_push(request, env_data->ntlm_cpw_domain ? mod_authenticate_domain_tmpl_push : NULL,
-						 mod_authenticate_resume, NULL, 0,
+						 mod_authenticate_resume, mod_authenticate_signal, ~FR_SIGNAL_CANCEL,
 						 UNLANG_SUB_FRAME, auth_ctx) < 0) RETURN_MODULE_FAIL;
 
 			fr_value_box_list_init(&auth_ctx->cpw_ctx->cpw_user);
@@ -2379,6 +2515,19 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		return UNLANG_ACTION_PUSHED_CHILD;
 	}
 
+	/*
+	 *	Authenticating via an ntlm_auth helper, or
+	 *	winbindd yields, so we need a frame to resume into.
+	 */
+	if ((((auth_ctx->method == AUTH_NTLMAUTH_EXEC) || (auth_ctx->method == AUTH_AUTO)) && inst->ntlm_helper.program)
+#ifdef WITH_AUTH_WINBIND_ASYNC
+	    || ((auth_ctx->method == AUTH_WBCLIENT) && inst->wb_async)
+#endif
+	    ) {
+		return unlang_function_push(request, NULL, mod_authenticate_resume, mod_authenticate_signal,
+					    ~FR_SIGNAL_CANCEL, UNLANG_SUB_FRAME, auth_ctx);
+	}
+
 	return mod_authenticate_resume(p_result, NULL, request, auth_ctx);
 }
 
@@ -2411,12 +2560,41 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 			cf_log_err(conf, "Unable to initialise winbind connection pool");
 			return -1;
 		}
+
+#ifdef WITH_AUTH_WINBIND_ASYNC
+		/*
+		 *	Normalising the username needs additional
+		 *	lookups, which are only available via libwbclient.
+		 */
+		if (inst->wb_async && inst->wb_retry_with_normalised_username) {
+			cf_log_err(conf, "'winbind.retry_with_normalised_username' cannot be used with 'winbind.async = yes'");
+			return -1;
+		}
+#endif
 #else
 		cf_log_err(conf, "'winbind' auth not enabled at compiled time");
 		return -1;
 #endif
 	}
 
+	/*
+	 *	The helper replaces ntlm_auth being
+	 *	run for each request, both can't be used.
+	 */
+	if (inst->ntlm_helper.program) {
+		if (inst->ntlm_auth) {
+			cf_log_err(conf, "'ntlm_auth' and 'ntlm_auth_helper.program' cannot both be set");
+			return -1;
+		}
+
+		if (inst->method != AUTH_INTERNAL) {
+			cf_log_err(conf, "'ntlm_auth_helper' cannot be used with 'winbind.username'");
+			return -1;
+		}
+
+		inst->method = AUTH_NTLMAUTH_EXEC;
+	}
+
 	/* preserve existing behaviour: this option overrides all */
 	if (inst->ntlm_auth) {
 		inst->method = AUTH_NTLMAUTH_EXEC;
@@ -2430,10 +2608,20 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		DEBUG("Using auto password or ntlm_auth");
 		break;
 	case AUTH_NTLMAUTH_EXEC:
+		if (inst->ntlm_helper.program) {
+			DEBUG("Authenticating using persistent 'ntlm_auth' helpers");
+			break;
+		}
 		DEBUG("Authenticating by calling 'ntlm_auth'");
 		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
+#ifdef WITH_AUTH_WINBIND_ASYNC
+		if (inst->wb_async) {
+			DEBUG("Authenticating directly to winbind, asynchronously via %s", inst->wb_pipe.path);
+			break;
+		}
+#endif
 		DEBUG("Authenticating directly to winbind");
 		break;
 #endif
@@ -2486,6 +2674,34 @@ done_mppe_check:
 	return 0;
 }
 
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_mschap_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+
+	if (inst->ntlm_helper.program) {
+		t->ntlm_helper = mschap_ntlm_helper_alloc(t, mctx->el, &inst->ntlm_helper, inst->ntlm_auth_timeout,
+							  mctx->mi->name);
+		if (!t->ntlm_helper) {
+			ERROR("Unable to start ntlm_auth helpers");
+			return -1;
+		}
+		return 0;
+	}
+
+#ifdef WITH_AUTH_WINBIND_ASYNC
+	if ((inst->method != AUTH_WBCLIENT) || !inst->wb_async) return 0;
+
+	t->wb = fr_winbind_alloc(t, mctx->el, &inst->wb_pipe, mctx->mi->name);
+	if (!t->wb) {
+		ERROR("Unable to create connections to winbindd");
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
 static int mod_bootstrap(module_inst_ctx_t const *mctx)
 {
 	xlat_t *xlat;
@@ -2525,7 +2741,10 @@ module_rlm_t rlm_mschap = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
-		.detach		= mod_detach
+		.detach		= mod_detach,
+		.thread_inst_size	= sizeof(rlm_mschap_thread_t),
+		.thread_inst_type	= "rlm_mschap_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
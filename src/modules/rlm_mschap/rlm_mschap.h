@@ -7,10 +7,17 @@ RCSIDH(rlm_mschap_h, "$Id$")
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/server/tmpl.h>
 
+#include "ntlm_helper.h"
+
 #ifdef WITH_AUTH_WINBIND
 #  include <wbclient.h>
 
 #include <freeradius-devel/server/pool.h>
+
+#  ifdef WITH_WINBIND_ASYNC
+#    define WITH_AUTH_WINBIND_ASYNC 1
+#    include <freeradius-devel/winbind/base.h>
+#  endif
 #endif
 
 /* Method of authentication we are going to use */
@@ -51,6 +58,7 @@ typedef struct {
 	char const		*ntlm_auth;
 	fr_time_delta_t		ntlm_auth_timeout;
 	char const		*ntlm_cpw;
+	mschap_ntlm_helper_conf_t	ntlm_helper;	//!< Persistent ntlm_auth processes.
 
 	bool			allow_retry;
 	char const		*retry_msg;
@@ -60,11 +68,22 @@ typedef struct {
 	fr_pool_t		*wb_pool;
 	bool			wb_retry_with_normalised_username;
 #endif
+#ifdef WITH_AUTH_WINBIND_ASYNC
+	bool			wb_async;		//!< Talk to winbindd directly, without libwbclient.
+	fr_winbind_conf_t	wb_pipe;		//!< Connections to winbindd for async authentication.
+#endif
 #ifdef __APPLE__
 	bool			open_directory;
 #endif
 } rlm_mschap_t;
 
+typedef struct {
+	mschap_ntlm_helper_t	*ntlm_helper;		//!< ntlm_auth helper processes.
+#ifdef WITH_AUTH_WINBIND_ASYNC
+	fr_winbind_t		*wb;			//!< Connections to winbindd.
+#endif
+} rlm_mschap_thread_t;
+
 typedef struct {
 	tmpl_t const	*username;
 	tmpl_t const	*chap_error;
@@ -81,6 +100,8 @@ typedef struct {
 	tmpl_t const	*chap_nt_enc_pw;
 	fr_value_box_t	wb_username;
 	fr_value_box_t	wb_domain;
+	fr_value_box_t	ntlm_helper_username;
+	fr_value_box_t	ntlm_helper_domain;
 	tmpl_t const	*ntlm_cpw_username;
 	tmpl_t const	*ntlm_cpw_domain;
 	tmpl_t const	*local_cpw;
@@ -27,6 +27,7 @@ RCSID("$Id$")
 USES_APPLE_DEPRECATED_API
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/compute.h>
 #include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/server/password.h>
 #include <freeradius-devel/tls/base.h>
@@ -52,6 +53,7 @@ USES_APPLE_DEPRECATED_API
 #ifdef HAVE_OPENSSL_EVP_H
 #  include <freeradius-devel/tls/openssl_user_macros.h>
 #  include <openssl/evp.h>
+#  include <openssl/err.h>
 #endif
 
 /*
@@ -73,12 +75,52 @@ static pthread_mutex_t fr_crypt_mutex = PTHREAD_MUTEX_INITIALIZER;
 typedef struct {
 	fr_dict_enum_value_t	*auth_type;
 	bool			normify;
+
+	fr_compute_conf_t	compute;		//!< Configuration for the compute pool.
+	fr_compute_pool_t	*compute_pool;		//!< Runs expensive hashes.  Allocated outside of the
+							///< instance data, as it's modified at runtime.
 } rlm_pap_t;
 
+typedef struct {
+	fr_compute_thread_t	*compute;		//!< For submitting jobs to the compute pool.
+} rlm_pap_thread_t;
+
 typedef unlang_action_t (*pap_auth_func_t)(rlm_rcode_t *p_result, rlm_pap_t const *inst, request_t *request, fr_pair_t const *, fr_value_box_t const *);
 
+/** Parse the "known good" password, and copy everything needed to check it into a job
+ *
+ * @return
+ *	- The job data, allocated in the request.
+ *	- NULL on error, with p_result set.
+ */
+typedef void *(*pap_offload_prepare_t)(rlm_rcode_t *p_result, request_t *request,
+				       fr_pair_t const *known_good, fr_value_box_t const *password);
+
+/** Check the result of a job
+ *
+ */
+typedef rlm_rcode_t (*pap_offload_finish_t)(request_t *request, void *data);
+
+/** Password types which are expensive enough to run in the compute pool
+ *
+ * These are split into a prepare step, which runs in the worker, a
+ * compute step, which may run in the compute pool, and a finish step,
+ * which runs in the worker.
+ */
+typedef struct {
+	pap_offload_prepare_t	prepare;
+	fr_compute_func_t	compute;
+	pap_offload_finish_t	finish;
+} pap_offload_t;
+
+typedef struct {
+	pap_offload_t const	*offload;		//!< Which the job was prepared by.
+	fr_compute_job_t	*job;			//!< Running in the compute pool.
+} pap_rctx_t;
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("normalise", rlm_pap_t, normify), .dflt = "yes" },
+	{ FR_CONF_OFFSET_SUBSECTION("compute", 0, rlm_pap_t, compute, fr_compute_config) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -189,44 +231,102 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_clear(rlm_rcode_t *p_result,
 	RETURN_MODULE_OK;
 }
 
+#if defined(HAVE_CRYPT) || defined(HAVE_OPENSSL_EVP_H)
+/** Prepare, compute, and finish, an offloadable password type in the worker
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) pap_auth_offload_inline(rlm_rcode_t *p_result, pap_offload_t const *offload,
+								request_t *request,
+								fr_pair_t const *known_good, fr_value_box_t const *password)
+{
+	void	*data;
+
+	data = offload->prepare(p_result, request, known_good, password);
+	if (!data) return UNLANG_ACTION_CALCULATE_RESULT;
+
+	offload->compute(data);
+	*p_result = offload->finish(request, data);
+	talloc_free(data);
+
+	return UNLANG_ACTION_CALCULATE_RESULT;
+}
+#endif
+
 #ifdef HAVE_CRYPT
-static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, request_t *request,
-						       fr_pair_t const *known_good, fr_value_box_t const *password)
+typedef struct {
+	char		*password;
+	char		*known_good;
+	bool		match;
+} pap_crypt_job_t;
+
+static void *pap_crypt_prepare(UNUSED rlm_rcode_t *p_result, request_t *request,
+			       fr_pair_t const *known_good, fr_value_box_t const *password)
 {
-	char	*crypt_out;
-	int	cmp = 0;
+	pap_crypt_job_t	*job;
+
+	MEM(job = talloc_zero(request, pap_crypt_job_t));
+	MEM(job->password = talloc_bstrndup(job, password->vb_strvalue, password->vb_length));
+	MEM(job->known_good = talloc_bstrndup(job, known_good->vp_strvalue, known_good->vp_length));
+
+	return job;
+}
+
+static void pap_crypt_compute(void *data)
+{
+	pap_crypt_job_t	*job = data;
+	char		*crypt_out;
+	int		cmp = 0;
 
 #ifdef HAVE_CRYPT_R
 	struct crypt_data crypt_data = { .initialized = 0 };
 
-	crypt_out = crypt_r(password->vb_strvalue, known_good->vp_strvalue, &crypt_data);
-	if (crypt_out) cmp = strcmp(known_good->vp_strvalue, crypt_out);
+	crypt_out = crypt_r(job->password, job->known_good, &crypt_data);
+	if (crypt_out) cmp = strcmp(job->known_good, crypt_out);
 #else
 	/*
 	 *	Ensure we're thread-safe, as crypt() isn't.
 	 */
 	pthread_mutex_lock(&fr_crypt_mutex);
-	crypt_out = crypt(password->vb_strvalue, known_good->vp_strvalue);
+	crypt_out = crypt(job->password, job->known_good);
 
 	/*
 	 *	Got something, check it within the lock.  This is
 	 *	faster than copying it to a local buffer, and the
 	 *	time spent within the lock is critical.
 	 */
-	if (crypt_out) cmp = strcmp(known_good->vp_strvalue, crypt_out);
+	if (crypt_out) cmp = strcmp(job->known_good, crypt_out);
 	pthread_mutex_unlock(&fr_crypt_mutex);
 #endif
 
+	job->match = (crypt_out && (cmp == 0));
+}
+
+static rlm_rcode_t pap_crypt_finish(request_t *request, void *data)
+{
+	pap_crypt_job_t	*job = talloc_get_type_abort(data, pap_crypt_job_t);
+
 	/*
 	 *	Error.
 	 */
-	if (!crypt_out || (cmp != 0)) {
+	if (!job->match) {
 		REDEBUG("Crypt digest does not match \"known good\" digest");
-		RETURN_MODULE_REJECT;
+		return RLM_MODULE_REJECT;
 	}
 
-	RETURN_MODULE_OK;
+	return RLM_MODULE_OK;
+}
+
+static pap_offload_t const pap_crypt_offload = {
+	.prepare = pap_crypt_prepare,
+	.compute = pap_crypt_compute,
+	.finish = pap_crypt_finish
+};
+
+static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
+						       UNUSED rlm_pap_t const *inst, request_t *request,
+						       fr_pair_t const *known_good, fr_value_box_t const *password)
+{
+	return pap_auth_offload_inline(p_result, &pap_crypt_offload, request, known_good, password);
 }
 #endif
 
@@ -438,9 +538,25 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_256, "SSHA3-256", EVP_sha
 PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_384, "SSHA3-384", EVP_sha3_384())
 PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha3_512())
 
+typedef struct {
+	EVP_MD const		*evp_md;
+	size_t			digest_len;
+	uint32_t		iterations;
+
+	uint8_t			*salt;
+	size_t			salt_len;
+	uint8_t			hash[EVP_MAX_MD_SIZE];
+	uint8_t			digest[EVP_MAX_MD_SIZE];
+
+	uint8_t			*password;
+
+	unsigned long		error;			//!< From OpenSSL, if PBKDF2 failed.
+} pap_pbkdf2_job_t;
+
 /** Validates Crypt::PBKDF2 LDAP format strings
  *
- * @param[out] p_result		The result of comparing the pbkdf2 hash with the password.
+ * The digest is calculated later by #pap_pbkdf2_compute.
+ *
  * @param[in] request		The current request.
  * @param[in] str		Raw PBKDF2 string.
  * @param[in] len		Length of string.
@@ -452,16 +568,15 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha
  * @param[in] iter_is_base64	Whether the iterations is are encoded as base64.
  * @param[in] password		to validate.
  * @return
- *	- RLM_MODULE_REJECT
- *	- RLM_MODULE_OK
+ *	- The job data.
+ *	- NULL if the string is invalid.
  */
-static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t *p_result,
-								     request_t *request, const uint8_t *str, size_t len,
-								     fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
-								     char scheme_sep, char iter_sep, char salt_sep,
-								     bool iter_is_base64, fr_value_box_t const *password)
+static inline CC_HINT(nonnull) pap_pbkdf2_job_t *pap_pbkdf2_parse(request_t *request, const uint8_t *str, size_t len,
+								  fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
+								  char scheme_sep, char iter_sep, char salt_sep,
+								  bool iter_is_base64, fr_value_box_t const *password)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
+	pap_pbkdf2_job_t	*job;
 
 	uint8_t const		*p, *q, *end;
 	ssize_t			slen;
@@ -472,10 +587,7 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 
 	uint32_t		iterations = 1;
 
-	uint8_t			*salt = NULL;
-	size_t			salt_len;
-	uint8_t			hash[EVP_MAX_MD_SIZE];
-	uint8_t			digest[EVP_MAX_MD_SIZE];
+	MEM(job = talloc_zero(request, pap_pbkdf2_job_t));
 
 	RDEBUG2("Comparing with \"known-good\" Password.PBKDF2");
 
@@ -622,14 +734,14 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 		goto finish;
 	}
 
-	MEM(salt = talloc_array(request, uint8_t, FR_BASE64_DEC_LENGTH(q - p)));
-	slen = fr_base64_decode(&FR_DBUFF_TMP(salt, talloc_array_length(salt)),
+	MEM(job->salt = talloc_array(job, uint8_t, FR_BASE64_DEC_LENGTH(q - p)));
+	slen = fr_base64_decode(&FR_DBUFF_TMP(job->salt, talloc_array_length(job->salt)),
 				&FR_SBUFF_IN((char const *) p, (char const *)q), false, false);
 	if (slen <= 0) {
 		RPEDEBUG("Failed decoding Password.PBKDF2 salt component");
 		goto finish;
 	}
-	salt_len = (size_t)slen;
+	job->salt_len = (size_t)slen;
 
 	p = q + 1;
 
@@ -638,7 +750,7 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 		goto finish;
 	}
 
-	slen = fr_base64_decode(&FR_DBUFF_TMP(hash, sizeof(hash)),
+	slen = fr_base64_decode(&FR_DBUFF_TMP(job->hash, sizeof(job->hash)),
 				&FR_SBUFF_IN((char const *)p, (char const *)end), false, false);
 	if (slen <= 0) {
 		RPEDEBUG("Failed decoding Password.PBKDF2 hash component");
@@ -649,53 +761,80 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 		REDEBUG("Password.PBKDF2 hash component length is incorrect for hash type, expected %zu, got %zd",
 			digest_len, slen);
 
-		RHEXDUMP2(hash, slen, "hash component");
+		RHEXDUMP2(job->hash, slen, "hash component");
 
 		goto finish;
 	}
 
 	RDEBUG2("PBKDF2 %s: Iterations %u, salt length %zu, hash length %zd",
 		fr_table_str_by_value(pbkdf2_crypt_names, digest_type, "<UNKNOWN>"),
-		iterations, salt_len, slen);
+		iterations, job->salt_len, slen);
 
-	/*
-	 *	Hash and compare
-	 */
-	if (PKCS5_PBKDF2_HMAC((char const *)password->vb_octets, (int)password->vb_length,
-			      (unsigned char const *)salt, (int)salt_len,
-			      (int)iterations,
-			      evp_md,
-			      (int)digest_len, (unsigned char *)digest) == 0) {
-		fr_tls_log(request, "PBKDF2 digest failure");
-		goto finish;
+	job->evp_md = evp_md;
+	job->digest_len = digest_len;
+	job->iterations = iterations;
+	MEM(job->password = talloc_memdup(job, password->vb_octets, password->vb_length));
+
+	return job;
+
+finish:
+	talloc_free(job);
+
+	return NULL;
+}
+
+static void pap_pbkdf2_compute(void *data)
+{
+	pap_pbkdf2_job_t	*job = data;
+
+	if (PKCS5_PBKDF2_HMAC((char const *)job->password, (int)talloc_array_length(job->password),
+			      (unsigned char const *)job->salt, (int)job->salt_len,
+			      (int)job->iterations,
+			      job->evp_md,
+			      (int)job->digest_len, (unsigned char *)job->digest) == 0) {
+		/*
+		 *	The error stack is per-thread, so take
+		 *	the error with us to the worker.
+		 */
+		job->error = ERR_get_error();
+		if (!job->error) job->error = ERR_PACK(ERR_LIB_EVP, 0, ERR_R_INTERNAL_ERROR);
+		ERR_clear_error();
 	}
+}
 
-	if (fr_digest_cmp(digest, hash, (size_t)digest_len) != 0) {
-		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
-		REDEBUG3("Salt       : %pH", fr_box_octets(salt, salt_len));
-		REDEBUG3("Calculated : %pH", fr_box_octets(digest, digest_len));
-		REDEBUG3("Expected   : %pH", fr_box_octets(hash, slen));
-		rcode = RLM_MODULE_REJECT;
-	} else {
-		rcode = RLM_MODULE_OK;
+static rlm_rcode_t pap_pbkdf2_finish(request_t *request, void *data)
+{
+	pap_pbkdf2_job_t	*job = talloc_get_type_abort(data, pap_pbkdf2_job_t);
+
+	if (job->error) {
+		char buffer[256];
+
+		ERR_error_string_n(job->error, buffer, sizeof(buffer));
+		REDEBUG("PBKDF2 digest failure: %s", buffer);
+		return RLM_MODULE_INVALID;
 	}
 
-finish:
-	talloc_free(salt);
+	if (fr_digest_cmp(job->digest, job->hash, job->digest_len) != 0) {
+		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
+		REDEBUG3("Salt       : %pH", fr_box_octets(job->salt, job->salt_len));
+		REDEBUG3("Calculated : %pH", fr_box_octets(job->digest, job->digest_len));
+		REDEBUG3("Expected   : %pH", fr_box_octets(job->hash, job->digest_len));
+		return RLM_MODULE_REJECT;
+	}
 
-	RETURN_MODULE_RCODE(rcode);
+	return RLM_MODULE_OK;
 }
 
-static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_result,
-							       UNUSED rlm_pap_t const *inst,
-							       request_t *request,
-							       fr_pair_t const *known_good, fr_value_box_t const *password)
+static void *pap_pbkdf2_prepare(rlm_rcode_t *p_result, request_t *request,
+				fr_pair_t const *known_good, fr_value_box_t const *password)
 {
-	uint8_t const *p = known_good->vp_octets, *q, *end = p + known_good->vp_length;
+	uint8_t const		*p = known_good->vp_octets, *q, *end = p + known_good->vp_length;
+
+	*p_result = RLM_MODULE_INVALID;
 
 	if (end - p < 2) {
 		REDEBUG("Password.PBKDF2 too short");
-		RETURN_MODULE_INVALID;
+		return NULL;
 	}
 
 	/*
@@ -712,9 +851,9 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 			q = memchr(p, '}', end - p);
 			p = q + 1;
 		}
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
-					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
-					     ':', ':', ':', true, password);
+		return pap_pbkdf2_parse(request, p, end - p,
+					pbkdf2_crypt_names, pbkdf2_crypt_names_len,
+					':', ':', ':', true, password);
 	}
 
 	/*
@@ -724,9 +863,9 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$PBKDF2$") && (memcmp(p, "$PBKDF2$", sizeof("$PBKDF2$") - 1) == 0)) {
 		p += sizeof("$PBKDF2$") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
-					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
-					     ':', ':', '$', false, password);
+		return pap_pbkdf2_parse(request, p, end - p,
+					pbkdf2_crypt_names, pbkdf2_crypt_names_len,
+					':', ':', '$', false, password);
 	}
 
 	/*
@@ -738,14 +877,28 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$pbkdf2-") && (memcmp(p, "$pbkdf2-", sizeof("$pbkdf2-") - 1) == 0)) {
 		p += sizeof("$pbkdf2-") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
-					     pbkdf2_passlib_names, pbkdf2_passlib_names_len,
-					     '$', '$', '$', false, password);
+		return pap_pbkdf2_parse(request, p, end - p,
+					pbkdf2_passlib_names, pbkdf2_passlib_names_len,
+					'$', '$', '$', false, password);
 	}
 
 	REDEBUG("Can't determine format of Password.PBKDF2");
 
-	RETURN_MODULE_INVALID;
+	return NULL;
+}
+
+static pap_offload_t const pap_pbkdf2_offload = {
+	.prepare = pap_pbkdf2_prepare,
+	.compute = pap_pbkdf2_compute,
+	.finish = pap_pbkdf2_finish
+};
+
+static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_result,
+							       UNUSED rlm_pap_t const *inst,
+							       request_t *request,
+							       fr_pair_t const *known_good, fr_value_box_t const *password)
+{
+	return pap_auth_offload_inline(p_result, &pap_pbkdf2_offload, request, known_good, password);
 }
 #endif
 
@@ -895,15 +1048,67 @@ static const pap_auth_func_t auth_func_table[] = {
 #endif	/* HAVE_OPENSSL_EVP_H */
 };
 
+/** Table of password types which may be run in the compute pool
+ *
+ */
+static const pap_offload_t *offload_table[] = {
+#ifdef HAVE_CRYPT
+	[FR_CRYPT]	= &pap_crypt_offload,
+#endif
+#ifdef HAVE_OPENSSL_EVP_H
+	[FR_PBKDF2]	= &pap_pbkdf2_offload,
+#endif
+};
+
+static unlang_action_t pap_auth_result(rlm_rcode_t *p_result, request_t *request, rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Password incorrect");
+		break;
+
+	case RLM_MODULE_OK:
+		RDEBUG2("User authenticated successfully");
+		break;
+
+	default:
+		break;
+	}
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	pap_rctx_t	*rctx = talloc_get_type_abort(mctx->rctx, pap_rctx_t);
+	rlm_rcode_t	rcode;
+
+	rcode = rctx->offload->finish(request, fr_compute_job_data(rctx->job));
+	fr_compute_job_free(rctx->job);
+	talloc_free(rctx);
+
+	return pap_auth_result(p_result, request, rcode);
+}
+
+static void mod_authenticate_signal(module_ctx_t const *mctx, UNUSED request_t *request, UNUSED fr_signal_t action)
+{
+	pap_rctx_t	*rctx = talloc_get_type_abort(mctx->rctx, pap_rctx_t);
+
+	fr_compute_job_free(rctx->job);
+	talloc_free(rctx);
+}
+
 /*
  *	Authenticate the user via one of any well-known password.
  */
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_pap_t const 	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_pap_t);
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
 	fr_pair_t		*known_good;
 	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
 	pap_auth_func_t		auth_func;
+	pap_offload_t const	*offload = NULL;
 	bool			ephemeral;
 	pap_call_env_t		*env_data = talloc_get_type_abort(mctx->env_data, pap_call_env_t);
 
@@ -953,25 +1158,48 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		RDEBUG2("Comparing with \"known-good\" %s (%zu)", known_good->da->name, known_good->vp_length);
 	}
 
+	if (t->compute && (known_good->da->attr < NUM_ELEMENTS(offload_table))) {
+		offload = offload_table[known_good->da->attr];
+	}
+
 	/*
-	 *	Authenticate, and return.
+	 *	Expensive hashes are run in the compute pool,
+	 *	so that the worker can process other requests.
 	 */
-	auth_func(&rcode, inst, request, known_good, &env_data->password);
-	if (ephemeral) TALLOC_FREE(known_good);
-	switch (rcode) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Password incorrect");
-		break;
+	if (offload) {
+		pap_rctx_t	*rctx;
+		void		*data;
 
-	case RLM_MODULE_OK:
-		RDEBUG2("User authenticated successfully");
-		break;
+		data = offload->prepare(&rcode, request, known_good, &env_data->password);
+		if (ephemeral) TALLOC_FREE(known_good);
+		if (!data) return pap_auth_result(p_result, request, rcode);
 
-	default:
-		break;
+		MEM(rctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), pap_rctx_t));
+		rctx->offload = offload;
+
+		if (fr_compute_submit(&rctx->job, t->compute, request, offload->compute, data) == 0) {
+			return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal,
+						   ~FR_SIGNAL_CANCEL, rctx);
+		}
+		talloc_free(rctx);
+
+		/*
+		 *	Queue is full, do it ourselves.
+		 */
+		offload->compute(data);
+		rcode = offload->finish(request, data);
+		talloc_free(data);
+
+		return pap_auth_result(p_result, request, rcode);
 	}
 
-	RETURN_MODULE_RCODE(rcode);
+	/*
+	 *	Authenticate, and return.
+	 */
+	auth_func(&rcode, inst, request, known_good, &env_data->password);
+	if (ephemeral) TALLOC_FREE(known_good);
+
+	return pap_auth_result(p_result, request, rcode);
 }
 
 static int mod_instantiate(module_inst_ctx_t const *mctx)
@@ -984,6 +1212,39 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		     mctx->mi->name);
 	}
 
+	if (inst->compute.threads) {
+		inst->compute_pool = fr_compute_pool_alloc(NULL, &inst->compute, mctx->mi->name);
+		if (!inst->compute_pool) {
+			PERROR("Failed creating compute pool");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_pap_t	*inst = talloc_get_type_abort(mctx->mi->data, rlm_pap_t);
+
+	TALLOC_FREE(inst->compute_pool);
+
+	return 0;
+}
+
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_pap_t const		*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_pap_t);
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
+
+	if (!inst->compute_pool) return 0;
+
+	t->compute = fr_compute_thread_alloc(t, inst->compute_pool, mctx->el);
+	if (!t->compute) {
+		PERROR("Failed creating compute pool thread state");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -1062,7 +1323,12 @@ module_rlm_t rlm_pap = {
 		.onload		= mod_load,
 		.unload		= mod_unload,
 		.config		= module_config,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+		.detach		= mod_detach,
+
+		.thread_inst_size	= sizeof(rlm_pap_thread_t),
+		.thread_inst_type	= "rlm_pap_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
@@ -27,6 +27,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module_rlm.h>
+#include <freeradius-devel/server/reload.h>
 #include <freeradius-devel/util/debug.h>
 
 struct mypasswd {
@@ -150,11 +151,13 @@ static void release_hash_table(struct hashtable * ht){
 	ht->tablesize = 0;
 }
 
+#ifdef TEST
 static void release_ht(struct hashtable * ht){
 	if (!ht) return;
 	release_hash_table(ht);
 	talloc_free(ht);
 }
+#endif
 
 static struct hashtable * build_hash_table (char const * file, int num_fields,
 					    int key_field, int islist, int tablesize, int ignorenis, char delimiter)
@@ -355,9 +358,10 @@ int main(void){
 
 #else  /* TEST */
 typedef struct {
-	struct hashtable	*ht;
+	fr_reload_t		*reload;	//!< Holding the current struct hashtable.
 	struct mypasswd		*pwd_fmt;
 	char const		*filename;
+	fr_time_delta_t		reload_interval;	//!< How often to check the file for changes.
 	char const		*format;
 	char const		*delimiter;
 	bool			allow_multiple;
@@ -382,9 +386,40 @@ static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", rlm_passwd_t, allow_multiple), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("hash_size", rlm_passwd_t, hash_size), .dflt = "100" },
+
+	{ FR_CONF_OFFSET("reload_interval", rlm_passwd_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
+static int _hashtable_free(struct hashtable *ht)
+{
+	release_hash_table(ht);
+
+	return 0;
+}
+
+/** Parse a version of the passwd file
+ *
+ * Called at startup, and from the reload thread when the file changes.
+ */
+static int passwd_load(void **out, TALLOC_CTX *ctx, char const *filename, void *uctx)
+{
+	rlm_passwd_t const	*inst = talloc_get_type_abort_const(uctx, rlm_passwd_t);
+	struct hashtable	*ht;
+
+	ht = build_hash_table(filename, inst->num_fields, inst->key_field, inst->listable,
+			      inst->hash_size, inst->ignore_nislike, *inst->delimiter);
+	if (!ht) {
+		fr_strerror_printf("Can't build hashtable from passwd file %s", filename);
+		return -1;
+	}
+	talloc_steal(ctx, ht);
+	talloc_set_destructor(ht, _hashtable_free);
+
+	*out = ht;
+	return 0;
+}
+
 static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	int			num_fields = 0, key_field = -1, listable = 0;
@@ -441,24 +476,13 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
-	inst->ht = build_hash_table(inst->filename, num_fields, key_field, listable,
-				    inst->hash_size, inst->ignore_nislike, *inst->delimiter);
-	if (!inst->ht){
-		ERROR("Can't build hashtable from passwd file");
-		return -1;
-	}
-
 	inst->pwd_fmt = mypasswd_alloc(inst->format, num_fields, &len);
 	if (!inst->pwd_fmt){
 		ERROR("Memory allocation failed");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 	if (!string_to_entry(inst->format, num_fields, ':', inst->pwd_fmt , len)) {
 		ERROR("Unable to convert format entry");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -473,8 +497,6 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	}
 	if (!*inst->pwd_fmt->field[key_field]) {
 		cf_log_err(conf, "key field is empty");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -482,8 +504,6 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 						  inst->pwd_fmt->field[key_field], true, true);
 	if (!da) {
 		PERROR("Unable to resolve attribute");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -495,6 +515,18 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	DEBUG3("num_fields: %d key_field %d(%s) listable: %s", num_fields, key_field,
 	       inst->pwd_fmt->field[key_field], listable ? "yes" : "no");
 
+	/*
+	 *	The reload structure isn't part of the instance data,
+	 *	as the reload thread writes to it after the instance
+	 *	data has been made read only.
+	 */
+	inst->reload = fr_reload_alloc(NULL, mctx->mi->name, inst->filename,
+				       passwd_load, inst, inst->reload_interval);
+	if (!inst->reload) {
+		PERROR("Failed reading passwd file");
+		return -1;
+	}
+
 	return 0;
 
 #undef inst
@@ -503,10 +535,8 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 static int mod_detach(module_detach_ctx_t const *mctx)
 {
 	rlm_passwd_t *inst = talloc_get_type_abort(mctx->mi->data, rlm_passwd_t);
-	if (inst->ht) {
-		release_ht(inst->ht);
-		inst->ht = NULL;
-	}
+
+	talloc_free(inst->reload);
 	talloc_free(inst->pwd_fmt);
 	return 0;
 }
@@ -563,6 +593,7 @@ static void result_add(TALLOC_CTX *ctx, rlm_passwd_t const *inst, request_t *req
 static unlang_action_t CC_HINT(nonnull) mod_passwd_map(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_passwd_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_passwd_t);
+	struct hashtable	*ht = fr_reload_data(inst->reload);
 
 	char			buffer[1024];
 	fr_pair_t		*key, *i;
@@ -587,14 +618,14 @@ static unlang_action_t CC_HINT(nonnull) mod_passwd_map(rlm_rcode_t *p_result, mo
 		buffer[0] = '\0';
 #endif
 		fr_pair_print_value_quoted(&FR_SBUFF_OUT(buffer, sizeof(buffer)), i, T_BARE_WORD);
-		pw = get_pw_nam(buffer, inst->ht, &last_found);
+		pw = get_pw_nam(buffer, ht, &last_found);
 		if (!pw) continue;
 
 		do {
 			result_add(request->control_ctx, inst, request, &request->control_pairs, pw, 0, "config");
 			result_add(request->reply_ctx, inst, request, &request->reply_pairs, pw, 1, "reply_items");
 			result_add(request->request_ctx, inst, request, &request->request_pairs, pw, 2, "request_items");
-		} while ((pw = get_next(buffer, inst->ht, &last_found)));
+		} while ((pw = get_next(buffer, ht, &last_found)));
 
 		found++;
 
@@ -73,9 +73,12 @@ typedef struct {
 	char const	*func_detach;
 	char const	*func_post_auth;
 	char const	*perl_flags;
+	bool		lazy_clone;		//!< Only clone the interpreter when a thread first uses it.
+	bool		pair_hashes;		//!< Copy the pair lists to and from the %RAD_* hashes.
 	PerlInterpreter	*perl;
 	bool		perl_parsed;
 	HV		*rad_perlconf_hv;	//!< holds "config" items (perl %RAD_PERLCONF hash).
+	CONF_SECTION	*perlconf_cs;		//!< "config" section, read by radiusd::config().
 
 } rlm_perl_t;
 
@@ -85,6 +88,14 @@ typedef struct {
 
 static void *perl_dlhandle;		//!< To allow us to load perl's symbols into the global symbol table.
 
+/** Serialises cloning of the parent interpreters
+ *
+ * With lazy_clone, threads clone the parent interpreter whenever they
+ * first need it, and perl_clone() isn't safe to call concurrently on
+ * the same interpreter.
+ */
+static pthread_mutex_t perl_clone_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
@@ -103,6 +114,10 @@ static const conf_parser_t module_config[] = {
 
 	{ FR_CONF_OFFSET("perl_flags", rlm_perl_t, perl_flags) },
 
+	{ FR_CONF_OFFSET("lazy_clone", rlm_perl_t, lazy_clone), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("pair_hashes", rlm_perl_t, pair_hashes), .dflt = "yes" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -112,6 +127,7 @@ static const conf_parser_t module_config[] = {
 EXTERN_C void boot_DynaLoader(pTHX_ CV* cv);
 
 static _Thread_local request_t *rlm_perl_request;
+static _Thread_local rlm_perl_t const *rlm_perl_inst;
 
 #  define dl_librefs "DynaLoader::dl_librefs"
 #  define dl_modules "DynaLoader::dl_modules"
@@ -231,6 +247,184 @@ static XS(XS_radiusd_xlat)
 	XSRETURN(1);
 }
 
+/** Find the pair list, and its talloc ctx, that a radiusd::pair_* call refers to
+ *
+ */
+static fr_pair_list_t *perl_pair_list(TALLOC_CTX **ctx, request_t *request, char const *name)
+{
+	if (strcmp(name, "request") == 0) {
+		*ctx = request->request_ctx;
+		return &request->request_pairs;
+	}
+	if (strcmp(name, "reply") == 0) {
+		*ctx = request->reply_ctx;
+		return &request->reply_pairs;
+	}
+	if (strcmp(name, "control") == 0) {
+		*ctx = request->control_ctx;
+		return &request->control_pairs;
+	}
+	if (strcmp(name, "session-state") == 0) {
+		*ctx = request->session_state_ctx;
+		return &request->session_state_pairs;
+	}
+
+	return NULL;
+}
+
+static SV *perl_vp_to_sv(fr_pair_t const *vp)
+{
+	SV *sv;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		sv = newSVpvn(vp->vp_strvalue, vp->vp_length);
+		break;
+
+	case FR_TYPE_OCTETS:
+		sv = newSVpvn((char const *)vp->vp_octets, vp->vp_length);
+		break;
+
+	default:
+	{
+		char	buffer[1024];
+		ssize_t	slen;
+
+		slen = fr_pair_print_value_quoted(&FR_SBUFF_OUT(buffer, sizeof(buffer)), vp, T_BARE_WORD);
+		if (slen < 0) return NULL;
+
+		sv = newSVpvn(buffer, (size_t)slen);
+	}
+		break;
+	}
+
+	if (sv) SvTAINT(sv);
+
+	return sv;
+}
+
+/*
+ *	Read pairs directly from the request, without needing the
+ *	%RAD_* hashes.  Returns all the values of the attribute, e.g.
+ *
+ *	my @classes = radiusd::pair_get('reply', 'Class');
+ */
+static XS(XS_radiusd_pair_get)
+{
+	dXSARGS;
+	request_t		*request = rlm_perl_request;
+	fr_pair_list_t		*list;
+	TALLOC_CTX		*ctx;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp = NULL;
+	char const		*list_name, *attr;
+	int			count = 0;
+
+	if (items != 2) croak("Usage: radiusd::pair_get(list, attribute)");
+	if (!request) XSRETURN_EMPTY;
+
+	list_name = SvPV_nolen(ST(0));
+	attr = SvPV_nolen(ST(1));
+
+	list = perl_pair_list(&ctx, request, list_name);
+	if (!list) croak("radiusd::pair_get: Unknown list '%s'", list_name);
+
+	da = fr_dict_attr_search_by_qualified_oid(NULL, request->dict, attr, true, true);
+	if (!da) XSRETURN_EMPTY;
+
+	SP -= items;
+	while ((vp = fr_pair_find_by_da_nested(list, vp, da))) {
+		SV *sv = perl_vp_to_sv(vp);
+
+		if (!sv) continue;
+
+		XPUSHs(sv_2mortal(sv));
+		count++;
+	}
+
+	XSRETURN(count);
+}
+
+static int pairadd_sv(TALLOC_CTX *ctx, request_t *request, fr_pair_list_t *vps, char *key, SV *sv,
+		      const char *hash_name, const char *list_name);
+
+/*
+ *	Replace all instances of an attribute in a list.  Passing
+ *	no values deletes the attribute, e.g.
+ *
+ *	radiusd::pair_set('reply', 'Reply-Message', 'Hello');
+ */
+static XS(XS_radiusd_pair_set)
+{
+	dXSARGS;
+	request_t		*request = rlm_perl_request;
+	fr_pair_list_t		*list;
+	TALLOC_CTX		*ctx;
+	fr_dict_attr_t const	*da;
+	char const		*list_name;
+	char			*attr;
+	int			i, count = 0;
+
+	if (items < 2) croak("Usage: radiusd::pair_set(list, attribute, value, ...)");
+	if (!request) XSRETURN_UNDEF;
+
+	list_name = SvPV_nolen(ST(0));
+	attr = SvPV_nolen(ST(1));
+
+	list = perl_pair_list(&ctx, request, list_name);
+	if (!list) croak("radiusd::pair_set: Unknown list '%s'", list_name);
+
+	da = fr_dict_attr_search_by_qualified_oid(NULL, request->dict, attr, true, true);
+	if (!da) {
+		REDEBUG("Ignoring unknown attribute '%s'", attr);
+		XSRETURN_UNDEF;
+	}
+
+	fr_pair_delete_by_da_nested(list, da);
+
+	for (i = 2; i < items; i++) {
+		if (pairadd_sv(ctx, request, list, attr, ST(i), "pair_set", list_name) < 0) continue;
+		count++;
+	}
+
+	XSRETURN_IV(count);
+}
+
+/*
+ *	Read an item from the module's "config" section.  Unlike
+ *	%RAD_PERLCONF, the value isn't copied into every thread's
+ *	interpreter, e.g.
+ *
+ *	my $name = radiusd::config('sub-config', 'name');
+ */
+static XS(XS_radiusd_config)
+{
+	dXSARGS;
+	rlm_perl_t const	*inst = rlm_perl_inst;
+	CONF_SECTION		*cs;
+	CONF_PAIR		*cp;
+	char const		*value;
+	int			i;
+
+	if (items < 1) croak("Usage: radiusd::config(section, ..., name)");
+	if (!inst || !inst->perlconf_cs) XSRETURN_UNDEF;
+
+	cs = inst->perlconf_cs;
+	for (i = 0; i < (items - 1); i++) {
+		cs = cf_section_find(cs, SvPV_nolen(ST(i)), NULL);
+		if (!cs) XSRETURN_UNDEF;
+	}
+
+	cp = cf_pair_find(cs, SvPV_nolen(ST(items - 1)));
+	if (!cp) XSRETURN_UNDEF;
+
+	value = cf_pair_value(cp);
+	if (!value) XSRETURN_UNDEF;
+
+	ST(0) = sv_2mortal(newSVpv(value, 0));
+	XSRETURN(1);
+}
+
 static void xs_init(pTHX)
 {
 	char const *file = __FILE__;
@@ -240,6 +434,9 @@ static void xs_init(pTHX)
 
 	newXS("radiusd::log",XS_radiusd_log, "rlm_perl");
 	newXS("radiusd::xlat",XS_radiusd_xlat, "rlm_perl");
+	newXS("radiusd::pair_get", XS_radiusd_pair_get, "rlm_perl");
+	newXS("radiusd::pair_set", XS_radiusd_pair_set, "rlm_perl");
+	newXS("radiusd::config", XS_radiusd_config, "rlm_perl");
 }
 
 /** Convert a list of value boxes to a Perl array for passing to subroutines
@@ -420,6 +617,8 @@ static xlat_arg_parser_t const perl_xlat_args[] = {
 	XLAT_ARG_PARSER_TERMINATOR
 };
 
+static PerlInterpreter *rlm_perl_thread_interp(rlm_perl_t const *inst, rlm_perl_thread_t *t);
+
 /** Call perl code using an xlat
  *
  * @ingroup xlat_functions
@@ -428,7 +627,9 @@ static xlat_action_t perl_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 			       xlat_ctx_t const *xctx,
 			       request_t *request, fr_value_box_list_t *in)
 {
-	rlm_perl_thread_t const		*t = talloc_get_type_abort_const(xctx->mctx->thread, rlm_perl_thread_t);
+	rlm_perl_t const		*inst = talloc_get_type_abort_const(xctx->mctx->mi->data, rlm_perl_t);
+	rlm_perl_thread_t		*t = talloc_get_type_abort(xctx->mctx->thread, rlm_perl_thread_t);
+	PerlInterpreter			*interp;
 	int				count, i;
 	xlat_action_t			ret = XLAT_ACTION_FAIL;
 	STRLEN				n_a;
@@ -442,9 +643,12 @@ static xlat_action_t perl_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	fr_value_box_list_init(&list);
 	fr_value_box_list_init(&sub_list);
 
+	interp = rlm_perl_thread_interp(inst, t);
+	if (!interp) return XLAT_ACTION_FAIL;
+
 	{
-		dTHXa(t->perl);
-		PERL_SET_CONTEXT(t->perl);
+		dTHXa(interp);
+		PERL_SET_CONTEXT(interp);
 	}
 
 	{
@@ -482,8 +686,13 @@ static xlat_action_t perl_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 
 		PUTBACK;
 
+		rlm_perl_request = request;
+		rlm_perl_inst = inst;
+
 		count = call_pv(func->vb_strvalue, G_ARRAY | G_EVAL);
 
+		rlm_perl_request = NULL;
+
 		SPAGAIN;
 		if (SvTRUE(ERRSV)) {
 			REDEBUG("Exit %s", SvPV(ERRSV,n_a));
@@ -822,15 +1031,24 @@ static unlang_action_t do_perl(rlm_rcode_t *p_result, module_ctx_t const *mctx,
 		rad_request_hv = get_hv("RAD_REQUEST", 1);
 		rad_state_hv = get_hv("RAD_STATE", 1);
 
-		perl_store_vps(request->request_ctx, request, &request->request_pairs, rad_request_hv, "RAD_REQUEST", "request");
-		perl_store_vps(request->reply_ctx, request, &request->reply_pairs, rad_reply_hv, "RAD_REPLY", "reply");
-		perl_store_vps(request->control_ctx, request, &request->control_pairs, rad_config_hv, "RAD_CONFIG", "control");
-		perl_store_vps(request->session_state_ctx, request, &request->session_state_pairs, rad_state_hv, "RAD_STATE", "session-state");
+		/*
+		 *	Building the hashes means copying, and sorting,
+		 *	every pair on every call.  Scripts which only
+		 *	look at a few attributes can turn it off, and use
+		 *	radiusd::pair_get() and radiusd::pair_set().
+		 */
+		if (inst->pair_hashes) {
+			perl_store_vps(request->request_ctx, request, &request->request_pairs, rad_request_hv, "RAD_REQUEST", "request");
+			perl_store_vps(request->reply_ctx, request, &request->reply_pairs, rad_reply_hv, "RAD_REPLY", "reply");
+			perl_store_vps(request->control_ctx, request, &request->control_pairs, rad_config_hv, "RAD_CONFIG", "control");
+			perl_store_vps(request->session_state_ctx, request, &request->session_state_pairs, rad_state_hv, "RAD_STATE", "session-state");
+		}
 
 		/*
 		 * Store pointer to request structure globally so radiusd::xlat works
 		 */
 		rlm_perl_request = request;
+		rlm_perl_inst = inst;
 
 		PUSHMARK(SP);
 		/*
@@ -864,6 +1082,8 @@ static unlang_action_t do_perl(rlm_rcode_t *p_result, module_ctx_t const *mctx,
 		FREETMPS;
 		LEAVE;
 
+		if (!inst->pair_hashes) RETURN_MODULE_RCODE(ret);
+
 		fr_pair_list_init(&vps);
 		if ((get_hv_content(request->request_ctx, request, rad_request_hv, &vps, "RAD_REQUEST", "request")) > 0) {
 			fr_pair_list_free(&request->request_pairs);
@@ -893,9 +1113,11 @@ static unlang_action_t do_perl(rlm_rcode_t *p_result, module_ctx_t const *mctx,
 static unlang_action_t CC_HINT(nonnull) mod_##_x(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request) \
 { \
 	rlm_perl_t *inst = talloc_get_type_abort(mctx->mi->data, rlm_perl_t); \
-	return do_perl(p_result, mctx, request, \
-		       ((rlm_perl_thread_t *)talloc_get_type_abort(mctx->thread, rlm_perl_thread_t))->perl, \
-		       inst->func_##_x); \
+	PerlInterpreter *interp; \
+	if (!inst->func_##_x) RETURN_MODULE_FAIL; \
+	interp = rlm_perl_thread_interp(inst, talloc_get_type_abort(mctx->thread, rlm_perl_thread_t)); \
+	if (!interp) RETURN_MODULE_FAIL; \
+	return do_perl(p_result, mctx, request, interp, inst->func_##_x); \
 }
 
 RLM_PERL_FUNC(authorize)
@@ -934,16 +1156,26 @@ static void rlm_perl_interp_free(PerlInterpreter *perl)
 DIAG_ON(shadow)
 DIAG_ON(DIAG_UNKNOWN_PRAGMAS)
 
-static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+/** Clone the parent interpreter for the current thread
+ *
+ * Everything the script loaded in the parent, including any CPAN
+ * modules, is copied into the clone.  perl_clone() has no copy-on-write
+ * mode, so the only ways of reducing the per-thread cost are to clone
+ * fewer interpreters (lazy_clone), and to keep large data out of the
+ * interpreters (radiusd::config()).
+ */
+static PerlInterpreter *rlm_perl_clone(rlm_perl_t const *inst)
 {
-	rlm_perl_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_perl_t);
-	rlm_perl_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_perl_thread_t);
 	PerlInterpreter		*interp;
 	UV			clone_flags = 0;
 
+	pthread_mutex_lock(&perl_clone_mutex);
 	PERL_SET_CONTEXT(inst->perl);
 
 	interp = perl_clone(inst->perl, clone_flags);
+	pthread_mutex_unlock(&perl_clone_mutex);
+	if (!interp) return NULL;
+
 	{
 		dTHXa(interp);			/* Sets the current thread's interpreter */
 	}
@@ -956,7 +1188,34 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 	PERL_SET_CONTEXT(aTHX);
 	rlm_perl_clear_handles(aTHX);
 
-	t->perl = interp;			/* Store perl interp for easy freeing later */
+	return interp;
+}
+
+/** Return this thread's interpreter, cloning it if it doesn't exist yet
+ *
+ */
+static PerlInterpreter *rlm_perl_thread_interp(rlm_perl_t const *inst, rlm_perl_thread_t *t)
+{
+	if (likely(t->perl != NULL)) return t->perl;
+
+	t->perl = rlm_perl_clone(inst);	/* Store perl interp for easy freeing later */
+	if (!t->perl) ERROR("Failed cloning perl interpreter");
+
+	return t->perl;
+}
+
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_perl_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_perl_t);
+	rlm_perl_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_perl_thread_t);
+
+	/*
+	 *	Threads which never call the module never pay
+	 *	for a copy of the interpreter.
+	 */
+	if (inst->lazy_clone) return 0;
+
+	if (!rlm_perl_thread_interp(inst, t)) return -1;
 
 	return 0;
 }
@@ -965,7 +1224,7 @@ static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
 {
 	rlm_perl_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_perl_thread_t);
 
-	rlm_perl_interp_free(t->perl);
+	if (t->perl) rlm_perl_interp_free(t->perl);
 
 	return 0;
 }
@@ -995,8 +1254,6 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	int		ret = 0, argc = 0;
 	char		arg[] = "0";
 
-	CONF_SECTION	*cs;
-
 	/*
 	 *	Setup the argument array we pass to the perl interpreter
 	 */
@@ -1033,6 +1290,13 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	PL_exit_flags |= PERL_EXIT_DESTRUCT_END;
 #endif
 
+	/*
+	 *	So that radiusd::config() works when the script
+	 *	is loaded.
+	 */
+	inst->perlconf_cs = cf_section_find(conf, "config", NULL);
+	rlm_perl_inst = inst;
+
 	ret = perl_parse(inst->perl, xs_init, argc, embed, NULL);
 
 	end_AV = PL_endav;
@@ -1040,20 +1304,21 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 
 	if (ret) {
 		ERROR("Perl_parse failed: %s not found or has syntax errors", inst->module);
+		rlm_perl_inst = NULL;
 		return -1;
 	}
 
 	/* parse perl configuration sub-section */
-	cs = cf_section_find(conf, "config", NULL);
-	if (cs) {
+	if (inst->perlconf_cs) {
 		inst->rad_perlconf_hv = get_hv("RAD_PERLCONF", 1);
-		perl_parse_config(cs, 0, inst->rad_perlconf_hv);
+		perl_parse_config(inst->perlconf_cs, 0, inst->rad_perlconf_hv);
 	}
 
 	inst->perl_parsed = true;
 	perl_run(inst->perl);
 
 	PL_endav = end_AV;
+	rlm_perl_inst = NULL;
 
 	return 0;
 }
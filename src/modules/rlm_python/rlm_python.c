@@ -51,14 +51,12 @@ typedef struct {
 	char const	*function_name;		//!< String name of function in module.
 } python_func_def_t;
 
-/** An instance of the rlm_python module
+/** The functions to call for each section
  *
+ * Python objects are only valid in the interpreter which created them,
+ * so each interpreter loads its own set.
  */
 typedef struct {
-	char const	*name;			//!< Name of the module instance
-	PyThreadState	*interpreter;		//!< The interpreter used for this instance of rlm_python.
-	PyObject	*module;		//!< Local, interpreter specific module.
-
 	python_func_def_t
 	instantiate,
 	authorize,
@@ -67,6 +65,23 @@ typedef struct {
 	accounting,
 	post_auth,
 	detach;
+} python_funcs_t;
+
+/** An instance of the rlm_python module
+ *
+ */
+typedef struct {
+	char const	*name;			//!< Name of the module instance
+	PyThreadState	*interpreter;		//!< The interpreter used for this instance of rlm_python.
+	PyObject	*module;		//!< Local, interpreter specific module.
+
+	python_funcs_t	funcs;			//!< Loaded into the instance's interpreter.
+
+	bool		per_thread_interpreter;	//!< Give each thread its own interpreter, with its own GIL.
+	bool		pair_view;		//!< Pass request pairs as a read-only mapping, rather
+						///< than as a tuple of tuples.
+
+	PyObject	*pair_view_type;	//!< Type of the pair view, in the instance's interpreter.
 
 	PyObject	*pythonconf_dict;	//!< Configuration parameters defined in the module
 						//!< made available to the python script.
@@ -84,9 +99,20 @@ typedef struct {
  *
  * Multiple instances of python create multiple interpreters and each
  * thread must have a PyThreadState per interpreter, to track execution.
+ *
+ * With per_thread_interpreter, the thread state is instead the main
+ * thread state of an interpreter which belongs to this thread alone.
  */
 typedef struct {
-	PyThreadState	*state;			//!< Module instance/thread specific state.
+	PyThreadState		*state;			//!< Module instance/thread specific state.
+	python_funcs_t const	*funcs;			//!< The instance's functions, or interp_funcs.
+	PyObject		*pair_view_type;	//!< The instance's pair view type, or our own.
+
+	PyThreadState		*main_state;		//!< Main interpreter thread state, used to create
+							///< and destroy the thread's interpreter.
+	PyObject		*module;		//!< freeradius module in the thread's interpreter.
+	PyObject		*pythonconf_dict;	//!< radiusd.config in the thread's interpreter.
+	python_funcs_t		interp_funcs;		//!< Loaded into the thread's interpreter.
 } rlm_python_thread_t;
 
 static void			*python_dlhandle;
@@ -146,8 +172,8 @@ global_lib_autoinst_t const * const rlm_python_lib[] = {
  */
 static conf_parser_t module_config[] = {
 
-#define A(x) { FR_CONF_OFFSET("mod_" #x, rlm_python_t, x.module_name), .dflt = "${.module}" }, \
-	{ FR_CONF_OFFSET("func_" #x, rlm_python_t, x.function_name) },
+#define A(x) { FR_CONF_OFFSET("mod_" #x, rlm_python_t, funcs.x.module_name), .dflt = "${.module}" }, \
+	{ FR_CONF_OFFSET("func_" #x, rlm_python_t, funcs.x.function_name) },
 
 	A(instantiate)
 	A(authorize)
@@ -159,6 +185,9 @@ static conf_parser_t module_config[] = {
 
 #undef A
 
+	{ FR_CONF_OFFSET("per_thread_interpreter", rlm_python_t, per_thread_interpreter), .dflt = "no" },
+	{ FR_CONF_OFFSET("pair_view", rlm_python_t, pair_view), .dflt = "no" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -366,18 +395,17 @@ static void mod_vptuple(TALLOC_CTX *ctx, module_ctx_t const *mctx, request_t *re
 }
 
 
-/*
- *	This is the core Python function that the others wrap around.
- *	Pass the value-pair print strings in a tuple.
+/** Convert the value of a pair to a Python object
+ *
+ * @return
+ *	- The new object.
+ *	- Py_None (with a new reference) for structural types.
+ *	- NULL on error.
  */
-static int mod_populate_vptuple(module_ctx_t const *mctx, request_t *request, PyObject *pp, fr_pair_t *vp)
+static PyObject *python_pair_value(fr_pair_t const *vp)
 {
-	PyObject *attribute = NULL;
 	PyObject *value = NULL;
 
-	attribute = PyUnicode_FromString(vp->da->name);
-	if (!attribute) return -1;
-
 	switch (vp->vp_type) {
 	case FR_TYPE_STRING:
 		value = PyUnicode_FromStringAndSize(vp->vp_strvalue, vp->vp_length);
@@ -450,22 +478,40 @@ static int mod_populate_vptuple(module_ctx_t const *mctx, request_t *request, Py
 		char buffer[256];
 
 		slen = fr_value_box_print(&FR_SBUFF_OUT(buffer, sizeof(buffer)), &vp->data, NULL);
-		if (slen < 0) {
-		error:
-			ROPTIONAL(REDEBUG, ERROR, "Failed marshalling %pP to Python value", vp);
-			python_error_log(mctx, request);
-			Py_XDECREF(attribute);
-			return -1;
-		}
+		if (slen < 0) return NULL;
+
 		value = PyUnicode_FromStringAndSize(buffer, (size_t)slen);
 	}
 		break;
 
 	case FR_TYPE_NON_LEAF:
-		return 0;
+		Py_RETURN_NONE;
 	}
 
-	if (value == NULL) goto error;
+	return value;
+}
+
+/*
+ *	This is the core Python function that the others wrap around.
+ *	Pass the value-pair print strings in a tuple.
+ */
+static int mod_populate_vptuple(module_ctx_t const *mctx, request_t *request, PyObject *pp, fr_pair_t *vp)
+{
+	PyObject *attribute = NULL;
+	PyObject *value = NULL;
+
+	if (fr_type_is_non_leaf(vp->vp_type)) return 0;
+
+	attribute = PyUnicode_FromString(vp->da->name);
+	if (!attribute) return -1;
+
+	value = python_pair_value(vp);
+	if (value == NULL) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed marshalling %pP to Python value", vp);
+		python_error_log(mctx, request);
+		Py_XDECREF(attribute);
+		return -1;
+	}
 
 	PyTuple_SET_ITEM(pp, 0, attribute);
 	PyTuple_SET_ITEM(pp, 1, value);
@@ -473,12 +519,136 @@ static int mod_populate_vptuple(module_ctx_t const *mctx, request_t *request, Py
 	return 0;
 }
 
+/** A read-only mapping of attribute names to values
+ *
+ * Values are only converted when the script asks for them, so the
+ * cost of a call doesn't depend on how many pairs the request has.
+ * The view is only valid for the duration of the call it was
+ * passed to.
+ */
+typedef struct {
+	PyObject_HEAD
+	request_t		*request;	//!< NULL once the call has returned.
+	fr_pair_list_t const	*list;		//!< Pairs to look up.
+} python_pair_view_t;
+
+static int python_pair_view_check(python_pair_view_t const *view)
+{
+	if (view->request) return 0;
+
+	PyErr_SetString(PyExc_RuntimeError, "Pair view used outside of the call it was passed to");
+	return -1;
+}
+
+static fr_dict_attr_t const *python_pair_view_da(python_pair_view_t const *view, PyObject *key)
+{
+	char const *name;
+
+	if (!PyUnicode_Check(key)) {
+		PyErr_SetString(PyExc_TypeError, "Attribute names must be strings");
+		return NULL;
+	}
+
+	name = PyUnicode_AsUTF8(key);
+	if (!name) return NULL;
+
+	return fr_dict_attr_search_by_qualified_oid(NULL, view->request->dict, name, true, true);
+}
+
+/** view['User-Name'] returns the value, or a tuple of values if there's more than one
+ *
+ */
+static PyObject *python_pair_view_subscript(PyObject *self, PyObject *key)
+{
+	python_pair_view_t	*view = (python_pair_view_t *)self;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp, *next;
+	PyObject		*values;
+	Py_ssize_t		i, num = 0;
+
+	if (python_pair_view_check(view) < 0) return NULL;
+
+	da = python_pair_view_da(view, key);
+	if (!da) {
+		if (!PyErr_Occurred()) PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	vp = fr_pair_find_by_da_nested(view->list, NULL, da);
+	if (!vp) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	next = fr_pair_find_by_da_nested(view->list, vp, da);
+	if (!next) return python_pair_value(vp);
+
+	for (next = vp; next; next = fr_pair_find_by_da_nested(view->list, next, da)) num++;
+
+	values = PyTuple_New(num);
+	if (!values) return NULL;
+
+	for (i = 0, next = vp; next; next = fr_pair_find_by_da_nested(view->list, next, da), i++) {
+		PyObject *value = python_pair_value(next);
+
+		if (!value) {
+			Py_DECREF(values);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(values, i, value);
+	}
+
+	return values;
+}
+
+static int python_pair_view_contains(PyObject *self, PyObject *key)
+{
+	python_pair_view_t	*view = (python_pair_view_t *)self;
+	fr_dict_attr_t const	*da;
+
+	if (python_pair_view_check(view) < 0) return -1;
+
+	da = python_pair_view_da(view, key);
+	if (!da) return PyErr_Occurred() ? -1 : 0;
+
+	return fr_pair_find_by_da_nested(view->list, NULL, da) != NULL;
+}
+
+static Py_ssize_t python_pair_view_length(PyObject *self)
+{
+	python_pair_view_t *view = (python_pair_view_t *)self;
+
+	if (python_pair_view_check(view) < 0) return -1;
+
+	return fr_pair_list_num_elements(view->list);
+}
+
+static PyType_Slot python_pair_view_slots[] = {
+	{ Py_mp_subscript, python_pair_view_subscript },
+	{ Py_mp_length, python_pair_view_length },
+	{ Py_sq_contains, python_pair_view_contains },
+	{ Py_tp_doc, UNCONST(char *, "Read-only view of the pairs in a list of the current request") },
+	{ 0, NULL }
+};
+
+/*
+ *	A heap type, as static types would be shared between
+ *	interpreters.  Each interpreter creates its own.
+ */
+static PyType_Spec python_pair_view_spec = {
+	.name = "freeradius.PairView",
+	.basicsize = sizeof(python_pair_view_t),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = python_pair_view_slots
+};
+
 static unlang_action_t do_python_single(rlm_rcode_t *p_result, module_ctx_t const *mctx,
 					request_t *request, PyObject *p_func, char const *funcname)
 {
 	fr_pair_t	*vp;
 	PyObject	*p_ret = NULL;
 	PyObject	*p_arg = NULL;
+	python_pair_view_t	*view = NULL;
 	int		tuple_len;
 	rlm_rcode_t	rcode = RLM_MODULE_OK;
 
@@ -495,7 +665,20 @@ static unlang_action_t do_python_single(rlm_rcode_t *p_result, module_ctx_t cons
 		tuple_len = fr_pair_list_num_elements(&request->request_pairs);
 	}
 
-	if (tuple_len == 0) {
+	if (request && mctx->thread &&
+	    ((rlm_python_thread_t *)mctx->thread)->pair_view_type) {
+		PyTypeObject *type = (PyTypeObject *)((rlm_python_thread_t *)mctx->thread)->pair_view_type;
+
+		view = PyObject_New(python_pair_view_t, type);
+		if (!view) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+		view->request = request;
+		view->list = &request->request_pairs;
+		p_arg = (PyObject *)view;
+
+	} else if (tuple_len == 0) {
 		Py_INCREF(Py_None);
 		p_arg = Py_None;
 	} else {
@@ -529,6 +712,12 @@ static unlang_action_t do_python_single(rlm_rcode_t *p_result, module_ctx_t cons
 
 	/* Call Python function. */
 	p_ret = PyObject_CallFunctionObjArgs(p_func, p_arg, NULL);
+
+	/*
+	 *	The script may have kept a reference to the view.
+	 */
+	if (view) view->request = NULL;
+
 	if (!p_ret) {
 		python_error_log(mctx, request); /* Needs valid thread with GIL */
 		rcode = RLM_MODULE_FAIL;
@@ -627,8 +816,8 @@ static unlang_action_t do_python(rlm_rcode_t *p_result, module_ctx_t const *mctx
 #define MOD_FUNC(x) \
 static unlang_action_t CC_HINT(nonnull) mod_##x(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request) \
 { \
-	rlm_python_t const *inst = talloc_get_type_abort_const(mctx->mi->data, rlm_python_t); \
-	return do_python(p_result, mctx, request, inst->x.function, #x);\
+	rlm_python_thread_t const *t = talloc_get_type_abort_const(mctx->thread, rlm_python_thread_t); \
+	return do_python(p_result, mctx, request, t->funcs->x.function, #x);\
 }
 
 MOD_FUNC(authenticate)
@@ -687,6 +876,40 @@ static int python_function_load(module_inst_ctx_t const *mctx, python_func_def_t
 	return 0;
 }
 
+/** Load all the functions for the sections, into the current interpreter
+ *
+ * @param[in] mctx	of the module instance.
+ * @param[out] funcs	to load.  The module and function names must
+ *			already be set.
+ */
+static int python_funcs_load(module_inst_ctx_t const *mctx, python_funcs_t *funcs)
+{
+#define PYTHON_FUNC_LOAD(_x) if (python_function_load(mctx, &funcs->_x) < 0) return -1
+	PYTHON_FUNC_LOAD(instantiate);
+	PYTHON_FUNC_LOAD(authenticate);
+	PYTHON_FUNC_LOAD(authorize);
+	PYTHON_FUNC_LOAD(preacct);
+	PYTHON_FUNC_LOAD(accounting);
+	PYTHON_FUNC_LOAD(post_auth);
+	PYTHON_FUNC_LOAD(detach);
+#undef PYTHON_FUNC_LOAD
+
+	return 0;
+}
+
+static void python_funcs_destroy(python_funcs_t *funcs)
+{
+#define PYTHON_FUNC_DESTROY(_x) python_function_destroy(&funcs->_x)
+	PYTHON_FUNC_DESTROY(instantiate);
+	PYTHON_FUNC_DESTROY(authorize);
+	PYTHON_FUNC_DESTROY(authenticate);
+	PYTHON_FUNC_DESTROY(preacct);
+	PYTHON_FUNC_DESTROY(accounting);
+	PYTHON_FUNC_DESTROY(post_auth);
+	PYTHON_FUNC_DESTROY(detach);
+#undef PYTHON_FUNC_DESTROY
+}
+
 /*
  *	Parse a configuration section, and populate a dict.
  *	This function is recursively called (allows to have nested dicts.)
@@ -774,21 +997,21 @@ static int python_parse_config(module_inst_ctx_t const *mctx, CONF_SECTION *cs,
 /** Make the current instance's config available within the module we're initialising
  *
  */
-static int python_module_import_config(module_inst_ctx_t const *mctx, CONF_SECTION *conf, PyObject *module)
+static int python_module_import_config(PyObject **dict_p, module_inst_ctx_t const *mctx,
+				       CONF_SECTION *conf, PyObject *module)
 {
-	rlm_python_t *inst = talloc_get_type_abort(mctx->mi->data, rlm_python_t);
 	CONF_SECTION *cs;
 
 	/*
 	 *	Convert a FreeRADIUS config structure into a python
 	 *	dictionary.
 	 */
-	inst->pythonconf_dict = PyDict_New();
-	if (!inst->pythonconf_dict) {
+	*dict_p = PyDict_New();
+	if (!*dict_p) {
 		ERROR("Unable to create python dict for config");
 	error:
-		Py_XDECREF(inst->pythonconf_dict);
-		inst->pythonconf_dict = NULL;
+		Py_XDECREF(*dict_p);
+		*dict_p = NULL;
 		python_error_log(MODULE_CTX_FROM_INST(mctx), NULL);
 		return -1;
 	}
@@ -796,13 +1019,13 @@ static int python_module_import_config(module_inst_ctx_t const *mctx, CONF_SECTI
 	cs = cf_section_find(conf, "config", NULL);
 	if (cs) {
 		DEBUG("Inserting \"config\" section into python environment as radiusd.config");
-		if (python_parse_config(mctx, cs, 0, inst->pythonconf_dict) < 0) goto error;
+		if (python_parse_config(mctx, cs, 0, *dict_p) < 0) goto error;
 	}
 
 	/*
 	 *	Add module configuration as a dict
 	 */
-	if (PyModule_AddObject(module, "config", inst->pythonconf_dict) < 0) goto error;
+	if (PyModule_AddObject(module, "config", *dict_p) < 0) goto error;
 
 	return 0;
 }
@@ -828,6 +1051,30 @@ static int python_module_import_constants(module_inst_ctx_t const *mctx, PyObjec
 /*
  *	Python 3 interpreter initialisation and destruction
  */
+#if PY_VERSION_HEX >= 0x030C0000
+/*
+ *	Sub-interpreters with their own GIL can only import modules
+ *	which use multi-phase initialisation, and say they support it.
+ */
+static PyModuleDef_Slot module_slots[] = {
+	{ Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+	{ 0, NULL }
+};
+
+static PyObject *python_module_init(void)
+{
+	static struct PyModuleDef py_module_def = {
+		PyModuleDef_HEAD_INIT,
+		.m_name = "freeradius",
+		.m_doc = "freeRADIUS python module",
+		.m_size = 0,
+		.m_methods = module_methods,
+		.m_slots = module_slots
+	};
+
+	return PyModuleDef_Init(&py_module_def);
+}
+#else
 static PyObject *python_module_init(void)
 {
 	PyObject		*module;
@@ -850,6 +1097,7 @@ static PyObject *python_module_init(void)
 
 	return module;
 }
+#endif
 
 static int python_interpreter_init(module_inst_ctx_t const *mctx)
 {
@@ -888,7 +1136,7 @@ static int python_interpreter_init(module_inst_ctx_t const *mctx)
  		ERROR("Failed importing \"freeradius\" module into interpreter %p", inst->interpreter);
  		return -1;
  	}
-	if ((python_module_import_config(mctx, conf, module) < 0) ||
+	if ((python_module_import_config(&inst->pythonconf_dict, mctx, conf, module) < 0) ||
 	    (python_module_import_constants(mctx, module) < 0)) {
 		Py_DECREF(module);
 		return -1;
@@ -928,6 +1176,13 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	rlm_python_t	*inst = talloc_get_type_abort(mctx->mi->data, rlm_python_t);
 
+#if PY_VERSION_HEX < 0x030C0000
+	if (inst->per_thread_interpreter) {
+		cf_log_err(mctx->mi->conf, "per_thread_interpreter requires Python 3.12 or later");
+		return -1;
+	}
+#endif
+
 	if (python_interpreter_init(mctx) < 0) return -1;
 
 	/*
@@ -938,22 +1193,23 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	/*
 	 *	Process the various sections
 	 */
-#define PYTHON_FUNC_LOAD(_x) if (python_function_load(mctx, &inst->_x) < 0) goto error
-	PYTHON_FUNC_LOAD(instantiate);
-	PYTHON_FUNC_LOAD(authenticate);
-	PYTHON_FUNC_LOAD(authorize);
-	PYTHON_FUNC_LOAD(preacct);
-	PYTHON_FUNC_LOAD(accounting);
-	PYTHON_FUNC_LOAD(post_auth);
-	PYTHON_FUNC_LOAD(detach);
+	if (python_funcs_load(mctx, &inst->funcs) < 0) goto error;
+
+	if (inst->pair_view) {
+		inst->pair_view_type = PyType_FromSpec(&python_pair_view_spec);
+		if (!inst->pair_view_type) {
+			python_error_log(MODULE_CTX_FROM_INST(mctx), NULL);
+			goto error;
+		}
+	}
 
 	/*
 	 *	Call the instantiate function.
 	 */
-	if (inst->instantiate.function) {
+	if (inst->funcs.instantiate.function) {
 		rlm_rcode_t rcode;
 
-		do_python_single(&rcode, MODULE_CTX_FROM_INST(mctx), NULL, inst->instantiate.function, "instantiate");
+		do_python_single(&rcode, MODULE_CTX_FROM_INST(mctx), NULL, inst->funcs.instantiate.function, "instantiate");
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 		case RLM_MODULE_REJECT:
@@ -994,21 +1250,15 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 	/*
 	 *	We don't care if this fails.
 	 */
-	if (inst->detach.function) {
+	if (inst->funcs.detach.function) {
 		rlm_rcode_t rcode;
 
-		(void)do_python_single(&rcode, MODULE_CTX_FROM_INST(mctx), NULL, inst->detach.function, "detach");
+		(void)do_python_single(&rcode, MODULE_CTX_FROM_INST(mctx), NULL, inst->funcs.detach.function, "detach");
 	}
 
-#define PYTHON_FUNC_DESTROY(_x) python_function_destroy(&inst->_x)
-	PYTHON_FUNC_DESTROY(instantiate);
-	PYTHON_FUNC_DESTROY(authorize);
-	PYTHON_FUNC_DESTROY(authenticate);
-	PYTHON_FUNC_DESTROY(preacct);
-	PYTHON_FUNC_DESTROY(accounting);
-	PYTHON_FUNC_DESTROY(post_auth);
-	PYTHON_FUNC_DESTROY(detach);
+	python_funcs_destroy(&inst->funcs);
 
+	Py_XDECREF(inst->pair_view_type);
 	Py_XDECREF(inst->pythonconf_dict);
 	PyEval_SaveThread();
 
@@ -1020,12 +1270,142 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 	return 0;
 }
 
+#if PY_VERSION_HEX >= 0x030C0000
+/** Create an interpreter, with its own GIL, for the current thread
+ *
+ * The thread's interpreter loads its own copy of the user's module,
+ * and calls its own instantiate function, so that Python code in
+ * different threads can run in parallel.
+ */
+static int python_thread_interpreter_init(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_python_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_python_t);
+	rlm_python_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t);
+	module_inst_ctx_t const	*inst_mctx = (module_inst_ctx_t const *)mctx;
+	PyStatus		status;
+	PyObject		*module;
+	PyInterpreterConfig	config = {
+		.use_main_obmalloc = 0,
+		.allow_fork = 0,
+		.allow_exec = 0,
+		.allow_threads = 1,
+		.allow_daemon_threads = 0,
+		.check_multi_interp_extensions = 1,
+		.gil = PyInterpreterConfig_OWN_GIL,
+	};
+
+	/*
+	 *	Creating an interpreter requires the GIL, and a thread
+	 *	state, for an existing interpreter.  The main
+	 *	interpreter's GIL is released once the new interpreter
+	 *	has been created.
+	 */
+	t->main_state = PyThreadState_New(global_interpreter->interp);
+	if (!t->main_state) {
+		ERROR("Failed initialising local PyThreadState");
+		return -1;
+	}
+	PyEval_RestoreThread(t->main_state);
+
+	LSAN_DISABLE(status = Py_NewInterpreterFromConfig(&t->state, &config));
+	if (PyStatus_Exception(status)) {
+		ERROR("Failed creating thread interpreter: %s", status.err_msg);
+		PyThreadState_Clear(t->main_state);
+		PyThreadState_DeleteCurrent();	/* Releases the GIL */
+		t->main_state = NULL;
+		t->state = NULL;
+		return -1;
+	}
+	DEBUG3("Created new thread interpreter %p", t->state);
+
+	module = PyImport_ImportModule("freeradius");
+	if (!module) {
+		ERROR("Failed importing \"freeradius\" module into interpreter %p", t->state);
+	error:
+		python_error_log(MODULE_CTX(mctx->mi, mctx->thread, NULL, NULL), NULL);
+		PyEval_SaveThread();
+		return -1;
+	}
+	t->module = module;
+
+	if ((python_module_import_config(&t->pythonconf_dict, inst_mctx, mctx->mi->conf, module) < 0) ||
+	    (python_module_import_constants(inst_mctx, module) < 0)) goto error;
+
+	/*
+	 *	Same names as the instance, but the objects are our own.
+	 */
+	t->interp_funcs = inst->funcs;
+#define PYTHON_FUNC_CLEAR(_x) t->interp_funcs._x.module = t->interp_funcs._x.function = NULL
+	PYTHON_FUNC_CLEAR(instantiate);
+	PYTHON_FUNC_CLEAR(authorize);
+	PYTHON_FUNC_CLEAR(authenticate);
+	PYTHON_FUNC_CLEAR(preacct);
+	PYTHON_FUNC_CLEAR(accounting);
+	PYTHON_FUNC_CLEAR(post_auth);
+	PYTHON_FUNC_CLEAR(detach);
+#undef PYTHON_FUNC_CLEAR
+
+	if (python_funcs_load(inst_mctx, &t->interp_funcs) < 0) goto error;
+	t->funcs = &t->interp_funcs;
+
+	if (inst->pair_view) {
+		t->pair_view_type = PyType_FromSpec(&python_pair_view_spec);
+		if (!t->pair_view_type) goto error;
+	}
+
+	if (t->interp_funcs.instantiate.function) {
+		rlm_rcode_t rcode;
+
+		do_python_single(&rcode, MODULE_CTX(mctx->mi, mctx->thread, NULL, NULL), NULL,
+				 t->interp_funcs.instantiate.function, "instantiate");
+		if ((rcode == RLM_MODULE_FAIL) || (rcode == RLM_MODULE_REJECT)) {
+			PyEval_SaveThread();
+			return -1;
+		}
+	}
+
+	PyEval_SaveThread();		/* Unlock the thread interpreter's GIL */
+
+	return 0;
+}
+
+static void python_thread_interpreter_free(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_python_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t);
+
+	if (!t->state) return;
+
+	PyEval_RestoreThread(t->state);
+
+	if (t->interp_funcs.detach.function) {
+		rlm_rcode_t rcode;
+
+		(void)do_python_single(&rcode, MODULE_CTX(mctx->mi, mctx->thread, NULL, NULL), NULL,
+				       t->interp_funcs.detach.function, "detach");
+	}
+
+	python_funcs_destroy(&t->interp_funcs);
+	Py_XDECREF(t->pair_view_type);
+	Py_XDECREF(t->module);
+
+	Py_EndInterpreter(t->state);	/* Destroys interpreter (GIL still locked) - sets thread state to NULL */
+
+	PyEval_RestoreThread(t->main_state);
+	PyThreadState_Clear(t->main_state);
+	PyThreadState_DeleteCurrent();	/* Releases the main interpreter's GIL */
+}
+#endif
+
 static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 {
 	PyThreadState		*state;
 	rlm_python_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_python_t);
 	rlm_python_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t);
 
+#if PY_VERSION_HEX >= 0x030C0000
+	if (inst->per_thread_interpreter) return python_thread_interpreter_init(mctx);
+#endif
+
 	state = PyThreadState_New(inst->interpreter->interp);
 	if (!state) {
 		ERROR("Failed initialising local PyThreadState");
@@ -1034,6 +1414,8 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 
 	DEBUG3("Initialised new thread state %p", state);
 	t->state = state;
+	t->funcs = &inst->funcs;
+	t->pair_view_type = inst->pair_view_type;
 
 	return 0;
 }
@@ -1042,6 +1424,15 @@ static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
 {
 	rlm_python_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_python_thread_t);
 
+#if PY_VERSION_HEX >= 0x030C0000
+	rlm_python_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_python_t);
+
+	if (inst->per_thread_interpreter) {
+		python_thread_interpreter_free(mctx);
+		return 0;
+	}
+#endif
+
 	PyEval_RestoreThread(t->state);	/* Swap in our local thread state */
 	PyThreadState_Clear(t->state);
 	PyEval_SaveThread();
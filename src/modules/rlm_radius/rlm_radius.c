@@ -39,6 +39,8 @@ static conf_parser_t const status_check_config[] = {
 	{ FR_CONF_OFFSET_TYPE_FLAGS("type", FR_TYPE_VOID, 0, rlm_radius_t, status_check),
 	  .func = status_check_type_parse },
 
+	{ FR_CONF_OFFSET("extended_id", rlm_radius_t, extended_id) },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -111,6 +113,10 @@ static conf_parser_t const module_config[] = {
 
 	{ FR_CONF_OFFSET("originate", rlm_radius_t, originate) },
 
+	{ FR_CONF_OFFSET("pass_through", rlm_radius_t, pass_through) },
+
+	{ FR_CONF_OFFSET("adaptive_rtx", rlm_radius_t, adaptive_rtx) },
+
 	{ FR_CONF_POINTER("status_check", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) status_check_config },
 
 	{ FR_CONF_OFFSET("max_attributes", rlm_radius_t, max_attributes), .dflt = STRINGIFY(RADIUS_MAX_ATTRIBUTES) },
@@ -354,6 +360,19 @@ static void mod_radius_signal(module_ctx_t const *mctx, request_t *request, fr_s
 			      mctx->rctx), request, action);
 }
 
+/** Report how busy the home server is, for load-balance sections
+ *
+ */
+static uint64_t mod_radius_load(module_ctx_t const *mctx)
+{
+	rlm_radius_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_radius_t);
+
+	if (!inst->io->get_load) return 0;
+
+	return inst->io->get_load(MODULE_CTX(inst->io_submodule,
+					 module_thread(inst->io_submodule)->data, NULL, NULL));
+}
+
 /** Do any RADIUS-layer fixups for proxying.
  *
  */
@@ -471,7 +490,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	 *	These limits are specific to RADIUS, and cannot be over-ridden
 	 */
 	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, >=, 2);
-	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, <=, 255);
+	if (!inst->extended_id) {
+		FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, <=, 255);
+	} else {
+		FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, <=, 65535);
+	}
 	FR_INTEGER_BOUND_CHECK("trunk.per_connection_target", inst->trunk_conf.target_req_per_conn, <=, inst->trunk_conf.max_req_per_conn / 2);
 
 	FR_TIME_DELTA_BOUND_CHECK("response_window", inst->zombie_period, >=, fr_time_delta_from_sec(1));
@@ -537,6 +560,20 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		 */
 	}
 
+	if (inst->pass_through && inst->originate) {
+		cf_log_err(conf, "Cannot use 'pass_through = yes' when 'originate = yes'");
+		return -1;
+	}
+
+	/*
+	 *	Extended IDs are negotiated when the connection is
+	 *	opened, which needs Status-Server.
+	 */
+	if (inst->extended_id && (inst->status_check != FR_RADIUS_CODE_STATUS_SERVER)) {
+		cf_log_err(conf, "Using 'status_check.extended_id = yes' requires 'status_check.type = Status-Server'");
+		return -1;
+	}
+
 	/*
 	 *	Don't sanity check the async timers if we're doing
 	 *	synchronous proxying.
@@ -683,5 +720,6 @@ module_rlm_t rlm_radius = {
 			{ .section = SECTION_NAME(CF_IDENT_ANY, CF_IDENT_ANY), .method = mod_process },
 			MODULE_BINDING_TERMINATOR
 		},
-	}
+	},
+	.get_load = mod_radius_load
 };
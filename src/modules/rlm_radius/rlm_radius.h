@@ -51,6 +51,10 @@ struct rlm_radius_s {
 	bool			replicate;		//!< Ignore responses.
 	bool			synchronous;		//!< Retransmit when receiving a duplicate request.
 	bool			originate;  		//!< Originating packets, instead of proxying existing ones.
+	bool			pass_through;		//!< Forward the original packet, instead of encoding the
+							///< request list.
+	bool			adaptive_rtx;		//!< Calculate the initial retransmission time from the
+							///< measured RTT.
 							///< Controls whether Proxy-State is added to the outbound
 							///< request.
 
@@ -65,6 +69,9 @@ struct rlm_radius_s {
 	map_list_t		status_check_map;	//!< attributes for the status-server checks
 	uint32_t		num_answers_to_alive;	//!< How many status check responses we need to
 							///< mark the connection as alive.
+	bool			extended_id;		//!< Require the home server to support extended IDs,
+							///< so more than 256 packets can be outstanding on
+							///< one connection.
 
 	bool			allowed[FR_RADIUS_CODE_MAX];
 	fr_retry_config_t      	retry[FR_RADIUS_CODE_MAX];
@@ -77,6 +84,11 @@ struct rlm_radius_s {
  */
 typedef unlang_action_t (*rlm_radius_io_enqueue_t)(rlm_rcode_t *p_result, void **rctx, void *instance, void *thread, request_t *request);
 
+/** Report how busy an IO submodule is in this thread
+ *
+ */
+typedef uint64_t (*rlm_radius_io_load_t)(module_ctx_t const *mctx);
+
 /** Public structure describing an I/O path for an outgoing socket.
  *
  * This structure is exported by client I/O modules e.g. rlm_radius_udp.
@@ -86,4 +98,5 @@ struct rlm_radius_io_s {
 	rlm_radius_io_enqueue_t	enqueue;		//!< Enqueue a request_t with an IO submodule.
 	unlang_module_signal_t	signal;			//!< Send a signal to an IO module.
 	module_method_t	resume;			//!< Resume a request, and get rcode.
+	rlm_radius_io_load_t	get_load;		//!< Report how busy the home server is.
 };
@@ -0,0 +1,2480 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_radius_tcp.c
+ * @brief RADIUS TCP and RADIUS/TLS transport
+ *
+ *  Many requests are multiplexed over a small number of long-lived
+ *  connections.  Each connection is a chain of bios:
+ *
+ *	mem (packet framing) -> [ tls ] -> fd
+ *
+ *  Packets are encoded directly into a per-connection send buffer, and
+ *  everything which the trunk gives us in one go is written with as few
+ *  system calls as possible.  Nagle is disabled, so a single packet is
+ *  never delayed.
+ *
+ *  As per RFC 6613 Section 2.6.1, we never retransmit a packet on the
+ *  same connection.  The transport layer takes care of that.  If the
+ *  home server doesn't reply in time, the request fails, and the
+ *  connection is checked to see if it's a zombie.
+ *
+ * @copyright 2024 Network RADIUS SAS (legal@networkradius.com)
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/bio/fd.h>
+#include <freeradius-devel/bio/mem.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/pair.h>
+#include <freeradius-devel/missing.h>
+#include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/heap.h>
+
+#ifdef WITH_TLS
+#  include <freeradius-devel/bio/tls.h>
+#  include <freeradius-devel/tls/session.h>
+#  include <freeradius-devel/tls/strerror.h>
+#endif
+
+#include <sys/socket.h>
+
+#include "rlm_radius.h"
+#include "track.h"
+
+/*
+ * Macro to simplify checking packets before calling decode(), so that
+ * it gets a known valid length and no longer calls fr_radius_ok() itself.
+ */
+#define check(_handle, _len_p) fr_radius_ok((_handle)->buffer, (size_t *)(_len_p), \
+					    (_handle)->thread->inst->parent->max_attributes, false, NULL)
+
+/** Static configuration for the module.
+ *
+ */
+typedef struct {
+	rlm_radius_t		*parent;		//!< rlm_radius instance.
+	CONF_SECTION		*config;
+
+	fr_ipaddr_t		dst_ipaddr;		//!< IP of the home server.
+	fr_ipaddr_t		src_ipaddr;		//!< IP we open our socket on.
+	uint16_t		dst_port;		//!< Port of the home server.
+	char const		*secret;		//!< Shared secret.
+
+	char const		*interface;		//!< Interface to bind to.
+
+	uint32_t		recv_buff;		//!< How big the kernel's receive buffer should be.
+	uint32_t		send_buff;		//!< How big the kernel's send buffer should be.
+
+	uint32_t		max_packet_size;	//!< Maximum packet size.
+	uint16_t		max_send_coalesce;	//!< Maximum number of packets to write in one go.
+
+	bool			recv_buff_is_set;	//!< Whether we were provided with a recv_buf
+	bool			send_buff_is_set;	//!< Whether we were provided with a send_buf
+
+#ifdef WITH_TLS
+	char const		*server_name;		//!< For SNI, and for checking the server certificate.
+	fr_tls_conf_t		*tls_conf;		//!< TLS configuration.  NULL for plain TCP.
+#endif
+
+	fr_radius_ctx_t		common_ctx;
+
+	trunk_conf_t		trunk_conf;		//!< trunk configuration
+} rlm_radius_tcp_t;
+
+typedef struct {
+	fr_event_list_t		*el;			//!< Event list.
+
+	rlm_radius_tcp_t const	*inst;			//!< our instance
+
+	trunk_t			*trunk;			//!< trunk handler
+
+#ifdef WITH_TLS
+	SSL_CTX			*ssl_ctx;		//!< Client context for RADIUS/TLS.
+#endif
+} tcp_thread_t;
+
+typedef struct {
+	trunk_request_t		*treq;
+	rlm_rcode_t		rcode;			//!< from the transport
+} tcp_result_t;
+
+typedef struct tcp_request_s tcp_request_t;
+
+/** Track the handle, which is tightly correlated with the FD
+ *
+ */
+typedef struct {
+	char const     		*name;			//!< From IP PORT to IP PORT.
+	char const		*module_name;		//!< the module that opened the connection
+
+	rlm_radius_tcp_t const	*inst;			//!< Our module instance.
+	tcp_thread_t		*thread;
+
+	int			fd;			//!< File descriptor.
+	fr_bio_fd_config_t	fd_config;		//!< How the socket was opened.  The FD bio keeps a pointer to it.
+	fr_bio_t		*fd_bio;		//!< Bottom of the bio chain.
+	fr_bio_fd_info_t const	*fd_info;		//!< Connection state, EOF, etc.
+
+#ifdef WITH_TLS
+	fr_tls_session_t	*tls_session;		//!< NULL for plain TCP.
+	fr_bio_t		*tls_bio;		//!< Encrypts and decrypts the data.
+#endif
+
+	fr_bio_t		*bio;			//!< Top of the bio chain.  Returns only complete packets.
+
+	uint8_t			*send;			//!< Encoded packets waiting to be written.
+	size_t			send_size;		//!< Size of the send buffer.
+	size_t			send_used;		//!< How much of the send buffer has been filled.
+	size_t			send_written;		//!< How much of the send buffer has been written.
+
+	fr_event_fd_cb_t	read_fn;		//!< What the trunk wants us to do on read.
+	bool			want_write;		//!< The trunk has packets for us to send.
+	bool			write_armed;		//!< We're waiting for the socket to become writable.
+
+	uint8_t			*buffer;		//!< Receive buffer.
+	size_t			buflen;			//!< Receive buffer length.
+
+	radius_track_t		*tt;			//!< RADIUS ID tracking structure.
+	bool			extended_id;		//!< The home server echoes Original-Request-Authenticator,
+							///< so replies are matched by ID and Request Authenticator.
+
+	fr_time_t		last_reply;		//!< When we last received a reply.
+	fr_time_t		first_sent;		//!< first time we sent a packet since going idle
+	fr_time_t		last_sent;		//!< last time we sent a packet.
+	fr_time_t		last_idle;		//!< last time we had nothing to do
+
+	fr_event_timer_t const	*zombie_ev;		//!< Zombie timeout.
+
+	bool			status_checking;       	//!< whether we're doing status checks
+	tcp_request_t		*status_u;		//!< for sending status check packets
+	tcp_result_t		*status_r;		//!< for faking out status checks as real packets
+	request_t		*status_request;
+} tcp_handle_t;
+
+
+/** Connect request_t to local tracking structure
+ *
+ */
+struct tcp_request_s {
+	uint32_t		priority;		//!< copied from request->async->priority
+	fr_time_t		recv_time;		//!< copied from request->async->recv_time
+
+	uint32_t		num_replies;		//!< number of reply packets
+
+	bool			synchronous;		//!< cached from inst->parent->synchronous
+	bool			require_message_authenticator;		//!< saved from the original packet.
+	bool			status_check;		//!< is this packet a status check?
+
+	fr_pair_list_t		extra;			//!< VPs for debugging, like Proxy-State.
+
+	uint8_t			code;			//!< Packet code.
+	uint8_t			id;			//!< ID assigned to this packet.
+	size_t			packet_len;		//!< Length of the packet.
+	uint8_t			vector[RADIUS_AUTH_VECTOR_LENGTH];	//!< Request Authenticator of the packet we sent.
+
+	fr_time_t		start;			//!< When the packet was sent.
+
+	radius_track_entry_t	*rr;			//!< ID tracking, etc.
+	fr_event_timer_t const	*ev;			//!< timer for the response
+};
+
+static const conf_parser_t module_config[] = {
+	{ FR_CONF_OFFSET_TYPE_FLAGS("ipaddr", FR_TYPE_COMBO_IP_ADDR, 0, rlm_radius_tcp_t, dst_ipaddr), },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("ipv4addr", FR_TYPE_IPV4_ADDR, 0, rlm_radius_tcp_t, dst_ipaddr) },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("ipv6addr", FR_TYPE_IPV6_ADDR, 0, rlm_radius_tcp_t, dst_ipaddr) },
+
+	{ FR_CONF_OFFSET("port", rlm_radius_tcp_t, dst_port) },
+
+	{ FR_CONF_OFFSET("secret", rlm_radius_tcp_t, secret) },
+
+	{ FR_CONF_OFFSET("interface", rlm_radius_tcp_t, interface) },
+
+	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, 0, rlm_radius_tcp_t, recv_buff) },
+	{ FR_CONF_OFFSET_IS_SET("send_buff", FR_TYPE_UINT32, 0, rlm_radius_tcp_t, send_buff) },
+
+	{ FR_CONF_OFFSET("max_packet_size", rlm_radius_tcp_t, max_packet_size), .dflt = "4096" },
+	{ FR_CONF_OFFSET("max_send_coalesce", rlm_radius_tcp_t, max_send_coalesce), .dflt = "256" },
+
+	{ FR_CONF_OFFSET_TYPE_FLAGS("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, 0, rlm_radius_tcp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("src_ipv4addr", FR_TYPE_IPV4_ADDR, 0, rlm_radius_tcp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET_TYPE_FLAGS("src_ipv6addr", FR_TYPE_IPV6_ADDR, 0, rlm_radius_tcp_t, src_ipaddr) },
+
+#ifdef WITH_TLS
+	{ FR_CONF_OFFSET("server_name", rlm_radius_tcp_t, server_name) },
+#endif
+
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_radius;
+
+extern fr_dict_autoload_t rlm_radius_tcp_dict[];
+fr_dict_autoload_t rlm_radius_tcp_dict[] = {
+	{ .out = &dict_radius, .proto = "radius" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_event_timestamp;
+static fr_dict_attr_t const *attr_extended_attribute_1;
+static fr_dict_attr_t const *attr_message_authenticator;
+static fr_dict_attr_t const *attr_eap_message;
+static fr_dict_attr_t const *attr_nas_identifier;
+static fr_dict_attr_t const *attr_original_packet_code;
+static fr_dict_attr_t const *attr_original_request_authenticator;
+static fr_dict_attr_t const *attr_proxy_state;
+static fr_dict_attr_t const *attr_user_password;
+static fr_dict_attr_t const *attr_packet_type;
+
+extern fr_dict_attr_autoload_t rlm_radius_tcp_dict_attr[];
+fr_dict_attr_autoload_t rlm_radius_tcp_dict_attr[] = {
+	{ .out = &attr_event_timestamp, .name = "Event-Timestamp", .type = FR_TYPE_DATE, .dict = &dict_radius},
+	{ .out = &attr_extended_attribute_1, .name = "Extended-Attribute-1", .type = FR_TYPE_TLV, .dict = &dict_radius},
+	{ .out = &attr_message_authenticator, .name = "Message-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_eap_message, .name = "EAP-Message", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_nas_identifier, .name = "NAS-Identifier", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ .out = &attr_original_packet_code, .name = "Extended-Attribute-1.Original-Packet-Code", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_original_request_authenticator, .name = "Vendor-Specific.FreeRADIUS.Original-Request-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_proxy_state, .name = "Proxy-State", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ NULL }
+};
+
+/** Turn a reply code into a module rcode;
+ *
+ */
+static rlm_rcode_t radius_code_to_rcode[FR_RADIUS_CODE_MAX] = {
+	[FR_RADIUS_CODE_ACCESS_ACCEPT]		= RLM_MODULE_OK,
+	[FR_RADIUS_CODE_ACCESS_CHALLENGE]	= RLM_MODULE_UPDATED,
+	[FR_RADIUS_CODE_ACCESS_REJECT]		= RLM_MODULE_REJECT,
+
+	[FR_RADIUS_CODE_ACCOUNTING_RESPONSE]	= RLM_MODULE_OK,
+
+	[FR_RADIUS_CODE_COA_ACK]		= RLM_MODULE_OK,
+	[FR_RADIUS_CODE_COA_NAK]		= RLM_MODULE_REJECT,
+
+	[FR_RADIUS_CODE_DISCONNECT_ACK]	= RLM_MODULE_OK,
+	[FR_RADIUS_CODE_DISCONNECT_NAK]	= RLM_MODULE_REJECT,
+
+	[FR_RADIUS_CODE_PROTOCOL_ERROR]	= RLM_MODULE_HANDLED,
+};
+
+static void		conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx);
+
+static ssize_t		encode(tcp_handle_t *h, request_t *request, tcp_request_t *u, uint8_t id,
+			       uint8_t *out, size_t outlen);
+
+static decode_fail_t	decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *response_code,
+			       tcp_handle_t *h, request_t *request, tcp_request_t *u,
+			       uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
+			       uint8_t *data, size_t data_len);
+
+/** Find the Original-Request-Authenticator in a reply, without decoding it
+ *
+ * The packet MUST have been validated by fr_radius_ok() first.
+ *
+ * @param[in] packet		to search.
+ * @param[in] packet_len	of the packet.
+ * @return
+ *	- The Request Authenticator the home server says this is a reply to.
+ *	- NULL if the packet doesn't contain one.
+ */
+static uint8_t const *original_request_authenticator(uint8_t const *packet, size_t packet_len)
+{
+	uint8_t const *attr, *end = packet + packet_len;
+
+	for (attr = packet + RADIUS_HEADER_LENGTH; (attr + 2) <= end; attr += attr[1]) {
+		if (attr[1] < 2) return NULL;
+
+		/*
+		 *	Vendor-Specific, PEN, then one vendor
+		 *	attribute holding the authenticator.
+		 */
+		if ((attr[0] != FR_VENDOR_SPECIFIC) ||
+		    (attr[1] != (2 + 4 + 2 + RADIUS_AUTH_VECTOR_LENGTH)) ||
+		    (fr_nbo_to_uint32(attr + 2) != VENDORPEC_FREERADIUS) ||
+		    (attr[6] != attr_original_request_authenticator->attr) ||
+		    (attr[7] != (2 + RADIUS_AUTH_VECTOR_LENGTH))) continue;
+
+		return attr + 8;
+	}
+
+	return NULL;
+}
+
+#ifndef NDEBUG
+/** Log additional information about a tracking entry
+ *
+ * @param[in] te	Tracking entry we're logging information for.
+ * @param[in] log	destination.
+ * @param[in] log_type	Type of log message.
+ * @param[in] file	the logging request was made in.
+ * @param[in] line 	logging request was made on.
+ */
+static void tcp_tracking_entry_log(fr_log_t const *log, fr_log_type_t log_type, char const *file, int line,
+				   radius_track_entry_t *te)
+{
+	request_t			*request;
+
+	if (!te->request) return;	/* Free entry */
+
+	request = talloc_get_type_abort(te->request, request_t);
+
+	fr_log(log, log_type, file, line, "request %s, allocated %s:%u", request->name,
+	       request->alloc_file, request->alloc_line);
+
+	trunk_request_state_log(log, log_type, file, line, talloc_get_type_abort(te->uctx, trunk_request_t));
+}
+#endif
+
+/** Clear out any connection specific resources from a tcp request
+ *
+ */
+static void tcp_request_reset(tcp_request_t *u)
+{
+	fr_pair_list_free(&u->extra);
+
+	/*
+	 *	Can have no u->rr if this is part of a
+	 *	pre-trunk status check.
+	 */
+	if (u->rr) radius_track_entry_release(&u->rr);
+}
+
+/** Reset a status_check packet, ready to reuse
+ *
+ */
+static void status_check_reset(tcp_handle_t *h, tcp_request_t *u)
+{
+	fr_assert(u->status_check == true);
+
+	h->status_checking = false;
+	u->num_replies = 0;	/* Reset */
+	u->start = fr_time_wrap(0);
+
+	if (u->ev) (void) fr_event_timer_delete(&u->ev);
+
+	tcp_request_reset(u);
+}
+
+/*
+ *	Status-Server checks.  Manually build the packet, and
+ *	all of its associated glue.
+ */
+static void CC_HINT(nonnull) status_check_alloc(tcp_handle_t *h)
+{
+	tcp_request_t		*u;
+	request_t		*request;
+	rlm_radius_tcp_t const	*inst = h->inst;
+	map_t			*map = NULL;
+
+	fr_assert(!h->status_u && !h->status_r && !h->status_request);
+
+	u = talloc_zero(h, tcp_request_t);
+	fr_pair_list_init(&u->extra);
+
+	/*
+	 *	Status checks are prioritized over any other packet
+	 */
+	u->priority = ~(uint32_t) 0;
+	u->status_check = true;
+
+	/*
+	 *	Allocate outside of the free list.
+	 *	There appears to be an issue where
+	 *	the thread destructor runs too
+	 *	early, and frees the freelist's
+	 *	head before the module destructor
+	 *      runs.
+	 */
+	request = request_local_alloc_external(u, NULL);
+	request->async = talloc_zero(request, fr_async_t);
+	talloc_const_free(request->name);
+	request->name = talloc_strdup(request, h->module_name);
+
+	request->packet = fr_packet_alloc(request, false);
+	request->reply = fr_packet_alloc(request, false);
+
+	/*
+	 *	Create the VPs, and ignore any errors
+	 *	creating them.
+	 */
+	while ((map = map_list_next(&inst->parent->status_check_map, map))) {
+		/*
+		 *	Skip things which aren't attributes.
+		 */
+		if (!tmpl_is_attr(map->lhs)) continue;
+
+		/*
+		 *	Ignore internal attributes.
+		 */
+		if (tmpl_attr_tail_da(map->lhs)->flags.internal) continue;
+
+		/*
+		 *	Ignore signalling attributes.  They shouldn't exist.
+		 */
+		if ((tmpl_attr_tail_da(map->lhs) == attr_proxy_state) ||
+		    (tmpl_attr_tail_da(map->lhs) == attr_message_authenticator)) continue;
+
+		/*
+		 *	Allow passwords only in Access-Request packets.
+		 */
+		if ((inst->parent->status_check != FR_RADIUS_CODE_ACCESS_REQUEST) &&
+		    (tmpl_attr_tail_da(map->lhs) == attr_user_password)) continue;
+
+		(void) map_to_request(request, map, map_to_vp, NULL);
+	}
+
+	/*
+	 *	Ensure that there's a NAS-Identifier, if one wasn't
+	 *	already added.
+	 */
+	if (!fr_pair_find_by_da(&request->request_pairs, NULL, attr_nas_identifier)) {
+		fr_pair_t *vp;
+
+		MEM(pair_append_request(&vp, attr_nas_identifier) >= 0);
+		fr_pair_value_strdup(vp, "status check - are you alive?", false);
+	}
+
+	/*
+	 *	Always add an Event-Timestamp, which will be the time
+	 *	at which the packet is sent.
+	 */
+	if (!fr_pair_find_by_da(&request->request_pairs, NULL, attr_event_timestamp)) {
+		MEM(pair_append_request(NULL, attr_event_timestamp) >= 0);
+	}
+
+	/*
+	 *	Initialize the request IO ctx.  Note that we don't set
+	 *	destructors.
+	 */
+	u->code = inst->parent->status_check;
+	request->packet->code = u->code;
+
+	DEBUG3("%s - Status check packet type will be %s", h->module_name, fr_radius_packet_name[u->code]);
+	log_request_pair_list(L_DBG_LVL_3, request, NULL, &request->request_pairs, NULL);
+
+	MEM(h->status_r = talloc_zero(request, tcp_result_t));
+	h->status_u = u;
+	h->status_request = request;
+}
+
+/** Is there still data waiting to be written to the socket?
+ *
+ */
+static inline bool tcp_write_pending(tcp_handle_t *h)
+{
+	if (h->send_used > h->send_written) return true;
+
+#ifdef WITH_TLS
+	if (h->tls_bio && (fr_bio_tls_write_pending(h->tls_bio) > 0)) return true;
+#endif
+
+	return false;
+}
+
+/** Write as much of the send buffer as the socket will take
+ *
+ * @return
+ *	- <0 on error.  The connection should be closed.
+ *	- 0 on success.  There may still be data left in the send buffer.
+ */
+static int tcp_flush(tcp_handle_t *h)
+{
+	ssize_t		slen = 0;
+
+	while (h->send_written < h->send_used) {
+		slen = fr_bio_write(h->bio, NULL, h->send + h->send_written, h->send_used - h->send_written);
+		if (slen == fr_bio_error(IO_WOULD_BLOCK)) break;
+		if (slen < 0) goto error;
+
+		if (slen == 0) {
+			if (h->fd_info->eof) goto closed;
+			break;
+		}
+
+		h->send_written += slen;
+	}
+
+	if (h->send_written == h->send_used) {
+		h->send_used = h->send_written = 0;
+
+#ifdef WITH_TLS
+		/*
+		 *	The TLS bio may still have ciphertext which the
+		 *	socket wouldn't take.
+		 */
+		if (h->tls_bio && (fr_bio_tls_write_pending(h->tls_bio) > 0)) {
+			slen = fr_bio_write(h->bio, NULL, NULL, SIZE_MAX);
+			if (slen < 0) goto error;
+		}
+#endif
+		return 0;
+	}
+
+	/*
+	 *	Move the unwritten data to the start of the buffer, so
+	 *	that we have room to encode more packets.  The TLS bio
+	 *	is OK with the data moving.
+	 */
+	if ((h->send_size - h->send_used) < h->inst->max_packet_size) {
+		memmove(h->send, h->send + h->send_written, h->send_used - h->send_written);
+		h->send_used -= h->send_written;
+		h->send_written = 0;
+	}
+
+	return 0;
+
+closed:
+	ERROR("%s - Connection %s closed by home server", h->module_name, h->name);
+	return -1;
+
+error:
+	ERROR("%s - Failed writing to connection %s: %s", h->module_name, h->name, fr_bio_strerror(slen));
+	return -1;
+}
+
+/** Frame RADIUS packets in the TCP stream
+ *
+ */
+static fr_bio_verify_action_t tcp_verify(fr_bio_t *bio, UNUSED void *packet_ctx, const void *data, size_t *size)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(bio->uctx, tcp_handle_t);
+	uint8_t const		*hdr = data;
+	size_t			want;
+
+	if (*size < RADIUS_HEADER_LENGTH) {
+		*size = RADIUS_HEADER_LENGTH;
+		return FR_BIO_VERIFY_WANT_MORE;
+	}
+
+	want = fr_nbo_to_uint16(hdr + 2);
+	if ((want < RADIUS_HEADER_LENGTH) || (want > h->buflen)) {
+		ERROR("%s - Received packet with invalid length %zu on connection %s", h->module_name, want, h->name);
+		return FR_BIO_VERIFY_ERROR_CLOSE;
+	}
+
+	if (want > *size) {
+		*size = want;
+		return FR_BIO_VERIFY_WANT_MORE;
+	}
+
+	*size = want;
+	return FR_BIO_VERIFY_OK;
+}
+
+/** Free a connection handle, closing associated resources
+ *
+ */
+static int _tcp_handle_free(tcp_handle_t *h)
+{
+	if (h->status_u) fr_event_timer_delete(&h->status_u->ev);
+
+	if (h->fd >= 0) (void) fr_event_fd_delete(h->thread->el, h->fd, FR_EVENT_FILTER_IO);
+
+	/*
+	 *	Frees the whole chain, and closes the socket.
+	 */
+	if (h->bio) {
+		(void) fr_bio_shutdown(h->bio);
+		(void) fr_bio_free(h->bio);
+		h->bio = NULL;
+	}
+
+	h->fd = -1;
+
+	DEBUG("%s - Connection closed - %s", h->module_name, h->name);
+
+	return 0;
+}
+
+/** Set the connection name from the socket information
+ *
+ */
+static void tcp_handle_name(tcp_handle_t *h)
+{
+	fr_socket_t const *sock = &h->fd_info->socket;
+
+	if (h->name) talloc_const_free(h->name);
+
+	h->name = fr_asprintf(h, "proto %s local %pV port %u remote %pV port %u",
+#ifdef WITH_TLS
+			      h->tls_bio ? "tls" : "tcp",
+#else
+			      "tcp",
+#endif
+			      fr_box_ipaddr(sock->inet.src_ipaddr), sock->inet.src_port,
+			      fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port);
+}
+
+/** Connection errored while we were opening it
+ *
+ */
+static void conn_init_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	connection_t		*conn = talloc_get_type_abort(uctx, connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	ERROR("%s - Connection %s failed: %s", h->module_name, h->name, fr_syserror(fd_errno));
+
+	connection_signal_reconnect(conn, CONNECTION_FAILED);
+}
+
+/** Read the response to the status check we sent when opening the connection
+ *
+ */
+static void conn_readable_status_check(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	connection_t		*conn = talloc_get_type_abort(uctx, connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	rlm_radius_t const 	*inst = h->inst->parent;
+	tcp_request_t		*u = h->status_u;
+	ssize_t			slen;
+	fr_pair_list_t		reply;
+	uint8_t			code = 0;
+
+	fr_pair_list_init(&reply);
+
+	slen = fr_bio_read(h->bio, NULL, h->buffer, h->buflen);
+	if (slen == 0) {
+		if (!h->fd_info->eof) return;
+
+		ERROR("%s - Connection %s closed by home server", h->module_name, h->name);
+	fail:
+		connection_signal_reconnect(conn, CONNECTION_FAILED);
+		return;
+	}
+
+	if (slen < 0) {
+		ERROR("%s - Failed reading response from connection %s: %s",
+		      h->module_name, h->name, fr_bio_strerror(slen));
+		goto fail;
+	}
+
+	if (u->id != h->buffer[1]) {
+		ERROR("%s - Received response with incorrect ID.  Expected %u, got %u",
+		      h->module_name, u->id, h->buffer[1]);
+		goto fail;
+	}
+
+	if (!check(h, &slen)) {
+		ERROR("%s - Received malformed response to status check", h->module_name);
+		goto fail;
+	}
+
+	if (decode(h, &reply, &code,
+		   h, h->status_request, h->status_u, u->vector,
+		   h->buffer, slen) != DECODE_FAIL_NONE) goto fail;
+
+	/*
+	 *	We need the home server to tell us which request each
+	 *	reply is for, otherwise we can't have more than 256
+	 *	packets outstanding.  There's no point in opening a
+	 *	connection we can't use properly.
+	 */
+	if (inst->extended_id) {
+		fr_pair_t *vp;
+
+		vp = fr_pair_find_by_da_nested(&reply, NULL, attr_original_request_authenticator);
+		if (!vp || (vp->vp_length != RADIUS_AUTH_VECTOR_LENGTH) ||
+		    (memcmp(vp->vp_octets, u->vector, RADIUS_AUTH_VECTOR_LENGTH) != 0)) {
+			ERROR("%s - Home server does not support extended IDs (no valid Original-Request-Authenticator"
+			      " in response to %s) - %s",
+			      h->module_name, fr_radius_packet_name[u->code], h->name);
+			fr_pair_list_free(&reply);
+			goto fail;
+		}
+
+		DEBUG("%s - Home server supports extended IDs - %s", h->module_name, h->name);
+		h->extended_id = true;
+		radius_track_use_authenticator(h->tt, true);
+	}
+
+	fr_pair_list_free(&reply);
+
+	/*
+	 *	It's alive!  Replies on a stream are reliable, so one
+	 *	answer is as good as "num_answers_to_alive" of them.
+	 */
+	status_check_reset(h, u);
+	h->last_reply = fr_time();
+
+	(void) fr_event_fd_delete(conn->el, h->fd, FR_EVENT_FILTER_IO);
+
+	DEBUG("%s - Connection open - %s", h->module_name, h->name);
+
+	connection_signal_connected(conn);
+}
+
+/** Finish writing the status check, and then wait for the reply
+ *
+ */
+static void conn_writable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	connection_t		*conn = talloc_get_type_abort(uctx, connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	if (tcp_flush(h) < 0) {
+		connection_signal_reconnect(conn, CONNECTION_FAILED);
+		return;
+	}
+
+	if (fr_event_fd_insert(h, NULL, el, h->fd, conn_readable_status_check,
+			       tcp_write_pending(h) ? conn_writable_status_check : NULL,
+			       conn_init_error, conn) < 0) {
+		PERROR("%s - Failed inserting FD event", h->module_name);
+		connection_signal_reconnect(conn, CONNECTION_FAILED);
+	}
+}
+
+/** Send a status check before signalling that the connection is open
+ *
+ * If the home server doesn't answer, the connection timeout takes
+ * care of closing the connection.
+ */
+static void conn_status_check(fr_event_list_t *el, connection_t *conn)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	tcp_request_t		*u = h->status_u;
+	ssize_t			slen;
+
+	u->id = fr_rand() & 0xff;	/* We don't care what the value is here */
+	u->start = fr_time();
+	h->status_checking = true;
+
+	DEBUG("%s - Sending %s ID %d over connection %s",
+	      h->module_name, fr_radius_packet_name[u->code], u->id, h->name);
+
+	slen = encode(h, h->status_request, u, u->id, h->send, h->send_size);
+	if (slen < 0) {
+		connection_signal_reconnect(conn, CONNECTION_FAILED);
+		return;
+	}
+	h->send_used = slen;
+
+	conn_writable_status_check(el, h->fd, 0, conn);
+}
+
+/** The connection is ready for application data
+ *
+ */
+static void conn_ready(fr_event_list_t *el, connection_t *conn)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	if (h->status_u) {
+		conn_status_check(el, conn);
+		return;
+	}
+
+	(void) fr_event_fd_delete(el, h->fd, FR_EVENT_FILTER_IO);
+
+	DEBUG("%s - Connection open - %s", h->module_name, h->name);
+
+	connection_signal_connected(conn);
+}
+
+#ifdef WITH_TLS
+/** Drive the TLS handshake
+ *
+ */
+static void conn_handshake(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	connection_t		*conn = talloc_get_type_abort(uctx, connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	fr_bio_tls_info_t const	*info;
+	int			rcode;
+
+	rcode = fr_bio_tls_handshake(h->tls_bio);
+	if (rcode < 0) {
+		PERROR("%s - TLS handshake failed on connection %s", h->module_name, h->name);
+		connection_signal_reconnect(conn, CONNECTION_FAILED);
+		return;
+	}
+
+	if (rcode == 0) {
+		bool write = (fr_bio_tls_write_pending(h->tls_bio) > 0);
+
+		if (fr_event_fd_insert(h, NULL, el, h->fd,
+				       write ? NULL : conn_handshake,
+				       write ? conn_handshake : NULL,
+				       conn_init_error, conn) < 0) {
+			PERROR("%s - Failed inserting FD event", h->module_name);
+			connection_signal_reconnect(conn, CONNECTION_FAILED);
+		}
+		return;
+	}
+
+	info = fr_bio_tls_info(h->tls_bio);
+	DEBUG("%s - TLS session %s (%s, %s) - %s", h->module_name,
+	      info->resumed ? "resumed" : "established",
+	      SSL_get_version(info->ssl), SSL_get_cipher_name(info->ssl), h->name);
+
+	conn_ready(el, conn);
+}
+#endif
+
+/** The socket is writable, so the connect() has finished
+ *
+ */
+static void conn_connected(fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	connection_t		*conn = talloc_get_type_abort(uctx, connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	if (fr_bio_fd_connect(h->fd_bio) < 0) {
+		PERROR("%s - Failed connecting to %pV port %u", h->module_name,
+		       fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port);
+		connection_signal_reconnect(conn, CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	We now know our source port.
+	 */
+	tcp_handle_name(h);
+
+#ifdef WITH_TLS
+	if (h->tls_bio) {
+		conn_handshake(el, h->fd, 0, conn);
+		return;
+	}
+#endif
+
+	conn_ready(el, conn);
+}
+
+/** Initialise a new outbound connection
+ *
+ * @param[out] h_out	Where to write the new file descriptor.
+ * @param[in] conn	to initialise.
+ * @param[in] uctx	A #tcp_thread_t
+ */
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_state_t conn_init(void **h_out, connection_t *conn, void *uctx)
+{
+	tcp_handle_t		*h;
+	tcp_thread_t		*thread = talloc_get_type_abort(uctx, tcp_thread_t);
+	rlm_radius_tcp_t const	*inst = thread->inst;
+	fr_bio_t		*next;
+
+	MEM(h = talloc_zero(conn, tcp_handle_t));
+	h->thread = thread;
+	h->inst = inst;
+	h->module_name = inst->parent->name;
+	h->last_idle = fr_time();
+	h->fd = -1;
+
+	/*
+	 *	Replies are framed by the mem bio, so the receive
+	 *	buffer only has to hold one packet.  The largest
+	 *	RADIUS packet is 64K, and we don't want to close the
+	 *	connection just because the home server sent us a
+	 *	large one.
+	 */
+	h->buflen = UINT16_MAX;
+	MEM(h->buffer = talloc_array(h, uint8_t, h->buflen));
+
+	h->send_size = inst->max_packet_size * 2;
+	if (h->send_size < 65536) h->send_size = 65536;
+	MEM(h->send = talloc_array(h, uint8_t, h->send_size));
+
+	MEM(h->tt = radius_track_alloc(h));
+
+	talloc_set_destructor(h, _tcp_handle_free);
+
+	/*
+	 *	Open the outgoing socket.  The connect() is
+	 *	non-blocking, and is finished in conn_connected().
+	 */
+	h->fd_config = (fr_bio_fd_config_t) {
+		.type = FR_BIO_FD_CONNECTED,
+		.socket_type = SOCK_STREAM,
+		.src_ipaddr = inst->src_ipaddr,
+		.dst_ipaddr = inst->dst_ipaddr,
+		.dst_port = inst->dst_port,
+		.interface = inst->interface,
+		.recv_buff = inst->recv_buff_is_set ? inst->recv_buff : 0,
+		.send_buff = inst->send_buff_is_set ? inst->send_buff : 0,
+		.async = true,
+		.tcp_delay = false,
+	};
+
+	h->fd_bio = fr_bio_fd_alloc(h, &h->fd_config, 0);
+	if (!h->fd_bio) {
+		PERROR("%s - Failed opening socket", h->module_name);
+	fail:
+		talloc_free(h);
+		return CONNECTION_STATE_FAILED;
+	}
+	h->fd_info = fr_bio_fd_info(h->fd_bio);
+	h->fd = h->fd_info->socket.fd;
+	next = h->fd_bio;
+
+#ifdef WITH_TLS
+	if (thread->ssl_ctx) {
+		SSL	*ssl;
+
+		h->tls_session = fr_tls_session_alloc_client(h, thread->ssl_ctx);
+		if (!h->tls_session) {
+			fr_tls_strerror_printf(NULL);
+			PERROR("%s - Failed allocating TLS session", h->module_name);
+			goto fail_bio;
+		}
+		ssl = h->tls_session->ssl;
+
+		/*
+		 *	The message callback needs a request, and
+		 *	there isn't one here.
+		 */
+		SSL_set_msg_callback(ssl, NULL);
+		SSL_set_connect_state(ssl);
+
+		if (inst->server_name &&
+		    ((SSL_set_tlsext_host_name(ssl, inst->server_name) != 1) ||
+		     (SSL_set1_host(ssl, inst->server_name) != 1))) {
+			fr_tls_strerror_printf(NULL);
+			PERROR("%s - Failed setting TLS server name", h->module_name);
+			goto fail_bio;
+		}
+
+		/*
+		 *	Skip the full handshake if the home server
+		 *	still knows about the last session any
+		 *	worker established with it.
+		 */
+		{
+			char *peer;
+
+			MEM(peer = fr_asprintf(NULL, "%pV:%u%s%s", fr_box_ipaddr(inst->dst_ipaddr), inst->dst_port,
+					       inst->server_name ? "/" : "",
+					       inst->server_name ? inst->server_name : ""));
+			fr_tls_cache_client_resume(h->tls_session, peer);
+			talloc_free(peer);
+		}
+
+		h->tls_bio = fr_bio_tls_alloc(h, ssl, next);
+		if (!h->tls_bio) {
+			PERROR("%s - Failed allocating TLS bio", h->module_name);
+			goto fail_bio;
+		}
+		next = h->tls_bio;
+	}
+#endif
+
+	/*
+	 *	Buffer enough data for a few maximum sized packets.
+	 *	Writes go straight through, as we have our own send
+	 *	buffer.
+	 */
+	h->bio = fr_bio_mem_alloc(h, ((size_t) UINT16_MAX + 1) * 2, 0, next);
+	if (!h->bio) {
+		PERROR("%s - Failed allocating memory bio", h->module_name);
+	fail_bio:
+		/*
+		 *	Unchain the bios, so that talloc can free
+		 *	them in any order.
+		 */
+		if (next != h->fd_bio) {
+			(void) fr_bio_shutdown(next);
+			(void) fr_bio_free(next);
+		}
+		h->fd = -1;
+		goto fail;
+	}
+	h->bio->uctx = h;
+	fr_bio_mem_set_verify(h->bio, tcp_verify, false);
+
+	tcp_handle_name(h);
+
+	if (h->inst->parent->status_check) status_check_alloc(h);
+
+	if (fr_event_fd_insert(h, NULL, conn->el, h->fd, NULL,
+			       conn_connected, conn_init_error, conn) < 0) {
+		PERROR("%s - Failed inserting FD event", h->module_name);
+		goto fail;
+	}
+
+	*h_out = h;
+
+	return CONNECTION_STATE_CONNECTING;
+}
+
+/** Shutdown/close a file descriptor
+ *
+ */
+static void conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uctx)
+{
+	tcp_handle_t *h = talloc_get_type_abort(handle, tcp_handle_t);
+
+	/*
+	 *	There's tracking entries still allocated
+	 *	this is bad, they should have all been
+	 *	released.
+	 */
+	if (h->tt && (h->tt->num_requests != 0)) {
+#ifndef NDEBUG
+		radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__, h->tt, tcp_tracking_entry_log);
+#endif
+		fr_assert_fail("%u tracking entries still allocated at conn close", h->tt->num_requests);
+	}
+
+	DEBUG4("Freeing rlm_radius_tcp handle %p", handle);
+
+	talloc_free(h);
+}
+
+/** Connection failed
+ *
+ * @param[in] handle   	of connection that failed.
+ * @param[in] state	the connection was in when it failed.
+ * @param[in] uctx	UNUSED.
+ */
+static connection_state_t conn_failed(void *handle, connection_state_t state, UNUSED void *uctx)
+{
+	switch (state) {
+	/*
+	 *	If the connection was connected when it failed,
+	 *	we need to handle any outstanding packets and
+	 *	timer events before reconnecting.
+	 */
+	case CONNECTION_STATE_CONNECTED:
+	{
+		tcp_handle_t	*h = talloc_get_type_abort(handle, tcp_handle_t); /* h only available if connected */
+
+		/*
+		 *	Reset the Status-Server checks.
+		 */
+		if (h->status_u && h->status_u->ev) (void) fr_event_timer_delete(&h->status_u->ev);
+	}
+		break;
+
+	default:
+		break;
+	}
+
+	return CONNECTION_STATE_INIT;
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_t *thread_conn_alloc(trunk_connection_t *tconn, fr_event_list_t *el,
+					  connection_conf_t const *conf,
+					  char const *log_prefix, void *uctx)
+{
+	connection_t		*conn;
+	tcp_thread_t		*thread = talloc_get_type_abort(uctx, tcp_thread_t);
+
+	conn = connection_alloc(tconn, el,
+				   &(connection_funcs_t){
+					.init = conn_init,
+					.close = conn_close,
+					.failed = conn_failed
+				   },
+				   conf,
+				   log_prefix,
+				   thread);
+	if (!conn) {
+		PERROR("%s - Failed allocating state handler for new connection", thread->inst->parent->name);
+		return NULL;
+	}
+
+	return conn;
+}
+
+/** Read and discard data
+ *
+ */
+static void conn_discard(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+	ssize_t			slen;
+
+	while ((slen = fr_bio_read(h->bio, NULL, h->buffer, h->buflen)) > 0);
+
+	if ((slen < 0) || h->fd_info->eof) {
+		ERROR("%s - Failed draining connection %s: %s", h->module_name, h->name,
+		      (slen < 0) ? fr_bio_strerror(slen) : "Connection closed");
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+	}
+}
+
+/** Connection errored
+ *
+ * We were signalled by the event loop that a fatal error occurred on this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that errored.
+ * @param[in] flags	El flags.
+ * @param[in] fd_errno	The nature of the error.
+ * @param[in] uctx	The trunk connection handle (tconn).
+ */
+static void conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	connection_t		*conn = tconn->conn;
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	ERROR("%s - Connection %s failed: %s", h->module_name, h->name, fr_syserror(fd_errno));
+
+	connection_signal_reconnect(conn, CONNECTION_FAILED);
+}
+
+/** Install the FD events for a connection
+ *
+ * We wait for the socket to become writable if the trunk has packets
+ * for us, or if we still have data to write.
+ */
+static int tcp_fd_events(tcp_handle_t *h, trunk_connection_t *tconn)
+{
+	fr_event_fd_cb_t	write_fn = NULL;
+
+	if (h->want_write || tcp_write_pending(h)) write_fn = conn_writable;
+
+	if (fr_event_fd_insert(h, NULL, h->thread->el, h->fd,
+			       h->read_fn,
+			       write_fn,
+			       conn_error,
+			       tconn) < 0) {
+		PERROR("%s - Failed inserting FD event", h->module_name);
+
+		/*
+		 *	May free the connection!
+		 */
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		return -1;
+	}
+
+	h->write_armed = (write_fn != NULL);
+	return 0;
+}
+
+/** The socket is writable
+ *
+ * Write any pending data, and then let the trunk give us more packets.
+ */
+static void conn_writable(fr_event_list_t *el, int fd, int flags, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+
+	if (tcp_write_pending(h) && (tcp_flush(h) < 0)) {
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	Only encode more packets if we have room for them.
+	 *	request_mux() updates the events.
+	 */
+	if (h->want_write && ((h->send_size - h->send_used) >= h->inst->max_packet_size)) {
+		trunk_connection_callback_writable(el, fd, flags, tconn);
+		return;
+	}
+
+	if (h->write_armed != (h->want_write || tcp_write_pending(h))) (void) tcp_fd_events(h, tconn);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void thread_conn_notify(trunk_connection_t *tconn, connection_t *conn,
+			       UNUSED fr_event_list_t *el,
+			       trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	switch (notify_on) {
+		/*
+		 *	The home server may still be sending us
+		 *	replies to requests which have been cancelled.
+		 *	We have to read them, or the connection will
+		 *	stall.
+		 */
+	case TRUNK_CONN_EVENT_NONE:
+		h->read_fn = conn_discard;
+		h->want_write = false;
+		break;
+
+	case TRUNK_CONN_EVENT_READ:
+		h->read_fn = trunk_connection_callback_readable;
+		h->want_write = false;
+		break;
+
+	case TRUNK_CONN_EVENT_WRITE:
+		h->read_fn = conn_discard;
+		h->want_write = true;
+		break;
+
+	case TRUNK_CONN_EVENT_BOTH:
+		h->read_fn = trunk_connection_callback_readable;
+		h->want_write = true;
+		break;
+	}
+
+	(void) tcp_fd_events(h, tconn);
+}
+
+/*
+ *  Return negative numbers to put 'a' at the top of the heap.
+ *  Return positive numbers to put 'b' at the top of the heap.
+ *
+ *  We want the value with the lowest timestamp to be prioritized at
+ *  the top of the heap.
+ */
+static int8_t request_prioritise(void const *one, void const *two)
+{
+	tcp_request_t const *a = one;
+	tcp_request_t const *b = two;
+	int8_t ret;
+
+	/*
+	 *	Larger priority is more important.
+	 */
+	ret = CMP(a->priority, b->priority);
+	if (ret != 0) return ret;
+
+	/*
+	 *	Smaller timestamp (i.e. earlier) is more important.
+	 */
+	return CMP_PREFER_SMALLER(fr_time_unwrap(a->recv_time), fr_time_unwrap(b->recv_time));
+}
+
+/** Decode response packet data, extracting relevant information and validating the packet
+ *
+ * @param[in] ctx			to allocate pairs in.
+ * @param[out] reply			Pointer to head of pair list to add reply attributes to.
+ * @param[out] response_code		The type of response packet.
+ * @param[in] h				connection handle.
+ * @param[in] request			the request.
+ * @param[in] u				TCP request.
+ * @param[in] request_authenticator	from the original request.
+ * @param[in] data			to decode.
+ * @param[in] data_len			Length of input data.
+ * @return
+ *	- DECODE_FAIL_NONE on success.
+ *	- DECODE_FAIL_* on failure.
+ */
+static decode_fail_t decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *response_code,
+			    tcp_handle_t *h, request_t *request, tcp_request_t *u,
+			    uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
+			    uint8_t *data, size_t data_len)
+{
+	rlm_radius_tcp_t const	*inst = talloc_get_type_abort_const(h->thread->inst, rlm_radius_tcp_t);
+	rlm_radius_t const	*parent = inst->parent;
+	uint8_t			code;
+	fr_radius_decode_ctx_t	decode_ctx;
+
+	*response_code = 0;	/* Initialise to keep the rest of the code happy */
+
+	RHEXDUMP3(data, data_len, "Read packet");
+
+	decode_ctx = (fr_radius_decode_ctx_t) {
+		.common = &inst->common_ctx,
+		.request_code = u->code,
+		.request_authenticator = request_authenticator,
+		.tmp_ctx = talloc(ctx, uint8_t),
+		.end = data + data_len,
+		.verify = true,
+		.require_message_authenticator = ((*(parent->received_message_authenticator) & parent->require_message_authenticator) |
+						  (parent->require_message_authenticator & FR_RADIUS_REQUIRE_MA_YES)) > 0
+	};
+
+	if (fr_radius_decode(ctx, reply, data, data_len, &decode_ctx) < 0) {
+		talloc_free(decode_ctx.tmp_ctx);
+		RPEDEBUG("Failed reading packet");
+		return DECODE_FAIL_UNKNOWN;
+	}
+	talloc_free(decode_ctx.tmp_ctx);
+
+	code = data[0];
+
+	RDEBUG("Received %s ID %d length %ld reply packet on connection %s",
+	       fr_radius_packet_name[code], data[1], data_len, h->name);
+	log_request_pair_list(L_DBG_LVL_2, request, NULL, reply, NULL);
+
+	/*
+	 *	This code is for BlastRADIUS mitigation.
+	 *
+	 *	The scenario where this applies is where we send Message-Authenticator
+	 *	but the home server doesn't support it or require it, in which case
+	 *	the response can be manipulated by an attacker.
+	 */
+	if (u->code == FR_RADIUS_CODE_ACCESS_REQUEST) {
+		if ((parent->require_message_authenticator == FR_RADIUS_REQUIRE_MA_AUTO) &&
+		    !*(parent->received_message_authenticator) &&
+		    fr_pair_find_by_da(&request->request_pairs, NULL, attr_message_authenticator) &&
+		    !fr_pair_find_by_da(&request->request_pairs, NULL, attr_eap_message)) {
+			RINFO("Packet contained a valid Message-Authenticator.  Setting \"require_message_authenticator = yes\"");
+			*(parent->received_message_authenticator) = true;
+		}
+	}
+
+	*response_code = code;
+
+	/*
+	 *	Record the fact we've seen a response
+	 */
+	u->num_replies++;
+
+	return DECODE_FAIL_NONE;
+}
+
+/** Encode a packet directly into the send buffer
+ *
+ * @return
+ *	- <0 on error.
+ *	- The length of the signed packet.
+ */
+static ssize_t encode(tcp_handle_t *h, request_t *request, tcp_request_t *u, uint8_t id,
+		      uint8_t *out, size_t outlen)
+{
+	rlm_radius_tcp_t const	*inst = h->inst;
+	ssize_t			packet_len;
+	fr_radius_encode_ctx_t	encode_ctx;
+
+	fr_assert(inst->parent->allowed[u->code]);
+	fr_pair_list_free(&u->extra);
+
+	if (outlen > inst->max_packet_size) outlen = inst->max_packet_size;
+
+	/*
+	 *	We should have at minimum 64-byte packets, so don't
+	 *	bother doing run-time checks here.
+	 */
+	fr_assert(outlen >= (size_t) RADIUS_HEADER_LENGTH);
+
+	encode_ctx = (fr_radius_encode_ctx_t) {
+		.common = &inst->common_ctx,
+		.rand_ctx = (fr_fast_rand_t) {
+			.a = fr_rand(),
+			.b = fr_rand(),
+		},
+		.code = u->code,
+		.id = id,
+		.add_proxy_state = !inst->parent->originate,
+	};
+
+	/*
+	 *	If we're sending a status check packet, update any
+	 *	necessary timestamps.  Also, don't add Proxy-State, as
+	 *	we're originating the packet.
+	 */
+	if (u->status_check) {
+		fr_pair_t *vp;
+
+		vp = fr_pair_find_by_da(&request->request_pairs, NULL, attr_event_timestamp);
+		if (vp) vp->vp_date = fr_time_to_unix_time(u->start);
+
+		encode_ctx.add_proxy_state = false;
+
+	/*
+	 *	The admin has told us that policy doesn't change the
+	 *	request.  Copy the attributes from the original
+	 *	packet, instead of encoding them all again.  If that's not possible,
+	 *	e.g. the packet contains User-Password, then fall
+	 *	back to encoding the request list.
+	 */
+	} else if (inst->parent->pass_through && request->packet->data) {
+		packet_len = fr_radius_encode_forward(&FR_DBUFF_TMP(out, outlen),
+						      request->packet->data, request->packet->data_len, &encode_ctx);
+		if (packet_len > 0) goto encoded;
+
+		RDEBUG3("Original packet cannot be forwarded as-is, encoding the request list");
+	}
+
+	/*
+	 *	Encode it, leaving room for Proxy-State if necessary.
+	 */
+	packet_len = fr_radius_encode(&FR_DBUFF_TMP(out, outlen),
+				      &request->request_pairs, &encode_ctx);
+	if (fr_pair_encode_is_error(packet_len)) {
+		RPERROR("Failed encoding packet");
+		return -1;
+	}
+
+	if (packet_len < 0) {
+		size_t have;
+		size_t need;
+
+		have = outlen;
+		need = have - packet_len;
+
+		if (need > RADIUS_MAX_PACKET_SIZE) {
+			RERROR("Failed encoding packet.  Have %zu bytes of buffer, need %zu bytes",
+			       have, need);
+		} else {
+			RERROR("Failed encoding packet.  Have %zu bytes of buffer, need %zu bytes.  "
+			       "Increase 'max_packet_size'", have, need);
+		}
+
+		return -1;
+	}
+
+encoded:
+	/*
+	 *	The encoded packet should NOT over-run the input buffer.
+	 */
+	fr_assert((size_t) packet_len <= outlen);
+
+	/*
+	 *	Add Proxy-State to the tail end of the packet.
+	 *
+	 *	We need to add it here, and NOT in
+	 *	request->request_pairs, because multiple modules
+	 *	may be sending the packets at the same time.
+	 */
+	if (encode_ctx.add_proxy_state) {
+		fr_pair_t	*vp;
+
+		MEM(vp = fr_pair_afrom_da(u, attr_proxy_state));
+		fr_pair_value_memdup(vp, (uint8_t const *) &inst->common_ctx.proxy_state, sizeof(inst->common_ctx.proxy_state), false);
+		fr_pair_append(&u->extra, vp);
+	}
+
+	/*
+	 *	Now that we're done mangling the packet, sign it.
+	 */
+	if (fr_radius_sign(out, NULL, (uint8_t const *) inst->secret,
+			   talloc_array_length(inst->secret) - 1) < 0) {
+		RERROR("Failed signing packet");
+		fr_pair_list_free(&u->extra);
+		return -1;
+	}
+
+	u->packet_len = packet_len;
+	memcpy(u->vector, out + RADIUS_AUTH_VECTOR_OFFSET, sizeof(u->vector));
+
+	RHEXDUMP3(out, packet_len, "Encoded packet");
+
+	return packet_len;
+}
+
+/** Revive a connection after "revive_interval"
+ *
+ */
+static void revive_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	tcp_handle_t	 	*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+
+	INFO("%s - Reviving connection %s", h->module_name, h->name);
+	trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+}
+
+/** Mark a connection dead after "zombie_interval"
+ *
+ */
+static void zombie_timeout(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+	tcp_handle_t	 	*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+
+	INFO("%s - No replies during 'zombie_period', marking connection %s as dead", h->module_name, h->name);
+
+	/*
+	 *	Don't use this connection, and re-queue all of its
+	 *	requests onto other connections.
+	 */
+	trunk_connection_signal_inactive(tconn);
+	(void) trunk_connection_requests_requeue(tconn, TRUNK_REQUEST_STATE_ALL, 0, false);
+
+	/*
+	 *	Revive the connection after a time.
+	 */
+	if (fr_event_timer_at(h, el, &h->zombie_ev,
+			      fr_time_add(now, h->inst->parent->revive_interval), revive_timeout, tconn) < 0) {
+		ERROR("Failed inserting revive timeout for connection");
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+	}
+}
+
+/** See if the connection is zombied.
+ *
+ *  We check for zombie when a request hits its final timeout.  The
+ *  packets on one connection are delivered in order, so if there was
+ *  no reply to anything sent after the request which timed out, the
+ *  home server is either dead, or very, very, busy.
+ *
+ * @return
+ *	- true if the connection is zombie.
+ *	- false if the connection is not zombie.
+ */
+static bool check_for_zombie(fr_event_list_t *el, trunk_connection_t *tconn, fr_time_t now, fr_time_t last_sent)
+{
+	tcp_handle_t	*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+
+	/*
+	 *	If we're status checking OR already zombie, don't go to zombie
+	 */
+	if (h->status_checking || h->zombie_ev) return true;
+
+	if (fr_time_eq(now, fr_time_wrap(0))) now = fr_time();
+
+	/*
+	 *	We received a reply since this packet was sent, the connection isn't zombie.
+	 */
+	if (fr_time_gteq(h->last_reply, last_sent)) return false;
+
+	/*
+	 *	If we've seen ANY response in the allowed window, then the connection is still alive.
+	 */
+	if (h->inst->parent->synchronous && fr_time_gt(last_sent, fr_time_wrap(0)) &&
+	    (fr_time_lt(fr_time_add(last_sent, h->inst->parent->response_window), now))) return false;
+
+	WARN("%s - Entering Zombie state - connection %s", h->module_name, h->name);
+	if (h->inst->parent->status_check) {
+		h->status_checking = true;
+
+		/*
+		 *	Queue up the status check packet.  It will be sent
+		 *	when the connection is writable.
+		 */
+		h->status_u->start = fr_time_wrap(0);
+		h->status_r->treq = NULL;
+
+		if (trunk_request_enqueue_on_conn(&h->status_r->treq, tconn, h->status_request,
+						     h->status_u, h->status_r, true) != TRUNK_ENQUEUE_OK) {
+			trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		}
+	} else {
+		if (fr_event_timer_at(h, el, &h->zombie_ev, fr_time_add(now, h->inst->parent->zombie_period),
+				      zombie_timeout, tconn) < 0) {
+			ERROR("Failed inserting zombie timeout for connection");
+			trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		}
+	}
+
+	return true;
+}
+
+/** How long we wait for a reply
+ *
+ * There are no retransmissions on a stream, so "max_rtx_duration" is
+ * the only retransmission setting which applies.
+ */
+static fr_time_delta_t request_timeout_delta(tcp_handle_t *h, tcp_request_t *u)
+{
+	rlm_radius_t const	*parent = h->inst->parent;
+
+	if (!parent->synchronous && fr_time_delta_ispos(parent->retry[u->code].mrd)) return parent->retry[u->code].mrd;
+
+	return parent->response_window;
+}
+
+/** Handle timeouts for requests
+ *
+ */
+static void request_timeout(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	trunk_request_t		*treq = talloc_get_type_abort(uctx, trunk_request_t);
+	tcp_request_t		*u = talloc_get_type_abort(treq->preq, tcp_request_t);
+	tcp_result_t		*r = talloc_get_type_abort(treq->rctx, tcp_result_t);
+	trunk_connection_t	*tconn = treq->tconn;
+	request_t		*request = treq->request;
+	fr_time_t		start = u->start;
+
+	fr_assert(treq->state == TRUNK_REQUEST_STATE_SENT);		/* No other states should be timing out */
+	fr_assert(treq->preq);						/* Must still have a protocol request */
+	fr_assert(u->rr);
+	fr_assert(tconn);
+	fr_assert(!u->status_check);
+
+	REDEBUG("No reply from home server after %pVs, failing request",
+		fr_box_time_delta(fr_time_sub(now, start)));
+
+	r->rcode = RLM_MODULE_FAIL;
+	trunk_request_signal_complete(treq);
+
+	check_for_zombie(el, tconn, now, start);
+}
+
+/** Handle timeouts for status checks
+ *
+ */
+static void status_check_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	trunk_request_t		*treq = talloc_get_type_abort(uctx, trunk_request_t);
+	tcp_handle_t		*h;
+	tcp_request_t		*u = talloc_get_type_abort(treq->preq, tcp_request_t);
+	tcp_result_t		*r = talloc_get_type_abort(treq->rctx, tcp_result_t);
+	trunk_connection_t	*tconn = treq->tconn;
+
+	fr_assert(treq->state == TRUNK_REQUEST_STATE_SENT);		/* No other states should be timing out */
+	fr_assert(treq->preq);						/* Must still have a protocol request */
+	fr_assert(u->rr);
+	fr_assert(tconn);
+	fr_assert(u->status_check);
+
+	h = talloc_get_type_abort(treq->tconn->conn->h, tcp_handle_t);
+
+	r->rcode = RLM_MODULE_FAIL;
+	trunk_request_signal_complete(treq);
+
+	WARN("%s - No response to status check, marking connection as dead - %s", h->module_name, h->name);
+
+	/*
+	 *	We're no longer status checking, reconnect the
+	 *	connection.
+	 */
+	h->status_checking = false;
+	trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void request_mux(fr_event_list_t *el,
+			trunk_connection_t *tconn, connection_t *conn, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	rlm_radius_tcp_t const	*inst = h->inst;
+	uint16_t		i;
+
+	/*
+	 *	Encode as many packets as we can into the send
+	 *	buffer, and then write them all at once.
+	 */
+	for (i = 0; (i < inst->max_send_coalesce) && ((h->send_size - h->send_used) >= inst->max_packet_size); i++) {
+		trunk_request_t		*treq;
+		tcp_request_t		*u;
+		request_t		*request;
+		ssize_t			slen;
+		fr_time_t		now;
+		char const		*action;
+
+ 		if (unlikely(trunk_connection_pop_request(&treq, tconn) < 0)) return;
+
+		/*
+		 *	No more requests to send
+		 */
+		if (!treq) break;
+
+ 		fr_assert((treq->state == TRUNK_REQUEST_STATE_PENDING) ||
+			   (treq->state == TRUNK_REQUEST_STATE_PARTIAL));
+
+		request = treq->request;
+		u = talloc_get_type_abort(treq->preq, tcp_request_t);
+
+		fr_assert(!u->rr);
+
+		if (unlikely(radius_track_entry_reserve(&u->rr, treq, h->tt, request, u->code, treq) < 0)) {
+#ifndef NDEBUG
+			radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__,
+					       h->tt, tcp_tracking_entry_log);
+#endif
+			fr_assert_fail("Tracking entry allocation failed: %s", fr_strerror());
+			trunk_request_signal_fail(treq);
+			continue;
+		}
+		u->id = u->rr->id;
+		u->start = now = fr_time();
+
+		slen = encode(h, request, u, u->id, h->send + h->send_used, h->send_size - h->send_used);
+		if (slen < 0) {
+			/*
+			 *	Need to do this because request_conn_release
+			 *	may not be called.
+			 */
+			tcp_request_reset(u);
+			trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		/*
+		 *	Remember the authentication vector, which now has the
+		 *	packet signature.
+		 */
+		(void) radius_track_entry_update(u->rr, u->vector);
+
+		RDEBUG("Sending %s ID %d length %zd over connection %s",
+		       fr_radius_packet_name[u->code], u->id, slen, h->name);
+		log_request_pair_list(L_DBG_LVL_2, request, NULL, &request->request_pairs, NULL);
+		if (!fr_pair_list_empty(&u->extra)) log_request_pair_list(L_DBG_LVL_2, request, NULL, &u->extra, NULL);
+
+		h->send_used += slen;
+
+		h->last_sent = now;
+		if (fr_time_lteq(h->first_sent, h->last_idle)) h->first_sent = h->last_sent;
+
+		/*
+		 *	Tell the trunk API that this request is now in
+		 *	the "sent" state.  The data may still be in our
+		 *	send buffer, but the request is our
+		 *	responsibility now.
+		 */
+		trunk_request_signal_sent(treq);
+
+		if (u->status_check) {
+			RDEBUG("Sent status check.  Expecting response within %pVs",
+			       fr_box_time_delta(request_timeout_delta(h, u)));
+
+			if (fr_event_timer_at(u, el, &u->ev, fr_time_add(now, request_timeout_delta(h, u)),
+					      status_check_timeout, treq) < 0) {
+				RERROR("Failed inserting timeout for connection");
+				trunk_request_signal_fail(treq);
+			}
+			continue;
+		}
+
+		action = inst->parent->originate ? "Originated" : "Proxied";
+		RDEBUG("%s request.  Expecting response within %pVs", action,
+		       fr_box_time_delta(request_timeout_delta(h, u)));
+
+		if (fr_event_timer_at(u, el, &u->ev, fr_time_add(now, request_timeout_delta(h, u)),
+				      request_timeout, treq) < 0) {
+			RERROR("Failed inserting timeout for connection");
+			trunk_request_signal_fail(treq);
+		}
+	}
+
+	/*
+	 *	Verify nothing accidentally freed the connection handle
+	 */
+	(void)talloc_get_type_abort(h, tcp_handle_t);
+
+	if (tcp_flush(h) < 0) {
+		/*
+		 *	Will re-queue any 'sent' requests, so we don't
+		 *	have to do any cleanup.
+		 */
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+		return;
+	}
+
+	if (h->write_armed != (h->want_write || tcp_write_pending(h))) (void) tcp_fd_events(h, tconn);
+}
+
+/** Deal with Protocol-Error replies
+ *
+ * The receive buffer can always hold the largest RADIUS packet, so
+ * there's no need to negotiate Response-Length.
+ */
+static void protocol_error_reply(tcp_request_t *u, tcp_result_t *r, tcp_handle_t *h)
+{
+	uint8_t const	*attr, *end;
+
+	end = h->buffer + fr_nbo_to_uint16(h->buffer + 2);
+
+	for (attr = h->buffer + RADIUS_HEADER_LENGTH;
+	     attr < end;
+	     attr += attr[1]) {
+		/*
+		 *	Protocol-Error packets MUST contain an
+		 *	Original-Packet-Code attribute.
+		 *
+		 *	The attribute containing the
+		 *	Original-Packet-Code is an extended
+		 *	attribute.
+		 */
+		if (attr[0] != attr_extended_attribute_1->attr) continue;
+
+		/*
+		 *	ATTR + LEN + EXT-Attr + uint32
+		 */
+		if (attr[1] != 7) continue;
+
+		/*
+		 *	See if there's an Original-Packet-Code.
+		 */
+		if (attr[2] != (uint8_t)attr_original_packet_code->attr) continue;
+
+		/*
+		 *	Has to be an 8-bit number, and has to match.
+		 */
+		if ((attr[3] != 0) ||
+		    (attr[4] != 0) ||
+		    (attr[5] != 0) ||
+		    (attr[6] != u->code)) {
+			if (r) r->rcode = RLM_MODULE_FAIL;
+			return;
+		}
+	}
+
+	/*
+	 *	The response is valid, but not useful for anything.
+	 */
+	if (r) r->rcode = RLM_MODULE_HANDLED;
+}
+
+/** Deal with replies to status checks
+ *
+ */
+static void status_check_reply(trunk_request_t *treq)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(treq->tconn->conn->h, tcp_handle_t);
+	tcp_request_t		*u = talloc_get_type_abort(treq->preq, tcp_request_t);
+	tcp_result_t		*r = talloc_get_type_abort(treq->rctx, tcp_result_t);
+
+	fr_assert(treq->preq == h->status_u);
+	fr_assert(treq->rctx == h->status_r);
+
+	r->treq = NULL;
+
+	DEBUG("Received reply to status check, marking connection as active - %s", h->name);
+
+	/*
+	 *	Set the "last idle" time to now, so that we don't
+	 *	restart zombie_period until sufficient time has
+	 *	passed.
+	 */
+	h->last_idle = fr_time();
+
+	/*
+	 *	Reset the counters, and free u->ev.
+	 */
+	status_check_reset(h, u);
+	trunk_connection_signal_active(treq->tconn);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void request_demux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn, connection_t *conn, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	DEBUG3("%s - Reading data for connection %s", h->module_name, h->name);
+
+	while (true) {
+		ssize_t			slen;
+
+		trunk_request_t		*treq;
+		request_t		*request;
+		tcp_request_t		*u;
+		tcp_result_t		*r;
+		radius_track_entry_t	*rr;
+		decode_fail_t		reason;
+		uint8_t			code = 0;
+		fr_pair_list_t		reply;
+
+		fr_pair_list_init(&reply);
+
+		/*
+		 *	The mem bio only gives us complete packets.
+		 *	Read all of them, as they may all have arrived
+		 *	in one TCP segment.
+		 */
+		slen = fr_bio_read(h->bio, NULL, h->buffer, h->buflen);
+		if (slen == 0) {
+			bool closed = h->fd_info->eof;
+
+#ifdef WITH_TLS
+			if (h->tls_bio && (fr_bio_tls_info(h->tls_bio)->state == FR_BIO_TLS_STATE_CLOSED)) closed = true;
+#endif
+			if (!closed) return;
+
+			ERROR("%s - Connection %s closed by home server", h->module_name, h->name);
+			trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+			return;
+		}
+
+		if (slen < 0) {
+			ERROR("%s - Failed reading response from connection %s: %s",
+			      h->module_name, h->name, fr_bio_strerror(slen));
+			trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+			return;
+		}
+
+		/*
+		 *	Validate the incoming packet.  We do this before
+		 *	looking for the request, as we may need to look
+		 *	inside of the packet to find it.
+		 */
+		if (!check(h, &slen)) {
+			WARN("%s - Ignoring malformed packet", h->module_name);
+			continue;
+		}
+
+		/*
+		 *	Note that we don't care about packet codes.  All
+		 *	packet codes share the same ID space.
+		 *
+		 *	With extended IDs, many requests share the same ID,
+		 *	and the home server tells us which one this reply
+		 *	is for.
+		 */
+		rr = radius_track_entry_find(h->tt, h->buffer[1],
+					     h->extended_id ? original_request_authenticator(h->buffer, slen) : NULL);
+		if (!rr) {
+			WARN("%s - Ignoring reply with ID %i that arrived too late",
+			     h->module_name, h->buffer[1]);
+			continue;
+		}
+
+		treq = talloc_get_type_abort(rr->uctx, trunk_request_t);
+		request = treq->request;
+		fr_assert(request != NULL);
+		u = talloc_get_type_abort(treq->preq, tcp_request_t);
+		r = talloc_get_type_abort(treq->rctx, tcp_result_t);
+
+		/*
+		 *	Decode the incoming packet
+		 */
+		reason = decode(request->reply_ctx, &reply, &code, h, request, u, rr->vector, h->buffer, (size_t)slen);
+		if (reason != DECODE_FAIL_NONE) continue;
+
+		/*
+		 *	Only valid packets are processed
+		 *	Otherwise an attacker could perform
+		 *	a DoS attack against the proxying servers
+		 *	by sending fake responses for upstream
+		 *	servers.
+		 */
+		h->last_reply = fr_time();
+
+		/*
+		 *	Status-Server can have any reply code, we don't care
+		 *	what it is.  So long as it's signed properly, we
+		 *	accept it.  This flexibility is because we don't
+		 *	expose Status-Server to the admins.  It's only used by
+		 *	this module for internal signalling.
+		 */
+		if (u == h->status_u) {
+			fr_pair_list_free(&reply);
+			status_check_reply(treq);
+			trunk_request_signal_complete(treq);
+			continue;
+		}
+
+		/*
+		 *	Handle any state changes, etc. needed by receiving a
+		 *	Protocol-Error reply packet.
+		 *
+		 *	Protocol-Error is permitted as a reply to any
+		 *	packet.
+		 */
+		switch (code) {
+		case FR_RADIUS_CODE_PROTOCOL_ERROR:
+			protocol_error_reply(u, r, h);
+			break;
+
+		default:
+			break;
+		}
+
+		/*
+		 *	Mark up the request as being an Access-Challenge, if
+		 *	required.
+		 *
+		 *	We don't do this for other packet types, because the
+		 *	ok/fail nature of the module return code will
+		 *	automatically result in it the parent request
+		 *	returning an ok/fail packet code.
+		 */
+		if ((u->code == FR_RADIUS_CODE_ACCESS_REQUEST) && (code == FR_RADIUS_CODE_ACCESS_CHALLENGE)) {
+			fr_pair_t	*vp;
+
+			vp = fr_pair_find_by_da(&request->reply_pairs, NULL, attr_packet_type);
+			if (!vp) {
+				MEM(vp = fr_pair_afrom_da(request->reply_ctx, attr_packet_type));
+				vp->vp_uint32 = FR_RADIUS_CODE_ACCESS_CHALLENGE;
+				fr_pair_append(&request->reply_pairs, vp);
+			}
+		}
+
+		/*
+		 *	Delete Proxy-State attributes from the reply.
+		 */
+		fr_pair_delete_by_da(&reply, attr_proxy_state);
+
+		/*
+		 *	If the reply has Message-Authenticator, delete
+		 *	it from the proxy reply so that it isn't
+		 *	copied over to our reply.  But also create a
+		 *	reply.Message-Authenticator attribute, so that
+		 *	it ends up in our reply.
+		 */
+		if (fr_pair_find_by_da(&reply, NULL, attr_message_authenticator)) {
+			fr_pair_t *vp;
+
+			fr_pair_delete_by_da(&reply, attr_message_authenticator);
+
+			MEM(vp = fr_pair_afrom_da(request->reply_ctx, attr_message_authenticator));
+			(void) fr_pair_value_memdup(vp, (uint8_t const *) "", 1, false);
+			fr_pair_append(&request->reply_pairs, vp);
+		}
+
+		treq->request->reply->code = code;
+		r->rcode = radius_code_to_rcode[code];
+		fr_pair_list_append(&request->reply_pairs, &reply);
+		trunk_request_signal_complete(treq);
+	}
+}
+
+/** Remove the request from any tracking structures
+ *
+ */
+static void request_cancel(UNUSED connection_t *conn, void *preq_to_reset,
+			   UNUSED trunk_cancel_reason_t reason, UNUSED void *uctx)
+{
+	tcp_request_t	*u = talloc_get_type_abort(preq_to_reset, tcp_request_t);
+
+	/*
+	 *	The request may be re-sent on another connection,
+	 *	so the timer has to go.
+	 */
+	if (u->ev) (void) fr_event_timer_delete(&u->ev);
+
+	/*
+	 *      Other cancellations are dealt with by
+	 *      request_conn_release as the request is removed
+	 *	from the trunk.
+	 */
+}
+
+/** Clear out anything associated with the handle from the request
+ *
+ */
+static void request_conn_release(connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	tcp_request_t		*u = talloc_get_type_abort(preq_to_reset, tcp_request_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	if (u->ev) (void)fr_event_timer_delete(&u->ev);
+	tcp_request_reset(u);
+
+	u->num_replies = 0;
+
+	/*
+	 *	If there are no outstanding tracking entries
+	 *	allocated then the connection is "idle".
+	 */
+	if (!h->tt || (h->tt->num_requests == 0)) h->last_idle = fr_time();
+}
+
+/** Write out a canned failure
+ *
+ */
+static void request_fail(request_t *request, void *preq, void *rctx,
+			 NDEBUG_UNUSED trunk_request_state_t state, UNUSED void *uctx)
+{
+	tcp_result_t		*r = talloc_get_type_abort(rctx, tcp_result_t);
+	tcp_request_t		*u = talloc_get_type_abort(preq, tcp_request_t);
+
+	fr_assert(!u->rr && fr_pair_list_empty(&u->extra) && !u->ev);	/* Dealt with by request_conn_release */
+
+	fr_assert(state != TRUNK_REQUEST_STATE_INIT);
+
+	if (u->status_check) return;
+
+	r->rcode = RLM_MODULE_FAIL;
+	r->treq = NULL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Response has already been written to the rctx at this point
+ *
+ */
+static void request_complete(request_t *request, void *preq, void *rctx, UNUSED void *uctx)
+{
+	tcp_result_t		*r = talloc_get_type_abort(rctx, tcp_result_t);
+	tcp_request_t		*u = talloc_get_type_abort(preq, tcp_request_t);
+
+	fr_assert(!u->rr && fr_pair_list_empty(&u->extra) && !u->ev);	/* Dealt with by request_conn_release */
+
+	if (u->status_check) return;
+
+	r->treq = NULL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Explicitly free resources associated with the protocol request
+ *
+ */
+static void request_free(UNUSED request_t *request, void *preq_to_free, UNUSED void *uctx)
+{
+	tcp_request_t		*u = talloc_get_type_abort(preq_to_free, tcp_request_t);
+
+	fr_assert(!u->rr && fr_pair_list_empty(&u->extra) && !u->ev);	/* Dealt with by request_conn_release */
+
+	/*
+	 *	Don't free status check requests.
+	 */
+	if (u->status_check) return;
+
+	talloc_free(u);
+}
+
+/** Resume execution of the request, returning the rcode set during trunk execution
+ *
+ */
+static unlang_action_t mod_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, UNUSED request_t *request)
+{
+	tcp_result_t	*r = talloc_get_type_abort(mctx->rctx, tcp_result_t);
+	rlm_rcode_t	rcode = r->rcode;
+
+	talloc_free(r);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static void mod_signal(module_ctx_t const *mctx, UNUSED request_t *request, fr_signal_t action)
+{
+	tcp_result_t		*r = talloc_get_type_abort(mctx->rctx, tcp_result_t);
+
+	/*
+	 *	If we don't have a treq associated with the
+	 *	rctx it's likely because the request was
+	 *	scheduled, but hasn't yet been resumed, and
+	 *	has received a signal, OR has been resumed
+	 *	and immediately cancelled as the event loop
+	 *	is exiting, in which case
+	 *	unlang_request_is_scheduled will return false
+	 *	(don't use it).
+	 */
+	if (!r->treq) {
+		talloc_free(r);
+		return;
+	}
+
+	switch (action) {
+	/*
+	 *	The request is being cancelled, tell the
+	 *	trunk so it can clean up the treq.
+	 */
+	case FR_SIGNAL_CANCEL:
+		trunk_request_signal_cancel(r->treq);
+		r->treq = NULL;
+		talloc_free(r);		/* Should be freed soon anyway, but better to be explicit */
+		return;
+
+	/*
+	 *	The NAS retransmitted the packet.  We don't
+	 *	retransmit on a reliable transport, the packet we
+	 *	sent will get to the home server.
+	 */
+	case FR_SIGNAL_DUP:
+		return;
+
+	default:
+		return;
+	}
+}
+
+#ifndef NDEBUG
+/** Free a tcp_result_t
+ *
+ * Allows us to set break points for debugging.
+ */
+static int _tcp_result_free(tcp_result_t *r)
+{
+	trunk_request_t		*treq;
+	tcp_request_t		*u;
+
+	if (!r->treq) return 0;
+
+	treq = talloc_get_type_abort(r->treq, trunk_request_t);
+	u = talloc_get_type_abort(treq->preq, tcp_request_t);
+
+	fr_assert_msg(!u->ev, "tcp_result_t freed with active timer");
+
+	return 0;
+}
+#endif
+
+/** Free a tcp_request_t
+ */
+static int _tcp_request_free(tcp_request_t *u)
+{
+	if (u->ev) (void) fr_event_timer_delete(&u->ev);
+
+	fr_assert(u->rr == NULL);
+
+	return 0;
+}
+
+/** Cost of sending another request to this home server
+ *
+ * The outstanding requests, weighted by how long the home server has
+ * recently been taking to respond.
+ */
+static uint64_t mod_load(module_ctx_t const *mctx)
+{
+	tcp_thread_t		*t = talloc_get_type_abort(mctx->thread, tcp_thread_t);
+
+	if (!t->trunk) return 0;
+
+	return (t->trunk->req_alloc + 1) * (uint64_t)(fr_time_delta_to_usec(t->trunk->latency) + 1);
+}
+
+static unlang_action_t mod_enqueue(rlm_rcode_t *p_result, void **rctx_out, void *instance, void *thread, request_t *request)
+{
+	rlm_radius_tcp_t		*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+	tcp_thread_t			*t = talloc_get_type_abort(thread, tcp_thread_t);
+	tcp_result_t			*r;
+	tcp_request_t			*u;
+	trunk_request_t			*treq;
+
+	fr_assert(request->packet->code > 0);
+	fr_assert(request->packet->code < FR_RADIUS_CODE_MAX);
+
+	if (request->packet->code == FR_RADIUS_CODE_STATUS_SERVER) {
+		RWDEBUG("Status-Server is reserved for internal use, and cannot be sent manually.");
+		RETURN_MODULE_NOOP;
+	}
+
+	treq = trunk_request_alloc(t->trunk, request);
+	if (!treq) RETURN_MODULE_FAIL;
+
+	MEM(r = talloc_zero(request, tcp_result_t));
+#ifndef NDEBUG
+	talloc_set_destructor(r, _tcp_result_free);
+#endif
+
+	/*
+	 *	Can't use compound literal - const issues.
+	 */
+	MEM(u = talloc_zero(treq, tcp_request_t));
+	u->code = request->packet->code;
+	u->synchronous = inst->parent->synchronous;
+	u->priority = request->async->priority;
+	u->recv_time = request->async->recv_time;
+	fr_pair_list_init(&u->extra);
+
+	r->rcode = RLM_MODULE_FAIL;
+
+	/*
+	 *	Make sure that we print out the actual encoded value
+	 *	of the Message-Authenticator attribute.  If the caller
+	 *	asked for one, delete theirs (which has a bad value),
+	 *	and remember to add one manually when we encode the
+	 *	packet.  This is the only editing we do on the input
+	 *	request.
+	 *
+	 *	@todo - don't edit the input packet!
+	 */
+	if (fr_pair_find_by_da(&request->request_pairs, NULL, attr_message_authenticator)) {
+		u->require_message_authenticator = true;
+		pair_delete_request(attr_message_authenticator);
+	}
+
+	switch(trunk_request_enqueue(&treq, t->trunk, request, u, r)) {
+	case TRUNK_ENQUEUE_OK:
+	case TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	case TRUNK_ENQUEUE_NO_CAPACITY:
+		REDEBUG("Unable to queue packet - connections at maximum capacity");
+	fail:
+		fr_assert(!u->rr);			/* Should not have been fed to the muxer */
+		trunk_request_free(&treq);		/* Return to the free list */
+		talloc_free(r);
+		RETURN_MODULE_FAIL;
+
+	case TRUNK_ENQUEUE_DST_UNAVAILABLE:
+		REDEBUG("All destinations are down - cannot send packet");
+		goto fail;
+
+	case TRUNK_ENQUEUE_FAIL:
+		REDEBUG("Unable to queue packet");
+		goto fail;
+	}
+
+	r->treq = treq;	/* Remember for signalling purposes */
+
+	talloc_set_destructor(u, _tcp_request_free);
+
+	*rctx_out = r;
+
+	return UNLANG_ACTION_YIELD;
+}
+
+/** Instantiate thread data for the submodule.
+ *
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_radius_tcp_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_radius_tcp_t);
+	tcp_thread_t			*thread = talloc_get_type_abort(mctx->thread, tcp_thread_t);
+
+	static trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = thread_conn_alloc,
+						.connection_notify = thread_conn_notify,
+						.request_prioritise = request_prioritise,
+						.request_mux = request_mux,
+						.request_demux = request_demux,
+						.request_conn_release = request_conn_release,
+						.request_complete = request_complete,
+						.request_fail = request_fail,
+						.request_cancel = request_cancel,
+						.request_free = request_free
+					};
+
+	thread->el = mctx->el;
+	thread->inst = inst;
+
+#ifdef WITH_TLS
+	if (inst->tls_conf) {
+		thread->ssl_ctx = fr_tls_ctx_alloc(inst->tls_conf, true);
+		if (!thread->ssl_ctx) return -1;
+	}
+#endif
+
+	thread->trunk = trunk_alloc(thread, mctx->el, &io_funcs,
+				    &inst->trunk_conf, inst->parent->name, thread, false);
+	if (!thread->trunk) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
+{
+	tcp_thread_t			*thread = talloc_get_type_abort(mctx->thread, tcp_thread_t);
+
+	TALLOC_FREE(thread->trunk);
+
+#ifdef WITH_TLS
+	if (likely(thread->ssl_ctx != NULL)) SSL_CTX_free(thread->ssl_ctx);
+	thread->ssl_ctx = NULL;
+#else
+	(void) thread;
+#endif
+
+	return 0;
+}
+
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	rlm_radius_t		*parent = talloc_get_type_abort(mctx->mi->parent->data, rlm_radius_t);
+	rlm_radius_tcp_t	*inst = talloc_get_type_abort(mctx->mi->data, rlm_radius_tcp_t);
+	CONF_SECTION		*conf = mctx->mi->conf;
+	CONF_SECTION		*tls;
+
+	if (!parent) {
+		ERROR("IO module cannot be instantiated directly");
+		return -1;
+	}
+
+	inst->parent = parent;
+
+	if (parent->replicate) {
+		cf_log_err(conf, "'replicate = yes' is not supported with 'transport = tcp'");
+		return -1;
+	}
+
+	if (inst->max_send_coalesce == 0) inst->max_send_coalesce = 1;
+
+	/*
+	 *	Ensure that we have a destination address.
+	 */
+	if (inst->dst_ipaddr.af == AF_UNSPEC) {
+		cf_log_err(conf, "A value must be given for 'ipaddr'");
+		return -1;
+	}
+
+	tls = cf_section_find(conf, "tls", NULL);
+#ifdef WITH_TLS
+	if (tls) {
+		inst->tls_conf = fr_tls_conf_parse_client(tls);
+		if (!inst->tls_conf) {
+			cf_log_err(tls, "Failed parsing TLS configuration");
+			return -1;
+		}
+
+		/*
+		 *	RFC 6614 Section 2.3 says that the secret is
+		 *	"radsec".  Allow it to be changed, as some home
+		 *	servers are configured otherwise.
+		 */
+		if (!inst->secret) inst->secret = talloc_typed_strdup(inst, "radsec");
+	}
+#else
+	if (tls) {
+		cf_log_err(tls, "TLS is not supported, the server was built without OpenSSL");
+		return -1;
+	}
+#endif
+
+	if (!inst->secret) {
+		cf_log_err(conf, "A value must be given for 'secret'");
+		return -1;
+	}
+
+	inst->common_ctx = (fr_radius_ctx_t) {
+		.secret = inst->secret,
+		.secret_length = talloc_array_length(inst->secret) - 1,
+		.proxy_state = inst->parent->proxy_state,
+	};
+
+	/*
+	 *	If src_ipaddr isn't set, make sure it's INADDR_ANY, of
+	 *	the same address family as dst_ipaddr.
+	 */
+	if (inst->src_ipaddr.af == AF_UNSPEC) {
+		memset(&inst->src_ipaddr, 0, sizeof(inst->src_ipaddr));
+
+		inst->src_ipaddr.af = inst->dst_ipaddr.af;
+
+		if (inst->src_ipaddr.af == AF_INET) {
+			inst->src_ipaddr.prefix = 32;
+		} else {
+			inst->src_ipaddr.prefix = 128;
+		}
+	}
+
+	else if (inst->src_ipaddr.af != inst->dst_ipaddr.af) {
+		cf_log_err(conf, "The 'ipaddr' and 'src_ipaddr' configuration items must "
+			   "be both of the same address family");
+		return -1;
+	}
+
+	if (!inst->dst_port) {
+		cf_log_err(conf, "A value must be given for 'port'");
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 64);
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
+
+	if (inst->recv_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, >=, inst->max_packet_size);
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, <=, (1 << 30));
+	}
+
+	if (inst->send_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, >=, inst->max_packet_size);
+		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, <=, (1 << 30));
+	}
+
+	memcpy(&inst->trunk_conf, &inst->parent->trunk_conf, sizeof(inst->trunk_conf));
+	inst->trunk_conf.req_pool_headers = 3;	/* One for the request, one for the tracking binding, one for Proxy-State VP */
+	inst->trunk_conf.req_pool_size = sizeof(tcp_request_t) + sizeof(radius_track_entry_t ***) + sizeof(fr_pair_t) + 20;
+
+	return 0;
+}
+
+extern rlm_radius_io_t rlm_radius_tcp;
+rlm_radius_io_t rlm_radius_tcp = {
+	.common = {
+		.magic			= MODULE_MAGIC_INIT,
+		.name			= "radius_tcp",
+		.inst_size		= sizeof(rlm_radius_tcp_t),
+
+		.thread_inst_size	= sizeof(tcp_thread_t),
+		.thread_inst_type	= "tcp_thread_t",
+
+		.config			= module_config,
+		.instantiate		= mod_instantiate,
+		.thread_instantiate 	= mod_thread_instantiate,
+		.thread_detach		= mod_thread_detach,
+	},
+	.enqueue		= mod_enqueue,
+	.signal			= mod_signal,
+	.resume			= mod_resume,
+	.get_load		= mod_load,
+};
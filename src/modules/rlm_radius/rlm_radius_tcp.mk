@@ -0,0 +1,6 @@
+TARGETNAME	:= rlm_radius_tcp
+TARGET		:= $(TARGETNAME)$(L)
+
+SOURCES		:= rlm_radius_tcp.c track.c
+
+TGT_PREREQS	:= libfreeradius-radius$(L) libfreeradius-bio$(L)
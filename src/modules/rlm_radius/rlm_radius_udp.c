@@ -45,6 +45,14 @@ RCSID("$Id$")
 #define check(_handle, _len_p) fr_radius_ok((_handle)->buffer, (size_t *)(_len_p), \
 					    (_handle)->thread->inst->parent->max_attributes, false, NULL)
 
+/** A destination for replicated packets
+ *
+ */
+typedef struct {
+	struct sockaddr_storage	addr;			//!< Where to send the packet.
+	socklen_t		addr_len;		//!< Length of addr.
+} udp_destination_t;
+
 /** Static configuration for the module.
  *
  */
@@ -53,6 +61,11 @@ typedef struct {
 	CONF_SECTION		*config;
 
 	fr_ipaddr_t		dst_ipaddr;		//!< IP of the home server.
+	fr_ipaddr_t		*replicate_to;		//!< Other home servers which are sent copies
+							///< of each replicated packet.
+	udp_destination_t	*dst;			//!< dst_ipaddr followed by replicate_to.
+							///< Only set if there's more than one.
+	uint16_t		num_dst;		//!< How many destinations each packet is sent to.
 	fr_ipaddr_t		src_ipaddr;		//!< IP we open our socket on.
 	uint16_t		dst_port;		//!< Port of the home server.
 	char const		*secret;		//!< Shared secret.
@@ -92,6 +105,7 @@ typedef struct udp_request_s udp_request_t;
 typedef struct {
 	struct iovec		out;			//!< Describes buffer to send.
 	trunk_request_t	*treq;				//!< Used for signalling.
+	bool			sign;			//!< Packet was encoded, but still needs to be signed.
 } udp_coalesced_t;
 
 /** Track the handle, which is tightly correlated with the FD
@@ -128,6 +142,11 @@ typedef struct {
 	size_t			buflen;			//!< Receive buffer length.
 
 	radius_track_t		*tt;			//!< RADIUS ID tracking structure.
+	bool			extended_id;		//!< The home server echoes Original-Request-Authenticator,
+							///< so replies are matched by ID and Request Authenticator.
+
+	fr_time_delta_t		srtt;			//!< Smoothed round trip time, as per RFC 6298.
+	fr_time_delta_t		rttvar;			//!< Round trip time variation.
 
 	fr_time_t		mrs_time;		//!< Most recent sent time which had a reply.
 	fr_time_t		last_reply;		//!< When we last received a reply.
@@ -167,8 +186,21 @@ struct udp_request_s {
 	radius_track_entry_t	*rr;			//!< ID tracking, resend count, etc.
 	fr_event_timer_t const	*ev;			//!< timer for retransmissions
 	fr_retry_t		retry;			//!< retransmission timers
+	fr_retry_config_t	retry_config;		//!< with the initial retransmission time
+							///< calculated from the connection's RTT.
 };
 
+/** Smallest initial retransmission time we will calculate from the RTT
+ *
+ * RFC 6298 uses one second, which is tuned for TCP across the Internet.
+ */
+#define ADAPTIVE_RTX_MIN	fr_time_delta_from_msec(200)
+
+/** Clock granularity, "G" in RFC 6298
+ *
+ */
+#define ADAPTIVE_RTX_G		fr_time_delta_from_msec(1)
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_TYPE_FLAGS("ipaddr", FR_TYPE_COMBO_IP_ADDR, 0, rlm_radius_udp_t, dst_ipaddr), },
 	{ FR_CONF_OFFSET_TYPE_FLAGS("ipv4addr", FR_TYPE_IPV4_ADDR, 0, rlm_radius_udp_t, dst_ipaddr) },
@@ -176,6 +208,8 @@ static const conf_parser_t module_config[] = {
 
 	{ FR_CONF_OFFSET("port", rlm_radius_udp_t, dst_port) },
 
+	{ FR_CONF_OFFSET_TYPE_FLAGS("replicate_to", FR_TYPE_COMBO_IP_ADDR, CONF_FLAG_MULTI, rlm_radius_udp_t, replicate_to) },
+
 	{ FR_CONF_OFFSET_FLAGS("secret", CONF_FLAG_REQUIRED, rlm_radius_udp_t, secret) },
 
 	{ FR_CONF_OFFSET("interface", rlm_radius_udp_t, interface) },
@@ -208,6 +242,7 @@ static fr_dict_attr_t const *attr_message_authenticator;
 static fr_dict_attr_t const *attr_eap_message;
 static fr_dict_attr_t const *attr_nas_identifier;
 static fr_dict_attr_t const *attr_original_packet_code;
+static fr_dict_attr_t const *attr_original_request_authenticator;
 static fr_dict_attr_t const *attr_proxy_state;
 static fr_dict_attr_t const *attr_response_length;
 static fr_dict_attr_t const *attr_user_password;
@@ -222,6 +257,7 @@ fr_dict_attr_autoload_t rlm_radius_udp_dict_attr[] = {
 	{ .out = &attr_eap_message, .name = "EAP-Message", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_nas_identifier, .name = "NAS-Identifier", .type = FR_TYPE_STRING, .dict = &dict_radius},
 	{ .out = &attr_original_packet_code, .name = "Extended-Attribute-1.Original-Packet-Code", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_original_request_authenticator, .name = "Vendor-Specific.FreeRADIUS.Original-Request-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_proxy_state, .name = "Proxy-State", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_response_length, .name = "Extended-Attribute-1.Response-Length", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius},
@@ -251,7 +287,7 @@ static rlm_rcode_t radius_code_to_rcode[FR_RADIUS_CODE_MAX] = {
 static void		conn_writable_status_check(UNUSED fr_event_list_t *el, UNUSED int fd,
 						   UNUSED int flags, void *uctx);
 
-static int 		encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_t *u, uint8_t id);
+static int 		encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_t *u, uint8_t id, bool sign);
 
 static decode_fail_t	decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *response_code,
 			       udp_handle_t *h, request_t *request, udp_request_t *u,
@@ -260,6 +296,39 @@ static decode_fail_t	decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *res
 
 static void		protocol_error_reply(udp_request_t *u, udp_result_t *r, udp_handle_t *h);
 
+/** Find the Original-Request-Authenticator in a reply, without decoding it
+ *
+ * The packet MUST have been validated by fr_radius_ok() first.
+ *
+ * @param[in] packet		to search.
+ * @param[in] packet_len	of the packet.
+ * @return
+ *	- The Request Authenticator the home server says this is a reply to.
+ *	- NULL if the packet doesn't contain one.
+ */
+static uint8_t const *original_request_authenticator(uint8_t const *packet, size_t packet_len)
+{
+	uint8_t const *attr, *end = packet + packet_len;
+
+	for (attr = packet + RADIUS_HEADER_LENGTH; (attr + 2) <= end; attr += attr[1]) {
+		if (attr[1] < 2) return NULL;
+
+		/*
+		 *	Vendor-Specific, PEN, then one vendor
+		 *	attribute holding the authenticator.
+		 */
+		if ((attr[0] != FR_VENDOR_SPECIFIC) ||
+		    (attr[1] != (2 + 4 + 2 + RADIUS_AUTH_VECTOR_LENGTH)) ||
+		    (fr_nbo_to_uint32(attr + 2) != VENDORPEC_FREERADIUS) ||
+		    (attr[6] != attr_original_request_authenticator->attr) ||
+		    (attr[7] != (2 + RADIUS_AUTH_VECTOR_LENGTH))) continue;
+
+		return attr + 8;
+	}
+
+	return NULL;
+}
+
 #ifndef NDEBUG
 /** Log additional information about a tracking entry
  *
@@ -569,6 +638,31 @@ static void conn_readable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
 		   h, h->status_request, h->status_u, u->packet + RADIUS_AUTH_VECTOR_OFFSET,
 		   h->buffer, slen) != DECODE_FAIL_NONE) return;
 
+	/*
+	 *	We need the home server to tell us which request each
+	 *	reply is for, otherwise we can't have more than 256
+	 *	packets outstanding.  There's no point in opening a
+	 *	connection we can't use properly.
+	 */
+	if (inst->extended_id && !h->extended_id) {
+		fr_pair_t *vp;
+
+		vp = fr_pair_find_by_da_nested(&reply, NULL, attr_original_request_authenticator);
+		if (!vp || (vp->vp_length != RADIUS_AUTH_VECTOR_LENGTH) ||
+		    (memcmp(vp->vp_octets, u->packet + RADIUS_AUTH_VECTOR_OFFSET, RADIUS_AUTH_VECTOR_LENGTH) != 0)) {
+			ERROR("%s - Home server does not support extended IDs (no valid Original-Request-Authenticator"
+			      " in response to %s) - %s",
+			      h->module_name, fr_radius_packet_name[u->code], h->name);
+			fr_pair_list_free(&reply);
+			connection_signal_reconnect(conn, CONNECTION_FAILED);
+			return;
+		}
+
+		DEBUG("%s - Home server supports extended IDs - %s", h->module_name, h->name);
+		h->extended_id = true;
+		radius_track_use_authenticator(h->tt, true);
+	}
+
 	fr_pair_list_free(&reply);	/* FIXME - Do something with these... */
 
 	/*
@@ -640,7 +734,7 @@ static void conn_writable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
 	DEBUG("%s - Sending %s ID %d over connection %s",
 	      h->module_name, fr_radius_packet_name[u->code], u->id, h->name);
 
-	if (encode(h->inst, h->status_request, u, u->id) < 0) {
+	if (encode(h->inst, h->status_request, u, u->id, true) < 0) {
 	fail:
 		connection_signal_reconnect(conn, CONNECTION_FAILED);
 		return;
@@ -710,6 +804,28 @@ static int _udp_handle_free(udp_handle_t *h)
  * @param[in] uctx	A #udp_thread_t
  */
 CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+/** Open an unconnected UDP socket for sending to multiple destinations
+ *
+ */
+static int udp_socket_unconnected(char const *ifname, fr_ipaddr_t *src_ipaddr, uint16_t *src_port, int af)
+{
+	int sockfd;
+
+	sockfd = socket(af, SOCK_DGRAM, 0);
+	if (sockfd < 0) {
+		fr_strerror_printf("Error creating UDP socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fr_nonblock(sockfd) < 0) ||
+	    (fr_socket_bind(sockfd, ifname, src_ipaddr, src_port) < 0)) {
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
 static connection_state_t conn_init(void **h_out, connection_t *conn, void *uctx)
 {
 	int			fd;
@@ -731,12 +847,23 @@ static connection_state_t conn_init(void **h_out, connection_t *conn, void *uctx
 	 *	to the iovec structs in coalesced, so we
 	 *	just need to setup the iovec, and pass how
 	 *      many messages we want to send to sendmmsg.
+	 *
+	 *	When replicating to multiple destinations,
+	 *	there's one message per destination, all
+	 *	pointing to the same iovec.
 	 */
-	h->mmsgvec = talloc_zero_array(h, struct mmsghdr, h->inst->max_send_coalesce);
+	h->mmsgvec = talloc_zero_array(h, struct mmsghdr, h->inst->max_send_coalesce * h->inst->num_dst);
 	h->coalesced = talloc_zero_array(h, udp_coalesced_t, h->inst->max_send_coalesce);
-	for (i = 0; i < h->inst->max_send_coalesce; i++) {
-		h->mmsgvec[i].msg_hdr.msg_iov = &h->coalesced[i].out;
+	for (i = 0; i < h->inst->max_send_coalesce * h->inst->num_dst; i++) {
+		h->mmsgvec[i].msg_hdr.msg_iov = &h->coalesced[i / h->inst->num_dst].out;
 		h->mmsgvec[i].msg_hdr.msg_iovlen = 1;
+
+		if (h->inst->dst) {
+			udp_destination_t const *dst = &h->inst->dst[i % h->inst->num_dst];
+
+			h->mmsgvec[i].msg_hdr.msg_name = UNCONST(struct sockaddr_storage *, &dst->addr);
+			h->mmsgvec[i].msg_hdr.msg_namelen = dst->addr_len;
+		}
 	}
 
 	MEM(h->buffer = talloc_array(h, uint8_t, h->max_packet_size));
@@ -746,9 +873,17 @@ static connection_state_t conn_init(void **h_out, connection_t *conn, void *uctx
 
 	/*
 	 *	Open the outgoing socket.
+	 *
+	 *	Packets to multiple destinations are sent with one
+	 *	sendmmsg() call, so the socket can't be connected.
 	 */
-	fd = fr_socket_client_udp(h->inst->interface, &h->src_ipaddr, &h->src_port,
-				  &h->inst->dst_ipaddr, h->inst->dst_port, true);
+	if (h->inst->dst) {
+		fd = udp_socket_unconnected(h->inst->interface, &h->src_ipaddr, &h->src_port,
+					    h->inst->dst_ipaddr.af);
+	} else {
+		fd = fr_socket_client_udp(h->inst->interface, &h->src_ipaddr, &h->src_port,
+					  &h->inst->dst_ipaddr, h->inst->dst_port, true);
+	}
 	if (fd < 0) {
 		PERROR("%s - Failed opening socket", h->module_name);
 	fail:
@@ -759,9 +894,16 @@ static connection_state_t conn_init(void **h_out, connection_t *conn, void *uctx
 	/*
 	 *	Set the connection name.
 	 */
-	h->name = fr_asprintf(h, "proto udp local %pV port %u remote %pV port %u",
-			      fr_box_ipaddr(h->src_ipaddr), h->src_port,
-			      fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port);
+	if (h->inst->dst) {
+		h->name = fr_asprintf(h, "proto udp local %pV port %u remote %pV port %u and %u others",
+				      fr_box_ipaddr(h->src_ipaddr), h->src_port,
+				      fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port,
+				      h->inst->num_dst - 1);
+	} else {
+		h->name = fr_asprintf(h, "proto udp local %pV port %u remote %pV port %u",
+				      fr_box_ipaddr(h->src_ipaddr), h->src_port,
+				      fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port);
+	}
 
 	talloc_set_destructor(h, _udp_handle_free);
 
@@ -1206,7 +1348,7 @@ static decode_fail_t decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *res
 	return DECODE_FAIL_NONE;
 }
 
-static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_t *u, uint8_t id)
+static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_t *u, uint8_t id, bool sign)
 {
 	ssize_t			packet_len;
 	fr_radius_encode_ctx_t	encode_ctx;
@@ -1250,6 +1392,20 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 		if (vp) vp->vp_date = fr_time_to_unix_time(u->retry.updated);
 
 		encode_ctx.add_proxy_state = false;
+
+	/*
+	 *	The admin has told us that policy doesn't change the
+	 *	request.  Copy the attributes from the original
+	 *	packet, instead of encoding them all again.  If that's not possible,
+	 *	e.g. the packet contains User-Password, then fall
+	 *	back to encoding the request list.
+	 */
+	} else if (inst->parent->pass_through && request->packet->data) {
+		packet_len = fr_radius_encode_forward(&FR_DBUFF_TMP(u->packet, u->packet_len),
+						      request->packet->data, request->packet->data_len, &encode_ctx);
+		if (packet_len > 0) goto encoded;
+
+		RDEBUG3("Original packet cannot be forwarded as-is, encoding the request list");
 	}
 
 	/*
@@ -1282,6 +1438,8 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 
 		goto error;
 	}
+
+encoded:
 	/*
 	 *	The encoded packet should NOT over-run the input buffer.
 	 */
@@ -1307,6 +1465,11 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 	 */
 	u->packet_len = packet_len;
 
+	/*
+	 *	The caller will sign this packet along with others.
+	 */
+	if (!sign) return 0;
+
 	/*
 	 *	Now that we're done mangling the packet, sign it.
 	 */
@@ -1320,6 +1483,58 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 }
 
 
+/** Update the connection's round trip time estimates, as per RFC 6298 Section 2
+ *
+ * @param[in] h		the reply was received on.
+ * @param[in] rtt	of a packet which was sent once.
+ */
+static void rtt_update(udp_handle_t *h, fr_time_delta_t rtt)
+{
+	int64_t r = fr_time_delta_unwrap(rtt);
+	int64_t srtt = fr_time_delta_unwrap(h->srtt);
+	int64_t rttvar = fr_time_delta_unwrap(h->rttvar);
+
+	if (srtt == 0) {
+		srtt = r;
+		rttvar = r / 2;
+	} else {
+		int64_t delta = (srtt > r) ? (srtt - r) : (r - srtt);
+
+		rttvar = ((3 * rttvar) + delta) / 4;
+		srtt = ((7 * srtt) + r) / 8;
+	}
+
+	h->srtt = fr_time_delta_wrap(srtt);
+	h->rttvar = fr_time_delta_wrap(rttvar);
+}
+
+/** Get the retransmission configuration for a new packet
+ *
+ * If "adaptive_rtx" is set, then the initial retransmission time is the RTO
+ * calculated from the connection's RTT, clamped between ADAPTIVE_RTX_MIN and
+ * the configured max_rtx_time.  Everything else comes from the
+ * configuration.
+ */
+static fr_retry_config_t const *retry_config(udp_handle_t *h, udp_request_t *u)
+{
+	fr_retry_config_t const	*config = &h->inst->parent->retry[u->code];
+	fr_time_delta_t		rto, var;
+
+	if (!h->inst->parent->adaptive_rtx || u->status_check || !fr_time_delta_ispos(h->srtt)) return config;
+
+	var = fr_time_delta_mul(h->rttvar, 4);
+	if (fr_time_delta_lt(var, ADAPTIVE_RTX_G)) var = ADAPTIVE_RTX_G;
+
+	rto = fr_time_delta_add(h->srtt, var);
+	if (fr_time_delta_lt(rto, ADAPTIVE_RTX_MIN)) rto = ADAPTIVE_RTX_MIN;
+	if (fr_time_delta_ispos(config->mrt) && fr_time_delta_gt(rto, config->mrt)) rto = config->mrt;
+
+	u->retry_config = *config;
+	u->retry_config.irt = rto;
+
+	return &u->retry_config;
+}
+
 /** Revive a connection after "revive_interval"
  *
  */
@@ -1573,6 +1788,103 @@ static void status_check_retry(UNUSED fr_event_list_t *el, fr_time_t now, void *
         trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
 }
 
+/** Sign the packets which request_mux() has just encoded
+ *
+ * The digests for multiple packets are calculated in parallel, which
+ * is much faster than signing them one by one.  Packets which can't
+ * be signed are failed, and removed from the coalesced vector.
+ *
+ * @param[in] h		the packets will be sent on.
+ * @param[in] queued	number of entries in h->coalesced.
+ * @return the number of entries left in h->coalesced.
+ */
+static uint16_t request_sign(udp_handle_t *h, uint16_t queued)
+{
+	fr_radius_sign_t	sign[MD5_MULTI_LANES * 2];
+	uint16_t		idx[NUM_ELEMENTS(sign)];
+	uint16_t		i, j, num = 0, failed = 0;
+	size_t			secret_len = talloc_array_length(h->inst->secret) - 1;
+
+	for (i = 0; i < queued; i++) {
+		if (h->coalesced[i].sign) {
+			sign[num] = (fr_radius_sign_t) {
+				.packet = h->coalesced[i].out.iov_base,
+				.secret = (uint8_t const *) h->inst->secret,
+				.secret_len = secret_len
+			};
+			idx[num++] = i;
+		}
+
+		if ((num < NUM_ELEMENTS(sign)) && (i < (queued - 1))) continue;
+
+		j = 0;
+		while (j < num) {
+			int ret;
+
+			ret = fr_radius_sign_multi(sign + j, num - j);
+			if (ret == 0) break;
+
+			/*
+			 *	Sign the rest of the packets after the one which failed.
+			 */
+			j += -(ret + 1);
+			{
+				trunk_request_t	*treq = h->coalesced[idx[j]].treq;
+				udp_request_t	*u = talloc_get_type_abort(treq->preq, udp_request_t);
+				request_t	*request = treq->request;
+
+				RPERROR("Failed signing packet");
+				udp_request_reset(u);
+				if (u->ev) (void) fr_event_timer_delete(&u->ev);
+				trunk_request_signal_fail(treq);
+
+				h->coalesced[idx[j]].treq = NULL;
+				failed++;
+			}
+			j++;
+		}
+
+		for (j = 0; j < num; j++) {
+			trunk_request_t	*treq = h->coalesced[idx[j]].treq;
+			udp_request_t	*u;
+			request_t	*request;
+
+			if (!treq) continue;
+
+			u = talloc_get_type_abort(treq->preq, udp_request_t);
+			request = treq->request;
+
+			RHEXDUMP3(u->packet, u->packet_len, "Encoded packet");
+
+			/*
+			 *	Remember the authentication vector, which now has the
+			 *	packet signature.
+			 */
+			(void) radius_track_entry_update(u->rr, u->packet + RADIUS_AUTH_VECTOR_OFFSET);
+		}
+		num = 0;
+	}
+
+	if (!failed) return queued;
+
+	/*
+	 *	Close the gaps left by the failed requests.  mmsgvec
+	 *	points to the iovecs, so only the contents move.
+	 */
+	for (i = 0, j = 0; i < queued; i++) {
+		if (!h->coalesced[i].treq) continue;
+
+		if (i != j) {
+			h->coalesced[j].treq = h->coalesced[i].treq;
+			h->coalesced[j].out = h->coalesced[i].out;
+			h->coalesced[j].sign = h->coalesced[i].sign;
+		}
+		j++;
+	}
+
+	return j;
+}
+
 CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
 static void request_mux(fr_event_list_t *el,
 			trunk_connection_t *tconn, connection_t *conn, UNUSED void *uctx)
@@ -1609,7 +1921,7 @@ static void request_mux(fr_event_list_t *el,
 		 *	Start retransmissions from when the socket is writable.
 		 */
 		if (fr_time_eq(u->retry.start, fr_time_wrap(0))) {
-			fr_retry_init(&u->retry, fr_time(), &h->inst->parent->retry[u->code]);
+			fr_retry_init(&u->retry, fr_time(), retry_config(h, u));
 			fr_assert(fr_time_delta_ispos(u->retry.rt));
 			fr_assert(fr_time_gt(u->retry.next, fr_time_wrap(0)));
 		}
@@ -1641,7 +1953,7 @@ static void request_mux(fr_event_list_t *el,
 			RDEBUG("Sending %s ID %d length %ld over connection %s",
 			       fr_radius_packet_name[u->code], u->id, u->packet_len, h->name);
 
-			if (encode(h->inst, request, u, u->id) < 0) {
+			if (encode(h->inst, request, u, u->id, false) < 0) {
 				/*
 				 *	Need to do this because request_conn_release
 				 *	may not be called.
@@ -1651,14 +1963,10 @@ static void request_mux(fr_event_list_t *el,
 				trunk_request_signal_fail(treq);
 				continue;
 			}
-			RHEXDUMP3(u->packet, u->packet_len, "Encoded packet");
-
-			/*
-			 *	Remember the authentication vector, which now has the
-			 *	packet signature.
-			 */
-			(void) radius_track_entry_update(u->rr, u->packet + RADIUS_AUTH_VECTOR_OFFSET);
+			h->coalesced[queued].sign = true;
 		} else {
+			h->coalesced[queued].sign = false;
+
 			RDEBUG("Retransmitting %s ID %d length %ld over connection %s",
 			       fr_radius_packet_name[u->code], u->id, u->packet_len, h->name);
 		}
@@ -1701,6 +2009,9 @@ static void request_mux(fr_event_list_t *el,
 	 */
 	(void)talloc_get_type_abort(h, udp_handle_t);
 
+	queued = request_sign(h, queued);
+	if (queued == 0) return;
+
 	/*
 	 *	Send the coalesced datagrams
 	 */
@@ -1839,6 +2150,7 @@ static void request_mux_replicate(UNUSED fr_event_list_t *el,
 
 	uint16_t		i = 0, queued;
 	int			sent;
+	uint16_t		num_dst = inst->num_dst;
 	size_t			total_len = 0;
 
 	for (i = 0, queued = 0; (i < inst->max_send_coalesce) && (total_len < h->send_buff_actual); i++) {
@@ -1862,7 +2174,7 @@ static void request_mux_replicate(UNUSED fr_event_list_t *el,
 		if (!u->packet) {
 			u->id = h->last_id++;
 
-			if (encode(h->inst, request, u, u->id) < 0) {
+			if (encode(h->inst, request, u, u->id, true) < 0) {
 				trunk_request_signal_fail(treq);
 				continue;
 			}
@@ -1882,8 +2194,10 @@ static void request_mux_replicate(UNUSED fr_event_list_t *el,
 		 *	Try not to exceed the SO_SNDBUF value of the
 		 *	socket as we potentially just waste CPU
 		 *	time re-encoding the packets.
+		 *
+		 *	Each destination gets its own copy.
 		 */
-		total_len += u->packet_len;
+		total_len += u->packet_len * num_dst;
 
 		trunk_request_signal_sent(treq);
 		queued++;
@@ -1895,7 +2209,11 @@ static void request_mux_replicate(UNUSED fr_event_list_t *el,
 	 */
 	(void)talloc_get_type_abort(h, udp_handle_t);
 
-	sent = sendmmsg(h->fd, h->mmsgvec, queued, 0);
+	/*
+	 *	All copies of a packet are identical, so
+	 *	one encoding is sent to every destination.
+	 */
+	sent = sendmmsg(h->fd, h->mmsgvec, queued * num_dst, 0);
 	if (sent < 0) {		/* Error means no messages were sent */
 		sent = 0;
 
@@ -1928,8 +2246,8 @@ static void request_mux_replicate(UNUSED fr_event_list_t *el,
 			ERROR("%s - Failed sending data over connection %s: %s",
 			      h->module_name, h->name, fr_syserror(errno));
 			trunk_request_signal_fail(h->coalesced[0].treq);
-			sent = 1;
-			break;
+			for (i = 1; i < queued; i++) trunk_request_requeue(h->coalesced[i].treq);
+			return;
 
 		/*
 		 *	Will re-queue any 'sent' requests, so we don't
@@ -1943,15 +2261,27 @@ static void request_mux_replicate(UNUSED fr_event_list_t *el,
 		}
 	}
 
+	/*
+	 *	It's UDP so there should never be partial writes
+	 */
+#ifndef NDEBUG
+	for (i = 0; i < sent; i++) {
+		fr_assert((size_t)h->mmsgvec[i].msg_len == h->mmsgvec[i].msg_hdr.msg_iov->iov_len);
+	}
+#endif
+
+	/*
+	 *	A request whose copies were only sent to some of
+	 *	the destinations is still done.  Replication is
+	 *	best-effort, and sending it again would duplicate
+	 *	the copies which did go out.
+	 */
+	sent = (sent + num_dst - 1) / num_dst;
+
 	for (i = 0; i < sent; i++) {
 		trunk_request_t	*treq = h->coalesced[i].treq;
 		udp_result_t		*r = talloc_get_type_abort(treq->rctx, udp_result_t);
 
-		/*
-		 *	It's UDP so there should never be partial writes
-		 */
-		fr_assert((size_t)h->mmsgvec[i].msg_len == h->mmsgvec[i].msg_hdr.msg_iov->iov_len);
-
 		r->rcode = RLM_MODULE_OK;
 		trunk_request_signal_complete(treq);
 	}
@@ -2185,11 +2515,26 @@ static void request_demux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn,
 			continue;
 		}
 
+		/*
+		 *	Validate the incoming packet.  We do this before
+		 *	looking for the request, as we may need to look
+		 *	inside of the packet to find it.
+		 */
+		if (!check(h, &slen)) {
+			WARN("%s - Ignoring malformed packet", h->module_name);
+			continue;
+		}
+
 		/*
 		 *	Note that we don't care about packet codes.  All
 		 *	packet codes share the same ID space.
+		 *
+		 *	With extended IDs, many requests share the same ID,
+		 *	and the home server tells us which one this reply
+		 *	is for.
 		 */
-		rr = radius_track_entry_find(h->tt, h->buffer[1], NULL);
+		rr = radius_track_entry_find(h->tt, h->buffer[1],
+					     h->extended_id ? original_request_authenticator(h->buffer, slen) : NULL);
 		if (!rr) {
 			WARN("%s - Ignoring reply with ID %i that arrived too late",
 			     h->module_name, h->buffer[1]);
@@ -2203,14 +2548,8 @@ static void request_demux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn,
 		r = talloc_get_type_abort(treq->rctx, udp_result_t);
 
 		/*
-		 *	Validate and decode the incoming packet
+		 *	Decode the incoming packet
 		 */
-
-		if (!check(h, &slen)) {
-			RWARN("Ignoring malformed packet");
-			continue;
-		}
-
 		reason = decode(request->reply_ctx, &reply, &code, h, request, u, rr->vector, h->buffer, (size_t)slen);
 		if (reason != DECODE_FAIL_NONE) continue;
 
@@ -2223,6 +2562,12 @@ static void request_demux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn,
 		 */
 		h->last_reply = now = fr_time();
 
+		/*
+		 *	Only packets which weren't retransmitted give
+		 *	us a usable RTT (Karn's algorithm).
+		 */
+		if (u->retry.count == 1) rtt_update(h, fr_time_sub(now, u->retry.start));
+
 		/*
 		 *	Status-Server can have any reply code, we don't care
 		 *	what it is.  So long as it's signed properly, we
@@ -2526,6 +2871,22 @@ static int _udp_request_free(udp_request_t *u)
 	return 0;
 }
 
+/** Cost of sending another request to this home server
+ *
+ * The outstanding requests, weighted by how long the home server has
+ * recently been taking to respond.  Both go up as soon as the home
+ * server slows down, so load moves elsewhere well before
+ * zombie_period expires.
+ */
+static uint64_t mod_load(module_ctx_t const *mctx)
+{
+	udp_thread_t		*t = talloc_get_type_abort(mctx->thread, udp_thread_t);
+
+	if (!t->trunk) return 0;
+
+	return (t->trunk->req_alloc + 1) * (uint64_t)(fr_time_delta_to_usec(t->trunk->latency) + 1);
+}
+
 static unlang_action_t mod_enqueue(rlm_rcode_t *p_result, void **rctx_out, void *instance, void *thread, request_t *request)
 {
 	rlm_radius_udp_t		*inst = talloc_get_type_abort(instance, rlm_radius_udp_t);
@@ -2709,6 +3070,45 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	/*
+	 *	Replicas share the port and secret of the main
+	 *	destination, so every copy of a packet is identical.
+	 */
+	inst->num_dst = 1;
+	if (inst->replicate_to) {
+		size_t num = talloc_array_length(inst->replicate_to);
+		size_t i;
+
+		if (!inst->replicate) {
+			cf_log_err(conf, "'replicate_to' can only be used when 'replicate = yes'");
+			return -1;
+		}
+
+		if ((num + 1) > UINT16_MAX) {
+			cf_log_err(conf, "Too many 'replicate_to' destinations");
+			return -1;
+		}
+
+		inst->num_dst = num + 1;
+		inst->dst = talloc_zero_array(inst, udp_destination_t, inst->num_dst);
+
+		for (i = 0; i < inst->num_dst; i++) {
+			fr_ipaddr_t const *ipaddr = (i == 0) ? &inst->dst_ipaddr : &inst->replicate_to[i - 1];
+
+			if (ipaddr->af != inst->dst_ipaddr.af) {
+				cf_log_err(conf, "The 'ipaddr' and 'replicate_to' configuration items must "
+					   "be both of the same address family");
+				return -1;
+			}
+
+			if (fr_ipaddr_to_sockaddr(&inst->dst[i].addr, &inst->dst[i].addr_len,
+						  ipaddr, inst->dst_port) < 0) {
+				cf_log_perr(conf, "Invalid destination address");
+				return -1;
+			}
+		}
+	}
+
 	/*
 	 *	Clamp max_packet_size first before checking recv_buff and send_buff
 	 */
@@ -2769,4 +3169,5 @@ rlm_radius_io_t rlm_radius_udp = {
 	.enqueue		= mod_enqueue,
 	.signal			= mod_signal,
 	.resume			= mod_resume,
+	.get_load		= mod_load,
 };
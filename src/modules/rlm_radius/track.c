@@ -321,6 +321,10 @@ int radius_track_entry_update(radius_track_entry_t *te, uint8_t const *vector)
 	 *	array.  That way if the server responds with
 	 *	Original-Request-Authenticator, we can easily find it.
 	 */
+	if (!tt->subtree[te->id]) {
+		MEM(tt->subtree[te->id] = fr_rb_inline_talloc_alloc(tt, radius_track_entry_t, node,
+								    te_cmp, NULL));
+	}
 	if (!fr_rb_insert(tt->subtree[te->id], te)) return -1;
 
 	return 0;
@@ -364,7 +368,7 @@ radius_track_entry_t *radius_track_entry_find(radius_track_t *tt, uint8_t packet
 	 */
 	memcpy(&my_te.vector, vector, sizeof(my_te.vector));
 
-	te = fr_rb_find(tt->subtree[packet_id], &my_te);
+	te = tt->subtree[packet_id] ? fr_rb_find(tt->subtree[packet_id], &my_te) : NULL;
 
 	/*
 	 *	Not found, the packet MAY have been allocated in the
@@ -40,16 +40,14 @@ static char const porttypes[] = "ASITX";
 /*
  *	used for caching radutmp lookups in the accounting component.
  */
-typedef struct nas_port_s NAS_PORT;
-struct nas_port_s {
+typedef struct {
 	uint32_t		nasaddr;
-	uint16_t		port;
+	uint32_t		port;
 	off_t			offset;
-	NAS_PORT 		*next;
-};
+} NAS_PORT;
 
 typedef struct {
-	NAS_PORT		*nas_port_list;
+	fr_hash_table_t		*nas_port_table;	//!< NAS_PORT entries, by NAS address and port.
 } rlm_radutmp_mutable_t;
 
 typedef struct {
@@ -171,20 +169,30 @@ static unlang_action_t radutmp_zap(rlm_rcode_t *p_result, request_t *request, ch
 	RETURN_MODULE_OK;
 }
 
-/*
- *	Lookup a NAS_PORT in the nas_port_list
- */
-static NAS_PORT *nas_port_find(NAS_PORT *nas_port_list, uint32_t nasaddr, uint16_t port)
+static uint32_t nas_port_hash(void const *data)
 {
-	NAS_PORT	*cl;
+	NAS_PORT const *a = data;
 
-	for(cl = nas_port_list; cl; cl = cl->next) {
-		if (nasaddr == cl->nasaddr &&
-			port == cl->port)
-			break;
-	}
+	return fr_hash_update(&a->port, sizeof(a->port), fr_hash(&a->nasaddr, sizeof(a->nasaddr)));
+}
+
+static int8_t nas_port_cmp(void const *one, void const *two)
+{
+	NAS_PORT const *a = one, *b = two;
+	int8_t ret;
+
+	ret = CMP(a->nasaddr, b->nasaddr);
+	if (ret != 0) return ret;
 
-	return cl;
+	return CMP(a->port, b->port);
+}
+
+/*
+ *	Lookup a NAS_PORT in the nas_port_table
+ */
+static NAS_PORT *nas_port_find(fr_hash_table_t *ht, uint32_t nasaddr, uint32_t port)
+{
+	return fr_hash_table_find(ht, &(NAS_PORT){ .nasaddr = nasaddr, .port = port });
 }
 
 
@@ -421,15 +429,16 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 	/*
 	 *	Find the entry for this NAS / portno combination.
 	 */
-	if ((cache = nas_port_find(inst->mutable->nas_port_list, ut.nas_address, ut.nas_port)) != NULL) {
+	off = 0;
+	if ((cache = nas_port_find(inst->mutable->nas_port_table, ut.nas_address, ut.nas_port)) != NULL) {
 		if (lseek(fd, (off_t)cache->offset, SEEK_SET) < 0) {
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
+		off = cache->offset;
 	}
 
 	r = 0;
-	off = 0;
 	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
 		off += sizeof(u);
 		if ((u.nas_address != ut.nas_address) || (u.nas_port != ut.nas_port)) {
@@ -504,14 +513,16 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 		 *	easier than searching through the entire file.
 		 */
 		if (!cache) {
-			cache = talloc_zero(inst->mutable, NAS_PORT);
+			cache = talloc_zero(inst->mutable->nas_port_table, NAS_PORT);
 			if (cache) {
 				cache->nasaddr = ut.nas_address;
 				cache->port = ut.nas_port;
 				cache->offset = off;
-				cache->next = inst->mutable->nas_port_list;
-				inst->mutable->nas_port_list = cache;
+				if (!fr_hash_table_insert(inst->mutable->nas_port_table, cache)) talloc_free(cache);
 			}
+
+		} else {
+			cache->offset = off;
 		}
 
 		ut.type = P_LOGIN;
@@ -561,6 +572,12 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	 *	end up in a protected page.
 	 */
 	inst->mutable = talloc_zero(NULL, rlm_radutmp_mutable_t);
+	inst->mutable->nas_port_table = fr_hash_table_talloc_alloc(inst->mutable, NAS_PORT,
+								   nas_port_hash, nas_port_cmp, NULL);
+	if (!inst->mutable->nas_port_table) {
+		TALLOC_FREE(inst->mutable);
+		return -1;
+	}
 
 	return 0;
 }
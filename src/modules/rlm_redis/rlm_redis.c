@@ -33,6 +33,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/tracking.h>
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/cf_util.h>
@@ -82,9 +83,19 @@ typedef struct {
 
 	rlm_redis_lua_t		lua;					//!< Array of functions to register.
 
+	fr_redis_tracking_conf_t	client_cache;			//!< Client side caching configuration.
+
 	fr_redis_cluster_t	*cluster;				//!< Redis cluster.
+	fr_redis_tracking_t	*tracking;				//!< Receives key invalidations for client_cache.
 } rlm_redis_t;
 
+/** rlm_redis thread instance
+ *
+ */
+typedef struct {
+	fr_redis_tracking_cache_t	*cache;				//!< Replies to read only commands.
+} rlm_redis_thread_t;
+
 static int lua_func_body_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, conf_parser_t const *rule);
 
 static conf_parser_t module_lua_func[] = {
@@ -100,8 +111,17 @@ static conf_parser_t module_lua[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static conf_parser_t module_client_cache[] = {
+	{ FR_CONF_OFFSET("max_entries", fr_redis_tracking_conf_t, max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("lifetime", fr_redis_tracking_conf_t, lifetime), .dflt = "60" },
+	{ FR_CONF_OFFSET("reconnection_delay", fr_redis_tracking_conf_t, reconnection_delay), .dflt = "1" },
+	{ FR_CONF_OFFSET_FLAGS("prefix", CONF_FLAG_MULTI, fr_redis_tracking_conf_t, prefix) },
+	CONF_PARSER_TERMINATOR
+};
+
 static conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_SUBSECTION("lua", 0, rlm_redis_t, lua, module_lua) },
+	{ FR_CONF_OFFSET_SUBSECTION("client_cache", 0, rlm_redis_t, client_cache, module_client_cache) },
 	REDIS_COMMON_CONFIG,
 	CONF_PARSER_TERMINATOR
 };
@@ -591,10 +611,13 @@ static xlat_action_t redis_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 				request_t *request, fr_value_box_list_t *in)
 {
 	rlm_redis_t const	*inst = talloc_get_type_abort_const(xctx->mctx->mi->data, rlm_redis_t);
+	rlm_redis_thread_t	*t = talloc_get_type_abort(xctx->mctx->thread, rlm_redis_thread_t);
 	xlat_action_t		action = XLAT_ACTION_DONE;
 	fr_redis_conn_t		*conn;
 
 	bool			read_only = false;
+	bool			cacheable = false;
+	uint64_t		gen = 0;
 	uint8_t	const		*key = NULL;
 	size_t			key_len = 0;
 
@@ -735,6 +758,27 @@ static xlat_action_t redis_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	 	key_len = arg_len[1];
 	}
 
+	if (t->cache && fr_redis_tracking_cacheable(inst->tracking, argc, argv, arg_len)) {
+		MEM(vb_out = fr_value_box_alloc_null(ctx));
+
+		switch (fr_redis_tracking_cache_find(ctx, vb_out, &gen, t->cache, argc, argv, arg_len)) {
+		case 1:
+			RDEBUG2("Using cached reply to: %pV", fr_value_box_list_head(in));
+			fr_dcursor_append(out, vb_out);
+			return XLAT_ACTION_DONE;
+
+		case 0:
+			talloc_free(vb_out);
+			cacheable = true;
+			break;
+
+		default:
+			RPERROR("Failed copying cached reply");
+			talloc_free(vb_out);
+			return XLAT_ACTION_FAIL;
+		}
+	}
+
 	for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, request, key, key_len, read_only);
 	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
 	     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, request, status, &reply)) {
@@ -767,6 +811,7 @@ reply_parse:
 		action = XLAT_ACTION_FAIL;
 		goto finish;
 	}
+	if (cacheable) fr_redis_tracking_cache_insert(t->cache, gen, argc, argv, arg_len, vb_out);
 	fr_dcursor_append(out, vb_out);
 
 finish:
@@ -784,6 +829,32 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	inst->cluster = fr_redis_cluster_alloc(inst, mctx->mi->conf, &inst->conf, true, NULL, NULL, NULL);
 	if (!inst->cluster) return -1;
 
+	/*
+	 *	Invalidations are only received from the node
+	 *	the tracking connection is open to, so we can't
+	 *	cache replies from any other nodes.
+	 */
+	if (inst->client_cache.max_entries > 0) {
+		if (inst->conf.use_cluster_map || (talloc_array_length(inst->conf.hostname) != 1)) {
+			cf_log_err(mctx->mi->conf, "client_cache requires a single server, and use_cluster_map = no");
+			return -1;
+		}
+
+		ret = fr_redis_cluster_node_addr_by_role(NULL, &nodes, inst->cluster, true, true);
+		if (ret <= 0) {
+			cf_log_err(mctx->mi->conf, "Failed finding server for client_cache");
+			return -1;
+		}
+
+		inst->tracking = fr_redis_tracking_alloc(inst, inst->cluster, &nodes[0], &inst->client_cache,
+							 mctx->mi->name);
+		talloc_free(nodes);
+		if (!inst->tracking) {
+			cf_log_perr(mctx->mi->conf, "Failed enabling client_cache");
+			return -1;
+		}
+	}
+
 	/*
 	 *	Best effort - Try and load in scripts on startup
 	 */
@@ -858,6 +929,16 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	return 0;
 }
 
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_redis_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_redis_t);
+	rlm_redis_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_thread_t);
+
+	if (inst->tracking) t->cache = fr_redis_tracking_cache_alloc(t, inst->tracking);
+
+	return 0;
+}
+
 static int mod_bootstrap(module_inst_ctx_t const *mctx)
 {
 	rlm_redis_t const	*inst = talloc_get_type_abort(mctx->mi->data, rlm_redis_t);
@@ -900,10 +981,14 @@ module_rlm_t rlm_redis = {
 	.common = {
 		.magic		= MODULE_MAGIC_INIT,
 		.name		= "redis",
+		.flags		= MODULE_TYPE_INSTANTIATE_PARALLEL,
 		.inst_size	= sizeof(rlm_redis_t),
 		.config		= module_config,
 		.onload		= mod_load,
 		.bootstrap	= mod_bootstrap,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+		.thread_inst_size	= sizeof(rlm_redis_thread_t),
+		.thread_inst_type	= "rlm_redis_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
 	}
 };
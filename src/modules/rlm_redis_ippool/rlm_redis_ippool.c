@@ -46,6 +46,9 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/base16.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/token.h>
 
 #include <freeradius-devel/redis/base.h>
@@ -75,14 +78,58 @@ typedef struct {
 	bool			copy_on_update; //!< Copy the address provided by ip_address to the
 						//!< allocated_address_attr if updates are successful.
 
+	struct {
+		uint32_t		size;		//!< How many addresses each thread reserves at once.
+							//!< 0 disables local reservations.
+		fr_time_delta_t		hold_time;	//!< How long reserved addresses are held for.
+		char			id[32];		//!< Identifies addresses reserved by this instance.
+	} reserve;
+
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
 } rlm_redis_ippool_t;
 
+/** An address reserved from Redis by a thread
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the free or offered list.
+
+	char			*ip;		//!< The address, as stored in the pool.
+	char			*range;		//!< Range the address belongs to.  May be NULL.
+	fr_time_t		held_until;	//!< When the reservation in Redis lapses.
+
+	uint8_t			*owner;		//!< Owner the address was offered to.  NULL if not offered.
+	size_t			owner_len;	//!< Length of the owner identifier.
+	fr_time_t		offer_expires;	//!< When the offer expires.
+} redis_ippool_reservation_t;
+
+/** Addresses a thread has reserved from a single pool
+ *
+ */
+typedef struct {
+	uint8_t			*name;		//!< Pool name.
+	size_t			name_len;	//!< Length of the pool name.
+
+	fr_dlist_head_t		free;		//!< Reserved addresses which haven't been offered.
+	fr_dlist_head_t		offered;	//!< Reserved addresses which have been offered, oldest first.
+	fr_hash_table_t		*owners;	//!< Offered addresses, by owner.
+} redis_ippool_cache_t;
+
+typedef struct {
+	fr_hash_table_t		*pools;		//!< Reservation caches, by pool name.
+} rlm_redis_ippool_thread_t;
+
 static conf_parser_t redis_config[] = {
 	REDIS_COMMON_CONFIG,
 	CONF_PARSER_TERMINATOR
 };
 
+static conf_parser_t reserve_config[] = {
+	{ FR_CONF_OFFSET("size", rlm_redis_ippool_t, reserve.size), .dflt = "0" },
+	{ FR_CONF_OFFSET("hold_time", rlm_redis_ippool_t, reserve.hold_time), .dflt = "30" },
+	CONF_PARSER_TERMINATOR
+};
+
 static conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("wait_num", rlm_redis_ippool_t, wait_num) },
 	{ FR_CONF_OFFSET("wait_timeout", rlm_redis_ippool_t, wait_timeout) },
@@ -94,6 +141,8 @@ static conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("ipv4_integer", rlm_redis_ippool_t, ipv4_integer) },
 	{ FR_CONF_OFFSET("copy_on_update", rlm_redis_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
 
+	{ FR_CONF_POINTER("reserve", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) reserve_config },
+
 	/*
 	 *	Split out to allow conversion to universal ippool module with
 	 *	minimum of config changes.
@@ -338,6 +387,9 @@ static char lua_alloc_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
  * - ARGV[3] IP address to update.
  * - ARGV[4] Lease owner identifier.
  * - ARGV[5] (optional) Gateway identifier.
+ * - ARGV[6] (optional) Reservation identifier.  If the address is reserved with
+ *   this identifier, it's claimed by the lease owner, and any other lease the owner
+ *   holds is released.
  *
  * Returns @verbatim array { <rcode>[, <range>] } @endverbatim
  * - IPPOOL_RCODE_SUCCESS lease updated..
@@ -365,17 +417,37 @@ static char lua_update_cmd[] =
 	"if not found[2] then" EOL							/* 8 */
 	"  return {" STRINGIFY(_IPPOOL_RCODE_NOT_FOUND) "}" EOL				/* 9 */
 	"end" EOL									/* 10 */
-	"if found[2] ~= ARGV[4] then" EOL						/* 11 */
-	"  return {" STRINGIFY(_IPPOOL_RCODE_DEVICE_MISMATCH) ", found[2]}" EOL		/* 12 */
-	"end" EOL									/* 13 */
+	"pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL			/* 11 */
+	"owner_key = '{' .. KEYS[1] .. '}:"IPPOOL_OWNER_KEY":' .. ARGV[4]" EOL		/* 12 */
+	"if found[2] ~= ARGV[4] then" EOL						/* 13 */
+	"  if not ARGV[6] or ARGV[6] == '' or found[2] ~= ARGV[6] then" EOL		/* 14 */
+	"    return {" STRINGIFY(_IPPOOL_RCODE_DEVICE_MISMATCH) ", found[2]}" EOL	/* 15 */
+	"  end" EOL									/* 16 */
+
+	/*
+	 *	The address was offered from a local reservation.
+	 *	Claim it, and release any dynamic lease the owner
+	 *	already has, as they're moving to this address.
+	 */
+	"  redis.call('HSET', address_key, 'device', ARGV[4])" EOL			/* 17 */
+	"  found[4] = redis.call('HINCRBY', address_key, 'counter', 1)" EOL		/* 18 */
+	"  local old = redis.call('GET', owner_key)" EOL				/* 19 */
+	"  if old and old ~= ARGV[3] then" EOL						/* 20 */
+	"    local old_expires = tonumber(redis.call('ZSCORE', pool_key, old))" EOL	/* 21 */
+	"    if old_expires and old_expires < " STRINGIFY(IPPOOL_STATIC_BIT) " and " EOL	/* 22 */
+	"       redis.call('HGET', '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. old, 'device') == ARGV[4] then" EOL	/* 23 */
+	"      redis.call('ZADD', pool_key, 'XX', ARGV[1] - 1, old)" EOL		/* 24 */
+	"    end" EOL									/* 25 */
+	"    redis.call('DEL', owner_key)" EOL						/* 26 */
+	"  end" EOL									/* 27 */
+	"end" EOL									/* 28 */
 
 	/*
 	 *	Update the expiry time
 	 */
-	"pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL			/* 14 */
-	"local expires = tonumber(redis.call('ZSCORE', pool_key, ARGV[3]))" EOL		/* 15 */
-	"local static = expires > " STRINGIFY(IPPOOL_STATIC_BIT) EOL			/* 16 */
-	"redis.call('ZADD', pool_key, 'XX', ARGV[1] + ARGV[2] + (static and " STRINGIFY(IPPOOL_STATIC_BIT) " or 0), ARGV[3])" EOL	/* 17 */
+	"local expires = tonumber(redis.call('ZSCORE', pool_key, ARGV[3]))" EOL		/* 29 */
+	"local static = expires > " STRINGIFY(IPPOOL_STATIC_BIT) EOL			/* 30 */
+	"redis.call('ZADD', pool_key, 'XX', ARGV[1] + ARGV[2] + (static and " STRINGIFY(IPPOOL_STATIC_BIT) " or 0), ARGV[3])" EOL	/* 31 */
 
 	/*
 	 *	The device key should usually exist, but
@@ -383,19 +455,18 @@ static char lua_update_cmd[] =
 	 *	of a lease being expired, it may have been
 	 *	removed.
 	 */
-	"owner_key = '{' .. KEYS[1] .. '}:"IPPOOL_OWNER_KEY":' .. ARGV[4]" EOL		/* 18 */
-	"if not static and (redis.call('EXPIRE', owner_key, ARGV[2]) == 0) then" EOL	/* 19 */
-	"  redis.call('SET', owner_key, ARGV[3])" EOL					/* 20 */
-	"  redis.call('EXPIRE', owner_key, ARGV[2])" EOL				/* 21 */
-	"end" EOL									/* 22 */
+	"if not static and (redis.call('EXPIRE', owner_key, ARGV[2]) == 0) then" EOL	/* 32 */
+	"  redis.call('SET', owner_key, ARGV[3])" EOL					/* 33 */
+	"  redis.call('EXPIRE', owner_key, ARGV[2])" EOL				/* 34 */
+	"end" EOL									/* 35 */
 
 	/*
 	 *	Update the gateway address
 	 */
-	"if ARGV[5] ~= found[3] then" EOL						/* 23 */
-	"  redis.call('HSET', address_key, 'gateway', ARGV[5])" EOL			/* 24 */
-	"end" EOL									/* 25 */
-	"return { " STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", found[1], found[4] }"EOL;	/* 26 */
+	"if ARGV[5] ~= found[3] then" EOL						/* 36 */
+	"  redis.call('HSET', address_key, 'gateway', ARGV[5])" EOL			/* 37 */
+	"end" EOL									/* 38 */
+	"return { " STRINGIFY(_IPPOOL_RCODE_SUCCESS) ", found[1], found[4] }"EOL;	/* 39 */
 static char lua_update_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
 
 /** Lua script for releasing leases
@@ -455,6 +526,48 @@ static char lua_release_cmd[] =
 	"}";										/* 25 */
 static char lua_release_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
 
+/** Lua script for reserving a block of free addresses
+ *
+ * The addresses are marked as in use until the hold time expires, and are
+ * recorded as belonging to the reservation identifier.  No owner is bound
+ * to them until the lease is updated.
+ *
+ * - KEYS[1] The pool name.
+ * - ARGV[1] Wall time (seconds since epoch).
+ * - ARGV[2] Hold time (seconds).
+ * - ARGV[3] Maximum number of addresses to reserve.
+ * - ARGV[4] Reservation identifier.
+ *
+ * Returns @verbatim array { <rcode>[, <ip>, <range>]... } @endverbatim
+ * - IPPOOL_RCODE_SUCCESS at least one address was reserved.
+ * - IPPOOL_RCODE_POOL_EMPTY no free addresses.
+ */
+static char lua_reserve_cmd[] =
+	"local pool_key" EOL										/* 1 */
+	"local address_key" EOL										/* 2 */
+	"local ips" EOL											/* 3 */
+	"local ret" EOL											/* 4 */
+
+	"pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL					/* 5 */
+
+	/*
+	 *	Get the addresses which expired the longest time ago.
+	 */
+	"ips = redis.call('ZRANGEBYSCORE', pool_key, '-inf', '(' .. ARGV[1], 'LIMIT', 0, ARGV[3])" EOL	/* 6 */
+	"if #ips == 0 then" EOL										/* 7 */
+	"  return {" STRINGIFY(_IPPOOL_RCODE_POOL_EMPTY) "}" EOL					/* 8 */
+	"end" EOL											/* 9 */
+	"ret = {" STRINGIFY(_IPPOOL_RCODE_SUCCESS) "}" EOL						/* 10 */
+	"for _, ip in ipairs(ips) do" EOL								/* 11 */
+	"  redis.call('ZADD', pool_key, 'XX', ARGV[1] + ARGV[2], ip)" EOL				/* 12 */
+	"  address_key = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. ip" EOL			/* 13 */
+	"  redis.call('HSET', address_key, 'device', ARGV[4])" EOL					/* 14 */
+	"  ret[#ret + 1] = ip" EOL									/* 15 */
+	"  ret[#ret + 1] = redis.call('HGET', address_key, 'range')" EOL				/* 16 */
+	"end" EOL											/* 17 */
+	"return ret" EOL;										/* 18 */
+static char lua_reserve_digest[(SHA1_DIGEST_LENGTH * 2) + 1];
+
 /** Check the requisite number of slaves replicated the lease info
  *
  * @param request The current request.
@@ -872,6 +985,248 @@ finish:
 	return ret;
 }
 
+static uint32_t reservation_owner_hash(void const *data)
+{
+	redis_ippool_reservation_t const *res = data;
+
+	return fr_hash(res->owner, res->owner_len);
+}
+
+static int8_t reservation_owner_cmp(void const *one, void const *two)
+{
+	redis_ippool_reservation_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->owner_len, b->owner_len);
+	if (ret != 0) return ret;
+
+	return CMP(memcmp(a->owner, b->owner, a->owner_len), 0);
+}
+
+static uint32_t reservation_cache_hash(void const *data)
+{
+	redis_ippool_cache_t const *cache = data;
+
+	return fr_hash(cache->name, cache->name_len);
+}
+
+static int8_t reservation_cache_cmp(void const *one, void const *two)
+{
+	redis_ippool_cache_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->name_len, b->name_len);
+	if (ret != 0) return ret;
+
+	return CMP(memcmp(a->name, b->name, a->name_len), 0);
+}
+
+/** Find, or create, the reservation cache for a pool
+ *
+ */
+static redis_ippool_cache_t *reservation_cache(rlm_redis_ippool_thread_t *t, fr_value_box_t const *pool_name)
+{
+	redis_ippool_cache_t	find, *cache;
+
+	find.name = UNCONST(uint8_t *, pool_name->vb_strvalue);
+	find.name_len = pool_name->vb_length;
+
+	cache = fr_hash_table_find(t->pools, &find);
+	if (cache) return cache;
+
+	MEM(cache = talloc_zero(t->pools, redis_ippool_cache_t));
+	MEM(cache->name = talloc_memdup(cache, pool_name->vb_strvalue, pool_name->vb_length));
+	cache->name_len = pool_name->vb_length;
+	fr_dlist_talloc_init(&cache->free, redis_ippool_reservation_t, entry);
+	fr_dlist_talloc_init(&cache->offered, redis_ippool_reservation_t, entry);
+	MEM(cache->owners = fr_hash_table_alloc(cache, reservation_owner_hash, reservation_owner_cmp, NULL));
+
+	if (!fr_hash_table_insert(t->pools, cache)) {
+		talloc_free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+/** Reserve a block of free addresses from Redis
+ *
+ * @return
+ *	- IPPOOL_RCODE_SUCCESS if one or more addresses were added to the cache.
+ *	- IPPOOL_RCODE_POOL_EMPTY if the pool contains no free addresses.
+ *	- IPPOOL_RCODE_FAIL on error.
+ */
+static ippool_rcode_t reservation_refill(rlm_redis_ippool_t const *inst, request_t *request,
+					 redis_ippool_cache_t *cache)
+{
+	struct			timeval now;
+	fr_time_t		held_until;
+	redisReply		*reply = NULL;
+	fr_redis_rcode_t	status;
+	ippool_rcode_t		ret;
+	size_t			i;
+
+	held_until = fr_time_add(fr_time(), inst->reserve.hold_time);
+	now = fr_time_to_timeval(fr_time());
+
+	status = ippool_script(&reply, request, inst->cluster,
+			       cache->name, cache->name_len,
+			       inst->wait_num, inst->wait_timeout,
+			       lua_reserve_digest, lua_reserve_cmd,
+			       "EVALSHA %s 1 %b %u %u %u %s",
+			       lua_reserve_digest,
+			       cache->name, cache->name_len,
+			       (unsigned int)now.tv_sec,
+			       (unsigned int)fr_time_delta_to_sec(inst->reserve.hold_time),
+			       inst->reserve.size, inst->reserve.id);
+	if (status != REDIS_RCODE_SUCCESS) {
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	fr_assert(reply);
+	if ((reply->type != REDIS_REPLY_ARRAY) || (reply->elements == 0) ||
+	    (reply->element[0]->type != REDIS_REPLY_INTEGER)) {
+		REDEBUG("Server returned malformed response to reservation request");
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+	ret = reply->element[0]->integer;
+	if (ret < 0) goto finish;
+
+	for (i = 1; (i + 1) < reply->elements; i += 2) {
+		redis_ippool_reservation_t	*res;
+		redisReply			*ip = reply->element[i], *range = reply->element[i + 1];
+
+		if (ip->type != REDIS_REPLY_STRING) {
+			REDEBUG("Server returned unexpected type \"%s\" for reserved address",
+				fr_table_str_by_value(redis_reply_types, ip->type, "<UNKNOWN>"));
+			ret = IPPOOL_RCODE_FAIL;
+			goto finish;
+		}
+
+		MEM(res = talloc_zero(cache, redis_ippool_reservation_t));
+		MEM(res->ip = talloc_bstrndup(res, ip->str, ip->len));
+		if (range->type == REDIS_REPLY_STRING) MEM(res->range = talloc_bstrndup(res, range->str, range->len));
+		res->held_until = held_until;
+
+		fr_dlist_insert_tail(&cache->free, res);
+	}
+
+	RDEBUG2("Reserved %u address(es) from pool \"%pV\"", fr_dlist_num_elements(&cache->free),
+		fr_box_strvalue_len((char const *)cache->name, cache->name_len));
+
+finish:
+	fr_redis_reply_free(&reply);
+	return ret;
+}
+
+/** Offer an address from the thread's reservations, without contacting Redis
+ *
+ * The address isn't bound to the owner until the lease is updated, at which
+ * point the update script claims it.
+ */
+static ippool_rcode_t redis_ippool_offer_reserved(rlm_redis_ippool_t const *inst, rlm_redis_ippool_thread_t *t,
+						  request_t *request, redis_ippool_alloc_call_env_t *env,
+						  uint32_t offer_time)
+{
+	redis_ippool_cache_t		*cache;
+	redis_ippool_reservation_t	*res, find;
+	fr_time_t			now = fr_time();
+	fr_time_t			offer_expires = fr_time_add(now, fr_time_delta_from_sec(offer_time));
+	uint32_t			expires_in = offer_time;
+	ippool_rcode_t			ret;
+
+	cache = reservation_cache(t, &env->pool_name);
+	if (!cache) return IPPOOL_RCODE_FAIL;
+
+	/*
+	 *	Forget about offers which have expired.  If they were
+	 *	accepted, the lease is now bound in Redis.  If they
+	 *	weren't, the reservation in Redis lapses by itself.
+	 */
+	while ((res = fr_dlist_head(&cache->offered)) && fr_time_lteq(res->offer_expires, now)) {
+		fr_dlist_remove(&cache->offered, res);
+		(void) fr_hash_table_remove(cache->owners, res);
+		talloc_free(res);
+	}
+
+	/*
+	 *	Retransmissions get the address we already offered.
+	 */
+	find.owner = UNCONST(uint8_t *, env->owner.vb_strvalue);
+	find.owner_len = env->owner.vb_length;
+	res = fr_hash_table_find(cache->owners, &find);
+	if (res) {
+		expires_in = fr_time_delta_to_sec(fr_time_sub(res->offer_expires, now));
+		goto reply;
+	}
+
+	/*
+	 *	Discard reservations which would lapse before the
+	 *	offer expires.
+	 */
+	for (;;) {
+		while ((res = fr_dlist_head(&cache->free)) && fr_time_lt(res->held_until, offer_expires)) {
+			fr_dlist_remove(&cache->free, res);
+			talloc_free(res);
+		}
+		if (res) break;
+
+		ret = reservation_refill(inst, request, cache);
+		if (ret != IPPOOL_RCODE_SUCCESS) return ret;
+
+		/*
+		 *	The hold time is too short for the offer.
+		 */
+		if (fr_time_lt(((redis_ippool_reservation_t *)fr_dlist_tail(&cache->free))->held_until, offer_expires)) {
+			REDEBUG("reserve.hold_time is less than the offer time");
+			return IPPOOL_RCODE_FAIL;
+		}
+	}
+
+	fr_dlist_remove(&cache->free, res);
+	MEM(res->owner = talloc_memdup(res, env->owner.vb_strvalue, env->owner.vb_length));
+	res->owner_len = env->owner.vb_length;
+	res->offer_expires = offer_expires;
+	fr_dlist_insert_tail(&cache->offered, res);
+	if (!fr_hash_table_insert(cache->owners, res)) {
+		fr_dlist_remove(&cache->offered, res);
+		talloc_free(res);
+		return IPPOOL_RCODE_FAIL;
+	}
+
+reply:
+	{
+		tmpl_t	ip_rhs;
+		map_t	ip_map = { .lhs = env->allocated_address_attr, .op = T_OP_SET, .rhs = &ip_rhs };
+
+		tmpl_init_shallow(&ip_rhs, TMPL_TYPE_DATA, T_BARE_WORD, "", 0, NULL);
+		fr_value_box_strdup_shallow(&ip_map.rhs->data.literal, NULL, res->ip, false);
+		if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
+	}
+
+	if (res->range) {
+		tmpl_t	range_rhs;
+		map_t	range_map = { .lhs = env->range_attr, .op = T_OP_SET, .rhs = &range_rhs };
+
+		tmpl_init_shallow(&range_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0, NULL);
+		fr_value_box_strdup_shallow(&range_map.rhs->data.literal, NULL, res->range, true);
+		if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
+	}
+
+	if (env->expiry_attr) {
+		tmpl_t	expiry_rhs;
+		map_t	expiry_map = { .lhs = env->expiry_attr, .op = T_OP_SET, .rhs = &expiry_rhs };
+
+		tmpl_init_shallow(&expiry_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0, NULL);
+		fr_value_box(&expiry_map.rhs->data.literal, expires_in, true);
+		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) return IPPOOL_RCODE_FAIL;
+	}
+
+	return IPPOOL_RCODE_SUCCESS;
+}
+
 /** Update an existing IP address in a pool
  *
  */
@@ -895,13 +1250,14 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 				       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
 				       inst->wait_num, inst->wait_timeout,
 				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %u %b %b",
+				       "EVALSHA %s 1 %b %u %u %u %b %b %s",
 				       lua_update_digest,
 				       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
 				       (unsigned int)now.tv_sec, expires,
 				       htonl(ip->addr.v4.s_addr),
 				       (uint8_t const *)owner->vb_strvalue, owner->vb_length,
-				       (uint8_t const *)gateway_id->vb_strvalue, gateway_id->vb_length);
+				       (uint8_t const *)gateway_id->vb_strvalue, gateway_id->vb_length,
+				       inst->reserve.id);
 	} else {
 		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
 
@@ -910,13 +1266,14 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 				       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
 				       inst->wait_num, inst->wait_timeout,
 				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %s %b %b",
+				       "EVALSHA %s 1 %b %u %u %s %b %b %s",
 				       lua_update_digest,
 				       (uint8_t const *)env->pool_name.vb_strvalue, env->pool_name.vb_length,
 				       (unsigned int)now.tv_sec, expires,
 				       ip_buff,
 				       (uint8_t const *)owner->vb_strvalue, owner->vb_length,
-				       (uint8_t const *)gateway_id->vb_strvalue, gateway_id->vb_length);
+				       (uint8_t const *)gateway_id->vb_strvalue, gateway_id->vb_length,
+				       inst->reserve.id);
 	}
 	if (status != REDIS_RCODE_SUCCESS) {
 		ret = IPPOOL_RCODE_FAIL;
@@ -1102,7 +1459,9 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_redis_ippool_t);
 	redis_ippool_alloc_call_env_t	*env = talloc_get_type_abort(mctx->env_data, redis_ippool_alloc_call_env_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
 	uint32_t			lease_time;
+	ippool_rcode_t			ret;
 
 	CHECK_POOL_NAME
 
@@ -1114,7 +1473,23 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 			env->offer_time.vb_uint32 : env->lease_time.vb_uint32;
 	ippool_action_print(request, POOL_ACTION_ALLOCATE, L_DBG_LVL_2, &env->pool_name, NULL,
 			    &env->owner, &env->gateway_id, lease_time);
-	switch (redis_ippool_allocate(inst, request, env, lease_time)) {
+
+	/*
+	 *	Offers can be made from the addresses this thread has
+	 *	reserved.  The lease is bound when it's updated.  If
+	 *	we can't reserve any addresses, fall back to asking
+	 *	Redis.
+	 */
+	if (inst->reserve.size && (env->offer_time.type == FR_TYPE_UINT32)) {
+		ret = redis_ippool_offer_reserved(inst, t, request, env, lease_time);
+		if (ret == IPPOOL_RCODE_SUCCESS) {
+			RDEBUG2("IP address offered from local reservation");
+			RETURN_MODULE_UPDATED;
+		}
+	}
+
+	ret = redis_ippool_allocate(inst, request, env, lease_time);
+	switch (ret) {
 	case IPPOOL_RCODE_SUCCESS:
 		RDEBUG2("IP address lease allocated");
 		RETURN_MODULE_UPDATED;
@@ -1269,11 +1644,39 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_release_cmd, sizeof(lua_release_cmd) - 1);
 		fr_sha1_final(digest, &sha1_ctx);
 		fr_base16_encode(&FR_SBUFF_OUT(lua_release_digest, sizeof(lua_release_digest)), &FR_DBUFF_TMP(digest, sizeof(digest)));
+
+		fr_sha1_init(&sha1_ctx);
+		fr_sha1_update(&sha1_ctx, (uint8_t const *)lua_reserve_cmd, sizeof(lua_reserve_cmd) - 1);
+		fr_sha1_final(digest, &sha1_ctx);
+		fr_base16_encode(&FR_SBUFF_OUT(lua_reserve_digest, sizeof(lua_reserve_digest)), &FR_DBUFF_TMP(digest, sizeof(digest)));
+	}
+
+	if (inst->reserve.size) {
+		FR_INTEGER_BOUND_CHECK("reserve.size", inst->reserve.size, <=, 1000);
+		FR_TIME_DELTA_BOUND_CHECK("reserve.hold_time", inst->reserve.hold_time, >=, fr_time_delta_from_sec(1));
+		FR_TIME_DELTA_BOUND_CHECK("reserve.hold_time", inst->reserve.hold_time, <=, fr_time_delta_from_sec(3600));
+
+		/*
+		 *	Addresses reserved by other instances, or by
+		 *	previous runs of this server, aren't ours to
+		 *	claim.  They're freed when their hold expires.
+		 */
+		snprintf(inst->reserve.id, sizeof(inst->reserve.id), "reserved:%08x%08x", fr_rand(), fr_rand());
 	}
 
 	return 0;
 }
 
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+
+	t->pools = fr_hash_table_alloc(t, reservation_cache_hash, reservation_cache_cmp, NULL);
+	if (!t->pools) return -1;
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -1289,7 +1692,11 @@ module_rlm_t rlm_redis_ippool = {
 		.inst_size	= sizeof(rlm_redis_ippool_t),
 		.config		= module_config,
 		.onload		= mod_load,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+
+		.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
+		.thread_inst_type	= "rlm_redis_ippool_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
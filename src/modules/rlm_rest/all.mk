@@ -21,5 +21,5 @@ TARGET		:= $(TARGETNAME)$(L)
 TGT_PREREQS	+= libfreeradius-curl$(L)
 endif
 
-SOURCES		:= $(TARGETNAME).c rest.c io.c
+SOURCES		:= $(TARGETNAME).c rest.c io.c cache.c
 LOG_ID_LIB	= 44
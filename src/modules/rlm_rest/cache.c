@@ -0,0 +1,433 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Cache HTTP responses, and coalesce identical requests.
+ * @file cache.c
+ *
+ * Each thread has its own cache, so no locking is needed.  Entries are
+ * keyed by everything which goes into the HTTP request: the section,
+ * virtual server, method, URI, credentials, headers and body.
+ *
+ * How long a response is cached for is determined by the Cache-Control
+ * header in the response.  Expired entries with an ETag are revalidated
+ * with If-None-Match, and reused if the server responds with 304.
+ *
+ * While a request is in progress, any identical requests wait for it,
+ * and are given a copy of its response, whether or not the response
+ * can be cached.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/unlang/call.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rb.h>
+
+#include "rest.h"
+
+struct rlm_rest_cache_s {
+	rlm_rest_cache_config_t const	*config;	//!< Limits and TTLs.
+	fr_rb_tree_t			*tree;		//!< Entries, by key.
+	fr_dlist_head_t			lru;		//!< Entries, most recently used first.
+};
+
+struct rlm_rest_cache_entry_s {
+	fr_rb_node_t			node;		//!< Entry in the tree of entries.
+	fr_dlist_t			entry;		//!< Entry in the LRU list.
+	rlm_rest_cache_t		*cache;		//!< This entry belongs to.
+
+	uint8_t				*key;		//!< Everything which went into the request.
+	size_t				key_len;	//!< Length of the key.
+
+	bool				valid;		//!< Whether we have a response.
+	int				code;		//!< HTTP status code of the response.
+	http_body_type_t		type;		//!< Type of the response body.
+	char				*body;		//!< Response body.  May be NULL.
+	size_t				body_len;	//!< Length of the response body.
+	char				*etag;		//!< Used to revalidate the response.  May be NULL.
+	fr_time_t			expires;	//!< When the response must be revalidated.
+
+	fr_curl_io_request_t		*leader;	//!< Handle which is fetching the response.
+	fr_dlist_head_t			waiting;	//!< rlm_rest_curl_context_t waiting for the leader.
+};
+
+static int8_t rest_cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_rest_cache_entry_t const *a = one, *b = two;
+
+	return memcmp_return(a->key, b->key, a->key_len, b->key_len);
+}
+
+/** Free an entry
+ *
+ * Entries aren't freed with a talloc destructor, as the tree may
+ * already have been freed when the whole cache is freed.
+ */
+static void rest_cache_entry_free(rlm_rest_cache_entry_t *entry)
+{
+	rlm_rest_cache_t *cache = entry->cache;
+
+	fr_assert(!entry->leader && fr_dlist_empty(&entry->waiting));
+
+	fr_rb_remove_by_inline_node(cache->tree, &entry->node);
+	fr_dlist_remove(&cache->lru, entry);
+	talloc_free(entry);
+}
+
+/** Make room for a new entry by freeing the least recently used ones
+ *
+ */
+static void rest_cache_evict(rlm_rest_cache_t *cache)
+{
+	rlm_rest_cache_entry_t *entry, *prev;
+
+	for (entry = fr_dlist_tail(&cache->lru);
+	     entry && (fr_rb_num_elements(cache->tree) >= cache->config->max_entries);
+	     entry = prev) {
+		prev = fr_dlist_prev(&cache->lru, entry);
+
+		if (entry->leader) continue;	/* In use */
+
+		rest_cache_entry_free(entry);
+	}
+}
+
+/** Copy a response into a handle, as if curl had received it
+ *
+ */
+static void rest_cache_fill(rlm_rest_curl_context_t *ctx, int code, http_body_type_t type, char const *body, size_t len)
+{
+	ctx->response.code = code;
+	ctx->response.type = type;
+	TALLOC_FREE(ctx->response.buffer);
+	ctx->response.alloc = 0;
+	ctx->response.used = 0;
+
+	if (!body) return;
+
+	MEM(ctx->response.buffer = talloc_bstrndup(NULL, body, len));
+	ctx->response.alloc = len + 1;
+	ctx->response.used = len;
+}
+
+/** Give a copy of a response to every handle waiting for it, and resume their requests
+ *
+ */
+static void rest_cache_wake(rlm_rest_cache_entry_t *entry, int code, http_body_type_t type, char const *body, size_t len)
+{
+	rlm_rest_curl_context_t *waiter;
+
+	while ((waiter = fr_dlist_pop_head(&entry->waiting))) {
+		waiter->cache_entry = NULL;
+		rest_cache_fill(waiter, code, type, body, len);
+		unlang_interpret_mark_runnable(waiter->response.request);
+	}
+}
+
+/** Add a length prefixed value to the key
+ *
+ */
+static inline int rest_cache_key_add(fr_sbuff_t *sbuff, char const *value, size_t len)
+{
+	if (fr_sbuff_in_bstrncpy(sbuff, (char const *)&len, sizeof(len)) < 0) return -1;
+	if (len && (fr_sbuff_in_bstrncpy(sbuff, value, len) < 0)) return -1;
+
+	return 0;
+}
+
+#define KEY_ADD(_value, _len) do { if (rest_cache_key_add(&sbuff, _value, _len) < 0) goto error; } while (0)
+#define KEY_ADD_BOX(_vb) do { if (_vb) { KEY_ADD((_vb)->vb_strvalue, (_vb)->vb_length); } else { KEY_ADD(NULL, 0); } } while (0)
+
+/** Build a key from everything which goes into the HTTP request
+ *
+ * @param[out] out	Where to write the key.
+ * @param[in] ctx	to allocate the key in.
+ * @param[in] section	configuration.
+ * @param[in] call_env	containing the expanded URI, headers, etc.
+ * @param[in] request	The current request.
+ * @return
+ *	- The length of the key.
+ *	- -1 on error.
+ */
+static ssize_t rest_cache_key(uint8_t **out, TALLOC_CTX *ctx, rlm_rest_section_t const *section,
+			      rlm_rest_call_env_t const *call_env, request_t *request)
+{
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+	char const		*server = cf_section_name2(unlang_call_current(request));
+	size_t			len;
+
+	if (!fr_sbuff_init_talloc(ctx, &sbuff, &tctx, 256, SIZE_MAX)) return -1;
+
+	KEY_ADD(section->name, strlen(section->name));
+	KEY_ADD(server, server ? strlen(server) : 0);
+	KEY_ADD(section->request.method_str, strlen(section->request.method_str));
+	KEY_ADD_BOX(call_env->request.uri);
+	KEY_ADD_BOX(call_env->request.username);
+	KEY_ADD_BOX(call_env->request.password);
+
+	if (call_env->request.header) {
+		size_t num = talloc_array_length(call_env->request.header), i;
+
+		for (i = 0; i < num; i++) {
+			fr_value_box_list_foreach(&call_env->request.header[i], header) KEY_ADD_BOX(header);
+		}
+	}
+
+	fr_pair_list_foreach(&request->control_pairs, vp) {
+		if (vp->da != attr_rest_http_header) continue;
+
+		KEY_ADD(vp->vp_strvalue, vp->vp_length);
+	}
+
+	if (fr_value_box_list_initialised(&call_env->request.data)) {
+		fr_value_box_list_foreach(&call_env->request.data, vb) KEY_ADD_BOX(vb);
+	} else {
+		KEY_ADD(NULL, 0);
+	}
+
+	len = fr_sbuff_used(&sbuff);
+	*out = (uint8_t *)sbuff.buff;
+
+	return len;
+
+error:
+	talloc_free(sbuff.buff);
+	return -1;
+}
+
+/** Allocate a response cache
+ *
+ * @param[in] ctx	to allocate the cache in.  Should be thread specific.
+ * @param[in] config	Limits and TTLs.
+ * @return The new cache.
+ */
+rlm_rest_cache_t *rest_cache_alloc(TALLOC_CTX *ctx, rlm_rest_cache_config_t const *config)
+{
+	rlm_rest_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, rlm_rest_cache_t));
+	cache->config = config;
+	MEM(cache->tree = fr_rb_inline_talloc_alloc(cache, rlm_rest_cache_entry_t, node, rest_cache_entry_cmp, NULL));
+	fr_dlist_init(&cache->lru, rlm_rest_cache_entry_t, entry);
+
+	return cache;
+}
+
+/** Find a cached response for the request we're about to send
+ *
+ * On #REST_CACHE_MISS, the handle becomes responsible for fetching the
+ * response.  Once it's received, rest_cache_response() must be called.
+ *
+ * @param[in] cache	to search.
+ * @param[in] section	configuration.
+ * @param[in] call_env	containing the expanded URI, headers, etc.
+ * @param[in] request	The current request.
+ * @param[in] randle	to copy any cached response into.
+ * @return One of #rest_cache_rcode_t.
+ */
+rest_cache_rcode_t rest_cache_lookup(rlm_rest_cache_t *cache, rlm_rest_section_t const *section,
+				     rlm_rest_call_env_t const *call_env, request_t *request,
+				     fr_curl_io_request_t *randle)
+{
+	rlm_rest_curl_context_t	*ctx = talloc_get_type_abort(randle->uctx, rlm_rest_curl_context_t);
+	rlm_rest_cache_entry_t	*entry;
+	uint8_t			*key;
+	ssize_t			key_len;
+	fr_time_t		now;
+
+	key_len = rest_cache_key(&key, cache, section, call_env, request);
+	if (key_len < 0) {
+		RWDEBUG("Failed creating cache key, response will not be cached");
+		return REST_CACHE_MISS;
+	}
+
+	entry = fr_rb_find(cache->tree, &(rlm_rest_cache_entry_t){ .key = key, .key_len = key_len });
+	if (!entry) {
+		rest_cache_evict(cache);
+
+		MEM(entry = talloc_zero(cache, rlm_rest_cache_entry_t));
+		entry->cache = cache;
+		entry->key = talloc_steal(entry, key);
+		entry->key_len = key_len;
+		fr_dlist_init(&entry->waiting, rlm_rest_curl_context_t, cache_wait);
+
+		fr_rb_insert(cache->tree, entry);
+		fr_dlist_insert_head(&cache->lru, entry);
+
+		goto fetch;
+	}
+	talloc_free(key);
+
+	fr_dlist_remove(&cache->lru, entry);
+	fr_dlist_insert_head(&cache->lru, entry);
+
+	if (entry->leader) {
+		RDEBUG2("Waiting for the response to an identical request");
+
+		ctx->cache_entry = entry;
+		ctx->cache_waiter = true;
+		ctx->response.request = request;
+		fr_dlist_insert_tail(&entry->waiting, ctx);
+
+		return REST_CACHE_WAIT;
+	}
+
+	now = fr_time();
+	if (entry->valid && fr_time_lt(now, entry->expires)) {
+		RDEBUG2("Using cached response, expires in %pVs", fr_box_time_delta(fr_time_sub(entry->expires, now)));
+
+		rest_cache_fill(ctx, entry->code, entry->type, entry->body, entry->body_len);
+
+		return REST_CACHE_HIT;
+	}
+
+	if (entry->valid && entry->etag) {
+		RDEBUG2("Cached response has expired, revalidating");
+		ctx->if_none_match = entry->etag;
+	}
+
+fetch:
+	entry->leader = randle;
+	ctx->cache_entry = entry;
+
+	return REST_CACHE_MISS;
+}
+
+/** Cache the response received by a handle, and copy it to any handles waiting for it
+ *
+ * Should be called before the response is processed.  If the response
+ * was a 304 for a cached entry, the cached response is copied into the
+ * handle.
+ *
+ * @param[in] request	The current request.
+ * @param[in] randle	which received the response.
+ */
+void rest_cache_response(request_t *request, fr_curl_io_request_t *randle)
+{
+	rlm_rest_curl_context_t		*ctx = talloc_get_type_abort(randle->uctx, rlm_rest_curl_context_t);
+	rlm_rest_response_t		*response = &ctx->response;
+	rlm_rest_cache_entry_t		*entry = ctx->cache_entry;
+	rlm_rest_cache_config_t const	*config;
+	fr_time_delta_t			ttl = fr_time_delta_wrap(0);
+	bool				success;
+
+	if (!entry || (entry->leader != randle)) return;
+
+	config = entry->cache->config;
+	entry->leader = NULL;
+	ctx->cache_entry = NULL;
+	ctx->if_none_match = NULL;
+
+	success = (response->code >= 200) && (response->code < 300);
+	if (success || (response->code == 304)) {
+		if (response->max_age_is_set) {
+			ttl = response->max_age;
+			if (fr_time_delta_ispos(config->max_ttl) && fr_time_delta_gt(ttl, config->max_ttl)) {
+				ttl = config->max_ttl;
+			}
+		} else {
+			ttl = config->default_ttl;
+		}
+		if (response->no_cache) ttl = fr_time_delta_wrap(0);
+
+	} else if ((response->code == 404) || (response->code == 410)) {
+		ttl = config->negative_ttl;
+	}
+
+	if ((response->code == 304) && entry->valid) {
+		RDEBUG2("Cached response is still valid, caching for %pVs", fr_box_time_delta(ttl));
+
+		entry->expires = fr_time_add(fr_time(), ttl);
+		rest_cache_fill(ctx, entry->code, entry->type, entry->body, entry->body_len);
+
+	/*
+	 *	Responses with an ETag can be stored even if they've
+	 *	already expired, as they can be revalidated.
+	 */
+	} else if (!response->no_store &&
+		   (fr_time_delta_ispos(ttl) || (success && response->etag)) &&
+		   (response->type != REST_HTTP_BODY_UNSUPPORTED) &&
+		   (response->type != REST_HTTP_BODY_UNAVAILABLE) &&
+		   (response->type != REST_HTTP_BODY_INVALID)) {
+		RDEBUG2("Caching response for %pVs", fr_box_time_delta(ttl));
+
+		TALLOC_FREE(entry->body);
+		TALLOC_FREE(entry->etag);
+
+		entry->code = response->code;
+		entry->type = response->type;
+		if (response->buffer) MEM(entry->body = talloc_bstrndup(entry, response->buffer, response->used));
+		entry->body_len = response->used;
+		if (response->etag) MEM(entry->etag = talloc_strdup(entry, response->etag));
+		entry->expires = fr_time_add(fr_time(), ttl);
+		entry->valid = true;
+
+	} else {
+		entry->valid = false;
+	}
+
+	rest_cache_wake(entry, response->code, response->type, response->buffer, response->used);
+
+	if (!entry->valid) rest_cache_entry_free(entry);
+}
+
+/** Whether the handle is waiting for another handle's response
+ *
+ * If it is, the handle was never passed to curl.
+ */
+bool rest_cache_is_waiting(fr_curl_io_request_t *randle)
+{
+	rlm_rest_curl_context_t *ctx = talloc_get_type_abort(randle->uctx, rlm_rest_curl_context_t);
+
+	return ctx->cache_waiter;
+}
+
+/** Disassociate a handle from the cache, before it's reused
+ *
+ * If the handle was fetching a response, which it never received,
+ * then the handles waiting for it are given an empty response, and
+ * their requests fail.
+ *
+ * @param[in] randle	being released.
+ */
+void rest_cache_release(fr_curl_io_request_t *randle)
+{
+	rlm_rest_curl_context_t	*ctx = talloc_get_type_abort(randle->uctx, rlm_rest_curl_context_t);
+	rlm_rest_cache_entry_t	*entry = ctx->cache_entry;
+
+	ctx->cache_entry = NULL;
+	ctx->cache_waiter = false;
+	ctx->if_none_match = NULL;
+
+	if (!entry) return;
+
+	if (entry->leader != randle) {
+		fr_dlist_remove(&entry->waiting, ctx);
+		return;
+	}
+
+	entry->leader = NULL;
+	rest_cache_wake(entry, 0, REST_HTTP_BODY_NONE, NULL, 0);
+
+	if (!entry->valid) rest_cache_entry_free(entry);
+}
@@ -38,6 +38,15 @@ void rest_io_module_signal(module_ctx_t const *mctx, request_t *request, UNUSED
 
 	RDEBUG2("Forcefully cancelling pending REST request");
 
+	/*
+	 *	Was waiting for an identical request, and was
+	 *	never passed to curl.
+	 */
+	if (rest_cache_is_waiting(randle)) {
+		rest_slab_release(randle);
+		return;
+	}
+
 	ret = curl_multi_remove_handle(t->mhandle->mandle, randle->candle);	/* Gracefully terminate the request */
 	if (ret != CURLM_OK) {
 		RERROR("Failed removing curl handle from multi-handle: %s (%i)", curl_multi_strerror(ret), ret);
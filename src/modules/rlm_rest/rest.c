@@ -35,6 +35,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/pool.h>
 #include <freeradius-devel/server/tmpl.h>
 #include <freeradius-devel/unlang/call.h>
+#include <freeradius-devel/util/iovec.h>
 #include <freeradius-devel/util/value.h>
 
 #include <talloc.h>
@@ -206,6 +207,10 @@ typedef struct {
 	char const	*start;	//!< Start of the buffer.
 	char const	*p;	//!< how much text we've sent so far.
 	size_t		len;	//!< Length of data
+
+	struct iovec	*vector;	//!< Remaining segments of custom body data, sent
+					///< after the current buffer.
+	size_t		vector_len;	//!< Number of remaining segments.
 } rest_custom_data_t;
 
 #ifdef HAVE_JSON
@@ -278,7 +283,10 @@ void *rest_mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta
 	return randle;
 }
 
-/** Copies a pre-expanded xlat string to the output buffer
+/** Copies pre-expanded custom body data to the output buffer
+ *
+ * The data is sent directly from the segments of the expansion, so it never
+ * has to be copied into a single buffer.
  *
  * @param[out] out	Char buffer to write encoded data to.
  * @param[in] size	Multiply by nmemb to get the length of ptr.
@@ -294,28 +302,32 @@ static size_t rest_encode_custom(void *out, size_t size, size_t nmemb, void *use
 	rest_custom_data_t	*data = ctx->encoder;
 
 	size_t			freespace = (size * nmemb) - 1;
-	size_t			len;
+	size_t			len, used = 0;
 	size_t			to_copy;
 
-	/*
-	 *	Special case for empty body
-	 */
-	if (data->len == 0) return 0;
-
-	/*
-	 *	If len > 0 then we must have these set.
-	 */
-	fr_assert(data->start);
-	fr_assert(data->p);
+	while (used < freespace) {
+		/*
+		 *	Move on to the next segment
+		 */
+		if (data->p == (data->start + data->len)) {
+			if (data->vector_len == 0) break;
+
+			data->p = data->start = data->vector->iov_base;
+			data->len = data->vector->iov_len;
+			data->vector++;
+			data->vector_len--;
+			continue;
+		}
 
-	to_copy = data->len - (data->p - data->start);
-	len = to_copy > freespace ? freespace : to_copy;
-	if (len == 0) return 0;
+		to_copy = data->len - (data->p - data->start);
+		len = to_copy > (freespace - used) ? (freespace - used) : to_copy;
 
-	memcpy(out, data->p, len);
-	data->p += len;
+		memcpy((uint8_t *)out + used, data->p, len);
+		data->p += len;
+		used += len;
+	}
 
-	return len;
+	return used;
 }
 
 /** Encodes fr_pair_t linked list in POST format
@@ -1226,6 +1238,58 @@ static int rest_decode_json(rlm_rest_t const *instance, rlm_rest_section_t const
 }
 #endif
 
+/** Parse the directives in a Cache-Control header
+ *
+ * Only the directives which affect whether, and for how long, the
+ * response can be cached are used.  We share cached responses between
+ * requests, so "private" is treated the same as "no-store".
+ *
+ * @param[in] ctx	to record the directives in.
+ * @param[in] p		Start of the header value.
+ * @param[in] end	End of the header line.
+ */
+static void rest_response_cache_control(rlm_rest_response_t *ctx, char const *p, char const *end)
+{
+	bool shared_max_age = false;
+
+	while (p < end) {
+		char const	*q;
+		size_t		len;
+
+		while ((p < end) && (isspace((uint8_t)*p) || (*p == ','))) p++;
+
+		for (q = p; (q < end) && (*q != ',') && (*q != '\r') && (*q != '\n'); q++);
+		len = q - p;
+
+		if (((len == 8) && (strncasecmp(p, "no-store", 8) == 0)) ||
+		    ((len >= 7) && (strncasecmp(p, "private", 7) == 0))) {
+			ctx->no_store = true;
+
+		} else if ((len >= 8) && (strncasecmp(p, "no-cache", 8) == 0)) {
+			ctx->no_cache = true;
+
+		} else if (((len > 8) && (strncasecmp(p, "max-age=", 8) == 0) && !shared_max_age) ||
+			   ((len > 9) && (strncasecmp(p, "s-maxage=", 9) == 0))) {
+			char const	*v = (char const *)memchr(p, '=', len) + 1;
+			uint64_t	secs = 0;
+
+			/*
+			 *	s-maxage is for shared caches, which is
+			 *	what we are, so it overrides max-age.
+			 */
+			if (*p == 's') shared_max_age = true;
+
+			while ((v < q) && isdigit((uint8_t)*v) && (secs < (UINT32_MAX / 10))) secs = (secs * 10) + (*v++ - '0');
+
+			ctx->max_age = fr_time_delta_from_sec(secs);
+			ctx->max_age_is_set = true;
+		}
+
+		p = q;
+		if ((p < end) && ((*p == '\r') || (*p == '\n'))) break;
+	}
+}
+
 /** Processes incoming HTTP header data from libcurl.
  *
  * Processes the status line, and Content-Type headers from the incoming HTTP
@@ -1432,6 +1496,19 @@ static size_t rest_response_header(void *in, size_t size, size_t nmemb, void *us
 					break;
 				}
 			}
+		} else if (((end - p) >= 14) &&
+			   (strncasecmp("Cache-Control:", p, 14) == 0)) {
+			rest_response_cache_control(ctx, p + 14, end);
+
+		} else if (((end - p) >= 5) &&
+			   (strncasecmp("ETag:", p, 5) == 0)) {
+			p += 5;
+			while ((p < end) && isspace((uint8_t)*p)) p++;
+
+			for (q = UNCONST(char *, end); (q > p) && isspace((uint8_t)q[-1]); q--);
+
+			talloc_free(ctx->etag);
+			ctx->etag = (q > p) ? talloc_bstrndup(NULL, p, q - p) : NULL;
 		}
 		break;
 
@@ -1606,6 +1683,11 @@ static void rest_response_init(rlm_rest_section_t const *section,
 	ctx->used = 0;
 	ctx->code = 0;
 	ctx->header = header;
+	ctx->max_age = fr_time_delta_wrap(0);
+	ctx->max_age_is_set = false;
+	ctx->no_store = false;
+	ctx->no_cache = false;
+	TALLOC_FREE(ctx->etag);
 	TALLOC_FREE(ctx->buffer);
 }
 
@@ -1711,9 +1793,9 @@ error:
  * @param[in] type	Content-Type for request encoding, also sets
  *			the default for decoding.
  * @param[in] uri	buffer containing the expanded URI to send the request to.
- * @param[in] body_data	(optional) custom body data. Must persist whilst we're
- *			writing data out to the socket.  Must be a talloced buffer
- *			which is \0 terminated.
+ * @param[in] body_data	(optional) custom body data, as a list of segments
+ *			which are sent one after another.  Must persist whilst
+ *			we're writing data out to the socket.
  * @return
  *	- 0 on success (all opts configured).
  *	- -1 on failure.
@@ -1721,7 +1803,7 @@ error:
 int rest_request_config(module_ctx_t const *mctx, rlm_rest_section_t const *section,
 			request_t *request, fr_curl_io_request_t *randle, http_method_t method,
 			http_body_type_t type,
-			char const *uri, char const *body_data)
+			char const *uri, fr_value_box_list_t *body_data)
 {
 	rlm_rest_t const	*inst = talloc_get_type_abort(mctx->mi->data, rlm_rest_t);
 	rlm_rest_call_env_t 	*call_env = talloc_get_type_abort(mctx->env_data, rlm_rest_call_env_t);
@@ -1765,11 +1847,19 @@ int rest_request_config(module_ctx_t const *mctx, rlm_rest_section_t const *sect
 	FR_CURL_REQUEST_SET_OPTION(CURLOPT_NOSIGNAL, 1L);
 	FR_CURL_REQUEST_SET_OPTION(CURLOPT_USERAGENT, "FreeRADIUS " RADIUSD_VERSION_STRING);
 
-	timeout = inst->conn_config.connect_timeout;
+	/*
+	 *	Don't wait for longer than the request has left.
+	 */
+	timeout = request_deadline_timeout(request, section->timeout);
+	if ((fr_time_delta_ispos(section->timeout) || fr_time_ispos(request->deadline)) &&
+	    (fr_time_delta_to_msec(timeout) <= 0)) {
+		REDEBUG("Request deadline has passed, not sending");
+		goto error;
+	}
 	RDEBUG3("Connect timeout is %pVs, request timeout is %pVs",
-	        fr_box_time_delta(timeout), fr_box_time_delta(section->timeout));
-	FR_CURL_REQUEST_SET_OPTION(CURLOPT_CONNECTTIMEOUT_MS, fr_time_delta_to_msec(timeout));
-	FR_CURL_REQUEST_SET_OPTION(CURLOPT_TIMEOUT_MS, fr_time_delta_to_msec(section->timeout));
+	        fr_box_time_delta(inst->conn_config.connect_timeout), fr_box_time_delta(timeout));
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_CONNECTTIMEOUT_MS, fr_time_delta_to_msec(inst->conn_config.connect_timeout));
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_TIMEOUT_MS, fr_time_delta_to_msec(timeout));
 
 	/*
 	 *	FreeRADIUS custom headers
@@ -1806,6 +1896,18 @@ int rest_request_config(module_ctx_t const *mctx, rlm_rest_section_t const *sect
 		}
 	}
 
+	/*
+	 *	Revalidate an expired cache entry
+	 */
+	if (ctx->if_none_match) {
+		snprintf(buffer, sizeof(buffer), "If-None-Match: %s", ctx->if_none_match);
+		RINDENT();
+		RDEBUG3("%s", buffer);
+		REXDENT();
+		ctx->headers = curl_slist_append(ctx->headers, buffer);
+		if (!ctx->headers) goto error_header;
+	}
+
 	/*
 	 *	Add in dynamic headers from the request
 	 */
@@ -2000,8 +2102,17 @@ do {\
 		rest_custom_data_t *data;
 
 		data = talloc_zero(request, rest_custom_data_t);
-		data->p = data->start = body_data;
-		data->len = talloc_strlen(body_data);
+		if (body_data) {
+			ssize_t slen;
+
+			slen = fr_iovec_afrom_value_box_list(data, &data->vector, body_data);
+			if (slen < 0) {
+				RPERROR("Failed building custom body");
+				talloc_free(data);
+				return -1;
+			}
+			data->vector_len = slen;
+		}
 
 		/* Use the encoder specific pointer to store the data we need to encode */
 		ctx->request.encoder = data;
@@ -142,9 +142,22 @@ typedef struct {
 	rlm_rest_section_request_t	request;	//!< Request configuration.
 	rlm_rest_section_response_t	response;	//!< Response configuration.
 
+	bool				cache;		//!< Whether responses should be cached.
+
 	fr_curl_tls_t			tls;
 } rlm_rest_section_t;
 
+/*
+ *	Structure for response cache configuration
+ */
+typedef struct {
+	uint32_t		max_entries;	//!< Maximum number of responses to cache, per thread.
+	fr_time_delta_t		default_ttl;	//!< How long to cache responses which don't specify
+						///< a max-age.  Zero means they're not cached.
+	fr_time_delta_t		max_ttl;	//!< Upper limit on max-age.  Zero means no limit.
+	fr_time_delta_t		negative_ttl;	//!< How long to cache 404 and 410 responses.
+} rlm_rest_cache_config_t;
+
 /*
  *	Structure for module configuration
  */
@@ -159,6 +172,8 @@ typedef struct {
 
 	fr_curl_conn_config_t	conn_config;	//!< Configuration of slab allocated connection handles.
 
+	rlm_rest_cache_config_t	cache;		//!< Configuration of the response cache.
+
 	rlm_rest_section_t	xlat;		//!< Configuration specific to xlat.
 	rlm_rest_section_t	authorize;	//!< Configuration specific to authorisation.
 	rlm_rest_section_t	authenticate;	//!< Configuration specific to authentication.
@@ -174,14 +189,19 @@ typedef struct {
 FR_SLAB_TYPES(rest, fr_curl_io_request_t)
 FR_SLAB_FUNCS(rest, fr_curl_io_request_t)
 
+typedef struct rlm_rest_cache_s rlm_rest_cache_t;
+typedef struct rlm_rest_cache_entry_s rlm_rest_cache_entry_t;
+
 /** Thread specific rlm_rest instance data
  *
  */
 typedef struct {
 	rlm_rest_t const	*inst;		//!< Instance of rlm_rest.
 	rest_slab_list_t	*slab;		//!< Slab list for connection handles.
+	rlm_rest_cache_t	*cache;		//!< Response cache.  NULL if no sections are cached.
 	fr_curl_handle_t	*mhandle;	//!< Thread specific multi handle.  Serves as the dispatch
-						//!< and coralling structure for REST requests.
+						//!< and coralling structure for REST requests.  Shared
+						//!< with the other rest instances in this thread.
 } rlm_rest_thread_t;
 
 /*
@@ -243,6 +263,12 @@ typedef struct {
 	tmpl_t			*header;	//!< Where to create pairs representing HTTP response headers.
 						///< If NULL no headers will be parsed other than content-type.
 
+	fr_time_delta_t		max_age;	//!< From the Cache-Control header.
+	bool			max_age_is_set;	//!< Whether the Cache-Control header contained a max-age.
+	bool			no_store;	//!< The response must not be cached.
+	bool			no_cache;	//!< The response must be revalidated before it's reused.
+	char			*etag;		//!< From the ETag header.
+
 	void			*decoder;	//!< Decoder specific data.
 } rlm_rest_response_t;
 
@@ -258,6 +284,12 @@ typedef struct {
 
 	rlm_rest_request_t	request;	//!< Request context data.
 	rlm_rest_response_t	response;	//!< Response context data.
+
+	rlm_rest_cache_entry_t	*cache_entry;	//!< Cache entry this handle is fetching, or waiting for.
+	fr_dlist_t		cache_wait;	//!< Entry in the list of handles waiting for cache_entry.
+	bool			cache_waiter;	//!< Handle was never passed to curl, its response is copied
+						///< from the handle fetching cache_entry.
+	char const		*if_none_match;	//!< ETag to revalidate.  Owned by cache_entry.
 } rlm_rest_curl_context_t;
 
 /** Stores the state of a yielded xlat
@@ -272,7 +304,8 @@ typedef struct {
 	struct {
 		fr_value_box_t		*uri;		//!< URI to send HTTP request to.
 		fr_value_box_list_t	*header;	//!< Headers to place in the request
-		fr_value_box_t		*data;		//!< Custom data to send in requests.
+		fr_value_box_list_t	data;		//!< Custom data to send in requests, as a list
+							///< of segments.
 		fr_value_box_t		*username;	//!< Username to use for authentication
 		fr_value_box_t		*password;	//!< Password to use for authentication
 	} request;
@@ -304,7 +337,7 @@ void *rest_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t time
 int rest_request_config(module_ctx_t const *mctx, rlm_rest_section_t const *section,
 			request_t *request, fr_curl_io_request_t *randle, http_method_t method,
 			http_body_type_t type,
-			char const *uri, char const *body_data) CC_HINT(nonnull (1,2,4,7));
+			char const *uri, fr_value_box_list_t *body_data) CC_HINT(nonnull (1,2,4,7));
 
 int rest_response_decode(rlm_rest_t const *instance,
 			UNUSED rlm_rest_section_t const *section, request_t *request,
@@ -329,5 +362,27 @@ ssize_t rest_uri_host_unescape(char **out, UNUSED rlm_rest_t const *mod_inst, re
 /*
  *	Async IO helpers
  */
+/*
+ *	Response cache
+ */
+typedef enum {
+	REST_CACHE_MISS = 0,				//!< Perform the request.
+	REST_CACHE_HIT,					//!< The response was copied into the handle.
+	REST_CACHE_WAIT					//!< An identical request is in progress.  Yield, its
+							///< response will be copied into the handle.
+} rest_cache_rcode_t;
+
+rlm_rest_cache_t *rest_cache_alloc(TALLOC_CTX *ctx, rlm_rest_cache_config_t const *config);
+
+rest_cache_rcode_t rest_cache_lookup(rlm_rest_cache_t *cache, rlm_rest_section_t const *section,
+				     rlm_rest_call_env_t const *call_env, request_t *request,
+				     fr_curl_io_request_t *randle);
+
+void rest_cache_response(request_t *request, fr_curl_io_request_t *randle);
+
+bool rest_cache_is_waiting(fr_curl_io_request_t *randle);
+
+void rest_cache_release(fr_curl_io_request_t *randle);
+
 void rest_io_module_signal(module_ctx_t const *mctx, request_t *request, fr_signal_t action);
 void rest_io_xlat_signal(xlat_ctx_t const *xctx, request_t *request, fr_signal_t action);
@@ -140,6 +140,8 @@ static const conf_parser_t section_config[] = {
 	/* Transfer configuration */
 	{ FR_CONF_OFFSET("timeout", rlm_rest_section_t, timeout), .dflt = "4.0" },
 
+	{ FR_CONF_OFFSET("cache", rlm_rest_section_t, cache), .dflt = "no" },
+
 	/* TLS Parameters */
 	{ FR_CONF_OFFSET_SUBSECTION("tls", 0, rlm_rest_section_t, tls, fr_curl_tls_config) },
 	CONF_PARSER_TERMINATOR
@@ -162,6 +164,14 @@ static const conf_parser_t xlat_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const conf_parser_t cache_config[] = {
+	{ FR_CONF_OFFSET("max_entries", rlm_rest_cache_config_t, max_entries), .dflt = "1024" },
+	{ FR_CONF_OFFSET("default_ttl", rlm_rest_cache_config_t, default_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_ttl", rlm_rest_cache_config_t, max_ttl), .dflt = "300" },
+	{ FR_CONF_OFFSET("negative_ttl", rlm_rest_cache_config_t, negative_ttl), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_DEPRECATED("connect_timeout", rlm_rest_t, connect_timeout) },
 	{ FR_CONF_OFFSET("connect_proxy", rlm_rest_t, connect_proxy), .func = rest_proxy_parse },
@@ -172,6 +182,8 @@ static const conf_parser_t module_config[] = {
 
 	{ FR_CONF_OFFSET_SUBSECTION("connection", 0, rlm_rest_t, conn_config, fr_curl_conn_config) },
 
+	{ FR_CONF_OFFSET_SUBSECTION("cache", 0, rlm_rest_t, cache, cache_config) },
+
 #ifdef CURLPIPE_MULTIPLEX
 	{ FR_CONF_OFFSET("multiplex", rlm_rest_t, multiplex), .dflt = "yes" },
 #endif
@@ -186,7 +198,7 @@ static const conf_parser_t module_config[] = {
 
 #define REST_CALL_ENV_REQUEST_COMMON(_dflt_username, _dflt_password) \
 	{ FR_CALL_ENV_OFFSET("header", FR_TYPE_STRING, CALL_ENV_FLAG_MULTI, rlm_rest_call_env_t, request.header) }, \
-	{ FR_CALL_ENV_OFFSET("data", FR_TYPE_STRING, CALL_ENV_FLAG_CONCAT, rlm_rest_call_env_t, request.data) }, \
+	{ FR_CALL_ENV_OFFSET("data", FR_TYPE_STRING, CALL_ENV_FLAG_SEGMENTS, rlm_rest_call_env_t, request.data) }, \
 	{ FR_CALL_ENV_OFFSET("username", FR_TYPE_STRING, CALL_ENV_FLAG_SINGLE | CALL_ENV_FLAG_NULLABLE, \
 				rlm_rest_call_env_t, request.username), .pair.dflt_quote = T_BARE_WORD, _dflt_username }, \
 	{ FR_CALL_ENV_OFFSET("password", FR_TYPE_STRING, CALL_ENV_FLAG_SINGLE | CALL_ENV_FLAG_NULLABLE | CALL_ENV_FLAG_SECRET, \
@@ -390,6 +402,13 @@ static int rest_uri_part_escape(fr_value_box_t *vb, UNUSED void *uctx)
 	return 0;
 }
 
+/** Send a request, or use a cached response
+ *
+ * @return
+ *	- 1 if a cached response was copied into the handle.  The request should not yield.
+ *	- 0 if the request should yield until the response is received.
+ *	- -1 on failure.
+ */
 static int rlm_rest_perform(module_ctx_t const *mctx,
 			    rlm_rest_section_t const *section, fr_curl_io_request_t *randle,
 			    request_t *request)
@@ -398,6 +417,25 @@ static int rlm_rest_perform(module_ctx_t const *mctx,
 	rlm_rest_call_env_t 	*call_env = talloc_get_type_abort(mctx->env_data, rlm_rest_call_env_t);
 	int			ret;
 
+	if (section->cache) {
+		switch (rest_cache_lookup(t->cache, section, call_env, request, randle)) {
+		case REST_CACHE_MISS:
+			break;
+
+		/*
+		 *	The headers would have been consumed by
+		 *	rest_request_config().
+		 */
+		case REST_CACHE_HIT:
+			pair_delete_control(attr_rest_http_header);
+			return 1;
+
+		case REST_CACHE_WAIT:
+			pair_delete_control(attr_rest_http_header);
+			return 0;
+		}
+	}
+
 	RDEBUG2("Sending HTTP %s to \"%pV\"",
 	        fr_table_str_by_value(http_method_table, section->request.method, NULL), call_env->request.uri);
 
@@ -407,7 +445,7 @@ static int rlm_rest_perform(module_ctx_t const *mctx,
 	 */
 	ret = rest_request_config(mctx, section, request, randle, section->request.method, section->request.body,
 				  call_env->request.uri->vb_strvalue,
-				  call_env->request.data ? call_env->request.data->vb_strvalue : NULL);
+				  fr_value_box_list_initialised(&call_env->request.data) ? &call_env->request.data : NULL);
 	if (ret < 0) return -1;
 
 	/*
@@ -604,18 +642,10 @@ static xlat_action_t rest_xlat(UNUSED TALLOC_CTX *ctx, UNUSED fr_dcursor_t *out,
 	}
 
 	/*
-	 *	Any additional arguments are freeform data
+	 *	Any additional arguments are freeform data.  They're sent
+	 *	as they are, without being concatenated first.
 	 */
-	if ((in_vb = fr_value_box_list_head(in))) {
-		if (fr_value_box_list_concat_in_place(in_vb,
-						      in_vb, in, FR_TYPE_STRING,
-						      FR_VALUE_BOX_LIST_FREE, true,
-						      SIZE_MAX) < 0) {
-			REDEBUG("Failed to concatenate freeform data");
-			goto error;
-		}
-		section->request.body = REST_HTTP_BODY_CUSTOM;
-	}
+	if (!fr_value_box_list_empty(in)) section->request.body = REST_HTTP_BODY_CUSTOM;
 
 	RDEBUG2("Sending HTTP %s to \"%pV\"",
 	       (section->request.method == REST_HTTP_METHOD_CUSTOM) ?
@@ -631,7 +661,7 @@ static xlat_action_t rest_xlat(UNUSED TALLOC_CTX *ctx, UNUSED fr_dcursor_t *out,
 	ret = rest_request_config(MODULE_CTX(xctx->mctx->mi, t, xctx->env_data, NULL),
 				  section, request, randle, section->request.method,
 				  section->request.body,
-				  uri_vb->vb_strvalue, in_vb ? in_vb->vb_strvalue : NULL);
+				  uri_vb->vb_strvalue, fr_value_box_list_empty(in) ? NULL : in);
 	if (ret < 0) goto error;
 
 	/*
@@ -656,6 +686,8 @@ static unlang_action_t mod_authorize_result(rlm_rcode_t *p_result, module_ctx_t
 	rlm_rcode_t			rcode = RLM_MODULE_OK;
 	int				ret;
 
+	rest_cache_response(request, handle);
+
 	if (section->tls.extract_cert_attrs) fr_curl_response_certinfo(request, handle);
 
 	if (rlm_rest_status_update(request, handle) < 0) {
@@ -755,6 +787,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 
 		RETURN_MODULE_FAIL;
 	}
+	if (ret > 0) return mod_authorize_result(p_result, MODULE_CTX(mctx->mi, mctx->thread, mctx->env_data, handle), request);
 
 	return unlang_module_yield(request, mod_authorize_result, rest_io_module_signal, ~FR_SIGNAL_CANCEL, handle);
 }
@@ -770,6 +803,8 @@ static unlang_action_t mod_authenticate_result(rlm_rcode_t *p_result,
 	int				rcode = RLM_MODULE_OK;
 	int				ret;
 
+	rest_cache_response(request, handle);
+
 	if (section->tls.extract_cert_attrs) fr_curl_response_certinfo(request, handle);
 
 	if (rlm_rest_status_update(request, handle) < 0) {
@@ -898,6 +933,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 
 		RETURN_MODULE_FAIL;
 	}
+	if (ret > 0) return mod_authenticate_result(p_result, MODULE_CTX(mctx->mi, mctx->thread, mctx->env_data, handle), request);
 
 	return unlang_module_yield(request, mod_authenticate_result, rest_io_module_signal, ~FR_SIGNAL_CANCEL, handle);
 }
@@ -912,6 +948,8 @@ static unlang_action_t mod_accounting_result(rlm_rcode_t *p_result, module_ctx_t
 	int				rcode = RLM_MODULE_OK;
 	int				ret;
 
+	rest_cache_response(request, handle);
+
 	if (section->tls.extract_cert_attrs) fr_curl_response_certinfo(request, handle);
 
 	if (rlm_rest_status_update(request, handle) < 0) {
@@ -976,6 +1014,7 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 
 		RETURN_MODULE_FAIL;
 	}
+	if (ret > 0) return mod_accounting_result(p_result, MODULE_CTX(mctx->mi, mctx->thread, mctx->env_data, handle), request);
 
 	return unlang_module_yield(request, mod_accounting_result, rest_io_module_signal, ~FR_SIGNAL_CANCEL, handle);
 }
@@ -990,6 +1029,8 @@ static unlang_action_t mod_post_auth_result(rlm_rcode_t *p_result, module_ctx_t
 	int				rcode = RLM_MODULE_OK;
 	int				ret;
 
+	rest_cache_response(request, handle);
+
 	if (section->tls.extract_cert_attrs) fr_curl_response_certinfo(request, handle);
 
 	if (rlm_rest_status_update(request, handle) < 0) {
@@ -1054,6 +1095,7 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 
 		RETURN_MODULE_FAIL;
 	}
+	if (ret > 0) return mod_post_auth_result(p_result, MODULE_CTX(mctx->mi, mctx->thread, mctx->env_data, handle), request);
 
 	return unlang_module_yield(request, mod_post_auth_result, rest_io_module_signal, ~FR_SIGNAL_CANCEL, handle);
 }
@@ -1148,6 +1190,12 @@ static int parse_sub_section(rlm_rest_t *inst, CONF_SECTION *parent, conf_parser
 		}
 	}
 
+	if (config->cache && (config->request.body != REST_HTTP_BODY_NONE) &&
+	    (config->request.body != REST_HTTP_BODY_CUSTOM)) {
+		cf_log_err(cs, "Responses can only be cached if the request body is 'none', or custom 'data'");
+		return -1;
+	}
+
 	if (config->response.force_to_str) {
 		config->response.force_to = fr_table_value_by_str(http_body_type_table, config->response.force_to_str, REST_HTTP_BODY_UNKNOWN);
 		if (config->response.force_to == REST_HTTP_BODY_UNKNOWN) {
@@ -1223,11 +1271,14 @@ static int _rest_request_cleanup(fr_curl_io_request_t *randle, UNUSED void *uctx
 	}
 #endif
 
+	rest_cache_release(randle);
+
 	/*
 	 *  Free response data
 	 */
 	TALLOC_FREE(ctx->body);
 	TALLOC_FREE(ctx->response.buffer);
+	TALLOC_FREE(ctx->response.etag);
 	TALLOC_FREE(ctx->request.encoder);
 	TALLOC_FREE(ctx->response.decoder);
 	ctx->response.header = NULL;	/* This is owned by the parsed call env and must not be freed */
@@ -1266,11 +1317,15 @@ static int rest_conn_alloc(fr_curl_io_request_t *randle, void *uctx)
 	return 0;
 }
 
-/** Create a thread specific multihandle
+/** Get the thread specific multihandle
  *
  * Easy handles representing requests are added to the curl multihandle
  * with the multihandle used for mux/demux.
  *
+ * The multihandle is shared with all the other rest instances in this
+ * thread, so that they share a connection cache, and with HTTP/2 can
+ * multiplex requests to the same server over a single connection.
+ *
  * @param[in] mctx	Thread instantiation data.
  * @return
  *	- 0 on success.
@@ -1290,18 +1345,22 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 		return -1;
 	}
 
-	mhandle = fr_curl_io_init(t, mctx->el, inst->multiplex);
+	mhandle = fr_curl_io_shared_init(mctx->el, inst->multiplex);
 	if (!mhandle) return -1;
 
 	t->mhandle = mhandle;
 
+	if (inst->authorize.cache || inst->authenticate.cache || inst->accounting.cache || inst->post_auth.cache) {
+		t->cache = rest_cache_alloc(t, &inst->cache);
+	}
+
 	return 0;
 }
 
 /** Cleanup all outstanding requests associated with this thread
  *
- * Destroys all curl easy handles, and then the multihandle associated
- * with this thread.
+ * Releases the multihandle associated with this thread, and then destroys
+ * all curl easy handles.
  *
  * @param[in] mctx	data to destroy.
  * @return 0
@@ -1310,7 +1369,7 @@ static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
 {
 	rlm_rest_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_rest_thread_t);
 
-	talloc_free(t->mhandle);	/* Ensure this is shutdown before the pool */
+	if (t->mhandle) fr_curl_io_shared_release(t->mhandle);	/* Ensure this is shutdown before the pool */
 	talloc_free(t->slab);
 
 	return 0;
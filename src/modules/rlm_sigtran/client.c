@@ -277,8 +277,105 @@ static void sigtran_client_signal(module_ctx_t const *mctx, UNUSED request_t *re
 	txn->ctx.request = NULL;	/* remove the link to the (now dead) request */
 }
 
+/** Number of vectors consumed by a single authentication attempt
+ *
+ * EAP-SIM needs three triplets to derive sufficient keying material,
+ * EAP-AKA only needs a single quintuplet.
+ */
+static inline unsigned int sigtran_vectors_per_auth(uint8_t version)
+{
+	return (version == 2) ? 3 : 1;
+}
+
+/** Add the contents of a list of vectors to the control list
+ *
+ */
+static void sigtran_vector_to_pairs(request_t *request, sigtran_vector_t *vector)
+{
+	unsigned int		i = 0;
+	fr_pair_t		*vp;
+	sigtran_vector_t	*vec;
+
+	for (vec = vector; vec; vec = vec->next) {
+		switch (vec->type) {
+		case SIGTRAN_VECTOR_TYPE_SIM_TRIPLETS:
+			fr_assert(vec->sim.rand);
+			fr_assert(vec->sim.sres);
+			fr_assert(vec->sim.kc);
+
+			RDEBUG2("SIM auth vector %i", i);
+			RINDENT();
+			MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_rand));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->sim.rand, true) == 0);
+			TALLOC_FREE(vec->sim.rand);
+			RDEBUG2("&control.%pP", vp);
+			fr_pair_append(&request->control_pairs, vp);
+
+			MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_sres));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->sim.sres, true) == 0);
+			TALLOC_FREE(vec->sim.sres);
+			RDEBUG2("&control.%pP", vp);
+			fr_pair_append(&request->control_pairs, vp);
+
+			MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_kc));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->sim.kc, true) == 0);
+			TALLOC_FREE(vec->sim.kc);
+			RDEBUG2("&control.%pP", vp);
+			fr_pair_append(&request->control_pairs, vp);
+			REXDENT();
+
+			i++;
+			break;
+
+		case SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS:
+			fr_assert(vec->umts.rand);
+			fr_assert(vec->umts.xres);
+			fr_assert(vec->umts.ck);
+			fr_assert(vec->umts.ik);
+			fr_assert(vec->umts.authn);
+
+			RDEBUG2("UMTS auth vector %i", i);
+			RINDENT();
+			MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_rand));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->umts.rand, true) == 0);
+			TALLOC_FREE(vec->umts.rand);
+			RDEBUG2("&control.%pP", vp);
+			fr_pair_append(&request->control_pairs, vp);
+
+			MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_xres));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->umts.xres, true) == 0);
+			TALLOC_FREE(vec->umts.xres);
+			RDEBUG2("&control.%pP", vp);
+			fr_pair_append(&request->control_pairs, vp);
+
+			MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_ck));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->umts.ck, true) == 0);
+			TALLOC_FREE(vec->umts.ck);
+			RDEBUG2("&control.%pP", vp);
+			fr_pair_append(&request->control_pairs, vp);
+
+			MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_ik));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->umts.ik, true) == 0);
+			TALLOC_FREE(vec->umts.ik);
+			RDEBUG2("&control.%pP", vp);
+			fr_pair_append(&request->control_pairs, vp);
+
+			MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_autn));
+			MEM(fr_pair_value_memdup_buffer(vp, vec->umts.authn, true) == 0);
+			TALLOC_FREE(vec->umts.authn);
+			RDEBUG2("&control.%pP", vp);
+			fr_pair_append(&request->control_pairs, vp);
+			REXDENT();
+
+			i++;
+			break;
+		}
+	}
+}
+
 static unlang_action_t sigtran_client_map_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
+	rlm_sigtran_t const			*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_sigtran_t);
 	sigtran_transaction_t			*txn = talloc_get_type_abort(mctx->rctx, sigtran_transaction_t);
 	rlm_rcode_t				rcode;
 	fr_assert(request == txn->ctx.request);
@@ -289,87 +386,33 @@ static unlang_action_t sigtran_client_map_resume(rlm_rcode_t *p_result, module_c
 	switch (txn->response.type) {
 	case SIGTRAN_RESPONSE_OK:
 	{
-		unsigned int		i = 0;
-		fr_pair_t		*vp;
-		sigtran_vector_t	*vec;
+		sigtran_map_send_auth_info_req_t *req = talloc_get_type_abort(txn->request.data,
+									      sigtran_map_send_auth_info_req_t);
 		sigtran_map_send_auth_info_res_t *res = talloc_get_type_abort(txn->response.data,
 									      sigtran_map_send_auth_info_res_t);
 
-		for (vec = res->vector; vec; vec = vec->next) {
-			switch (vec->type) {
-			case SIGTRAN_VECTOR_TYPE_SIM_TRIPLETS:
-				fr_assert(vec->sim.rand);
-				fr_assert(vec->sim.sres);
-				fr_assert(vec->sim.kc);
-
-				RDEBUG2("SIM auth vector %i", i);
-				RINDENT();
-				MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_rand));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->sim.rand, true) == 0);
-				TALLOC_FREE(vec->sim.rand);
-				RDEBUG2("&control.%pP", vp);
-				fr_pair_append(&request->control_pairs, vp);
-
-				MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_sres));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->sim.sres, true) == 0);
-				TALLOC_FREE(vec->sim.sres);
-				RDEBUG2("&control.%pP", vp);
-				fr_pair_append(&request->control_pairs, vp);
-
-				MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_kc));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->sim.kc, true) == 0);
-				TALLOC_FREE(vec->sim.kc);
-				RDEBUG2("&control.%pP", vp);
-				fr_pair_append(&request->control_pairs, vp);
-				REXDENT();
-
-				i++;
-				break;
-
-			case SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS:
-				fr_assert(vec->umts.rand);
-				fr_assert(vec->umts.xres);
-				fr_assert(vec->umts.ck);
-				fr_assert(vec->umts.ik);
-				fr_assert(vec->umts.authn);
-
-				RDEBUG2("UMTS auth vector %i", i);
-				RINDENT();
-				MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_rand));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->umts.rand, true) == 0);
-				TALLOC_FREE(vec->umts.rand);
-				RDEBUG2("&control.%pP", vp);
-				fr_pair_append(&request->control_pairs, vp);
-
-				MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_xres));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->umts.xres, true) == 0);
-				TALLOC_FREE(vec->umts.xres);
-				RDEBUG2("&control.%pP", vp);
-				fr_pair_append(&request->control_pairs, vp);
-
-				MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_ck));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->umts.ck, true) == 0);
-				TALLOC_FREE(vec->umts.ck);
-				RDEBUG2("&control.%pP", vp);
-				fr_pair_append(&request->control_pairs, vp);
-
-				MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_ik));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->umts.ik, true) == 0);
-				TALLOC_FREE(vec->umts.ik);
-				RDEBUG2("&control.%pP", vp);
-				fr_pair_append(&request->control_pairs, vp);
-
-				MEM(vp = fr_pair_afrom_da(request->control_ctx, attr_eap_aka_sim_autn));
-				MEM(fr_pair_value_memdup_buffer(vp, vec->umts.authn, true) == 0);
-				TALLOC_FREE(vec->umts.authn);
-				RDEBUG2("&control.%pP", vp);
-				fr_pair_append(&request->control_pairs, vp);
-				REXDENT();
-
-				i++;
-				break;
+		/*
+		 *	Keep any vectors we don't need for this
+		 *	authentication attempt, so the next one
+		 *	for this subscriber doesn't need to go
+		 *	to the HLR.
+		 */
+		if (inst->vector_cache) {
+			unsigned int		i, num = sigtran_vectors_per_auth(req->version);
+			sigtran_vector_t	*vec = res->vector, *unused;
+
+			for (i = 1; vec && (i < num); i++) vec = vec->next;
+			if (vec && vec->next) {
+				unused = vec->next;
+				vec->next = NULL;
+
+				RDEBUG2("Caching unused vectors for IMSI \"%pV\"",
+					fr_box_strvalue_buffer(req->imsi_ascii));
+				sigtran_vector_cache_push(inst->vector_cache, req->imsi_ascii, req->version, unused);
 			}
 		}
+
+		sigtran_vector_to_pairs(request, res->vector);
 		rcode = RLM_MODULE_OK;
 	}
 		break;
@@ -418,6 +461,7 @@ unlang_action_t sigtran_client_map_send_auth_info(rlm_rcode_t *p_result, rlm_sig
 
 	req = talloc(txn, sigtran_map_send_auth_info_req_t);
 	req->conn = conn;
+	req->num_vectors = inst->conn_conf.map_num_vectors;
 
 	if (tmpl_aexpand(request, &req->version, request, inst->conn_conf.map_version, NULL, NULL) < 0) {
 		ERROR("Failed retrieving version");
@@ -449,6 +493,26 @@ unlang_action_t sigtran_client_map_send_auth_info(rlm_rcode_t *p_result, rlm_sig
 		REDEBUG("IMSI must be 15 or 16 digits got %zu digits", len);
 		goto error;
 	}
+	req->imsi_ascii = imsi;
+
+	/*
+	 *	Use vectors left over from a previous
+	 *	request if we have enough of them.
+	 */
+	if (inst->vector_cache) {
+		sigtran_vector_t	*vector;
+		unsigned int		remaining;
+
+		vector = sigtran_vector_cache_pop(txn, &remaining, inst->vector_cache, imsi, req->version,
+						  sigtran_vectors_per_auth(req->version));
+		if (vector) {
+			RDEBUG2("Using cached vectors for IMSI \"%pV\", %u remaining",
+				fr_box_strvalue_buffer(imsi), remaining);
+			sigtran_vector_to_pairs(request, vector);
+			talloc_free(txn);
+			RETURN_MODULE_OK;
+		}
+	}
 
 	if (sigtran_ascii_to_tbcd(req, &req->imsi, imsi) < 0) {
 		REDEBUG("Failed converting ASCII to BCD");
@@ -139,6 +139,10 @@ static const conf_parser_t sccp_config[] = {
 
 static const conf_parser_t map_config[] = {
 	{ FR_CONF_OFFSET("version", rlm_sigtran_t, conn_conf.map_version), .dflt = "2", .quote = T_BARE_WORD},
+	{ FR_CONF_OFFSET("num_vectors", rlm_sigtran_t, conn_conf.map_num_vectors), .dflt = "1" },
+
+	{ FR_CONF_OFFSET("cache_max_entries", rlm_sigtran_t, vector_cache_max_entries), .dflt = "0" },
+	{ FR_CONF_OFFSET("cache_lifetime", rlm_sigtran_t, vector_cache_lifetime), .dflt = "300" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -358,6 +362,21 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	MTP3_PC_CHECK(dpc);
 	MTP3_PC_CHECK(opc);
 
+	/*
+	 *	MAP limits numberOfRequestedVectors to 1..5
+	 */
+	FR_INTEGER_BOUND_CHECK("num_vectors", inst->conn_conf.map_num_vectors, >=, 1);
+	FR_INTEGER_BOUND_CHECK("num_vectors", inst->conn_conf.map_num_vectors, <=, 5);
+
+	if (inst->vector_cache_max_entries) {
+		inst->vector_cache = sigtran_vector_cache_alloc(inst, inst->vector_cache_max_entries,
+								inst->vector_cache_lifetime);
+		if (!inst->vector_cache) {
+			cf_log_err(conf, "Failed allocating vector cache");
+			return -1;
+		}
+	}
+
 	if (sigtran_sccp_sockaddr_from_conf(inst, &inst->conn_conf.sccp_called_sockaddr,
 					    &inst->conn_conf.sccp_called, conf) < 0) return -1;
 	if (sigtran_sccp_sockaddr_from_conf(inst, &inst->conn_conf.sccp_calling_sockaddr,
@@ -117,7 +117,7 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x6c, /* 0x28 */
 		0x19, 0xa1, 0x80, 0x02, 0x01, 0x01, 0x02, 0x01, /* 0x30 (0x35 is invoke ID) */
 		0x38, 0x30, 0x0d, 0x80, 0x00, 0x00, 0x00, 0x00, /* 0x38 (0x3c is IMSI len, 0x3d-0x44 IMSI) */
-		0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x01, 0x01, /* 0x40 */
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x01, 0x01, /* 0x40 (0x47 is number of vectors) */
 		0x00, 0x00 };					/* 0x48 */
 
 	sigtran_map_send_auth_info_req_t *req =
@@ -164,6 +164,7 @@ int sigtran_tcap_outgoing(UNUSED struct msgb *msg_in, void *ctx, sigtran_transac
 
 		*(msg->l3h + 0x3c) = talloc_array_length(req->imsi);
 		memcpy(msg->l3h + 0x3d, req->imsi, talloc_array_length(req->imsi));
+		*(msg->l3h + 0x47) = req->num_vectors;		/* numberOfRequestedVectors */
 //		RHEXDUMP(0, msg->l3h, sizeof(tcap_map_raw_v3), "MAPv3 Request");
 
 		break;
@@ -310,15 +311,29 @@ static int sigtran_tcap_incoming(struct msgb *msg, UNUSED unsigned int length, U
 	} else if (req->version == 3) {
 		p = tcap + 0x40; /* fixed offset for now */
 
-		MEM(vec = talloc_zero(res, sigtran_vector_t));
-		vec->type = SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS;
-		sigtran_memdup(umts.rand);
-		sigtran_memdup(umts.xres);
-		sigtran_memdup(umts.ck);
-		sigtran_memdup(umts.ik);
-		sigtran_memdup(umts.authn);
+		for (;;) {
+			MEM(vec = talloc_zero(res, sigtran_vector_t));
+			vec->type = SIGTRAN_VECTOR_TYPE_UMTS_QUINTUPLETS;
+			sigtran_memdup(umts.rand);
+			sigtran_memdup(umts.xres);
+			sigtran_memdup(umts.ck);
+			sigtran_memdup(umts.ik);
+			sigtran_memdup(umts.authn);
 
-		*last = vec;
+			*last = vec;
+			last = &(vec->next);
+
+			/*
+			 *	If we asked for more than one vector,
+			 *	further quintuplets follow the first,
+			 *	each in its own SEQUENCE.
+			 */
+			if (((end - p) < 2) || (p[0] != 0x30) || (p[1] > (end - p) - 2)) {
+				DEBUG4("Breaking out of parsing loop at %x", (uint32_t)(p - tcap));
+				break;
+			}
+			p += 2;
+		}
 	}
 
 	if (sigtran_event_submit(ofd, txn) < 0) {
@@ -171,6 +171,7 @@ typedef struct sigtran_conn_conf {
 	struct sockaddr_sccp		sccp_called_sockaddr;		//!< Parsed version of the above
 
 	tmpl_t			*map_version;			//!< Application context version.
+	uint32_t			map_num_vectors;		//!< Number of vectors to request from the HLR.
 } sigtran_conn_conf_t;
 
 /** Represents a connection to a remote SS7 entity
@@ -191,6 +192,7 @@ typedef struct sigtran_conn {
 typedef struct sigtran_map_send_auth_info_req {
 	sigtran_conn_t const	*conn;					//!< Connection to send request on.
 	uint8_t			*imsi;					//!< BCD encoded IMSI.
+	char const		*imsi_ascii;				//!< IMSI as provided, used as the vector cache key.
 	uint8_t			version;				//!< Application context version.
 	unsigned int		num_vectors;				//!< Number of vectors requested.
 } sigtran_map_send_auth_info_req_t;
@@ -228,12 +230,19 @@ typedef struct sigtran_map_send_auth_info_res {
 	sigtran_vector_t	*vector;				//!< Linked list of vectors.
 } sigtran_map_send_auth_info_res_t;
 
+typedef struct sigtran_vector_cache_s sigtran_vector_cache_t;
+
 typedef struct rlm_sigtran {
 	sigtran_conn_t const	*conn;					//!< Linkset associated with this instance.
 
 	sigtran_conn_conf_t	conn_conf;				//!< Connection configuration
 
 	tmpl_t			*imsi;					//!< Subscriber identifier.
+
+	uint32_t		vector_cache_max_entries;		//!< Maximum number of subscribers to cache
+									///< unused vectors for.
+	fr_time_delta_t		vector_cache_lifetime;			//!< How long unused vectors are kept for.
+	sigtran_vector_cache_t	*vector_cache;				//!< Unused vectors, shared by all workers.
 } rlm_sigtran_t;
 
 typedef struct rlm_sigtran_thread {
@@ -290,6 +299,18 @@ int	sigtran_sccp_global_title(TALLOC_CTX *ctx, uint8_t **out, int gt_ind, char c
 
 int	sigtran_ascii_to_tbcd(TALLOC_CTX *ctx, uint8_t **out, char const *ascii);
 
+/*
+ *	vector.c
+ */
+sigtran_vector_cache_t *sigtran_vector_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, fr_time_delta_t lifetime);
+
+sigtran_vector_t *sigtran_vector_cache_pop(TALLOC_CTX *ctx, unsigned int *remaining,
+					   sigtran_vector_cache_t *cache, char const *imsi, uint8_t version,
+					   unsigned int num);
+
+void	sigtran_vector_cache_push(sigtran_vector_cache_t *cache, char const *imsi, uint8_t version,
+				  sigtran_vector_t *vector);
+
 /*
  *	log.c
  */
@@ -0,0 +1,252 @@
+/*
+ * @copyright (c) 2016, Network RADIUS SAS (license@networkradius.com)
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of Network RADIUS SAS nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * $Id$
+ * @file rlm_sigtran/vector.c
+ * @brief Cache authentication vectors the HLR returned, but we didn't use.
+ *
+ * The HLR may return up to five vectors in response to a single
+ * MAP SendAuthenticationInfo request.  Only some are needed for an
+ * authentication attempt, the rest are stored here, so that
+ * subsequent authentications for the same subscriber can avoid
+ * the round trip to the HLR.
+ *
+ * Vectors are single use.  They're removed from the cache as soon
+ * as they're handed out, and are given out in the order the HLR
+ * supplied them, which keeps the AKA sequence numbers ascending.
+ *
+ * @copyright 2026 Network RADIUS SAS (license@networkradius.com)
+ */
+#define LOG_PREFIX "sigtran"
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+
+#include "sigtran.h"
+
+/** Unused vectors for a single subscriber
+ *
+ */
+typedef struct {
+	char const		*imsi;			//!< Subscriber the vectors belong to.
+	uint8_t			version;		//!< MAP version the vectors were retrieved with.
+
+	sigtran_vector_t	*vector;		//!< Linked list of unused vectors.
+	unsigned int		num_vectors;		//!< How many vectors are in the list.
+
+	fr_time_t		expires;		//!< When the vectors must no longer be used.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} sigtran_vector_cache_entry_t;
+
+struct sigtran_vector_cache_s {
+	pthread_mutex_t		mutex;			//!< Lookups and updates can happen in any worker.
+	fr_hash_table_t		*ht;			//!< Entries by IMSI and version.
+	fr_dlist_head_t		lru;			//!< Least recently used entries at the head.
+	uint32_t		max_entries;		//!< Maximum number of subscribers to cache vectors for.
+	fr_time_delta_t		lifetime;		//!< How long vectors may be cached for.
+};
+
+static uint32_t sigtran_vector_cache_entry_hash(void const *data)
+{
+	sigtran_vector_cache_entry_t const *e = data;
+
+	return fr_hash_update(&e->version, sizeof(e->version), fr_hash_string(e->imsi));
+}
+
+static int8_t sigtran_vector_cache_entry_cmp(void const *one, void const *two)
+{
+	sigtran_vector_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	CMP_RETURN(a, b, version);
+
+	ret = strcmp(a->imsi, b->imsi);
+	return CMP(ret, 0);
+}
+
+static void sigtran_vector_cache_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int _sigtran_vector_cache_free(sigtran_vector_cache_t *cache)
+{
+	talloc_free(cache->ht);
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache for unused authentication vectors
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of subscribers to cache vectors for.
+ * @param[in] lifetime		How long vectors are kept for.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+sigtran_vector_cache_t *sigtran_vector_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries, fr_time_delta_t lifetime)
+{
+	sigtran_vector_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, sigtran_vector_cache_t));
+
+	/*
+	 *	Entries are allocated in the NULL ctx, so that
+	 *	workers only ever touch the chunks belonging
+	 *	to the entries they're manipulating.
+	 */
+	cache->ht = fr_hash_table_alloc(NULL, sigtran_vector_cache_entry_hash, sigtran_vector_cache_entry_cmp,
+					sigtran_vector_cache_entry_free);
+	if (!cache->ht) {
+		talloc_free(cache);
+		return NULL;
+	}
+	fr_dlist_talloc_init(&cache->lru, sigtran_vector_cache_entry_t, entry);
+	cache->max_entries = max_entries;
+	cache->lifetime = lifetime;
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _sigtran_vector_cache_free);
+
+	return cache;
+}
+
+/** Remove vectors for a subscriber from the cache
+ *
+ * If the subscriber has fewer than num cached vectors, all their
+ * vectors are discarded, and the caller should ask the HLR for a
+ * new batch.
+ *
+ * @param[in] ctx		to move the vectors into.
+ * @param[out] remaining	How many vectors are still cached for the subscriber.
+ * @param[in] cache		to search in.
+ * @param[in] imsi		of the subscriber, as ASCII digits.
+ * @param[in] version		MAP version the vectors must have been retrieved with.
+ * @param[in] num		How many vectors are required.
+ * @return
+ *	- A linked list of num vectors.
+ *	- NULL if there weren't enough cached vectors.
+ */
+sigtran_vector_t *sigtran_vector_cache_pop(TALLOC_CTX *ctx, unsigned int *remaining,
+					   sigtran_vector_cache_t *cache, char const *imsi, uint8_t version,
+					   unsigned int num)
+{
+	sigtran_vector_cache_entry_t	*e;
+	sigtran_vector_t		*head = NULL, *vec, **last = &head;
+	unsigned int			i;
+
+	*remaining = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	e = fr_hash_table_find(cache->ht, &(sigtran_vector_cache_entry_t){ .imsi = imsi, .version = version });
+	if (!e) goto done;
+
+	if (fr_time_lteq(e->expires, fr_time()) || (e->num_vectors < num)) {
+	remove:
+		fr_dlist_remove(&cache->lru, e);
+		fr_hash_table_delete(cache->ht, e);
+		goto done;
+	}
+
+	for (i = 0; i < num; i++) {
+		vec = e->vector;
+		e->vector = vec->next;
+		vec->next = NULL;
+
+		*last = talloc_steal(ctx, vec);
+		last = &vec->next;
+	}
+	e->num_vectors -= num;
+	*remaining = e->num_vectors;
+
+	if (!e->num_vectors) goto remove;
+
+	fr_dlist_remove(&cache->lru, e);
+	fr_dlist_insert_tail(&cache->lru, e);
+
+done:
+	pthread_mutex_unlock(&cache->mutex);
+
+	return head;
+}
+
+/** Store vectors for a subscriber
+ *
+ * Any vectors already cached for the subscriber are discarded.
+ * A new batch was only requested because the old one didn't hold
+ * enough vectors, and with AKA, the new batch has higher sequence
+ * numbers, which would cause the old vectors to be rejected anyway.
+ *
+ * @param[in] cache		to insert the vectors into.
+ * @param[in] imsi		of the subscriber, as ASCII digits.
+ * @param[in] version		MAP version the vectors were retrieved with.
+ * @param[in] vector		Linked list of vectors.  Ownership is taken.
+ */
+void sigtran_vector_cache_push(sigtran_vector_cache_t *cache, char const *imsi, uint8_t version,
+			       sigtran_vector_t *vector)
+{
+	sigtran_vector_cache_entry_t	*e, *old;
+	sigtran_vector_t		*vec;
+
+	if (!vector) return;
+
+	MEM(e = talloc_zero(NULL, sigtran_vector_cache_entry_t));
+	MEM(e->imsi = talloc_strdup(e, imsi));
+	e->version = version;
+	e->vector = vector;
+	e->expires = fr_time_add(fr_time(), cache->lifetime);
+
+	for (vec = vector; vec; vec = vec->next) {
+		talloc_steal(e, vec);
+		e->num_vectors++;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	old = fr_hash_table_find(cache->ht, e);
+	if (old) {
+		fr_dlist_remove(&cache->lru, old);
+		fr_hash_table_delete(cache->ht, old);
+	}
+
+	while (fr_hash_table_num_elements(cache->ht) >= cache->max_entries) {
+		old = fr_dlist_pop_head(&cache->lru);
+		if (!old) break;
+		fr_hash_table_delete(cache->ht, old);
+	}
+
+	if (!fr_hash_table_insert(cache->ht, e)) {
+		pthread_mutex_unlock(&cache->mutex);
+		talloc_free(e);
+		return;
+	}
+	fr_dlist_insert_tail(&cache->lru, e);
+	pthread_mutex_unlock(&cache->mutex);
+}
@@ -50,8 +50,27 @@ DIAG_ON(documentation)
 
 #include "rlm_sql.h"
 
+/** Shared between a connection and the callbacks of its outstanding futures
+ *
+ * Future callbacks run in one of libcassandra's I/O threads, and may run
+ * after the connection has been freed, so they only touch this.  Whichever
+ * of the connection or the last callback finishes with it, frees it.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;				//!< Protects the fields below.
+	fr_event_list_t		*el;				//!< Event list the connection runs in.
+	fr_event_user_t		*ev;				//!< Triggered when a future completes.
+								//!< NULL once the connection has been closed.
+	unsigned int		pending;			//!< Futures whose callbacks haven't run yet.
+} rlm_sql_cassandra_wake_t;
+
+typedef struct rlm_sql_cassandra_s rlm_sql_cassandra_t;
+
 /** Cassandra cluster connection
  *
+ * All connections share the instance's session, which multiplexes queries
+ * over its own connections to the cluster.  This just tracks the query
+ * the trunk has assigned to it.
  */
 typedef struct {
 	CassResult const	*result;			//!< Result from executing a query.
@@ -60,19 +79,30 @@ typedef struct {
 	TALLOC_CTX		*log_ctx;			//!< Prevent unneeded memory allocation by keeping a
 								//!< permanent pool, to store log entries.
 	sql_log_entry_t		last_error;
+
+	connection_t		*conn;				//!< Generic connection structure for this connection.
+	rlm_sql_cassandra_t	*inst;				//!< Driver instance data.
+	rlm_sql_config_t const	*config;			//!< rlm_sql instance configuration.
+	fr_sql_query_t		*query_ctx;			//!< Current query running on this connection.
+	CassFuture		**futures;			//!< One for each statement of the current query.
+	unsigned int		num_futures;			//!< How many futures are in use.
+	rlm_sql_cassandra_wake_t *wake;				//!< Signals the event loop when futures complete.
+	fr_event_timer_t const	*connect_ev;			//!< Polls the session's connection to the cluster.
+	fr_event_timer_t const	*write_ev;			//!< Signals the trunk that this connection is writable.
 } rlm_sql_cassandra_conn_t;
 
 /** Cassandra driver instance
  *
  */
-typedef struct {
+struct rlm_sql_cassandra_s {
 	CassCluster		*cluster;			//!< Configuration of the cassandra cluster connection.
 	CassSession		*session;			//!< Cluster's connection pool.
 	CassSsl			*ssl;				//!< Connection's SSL context.
 	bool			done_connect_keyspace;		//!< Whether we've connected to a keyspace.
+	CassFuture		*connect_future;		//!< Outstanding attempt to connect to the keyspace.
 
-	pthread_mutex_t		connect_mutex;			//!< Mutex to prevent multiple connections attempting
-								//!< to connect a keyspace concurrently.
+	pthread_mutex_t		connect_mutex;			//!< Protects connect_future and done_connect_keyspace.
+								//!< Never held while waiting on the cluster.
 
 	/*
 	 *	Configuration options
@@ -171,7 +201,7 @@ typedef struct {
 	char const		*tls_private_key_password;	//!< String to decrypt private key.
 	char const 		*tls_verify_cert_str;		//!< Whether we validate the cert provided by the
 								//!< server.
-} rlm_sql_cassandra_t;
+};
 
 static fr_table_num_sorted_t const consistency_levels[] = {
 	{ L("all"),		CASS_CONSISTENCY_ALL		},
@@ -373,119 +403,575 @@ static void sql_set_last_error_printf(rlm_sql_cassandra_conn_t *conn, char const
 	conn->last_error.type = L_ERR;
 }
 
+static void sql_wake_free(rlm_sql_cassandra_wake_t *wake)
+{
+	pthread_mutex_destroy(&wake->mutex);
+	talloc_free(wake);
+}
+
+/** Called by libcassandra, in one of its I/O threads, when a future completes
+ *
+ * Wakes the event loop of the connection the future was submitted on.
+ */
+static void _sql_future_callback(UNUSED CassFuture *future, void *data)
+{
+	rlm_sql_cassandra_wake_t	*wake = data;
+	bool				orphaned;
+
+	pthread_mutex_lock(&wake->mutex);
+	fr_assert(wake->pending > 0);
+	wake->pending--;
+	if (wake->ev) (void) fr_event_user_trigger(wake->el, wake->ev);
+	orphaned = !wake->ev && (wake->pending == 0);
+	pthread_mutex_unlock(&wake->mutex);
+
+	if (orphaned) sql_wake_free(wake);
+}
+
+/** Release the futures of the current query
+ *
+ * Futures which haven't completed yet are abandoned, libcassandra still
+ * runs their callbacks.
+ */
+static void sql_futures_free(rlm_sql_cassandra_conn_t *c)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->num_futures; i++) cass_future_free(c->futures[i]);
+	c->num_futures = 0;
+}
+
+static void sql_result_free(rlm_sql_cassandra_conn_t *c)
+{
+	if (c->iterator) {
+		cass_iterator_free(c->iterator);
+		c->iterator = NULL;
+	}
+
+	if (c->result) {
+		cass_result_free(c->result);
+		c->result = NULL;
+	}
+}
+
 static int _sql_socket_destructor(rlm_sql_cassandra_conn_t *conn)
 {
+	rlm_sql_cassandra_wake_t	*wake = conn->wake;
+	bool				orphaned;
+
 	DEBUG2("Socket destructor called, closing socket");
 
-	if (conn->iterator) cass_iterator_free(conn->iterator);
-	if (conn->result) cass_result_free(conn->result);
+	sql_futures_free(conn);
+	sql_result_free(conn);
+
+	if (!wake) return 0;
+
+	/*
+	 *	Stop callbacks which are still outstanding from
+	 *	triggering the event we're about to free.
+	 */
+	pthread_mutex_lock(&wake->mutex);
+	TALLOC_FREE(wake->ev);
+	orphaned = (wake->pending == 0);
+	pthread_mutex_unlock(&wake->mutex);
+
+	if (orphaned) sql_wake_free(wake);
 
 	return 0;
 }
 
-static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t const *config, fr_time_delta_t timeout)
+/** Check on, or start, the session's connection to the keyspace
+ *
+ * There's one session per instance, shared by every connection in every
+ * thread.  The first connection to find it disconnected starts connecting
+ * it, and every connection then polls the same future.
+ *
+ * We do this here instead of in mod_instantiate to allow the server to
+ * start if Cassandra is unavailable.
+ *
+ * @return
+ *	- 1 if the session is connected.
+ *	- 0 if it's still connecting.
+ *	- -1 if connecting failed.
+ */
+static int sql_session_connect(rlm_sql_cassandra_conn_t *c)
 {
-	rlm_sql_cassandra_conn_t	*conn;
-	rlm_sql_cassandra_t		*inst = talloc_get_type_abort(handle->inst->driver_submodule->data, rlm_sql_cassandra_t);
+	rlm_sql_cassandra_t	*inst = c->inst;
+	rlm_sql_config_t const	*config = c->config;
+	CassError		ret;
+	int			rcode = 1;
+
+	pthread_mutex_lock(&inst->connect_mutex);
+	if (inst->done_connect_keyspace) goto done;
+
+	if (!inst->connect_future) {
+		cass_cluster_set_connect_timeout(inst->cluster,
+						 fr_time_delta_to_msec(config->trunk_conf.conn_conf->connection_timeout));
+
+		DEBUG2("Connecting to Cassandra cluster");
+		inst->connect_future = cass_session_connect_keyspace(inst->session, inst->cluster, config->sql_db);
+	}
+
+	if (!cass_future_ready(inst->connect_future)) {
+		rcode = 0;
+		goto done;
+	}
 
-	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_cassandra_conn_t));
-	talloc_set_destructor(conn, _sql_socket_destructor);
+	ret = cass_future_error_code(inst->connect_future);
+	if (ret != CASS_OK) {
+		const char	*msg;
+		size_t		msg_len;
+
+		cass_future_error_message(inst->connect_future, &msg, &msg_len);
+		ERROR("Unable to connect: [%x] %.*s", (int)ret, (int)msg_len, msg);
+		rcode = -1;
+	} else {
+		inst->done_connect_keyspace = true;
+	}
+
+	cass_future_free(inst->connect_future);
+	inst->connect_future = NULL;
+
+done:
+	pthread_mutex_unlock(&inst->connect_mutex);
+
+	return rcode;
+}
+
+/** How often a connecting connection checks on the session
+ *
+ * The connect future is shared between connections, and a future can only
+ * have one callback, so connections poll it instead.
+ */
+#define SQL_CONNECT_POLL_INTERVAL	fr_time_delta_from_msec(10)
+
+static void _sql_connect_poll(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_sql_cassandra_conn_t	*c = talloc_get_type_abort(uctx, rlm_sql_cassandra_conn_t);
+
+	switch (sql_session_connect(c)) {
+	case 1:
+		connection_signal_connected(c->conn);
+		return;
+
+	case 0:
+		if (fr_event_timer_in(c, c->conn->el, &c->connect_ev, SQL_CONNECT_POLL_INTERVAL,
+				      _sql_connect_poll, c) == 0) return;
+		PERROR("Failed inserting connect poll timer");
+		FALL_THROUGH;
+
+	default:
+		connection_signal_reconnect(c->conn, CONNECTION_FAILED);
+		return;
+	}
+}
+
+static void _sql_futures_ready(fr_event_list_t *el, void *uctx);
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_state_t _sql_connection_init(void **h, connection_t *conn, void *uctx)
+{
+	rlm_sql_t const			*sql = talloc_get_type_abort_const(uctx, rlm_sql_t);
+	rlm_sql_cassandra_t		*inst = talloc_get_type_abort(sql->driver_submodule->data, rlm_sql_cassandra_t);
+	rlm_sql_cassandra_conn_t	*c;
+	rlm_sql_cassandra_wake_t	*wake;
+
+	MEM(c = talloc_zero(conn, rlm_sql_cassandra_conn_t));
+	talloc_set_destructor(c, _sql_socket_destructor);
+	c->conn = conn;
+	c->inst = inst;
+	c->config = &sql->config;
+	c->log_ctx = talloc_pool(c, 1024);	/* Pre-allocate some memory for log messages */
 
 	/*
-	 *	We do this one inside sql_socket_init, to allow pool.start = 0 to
-	 *	work as expected (allow the server to start if Cassandra is
-	 *	unavailable).
+	 *	Not parented by the connection, as it may outlive it.
 	 */
-	if (!inst->done_connect_keyspace) {
-		CassFuture	*future;
-		CassError	ret;
+	MEM(wake = talloc_zero(NULL, rlm_sql_cassandra_wake_t));
+	pthread_mutex_init(&wake->mutex, NULL);
+	wake->el = conn->el;
+	c->wake = wake;
+
+	if (fr_event_user_insert(c, conn->el, &wake->ev, false, _sql_futures_ready, c) < 0) {
+		PERROR("Failed inserting user event");
+	error:
+		talloc_free(c);
+		return CONNECTION_STATE_FAILED;
+	}
 
-		pthread_mutex_lock(&inst->connect_mutex);
-		if (!inst->done_connect_keyspace) {
-			/*
-			 *	Easier to do this here instead of mod_instantiate
-			 *	as we don't have a pointer to the pool.
-			 */
-			cass_cluster_set_connect_timeout(inst->cluster, fr_time_delta_to_msec(timeout));
-
-			DEBUG2("Connecting to Cassandra cluster");
-			future = cass_session_connect_keyspace(inst->session, inst->cluster, config->sql_db);
-			ret = cass_future_error_code(future);
-			if (ret != CASS_OK) {
-				const char	*msg;
-				size_t		msg_len;
-
-				cass_future_error_message(future, &msg, &msg_len);
-				ERROR("Unable to connect: [%x] %s", (int)ret, msg);
-				cass_future_free(future);
-				pthread_mutex_unlock(&inst->connect_mutex);
-
-				return RLM_SQL_ERROR;
-			}
-			cass_future_free(future);
-			inst->done_connect_keyspace = true;
+	*h = c;
+
+	switch (sql_session_connect(c)) {
+	case 1:
+		return CONNECTION_STATE_CONNECTED;
+
+	case 0:
+		if (fr_event_timer_in(c, conn->el, &c->connect_ev, SQL_CONNECT_POLL_INTERVAL,
+				      _sql_connect_poll, c) < 0) {
+			PERROR("Failed inserting connect poll timer");
+			goto error;
 		}
-		pthread_mutex_unlock(&inst->connect_mutex);
+		return CONNECTION_STATE_CONNECTING;
+
+	default:
+		goto error;
 	}
-	conn->log_ctx = talloc_pool(conn, 1024);	/* Pre-allocate some memory for log messages */
+}
 
-	return RLM_SQL_OK;
+static void _sql_connection_close(UNUSED fr_event_list_t *el, void *h, UNUSED void *uctx)
+{
+	rlm_sql_cassandra_conn_t	*c = talloc_get_type_abort(h, rlm_sql_cassandra_conn_t);
+
+	if (c->connect_ev) fr_event_timer_delete(&c->connect_ev);
+	if (c->write_ev) fr_event_timer_delete(&c->write_ev);
+	c->query_ctx = NULL;
+	talloc_free(h);
 }
 
-static unlang_action_t sql_query(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
+/** Allocate an SQL trunk connection
+ *
+ * @param[in] tconn		Trunk handle.
+ * @param[in] el		Event list which will be used for I/O and timer events.
+ * @param[in] conn_conf		Configuration of the connection.
+ * @param[in] log_prefix	What to prefix log messages with.
+ * @param[in] uctx		User context passed to trunk_alloc.
+ */
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_t *sql_trunk_connection_alloc(trunk_connection_t *tconn, fr_event_list_t *el,
+						connection_conf_t const *conn_conf,
+						char const *log_prefix, void *uctx)
 {
-	fr_sql_query_t			*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
-	rlm_sql_cassandra_conn_t	*conn = query_ctx->handle->conn;
-	rlm_sql_cassandra_t		*inst = talloc_get_type_abort(query_ctx->handle->inst->driver_submodule->data, rlm_sql_cassandra_t);
+	connection_t		*conn;
+	rlm_sql_thread_t	*thread = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+
+	conn = connection_alloc(tconn, el,
+				&(connection_funcs_t){
+					.init = _sql_connection_init,
+					.close = _sql_connection_close
+				},
+				conn_conf, log_prefix, thread->inst);
+	if (!conn) {
+		PERROR("Failed allocating state handler for new SQL connection");
+		return NULL;
+	}
+
+	return conn;
+}
+
+/** Signal the trunk that the connection can accept a new query
+ *
+ * The session's sockets are managed by libcassandra, so there's no I/O
+ * event to wait on.  With one query per connection, the connection is
+ * writable whenever the trunk asks.
+ */
+static void sql_trunk_connection_write_poll(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+
+	trunk_connection_signal_writable(tconn);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_trunk_connection_notify(trunk_connection_t *tconn, connection_t *conn, fr_event_list_t *el,
+					trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	rlm_sql_cassandra_conn_t	*c = talloc_get_type_abort(conn->h, rlm_sql_cassandra_conn_t);
+
+	if (c->write_ev) fr_event_timer_delete(&c->write_ev);
+
+	switch (notify_on) {
+	/*
+	 *	Reads are driven by the future callbacks
+	 */
+	case TRUNK_CONN_EVENT_NONE:
+	case TRUNK_CONN_EVENT_READ:
+		return;
+
+	case TRUNK_CONN_EVENT_WRITE:
+	case TRUNK_CONN_EVENT_BOTH:
+		break;
+	}
+
+	if (fr_event_timer_in(c, el, &c->write_ev, fr_time_delta_wrap(0),
+			      sql_trunk_connection_write_poll, tconn) < 0) {
+		PERROR("Failed inserting write poll timer");
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+	}
+}
 
+/** Execute one statement, registering a callback to wake us when it completes
+ *
+ */
+static void sql_statement_execute(rlm_sql_cassandra_conn_t *c, char const *str, size_t len)
+{
+	rlm_sql_cassandra_t const	*inst = c->inst;
 	CassStatement			*statement;
 	CassFuture			*future;
-	CassError			ret;
 
-	statement = cass_statement_new_n(query_ctx->query_str, talloc_array_length(query_ctx->query_str) - 1, 0);
+	statement = cass_statement_new_n(str, len, 0);
 	if (inst->consistency_str) cass_statement_set_consistency(statement, inst->consistency);
 
 	future = cass_session_execute(inst->session, statement);
 	cass_statement_free(statement);
 
-	ret = cass_future_error_code(future);
-	if (ret != CASS_OK) {
+	if (c->num_futures == talloc_array_length(c->futures)) {
+		MEM(c->futures = talloc_realloc(c, c->futures, CassFuture *, c->num_futures ? c->num_futures * 2 : 4));
+	}
+	c->futures[c->num_futures++] = future;
+
+	/*
+	 *	Count the callback before registering it.  If the
+	 *	future has already completed, it runs immediately,
+	 *	in this thread.
+	 */
+	pthread_mutex_lock(&c->wake->mutex);
+	c->wake->pending++;
+	pthread_mutex_unlock(&c->wake->mutex);
+
+	if (cass_future_set_callback(future, _sql_future_callback, c->wake) != CASS_OK) {
+		pthread_mutex_lock(&c->wake->mutex);
+		c->wake->pending--;
+		pthread_mutex_unlock(&c->wake->mutex);
+
+		/*
+		 *	Shouldn't happen, but make sure we're woken
+		 *	up to find the future complete.
+		 */
+		(void) cass_future_wait(future);
+		(void) fr_event_user_trigger(c->conn->el, c->wake->ev);
+	}
+}
+
+/** Execute each ';' separated statement of a query
+ *
+ * Batched accounting queries are written as a single multi-statement query,
+ * which CQL doesn't support.  Rather than combining the statements into a
+ * CassBatch, which is sent to a single coordinator, each statement is
+ * executed on its own, so that token aware routing can send it straight
+ * to a replica of the partition it writes to.  The statements all run
+ * concurrently.
+ *
+ * ';' within quoted strings and identifiers doesn't end a statement.
+ */
+static void sql_statements_execute(rlm_sql_cassandra_conn_t *c, char const *query_str, size_t len)
+{
+	char const	*p = query_str, *end = query_str + len;
+	char const	*start = p;
+	char		quote = '\0';
+
+	for (;;) {
+		char const *stmt_end;
+
+		while ((p < end) && (quote || (*p != ';'))) {
+			if (quote) {
+				if (*p == quote) quote = '\0';	/* Doubled quotes are two adjacent strings */
+			} else if ((*p == '\'') || (*p == '"')) {
+				quote = *p;
+			}
+			p++;
+		}
+
+		/*
+		 *	Trim leading and trailing whitespace
+		 */
+		stmt_end = p;
+		while ((start < stmt_end) && isspace((uint8_t)*start)) start++;
+		while ((stmt_end > start) && isspace((uint8_t)stmt_end[-1])) stmt_end--;
+
+		if (stmt_end > start) sql_statement_execute(c, start, stmt_end - start);
+
+		if (p >= end) break;
+		start = ++p;
+	}
+}
+
+/** Process the results of the current query once all its futures have completed
+ *
+ * Called in the worker, whenever a future callback triggers the connection's
+ * user event.
+ */
+static void _sql_futures_ready(UNUSED fr_event_list_t *el, void *uctx)
+{
+	rlm_sql_cassandra_conn_t	*c = talloc_get_type_abort(uctx, rlm_sql_cassandra_conn_t);
+	fr_sql_query_t			*query_ctx = c->query_ctx;
+	request_t			*request;
+	unsigned int			i;
+
+	/*
+	 *	Query was cancelled
+	 */
+	if (!query_ctx) return;
+
+	for (i = 0; i < c->num_futures; i++) if (!cass_future_ready(c->futures[i])) return;
+
+	request = query_ctx->request;
+	query_ctx->rcode = RLM_SQL_OK;
+
+	for (i = 0; i < c->num_futures; i++) {
+		CassError	ret;
 		char const	*error;
 		size_t		len;
 
-		cass_future_error_message(future, &error, &len);
-		sql_set_last_error(conn, error, len);
-		cass_future_free(future);
+		ret = cass_future_error_code(c->futures[i]);
+		if (ret == CASS_OK) continue;
+
+		cass_future_error_message(c->futures[i], &error, &len);
+		ROPTIONAL(RERROR, ERROR, "Statement %u of %u failed: %.*s", i + 1, c->num_futures, (int)len, error);
+
+		if (query_ctx->rcode != RLM_SQL_OK) continue;	/* Report the first failure */
+
+		sql_set_last_error(c, error, len);
 
 		switch (ret) {
 		case CASS_ERROR_SERVER_SYNTAX_ERROR:
 		case CASS_ERROR_SERVER_INVALID_QUERY:
 			query_ctx->rcode = RLM_SQL_QUERY_INVALID;
-			RETURN_MODULE_INVALID;
+			break;
 
 		default:
 			query_ctx->rcode = RLM_SQL_ERROR;
-			RETURN_MODULE_FAIL;
+			break;
 		}
 	}
 
-	conn->result = cass_future_get_result(future);
-	cass_future_free(future);
+	if (query_ctx->rcode != RLM_SQL_OK) {
+		query_ctx->status = SQL_QUERY_FAILED;
+	} else if (query_ctx->type == SQL_QUERY_SELECT) {
+		if (c->num_futures > 0) c->result = cass_future_get_result(c->futures[0]);
+		query_ctx->status = SQL_QUERY_RESULTS_FETCHED;
+	} else {
+		query_ctx->status = SQL_QUERY_RETURNED;
+	}
 
-	query_ctx->rcode = RLM_SQL_OK;
-	RETURN_MODULE_OK;
+	sql_futures_free(c);
+	c->query_ctx = NULL;
+
+	if (request) unlang_interpret_mark_runnable(request);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_trunk_request_mux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn,
+				  connection_t *conn, UNUSED void *uctx)
+{
+	rlm_sql_cassandra_conn_t	*sql_conn = talloc_get_type_abort(conn->h, rlm_sql_cassandra_conn_t);
+	request_t			*request;
+	trunk_request_t			*treq;
+	fr_sql_query_t			*query_ctx;
+	size_t				len;
+
+	if (trunk_connection_pop_request(&treq, tconn) != 0) return;
+	if (!treq) return;
+
+	query_ctx = talloc_get_type_abort(treq->preq, fr_sql_query_t);
+	request = query_ctx->request;
+
+	switch (query_ctx->status) {
+	case SQL_QUERY_PREPARED:
+		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query_ctx->query_str);
+		query_ctx->tconn = tconn;
+
+		sql_result_free(sql_conn);	/* Any previous result set */
+
+		query_ctx->status = SQL_QUERY_SUBMITTED;
+		sql_conn->query_ctx = query_ctx;
+		trunk_request_signal_sent(treq);
+
+		len = talloc_array_length(query_ctx->query_str) - 1;
+		if (query_ctx->type == SQL_QUERY_SELECT) {
+			sql_statement_execute(sql_conn, query_ctx->query_str, len);
+		} else {
+			sql_statements_execute(sql_conn, query_ctx->query_str, len);
+		}
+
+		/*
+		 *	Nothing to run, complete immediately
+		 */
+		if (sql_conn->num_futures == 0) (void) fr_event_user_trigger(conn->el, sql_conn->wake->ev);
+		return;
+
+	default:
+		return;
+	}
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_request_cancel(connection_t *conn, void *preq, trunk_cancel_reason_t reason,
+			       UNUSED void *uctx)
+{
+	fr_sql_query_t			*query_ctx = talloc_get_type_abort(preq, fr_sql_query_t);
+	rlm_sql_cassandra_conn_t	*sql_conn = talloc_get_type_abort(conn->h, rlm_sql_cassandra_conn_t);
+
+	if (!query_ctx->treq) return;
+	if (reason != TRUNK_CANCEL_REASON_SIGNAL) return;
+	if (sql_conn->query_ctx == query_ctx) sql_conn->query_ctx = NULL;
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_request_cancel_mux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn,
+				   connection_t *conn, UNUSED void *uctx)
+{
+	rlm_sql_cassandra_conn_t	*sql_conn = talloc_get_type_abort(conn->h, rlm_sql_cassandra_conn_t);
+	trunk_request_t			*treq;
+
+	/*
+	 *	The statements can't be recalled, but as the session
+	 *	isn't tied to this connection, we can abandon their
+	 *	futures and carry on using it.
+	 */
+	if ((trunk_connection_pop_cancellation(&treq, tconn)) == 0) {
+		sql_futures_free(sql_conn);
+		trunk_request_signal_cancel_complete(treq);
+	}
+}
+
+static void sql_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+			     UNUSED trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_sql_query_t		*query_ctx = talloc_get_type_abort(preq, fr_sql_query_t);
+
+	query_ctx->treq = NULL;
+	query_ctx->rcode = RLM_SQL_ERROR;
+
+	if (request) unlang_interpret_mark_runnable(request);
+}
+
+static unlang_action_t sql_query_resume(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
+{
+	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
+
+	switch (query_ctx->rcode) {
+	case RLM_SQL_OK:
+		RETURN_MODULE_OK;
+
+	case RLM_SQL_QUERY_INVALID:
+		RETURN_MODULE_INVALID;
+
+	default:
+		RETURN_MODULE_FAIL;
+	}
+}
+
+/** Return the connection a query ran on, if it's still usable
+ *
+ */
+static rlm_sql_cassandra_conn_t *sql_query_conn(fr_sql_query_t *query_ctx)
+{
+	if (!query_ctx->tconn || !query_ctx->tconn->conn || !query_ctx->tconn->conn->h) return NULL;
+
+	if (!(query_ctx->tconn->state & TRUNK_CONN_PROCESSING)) return NULL;
+
+	return talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_cassandra_conn_t);
 }
 
 static int sql_num_rows(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_cassandra_conn_t *conn = query_ctx->handle->conn;
+	rlm_sql_cassandra_conn_t *conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_cassandra_conn_t);
 
 	return conn->result ? cass_result_row_count(conn->result) : 0;
 }
 
 static sql_rcode_t sql_fields(char const **out[], fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_cassandra_conn_t *conn = query_ctx->handle->conn;
+	rlm_sql_cassandra_conn_t *conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_cassandra_conn_t);
 
 	unsigned int	fields, i;
 	char const	**names;
@@ -514,7 +1000,8 @@ static sql_rcode_t sql_fields(char const **out[], fr_sql_query_t *query_ctx, UNU
 static unlang_action_t sql_fetch_row(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
 {
 	fr_sql_query_t			*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
-	rlm_sql_cassandra_conn_t 	*conn = query_ctx->handle->conn;
+	rlm_sql_cassandra_conn_t 	*conn = talloc_get_type_abort(query_ctx->tconn->conn->h,
+								      rlm_sql_cassandra_conn_t);
 	CassRow	const 			*cass_row;
 	int				fields, i;
 	char				**row;
@@ -648,19 +1135,22 @@ do {\
 
 static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_cassandra_conn_t *conn = query_ctx->handle->conn;
+	rlm_sql_cassandra_conn_t *conn;
 
 	if (query_ctx->row) TALLOC_FREE(query_ctx->row);
 
-	if (conn->iterator) {
-		cass_iterator_free(conn->iterator);
-		conn->iterator = NULL;
-	}
+	if (query_ctx->treq && !(query_ctx->treq->state &
+	    (TRUNK_REQUEST_STATE_SENT | TRUNK_REQUEST_STATE_REAPABLE | TRUNK_REQUEST_STATE_COMPLETE))) return RLM_SQL_OK;
 
-	if (conn->result) {
-		cass_result_free(conn->result);
-		conn->result = NULL;
-	}
+	conn = sql_query_conn(query_ctx);
+	if (!conn) return RLM_SQL_ERROR;
+
+	/*
+	 *	Still running, the cancellation will clean up
+	 */
+	if (conn->query_ctx == query_ctx) return RLM_SQL_OK;
+
+	sql_result_free(conn);
 
 	return RLM_SQL_OK;
 }
@@ -668,7 +1158,9 @@ static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, UNUSED rlm_sql_con
 static size_t sql_error(UNUSED TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
 			fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_cassandra_conn_t *conn = query_ctx->handle->conn;
+	rlm_sql_cassandra_conn_t *conn = sql_query_conn(query_ctx);
+
+	if (!conn) return 0;
 
 	if (conn->last_error.msg && (outlen >= 1)) {
 		out[0].msg = conn->last_error.msg;
@@ -683,7 +1175,9 @@ static size_t sql_error(UNUSED TALLOC_CTX *ctx, sql_log_entry_t out[], size_t ou
 
 static sql_rcode_t sql_finish_query(fr_sql_query_t *query_ctx, rlm_sql_config_t const *config)
 {
-	rlm_sql_cassandra_conn_t *conn = query_ctx->handle->conn;
+	rlm_sql_cassandra_conn_t *conn = sql_query_conn(query_ctx);
+
+	if (!conn) return sql_free_result(query_ctx, config);
 
 	/*
 	 *	Clear our local log buffer, and free any messages which weren't
@@ -711,6 +1205,7 @@ static int mod_detach(module_detach_ctx_t const *mctx)
 {
 	rlm_sql_cassandra_t *inst = talloc_get_type_abort(mctx->mi->data, rlm_sql_cassandra_t);
 
+	if (inst->connect_future) cass_future_free(inst->connect_future);
 	if (inst->ssl) cass_ssl_free(inst->ssl);
 	if (inst->session) cass_session_free(inst->session);	/* also synchronously closes the session */
 	if (inst->cluster) cass_cluster_free(inst->cluster);
@@ -972,9 +1467,9 @@ rlm_sql_driver_t rlm_sql_cassandra = {
 		.instantiate			= mod_instantiate,
 		.detach				= mod_detach
 	},
-	.sql_socket_init		= sql_socket_init,
-	.sql_query			= sql_query,
-	.sql_select_query		= sql_query,
+	.flags				= RLM_SQL_FLAGS_MULTI_STATEMENTS,
+	.sql_query_resume		= sql_query_resume,
+	.sql_select_query_resume	= sql_query_resume,
 	.sql_num_rows			= sql_num_rows,
 	.sql_affected_rows		= sql_affected_rows,
 	.sql_fields			= sql_fields,
@@ -982,5 +1477,14 @@ rlm_sql_driver_t rlm_sql_cassandra = {
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_query
+	.sql_finish_select_query	= sql_finish_query,
+	.uses_trunks			= true,
+	.trunk_io_funcs = {
+		.connection_alloc	= sql_trunk_connection_alloc,
+		.connection_notify	= sql_trunk_connection_notify,
+		.request_mux		= sql_trunk_request_mux,
+		.request_cancel		= sql_request_cancel,
+		.request_cancel_mux	= sql_request_cancel_mux,
+		.request_fail		= sql_request_fail,
+	}
 };
@@ -62,16 +62,30 @@ typedef struct {
 	uint32_t	spool_min;	//!< Specifies the minimum number of sessions in the session pool.
 	uint32_t	spool_max;	//!< Specifies the maximum number of sessions that can be opened in the session pool
 	uint32_t	spool_inc;	//!< Specifies the increment for sessions to be started if the current number of sessions are less than sessMax
+
+	fr_time_delta_t	poll_interval;	//!< How often to check whether a non-blocking call has completed.
 } rlm_sql_oracle_t;
 
 typedef struct {
 	OCIStmt		*query;
 	OCIError	*error;
 	OCISvcCtx	*ctx;
+	OCIServer	*server;	//!< Server handle the session is attached to.
+	bool		nonblocking;	//!< Whether we toggled the server handle into non-blocking mode.
 	sb2		*ind;
-	char		**row;
-	int		id;
+	char		**row;		//!< Define buffers each fetched row is written to.
 	int		col_count;	//!< Number of columns associated with the result set
+
+	char		***results;	//!< Rows fetched by the current select.
+	ub4		num_rows;	//!< Number of rows in results.
+	ub4		cur_row;	//!< Next row to return from results.
+	ub4		affected_rows;	//!< Rows affected by the last non-select query.
+
+	connection_t	*conn;		//!< Generic connection structure for this connection.
+	rlm_sql_oracle_t const	*inst;	//!< Driver instance data.
+	fr_sql_query_t	*query_ctx;	//!< Current query running on this connection.
+	fr_event_timer_t const	*read_ev;	//!< Polls the outstanding non-blocking call.
+	fr_event_timer_t const	*write_ev;	//!< Signals the trunk that this connection is writable.
 } rlm_sql_oracle_conn_t;
 
 static const conf_parser_t spool_config[] = {
@@ -85,6 +99,7 @@ static const conf_parser_t spool_config[] = {
 
 static const conf_parser_t driver_config[] = {
 	{ FR_CONF_POINTER("spool", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) spool_config },
+	{ FR_CONF_OFFSET("poll_interval", rlm_sql_oracle_t, poll_interval), .dflt = "0.001" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -105,16 +120,14 @@ static int max_dflt(CONF_PAIR **out, UNUSED void *parent, CONF_SECTION *cs, fr_t
  *
  * @param out Where to write the error (should be at least 512 bytes).
  * @param outlen The length of the error buffer.
- * @param handle sql handle.
- * @param config Instance config.
+ * @param conn Oracle connection.
  * @return
  *	- 0 on success.
  *	- -1 if there was no error.
  */
-static int sql_snprint_error(char *out, size_t outlen, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+static int sql_snprint_error(char *out, size_t outlen, rlm_sql_oracle_conn_t *conn)
 {
 	sb4			errcode = 0;
-	rlm_sql_oracle_conn_t	*conn = handle->conn;
 
 	fr_assert(conn);
 
@@ -139,15 +152,17 @@ static int sql_snprint_error(char *out, size_t outlen, rlm_sql_handle_t *handle,
  * @return number of errors written to the #sql_log_entry_t array.
  */
 static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], NDEBUG_UNUSED size_t outlen,
-		        fr_sql_query_t *query_ctx, rlm_sql_config_t const *config)
+		        fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
-	char errbuff[512];
-	int ret;
+	char			errbuff[512];
+	rlm_sql_oracle_conn_t	*conn;
 
 	fr_assert(outlen > 0);
 
-	ret = sql_snprint_error(errbuff, sizeof(errbuff), query_ctx->handle, config);
-	if (ret < 0) return 0;
+	if (!query_ctx->tconn || !query_ctx->tconn->conn || !query_ctx->tconn->conn->h) return 0;
+	conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_oracle_conn_t);
+
+	if (sql_snprint_error(errbuff, sizeof(errbuff), conn) < 0) return 0;
 
 	out[0].type = L_ERR;
 	out[0].msg = talloc_strdup(ctx, errbuff);
@@ -250,11 +265,11 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	return 0;
 }
 
-static sql_rcode_t sql_check_reconnect(rlm_sql_handle_t *handle, rlm_sql_config_t const *config)
+static sql_rcode_t sql_check_reconnect(rlm_sql_oracle_conn_t *conn)
 {
 	char errbuff[512];
 
-	if (sql_snprint_error(errbuff, sizeof(errbuff), handle, config) < 0) return -1;
+	if (sql_snprint_error(errbuff, sizeof(errbuff), conn) < 0) return -1;
 
 	if (strstr(errbuff, "ORA-03113") || strstr(errbuff, "ORA-03114")) {
 		ERROR("OCI_SERVER_NOT_CONNECTED");
@@ -264,194 +279,215 @@ static sql_rcode_t sql_check_reconnect(rlm_sql_handle_t *handle, rlm_sql_config_
 	return RLM_SQL_ERROR;
 }
 
-static int _sql_socket_destructor(rlm_sql_oracle_conn_t *conn)
+/** Free the results of the last select, and return the statement to the cache
+ *
+ */
+static void sql_stmt_release(rlm_sql_oracle_conn_t *conn)
+{
+	TALLOC_FREE(conn->row);
+	conn->ind = NULL;	/* ind is a child of row */
+	conn->col_count = 0;
+
+	TALLOC_FREE(conn->results);
+	conn->num_rows = 0;
+	conn->cur_row = 0;
+
+	if (!conn->query) return;
+
+	if (OCIStmtRelease(conn->query, conn->error, NULL, 0, OCI_DEFAULT) != OCI_SUCCESS) {
+		ERROR("OCI release failed");
+	}
+	conn->query = NULL;
+}
+
+static int _sql_conn_destructor(rlm_sql_oracle_conn_t *conn)
 {
+	/*
+	 *	Session release must not return early
+	 */
+	if (conn->nonblocking) OCIAttrSet((dvoid *)conn->server, OCI_HTYPE_SERVER, NULL, 0,
+					  OCI_ATTR_NONBLOCKING_MODE, conn->error);
+
+	sql_stmt_release(conn);
 	if (conn->ctx) OCISessionRelease(conn->ctx, conn->error, NULL, 0, OCI_DEFAULT);
 	if (conn->error) OCIHandleFree((dvoid *)conn->error, OCI_HTYPE_ERROR);
 	return 0;
 }
 
-static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
-				   UNUSED fr_time_delta_t timeout)
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_state_t _sql_connection_init(void **h, connection_t *conn, void *uctx)
 {
-	char errbuff[512];
+	rlm_sql_t const		*sql = talloc_get_type_abort_const(uctx, rlm_sql_t);
+	rlm_sql_oracle_t const	*inst = talloc_get_type_abort(sql->driver_submodule->data, rlm_sql_oracle_t);
+	rlm_sql_oracle_conn_t	*c;
+	char			errbuff[512];
 
-	rlm_sql_oracle_t	*inst = talloc_get_type_abort(handle->inst->driver_submodule->data, rlm_sql_oracle_t);
-	rlm_sql_oracle_conn_t	*conn;
-
-	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_oracle_conn_t));
-	talloc_set_destructor(conn, _sql_socket_destructor);
+	MEM(c = talloc_zero(conn, rlm_sql_oracle_conn_t));
+	talloc_set_destructor(c, _sql_conn_destructor);
+	c->conn = conn;
+	c->inst = inst;
 
 	/*
 	 *	Allocates an error handle
 	 */
-	if (OCIHandleAlloc((dvoid *)inst->env, (dvoid **)&conn->error, OCI_HTYPE_ERROR, 0, NULL)) {
+	if (OCIHandleAlloc((dvoid *)inst->env, (dvoid **)&c->error, OCI_HTYPE_ERROR, 0, NULL)) {
 		ERROR("Couldn't init Oracle ERROR handle (OCIHandleAlloc())");
-
-		return RLM_SQL_ERROR;
+	error:
+		talloc_free(c);
+		return CONNECTION_STATE_FAILED;
 	}
 
 	/*
 	 *	Get session from pool
+	 *
+	 *	This is the only blocking call, sessions are normally
+	 *	handed out by the OCI session pool without a round trip.
 	 */
-	if (OCISessionGet((dvoid *)inst->env, conn->error, &conn->ctx, NULL,
+	if (OCISessionGet((dvoid *)inst->env, c->error, &c->ctx, NULL,
 		     (OraText *)inst->pool_name, inst->pool_name_len,
 		     NULL, 0, NULL, NULL, NULL,
 		     OCI_SESSGET_SPOOL | OCI_SESSGET_STMTCACHE) != OCI_SUCCESS) {
-		ERROR("Oracle get sessin from pool[%s] failed: '%s'",
+		ERROR("Oracle get session from pool[%s] failed: '%s'",
 		      inst->pool_name,
-		      (sql_snprint_error(errbuff, sizeof(errbuff), handle, config) == 0) ? errbuff : "unknown");
-
-		return RLM_SQL_ERROR;
+		      (sql_snprint_error(errbuff, sizeof(errbuff), c) == 0) ? errbuff : "unknown");
+		goto error;
 	}
 
-	return RLM_SQL_OK;
-}
-
-static sql_rcode_t sql_fields(char const **out[], fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
-{
-	rlm_sql_oracle_conn_t *conn = query_ctx->handle->conn;
-	int		fields, i, status;
-	char const	**names;
-	OCIParam	*param;
-
-	if (OCIAttrGet((dvoid *)conn->query, OCI_HTYPE_STMT, (dvoid *)&fields, NULL, OCI_ATTR_PARAM_COUNT,
-		       conn->error)) return RLM_SQL_ERROR;
-	if (fields == 0) return RLM_SQL_ERROR;
+	/*
+	 *	Switch the session's server handle into non-blocking
+	 *	mode.  Calls will now return OCI_STILL_EXECUTING and
+	 *	must be repeated until they complete.
+	 */
+	if ((OCIAttrGet((dvoid *)c->ctx, OCI_HTYPE_SVCCTX, (dvoid *)&c->server, NULL,
+			OCI_ATTR_SERVER, c->error) != OCI_SUCCESS) ||
+	    (OCIAttrSet((dvoid *)c->server, OCI_HTYPE_SERVER, NULL, 0,
+			OCI_ATTR_NONBLOCKING_MODE, c->error) != OCI_SUCCESS)) {
+		ERROR("Failed setting Oracle session to non-blocking mode: '%s'",
+		      (sql_snprint_error(errbuff, sizeof(errbuff), c) == 0) ? errbuff : "unknown");
+		goto error;
+	}
+	c->nonblocking = true;
 
-	MEM(names = talloc_array(query_ctx, char const *, fields));
+	DEBUG2("Got session from pool[%s]", inst->pool_name);
 
-	for (i = 0; i < fields; i++) {
-		OraText *pcol_name = NULL;
-		ub4 pcol_size = 0;
+	*h = c;
 
-		status = OCIParamGet(conn->query, OCI_HTYPE_STMT, conn->error, (dvoid **)&param, i + 1);
-		if (status != OCI_SUCCESS) {
-			ERROR("OCIParamGet(OCI_HTYPE_STMT) failed in sql_fields()");
-		error:
-			talloc_free(names);
-
-			return RLM_SQL_ERROR;
-		}
+	return CONNECTION_STATE_CONNECTED;
+}
 
-		status = OCIAttrGet((dvoid **)param, OCI_DTYPE_PARAM, &pcol_name, &pcol_size,
-				    OCI_ATTR_NAME, conn->error);
-		if (status != OCI_SUCCESS) {
-			ERROR("OCIParamGet(OCI_ATTR_NAME) failed in sql_fields()");
+static void _sql_connection_close(UNUSED fr_event_list_t *el, void *h, UNUSED void *uctx)
+{
+	rlm_sql_oracle_conn_t	*c = talloc_get_type_abort(h, rlm_sql_oracle_conn_t);
 
-			goto error;
-		}
+	if (c->read_ev) fr_event_timer_delete(&c->read_ev);
+	if (c->write_ev) fr_event_timer_delete(&c->write_ev);
+	c->query_ctx = NULL;
+	talloc_free(h);
+}
 
-		names[i] = (char const *)pcol_name;
+/** Allocate an SQL trunk connection
+ *
+ * @param[in] tconn		Trunk handle.
+ * @param[in] el		Event list which will be used for I/O and timer events.
+ * @param[in] conn_conf		Configuration of the connection.
+ * @param[in] log_prefix	What to prefix log messages with.
+ * @param[in] uctx		User context passed to trunk_alloc.
+ */
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_t *sql_trunk_connection_alloc(trunk_connection_t *tconn, fr_event_list_t *el,
+						connection_conf_t const *conn_conf,
+						char const *log_prefix, void *uctx)
+{
+	connection_t		*conn;
+	rlm_sql_thread_t	*thread = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+
+	conn = connection_alloc(tconn, el,
+				&(connection_funcs_t){
+					.init = _sql_connection_init,
+					.close = _sql_connection_close
+				},
+				conn_conf, log_prefix, thread->inst);
+	if (!conn) {
+		PERROR("Failed allocating state handler for new SQL connection");
+		return NULL;
 	}
 
-	*out = names;
-
-	return RLM_SQL_OK;
+	return conn;
 }
 
-static unlang_action_t sql_query(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
+/** Signal the trunk that the connection can accept a new query
+ *
+ * OCI doesn't expose the session's file descriptor, so there's no I/O event
+ * to wait on.  With one query per connection, the connection is writable
+ * whenever the trunk asks.
+ */
+static void sql_trunk_connection_write_poll(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
 {
-	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
-	int			status;
-	rlm_sql_oracle_conn_t	*conn = query_ctx->handle->conn;
-
-	if (!conn->ctx) {
-		ERROR("Socket not connected");
-
-		query_ctx->rcode = RLM_SQL_RECONNECT;
-		RETURN_MODULE_FAIL;
-	}
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
 
-	query_ctx->rcode = RLM_SQL_ERROR;
+	trunk_connection_signal_writable(tconn);
+}
 
-	if (OCIStmtPrepare2(conn->ctx, &conn->query, conn->error, (const OraText *)query_ctx->query_str, strlen(query_ctx->query_str),
-	           NULL, 0, OCI_NTV_SYNTAX, OCI_DEFAULT)) {
-		ERROR("prepare failed in sql_query");
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_trunk_connection_notify(trunk_connection_t *tconn, connection_t *conn, fr_event_list_t *el,
+					trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	rlm_sql_oracle_conn_t	*c = talloc_get_type_abort(conn->h, rlm_sql_oracle_conn_t);
 
-		RETURN_MODULE_FAIL;
-	}
+	if (c->write_ev) fr_event_timer_delete(&c->write_ev);
 
-	status = OCIStmtExecute(conn->ctx, conn->query, conn->error, 1, 0,
-				NULL, NULL, OCI_COMMIT_ON_SUCCESS);
+	switch (notify_on) {
+	/*
+	 *	Reads are driven by the poll timer of the outstanding call
+	 */
+	case TRUNK_CONN_EVENT_NONE:
+	case TRUNK_CONN_EVENT_READ:
+		return;
 
-	if (status == OCI_SUCCESS) {
-		query_ctx->rcode = RLM_SQL_OK;
-		RETURN_MODULE_OK;
+	case TRUNK_CONN_EVENT_WRITE:
+	case TRUNK_CONN_EVENT_BOTH:
+		break;
 	}
-	if (status == OCI_ERROR) {
-		ERROR("execute query failed in sql_query");
 
-		query_ctx->rcode = sql_check_reconnect(query_ctx->handle, &query_ctx->inst->config);
+	if (fr_event_timer_in(c, el, &c->write_ev, fr_time_delta_wrap(0),
+			      sql_trunk_connection_write_poll, tconn) < 0) {
+		PERROR("Failed inserting write poll timer");
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
 	}
-
-	RETURN_MODULE_FAIL;
 }
 
-static unlang_action_t sql_select_query(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
+/** Define output buffers for each column of a select's result set
+ *
+ */
+static sql_rcode_t sql_columns_define(rlm_sql_oracle_conn_t *conn)
 {
-	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
-	int		status;
-	char		**row = NULL;
-
 	int		i;
+	sword		status;
 	OCIParam	*param;
 	OCIDefine	*define;
-
 	ub2		dtype;
 	ub2		dsize;
 
-	sb2		*ind;
+	if (OCIAttrGet((dvoid *)conn->query, OCI_HTYPE_STMT, (dvoid *)&conn->col_count, NULL,
+		       OCI_ATTR_PARAM_COUNT, conn->error)) return RLM_SQL_ERROR;
 
-	rlm_sql_oracle_conn_t *conn = query_ctx->handle->conn;
+	if (conn->col_count == 0) return RLM_SQL_ERROR;
 
-	if (OCIStmtPrepare2(conn->ctx, &conn->query, conn->error, (const OraText *)query_ctx->query_str, strlen(query_ctx->query_str),
-	           NULL, 0, OCI_NTV_SYNTAX, OCI_DEFAULT)) {
-		ERROR("prepare failed in sql_select_query");
-
-		goto error;
-	}
-
-	/*
-	 *	Retrieve a single row
-	 */
-	status = OCIStmtExecute(conn->ctx, conn->query, conn->error, 0, 0, NULL, NULL, OCI_DEFAULT);
-	if (status == OCI_NO_DATA) goto finish;
-	if (status != OCI_SUCCESS) {
-		ERROR("query failed in sql_select_query");
-
-		query_ctx->rcode = sql_check_reconnect(query_ctx->handle, &query_ctx->inst->config);
-		RETURN_MODULE_FAIL;
-	}
-
-	/*
-	 *	We only need to do this once per result set, because
-	 *	the number of columns won't change.
-	 */
-	if (conn->col_count == 0) {
-		if (OCIAttrGet((dvoid *)conn->query, OCI_HTYPE_STMT, (dvoid *)&conn->col_count, NULL,
-			       OCI_ATTR_PARAM_COUNT, conn->error)) goto error;
-
-		if (conn->col_count == 0) goto error;
-	}
-
-	MEM(row = talloc_zero_array(conn, char*, conn->col_count + 1));
-	MEM(ind = talloc_zero_array(row, sb2, conn->col_count + 1));
+	MEM(conn->row = talloc_zero_array(conn, char *, conn->col_count + 1));
+	MEM(conn->ind = talloc_zero_array(conn->row, sb2, conn->col_count + 1));
 
 	for (i = 0; i < conn->col_count; i++) {
 		status = OCIParamGet(conn->query, OCI_HTYPE_STMT, conn->error, (dvoid **)&param, i + 1);
 		if (status != OCI_SUCCESS) {
-			ERROR("OCIParamGet() failed in sql_select_query");
-
-			goto error;
+			ERROR("OCIParamGet() failed in sql_columns_define");
+			return RLM_SQL_ERROR;
 		}
 
 		status = OCIAttrGet((dvoid*)param, OCI_DTYPE_PARAM, (dvoid*)&dtype, NULL, OCI_ATTR_DATA_TYPE,
 				    conn->error);
 		if (status != OCI_SUCCESS) {
-			ERROR("OCIAttrGet() failed in sql_select_query");
-
-			goto error;
+			ERROR("OCIAttrGet() failed in sql_columns_define");
+			return RLM_SQL_ERROR;
 		}
 
 		dsize = MAX_DATASTR_LEN;
@@ -473,12 +509,11 @@ static unlang_action_t sql_select_query(rlm_rcode_t *p_result, UNUSED int *prior
 			status = OCIAttrGet((dvoid *)param, OCI_DTYPE_PARAM, (dvoid *)&dsize, NULL,
 					    OCI_ATTR_DATA_SIZE, conn->error);
 			if (status != OCI_SUCCESS) {
-				ERROR("OCIAttrGet() failed in sql_select_query");
-
-				goto error;
+				ERROR("OCIAttrGet() failed in sql_columns_define");
+				return RLM_SQL_ERROR;
 			}
 
-			MEM(row[i] = talloc_zero_array(row, char, dsize + 1));
+			MEM(conn->row[i] = talloc_zero_array(conn->row, char, dsize + 1));
 
 			break;
 		case SQLT_DAT:
@@ -488,138 +523,390 @@ static unlang_action_t sql_select_query(rlm_rcode_t *p_result, UNUSED int *prior
 		case SQLT_PDN:
 		case SQLT_BIN:
 		case SQLT_NUM:
-			MEM(row[i] = talloc_zero_array(row, char, dsize + 1));
+			MEM(conn->row[i] = talloc_zero_array(conn->row, char, dsize + 1));
 
 			break;
 		default:
 			dsize = 0;
-			row[i] = NULL;
+			conn->row[i] = NULL;
 			break;
 		}
 
-		ind[i] = 0;
+		conn->ind[i] = 0;
 
 		/*
 		 *	Grab the actual row value and write it to the buffer we allocated.
 		 */
-		status = OCIDefineByPos(conn->query, &define, conn->error, i + 1, (ub1 *)row[i], dsize + 1, SQLT_STR,
-					(dvoid *)&ind[i], NULL, NULL, OCI_DEFAULT);
-
+		status = OCIDefineByPos(conn->query, &define, conn->error, i + 1, (ub1 *)conn->row[i], dsize + 1,
+					SQLT_STR, (dvoid *)&conn->ind[i], NULL, NULL, OCI_DEFAULT);
 		if (status != OCI_SUCCESS) {
-			ERROR("OCIDefineByPos() failed in sql_select_query");
-			goto error;
+			ERROR("OCIDefineByPos() failed in sql_columns_define");
+			return RLM_SQL_ERROR;
 		}
 	}
 
-	conn->row = row;
-	conn->ind = ind;
+	return RLM_SQL_OK;
+}
 
-finish:
-	query_ctx->rcode = RLM_SQL_OK;
-	RETURN_MODULE_OK;
+/** Copy the row just fetched into the result set
+ *
+ */
+static void sql_row_store(rlm_sql_oracle_conn_t *conn)
+{
+	char	**row;
+	int	i;
 
- error:
-	talloc_free(row);
+	if (conn->num_rows == talloc_array_length(conn->results)) {
+		MEM(conn->results = talloc_realloc(conn, conn->results, char **,
+						   conn->num_rows ? conn->num_rows * 2 : 16));
+	}
 
-	query_ctx->rcode = RLM_SQL_ERROR;
-	RETURN_MODULE_FAIL;
+	MEM(row = talloc_zero_array(conn->results, char *, conn->col_count + 1));
+	for (i = 0; i < conn->col_count; i++) {
+		if (!conn->row[i] || (conn->ind[i] == -1)) continue;	/* NULL value */
+		MEM(row[i] = talloc_typed_strdup(row, conn->row[i]));
+	}
+	conn->results[conn->num_rows++] = row;
 }
 
-static int sql_num_rows(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
+static void sql_trunk_connection_read_poll(fr_event_list_t *el, fr_time_t now, void *uctx);
+
+/** Advance the query running on a connection as far as it can go without blocking
+ *
+ * Non-blocking OCI calls return OCI_STILL_EXECUTING until they complete, and
+ * must be repeated, with the same arguments, until they do.  As there's no
+ * file descriptor to wait on, a timer repeats the call every poll_interval.
+ */
+static void sql_query_process(rlm_sql_oracle_conn_t *conn)
+{
+	fr_sql_query_t	*query_ctx = conn->query_ctx;
+	request_t	*request = query_ctx->request;
+	sword		status;
+
+	switch (query_ctx->status) {
+	case SQL_QUERY_SUBMITTED:
+		if (query_ctx->type == SQL_QUERY_SELECT) {
+			status = OCIStmtExecute(conn->ctx, conn->query, conn->error, 0, 0, NULL, NULL, OCI_DEFAULT);
+		} else {
+			status = OCIStmtExecute(conn->ctx, conn->query, conn->error, 1, 0,
+						NULL, NULL, OCI_COMMIT_ON_SUCCESS);
+		}
+		if (status == OCI_STILL_EXECUTING) goto poll;
+
+		if (status == OCI_NO_DATA) {
+			query_ctx->status = SQL_QUERY_RESULTS_FETCHED;
+			break;
+		}
+
+		if ((status != OCI_SUCCESS) && (status != OCI_SUCCESS_WITH_INFO)) {
+			ROPTIONAL(RERROR, ERROR, "Query execution failed");
+			query_ctx->status = SQL_QUERY_FAILED;
+			query_ctx->rcode = sql_check_reconnect(conn);
+			goto done;
+		}
+
+		if (query_ctx->type != SQL_QUERY_SELECT) {
+			ub4 size = sizeof(ub4);
+
+			OCIAttrGet((CONST dvoid *)conn->query, OCI_HTYPE_STMT, (dvoid *)&conn->affected_rows, &size,
+				   OCI_ATTR_ROW_COUNT, conn->error);
+			query_ctx->status = SQL_QUERY_RETURNED;
+			break;
+		}
+
+		if (sql_columns_define(conn) != RLM_SQL_OK) {
+			query_ctx->status = SQL_QUERY_FAILED;
+			query_ctx->rcode = RLM_SQL_ERROR;
+			goto done;
+		}
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "Fetching results");
+		query_ctx->status = SQL_QUERY_FETCHING_RESULTS;
+		FALL_THROUGH;
+
+	case SQL_QUERY_FETCHING_RESULTS:
+		while (((status = OCIStmtFetch2(conn->query, conn->error, 1, OCI_FETCH_NEXT, 0, OCI_DEFAULT)) == OCI_SUCCESS) ||
+		       (status == OCI_SUCCESS_WITH_INFO)) {
+			sql_row_store(conn);
+		}
+		if (status == OCI_STILL_EXECUTING) goto poll;
+
+		if (status != OCI_NO_DATA) {
+			ROPTIONAL(RERROR, ERROR, "Fetching results failed");
+			query_ctx->status = SQL_QUERY_FAILED;
+			query_ctx->rcode = sql_check_reconnect(conn);
+			goto done;
+		}
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "query returned rows = %u, fields = %i", conn->num_rows, conn->col_count);
+		query_ctx->status = SQL_QUERY_RESULTS_FETCHED;
+		break;
+
+	default:
+		fr_assert(0);
+		return;
+	}
+
+	query_ctx->rcode = RLM_SQL_OK;
+
+done:
+	conn->query_ctx = NULL;
+	if (request) unlang_interpret_mark_runnable(request);
+	return;
+
+poll:
+	ROPTIONAL(RDEBUG3, DEBUG3, "Waiting for response");
+	if (fr_event_timer_in(conn, conn->conn->el, &conn->read_ev, conn->inst->poll_interval,
+			      sql_trunk_connection_read_poll, conn) < 0) {
+		ROPTIONAL(RERROR, ERROR, "Failed inserting poll timer");
+		query_ctx->status = SQL_QUERY_FAILED;
+		query_ctx->rcode = RLM_SQL_ERROR;
+		goto done;
+	}
+}
+
+/** Repeat the outstanding non-blocking call
+ *
+ */
+static void sql_trunk_connection_read_poll(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
 {
-	rlm_sql_oracle_conn_t *conn = query_ctx->handle->conn;
-	ub4 rows = 0;
-	ub4 size = sizeof(ub4);
+	rlm_sql_oracle_conn_t	*conn = talloc_get_type_abort(uctx, rlm_sql_oracle_conn_t);
 
-	OCIAttrGet((CONST dvoid *)conn->query, OCI_HTYPE_STMT, (dvoid *)&rows, &size, OCI_ATTR_ROW_COUNT, conn->error);
+	/*
+	 *	Query was cancelled
+	 */
+	if (!conn->query_ctx) return;
 
-	return rows;
+	sql_query_process(conn);
 }
 
-static unlang_action_t sql_fetch_row(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_trunk_request_mux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn,
+				  connection_t *conn, UNUSED void *uctx)
 {
-	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
-	int			status;
-	rlm_sql_handle_t	*handle = query_ctx->handle;
-	rlm_sql_oracle_conn_t	*conn = handle->conn;
+	rlm_sql_oracle_conn_t	*sql_conn = talloc_get_type_abort(conn->h, rlm_sql_oracle_conn_t);
+	request_t		*request;
+	trunk_request_t		*treq;
+	fr_sql_query_t		*query_ctx;
+
+	if (trunk_connection_pop_request(&treq, tconn) != 0) return;
+	if (!treq) return;
+
+	query_ctx = talloc_get_type_abort(treq->preq, fr_sql_query_t);
+	request = query_ctx->request;
+
+	switch (query_ctx->status) {
+	case SQL_QUERY_PREPARED:
+		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query_ctx->query_str);
+		query_ctx->tconn = tconn;
+
+		sql_stmt_release(sql_conn);	/* Any previous result set */
+		sql_conn->affected_rows = 0;
+
+		if (OCIStmtPrepare2(sql_conn->ctx, &sql_conn->query, sql_conn->error,
+				    (const OraText *)query_ctx->query_str, strlen(query_ctx->query_str),
+				    NULL, 0, OCI_NTV_SYNTAX, OCI_DEFAULT) != OCI_SUCCESS) {
+			ROPTIONAL(RERROR, ERROR, "Failed preparing query");
+			query_ctx->status = SQL_QUERY_FAILED;
+			trunk_request_signal_fail(treq);
+			return;
+		}
 
-	if (!conn->ctx) {
-		ERROR("Socket not connected");
+		query_ctx->status = SQL_QUERY_SUBMITTED;
+		sql_conn->query_ctx = query_ctx;
+		trunk_request_signal_sent(treq);
 
-		query_ctx->rcode = RLM_SQL_RECONNECT;
-		RETURN_MODULE_FAIL;
+		sql_query_process(sql_conn);
+		return;
+
+	default:
+		return;
 	}
+}
 
-	query_ctx->row = NULL;
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_request_cancel(connection_t *conn, void *preq, trunk_cancel_reason_t reason,
+			       UNUSED void *uctx)
+{
+	fr_sql_query_t		*query_ctx = talloc_get_type_abort(preq, fr_sql_query_t);
+	rlm_sql_oracle_conn_t	*sql_conn = talloc_get_type_abort(conn->h, rlm_sql_oracle_conn_t);
 
-	status = OCIStmtFetch(conn->query, conn->error, 1, OCI_FETCH_NEXT, OCI_DEFAULT);
-	if (status == OCI_SUCCESS) {
-		query_ctx->row = conn->row;
+	if (!query_ctx->treq) return;
+	if (reason != TRUNK_CANCEL_REASON_SIGNAL) return;
+	if (sql_conn->query_ctx == query_ctx) sql_conn->query_ctx = NULL;
+}
 
-		query_ctx->rcode = RLM_SQL_OK;
-		RETURN_MODULE_OK;
-	}
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_request_cancel_mux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn,
+				   connection_t *conn, UNUSED void *uctx)
+{
+	rlm_sql_oracle_conn_t	*sql_conn = talloc_get_type_abort(conn->h, rlm_sql_oracle_conn_t);
+	trunk_request_t		*treq;
 
-	if (status == OCI_NO_DATA) {
-		query_ctx->rcode = RLM_SQL_NO_MORE_ROWS;
-		RETURN_MODULE_OK;
-	}
+	if ((trunk_connection_pop_cancellation(&treq, tconn)) == 0) {
+		if (sql_conn->read_ev) fr_event_timer_delete(&sql_conn->read_ev);
 
-	if (status == OCI_ERROR) {
-		ERROR("fetch failed in sql_fetch_row");
-		query_ctx->rcode = sql_check_reconnect(handle, &query_ctx->inst->config);
-		RETURN_MODULE_FAIL;
+		/*
+		 *	Abort the outstanding call, then reset the
+		 *	session so it can be used again.  If that
+		 *	fails the session's state is unknown.
+		 */
+		if ((OCIBreak(sql_conn->ctx, sql_conn->error) != OCI_SUCCESS) ||
+		    (OCIReset(sql_conn->ctx, sql_conn->error) != OCI_SUCCESS)) {
+			trunk_request_signal_cancel_complete(treq);
+			connection_signal_reconnect(conn, CONNECTION_FAILED);
+			return;
+		}
+		sql_stmt_release(sql_conn);
+
+		trunk_request_signal_cancel_complete(treq);
 	}
+}
+
+static void sql_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+			     UNUSED trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_sql_query_t		*query_ctx = talloc_get_type_abort(preq, fr_sql_query_t);
 
+	query_ctx->treq = NULL;
 	query_ctx->rcode = RLM_SQL_ERROR;
-	RETURN_MODULE_FAIL;
+
+	if (request) unlang_interpret_mark_runnable(request);
 }
 
-static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
+static unlang_action_t sql_query_resume(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
 {
-	rlm_sql_oracle_conn_t *conn = query_ctx->handle->conn;
+	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
 
-	/* Cancel the cursor first */
-	(void) OCIStmtFetch(conn->query, conn->error, 0, OCI_FETCH_NEXT, OCI_DEFAULT);
+	if (query_ctx->rcode != RLM_SQL_OK) RETURN_MODULE_FAIL;
 
-	TALLOC_FREE(conn->row);
-	conn->ind = NULL;	/* ind is a child of row */
-	conn->col_count = 0;
+	RETURN_MODULE_OK;
+}
 
-	if (OCIStmtRelease (conn->query, conn->error, NULL, 0, OCI_DEFAULT) != OCI_SUCCESS ) {
-		ERROR("OCI release failed in sql_finish_query");
-		return RLM_SQL_ERROR;
+static sql_rcode_t sql_fields(char const **out[], fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_oracle_conn_t *conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_oracle_conn_t);
+	int		fields, i, status;
+	char const	**names;
+	OCIParam	*param;
+
+	if (!conn->query) return RLM_SQL_ERROR;
+
+	if (OCIAttrGet((dvoid *)conn->query, OCI_HTYPE_STMT, (dvoid *)&fields, NULL, OCI_ATTR_PARAM_COUNT,
+		       conn->error)) return RLM_SQL_ERROR;
+	if (fields == 0) return RLM_SQL_ERROR;
+
+	MEM(names = talloc_array(query_ctx, char const *, fields));
+
+	for (i = 0; i < fields; i++) {
+		OraText *pcol_name = NULL;
+		ub4 pcol_size = 0;
+
+		status = OCIParamGet(conn->query, OCI_HTYPE_STMT, conn->error, (dvoid **)&param, i + 1);
+		if (status != OCI_SUCCESS) {
+			ERROR("OCIParamGet(OCI_HTYPE_STMT) failed in sql_fields()");
+		error:
+			talloc_free(names);
+
+			return RLM_SQL_ERROR;
+		}
+
+		status = OCIAttrGet((dvoid **)param, OCI_DTYPE_PARAM, &pcol_name, &pcol_size,
+				    OCI_ATTR_NAME, conn->error);
+		if (status != OCI_SUCCESS) {
+			ERROR("OCIParamGet(OCI_ATTR_NAME) failed in sql_fields()");
+
+			goto error;
+		}
+
+		names[i] = (char const *)pcol_name;
 	}
 
+	*out = names;
+
 	return RLM_SQL_OK;
 }
 
-static sql_rcode_t sql_finish_query(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
+static int sql_num_rows(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_oracle_conn_t *conn = query_ctx->handle->conn;
+	rlm_sql_oracle_conn_t *conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_oracle_conn_t);
 
-	if (OCIStmtRelease(conn->query, conn->error, NULL, 0, OCI_DEFAULT) != OCI_SUCCESS ) {
-		ERROR("OCI release failed in sql_finish_query");
-		return RLM_SQL_ERROR;
-	}
+	return conn->num_rows;
+}
 
-	return 0;
+static int sql_affected_rows(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_oracle_conn_t *conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_oracle_conn_t);
+
+	return conn->affected_rows;
 }
 
-static sql_rcode_t sql_finish_select_query(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
+/** Return the next row of the result set
+ *
+ * All rows were fetched while the query was running asynchronously,
+ * so this never blocks.
+ */
+static unlang_action_t sql_fetch_row(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
 {
-	rlm_sql_oracle_conn_t *conn = query_ctx->handle->conn;
+	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
+	rlm_sql_oracle_conn_t	*conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_oracle_conn_t);
 
-	TALLOC_FREE(conn->row);
-	conn->ind = NULL;	/* ind is a child of row */
-	conn->col_count = 0;
+	query_ctx->row = NULL;
 
-	if (OCIStmtRelease (conn->query, conn->error, NULL, 0, OCI_DEFAULT) != OCI_SUCCESS ) {
-		ERROR("OCI release failed in sql_finish_query");
-		return RLM_SQL_ERROR;
+	if (conn->cur_row >= conn->num_rows) {
+		query_ctx->rcode = RLM_SQL_NO_MORE_ROWS;
+		RETURN_MODULE_OK;
 	}
 
-	return 0;
+	query_ctx->row = conn->results[conn->cur_row++];
+
+	query_ctx->rcode = RLM_SQL_OK;
+	RETURN_MODULE_OK;
+}
+
+/** Return all remaining rows of the result set
+ *
+ */
+static sql_rcode_t sql_fetch_rows(rlm_sql_row_t **out, size_t *num_rows, fr_sql_query_t *query_ctx,
+				  UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_oracle_conn_t	*conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_oracle_conn_t);
+
+	if (conn->cur_row >= conn->num_rows) {
+		*out = NULL;
+		*num_rows = 0;
+		return RLM_SQL_OK;
+	}
+
+	*out = conn->results + conn->cur_row;
+	*num_rows = conn->num_rows - conn->cur_row;
+	conn->cur_row = conn->num_rows;
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_oracle_conn_t *conn;
+
+	if (query_ctx->treq && !(query_ctx->treq->state &
+	    (TRUNK_REQUEST_STATE_SENT | TRUNK_REQUEST_STATE_REAPABLE | TRUNK_REQUEST_STATE_COMPLETE))) return RLM_SQL_OK;
+
+	if (!query_ctx->tconn || !query_ctx->tconn->conn || !query_ctx->tconn->conn->h) return RLM_SQL_ERROR;
+
+	if (!(query_ctx->tconn->state & TRUNK_CONN_PROCESSING)) return RLM_SQL_ERROR;
+
+	conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_oracle_conn_t);
+
+	/*
+	 *	Still running, the cancellation will clean up
+	 */
+	if (conn->query_ctx == query_ctx) return RLM_SQL_OK;
+
+	query_ctx->row = NULL;
+	sql_stmt_release(conn);
+
+	return RLM_SQL_OK;
 }
 
 /* Exported to rlm_sql */
@@ -633,15 +920,24 @@ rlm_sql_driver_t rlm_sql_oracle = {
 		.instantiate			= mod_instantiate,
 		.detach				= mod_detach
 	},
-	.sql_socket_init		= sql_socket_init,
-	.sql_query			= sql_query,
-	.sql_select_query		= sql_select_query,
+	.sql_query_resume		= sql_query_resume,
+	.sql_select_query_resume	= sql_query_resume,
 	.sql_num_rows			= sql_num_rows,
-	.sql_affected_rows		= sql_num_rows,
+	.sql_affected_rows		= sql_affected_rows,
 	.sql_fetch_row			= sql_fetch_row,
+	.sql_fetch_rows			= sql_fetch_rows,
 	.sql_fields			= sql_fields,
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
-	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_select_query
+	.sql_finish_query		= sql_free_result,
+	.sql_finish_select_query	= sql_free_result,
+	.uses_trunks			= true,
+	.trunk_io_funcs = {
+		.connection_alloc	= sql_trunk_connection_alloc,
+		.connection_notify	= sql_trunk_connection_notify,
+		.request_mux		= sql_trunk_request_mux,
+		.request_cancel		= sql_request_cancel,
+		.request_cancel_mux	= sql_request_cancel_mux,
+		.request_fail		= sql_request_fail,
+	}
 };
@@ -72,9 +72,14 @@ typedef struct {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	rlm_sql_row_t	*rows;			//!< Rows handed out by sql_fetch_rows.
 	connection_t	*conn;			//!< Generic connection structure for this connection.
 	int		fd;			//!< fd for this connection's I/O events.
 	fr_sql_query_t	*query_ctx;		//!< Current query running on this connection.
+	bool		*prepared;		//!< Which statements have been prepared on this
+						///< connection, indexed by statement id.
+	bool		preparing;		//!< Waiting for the server to prepare the statement
+						///< for the current query.
 } rlm_sql_postgres_conn_t;
 
 static conf_parser_t driver_config[] = {
@@ -367,6 +372,32 @@ static connection_t *sql_trunk_connection_alloc(trunk_connection_t *tconn, fr_ev
 
 TRUNK_NOTIFY_FUNC(sql_trunk_connection_notify, rlm_sql_postgres_conn_t)
 
+/** Send a query using a prepared statement
+ *
+ * Statements are prepared on each connection the first time they're used.
+ */
+static int sql_send_prepared(rlm_sql_postgres_conn_t *sql_conn, fr_sql_query_t *query_ctx)
+{
+	fr_sql_prepared_t const	*prepared = query_ctx->prepared;
+	request_t		*request = query_ctx->request;
+	size_t			len = talloc_array_length(sql_conn->prepared);
+
+	if (prepared->id >= len) {
+		MEM(sql_conn->prepared = talloc_realloc(sql_conn, sql_conn->prepared, bool, prepared->id + 1));
+		memset(sql_conn->prepared + len, 0, sizeof(bool) * ((prepared->id + 1) - len));
+	}
+
+	if (!sql_conn->prepared[prepared->id]) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Preparing statement \"%s\": %s", prepared->name, query_ctx->query_str);
+		sql_conn->preparing = true;
+		return PQsendPrepare(sql_conn->db, prepared->name, query_ctx->query_str, prepared->num_params, NULL);
+	}
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Executing statement \"%s\": %s", prepared->name, query_ctx->query_str);
+	return PQsendQueryPrepared(sql_conn->db, prepared->name, prepared->num_params, query_ctx->params,
+				   NULL, NULL, 0);
+}
+
 CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
 static void sql_trunk_request_mux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn,
 				  connection_t *conn, UNUSED void *uctx)
@@ -385,8 +416,12 @@ static void sql_trunk_request_mux(UNUSED fr_event_list_t *el, trunk_connection_t
 
 	switch (query_ctx->status) {
 	case SQL_QUERY_PREPARED:
-		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query_ctx->query_str);
-		err = PQsendQuery(sql_conn->db, query_ctx->query_str);
+		if (query_ctx->prepared) {
+			err = sql_send_prepared(sql_conn, query_ctx);
+		} else {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query_ctx->query_str);
+			err = PQsendQuery(sql_conn->db, query_ctx->query_str);
+		}
 		query_ctx->tconn = tconn;
 		if (!err) {
 			ROPTIONAL(RERROR, ERROR, "Failed to send query: %s", PQerrorMessage(sql_conn->db));
@@ -429,19 +464,64 @@ static void sql_trunk_request_demux(UNUSED fr_event_list_t *el, UNUSED trunk_con
 		}
 		if (PQisBusy(sql_conn->db)) return;
 
+		/*
+		 *	The statement has been prepared, now run it.
+		 *	A statement may already exist if the server
+		 *	completed a PREPARE we gave up waiting for.
+		 */
+		if (sql_conn->preparing) {
+			char const *sql_state;
+
+			sql_conn->preparing = false;
+			sql_conn->result = PQgetResult(sql_conn->db);
+			while ((tmp_result = PQgetResult(sql_conn->db)) != NULL) PQclear(tmp_result);
+
+			if (sql_conn->result &&
+			    ((PQresultStatus(sql_conn->result) == PGRES_COMMAND_OK) ||
+			     ((sql_state = PQresultErrorField(sql_conn->result, PG_DIAG_SQLSTATE)) &&
+			      (strcmp(sql_state, "42P05") == 0)))) {
+				PQclear(sql_conn->result);
+				sql_conn->result = NULL;
+				sql_conn->prepared[query_ctx->prepared->id] = true;
+
+				if (sql_send_prepared(sql_conn, query_ctx) == 0) {
+					ROPTIONAL(RERROR, ERROR, "Failed to send query: %s", PQerrorMessage(sql_conn->db));
+					query_ctx->rcode = RLM_SQL_ERROR;
+					break;
+				}
+				return;
+			}
+
+			query_ctx->status = SQL_QUERY_RETURNED;
+			goto check_result;
+		}
+
 		query_ctx->status = SQL_QUERY_RETURNED;
 
 		sql_conn->result = PQgetResult(sql_conn->db);
 
-		/* Discard results for appended queries */
-		while ((tmp_result = PQgetResult(sql_conn->db)) != NULL)
+		/*
+		 *	Discard results for appended queries, unless the
+		 *	first result was a success and a later one failed.
+		 *	A multi-statement query runs in a single transaction,
+		 *	so if any statement fails, none of them took effect.
+		 */
+		while ((tmp_result = PQgetResult(sql_conn->db)) != NULL) {
+			if (sql_conn->result && (PQresultStatus(tmp_result) == PGRES_FATAL_ERROR) &&
+			    (PQresultStatus(sql_conn->result) != PGRES_FATAL_ERROR)) {
+				PQclear(sql_conn->result);
+				sql_conn->result = tmp_result;
+				continue;
+			}
 			PQclear(tmp_result);
+		}
 
 		/*
 		 *  As this error COULD be a connection error OR an out-of-memory
 		 *  condition return value WILL be wrong SOME of the time
 		 *  regardless! Pick your poison...
 		 */
+	check_result:
 		if (!sql_conn->result) {
 			ROPTIONAL(RERROR, ERROR, "Failed getting query result: %s", PQerrorMessage(sql_conn->db));
 			query_ctx->rcode = RLM_SQL_RECONNECT;
@@ -529,6 +609,7 @@ static void sql_request_cancel_mux(UNUSED fr_event_list_t *el, trunk_connection_
 	PGresult		*tmp_result;
 
 	if ((trunk_connection_pop_cancellation(&treq, tconn)) == 0) {
+		sql_conn->preparing = false;
 		cancel = PQgetCancel(sql_conn->db);
 		if (!cancel) goto complete;
 		if (PQcancel(cancel, errbuf, sizeof(errbuf)) == 0) {
@@ -618,6 +699,48 @@ static unlang_action_t sql_fetch_row(rlm_rcode_t *p_result, UNUSED int *priority
 	RETURN_MODULE_OK;
 }
 
+/** Return all remaining rows of the result
+ *
+ * The fields point directly into the PGresult, so no copies are made.
+ */
+static sql_rcode_t sql_fetch_rows(rlm_sql_row_t **out, size_t *num_rows, fr_sql_query_t *query_ctx,
+				  UNUSED rlm_sql_config_t const *config)
+{
+	rlm_sql_postgres_conn_t *conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_postgres_conn_t);
+	int			rows, fields, i, j;
+
+	*out = NULL;
+	*num_rows = 0;
+
+	if (!conn->result) return RLM_SQL_OK;
+
+	rows = PQntuples(conn->result) - conn->cur_row;
+	fields = PQnfields(conn->result);
+	if ((rows <= 0) || (fields <= 0)) return RLM_SQL_OK;
+
+	TALLOC_FREE(conn->rows);
+	conn->rows = talloc_array(conn, rlm_sql_row_t, rows);
+	if (!conn->rows) return RLM_SQL_ERROR;
+
+	for (i = 0; i < rows; i++) {
+		conn->rows[i] = talloc_array(conn->rows, char *, fields + 1);
+		if (!conn->rows[i]) {
+			TALLOC_FREE(conn->rows);
+			return RLM_SQL_ERROR;
+		}
+
+		for (j = 0; j < fields; j++) conn->rows[i][j] = PQgetvalue(conn->result, conn->cur_row + i, j);
+		conn->rows[i][fields] = NULL;
+	}
+	conn->cur_row += rows;
+	conn->num_fields = fields;
+
+	*out = conn->rows;
+	*num_rows = rows;
+
+	return RLM_SQL_OK;
+}
+
 static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
 	rlm_sql_postgres_conn_t *conn;
@@ -637,6 +760,7 @@ static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, UNUSED rlm_sql_con
 	}
 
 	free_result_row(conn);
+	TALLOC_FREE(conn->rows);
 
 	return 0;
 }
@@ -867,11 +991,13 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 		.config				= driver_config,
 		.instantiate			= mod_instantiate
 	},
-	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,
+	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY | RLM_SQL_FLAGS_MULTI_STATEMENTS |
+					  RLM_SQL_FLAGS_PREPARED_STATEMENTS,
 	.sql_query_resume		= sql_query_resume,
 	.sql_select_query_resume	= sql_query_resume,
 	.sql_fields			= sql_fields,
 	.sql_fetch_row			= sql_fetch_row,
+	.sql_fetch_rows			= sql_fetch_rows,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
@@ -29,6 +29,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include <sqlite3.h>
@@ -49,19 +50,59 @@ RCSID("$Id$")
 typedef sqlite_int64 sqlite3_int64;
 #endif
 
+/** A statement waiting to be run by the writer thread
+ *
+ * Lives in the connection of the worker which submitted it, and the
+ * worker waits until the writer marks it as done.
+ */
+typedef struct {
+	fr_dlist_t	entry;			//!< In the writer's queue.
+	char const	*query_str;		//!< Statement to run.
+	int		status;			//!< SQLite status of the statement, or of the
+						///< transaction if that failed.
+	int		changes;		//!< Rows the statement changed.
+	char		error[256];		//!< Error message, if status indicates failure.
+	bool		done;			//!< Set by the writer once the transaction has
+						///< committed or failed.  Protected by the writer's mutex.
+} rlm_sql_sqlite_write_t;
+
+/** Runs every write, so that workers don't contend for the database lock
+ *
+ */
+typedef struct {
+	pthread_mutex_t	mutex;			//!< Protects everything below, and the done flag of queued writes.
+	pthread_cond_t	work;			//!< Signalled when writes are queued.
+	pthread_cond_t	done;			//!< Broadcast when a transaction has committed or failed.
+	pthread_t	thread;			//!< The writer thread.
+	bool		running;		//!< The thread was started.
+	bool		stopping;		//!< The thread should exit.
+
+	fr_dlist_head_t	queue;			//!< Writes waiting for the next transaction.
+	uint32_t	batch_size;		//!< Maximum number of writes in a transaction.
+	sqlite3		*db;			//!< The only read-write connection.
+} rlm_sql_sqlite_writer_t;
+
 typedef struct {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int col_count;
+	bool wrote;				//!< The last query was run by the writer thread.
+	rlm_sql_sqlite_write_t write;		//!< Result of the last query run by the writer thread.
 } rlm_sql_sqlite_conn_t;
 
 typedef struct {
 	char const	*filename;
 	bool		bootstrap;
+	bool		write_thread;		//!< Run writes in a dedicated thread, using WAL.
+	uint32_t	write_batch_size;	//!< Maximum number of writes in a transaction.
+
+	rlm_sql_sqlite_writer_t	*writer;	//!< Runs writes, if write_thread is set.
 } rlm_sql_sqlite_t;
 
 static const conf_parser_t driver_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("filename", CONF_FLAG_FILE_OUTPUT | CONF_FLAG_REQUIRED, rlm_sql_sqlite_t, filename) },
+	{ FR_CONF_OFFSET("write_thread", rlm_sql_sqlite_t, write_thread), .dflt = "no" },
+	{ FR_CONF_OFFSET("write_batch_size", rlm_sql_sqlite_t, write_batch_size), .dflt = "64" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -393,6 +434,45 @@ static void _sql_greatest(sqlite3_context *ctx, int num_values, sqlite3_value **
 	sqlite3_result_int64(ctx, max);
 }
 
+/** Configure a database handle, for use by the server
+ *
+ */
+static sql_rcode_t sql_db_setup(sqlite3 *db, rlm_sql_config_t const *config)
+{
+	int status;
+
+	status = sqlite3_busy_timeout(db, fr_time_delta_to_sec(config->query_timeout));
+	if (sql_check_error(db, status) != RLM_SQL_OK) {
+		sql_print_error(db, status, "Error setting busy timeout");
+		return RLM_SQL_ERROR;
+	}
+
+	/*
+	 *	Enable extended return codes for extra debugging info.
+	 */
+#ifdef HAVE_SQLITE3_EXTENDED_RESULT_CODES
+	status = sqlite3_extended_result_codes(db, 1);
+	if (sql_check_error(db, status) != RLM_SQL_OK) {
+		sql_print_error(db, status, "Error enabling extended result codes");
+		return RLM_SQL_ERROR;
+	}
+#endif
+
+#ifdef HAVE_SQLITE3_CREATE_FUNCTION_V2
+	status = sqlite3_create_function_v2(db, "GREATEST", -1, SQLITE_ANY, NULL,
+					    _sql_greatest, NULL, NULL, NULL);
+#else
+	status = sqlite3_create_function(db, "GREATEST", -1, SQLITE_ANY, NULL,
+					 _sql_greatest, NULL, NULL);
+#endif
+	if (sql_check_error(db, status) != RLM_SQL_OK) {
+		sql_print_error(db, status, "Failed registering 'GREATEST' sql function");
+		return RLM_SQL_ERROR;
+	}
+
+	return RLM_SQL_OK;
+}
+
 static sql_rcode_t CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
 					    UNUSED fr_time_delta_t timeout)
 {
@@ -406,7 +486,14 @@ static sql_rcode_t CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rl
 
 	INFO("Opening SQLite database \"%s\"", inst->filename);
 #ifdef HAVE_SQLITE3_OPEN_V2
-	status = sqlite3_open_v2(inst->filename, &(conn->db), SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL);
+	/*
+	 *	With a writer thread, pool connections only read.
+	 *	WAL allows them to do so while the writer is
+	 *	writing.
+	 */
+	status = sqlite3_open_v2(inst->filename, &(conn->db),
+				 (inst->writer ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE) | SQLITE_OPEN_NOMUTEX,
+				 NULL);
 #else
 	status = sqlite3_open(inst->filename, &(conn->db));
 #endif
@@ -420,36 +507,223 @@ static sql_rcode_t CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rl
 #endif
 		return RLM_SQL_ERROR;
 	}
-	status = sqlite3_busy_timeout(conn->db, fr_time_delta_to_sec(config->query_timeout));
-	if (sql_check_error(conn->db, status) != RLM_SQL_OK) {
-		sql_print_error(conn->db, status, "Error setting busy timeout");
-		return RLM_SQL_ERROR;
+
+	return sql_db_setup(conn->db, config);
+}
+
+/** Run one statement, inside the writer's current transaction
+ *
+ * Each statement gets its own savepoint, so that one which fails doesn't
+ * undo the others.
+ */
+static void sql_writer_run(sqlite3 *db, rlm_sql_sqlite_write_t *w)
+{
+	sqlite3_stmt	*statement = NULL;
+	int		status;
+
+	(void) sqlite3_exec(db, "SAVEPOINT write", NULL, NULL, NULL);
+
+#ifdef HAVE_SQLITE3_PREPARE_V2
+	status = sqlite3_prepare_v2(db, w->query_str, strlen(w->query_str), &statement, NULL);
+#else
+	status = sqlite3_prepare(db, w->query_str, strlen(w->query_str), &statement, NULL);
+#endif
+	if ((status == SQLITE_OK) && statement) {
+		while ((status = sqlite3_step(statement)) == SQLITE_ROW);
 	}
 
-	/*
-	 *	Enable extended return codes for extra debugging info.
-	 */
-#ifdef HAVE_SQLITE3_EXTENDED_RESULT_CODES
-	status = sqlite3_extended_result_codes(conn->db, 1);
-	if (sql_check_error(conn->db, status) != RLM_SQL_OK) {
-		sql_print_error(conn->db, status, "Error enabling extended result codes");
-		return RLM_SQL_ERROR;
+	w->status = status;
+	if (sql_error_to_rcode(status) == RLM_SQL_OK) {
+		if (statement) {
+			w->changes = sqlite3_changes(db);
+			(void) sqlite3_finalize(statement);
+		}
+		(void) sqlite3_exec(db, "RELEASE write", NULL, NULL, NULL);
+		return;
+	}
+
+	strlcpy(w->error, sqlite3_errmsg(db), sizeof(w->error));
+	if (statement) (void) sqlite3_finalize(statement);
+	(void) sqlite3_exec(db, "ROLLBACK TO write", NULL, NULL, NULL);
+	(void) sqlite3_exec(db, "RELEASE write", NULL, NULL, NULL);
+}
+
+/** Mark every write in a transaction as failed
+ *
+ */
+static void sql_writer_fail(sqlite3 *db, fr_dlist_head_t *batch, int status)
+{
+	fr_dlist_foreach(batch, rlm_sql_sqlite_write_t, w) {
+		if (sql_error_to_rcode(w->status) != RLM_SQL_OK) continue;
+
+		w->status = status;
+		w->changes = 0;
+		strlcpy(w->error, sqlite3_errmsg(db), sizeof(w->error));
+	}
+}
+
+/** Write each batch of queued statements in a single transaction
+ *
+ * Committing is what costs, as it has to sync the database to disk, so
+ * each transaction includes every write which queued while the previous
+ * one was committing, up to batch_size.
+ */
+static void *sql_writer_main(void *arg)
+{
+	rlm_sql_sqlite_writer_t	*writer = arg;
+	fr_dlist_head_t		batch;
+	rlm_sql_sqlite_write_t	*w;
+	int			status;
+
+	fr_dlist_init(&batch, rlm_sql_sqlite_write_t, entry);
+
+	pthread_mutex_lock(&writer->mutex);
+	for (;;) {
+		while (!writer->stopping && (fr_dlist_num_elements(&writer->queue) == 0)) {
+			pthread_cond_wait(&writer->work, &writer->mutex);
+		}
+		if (fr_dlist_num_elements(&writer->queue) == 0) break;
+
+		while ((fr_dlist_num_elements(&batch) < writer->batch_size) &&
+		       (w = fr_dlist_pop_head(&writer->queue))) fr_dlist_insert_tail(&batch, w);
+		pthread_mutex_unlock(&writer->mutex);
+
+		status = sqlite3_exec(writer->db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+		if (status != SQLITE_OK) {
+			sql_writer_fail(writer->db, &batch, status);
+		} else {
+			fr_dlist_foreach(&batch, rlm_sql_sqlite_write_t, pending) sql_writer_run(writer->db, pending);
+
+			status = sqlite3_exec(writer->db, "COMMIT", NULL, NULL, NULL);
+			if (status != SQLITE_OK) {
+				sql_writer_fail(writer->db, &batch, status);
+				(void) sqlite3_exec(writer->db, "ROLLBACK", NULL, NULL, NULL);
+			}
+		}
+
+		/*
+		 *	Writes belong to the workers, so remove each
+		 *	one from the batch before telling the worker.
+		 */
+		pthread_mutex_lock(&writer->mutex);
+		while ((w = fr_dlist_pop_head(&batch))) w->done = true;
+		pthread_cond_broadcast(&writer->done);
 	}
+	pthread_mutex_unlock(&writer->mutex);
+
+	return NULL;
+}
+
+static int _sql_writer_free(rlm_sql_sqlite_writer_t *writer)
+{
+	if (writer->running) {
+		pthread_mutex_lock(&writer->mutex);
+		writer->stopping = true;
+		pthread_cond_signal(&writer->work);
+		pthread_mutex_unlock(&writer->mutex);
+
+		pthread_join(writer->thread, NULL);
+	}
+
+	pthread_cond_destroy(&writer->done);
+	pthread_cond_destroy(&writer->work);
+	pthread_mutex_destroy(&writer->mutex);
+
+	if (writer->db) (void) sqlite3_close(writer->db);
+
+	return 0;
+}
+
+/** Open the writer's connection, switch the database to WAL, and start the writer thread
+ *
+ */
+static int sql_writer_start(rlm_sql_sqlite_t *inst, rlm_sql_config_t const *config)
+{
+	rlm_sql_sqlite_writer_t	*writer;
+	sqlite3_stmt		*statement;
+	char const		*mode = NULL;
+	int			status, ret;
+
+	MEM(writer = talloc_zero(inst, rlm_sql_sqlite_writer_t));
+	writer->batch_size = inst->write_batch_size;
+	fr_dlist_init(&writer->queue, rlm_sql_sqlite_write_t, entry);
+	pthread_mutex_init(&writer->mutex, NULL);
+	pthread_cond_init(&writer->work, NULL);
+	pthread_cond_init(&writer->done, NULL);
+	talloc_set_destructor(writer, _sql_writer_free);
+
+#ifdef HAVE_SQLITE3_OPEN_V2
+	status = sqlite3_open_v2(inst->filename, &writer->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL);
+#else
+	status = sqlite3_open(inst->filename, &writer->db);
 #endif
+	if (!writer->db || (sql_check_error(writer->db, status) != RLM_SQL_OK)) {
+		sql_print_error(writer->db, status, "Error opening SQLite database \"%s\" for writing", inst->filename);
+	error:
+		talloc_free(writer);
+		return -1;
+	}
 
-#ifdef HAVE_SQLITE3_CREATE_FUNCTION_V2
-	status = sqlite3_create_function_v2(conn->db, "GREATEST", -1, SQLITE_ANY, NULL,
-					    _sql_greatest, NULL, NULL, NULL);
+	if (sql_db_setup(writer->db, config) != RLM_SQL_OK) goto error;
+
+	/*
+	 *	The journal mode is persistent, so this only has to
+	 *	be done by one connection.  It returns the new mode.
+	 */
+#ifdef HAVE_SQLITE3_PREPARE_V2
+	status = sqlite3_prepare_v2(writer->db, "PRAGMA journal_mode=WAL", -1, &statement, NULL);
 #else
-	status = sqlite3_create_function(conn->db, "GREATEST", -1, SQLITE_ANY, NULL,
-					 _sql_greatest, NULL, NULL);
+	status = sqlite3_prepare(writer->db, "PRAGMA journal_mode=WAL", -1, &statement, NULL);
 #endif
-	if (sql_check_error(conn->db, status) != RLM_SQL_OK) {
-		sql_print_error(conn->db, status, "Failed registering 'GREATEST' sql function");
-		return RLM_SQL_ERROR;
+	if (status != SQLITE_OK) {
+		sql_print_error(writer->db, status, "Error enabling WAL");
+		goto error;
 	}
+	if (sqlite3_step(statement) == SQLITE_ROW) mode = (char const *)sqlite3_column_text(statement, 0);
+	if (!mode || (strcasecmp(mode, "wal") != 0)) {
+		ERROR("Error enabling WAL, journal mode is \"%s\"", mode ? mode : "unknown");
+		(void) sqlite3_finalize(statement);
+		goto error;
+	}
+	(void) sqlite3_finalize(statement);
 
-	return RLM_SQL_OK;
+	ret = pthread_create(&writer->thread, NULL, sql_writer_main, writer);
+	if (ret != 0) {
+		ERROR("Failed creating writer thread: %s", fr_syserror(ret));
+		goto error;
+	}
+	writer->running = true;
+
+	DEBUG2("Started writer thread for \"%s\"", inst->filename);
+
+	inst->writer = writer;
+
+	return 0;
+}
+
+/** Queue a statement for the writer thread, and wait for its transaction to commit
+ *
+ * Pool connections block the worker while a query runs, so the worker
+ * waits here, rather than yielding.  Unlike contending for the database
+ * lock, waiting doesn't spin.
+ */
+static sql_rcode_t sql_writer_query(rlm_sql_sqlite_writer_t *writer, rlm_sql_sqlite_conn_t *conn,
+				    char const *query_str)
+{
+	rlm_sql_sqlite_write_t	*w = &conn->write;
+
+	*w = (rlm_sql_sqlite_write_t) {
+		.query_str = query_str
+	};
+	conn->wrote = true;
+
+	pthread_mutex_lock(&writer->mutex);
+	fr_dlist_insert_tail(&writer->queue, w);
+	pthread_cond_signal(&writer->work);
+	while (!w->done) pthread_cond_wait(&writer->done, &writer->mutex);
+	pthread_mutex_unlock(&writer->mutex);
+
+	return sql_error_to_rcode(w->status);
 }
 
 static unlang_action_t sql_select_query(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
@@ -477,9 +751,17 @@ static unlang_action_t sql_query(rlm_rcode_t *p_result, UNUSED int *priority, UN
 {
 	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
 	rlm_sql_sqlite_conn_t	*conn = query_ctx->handle->conn;
+	rlm_sql_sqlite_t	*inst = talloc_get_type_abort(query_ctx->handle->inst->driver_submodule->data,
+							      rlm_sql_sqlite_t);
 	char const		*z_tail;
 	int			status;
 
+	if (inst->writer) {
+		query_ctx->rcode = sql_writer_query(inst->writer, conn, query_ctx->query_str);
+		if (query_ctx->rcode != RLM_SQL_OK) RETURN_MODULE_FAIL;
+		RETURN_MODULE_OK;
+	}
+
 #ifdef HAVE_SQLITE3_PREPARE_V2
 	status = sqlite3_prepare_v2(conn->db, query_ctx->query_str, strlen(query_ctx->query_str), &conn->statement, &z_tail);
 #else
@@ -614,6 +896,8 @@ static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, UNUSED rlm_sql_con
 {
 	rlm_sql_sqlite_conn_t *conn = query_ctx->handle->conn;
 
+	conn->wrote = false;
+
 	if (conn->statement) {
 		TALLOC_FREE(query_ctx->row);
 
@@ -651,7 +935,7 @@ static size_t sql_error(UNUSED TALLOC_CTX *ctx, sql_log_entry_t out[], NDEBUG_UN
 
 	fr_assert(outlen > 0);
 
-	error = sqlite3_errmsg(conn->db);
+	error = conn->wrote ? conn->write.error : sqlite3_errmsg(conn->db);
 	if (!error) return 0;
 
 	out[0].type = L_ERR;
@@ -670,6 +954,7 @@ static int sql_affected_rows(fr_sql_query_t *query_ctx,
 {
 	rlm_sql_sqlite_conn_t *conn = query_ctx->handle->conn;
 
+	if (conn->wrote) return conn->write.changes;
 	if (conn->db) return sqlite3_changes(conn->db);
 
 	return -1;
@@ -806,6 +1091,14 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	}
 
 	close(fd);
+
+	if (inst->write_thread) {
+		FR_INTEGER_BOUND_CHECK("write_batch_size", inst->write_batch_size, >=, 1);
+		FR_INTEGER_BOUND_CHECK("write_batch_size", inst->write_batch_size, <=, 10000);
+
+		if (sql_writer_start(inst, config) < 0) return -1;
+	}
+
 	return 0;
 }
 
@@ -29,22 +29,41 @@ USES_APPLE_DEPRECATED_API
 #include <sqltypes.h>
 #include "rlm_sql.h"
 
+typedef struct {
+	fr_time_delta_t	poll_interval;	//!< How often to check whether an asynchronous call has completed.
+} rlm_sql_unixodbc_t;
+
 typedef struct {
 	SQLHENV env;
 	SQLHDBC dbc;
 	SQLHSTMT stmt;
-	rlm_sql_row_t row;
-	void *conn;
+	rlm_sql_row_t row;		//!< Buffers columns are bound to.
+	SQLLEN *ind;			//!< Length/indicator for each bound column.
+	int col_count;			//!< Number of columns in the result set.
+
+	char ***results;		//!< Rows fetched by the current select.
+	size_t num_rows;		//!< Number of rows in results.
+	size_t cur_row;			//!< Next row to return from results.
+	SQLLEN affected_rows;		//!< Rows affected by the last non-select query.
+
+	connection_t *conn;		//!< Generic connection structure for this connection.
+	rlm_sql_unixodbc_t const *inst;	//!< Driver instance data.
+	fr_sql_query_t *query_ctx;	//!< Current query running on this connection.
+	fr_event_timer_t const *read_ev;	//!< Polls the outstanding asynchronous call.
+	fr_event_timer_t const *write_ev;	//!< Signals the trunk that this connection is writable.
 } rlm_sql_unixodbc_conn_t;
 
 USES_APPLE_DEPRECATED_API
 #include <sql.h>
 #include <sqlext.h>
 
+static const conf_parser_t driver_config[] = {
+	{ FR_CONF_OFFSET("poll_interval", rlm_sql_unixodbc_t, poll_interval), .dflt = "0.001" },
+	CONF_PARSER_TERMINATOR
+};
+
 /* Forward declarations */
-static sql_rcode_t sql_check_error(long error_handle, rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
-static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, rlm_sql_config_t const *config);
-static int sql_num_fields(rlm_sql_handle_t *handle, rlm_sql_config_t const *config);
+static sql_rcode_t sql_check_error(long error_handle, rlm_sql_unixodbc_conn_t *conn);
 
 static int _sql_socket_destructor(rlm_sql_unixodbc_conn_t *conn)
 {
@@ -62,123 +81,439 @@ static int _sql_socket_destructor(rlm_sql_unixodbc_conn_t *conn)
 	return 0;
 }
 
-static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t const *config,
-				   fr_time_delta_t timeout)
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_state_t _sql_connection_init(void **h, connection_t *conn, void *uctx)
 {
-	rlm_sql_unixodbc_conn_t *conn;
+	rlm_sql_t const		*sql = talloc_get_type_abort_const(uctx, rlm_sql_t);
+	rlm_sql_unixodbc_t const *inst = talloc_get_type_abort(sql->driver_submodule->data, rlm_sql_unixodbc_t);
+	rlm_sql_config_t const	*config = &sql->config;
+	rlm_sql_unixodbc_conn_t *c;
 	long err_handle;
-	uint32_t timeout_ms = fr_time_delta_to_msec(timeout);
+	uint32_t timeout_ms = fr_time_delta_to_msec(config->trunk_conf.conn_conf->connection_timeout);
 
-	MEM(conn = handle->conn = talloc_zero(handle, rlm_sql_unixodbc_conn_t));
-	talloc_set_destructor(conn, _sql_socket_destructor);
+	MEM(c = talloc_zero(conn, rlm_sql_unixodbc_conn_t));
+	talloc_set_destructor(c, _sql_socket_destructor);
+	c->conn = conn;
+	c->inst = inst;
 
 	/* 1. Allocate environment handle and register version */
-	err_handle = SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &conn->env);
-	if (sql_check_error(err_handle, handle, config)) {
+	err_handle = SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &c->env);
+	if (sql_check_error(err_handle, c)) {
 		ERROR("Can't allocate environment handle");
-		return RLM_SQL_ERROR;
+	error:
+		talloc_free(c);
+		return CONNECTION_STATE_FAILED;
 	}
 
-	err_handle = SQLSetEnvAttr(conn->env, SQL_ATTR_ODBC_VERSION, (void*)SQL_OV_ODBC3, 0);
-	if (sql_check_error(err_handle, handle, config)) {
+	err_handle = SQLSetEnvAttr(c->env, SQL_ATTR_ODBC_VERSION, (void*)SQL_OV_ODBC3, 0);
+	if (sql_check_error(err_handle, c)) {
 		ERROR("Can't register ODBC version");
-		return RLM_SQL_ERROR;
+		goto error;
 	}
 
 	/* 2. Allocate connection handle */
-	err_handle = SQLAllocHandle(SQL_HANDLE_DBC, conn->env, &conn->dbc);
-	if (sql_check_error(err_handle, handle, config)) {
+	err_handle = SQLAllocHandle(SQL_HANDLE_DBC, c->env, &c->dbc);
+	if (sql_check_error(err_handle, c)) {
 		ERROR("Can't allocate connection handle");
-		return RLM_SQL_ERROR;
+		goto error;
 	}
 
 	/* Set the connection timeout */
-	SQLSetConnectAttr(conn->dbc, SQL_ATTR_LOGIN_TIMEOUT, &timeout_ms, SQL_IS_UINTEGER);
+	SQLSetConnectAttr(c->dbc, SQL_ATTR_LOGIN_TIMEOUT, &timeout_ms, SQL_IS_UINTEGER);
 
 	/* 3. Connect to the datasource */
-	err_handle = SQLConnect(conn->dbc,
+	err_handle = SQLConnect(c->dbc,
 				UNCONST(SQLCHAR *, config->sql_server), strlen(config->sql_server),
 				UNCONST(SQLCHAR *, config->sql_login), strlen(config->sql_login),
 				UNCONST(SQLCHAR *, config->sql_password), strlen(config->sql_password));
 
-	if (sql_check_error(err_handle, handle, config)) {
+	if (sql_check_error(err_handle, c)) {
 		ERROR("Connection failed");
-		return RLM_SQL_ERROR;
+		goto error;
 	}
 
 	/* 4. Allocate the stmt */
-	err_handle = SQLAllocHandle(SQL_HANDLE_STMT, conn->dbc, &conn->stmt);
-	if (sql_check_error(err_handle, handle, config)) {
+	err_handle = SQLAllocHandle(SQL_HANDLE_STMT, c->dbc, &c->stmt);
+	if (sql_check_error(err_handle, c)) {
 		ERROR("Can't allocate the stmt");
-		return RLM_SQL_ERROR;
+		goto error;
+	}
+
+	/*
+	 *	5. Enable asynchronous execution.  Calls on the
+	 *	statement then return SQL_STILL_EXECUTING, and must
+	 *	be repeated until they complete.
+	 *
+	 *	Not all drivers support this, in which case queries
+	 *	block the thread they're run on.
+	 */
+	err_handle = SQLSetStmtAttr(c->stmt, SQL_ATTR_ASYNC_ENABLE, (SQLPOINTER)SQL_ASYNC_ENABLE_ON, 0);
+	if (err_handle != SQL_SUCCESS) {
+		WARN("ODBC driver doesn't support asynchronous execution, queries will block");
 	}
 
-    return RLM_SQL_OK;
+	*h = c;
+
+	return CONNECTION_STATE_CONNECTED;
 }
 
-static unlang_action_t sql_query(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
+static void _sql_connection_close(UNUSED fr_event_list_t *el, void *h, UNUSED void *uctx)
 {
-	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
-	rlm_sql_unixodbc_conn_t *conn = query_ctx->handle->conn;
-	long err_handle;
+	rlm_sql_unixodbc_conn_t	*c = talloc_get_type_abort(h, rlm_sql_unixodbc_conn_t);
 
-	/* Executing query */
-	err_handle = SQLExecDirect(conn->stmt, UNCONST(SQLCHAR *, query_ctx->query_str), strlen(query_ctx->query_str));
-	if ((query_ctx->rcode = sql_check_error(err_handle, query_ctx->handle, &query_ctx->inst->config))) {
-		if(query_ctx->rcode == RLM_SQL_RECONNECT) {
-			DEBUG("rlm_sql will attempt to reconnect");
-		}
-		RETURN_MODULE_FAIL;
+	if (c->read_ev) fr_event_timer_delete(&c->read_ev);
+	if (c->write_ev) fr_event_timer_delete(&c->write_ev);
+	c->query_ctx = NULL;
+	talloc_free(h);
+}
+
+/** Allocate an SQL trunk connection
+ *
+ * @param[in] tconn		Trunk handle.
+ * @param[in] el		Event list which will be used for I/O and timer events.
+ * @param[in] conn_conf		Configuration of the connection.
+ * @param[in] log_prefix	What to prefix log messages with.
+ * @param[in] uctx		User context passed to trunk_alloc.
+ */
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static connection_t *sql_trunk_connection_alloc(trunk_connection_t *tconn, fr_event_list_t *el,
+						connection_conf_t const *conn_conf,
+						char const *log_prefix, void *uctx)
+{
+	connection_t		*conn;
+	rlm_sql_thread_t	*thread = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+
+	conn = connection_alloc(tconn, el,
+				&(connection_funcs_t){
+					.init = _sql_connection_init,
+					.close = _sql_connection_close
+				},
+				conn_conf, log_prefix, thread->inst);
+	if (!conn) {
+		PERROR("Failed allocating state handler for new SQL connection");
+		return NULL;
 	}
-	RETURN_MODULE_OK;
+
+	return conn;
+}
+
+/** Signal the trunk that the connection can accept a new query
+ *
+ * ODBC doesn't expose the connection's file descriptor, so there's no I/O
+ * event to wait on.  With one query per connection, the connection is
+ * writable whenever the trunk asks.
+ */
+static void sql_trunk_connection_write_poll(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	trunk_connection_t	*tconn = talloc_get_type_abort(uctx, trunk_connection_t);
+
+	trunk_connection_signal_writable(tconn);
 }
 
-static unlang_action_t sql_select_query(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_trunk_connection_notify(trunk_connection_t *tconn, connection_t *conn, fr_event_list_t *el,
+					trunk_connection_event_t notify_on, UNUSED void *uctx)
 {
-	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
-	rlm_sql_unixodbc_conn_t *conn = query_ctx->handle->conn;
-	SQLINTEGER i;
-	SQLLEN len;
-	int colcount;
+	rlm_sql_unixodbc_conn_t	*c = talloc_get_type_abort(conn->h, rlm_sql_unixodbc_conn_t);
 
-	/* Only state = 0 means success */
-	if ((sql_query(p_result, NULL, request, query_ctx) == UNLANG_ACTION_CALCULATE_RESULT) &&
-	    (query_ctx->rcode != RLM_SQL_OK)) RETURN_MODULE_FAIL;
+	if (c->write_ev) fr_event_timer_delete(&c->write_ev);
 
-	colcount = sql_num_fields(query_ctx->handle, &query_ctx->inst->config);
-	if (colcount < 0) {
-		query_ctx->rcode = RLM_SQL_ERROR;
-		RETURN_MODULE_FAIL;
+	switch (notify_on) {
+	/*
+	 *	Reads are driven by the poll timer of the outstanding call
+	 */
+	case TRUNK_CONN_EVENT_NONE:
+	case TRUNK_CONN_EVENT_READ:
+		return;
+
+	case TRUNK_CONN_EVENT_WRITE:
+	case TRUNK_CONN_EVENT_BOTH:
+		break;
 	}
 
+	if (fr_event_timer_in(c, el, &c->write_ev, fr_time_delta_wrap(0),
+			      sql_trunk_connection_write_poll, tconn) < 0) {
+		PERROR("Failed inserting write poll timer");
+		trunk_connection_signal_reconnect(tconn, CONNECTION_FAILED);
+	}
+}
+
+/** Free any result set, and close the statement's cursor
+ *
+ */
+static void sql_stmt_close(rlm_sql_unixodbc_conn_t *conn)
+{
+	TALLOC_FREE(conn->row);
+	conn->ind = NULL;	/* ind is a child of row */
+	conn->col_count = 0;
+
+	TALLOC_FREE(conn->results);
+	conn->num_rows = 0;
+	conn->cur_row = 0;
+
+	/*
+	 *	SQL_CLOSE - The cursor (if any) associated with the statement
+	 *	handle (StatementHandle) is closed and all pending results are
+	 *	discarded. The application can reopen the cursor by calling
+	 *	SQLExecute() with the same or different values in the
+	 *	application variables (if any) that are bound to StatementHandle.
+	 *	If no cursor has been associated with the statement handle,
+	 *	this option has no effect (no warning or error is generated).
+	 *
+	 *	So, this call does NOT free the statement at all, it merely
+	 *	resets it for the next call. This is terrible terrible naming.
+	 */
+	SQLFreeStmt(conn->stmt, SQL_CLOSE);
+}
+
+/** Bind output buffers for each column of a select's result set
+ *
+ */
+static sql_rcode_t sql_columns_bind(rlm_sql_unixodbc_conn_t *conn)
+{
+	SQLSMALLINT	num_fields = 0;
+	SQLINTEGER	i;
+	SQLLEN		len;
+	sql_rcode_t	rcode;
+
+	rcode = sql_check_error(SQLNumResultCols(conn->stmt, &num_fields), conn);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	conn->col_count = num_fields;
+
 	/* Reserving memory for result */
-	conn->row = talloc_zero_array(conn, char *, colcount + 1); /* Space for pointers */
+	MEM(conn->row = talloc_zero_array(conn, char *, conn->col_count + 1)); /* Space for pointers */
+	MEM(conn->ind = talloc_zero_array(conn->row, SQLLEN, conn->col_count + 1));
 
-	for (i = 1; i <= colcount; i++) {
+	for (i = 1; i <= conn->col_count; i++) {
 		len = 0;
 		SQLColAttributes(conn->stmt, ((SQLUSMALLINT) i), SQL_DESC_LENGTH, NULL, 0, NULL, &len);
-		conn->row[i - 1] = talloc_array(conn->row, char, ++len);
-		SQLBindCol(conn->stmt, i, SQL_C_CHAR, (SQLCHAR *)conn->row[i - 1], len, NULL);
+		MEM(conn->row[i - 1] = talloc_array(conn->row, char, ++len));
+		SQLBindCol(conn->stmt, i, SQL_C_CHAR, (SQLCHAR *)conn->row[i - 1], len, &conn->ind[i - 1]);
 	}
 
-	RETURN_MODULE_OK;
+	return RLM_SQL_OK;
 }
 
-static int sql_num_fields(rlm_sql_handle_t *handle, rlm_sql_config_t const *config)
+/** Copy the row just fetched into the result set
+ *
+ */
+static void sql_row_store(rlm_sql_unixodbc_conn_t *conn)
 {
-	rlm_sql_unixodbc_conn_t *conn = handle->conn;
-	long err_handle;
-	SQLSMALLINT num_fields = 0;
+	char	**row;
+	int	i;
 
-	err_handle = SQLNumResultCols(conn->stmt,&num_fields);
-	if (sql_check_error(err_handle, handle, config)) return -1;
+	if (conn->num_rows == talloc_array_length(conn->results)) {
+		MEM(conn->results = talloc_realloc(conn, conn->results, char **,
+						   conn->num_rows ? conn->num_rows * 2 : 16));
+	}
 
-	return num_fields;
+	MEM(row = talloc_zero_array(conn->results, char *, conn->col_count + 1));
+	for (i = 0; i < conn->col_count; i++) {
+		if (conn->ind[i] == SQL_NULL_DATA) continue;
+		MEM(row[i] = talloc_typed_strdup(row, conn->row[i]));
+	}
+	conn->results[conn->num_rows++] = row;
+}
+
+static void sql_trunk_connection_read_poll(fr_event_list_t *el, fr_time_t now, void *uctx);
+
+/** Advance the query running on a connection as far as it can go without blocking
+ *
+ * Asynchronous ODBC calls return SQL_STILL_EXECUTING until they complete, and
+ * must be repeated, with the same arguments, until they do.  As there's no
+ * file descriptor to wait on, a timer repeats the call every poll_interval.
+ */
+static void sql_query_process(rlm_sql_unixodbc_conn_t *conn)
+{
+	fr_sql_query_t	*query_ctx = conn->query_ctx;
+	request_t	*request = query_ctx->request;
+	long		err_handle;
+
+	switch (query_ctx->status) {
+	case SQL_QUERY_SUBMITTED:
+		err_handle = SQLExecDirect(conn->stmt, UNCONST(SQLCHAR *, query_ctx->query_str),
+					   strlen(query_ctx->query_str));
+		if (err_handle == SQL_STILL_EXECUTING) goto poll;
+
+		/*
+		 *	Statements which affect no rows
+		 */
+		if (err_handle == SQL_NO_DATA) {
+			query_ctx->status = (query_ctx->type == SQL_QUERY_SELECT) ?
+					    SQL_QUERY_RESULTS_FETCHED : SQL_QUERY_RETURNED;
+			break;
+		}
+
+		query_ctx->rcode = sql_check_error(err_handle, conn);
+		if (query_ctx->rcode != RLM_SQL_OK) {
+			if (query_ctx->rcode == RLM_SQL_RECONNECT) {
+				ROPTIONAL(RDEBUG2, DEBUG2, "rlm_sql will attempt to reconnect");
+			}
+			query_ctx->status = SQL_QUERY_FAILED;
+			goto done;
+		}
+
+		if (query_ctx->type != SQL_QUERY_SELECT) {
+			SQLRowCount(conn->stmt, &conn->affected_rows);
+			query_ctx->status = SQL_QUERY_RETURNED;
+			break;
+		}
+
+		query_ctx->rcode = sql_columns_bind(conn);
+		if (query_ctx->rcode != RLM_SQL_OK) {
+			query_ctx->status = SQL_QUERY_FAILED;
+			goto done;
+		}
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "Fetching results");
+		query_ctx->status = SQL_QUERY_FETCHING_RESULTS;
+		FALL_THROUGH;
+
+	case SQL_QUERY_FETCHING_RESULTS:
+		while (SQL_SUCCEEDED(err_handle = SQLFetch(conn->stmt))) sql_row_store(conn);
+		if (err_handle == SQL_STILL_EXECUTING) goto poll;
+
+		if (err_handle != SQL_NO_DATA_FOUND) {
+			query_ctx->rcode = sql_check_error(err_handle, conn);
+			if (query_ctx->rcode == RLM_SQL_OK) query_ctx->rcode = RLM_SQL_ERROR;
+			query_ctx->status = SQL_QUERY_FAILED;
+			goto done;
+		}
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "query returned rows = %zu, fields = %i", conn->num_rows, conn->col_count);
+		query_ctx->status = SQL_QUERY_RESULTS_FETCHED;
+		break;
+
+	default:
+		fr_assert(0);
+		return;
+	}
+
+	query_ctx->rcode = RLM_SQL_OK;
+
+done:
+	conn->query_ctx = NULL;
+	if (request) unlang_interpret_mark_runnable(request);
+	return;
+
+poll:
+	ROPTIONAL(RDEBUG3, DEBUG3, "Waiting for response");
+	if (fr_event_timer_in(conn, conn->conn->el, &conn->read_ev, conn->inst->poll_interval,
+			      sql_trunk_connection_read_poll, conn) < 0) {
+		ROPTIONAL(RERROR, ERROR, "Failed inserting poll timer");
+		query_ctx->status = SQL_QUERY_FAILED;
+		query_ctx->rcode = RLM_SQL_ERROR;
+		goto done;
+	}
+}
+
+/** Repeat the outstanding asynchronous call
+ *
+ */
+static void sql_trunk_connection_read_poll(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_sql_unixodbc_conn_t	*conn = talloc_get_type_abort(uctx, rlm_sql_unixodbc_conn_t);
+
+	/*
+	 *	Query was cancelled
+	 */
+	if (!conn->query_ctx) return;
+
+	sql_query_process(conn);
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_trunk_request_mux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn,
+				  connection_t *conn, UNUSED void *uctx)
+{
+	rlm_sql_unixodbc_conn_t	*sql_conn = talloc_get_type_abort(conn->h, rlm_sql_unixodbc_conn_t);
+	request_t		*request;
+	trunk_request_t		*treq;
+	fr_sql_query_t		*query_ctx;
+
+	if (trunk_connection_pop_request(&treq, tconn) != 0) return;
+	if (!treq) return;
+
+	query_ctx = talloc_get_type_abort(treq->preq, fr_sql_query_t);
+	request = query_ctx->request;
+
+	switch (query_ctx->status) {
+	case SQL_QUERY_PREPARED:
+		ROPTIONAL(RDEBUG2, DEBUG2, "Executing query: %s", query_ctx->query_str);
+		query_ctx->tconn = tconn;
+
+		sql_stmt_close(sql_conn);	/* Any previous result set */
+		sql_conn->affected_rows = 0;
+
+		query_ctx->status = SQL_QUERY_SUBMITTED;
+		sql_conn->query_ctx = query_ctx;
+		trunk_request_signal_sent(treq);
+
+		sql_query_process(sql_conn);
+		return;
+
+	default:
+		return;
+	}
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_request_cancel(connection_t *conn, void *preq, trunk_cancel_reason_t reason,
+			       UNUSED void *uctx)
+{
+	fr_sql_query_t		*query_ctx = talloc_get_type_abort(preq, fr_sql_query_t);
+	rlm_sql_unixodbc_conn_t	*sql_conn = talloc_get_type_abort(conn->h, rlm_sql_unixodbc_conn_t);
+
+	if (!query_ctx->treq) return;
+	if (reason != TRUNK_CANCEL_REASON_SIGNAL) return;
+	if (sql_conn->query_ctx == query_ctx) sql_conn->query_ctx = NULL;
+}
+
+CC_NO_UBSAN(function) /* UBSAN: false positive - public vs private connection_t trips --fsanitize=function*/
+static void sql_request_cancel_mux(UNUSED fr_event_list_t *el, trunk_connection_t *tconn,
+				   connection_t *conn, UNUSED void *uctx)
+{
+	rlm_sql_unixodbc_conn_t	*sql_conn = talloc_get_type_abort(conn->h, rlm_sql_unixodbc_conn_t);
+	trunk_request_t		*treq;
+
+	/*
+	 *	After SQLCancel() an asynchronous call still has to be
+	 *	repeated until it stops returning SQL_STILL_EXECUTING,
+	 *	so rather than tracking that, close the connection.
+	 */
+	if ((trunk_connection_pop_cancellation(&treq, tconn)) == 0) {
+		if (sql_conn->read_ev) fr_event_timer_delete(&sql_conn->read_ev);
+		SQLCancel(sql_conn->stmt);
+
+		trunk_request_signal_cancel_complete(treq);
+		connection_signal_reconnect(conn, CONNECTION_FAILED);
+	}
+}
+
+static void sql_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+			     UNUSED trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_sql_query_t		*query_ctx = talloc_get_type_abort(preq, fr_sql_query_t);
+
+	query_ctx->treq = NULL;
+	query_ctx->rcode = RLM_SQL_ERROR;
+
+	if (request) unlang_interpret_mark_runnable(request);
+}
+
+static unlang_action_t sql_query_resume(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
+{
+	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
+
+	if (query_ctx->rcode != RLM_SQL_OK) RETURN_MODULE_FAIL;
+
+	RETURN_MODULE_OK;
 }
 
 static sql_rcode_t sql_fields(char const **out[], fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_unixodbc_conn_t *conn = query_ctx->handle->conn;
+	rlm_sql_unixodbc_conn_t *conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_unixodbc_conn_t);
 
 	SQLSMALLINT	fields, len, i;
 
@@ -214,69 +549,72 @@ static sql_rcode_t sql_fields(char const **out[], fr_sql_query_t *query_ctx, UNU
 	return RLM_SQL_OK;
 }
 
+/** Return the next row of the result set
+ *
+ * All rows were fetched while the query was running asynchronously,
+ * so this never blocks.
+ */
 static unlang_action_t sql_fetch_row(rlm_rcode_t *p_result, UNUSED int *priority, UNUSED request_t *request, void *uctx)
 {
 	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
-	rlm_sql_handle_t	*handle = query_ctx->handle;
-	rlm_sql_unixodbc_conn_t *conn = handle->conn;
-	long			err_handle;
+	rlm_sql_unixodbc_conn_t *conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_unixodbc_conn_t);
 
 	query_ctx->row = NULL;
 
-	err_handle = SQLFetch(conn->stmt);
-	if (err_handle == SQL_NO_DATA_FOUND) {
+	if (conn->cur_row >= conn->num_rows) {
 		query_ctx->rcode = RLM_SQL_NO_MORE_ROWS;
 		RETURN_MODULE_OK;
 	}
 
-	query_ctx->rcode = sql_check_error(err_handle, handle, &query_ctx->inst->config);
-	if (query_ctx->rcode != RLM_SQL_OK) RETURN_MODULE_FAIL;
-
-	query_ctx->row = conn->row;
+	query_ctx->row = conn->results[conn->cur_row++];
 
 	query_ctx->rcode = RLM_SQL_OK;
 	RETURN_MODULE_OK;
 }
 
-static sql_rcode_t sql_finish_select_query(fr_sql_query_t *query_ctx, rlm_sql_config_t const *config)
+/** Return all remaining rows of the result set
+ *
+ */
+static sql_rcode_t sql_fetch_rows(rlm_sql_row_t **out, size_t *num_rows, fr_sql_query_t *query_ctx,
+				  UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_unixodbc_conn_t *conn = query_ctx->handle->conn;
+	rlm_sql_unixodbc_conn_t *conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_unixodbc_conn_t);
 
-	sql_free_result(query_ctx, config);
+	if (conn->cur_row >= conn->num_rows) {
+		*out = NULL;
+		*num_rows = 0;
+		return RLM_SQL_OK;
+	}
 
-	/*
-	 *	SQL_CLOSE - The cursor (if any) associated with the statement
-	 *	handle (StatementHandle) is closed and all pending results are
-	 *	discarded. The application can reopen the cursor by calling
-	 *	SQLExecute() with the same or different values in the
-	 *	application variables (if any) that are bound to StatementHandle.
-	 *	If no cursor has been associated with the statement handle,
-	 *	this option has no effect (no warning or error is generated).
-	 *
-	 *	So, this call does NOT free the statement at all, it merely
-	 *	resets it for the next call. This is terrible terrible naming.
-	 */
-	SQLFreeStmt(conn->stmt, SQL_CLOSE);
+	*out = conn->results + conn->cur_row;
+	*num_rows = conn->num_rows - conn->cur_row;
+	conn->cur_row = conn->num_rows;
 
-	return 0;
+	return RLM_SQL_OK;
 }
 
-static sql_rcode_t sql_finish_query(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
+static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_unixodbc_conn_t *conn = query_ctx->handle->conn;
+	rlm_sql_unixodbc_conn_t *conn;
 
-	SQLFreeStmt(conn->stmt, SQL_CLOSE);
+	if (query_ctx->treq && !(query_ctx->treq->state &
+	    (TRUNK_REQUEST_STATE_SENT | TRUNK_REQUEST_STATE_REAPABLE | TRUNK_REQUEST_STATE_COMPLETE))) return RLM_SQL_OK;
 
-	return 0;
-}
+	if (!query_ctx->tconn || !query_ctx->tconn->conn || !query_ctx->tconn->conn->h) return RLM_SQL_ERROR;
 
-static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
-{
-	rlm_sql_unixodbc_conn_t *conn = query_ctx->handle->conn;
+	if (!(query_ctx->tconn->state & TRUNK_CONN_PROCESSING)) return RLM_SQL_ERROR;
 
-	TALLOC_FREE(conn->row);
+	conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_unixodbc_conn_t);
 
-	return 0;
+	/*
+	 *	Still running, the cancellation will clean up
+	 */
+	if (conn->query_ctx == query_ctx) return RLM_SQL_OK;
+
+	query_ctx->row = NULL;
+	sql_stmt_close(conn);
+
+	return RLM_SQL_OK;
 }
 
 /** Retrieves any errors associated with the query context
@@ -293,7 +631,7 @@ static sql_rcode_t sql_free_result(fr_sql_query_t *query_ctx, UNUSED rlm_sql_con
 static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], NDEBUG_UNUSED size_t outlen,
 			fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_unixodbc_conn_t		*conn = query_ctx->handle->conn;
+	rlm_sql_unixodbc_conn_t		*conn;
 	SQLCHAR				state[256];
 	SQLCHAR				errbuff[256];
 	SQLINTEGER			errnum = 0;
@@ -301,6 +639,9 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], NDEBUG_UNUSED si
 
 	fr_assert(outlen > 0);
 
+	if (!query_ctx->tconn || !query_ctx->tconn->conn || !query_ctx->tconn->conn->h) return 0;
+	conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_unixodbc_conn_t);
+
 	errbuff[0] = state[0] = '\0';
 	SQLError(conn->env, conn->dbc, conn->stmt, state, &errnum,
 		 errbuff, sizeof(errbuff), &length);
@@ -315,14 +656,13 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], NDEBUG_UNUSED si
 /** Checks the error code to determine if the connection needs to be re-esttablished
  *
  * @param error_handle Return code from a failed unixodbc call.
- * @param handle rlm_sql connection handle.
- * @param config rlm_sql config.
+ * @param conn unixodbc connection.
  * @return
  *	- #RLM_SQL_OK on success.
  *	- #RLM_SQL_RECONNECT if reconnect is needed.
  *	- #RLM_SQL_ERROR on error.
  */
-static sql_rcode_t sql_check_error(long error_handle, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t const *config)
+static sql_rcode_t sql_check_error(long error_handle, rlm_sql_unixodbc_conn_t *conn)
 {
 	SQLCHAR state[256];
 	SQLCHAR error[256];
@@ -330,8 +670,6 @@ static sql_rcode_t sql_check_error(long error_handle, rlm_sql_handle_t *handle,
 	SQLSMALLINT length = 255;
 	int res = -1;
 
-	rlm_sql_unixodbc_conn_t *conn = handle->conn;
-
 	if (SQL_SUCCEEDED(error_handle)) return 0; /* on success, just return 0 */
 
 	error[0] = state[0] = '\0';
@@ -376,16 +714,11 @@ static sql_rcode_t sql_check_error(long error_handle, rlm_sql_handle_t *handle,
  *	       or insert)
  *
  *************************************************************************/
-static int sql_affected_rows(fr_sql_query_t *query_ctx, rlm_sql_config_t const *config)
+static int sql_affected_rows(fr_sql_query_t *query_ctx, UNUSED rlm_sql_config_t const *config)
 {
-	rlm_sql_unixodbc_conn_t *conn = query_ctx->handle->conn;
-	long error_handle;
-	SQLLEN affected_rows;
+	rlm_sql_unixodbc_conn_t *conn = talloc_get_type_abort(query_ctx->tconn->conn->h, rlm_sql_unixodbc_conn_t);
 
-	error_handle = SQLRowCount(conn->stmt, &affected_rows);
-	if (sql_check_error(error_handle, query_ctx->handle, config)) return -1;
-
-	return affected_rows;
+	return conn->affected_rows;
 }
 
 
@@ -394,16 +727,27 @@ extern rlm_sql_driver_t rlm_sql_unixodbc;
 rlm_sql_driver_t rlm_sql_unixodbc = {
 	.common = {
 		.magic				= MODULE_MAGIC_INIT,
-		.name				= "sql_unixodbc"
+		.name				= "sql_unixodbc",
+		.inst_size			= sizeof(rlm_sql_unixodbc_t),
+		.config				= driver_config
 	},
-	.sql_socket_init		= sql_socket_init,
-	.sql_query			= sql_query,
-	.sql_select_query		= sql_select_query,
+	.sql_query_resume		= sql_query_resume,
+	.sql_select_query_resume	= sql_query_resume,
 	.sql_affected_rows		= sql_affected_rows,
 	.sql_fields			= sql_fields,
 	.sql_fetch_row			= sql_fetch_row,
+	.sql_fetch_rows			= sql_fetch_rows,
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
-	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_select_query
+	.sql_finish_query		= sql_free_result,
+	.sql_finish_select_query	= sql_free_result,
+	.uses_trunks			= true,
+	.trunk_io_funcs = {
+		.connection_alloc	= sql_trunk_connection_alloc,
+		.connection_notify	= sql_trunk_connection_notify,
+		.request_mux		= sql_trunk_request_mux,
+		.request_cancel		= sql_request_cancel,
+		.request_cancel_mux	= sql_request_cancel_mux,
+		.request_fail		= sql_request_fail,
+	}
 };
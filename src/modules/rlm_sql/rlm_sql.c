@@ -53,6 +53,12 @@ typedef struct {
 	fr_dict_attr_t const *group_da;
 } rlm_sql_boot_t;
 
+static const conf_parser_t batch_config[] = {
+	{ FR_CONF_OFFSET("size", rlm_sql_config_t, batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("interval", rlm_sql_config_t, batch_interval), .dflt = "0.01" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_TYPE_FLAGS("driver", FR_TYPE_VOID, 0, rlm_sql_t, driver_submodule), .dflt = "null",
 			 .func = submodule_parse },
@@ -61,6 +67,7 @@ static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("login", rlm_sql_config_t, sql_login), .dflt = "" },
 	{ FR_CONF_OFFSET_FLAGS("password", CONF_FLAG_SECRET, rlm_sql_config_t, sql_password), .dflt = "" },
 	{ FR_CONF_OFFSET("radius_db", rlm_sql_config_t, sql_db), .dflt = "radius" },
+	{ FR_CONF_OFFSET_FLAGS("read_replica", CONF_FLAG_MULTI, rlm_sql_config_t, read_replicas) },
 	{ FR_CONF_OFFSET("read_groups", rlm_sql_config_t, read_groups), .dflt = "yes" },
 	{ FR_CONF_OFFSET("group_attribute", rlm_sql_config_t, group_attribute) },
 	{ FR_CONF_OFFSET("cache_groups", rlm_sql_config_t, cache_groups) },
@@ -74,6 +81,18 @@ static const conf_parser_t module_config[] = {
 	 */
 	{ FR_CONF_OFFSET("query_timeout", rlm_sql_config_t, query_timeout) },
 
+	/*
+	 *	This only works for drivers which can run multiple
+	 *	statements as a single query.
+	 */
+	{ FR_CONF_POINTER("batch", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) batch_config },
+
+	/*
+	 *	This only works for drivers which support
+	 *	parameterised statements.
+	 */
+	{ FR_CONF_OFFSET("prepared_statements", rlm_sql_config_t, prepared_statements), .dflt = "no" },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -230,14 +249,34 @@ typedef struct {
 	rlm_sql_t const			*inst;		//!< Module instance.
 	request_t			*request;	//!< Request being processed.
 	rlm_sql_handle_t		*handle;	//!< Database connection handle.
+	rlm_sql_thread_t		*thread;	//!< Thread instance data.
 	trunk_t			*trunk;		//!< Trunk connection for queries.
 	sql_redundant_call_env_t	*call_env;	//!< Call environment data.
 	size_t				query_no;	//!< Current query number.
 	fr_value_box_list_t		query;		//!< Where expanded query tmpl will be written.
 	fr_value_box_t			*query_vb;	//!< Current query string.
 	fr_sql_query_t			*query_ctx;	//!< Query context for current query.
+	bool				batchable;	//!< The first query may be written as part of a batch.
+	sql_batch_t			*batch;		//!< Batch the first query is waiting on.
+	fr_dlist_t			batch_entry;	//!< Entry in the batch's list of waiting requests.
 } sql_redundant_ctx_t;
 
+/** Accounting queries from multiple requests, written in a single round trip
+ *
+ * The request which writes the batch is the "leader".  Everyone else yields
+ * until the leader's query completes.  If it fails, each request runs its own
+ * queries individually, so a query is written at least once.
+ */
+struct sql_batch_s {
+	rlm_sql_thread_t		*thread;	//!< Thread the batch was created in.
+	fr_dlist_head_t			entries;	//!< Requests waiting on this batch.
+	sql_redundant_ctx_t		*leader;	//!< Request writing the batch.
+	bool				flush;		//!< Batch is full, or its interval has expired.
+	bool				submitted;	//!< Combined query has been submitted.
+	bool				done;		//!< Combined query has completed.
+	sql_rcode_t			rcode;		//!< Result of the combined query.
+};
+
 typedef struct {
 	fr_value_box_t	user;
 	tmpl_t		*membership_query;
@@ -1714,8 +1753,11 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
  *
  * Release the connection handle and unset the SQL-User attribute.
  */
+static void sql_batch_entry_remove(sql_redundant_ctx_t *redundant_ctx);
+
 static int sql_redundant_ctx_free(sql_redundant_ctx_t *to_free)
 {
+	sql_batch_entry_remove(to_free);
 	if (!to_free->inst->sql_escape_arg) (void) request_data_get(to_free->request, (void *)sql_escape_uctx_alloc, 0);
 	if (to_free->handle) fr_pool_connection_release(to_free->inst->pool, to_free->request, to_free->handle);
 	sql_unset_user(to_free->inst, to_free->request);
@@ -1807,6 +1849,232 @@ next:
 }
 
 
+/** Run the current query in a redundant list of queries
+ *
+ */
+static unlang_action_t sql_redundant_query_push(rlm_rcode_t *p_result, request_t *request, sql_redundant_ctx_t *redundant_ctx)
+{
+	rlm_sql_t const			*inst = redundant_ctx->inst;
+
+	MEM(redundant_ctx->query_ctx = fr_sql_query_alloc(redundant_ctx, inst, request,
+							  redundant_ctx->handle, redundant_ctx->trunk,
+							  redundant_ctx->query_vb->vb_strvalue, SQL_QUERY_OTHER));
+
+	if (unlang_function_repeat_set(request, mod_sql_redundant_query_resume) < 0) RETURN_MODULE_FAIL;
+
+	return unlang_function_push(request, inst->query, NULL, NULL, 0, UNLANG_SUB_FRAME, redundant_ctx->query_ctx);
+}
+
+/** Wake every request waiting on a batch, other than the leader
+ *
+ */
+static void sql_batch_wake(sql_batch_t *batch)
+{
+	fr_dlist_foreach(&batch->entries, sql_redundant_ctx_t, entry) {
+		if (entry == batch->leader) continue;
+		unlang_interpret_mark_runnable(entry->request);
+	}
+}
+
+/** Remove a request from the batch it's waiting on, freeing the batch if it was the last one
+ *
+ */
+static void sql_batch_entry_remove(sql_redundant_ctx_t *redundant_ctx)
+{
+	sql_batch_t		*batch = redundant_ctx->batch;
+	rlm_sql_thread_t	*thread;
+	sql_redundant_ctx_t	*head;
+
+	if (!batch) return;
+
+	fr_dlist_remove(&batch->entries, redundant_ctx);
+	redundant_ctx->batch = NULL;
+
+	/*
+	 *	The leader was cancelled before the combined query
+	 *	completed.  We don't know if it was written, so
+	 *	everyone else writes their queries individually.
+	 */
+	if (batch->leader == redundant_ctx) {
+		batch->leader = NULL;
+		if (!batch->done) {
+			batch->done = true;
+			batch->rcode = RLM_SQL_ERROR;
+			sql_batch_wake(batch);
+		}
+	}
+
+	head = fr_dlist_head(&batch->entries);
+	if (head) {
+		/*
+		 *	The request that was going to write the batch
+		 *	went away, the next one needs to do it instead.
+		 */
+		if (batch->flush && !batch->submitted) unlang_interpret_mark_runnable(head->request);
+		return;
+	}
+
+	thread = batch->thread;
+	if (thread->batch == batch) {
+		thread->batch = NULL;
+		fr_event_timer_delete(&thread->batch_ev);
+	}
+	talloc_free(batch);
+}
+
+/** Flush a partial batch once batch_interval has expired
+ *
+ * The request at the head of the batch writes it.
+ */
+static void sql_batch_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_sql_thread_t	*thread = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+	sql_batch_t		*batch = thread->batch;
+	sql_redundant_ctx_t	*head;
+
+	if (!batch) return;
+
+	batch->flush = true;
+	thread->batch = NULL;
+
+	head = fr_dlist_head(&batch->entries);
+	if (head) unlang_interpret_mark_runnable(head->request);
+}
+
+/** Add a request's query to the thread's current batch
+ *
+ * @return
+ *	- 1 if the batch is now full, and the caller should write it.
+ *	- 0 if the caller should wait for the batch to be written.
+ *	- -1 on error.
+ */
+static int sql_batch_add(rlm_sql_thread_t *thread, sql_redundant_ctx_t *redundant_ctx)
+{
+	rlm_sql_t const		*inst = thread->inst;
+	sql_batch_t		*batch = thread->batch;
+
+	if (!batch) {
+		MEM(batch = talloc_zero(thread, sql_batch_t));
+		batch->thread = thread;
+		fr_dlist_talloc_init(&batch->entries, sql_redundant_ctx_t, batch_entry);
+
+		if (fr_event_timer_in(thread, thread->el, &thread->batch_ev, inst->config.batch_interval,
+				      sql_batch_timeout, thread) < 0) {
+			talloc_free(batch);
+			return -1;
+		}
+		thread->batch = batch;
+	}
+
+	fr_dlist_insert_tail(&batch->entries, redundant_ctx);
+	redundant_ctx->batch = batch;
+
+	if (fr_dlist_num_elements(&batch->entries) < inst->config.batch_size) return 0;
+
+	batch->flush = true;
+	thread->batch = NULL;
+	fr_event_timer_delete(&thread->batch_ev);
+
+	return 1;
+}
+
+static unlang_action_t sql_batch_resume(rlm_rcode_t *p_result, int *priority, request_t *request, void *uctx);
+
+/** Record the result of the combined query, and wake everyone waiting on it
+ *
+ */
+static unlang_action_t sql_batch_query_resume(rlm_rcode_t *p_result, int *priority, request_t *request, void *uctx)
+{
+	sql_redundant_ctx_t	*redundant_ctx = talloc_get_type_abort(uctx, sql_redundant_ctx_t);
+	sql_batch_t		*batch = redundant_ctx->batch;
+
+	batch->rcode = redundant_ctx->query_ctx->rcode;
+	batch->done = true;
+	TALLOC_FREE(redundant_ctx->query_ctx);
+
+	sql_batch_wake(batch);
+
+	return sql_batch_resume(p_result, priority, request, uctx);
+}
+
+/** Write every query in a batch as a single multi-statement query
+ *
+ */
+static unlang_action_t sql_batch_submit(rlm_rcode_t *p_result, request_t *request, sql_redundant_ctx_t *redundant_ctx)
+{
+	rlm_sql_t const		*inst = redundant_ctx->inst;
+	sql_batch_t		*batch = redundant_ctx->batch;
+	char			*query_str;
+
+	batch->leader = redundant_ctx;
+	batch->submitted = true;
+
+	MEM(query_str = talloc_strdup(redundant_ctx, ""));
+	fr_dlist_foreach(&batch->entries, sql_redundant_ctx_t, entry) {
+		char const	*p = entry->query_vb->vb_strvalue;
+		size_t		len = entry->query_vb->vb_length;
+
+		/*
+		 *	Strip any terminator, we add our own.
+		 */
+		while ((len > 0) && (isspace((uint8_t)p[len - 1]) || (p[len - 1] == ';'))) len--;
+		if (len == 0) continue;
+
+		MEM(query_str = talloc_asprintf_append_buffer(query_str, "%.*s;\n", (int)len, p));
+	}
+
+	RDEBUG2("Writing batch of %u queries", fr_dlist_num_elements(&batch->entries));
+
+	MEM(redundant_ctx->query_ctx = fr_sql_query_alloc(redundant_ctx, inst, request,
+							  NULL, redundant_ctx->trunk,
+							  query_str, SQL_QUERY_OTHER));
+	talloc_steal(redundant_ctx->query_ctx, query_str);
+
+	if (unlang_function_repeat_set(request, sql_batch_query_resume) < 0) RETURN_MODULE_FAIL;
+
+	return unlang_function_push(request, inst->query, NULL, NULL, 0, UNLANG_SUB_FRAME, redundant_ctx->query_ctx);
+}
+
+/** Resume function called when the batch a request is waiting on has been written, or needs writing
+ *
+ * @param p_result	Result of current module call.
+ * @param priority	Unused.
+ * @param request	Current request.
+ * @param uctx		Current redundant sql context.
+ * @return one of the RLM_MODULE_* values.
+ */
+static unlang_action_t sql_batch_resume(rlm_rcode_t *p_result, UNUSED int *priority, request_t *request, void *uctx)
+{
+	sql_redundant_ctx_t	*redundant_ctx = talloc_get_type_abort(uctx, sql_redundant_ctx_t);
+	sql_batch_t		*batch = redundant_ctx->batch;
+	sql_rcode_t		rcode;
+
+	if (!batch->done) {
+		/*
+		 *	The batch's interval expired, and we're at the
+		 *	head, so write it for everyone.
+		 */
+		if (batch->flush && !batch->submitted && (fr_dlist_head(&batch->entries) == redundant_ctx)) {
+			return sql_batch_submit(p_result, request, redundant_ctx);
+		}
+
+		return UNLANG_ACTION_YIELD;
+	}
+
+	rcode = batch->rcode;
+	sql_batch_entry_remove(redundant_ctx);
+
+	if (rcode == RLM_SQL_OK) {
+		RDEBUG2("Query written as part of a batch");
+		RETURN_MODULE_OK;
+	}
+
+	RDEBUG2("Batch returned: %s, running queries individually",
+		fr_table_str_by_value(sql_rcode_description_table, rcode, "<INVALID>"));
+
+	return sql_redundant_query_push(p_result, request, redundant_ctx);
+}
+
 /** Resume function called after expansion of next query in a redundant list of queries
  *
  * @param p_result	Result of current module call.
@@ -1828,13 +2096,29 @@ static unlang_action_t mod_sql_redundant_resume(rlm_rcode_t *p_result, UNUSED in
 		rlm_sql_query_log(inst, call_env->filename.vb_strvalue, redundant_ctx->query_vb->vb_strvalue);
 	}
 
-	MEM(redundant_ctx->query_ctx = fr_sql_query_alloc(redundant_ctx, inst, request,
-							  redundant_ctx->handle, redundant_ctx->trunk,
-							  redundant_ctx->query_vb->vb_strvalue, SQL_QUERY_OTHER));
+	/*
+	 *	Only the first query is batched.  If the batch fails
+	 *	we fall back to running the queries individually.
+	 *	Prepared statements need their parameters binding
+	 *	so are always run on their own.
+	 */
+	if (redundant_ctx->batchable && (redundant_ctx->query_no == 0) && (redundant_ctx->query_vb->vb_length > 0) &&
+	    !sql_prepared_find(inst, redundant_ctx->query_vb->vb_strvalue)) {
+		switch (sql_batch_add(redundant_ctx->thread, redundant_ctx)) {
+		case 1:
+			return sql_batch_submit(p_result, request, redundant_ctx);
 
-	if (unlang_function_repeat_set(request, mod_sql_redundant_query_resume) < 0) RETURN_MODULE_FAIL;
+		case 0:
+			if (unlang_function_repeat_set(request, sql_batch_resume) < 0) RETURN_MODULE_FAIL;
+			return UNLANG_ACTION_YIELD;
 
-	return unlang_function_push(request, inst->query, NULL, NULL, 0, UNLANG_SUB_FRAME, redundant_ctx->query_ctx);
+		default:
+			RWARN("Failed adding query to batch, running it individually");
+			break;
+		}
+	}
+
+	return sql_redundant_query_push(p_result, request, redundant_ctx);
 }
 
 /**  Generic module call for failing between a bunch of queries.
@@ -1842,7 +2126,8 @@ static unlang_action_t mod_sql_redundant_resume(rlm_rcode_t *p_result, UNUSED in
  * Used for `accounting` and `send` module calls
  *
  */
-static unlang_action_t CC_HINT(nonnull) mod_sql_redundant(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t CC_HINT(nonnull) sql_redundant(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+						      bool batchable)
 {
 	rlm_sql_t const			*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_sql_t);
 	rlm_sql_thread_t		*thread = talloc_get_type_abort(mctx->thread, rlm_sql_thread_t);
@@ -1861,9 +2146,11 @@ static unlang_action_t CC_HINT(nonnull) mod_sql_redundant(rlm_rcode_t *p_result,
 	*redundant_ctx = (sql_redundant_ctx_t) {
 		.inst = inst,
 		.request = request,
+		.thread = thread,
 		.trunk = thread->trunk,
 		.call_env = call_env,
-		.query_no = 0
+		.query_no = 0,
+		.batchable = batchable
 	};
 	talloc_set_destructor(redundant_ctx, sql_redundant_ctx_free);
 
@@ -1886,6 +2173,21 @@ static unlang_action_t CC_HINT(nonnull) mod_sql_redundant(rlm_rcode_t *p_result,
 	return UNLANG_ACTION_PUSHED_CHILD;
 }
 
+static unlang_action_t CC_HINT(nonnull) mod_sql_redundant(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	return sql_redundant(p_result, mctx, request, false);
+}
+
+/** Run accounting queries, batching them with the queries of other requests if configured
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sql_t const			*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_sql_t);
+
+	return sql_redundant(p_result, mctx, request, inst->config.batch_size > 1);
+}
+
 static int logfile_call_env_parse(TALLOC_CTX *ctx, call_env_parsed_head_t *out, tmpl_rules_t const *t_rules,
 				  CONF_ITEM *ci,
 				  call_env_ctx_t const *cec, UNUSED call_env_parser_t const *rule)
@@ -1967,7 +2269,7 @@ static int query_call_env_parse(TALLOC_CTX *ctx, call_env_parsed_head_t *out, tm
 				CONF_ITEM *ci,
 				call_env_ctx_t const *cec, UNUSED call_env_parser_t const *rule)
 {
-	rlm_sql_t const		*inst = talloc_get_type_abort_const(cec->mi->data, rlm_sql_t);
+	rlm_sql_t		*inst = talloc_get_type_abort(cec->mi->data, rlm_sql_t);
 	CONF_SECTION const	*subcs = NULL;
 	CONF_PAIR const		*to_parse = NULL;
 	tmpl_t			*parsed_tmpl;
@@ -2019,15 +2321,22 @@ static int query_call_env_parse(TALLOC_CTX *ctx, call_env_parsed_head_t *out, tm
 										      sql_redundant_call_env_t, query)
 						     }));
 
-		slen = tmpl_afrom_substr(parsed_env, &parsed_tmpl,
-					 &FR_SBUFF_IN(cf_pair_value(to_parse), talloc_array_length(cf_pair_value(to_parse)) - 1),
-					 cf_pair_value_quote(to_parse), NULL, &our_rules);
-		if (slen <= 0) {
-			cf_canonicalize_error(to_parse, slen, "Failed parsing query", cf_pair_value(to_parse));
+		if (sql_prepared_from_cp(parsed_env, &parsed_tmpl, inst, to_parse, &our_rules) < 0) {
 		error:
 			call_env_parsed_free(out, parsed_env);
 			return -1;
 		}
+
+		if (!parsed_tmpl) {
+			slen = tmpl_afrom_substr(parsed_env, &parsed_tmpl,
+						 &FR_SBUFF_IN(cf_pair_value(to_parse),
+							      talloc_array_length(cf_pair_value(to_parse)) - 1),
+						 cf_pair_value_quote(to_parse), NULL, &our_rules);
+			if (slen <= 0) {
+				cf_canonicalize_error(to_parse, slen, "Failed parsing query", cf_pair_value(to_parse));
+				goto error;
+			}
+		}
 		if (tmpl_needs_resolving(parsed_tmpl) &&
 		    (tmpl_resolve(parsed_tmpl, &(tmpl_res_rules_t){ .dict_def = our_rules.attr.dict_def }) < 0)) {
 			cf_log_perr(to_parse, "Failed resolving query");
@@ -2128,6 +2437,24 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	}
 	inst->box_escape_func = sql_box_escape;
 
+	if (inst->config.batch_size > 1) {
+		if (!inst->driver->uses_trunks || !(inst->driver->flags & RLM_SQL_FLAGS_MULTI_STATEMENTS)) {
+			cf_log_err(conf, "Driver \"%s\" does not support batching queries", inst->driver->common.name);
+			return -1;
+		}
+
+		if (!fr_time_delta_ispos(inst->config.batch_interval)) {
+			cf_log_err(conf, "batch.interval must be greater than zero");
+			return -1;
+		}
+	}
+
+	if (inst->config.prepared_statements &&
+	    (!inst->driver->uses_trunks || !(inst->driver->flags & RLM_SQL_FLAGS_PREPARED_STATEMENTS))) {
+		cf_log_warn(conf, "Driver \"%s\" does not support prepared statements, queries will be expanded as text",
+			    inst->driver->common.name);
+	}
+
 	inst->ef = module_rlm_exfile_init(inst, conf, 256, fr_time_delta_from_sec(30), true, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
@@ -2172,9 +2499,44 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		 */
 		inst->config.trunk_conf.target_req_per_conn = 1;
 		inst->config.trunk_conf.max_req_per_conn = 1;
+
+		/*
+		 *	Connection limits shared between all threads.
+		 */
+		trunk_conf_shared_alloc(inst, &inst->config.trunk_conf);
+
+		/*
+		 *	The drivers open connections using the server
+		 *	in the instance config, so each replica gets a
+		 *	copy of the instance with its own server, and
+		 *	its own connection limits.
+		 */
+		if (inst->config.read_replicas) {
+			size_t i, num = talloc_array_length(inst->config.read_replicas);
+
+			MEM(inst->replicas = talloc_array(inst, rlm_sql_t *, num));
+			for (i = 0; i < num; i++) {
+				rlm_sql_t *replica;
+
+				MEM(replica = talloc_memdup(inst->replicas, inst, sizeof(*inst)));
+				talloc_set_name_const(replica, "rlm_sql_t");
+
+				replica->config.sql_server = inst->config.read_replicas[i];
+				replica->config.read_replicas = NULL;
+				replica->replicas = NULL;
+				trunk_conf_shared_alloc(replica, &replica->config.trunk_conf);
+
+				inst->replicas[i] = replica;
+			}
+		}
 		return 0;
 	}
 
+	if (inst->config.read_replicas) {
+		cf_log_warn(conf, "Driver \"%s\" does not support 'read_replica', all queries will use 'server'",
+			    inst->driver->common.name);
+	}
+
 	/*
 	 *	Initialise the connection pool for this instance
 	 */
@@ -2327,6 +2689,7 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 	}
 
 	t->inst = inst;
+	t->el = mctx->el;
 
 	if (!inst->driver->uses_trunks) return 0;
 
@@ -2334,6 +2697,28 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 				  &inst->config.trunk_conf, inst->name, t, false);
 	if (!t->trunk) return -1;
 
+	if (inst->replicas) {
+		size_t i, num = talloc_array_length(inst->replicas);
+
+		MEM(t->replicas = talloc_array(t, rlm_sql_thread_t *, num));
+		for (i = 0; i < num; i++) {
+			rlm_sql_thread_t *r;
+
+			MEM(r = talloc_zero(t->replicas, rlm_sql_thread_t));
+			r->inst = inst->replicas[i];
+			r->el = mctx->el;
+
+			r->trunk = trunk_alloc(r, mctx->el, &inst->driver->trunk_io_funcs,
+					       &r->inst->config.trunk_conf,
+					       talloc_asprintf(r, "%s - replica %s", inst->name,
+							       r->inst->config.sql_server),
+					       r, false);
+			if (!r->trunk) return -1;
+
+			t->replicas[i] = r;
+		}
+	}
+
 	return 0;
 }
 
@@ -2354,7 +2739,7 @@ static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
 static int call_env_parse(TALLOC_CTX *ctx, void *out, tmpl_rules_t const *t_rules, CONF_ITEM *ci,
 			  call_env_ctx_t const *cec, UNUSED call_env_parser_t const *rule)
 {
-	rlm_sql_t const		*inst = talloc_get_type_abort_const(cec->mi->data, rlm_sql_t);
+	rlm_sql_t		*inst = talloc_get_type_abort(cec->mi->data, rlm_sql_t);
 	tmpl_t			*parsed_tmpl;
 	CONF_PAIR const		*to_parse = cf_item_to_pair(ci);
 	tmpl_rules_t		our_rules = *t_rules;
@@ -2368,6 +2753,12 @@ static int call_env_parse(TALLOC_CTX *ctx, void *out, tmpl_rules_t const *t_rule
 	our_rules.escape.safe_for = SQL_SAFE_FOR;
 	our_rules.literals_safe_for = SQL_SAFE_FOR;
 
+	if (sql_prepared_from_cp(ctx, &parsed_tmpl, inst, to_parse, &our_rules) < 0) return -1;
+	if (parsed_tmpl) {
+		*(void **)out = parsed_tmpl;
+		return 0;
+	}
+
 	if (tmpl_afrom_substr(ctx, &parsed_tmpl,
 			      &FR_SBUFF_IN(cf_pair_value(to_parse), talloc_array_length(cf_pair_value(to_parse)) - 1),
 			      cf_pair_value_quote(to_parse), NULL, &our_rules) < 0) return -1;
@@ -2414,7 +2805,7 @@ module_rlm_t rlm_sql = {
 			/*
 			 *	Hack to support old configurations
 			 */
-			{ .section = SECTION_NAME("accounting", CF_IDENT_ANY), .method = mod_sql_redundant, .method_env = &accounting_method_env },
+			{ .section = SECTION_NAME("accounting", CF_IDENT_ANY), .method = mod_accounting, .method_env = &accounting_method_env },
 			{ .section = SECTION_NAME("authorize", CF_IDENT_ANY), .method = mod_authorize, .method_env = &authorize_method_env },
 
 			{ .section = SECTION_NAME("recv", CF_IDENT_ANY), .method = mod_authorize, .method_env = &authorize_method_env },
@@ -76,6 +76,7 @@ typedef struct {
 	char const 		*sql_login;			//!< Login credentials to use.
 	char const 		*sql_password;			//!< Login password to use.
 	char const 		*sql_db;			//!< Database to run queries against.
+	char const		**read_replicas;		//!< Servers to run SELECT queries against.
 
 	char const		*group_attribute;		//!< Name of the group attribute.
 
@@ -96,18 +97,33 @@ typedef struct {
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
 
+	uint32_t		batch_size;			//!< Maximum number of accounting queries to
+								//!< write in a single round trip.
+	fr_time_delta_t		batch_interval;			//!< Maximum time an accounting query waits
+								//!< for its batch to fill.
+
+	bool			prepared_statements;		//!< Convert query templates to parameterised
+								//!< statements where the driver supports it.
+
 	trunk_conf_t		trunk_conf;			//!< Configuration for trunk connections.
 } rlm_sql_config_t;
 
 typedef struct sql_inst rlm_sql_t;
 
+typedef struct sql_batch_s sql_batch_t;
+
 /*
  *	Per-thread instance data structure
  */
-typedef struct {
+typedef struct rlm_sql_thread_s {
 	trunk_t		*trunk;				//!< Trunk connection for this thread.
 	rlm_sql_t const		*inst;				//!< Module instance data.
 	void			*sql_escape_arg;		//!< Thread specific argument to be passed to escape function.
+	fr_event_list_t		*el;				//!< Event list for this thread.
+	sql_batch_t		*batch;				//!< Accounting queries waiting to be written.
+	fr_event_timer_t const	*batch_ev;			//!< Writes a partial batch once batch_interval expires.
+	struct rlm_sql_thread_s	**replicas;			//!< One per read replica, each with its own trunk.
+	unsigned int		next_replica;			//!< Where to start looking for the least loaded replica.
 } rlm_sql_thread_t;
 
 typedef struct {
@@ -122,6 +138,18 @@ typedef enum {
 	SQL_QUERY_OTHER
 } fr_sql_query_type_t;
 
+/** A query template converted to a parameterised statement
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;				//!< Entry in the instance's tree of statements.
+	char const		*query_str;			//!< Statement text, with $<n> placeholders.
+	char const		*name;				//!< Name the statement is prepared under.
+	tmpl_t			**params;			//!< Expansions producing the value of each parameter.
+	unsigned int		num_params;			//!< Number of parameters.
+	unsigned int		id;				//!< Unique index of the statement within the instance.
+} fr_sql_prepared_t;
+
 /** Status of an SQL query
  */
 typedef enum {
@@ -141,10 +169,17 @@ typedef struct {
 	trunk_connection_t	*tconn;				//!< Trunk connection this query is being run on.
 	trunk_request_t	*treq;				//!< Trunk request for this query.
 	char const		*query_str;			//!< Query string to run.
+	fr_sql_prepared_t const	*prepared;			//!< Statement query_str was converted to, if any.
+	fr_value_box_list_t	*param_values;			//!< Expanded parameter values, prior to binding.
+	char const		**params;			//!< Parameter values bound to the statement.
 	fr_sql_query_type_t	type;				//!< Type of query.
 	fr_sql_query_status_t	status;				//!< Status of the query.
 	sql_rcode_t		rcode;				//!< Result code.
 	rlm_sql_row_t		row;				//!< Row data from the last query.
+	rlm_sql_row_t		*rows;				//!< Rows returned by the driver's sql_fetch_rows.
+	size_t			num_rows;			//!< How many entries there are in rows.
+	size_t			cur_row;			//!< Next entry in rows to return.
+	bool			rows_fetched;			//!< sql_fetch_rows has been called.
 } fr_sql_query_t;
 
 /** Context used when fetching attribute value pairs as a map list
@@ -169,6 +204,11 @@ extern size_t sql_rcode_table_len;
  */
 #define RLM_SQL_RCODE_FLAGS_ALT_QUERY	1			//!< Can distinguish between other errors and those
 								//!< resulting from a unique key violation.
+#define RLM_SQL_FLAGS_MULTI_STATEMENTS	2			//!< Can run multiple ';' separated statements
+								//!< as a single query, and reports an error if
+								//!< any of them fail.
+#define RLM_SQL_FLAGS_PREPARED_STATEMENTS	4		//!< Can run parameterised statements using
+								//!< $<n> placeholders.
 
 /** Retrieve errors from the last query operation
  *
@@ -216,6 +256,15 @@ typedef struct {
 	int		(*sql_affected_rows)(fr_sql_query_t *query_ctx, rlm_sql_config_t const *config);
 
 	unlang_function_t	sql_fetch_row;
+
+	/** Return every remaining row of the result set in one call
+	 *
+	 * Optional.  For drivers which buffer the whole result set.  Rows must
+	 * remain valid until the query is finished.  If provided, sql_fetch_row
+	 * is not called for the query.
+	 */
+	sql_rcode_t	(*sql_fetch_rows)(rlm_sql_row_t **out, size_t *num_rows, fr_sql_query_t *query_ctx,
+					  rlm_sql_config_t const *config);
 	sql_rcode_t	(*sql_fields)(char const **out[], fr_sql_query_t *query_ctx, rlm_sql_config_t const *config);
 	sql_rcode_t	(*sql_free_result)(fr_sql_query_t *query_ctx, rlm_sql_config_t const *config);
 
@@ -249,11 +298,17 @@ struct sql_inst {
 	unlang_function_t	query;
 	unlang_function_t	select;
 	unlang_function_t	fetch_row;
+	fr_rb_tree_t		*prepared;		//!< Statements converted from query templates,
+							//!< keyed by their text.
+	unsigned int		num_prepared;		//!< How many statements have been converted.
 	fr_sql_query_t		*(*query_alloc)(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle, trunk_t *trunk, char const *query_str, fr_sql_query_type_t type);
 
 	char const		*name;			//!< Module instance name.
 	fr_dict_attr_t const	*group_da;		//!< Group dictionary attribute.
 	module_instance_t const	*mi;			//!< Module instance data for thread lookups.
+
+	rlm_sql_t		**replicas;		//!< Copies of this instance, with "server" set to
+							//!< each read replica.  Used to open their connections.
 };
 
 void		*sql_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
@@ -265,6 +320,9 @@ unlang_action_t rlm_sql_trunk_query(rlm_rcode_t *p_result, UNUSED int *priority,
 unlang_action_t rlm_sql_fetch_row(rlm_rcode_t *p_result, UNUSED int *priority, request_t *request, void *uctx);
 void		rlm_sql_print_error(rlm_sql_t const *inst, request_t *request, fr_sql_query_t *query_ctx, bool force_debug);
 fr_sql_query_t *fr_sql_query_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle, trunk_t *trunk, char const *query_str, fr_sql_query_type_t type);
+int		sql_prepared_from_cp(TALLOC_CTX *ctx, tmpl_t **out, rlm_sql_t *inst, CONF_PAIR const *cp,
+				     tmpl_rules_t const *t_rules);
+fr_sql_prepared_t const *sql_prepared_find(rlm_sql_t const *inst, char const *query_str);
 
 /*
  *	sql_state.c
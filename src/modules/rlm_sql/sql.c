@@ -30,6 +30,7 @@ RCSID("$Id$")
 
 #include	<freeradius-devel/server/base.h>
 #include	<freeradius-devel/util/debug.h>
+#include	<freeradius-devel/unlang/tmpl.h>
 
 #include	<sys/file.h>
 #include	<sys/stat.h>
@@ -290,11 +291,56 @@ static int sql_pair_afrom_row(TALLOC_CTX *ctx, request_t *request, fr_pair_list_
 }
 #endif
 
+/** Forget any rows from a previous query which used this query context
+ *
+ */
+static inline void sql_query_rows_reset(fr_sql_query_t *query_ctx)
+{
+	query_ctx->row = NULL;
+	query_ctx->rows = NULL;
+	query_ctx->num_rows = 0;
+	query_ctx->cur_row = 0;
+	query_ctx->rows_fetched = false;
+}
+
+/** Return the next row from the rows retrieved by the driver's sql_fetch_rows
+ *
+ */
+static void sql_fetch_buffered_row(fr_sql_query_t *query_ctx)
+{
+	rlm_sql_t const	*inst = query_ctx->inst;
+
+	query_ctx->row = NULL;
+
+	if (!query_ctx->rows_fetched) {
+		query_ctx->rows_fetched = true;
+		query_ctx->rcode = (inst->driver->sql_fetch_rows)(&query_ctx->rows, &query_ctx->num_rows,
+								  query_ctx, &inst->config);
+		if (query_ctx->rcode != RLM_SQL_OK) {
+			query_ctx->rows = NULL;
+			query_ctx->num_rows = 0;
+			return;
+		}
+	}
+
+	if (query_ctx->cur_row >= query_ctx->num_rows) {
+		query_ctx->rcode = RLM_SQL_NO_MORE_ROWS;
+		return;
+	}
+
+	query_ctx->row = query_ctx->rows[query_ctx->cur_row++];
+	query_ctx->rcode = RLM_SQL_OK;
+}
+
 /** Call the driver's sql_fetch_row function
  *
  * Calls the driver's sql_fetch_row logging any errors. On success, will
  * write row data to ``uctx->row``.
  *
+ * If the driver provides sql_fetch_rows, the first call retrieves every
+ * remaining row at once, and later calls return rows from that batch,
+ * without calling the driver, or copying the row.
+ *
  * The rcode within the query context is updated to
  *	- #RLM_SQL_OK on success.
  *	- other #sql_rcode_t constants on error.
@@ -322,7 +368,12 @@ unlang_action_t rlm_sql_fetch_row(rlm_rcode_t *p_result, UNUSED int *priority, r
 	 *	may require the original connection to free up queries or
 	 *	result sets associated with that connection.
 	 */
-	(inst->driver->sql_fetch_row)(p_result, NULL, request, query_ctx);
+	if (inst->driver->sql_fetch_rows) {
+		sql_fetch_buffered_row(query_ctx);
+	} else {
+		(inst->driver->sql_fetch_row)(p_result, NULL, request, query_ctx);
+	}
+
 	switch (query_ctx->rcode) {
 	case RLM_SQL_OK:
 		fr_assert(query_ctx->row != NULL);
@@ -427,6 +478,193 @@ fr_sql_query_t *fr_sql_query_alloc(TALLOC_CTX *ctx, rlm_sql_t const *inst, reque
 	return query;
 }
 
+/** Order prepared statements by their text
+ *
+ */
+static int8_t sql_prepared_cmp(void const *one, void const *two)
+{
+	fr_sql_prepared_t const *a = one, *b = two;
+
+	return CMP(strcmp(a->query_str, b->query_str), 0);
+}
+
+/** Find the end of an expansion
+ *
+ * @param[in] p		The first character after the opening '{'.
+ * @return
+ *	- The closing '}' of the expansion.
+ *	- NULL if the expansion isn't terminated, or contains escape sequences.
+ */
+static char const *sql_expansion_end(char const *p)
+{
+	unsigned int	depth = 1;
+	char		quote;
+
+	while (*p) {
+		switch (*p) {
+		case '\\':
+			return NULL;
+
+		case '{':
+			depth++;
+			break;
+
+		case '}':
+			if (--depth == 0) return p;
+			break;
+
+		case '\'':
+		case '"':
+			quote = *p++;
+			while (*p && (*p != quote)) {
+				if (*p == '\\') return NULL;
+				p++;
+			}
+			if (!*p) return NULL;
+			break;
+
+		default:
+			break;
+		}
+		p++;
+	}
+
+	return NULL;
+}
+
+/** Convert a query template to a parameterised statement
+ *
+ * Each single quoted expansion in the query, i.e. '%{...}', is replaced with a
+ * $<n> placeholder, and parsed as a separate template which produces the value
+ * of that parameter.  Queries containing any other expansions, escape
+ * sequences, or '$' characters are left for the caller to parse as normal.
+ *
+ * Statements are recorded in the instance so that the query string produced by
+ * expanding the returned template can be matched back to its parameters.
+ *
+ * @param[in] ctx	to allocate the statement template in.
+ * @param[out] out	Literal template containing the statement text.
+ *			Left as NULL if the query can't be converted.
+ * @param[in] inst	Module instance the statement belongs to.
+ * @param[in] cp	Pair containing the query.
+ * @param[in] t_rules	Rules used to parse the statement and its parameters.
+ * @return
+ *	- 0 on success, or if the query is unsuitable for conversion.
+ *	- -1 on error.
+ */
+int sql_prepared_from_cp(TALLOC_CTX *ctx, tmpl_t **out, rlm_sql_t *inst, CONF_PAIR const *cp,
+			 tmpl_rules_t const *t_rules)
+{
+	char const		*query = cf_pair_value(cp);
+	char const		*p, *start, *end;
+	char			*stmt;
+	fr_sql_prepared_t	*prepared, *found;
+	tmpl_rules_t		param_rules = *t_rules;
+	unsigned int		i;
+
+	*out = NULL;
+
+	if (!inst->config.prepared_statements || !inst->driver->uses_trunks ||
+	    !(inst->driver->flags & RLM_SQL_FLAGS_PREPARED_STATEMENTS)) return 0;
+
+	if (cf_pair_value_quote(cp) != T_DOUBLE_QUOTED_STRING) return 0;
+
+	/*
+	 *	Parameter values are passed to the server separately
+	 *	from the statement, so they're never escaped.
+	 */
+	param_rules.escape = (tmpl_escape_t){};
+	param_rules.literals_safe_for = 0;
+
+	MEM(prepared = talloc_zero(inst, fr_sql_prepared_t));
+	MEM(stmt = talloc_strdup(prepared, ""));
+
+	p = start = query;
+	while (*p) {
+		if ((*p == '\\') || (*p == '$')) {
+		unsuitable:
+			talloc_free(prepared);
+			return 0;
+		}
+
+		if (*p != '%') {
+			p++;
+			continue;
+		}
+
+		if ((p == query) || (p[-1] != '\'') || (p[1] != '{')) goto unsuitable;
+
+		end = sql_expansion_end(p + 2);
+		if (!end || (end[1] != '\'')) goto unsuitable;
+
+		MEM(stmt = talloc_asprintf_append_buffer(stmt, "%.*s$%u", (int)((p - 1) - start), start,
+							 prepared->num_params + 1));
+
+		MEM(prepared->params = talloc_realloc(prepared, prepared->params, tmpl_t *, prepared->num_params + 1));
+		if (tmpl_afrom_substr(prepared, &prepared->params[prepared->num_params],
+				      &FR_SBUFF_IN(p, (end + 1) - p), T_DOUBLE_QUOTED_STRING, NULL, &param_rules) <= 0) {
+			cf_log_perr(cp, "Failed parsing query parameter");
+		error:
+			talloc_free(prepared);
+			return -1;
+		}
+		if (tmpl_needs_resolving(prepared->params[prepared->num_params]) &&
+		    (tmpl_resolve(prepared->params[prepared->num_params],
+				  &(tmpl_res_rules_t){ .dict_def = param_rules.attr.dict_def }) < 0)) {
+			cf_log_perr(cp, "Failed resolving query parameter");
+			goto error;
+		}
+		prepared->num_params++;
+
+		p = start = end + 2;
+	}
+
+	if (prepared->num_params == 0) goto unsuitable;
+
+	MEM(stmt = talloc_strdup_append_buffer(stmt, start));
+	prepared->query_str = stmt;
+
+	if (!inst->prepared) {
+		MEM(inst->prepared = fr_rb_inline_talloc_alloc(inst, fr_sql_prepared_t, node, sql_prepared_cmp, NULL));
+	}
+
+	/*
+	 *	The same query is parsed once for every section the
+	 *	module is called from.  If the parameters match we can
+	 *	share the statement, otherwise the query string alone
+	 *	can't identify which parameters to bind, so leave this
+	 *	one as a normal query.
+	 */
+	found = fr_rb_find(inst->prepared, prepared);
+	if (found) {
+		if (found->num_params != prepared->num_params) {
+		conflict:
+			cf_log_debug(cp, "Query conflicts with an existing prepared statement, "
+				     "it will not be prepared");
+			goto unsuitable;
+		}
+		for (i = 0; i < found->num_params; i++) {
+			if (strcmp(found->params[i]->name, prepared->params[i]->name) != 0) goto conflict;
+		}
+		talloc_free(prepared);
+		prepared = found;
+	} else {
+		prepared->id = inst->num_prepared++;
+		MEM(prepared->name = talloc_asprintf(prepared, "fr_%u", prepared->id));
+		fr_rb_insert(inst->prepared, prepared);
+	}
+
+	if (tmpl_afrom_substr(ctx, out, &FR_SBUFF_IN(prepared->query_str, talloc_array_length(prepared->query_str) - 1),
+			      T_SINGLE_QUOTED_STRING, NULL, t_rules) <= 0) {
+		cf_log_perr(cp, "Failed parsing prepared statement");
+		return -1;
+	}
+
+	cf_log_debug(cp, "Prepared as statement \"%s\" with %u parameter(s)", prepared->name, prepared->num_params);
+
+	return 0;
+}
+
 /** Call the driver's sql_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_query)(handle, &inst->config);``
@@ -453,6 +691,8 @@ unlang_action_t rlm_sql_query(rlm_rcode_t *p_result, UNUSED int *priority, reque
 	/* Caller should check they have a valid handle */
 	fr_assert(query_ctx->handle);
 
+	sql_query_rows_reset(query_ctx);
+
 	/* There's no query to run, return an error */
 	if (query_ctx->query_str[0] == '\0') {
 		if (request) REDEBUG("Zero length query");
@@ -561,6 +801,123 @@ static void sql_trunk_query_cancel(UNUSED request_t *request, UNUSED fr_signal_t
 	query_ctx->treq = NULL;
 }
 
+/** Find the prepared statement a query string was produced from
+ *
+ * @param[in] inst	Module instance to search.
+ * @param[in] query_str	Expanded query.
+ * @return
+ *	- The prepared statement.
+ *	- NULL if the query wasn't produced from a prepared statement template.
+ */
+fr_sql_prepared_t const *sql_prepared_find(rlm_sql_t const *inst, char const *query_str)
+{
+	if (!inst->prepared) return NULL;
+
+	return fr_rb_find(inst->prepared, &(fr_sql_prepared_t){ .query_str = query_str });
+}
+
+/** Convert the expanded parameter values to strings, then submit the statement
+ *
+ */
+static unlang_action_t sql_prepared_bind(rlm_rcode_t *p_result, int *priority, request_t *request, void *uctx)
+{
+	fr_sql_query_t		*query_ctx = talloc_get_type_abort(uctx, fr_sql_query_t);
+	fr_sql_prepared_t const	*prepared = query_ctx->prepared;
+	char const		**params;
+	char			*value;
+	unsigned int		i;
+
+	MEM(params = talloc_array(query_ctx, char const *, prepared->num_params));
+	for (i = 0; i < prepared->num_params; i++) {
+		value = fr_value_box_list_aprint(params, &query_ctx->param_values[i], NULL, NULL);
+		if (!value) MEM(value = talloc_typed_strdup(params, ""));
+
+		RDEBUG3("$%u = '%s'", i + 1, value);
+		params[i] = value;
+	}
+	TALLOC_FREE(query_ctx->param_values);
+	query_ctx->params = params;
+
+	return rlm_sql_trunk_query(p_result, priority, request, uctx);
+}
+
+/** Expand the parameter values of a prepared statement
+ *
+ */
+static unlang_action_t sql_prepared_push(rlm_rcode_t *p_result, request_t *request, fr_sql_query_t *query_ctx,
+					 fr_sql_prepared_t const *prepared)
+{
+	unsigned int	i;
+
+	if (unlang_function_repeat_set(request, sql_prepared_bind) < 0) {
+		REDEBUG("Query matches prepared statement \"%s\", but its parameters can't be expanded here",
+			prepared->name);
+		RETURN_MODULE_FAIL;
+	}
+
+	query_ctx->prepared = prepared;
+	MEM(query_ctx->param_values = talloc_array(query_ctx, fr_value_box_list_t, prepared->num_params));
+	for (i = 0; i < prepared->num_params; i++) {
+		fr_value_box_list_init(&query_ctx->param_values[i]);
+		if (unlang_tmpl_push(query_ctx->param_values, &query_ctx->param_values[i], request,
+				     prepared->params[i], NULL) < 0) RETURN_MODULE_FAIL;
+	}
+
+	*p_result = RLM_MODULE_OK;
+	return UNLANG_ACTION_PUSHED_CHILD;
+}
+
+/** Pick the trunk to run a SELECT on
+ *
+ * Replicas without an active connection are skipped.  Of the others,
+ * the one with the fewest outstanding requests per connection is used.
+ * A slow replica builds up outstanding requests, so this favours the
+ * replicas which are answering fastest.
+ *
+ * If no replica can take the query, it goes to the primary.
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] primary	trunk the query was going to be run on.
+ * @return the trunk to use.
+ */
+static trunk_t *sql_select_trunk(rlm_sql_t const *inst, trunk_t *primary)
+{
+	rlm_sql_thread_t	*thread = talloc_get_type_abort(module_thread(inst->mi)->data, rlm_sql_thread_t);
+	trunk_t			*best = primary;
+	uint64_t		best_load = UINT64_MAX;
+	size_t			i, num;
+
+	/*
+	 *	Only re-route queries for the thread's own trunk.
+	 */
+	if (!thread->replicas || (primary != thread->trunk)) return primary;
+
+	num = talloc_array_length(thread->replicas);
+
+	/*
+	 *	Rotate the starting point, so that idle replicas
+	 *	share the load.
+	 */
+	thread->next_replica++;
+
+	for (i = 0; i < num; i++) {
+		trunk_t		*trunk = thread->replicas[(thread->next_replica + i) % num]->trunk;
+		uint16_t	active;
+		uint64_t	load;
+
+		active = trunk_connection_count_by_state(trunk, TRUNK_CONN_ACTIVE);
+		if (!active) continue;
+
+		load = trunk_request_count_by_state(trunk, TRUNK_CONN_ALL, TRUNK_REQUEST_STATE_ALL) * 1024 / active;
+		if (load < best_load) {
+			best = trunk;
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
 /** Submit an SQL query using a trunk connection.
  *
  * @param p_result	Result of current module call.
@@ -576,12 +933,25 @@ unlang_action_t rlm_sql_trunk_query(rlm_rcode_t *p_result, UNUSED int *priority,
 
 	fr_assert(query_ctx->trunk);
 
+	sql_query_rows_reset(query_ctx);
+
 	/* There's no query to run, return an error */
 	if (query_ctx->query_str[0] == '\0') {
 		if (request) REDEBUG("Zero length query");
 		RETURN_MODULE_INVALID;
 	}
 
+	/*
+	 *	Queries produced from a prepared statement template
+	 *	need their parameter values expanding before they're
+	 *	sent.
+	 */
+	if (request && !query_ctx->prepared) {
+		fr_sql_prepared_t const	*prepared = sql_prepared_find(query_ctx->inst, query_ctx->query_str);
+
+		if (prepared) return sql_prepared_push(p_result, request, query_ctx, prepared);
+	}
+
 	/*
 	 *	If the query already has a treq, and that is not in the "init" state
 	 *	then this is part of an ongoing transaction and needs requeueing
@@ -590,6 +960,13 @@ unlang_action_t rlm_sql_trunk_query(rlm_rcode_t *p_result, UNUSED int *priority,
 	if (query_ctx->treq && query_ctx->treq->state != TRUNK_REQUEST_STATE_INIT) {
 		status = trunk_request_requeue(query_ctx->treq);
 	} else {
+		/*
+		 *	SELECTs can be answered by any replica.
+		 */
+		if ((query_ctx->type == SQL_QUERY_SELECT) && query_ctx->inst->replicas) {
+			query_ctx->trunk = sql_select_trunk(query_ctx->inst, query_ctx->trunk);
+		}
+
 		status = trunk_request_enqueue(&query_ctx->treq, query_ctx->trunk, request, query_ctx, NULL);
 	}
 	switch (status) {
@@ -638,6 +1015,8 @@ unlang_action_t rlm_sql_select_query(rlm_rcode_t *p_result, UNUSED int *priority
 	/* Caller should check they have a valid handle */
 	fr_assert(query_ctx->handle);
 
+	sql_query_rows_reset(query_ctx);
+
 	/* There's no query to run, return an error */
 	if (query_ctx->query_str[0] == '\0') {
 		if (request) REDEBUG("Zero length query");
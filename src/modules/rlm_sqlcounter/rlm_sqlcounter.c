@@ -31,8 +31,10 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/unlang/function.h>
+#include <freeradius-devel/util/hash.h>
 
 #include <ctype.h>
+#include <pthread.h>
 
 /*
  *	Note: When your counter spans more than 1 period (ie 3 months
@@ -52,6 +54,39 @@ RCSID("$Id$")
  *	Reset Time.
  */
 
+/** Usage of a single session, as last seen in an accounting packet
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the counter's list of sessions.
+	char const		*id;		//!< Session identifier.
+	uint64_t		last;		//!< Last cumulative value seen for the session.
+} sqlcounter_session_t;
+
+/** Cached counter value for a single key
+ *
+ * The value of the counter is the result of the last SQL query, plus any
+ * usage reported in accounting packets since then.
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+	char const		*key;		//!< Counter key, usually the User-Name.
+	uint64_t		sql_value;	//!< Value returned by the last SQL query.
+	uint64_t		delta;		//!< Usage reported by accounting since the SQL query.
+	fr_time_t		reconciled;	//!< When the SQL query was last run.
+	fr_time_t		period;		//!< Start of the reset period the SQL query was run for.
+	fr_dlist_head_t		sessions;	//!< Sessions contributing to delta.
+} sqlcounter_entry_t;
+
+/** Counter cache shared between all threads
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	fr_hash_table_t		*ht;		//!< Counter entries, keyed by key.
+	fr_dlist_head_t		lru;		//!< Counter entries, most recently used first.
+} sqlcounter_mutable_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -74,10 +109,25 @@ typedef struct {
 					///< period allow for that in setting the reply attribute.
 	bool		utc;		//!< Use UTC time.
 
+	struct {
+		bool		enable;			//!< Maintain counters in memory.
+		fr_time_delta_t	reconcile_interval;	//!< How often to re-read counters from SQL.
+		uint32_t	max_entries;		//!< Maximum number of counters to hold.
+	} cache;
+
+	sqlcounter_mutable_t	*mutable;	//!< Counter cache.
+
 	fr_time_t	reset_time;
 	fr_time_t	last_reset;
 } rlm_sqlcounter_t;
 
+static const conf_parser_t cache_config[] = {
+	{ FR_CONF_OFFSET("enable", rlm_sqlcounter_t, cache.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("reconcile_interval", rlm_sqlcounter_t, cache.reconcile_interval), .dflt = "300" },
+	{ FR_CONF_OFFSET("max_entries", rlm_sqlcounter_t, cache.max_entries), .dflt = "65536" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("sql_module_instance", CONF_FLAG_REQUIRED, rlm_sqlcounter_t, sql_name) },
 
@@ -98,15 +148,24 @@ static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET_FLAGS("counter_name", CONF_FLAG_ATTRIBUTE | CONF_FLAG_REQUIRED, rlm_sqlcounter_t, counter_attr) },
 	{ FR_CONF_OFFSET_FLAGS("check_name", CONF_FLAG_ATTRIBUTE | CONF_FLAG_REQUIRED, rlm_sqlcounter_t, limit_attr) },
 
+	{ FR_CONF_POINTER("cache", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) cache_config },
+
 	CONF_PARSER_TERMINATOR
 };
 
 typedef struct {
+	fr_value_box_t	key;			//!< Key of the counter, used for the cache.
 	xlat_exp_head_t	*query_xlat;		//!< Tokenized xlat to run query.
 	tmpl_t		*reply_attr;		//!< Attribute to write timeout to.
 	tmpl_t		*reply_msg_attr;	//!< Attribute to write reply message to.
 } sqlcounter_call_env_t;
 
+typedef struct {
+	fr_value_box_t	key;			//!< Key of the counter to update.
+	fr_value_box_t	increment;		//!< Usage to add to the counter.
+	fr_value_box_t	session_id;		//!< If set, increment is cumulative for this session.
+} sqlcounter_acct_call_env_t;
+
 static fr_dict_t const *dict_freeradius;
 
 extern fr_dict_autoload_t rlm_sqlcounter_dict[];
@@ -247,38 +306,127 @@ static int find_prev_reset(rlm_sqlcounter_t *inst, fr_time_t now)
 	return ret;
 }
 
+static uint32_t sqlcounter_entry_hash(void const *data)
+{
+	sqlcounter_entry_t const *entry = data;
+
+	return fr_hash_string(entry->key);
+}
+
+static int8_t sqlcounter_entry_cmp(void const *one, void const *two)
+{
+	sqlcounter_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->key, b->key);
+	return CMP(ret, 0);
+}
+
+/** Find the cached counter for a key
+ *
+ * @note Must be called with the mutex held.
+ */
+static inline sqlcounter_entry_t *sqlcounter_cache_find(sqlcounter_mutable_t *mutable, char const *key)
+{
+	return fr_hash_table_find(mutable->ht, &(sqlcounter_entry_t){ .key = key });
+}
+
+/** Return the cached value of a counter, if it's still current
+ *
+ * @param[out] out	Value of the counter.
+ * @param[in] inst	Module instance.
+ * @param[in] key	Of the counter.
+ * @param[in] now	The current time.
+ * @return
+ *	- true if the counter was found, and didn't need reconciling.
+ *	- false if the SQL query needs to be run.
+ */
+static bool sqlcounter_cache_get(uint64_t *out, rlm_sqlcounter_t const *inst, char const *key, fr_time_t now)
+{
+	sqlcounter_mutable_t	*mutable = inst->mutable;
+	sqlcounter_entry_t	*entry;
+	bool			found = false;
+
+	pthread_mutex_lock(&mutable->mutex);
+	entry = sqlcounter_cache_find(mutable, key);
+	if (entry && fr_time_eq(entry->period, inst->last_reset) &&
+	    fr_time_delta_lt(fr_time_sub(now, entry->reconciled), inst->cache.reconcile_interval)) {
+		*out = entry->sql_value + entry->delta;
+		fr_dlist_remove(&mutable->lru, entry);
+		fr_dlist_insert_head(&mutable->lru, entry);
+		found = true;
+	}
+	pthread_mutex_unlock(&mutable->mutex);
+
+	return found;
+}
+
+/** Record the value of a counter retrieved from SQL
+ *
+ * Usage reported by accounting before this point is assumed to be included
+ * in the SQL value, so the accumulated delta is discarded.
+ */
+static void sqlcounter_cache_set(rlm_sqlcounter_t const *inst, char const *key, uint64_t value, fr_time_t now)
+{
+	sqlcounter_mutable_t	*mutable = inst->mutable;
+	sqlcounter_entry_t	*entry;
+
+	pthread_mutex_lock(&mutable->mutex);
+	entry = sqlcounter_cache_find(mutable, key);
+	if (!entry) {
+		/*
+		 *	Make room by evicting the least recently used counter.
+		 */
+		if (fr_hash_table_num_elements(mutable->ht) >= inst->cache.max_entries) {
+			sqlcounter_entry_t *old = fr_dlist_pop_tail(&mutable->lru);
+
+			if (old) fr_hash_table_delete(mutable->ht, old);
+		}
+
+		MEM(entry = talloc_zero(mutable, sqlcounter_entry_t));
+		entry->key = talloc_strdup(entry, key);
+		fr_dlist_init(&entry->sessions, sqlcounter_session_t, entry);
+		if (!fr_hash_table_insert(mutable->ht, entry)) {
+			talloc_free(entry);
+			pthread_mutex_unlock(&mutable->mutex);
+			return;
+		}
+	} else {
+		fr_dlist_remove(&mutable->lru, entry);
+	}
+
+	entry->sql_value = value;
+	entry->delta = 0;
+	entry->reconciled = now;
+	entry->period = inst->last_reset;
+	fr_dlist_insert_head(&mutable->lru, entry);
+	pthread_mutex_unlock(&mutable->mutex);
+}
+
 typedef struct {
 	bool			last_success;
 	fr_value_box_list_t	result;
 	rlm_sqlcounter_t	*inst;
 	sqlcounter_call_env_t	*env;
 	fr_pair_t		*limit;
+	bool			cache;		//!< Store the result in the counter cache.
 } sqlcounter_rctx_t;
 
-/** Handle the result of calling the SQL query to retrieve the `counter` value.
+/** Compare the `counter` value with the `limit`
  *
  * Create / update the `counter` attribute in the control list
  * If `counter` > `limit`, optionally populate a reply message and return RLM_MODULE_REJECT.
  * Otherwise, optionally populate a reply attribute with the value of `limit` - `counter` and return RLM_MODULE_UPDATED.
  * If no reply attribute is set, return RLM_MODULE_OK.
  */
-static unlang_action_t mod_authorize_resume(rlm_rcode_t *p_result, UNUSED int *priority, request_t *request, void *uctx)
+static unlang_action_t sqlcounter_check(rlm_rcode_t *p_result, request_t *request, rlm_sqlcounter_t const *inst,
+					sqlcounter_call_env_t *env, fr_pair_t *limit, uint64_t counter)
 {
-	sqlcounter_rctx_t	*rctx = talloc_get_type_abort(uctx, sqlcounter_rctx_t);
-	rlm_sqlcounter_t	*inst = rctx->inst;
-	sqlcounter_call_env_t	*env = rctx->env;
-	fr_value_box_t		*sql_result = fr_value_box_list_pop_head(&rctx->result);
-	uint64_t		counter, res;
-	fr_pair_t		*vp, *limit = rctx->limit;
+	uint64_t		res;
+	fr_pair_t		*vp;
 	int			ret;
 	char			msg[128];
 
-	if (!sql_result || (sscanf(sql_result->vb_strvalue, "%" PRIu64, &counter) != 1)) {
-		RDEBUG2("No integer found in result string \"%pV\".  May be first session, setting counter to 0",
-			sql_result);
-		counter = 0;
-	}
-
 	/*
 	 *	Add the counter to the control list
 	 */
@@ -375,6 +523,26 @@ static unlang_action_t mod_authorize_resume(rlm_rcode_t *p_result, UNUSED int *p
 	RETURN_MODULE_OK;
 }
 
+/** Handle the result of calling the SQL query to retrieve the `counter` value.
+ *
+ */
+static unlang_action_t mod_authorize_resume(rlm_rcode_t *p_result, UNUSED int *priority, request_t *request, void *uctx)
+{
+	sqlcounter_rctx_t	*rctx = talloc_get_type_abort(uctx, sqlcounter_rctx_t);
+	fr_value_box_t		*sql_result = fr_value_box_list_pop_head(&rctx->result);
+	uint64_t		counter;
+
+	if (!sql_result || (sscanf(sql_result->vb_strvalue, "%" PRIu64, &counter) != 1)) {
+		RDEBUG2("No integer found in result string \"%pV\".  May be first session, setting counter to 0",
+			sql_result);
+		counter = 0;
+	}
+
+	if (rctx->cache) sqlcounter_cache_set(rctx->inst, rctx->env->key.vb_strvalue, counter, fr_time());
+
+	return sqlcounter_check(p_result, request, rctx->inst, rctx->env, rctx->limit, counter);
+}
+
 /** Check the value of a `counter` retrieved from an SQL query with a `limit`
  *
  * Module specific attributes containing the start / end times are created / updated,
@@ -421,11 +589,25 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	}
 	vp->vp_uint64 = fr_time_to_sec(inst->reset_time);
 
+	/*
+	 *	Only run the SQL query if there's no current value
+	 *	for the counter.
+	 */
+	if (inst->cache.enable && (env->key.type == FR_TYPE_STRING)) {
+		uint64_t	counter;
+
+		if (sqlcounter_cache_get(&counter, inst, env->key.vb_strvalue, fr_time())) {
+			RDEBUG2("Using cached counter value %" PRIu64 " for \"%pV\"", counter, &env->key);
+			return sqlcounter_check(p_result, request, inst, env, limit, counter);
+		}
+	}
+
 	MEM(rctx = talloc(unlang_interpret_frame_talloc_ctx(request), sqlcounter_rctx_t));
 	*rctx = (sqlcounter_rctx_t) {
 		.inst = inst,
 		.env = env,
-		.limit = limit
+		.limit = limit,
+		.cache = inst->cache.enable && (env->key.type == FR_TYPE_STRING)
 	};
 
 	if (unlang_function_push(request, NULL, mod_authorize_resume, NULL, 0, UNLANG_SUB_FRAME, rctx) < 0) {
@@ -440,6 +622,75 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	return UNLANG_ACTION_PUSHED_CHILD;
 }
 
+/** Add usage reported by an accounting packet to a cached counter
+ *
+ * If a session_id is available, the increment is treated as the
+ * cumulative usage of that session, and only the difference from the
+ * previous packet is added.  Otherwise the increment is added as-is.
+ *
+ * Counters which aren't cached are left alone, they'll be read from SQL
+ * the next time they're checked.
+ */
+static unlang_action_t sqlcounter_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+					     bool stop)
+{
+	rlm_sqlcounter_t const		*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_sqlcounter_t);
+	sqlcounter_acct_call_env_t	*env = talloc_get_type_abort(mctx->env_data, sqlcounter_acct_call_env_t);
+	sqlcounter_mutable_t		*mutable = inst->mutable;
+	sqlcounter_entry_t		*entry;
+	uint64_t			delta;
+
+	if (!inst->cache.enable || (env->key.type != FR_TYPE_STRING) ||
+	    (env->increment.type != FR_TYPE_UINT64)) RETURN_MODULE_NOOP;
+
+	pthread_mutex_lock(&mutable->mutex);
+	entry = sqlcounter_cache_find(mutable, env->key.vb_strvalue);
+	if (!entry) {
+		pthread_mutex_unlock(&mutable->mutex);
+		RDEBUG2("No cached counter for \"%pV\"", &env->key);
+		RETURN_MODULE_NOOP;
+	}
+
+	delta = env->increment.vb_uint64;
+	if (env->session_id.type == FR_TYPE_STRING) {
+		sqlcounter_session_t *session = NULL;
+
+		while ((session = fr_dlist_next(&entry->sessions, session))) {
+			if (strcmp(session->id, env->session_id.vb_strvalue) == 0) break;
+		}
+
+		if (!session) {
+			MEM(session = talloc_zero(entry, sqlcounter_session_t));
+			session->id = talloc_strdup(session, env->session_id.vb_strvalue);
+			fr_dlist_insert_tail(&entry->sessions, session);
+		}
+
+		delta = (env->increment.vb_uint64 > session->last) ? env->increment.vb_uint64 - session->last : 0;
+		session->last = env->increment.vb_uint64;
+
+		if (stop) {
+			fr_dlist_remove(&entry->sessions, session);
+			talloc_free(session);
+		}
+	}
+	entry->delta += delta;
+	pthread_mutex_unlock(&mutable->mutex);
+
+	RDEBUG2("Added %" PRIu64 " to counter for \"%pV\"", delta, &env->key);
+
+	RETURN_MODULE_UPDATED;
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	return sqlcounter_accounting(p_result, mctx, request, false);
+}
+
+static unlang_action_t CC_HINT(nonnull) mod_accounting_stop(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	return sqlcounter_accounting(p_result, mctx, request, true);
+}
+
 /** Custom call_env parser to tokenize the SQL query xlat used for counter retrieval
  */
 static int call_env_query_parse(TALLOC_CTX *ctx, void *out, tmpl_rules_t const *t_rules, CONF_ITEM *ci,
@@ -481,6 +732,7 @@ static int call_env_query_parse(TALLOC_CTX *ctx, void *out, tmpl_rules_t const *
 static const call_env_method_t sqlcounter_call_env = {
 	FR_CALL_ENV_METHOD_OUT(sqlcounter_call_env_t),
 	.env = (call_env_parser_t[]){
+		{ FR_CALL_ENV_OFFSET("key", FR_TYPE_STRING, CALL_ENV_FLAG_CONCAT | CALL_ENV_FLAG_NULLABLE, sqlcounter_call_env_t, key) },
 		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("query", FR_TYPE_VOID, CALL_ENV_FLAG_REQUIRED | CALL_ENV_FLAG_PARSE_ONLY, sqlcounter_call_env_t, query_xlat),
 		  .pair.func = call_env_query_parse },
 		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("reply_name", FR_TYPE_VOID, CALL_ENV_FLAG_PARSE_ONLY, sqlcounter_call_env_t, reply_attr) },
@@ -489,6 +741,16 @@ static const call_env_method_t sqlcounter_call_env = {
 	}
 };
 
+static const call_env_method_t sqlcounter_acct_call_env = {
+	FR_CALL_ENV_METHOD_OUT(sqlcounter_acct_call_env_t),
+	.env = (call_env_parser_t[]){
+		{ FR_CALL_ENV_OFFSET("key", FR_TYPE_STRING, CALL_ENV_FLAG_CONCAT | CALL_ENV_FLAG_NULLABLE, sqlcounter_acct_call_env_t, key) },
+		{ FR_CALL_ENV_OFFSET("increment", FR_TYPE_UINT64, CALL_ENV_FLAG_NULLABLE, sqlcounter_acct_call_env_t, increment) },
+		{ FR_CALL_ENV_OFFSET("session_id", FR_TYPE_STRING, CALL_ENV_FLAG_CONCAT | CALL_ENV_FLAG_NULLABLE, sqlcounter_acct_call_env_t, session_id) },
+		CALL_ENV_TERMINATOR
+	}
+};
+
 
 /*
  *	Do any per-module initialization that is separate to each
@@ -535,6 +797,32 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	if (inst->cache.enable) {
+		FR_INTEGER_BOUND_CHECK("cache.max_entries", inst->cache.max_entries, >=, 1);
+		FR_TIME_DELTA_BOUND_CHECK("cache.reconcile_interval", inst->cache.reconcile_interval, >=, fr_time_delta_from_sec(1));
+
+		MEM(inst->mutable = talloc_zero(NULL, sqlcounter_mutable_t));
+		pthread_mutex_init(&inst->mutable->mutex, NULL);
+		fr_dlist_init(&inst->mutable->lru, sqlcounter_entry_t, entry);
+		inst->mutable->ht = fr_hash_table_alloc(inst->mutable, sqlcounter_entry_hash, sqlcounter_entry_cmp, NULL);
+		if (!inst->mutable->ht) {
+			cf_log_err(conf, "Failed creating counter cache");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_sqlcounter_t *inst = talloc_get_type_abort(mctx->mi->data, rlm_sqlcounter_t);
+
+	if (!inst->mutable) return 0;
+
+	pthread_mutex_destroy(&inst->mutable->mutex);
+	TALLOC_FREE(inst->mutable);
+
 	return 0;
 }
 
@@ -582,9 +870,12 @@ module_rlm_t rlm_sqlcounter = {
 		.config		= module_config,
 		.bootstrap	= mod_bootstrap,
 		.instantiate	= mod_instantiate,
+		.detach		= mod_detach,
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
+			{ .section = SECTION_NAME("accounting", "Stop"), .method = mod_accounting_stop, .method_env = &sqlcounter_acct_call_env },
+			{ .section = SECTION_NAME("accounting", CF_IDENT_ANY), .method = mod_accounting, .method_env = &sqlcounter_acct_call_env },
 			{ .section = SECTION_NAME(CF_IDENT_ANY, CF_IDENT_ANY), .method = mod_authorize, .method_env = &sqlcounter_call_env },
 			MODULE_BINDING_TERMINATOR
 		}
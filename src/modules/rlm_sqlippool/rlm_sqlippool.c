@@ -52,6 +52,8 @@ typedef struct {
 	fr_value_box_t	requested_address;		//!< IP address being requested by client.
 	tmpl_t		*allocated_address_attr;	//!< Attribute to populate with allocated IP.
 	fr_value_box_t	allocated_address;		//!< Existing value for allocated IP.
+	tmpl_t		*single;			//!< tmpl to expand as a single query which finds and
+							///< allocates the IP.  Replaces all the other alloc queries.
 	fr_value_box_t	begin;				//!< SQL query to begin transaction.
 	tmpl_t		*existing;			//!< tmpl to expand as query for finding the existing IP.
 	tmpl_t		*requested;			//!< tmpl to expand as query for finding the requested IP.
@@ -78,6 +80,8 @@ typedef enum {
 	IPPOOL_ALLOC_REQUESTED_RUN,		//!< Run the "requested" query
 	IPPOOL_ALLOC_FIND,			//!< Expanding the "find" query
 	IPPOOL_ALLOC_FIND_RUN,			//!< Run the "find" query
+	IPPOOL_ALLOC_SINGLE,			//!< Expanding the "single" query
+	IPPOOL_ALLOC_SINGLE_RUN,		//!< Run the "single" query
 	IPPOOL_ALLOC_NO_ADDRESS,		//!< No address was found
 	IPPOOL_ALLOC_POOL_CHECK,		//!< Expanding the "pool_check" query
 	IPPOOL_ALLOC_POOL_CHECK_RUN,		//!< Run the "pool_check" query
@@ -285,6 +289,17 @@ static unlang_action_t mod_alloc_resume(rlm_rcode_t *p_result, UNUSED int *prior
 
 	switch (alloc_ctx->status) {
 	case IPPOOL_ALLOC_BEGIN_RUN:
+		/*
+		 *	A single query replaces the whole sequence, and is run
+		 *	outside of a transaction.
+		 */
+		if (env->single) {
+			alloc_ctx->status = IPPOOL_ALLOC_SINGLE;
+			REPEAT_MOD_ALLOC_RESUME;
+			if (unlang_tmpl_push(alloc_ctx, &alloc_ctx->values, request, env->single, NULL) < 0) goto error;
+			return UNLANG_ACTION_PUSHED_CHILD;
+		}
+
 		if ((env->begin.type == FR_TYPE_STRING) &&
 		    env->begin.vb_length) sql->driver->sql_finish_query(query_ctx, &query_ctx->inst->config);
 
@@ -376,6 +391,7 @@ static unlang_action_t mod_alloc_resume(rlm_rcode_t *p_result, UNUSED int *prior
 		if ((env->commit.type == FR_TYPE_STRING) &&
 		    env->commit.vb_length) sql->driver->sql_finish_query(query_ctx, &query_ctx->inst->config);
 
+	pool_check:
 		/*
 		 *  Should we perform pool-check?
 		 */
@@ -417,6 +433,16 @@ static unlang_action_t mod_alloc_resume(rlm_rcode_t *p_result, UNUSED int *prior
 		RDEBUG2("Allocated IP %s", allocation);
 		alloc_ctx->rcode = RLM_MODULE_UPDATED;
 
+		/*
+		 *	The single query has already marked the address as in use,
+		 *	and there's no transaction to commit.
+		 */
+		if (env->single) {
+			rlm_rcode_t	rcode = alloc_ctx->rcode;
+			talloc_free(alloc_ctx);
+			RETURN_MODULE_RCODE(rcode);
+		}
+
 		/*
 		 *	If we have an update query expand it
 		 */
@@ -430,6 +456,20 @@ static unlang_action_t mod_alloc_resume(rlm_rcode_t *p_result, UNUSED int *prior
 		goto finish;
 	}
 
+	case IPPOOL_ALLOC_SINGLE:
+		if (query && query->vb_length) SUBMIT_QUERY(query->vb_strvalue, IPPOOL_ALLOC_SINGLE_RUN, SQL_QUERY_SELECT, select);
+		goto pool_check;
+
+	case IPPOOL_ALLOC_SINGLE_RUN:
+		TALLOC_FREE(alloc_ctx->query);
+		if (query_ctx->rcode != RLM_SQL_OK) goto error;
+
+		allocation_len = sqlippool_result_process(allocation, sizeof(allocation), query_ctx);
+		sql->driver->sql_finish_select_query(query_ctx, &query_ctx->inst->config);
+
+		if (allocation_len > 0) goto make_pair;
+		goto pool_check;
+
 	case IPPOOL_ALLOC_POOL_CHECK:
 		/*
 		 *	Ok, so the allocate-find query found nothing ...
@@ -528,6 +568,11 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 		RETURN_MODULE_NOOP;
 	}
 
+	if (!env->single && !env->find) {
+		REDEBUG("Either alloc_single or alloc_find must be set");
+		RETURN_MODULE_FAIL;
+	}
+
 	RESERVE_CONNECTION(handle, inst->sql, request);
 	if (!sql->sql_escape_arg && !thread->sql_escape_arg && handle)
 		request_data_add(request, (void *)sql_escape_uctx_alloc, 0, handle, false, false, false);
@@ -555,7 +600,11 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 		RETURN_MODULE_FAIL;
 	}
 
-	if ((env->begin.type == FR_TYPE_STRING) && env->begin.vb_length) {
+	/*
+	 *	The single query finds and allocates the address in one
+	 *	round trip, so there's no transaction to start.
+	 */
+	if (!env->single && (env->begin.type == FR_TYPE_STRING) && env->begin.vb_length) {
 		alloc_ctx->query_ctx->query_str = env->begin.vb_strvalue;
 		return unlang_function_push(request, sql->query, NULL, NULL, 0, UNLANG_SUB_FRAME, alloc_ctx->query_ctx);
 	}
@@ -739,6 +788,8 @@ static const call_env_method_t sqlippool_alloc_method_env = {
 		{ FR_CALL_ENV_PARSE_OFFSET("allocated_address_attr", FR_TYPE_VOID,
 					   CALL_ENV_FLAG_ATTRIBUTE | CALL_ENV_FLAG_REQUIRED | CALL_ENV_FLAG_NULLABLE,
 					   ippool_alloc_call_env_t, allocated_address, allocated_address_attr) },
+		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("alloc_single", FR_TYPE_STRING, CALL_ENV_FLAG_PARSE_ONLY,
+						ippool_alloc_call_env_t, single), QUERY_ESCAPE },
 		{ FR_CALL_ENV_OFFSET("alloc_begin", FR_TYPE_STRING, CALL_ENV_FLAG_CONCAT | CALL_ENV_FLAG_NULLABLE,
 				     ippool_alloc_call_env_t, begin), QUERY_ESCAPE,
 				     .pair.dflt = "START TRANSACTION", .pair.dflt_quote = T_SINGLE_QUOTED_STRING },
@@ -746,7 +797,7 @@ static const call_env_method_t sqlippool_alloc_method_env = {
 						ippool_alloc_call_env_t, existing), QUERY_ESCAPE },
 		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("alloc_requested", FR_TYPE_STRING, CALL_ENV_FLAG_PARSE_ONLY,
 						ippool_alloc_call_env_t, requested), QUERY_ESCAPE },
-		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("alloc_find", FR_TYPE_STRING, CALL_ENV_FLAG_PARSE_ONLY | CALL_ENV_FLAG_REQUIRED,
+		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("alloc_find", FR_TYPE_STRING, CALL_ENV_FLAG_PARSE_ONLY,
 						ippool_alloc_call_env_t, find), QUERY_ESCAPE },
 		{ FR_CALL_ENV_PARSE_ONLY_OFFSET("alloc_update", FR_TYPE_STRING, CALL_ENV_FLAG_PARSE_ONLY,
 						ippool_alloc_call_env_t, update), QUERY_ESCAPE },
@@ -41,10 +41,38 @@ RCSID("$Id$")
 
 #include <pthread.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/*
+ *	Counters are only ever written by the thread which owns them,
+ *	so relaxed atomics are enough.  Readers add up a snapshot of
+ *	every thread's counters, and may see some of them slightly
+ *	out of date.
+ */
+#define stats_incr(_x)	atomic_fetch_add_explicit(&(_x), 1, memory_order_relaxed)
+#define stats_load(_x)	atomic_load_explicit(&(_x), memory_order_relaxed)
+
+/** Number of buckets in a latency histogram
+ *
+ * Buckets 0 and 1 hold latencies of 0us and 1us.  After that, each
+ * power of two is split into two buckets, so the error is at most 50%,
+ * and the last bucket holds everything over about 35 minutes.
+ */
+#define STATS_LATENCY_BUCKETS	64
+
+typedef struct {
+	_Atomic(uint64_t)	bucket[STATS_LATENCY_BUCKETS];
+} rlm_stats_latency_t;
+
 typedef struct {
 	pthread_mutex_t		mutex;
 	fr_dlist_head_t		list;				//!< for threads to know about each other
-	uint64_t		stats[FR_RADIUS_CODE_MAX];
+	uint64_t		stats[FR_RADIUS_CODE_MAX];	//!< from threads which have exited.
+	uint64_t		latency[FR_RADIUS_CODE_MAX][STATS_LATENCY_BUCKETS];	//!< from threads which have exited.
 } rlm_stats_mutable_t;
 
 /*
@@ -67,13 +95,13 @@ typedef struct {
 	fr_ipaddr_t		ipaddr;				//!< IP address of this thing
 	fr_time_t		created;			//!< when it was created
 	fr_time_t		last_packet;			//!< when we last saw a packet
-	uint64_t		stats[FR_RADIUS_CODE_MAX];	//!< actual statistic
+	_Atomic(uint64_t)	stats[FR_RADIUS_CODE_MAX];	//!< actual statistic
+	rlm_stats_latency_t	latency;			//!< for all packet types
 } rlm_stats_data_t;
 
 typedef struct {
 	rlm_stats_t		*inst;
 
-	fr_time_t		last_global_update;
 	fr_dlist_t		entry;				//!< for threads to know about each other
 
 	fr_time_t		last_manage;			//!< when we deleted old things
@@ -81,9 +109,11 @@ typedef struct {
 	fr_rb_tree_t		*src;				//!< stats by source
 	fr_rb_tree_t		*dst;				//!< stats by destination
 
-	uint64_t		stats[FR_RADIUS_CODE_MAX];
+	_Atomic(uint64_t)	stats[FR_RADIUS_CODE_MAX];
+	rlm_stats_latency_t	latency[FR_RADIUS_CODE_MAX];	//!< by request packet type
 
-	pthread_mutex_t		mutex;
+	pthread_mutex_t		mutex;				//!< Only held when inserting into src / dst,
+								//!< and by other threads looking up entries.
 } rlm_stats_thread_t;
 
 static const conf_parser_t module_config[] = {
@@ -98,166 +128,236 @@ fr_dict_autoload_t rlm_stats_dict[] = {
 	{ NULL }
 };
 
+static fr_dict_attr_t const *attr_freeradius_stats4;
 static fr_dict_attr_t const *attr_freeradius_stats4_ipv4_address;
 static fr_dict_attr_t const *attr_freeradius_stats4_ipv6_address;
 static fr_dict_attr_t const *attr_freeradius_stats4_type;
+static fr_dict_attr_t const *attr_freeradius_stats4_packet_counters;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency_packet_type;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency_bucket;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency_lower_bound;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency_count;
 
 extern fr_dict_attr_autoload_t rlm_stats_dict_attr[];
 fr_dict_attr_autoload_t rlm_stats_dict_attr[] = {
+	{ .out = &attr_freeradius_stats4, .name = "Vendor-Specific.FreeRADIUS.Stats4", .type = FR_TYPE_TLV, .dict = &dict_radius },
 	{ .out = &attr_freeradius_stats4_ipv4_address, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-IPv4-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_radius },
 	{ .out = &attr_freeradius_stats4_ipv6_address, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-IPv6-Address", .type = FR_TYPE_IPV6_ADDR, .dict = &dict_radius },
 	{ .out = &attr_freeradius_stats4_type, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_packet_counters, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Packet-Counters", .type = FR_TYPE_TLV, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency", .type = FR_TYPE_TLV, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency_packet_type, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency.Stats4-Latency-Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency_bucket, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency.Stats4-Latency-Bucket", .type = FR_TYPE_TLV, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency_lower_bound, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency.Stats4-Latency-Bucket.Stats4-Latency-Lower-Bound", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency_count, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency.Stats4-Latency-Bucket.Stats4-Latency-Count", .type = FR_TYPE_UINT64, .dict = &dict_radius },
 	{ NULL }
 };
 
-static void coalesce(uint64_t final_stats[FR_RADIUS_CODE_MAX], rlm_stats_thread_t *t,
-		     size_t tree_offset, rlm_stats_data_t *mydata)
+/** Map a latency to a histogram bucket
+ *
+ */
+static inline CC_HINT(always_inline) unsigned int stats_latency_bucket(fr_time_delta_t delay)
+{
+	int64_t		usec = fr_time_delta_to_usec(delay);
+	unsigned int	msb, bucket;
+
+	if (usec < 2) return (usec < 0) ? 0 : usec;
+
+	msb = fr_high_bit_pos(usec) - 1;
+	bucket = (msb * 2) + ((usec >> (msb - 1)) & 0x01);
+	if (bucket >= STATS_LATENCY_BUCKETS) bucket = STATS_LATENCY_BUCKETS - 1;
+
+	return bucket;
+}
+
+/** The smallest latency, in microseconds, which is counted in a bucket
+ *
+ */
+static inline CC_HINT(always_inline) uint32_t stats_latency_lower_bound(unsigned int bucket)
+{
+	unsigned int msb;
+
+	if (bucket < 2) return bucket;
+
+	msb = bucket / 2;
+	return (((uint32_t) 1) << msb) | ((bucket & 0x01) << (msb - 1));
+}
+
+static void coalesce(uint64_t final_stats[FR_RADIUS_CODE_MAX], uint64_t final_latency[STATS_LATENCY_BUCKETS],
+		     rlm_stats_thread_t *t, size_t tree_offset, rlm_stats_data_t *mydata)
 {
 	rlm_stats_data_t *stats;
 	rlm_stats_thread_t *other;
 	fr_rb_tree_t **tree;
-	uint64_t local_stats[FR_RADIUS_CODE_MAX];
+	int i;
 
-	tree = (fr_rb_tree_t **) (((uint8_t *) t) + tree_offset);
+	memset(final_stats, 0, sizeof(uint64_t) * FR_RADIUS_CODE_MAX);
+	memset(final_latency, 0, sizeof(uint64_t) * STATS_LATENCY_BUCKETS);
 
 	/*
-	 *	Bootstrap with my statistics, where we don't need a
-	 *	lock.
-	 */
-	stats = fr_rb_find(*tree, mydata);
-	if (!stats) {
-		memset(final_stats, 0, sizeof(uint64_t) * FR_RADIUS_CODE_MAX);
-	} else {
-		memcpy(final_stats, stats->stats, sizeof(stats->stats));
-	}
-
-	/*
-	 *	Loop over all of the other thread instances, locking
-	 *	them, and adding their statistics in.
+	 *	Loop over all of the thread instances, and add their
+	 *	statistics in.  The mutex only stops the entry being
+	 *	inserted into the tree while we're looking for it.  The
+	 *	counters themselves are read without any locks.
 	 */
 	pthread_mutex_lock(&t->inst->mutable->mutex);
 	for (other = fr_dlist_head(&t->inst->mutable->list);
 	     other != NULL;
 	     other = fr_dlist_next(&t->inst->mutable->list, other)) {
-		int i;
-
-		if (other == t) continue;
-
 		tree = (fr_rb_tree_t **) (((uint8_t *) other) + tree_offset);
-		pthread_mutex_lock(&other->mutex);
+
+		/*
+		 *	We're the only thread which inserts into our
+		 *	own tree, so we don't need the lock.
+		 */
+		if (other != t) pthread_mutex_lock(&other->mutex);
 		stats = fr_rb_find(*tree, mydata);
+		if (other != t) pthread_mutex_unlock(&other->mutex);
 
-		if (!stats) {
-			pthread_mutex_unlock(&other->mutex);
-			continue;
-		}
-		memcpy(&local_stats, stats->stats, sizeof(stats->stats));
+		if (!stats) continue;
 
 		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-			final_stats[i] += local_stats[i];
+			final_stats[i] += stats_load(stats->stats[i]);
 		}
 
-		pthread_mutex_unlock(&other->mutex);
+		for (i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+			final_latency[i] += stats_load(stats->latency.bucket[i]);
+		}
 	}
 	pthread_mutex_unlock(&t->inst->mutable->mutex);
 }
 
+/** Find or create the statistics for an IP address
+ *
+ * Lookups are done without the mutex, as no other thread modifies our trees.
+ */
+static rlm_stats_data_t *stats_data_find(rlm_stats_thread_t *t, fr_rb_tree_t *tree, fr_ipaddr_t const *ipaddr,
+					 fr_time_t now)
+{
+	rlm_stats_data_t *stats, mydata;
 
-/*
- *	Do the statistics
+	mydata.ipaddr = *ipaddr;
+	stats = fr_rb_find(tree, &mydata);
+	if (stats) return stats;
+
+	MEM(stats = talloc_zero(t, rlm_stats_data_t));
+
+	stats->ipaddr = *ipaddr;
+	stats->created = now;
+
+	pthread_mutex_lock(&t->mutex);
+	(void) fr_rb_insert(tree, stats);
+	pthread_mutex_unlock(&t->mutex);
+
+	return stats;
+}
+
+/** Add a latency histogram to the reply
+ *
  */
-static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static void stats_latency_add(request_t *request, fr_pair_t *parent, uint32_t code,
+			      uint64_t const latency[STATS_LATENCY_BUCKETS])
 {
-	rlm_stats_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_stats_t);
-	rlm_stats_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_stats_thread_t);
-	int			i;
-	uint32_t		stats_type;
+	fr_pair_t	*lat, *bucket, *vp;
+	int		i;
 
+	MEM(lat = fr_pair_afrom_da(parent, attr_freeradius_stats4_latency));
+	fr_pair_append(&parent->vp_group, lat);
 
-	fr_pair_t *vp;
-	rlm_stats_data_t mydata;
-	char buffer[64];
-	uint64_t local_stats[NUM_ELEMENTS(inst->mutable->stats)];
+	if (code) {
+		MEM(vp = fr_pair_afrom_da(lat, attr_freeradius_stats4_latency_packet_type));
+		vp->vp_uint32 = code;
+		fr_pair_append(&lat->vp_group, vp);
+	}
 
-	/*
-	 *	Increment counters only in "send foo" sections.
-	 *
-	 *	i.e. only when we have a reply to send.
-	 *
-	 *	FIXME - Nothing sets request_state anymore
-	 */
-#if 0
-	if (request->request_state == REQUEST_SEND) {
-		int src_code, dst_code;
-		rlm_stats_data_t *stats;
+	for (i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+		if (!latency[i]) continue;
 
-		src_code = request->packet->code;
-		if (src_code >= FR_RADIUS_CODE_MAX) src_code = 0;
+		MEM(bucket = fr_pair_afrom_da(lat, attr_freeradius_stats4_latency_bucket));
+		fr_pair_append(&lat->vp_group, bucket);
 
-		dst_code = request->reply->code;
-		if (dst_code >= FR_RADIUS_CODE_MAX) dst_code = 0;
+		MEM(vp = fr_pair_afrom_da(bucket, attr_freeradius_stats4_latency_lower_bound));
+		vp->vp_uint32 = stats_latency_lower_bound(i);
+		fr_pair_append(&bucket->vp_group, vp);
 
-		pthread_mutex_lock(&t->mutex);
-		t->stats[src_code]++;
-		t->stats[dst_code]++;
+		MEM(vp = fr_pair_afrom_da(bucket, attr_freeradius_stats4_latency_count));
+		vp->vp_uint64 = latency[i];
+		fr_pair_append(&bucket->vp_group, vp);
+	}
 
-		/*
-		 *	Update source statistics
-		 */
-		mydata.ipaddr = request->packet->socket.inet.src_ipaddr;
-		stats = fr_rb_find(t->src, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
+	RDEBUG3("Added latency histogram for packet type %u", code);
+}
 
-			stats->ipaddr = request->packet->socket.inet.src_ipaddr;
-			stats->created = request->async->recv_time;
+/*
+ *	Increment counters only in "send foo" sections.
+ *
+ *	i.e. only when we have a reply to send.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_stats_update(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_stats_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_stats_thread_t);
+	rlm_stats_data_t	*stats;
+	int			src_code, dst_code;
+	unsigned int		bucket;
+	fr_time_t		now = fr_time();
 
-			(void) fr_rb_insert(t->src, stats);
-		}
+	if (!request->async) RETURN_MODULE_NOOP;
 
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
+	src_code = request->packet->code;
+	if (src_code >= FR_RADIUS_CODE_MAX) src_code = 0;
 
-		/*
-		 *	Update destination statistics
-		 */
-		mydata.ipaddr = request->packet->socket.inet.dst_ipaddr;
-		stats = fr_rb_find(t->dst, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
+	dst_code = request->reply->code;
+	if (dst_code >= FR_RADIUS_CODE_MAX) dst_code = 0;
 
-			stats->ipaddr = request->packet->socket.inet.dst_ipaddr;
-			stats->created = request->async->recv_time;
+	bucket = stats_latency_bucket(fr_time_sub(now, request->async->recv_time));
 
-			(void) fr_rb_insert(t->dst, stats);
-		}
+	stats_incr(t->stats[src_code]);
+	stats_incr(t->stats[dst_code]);
+	stats_incr(t->latency[src_code].bucket[bucket]);
 
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
-		pthread_mutex_unlock(&t->mutex);
+	/*
+	 *	Update source statistics
+	 */
+	stats = stats_data_find(t, t->src, &request->packet->socket.inet.src_ipaddr, request->async->recv_time);
+	stats->last_packet = request->async->recv_time;
+	stats_incr(stats->stats[src_code]);
+	stats_incr(stats->stats[dst_code]);
+	stats_incr(stats->latency.bucket[bucket]);
 
-		/*
-		 *	@todo - periodically clean up old entries.
-		 */
+	/*
+	 *	Update destination statistics
+	 */
+	stats = stats_data_find(t, t->dst, &request->packet->socket.inet.dst_ipaddr, request->async->recv_time);
+	stats->last_packet = request->async->recv_time;
+	stats_incr(stats->stats[src_code]);
+	stats_incr(stats->stats[dst_code]);
+	stats_incr(stats->latency.bucket[bucket]);
 
-		if ((t->last_global_update + NSEC) > request->async->recv_time) {
-			RETURN_MODULE_UPDATED;
-		}
+	/*
+	 *	@todo - periodically clean up old entries.
+	 */
 
-		t->last_global_update = request->async->recv_time;
+	RETURN_MODULE_UPDATED;
+}
 
-		pthread_mutex_lock(&inst->mutable->mutex);
-		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-			inst->mutable->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
-		pthread_mutex_unlock(&inst->mutable->mutex);
+/*
+ *	Do the statistics
+ */
+static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_stats_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_stats_t);
+	rlm_stats_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_stats_thread_t);
+	rlm_stats_thread_t	*other;
+	int			i, j;
+	uint32_t		stats_type;
 
-		RETURN_MODULE_UPDATED;
-	}
-#endif
+
+	fr_pair_t *vp, *parent;
+	rlm_stats_data_t mydata;
+	uint64_t local_stats[NUM_ELEMENTS(inst->mutable->stats)];
+	uint64_t local_latency[FR_RADIUS_CODE_MAX][STATS_LATENCY_BUCKETS];
+	int num_latency = 1;
 
 	/*
 	 *	Ignore "authenticate" and anything other than Status-Server
@@ -282,18 +382,29 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 	switch (stats_type) {
 	case FR_STATS4_TYPE_VALUE_GLOBAL:			/* global */
 		/*
-		 *	Merge our stats with the global stats, and then copy
-		 *	the global stats to a thread-local variable.
+		 *	Take a snapshot of the statistics from the
+		 *	threads which have exited, and add in the
+		 *	current values from all of the running threads.
 		 *
-		 *	The copy helps minimize mutex contention.
+		 *	The mutex only protects the list of threads.
 		 */
 		pthread_mutex_lock(&inst->mutable->mutex);
-		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-			inst->mutable->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
 		memcpy(&local_stats, inst->mutable->stats, sizeof(inst->mutable->stats));
+		memcpy(&local_latency, inst->mutable->latency, sizeof(inst->mutable->latency));
+
+		for (other = fr_dlist_head(&inst->mutable->list);
+		     other != NULL;
+		     other = fr_dlist_next(&inst->mutable->list, other)) {
+			for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
+				local_stats[i] += stats_load(other->stats[i]);
+
+				for (j = 0; j < STATS_LATENCY_BUCKETS; j++) {
+					local_latency[i][j] += stats_load(other->latency[i].bucket[j]);
+				}
+			}
+		}
 		pthread_mutex_unlock(&inst->mutable->mutex);
+		num_latency = FR_RADIUS_CODE_MAX;
 		vp = NULL;
 		break;
 
@@ -303,7 +414,7 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		if (!vp) RETURN_MODULE_NOOP;
 
 		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, src), &mydata);
+		coalesce(local_stats, local_latency[0], t, offsetof(rlm_stats_thread_t, src), &mydata);
 		break;
 
 	case FR_STATS4_TYPE_VALUE_LISTENER:			/* dst */
@@ -312,7 +423,7 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		if (!vp) RETURN_MODULE_NOOP;
 
 		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, dst), &mydata);
+		coalesce(local_stats, local_latency[0], t, offsetof(rlm_stats_thread_t, dst), &mydata);
 		break;
 
 	default:
@@ -329,23 +440,33 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 
 	/*
 	 *	@todo - do this only for RADIUS
-	 *	key off of packet ID, and Stats4-Packet-Counters TLV.
+	 *
+	 *	The attribute number of each counter is the packet code.
 	 */
-	strcpy(buffer, "FreeRADIUS-Stats4-");
-
 	for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
 		fr_dict_attr_t const *da;
 
 		if (!local_stats[i]) continue;
 
-		strlcpy(buffer + 18, fr_radius_packet_name[i], sizeof(buffer) - 18);
-		da = fr_dict_attr_by_name(NULL, fr_dict_root(dict_radius), buffer);
+		da = fr_dict_attr_child_by_num(attr_freeradius_stats4_packet_counters, i);
 		if (!da) continue;
 
-		MEM(vp = fr_pair_afrom_da(request->reply_ctx, da));
+		MEM(fr_pair_update_by_da_parent(request->reply_ctx, &vp, da) >= 0);
 		vp->vp_uint64 = local_stats[i];
+	}
 
-		fr_pair_append(&request->reply_pairs, vp);
+	/*
+	 *	Global statistics have one histogram per request packet
+	 *	type.  Everything else has one for all packet types.
+	 */
+	MEM(pair_update_reply(&parent, attr_freeradius_stats4) >= 0);
+	for (i = 0; i < num_latency; i++) {
+		for (j = 0; j < STATS_LATENCY_BUCKETS; j++) {
+			if (local_latency[i][j]) break;
+		}
+		if (j == STATS_LATENCY_BUCKETS) continue;
+
+		stats_latency_add(request, parent, (num_latency > 1) ? i : 0, local_latency[i]);
 	}
 
 	RETURN_MODULE_OK;
@@ -381,6 +502,8 @@ static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
 		return -1;
 	}
 
+	pthread_mutex_init(&t->mutex, NULL);
+
 	pthread_mutex_lock(&inst->mutable->mutex);
 	fr_dlist_insert_head(&inst->mutable->list, t);
 	pthread_mutex_unlock(&inst->mutable->mutex);
@@ -396,11 +519,15 @@ static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
 {
 	rlm_stats_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_stats_thread_t);
 	rlm_stats_t		*inst = t->inst;
-	int			i;
+	int			i, j;
 
 	pthread_mutex_lock(&inst->mutable->mutex);
 	for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-		inst->mutable->stats[i] += t->stats[i];
+		inst->mutable->stats[i] += stats_load(t->stats[i]);
+
+		for (j = 0; j < STATS_LATENCY_BUCKETS; j++) {
+			inst->mutable->latency[i][j] += stats_load(t->latency[i].bucket[j]);
+		}
 	}
 	fr_dlist_remove(&inst->mutable->list, t);
 	pthread_mutex_unlock(&inst->mutable->mutex);
@@ -460,6 +587,7 @@ module_rlm_t rlm_stats = {
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
+			{ .section = SECTION_NAME("send", CF_IDENT_ANY), .method = mod_stats_update },
 			{ .section = SECTION_NAME(CF_IDENT_ANY, CF_IDENT_ANY), .method = mod_stats },
 			MODULE_BINDING_TERMINATOR
 		}
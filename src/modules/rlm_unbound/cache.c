@@ -0,0 +1,400 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_unbound/cache.c
+ * @brief A TTL aware cache of DNS answers, shared by all threads.
+ *
+ * Each thread has its own libunbound context, and therefore its own
+ * libunbound cache.  This cache sits in front of all of them, so that
+ * an answer fetched by one thread can be used by every other thread.
+ *
+ * Answers are stored in wire format, and decoded again for each request.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/nbo.h>
+#include <freeradius-devel/util/rb.h>
+
+#include <pthread.h>
+
+#include "cache.h"
+
+/** Number of shards a thread safe cache is split into.  Must be a power of 2.
+ */
+#define UNBOUND_CACHE_SHARDS	16
+
+/** Refresh answers which have less than 1/PREFETCH_RATIO of their TTL left
+ */
+#define UNBOUND_CACHE_PREFETCH_RATIO	10
+
+#define DNS_HDR_LEN		12
+
+typedef struct {
+	uint16_t		rr_type;	//!< Type of record.
+	char const		*name;		//!< Lowercase name, without the trailing '.'.
+
+	uint8_t			*packet;	//!< Wire format reply.
+	size_t			packet_len;	//!< Length of the reply.
+
+	fr_time_t		created;	//!< When the answer was cached.
+	fr_time_t		expires;	//!< When the answer must be thrown away.
+	uint32_t		hits;		//!< How many times the answer was used.
+	bool			prefetching;	//!< A refresh is in progress.
+
+	fr_rb_node_t		node;		//!< Entry in the shard tree.
+	fr_dlist_t		entry;		//!< Entry in the shard LRU list.
+} unbound_cache_entry_t;
+
+typedef struct {
+	fr_rb_tree_t		*tree;		//!< Answers, by type and name.
+	fr_dlist_head_t		lru;		//!< Least recently used answers are at the head.
+	pthread_mutex_t		mutex;		//!< Synchronisation mutex.
+} unbound_cache_shard_t;
+
+struct unbound_cache_s {
+	unbound_cache_conf_t const	*conf;		//!< Our configuration.
+
+	bool				thread_safe;	//!< Whether we lock the shards.
+	uint32_t			num_shards;	//!< How many shards are in use.
+	uint32_t			max_per_shard;	//!< Maximum number of answers in each shard.
+	unbound_cache_shard_t		shard[UNBOUND_CACHE_SHARDS];
+};
+
+#define PTHREAD_MUTEX_LOCK if (cache->thread_safe) pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK if (cache->thread_safe) pthread_mutex_unlock
+
+static int8_t cache_entry_cmp(void const *one, void const *two)
+{
+	unbound_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->rr_type, b->rr_type);
+	if (ret != 0) return ret;
+
+	ret = strcmp(a->name, b->name);
+	return CMP(ret, 0);
+}
+
+static inline CC_HINT(always_inline)
+unbound_cache_shard_t *cache_shard(unbound_cache_t *cache, uint16_t rr_type, char const *name)
+{
+	if (cache->num_shards == 1) return &cache->shard[0];
+
+	return &cache->shard[(fr_hash_string(name) ^ rr_type) & (cache->num_shards - 1)];
+}
+
+/** Remove an answer from its shard.  The caller must hold the lock, and free the answer
+ *
+ */
+static inline void cache_entry_unlink(unbound_cache_shard_t *shard, unbound_cache_entry_t *entry)
+{
+	fr_rb_remove(shard->tree, entry);
+	fr_dlist_remove(&shard->lru, entry);
+}
+
+/** Skip over a name in a DNS packet
+ *
+ * @return
+ *	- The first byte after the name.
+ *	- NULL if the name is malformed.
+ */
+static uint8_t const *cache_name_skip(uint8_t const *p, uint8_t const *end)
+{
+	while (p < end) {
+		if (*p == 0) return p + 1;
+
+		/*
+		 *	Compression pointers end the name.
+		 */
+		if ((*p & 0xc0) == 0xc0) return ((p + 2) <= end) ? p + 2 : NULL;
+		if ((*p & 0xc0) != 0) return NULL;
+
+		p += *p + 1;
+	}
+
+	return NULL;
+}
+
+/** Find the TTL of a reply, which is the smallest TTL of its answers
+ *
+ * We only cache successful replies which contain answers.  Errors
+ * and empty replies are always passed back to libunbound.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the reply can't be cached.
+ */
+static int cache_answer_ttl(uint32_t *ttl, uint8_t const *packet, size_t len)
+{
+	uint8_t const	*p = packet, *end = packet + len;
+	uint16_t	qdcount, ancount, i;
+	uint32_t	min = UINT32_MAX;
+
+	if (len < DNS_HDR_LEN) return -1;
+
+	/*
+	 *	Truncated replies and errors are not cached.
+	 */
+	if ((p[2] & 0x02) != 0) return -1;
+	if ((p[3] & 0x0f) != 0) return -1;
+
+	qdcount = fr_nbo_to_uint16(p + 4);
+	ancount = fr_nbo_to_uint16(p + 6);
+	if ((qdcount > 1) || (ancount == 0)) return -1;
+
+	p += DNS_HDR_LEN;
+
+	for (i = 0; i < qdcount; i++) {
+		p = cache_name_skip(p, end);
+		if (!p || ((p + 4) > end)) return -1;
+		p += 4;				/* QTYPE and QCLASS */
+	}
+
+	for (i = 0; i < ancount; i++) {
+		uint32_t	rr_ttl;
+
+		p = cache_name_skip(p, end);
+		if (!p || ((p + 10) > end)) return -1;
+
+		rr_ttl = fr_nbo_to_uint32(p + 4);
+		if (rr_ttl < min) min = rr_ttl;
+
+		p += 10 + fr_nbo_to_uint16(p + 8);
+		if (p > end) return -1;
+	}
+
+	*ttl = min;
+	return 0;
+}
+
+static int _cache_free(unbound_cache_t *cache)
+{
+	uint32_t i;
+
+	for (i = 0; i < cache->num_shards; i++) {
+		unbound_cache_shard_t	*shard = &cache->shard[i];
+		unbound_cache_entry_t	*entry;
+
+		if (cache->thread_safe) pthread_mutex_destroy(&shard->mutex);
+
+		while ((entry = fr_dlist_head(&shard->lru))) {
+			cache_entry_unlink(shard, entry);
+			talloc_free(entry);
+		}
+		talloc_free(shard->tree);
+	}
+
+	return 0;
+}
+
+/** Allocate an answer cache
+ *
+ * The cache is allocated in the NULL ctx, as it's written to by every
+ * thread, and the module instance data is read-only.  The caller is
+ * responsible for freeing it.
+ *
+ * @param[in] conf		Cache configuration.  Must remain valid for the lifetime of the cache.
+ * @param[in] thread_safe	Whether multiple threads will use the cache.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+unbound_cache_t *unbound_cache_alloc(unbound_cache_conf_t const *conf, bool thread_safe)
+{
+	unbound_cache_t	*cache;
+	uint32_t	i;
+
+	cache = talloc_zero(NULL, unbound_cache_t);
+	if (!cache) return NULL;
+
+	cache->conf = conf;
+	cache->thread_safe = thread_safe;
+	cache->num_shards = thread_safe ? UNBOUND_CACHE_SHARDS : 1;
+	cache->max_per_shard = conf->max_entries / cache->num_shards;
+	if (!cache->max_per_shard) cache->max_per_shard = 1;
+
+	for (i = 0; i < cache->num_shards; i++) {
+		unbound_cache_shard_t *shard = &cache->shard[i];
+
+		fr_dlist_talloc_init(&shard->lru, unbound_cache_entry_t, entry);
+
+		shard->tree = fr_rb_inline_alloc(NULL, unbound_cache_entry_t, node, cache_entry_cmp, NULL);
+		if (!shard->tree) {
+		fail:
+			cache->num_shards = i;
+			_cache_free(cache);
+			talloc_free(cache);
+			return NULL;
+		}
+
+		if (thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(shard->tree);
+			goto fail;
+		}
+	}
+	talloc_set_destructor(cache, _cache_free);
+
+	return cache;
+}
+
+/** Find a cached answer
+ *
+ * @param[in] ctx		to allocate the copy of the reply in.
+ * @param[out] len		Length of the reply.
+ * @param[out] prefetch		Set to true if the caller should refresh the answer.
+ *				The caller must then call #unbound_cache_insert, or
+ *				#unbound_cache_prefetch_done.
+ * @param[in] cache		to search in.
+ * @param[in] rr_type		of the query.
+ * @param[in] name		of the query, lowercase, and without the trailing '.'.
+ * @return
+ *	- A copy of the wire format reply.
+ *	- NULL if there is no usable answer.
+ */
+uint8_t *unbound_cache_find(TALLOC_CTX *ctx, size_t *len, bool *prefetch,
+			    unbound_cache_t *cache, uint16_t rr_type, char const *name)
+{
+	unbound_cache_shard_t	*shard = cache_shard(cache, rr_type, name);
+	unbound_cache_entry_t	find = { .rr_type = rr_type, .name = name }, *entry, *expired = NULL;
+	uint8_t			*packet = NULL;
+	fr_time_t		now = fr_time();
+
+	*prefetch = false;
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = fr_rb_find(shard->tree, &find);
+	if (!entry) goto done;
+
+	if (fr_time_lteq(entry->expires, now)) {
+		cache_entry_unlink(shard, entry);
+		expired = entry;
+		goto done;
+	}
+
+	packet = talloc_memdup(ctx, entry->packet, entry->packet_len);
+	if (!packet) goto done;
+	*len = entry->packet_len;
+
+	entry->hits++;
+	fr_dlist_remove(&shard->lru, entry);
+	fr_dlist_insert_tail(&shard->lru, entry);
+
+	/*
+	 *	Answers which are used more than once, and which are
+	 *	about to expire, are refreshed in the background.
+	 *	Only one refresh is done at a time.
+	 */
+	if (cache->conf->prefetch && !entry->prefetching && (entry->hits > 1) &&
+	    fr_time_delta_lt(fr_time_sub(entry->expires, now),
+			     fr_time_delta_div(fr_time_sub(entry->expires, entry->created),
+					       fr_time_delta_wrap(UNBOUND_CACHE_PREFETCH_RATIO)))) {
+		entry->prefetching = true;
+		*prefetch = true;
+	}
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	talloc_free(expired);
+
+	return packet;
+}
+
+/** Add an answer to the cache, replacing any existing answer
+ *
+ * @param[in] cache		to insert into.
+ * @param[in] rr_type		of the query.
+ * @param[in] name		of the query, lowercase, and without the trailing '.'.
+ * @param[in] packet		Wire format reply.
+ * @param[in] len		Length of the reply.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the answer can't be cached.
+ */
+int unbound_cache_insert(unbound_cache_t *cache, uint16_t rr_type, char const *name,
+			 uint8_t const *packet, size_t len)
+{
+	unbound_cache_shard_t	*shard;
+	unbound_cache_entry_t	*entry, *old, *evicted = NULL;
+	uint32_t		ttl;
+	fr_time_delta_t		lifetime;
+
+	if (cache_answer_ttl(&ttl, packet, len) < 0) return -1;
+
+	lifetime = fr_time_delta_from_sec(ttl);
+	if (fr_time_delta_lt(lifetime, cache->conf->min_ttl)) lifetime = cache->conf->min_ttl;
+	if (fr_time_delta_gt(lifetime, cache->conf->max_ttl)) lifetime = cache->conf->max_ttl;
+	if (!fr_time_delta_ispos(lifetime)) return -1;
+
+	/*
+	 *	Do all of the allocations before taking the lock.
+	 */
+	entry = talloc_zero(NULL, unbound_cache_entry_t);
+	if (!entry) return -1;
+
+	entry->rr_type = rr_type;
+	entry->name = talloc_strdup(entry, name);
+	entry->packet = talloc_memdup(entry, packet, len);
+	if (!entry->name || !entry->packet) {
+		talloc_free(entry);
+		return -1;
+	}
+	entry->packet_len = len;
+	entry->created = fr_time();
+	entry->expires = fr_time_add(entry->created, lifetime);
+
+	shard = cache_shard(cache, rr_type, name);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	old = fr_rb_find(shard->tree, entry);
+	if (old) {
+		entry->hits = old->hits;
+		cache_entry_unlink(shard, old);
+
+	} else if (fr_rb_num_elements(shard->tree) >= cache->max_per_shard) {
+		evicted = fr_dlist_head(&shard->lru);
+		cache_entry_unlink(shard, evicted);
+	}
+
+	fr_rb_insert(shard->tree, entry);
+	fr_dlist_insert_tail(&shard->lru, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	talloc_free(old);
+	talloc_free(evicted);
+
+	return 0;
+}
+
+/** Allow an answer to be refreshed again, after a refresh failed
+ *
+ */
+void unbound_cache_prefetch_done(unbound_cache_t *cache, uint16_t rr_type, char const *name)
+{
+	unbound_cache_shard_t	*shard = cache_shard(cache, rr_type, name);
+	unbound_cache_entry_t	find = { .rr_type = rr_type, .name = name }, *entry;
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = fr_rb_find(shard->tree, &find);
+	if (entry) entry->prefetching = false;
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
@@ -0,0 +1,61 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Function prototypes and datatypes for the answer cache.
+ * @file rlm_unbound/cache.h
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(rlm_unbound_cache_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/util/time.h>
+
+/** Answer cache configuration
+ *
+ */
+typedef struct {
+	bool			enable;		//!< Whether answers are cached.
+	uint32_t		max_entries;	//!< Maximum number of answers to cache.
+	fr_time_delta_t		min_ttl;	//!< Answers are cached for at least this long.
+	fr_time_delta_t		max_ttl;	//!< Answers are cached for at most this long.
+	bool			prefetch;	//!< Refresh popular answers before they expire.
+} unbound_cache_conf_t;
+
+typedef struct unbound_cache_s unbound_cache_t;
+
+unbound_cache_t	*unbound_cache_alloc(unbound_cache_conf_t const *conf, bool thread_safe);
+
+uint8_t		*unbound_cache_find(TALLOC_CTX *ctx, size_t *len, bool *prefetch,
+				    unbound_cache_t *cache, uint16_t rr_type, char const *name)
+				    CC_HINT(nonnull);
+
+int		unbound_cache_insert(unbound_cache_t *cache, uint16_t rr_type, char const *name,
+				     uint8_t const *packet, size_t len) CC_HINT(nonnull);
+
+void		unbound_cache_prefetch_done(unbound_cache_t *cache, uint16_t rr_type, char const *name)
+					    CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
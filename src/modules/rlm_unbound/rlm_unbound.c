@@ -32,6 +32,7 @@ RCSID("$Id$")
 #include <freeradius-devel/unlang/xlat_func.h>
 #include <fcntl.h>
 
+#include "cache.h"
 #include "io.h"
 #include "log.h"
 
@@ -41,6 +42,9 @@ typedef struct {
 	char const	*filename;		//!< Unbound configuration file
 	char const	*resolvconf;		//!< resolv.conf file to use
 	char const	*hosts;			//!< hosts file to load
+
+	unbound_cache_conf_t	cache_conf;	//!< Answer cache configuration
+	unbound_cache_t		*cache;		//!< Answers shared by all threads
 } rlm_unbound_t;
 
 typedef struct {
@@ -62,8 +66,29 @@ typedef struct {
 	fr_value_box_list_t	list;		//!< Where to put the parsed results
 	TALLOC_CTX		*out_ctx;	//!< CTX to allocate parsed results in
 	fr_event_timer_t const	*ev;		//!< Event for timeout
+	uint16_t		rr_type;	//!< Type of record being queried
+	char const		*name;		//!< Normalised name, used as the cache key
 } unbound_request_t;
 
+/** A background refresh of a cached answer
+ *
+ */
+typedef struct {
+	int			async_id;	//!< Id of async query
+	rlm_unbound_thread_t	*t;		//!< Thread running this query
+	uint16_t		rr_type;	//!< Type of record being queried
+	char const		*name;		//!< Normalised name, used as the cache key
+} unbound_prefetch_t;
+
+static const conf_parser_t cache_config[] = {
+	{ FR_CONF_OFFSET("enable", unbound_cache_conf_t, enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_entries", unbound_cache_conf_t, max_entries), .dflt = "8192" },
+	{ FR_CONF_OFFSET("min_ttl", unbound_cache_conf_t, min_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_ttl", unbound_cache_conf_t, max_ttl), .dflt = "3600" },
+	{ FR_CONF_OFFSET("prefetch", unbound_cache_conf_t, prefetch), .dflt = "yes" },
+	CONF_PARSER_TERMINATOR
+};
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
@@ -72,6 +97,7 @@ static const conf_parser_t module_config[] = {
 	{ FR_CONF_OFFSET("timeout", rlm_unbound_t, timeout), .dflt = "3000" },
 	{ FR_CONF_OFFSET_FLAGS("resolvconf", CONF_FLAG_FILE_INPUT, rlm_unbound_t, resolvconf) },
 	{ FR_CONF_OFFSET_FLAGS("hosts", CONF_FLAG_FILE_INPUT, rlm_unbound_t, hosts) },
+	{ FR_CONF_OFFSET_SUBSECTION("cache", 0, rlm_unbound_t, cache_conf, cache_config) },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -85,47 +111,19 @@ static int _unbound_request_free(unbound_request_t *ur)
 	return 0;
 }
 
-/**	Callback called by unbound when resolution started with ub_resolve_event() completes
+/** Decode a wire format reply into the value boxes for the request
  *
- * @param mydata	the request tracking structure set up before ub_resolve_event() was called
- * @param rcode		should be the rcode from the reply packet, but appears not to be
- * @param packet	wire format reply packet
- * @param packet_len	length of wire format packet
- * @param sec		DNSSEC status code
- * @param why_bogus	String describing DNSSEC issue if sec = 1
- * @param rate_limited	Was the request rate limited due to unbound workload
+ * Sets ur->done to indicate success or failure.
  */
-static void xlat_unbound_callback(void *mydata, int rcode, void *packet, int packet_len, int sec,
-				  char *why_bogus
-#if UNBOUND_VERSION_MAJOR > 1 || (UNBOUND_VERSION_MAJOR == 1 && UNBOUND_VERSION_MINOR > 7)
-				  , UNUSED int rate_limited
-#endif
-				  )
-
+static void xlat_unbound_decode(unbound_request_t *ur, uint8_t const *packet, int packet_len)
 {
-	unbound_request_t	*ur = talloc_get_type_abort(mydata, unbound_request_t);
 	request_t		*request = ur->request;
 	fr_dbuff_t		dbuff;
 	uint16_t		qdcount = 0, ancount = 0, i, rdlength = 0;
 	uint8_t			pktrcode = 0, skip = 0;
 	ssize_t			used;
 	fr_value_box_t		*vb;
-
-	/*
-	 *	Request has completed remove timeout event and set
-	 *	async_id to 0 so ub_cancel() is not called when ur is freed
-	 */
-	if (ur->ev) (void)fr_event_timer_delete(&ur->ev);
-	ur->async_id = 0;
-
-	/*
-	 *	Bogus responses have the "sec" flag set to 1
-	 */
-	if (sec == 1) {
-		RERROR("%s", why_bogus);
-		ur->done = -16;
-		goto resume;
-	}
+	int			rcode;
 
 	RHEXDUMP4((uint8_t const *)packet, packet_len, "Unbound callback called with packet [length %d]", packet_len);
 
@@ -143,14 +141,14 @@ static void xlat_unbound_callback(void *mydata, int rcode, void *packet, int pac
 	if (rcode != 0) {
 		ur->done = 0 - rcode;
 		REDEBUG("DNS rcode is %d", rcode);
-		goto resume;
+		return;
 	}
 
 	fr_dbuff_out(&qdcount, &dbuff);
 	if (qdcount > 1) {
 		RERROR("DNS results packet with multiple questions");
 		ur->done = -32;
-		goto resume;
+		return;
 	}
 
 	/*	How many answer records do we have? */
@@ -207,7 +205,7 @@ static void xlat_unbound_callback(void *mydata, int rcode, void *packet, int pac
 				talloc_free(vb);
 				fr_value_box_list_talloc_free(&ur->list);
 				ur->done = -32;
-				goto resume;
+				return;
 			}
 			break;
 
@@ -248,11 +246,108 @@ static void xlat_unbound_callback(void *mydata, int rcode, void *packet, int pac
 	}
 
 	ur->done = 1;
+}
+
+/**	Callback called by unbound when resolution started with ub_resolve_event() completes
+ *
+ * @param mydata	the request tracking structure set up before ub_resolve_event() was called
+ * @param rcode		should be the rcode from the reply packet, but appears not to be
+ * @param packet	wire format reply packet
+ * @param packet_len	length of wire format packet
+ * @param sec		DNSSEC status code
+ * @param why_bogus	String describing DNSSEC issue if sec = 1
+ * @param rate_limited	Was the request rate limited due to unbound workload
+ */
+static void xlat_unbound_callback(void *mydata, UNUSED int rcode, void *packet, int packet_len, int sec,
+				  char *why_bogus
+#if UNBOUND_VERSION_MAJOR > 1 || (UNBOUND_VERSION_MAJOR == 1 && UNBOUND_VERSION_MINOR > 7)
+				  , UNUSED int rate_limited
+#endif
+				  )
+
+{
+	unbound_request_t	*ur = talloc_get_type_abort(mydata, unbound_request_t);
+	request_t		*request = ur->request;
+	rlm_unbound_t const	*inst = ur->t->inst;
+
+	/*
+	 *	Request has completed remove timeout event and set
+	 *	async_id to 0 so ub_cancel() is not called when ur is freed
+	 */
+	if (ur->ev) (void)fr_event_timer_delete(&ur->ev);
+	ur->async_id = 0;
+
+	/*
+	 *	Bogus responses have the "sec" flag set to 1
+	 */
+	if (sec == 1) {
+		RERROR("%s", why_bogus);
+		ur->done = -16;
+		goto resume;
+	}
+
+	xlat_unbound_decode(ur, (uint8_t const *)packet, packet_len);
+
+	/*
+	 *	Only answers we could decode are cached.  The cache
+	 *	checks the rest.
+	 */
+	if ((ur->done == 1) && inst->cache) {
+		(void)unbound_cache_insert(inst->cache, ur->rr_type, ur->name, (uint8_t const *)packet, (size_t)packet_len);
+	}
 
 resume:
 	unlang_interpret_mark_runnable(ur->request);
 }
 
+/**	Callback called by unbound when a background refresh of a cached answer completes
+ *
+ */
+static void xlat_unbound_prefetch_callback(void *mydata, UNUSED int rcode, void *packet, int packet_len, int sec,
+					   UNUSED char *why_bogus
+#if UNBOUND_VERSION_MAJOR > 1 || (UNBOUND_VERSION_MAJOR == 1 && UNBOUND_VERSION_MINOR > 7)
+					   , UNUSED int rate_limited
+#endif
+					   )
+{
+	unbound_prefetch_t	*up = talloc_get_type_abort(mydata, unbound_prefetch_t);
+	rlm_unbound_t const	*inst = up->t->inst;
+
+	if ((sec == 1) ||
+	    (unbound_cache_insert(inst->cache, up->rr_type, up->name, (uint8_t const *)packet, (size_t)packet_len) < 0)) {
+		unbound_cache_prefetch_done(inst->cache, up->rr_type, up->name);
+	}
+
+	talloc_free(up);
+}
+
+/** Refresh a cached answer in the background
+ *
+ * There's no request waiting on the result, the answer is just put
+ * back into the cache.
+ */
+static void xlat_unbound_prefetch(rlm_unbound_thread_t *t, unbound_request_t *ur)
+{
+	rlm_unbound_t const	*inst = t->inst;
+	request_t		*request = ur->request;
+	unbound_prefetch_t	*up;
+
+	MEM(up = talloc_zero(t, unbound_prefetch_t));
+	up->t = t;
+	up->rr_type = ur->rr_type;
+	MEM(up->name = talloc_strdup(up, ur->name));
+
+	RDEBUG2("Refreshing cached answer for %s", up->name);
+
+	if (ub_resolve_event(t->ev_b->ub, up->name, up->rr_type, 1, up,
+			     xlat_unbound_prefetch_callback, &up->async_id) != 0) {
+		RWDEBUG("Failed refreshing cached answer");
+		unbound_cache_prefetch_done(inst->cache, up->rr_type, up->name);
+		talloc_free(up);
+	}
+}
+
+
 /**	Callback from our timeout event to cancel a request
  *
  */
@@ -377,10 +472,9 @@ static xlat_action_t xlat_unbound(TALLOC_CTX *ctx, fr_dcursor_t *out,
 
 #define UB_QUERY(_record, _rrvalue, _return, _hasprio) \
 	if (strcmp(query_vb->vb_strvalue, _record) == 0) { \
+		ur->rr_type = _rrvalue; \
 		ur->return_type = _return; \
 		ur->has_priority = _hasprio; \
-		ub_resolve_event(t->ev_b->ub, host_vb->vb_strvalue, _rrvalue, 1, ur, \
-				xlat_unbound_callback, &ur->async_id); \
 	}
 
 	/* coverity[dereference] */
@@ -396,6 +490,42 @@ static xlat_action_t xlat_unbound(TALLOC_CTX *ctx, fr_dcursor_t *out,
 		return XLAT_ACTION_FAIL;
 	}
 
+	if (inst->cache) {
+		uint8_t		*packet;
+		size_t		packet_len;
+		bool		prefetch;
+		char		*name, *p;
+
+		/*
+		 *	Names are case insensitive, and may be fully
+		 *	qualified.  Normalise them so that they all
+		 *	hit the same cache entry.
+		 */
+		MEM(name = talloc_bstrndup(ur, host_vb->vb_strvalue, host_vb->vb_length));
+		if ((host_vb->vb_length > 1) && (name[host_vb->vb_length - 1] == '.')) name[host_vb->vb_length - 1] = '\0';
+		for (p = name; *p; p++) *p = tolower((uint8_t) *p);
+		ur->name = name;
+
+		packet = unbound_cache_find(ur, &packet_len, &prefetch, inst->cache, ur->rr_type, ur->name);
+		if (packet) {
+			xlat_ctx_t our_xctx = *xctx;
+
+			RDEBUG2("Found cached answer for %s", ur->name);
+
+			xlat_unbound_decode(ur, packet, (int)packet_len);
+			talloc_free(packet);
+
+			if (prefetch) xlat_unbound_prefetch(t, ur);
+
+			our_xctx.rctx = ur;
+
+			return xlat_unbound_resume(ctx, out, &our_xctx, request, in);
+		}
+	}
+
+	ub_resolve_event(t->ev_b->ub, host_vb->vb_strvalue, ur->rr_type, 1, ur,
+			 xlat_unbound_callback, &ur->async_id);
+
 	/*
 	 *	unbound returned before we yielded - run the callback
 	 *	This is when serving results from local data
@@ -483,6 +613,38 @@ static int mod_thread_detach(module_thread_inst_ctx_t const *mctx)
 	return 0;
 }
 
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	rlm_unbound_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_unbound_t);
+
+	if (!inst->cache_conf.enable) return 0;
+
+	FR_INTEGER_BOUND_CHECK("cache.max_entries", inst->cache_conf.max_entries, >=, 16);
+	FR_TIME_DELTA_BOUND_CHECK("cache.max_ttl", inst->cache_conf.max_ttl, >=, fr_time_delta_from_sec(1));
+	FR_TIME_DELTA_BOUND_CHECK("cache.min_ttl", inst->cache_conf.min_ttl, <=, inst->cache_conf.max_ttl);
+
+	/*
+	 *	The cache is written to by all threads, so it can't
+	 *	live in the instance data.
+	 */
+	inst->cache = unbound_cache_alloc(&inst->cache_conf, main_config->spawn_workers);
+	if (!inst->cache) {
+		cf_log_err(mctx->mi->conf, "Failed allocating answer cache");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	rlm_unbound_t		*inst = talloc_get_type_abort(mctx->mi->data, rlm_unbound_t);
+
+	TALLOC_FREE(inst->cache);
+
+	return 0;
+}
+
 static int mod_bootstrap(module_inst_ctx_t const *mctx)
 {
 	rlm_unbound_t const	*inst = talloc_get_type_abort(mctx->mi->data, rlm_unbound_t);
@@ -507,6 +669,8 @@ module_rlm_t rlm_unbound = {
 		.inst_size		= sizeof(rlm_unbound_t),
 		.config			= module_config,
 		.bootstrap		= mod_bootstrap,
+		.instantiate		= mod_instantiate,
+		.detach			= mod_detach,
 
 		.thread_inst_size	= sizeof(rlm_unbound_thread_t),
 		.thread_inst_type	= "rlm_unbound_thread_t",
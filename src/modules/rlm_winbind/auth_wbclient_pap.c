@@ -175,3 +175,96 @@ done:
 	return ret;
 }
 
+
+#ifdef WITH_WINBIND_ASYNC
+/** Queue PAP authentication, sent directly to winbindd
+ *
+ * The request will be marked runnable when the result is available,
+ * which can then be retrieved with #auth_wbclient_pap_async_result.
+ *
+ * @param[out] out	Where to write the outstanding authentication.
+ * @param[in] ctx	to allocate the authentication in.
+ * @param[in] wb	Thread's connections to winbindd.
+ * @param[in] request	The current request.
+ * @param[in] env	The call_env for the current winbind authentication.
+ * @return
+ *	- 0	Request queued, the caller should yield.
+ *	- -1	Failed queueing the request.
+ */
+int do_auth_wbclient_pap_async(fr_winbind_auth_t **out, TALLOC_CTX *ctx, fr_winbind_t *wb,
+			       request_t *request, winbind_auth_call_env_t *env)
+{
+	char const	*domain = NULL;
+
+	/*
+	 * username must be set for this function to be called
+	 */
+	fr_assert(env->username.type == FR_TYPE_STRING);
+
+	if (env->domain.type == FR_TYPE_STRING) {
+		domain = env->domain.vb_strvalue;
+	} else {
+		RWDEBUG2("No domain specified; authentication may fail because of this");
+	}
+
+	RDEBUG2("Sending authentication request user='%s' domain='%s'", env->username.vb_strvalue,
+		domain ? domain : "");
+
+	if (fr_winbind_auth_plain(out, ctx, wb, request, env->username.vb_strvalue, domain,
+				  env->password.vb_strvalue) < 0) {
+		RERROR("Unable to send authentication request to winbindd");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Interpret the result of PAP authentication sent directly to winbindd
+ *
+ * @param[in] request	The current request.
+ * @param[in] auth	Completed authentication.
+ * @return
+ *	- 0	Success
+ *	- -1	Authentication failure
+ *	- -648	Password expired
+ */
+int auth_wbclient_pap_async_result(request_t *request, fr_winbind_auth_t const *auth)
+{
+	switch (auth->status) {
+	case FR_WINBIND_AUTH_OK:
+		RDEBUG2("Authenticated successfully");
+		return 0;
+
+	case FR_WINBIND_AUTH_REJECT:
+		/*
+		 * Return the NT_STATUS human readable error string, if there is one.
+		 */
+		if (auth->error) {
+			REDEBUG2("%s [0x%X]", auth->error, auth->nt_status);
+		} else {
+			REDEBUG2("Unknown authentication failure [0x%X]", auth->nt_status);
+		}
+
+		/*
+		 * The password needs to be changed, set ret appropriately.
+		 */
+		if (auth->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
+		    auth->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) return -648;
+		return -1;
+
+	case FR_WINBIND_AUTH_PENDING:
+	case FR_WINBIND_AUTH_FAIL:
+		break;
+	}
+
+	if (auth->error) {
+		REDEBUG2("Failed authenticating user: %s", auth->error);
+	} else {
+		RERROR("Unable to contact winbindd");
+		RDEBUG2("Check that winbind is running and that FreeRADIUS has");
+		RDEBUG2("permission to connect to the winbind privileged socket");
+	}
+
+	return -1;
+}
+#endif
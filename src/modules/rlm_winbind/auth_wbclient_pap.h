@@ -5,3 +5,10 @@
 RCSIDH(auth_wbclient_h, "$Id$")
 
 int do_auth_wbclient_pap(rlm_winbind_t const *inst, request_t *request, winbind_auth_call_env_t *env);
+
+#ifdef WITH_WINBIND_ASYNC
+int do_auth_wbclient_pap_async(fr_winbind_auth_t **out, TALLOC_CTX *ctx, fr_winbind_t *wb,
+			       request_t *request, winbind_auth_call_env_t *env);
+
+int auth_wbclient_pap_async_result(request_t *request, fr_winbind_auth_t const *auth);
+#endif
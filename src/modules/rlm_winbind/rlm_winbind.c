@@ -29,6 +29,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module_rlm.h>
 #include <freeradius-devel/unlang/call_env.h>
+#include <freeradius-devel/unlang/module.h>
 #include <freeradius-devel/unlang/xlat_func.h>
 #include <freeradius-devel/util/debug.h>
 
@@ -44,6 +45,10 @@ static const conf_parser_t group_config[] = {
 
 static const conf_parser_t module_config[] = {
 	{ FR_CONF_POINTER("group", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) group_config },
+#ifdef WITH_WINBIND_ASYNC
+	{ FR_CONF_OFFSET("async", rlm_winbind_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET_SUBSECTION("pipe", 0, rlm_winbind_t, pipe, fr_winbind_conf_config) },
+#endif
 	CONF_PARSER_TERMINATOR
 };
 
@@ -387,6 +392,40 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 }
 
 
+#ifdef WITH_WINBIND_ASYNC
+/** Process the result of authenticating directly with winbindd
+ *
+ * @param[out] p_result		The result of the module call.
+ * @param[in] mctx		Module instance data.
+ * @param[in] request		The current request
+ */
+static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	fr_winbind_auth_t	*auth = talloc_get_type_abort(mctx->rctx, fr_winbind_auth_t);
+	int			ret;
+
+	ret = auth_wbclient_pap_async_result(request, auth);
+	talloc_free(auth);
+
+	if (ret == 0) {
+		RDEBUG2("User authenticated successfully using winbind");
+		RETURN_MODULE_OK;
+	}
+
+	RETURN_MODULE_REJECT;
+}
+
+/** Cancel an outstanding authentication
+ *
+ */
+static void mod_authenticate_signal(module_ctx_t const *mctx, UNUSED request_t *request, UNUSED fr_signal_t action)
+{
+	fr_winbind_auth_t	*auth = talloc_get_type_abort(mctx->rctx, fr_winbind_auth_t);
+
+	talloc_free(auth);
+}
+#endif
+
 /** Authenticate the user via libwbclient and winbind
  *
  * @param[out] p_result		The result of the module call.
@@ -415,6 +454,19 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		RDEBUG2("Login attempt with password");
 	}
 
+#ifdef WITH_WINBIND_ASYNC
+	if (inst->async) {
+		rlm_winbind_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_winbind_thread_t);
+		fr_winbind_auth_t	*auth;
+
+		if (do_auth_wbclient_pap_async(&auth, unlang_interpret_frame_talloc_ctx(request),
+					       t->wb, request, env) < 0) RETURN_MODULE_FAIL;
+
+		return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal,
+					   ~FR_SIGNAL_CANCEL, auth);
+	}
+#endif
+
 	/*
 	 *	Authenticate and return OK if successful. No need for
 	 *	many debug outputs or errors as the auth function is
@@ -526,6 +578,32 @@ static const call_env_method_t winbind_group_xlat_call_env = {
 	}
 };
 
+#ifdef WITH_WINBIND_ASYNC
+/** Create the connections to winbindd used for async authentication
+ *
+ * @param[in] mctx	data for this thread
+ *
+ * @return
+ *	- 0	success
+ *	- -1	failure
+ */
+static int mod_thread_instantiate(module_thread_inst_ctx_t const *mctx)
+{
+	rlm_winbind_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, rlm_winbind_t);
+	rlm_winbind_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_winbind_thread_t);
+
+	if (!inst->async) return 0;
+
+	t->wb = fr_winbind_alloc(t, mctx->el, &inst->pipe, mctx->mi->name);
+	if (!t->wb) {
+		ERROR("Unable to create connections to winbindd");
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
 /** Bootstrap this module
  *
  * @param[in] mctx	data for this module
@@ -574,7 +652,12 @@ module_rlm_t rlm_winbind = {
 		.config		= module_config,
 		.instantiate	= mod_instantiate,
 		.bootstrap	= mod_bootstrap,
-		.detach		= mod_detach
+		.detach		= mod_detach,
+#ifdef WITH_WINBIND_ASYNC
+		.thread_inst_size	= sizeof(rlm_winbind_thread_t),
+		.thread_inst_type	= "rlm_winbind_thread_t",
+		.thread_instantiate	= mod_thread_instantiate
+#endif
 	},
 	.method_group = {
 		.bindings = (module_method_binding_t[]){
@@ -5,6 +5,10 @@
 #include <wbclient.h>
 #include <freeradius-devel/server/pool.h>
 
+#ifdef WITH_WINBIND_ASYNC
+#  include <freeradius-devel/winbind/base.h>
+#endif
+
 /*
  *      Structure for the module configuration.
  */
@@ -14,8 +18,19 @@ typedef struct {
 
 	/* group config */
 	bool			group_add_domain;
+
+#ifdef WITH_WINBIND_ASYNC
+	bool			async;		//!< Talk to winbindd directly, without libwbclient.
+	fr_winbind_conf_t	pipe;		//!< Connections to winbindd for async authentication.
+#endif
 } rlm_winbind_t;
 
+#ifdef WITH_WINBIND_ASYNC
+typedef struct {
+	fr_winbind_t		*wb;		//!< Connections to winbindd.
+} rlm_winbind_thread_t;
+#endif
+
 typedef struct {
 	fr_value_box_t	username;
 	fr_value_box_t	domain;
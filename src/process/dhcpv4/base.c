@@ -25,12 +25,16 @@
 #define LOG_PREFIX "process_dhcpv4"
 
 #include <freeradius-devel/io/application.h>
+#include <freeradius-devel/server/main_config.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/server/module_method.h>
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/dhcpv4/dhcpv4.h>
 
+#include <pthread.h>
+
 static fr_dict_t const *dict_dhcpv4;
 
 extern fr_dict_autoload_t process_dhcpv4_dict[];
@@ -41,12 +45,26 @@ fr_dict_autoload_t process_dhcpv4_dict[] = {
 
 static fr_dict_attr_t const *attr_message_type;
 static fr_dict_attr_t const *attr_yiaddr;
+static fr_dict_attr_t const *attr_ciaddr;
+static fr_dict_attr_t const *attr_chaddr;
+static fr_dict_attr_t const *attr_requested_ip_address;
+static fr_dict_attr_t const *attr_server_identifier;
+static fr_dict_attr_t const *attr_lease_time;
+static fr_dict_attr_t const *attr_renewal_time;
+static fr_dict_attr_t const *attr_rebinding_time;
 static fr_dict_attr_t const *attr_packet_type;
 
 extern fr_dict_attr_autoload_t process_dhcpv4_dict_attr[];
 fr_dict_attr_autoload_t process_dhcpv4_dict_attr[] = {
 	{ .out = &attr_message_type, .name = "Message-Type", .type = FR_TYPE_UINT8, .dict = &dict_dhcpv4},
 	{ .out = &attr_yiaddr, .name = "Your-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_ciaddr, .name = "Client-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_chaddr, .name = "Client-Hardware-Address", .type = FR_TYPE_ETHERNET, .dict = &dict_dhcpv4},
+	{ .out = &attr_requested_ip_address, .name = "Requested-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_server_identifier, .name = "Server-Identifier", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_lease_time, .name = "IP-Address-Lease-Time", .type = FR_TYPE_UINT32, .dict = &dict_dhcpv4},
+	{ .out = &attr_renewal_time, .name = "Renewal-Time", .type = FR_TYPE_UINT32, .dict = &dict_dhcpv4},
+	{ .out = &attr_rebinding_time, .name = "Rebinding-Time", .type = FR_TYPE_UINT32, .dict = &dict_dhcpv4},
 	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_dhcpv4},
 	{ NULL }
 };
@@ -116,10 +134,337 @@ typedef struct {
 	CONF_SECTION	*deny_client;
 } process_dhcpv4_sections_t;
 
+/** A lease which was ACKed by a full run of the policy
+ *
+ */
 typedef struct {
-	process_dhcpv4_sections_t sections;
+	uint8_t			chaddr[6];		//!< Client hardware address.  The key.
+	uint32_t		yiaddr;			//!< The IP address the client was given.
+
+	fr_time_t		created;		//!< When the lease was ACKed
+	fr_time_t		expires;		//!< When the lease expires.
+
+	fr_pair_list_t		reply;			//!< The reply sent to the client.
+
+	fr_rb_node_t		node;			//!< Entry in the shard tree.
+	fr_dlist_t		entry;			//!< Entry in the shard LRU list.
+} process_dhcpv4_lease_t;
+
+/** A subset of the lease cache, with its own lock
+ *
+ */
+typedef struct {
+	fr_rb_tree_t		*tree;			//!< Leases, by chaddr.
+	fr_dlist_head_t		lru;			//!< Least recently used leases are at the head.
+	pthread_mutex_t		mutex;			//!< Synchronisation mutex.
+} process_dhcpv4_lease_shard_t;
+
+/** Number of shards a thread safe lease cache is split into.  Must be a power of 2.
+ */
+#define LEASE_CACHE_SHARDS	32
+
+typedef struct {
+	bool				enable;		//!< Whether we answer renews from the cache.
+	uint32_t			max_entries;	//!< Maximum number of leases we cache.
+	fr_time_delta_t			lifetime;	//!< How long a cached reply can be re-used.
+	fr_time_delta_t			min_remaining;	//!< Renews for leases with less than this left
+							///< go through the policy.
+
+	bool				thread_safe;	//!< Whether we lock the shards.
+	uint32_t			num_shards;	//!< How many shards there are.
+	uint32_t			max_per_shard;	//!< Maximum number of leases in each shard.
+	process_dhcpv4_lease_shard_t	*shard;		//!< Array of shards.
+} process_dhcpv4_lease_cache_t;
+
+typedef struct {
+	process_dhcpv4_sections_t	sections;
+	process_dhcpv4_lease_cache_t	lease_cache;	//!< Leases we can renew without running the policy.
 } process_dhcpv4_t;
 
+static const conf_parser_t lease_cache_config[] = {
+	{ FR_CONF_OFFSET("enable", process_dhcpv4_lease_cache_t, enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_entries", process_dhcpv4_lease_cache_t, max_entries), .dflt = "65536" },
+	{ FR_CONF_OFFSET("lifetime", process_dhcpv4_lease_cache_t, lifetime), .dflt = "3600" },
+	{ FR_CONF_OFFSET("min_remaining", process_dhcpv4_lease_cache_t, min_remaining), .dflt = "300" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static const conf_parser_t request_config[] = {
+	{ FR_CONF_POINTER("lease_cache", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) lease_cache_config },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static const conf_parser_t config[] = {
+	{ FR_CONF_POINTER("Request", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) request_config,
+	  .offset = offsetof(process_dhcpv4_t, lease_cache), },
+
+	CONF_PARSER_TERMINATOR
+};
+
+#define PTHREAD_MUTEX_LOCK if (cache->thread_safe) pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK if (cache->thread_safe) pthread_mutex_unlock
+
+static int8_t lease_cmp(void const *one, void const *two)
+{
+	process_dhcpv4_lease_t const *a = one, *b = two;
+	int ret;
+
+	ret = memcmp(a->chaddr, b->chaddr, sizeof(a->chaddr));
+	return CMP(ret, 0);
+}
+
+static inline CC_HINT(always_inline)
+process_dhcpv4_lease_shard_t *lease_shard(process_dhcpv4_lease_cache_t const *cache, uint8_t const *chaddr)
+{
+	if (cache->num_shards == 1) return &cache->shard[0];
+
+	return &cache->shard[fr_hash(chaddr, 6) & (cache->num_shards - 1)];
+}
+
+/** Remove a lease from its shard.  The caller must hold the lock, and free the lease
+ *
+ */
+static inline void lease_unlink(process_dhcpv4_lease_shard_t *shard, process_dhcpv4_lease_t *lease)
+{
+	fr_rb_remove(shard->tree, lease);
+	fr_dlist_remove(&shard->lru, lease);
+}
+
+static void lease_cache_free(process_dhcpv4_lease_cache_t *cache)
+{
+	uint32_t i;
+
+	for (i = 0; i < cache->num_shards; i++) {
+		process_dhcpv4_lease_shard_t	*shard = &cache->shard[i];
+		process_dhcpv4_lease_t		*lease;
+
+		if (cache->thread_safe) pthread_mutex_destroy(&shard->mutex);
+
+		while ((lease = fr_dlist_head(&shard->lru))) {
+			lease_unlink(shard, lease);
+			talloc_free(lease);
+		}
+		talloc_free(shard->tree);
+	}
+	TALLOC_FREE(cache->shard);
+	cache->num_shards = 0;
+}
+
+static int lease_cache_init(process_dhcpv4_lease_cache_t *cache)
+{
+	uint32_t i;
+
+	/*
+	 *	Only split the cache up if multiple threads will be
+	 *	using it.
+	 */
+	cache->thread_safe = main_config->spawn_workers;
+	cache->num_shards = cache->thread_safe ? LEASE_CACHE_SHARDS : 1;
+	cache->max_per_shard = cache->max_entries / cache->num_shards;
+	if (!cache->max_per_shard) cache->max_per_shard = 1;
+
+	/*
+	 *	The instance data is read-only once the module has
+	 *	been instantiated, so the shards (and their locks)
+	 *	have to be allocated elsewhere.
+	 */
+	cache->shard = talloc_zero_array(NULL, process_dhcpv4_lease_shard_t, cache->num_shards);
+	if (!cache->shard) return -1;
+
+	for (i = 0; i < cache->num_shards; i++) {
+		process_dhcpv4_lease_shard_t *shard = &cache->shard[i];
+
+		fr_dlist_talloc_init(&shard->lru, process_dhcpv4_lease_t, entry);
+
+		/*
+		 *	Leases are parented from the NULL ctx, as
+		 *	they're allocated by multiple threads.
+		 */
+		shard->tree = fr_rb_inline_alloc(NULL, process_dhcpv4_lease_t, node, lease_cmp, NULL);
+		if (!shard->tree) {
+		fail:
+			cache->num_shards = i;
+			lease_cache_free(cache);
+			return -1;
+		}
+
+		if (cache->thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(shard->tree);
+			goto fail;
+		}
+	}
+
+	return 0;
+}
+
+/** Forget any lease we have cached for the client
+ *
+ */
+static void lease_cache_forget(process_dhcpv4_lease_cache_t const *cache, request_t *request)
+{
+	process_dhcpv4_lease_shard_t	*shard;
+	process_dhcpv4_lease_t		find, *lease;
+	fr_pair_t			*vp;
+
+	vp = fr_pair_find_by_da(&request->request_pairs, NULL, attr_chaddr);
+	if (!vp) return;
+
+	memcpy(find.chaddr, vp->vp_ether, sizeof(find.chaddr));
+	shard = lease_shard(cache, find.chaddr);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	lease = fr_rb_find(shard->tree, &find);
+	if (lease) lease_unlink(shard, lease);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	if (lease) {
+		RDEBUG2("Removed lease for %pV from the lease cache", &vp->data);
+		talloc_free(lease);
+	}
+}
+
+/** Cache the reply to a Request which was ACKed
+ *
+ * We need the lease time in the reply, so that we know when the
+ * lease in the backend expires.
+ */
+static void lease_cache_store(process_dhcpv4_lease_cache_t const *cache, request_t *request)
+{
+	process_dhcpv4_lease_shard_t	*shard;
+	process_dhcpv4_lease_t		*lease, *old, *evicted = NULL;
+	fr_pair_t			*chaddr, *yiaddr, *lease_time;
+
+	chaddr = fr_pair_find_by_da(&request->request_pairs, NULL, attr_chaddr);
+	yiaddr = fr_pair_find_by_da(&request->reply_pairs, NULL, attr_yiaddr);
+	lease_time = fr_pair_find_by_da(&request->reply_pairs, NULL, attr_lease_time);
+	if (!chaddr || !yiaddr || !lease_time || (lease_time->vp_uint32 == 0) ||
+	    (lease_time->vp_uint32 == UINT32_MAX)) return;
+
+	/*
+	 *	Do all of the allocations before taking the lock.
+	 */
+	lease = talloc_zero(NULL, process_dhcpv4_lease_t);
+	if (!lease) return;
+
+	memcpy(lease->chaddr, chaddr->vp_ether, sizeof(lease->chaddr));
+	lease->yiaddr = yiaddr->vp_ipv4addr;
+	lease->created = fr_time();
+	lease->expires = fr_time_add(lease->created, fr_time_delta_from_sec(lease_time->vp_uint32));
+
+	fr_pair_list_init(&lease->reply);
+	if (fr_pair_list_copy(lease, &lease->reply, &request->reply_pairs) < 0) {
+		talloc_free(lease);
+		return;
+	}
+
+	shard = lease_shard(cache, lease->chaddr);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	old = fr_rb_find(shard->tree, lease);
+	if (old) {
+		lease_unlink(shard, old);
+
+	} else if (fr_rb_num_elements(shard->tree) >= cache->max_per_shard) {
+		evicted = fr_dlist_head(&shard->lru);
+		lease_unlink(shard, evicted);
+	}
+
+	fr_rb_insert(shard->tree, lease);
+	fr_dlist_insert_tail(&shard->lru, lease);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	RDEBUG2("Added lease for %pV to the lease cache", &chaddr->data);
+
+	talloc_free(old);
+	talloc_free(evicted);
+}
+
+/** See if we can answer a renew from the lease cache
+ *
+ * The Request must be from a client in the RENEWING or REBINDING state,
+ * for the same IP address which we ACKed, and the lease must have enough
+ * time left.  Otherwise the Request goes through the policy as normal.
+ *
+ * @return
+ *	- true if the reply was filled in from the cache.
+ *	- false if the Request should be processed as normal.
+ */
+static bool lease_cache_renew(process_dhcpv4_lease_cache_t const *cache, request_t *request)
+{
+	process_dhcpv4_lease_shard_t	*shard;
+	process_dhcpv4_lease_t		find, *lease;
+	fr_pair_t			*chaddr, *ciaddr, *vp;
+	fr_time_t			now;
+	fr_time_delta_t			remaining = fr_time_delta_wrap(0);
+	bool				hit = false;
+
+	/*
+	 *	RFC 2131 Section 4.3.2.  When renewing or rebinding,
+	 *	'ciaddr' is set, and there's no Server-Identifier or
+	 *	Requested-IP-Address.
+	 */
+	ciaddr = fr_pair_find_by_da(&request->request_pairs, NULL, attr_ciaddr);
+	if (!ciaddr || (ciaddr->vp_ipv4addr == htonl(INADDR_ANY))) return false;
+
+	if (fr_pair_find_by_da(&request->request_pairs, NULL, attr_server_identifier) ||
+	    fr_pair_find_by_da(&request->request_pairs, NULL, attr_requested_ip_address)) return false;
+
+	chaddr = fr_pair_find_by_da(&request->request_pairs, NULL, attr_chaddr);
+	if (!chaddr) return false;
+
+	/*
+	 *	We copy into an empty list, so that a partial copy can
+	 *	just be thrown away.
+	 */
+	if (!fr_pair_list_empty(&request->reply_pairs)) return false;
+
+	memcpy(find.chaddr, chaddr->vp_ether, sizeof(find.chaddr));
+	shard = lease_shard(cache, find.chaddr);
+	now = fr_time();
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	lease = fr_rb_find(shard->tree, &find);
+	if (!lease || (lease->yiaddr != ciaddr->vp_ipv4addr) ||
+	    fr_time_gt(now, fr_time_add(lease->created, cache->lifetime))) goto done;
+
+	remaining = fr_time_sub(lease->expires, now);
+	if (fr_time_delta_lt(remaining, cache->min_remaining)) goto done;
+
+	if (fr_pair_list_copy(request->reply_ctx, &request->reply_pairs, &lease->reply) < 0) {
+		fr_pair_list_free(&request->reply_pairs);
+		goto done;
+	}
+	hit = true;
+
+	fr_dlist_remove(&shard->lru, lease);
+	fr_dlist_insert_tail(&shard->lru, lease);
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	if (!hit) return false;
+
+	/*
+	 *	The backend hasn't extended the lease, so we can only
+	 *	give the client what's left.  It will renew again
+	 *	sooner, and eventually go through the policy.
+	 *
+	 *	The renewal and rebinding times are then the defaults,
+	 *	which are relative to the lease time.
+	 */
+	vp = fr_pair_find_by_da(&request->reply_pairs, NULL, attr_lease_time);
+	if (vp) vp->vp_uint32 = fr_time_delta_to_sec(remaining);
+	fr_pair_delete_by_da(&request->reply_pairs, attr_renewal_time);
+	fr_pair_delete_by_da(&request->reply_pairs, attr_rebinding_time);
+
+	RDEBUG("Answering renew for %pV from the lease cache, %u seconds remaining",
+	       &chaddr->data, (unsigned int) fr_time_delta_to_sec(remaining));
+
+	return true;
+}
+
 #define FR_DHCP_PROCESS_CODE_VALID(_x) (FR_DHCP_PACKET_CODE_VALID(_x) || (_x == FR_DHCP_DO_NOT_RESPOND))
 
 #define PROCESS_PACKET_TYPE		fr_dhcpv4_packet_code_t
@@ -143,6 +488,64 @@ RESUME(check_yiaddr)
 	return CALL_RESUME(send_generic);
 }
 
+RESUME(send_ack)
+{
+	process_dhcpv4_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, process_dhcpv4_t);
+	unlang_action_t		ua;
+
+	ua = CALL_RESUME(check_yiaddr);
+
+	/*
+	 *	If "send Ack" failed, we're now running "send NAK",
+	 *	which removes the lease from the cache.
+	 */
+	if (inst->lease_cache.enable && (ua == UNLANG_ACTION_CALCULATE_RESULT) &&
+	    (request->packet->code == FR_DHCP_REQUEST) && (request->reply->code == FR_DHCP_ACK)) {
+		lease_cache_store(&inst->lease_cache, request);
+	}
+
+	return ua;
+}
+
+RESUME(send_nak)
+{
+	process_dhcpv4_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, process_dhcpv4_t);
+
+	if (inst->lease_cache.enable) lease_cache_forget(&inst->lease_cache, request);
+
+	return CALL_RESUME(send_generic);
+}
+
+RECV(request)
+{
+	process_dhcpv4_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, process_dhcpv4_t);
+
+	/*
+	 *	The policy has already been run for this lease, so
+	 *	we skip both "recv Request" and "send Ack".
+	 */
+	if (inst->lease_cache.enable && lease_cache_renew(&inst->lease_cache, request)) {
+		request->reply->code = FR_DHCP_ACK;
+		request->reply->timestamp = fr_time();
+		dhcpv4_packet_debug(request, request->reply, &request->reply_pairs, false);
+		RETURN_MODULE_OK;
+	}
+
+	return CALL_RECV(generic);
+}
+
+/*
+ *	The client is starting again, or is giving up the lease.
+ */
+RECV(forget)
+{
+	process_dhcpv4_t const	*inst = talloc_get_type_abort_const(mctx->mi->data, process_dhcpv4_t);
+
+	if (inst->lease_cache.enable) lease_cache_forget(&inst->lease_cache, request);
+
+	return CALL_RECV(generic);
+}
+
 static fr_process_state_t const process_state[] = {
 	[FR_DHCP_DISCOVER] = {
 		.packet_type = {
@@ -158,7 +561,7 @@ static fr_process_state_t const process_state[] = {
 		},
 		.rcode = RLM_MODULE_NOOP,
 		.default_reply = FR_DHCP_DO_NOT_RESPOND,
-		.recv = recv_generic,
+		.recv = recv_forget,
 		.resume = resume_recv_generic,
 		.section_offset = PROCESS_CONF_OFFSET(discover),
 	},
@@ -195,7 +598,7 @@ static fr_process_state_t const process_state[] = {
 		},
 		.rcode = RLM_MODULE_NOOP,
 		.default_reply = FR_DHCP_DO_NOT_RESPOND,
-		.recv = recv_generic,
+		.recv = recv_request,
 		.resume = resume_recv_generic,
 		.section_offset = PROCESS_CONF_OFFSET(request),
 	},
@@ -213,7 +616,7 @@ static fr_process_state_t const process_state[] = {
 		},
 		.rcode = RLM_MODULE_NOOP,
 		.default_reply = FR_DHCP_DO_NOT_RESPOND,
-		.recv = recv_generic,
+		.recv = recv_forget,
 		.resume = resume_recv_generic,
 		.section_offset = PROCESS_CONF_OFFSET(request),
 	},
@@ -233,7 +636,7 @@ static fr_process_state_t const process_state[] = {
 		.rcode = RLM_MODULE_NOOP,
 		.default_reply = FR_DHCP_DO_NOT_RESPOND,
 		.send = send_generic,
-		.resume = resume_check_yiaddr,
+		.resume = resume_send_ack,
 		.section_offset = PROCESS_CONF_OFFSET(ack),
 	},
 	[FR_DHCP_NAK] = {
@@ -251,7 +654,7 @@ static fr_process_state_t const process_state[] = {
 		.rcode = RLM_MODULE_NOOP,
 		.default_reply = FR_DHCP_DO_NOT_RESPOND,
 		.send = send_generic,
-		.resume = resume_send_generic,
+		.resume = resume_send_nak,
 		.section_offset = PROCESS_CONF_OFFSET(nak),
 	},
 
@@ -288,7 +691,7 @@ static fr_process_state_t const process_state[] = {
 		},
 		.rcode = RLM_MODULE_NOOP,
 		.default_reply = FR_DHCP_DO_NOT_RESPOND,
-		.recv = recv_generic,
+		.recv = recv_forget,
 		.resume = resume_recv_generic,
 		.section_offset = PROCESS_CONF_OFFSET(release),
 	},
@@ -418,6 +821,32 @@ static unlang_action_t mod_process(rlm_rcode_t *p_result, module_ctx_t const *mc
 	return state->recv(p_result, mctx, request);
 }
 
+static int mod_instantiate(module_inst_ctx_t const *mctx)
+{
+	process_dhcpv4_t	*inst = talloc_get_type_abort(mctx->mi->data, process_dhcpv4_t);
+
+	if (!inst->lease_cache.enable) return 0;
+
+	FR_INTEGER_BOUND_CHECK("lease_cache.max_entries", inst->lease_cache.max_entries, >=, 256);
+	FR_TIME_DELTA_BOUND_CHECK("lease_cache.lifetime", inst->lease_cache.lifetime, >=, fr_time_delta_from_sec(1));
+
+	if (lease_cache_init(&inst->lease_cache) < 0) {
+		cf_log_err(mctx->mi->conf, "Failed allocating lease cache");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	process_dhcpv4_t	*inst = talloc_get_type_abort(mctx->mi->data, process_dhcpv4_t);
+
+	lease_cache_free(&inst->lease_cache);
+
+	return 0;
+}
+
 static const virtual_server_compile_t compile_list[] = {
 	{
 		.section = SECTION_NAME("recv", "Discover"),
@@ -520,7 +949,10 @@ fr_process_module_t process_dhcpv4 = {
 	.common = {
 		.magic		= MODULE_MAGIC_INIT,
 		.name		= "dhcpv4",
-		.inst_size	= sizeof(process_dhcpv4_t)
+		.config		= config,
+		.inst_size	= sizeof(process_dhcpv4_t),
+		.instantiate	= mod_instantiate,
+		.detach		= mod_detach
 	},
 	.process	= mod_process,
 	.compile_list	= compile_list,
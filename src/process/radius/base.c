@@ -39,9 +39,12 @@
 #include <freeradius-devel/unlang/xlat_func.h>
 
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/pair.h>
 #include <freeradius-devel/util/value.h>
 
+#include <pthread.h>
+
 static fr_dict_t const *dict_freeradius;
 static fr_dict_t const *dict_radius;
 
@@ -141,6 +144,51 @@ typedef struct {
 	CONF_SECTION	*deny_client;
 } process_radius_sections_t;
 
+/** An Access-Accept which was sent after a full run of the policy
+ *
+ */
+typedef struct {
+	uint8_t			*key;			//!< Built from the key attributes in the request.
+
+	fr_time_t		expires;		//!< When we stop using the reply.
+
+	fr_pair_list_t		reply;			//!< The reply, without Proxy-State.
+
+	fr_rb_node_t		node;			//!< Entry in the shard tree.
+	fr_dlist_t		entry;			//!< Entry in the shard LRU list.
+} process_radius_reply_t;
+
+/** A subset of the reply cache, with its own lock
+ *
+ */
+typedef struct {
+	fr_rb_tree_t		*tree;			//!< Replies, by key.
+	fr_dlist_head_t		lru;			//!< Least recently used replies are at the head.
+	pthread_mutex_t		mutex;			//!< Synchronisation mutex.
+} process_radius_reply_shard_t;
+
+/** Number of shards a thread safe reply cache is split into.  Must be a power of 2.
+ */
+#define REPLY_CACHE_SHARDS	32
+
+/** Maximum length of a reply cache key
+ */
+#define REPLY_CACHE_KEY_MAX	1024
+
+typedef struct {
+	bool				enable;		//!< Whether we answer Access-Requests from the cache.
+	char const			**key;		//!< Names of the attributes used to build the key.
+	uint32_t			max_entries;	//!< Maximum number of replies we cache.
+	fr_time_delta_t			lifetime;	//!< How long a cached reply can be re-used.
+
+	fr_dict_attr_t const		**key_da;	//!< Resolved key attributes.
+
+	bool				thread_safe;	//!< Whether we lock the shards.
+	uint32_t			num_shards;	//!< How many shards there are.
+	uint32_t			max_per_shard;	//!< Maximum number of replies in each shard.
+	process_radius_reply_shard_t	*shard;		//!< Array of shards.
+} process_radius_reply_cache_t;
+
 typedef struct {
 	fr_time_delta_t	session_timeout;	//!< Maximum time between the last response and next request.
 	uint32_t	max_session;		//!< Maximum ongoing session allowed.
@@ -149,7 +197,12 @@ typedef struct {
 						//!< authenticating server to be identified in packet
 						//!<captures.
 
+	bool		state_compact;		//!< Store session-state encoded between rounds.
+	bool		state_intern;		//!< Intern session-state values between rounds.
+
 	fr_state_tree_t	*state_tree;		//!< State tree to link multiple requests/responses.
+
+	process_radius_reply_cache_t	reply_cache;	//!< Replies we can re-send without running the policy.
 } process_radius_auth_t;
 
 typedef struct {
@@ -164,6 +217,7 @@ typedef struct {
 typedef struct {
 	fr_value_box_list_head_t	proxy_state;	//!< These need to be copied into the response in exactly
 							///< the same order as they were added.
+	uint8_t				*cache_key;	//!< Where we cache the reply, if it's an Access-Accept.
 } process_radius_request_pairs_t;
 
 #define FR_RADIUS_PROCESS_CODE_VALID(_x) (FR_RADIUS_PACKET_CODE_VALID(_x) || (_x == FR_RADIUS_CODE_DO_NOT_RESPOND))
@@ -180,12 +234,25 @@ static const conf_parser_t session_config[] = {
 	{ FR_CONF_OFFSET("timeout", process_radius_auth_t, session_timeout), .dflt = "15" },
 	{ FR_CONF_OFFSET("max", process_radius_auth_t, max_session), .dflt = "4096" },
 	{ FR_CONF_OFFSET("state_server_id", process_radius_auth_t, state_server_id) },
+	{ FR_CONF_OFFSET("compact", process_radius_auth_t, state_compact), .dflt = "no" },
+	{ FR_CONF_OFFSET("intern", process_radius_auth_t, state_intern), .dflt = "no" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static const conf_parser_t reply_cache_config[] = {
+	{ FR_CONF_OFFSET("enable", process_radius_reply_cache_t, enable), .dflt = "no" },
+	{ FR_CONF_OFFSET_FLAGS("key", CONF_FLAG_MULTI, process_radius_reply_cache_t, key) },
+	{ FR_CONF_OFFSET("max_entries", process_radius_reply_cache_t, max_entries), .dflt = "16384" },
+	{ FR_CONF_OFFSET("lifetime", process_radius_reply_cache_t, lifetime), .dflt = "60" },
 
 	CONF_PARSER_TERMINATOR
 };
 
 static const conf_parser_t auth_config[] = {
 	{ FR_CONF_POINTER("session", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) session_config },
+	{ FR_CONF_POINTER("reply_cache", 0, CONF_FLAG_SUBSECTION, NULL), .subcs = (void const *) reply_cache_config,
+	  .offset = offsetof(process_radius_auth_t, reply_cache), },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -309,6 +376,241 @@ void radius_request_pairs_to_reply(request_t *request, process_radius_request_pa
 	REXDENT();
 }
 
+#define PTHREAD_MUTEX_LOCK if (cache->thread_safe) pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK if (cache->thread_safe) pthread_mutex_unlock
+
+static int8_t reply_cmp(void const *one, void const *two)
+{
+	process_radius_reply_t const *a = one, *b = two;
+	size_t a_len = talloc_array_length(a->key);
+	size_t b_len = talloc_array_length(b->key);
+	int ret;
+
+	ret = CMP(a_len, b_len);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->key, b->key, a_len);
+	return CMP(ret, 0);
+}
+
+static inline CC_HINT(always_inline)
+process_radius_reply_shard_t *reply_shard(process_radius_reply_cache_t const *cache, uint8_t const *key)
+{
+	if (cache->num_shards == 1) return &cache->shard[0];
+
+	return &cache->shard[fr_hash(key, talloc_array_length(key)) & (cache->num_shards - 1)];
+}
+
+/** Remove a reply from its shard.  The caller must hold the lock, and free the reply
+ *
+ */
+static inline void reply_unlink(process_radius_reply_shard_t *shard, process_radius_reply_t *reply)
+{
+	fr_rb_remove(shard->tree, reply);
+	fr_dlist_remove(&shard->lru, reply);
+}
+
+static void reply_cache_free(process_radius_reply_cache_t *cache)
+{
+	uint32_t i;
+
+	for (i = 0; i < cache->num_shards; i++) {
+		process_radius_reply_shard_t	*shard = &cache->shard[i];
+		process_radius_reply_t		*reply;
+
+		if (cache->thread_safe) pthread_mutex_destroy(&shard->mutex);
+
+		while ((reply = fr_dlist_head(&shard->lru))) {
+			reply_unlink(shard, reply);
+			talloc_free(reply);
+		}
+		talloc_free(shard->tree);
+	}
+	TALLOC_FREE(cache->shard);
+	cache->num_shards = 0;
+}
+
+static int reply_cache_init(process_radius_reply_cache_t *cache)
+{
+	uint32_t i;
+
+	/*
+	 *	Only split the cache up if multiple threads will be
+	 *	using it.
+	 */
+	cache->thread_safe = main_config->spawn_workers;
+	cache->num_shards = cache->thread_safe ? REPLY_CACHE_SHARDS : 1;
+	cache->max_per_shard = cache->max_entries / cache->num_shards;
+	if (!cache->max_per_shard) cache->max_per_shard = 1;
+
+	/*
+	 *	The instance data is read-only once the module has
+	 *	been instantiated, so the shards (and their locks)
+	 *	have to be allocated elsewhere.
+	 */
+	cache->shard = talloc_zero_array(NULL, process_radius_reply_shard_t, cache->num_shards);
+	if (!cache->shard) return -1;
+
+	for (i = 0; i < cache->num_shards; i++) {
+		process_radius_reply_shard_t *shard = &cache->shard[i];
+
+		fr_dlist_talloc_init(&shard->lru, process_radius_reply_t, entry);
+
+		/*
+		 *	Replies are parented from the NULL ctx, as
+		 *	they're allocated by multiple threads.
+		 */
+		shard->tree = fr_rb_inline_alloc(NULL, process_radius_reply_t, node, reply_cmp, NULL);
+		if (!shard->tree) {
+		fail:
+			cache->num_shards = i;
+			reply_cache_free(cache);
+			return -1;
+		}
+
+		if (cache->thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(shard->tree);
+			goto fail;
+		}
+	}
+
+	return 0;
+}
+
+/** Build the reply cache key for a request
+ *
+ * Each key attribute contributes a two byte length, followed by its
+ * value in network format.
+ *
+ * @return
+ *	- The key, allocated in ctx.
+ *	- NULL if one of the key attributes is missing, or the key is too long.
+ */
+static uint8_t *reply_cache_key(TALLOC_CTX *ctx, process_radius_reply_cache_t const *cache, request_t *request)
+{
+	uint8_t		buffer[REPLY_CACHE_KEY_MAX];
+	fr_dbuff_t	dbuff = FR_DBUFF_TMP(buffer, sizeof(buffer));
+	size_t		i;
+
+	for (i = 0; i < talloc_array_length(cache->key_da); i++) {
+		fr_pair_t		*vp;
+		fr_dbuff_marker_t	hdr;
+		ssize_t			slen;
+
+		vp = fr_pair_find_by_da(&request->request_pairs, NULL, cache->key_da[i]);
+		if (!vp) {
+			RDEBUG3("No %s in the request, not using the reply cache", cache->key_da[i]->name);
+			return NULL;
+		}
+
+		fr_dbuff_marker(&hdr, &dbuff);
+		if (fr_dbuff_advance(&dbuff, 2) < 0) return NULL;
+
+		slen = fr_value_box_to_network(&dbuff, &vp->data);
+		if ((slen < 0) || (slen > UINT16_MAX)) return NULL;
+
+		fr_dbuff_in(&hdr, (uint16_t) slen);
+	}
+
+	return talloc_memdup(ctx, buffer, fr_dbuff_used(&dbuff));
+}
+
+/** Cache the reply to an Access-Request which was accepted
+ *
+ */
+static void reply_cache_store(process_radius_reply_cache_t const *cache, request_t *request, uint8_t const *key)
+{
+	process_radius_reply_shard_t	*shard;
+	process_radius_reply_t		*reply, *old, *evicted = NULL;
+
+	/*
+	 *	Do all of the allocations before taking the lock.
+	 */
+	reply = talloc_zero(NULL, process_radius_reply_t);
+	if (!reply) return;
+
+	reply->key = talloc_memdup(reply, key, talloc_array_length(key));
+	if (!reply->key) {
+	error:
+		talloc_free(reply);
+		return;
+	}
+	reply->expires = fr_time_add(fr_time(), cache->lifetime);
+
+	/*
+	 *	The Proxy-State is added from each request.
+	 */
+	fr_pair_list_init(&reply->reply);
+	if (fr_pair_list_copy(reply, &reply->reply, &request->reply_pairs) < 0) goto error;
+	fr_pair_delete_by_da(&reply->reply, attr_proxy_state);
+
+	shard = reply_shard(cache, reply->key);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	old = fr_rb_find(shard->tree, reply);
+	if (old) {
+		reply_unlink(shard, old);
+
+	} else if (fr_rb_num_elements(shard->tree) >= cache->max_per_shard) {
+		evicted = fr_dlist_head(&shard->lru);
+		reply_unlink(shard, evicted);
+	}
+
+	fr_rb_insert(shard->tree, reply);
+	fr_dlist_insert_tail(&shard->lru, reply);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	RDEBUG2("Added Access-Accept to the reply cache");
+
+	talloc_free(old);
+	talloc_free(evicted);
+}
+
+/** See if we can answer an Access-Request from the reply cache
+ *
+ * @return
+ *	- true if the reply was filled in from the cache.
+ *	- false if the Access-Request should be processed as normal.
+ */
+static bool reply_cache_find(process_radius_reply_cache_t const *cache, request_t *request, uint8_t *key)
+{
+	process_radius_reply_shard_t	*shard;
+	process_radius_reply_t		find, *reply;
+	bool				hit = false;
+
+	/*
+	 *	We copy into an empty list, so that a partial copy can
+	 *	just be thrown away.
+	 */
+	if (!fr_pair_list_empty(&request->reply_pairs)) return false;
+
+	find.key = key;
+	shard = reply_shard(cache, key);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	reply = fr_rb_find(shard->tree, &find);
+	if (!reply) goto done;
+
+	/*
+	 *	Leave it for the store, or the LRU, to clean up.
+	 */
+	if (fr_time_gt(fr_time(), reply->expires)) goto done;
+
+	if (fr_pair_list_copy(request->reply_ctx, &request->reply_pairs, &reply->reply) < 0) {
+		fr_pair_list_free(&request->reply_pairs);
+		goto done;
+	}
+	hit = true;
+
+	fr_dlist_remove(&shard->lru, reply);
+	fr_dlist_insert_tail(&shard->lru, reply);
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return hit;
+}
+
 /** A wrapper around recv generic which stores fields from the request
  */
 RECV(generic_radius_request)
@@ -345,6 +647,51 @@ RECV(access_request)
 		return CALL_SEND_TYPE(FR_RADIUS_CODE_ACCESS_REJECT);
 	}
 
+	/*
+	 *	Requests which are part of a multi-round session,
+	 *	or which come from another virtual server, always go
+	 *	through the policy.
+	 */
+	if (inst->auth.reply_cache.enable && !request->parent &&
+	    !fr_pair_find_by_da(&request->request_pairs, NULL, attr_state)) {
+		module_ctx_t			our_mctx = *mctx;
+		process_radius_request_pairs_t	*rctx;
+		uint8_t				*key;
+
+		key = reply_cache_key(unlang_interpret_frame_talloc_ctx(request), &inst->auth.reply_cache, request);
+		if (!key) return CALL_RECV(generic_radius_request);
+
+		rctx = radius_request_pairs_store(request);
+
+		/*
+		 *	Skip all of the policy, and send the same
+		 *	Access-Accept as last time.
+		 */
+		if (reply_cache_find(&inst->auth.reply_cache, request, key)) {
+			talloc_free(key);
+
+			request->reply->code = FR_RADIUS_CODE_ACCESS_ACCEPT;
+			radius_request_pairs_to_reply(request, rctx);
+			talloc_free(rctx);
+
+			RDEBUG("Answering from the reply cache");
+			request->reply->timestamp = fr_time();
+			radius_packet_debug(request, request->reply, &request->reply_pairs, false);
+			RETURN_MODULE_OK;
+		}
+
+		if (!rctx) {
+			MEM(rctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), process_radius_request_pairs_t));
+			fr_value_box_list_init(&rctx->proxy_state);
+		}
+		rctx->cache_key = talloc_steal(rctx, key);
+
+		our_mctx.rctx = rctx;
+		mctx = &our_mctx;	/* Our mutable mctx */
+
+		return CALL_RECV(generic);
+	}
+
 	return CALL_RECV(generic_radius_request);
 }
 
@@ -579,6 +926,26 @@ RESUME(access_accept)
 		RWDEBUG("Please update Stripped-User-Name with information which identifies the user.");
 	}
 
+	/*
+	 *	Only cache the reply if "send Access-Accept" didn't fail.
+	 */
+	if (mctx->rctx) {
+		process_radius_request_pairs_t *rctx = talloc_get_type_abort(mctx->rctx, process_radius_request_pairs_t);
+
+		if (rctx->cache_key && (request->reply->code == FR_RADIUS_CODE_ACCESS_ACCEPT)) {
+			switch (*p_result) {
+			case RLM_MODULE_OK:
+			case RLM_MODULE_UPDATED:
+			case RLM_MODULE_NOOP:
+				reply_cache_store(&inst->auth.reply_cache, request, rctx->cache_key);
+				break;
+
+			default:
+				break;
+			}
+		}
+	}
+
 	fr_state_discard(inst->auth.state_tree, request);
 	radius_request_pairs_to_reply(request, mctx->rctx);
 	RETURN_MODULE_OK;
@@ -885,6 +1252,46 @@ static xlat_action_t xlat_func_radius_secret_verify(TALLOC_CTX *ctx, fr_dcursor_
 	return XLAT_ACTION_DONE;
 }
 
+/** Return the state_server_id of the server which created the State attribute
+ *
+ * Allows a cluster of servers, each with their own state_server_id, to
+ * send the later rounds of a session to the server holding its state.
+ *
+ * Example:
+@verbatim
+%radius.state.server_id()
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t xlat_func_radius_state_server_id(TALLOC_CTX *ctx, fr_dcursor_t *out, UNUSED xlat_ctx_t const *xctx,
+						      request_t *request, UNUSED fr_value_box_list_t *args)
+{
+	fr_pair_t		*vp;
+	fr_value_box_t		*vb;
+	int			server_id;
+
+	if (request->dict != dict_radius) return XLAT_ACTION_FAIL;
+
+	vp = fr_pair_find_by_da(&request->request_pairs, NULL, attr_state);
+	if (!vp) {
+		RDEBUG2("No %s attribute", attr_state->name);
+		return XLAT_ACTION_DONE;
+	}
+
+	server_id = fr_state_server_id(vp);
+	if (server_id < 0) {
+		RDEBUG2("%s attribute was not created by a server", attr_state->name);
+		return XLAT_ACTION_DONE;
+	}
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT8, NULL));
+	vb->vb_uint8 = server_id;
+	fr_dcursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
+}
+
 static int mod_instantiate(module_inst_ctx_t const *mctx)
 {
 	process_radius_t	*inst = talloc_get_type_abort(mctx->mi->data, process_radius_t);
@@ -894,6 +1301,53 @@ static int mod_instantiate(module_inst_ctx_t const *mctx)
 	inst->auth.state_tree = fr_state_tree_init(inst, attr_state, main_config->spawn_workers, inst->auth.max_session,
 						   inst->auth.session_timeout, inst->auth.state_server_id,
 						   fr_hash_string(cf_section_name2(inst->server_cs)));
+	fr_state_tree_compact_set(inst->auth.state_tree, inst->auth.state_compact);
+	fr_state_tree_intern_set(inst->auth.state_tree, inst->auth.state_intern);
+
+	if (inst->auth.reply_cache.enable) {
+		process_radius_reply_cache_t	*cache = &inst->auth.reply_cache;
+		size_t				i, num = talloc_array_length(cache->key);
+
+		if (!num) {
+			cf_log_err(mctx->mi->conf, "Access-Request.reply_cache.key must be set when the reply cache is enabled");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("reply_cache.max_entries", cache->max_entries, >=, 256);
+		FR_TIME_DELTA_BOUND_CHECK("reply_cache.lifetime", cache->lifetime, >=, fr_time_delta_from_sec(1));
+
+		MEM(cache->key_da = talloc_array(inst, fr_dict_attr_t const *, num));
+		for (i = 0; i < num; i++) {
+			fr_dict_attr_t const *da;
+
+			da = fr_dict_attr_by_oid(NULL, fr_dict_root(dict_radius), cache->key[i]);
+			if (!da) {
+				cf_log_err(mctx->mi->conf, "Unknown reply_cache.key attribute '%s'", cache->key[i]);
+				return -1;
+			}
+
+			if (!fr_type_is_leaf(da->type)) {
+				cf_log_err(mctx->mi->conf, "Invalid reply_cache.key attribute '%s' - it must be a leaf type",
+					   cache->key[i]);
+				return -1;
+			}
+			cache->key_da[i] = da;
+		}
+
+		if (reply_cache_init(cache) < 0) {
+			cf_log_err(mctx->mi->conf, "Failed allocating reply cache");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int mod_detach(module_detach_ctx_t const *mctx)
+{
+	process_radius_t	*inst = talloc_get_type_abort(mctx->mi->data, process_radius_t);
+
+	reply_cache_free(&inst->auth.reply_cache);
 
 	return 0;
 }
@@ -916,12 +1370,16 @@ static int mod_load(void)
 
 	xlat_func_args_set(xlat, xlat_func_radius_secret_verify_args);
 
+	if (unlikely(!xlat_func_register(NULL, "radius.state.server_id", xlat_func_radius_state_server_id,
+					 FR_TYPE_UINT8))) return -1;
+
 	return 0;
 }
 
 static void mod_unload(void)
 {
 	xlat_func_unregister("radius.secret.verify");
+	xlat_func_unregister("radius.state.server_id");
 }
 
 /*
@@ -1245,7 +1703,8 @@ fr_process_module_t process_radius = {
 		.onload		= mod_load,
 		.unload		= mod_unload,
 		.bootstrap	= mod_bootstrap,
-		.instantiate	= mod_instantiate
+		.instantiate	= mod_instantiate,
+		.detach		= mod_detach
 	},
 	.process	= mod_process,
 	.compile_list	= compile_list,
@@ -201,6 +201,12 @@ int		fr_dhcpv4_packet_encode(fr_packet_t *packet, fr_pair_list_t *list);
 #include <linux/if_packet.h>
 int		fr_dhcpv4_raw_socket_open(struct sockaddr_ll *p_ll, int iface_index);
 
+int		fr_dhcpv4_raw_socket_open_send(struct sockaddr_ll *p_ll, int iface_index);
+
+ssize_t		fr_dhcpv4_raw_send(int sockfd, struct sockaddr_ll *p_ll,
+				   uint8_t const src_addr[static ETH_ADDR_LEN], uint8_t const dst_addr[static ETH_ADDR_LEN],
+				   fr_socket_t const *socket, uint8_t const *data, size_t data_len);
+
 int		fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *p_ll,
 					  fr_packet_t *packet, fr_pair_list_t *list);
 
@@ -46,16 +46,7 @@
 #include <net/if_arp.h>
 
 #ifdef HAVE_LINUX_IF_PACKET_H
-/** Open a raw socket to read/write packets from/to
- *
- * @param[out] link_layer	A sockaddr_ll struct to populate.  Must be passed to other raw
- *				functions.
- * @param[in] ifindex		of the interface we're binding to.
- * @return
- *	- >= 0 a file descriptor to read/write packets on.
- *	- <0 an error occurred.
- */
-int fr_dhcpv4_raw_socket_open(struct sockaddr_ll *link_layer, int ifindex)
+static int raw_socket_open(struct sockaddr_ll *link_layer, int ifindex, uint16_t protocol)
 {
 	int fd;
 
@@ -63,7 +54,7 @@ int fr_dhcpv4_raw_socket_open(struct sockaddr_ll *link_layer, int ifindex)
 	 * PF_PACKET - packet interface on device level.
 	 * using a raw socket allows packet data to be unchanged by the device driver.
 	 */
-	fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	fd = socket(PF_PACKET, SOCK_RAW, protocol);
 	if (fd < 0) {
 		fr_strerror_printf("Cannot open socket: %s", fr_syserror(errno));
 		return fd;
@@ -73,7 +64,7 @@ int fr_dhcpv4_raw_socket_open(struct sockaddr_ll *link_layer, int ifindex)
 	memset(link_layer, 0, sizeof(struct sockaddr_ll));
 
 	link_layer->sll_family = AF_PACKET;
-	link_layer->sll_protocol = htons(ETH_P_ALL);
+	link_layer->sll_protocol = protocol;
 	link_layer->sll_ifindex = ifindex;
 	link_layer->sll_hatype = ARPHRD_ETHER;
 	link_layer->sll_pkttype = PACKET_OTHERHOST;
@@ -88,60 +79,90 @@ int fr_dhcpv4_raw_socket_open(struct sockaddr_ll *link_layer, int ifindex)
 	return fd;
 }
 
-/** Create the requisite L2/L3 headers, and write a DHCPv4 packet to a raw socket
+/** Open a raw socket to read/write packets from/to
+ *
+ * @param[out] link_layer	A sockaddr_ll struct to populate.  Must be passed to other raw
+ *				functions.
+ * @param[in] ifindex		of the interface we're binding to.
+ * @return
+ *	- >= 0 a file descriptor to read/write packets on.
+ *	- <0 an error occurred.
+ */
+int fr_dhcpv4_raw_socket_open(struct sockaddr_ll *link_layer, int ifindex)
+{
+	return raw_socket_open(link_layer, ifindex, htons(ETH_P_ALL));
+}
+
+/** Open a raw socket which is only used to write packets
+ *
+ * The socket is bound with protocol 0, so the kernel doesn't queue
+ * any received packets to it.
+ *
+ * @param[out] link_layer	A sockaddr_ll struct to populate.  Must be passed to other raw
+ *				functions.
+ * @param[in] ifindex		of the interface we're binding to.
+ * @return
+ *	- >= 0 a file descriptor to write packets on.
+ *	- <0 an error occurred.
+ */
+int fr_dhcpv4_raw_socket_open_send(struct sockaddr_ll *link_layer, int ifindex)
+{
+	return raw_socket_open(link_layer, ifindex, 0);
+}
+
+/** Create the requisite L2/L3 headers, and write encoded DHCPv4 data to a raw socket
  *
  * @param[in] sockfd		to write to.
  * @param[in] link_layer	information, as returned by fr_dhcpv4_raw_socket_open.
- * @param[in] packet		to write.
- * @param[in] list		to send.
+ * @param[in] src_addr		Ethernet source address.
+ * @param[in] dst_addr		Ethernet destination address.
+ * @param[in] socket		IP addresses and UDP ports to use.
+ * @param[in] data		the encoded DHCPv4 packet.
+ * @param[in] data_len		length of the encoded DHCPv4 packet.
  * @return
- *	- 0 on success.
+ *	- >= 0 the number of bytes written.
  *	- -1 on failure.
  */
-int fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *link_layer,
-			      fr_packet_t *packet, fr_pair_list_t *list)
+ssize_t fr_dhcpv4_raw_send(int sockfd, struct sockaddr_ll *link_layer,
+			   uint8_t const src_addr[static ETH_ADDR_LEN], uint8_t const dst_addr[static ETH_ADDR_LEN],
+			   fr_socket_t const *socket, uint8_t const *data, size_t data_len)
 {
 	uint8_t			dhcp_packet[1518] = { 0 };
 	ethernet_header_t	*eth_hdr = (ethernet_header_t *)dhcp_packet;
 	ip_header_t		*ip_hdr = (ip_header_t *)(dhcp_packet + ETH_HDR_SIZE);
 	udp_header_t		*udp_hdr = (udp_header_t *) (dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE);
-	dhcp_packet_t		*dhcp = (dhcp_packet_t *)(dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE);
+	uint8_t			*dhcp = dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE;
+	uint16_t		l4_len = (UDP_HDR_SIZE + data_len);
+	struct sockaddr_ll	dst_ll = *link_layer;
 
-	uint16_t		l4_len = (UDP_HDR_SIZE + packet->data_len);
-	fr_pair_t		*vp;
-
-	/* set ethernet source address to our MAC address (Client-Hardware-Address). */
-	uint8_t dhmac[ETH_ADDR_LEN] = { 0 };
-	if ((vp = fr_pair_find_by_da(list, NULL, attr_dhcp_client_hardware_address))) {
-		if (vp->vp_type == FR_TYPE_ETHERNET) memcpy(dhmac, vp->vp_ether, sizeof(vp->vp_ether));
+	if (data_len > (sizeof(dhcp_packet) - (ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE))) {
+		fr_strerror_printf("DHCP packet is too large (%zu) for a raw socket", data_len);
+		return -1;
 	}
 
 	/* fill in Ethernet layer (L2) */
-	memcpy(eth_hdr->dst_addr, eth_bcast, ETH_ADDR_LEN);
-	memcpy(eth_hdr->src_addr, dhmac, ETH_ADDR_LEN);
+	memcpy(eth_hdr->dst_addr, dst_addr, ETH_ADDR_LEN);
+	memcpy(eth_hdr->src_addr, src_addr, ETH_ADDR_LEN);
 	eth_hdr->ether_type = htons(ETH_TYPE_IP);
 
 	/* fill in IP layer (L3) */
 	ip_hdr->ip_vhl = IP_VHL(4, 5);
 	ip_hdr->ip_tos = 0;
-	ip_hdr->ip_len = htons(IP_HDR_SIZE +  UDP_HDR_SIZE + packet->data_len);
+	ip_hdr->ip_len = htons(IP_HDR_SIZE +  UDP_HDR_SIZE + data_len);
 	ip_hdr->ip_id = 0;
 	ip_hdr->ip_off = 0;
 	ip_hdr->ip_ttl = 64;
 	ip_hdr->ip_p = 17;
 	ip_hdr->ip_sum = 0; /* Filled later */
 
-	/* saddr: packet src IP addr (default: 0.0.0.0). */
-	ip_hdr->ip_src.s_addr = packet->socket.inet.src_ipaddr.addr.v4.s_addr;
-
-	/* daddr: packet destination IP addr (should be 255.255.255.255 for broadcast). */
-	ip_hdr->ip_dst.s_addr = packet->socket.inet.dst_ipaddr.addr.v4.s_addr;
+	ip_hdr->ip_src.s_addr = socket->inet.src_ipaddr.addr.v4.s_addr;
+	ip_hdr->ip_dst.s_addr = socket->inet.dst_ipaddr.addr.v4.s_addr;
 
 	/* IP header checksum */
 	ip_hdr->ip_sum = fr_ip_header_checksum((uint8_t const *)ip_hdr, 5);
 
-	udp_hdr->src = htons(packet->socket.inet.src_port);
-	udp_hdr->dst = htons(packet->socket.inet.dst_port);
+	udp_hdr->src = htons(socket->inet.src_port);
+	udp_hdr->dst = htons(socket->inet.dst_port);
 
 	udp_hdr->len = htons(l4_len);
 	udp_hdr->checksum = 0; /* UDP checksum will be done after dhcp header */
@@ -149,15 +170,50 @@ int fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *link_layer,
 	/* DHCP layer (L7) */
 
 	/* just copy what FreeRADIUS has encoded for us. */
-	memcpy(dhcp, packet->data, packet->data_len);
+	memcpy(dhcp, data, data_len);
 
 	/* UDP checksum is done here */
 	udp_hdr->checksum = fr_udp_checksum((uint8_t const *)(dhcp_packet + ETH_HDR_SIZE + IP_HDR_SIZE),
 					    l4_len, udp_hdr->checksum,
-					    packet->socket.inet.src_ipaddr.addr.v4, packet->socket.inet.dst_ipaddr.addr.v4);
+					    socket->inet.src_ipaddr.addr.v4, socket->inet.dst_ipaddr.addr.v4);
+
+	/*
+	 *	The socket may have been opened with protocol 0, so
+	 *	tell the kernel what we're sending, and to whom.
+	 */
+	dst_ll.sll_protocol = htons(ETH_P_IP);
+	memcpy(dst_ll.sll_addr, dst_addr, ETH_ADDR_LEN);
+
+	return sendto(sockfd, dhcp_packet, (ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE + data_len),
+		      0, (struct sockaddr *) &dst_ll, sizeof(dst_ll));
+}
+
+/** Create the requisite L2/L3 headers, and write a DHCPv4 packet to a raw socket
+ *
+ * @param[in] sockfd		to write to.
+ * @param[in] link_layer	information, as returned by fr_dhcpv4_raw_socket_open.
+ * @param[in] packet		to write.
+ * @param[in] list		to send.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *link_layer,
+			      fr_packet_t *packet, fr_pair_list_t *list)
+{
+	fr_pair_t		*vp;
 
-	return sendto(sockfd, dhcp_packet, (ETH_HDR_SIZE + IP_HDR_SIZE + UDP_HDR_SIZE + packet->data_len),
-		      0, (struct sockaddr *) link_layer, sizeof(struct sockaddr_ll));
+	/* set ethernet source address to our MAC address (Client-Hardware-Address). */
+	uint8_t dhmac[ETH_ADDR_LEN] = { 0 };
+	if ((vp = fr_pair_find_by_da(list, NULL, attr_dhcp_client_hardware_address))) {
+		if (vp->vp_type == FR_TYPE_ETHERNET) memcpy(dhmac, vp->vp_ether, sizeof(vp->vp_ether));
+	}
+
+	/*
+	 *	daddr: packet destination IP addr (should be 255.255.255.255 for broadcast).
+	 */
+	return fr_dhcpv4_raw_send(sockfd, link_layer, dhmac, eth_bcast,
+				  &packet->socket, packet->data, packet->data_len);
 }
 
 /*
@@ -6,6 +6,7 @@
 TARGET		:= libfreeradius-internal$(L)
 
 SOURCES		:= decode.c \
-		   encode.c
+		   encode.c \
+		   record.c
 
 TGT_PREREQS	:= libfreeradius-util$(L)
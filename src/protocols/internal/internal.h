@@ -62,3 +62,65 @@ ssize_t fr_internal_decode_pair_dbuff(TALLOC_CTX *ctx, fr_pair_list_t *out, fr_d
 
 ssize_t fr_internal_decode_list_dbuff(TALLOC_CTX *ctx, fr_pair_list_t *out, fr_dict_attr_t const *parent,
 				fr_dbuff_t *dbuff, void *decode_ctx);
+
+/*
+ *	Record framing for files of internally encoded pairs.
+ *
+ *	File header:
+ *
+ *	0                   1                   2                   3
+ *	0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                         Magic ("FRIR")                        |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|    Version    |                   Reserved                    |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ *	Each record:
+ *
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|      Zero     |     Flags     |           Reserved            |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                         Payload length                        |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                       Payload checksum                        |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                          Packet code                          |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                   Timestamp (seconds, 64 bit)                 |
+ *	|                                                               |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|   Payload (internally encoded pairs) ...
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-
+ *
+ *	The leading zero byte means a record can never be confused with
+ *	a text detail entry.  The checksum covers only the payload, so
+ *	that readers can update the flags in place.
+ */
+#define FR_INTERNAL_RECORD_MAGIC		"FRIR"
+#define FR_INTERNAL_RECORD_VERSION		1
+#define FR_INTERNAL_RECORD_FILE_HEADER_LEN	8
+#define FR_INTERNAL_RECORD_HEADER_LEN		24
+#define FR_INTERNAL_RECORD_FLAGS_OFFSET		1	//!< Offset of the flags byte in the record header.
+
+#define FR_INTERNAL_RECORD_FLAG_DONE		0x01	//!< Record has been processed by a reader.
+
+typedef struct {
+	uint8_t		flags;		//!< FR_INTERNAL_RECORD_FLAG_* values.
+	uint32_t	code;		//!< Packet code.
+	uint64_t	timestamp;	//!< When the original packet was received (seconds).
+	uint8_t const	*payload;	//!< Internally encoded pairs.
+	size_t		payload_len;	//!< Length of the payload.
+} fr_internal_record_t;
+
+void	fr_internal_record_file_header(uint8_t out[static FR_INTERNAL_RECORD_FILE_HEADER_LEN]);
+
+bool	fr_internal_record_file_header_ok(uint8_t const *data, size_t data_len);
+
+void	fr_internal_record_header(uint8_t out[static FR_INTERNAL_RECORD_HEADER_LEN],
+				  uint32_t code, uint64_t timestamp,
+				  uint8_t const *payload, size_t payload_len);
+
+ssize_t	fr_internal_record_decode(fr_internal_record_t *out, uint8_t const *data, size_t data_len);
+
+ssize_t	fr_internal_record_find(uint8_t const **out, fr_internal_record_t const *record, fr_dict_attr_t const *da);
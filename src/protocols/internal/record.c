@@ -0,0 +1,170 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file protocols/internal/record.c
+ * @brief Length prefixed records of internally encoded pairs, for storing packets in files.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+#include <freeradius-devel/internal/internal.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/nbo.h>
+#include <freeradius-devel/util/strerror.h>
+
+/** Write the header which marks a file as containing records
+ *
+ * @param[out] out	Where to write the header.
+ */
+void fr_internal_record_file_header(uint8_t out[static FR_INTERNAL_RECORD_FILE_HEADER_LEN])
+{
+	memset(out, 0, FR_INTERNAL_RECORD_FILE_HEADER_LEN);
+	memcpy(out, FR_INTERNAL_RECORD_MAGIC, sizeof(FR_INTERNAL_RECORD_MAGIC) - 1);
+	out[4] = FR_INTERNAL_RECORD_VERSION;
+}
+
+/** Check whether data starts with a file header we understand
+ *
+ * @param[in] data	Start of the file.
+ * @param[in] data_len	Length of the data.
+ * @return
+ *	- true if this is a record file.
+ *	- false if it is not (e.g. a text detail file).
+ */
+bool fr_internal_record_file_header_ok(uint8_t const *data, size_t data_len)
+{
+	if (data_len < FR_INTERNAL_RECORD_FILE_HEADER_LEN) return false;
+
+	if (memcmp(data, FR_INTERNAL_RECORD_MAGIC, sizeof(FR_INTERNAL_RECORD_MAGIC) - 1) != 0) return false;
+
+	return (data[4] == FR_INTERNAL_RECORD_VERSION);
+}
+
+/** Fill in the header for a record
+ *
+ * The header is normally written directly before the payload.
+ *
+ * @param[out] out		Where to write the header.
+ * @param[in] code		Packet code.
+ * @param[in] timestamp		When the packet was received.
+ * @param[in] payload		Internally encoded pairs.
+ * @param[in] payload_len	Length of the payload.
+ */
+void fr_internal_record_header(uint8_t out[static FR_INTERNAL_RECORD_HEADER_LEN],
+			       uint32_t code, uint64_t timestamp,
+			       uint8_t const *payload, size_t payload_len)
+{
+	memset(out, 0, 4);
+	fr_nbo_from_uint32(out + 4, (uint32_t) payload_len);
+	fr_nbo_from_uint32(out + 8, fr_hash(payload, payload_len));
+	fr_nbo_from_uint32(out + 12, code);
+	fr_nbo_from_uint64(out + 16, timestamp);
+}
+
+/** Decode a record header, and verify the payload
+ *
+ * @param[out] out	Decoded record.  The payload points into data.
+ *			If the checksum fails, the rest of out is still
+ *			filled in, so that the caller can skip the record.
+ * @param[in] data	Start of the record.
+ * @param[in] data_len	Length of the data available.
+ * @return
+ *	- >0 the length of the complete record.
+ *	- 0 the record is truncated.
+ *	- <0 the record is malformed, or fails its checksum.
+ */
+ssize_t fr_internal_record_decode(fr_internal_record_t *out, uint8_t const *data, size_t data_len)
+{
+	size_t		payload_len;
+
+	if (data_len < FR_INTERNAL_RECORD_HEADER_LEN) return 0;
+
+	if (data[0] != 0) {
+		fr_strerror_const("Invalid record header");
+		return -1;
+	}
+
+	payload_len = fr_nbo_to_uint32(data + 4);
+	if (payload_len > (data_len - FR_INTERNAL_RECORD_HEADER_LEN)) return 0;
+
+	*out = (fr_internal_record_t) {
+		.flags = data[FR_INTERNAL_RECORD_FLAGS_OFFSET],
+		.code = fr_nbo_to_uint32(data + 12),
+		.timestamp = fr_nbo_to_uint64(data + 16),
+		.payload = data + FR_INTERNAL_RECORD_HEADER_LEN,
+		.payload_len = payload_len
+	};
+
+	if (fr_hash(out->payload, payload_len) != fr_nbo_to_uint32(data + 8)) {
+		fr_strerror_const("Record checksum does not match payload");
+		return -1;
+	}
+
+	return FR_INTERNAL_RECORD_HEADER_LEN + payload_len;
+}
+
+/** Find the value of a top level attribute in a record
+ *
+ * This walks the encoded pairs without decoding them, for when only
+ * one value is needed, e.g. to decide how a record should be scheduled.
+ *
+ * @param[out] out	Start of the attribute's value.  Points into the record.
+ * @param[in] record	to search.
+ * @param[in] da	to search for.  Must be a top level attribute.
+ * @return
+ *	- >= 0 the length of the value.
+ *	- <0 the attribute wasn't found, or the payload is malformed.
+ */
+ssize_t fr_internal_record_find(uint8_t const **out, fr_internal_record_t const *record, fr_dict_attr_t const *da)
+{
+	uint8_t const	*p = record->payload, *end = p + record->payload_len;
+	bool		want_internal = (da->parent == fr_dict_root(fr_dict_internal()));
+
+	while (p < end) {
+		uint8_t		enc_byte, ext_byte = 0;
+		size_t		type_size, len_size, i;
+		uint64_t	type = 0, len = 0;
+
+		enc_byte = *p++;
+		type_size = ((enc_byte & FR_INTERNAL_MASK_TYPE) >> 5) + 1;
+		len_size = ((enc_byte & FR_INTERNAL_MASK_LEN) >> 2) + 1;
+
+		if (enc_byte & FR_INTERNAL_FLAG_EXTENDED) {
+			if (p >= end) break;
+			ext_byte = *p++;
+		}
+
+		if ((size_t) (end - p) < (type_size + len_size)) break;
+
+		for (i = 0; i < type_size; i++) type = (type << 8) | *p++;
+		for (i = 0; i < len_size; i++) len = (len << 8) | *p++;
+
+		if (len > (size_t) (end - p)) break;
+
+		if ((type == da->attr) &&
+		    !(ext_byte & FR_INTERNAL_FLAG_UNKNOWN) &&
+		    (((ext_byte & FR_INTERNAL_FLAG_INTERNAL) != 0) == want_internal)) {
+			*out = p;
+			return len;
+		}
+
+		p += len;
+	}
+
+	return -1;
+}
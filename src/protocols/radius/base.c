@@ -302,25 +302,31 @@ invalid:
 	return packet_len;
 }
 
-/** Sign a previously encoded packet
+/** Prepare a previously encoded packet for signing
  *
- * Calculates the request/response authenticator for packets which need it, and fills
- * in the message-authenticator value if the attribute is present in the encoded packet.
+ * Fills in the authenticator field of the header as needed for the
+ * Message-Authenticator and Request/Response Authenticator calculations,
+ * and zeroes the Message-Authenticator value.
  *
+ * @param[out] ma		where to write a pointer to the Message-Authenticator
+ *				value, or NULL if the packet doesn't contain one.
+ * @param[out] authenticator	whether the header needs a Request/Response Authenticator.
  * @param[in,out] packet	(request or response).
  * @param[in] vector		original packet vector to use
- * @param[in] secret		to sign the packet with.
  * @param[in] secret_len	The length of the secret.
  * @return
  *	- <0 on error
  *	- 0 on success
  */
-int fr_radius_sign(uint8_t *packet, uint8_t const *vector,
-		   uint8_t const *secret, size_t secret_len)
+static int radius_sign_prepare(uint8_t **ma, bool *authenticator,
+			       uint8_t *packet, uint8_t const *vector, size_t secret_len)
 {
 	uint8_t		*msg, *end;
 	size_t		packet_len = fr_nbo_to_uint16(packet + 2);
 
+	*ma = NULL;
+	*authenticator = false;
+
 	/*
 	 *	No real limit on secret length, this is just
 	 *	to catch uninitialised fields.
@@ -363,41 +369,19 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *vector,
 			return -1;
 		}
 
-		switch (packet[0]) {
-		case FR_RADIUS_CODE_ACCOUNTING_REQUEST:
-		case FR_RADIUS_CODE_DISCONNECT_REQUEST:
-		case FR_RADIUS_CODE_COA_REQUEST:
-			memset(packet + 4, 0, RADIUS_AUTH_VECTOR_LENGTH);
-			break;
-
-		case FR_RADIUS_CODE_ACCESS_ACCEPT:
-		case FR_RADIUS_CODE_ACCESS_REJECT:
-		case FR_RADIUS_CODE_ACCESS_CHALLENGE:
-		case FR_RADIUS_CODE_ACCOUNTING_RESPONSE:
-		case FR_RADIUS_CODE_DISCONNECT_ACK:
-		case FR_RADIUS_CODE_DISCONNECT_NAK:
-		case FR_RADIUS_CODE_COA_ACK:
-		case FR_RADIUS_CODE_COA_NAK:
-			if (!vector) goto need_original;
-			memcpy(packet + 4, vector, RADIUS_AUTH_VECTOR_LENGTH);
-			break;
-
-		case FR_RADIUS_CODE_ACCESS_REQUEST:
-		case FR_RADIUS_CODE_STATUS_SERVER:
-			/* packet + 4 MUST be the Request Authenticator filled with random data */
-			break;
-
-		default:
-			goto bad_packet;
-		}
+		/*
+		 *	Protocol-Error packets can't contain a
+		 *	Message-Authenticator.
+		 */
+		if (packet[0] == FR_RADIUS_CODE_PROTOCOL_ERROR) goto bad_packet;
 
 		/*
-		 *	Force Message-Authenticator to be zero,
-		 *	calculate the HMAC, and put it into the
-		 *	Message-Authenticator attribute.
+		 *	Force Message-Authenticator to be zero.  The
+		 *	caller calculates the HMAC, and puts it into
+		 *	the Message-Authenticator attribute.
 		 */
 		memset(msg + 2, 0, RADIUS_AUTH_VECTOR_LENGTH);
-		fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		*ma = msg + 2;
 		break;
 	}
 
@@ -421,7 +405,6 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *vector,
 	case FR_RADIUS_CODE_COA_NAK:
 	case FR_RADIUS_CODE_PROTOCOL_ERROR:
 		if (!vector) {
-		need_original:
 			fr_strerror_const("Cannot sign response packet without a request packet");
 			return -1;
 		}
@@ -443,6 +426,37 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *vector,
 		return -1;
 	}
 
+	*authenticator = true;
+
+	return 0;
+}
+
+/** Sign a previously encoded packet
+ *
+ * Calculates the request/response authenticator for packets which need it, and fills
+ * in the message-authenticator value if the attribute is present in the encoded packet.
+ *
+ * @param[in,out] packet	(request or response).
+ * @param[in] vector		original packet vector to use
+ * @param[in] secret		to sign the packet with.
+ * @param[in] secret_len	The length of the secret.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_radius_sign(uint8_t *packet, uint8_t const *vector,
+		   uint8_t const *secret, size_t secret_len)
+{
+	uint8_t		*ma;
+	bool		authenticator;
+	size_t		packet_len = fr_nbo_to_uint16(packet + 2);
+
+	if (radius_sign_prepare(&ma, &authenticator, packet, vector, secret_len) < 0) return -1;
+
+	if (ma) fr_hmac_md5(ma, packet, packet_len, secret, secret_len);
+
+	if (!authenticator) return 0;
+
 	/*
 	 *	Request / Response Authenticator = MD5(packet + secret)
 	 */
@@ -459,6 +473,83 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *vector,
 	return 0;
 }
 
+/** Sign multiple previously encoded packets
+ *
+ * Produces the same result as calling fr_radius_sign() for each packet,
+ * but calculates the digests for several packets in parallel.
+ *
+ * @param[in,out] sign		packets to sign.
+ * @param[in] num		number of packets.
+ * @return
+ *	- <0 on error.  Packets before the one which failed have been
+ *	  signed, and the index of the failed packet is -(ret + 1).
+ *	- 0 on success
+ */
+int fr_radius_sign_multi(fr_radius_sign_t const *sign, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i += MD5_MULTI_LANES) {
+		fr_hmac_md5_multi_t	hmac[MD5_MULTI_LANES];
+		fr_md5_multi_t		md5[MD5_MULTI_LANES];
+		uint8_t			*ma[MD5_MULTI_LANES], *hdr[MD5_MULTI_LANES];
+		uint8_t			digest[MD5_MULTI_LANES][MD5_DIGEST_LENGTH];
+		size_t			j, num_hmac = 0, num_md5 = 0, lanes = ((num - i) < MD5_MULTI_LANES) ? (num - i) : MD5_MULTI_LANES;
+		ssize_t			failed = -1;
+
+		for (j = 0; j < lanes; j++) {
+			fr_radius_sign_t const	*p = &sign[i + j];
+			uint8_t			*msg;
+			bool			authenticator;
+
+			if (radius_sign_prepare(&msg, &authenticator, p->packet, p->vector, p->secret_len) < 0) {
+				failed = j;
+				lanes = j;
+				break;
+			}
+
+			if (msg) {
+				ma[num_hmac] = msg;
+				hmac[num_hmac++] = (fr_hmac_md5_multi_t) {
+					.in = p->packet,
+					.inlen = fr_nbo_to_uint16(p->packet + 2),
+					.key = p->secret,
+					.key_len = p->secret_len
+				};
+			}
+
+			if (authenticator) {
+				hdr[num_md5] = p->packet + 4;
+				md5[num_md5++] = (fr_md5_multi_t) {
+					.in = p->packet,
+					.inlen = fr_nbo_to_uint16(p->packet + 2),
+					.suffix = p->secret,
+					.suffix_len = p->secret_len
+				};
+			}
+		}
+
+		/*
+		 *	Message-Authenticator has to be filled in
+		 *	before the Request / Response Authenticator
+		 *	is calculated.
+		 */
+		if (num_hmac) {
+			fr_hmac_md5_multi(digest, hmac, num_hmac);
+			for (j = 0; j < num_hmac; j++) memcpy(ma[j], digest[j], MD5_DIGEST_LENGTH);
+		}
+
+		if (num_md5) {
+			fr_md5_calc_multi(digest, md5, num_md5);
+			for (j = 0; j < num_md5; j++) memcpy(hdr[j], digest[j], MD5_DIGEST_LENGTH);
+		}
+
+		if (failed >= 0) return -(int)(i + failed) - 1;
+	}
+
+	return 0;
+}
+
 
 /** See if the data pointed to by PTR is a valid RADIUS packet.
  *
@@ -1044,6 +1135,153 @@ ssize_t fr_radius_encode(fr_dbuff_t *dbuff, fr_pair_list_t *vps, fr_radius_encod
 	return fr_dbuff_set(dbuff, &work_dbuff);
 }
 
+/** Check whether an attribute can be copied verbatim into a packet with a different authenticator
+ *
+ * @param[in] attr	to check.  Must have been validated by fr_radius_ok().
+ * @return
+ *	- true if the attribute doesn't depend on the Request Authenticator.
+ *	- false if it does, or we can't tell.
+ */
+static bool radius_attr_forwardable(uint8_t const *attr)
+{
+	fr_dict_attr_t const	*da, *vendor;
+	fr_dict_vendor_t const	*dv;
+	uint8_t const		*p, *end;
+
+	/*
+	 *	CHAP uses the Request Authenticator as the challenge,
+	 *	if there's no CHAP-Challenge.
+	 */
+	if (attr[0] == FR_CHAP_PASSWORD) return false;
+
+	da = fr_dict_attr_child_by_num(fr_dict_root(dict_radius), attr[0]);
+	if (!da) return true;	/* Unknown attributes are never encrypted */
+
+	if (da != attr_vendor_specific) {
+		if (fr_type_is_leaf(da->type)) return !flag_encrypted(&da->flags);
+
+		/*
+		 *	Extended attributes can contain anything,
+		 *	including encrypted VSAs.
+		 */
+		return false;
+	}
+
+	if (attr[1] < 6) return false;
+
+	vendor = fr_dict_attr_child_by_num(da, fr_nbo_to_uint32(attr + 2));
+	if (!vendor) return true;
+
+	/*
+	 *	We only look inside of VSAs using the standard
+	 *	format.  Anything else is sent through the encoder.
+	 */
+	dv = fr_dict_vendor_by_da(vendor);
+	if (!dv || (dv->type != 1) || (dv->length != 1)) return false;
+
+	end = attr + attr[1];
+	for (p = attr + 6; p < end; p += p[1]) {
+		if (((end - p) < 2) || (p[1] < 2) || ((p + p[1]) > end)) return false;
+
+		da = fr_dict_attr_child_by_num(vendor, p[0]);
+		if (da && (!fr_type_is_leaf(da->type) || flag_encrypted(&da->flags))) return false;
+	}
+
+	return true;
+}
+
+/** Forward a packet without decoding and re-encoding it
+ *
+ * The attributes from the original packet are copied verbatim, with the
+ * header, Message-Authenticator and Proxy-State set up as fr_radius_encode()
+ * would do.  The caller MUST then sign the packet with fr_radius_sign().
+ *
+ * This only works if the original packet doesn't contain any attributes
+ * which are encrypted, or which otherwise depend on the Request Authenticator.
+ *
+ * @param[out] dbuff		to write the packet to.
+ * @param[in] original		packet, as received.  Must have been validated by fr_radius_ok().
+ * @param[in] original_len	length of the original packet.
+ * @param[in] packet_ctx	code, ID, etc. for the new packet.
+ * @return
+ *	- >0 the length of the new packet.
+ *	- 0 if the packet can't be forwarded verbatim, and must be re-encoded.
+ *	- <0 the number of bytes we need to write the packet.
+ */
+ssize_t fr_radius_encode_forward(fr_dbuff_t *dbuff, uint8_t const *original, size_t original_len,
+				 fr_radius_encode_ctx_t *packet_ctx)
+{
+	uint8_t const		*attr, *end;
+	fr_dbuff_t		work_dbuff, length_dbuff;
+	int			i;
+
+	if ((original_len < RADIUS_HEADER_LENGTH) || (original[0] != packet_ctx->code)) return 0;
+	if (fr_nbo_to_uint16(original + 2) < original_len) original_len = fr_nbo_to_uint16(original + 2);
+
+	end = original + original_len;
+	for (attr = original + RADIUS_HEADER_LENGTH; attr < end; attr += attr[1]) {
+		if (((end - attr) < 2) || (attr[1] < 2) || ((attr + attr[1]) > end)) return 0;
+
+		if (attr[0] == FR_MESSAGE_AUTHENTICATOR) continue;
+
+		if (!radius_attr_forwardable(attr)) return 0;
+	}
+
+	work_dbuff = FR_DBUFF_MAX(dbuff, 65535);
+
+	FR_DBUFF_IN_BYTES_RETURN(&work_dbuff, packet_ctx->code, packet_ctx->id);
+	length_dbuff = FR_DBUFF(&work_dbuff);
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint16_t) RADIUS_HEADER_LENGTH);
+
+	switch (packet_ctx->code) {
+	case FR_RADIUS_CODE_ACCESS_REQUEST:
+		packet_ctx->request_authenticator = fr_dbuff_current(&work_dbuff);
+		for (i = 0; i < 4; i++) {
+			FR_DBUFF_IN_RETURN(&work_dbuff, (uint32_t) fr_rand());
+		}
+		break;
+
+	case FR_RADIUS_CODE_ACCOUNTING_REQUEST:
+	case FR_RADIUS_CODE_COA_REQUEST:
+	case FR_RADIUS_CODE_DISCONNECT_REQUEST:
+		packet_ctx->request_authenticator = fr_dbuff_current(&work_dbuff);
+		FR_DBUFF_MEMSET_RETURN(&work_dbuff, 0, RADIUS_AUTH_VECTOR_LENGTH);
+		break;
+
+	default:
+		return 0;
+	}
+
+	/*
+	 *	The original Message-Authenticator is wrong for the
+	 *	new packet.  Add our own where fr_radius_encode() would
+	 *	put it, and let fr_radius_sign() fill it in.
+	 */
+	if (!packet_ctx->common->secure_transport && (packet_ctx->code == FR_RADIUS_CODE_ACCESS_REQUEST)) {
+		FR_DBUFF_IN_BYTES_RETURN(&work_dbuff, FR_MESSAGE_AUTHENTICATOR, 0x12,
+					 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+					 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
+		packet_ctx->seen_message_authenticator = true;
+	}
+
+	for (attr = original + RADIUS_HEADER_LENGTH; attr < end; attr += attr[1]) {
+		if (attr[0] == FR_MESSAGE_AUTHENTICATOR) continue;
+
+		FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, attr, attr[1]);
+	}
+
+	if (packet_ctx->add_proxy_state) {
+		FR_DBUFF_IN_BYTES_RETURN(&work_dbuff, FR_PROXY_STATE, 6);
+		FR_DBUFF_IN_RETURN(&work_dbuff, packet_ctx->common->proxy_state);
+	}
+
+	fr_dbuff_in(&length_dbuff, (uint16_t) (fr_dbuff_used(&work_dbuff)));
+
+	FR_PROTO_HEX_DUMP(fr_dbuff_start(&work_dbuff), fr_dbuff_used(&work_dbuff), "%s forwarded packet", __FUNCTION__);
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
 ssize_t	fr_radius_decode(TALLOC_CTX *ctx, fr_pair_list_t *out,
 			 uint8_t *packet, size_t packet_len,
 			 fr_radius_decode_ctx_t *decode_ctx)
@@ -1122,12 +1360,24 @@ ssize_t	fr_radius_decode(TALLOC_CTX *ctx, fr_pair_list_t *out,
 
 	attr = packet + 20;
 	end = packet + packet_len;
+	decode_ctx->packet = packet;
 
 	/*
 	 *	The caller MUST have called fr_radius_ok() first.  If
 	 *	he doesn't, all hell breaks loose.
 	 */
 	while (attr < end) {
+		/*
+		 *	The caller only cares about some attributes.
+		 *	fr_radius_ok() has checked the lengths, so we
+		 *	can just skip the others.
+		 */
+		if (decode_ctx->decode_only &&
+		    ((decode_ctx->decode_only[attr[0] >> 3] & (1 << (attr[0] & 0x07))) == 0)) {
+			attr += attr[1];
+			continue;
+		}
+
 		slen = fr_radius_decode_pair(ctx, out, attr, (end - attr), decode_ctx);
 		if (slen < 0) return slen;
 
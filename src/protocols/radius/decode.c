@@ -1457,6 +1457,34 @@ static ssize_t decode_tlv_trampoline(TALLOC_CTX *ctx, fr_pair_list_t *out,
 }
 
 
+/*
+ *	Data types which RADIUS encodes in the standard network
+ *	format.  When an attribute of one of these types has no
+ *	flags, fr_value_box_from_network() can decode it directly.
+ *
+ *	"octets" isn't here, as it has to deal with fixed lengths,
+ *	and with borrowing the packet data.  The prefixes have their
+ *	own RADIUS specific format.
+ */
+static const bool decode_direct[FR_TYPE_MAX + 1] = {
+	[FR_TYPE_STRING]	= true,
+	[FR_TYPE_BOOL]		= true,
+	[FR_TYPE_UINT8]		= true,
+	[FR_TYPE_UINT16]	= true,
+	[FR_TYPE_UINT32]	= true,
+	[FR_TYPE_UINT64]	= true,
+	[FR_TYPE_INT8]		= true,
+	[FR_TYPE_INT16]		= true,
+	[FR_TYPE_INT32]		= true,
+	[FR_TYPE_INT64]		= true,
+	[FR_TYPE_DATE]		= true,
+	[FR_TYPE_TIME_DELTA]	= true,
+	[FR_TYPE_IPV4_ADDR]	= true,
+	[FR_TYPE_IPV6_ADDR]	= true,
+	[FR_TYPE_IFID]		= true,
+	[FR_TYPE_ETHERNET]	= true,
+};
+
 /** Create any kind of VP from the attribute contents
  *
  *  "length" is AT LEAST the length of this attribute, as we
@@ -1507,6 +1535,17 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, fr_pair_list_t *out,
 	 */
 	if (attr_len == 0) return 0;
 
+	/*
+	 *	Most attributes are simple leaf types with no tags or
+	 *	encryption.  Skip all of the checks below for them.
+	 */
+	if (!parent->flags.subtype && decode_direct[parent->type]) {
+		vp = fr_pair_afrom_da(ctx, parent);
+		if (!vp) return -1;
+
+		goto decode;
+	}
+
 	/*
 	 *	Hacks for tags.
 	 */
@@ -1928,6 +1967,18 @@ ssize_t fr_radius_decode_pair_value(TALLOC_CTX *ctx, fr_pair_list_t *out,
 		 *	doesn't.  Therefore it's malformed.
 		 */
 		if (parent->flags.length && (data_len != parent->flags.length)) goto raw;
+
+		/*
+		 *	Reference the caller's copy of the packet,
+		 *	unless the data was rewritten into a
+		 *	temporary buffer (e.g. decrypted, or
+		 *	concatenated).
+		 */
+		if (packet_ctx->borrow && (p >= packet_ctx->packet) && ((p + data_len) <= packet_ctx->end)) {
+			fr_value_box_memdup_borrowed(&vp->data, vp->da,
+						     packet_ctx->borrow + (p - packet_ctx->packet), data_len, true);
+			break;
+		}
 		FALL_THROUGH;
 
 	default:
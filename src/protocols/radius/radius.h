@@ -174,6 +174,11 @@ typedef struct {
 	TALLOC_CTX		*tmp_ctx;		//!< for temporary things cleaned up during decoding
 	uint8_t const  		*end;			//!< end of the packet
 
+	uint8_t const		*packet;		//!< start of the packet being decoded.
+	uint8_t const		*borrow;		//!< copy of the packet which outlives the decoded pairs.
+							///< If set, octets values reference this copy instead of
+							///< being duplicated.
+
 	uint8_t			request_code;		//!< original code for the request.
 
 	bool 			tunnel_password_zeros;  //!< check for trailing zeros on decode
@@ -181,11 +186,24 @@ typedef struct {
 	bool			require_message_authenticator;
 	bool			limit_proxy_state;	//!< Don't allow Proxy-State in requests
 
+	uint8_t const		*decode_only;		//!< Bitmap of top-level attribute numbers to decode.
+							///< If set, all other attributes are skipped.
+
 	fr_radius_tag_ctx_t    	**tags;			//!< for decoding tagged attributes
 	fr_pair_list_t		*tag_root;		//!< Where to insert tag attributes.
 	TALLOC_CTX		*tag_root_ctx;		//!< Where to allocate new tag attributes.
 } fr_radius_decode_ctx_t;
 
+/** A packet for fr_radius_sign_multi()
+ *
+ */
+typedef struct {
+	uint8_t			*packet;		//!< Encoded packet to sign.
+	uint8_t const		*vector;		//!< Original packet vector, for replies.
+	uint8_t const		*secret;		//!< Shared secret.
+	size_t			secret_len;		//!< Length of the shared secret.
+} fr_radius_sign_t;
+
 extern fr_table_num_sorted_t const fr_radius_require_ma_table[];
 extern size_t fr_radius_require_ma_table_len;
 
@@ -205,6 +223,8 @@ int		fr_radius_allow_reply(int code, bool allowed[static FR_RADIUS_CODE_MAX]);
 int		fr_radius_sign(uint8_t *packet, uint8_t const *vector,
 			       uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
 
+int		fr_radius_sign_multi(fr_radius_sign_t const *sign, size_t num) CC_HINT(nonnull);
+
 int		fr_radius_verify(uint8_t *packet, uint8_t const *vector,
 				 uint8_t const *secret, size_t secret_len,
 				 bool require_message_authenticator, bool limit_proxy_state) CC_HINT(nonnull (1,3));
@@ -219,6 +239,9 @@ ssize_t		fr_radius_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *sr
 
 ssize_t		fr_radius_encode(fr_dbuff_t *dbuff, fr_pair_list_t *vps, fr_radius_encode_ctx_t *packet_ctx) CC_HINT(nonnull);
 
+ssize_t		fr_radius_encode_forward(fr_dbuff_t *dbuff, uint8_t const *original, size_t original_len,
+					 fr_radius_encode_ctx_t *packet_ctx) CC_HINT(nonnull);
+
 ssize_t		fr_radius_decode(TALLOC_CTX *ctx, fr_pair_list_t *out,
 				 uint8_t *packet, size_t packet_len,
 				 fr_radius_decode_ctx_t *decode_ctx) CC_HINT(nonnull);
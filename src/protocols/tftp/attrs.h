@@ -38,5 +38,8 @@ extern HIDDEN fr_dict_attr_t const *attr_tftp_error_message;
 extern HIDDEN fr_dict_attr_t const *attr_tftp_filename;
 extern HIDDEN fr_dict_attr_t const *attr_tftp_opcode;
 extern HIDDEN fr_dict_attr_t const *attr_tftp_mode;
+extern HIDDEN fr_dict_attr_t const *attr_tftp_timeout;
+extern HIDDEN fr_dict_attr_t const *attr_tftp_transfer_size;
+extern HIDDEN fr_dict_attr_t const *attr_tftp_window_size;
 
 extern HIDDEN fr_dict_attr_t const *attr_packet_type;
@@ -32,6 +32,103 @@ RCSID("$Id$")
 #include "tftp.h"
 #include "attrs.h"
 
+/** Decode the options in a request, or in an Option-Acknowledgement
+ *
+ *  Each option is a pair of NUL terminated strings, the name and then
+ *  the value in ASCII.  Names are case insensitive, and options we
+ *  don't know about are ignored, as required by RFC 2347.
+ */
+static int decode_options(TALLOC_CTX *ctx, fr_pair_list_t *out, uint8_t const *p, uint8_t const *end)
+{
+	while (p < end) {
+		uint8_t const		*name, *value, *q;
+		size_t			name_len;
+		fr_dict_attr_t const	*da;
+		fr_pair_t		*vp;
+		char			*p_end = NULL;
+		unsigned long long	num;
+
+		name = p;
+		q = memchr(p, '\0', (end - p));
+		if (!q || (q == p)) {
+		error_malformed:
+			fr_strerror_printf("Packet contains malformed attribute");
+			return -1;
+		}
+		name_len = q - p;
+
+		value = q + 1;
+		if (value >= end) goto error_malformed;
+
+		q = memchr(value, '\0', (end - value));
+		if (!q || ((q - value) > 20)) goto error_malformed;
+		p = q + 1;
+
+		if ((name_len == 7) && (strncasecmp((char const *)name, "blksize", 7) == 0)) {
+			da = attr_tftp_block_size;
+
+		} else if ((name_len == 10) && (strncasecmp((char const *)name, "windowsize", 10) == 0)) {
+			da = attr_tftp_window_size;
+
+		} else if ((name_len == 7) && (strncasecmp((char const *)name, "timeout", 7) == 0)) {
+			da = attr_tftp_timeout;
+
+		} else if ((name_len == 5) && (strncasecmp((char const *)name, "tsize", 5) == 0)) {
+			da = attr_tftp_transfer_size;
+
+		} else {
+			continue;
+		}
+
+		/*
+		 *	The first copy of an option wins.
+		 */
+		if (fr_pair_find_by_da(out, NULL, da)) continue;
+
+		if (!isdigit(value[0])) {
+		error_value:
+			fr_strerror_printf("Invalid %s value", da->name);
+			return -1;
+		}
+
+		errno = 0;
+		num = strtoull((char const *)value, &p_end, 10);
+		if ((p_end != (char const *)q) || (errno == ERANGE)) goto error_value;
+
+		vp = fr_pair_afrom_da(ctx, da);
+		if (!vp) return -1;
+
+		switch (da->type) {
+		case FR_TYPE_UINT8:
+			if ((num < FR_TFTP_TIMEOUT_MIN) || (num > FR_TFTP_TIMEOUT_MAX)) {
+			error_range:
+				fr_strerror_printf("Invalid %s %llu value", da->name, num);
+				talloc_free(vp);
+				return -1;
+			}
+			vp->vp_uint8 = num;
+			break;
+
+		case FR_TYPE_UINT16:
+			if (da == attr_tftp_block_size) {
+				if ((num < FR_TFTP_BLOCK_MIN_SIZE) || (num > FR_TFTP_BLOCK_MAX_SIZE)) goto error_range;
+			} else {
+				if ((num < FR_TFTP_WINDOW_MIN_SIZE) || (num > FR_TFTP_WINDOW_MAX_SIZE)) goto error_range;
+			}
+			vp->vp_uint16 = num;
+			break;
+
+		default:
+			vp->vp_uint64 = num;
+			break;
+		}
+
+		fr_pair_append(out, vp);
+	}
+
+	return 0;
+}
+
 /*
  *  https://tools.ietf.org/html/rfc1350
  *
@@ -160,32 +257,10 @@ int fr_tftp_decode(TALLOC_CTX *ctx, fr_pair_list_t *out, uint8_t const *data, si
 		if (p >= end) goto done;
 
 		/*
-		 *  Once here, the next 'blksize' is optional.
+		 *  Once here, the options are optional.
 		 *  At least: | blksize | \0 | #blksize | \0 |
 		 */
-		if ((end - p) < 10) goto error_malformed;
-
-		if (!memcmp(p, "blksize\0", 8)) {
-			char *p_end = NULL;
-			long blksize;
-
-			p += 8;
-
-			if (p >= end || (end - p) < 1 || (end - p) > 6) goto error_malformed;
-
-			vp = fr_pair_afrom_da(ctx, attr_tftp_block_size);
-			if (!vp) goto error;
-
-			blksize = strtol((const char *)p, &p_end, 10);
-
-			if (p == (const uint8_t *)p_end || blksize > FR_TFTP_BLOCK_MAX_SIZE) {
-				fr_strerror_printf("Invalid Block-Size %ld value", blksize);
-				goto error;
-			}
-
-			vp->vp_uint16 = (uint16_t)blksize;
-			fr_pair_append(out, vp);
-		}
+		if (decode_options(ctx, out, p, end) < 0) goto error;
 
 		break;
 
@@ -260,6 +335,19 @@ int fr_tftp_decode(TALLOC_CTX *ctx, fr_pair_list_t *out, uint8_t const *data, si
 
 		break;
 
+	case FR_OPCODE_VALUE_OPTION_ACKNOWLEDGEMENT:
+		/*
+		 *  2 bytes      string    1 byte   string   1 byte
+		 *  +-----------------------------------------------+
+		 *  | Opcode |  blksize  |  0  |  #blksize |  0  |
+		 *  +-----------------------------------------------+
+		 *  RFC 2347 - OACK packet
+		 */
+		if (*(end - 1) != '\0') goto error_malformed;
+
+		if (decode_options(ctx, out, p, end) < 0) goto error;
+		break;
+
 	default:
 		fr_strerror_printf("Invalid TFTP opcode %#04x", opcode);
 		goto error;
@@ -33,6 +33,58 @@ RCSID("$Id$")
 #include "tftp.h"
 #include "attrs.h"
 
+/** Encode the options for a request, or for an Option-Acknowledgement
+ *
+ *  Each option is written as its name and then its value in ASCII,
+ *  both NUL terminated.
+ */
+static ssize_t encode_options(fr_dbuff_t *dbuff, fr_pair_list_t *vps)
+{
+	static struct {
+		fr_dict_attr_t const	**da;
+		char const		*name;
+	} const options[] = {
+		{ &attr_tftp_block_size,	"blksize" },
+		{ &attr_tftp_window_size,	"windowsize" },
+		{ &attr_tftp_timeout,		"timeout" },
+		{ &attr_tftp_transfer_size,	"tsize" },
+	};
+	fr_dbuff_t	work_dbuff = FR_DBUFF(dbuff);
+	size_t		i;
+
+	for (i = 0; i < NUM_ELEMENTS(options); i++) {
+		fr_pair_t	*vp;
+		char		tmp[20+1];			/* max: 18446744073709551615 */
+		uint64_t	num;
+
+		vp = fr_pair_find_by_da(vps, NULL, *options[i].da);
+		if (!vp) continue;
+
+		switch (vp->vp_type) {
+		case FR_TYPE_UINT8:
+			num = vp->vp_uint8;
+			break;
+
+		case FR_TYPE_UINT16:
+			num = vp->vp_uint16;
+			break;
+
+		default:
+			num = vp->vp_uint64;
+			break;
+		}
+
+		FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, options[i].name, strlen(options[i].name));
+		FR_DBUFF_IN_BYTES_RETURN(&work_dbuff, '\0');
+
+		snprintf(tmp, sizeof(tmp), "%" PRIu64, num);
+		FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, tmp, strlen(tmp));
+		FR_DBUFF_IN_BYTES_RETURN(&work_dbuff, '\0');
+	}
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
 /*
  *  https://tools.ietf.org/html/rfc1350
  *
@@ -127,18 +179,8 @@ ssize_t fr_tftp_encode(fr_dbuff_t *dbuff, fr_pair_list_t *vps)
 		FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, buf, 5);
 		fr_dbuff_in_bytes(&work_dbuff, '\0');
 
-		/* <blksize> is optional */
-		vp = fr_pair_find_by_da(vps, NULL, attr_tftp_block_size);
-		if (vp) {
-			char tmp[5+1];                                   /* max: 65535 */
-
-			FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, "blksize", 7);
-			fr_dbuff_in_bytes(&work_dbuff, '\0');
-
-			snprintf(tmp, sizeof(tmp), "%d", vp->vp_uint16); /* #blksize */
-			FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, tmp, strlen(tmp));
-			fr_dbuff_in_bytes(&work_dbuff, '\0');
-		}
+		/* <blksize>, etc. are optional */
+		if (encode_options(&work_dbuff, vps) < 0) return -1;
 
 		break;
 
@@ -222,6 +264,17 @@ ssize_t fr_tftp_encode(fr_dbuff_t *dbuff, fr_pair_list_t *vps)
 		break;
 	}
 
+	case FR_OPCODE_VALUE_OPTION_ACKNOWLEDGEMENT:
+		/*
+		 *  2 bytes      string    1 byte   string   1 byte
+		 *  +-----------------------------------------------+
+		 *  | Opcode |  blksize  |  0  |  #blksize |  0  |
+		 *  +-----------------------------------------------+
+		 *  RFC 2347 - OACK packet
+		 */
+		if (encode_options(&work_dbuff, vps) < 0) return -1;
+		break;
+
 	default:
 		fr_strerror_printf("Invalid TFTP opcode %#04x", opcode);
 		return -1;
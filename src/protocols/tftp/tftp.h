@@ -40,6 +40,8 @@ extern "C" {
 #define FR_TFTP_MAX_ERROR_CODE				(FR_ERROR_CODE_VALUE_NO_SUCH_USER+1)
 #define FR_TFTP_HDR_LEN				(4)	/* at least: 2-bytes opcode + 2-bytes */
 
+#define FR_TFTP_PACKET_CODE_VALID(_code)		(((_code) > 0) && ((_code) < FR_TFTP_MAX_CODE))
+
 /*
  *  2. Overview of the Protocol
  *
@@ -72,6 +74,29 @@ extern "C" {
 #define FR_TFTP_BLOCK_MIN_SIZE				8
 #define FR_TFTP_BLOCK_MAX_SIZE				65464
 
+/*
+ *	Block size used when the client doesn't negotiate one.
+ */
+#define FR_TFTP_BASE_BLOCK_SIZE				512
+
+/*
+ *	As described in https://tools.ietf.org/html/rfc7440
+ *
+ *  The number of blocks in a window, specified in ASCII.  Valid
+ *  values range between "1" and "65535" blocks, inclusive.
+ */
+#define FR_TFTP_WINDOW_MIN_SIZE				1
+#define FR_TFTP_WINDOW_MAX_SIZE				65535
+
+/*
+ *	As described in https://tools.ietf.org/html/rfc2349
+ *
+ *  The number of seconds to wait before retransmitting, specified in
+ *  ASCII.  Valid values range between "1" and "255" seconds, inclusive.
+ */
+#define FR_TFTP_TIMEOUT_MIN				1
+#define FR_TFTP_TIMEOUT_MAX				255
+
 /*
  * The original protocol has a transfer file size limit of 512 bytes/block x 65535 blocks = 32 MB.
  * In 1998 this limit was extended to 65535 bytes/block x 65535 blocks = 4 GB
@@ -0,0 +1,55 @@
+SUBMAKEFILES := radbench.mk radbench_proto.mk
+
+#
+#  Micro-benchmarks for the core data structures.
+#
+#  The results are written as JSON.  To check for regressions, save
+#  the results from a known good build, and pass them in on later runs:
+#
+#	make bench
+#	cp build/tests/bench/results.json baseline.json
+#	...
+#	make BENCH_BASELINE=baseline.json bench
+#
+#  A benchmark which is more than BENCH_THRESHOLD percent slower than
+#  the baseline causes the target to fail.
+#
+BENCH_THRESHOLD ?= 20
+
+.PHONY: $(BUILD_DIR)/tests/bench
+$(BUILD_DIR)/tests/bench:
+	${Q}mkdir -p $@
+
+.PHONY: bench
+bench: $(TEST_BIN_DIR)/radbench | $(BUILD_DIR)/tests/bench
+	@echo BENCH radbench
+	${Q}$(TEST_BIN)/radbench -D $(top_srcdir)/share/dictionary -o $(BUILD_DIR)/tests/bench/results.json \
+		$(if $(BENCH_BASELINE),-b $(BENCH_BASELINE) -t $(BENCH_THRESHOLD))
+	${Q}cat $(BUILD_DIR)/tests/bench/results.json
+
+#
+#  Encode / decode throughput for each protocol library.
+#
+#  The packets come from BENCH_CORPUS, which can be a list of pcap
+#  files, or of directories containing raw packets.  It defaults to
+#  the fuzzer corpus for the protocol, which must already have been
+#  extracted (see fuzzer.mk).
+#
+#	make bench.proto.radius BENCH_CORPUS=/path/to/radius.pcap
+#
+BENCH_PROTOCOLS ?= radius dhcpv4 dhcpv6 dns tacacs bfd tftp
+
+.PHONY: bench.proto
+bench.proto: $(addprefix bench.proto.,$(BENCH_PROTOCOLS))
+
+bench.proto.%: $(TEST_BIN_DIR)/radbench_proto $(BUILD_DIR)/lib/local/libfreeradius-%.la | $(BUILD_DIR)/tests/bench
+	@echo BENCH radbench_proto $*
+	${Q}$(TEST_BIN)/radbench_proto -D $(top_srcdir)/share/dictionary -L $(BUILD_DIR)/lib/local/.libs \
+		-o $(BUILD_DIR)/tests/bench/proto-$*.json $* $(if $(BENCH_CORPUS),$(BENCH_CORPUS),src/tests/fuzzer-corpus/$*)
+	${Q}cat $(BUILD_DIR)/tests/bench/proto-$*.json
+
+.PHONY: clean.test.bench
+clean.test.bench:
+	${Q}rm -rf $(BUILD_DIR)/tests/bench/
+
+clean.test: clean.test.bench
@@ -0,0 +1,823 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/tests/bench/radbench.c
+ * @brief Micro-benchmarks for core data structures.
+ *
+ * Each benchmark is run for long enough to get a stable measurement, and
+ * the results are written as JSON, one benchmark per line, so they can be
+ * tracked over time, and compared against a previous run with -b.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/io/message.h>
+#include <freeradius-devel/radius/radius.h>
+#include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/util/pair_legacy.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/trie.h>
+#include <freeradius-devel/util/value.h>
+#include <freeradius-devel/util/version.h>
+
+#ifdef RADBENCH_WITH_JSON
+#  include <freeradius-devel/json/base.h>
+#endif
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+#include "radbench_alloc.h"
+
+#define RADBENCH_MIN_TIME	(500)		//!< Default minimum run time in milliseconds.
+#define RADBENCH_THRESHOLD	(20)		//!< Default regression threshold in percent.
+#define RADBENCH_LIST_SIZE	(50)		//!< Pairs in the lists we search and copy.
+#define RADBENCH_TRIE_SIZE	(10000)		//!< Prefixes in the trie.
+
+/** One benchmark
+ *
+ */
+typedef struct {
+	char const	*name;		//!< Reported in the output.
+
+	/** Called once, before the benchmark is run
+	 *
+	 * @return
+	 *	- 0 on success.
+	 *	- -1 on failure.
+	 */
+	int		(*init)(TALLOC_CTX *ctx);
+
+	/** Run the operation being measured, n times
+	 *
+	 */
+	void		(*run)(uint64_t n);
+} radbench_t;
+
+/** The result of running one benchmark
+ *
+ */
+typedef struct {
+	char const	*name;
+	uint64_t	iterations;
+	double		ns_per_op;
+	double		allocs_per_op;
+} radbench_result_t;
+
+static fr_dict_t const *dict_radius;
+
+static fr_dict_autoload_t radbench_dict[] = {
+	{ .out = &dict_radius, .proto = "radius" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_user_name;
+static fr_dict_attr_t const *attr_nas_port;
+static fr_dict_attr_t const *attr_framed_ip_address;
+
+static fr_dict_attr_autoload_t radbench_dict_attr[] = {
+	{ .out = &attr_user_name, .name = "User-Name", .type = FR_TYPE_STRING, .dict = &dict_radius },
+	{ .out = &attr_nas_port, .name = "NAS-Port", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_framed_ip_address, .name = "Framed-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_radius },
+	{ NULL }
+};
+
+/*
+ *	State shared between a benchmark's init and run functions.
+ */
+static TALLOC_CTX		*bench_ctx;
+static fr_pair_list_t		bench_list;
+static fr_atomic_queue_t	*bench_aq;
+static fr_message_set_t		*bench_ms;
+static fr_trie_t		*bench_trie;
+static uint32_t			bench_keys[RADBENCH_TRIE_SIZE];
+static uint8_t			bench_packet[4096];
+static size_t			bench_packet_len;
+static fr_radius_ctx_t		bench_radius_ctx = {
+					.secret = "testing123",
+					.secret_length = 10
+				};
+
+/** Stop the compiler from optimising away results
+ *
+ */
+static volatile uintptr_t bench_sink;
+
+static char const *bench_request = "User-Name = \"bob@example.com\", "
+				   "User-Password = \"hello\", "
+				   "NAS-IP-Address = 192.0.2.1, "
+				   "NAS-Port = 17, "
+				   "NAS-Port-Type = Ethernet, "
+				   "Service-Type = Framed-User, "
+				   "Called-Station-Id = \"00-11-22-33-44-55:eduroam\", "
+				   "Calling-Station-Id = \"66-77-88-99-AA-BB\", "
+				   "Framed-MTU = 1400, "
+				   "Acct-Session-Id = \"0123456789abcdef\", "
+				   "Connect-Info = \"CONNECT 11Mbps 802.11b\"";
+
+static int bench_list_init(TALLOC_CTX *ctx)
+{
+	fr_pair_parse_t	root, relative;
+
+	fr_pair_list_init(&bench_list);
+
+	root = (fr_pair_parse_t) {
+		.ctx = ctx,
+		.da = fr_dict_root(dict_radius),
+		.list = &bench_list,
+	};
+	relative = (fr_pair_parse_t) { };
+
+	if (fr_pair_list_afrom_substr(&root, &relative, &FR_SBUFF_IN(bench_request, strlen(bench_request))) <= 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Pair lists
+ */
+static void bench_pair_append_run(uint64_t n)
+{
+	uint64_t	i;
+	fr_pair_list_t	list;
+
+	fr_pair_list_init(&list);
+
+	for (i = 0; i < n; i++) {
+		fr_pair_t *vp;
+
+		vp = fr_pair_afrom_da(bench_ctx, attr_nas_port);
+		vp->vp_uint32 = i;
+		fr_pair_append(&list, vp);
+
+		if ((i % RADBENCH_LIST_SIZE) == (RADBENCH_LIST_SIZE - 1)) fr_pair_list_free(&list);
+	}
+	fr_pair_list_free(&list);
+}
+
+static int bench_pair_find_init(TALLOC_CTX *ctx)
+{
+	int i;
+
+	if (bench_list_init(ctx) < 0) return -1;
+
+	/*
+	 *	Put the attribute we're looking for at the end.
+	 */
+	for (i = fr_pair_list_num_elements(&bench_list); i < RADBENCH_LIST_SIZE; i++) {
+		fr_pair_t *vp;
+
+		MEM(vp = fr_pair_afrom_da(ctx, attr_nas_port));
+		fr_pair_append(&bench_list, vp);
+	}
+	return fr_pair_append_by_da(ctx, NULL, &bench_list, attr_framed_ip_address);
+}
+
+static void bench_pair_find_run(uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) bench_sink = (uintptr_t) fr_pair_find_by_da(&bench_list, NULL, attr_framed_ip_address);
+}
+
+static void bench_pair_list_copy_run(uint64_t n)
+{
+	uint64_t	i;
+	fr_pair_list_t	copy;
+
+	fr_pair_list_init(&copy);
+
+	for (i = 0; i < n; i++) {
+		fr_pair_list_copy(bench_ctx, &copy, &bench_list);
+		fr_pair_list_free(&copy);
+	}
+}
+
+/*
+ *	Dictionary lookups
+ */
+static void bench_dict_by_name_run(uint64_t n)
+{
+	uint64_t		i;
+	fr_dict_attr_t const	*root = fr_dict_root(dict_radius);
+
+	for (i = 0; i < n; i++) bench_sink = (uintptr_t) fr_dict_attr_by_name(NULL, root, "Framed-IP-Address");
+}
+
+static void bench_dict_by_num_run(uint64_t n)
+{
+	uint64_t		i;
+	fr_dict_attr_t const	*root = fr_dict_root(dict_radius);
+
+	for (i = 0; i < n; i++) bench_sink = (uintptr_t) fr_dict_attr_child_by_num(root, 8);
+}
+
+/*
+ *	Value box casts
+ */
+static void bench_cast_str_uint32_run(uint64_t n)
+{
+	uint64_t	i;
+	fr_value_box_t	src, dst;
+
+	fr_value_box_strdup_shallow(&src, NULL, "4294967295", false);
+
+	for (i = 0; i < n; i++) {
+		fr_value_box_cast(bench_ctx, &dst, FR_TYPE_UINT32, NULL, &src);
+		bench_sink = dst.vb_uint32;
+	}
+}
+
+static void bench_cast_uint32_str_run(uint64_t n)
+{
+	uint64_t	i;
+	fr_value_box_t	src, dst;
+
+	fr_value_box_init(&src, FR_TYPE_UINT32, NULL, false);
+	src.vb_uint32 = 4294967295;
+
+	for (i = 0; i < n; i++) {
+		fr_value_box_cast(bench_ctx, &dst, FR_TYPE_STRING, NULL, &src);
+		fr_value_box_clear(&dst);
+	}
+}
+
+static void bench_cast_str_ipv4_run(uint64_t n)
+{
+	uint64_t	i;
+	fr_value_box_t	src, dst;
+
+	fr_value_box_strdup_shallow(&src, NULL, "192.0.2.1", false);
+
+	for (i = 0; i < n; i++) {
+		fr_value_box_cast(bench_ctx, &dst, FR_TYPE_IPV4_ADDR, NULL, &src);
+		bench_sink = dst.vb_ip.addr.v4.s_addr;
+	}
+}
+
+/*
+ *	RADIUS encode / decode
+ */
+static ssize_t bench_radius_encode(void)
+{
+	return fr_radius_encode(&FR_DBUFF_TMP(bench_packet, sizeof(bench_packet)), &bench_list,
+				&(fr_radius_encode_ctx_t) {
+					.common = &bench_radius_ctx,
+					.rand_ctx = (fr_fast_rand_t) {
+						.a = 1,
+						.b = 2,
+					},
+					.code = FR_RADIUS_CODE_ACCESS_REQUEST,
+					.id = 1,
+				});
+}
+
+static int bench_radius_init(TALLOC_CTX *ctx)
+{
+	ssize_t slen;
+
+	if (bench_list_init(ctx) < 0) return -1;
+
+	slen = bench_radius_encode();
+	if (slen < 0) return -1;
+
+	bench_packet_len = slen;
+	return 0;
+}
+
+static void bench_radius_encode_run(uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) bench_sink = bench_radius_encode();
+}
+
+static void bench_radius_decode_run(uint64_t n)
+{
+	uint64_t	i;
+	fr_pair_list_t	list;
+
+	fr_pair_list_init(&list);
+
+	for (i = 0; i < n; i++) {
+		fr_radius_decode_simple(bench_ctx, &list, bench_packet, bench_packet_len,
+					NULL, bench_radius_ctx.secret);
+		fr_pair_list_free(&list);
+	}
+}
+
+/*
+ *	Atomic queues
+ */
+static int bench_atomic_queue_init(TALLOC_CTX *ctx)
+{
+	bench_aq = fr_atomic_queue_alloc(ctx, 1024);
+	return bench_aq ? 0 : -1;
+}
+
+static void bench_atomic_queue_run(uint64_t n)
+{
+	uint64_t	i;
+	void		*data;
+
+	for (i = 0; i < n; i++) {
+		fr_atomic_queue_push(bench_aq, (void *) (uintptr_t) (i + 1));
+		fr_atomic_queue_pop(bench_aq, &data);
+		bench_sink = (uintptr_t) data;
+	}
+}
+
+/*
+ *	Message sets
+ */
+static int bench_message_set_init(TALLOC_CTX *ctx)
+{
+	bench_ms = fr_message_set_create(ctx, 1024, sizeof(fr_message_t), 1024 * 1024);
+	return bench_ms ? 0 : -1;
+}
+
+static void bench_message_set_run(uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		fr_message_t *m;
+
+		m = fr_message_reserve(bench_ms, 4096);
+		if (!m) {
+			fr_message_set_gc(bench_ms);
+			continue;
+		}
+
+		fr_message_alloc(bench_ms, m, 200);
+		fr_message_done(m);
+
+		if ((i & 0x3ff) == 0x3ff) fr_message_set_gc(bench_ms);
+	}
+}
+
+/*
+ *	Tries
+ */
+static int bench_trie_init(TALLOC_CTX *ctx)
+{
+	int		i;
+	fr_fast_rand_t	rand_ctx = { .a = 1, .b = 2 };
+
+	bench_trie = fr_trie_alloc(ctx, NULL, NULL);
+	if (!bench_trie) return -1;
+
+	for (i = 0; i < RADBENCH_TRIE_SIZE; i++) {
+		bench_keys[i] = fr_fast_rand(&rand_ctx);
+
+		/*
+		 *	Duplicates are fine, the lookups still hit.
+		 */
+		(void) fr_trie_insert_by_key(bench_trie, &bench_keys[i], 24, &bench_keys[i]);
+	}
+
+	return 0;
+}
+
+static void bench_trie_lookup_run(uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		bench_sink = (uintptr_t) fr_trie_lookup_by_key(bench_trie, &bench_keys[i % RADBENCH_TRIE_SIZE], 32);
+	}
+}
+
+#ifdef RADBENCH_WITH_JSON
+/*
+ *	JSON encoding, with the default format, as used by rlm_rest.
+ */
+static char bench_json[8192];
+
+/** What fr_json_afrom_pair_list() used to do, build a json-c tree, then print it
+ *
+ */
+static char *bench_json_tree_encode(TALLOC_CTX *ctx)
+{
+	json_object	*obj;
+	char		*out;
+
+	obj = fr_json_object_afrom_pair_list(ctx, &bench_list, NULL);
+	out = talloc_typed_strdup(ctx, json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN));
+	json_object_put(obj);
+
+	return out;
+}
+
+static int bench_json_init(TALLOC_CTX *ctx)
+{
+	char	*tree, *stream;
+	int	ret = 0;
+
+	if (bench_list_init(ctx) < 0) return -1;
+
+	/*
+	 *	Both encoders must produce the same document,
+	 *	otherwise the comparison is meaningless.
+	 */
+	tree = bench_json_tree_encode(ctx);
+	stream = fr_json_afrom_pair_list(ctx, &bench_list, NULL);
+	if (!tree || !stream || (strcmp(tree, stream) != 0)) {
+		fr_strerror_printf("Streaming encoder produced \"%s\", json-c produced \"%s\"", stream, tree);
+		ret = -1;
+	}
+	talloc_free(tree);
+	talloc_free(stream);
+
+	return ret;
+}
+
+static void bench_json_tree_run(uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		char *out = bench_json_tree_encode(NULL);
+
+		bench_sink = (uintptr_t) out;
+		talloc_free(out);
+	}
+}
+
+static void bench_json_stream_run(uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		char *out = fr_json_afrom_pair_list(NULL, &bench_list, NULL);
+
+		bench_sink = (uintptr_t) out;
+		talloc_free(out);
+	}
+}
+
+static void bench_json_stream_sbuff_run(uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		bench_sink = fr_json_str_from_pair_list(&FR_SBUFF_OUT(bench_json, sizeof(bench_json)), &bench_list, NULL);
+	}
+}
+#endif
+
+static radbench_t const radbench[] = {
+	{ .name = "pair_alloc_append",		.run = bench_pair_append_run },
+	{ .name = "pair_find_by_da",		.init = bench_pair_find_init,		.run = bench_pair_find_run },
+	{ .name = "pair_list_copy",		.init = bench_list_init,		.run = bench_pair_list_copy_run },
+
+	{ .name = "dict_attr_by_name",		.run = bench_dict_by_name_run },
+	{ .name = "dict_attr_child_by_num",	.run = bench_dict_by_num_run },
+
+	{ .name = "value_box_cast_string_uint32", .run = bench_cast_str_uint32_run },
+	{ .name = "value_box_cast_uint32_string", .run = bench_cast_uint32_str_run },
+	{ .name = "value_box_cast_string_ipv4",	.run = bench_cast_str_ipv4_run },
+
+	{ .name = "radius_encode",		.init = bench_radius_init,		.run = bench_radius_encode_run },
+	{ .name = "radius_decode",		.init = bench_radius_init,		.run = bench_radius_decode_run },
+
+	{ .name = "atomic_queue_push_pop",	.init = bench_atomic_queue_init,	.run = bench_atomic_queue_run },
+
+	{ .name = "message_set_alloc",		.init = bench_message_set_init,		.run = bench_message_set_run },
+
+	{ .name = "trie_lookup",		.init = bench_trie_init,		.run = bench_trie_lookup_run },
+
+#ifdef RADBENCH_WITH_JSON
+	{ .name = "json_encode_tree",		.init = bench_json_init,		.run = bench_json_tree_run },
+	{ .name = "json_encode_stream",		.init = bench_json_init,		.run = bench_json_stream_run },
+	{ .name = "json_encode_stream_sbuff",	.init = bench_json_init,		.run = bench_json_stream_sbuff_run },
+#endif
+};
+
+/** Run one benchmark until it takes at least min_time
+ *
+ */
+static int radbench_run(radbench_result_t *out, radbench_t const *b, fr_time_delta_t min_time, uint64_t iterations)
+{
+	uint64_t	n = iterations ? iterations : 1000;
+	fr_time_t	start;
+	fr_time_delta_t	elapsed;
+	uint64_t	allocs = 0;
+
+	bench_ctx = talloc_new(NULL);
+	if (!bench_ctx) return -1;
+
+	if (b->init && (b->init(bench_ctx) < 0)) {
+		fr_perror("radbench - Failed initialising %s", b->name);
+		TALLOC_FREE(bench_ctx);
+		return -1;
+	}
+
+	/*
+	 *	Warm up the caches, and the allocator.
+	 */
+	b->run(n < 1000 ? n : 1000);
+
+	for (;;) {
+		allocs = radbench_allocations;
+		start = fr_time();
+		b->run(n);
+		elapsed = fr_time_sub(fr_time(), start);
+		allocs = radbench_allocations - allocs;
+
+		if (iterations || fr_time_delta_gteq(elapsed, min_time)) break;
+
+		/*
+		 *	Aim for a little over the minimum, so we don't
+		 *	need another round.
+		 */
+		if (fr_time_delta_unwrap(elapsed) <= 0) {
+			n *= 10;
+		} else {
+			n = (double) n * 1.2 * fr_time_delta_unwrap(min_time) / fr_time_delta_unwrap(elapsed) + 1;
+		}
+	}
+
+	*out = (radbench_result_t) {
+		.name = b->name,
+		.iterations = n,
+		.ns_per_op = (double) fr_time_delta_unwrap(elapsed) / n,
+		.allocs_per_op = (double) allocs / n,
+	};
+
+	fr_pair_list_init(&bench_list);
+	TALLOC_FREE(bench_ctx);
+
+	return 0;
+}
+
+static void radbench_print(FILE *fp, radbench_result_t const *results, size_t num)
+{
+	size_t i;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"version\": \"%s\",\n", STRINGIFY(RADIUSD_VERSION_MAJOR) "." STRINGIFY(RADIUSD_VERSION_MINOR) "."
+		STRINGIFY(RADIUSD_VERSION_INCRM));
+	fprintf(fp, "\t\"benchmarks\": [\n");
+
+	for (i = 0; i < num; i++) {
+		fprintf(fp, "\t\t{ \"name\": \"%s\", \"iterations\": %" PRIu64 ", \"ns_per_op\": %.2f, ",
+			results[i].name, results[i].iterations, results[i].ns_per_op);
+#ifdef RADBENCH_ALLOC_COUNT
+		fprintf(fp, "\"allocs_per_op\": %.2f }", results[i].allocs_per_op);
+#else
+		fprintf(fp, "\"allocs_per_op\": null }");
+#endif
+		fprintf(fp, "%s\n", (i + 1) < num ? "," : "");
+	}
+
+	fprintf(fp, "\t]\n");
+	fprintf(fp, "}\n");
+}
+
+/** Compare results against a previous run
+ *
+ * The baseline must be a file written by us, which has one benchmark per line.
+ *
+ * @return
+ *	- 0 if nothing regressed.
+ *	- 1 if one or more benchmarks regressed.
+ *	- -1 on error.
+ */
+static int radbench_compare(char const *filename, radbench_result_t const *results, size_t num, int threshold)
+{
+	FILE	*fp;
+	char	line[1024];
+	int	ret = 0;
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "radbench - Failed opening baseline \"%s\": %s\n", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char	name[128];
+		char	*p;
+		double	baseline;
+		size_t	i;
+
+		p = strstr(line, "\"name\": \"");
+		if (!p || (sscanf(p, "\"name\": \"%127[^\"]\"", name) != 1)) continue;
+
+		p = strstr(line, "\"ns_per_op\": ");
+		if (!p || (sscanf(p, "\"ns_per_op\": %lf", &baseline) != 1) || (baseline <= 0)) continue;
+
+		for (i = 0; i < num; i++) {
+			double change;
+
+			if (strcmp(results[i].name, name) != 0) continue;
+
+			change = ((results[i].ns_per_op - baseline) * 100) / baseline;
+			if (change > threshold) {
+				fprintf(stderr, "REGRESSION %s: %.2f ns/op, baseline %.2f ns/op (%+.1f%%)\n",
+					name, results[i].ns_per_op, baseline, change);
+				ret = 1;
+			} else if (fr_debug_lvl > 0) {
+				fprintf(stderr, "ok %s: %.2f ns/op, baseline %.2f ns/op (%+.1f%%)\n",
+					name, results[i].ns_per_op, baseline, change);
+			}
+			break;
+		}
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+static NEVER_RETURNS void usage(int status)
+{
+	FILE *output = status ? stderr : stdout;
+
+	fprintf(output, "Usage: radbench [options] [benchmark ...]\n");
+	fprintf(output, "options:\n");
+	fprintf(output, "  -b <file>             Compare results against a baseline written by a previous run.\n");
+	fprintf(output, "  -D <dictdir>          Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(output, "  -h                    This help message.\n");
+	fprintf(output, "  -l                    List the benchmarks.\n");
+	fprintf(output, "  -n <iterations>       Run each benchmark this many times, instead of timing it.\n");
+	fprintf(output, "  -o <file>             Write results to <file> instead of stdout.\n");
+	fprintf(output, "  -t <percent>          Slowdown which counts as a regression (defaults to %i).\n",
+		RADBENCH_THRESHOLD);
+	fprintf(output, "  -T <msec>             Minimum time to run each benchmark (defaults to %i).\n",
+		RADBENCH_MIN_TIME);
+	fprintf(output, "  -x                    Print more debugging information.\n");
+	fr_exit_now(status);
+}
+
+/**
+ *
+ * @hidecallgraph
+ */
+int main(int argc, char *argv[])
+{
+	int			c, ret = EXIT_SUCCESS;
+	char const		*dict_dir = DICTDIR;
+	char const		*baseline = NULL;
+	char const		*output = NULL;
+	int			threshold = RADBENCH_THRESHOLD;
+	int			min_time = RADBENCH_MIN_TIME;
+	uint64_t		iterations = 0;
+	size_t			i, num = 0;
+	radbench_result_t	results[NUM_ELEMENTS(radbench)];
+	FILE			*fp = stdout;
+
+	/*
+	 *	Must be called first, so the handler is called last
+	 */
+	fr_atexit_global_setup();
+
+	fr_debug_lvl = 0;
+	fr_log_fp = stderr;
+
+	while ((c = getopt(argc, argv, "b:D:hln:o:t:T:x")) != -1) switch (c) {
+		case 'b':
+			baseline = optarg;
+			break;
+
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'l':
+			for (i = 0; i < NUM_ELEMENTS(radbench); i++) printf("%s\n", radbench[i].name);
+			fr_exit_now(EXIT_SUCCESS);
+
+		case 'n':
+			iterations = strtoull(optarg, NULL, 10);
+			if (!iterations) usage(64);
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 't':
+			threshold = atoi(optarg);
+			if (threshold <= 0) usage(64);
+			break;
+
+		case 'T':
+			min_time = atoi(optarg);
+			if (min_time <= 0) usage(64);
+			break;
+
+		case 'x':
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+			usage(EXIT_SUCCESS);
+
+		default:
+			usage(64);
+	}
+	argc -= optind;
+	argv += optind;
+
+	/*
+	 *	Mismatch between the binary and the libraries it depends on
+	 */
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("radbench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (!fr_dict_global_ctx_init(NULL, true, dict_dir)) {
+	error:
+		fr_perror("radbench");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	if (fr_dict_autoload(radbench_dict) < 0) goto error;
+	if (fr_dict_attr_autoload(radbench_dict_attr) < 0) goto error;
+	if (fr_radius_global_init() < 0) goto error;
+
+	fr_time_start();
+
+	for (i = 0; i < NUM_ELEMENTS(radbench); i++) {
+		/*
+		 *	Only run the benchmarks we were asked to.
+		 */
+		if (argc > 0) {
+			int j;
+
+			for (j = 0; j < argc; j++) if (strcmp(argv[j], radbench[i].name) == 0) break;
+			if (j == argc) continue;
+		}
+
+		if (fr_debug_lvl > 0) fprintf(stderr, "Running %s\n", radbench[i].name);
+
+		if (radbench_run(&results[num], &radbench[i],
+				 fr_time_delta_from_msec(min_time), iterations) < 0) {
+			ret = EXIT_FAILURE;
+			goto finish;
+		}
+		num++;
+	}
+
+	if (output) {
+		fp = fopen(output, "w");
+		if (!fp) {
+			fprintf(stderr, "radbench - Failed opening \"%s\": %s\n", output, fr_syserror(errno));
+			ret = EXIT_FAILURE;
+			goto finish;
+		}
+	}
+	radbench_print(fp, results, num);
+	if (output) fclose(fp);
+
+	if (baseline) {
+		switch (radbench_compare(baseline, results, num, threshold)) {
+		case 0:
+			break;
+
+		case 1:
+			ret = EXIT_FAILURE;
+			break;
+
+		default:
+			ret = 64;
+			break;
+		}
+	}
+
+finish:
+	fr_radius_global_free();
+	fr_dict_autofree(radbench_dict);
+
+	/*
+	 *	Ensure our atexit handlers run before any other
+	 *	atexit handlers registered by third party libraries.
+	 */
+	fr_atexit_global_trigger_all();
+
+	return ret;
+}
@@ -0,0 +1,21 @@
+#
+#  The JSON benchmarks are only built if we have json-c, and the
+#  libfreeradius-json library.  TARGETNAME needs to be cleared
+#  explicitly, as the previous target's TARGETNAME may stick around.
+#  The include also sets the json-c CFLAGS and LDLIBS, which we keep.
+#
+TARGETNAME	:=
+-include $(top_builddir)/src/lib/json/all.mk
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-io$(L) libfreeradius-radius$(L)
+
+ifneq "$(TARGETNAME)" ""
+SRC_CFLAGS	+= -DRADBENCH_WITH_JSON -I$(top_builddir)/src/lib/json/
+TGT_PREREQS	+= libfreeradius-json$(L)
+endif
+
+TARGET		:= radbench$(E)
+
+SOURCES		:= radbench.c
+
+TGT_LDLIBS	+= $(LIBS)
@@ -0,0 +1,84 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/tests/bench/radbench_alloc.h
+ * @brief Count allocations made by the benchmarks.
+ *
+ * Allocations are counted by interposing malloc().  talloc, and
+ * everything else, end up here.
+ *
+ * This only works with glibc, and conflicts with the sanitizers, which
+ * have their own allocators.  When RADBENCH_ALLOC_COUNT isn't defined,
+ * the counters stay at zero, and the results should say so.
+ *
+ * The functions are defined here, so this header must be included by
+ * exactly one source file in each benchmark binary.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSIDH(radbench_alloc_h, "$Id$")
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(__has_feature)
+#  if __has_feature(address_sanitizer)
+#    define RADBENCH_NO_ALLOC_COUNT
+#  endif
+#endif
+#ifdef __SANITIZE_ADDRESS__
+#  define RADBENCH_NO_ALLOC_COUNT
+#endif
+
+/*
+ *	Only the main thread runs benchmarks, so these don't need
+ *	to be atomic.
+ */
+static uint64_t radbench_allocations;		//!< Calls to malloc(), calloc() and realloc().
+static uint64_t radbench_allocated;		//!< Bytes requested by those calls.
+
+#if defined(__GLIBC__) && !defined(RADBENCH_NO_ALLOC_COUNT)
+#  define RADBENCH_ALLOC_COUNT
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	radbench_allocations++;
+	radbench_allocated += size;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	radbench_allocations++;
+	radbench_allocated += nmemb * size;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	radbench_allocations++;
+	radbench_allocated += size;
+	return __libc_realloc(ptr, size);
+}
+#endif
@@ -0,0 +1,625 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/tests/bench/radbench_proto.c
+ * @brief Encode / decode throughput of the protocol libraries.
+ *
+ * Packets are read from pcap files, or from directories of raw packets
+ * (e.g. the fuzzer corpus).  They're decoded, and re-encoded, using the
+ * same test points as unit_test_attribute, and the throughput and
+ * allocations are written as JSON.
+ *
+ * Packets which the decoder rejects are counted, but not benchmarked.
+ *
+ * @copyright 2024 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/test_point.h>
+#include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/util/dl.h>
+#include <freeradius-devel/util/file.h>
+#include <freeradius-devel/util/net.h>
+#include <freeradius-devel/util/syserror.h>
+
+#ifdef HAVE_LIBPCAP
+#  include <freeradius-devel/util/pcap.h>
+#endif
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+#include "radbench_alloc.h"
+
+#define RADBENCH_MIN_TIME	(1000)		//!< Default minimum run time in milliseconds.
+#define RADBENCH_MAX_PACKET	(65536)		//!< Largest packet we read, or encode.
+
+/** A packet from the corpus
+ *
+ */
+typedef struct {
+	uint8_t		*data;			//!< Wire format.
+	size_t		data_len;		//!< Length of the wire format.
+	fr_pair_list_t	list;			//!< Decoded pairs, used for the encode benchmark.
+	bool		skip;			//!< The encoder rejected the pairs.
+} radbench_packet_t;
+
+typedef struct {
+	TALLOC_CTX		*ctx;		//!< Everything is allocated in this.
+
+	radbench_packet_t	*packet;	//!< Array of packets which decoded OK.
+	size_t			num;		//!< Number of packets which decoded OK.
+	size_t			bytes;		//!< Total length of the packets we benchmark.
+
+	size_t			read;		//!< Packets read.
+	size_t			skipped;	//!< Packets the decoder rejected.
+	size_t			encode_failed;	//!< Packets the encoder rejected.
+} radbench_corpus_t;
+
+typedef struct {
+	char const	*name;
+	uint64_t	packets;		//!< Packets processed during the measured run.
+	uint64_t	bytes;			//!< Bytes processed during the measured run.
+	fr_time_delta_t	elapsed;		//!< How long the measured run took.
+	uint64_t	allocs;			//!< Allocations during the measured run.
+	uint64_t	allocated;		//!< Bytes allocated during the measured run.
+} radbench_proto_result_t;
+
+static fr_test_point_proto_decode_t	*tp_decode;
+static fr_test_point_proto_encode_t	*tp_encode;
+static void				*decode_ctx;
+static void				*encode_ctx;
+
+static uint8_t				encode_buffer[RADBENCH_MAX_PACKET];
+
+static void radbench_packet_add(radbench_corpus_t *corpus, uint8_t const *data, size_t data_len)
+{
+	radbench_packet_t	*packet;
+	ssize_t			slen;
+
+	corpus->read++;
+
+	if (corpus->num >= talloc_array_length(corpus->packet)) {
+		MEM(corpus->packet = talloc_realloc(corpus->ctx, corpus->packet, radbench_packet_t,
+						    corpus->num ? corpus->num * 2 : 256));
+	}
+
+	packet = &corpus->packet[corpus->num];
+	memset(packet, 0, sizeof(*packet));
+	fr_pair_list_init(&packet->list);
+
+	/*
+	 *	Check that the packet decodes, and keep the pairs
+	 *	for the encoder.
+	 */
+	slen = tp_decode->func(corpus->ctx, &packet->list, data, data_len, decode_ctx);
+	if (slen <= 0) {
+		if (fr_debug_lvl > 1) fr_perror("radbench_proto - Skipping packet %zu", corpus->read);
+		fr_pair_list_free(&packet->list);
+		fr_strerror_clear();
+		corpus->skipped++;
+		return;
+	}
+
+	MEM(packet->data = talloc_memdup(corpus->ctx, data, data_len));
+	packet->data_len = data_len;
+
+	corpus->bytes += data_len;
+	corpus->num++;
+}
+
+#ifdef HAVE_LIBPCAP
+/** Find the UDP or TCP payload of a captured frame
+ *
+ * @return
+ *	- The payload.
+ *	- NULL if the frame isn't an unfragmented IPv4 or IPv6 UDP / TCP frame.
+ */
+static uint8_t const *radbench_pcap_payload(size_t *payload_len, uint8_t const *data, size_t data_len, int link_layer)
+{
+	uint8_t const	*p = data, *end = data + data_len;
+	ssize_t		len;
+	uint8_t		ip_proto;
+
+	len = fr_pcap_link_layer_offset(data, data_len, link_layer);
+	if (len < 0) return NULL;
+	p += len;
+
+	if ((end - p) < (ssize_t) sizeof(ip_header_t)) return NULL;
+
+	switch ((p[0] & 0xf0) >> 4) {
+	case 4:
+	{
+		ip_header_t const *ip = (ip_header_t const *) p;
+
+		if (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) return NULL;
+
+		ip_proto = ip->ip_p;
+		p += IP_HL(ip);
+	}
+		break;
+
+	case 6:
+	{
+		ip_header6_t const *ip6 = (ip_header6_t const *) p;
+
+		if ((end - p) < (ssize_t) sizeof(*ip6)) return NULL;
+
+		ip_proto = ip6->ip_next;
+		p += sizeof(*ip6);
+	}
+		break;
+
+	default:
+		return NULL;
+	}
+
+	switch (ip_proto) {
+	case IPPROTO_UDP:
+		if ((end - p) <= (ssize_t) sizeof(udp_header_t)) return NULL;
+		p += sizeof(udp_header_t);
+		break;
+
+	case IPPROTO_TCP:
+		/*
+		 *	Assume one PDU per segment, which is true for
+		 *	nearly all captures of the protocols we care about.
+		 */
+		if ((end - p) <= 20) return NULL;
+		p += ((p[12] & 0xf0) >> 4) * 4;
+		break;
+
+	default:
+		return NULL;
+	}
+
+	if (p >= end) return NULL;
+
+	*payload_len = end - p;
+	return p;
+}
+
+static int radbench_read_pcap(radbench_corpus_t *corpus, char const *filename)
+{
+	pcap_t			*pcap;
+	char			errbuf[PCAP_ERRBUF_SIZE];
+	struct pcap_pkthdr	*header;
+	uint8_t const		*data;
+	int			link_layer, ret;
+
+	pcap = pcap_open_offline(filename, errbuf);
+	if (!pcap) {
+		fr_strerror_printf("Failed opening \"%s\": %s", filename, errbuf);
+		return -1;
+	}
+	link_layer = pcap_datalink(pcap);
+
+	while ((ret = pcap_next_ex(pcap, &header, &data)) == 1) {
+		uint8_t const	*payload;
+		size_t		payload_len;
+
+		payload = radbench_pcap_payload(&payload_len, data, header->caplen, link_layer);
+		if (!payload) continue;
+
+		radbench_packet_add(corpus, payload, payload_len);
+	}
+
+	if (ret == -1) {
+		fr_strerror_printf("Failed reading \"%s\": %s", filename, pcap_geterr(pcap));
+		pcap_close(pcap);
+		return -1;
+	}
+	pcap_close(pcap);
+
+	return 0;
+}
+#endif
+
+/** Read a file containing one raw packet
+ *
+ */
+static int radbench_read_raw(radbench_corpus_t *corpus, char const *filename)
+{
+	static uint8_t	buffer[RADBENCH_MAX_PACKET];
+	ssize_t		len;
+	int		fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening \"%s\": %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	len = read(fd, buffer, sizeof(buffer));
+	close(fd);
+	if (len < 0) {
+		fr_strerror_printf("Failed reading \"%s\": %s", filename, fr_syserror(errno));
+		return -1;
+	}
+	if (len == 0) return 0;
+
+	radbench_packet_add(corpus, buffer, len);
+
+	return 0;
+}
+
+static int radbench_read(radbench_corpus_t *corpus, char const *path)
+{
+	struct stat	st;
+	DIR		*dir;
+	struct dirent	*dp;
+	size_t		len;
+
+	if (stat(path, &st) < 0) {
+		fr_strerror_printf("Failed reading \"%s\": %s", path, fr_syserror(errno));
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		len = strlen(path);
+
+		if (((len > 5) && (strcmp(path + len - 5, ".pcap") == 0)) ||
+		    ((len > 7) && (strcmp(path + len - 7, ".pcapng") == 0))) {
+#ifdef HAVE_LIBPCAP
+			return radbench_read_pcap(corpus, path);
+#else
+			fr_strerror_printf("Can't read \"%s\", the server was built without libpcap", path);
+			return -1;
+#endif
+		}
+
+		return radbench_read_raw(corpus, path);
+	}
+
+	dir = opendir(path);
+	if (!dir) {
+		fr_strerror_printf("Failed opening \"%s\": %s", path, fr_syserror(errno));
+		return -1;
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		char	*filename;
+		int	ret;
+
+		if (dp->d_name[0] == '.') continue;
+
+		MEM(filename = talloc_asprintf(NULL, "%s/%s", path, dp->d_name));
+		ret = radbench_read(corpus, filename);
+		talloc_free(filename);
+
+		if (ret < 0) {
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+static void radbench_decode_run(radbench_corpus_t const *corpus, TALLOC_CTX *ctx)
+{
+	size_t		i;
+	fr_pair_list_t	list;
+
+	fr_pair_list_init(&list);
+
+	for (i = 0; i < corpus->num; i++) {
+		if (corpus->packet[i].skip) continue;
+
+		(void) tp_decode->func(ctx, &list, corpus->packet[i].data, corpus->packet[i].data_len, decode_ctx);
+		fr_pair_list_free(&list);
+	}
+	fr_strerror_clear();
+}
+
+static void radbench_encode_run(radbench_corpus_t const *corpus, TALLOC_CTX *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < corpus->num; i++) {
+		if (corpus->packet[i].skip) continue;
+
+		(void) tp_encode->func(ctx, UNCONST(fr_pair_list_t *, &corpus->packet[i].list),
+				       encode_buffer, sizeof(encode_buffer), encode_ctx);
+	}
+	fr_strerror_clear();
+}
+
+/** Run the corpus through decode or encode until it takes at least min_time
+ *
+ */
+static void radbench_proto_run(radbench_proto_result_t *out, char const *name, radbench_corpus_t const *corpus,
+			       void (*run)(radbench_corpus_t const *corpus, TALLOC_CTX *ctx),
+			       fr_time_delta_t min_time)
+{
+	TALLOC_CTX	*ctx;
+	uint64_t	rounds = 0, allocs, allocated;
+	fr_time_t	start;
+
+	MEM(ctx = talloc_new(NULL));
+
+	/*
+	 *	Warm up the caches, and the allocator.
+	 */
+	run(corpus, ctx);
+
+	allocs = radbench_allocations;
+	allocated = radbench_allocated;
+	start = fr_time();
+
+	do {
+		run(corpus, ctx);
+		talloc_free_children(ctx);
+		rounds++;
+	} while (fr_time_delta_lt(fr_time_sub(fr_time(), start), min_time));
+
+	*out = (radbench_proto_result_t) {
+		.name = name,
+		.packets = rounds * (corpus->num - corpus->encode_failed),
+		.bytes = rounds * corpus->bytes,
+		.elapsed = fr_time_sub(fr_time(), start),
+		.allocs = radbench_allocations - allocs,
+		.allocated = radbench_allocated - allocated,
+	};
+
+	talloc_free(ctx);
+}
+
+static void radbench_proto_print(FILE *fp, char const *proto, radbench_corpus_t const *corpus,
+				 radbench_proto_result_t const *results, size_t num)
+{
+	size_t i;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "\t\"protocol\": \"%s\",\n", proto);
+	fprintf(fp, "\t\"packets_read\": %zu,\n", corpus->read);
+	fprintf(fp, "\t\"packets_skipped\": %zu,\n", corpus->skipped);
+	fprintf(fp, "\t\"encode_failed\": %zu,\n", corpus->encode_failed);
+	fprintf(fp, "\t\"benchmarks\": [\n");
+
+	for (i = 0; i < num; i++) {
+		radbench_proto_result_t const	*r = &results[i];
+		double				secs = fr_time_delta_unwrap(r->elapsed) / (double) NSEC;
+		double				packets = r->packets ? r->packets : 1;
+
+		fprintf(fp, "\t\t{ \"name\": \"%s_%s\", \"packets\": %" PRIu64 ", \"packets_per_sec\": %.0f, "
+			"\"mbytes_per_sec\": %.2f, \"ns_per_op\": %.2f, ",
+			proto, r->name, r->packets, r->packets / secs, (r->bytes / secs) / (1024 * 1024),
+			fr_time_delta_unwrap(r->elapsed) / packets);
+#ifdef RADBENCH_ALLOC_COUNT
+		fprintf(fp, "\"allocs_per_op\": %.2f, \"bytes_allocated_per_op\": %.2f }",
+			r->allocs / packets, r->allocated / packets);
+#else
+		fprintf(fp, "\"allocs_per_op\": null, \"bytes_allocated_per_op\": null }");
+#endif
+		fprintf(fp, "%s\n", (i + 1) < num ? "," : "");
+	}
+
+	fprintf(fp, "\t]\n");
+	fprintf(fp, "}\n");
+}
+
+static NEVER_RETURNS void usage(int status)
+{
+	FILE *output = status ? stderr : stdout;
+
+	fprintf(output, "Usage: radbench_proto [options] <protocol> <file|directory> ...\n");
+	fprintf(output, "  <protocol>            The protocol library to benchmark, e.g. radius, dhcpv4.\n");
+	fprintf(output, "  <file|directory>      pcap files, files containing one raw packet, or directories\n");
+	fprintf(output, "                        of those.\n");
+	fprintf(output, "options:\n");
+	fprintf(output, "  -D <dictdir>          Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(output, "  -h                    This help message.\n");
+	fprintf(output, "  -L <libdir>           Where to find the protocol libraries (defaults to " LIBDIR ").\n");
+	fprintf(output, "  -o <file>             Write results to <file> instead of stdout.\n");
+	fprintf(output, "  -T <msec>             Minimum time to run each benchmark (defaults to %i).\n",
+		RADBENCH_MIN_TIME);
+	fprintf(output, "  -x                    Print more debugging information.\n");
+	fr_exit_now(status);
+}
+
+/**
+ *
+ * @hidecallgraph
+ */
+int main(int argc, char *argv[])
+{
+	int			c, i, ret = EXIT_SUCCESS;
+	char const		*dict_dir = DICTDIR;
+	char const		*lib_dir = getenv("FR_LIBRARY_PATH");
+	char const		*output = NULL;
+	char const		*proto;
+	int			min_time = RADBENCH_MIN_TIME;
+	char			buffer[256];
+	TALLOC_CTX		*autofree;
+	dl_loader_t		*dl_loader;
+	dl_t			*dl;
+	fr_dict_t		*dict = NULL;
+	fr_dict_protocol_t	*dl_proto = NULL;
+	radbench_corpus_t	corpus = { 0 };
+	radbench_proto_result_t	results[2];
+	size_t			num = 0, j;
+	FILE			*fp = stdout;
+
+	/*
+	 *	Must be called first, so the handler is called last
+	 */
+	fr_atexit_global_setup();
+
+	autofree = talloc_autofree_context();
+
+	fr_debug_lvl = 0;
+	fr_log_fp = stderr;
+
+	while ((c = getopt(argc, argv, "D:hL:o:T:x")) != -1) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'L':
+			lib_dir = optarg;
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'T':
+			min_time = atoi(optarg);
+			if (min_time <= 0) usage(64);
+			break;
+
+		case 'x':
+			fr_debug_lvl++;
+			break;
+
+		case 'h':
+			usage(EXIT_SUCCESS);
+
+		default:
+			usage(64);
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 2) usage(64);
+	proto = argv[0];
+
+	if (!lib_dir) lib_dir = LIBDIR;
+
+	if (dl_search_global_path_set(lib_dir) < 0) {
+	error:
+		fr_perror("radbench_proto");
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	dl_loader = dl_loader_init(autofree, NULL, false, false);
+	if (!dl_loader) goto error;
+
+	if (!fr_dict_global_ctx_init(autofree, true, dict_dir)) goto error;
+
+	if (fr_dict_internal_afrom_file(&dict, FR_DICTIONARY_INTERNAL_DIR, __FILE__) < 0) goto error;
+
+	/*
+	 *	Load the protocol library, and initialise it, which
+	 *	loads its dictionary.
+	 */
+	snprintf(buffer, sizeof(buffer), "libfreeradius-%s", proto);
+	dl = dl_by_name(dl_loader, buffer, NULL, false);
+	if (!dl) goto error;
+
+	snprintf(buffer, sizeof(buffer), "libfreeradius_%s_dict_protocol", proto);
+	dl_proto = dlsym(dl->handle, buffer);
+	if (dl_proto && dl_proto->init && (dl_proto->init() < 0)) goto error;
+
+	snprintf(buffer, sizeof(buffer), "%s_tp_decode_proto", proto);
+	tp_decode = dlsym(dl->handle, buffer);
+	if (!tp_decode) {
+		fr_strerror_printf("Test point (symbol \"%s\") not exported by library", buffer);
+		goto error;
+	}
+
+	snprintf(buffer, sizeof(buffer), "%s_tp_encode_proto", proto);
+	tp_encode = dlsym(dl->handle, buffer);
+
+	if (tp_decode->test_ctx && (tp_decode->test_ctx(&decode_ctx, autofree) < 0)) goto error;
+	if (tp_encode && tp_encode->test_ctx && (tp_encode->test_ctx(&encode_ctx, autofree) < 0)) goto error;
+
+	/*
+	 *	Read in the corpus.
+	 */
+	MEM(corpus.ctx = talloc_new(autofree));
+	for (i = 1; i < argc; i++) {
+		if (radbench_read(&corpus, argv[i]) < 0) goto error;
+	}
+
+	if (!corpus.num) {
+		fr_strerror_printf("None of the %zu packets read could be decoded", corpus.read);
+		goto error;
+	}
+
+	/*
+	 *	Only encode packets which the encoder accepts.
+	 */
+	if (tp_encode) {
+		for (j = 0; j < corpus.num; j++) {
+			if (tp_encode->func(corpus.ctx, &corpus.packet[j].list,
+					    encode_buffer, sizeof(encode_buffer), encode_ctx) > 0) continue;
+
+			/*
+			 *	The decode benchmark skips them too, so the
+			 *	results for the two are comparable.
+			 */
+			corpus.packet[j].skip = true;
+			corpus.bytes -= corpus.packet[j].data_len;
+			corpus.encode_failed++;
+		}
+		fr_strerror_clear();
+	}
+
+	if (fr_debug_lvl > 0) {
+		fprintf(stderr, "Read %zu packets, %zu skipped, %zu failed encoding, benchmarking %zu\n",
+			corpus.read, corpus.skipped, corpus.encode_failed, corpus.num - corpus.encode_failed);
+	}
+
+	fr_time_start();
+
+	if (corpus.num > corpus.encode_failed) {
+		radbench_proto_run(&results[num++], "decode", &corpus, radbench_decode_run,
+				   fr_time_delta_from_msec(min_time));
+
+		if (tp_encode) {
+			radbench_proto_run(&results[num++], "encode", &corpus, radbench_encode_run,
+					   fr_time_delta_from_msec(min_time));
+		}
+	}
+
+	if (output) {
+		fp = fopen(output, "w");
+		if (!fp) {
+			fprintf(stderr, "radbench_proto - Failed opening \"%s\": %s\n", output, fr_syserror(errno));
+			ret = EXIT_FAILURE;
+			goto finish;
+		}
+	}
+	radbench_proto_print(fp, proto, &corpus, results, num);
+	if (output) fclose(fp);
+
+finish:
+	TALLOC_FREE(corpus.ctx);
+
+	if (dl_proto && dl_proto->free) dl_proto->free();
+	fr_dict_free(&dict, __FILE__);
+
+	/*
+	 *	Ensure our atexit handlers run before any other
+	 *	atexit handlers registered by third party libraries.
+	 */
+	fr_atexit_global_trigger_all();
+
+	return ret;
+}
@@ -0,0 +1,7 @@
+TARGET		:= radbench_proto$(E)
+
+SOURCES		:= radbench_proto.c
+
+TGT_PREREQS	:= libfreeradius-util$(L)
+TGT_LDLIBS	:= $(LIBS) $(PCAP_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(PCAP_LDFLAGS)
@@ -0,0 +1,3 @@
+#
+#  Test the "auth_cache" module
+#
@@ -0,0 +1,4 @@
+#
+#  Test the "shard" driver
+#
+cache_shard.test:
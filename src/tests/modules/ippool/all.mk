@@ -0,0 +1,3 @@
+#
+#  Test the "ippool" module
+#
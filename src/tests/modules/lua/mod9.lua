@@ -0,0 +1,28 @@
+function authorize()
+	if fr.request['User-Name'][0] ~= "caipirinha" then
+		return fr.rcode.fail
+	end
+
+	if fr.request['User-Name'][1] ~= nil then
+		return fr.rcode.fail
+	end
+
+	fr.request['Session-Timeout'][0] = 3600
+	if fr.request['Session-Timeout'][0] ~= 3600 then
+		return fr.rcode.fail
+	end
+
+	fr.request['Filter-Id'][0] = "first"
+	fr.request['Filter-Id'][1] = "second"
+	fr.request['Filter-Id'][0] = "replaced"
+	if fr.request['Filter-Id'][0] ~= "replaced" or fr.request['Filter-Id'][1] ~= "second" then
+		return fr.rcode.fail
+	end
+
+	fr.request['Session-Timeout'][0] = nil
+	if fr.request['Session-Timeout'][0] ~= nil then
+		return fr.rcode.fail
+	end
+
+	return fr.rcode.ok
+end
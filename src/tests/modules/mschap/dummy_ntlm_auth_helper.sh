@@ -0,0 +1,32 @@
+#!/bin/bash
+#
+#  Dummy script which emulates ntlm_auth --helper-protocol=ntlm-server-1
+#
+while read -r line; do
+  case "$line" in
+  "LANMAN-Challenge: "*)
+    challenge="${line#LANMAN-Challenge: }"
+    ;;
+  "NT-Response: "*)
+    response="${line#NT-Response: }"
+    ;;
+  "Username:: "*)
+    username="${line#Username:: }"
+    ;;
+  ".")
+    if [ "$username" = 'am9obg==' ] && [ "$challenge" = '696bcaff8f8bef29' ] && \
+       [ "$response" = '16c32819add27b3d29f6866506e6cc6548f50b6429518579' ]; then
+      echo "Authenticated: Yes"
+      echo "User-Session-Key: 000102030405060708090A0B0C0D0E0F"
+    else
+      echo "Authenticated: No"
+      echo "Authentication-Error: Logon failure (0xc000006d)"
+      echo "."
+    fi
+    echo "."
+    challenge=
+    response=
+    username=
+    ;;
+  esac
+done
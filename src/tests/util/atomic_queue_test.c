@@ -175,6 +175,57 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	/*
+	 *	Batched operations.  Push one more than will fit.
+	 */
+	{
+		void	*batch[size + 1];
+		size_t	num;
+
+		for (i = 0; i <= size; i++) batch[i] = (void *) (intptr_t) (i + OFFSET);
+
+		num = fr_atomic_queue_push_n(aq, batch, size + 1);
+		if (num != (size_t) size) {
+			fprintf(stderr, "Batch push expected %d, pushed %zu\n", size, num);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		if (fr_atomic_queue_push_n(aq, batch, 1) != 0) {
+			fprintf(stderr, "Batch pushed an entry past the end of the queue.");
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		memset(batch, 0, sizeof(batch));
+
+		/*
+		 *	Pop one on its own, and the rest as a batch.
+		 */
+		if (!fr_atomic_queue_pop(aq, &batch[0])) {
+			fprintf(stderr, "Failed popping batched entry\n");
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		num = fr_atomic_queue_pop_n(aq, batch + 1, size + 1);
+		if (num != (size_t) (size - 1)) {
+			fprintf(stderr, "Batch pop expected %d, popped %zu\n", size - 1, num);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < size; i++) {
+			val = (intptr_t) batch[i];
+			if (val != (i + OFFSET)) {
+				fprintf(stderr, "Batch pop expected %d, got %d\n",
+					i + OFFSET, (int) val);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		if (fr_atomic_queue_pop_n(aq, batch, size) != 0) {
+			fprintf(stderr, "Batch popped an entry past the end of the queue.");
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
 	return ret;
 }
 